@@ -36,6 +36,7 @@
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
+#include <android-base/properties.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <openssl/sha.h>
@@ -43,12 +44,26 @@
 #include "edify/expr.h"
 #include "otautil/paths.h"
 #include "otautil/print_sha1.h"
+#include "otautil/sysutil.h"
 
 using namespace std::string_literals;
 
+// Setting this property to more than 1 applies the chunks of imgdiff patches on that many threads
+// (up to kMaxImagePatchThreads).
+static constexpr const char* kImagePatchThreadsProperty = "ro.applypatch.image_patch_threads";
+static constexpr size_t kMaxImagePatchThreads = 8;
+
 static bool GenerateTarget(const Partition& target, const FileContents& source_file,
                            const Value& patch, const Value* bonus_data, bool backup_source);
 
+const unsigned char* FileContents::contents() const {
+  return mapping ? mapping->addr : data.data();
+}
+
+size_t FileContents::size() const {
+  return mapping ? mapping->length : data.size();
+}
+
 bool LoadFileContents(const std::string& filename, FileContents* file) {
   // No longer allow loading contents from eMMC partitions.
   if (android::base::StartsWith(filename, "EMMC:")) {
@@ -62,11 +77,49 @@ bool LoadFileContents(const std::string& filename, FileContents* file) {
   }
 
   file->data = std::vector<unsigned char>(data.begin(), data.end());
+  file->mapping.reset();
   SHA1(file->data.data(), file->data.size(), file->sha1);
   return true;
 }
 
-// Reads the contents of a Partition to the given FileContents buffer.
+bool MapFileContents(const std::string& filename, FileContents* file) {
+  // Empty files can't be mapped.
+  struct stat sb;
+  if (stat(filename.c_str(), &sb) == 0 && sb.st_size == 0) {
+    return LoadFileContents(filename, file);
+  }
+
+  auto mapping = std::make_shared<MemMapping>();
+  if (!mapping->MapFile(filename)) {
+    return false;
+  }
+
+  file->data.clear();
+  file->mapping = std::move(mapping);
+  SHA1(file->contents(), file->size(), file->sha1);
+  return true;
+}
+
+// Reads the contents of the partition into 'buffer', and computes their SHA-1 into 'sha1'.
+static bool ReadPartition(const Partition& partition, std::vector<unsigned char>* buffer,
+                          uint8_t* sha1) {
+  android::base::unique_fd dev(open(partition.name.c_str(), O_RDONLY));
+  if (dev == -1) {
+    PLOG(ERROR) << "Failed to open eMMC partition \"" << partition << "\"";
+    return false;
+  }
+  buffer->resize(partition.size);
+  if (!android::base::ReadFully(dev, buffer->data(), buffer->size())) {
+    PLOG(ERROR) << "Failed to read " << buffer->size() << " bytes of data for partition "
+                << partition;
+    return false;
+  }
+  SHA1(buffer->data(), buffer->size(), sha1);
+  return true;
+}
+
+// Maps the contents of a Partition (or reads them, if the partition can't be mapped) to the given
+// FileContents.
 static bool ReadPartitionToBuffer(const Partition& partition, FileContents* out,
                                   bool check_backup) {
   uint8_t expected_sha1[SHA_DIGEST_LENGTH];
@@ -75,20 +128,21 @@ static bool ReadPartitionToBuffer(const Partition& partition, FileContents* out,
     return false;
   }
 
-  android::base::unique_fd dev(open(partition.name.c_str(), O_RDONLY));
-  if (dev == -1) {
-    PLOG(ERROR) << "Failed to open eMMC partition \"" << partition << "\"";
+  auto mapping = std::make_shared<MemMapping>();
+  if (mapping->MapDevice(partition.name, partition.size)) {
+    SHA1(mapping->addr, mapping->length, out->sha1);
+    if (memcmp(out->sha1, expected_sha1, SHA_DIGEST_LENGTH) == 0) {
+      out->data.clear();
+      out->mapping = std::move(mapping);
+      return true;
+    }
   } else {
-    std::vector<unsigned char> buffer(partition.size);
-    if (!android::base::ReadFully(dev, buffer.data(), buffer.size())) {
-      PLOG(ERROR) << "Failed to read " << buffer.size() << " bytes of data for partition "
-                  << partition;
-    } else {
-      SHA1(buffer.data(), buffer.size(), out->sha1);
-      if (memcmp(out->sha1, expected_sha1, SHA_DIGEST_LENGTH) == 0) {
-        out->data = std::move(buffer);
-        return true;
-      }
+    std::vector<unsigned char> buffer;
+    if (ReadPartition(partition, &buffer, out->sha1) &&
+        memcmp(out->sha1, expected_sha1, SHA_DIGEST_LENGTH) == 0) {
+      out->data = std::move(buffer);
+      out->mapping.reset();
+      return true;
     }
   }
 
@@ -97,6 +151,7 @@ static bool ReadPartitionToBuffer(const Partition& partition, FileContents* out,
     return false;
   }
 
+  // The backup is copied rather than mapped, since GenerateTarget() rewrites it.
   if (LoadFileContents(Paths::Get().cache_temp_source(), out) &&
       memcmp(out->sha1, expected_sha1, SHA_DIGEST_LENGTH) == 0) {
     return true;
@@ -114,8 +169,8 @@ bool SaveFileContents(const std::string& filename, const FileContents* file) {
     return false;
   }
 
-  if (!android::base::WriteFully(fd, file->data.data(), file->data.size())) {
-    PLOG(ERROR) << "Failed to write " << file->data.size() << " bytes of data to " << filename;
+  if (!android::base::WriteFully(fd, file->contents(), file->size())) {
+    PLOG(ERROR) << "Failed to write " << file->size() << " bytes of data to " << filename;
     return false;
   }
 
@@ -132,10 +187,98 @@ bool SaveFileContents(const std::string& filename, const FileContents* file) {
   return true;
 }
 
-// Writes a memory buffer to 'target' Partition.
+// Writes to and verifies partitions in chunks of this size.
+static constexpr size_t kPartitionChunkSize = 1024 * 1024;
+
+// O_DIRECT reads need buffers, offsets and sizes aligned to the logical block size. 4096 covers
+// all the block devices we flash.
+static constexpr size_t kDirectIoAlignment = 4096;
+
+// Setting this property to true verifies the written partition with O_DIRECT reads, which bypass
+// the page cache, instead of dropping the caches and reading it back through them.
+static constexpr const char* kDirectVerifyProperty = "ro.applypatch.direct_verify";
+
+// Writes data[start, len) to |fd| in chunks. If |ctx| is not null, the written bytes are also added
+// to the hash, so that the caller can check what actually went to the partition without reading it
+// back.
+static bool WriteChunks(int fd, const unsigned char* data, size_t start, size_t len,
+                        SHA_CTX* ctx) {
+  for (size_t p = start; p < len; p += kPartitionChunkSize) {
+    size_t to_write = std::min(kPartitionChunkSize, len - p);
+    if (!android::base::WriteFully(fd, data + p, to_write)) {
+      PLOG(ERROR) << "Failed to write " << to_write << " bytes at " << p;
+      return false;
+    }
+    if (ctx != nullptr) {
+      SHA1_Update(ctx, data + p, to_write);
+    }
+  }
+  return true;
+}
+
+// Reads up to |count| bytes into |buffer|, stopping early only at the end of the file. Fails if
+// fewer than |needed| bytes could be read.
+static bool ReadAtLeast(int fd, unsigned char* buffer, size_t count, size_t needed) {
+  size_t total = 0;
+  while (total < count) {
+    ssize_t n = TEMP_FAILURE_RETRY(read(fd, buffer + total, count - total));
+    if (n == -1) {
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    total += n;
+  }
+  if (total < needed) {
+    errno = EIO;
+    return false;
+  }
+  return true;
+}
+
+// Reads back the first |len| bytes of |fd| and compares them with |data|. On success, sets
+// |mismatch| to the offset of the first chunk that differs, or |len| if all of them match. With
+// |direct| set, |fd| has been opened with O_DIRECT and every read is rounded up to a multiple of
+// kDirectIoAlignment; the extra bytes past |len| are ignored.
+static bool VerifyChunks(int fd, const unsigned char* data, size_t len, bool direct,
+                         size_t* mismatch) {
+  std::unique_ptr<void, decltype(&free)> buffer(nullptr, free);
+  void* ptr;
+  if (posix_memalign(&ptr, kDirectIoAlignment, kPartitionChunkSize) != 0) {
+    LOG(ERROR) << "Failed to allocate the verification buffer";
+    return false;
+  }
+  buffer.reset(ptr);
+
+  for (size_t p = 0; p < len; p += kPartitionChunkSize) {
+    size_t to_compare = std::min(kPartitionChunkSize, len - p);
+    size_t to_read = to_compare;
+    if (direct) {
+      to_read = (to_compare + kDirectIoAlignment - 1) / kDirectIoAlignment * kDirectIoAlignment;
+    }
+    if (!ReadAtLeast(fd, static_cast<unsigned char*>(ptr), to_read, to_compare)) {
+      PLOG(ERROR) << "Failed to verify-read at " << p;
+      return false;
+    }
+    if (memcmp(ptr, data + p, to_compare) != 0) {
+      LOG(ERROR) << "Verification failed starting at " << p;
+      *mismatch = p;
+      return true;
+    }
+  }
+  *mismatch = len;
+  return true;
+}
+
+// Writes a memory buffer to 'target' Partition. The first write hashes the bytes as they go out
+// and checks them against |file_contents.sha1|, which catches the buffer changing after it was
+// checked (e.g. a mapped source file being modified). The partition is then read back and
+// compared to the buffer, rewriting from the first mismatching chunk once if needed.
 static bool WriteBufferToPartition(const FileContents& file_contents, const Partition& partition) {
-  const unsigned char* data = file_contents.data.data();
-  size_t len = file_contents.data.size();
+  const unsigned char* data = file_contents.contents();
+  size_t len = file_contents.size();
+  bool direct_verify = android::base::GetBoolProperty(kDirectVerifyProperty, false);
   size_t start = 0;
   bool success = false;
   for (size_t attempt = 0; attempt < 2; ++attempt) {
@@ -150,10 +293,22 @@ static bool WriteBufferToPartition(const FileContents& file_contents, const Part
       return false;
     }
 
-    if (!android::base::WriteFully(fd, data + start, len - start)) {
-      PLOG(ERROR) << "Failed to write " << len - start << " bytes to \"" << partition << "\"";
+    // Only the first attempt writes the whole buffer, so only that one can be hashed.
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    if (!WriteChunks(fd, data, start, len, attempt == 0 ? &ctx : nullptr)) {
+      LOG(ERROR) << "Failed to write " << len - start << " bytes to \"" << partition << "\"";
       return false;
     }
+    if (attempt == 0) {
+      uint8_t written_sha1[SHA_DIGEST_LENGTH];
+      SHA1_Final(written_sha1, &ctx);
+      if (memcmp(written_sha1, file_contents.sha1, SHA_DIGEST_LENGTH) != 0) {
+        LOG(ERROR) << "Wrote " << short_sha1(written_sha1) << " to \"" << partition
+                   << "\", expected " << short_sha1(file_contents.sha1);
+        return false;
+      }
+    }
 
     if (fsync(fd) != 0) {
       PLOG(ERROR) << "Failed to sync \"" << partition << "\"";
@@ -164,48 +319,40 @@ static bool WriteBufferToPartition(const FileContents& file_contents, const Part
       return false;
     }
 
-    fd.reset(open(partition.name.c_str(), O_RDONLY));
-    if (fd == -1) {
-      PLOG(ERROR) << "Failed to reopen \"" << partition << "\" for verification";
-      return false;
+    bool direct = false;
+    if (direct_verify) {
+      fd.reset(open(partition.name.c_str(), O_RDONLY | O_DIRECT));
+      if (fd == -1) {
+        PLOG(WARNING) << "Failed to open \"" << partition
+                      << "\" with O_DIRECT; verifying through the page cache";
+      } else {
+        direct = true;
+      }
     }
+    if (!direct) {
+      fd.reset(open(partition.name.c_str(), O_RDONLY));
+      if (fd == -1) {
+        PLOG(ERROR) << "Failed to reopen \"" << partition << "\" for verification";
+        return false;
+      }
 
-    // Drop caches so our subsequent verification read won't just be reading the cache.
-    sync();
-    std::string drop_cache = "/proc/sys/vm/drop_caches";
-    if (!android::base::WriteStringToFile("3\n", drop_cache)) {
-      PLOG(ERROR) << "Failed to write to " << drop_cache;
-    } else {
-      LOG(INFO) << "  caches dropped";
+      // Drop caches so our subsequent verification read won't just be reading the cache.
+      sync();
+      std::string drop_cache = "/proc/sys/vm/drop_caches";
+      if (!android::base::WriteStringToFile("3\n", drop_cache)) {
+        PLOG(ERROR) << "Failed to write to " << drop_cache;
+      } else {
+        LOG(INFO) << "  caches dropped";
+      }
+      sleep(1);
     }
-    sleep(1);
 
     // Verify.
-    if (TEMP_FAILURE_RETRY(lseek(fd, 0, SEEK_SET)) == -1) {
-      PLOG(ERROR) << "Failed to seek to 0 on " << partition;
+    if (!VerifyChunks(fd, data, len, direct, &start)) {
+      LOG(ERROR) << "Failed to verify " << partition;
       return false;
     }
 
-    unsigned char buffer[4096];
-    start = len;
-    for (size_t p = 0; p < len; p += sizeof(buffer)) {
-      size_t to_read = len - p;
-      if (to_read > sizeof(buffer)) {
-        to_read = sizeof(buffer);
-      }
-
-      if (!android::base::ReadFully(fd, buffer, to_read)) {
-        PLOG(ERROR) << "Failed to verify-read " << partition << " at " << p;
-        return false;
-      }
-
-      if (memcmp(buffer, data + p, to_read) != 0) {
-        LOG(ERROR) << "Verification failed starting at " << p;
-        start = p;
-        break;
-      }
-    }
-
     if (start == len) {
       LOG(INFO) << "Verification read succeeded (attempt " << attempt + 1 << ")";
       success = true;
@@ -287,6 +434,30 @@ bool PatchPartition(const Partition& target, const Partition& source, const Valu
   return false;
 }
 
+bool PatchPartition(const Partition& target,
+                    const std::function<const FileContents*()>& load_source, const Value& patch,
+                    const Value* bonus) {
+  LOG(INFO) << "Patching " << target.name;
+
+  FileContents target_file;
+  if (ReadPartitionToBuffer(target, &target_file, false)) {
+    LOG(INFO) << "  already " << target.hash.substr(0, 8);
+    return true;
+  }
+
+  const FileContents* source_file = load_source();
+  if (source_file != nullptr) {
+    return GenerateTarget(target, *source_file, patch, bonus, false);
+  }
+
+  LOG(ERROR) << "Failed to find any match";
+  return false;
+}
+
+bool LoadPartitionContents(const Partition& partition, FileContents* file) {
+  return ReadPartitionToBuffer(partition, file, false);
+}
+
 bool FlashPartition(const Partition& partition, const std::string& source_filename) {
   LOG(INFO) << "Flashing " << partition;
 
@@ -300,7 +471,7 @@ bool FlashPartition(const Partition& partition, const std::string& source_filena
   }
 
   FileContents source_file;
-  if (!LoadFileContents(source_filename, &source_file)) {
+  if (!MapFileContents(source_filename, &source_file)) {
     LOG(ERROR) << "Failed to load source file";
     return false;
   }
@@ -338,8 +509,8 @@ static bool GenerateTarget(const Partition& target, const FileContents& source_f
     return false;
   }
 
-  const char* header = patch.data.data();
-  size_t header_bytes_read = patch.data.size();
+  const char* header = patch.data().data();
+  size_t header_bytes_read = patch.data().size();
   bool use_bsdiff = false;
   if (header_bytes_read >= 8 && memcmp(header, "BSDIFF40", 8) == 0) {
     use_bsdiff = true;
@@ -351,7 +522,7 @@ static bool GenerateTarget(const Partition& target, const FileContents& source_f
   }
 
   // We write the original source to cache, in case the partition write is interrupted.
-  if (backup_source && !CheckAndFreeSpaceOnCache(source_file.data.size())) {
+  if (backup_source && !CheckAndFreeSpaceOnCache(source_file.size())) {
     LOG(ERROR) << "Not enough free space on /cache";
     return false;
   }
@@ -372,10 +543,16 @@ static bool GenerateTarget(const Partition& target, const FileContents& source_f
 
   int result;
   if (use_bsdiff) {
-    result = ApplyBSDiffPatch(source_file.data.data(), source_file.data.size(), patch, 0, sink);
+    result = ApplyBSDiffPatch(source_file.contents(), source_file.size(), patch, 0, sink);
   } else {
-    result =
-        ApplyImagePatch(source_file.data.data(), source_file.data.size(), patch, sink, bonus_data);
+    size_t num_threads = android::base::GetUintProperty<size_t>(kImagePatchThreadsProperty, 1,
+                                                                kMaxImagePatchThreads);
+    if (num_threads > 1) {
+      result = ApplyImagePatchInParallel(source_file.contents(), source_file.size(), patch, sink,
+                                         bonus_data, num_threads);
+    } else {
+      result = ApplyImagePatch(source_file.contents(), source_file.size(), patch, sink, bonus_data);
+    }
   }
 
   if (result != 0) {
@@ -388,18 +565,18 @@ static bool GenerateTarget(const Partition& target, const FileContents& source_f
     LOG(ERROR) << "Patching did not produce the expected SHA-1 of " << short_sha1(expected_sha1);
 
     LOG(ERROR) << "target size " << patched.data.size() << " SHA-1 " << short_sha1(patched.sha1);
-    LOG(ERROR) << "source size " << source_file.data.size() << " SHA-1 "
+    LOG(ERROR) << "source size " << source_file.size() << " SHA-1 "
                << short_sha1(source_file.sha1);
 
     uint8_t patch_digest[SHA_DIGEST_LENGTH];
-    SHA1(reinterpret_cast<const uint8_t*>(patch.data.data()), patch.data.size(), patch_digest);
-    LOG(ERROR) << "patch size " << patch.data.size() << " SHA-1 " << short_sha1(patch_digest);
+    SHA1(reinterpret_cast<const uint8_t*>(patch.data().data()), patch.data().size(), patch_digest);
+    LOG(ERROR) << "patch size " << patch.data().size() << " SHA-1 " << short_sha1(patch_digest);
 
     if (bonus_data != nullptr) {
       uint8_t bonus_digest[SHA_DIGEST_LENGTH];
-      SHA1(reinterpret_cast<const uint8_t*>(bonus_data->data.data()), bonus_data->data.size(),
+      SHA1(reinterpret_cast<const uint8_t*>(bonus_data->data().data()), bonus_data->data().size(),
            bonus_digest);
-      LOG(ERROR) << "bonus size " << bonus_data->data.size() << " SHA-1 "
+      LOG(ERROR) << "bonus size " << bonus_data->data().size() << " SHA-1 "
                  << short_sha1(bonus_digest);
     }
 
@@ -22,8 +22,14 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -90,6 +96,171 @@ static int PatchMode(const std::string& target_emmc, const std::string& source_e
   return PatchPartition(target, source, patch, bonus.get(), false) ? 0 : 1;
 }
 
+// An entry of a batch manifest, one per line:
+//   check <target>
+//   flash <target> <source-file>
+//   patch <target> <source> <patch-file> [<bonus-file>]
+// where <target> and <source> are of the form "EMMC:<device>:<size>:<hash>". Blank lines and lines
+// starting with '#' are ignored.
+struct BatchEntry {
+  std::string kind;
+  Partition target;
+  Partition source;
+  // The source image to flash, or the patch file.
+  std::string file;
+  std::string bonus_file;
+};
+
+// The contents of a source partition, loaded once for all the entries patched from it.
+struct SharedSource {
+  std::once_flag once;
+  FileContents contents;
+  bool loaded = false;
+};
+
+static bool ParseBatchManifest(const std::string& manifest_file, std::vector<BatchEntry>* entries) {
+  std::string content;
+  if (!android::base::ReadFileToString(manifest_file, &content)) {
+    PLOG(ERROR) << "Failed to read manifest \"" << manifest_file << "\"";
+    return false;
+  }
+
+  for (const auto& raw_line : android::base::Split(content, "\n")) {
+    std::string line = android::base::Trim(raw_line);
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::vector<std::string> args;
+    for (auto& arg : android::base::Split(line, " \t")) {
+      if (!arg.empty()) {
+        args.push_back(std::move(arg));
+      }
+    }
+
+    BatchEntry entry;
+    entry.kind = args[0];
+    if (!((entry.kind == "check" && args.size() == 2) ||
+          (entry.kind == "flash" && args.size() == 3) ||
+          (entry.kind == "patch" && (args.size() == 4 || args.size() == 5)))) {
+      LOG(ERROR) << "Invalid manifest entry \"" << line << "\"";
+      return false;
+    }
+    std::string err;
+    entry.target = Partition::Parse(args[1], &err);
+    if (!entry.target) {
+      LOG(ERROR) << "Failed to parse target \"" << args[1] << "\": " << err;
+      return false;
+    }
+    if (entry.kind == "flash") {
+      entry.file = args[2];
+    } else if (entry.kind == "patch") {
+      entry.source = Partition::Parse(args[2], &err);
+      if (!entry.source) {
+        LOG(ERROR) << "Failed to parse source \"" << args[2] << "\": " << err;
+        return false;
+      }
+      entry.file = args[3];
+      if (args.size() == 5) {
+        entry.bonus_file = args[4];
+      }
+    }
+    entries->push_back(std::move(entry));
+  }
+
+  // The entries run concurrently, so none of them may write what another one reads or writes.
+  std::set<std::string> targets;
+  for (const auto& entry : *entries) {
+    if (!targets.insert(entry.target.name).second) {
+      LOG(ERROR) << "Target " << entry.target.name << " is written by more than one entry";
+      return false;
+    }
+  }
+  for (const auto& entry : *entries) {
+    if (entry.source && targets.count(entry.source.name) != 0) {
+      LOG(ERROR) << "Source " << entry.source.name << " is also the target of an entry";
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool RunBatchEntry(const BatchEntry& entry, SharedSource* source) {
+  if (entry.kind == "check") {
+    return CheckPartition(entry.target);
+  }
+  if (entry.kind == "flash") {
+    return FlashPartition(entry.target, entry.file);
+  }
+
+  std::string patch_contents;
+  if (!android::base::ReadFileToString(entry.file, &patch_contents)) {
+    PLOG(ERROR) << "Failed to read patch file \"" << entry.file << "\"";
+    return false;
+  }
+  Value patch(Value::Type::BLOB, std::move(patch_contents));
+  std::unique_ptr<Value> bonus;
+  if (!entry.bonus_file.empty()) {
+    std::string bonus_contents;
+    if (!android::base::ReadFileToString(entry.bonus_file, &bonus_contents)) {
+      PLOG(ERROR) << "Failed to read bonus file \"" << entry.bonus_file << "\"";
+      return false;
+    }
+    bonus = std::make_unique<Value>(Value::Type::BLOB, std::move(bonus_contents));
+  }
+
+  auto load_source = [&entry, source]() -> const FileContents* {
+    std::call_once(source->once, [&entry, source]() {
+      source->loaded = LoadPartitionContents(entry.source, &source->contents);
+    });
+    return source->loaded ? &source->contents : nullptr;
+  };
+  return PatchPartition(entry.target, load_source, patch, bonus.get());
+}
+
+// Checks, flashes or patches all the entries of the manifest at once, and prints the result of
+// each of them. The targets patched from the same source read it once. Returns 0 if all the
+// entries succeed, or 1 if any of them fails.
+static int BatchMode(const std::string& manifest_file) {
+  std::vector<BatchEntry> entries;
+  if (!ParseBatchManifest(manifest_file, &entries)) {
+    return 2;
+  }
+
+  std::map<std::string, SharedSource> sources;
+  std::vector<SharedSource*> entry_sources;
+  for (const auto& entry : entries) {
+    entry_sources.push_back(entry.source ? &sources[entry.source.ToString()] : nullptr);
+  }
+
+  std::vector<char> results(entries.size(), false);
+  std::atomic<size_t> next_entry = 0;
+  auto worker = [&]() {
+    for (size_t i = next_entry++; i < entries.size(); i = next_entry++) {
+      results[i] = RunBatchEntry(entries[i], entry_sources[i]);
+    }
+  };
+  size_t num_threads =
+      std::min<size_t>(entries.size(), std::max(std::thread::hardware_concurrency(), 1U));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  int status = 0;
+  for (size_t i = 0; i < entries.size(); i++) {
+    printf("%s %s: %s\n", entries[i].kind.c_str(), entries[i].target.name.c_str(),
+           results[i] ? "ok" : "failed");
+    if (!results[i]) {
+      status = 1;
+    }
+  }
+  return status;
+}
+
 static void Usage() {
   printf(
       "Usage: \n"
@@ -103,6 +274,13 @@ static void Usage() {
       "             --patch <patch-file>\n"
       "             --target EMMC:<target-file>:<target-size>:<target-sha1>\n"
       "             --source EMMC:<source-file>:<source-size>:<source-sha1>\n\n"
+      "batch mode\n"
+      "  applypatch --batch <manifest-file>\n"
+      "  with one entry per line, all run at once:\n"
+      "    check <target>\n"
+      "    flash <target> <source-file>\n"
+      "    patch <target> <source> <patch-file> [<bonus-file>]\n"
+      "  where <target> and <source> are EMMC:<file>:<size>:<sha1>\n\n"
       "show license\n"
       "  applypatch --license\n"
       "\n\n");
@@ -111,6 +289,7 @@ static void Usage() {
 int applypatch_modes(int argc, char* argv[]) {
   static constexpr struct option OPTIONS[]{
     // clang-format off
+    { "batch", required_argument, nullptr, 0 },
     { "bonus", required_argument, nullptr, 0 },
     { "check", required_argument, nullptr, 0 },
     { "flash", required_argument, nullptr, 0 },
@@ -140,7 +319,9 @@ int applypatch_modes(int argc, char* argv[]) {
     switch (arg) {
       case 0: {
         std::string option = OPTIONS[option_index].name;
-        if (option == "bonus") {
+        if (option == "batch") {
+          return BatchMode(optarg);
+        } else if (option == "bonus") {
           bonus = optarg;
         } else if (option == "check") {
           check_target = optarg;
@@ -23,10 +23,13 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <memory>
 #include <string>
 
 #include <android-base/logging.h>
 #include <bsdiff/bspatch.h>
+#include <bsdiff/file_interface.h>
 #include <openssl/sha.h>
 
 #include "applypatch/applypatch.h"
@@ -65,23 +68,121 @@ void ShowBSDiffLicense() {
         );
 }
 
+// Logs the failure of bspatch(), along with the SHA1 of the patch in the case of a data error.
+static void LogBSPatchFailure(int result, const Value& patch, size_t patch_offset) {
+  LOG(ERROR) << "bspatch failed, result: " << result;
+  if (result == 2) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const uint8_t*>(patch.data().data() + patch_offset),
+         patch.data().size() - patch_offset, digest);
+    std::string patch_sha1 = print_sha1(digest);
+    LOG(ERROR) << "Patch may be corrupted, offset: " << patch_offset << ", SHA1: " << patch_sha1;
+  }
+}
+
 int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value& patch,
                      size_t patch_offset, SinkFn sink) {
-  CHECK_LE(patch_offset, patch.data.size());
+  CHECK_LE(patch_offset, patch.data().size());
 
   int result = bsdiff::bspatch(old_data, old_size,
-                               reinterpret_cast<const uint8_t*>(&patch.data[patch_offset]),
-                               patch.data.size() - patch_offset, sink);
+                               reinterpret_cast<const uint8_t*>(patch.data().data() + patch_offset),
+                               patch.data().size() - patch_offset, sink);
   if (result != 0) {
-    LOG(ERROR) << "bspatch failed, result: " << result;
-    // print SHA1 of the patch in the case of a data error.
-    if (result == 2) {
-      uint8_t digest[SHA_DIGEST_LENGTH];
-      SHA1(reinterpret_cast<const uint8_t*>(patch.data.data() + patch_offset),
-           patch.data.size() - patch_offset, digest);
-      std::string patch_sha1 = print_sha1(digest);
-      LOG(ERROR) << "Patch may be corrupted, offset: " << patch_offset << ", SHA1: " << patch_sha1;
+    LogBSPatchFailure(result, patch, patch_offset);
+  }
+  return result;
+}
+
+// A read-only bsdiff::FileInterface over a range of a PatchSourceReader.
+class SourceRangeFile : public bsdiff::FileInterface {
+ public:
+  SourceRangeFile(const PatchSourceReader& source, size_t start, size_t len)
+      : source_(source), start_(start), len_(len) {}
+
+  bool Read(void* buf, size_t count, size_t* bytes_read) override {
+    size_t len = std::min(count, len_ - offset_);
+    if (!source_.Read(start_ + offset_, static_cast<uint8_t*>(buf), len)) {
+      return false;
+    }
+    offset_ += len;
+    *bytes_read = len;
+    return true;
+  }
+
+  bool Write(const void* /* buf */, size_t /* count */, size_t* /* bytes_written */) override {
+    return false;
+  }
+
+  bool Seek(off_t pos) override {
+    if (pos < 0 || static_cast<uint64_t>(pos) > len_) {
+      return false;
     }
+    offset_ = static_cast<size_t>(pos);
+    return true;
+  }
+
+  bool Close() override {
+    return true;
+  }
+
+  bool GetSize(uint64_t* size) override {
+    *size = len_;
+    return true;
+  }
+
+ private:
+  const PatchSourceReader& source_;
+  size_t start_;
+  size_t len_;
+  size_t offset_{ 0 };
+};
+
+// A write-only bsdiff::FileInterface that passes the patched data to a sink.
+class SinkFile : public bsdiff::FileInterface {
+ public:
+  explicit SinkFile(SinkFn sink) : sink_(std::move(sink)) {}
+
+  bool Read(void* /* buf */, size_t /* count */, size_t* /* bytes_read */) override {
+    return false;
+  }
+
+  bool Write(const void* buf, size_t count, size_t* bytes_written) override {
+    *bytes_written = sink_(static_cast<const unsigned char*>(buf), count);
+    return *bytes_written == count;
+  }
+
+  bool Seek(off_t /* pos */) override {
+    return false;
+  }
+
+  bool Close() override {
+    return true;
+  }
+
+  bool GetSize(uint64_t* /* size */) override {
+    return false;
+  }
+
+ private:
+  SinkFn sink_;
+};
+
+int ApplyBSDiffPatch(const PatchSourceReader& source, size_t src_start, size_t src_len,
+                     const Value& patch, size_t patch_offset, SinkFn sink) {
+  CHECK_LE(src_start + src_len, source.size());
+  if (source.data() != nullptr) {
+    return ApplyBSDiffPatch(source.data() + src_start, src_len, patch, patch_offset, sink);
+  }
+
+  CHECK_LE(patch_offset, patch.data().size());
+  std::unique_ptr<bsdiff::FileInterface> old_file =
+      std::make_unique<SourceRangeFile>(source, src_start, src_len);
+  std::unique_ptr<bsdiff::FileInterface> new_file = std::make_unique<SinkFile>(std::move(sink));
+  int result = bsdiff::bspatch(old_file, new_file,
+                               reinterpret_cast<const uint8_t*>(patch.data().data() + patch_offset),
+                               patch.data().size() - patch_offset);
+  if (result != 0) {
+    LogBSPatchFailure(result, patch, patch_offset);
   }
   return result;
 }
@@ -25,10 +25,13 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <functional>
 #include <limits>
+#include <map>
 #include <memory>
-#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -39,19 +42,44 @@
 #include "applypatch/applypatch.h"
 #include "otautil/paths.h"
 
-static int EliminateOpenFiles(const std::string& dirname, std::set<std::string>* files) {
+// A file is identified by its device and inode numbers, so that a descriptor matches the file it
+// refers to no matter which path (e.g. another hard link) it was opened through.
+using FileId = std::pair<dev_t, ino_t>;
+
+// A file that may be deleted, with the space its deletion is expected to free.
+struct ExpendableFile {
+  std::string path;
+  int64_t bytes;
+};
+
+// Returns the space that deleting the file with |st| is expected to free: its allocated blocks, or
+// its size rounded up to the block size if that's more, so that the plan errs on deleting too
+// little rather than too much. A file with other links frees nothing.
+static int64_t FreedBytes(const struct stat& st) {
+  if (st.st_nlink > 1) {
+    return 0;
+  }
+  int64_t block_size = st.st_blksize > 0 ? st.st_blksize : 4096;
+  int64_t rounded_size = (st.st_size + block_size - 1) / block_size * block_size;
+  return std::max(static_cast<int64_t>(st.st_blocks) * 512, rounded_size);
+}
+
+// Removes the files that are open by any process from |files|. Each descriptor in /proc/*/fd is
+// stat'ed relative to the fd directory, and compared by FileId. The scan stops as soon as every
+// candidate has been found open.
+static int EliminateOpenFiles(std::multimap<FileId, ExpendableFile>* files) {
   std::unique_ptr<DIR, decltype(&closedir)> d(opendir("/proc"), closedir);
   if (!d) {
     PLOG(ERROR) << "Failed to open /proc";
     return -1;
   }
   struct dirent* de;
-  while ((de = readdir(d.get())) != 0) {
+  while (!files->empty() && (de = readdir(d.get())) != 0) {
     unsigned int pid;
     if (!android::base::ParseUint(de->d_name, &pid)) {
         continue;
     }
-    std::string path = android::base::StringPrintf("/proc/%s/fd/", de->d_name);
+    std::string path = android::base::StringPrintf("/proc/%s/fd", de->d_name);
 
     struct dirent* fdde;
     std::unique_ptr<DIR, decltype(&closedir)> fdd(opendir(path.c_str()), closedir);
@@ -59,36 +87,43 @@ static int EliminateOpenFiles(const std::string& dirname, std::set<std::string>*
       PLOG(ERROR) << "Failed to open " << path;
       continue;
     }
-    while ((fdde = readdir(fdd.get())) != 0) {
-      std::string fd_path = path + fdde->d_name;
-      char link[FILENAME_MAX];
-
-      int count = readlink(fd_path.c_str(), link, sizeof(link)-1);
-      if (count >= 0) {
-        link[count] = '\0';
-        if (android::base::StartsWith(link, dirname)) {
-          if (files->erase(link) > 0) {
-            LOG(INFO) << link << " is open by " << de->d_name;
-          }
-        }
+    int fdd_fd = dirfd(fdd.get());
+    while (!files->empty() && (fdde = readdir(fdd.get())) != 0) {
+      if (fdde->d_name[0] == '.') {
+        continue;
       }
+      // The descriptor may have been closed since the readdir().
+      struct stat st;
+      if (fstatat(fdd_fd, fdde->d_name, &st, 0) != 0) {
+        continue;
+      }
+      auto [first, last] = files->equal_range({ st.st_dev, st.st_ino });
+      for (auto it = first; it != last; it++) {
+        LOG(INFO) << it->second.path << " is open by " << de->d_name;
+      }
+      files->erase(first, last);
     }
   }
   return 0;
 }
 
-static std::vector<std::string> FindExpendableFiles(
+static std::vector<ExpendableFile> FindExpendableFiles(
     const std::string& dirname, const std::function<bool(const std::string&)>& name_filter) {
   std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dirname.c_str()), closedir);
   if (!d) {
     PLOG(ERROR) << "Failed to open " << dirname;
     return {};
   }
+  int dir_fd = dirfd(d.get());
 
   // Look for regular files in the directory (not in any subdirectories).
-  std::set<std::string> files;
+  std::multimap<FileId, ExpendableFile> files;
   struct dirent* de;
   while ((de = readdir(d.get())) != 0) {
+    // Skip the entries that readdir() already tells apart from regular files without a stat().
+    if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN) {
+      continue;
+    }
     std::string path = dirname + "/" + de->d_name;
 
     // We can't delete cache_temp_source; if it's there we might have restarted during
@@ -103,17 +138,24 @@ static std::vector<std::string> FindExpendableFiles(
     }
 
     struct stat st;
-    if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
-      files.insert(path);
+    if (fstatat(dir_fd, de->d_name, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+      files.emplace(FileId{ st.st_dev, st.st_ino }, ExpendableFile{ path, FreedBytes(st) });
     }
   }
 
   LOG(INFO) << files.size() << " regular files in deletable directory";
-  if (EliminateOpenFiles(dirname, &files) < 0) {
+  if (EliminateOpenFiles(&files) < 0) {
     return {};
   }
 
-  return std::vector<std::string>(files.begin(), files.end());
+  std::vector<ExpendableFile> result;
+  for (const auto& [id, file] : files) {
+    result.push_back(file);
+  }
+  // Keep the order of the paths, which the callers build on.
+  std::sort(result.begin(), result.end(),
+            [](const auto& file1, const auto& file2) { return file1.path < file2.path; });
+  return result;
 }
 
 // Parses the index of given log file, e.g. 3 for last_log.3; returns max number if the log name
@@ -199,7 +241,7 @@ bool RemoveFilesInDirectory(size_t bytes_needed, const std::string& dirname,
     return true;
   }
 
-  std::vector<std::string> files;
+  std::vector<ExpendableFile> files;
   if (dirname == Paths::Get().cache_log_directory()) {
     // Deletes the log files only.
     auto log_filter = [](const std::string& file_name) {
@@ -210,11 +252,11 @@ bool RemoveFilesInDirectory(size_t bytes_needed, const std::string& dirname,
     files = FindExpendableFiles(dirname, log_filter);
 
     // Older logs will come to the top of the queue.
-    auto comparator = [](const std::string& name1, const std::string& name2) -> bool {
-      unsigned int index1 = GetLogIndex(android::base::Basename(name1));
-      unsigned int index2 = GetLogIndex(android::base::Basename(name2));
+    auto comparator = [](const ExpendableFile& file1, const ExpendableFile& file2) -> bool {
+      unsigned int index1 = GetLogIndex(android::base::Basename(file1.path));
+      unsigned int index2 = GetLogIndex(android::base::Basename(file2.path));
       if (index1 == index2) {
-        return name1 < name2;
+        return file1.path < file2.path;
       }
 
       return index1 > index2;
@@ -226,7 +268,38 @@ bool RemoveFilesInDirectory(size_t bytes_needed, const std::string& dirname,
     files = FindExpendableFiles(dirname, nullptr);
   }
 
-  for (const auto& file : files) {
+  // Plan the deletion first: take the files in order until the space they're expected to free
+  // covers what's missing, delete them all, then check the free space once.
+  int64_t missing = static_cast<int64_t>(bytes_needed) - free_now;
+  size_t planned = 0;
+  for (int64_t planned_bytes = 0; planned < files.size() && planned_bytes < missing; planned++) {
+    planned_bytes += files[planned].bytes;
+  }
+  size_t deleted = 0;
+  for (size_t i = 0; i < planned; i++) {
+    if (unlink(files[i].path.c_str()) == -1) {
+      PLOG(ERROR) << "Failed to delete " << files[i].path;
+      continue;
+    }
+    LOG(INFO) << "Deleted " << files[i].path << " (" << files[i].bytes << " bytes)";
+    deleted++;
+  }
+  if (deleted > 0) {
+    free_now = space_checker(dirname);
+    if (free_now == -1) {
+      LOG(ERROR) << "Failed to check free space for " << dirname;
+      return false;
+    }
+    LOG(INFO) << "Deleted " << deleted << " files; now " << free_now << " bytes free";
+    if (free_now >= static_cast<int64_t>(bytes_needed)) {
+      return true;
+    }
+  }
+
+  // The plan fell short (e.g. a deletion failed, or freed less than expected); delete the rest
+  // one by one.
+  for (size_t i = planned; i < files.size(); i++) {
+    const auto& file = files[i].path;
     if (unlink(file.c_str()) == -1) {
       PLOG(ERROR) << "Failed to delete " << file;
       continue;
@@ -125,6 +125,13 @@
  * We move on to the next pair of pieces if the size of the split source image reaches the block
  * limit.
  *
+ * With "--split-patch-slack", the split points are also picked with a cost model of applying each
+ * piece on the device: its source ranges, its patch and the largest pair of inflated deflate chunks
+ * are held in memory at once.  The pieces are then cut short of the block limit where that lowers
+ * the peak over all the pieces, as long as the estimated total patch stays within the given
+ * percentage of the one with the pieces filled up to the block limit.  The predicted peak of each
+ * piece is logged.
+ *
  * After the split, the target pieces are continuous and block aligned, while the source pieces
  * are mutually exclusive.  Some of the source blocks may not be used if there's no matching
  * entry_name in the target; as a result, they won't be included in any of these split source
@@ -148,12 +155,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -168,6 +181,7 @@
 #include <zlib.h>
 
 #include "applypatch/imgdiff_image.h"
+#include "applypatch/suffix_array_cache.h"
 #include "otautil/rangeset.h"
 
 using android::base::get_unaligned;
@@ -251,15 +265,65 @@ static const struct option OPTIONS[] = {
   { "block-limit", required_argument, nullptr, 0 },
   { "debug-dir", required_argument, nullptr, 0 },
   { "split-info", required_argument, nullptr, 0 },
+  { "split-patch-slack", required_argument, nullptr, 0 },
+  { "num-threads", required_argument, nullptr, 0 },
+  { "sa-cache-dir", required_argument, nullptr, 0 },
+  { "low-memory", no_argument, nullptr, 0 },
   { "verbose", no_argument, nullptr, 'v' },
   { nullptr, 0, nullptr, 0 },
 };
 
+bool FileContent::Load(const std::string& filename, bool map) {
+  android::base::unique_fd fd(open(filename.c_str(), O_RDONLY));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to open " << filename;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    PLOG(ERROR) << "Failed to stat " << filename;
+    return false;
+  }
+
+  size_t sz = static_cast<size_t>(st.st_size);
+  mapped_.reset();
+  data_.clear();
+  // An empty file can't be mapped, and has nothing to read.
+  if (map && sz > 0) {
+    mapped_ = android::base::MappedFile::FromFd(fd, 0, sz, PROT_READ);
+    if (!mapped_) {
+      PLOG(ERROR) << "Failed to map " << filename;
+      return false;
+    }
+    return true;
+  }
+
+  data_.resize(sz);
+  if (!android::base::ReadFully(fd, data_.data(), sz)) {
+    PLOG(ERROR) << "Failed to read " << filename;
+    return false;
+  }
+  return true;
+}
+
 ImageChunk::ImageChunk(int type, size_t start, const std::vector<uint8_t>* file_content,
                        size_t raw_data_len, std::string entry_name)
     : type_(type),
       start_(start),
-      input_file_ptr_(file_content),
+      input_data_(file_content != nullptr ? file_content->data() : nullptr),
+      input_size_(file_content != nullptr ? file_content->size() : 0),
+      raw_data_len_(raw_data_len),
+      compress_level_(6),
+      entry_name_(std::move(entry_name)) {
+  CHECK(file_content != nullptr) << "input file container can't be nullptr";
+}
+
+ImageChunk::ImageChunk(int type, size_t start, const FileContent* file_content,
+                       size_t raw_data_len, std::string entry_name)
+    : type_(type),
+      start_(start),
+      input_data_(file_content != nullptr ? file_content->data() : nullptr),
+      input_size_(file_content != nullptr ? file_content->size() : 0),
       raw_data_len_(raw_data_len),
       compress_level_(6),
       entry_name_(std::move(entry_name)) {
@@ -267,12 +331,13 @@ ImageChunk::ImageChunk(int type, size_t start, const std::vector<uint8_t>* file_
 }
 
 const uint8_t* ImageChunk::GetRawData() const {
-  CHECK_LE(start_ + raw_data_len_, input_file_ptr_->size());
-  return input_file_ptr_->data() + start_;
+  CHECK_LE(start_ + raw_data_len_, input_size_);
+  return input_data_ + start_;
 }
 
 const uint8_t * ImageChunk::DataForPatch() const {
   if (type_ == CHUNK_DEFLATE) {
+    CHECK(!inflate_on_demand_) << "the uncompressed data of " << entry_name_ << " isn't kept";
     return uncompressed_data_.data();
   }
   return GetRawData();
@@ -280,11 +345,50 @@ const uint8_t * ImageChunk::DataForPatch() const {
 
 size_t ImageChunk::DataLengthForPatch() const {
   if (type_ == CHUNK_DEFLATE) {
+    if (inflate_on_demand_) {
+      return uncompressed_len_ + bonus_data_.size();
+    }
     return uncompressed_data_.size();
   }
   return raw_data_len_;
 }
 
+const uint8_t* ImageChunk::LoadDataForPatch(std::vector<uint8_t>* storage) const {
+  if (type_ != CHUNK_DEFLATE || !inflate_on_demand_) {
+    return DataForPatch();
+  }
+  if (!Inflate(storage)) {
+    return nullptr;
+  }
+  storage->insert(storage->end(), bonus_data_.begin(), bonus_data_.end());
+  return storage->data();
+}
+
+bool ImageChunk::Inflate(std::vector<uint8_t>* data) const {
+  // One spare byte, to tell a stream that inflates to more than expected.
+  data->resize(uncompressed_len_ + 1);
+
+  z_stream strm = {};
+  strm.avail_in = raw_data_len_;
+  strm.next_in = const_cast<uint8_t*>(GetRawData());
+  strm.avail_out = data->size();
+  strm.next_out = data->data();
+  if (int ret = inflateInit2(&strm, WINDOWBITS); ret != Z_OK) {
+    LOG(ERROR) << "Failed to initialize inflate: " << ret;
+    return false;
+  }
+  int ret = inflate(&strm, Z_FINISH);
+  size_t inflated = data->size() - strm.avail_out;
+  inflateEnd(&strm);
+  if (ret != Z_STREAM_END || inflated != uncompressed_len_) {
+    LOG(ERROR) << "Failed to inflate " << entry_name_ << " at offset " << start_ << ": " << ret
+               << ", " << inflated << " of " << uncompressed_len_ << " bytes";
+    return false;
+  }
+  data->resize(uncompressed_len_);
+  return true;
+}
+
 void ImageChunk::Dump(size_t index) const {
   LOG(INFO) << "chunk: " << index << ", type: " << type_ << ", start: " << start_
             << ", len: " << DataLengthForPatch() << ", name: " << entry_name_;
@@ -302,11 +406,17 @@ void ImageChunk::SetUncompressedData(std::vector<uint8_t> data) {
   uncompressed_data_ = std::move(data);
 }
 
+void ImageChunk::SetUncompressedLength(size_t length) {
+  inflate_on_demand_ = true;
+  uncompressed_len_ = length;
+}
+
 bool ImageChunk::SetBonusData(const std::vector<uint8_t>& bonus_data) {
   if (type_ != CHUNK_DEFLATE) {
     return false;
   }
-  uncompressed_data_.insert(uncompressed_data_.end(), bonus_data.begin(), bonus_data.end());
+  auto& data = inflate_on_demand_ ? bonus_data_ : uncompressed_data_;
+  data.insert(data.end(), bonus_data.begin(), bonus_data.end());
   return true;
 }
 
@@ -315,6 +425,7 @@ void ImageChunk::ChangeDeflateChunkToNormal() {
   type_ = CHUNK_NORMAL;
   // No need to clear the entry name.
   uncompressed_data_.clear();
+  bonus_data_.clear();
 }
 
 bool ImageChunk::IsAdjacentNormal(const ImageChunk& other) const {
@@ -327,11 +438,87 @@ bool ImageChunk::IsAdjacentNormal(const ImageChunk& other) const {
 void ImageChunk::MergeAdjacentNormal(const ImageChunk& other) {
   CHECK(IsAdjacentNormal(other));
   raw_data_len_ = raw_data_len_ + other.raw_data_len_;
+  // The merged chunk is no longer a single zip entry.
+  content_key_.reset();
 }
 
-bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
-                           std::vector<uint8_t>* patch_data,
-                           bsdiff::SuffixArrayIndexInterface** bsdiff_cache) {
+/*
+ * PatchSpool keeps the patches of the low-memory mode in a temporary file next to the output, as
+ * they are made, so that only the patches being made are held in memory. The patches are copied
+ * out in order once they are all made.
+ */
+class PatchSpool {
+ public:
+  explicit PatchSpool(const std::string& dir) : file_(dir) {}
+
+  bool ok() const {
+    return file_.fd != -1;
+  }
+
+  // Appends the |size| bytes of the patch in |patch_fd|, and sets |offset| to where it went.
+  bool Append(int patch_fd, size_t size, size_t* offset) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      *offset = size_;
+      size_ += size;
+    }
+    std::vector<uint8_t> buffer(std::min(size, kCopyBufferSize));
+    for (size_t copied = 0; copied < size;) {
+      size_t to_copy = std::min(size - copied, buffer.size());
+      if (!android::base::ReadFullyAtOffset(patch_fd, buffer.data(), to_copy, copied) ||
+          !android::base::WriteFullyAtOffset(file_.fd, buffer.data(), to_copy, *offset + copied)) {
+        PLOG(ERROR) << "Failed to spool the patch to " << file_.path;
+        return false;
+      }
+      copied += to_copy;
+    }
+    return true;
+  }
+
+  // Writes the |size| bytes at |offset| to |fd|.
+  bool CopyTo(int fd, size_t offset, size_t size) const {
+    std::vector<uint8_t> buffer(std::min(size, kCopyBufferSize));
+    for (size_t copied = 0; copied < size;) {
+      size_t to_copy = std::min(size - copied, buffer.size());
+      if (!android::base::ReadFullyAtOffset(file_.fd, buffer.data(), to_copy, offset + copied) ||
+          !android::base::WriteFully(fd, buffer.data(), to_copy)) {
+        PLOG(ERROR) << "Failed to copy the patch out of " << file_.path;
+        return false;
+      }
+      copied += to_copy;
+    }
+    return true;
+  }
+
+ private:
+  static constexpr size_t kCopyBufferSize = 1024 * 1024;
+
+  std::mutex mutex_;
+  TemporaryFile file_;
+  size_t size_{ 0 };
+};
+
+// Creates the spool of the low-memory mode, next to the patch at |patch_name|.
+static bool CreatePatchSpool(const std::string& patch_name, std::unique_ptr<PatchSpool>* spool) {
+  *spool = std::make_unique<PatchSpool>(android::base::Dirname(patch_name));
+  if (!(*spool)->ok()) {
+    PLOG(ERROR) << "Failed to create the patch spool for " << patch_name;
+    return false;
+  }
+  return true;
+}
+
+// The patch made for a chunk: in |data|, or at |spool_offset| of the spool in the low-memory mode.
+struct PatchData {
+  std::vector<uint8_t> data;
+  size_t size{ 0 };
+  size_t spool_offset{ 0 };
+};
+
+// Computes a bsdiff patch from |src| to |tgt| into |patch|, or into |spool| if given.
+static bool MakeBsdiffPatch(const uint8_t* src, size_t src_len, const uint8_t* tgt, size_t tgt_len,
+                            bsdiff::SuffixArrayIndexInterface** bsdiff_cache, PatchSpool* spool,
+                            PatchData* patch) {
 #if defined(__ANDROID__)
   char ptemp[] = "/data/local/tmp/imgdiff-patch-XXXXXX";
 #else
@@ -345,14 +532,15 @@ bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
   }
   close(fd);
 
-  int r = bsdiff::bsdiff(src.DataForPatch(), src.DataLengthForPatch(), tgt.DataForPatch(),
-                         tgt.DataLengthForPatch(), ptemp, bsdiff_cache);
+  int r = bsdiff::bsdiff(src, src_len, tgt, tgt_len, ptemp, bsdiff_cache);
   if (r != 0) {
     LOG(ERROR) << "bsdiff() failed: " << r;
+    unlink(ptemp);
     return false;
   }
 
   android::base::unique_fd patch_fd(open(ptemp, O_RDONLY));
+  unlink(ptemp);
   if (patch_fd == -1) {
     PLOG(ERROR) << "Failed to open " << ptemp;
     return false;
@@ -363,82 +551,275 @@ bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
     return false;
   }
 
-  size_t sz = static_cast<size_t>(st.st_size);
+  patch->size = static_cast<size_t>(st.st_size);
+  if (spool != nullptr) {
+    return spool->Append(patch_fd, patch->size, &patch->spool_offset);
+  }
 
-  patch_data->resize(sz);
-  if (!android::base::ReadFully(patch_fd, patch_data->data(), sz)) {
+  patch->data.resize(patch->size);
+  if (!android::base::ReadFully(patch_fd, patch->data.data(), patch->size)) {
     PLOG(ERROR) << "Failed to read " << ptemp;
-    unlink(ptemp);
     return false;
   }
+  return true;
+}
 
-  unlink(ptemp);
+bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
+                           std::vector<uint8_t>* patch_data,
+                           bsdiff::SuffixArrayIndexInterface** bsdiff_cache) {
+  std::vector<uint8_t> src_storage;
+  std::vector<uint8_t> tgt_storage;
+  const uint8_t* src_data = src.LoadDataForPatch(&src_storage);
+  const uint8_t* tgt_data = tgt.LoadDataForPatch(&tgt_storage);
+  if (src_data == nullptr || tgt_data == nullptr) {
+    return false;
+  }
 
+  PatchData patch;
+  if (!MakeBsdiffPatch(src_data, src.DataLengthForPatch(), tgt_data, tgt.DataLengthForPatch(),
+                       bsdiff_cache, nullptr, &patch)) {
+    return false;
+  }
+  *patch_data = std::move(patch.data);
   return true;
 }
 
-bool ImageChunk::ReconstructDeflateChunk() {
-  if (type_ != CHUNK_DEFLATE) {
-    LOG(ERROR) << "Attempted to reconstruct non-deflate chunk";
+// A pair of target and source chunks to make a bsdiff patch for.
+struct PatchTask {
+  size_t tgt_index;
+  const ImageChunk* tgt;
+  const ImageChunk* src;
+  // Whether the patch is made against the pseudo source, which is shared by all such tasks.
+  bool use_pseudo_source;
+  PatchData patch;
+};
+
+// Makes the patches for the given tasks on up to |num_threads| threads. The chunks are independent,
+// except that the tasks against the pseudo source share its bsdiff suffix array; the first of them
+// builds it before the others start. If |sa_cache| is given, the suffix arrays of all the source
+// chunks come from it. The suffix arrays of the large sources are sorted on the threads that would
+// be idle otherwise: all of them for the pseudo source, and an even share for each of the tasks
+// when there are fewer tasks than threads. The deflate chunks that don't keep their uncompressed
+// data are inflated only for the duration of their task, and the patches go to |spool| if given.
+// Returns false and sets |failed_task| if any of them fails.
+static bool MakePatches(std::vector<PatchTask>* tasks, size_t num_threads,
+                        const SuffixArrayCache* sa_cache, PatchSpool* spool, size_t* failed_task) {
+  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+  size_t sa_threads = num_threads / std::max<size_t>(std::min(num_threads, tasks->size()), 1);
+  auto make_patch = [&bsdiff_cache, sa_cache, sa_threads, spool](PatchTask* task) {
+    std::vector<uint8_t> src_storage;
+    std::vector<uint8_t> tgt_storage;
+    const uint8_t* src_data = task->src->LoadDataForPatch(&src_storage);
+    const uint8_t* tgt_data = task->tgt->LoadDataForPatch(&tgt_storage);
+    if (src_data == nullptr || tgt_data == nullptr) {
+      return false;
+    }
+    size_t src_len = task->src->DataLengthForPatch();
+    size_t tgt_len = task->tgt->DataLengthForPatch();
+
+    if (task->use_pseudo_source) {
+      return MakeBsdiffPatch(src_data, src_len, tgt_data, tgt_len, &bsdiff_cache, spool,
+                             &task->patch);
+    }
+    // Without an index, bsdiff() sorts the suffix array itself.
+    std::unique_ptr<bsdiff::SuffixArrayIndexInterface> index;
+    if (sa_cache != nullptr) {
+      index = sa_cache->Get(src_data, src_len, sa_threads);
+    } else if (sa_threads > 1 && src_len >= kMinParallelSuffixSortSize) {
+      index = CreateSuffixArrayIndex(src_data, src_len, sa_threads);
+    }
+    bsdiff::SuffixArrayIndexInterface* index_ptr = index.get();
+    return MakeBsdiffPatch(src_data, src_len, tgt_data, tgt_len,
+                           index_ptr != nullptr ? &index_ptr : nullptr, spool, &task->patch);
+  };
+
+  auto first_cached = std::find_if(tasks->begin(), tasks->end(),
+                                   [](const PatchTask& task) { return task.use_pseudo_source; });
+  if (first_cached != tasks->end()) {
+    // The pseudo source is a normal chunk, which always has its data.
+    const ImageChunk* src = first_cached->src;
+    if (sa_cache != nullptr) {
+      bsdiff_cache =
+          sa_cache->Get(src->DataForPatch(), src->DataLengthForPatch(), num_threads).release();
+    } else if (num_threads > 1 && src->DataLengthForPatch() >= kMinParallelSuffixSortSize) {
+      bsdiff_cache =
+          CreateSuffixArrayIndex(src->DataForPatch(), src->DataLengthForPatch(), num_threads)
+              .release();
+    }
+  }
+  if (first_cached != tasks->end() && !make_patch(&*first_cached)) {
+    *failed_task = first_cached - tasks->begin();
+    delete bsdiff_cache;
     return false;
   }
 
-  // We only check two combinations of encoder parameters:  level 6 (the default) and level 9
-  // (the maximum).
-  for (int level = 6; level <= 9; level += 3) {
-    if (TryReconstruction(level)) {
-      compress_level_ = level;
-      return true;
+  std::atomic<size_t> next{ 0 };
+  std::atomic<bool> failed{ false };
+  auto worker = [&]() {
+    size_t i;
+    while (!failed && (i = next++) < tasks->size()) {
+      if (tasks->begin() + i == first_cached) {
+        continue;
+      }
+      if (!make_patch(&(*tasks)[i]) && !failed.exchange(true)) {
+        *failed_task = i;
+      }
+    }
+  };
+
+  num_threads = std::min(num_threads, tasks->size());
+  if (num_threads <= 1) {
+    worker();
+  } else {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < num_threads; i++) {
+      threads.emplace_back(worker);
+    }
+    for (auto& thread : threads) {
+      thread.join();
     }
   }
 
-  return false;
+  delete bsdiff_cache;
+  return !failed;
 }
 
+// The number of compressed bytes each candidate level has to reproduce before the full chunk is
+// recompressed at that level. Most levels that don't match diverge within the first few blocks.
+static constexpr size_t kQuickRejectWindow = 64 * 1024;
+
 /*
- * Takes the uncompressed data stored in the chunk, compresses it using the zlib parameters stored
- * in the chunk, and checks that it matches exactly the compressed data we started with (also
- * stored in the chunk).
+ * Recompresses the uncompressed data of a deflate chunk at the given level, and compares the output
+ * against the original compressed data as it's produced. The recompression can be stopped after a
+ * prefix and resumed later.
  */
-bool ImageChunk::TryReconstruction(int level) {
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = uncompressed_data_.size();
-  strm.next_in = uncompressed_data_.data();
-  int ret = deflateInit2(&strm, level, METHOD, WINDOWBITS, MEMLEVEL, STRATEGY);
-  if (ret < 0) {
-    LOG(ERROR) << "Failed to initialize deflate: " << ret;
-    return false;
+class DeflateMatcher {
+ public:
+  DeflateMatcher(const std::vector<uint8_t>& uncompressed, const uint8_t* compressed,
+                 size_t compressed_len, int level)
+      : compressed_(compressed), compressed_len_(compressed_len), level_(level) {
+    strm_.zalloc = Z_NULL;
+    strm_.zfree = Z_NULL;
+    strm_.opaque = Z_NULL;
+    strm_.avail_in = uncompressed.size();
+    strm_.next_in = const_cast<uint8_t*>(uncompressed.data());
+    int ret = deflateInit2(&strm_, level, ImageChunk::METHOD, ImageChunk::WINDOWBITS,
+                           ImageChunk::MEMLEVEL, ImageChunk::STRATEGY);
+    if (ret < 0) {
+      LOG(ERROR) << "Failed to initialize deflate: " << ret;
+      failed_ = true;
+      return;
+    }
+    initialized_ = true;
   }
 
-  std::vector<uint8_t> buffer(BUFFER_SIZE);
-  size_t offset = 0;
-  do {
-    strm.avail_out = buffer.size();
-    strm.next_out = buffer.data();
-    ret = deflate(&strm, Z_FINISH);
-    if (ret < 0) {
-      LOG(ERROR) << "Failed to deflate: " << ret;
-      return false;
+  ~DeflateMatcher() {
+    if (initialized_) {
+      deflateEnd(&strm_);
     }
+  }
 
-    size_t compressed_size = buffer.size() - strm.avail_out;
-    if (memcmp(buffer.data(), input_file_ptr_->data() + start_ + offset, compressed_size) != 0) {
-      // mismatch; data isn't the same.
-      deflateEnd(&strm);
-      return false;
+  int level() const {
+    return level_;
+  }
+
+  // Continues the recompression until at least |limit| compressed bytes have been compared (or the
+  // stream ends). Returns false on a mismatch, or if |cancelled| gets set in the meantime.
+  bool Match(size_t limit, const std::atomic<bool>* cancelled = nullptr) {
+    while (!failed_ && !finished_ && offset_ < limit) {
+      if (cancelled != nullptr && *cancelled) {
+        return false;
+      }
+      strm_.avail_out = buffer_.size();
+      strm_.next_out = buffer_.data();
+      int ret = deflate(&strm_, Z_FINISH);
+      if (ret < 0) {
+        LOG(ERROR) << "Failed to deflate: " << ret;
+        failed_ = true;
+        break;
+      }
+
+      size_t compressed_size = buffer_.size() - strm_.avail_out;
+      if (compressed_size > compressed_len_ - offset_ ||
+          memcmp(buffer_.data(), compressed_ + offset_, compressed_size) != 0) {
+        // mismatch; data isn't the same.
+        failed_ = true;
+        break;
+      }
+      offset_ += compressed_size;
+      finished_ = (ret == Z_STREAM_END);
     }
-    offset += compressed_size;
-  } while (ret != Z_STREAM_END);
-  deflateEnd(&strm);
+    // The stream must also end exactly where the original data does.
+    return !failed_ && (!finished_ || offset_ == compressed_len_);
+  }
+
+ private:
+  z_stream strm_;
+  const uint8_t* compressed_;
+  size_t compressed_len_;
+  int level_;
+  std::vector<uint8_t> buffer_ = std::vector<uint8_t>(BUFFER_SIZE);
+  size_t offset_{ 0 };
+  bool initialized_{ false };
+  bool finished_{ false };
+  bool failed_{ false };
+};
 
-  if (offset != raw_data_len_) {
-    // mismatch; ran out of data before we should have.
+/*
+ * Takes the uncompressed data stored in the chunk, compresses it using the candidate encoder
+ * parameters, and checks that it matches exactly the compressed data we started with (also stored
+ * in the chunk). Each level first has to reproduce a short prefix; the levels that pass are then
+ * finished in parallel, since a level can still diverge late in a large entry.
+ */
+bool ImageChunk::ReconstructDeflateChunk() {
+  if (type_ != CHUNK_DEFLATE) {
+    LOG(ERROR) << "Attempted to reconstruct non-deflate chunk";
     return false;
   }
-  return true;
+
+  // In the low-memory mode, the data is only inflated for the check.
+  std::vector<uint8_t> inflated;
+  if (inflate_on_demand_ && !Inflate(&inflated)) {
+    return false;
+  }
+  const auto& uncompressed = inflate_on_demand_ ? inflated : uncompressed_data_;
+
+  // We only check two combinations of encoder parameters:  level 6 (the default) and level 9
+  // (the maximum). Level 6 is preferred if both of them match.
+  std::vector<std::unique_ptr<DeflateMatcher>> candidates;
+  for (int level = 6; level <= 9; level += 3) {
+    auto matcher =
+        std::make_unique<DeflateMatcher>(uncompressed, GetRawData(), raw_data_len_, level);
+    if (matcher->Match(kQuickRejectWindow)) {
+      candidates.push_back(std::move(matcher));
+    }
+  }
+  if (candidates.empty()) {
+    return false;
+  }
+
+  // The later candidates give up as soon as the first one matches.
+  std::atomic<bool> first_matched{ false };
+  std::vector<char> matched(candidates.size(), false);
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < candidates.size(); i++) {
+    threads.emplace_back([&, i]() {
+      matched[i] = candidates[i]->Match(std::numeric_limits<size_t>::max(), &first_matched);
+    });
+  }
+  matched[0] = candidates[0]->Match(std::numeric_limits<size_t>::max());
+  first_matched = matched[0];
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (size_t i = 0; i < candidates.size(); i++) {
+    if (matched[i]) {
+      compress_level_ = candidates[i]->level();
+      return true;
+    }
+  }
+  return false;
 }
 
 PatchChunk::PatchChunk(const ImageChunk& tgt, const ImageChunk& src, std::vector<uint8_t> data)
@@ -450,9 +831,25 @@ PatchChunk::PatchChunk(const ImageChunk& tgt, const ImageChunk& src, std::vector
       target_len_(tgt.GetRawDataLength()),
       target_uncompressed_len_(tgt.DataLengthForPatch()),
       target_compress_level_(tgt.GetCompressLevel()),
-      data_(std::move(data)) {}
+      data_(std::move(data)),
+      data_size_(data_.size()) {}
 
-// Construct a CHUNK_RAW patch from the target data directly.
+PatchChunk::PatchChunk(const ImageChunk& tgt, const ImageChunk& src, const PatchSpool* spool,
+                       size_t offset, size_t size)
+    : type_(tgt.GetType()),
+      source_start_(src.GetStartOffset()),
+      source_len_(src.GetRawDataLength()),
+      source_uncompressed_len_(src.DataLengthForPatch()),
+      target_start_(tgt.GetStartOffset()),
+      target_len_(tgt.GetRawDataLength()),
+      target_uncompressed_len_(tgt.DataLengthForPatch()),
+      target_compress_level_(tgt.GetCompressLevel()),
+      spool_(spool),
+      spool_offset_(offset),
+      data_size_(size) {}
+
+// Construct a CHUNK_RAW patch from the target data directly. The data is written out of the target
+// file rather than copied, so the target image must outlive the patch.
 PatchChunk::PatchChunk(const ImageChunk& tgt)
     : type_(CHUNK_RAW),
       source_start_(0),
@@ -462,7 +859,8 @@ PatchChunk::PatchChunk(const ImageChunk& tgt)
       target_len_(tgt.GetRawDataLength()),
       target_uncompressed_len_(tgt.DataLengthForPatch()),
       target_compress_level_(tgt.GetCompressLevel()),
-      data_(tgt.GetRawData(), tgt.GetRawData() + tgt.GetRawDataLength()) {}
+      raw_data_(tgt.GetRawData()),
+      data_size_(tgt.GetRawDataLength()) {}
 
 // Return true if raw data is smaller than the patch size.
 bool PatchChunk::RawDataIsSmaller(const ImageChunk& tgt, size_t patch_size) {
@@ -488,7 +886,7 @@ size_t PatchChunk::GetHeaderSize() const {
     case CHUNK_DEFLATE:
       return 4 + 8 * 5 + 4 * 5;
     case CHUNK_RAW:
-      return 4 + 4 + data_.size();
+      return 4 + 4 + data_size_;
     default:
       CHECK(false) << "unexpected chunk type: " << type_;  // Should not reach here.
       return 0;
@@ -501,14 +899,14 @@ size_t PatchChunk::WriteHeaderToFd(int fd, size_t offset, size_t index) const {
   switch (type_) {
     case CHUNK_NORMAL:
       LOG(INFO) << android::base::StringPrintf("chunk %zu: normal   (%10zu, %10zu)  %10zu", index,
-                                               target_start_, target_len_, data_.size());
+                                               target_start_, target_len_, data_size_);
       Write8(fd, static_cast<int64_t>(source_start_));
       Write8(fd, static_cast<int64_t>(source_len_));
       Write8(fd, static_cast<int64_t>(offset));
-      return offset + data_.size();
+      return offset + data_size_;
     case CHUNK_DEFLATE:
       LOG(INFO) << android::base::StringPrintf("chunk %zu: deflate  (%10zu, %10zu)  %10zu", index,
-                                               target_start_, target_len_, data_.size());
+                                               target_start_, target_len_, data_size_);
       Write8(fd, static_cast<int64_t>(source_start_));
       Write8(fd, static_cast<int64_t>(source_len_));
       Write8(fd, static_cast<int64_t>(offset));
@@ -519,13 +917,13 @@ size_t PatchChunk::WriteHeaderToFd(int fd, size_t offset, size_t index) const {
       Write4(fd, ImageChunk::WINDOWBITS);
       Write4(fd, ImageChunk::MEMLEVEL);
       Write4(fd, ImageChunk::STRATEGY);
-      return offset + data_.size();
+      return offset + data_size_;
     case CHUNK_RAW:
       LOG(INFO) << android::base::StringPrintf("chunk %zu: raw      (%10zu, %10zu)", index,
                                                target_start_, target_len_);
-      Write4(fd, static_cast<int32_t>(data_.size()));
-      if (!android::base::WriteFully(fd, data_.data(), data_.size())) {
-        CHECK(false) << "Failed to write " << data_.size() << " bytes patch";
+      Write4(fd, static_cast<int32_t>(data_size_));
+      if (!android::base::WriteFully(fd, raw_data_, data_size_)) {
+        CHECK(false) << "Failed to write " << data_size_ << " bytes patch";
       }
       return offset;
     default:
@@ -538,7 +936,7 @@ size_t PatchChunk::PatchSize() const {
   if (type_ == CHUNK_RAW) {
     return GetHeaderSize();
   }
-  return GetHeaderSize() + data_.size();
+  return GetHeaderSize() + data_size_;
 }
 
 // Write the contents of |patch_chunks| to |patch_fd|.
@@ -569,7 +967,11 @@ bool PatchChunk::WritePatchDataToFd(const std::vector<PatchChunk>& patch_chunks,
     if (patch.type_ == CHUNK_RAW) {
       continue;
     }
-    if (!android::base::WriteFully(patch_fd, patch.data_.data(), patch.data_.size())) {
+    if (patch.spool_ != nullptr) {
+      if (!patch.spool_->CopyTo(patch_fd, patch.spool_offset_, patch.data_size_)) {
+        return false;
+      }
+    } else if (!android::base::WriteFully(patch_fd, patch.data_.data(), patch.data_.size())) {
       PLOG(ERROR) << "Failed to write " << patch.data_.size() << " bytes patch to patch_fd";
       return false;
     }
@@ -618,29 +1020,9 @@ void Image::DumpChunks() const {
   }
 }
 
-bool Image::ReadFile(const std::string& filename, std::vector<uint8_t>* file_content) {
+bool Image::ReadFile(const std::string& filename, FileContent* file_content) {
   CHECK(file_content != nullptr);
-
-  android::base::unique_fd fd(open(filename.c_str(), O_RDONLY));
-  if (fd == -1) {
-    PLOG(ERROR) << "Failed to open " << filename;
-    return false;
-  }
-  struct stat st;
-  if (fstat(fd, &st) != 0) {
-    PLOG(ERROR) << "Failed to stat " << filename;
-    return false;
-  }
-
-  size_t sz = static_cast<size_t>(st.st_size);
-  file_content->resize(sz);
-  if (!android::base::ReadFully(fd, file_content->data(), sz)) {
-    PLOG(ERROR) << "Failed to read " << filename;
-    return false;
-  }
-  fd.reset();
-
-  return true;
+  return file_content->Load(filename, low_memory_);
 }
 
 bool ZipModeImage::Initialize(const std::string& filename) {
@@ -669,9 +1051,22 @@ bool ZipModeImage::Initialize(const std::string& filename) {
   }
 
   CloseArchive(handle);
+  IndexChunksByContent();
   return true;
 }
 
+void ZipModeImage::IndexChunksByContent() {
+  chunks_by_content_.clear();
+  if (!is_source_) {
+    return;
+  }
+  for (size_t i = 0; i < chunks_.size(); i++) {
+    if (const auto& key = chunks_[i].GetContentKey(); key) {
+      chunks_by_content_.emplace(*key, i);
+    }
+  }
+}
+
 // Iterate the zip entries and compose the image chunks accordingly.
 bool ZipModeImage::InitializeChunks(const std::string& filename, ZipArchiveHandle handle) {
   void* cookie;
@@ -801,18 +1196,24 @@ bool ZipModeImage::AddZipEntryToChunks(ZipArchiveHandle handle, const std::strin
                  << uncompressed_len;
       return false;
     }
-    std::vector<uint8_t> uncompressed_data(uncompressed_len);
-    int ret = ExtractToMemory(handle, entry, uncompressed_data.data(), uncompressed_len);
-    if (ret != 0) {
-      LOG(ERROR) << "Failed to extract " << entry_name << " with size " << uncompressed_len << ": "
-                 << ErrorCodeString(ret);
-      return false;
-    }
     ImageChunk curr(CHUNK_DEFLATE, entry->offset, &file_content_, compressed_len, entry_name);
-    curr.SetUncompressedData(std::move(uncompressed_data));
+    curr.SetContentKey(entry->crc32, entry->uncompressed_length);
+    if (low_memory_) {
+      curr.SetUncompressedLength(uncompressed_len);
+    } else {
+      std::vector<uint8_t> uncompressed_data(uncompressed_len);
+      int ret = ExtractToMemory(handle, entry, uncompressed_data.data(), uncompressed_len);
+      if (ret != 0) {
+        LOG(ERROR) << "Failed to extract " << entry_name << " with size " << uncompressed_len
+                   << ": " << ErrorCodeString(ret);
+        return false;
+      }
+      curr.SetUncompressedData(std::move(uncompressed_data));
+    }
     chunks_.push_back(std::move(curr));
   } else {
     chunks_.emplace_back(CHUNK_NORMAL, entry->offset, &file_content_, compressed_len, entry_name);
+    chunks_.back().SetContentKey(entry->crc32, entry->uncompressed_length);
   }
 
   return true;
@@ -886,13 +1287,41 @@ ImageChunk* ZipModeImage::FindChunkByName(const std::string& name, bool find_nor
       static_cast<const ZipModeImage*>(this)->FindChunkByName(name, find_normal));
 }
 
+const ImageChunk* ZipModeImage::FindSourceChunk(const ImageChunk& tgt_chunk,
+                                                bool find_normal) const {
+  if (const ImageChunk* chunk = FindChunkByName(tgt_chunk.GetEntryName(), find_normal); chunk) {
+    return chunk;
+  }
+
+  const auto& key = tgt_chunk.GetContentKey();
+  if (!key) {
+    return nullptr;
+  }
+  auto it = chunks_by_content_.find(*key);
+  if (it == chunks_by_content_.end()) {
+    return nullptr;
+  }
+  const ImageChunk& chunk = chunks_[it->second];
+  if (chunk.GetType() != CHUNK_DEFLATE && !find_normal) {
+    return nullptr;
+  }
+  LOG(INFO) << "Matched " << tgt_chunk.GetEntryName() << " with " << chunk.GetEntryName()
+            << " by content";
+  return &chunk;
+}
+
+ImageChunk* ZipModeImage::FindSourceChunk(const ImageChunk& tgt_chunk, bool find_normal) {
+  return const_cast<ImageChunk*>(
+      static_cast<const ZipModeImage*>(this)->FindSourceChunk(tgt_chunk, find_normal));
+}
+
 bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image) {
   for (auto& tgt_chunk : *tgt_image) {
     if (tgt_chunk.GetType() != CHUNK_DEFLATE) {
       continue;
     }
 
-    ImageChunk* src_chunk = src_image->FindChunkByName(tgt_chunk.GetEntryName());
+    ImageChunk* src_chunk = src_image->FindSourceChunk(tgt_chunk);
     if (src_chunk == nullptr) {
       tgt_chunk.ChangeDeflateChunkToNormal();
     } else if (tgt_chunk == *src_chunk) {
@@ -914,7 +1343,8 @@ bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage*
   }
 
   // For zips, we only need merge normal chunks for the target:  deflated chunks are matched via
-  // filename, and normal chunks are patched using the entire source file as the source.
+  // filename (or content), and normal chunks are patched using the entire source file as the
+  // source.
   if (tgt_image->limit_ == 0) {
     tgt_image->MergeAdjacentNormalChunks();
     tgt_image->DumpChunks();
@@ -923,20 +1353,154 @@ bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage*
   return true;
 }
 
+// Estimates the patch and the inflated data of |tgt| in a split piece, diffed against |src|
+// (nullptr if it has none) as a pair of deflate chunks if |deflate| is true.
+static SplitCost EstimateSplitChunkCost(const ImageChunk& tgt, const ImageChunk* src, bool deflate,
+                                        const SplitCostModel& cost_model) {
+  SplitCost cost;
+  if (src == nullptr) {
+    cost.patch_size = tgt.GetRawDataLength();
+  } else if (deflate) {
+    cost.patch_size = tgt.DataLengthForPatch() * cost_model.diff_patch_percent / 100;
+    cost.inflate_size = src->DataLengthForPatch() + tgt.DataLengthForPatch();
+  } else if (src->GetRawDataLength() != tgt.GetRawDataLength() ||
+             memcmp(src->GetRawData(), tgt.GetRawData(), tgt.GetRawDataLength()) != 0) {
+    cost.patch_size = tgt.GetRawDataLength() * cost_model.diff_patch_percent / 100;
+  }
+  return cost;
+}
+
+// Adds the patch and the inflated data of a chunk to the cost of its split piece.
+static void AddSplitChunkCost(const SplitCost& chunk_cost, SplitCost* piece_cost) {
+  piece_cost->patch_size += chunk_cost.patch_size;
+  piece_cost->inflate_size = std::max(piece_cost->inflate_size, chunk_cost.inflate_size);
+}
+
+std::vector<size_t> ZipModeImage::PlanSplitPoints(const ZipModeImage& tgt_image,
+                                                  const ZipModeImage& src_image,
+                                                  const SplitCostModel& cost_model) {
+  size_t limit = tgt_image.limit_;
+
+  // The size of the whole blocks that |length| bytes at |offset| span.
+  auto block_aligned_size = [](size_t offset, size_t length) {
+    return ((offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE - offset / BLOCK_SIZE) * BLOCK_SIZE;
+  };
+
+  // The source and the estimated cost of each tgt chunk, as the first one of a piece (which is
+  // aligned into a normal chunk) and otherwise. The source ranges of the chunks are taken as
+  // disjoint, which they mostly are.
+  struct ChunkCost {
+    size_t src_length = 0;
+    SplitCost head;
+    SplitCost rest;
+  };
+  const auto& central_directory = src_image.cend() - 1;
+  std::vector<ChunkCost> chunk_costs;
+  for (auto tgt = tgt_image.cbegin(); tgt != tgt_image.cend(); tgt++) {
+    const ImageChunk* src = src_image.FindSourceChunk(*tgt, true);
+    // The central directory is reserved for the last piece, and can't be the source of a chunk.
+    if (src == &*central_directory) {
+      src = nullptr;
+    }
+    ChunkCost& cost = chunk_costs.emplace_back();
+    cost.head = EstimateSplitChunkCost(*tgt, src, false, cost_model);
+    cost.rest = EstimateSplitChunkCost(*tgt, src, src != nullptr && src->GetType() == CHUNK_DEFLATE,
+                                       cost_model);
+    if (src != nullptr) {
+      cost.src_length = src->GetRawDataLength();
+      cost.head.src_size = block_aligned_size(src->GetStartOffset(), cost.src_length);
+      cost.rest.src_size = cost.head.src_size;
+    }
+  }
+  // The central directory goes into the last piece, beyond the block limit.
+  size_t cd_size = block_aligned_size(central_directory->GetStartOffset(),
+                                      central_directory->DataLengthForPatch());
+  chunk_costs.back().head.src_size += cd_size;
+  chunk_costs.back().rest.src_size += cd_size;
+
+  struct Plan {
+    std::vector<size_t> split_points;
+    size_t peak = 0;
+    size_t patch_size = 0;
+  };
+  // Fills each piece up to the block limit, or until its peak would exceed |budget|.
+  auto plan_with_budget = [&](size_t budget) {
+    Plan plan;
+    SplitCost piece;
+    size_t piece_src_length = 0;
+    for (size_t i = 0; i < chunk_costs.size(); i++) {
+      const ChunkCost& cost = chunk_costs[i];
+      if (i > 0) {
+        SplitCost grown = piece;
+        grown.src_size += cost.rest.src_size;
+        AddSplitChunkCost(cost.rest, &grown);
+        // A piece can't be closed before it has any source.
+        if (piece.src_size == 0 ||
+            (piece_src_length + cost.src_length <= limit && grown.PeakMemory() <= budget)) {
+          piece = grown;
+          piece_src_length += cost.src_length;
+          continue;
+        }
+        plan.peak = std::max(plan.peak, piece.PeakMemory());
+        plan.patch_size += piece.patch_size;
+        plan.split_points.push_back(i);
+        piece = {};
+      }
+      piece.src_size = cost.head.src_size;
+      AddSplitChunkCost(cost.head, &piece);
+      piece_src_length = cost.src_length;
+    }
+    plan.peak = std::max(plan.peak, piece.PeakMemory());
+    plan.patch_size += piece.patch_size;
+    return plan;
+  };
+
+  // Look for the lowest budget that can be met with the estimated patch within the slack, over the
+  // pieces filled up to the block limit.
+  Plan best = plan_with_budget(std::numeric_limits<size_t>::max());
+  size_t max_patch_size = best.patch_size + best.patch_size * cost_model.patch_slack_percent / 100;
+  LOG(INFO) << "Pieces filled up to the block limit: " << best.split_points.size() + 1
+            << " pieces, predicted peak " << best.peak << ", estimated patch " << best.patch_size;
+  size_t low = 0;
+  size_t high = best.peak;
+  while (low < high) {
+    size_t budget = low + (high - low) / 2;
+    Plan plan = plan_with_budget(budget);
+    if (plan.peak > budget || plan.patch_size > max_patch_size) {
+      low = budget + 1;
+      continue;
+    }
+    best = std::move(plan);
+    high = budget;
+  }
+  LOG(INFO) << "Planned split: " << best.split_points.size() + 1 << " pieces, predicted peak "
+            << best.peak << ", estimated patch " << best.patch_size;
+  return best.split_points;
+}
+
 // For each target chunk, look for the corresponding source chunk by the zip_entry name. If
 // found, add the range of this chunk in the original source file to the block aligned source
-// ranges. Construct the split src & tgt image once the size of source range reaches limit.
+// ranges. Construct the split src & tgt image once the size of source range reaches limit, or at
+// the split points planned by the cost model.
 bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
                                               const ZipModeImage& src_image,
                                               std::vector<ZipModeImage>* split_tgt_images,
                                               std::vector<ZipModeImage>* split_src_images,
-                                              std::vector<SortedRangeSet>* split_src_ranges) {
+                                              std::vector<SortedRangeSet>* split_src_ranges,
+                                              const SplitCostModel& cost_model,
+                                              std::vector<SplitCost>* split_costs) {
   CHECK_EQ(tgt_image.limit_, src_image.limit_);
   size_t limit = tgt_image.limit_;
 
   src_image.DumpChunks();
   LOG(INFO) << "Splitting " << tgt_image.NumOfChunks() << " tgt chunks...";
 
+  std::vector<size_t> split_points;
+  if (cost_model.minimize_peak) {
+    split_points = PlanSplitPoints(tgt_image, src_image, cost_model);
+  }
+  auto next_split_point = split_points.cbegin();
+
   SortedRangeSet used_src_ranges;  // ranges used for previous split source images.
 
   // Reserve the central directory in advance for the last split image.
@@ -948,11 +1512,42 @@ bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
   SortedRangeSet src_ranges;
   std::vector<ImageChunk> split_src_chunks;
   std::vector<ImageChunk> split_tgt_chunks;
+  std::vector<SplitCost> costs;
+  SplitCost piece_cost;
+  auto add_split_image = [&]() {
+    bool added_image = ZipModeImage::AddSplitImageFromChunkList(
+        tgt_image, src_image, src_ranges, split_tgt_chunks, split_src_chunks, split_tgt_images,
+        split_src_images);
+
+    split_tgt_chunks.clear();
+    split_src_chunks.clear();
+    // No need to update the split_src_ranges if we don't update the split source images.
+    if (added_image) {
+      piece_cost.src_size = src_ranges.blocks() * BLOCK_SIZE;
+      costs.push_back(piece_cost);
+      used_src_ranges.Insert(src_ranges);
+      split_src_ranges->push_back(std::move(src_ranges));
+    }
+    src_ranges = {};
+    piece_cost = {};
+  };
+
   for (auto tgt = tgt_image.cbegin(); tgt != tgt_image.cend(); tgt++) {
-    const ImageChunk* src = src_image.FindChunkByName(tgt->GetEntryName(), true);
+    size_t index = tgt - tgt_image.cbegin();
+    if (next_split_point != split_points.cend() && *next_split_point == index) {
+      next_split_point++;
+      if (src_ranges.blocks() > 0) {
+        add_split_image();
+      }
+    }
+    // The first chunk of a piece is aligned into a normal chunk.
+    bool head = split_tgt_chunks.empty();
+
+    const ImageChunk* src = src_image.FindSourceChunk(*tgt, true);
     if (src == nullptr) {
       split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), &tgt_image.file_content_,
                                     tgt->GetRawDataLength());
+      AddSplitChunkCost(EstimateSplitChunkCost(*tgt, nullptr, false, cost_model), &piece_cost);
       continue;
     }
 
@@ -967,11 +1562,13 @@ bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
     if (!RemoveUsedBlocks(&src_offset, &src_length, used_src_ranges)) {
       split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), &tgt_image.file_content_,
                                     tgt->GetRawDataLength());
+      AddSplitChunkCost(EstimateSplitChunkCost(*tgt, nullptr, false, cost_model), &piece_cost);
     } else if (src_ranges.blocks() * BLOCK_SIZE + src_length <= limit) {
       src_ranges.Insert(src_offset, src_length);
 
       // Add the deflate source chunk if it hasn't been aligned.
-      if (src->GetType() == CHUNK_DEFLATE && src_length == src->GetRawDataLength()) {
+      bool deflate = src->GetType() == CHUNK_DEFLATE && src_length == src->GetRawDataLength();
+      if (deflate) {
         split_src_chunks.push_back(*src);
         split_tgt_chunks.push_back(*tgt);
       } else {
@@ -979,19 +1576,10 @@ bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
         split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), &tgt_image.file_content_,
                                       tgt->GetRawDataLength());
       }
+      AddSplitChunkCost(EstimateSplitChunkCost(*tgt, src, deflate && !head, cost_model),
+                        &piece_cost);
     } else {
-      bool added_image = ZipModeImage::AddSplitImageFromChunkList(
-          tgt_image, src_image, src_ranges, split_tgt_chunks, split_src_chunks, split_tgt_images,
-          split_src_images);
-
-      split_tgt_chunks.clear();
-      split_src_chunks.clear();
-      // No need to update the split_src_ranges if we don't update the split source images.
-      if (added_image) {
-        used_src_ranges.Insert(src_ranges);
-        split_src_ranges->push_back(std::move(src_ranges));
-      }
-      src_ranges = {};
+      add_split_image();
 
       // We don't have enough space for the current chunk; start a new split image and handle
       // this chunk there.
@@ -1001,16 +1589,20 @@ bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
 
   // TODO Trim it in case the CD exceeds limit too much.
   src_ranges.Insert(central_directory->GetStartOffset(), central_directory->DataLengthForPatch());
-  bool added_image = ZipModeImage::AddSplitImageFromChunkList(tgt_image, src_image, src_ranges,
-                                                              split_tgt_chunks, split_src_chunks,
-                                                              split_tgt_images, split_src_images);
-  if (added_image) {
-    split_src_ranges->push_back(std::move(src_ranges));
-  }
+  add_split_image();
 
   ValidateSplitImages(*split_tgt_images, *split_src_images, *split_src_ranges,
                       tgt_image.file_content_.size());
 
+  for (size_t i = 0; i < costs.size(); i++) {
+    LOG(INFO) << "Split piece " << i << ": " << costs[i].src_size << " bytes of source, ~"
+              << costs[i].patch_size << " bytes of patch, " << costs[i].inflate_size
+              << " bytes to inflate; predicted peak " << costs[i].PeakMemory();
+  }
+  if (split_costs != nullptr) {
+    *split_costs = std::move(costs);
+  }
+
   return true;
 }
 
@@ -1060,7 +1652,7 @@ bool ZipModeImage::AddSplitImageFromChunkList(const ZipModeImage& tgt_image,
                                     tail_block_length);
   }
 
-  ZipModeImage split_tgt_image(false);
+  ZipModeImage split_tgt_image(false, 0, tgt_image.low_memory_);
   split_tgt_image.Initialize(aligned_tgt_chunks, {});
   split_tgt_image.MergeAdjacentNormalChunks();
 
@@ -1077,7 +1669,7 @@ bool ZipModeImage::AddSplitImageFromChunkList(const ZipModeImage& tgt_image,
   // bsdiff since split_src_content.data() == nullptr.
   CHECK(!split_src_content.empty());
 
-  ZipModeImage split_src_image(true);
+  ZipModeImage split_src_image(true, 0, src_image.low_memory_);
   split_src_image.Initialize(split_src_chunks, split_src_content);
 
   split_tgt_images->push_back(std::move(split_tgt_image));
@@ -1123,53 +1715,71 @@ void ZipModeImage::ValidateSplitImages(const std::vector<ZipModeImage>& split_tg
 
 bool ZipModeImage::GeneratePatchesInternal(const ZipModeImage& tgt_image,
                                            const ZipModeImage& src_image,
-                                           std::vector<PatchChunk>* patch_chunks) {
+                                           std::vector<PatchChunk>* patch_chunks,
+                                           size_t num_threads,
+                                           const SuffixArrayCache* sa_cache, PatchSpool* spool) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
   patch_chunks->clear();
 
-  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+  // Pair up the target chunks with their source chunks first, then make the patches in parallel.
+  const ImageChunk pseudo_source = src_image.PseudoSource();
+  std::vector<PatchTask> tasks;
   for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
     const auto& tgt_chunk = tgt_image[i];
-
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks->emplace_back(tgt_chunk);
       continue;
     }
 
-    const ImageChunk* src_chunk = (tgt_chunk.GetType() != CHUNK_DEFLATE)
-                                      ? nullptr
-                                      : src_image.FindChunkByName(tgt_chunk.GetEntryName());
+    const ImageChunk* src_chunk =
+        (tgt_chunk.GetType() != CHUNK_DEFLATE) ? nullptr : src_image.FindSourceChunk(tgt_chunk);
+    tasks.push_back(PatchTask{ i, &tgt_chunk, src_chunk == nullptr ? &pseudo_source : src_chunk,
+                               src_chunk == nullptr, {} });
+  }
 
-    const auto& src_ref = (src_chunk == nullptr) ? src_image.PseudoSource() : *src_chunk;
-    bsdiff::SuffixArrayIndexInterface** bsdiff_cache_ptr =
-        (src_chunk == nullptr) ? &bsdiff_cache : nullptr;
+  size_t failed_task;
+  if (!MakePatches(&tasks, num_threads, sa_cache, spool, &failed_task)) {
+    LOG(ERROR) << "Failed to generate patch, name: " << tasks[failed_task].tgt->GetEntryName();
+    return false;
+  }
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &patch_data, bsdiff_cache_ptr)) {
-      LOG(ERROR) << "Failed to generate patch, name: " << tgt_chunk.GetEntryName();
-      return false;
+  // Assemble the patch chunks in order.
+  auto task = tasks.begin();
+  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+    const auto& tgt_chunk = tgt_image[i];
+    if (task == tasks.end() || task->tgt_index != i) {
+      patch_chunks->emplace_back(tgt_chunk);
+      continue;
     }
 
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << task->patch.size << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+    if (PatchChunk::RawDataIsSmaller(tgt_chunk, task->patch.size)) {
       patch_chunks->emplace_back(tgt_chunk);
+    } else if (spool != nullptr) {
+      patch_chunks->emplace_back(tgt_chunk, *task->src, spool, task->patch.spool_offset,
+                                 task->patch.size);
     } else {
-      patch_chunks->emplace_back(tgt_chunk, src_ref, std::move(patch_data));
+      patch_chunks->emplace_back(tgt_chunk, *task->src, std::move(task->patch.data));
     }
+    task++;
   }
-  delete bsdiff_cache;
 
   CHECK_EQ(patch_chunks->size(), tgt_image.NumOfChunks());
   return true;
 }
 
 bool ZipModeImage::GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                   const std::string& patch_name) {
-  std::vector<PatchChunk> patch_chunks;
+                                   const std::string& patch_name, size_t num_threads,
+                                   const SuffixArrayCache* sa_cache) {
+  std::unique_ptr<PatchSpool> spool;
+  if (tgt_image.low_memory_ && !CreatePatchSpool(patch_name, &spool)) {
+    return false;
+  }
 
-  ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks);
+  std::vector<PatchChunk> patch_chunks;
+  ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks, num_threads, sa_cache,
+                                        spool.get());
 
   CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
 
@@ -1188,7 +1798,8 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
                                    const std::vector<SortedRangeSet>& split_src_ranges,
                                    const std::string& patch_name,
                                    const std::string& split_info_file,
-                                   const std::string& debug_dir) {
+                                   const std::string& debug_dir, size_t num_threads,
+                                   const SuffixArrayCache* sa_cache) {
   LOG(INFO) << "Constructing patches for " << split_tgt_images.size() << " split images...";
 
   android::base::unique_fd patch_fd(
@@ -1198,11 +1809,18 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
     return false;
   }
 
+  std::unique_ptr<PatchSpool> spool;
+  if (!split_tgt_images.empty() && split_tgt_images[0].low_memory_ &&
+      !CreatePatchSpool(patch_name, &spool)) {
+    return false;
+  }
+
   std::vector<std::string> split_info_list;
   for (size_t i = 0; i < split_tgt_images.size(); i++) {
     std::vector<PatchChunk> patch_chunks;
     if (!ZipModeImage::GeneratePatchesInternal(split_tgt_images[i], split_src_images[i],
-                                               &patch_chunks)) {
+                                               &patch_chunks, num_threads, sa_cache,
+                                               spool.get())) {
       LOG(ERROR) << "Failed to generate split patch";
       return false;
     }
@@ -1301,7 +1919,7 @@ bool ImageModeImage::Initialize(const std::string& filename) {
       strm.zfree = Z_NULL;
       strm.opaque = Z_NULL;
       strm.avail_in = sz - pos;
-      strm.next_in = file_content_.data() + pos;
+      strm.next_in = const_cast<uint8_t*>(file_content_.data() + pos);
 
       // -15 means we are decoding a 'raw' deflate stream; zlib will
       // not expect zlib headers.
@@ -1315,16 +1933,19 @@ bool ImageModeImage::Initialize(const std::string& filename) {
       std::vector<uint8_t> uncompressed_data(allocated);
       size_t uncompressed_len = 0, raw_data_len = 0;
       do {
-        strm.avail_out = allocated - uncompressed_len;
-        strm.next_out = uncompressed_data.data() + uncompressed_len;
+        // In the low-memory mode, the data only needs to be counted here; it's inflated again when
+        // it's needed.
+        size_t out_pos = low_memory_ ? 0 : uncompressed_len;
+        strm.avail_out = allocated - out_pos;
+        strm.next_out = uncompressed_data.data() + out_pos;
         ret = inflate(&strm, Z_NO_FLUSH);
         if (ret < 0) {
           LOG(WARNING) << "Inflate failed [" << strm.msg << "] at offset [" << chunk_offset
                        << "]; treating as a normal chunk";
           break;
         }
-        uncompressed_len = allocated - strm.avail_out;
-        if (strm.avail_out == 0) {
+        uncompressed_len += allocated - out_pos - strm.avail_out;
+        if (!low_memory_ && strm.avail_out == 0) {
           allocated *= 2;
           uncompressed_data.resize(allocated);
         }
@@ -1352,8 +1973,12 @@ bool ImageModeImage::Initialize(const std::string& filename) {
       }
 
       ImageChunk body(CHUNK_DEFLATE, pos, &file_content_, raw_data_len);
-      uncompressed_data.resize(uncompressed_len);
-      body.SetUncompressedData(std::move(uncompressed_data));
+      if (low_memory_) {
+        body.SetUncompressedLength(uncompressed_len);
+      } else {
+        uncompressed_data.resize(uncompressed_len);
+        body.SetUncompressedData(std::move(uncompressed_data));
+      }
       chunks_.push_back(std::move(body));
 
       pos += raw_data_len;
@@ -1456,33 +2081,49 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
 // result to |patch_name|.
 bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
                                      const ImageModeImage& src_image,
-                                     const std::string& patch_name) {
+                                     const std::string& patch_name, size_t num_threads,
+                                     const SuffixArrayCache* sa_cache) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
+  std::unique_ptr<PatchSpool> spool;
+  if (tgt_image.low_memory_ && !CreatePatchSpool(patch_name, &spool)) {
+    return false;
+  }
+
+  std::vector<PatchTask> tasks;
+  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+    if (!PatchChunk::RawDataIsSmaller(tgt_image[i], 0)) {
+      tasks.push_back(PatchTask{ i, &tgt_image[i], &src_image[i], false, {} });
+    }
+  }
+
+  size_t failed_task;
+  if (!MakePatches(&tasks, num_threads, sa_cache, spool.get(), &failed_task)) {
+    LOG(ERROR) << "Failed to generate patch for target chunk " << tasks[failed_task].tgt_index;
+    return false;
+  }
+
   std::vector<PatchChunk> patch_chunks;
   patch_chunks.reserve(tgt_image.NumOfChunks());
-
+  auto task = tasks.begin();
   for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
     const auto& tgt_chunk = tgt_image[i];
-    const auto& src_chunk = src_image[i];
-
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
+    if (task == tasks.end() || task->tgt_index != i) {
       patch_chunks.emplace_back(tgt_chunk);
       continue;
     }
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_chunk, &patch_data, nullptr)) {
-      LOG(ERROR) << "Failed to generate patch for target chunk " << i;
-      return false;
-    }
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << task->patch.size << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+    if (PatchChunk::RawDataIsSmaller(tgt_chunk, task->patch.size)) {
       patch_chunks.emplace_back(tgt_chunk);
+    } else if (spool != nullptr) {
+      patch_chunks.emplace_back(tgt_chunk, src_image[i], spool.get(), task->patch.spool_offset,
+                                task->patch.size);
     } else {
-      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patch_data));
+      patch_chunks.emplace_back(tgt_chunk, src_image[i], std::move(task->patch.data));
     }
+    task++;
   }
 
   CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
@@ -1503,7 +2144,11 @@ int imgdiff(int argc, const char** argv) {
   std::vector<uint8_t> bonus_data;
   size_t blocks_limit = 0;
   std::string split_info_file;
+  SplitCostModel split_cost_model;
   std::string debug_dir;
+  size_t num_threads = 1;
+  std::string sa_cache_dir;
+  bool low_memory = false;
 
   int opt;
   int option_index;
@@ -1545,8 +2190,22 @@ int imgdiff(int argc, const char** argv) {
           return 1;
         } else if (name == "split-info") {
           split_info_file = optarg;
+        } else if (name == "split-patch-slack") {
+          if (!android::base::ParseUint(optarg, &split_cost_model.patch_slack_percent)) {
+            LOG(ERROR) << "Failed to parse split-patch-slack: " << optarg;
+            return 1;
+          }
+          split_cost_model.minimize_peak = true;
         } else if (name == "debug-dir") {
           debug_dir = optarg;
+        } else if (name == "num-threads" &&
+                   (!android::base::ParseUint(optarg, &num_threads) || num_threads == 0)) {
+          LOG(ERROR) << "Failed to parse num_threads: " << optarg;
+          return 1;
+        } else if (name == "sa-cache-dir") {
+          sa_cache_dir = optarg;
+        } else if (name == "low-memory") {
+          low_memory = true;
         }
         break;
       }
@@ -1571,14 +2230,32 @@ int imgdiff(int argc, const char** argv) {
            "                    patches together and output them into <patch-file>.\n"
            "  --split-info,     Output the split information (patch_size, tgt_size, src_ranges);\n"
            "                    zip mode with block-limit only.\n"
+           "  --split-patch-slack, Pick the split points to lower the peak memory of applying\n"
+           "                    the pieces, while keeping the estimated patch within the given\n"
+           "                    percentage over the pieces filled up to the block limit.\n"
            "  --debug-dir,      Debug directory to put the split srcs and patches, zip mode only.\n"
+           "  --num-threads,    The number of threads that compute the chunk patches, and sort\n"
+           "                    the suffix arrays of the large sources (default 1).\n"
+           "  --sa-cache-dir,   Directory to keep the source suffix arrays in, to be reused when\n"
+           "                    diffing against the same source again.\n"
+           "  --low-memory,     Map the inputs, inflate the chunks only while diffing them, and\n"
+           "                    keep the patches in a temporary file next to <patch-file>.\n"
            "  -v, --verbose,    Enable verbose logging.";
     return 2;
   }
 
+  std::unique_ptr<SuffixArrayCache> sa_cache;
+  if (!sa_cache_dir.empty()) {
+    if (mkdir(sa_cache_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      PLOG(ERROR) << "Failed to create " << sa_cache_dir;
+      return 1;
+    }
+    sa_cache = std::make_unique<SuffixArrayCache>(sa_cache_dir);
+  }
+
   if (zip_mode) {
-    ZipModeImage src_image(true, blocks_limit * BLOCK_SIZE);
-    ZipModeImage tgt_image(false, blocks_limit * BLOCK_SIZE);
+    ZipModeImage src_image(true, blocks_limit * BLOCK_SIZE, low_memory);
+    ZipModeImage tgt_image(false, blocks_limit * BLOCK_SIZE, low_memory);
 
     if (!src_image.Initialize(argv[optind])) {
       return 1;
@@ -1603,19 +2280,22 @@ int imgdiff(int argc, const char** argv) {
       std::vector<ZipModeImage> split_src_images;
       std::vector<SortedRangeSet> split_src_ranges;
       ZipModeImage::SplitZipModeImageWithLimit(tgt_image, src_image, &split_tgt_images,
-                                               &split_src_images, &split_src_ranges);
+                                               &split_src_images, &split_src_ranges,
+                                               split_cost_model);
 
       if (!ZipModeImage::GeneratePatches(split_tgt_images, split_src_images, split_src_ranges,
-                                         argv[optind + 2], split_info_file, debug_dir)) {
+                                         argv[optind + 2], split_info_file, debug_dir,
+                                         num_threads, sa_cache.get())) {
         return 1;
       }
 
-    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2],
+                                              num_threads, sa_cache.get())) {
       return 1;
     }
   } else {
-    ImageModeImage src_image(true);
-    ImageModeImage tgt_image(false);
+    ImageModeImage src_image(true, low_memory);
+    ImageModeImage tgt_image(false, low_memory);
 
     if (!src_image.Initialize(argv[optind])) {
       return 1;
@@ -1632,7 +2312,8 @@ int imgdiff(int argc, const char** argv) {
       return 1;
     }
 
-    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2], num_threads,
+                                         sa_cache.get())) {
       return 1;
     }
   }
@@ -26,10 +26,15 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/memory.h>
 #include <applypatch/applypatch.h>
@@ -48,11 +53,50 @@ static inline int32_t Read4(const void *address) {
   return android::base::get_unaligned<int32_t>(address);
 }
 
+// The size of the buffer that the deflate chunks are recompressed into, for sinks that don't lend
+// their own memory.
+static constexpr size_t kDeflateOutputSize = 32768;
+
+// Where the recompressed output of the deflate chunks goes: into the memory lent by a ZeroCopySink
+// if there's one, or otherwise into a buffer that's reused for all the chunks and then passed to
+// the SinkFn.
+class DeflateOutput {
+ public:
+  DeflateOutput(const SinkFn& sink, ZeroCopySink* zero_copy_sink)
+      : sink_(sink), zero_copy_sink_(zero_copy_sink) {}
+
+  // Returns the memory for the next piece of output and sets |size| to its size, or returns nullptr
+  // on error.
+  uint8_t* Next(size_t* size) {
+    if (zero_copy_sink_ != nullptr) {
+      return zero_copy_sink_->GetBuffer(size);
+    }
+    if (buffer_.empty()) {
+      buffer_.resize(kDeflateOutputSize);
+    }
+    *size = buffer_.size();
+    return buffer_.data();
+  }
+
+  // Outputs the first |size| bytes of the memory returned by the last Next() call.
+  bool Emit(size_t size) {
+    if (zero_copy_sink_ != nullptr) {
+      return zero_copy_sink_->Commit(size);
+    }
+    return sink_(buffer_.data(), size) == size;
+  }
+
+ private:
+  const SinkFn& sink_;
+  ZeroCopySink* zero_copy_sink_;
+  std::vector<uint8_t> buffer_;
+};
+
 // This function is a wrapper of ApplyBSDiffPatch(). It has a custom sink function to deflate the
-// patched data and stream the deflated data to output.
+// patched data and stream the deflated data to |output|.
 static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_len,
                                             const Value& patch, size_t patch_offset,
-                                            const char* deflate_header, SinkFn sink) {
+                                            const char* deflate_header, DeflateOutput* output) {
   size_t expected_target_length = static_cast<size_t>(Read8(deflate_header + 32));
   CHECK_GT(expected_target_length, static_cast<size_t>(0));
   int level = Read4(deflate_header + 40);
@@ -74,19 +118,23 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   }
 
   // Define a custom sink wrapper that feeds to bspatch. It deflates the available patch data on
-  // the fly and outputs the compressed data to the given sink.
+  // the fly and outputs the compressed data to the given output.
   size_t actual_target_length = 0;
   size_t total_written = 0;
-  static constexpr size_t buffer_size = 32768;
   auto compression_sink = [&strm, &actual_target_length, &expected_target_length, &total_written,
-                           &ret, &sink](const uint8_t* data, size_t len) -> size_t {
+                           &ret, output](const uint8_t* data, size_t len) -> size_t {
     // The input patch length for an update never exceeds INT_MAX.
     strm.avail_in = len;
     strm.next_in = data;
     do {
-      std::vector<uint8_t> buffer(buffer_size);
+      size_t buffer_size;
+      uint8_t* buffer = output->Next(&buffer_size);
+      if (buffer == nullptr) {
+        LOG(ERROR) << "Failed to get the output buffer";
+        return 0;
+      }
       strm.avail_out = buffer_size;
-      strm.next_out = buffer.data();
+      strm.next_out = buffer;
       if (actual_target_length + len < expected_target_length) {
         ret = deflate(&strm, Z_NO_FLUSH);
       } else {
@@ -100,7 +148,7 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
 
       size_t have = buffer_size - strm.avail_out;
       total_written += have;
-      if (sink(buffer.data(), have) != have) {
+      if (!output->Emit(have)) {
         LOG(ERROR) << "Failed to write " << have << " compressed bytes to output.";
         return 0;
       }
@@ -132,162 +180,474 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   return true;
 }
 
-int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
-                    size_t patch_size, SinkFn sink) {
-  Value patch(Value::Type::BLOB,
-              std::string(reinterpret_cast<const char*>(patch_data), patch_size));
-  return ApplyImagePatch(old_data, old_size, patch, sink, nullptr);
+bool MemorySourceReader::Read(size_t offset, uint8_t* buffer, size_t len) const {
+  if (offset > size_ || len > size_ - offset) {
+    LOG(ERROR) << "Failed to read " << len << " bytes at " << offset << " from a source of "
+               << size_ << " bytes";
+    return false;
+  }
+  memcpy(buffer, data_ + offset, len);
+  return true;
 }
 
-int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
-                    const Value* bonus_data) {
-  if (patch.data.size() < 12) {
+bool FdSourceReader::Read(size_t offset, uint8_t* buffer, size_t len) const {
+  if (offset > size_ || len > size_ - offset) {
+    LOG(ERROR) << "Failed to read " << len << " bytes at " << offset << " from a source of "
+               << size_ << " bytes";
+    return false;
+  }
+  if (!android::base::ReadFullyAtOffset(fd_, buffer, len, offset)) {
+    PLOG(ERROR) << "Failed to read " << len << " bytes at " << offset;
+    return false;
+  }
+  return true;
+}
+
+// The amount of compressed source data that's read at a time when inflating a deflate chunk.
+static constexpr size_t kInflateInputSize = 256 * 1024;
+
+// Buffers that are reused across the deflate chunks of a patch, so that each chunk doesn't allocate
+// (and zero-fill) a new buffer for its inflated source. The buffers only ever grow to the size of
+// the largest chunk.
+class InflateBufferPool {
+ public:
+  // Returns a buffer of at least |size| bytes, with unspecified contents.
+  uint8_t* Expanded(size_t size) {
+    if (size > expanded_size_) {
+      expanded_.reset(new uint8_t[size]);
+      expanded_size_ = size;
+    }
+    return expanded_.get();
+  }
+
+  // Returns a buffer of kInflateInputSize bytes for reading the compressed data.
+  uint8_t* Input() {
+    if (!input_) {
+      input_.reset(new uint8_t[kInflateInputSize]);
+    }
+    return input_.get();
+  }
+
+ private:
+  std::unique_ptr<uint8_t[]> expanded_;
+  size_t expanded_size_{ 0 };
+  std::unique_ptr<uint8_t[]> input_;
+};
+
+std::string InflateCache::Key(const uint8_t* data, size_t len, size_t expanded_len) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(data, len, digest);
+  return std::string(reinterpret_cast<const char*>(digest), sizeof(digest)) + ":" +
+         std::to_string(expanded_len);
+}
+
+std::shared_ptr<const std::vector<uint8_t>> InflateCache::Get(const std::string& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    misses_++;
+    return nullptr;
+  }
+  entries_.splice(entries_.begin(), entries_, it->second);
+  hits_++;
+  return it->second->data;
+}
+
+void InflateCache::Put(const std::string& key, const uint8_t* data, size_t size) {
+  if (size > capacity_) {
+    return;
+  }
+  // Copy the data before taking the lock; the workers of a segmented patch share the cache.
+  auto copy = std::make_shared<const std::vector<uint8_t>>(data, data + size);
+  std::lock_guard<std::mutex> lock(mutex_);
+  // The cache may have shrunk meanwhile.
+  if (index_.find(key) != index_.end() || size > capacity_) {
+    return;
+  }
+  entries_.push_front(Entry{ key, std::move(copy) });
+  index_.emplace(key, entries_.begin());
+  used_ += size;
+  EvictToCapacity();
+}
+
+void InflateCache::EvictToCapacity() {
+  while (used_ > capacity_) {
+    used_ -= entries_.back().data->size();
+    index_.erase(entries_.back().key);
+    entries_.pop_back();
+  }
+}
+
+size_t InflateCache::Shrink(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t shrunk = std::min<size_t>(bytes, capacity_);
+  capacity_ -= shrunk;
+  EvictToCapacity();
+  return shrunk;
+}
+
+size_t InflateCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return used_;
+}
+
+size_t InflateCache::hits() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return hits_;
+}
+
+size_t InflateCache::misses() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return misses_;
+}
+
+// Inflates the deflate chunk at (src_start, src_len) of |source| into |out|. The inflated data must
+// fill |out_len| bytes exactly, except for the trailing |bonus_size| bytes. Unless the source is in
+// memory, the compressed data is read in pieces of kInflateInputSize bytes.
+static bool InflateSource(const PatchSourceReader& source, size_t src_start, size_t src_len,
+                          uint8_t* out, size_t out_len, size_t bonus_size, InflateBufferPool* pool) {
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = 0;
+  strm.next_in = nullptr;
+  strm.avail_out = out_len;
+  strm.next_out = out;
+
+  int ret = inflateInit2(&strm, -15);
+  if (ret != Z_OK) {
+    printf("failed to init source inflation: %d\n", ret);
+    return false;
+  }
+
+  size_t offset = 0;
+  while (ret != Z_STREAM_END) {
+    if (strm.avail_in == 0) {
+      if (offset == src_len) {
+        break;
+      }
+      if (source.data() != nullptr) {
+        strm.next_in = source.data() + src_start;
+        strm.avail_in = src_len;
+        offset = src_len;
+      } else {
+        size_t len = std::min(kInflateInputSize, src_len - offset);
+        if (!source.Read(src_start + offset, pool->Input(), len)) {
+          inflateEnd(&strm);
+          return false;
+        }
+        strm.next_in = pool->Input();
+        strm.avail_in = len;
+        offset += len;
+      }
+    }
+
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END) {
+      break;
+    }
+  }
+  inflateEnd(&strm);
+
+  if (ret != Z_STREAM_END) {
+    printf("source inflation returned %d\n", ret);
+    return false;
+  }
+  // We should have filled the output buffer exactly, except for the bonus_size.
+  if (strm.avail_out != bonus_size) {
+    printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
+    return false;
+  }
+  return true;
+}
+
+// A chunk of an imgdiff patch, with its type and the type-specific part of its header, which has
+// been checked to be within the patch.
+struct ImagePatchChunk {
+  int type;
+  const char* header;
+};
+
+// Parses the chunk headers of the patch. Returns false if the patch is malformed.
+static bool ParseImagePatch(const Value& patch, std::vector<ImagePatchChunk>* chunks) {
+  if (patch.data().size() < 12) {
     printf("patch too short to contain header\n");
-    return -1;
+    return false;
   }
 
   // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW. (IMGDIFF1, which is no longer
   // supported, used CHUNK_NORMAL and CHUNK_GZIP.)
-  const char* const patch_header = patch.data.data();
+  const char* const patch_header = patch.data().data();
   if (memcmp(patch_header, "IMGDIFF2", 8) != 0) {
     printf("corrupt patch file header (magic number)\n");
-    return -1;
+    return false;
   }
 
   int num_chunks = Read4(patch_header + 8);
   size_t pos = 12;
   for (int i = 0; i < num_chunks; ++i) {
     // each chunk's header record starts with 4 bytes.
-    if (pos + 4 > patch.data.size()) {
+    if (pos + 4 > patch.data().size()) {
       printf("failed to read chunk %d record\n", i);
-      return -1;
+      return false;
     }
     int type = Read4(patch_header + pos);
     pos += 4;
+    chunks->push_back(ImagePatchChunk{ type, patch_header + pos });
 
     if (type == CHUNK_NORMAL) {
-      const char* normal_header = patch_header + pos;
       pos += 24;
-      if (pos > patch.data.size()) {
+      if (pos > patch.data().size()) {
         printf("failed to read chunk %d normal header data\n", i);
-        return -1;
-      }
-
-      size_t src_start = static_cast<size_t>(Read8(normal_header));
-      size_t src_len = static_cast<size_t>(Read8(normal_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(normal_header + 16));
-
-      if (src_start + src_len > old_size) {
-        printf("source data too short\n");
-        return -1;
+        return false;
       }
-      if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink) != 0) {
-        printf("Failed to apply bsdiff patch.\n");
-        return -1;
-      }
-
-      LOG(DEBUG) << "Processed chunk type normal";
     } else if (type == CHUNK_RAW) {
       const char* raw_header = patch_header + pos;
       pos += 4;
-      if (pos > patch.data.size()) {
+      if (pos > patch.data().size()) {
         printf("failed to read chunk %d raw header data\n", i);
-        return -1;
+        return false;
       }
 
       size_t data_len = static_cast<size_t>(Read4(raw_header));
-
-      if (pos + data_len > patch.data.size()) {
+      if (pos + data_len > patch.data().size()) {
         printf("failed to read chunk %d raw data\n", i);
-        return -1;
-      }
-      if (sink(reinterpret_cast<const unsigned char*>(patch_header + pos), data_len) != data_len) {
-        printf("failed to write chunk %d raw data\n", i);
-        return -1;
+        return false;
       }
       pos += data_len;
-
-      LOG(DEBUG) << "Processed chunk type raw";
     } else if (type == CHUNK_DEFLATE) {
       // deflate chunks have an additional 60 bytes in their chunk header.
-      const char* deflate_header = patch_header + pos;
       pos += 60;
-      if (pos > patch.data.size()) {
+      if (pos > patch.data().size()) {
         printf("failed to read chunk %d deflate header data\n", i);
-        return -1;
+        return false;
       }
+    } else {
+      printf("patch chunk %d is unknown type %d\n", i, type);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Applies the chunk |i| of the patch, writing the output of the deflate chunks to |output| and that
+// of the others to |sink|. The inflated source of a deflate chunk is taken from, or kept in,
+// |inflate_cache| if given and the source is in memory.
+static bool ApplyImagePatchChunk(const PatchSourceReader& source, const Value& patch,
+                                 const ImagePatchChunk& chunk, int i, const SinkFn& sink,
+                                 const Value* bonus_data, InflateBufferPool* pool,
+                                 DeflateOutput* output, InflateCache* inflate_cache) {
+  if (chunk.type == CHUNK_NORMAL) {
+    const char* normal_header = chunk.header;
+    size_t src_start = static_cast<size_t>(Read8(normal_header));
+    size_t src_len = static_cast<size_t>(Read8(normal_header + 8));
+    size_t patch_offset = static_cast<size_t>(Read8(normal_header + 16));
+
+    if (src_start + src_len > source.size()) {
+      printf("source data too short\n");
+      return false;
+    }
+    if (ApplyBSDiffPatch(source, src_start, src_len, patch, patch_offset, sink) != 0) {
+      printf("Failed to apply bsdiff patch.\n");
+      return false;
+    }
+
+    LOG(DEBUG) << "Processed chunk type normal";
+  } else if (chunk.type == CHUNK_RAW) {
+    const char* raw_header = chunk.header;
+    size_t data_len = static_cast<size_t>(Read4(raw_header));
+    if (sink(reinterpret_cast<const unsigned char*>(raw_header + 4), data_len) != data_len) {
+      printf("failed to write chunk %d raw data\n", i);
+      return false;
+    }
+
+    LOG(DEBUG) << "Processed chunk type raw";
+  } else {
+    const char* deflate_header = chunk.header;
+    size_t src_start = static_cast<size_t>(Read8(deflate_header));
+    size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
+    size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
+    size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
+
+    if (src_start + src_len > source.size()) {
+      printf("source data too short\n");
+      return false;
+    }
 
-      size_t src_start = static_cast<size_t>(Read8(deflate_header));
-      size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
-      size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    // Note: expanded_len will include the bonus data size if the patch was constructed with
+    // bonus data. The deflation will come up 'bonus_size' bytes short; these must be appended
+    // from the bonus_data value.
+    size_t bonus_size = (i == 1 && bonus_data != nullptr) ? bonus_data->data().size() : 0;
+    if (bonus_size > expanded_len) {
+      printf("bonus data too long\n");
+      return false;
+    }
 
-      if (src_start + src_len > old_size) {
-        printf("source data too short\n");
-        return -1;
+    // The chunk with the bonus data isn't cached, as the key doesn't cover the bonus data.
+    std::string cache_key;
+    std::shared_ptr<const std::vector<uint8_t>> cached;
+    if (inflate_cache != nullptr && source.data() != nullptr && expanded_len != 0 &&
+        bonus_size == 0) {
+      cache_key = InflateCache::Key(source.data() + src_start, src_len, expanded_len);
+      cached = inflate_cache->Get(cache_key);
+    }
+
+    uint8_t* expanded = cached ? nullptr : pool->Expanded(expanded_len);
+    const uint8_t* expanded_source = cached ? cached->data() : expanded;
+
+    // inflate() doesn't like strm.next_out being a nullptr even with
+    // avail_out being zero (Z_STREAM_ERROR).
+    if (!cached && expanded_len != 0) {
+      if (!InflateSource(source, src_start, src_len, expanded, expanded_len, bonus_size, pool)) {
+        return false;
+      }
+
+      if (bonus_size) {
+        memcpy(expanded + (expanded_len - bonus_size), bonus_data->data().data(), bonus_size);
       }
+      if (!cache_key.empty()) {
+        inflate_cache->Put(cache_key, expanded, expanded_len);
+      }
+    }
+
+    if (!ApplyBSDiffPatchAndStreamOutput(expanded_source, expanded_len, patch, patch_offset,
+                                         deflate_header, output)) {
+      LOG(ERROR) << "Fail to apply streaming bspatch.";
+      return false;
+    }
 
-      // Decompress the source data; the chunk header tells us exactly
-      // how big we expect it to be when decompressed.
+    LOG(DEBUG) << "Processed chunk type deflate";
+  }
+  return true;
+}
 
-      // Note: expanded_len will include the bonus data size if the patch was constructed with
-      // bonus data. The deflation will come up 'bonus_size' bytes short; these must be appended
-      // from the bonus_data value.
-      size_t bonus_size = (i == 1 && bonus_data != nullptr) ? bonus_data->data.size() : 0;
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
+                    size_t patch_size, SinkFn sink) {
+  Value patch(std::string_view(reinterpret_cast<const char*>(patch_data), patch_size), nullptr);
+  return ApplyImagePatch(old_data, old_size, patch, sink, nullptr);
+}
 
-      std::vector<unsigned char> expanded_source(expanded_len);
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
+                    const Value* bonus_data) {
+  MemorySourceReader source(old_data, old_size);
+  return ApplyImagePatch(source, patch, sink, bonus_data);
+}
 
-      // inflate() doesn't like strm.next_out being a nullptr even with
-      // avail_out being zero (Z_STREAM_ERROR).
-      if (expanded_len != 0) {
-        z_stream strm;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        strm.avail_in = src_len;
-        strm.next_in = old_data + src_start;
-        strm.avail_out = expanded_len;
-        strm.next_out = expanded_source.data();
-
-        int ret = inflateInit2(&strm, -15);
-        if (ret != Z_OK) {
-          printf("failed to init source inflation: %d\n", ret);
-          return -1;
-        }
+int ApplyImagePatch(const PatchSourceReader& source, const Value& patch, SinkFn sink,
+                    const Value* bonus_data, ZeroCopySink* zero_copy_sink,
+                    InflateCache* inflate_cache) {
+  std::vector<ImagePatchChunk> chunks;
+  if (!ParseImagePatch(patch, &chunks)) {
+    return -1;
+  }
 
-        // Because we've provided enough room to accommodate the output
-        // data, we expect one call to inflate() to suffice.
-        ret = inflate(&strm, Z_SYNC_FLUSH);
-        if (ret != Z_STREAM_END) {
-          printf("source inflation returned %d\n", ret);
-          return -1;
-        }
-        // We should have filled the output buffer exactly, except
-        // for the bonus_size.
-        if (strm.avail_out != bonus_size) {
-          printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
-          return -1;
-        }
-        inflateEnd(&strm);
+  InflateBufferPool pool;
+  DeflateOutput output(sink, zero_copy_sink);
+  for (size_t i = 0; i < chunks.size(); i++) {
+    if (!ApplyImagePatchChunk(source, patch, chunks[i], i, sink, bonus_data, &pool, &output,
+                              inflate_cache)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int ApplyImagePatchInParallel(const unsigned char* old_data, size_t old_size, const Value& patch,
+                              SinkFn sink, const Value* bonus_data, size_t num_threads) {
+  std::vector<ImagePatchChunk> chunks;
+  if (!ParseImagePatch(patch, &chunks)) {
+    return -1;
+  }
+  num_threads = std::min(num_threads, chunks.size());
+  if (num_threads <= 1) {
+    return ApplyImagePatch(old_data, old_size, patch, sink, bonus_data);
+  }
 
-        if (bonus_size) {
-          memcpy(expanded_source.data() + (expanded_len - bonus_size), bonus_data->data.data(),
-                 bonus_size);
+  // The output of each chunk, once it's been patched.
+  struct ChunkOutput {
+    bool done{ false };
+    std::vector<uint8_t> data;
+  };
+  std::vector<ChunkOutput> outputs(chunks.size());
+
+  // The workers stay at most |window| chunks ahead of the output, which bounds the memory held by
+  // the patched chunks that haven't been written yet.
+  const size_t window = 2 * num_threads;
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t next = 0;
+  size_t emitted = 0;
+  bool failed = false;
+
+  MemorySourceReader source(old_data, old_size);
+  auto worker = [&]() {
+    InflateBufferPool pool;
+    while (true) {
+      size_t i;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return failed || next == chunks.size() || next < emitted + window; });
+        if (failed || next == chunks.size()) {
+          return;
         }
+        i = next++;
       }
 
-      if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), expanded_len, patch,
-                                           patch_offset, deflate_header, sink)) {
-        LOG(ERROR) << "Fail to apply streaming bspatch.";
-        return -1;
+      std::vector<uint8_t> data;
+      SinkFn chunk_sink = [&data](const unsigned char* buffer, size_t len) {
+        data.insert(data.end(), buffer, buffer + len);
+        return len;
+      };
+      DeflateOutput output(chunk_sink, nullptr);
+      bool success = ApplyImagePatchChunk(source, patch, chunks[i], i, chunk_sink, bonus_data,
+                                          &pool, &output, nullptr);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (success) {
+        outputs[i].data = std::move(data);
+        outputs[i].done = true;
+      } else {
+        failed = true;
       }
+      cv.notify_all();
+    }
+  };
 
-      LOG(DEBUG) << "Processed chunk type deflate";
-    } else {
-      printf("patch chunk %d is unknown type %d\n", i, type);
-      return -1;
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; i++) {
+    threads.emplace_back(worker);
+  }
+
+  // Write out the chunks in order as they complete.
+  for (size_t i = 0; i < chunks.size(); i++) {
+    std::vector<uint8_t> data;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return failed || outputs[i].done; });
+      if (failed) {
+        break;
+      }
+      data = std::move(outputs[i].data);
     }
+    if (sink(data.data(), data.size()) != data.size()) {
+      printf("failed to write chunk %zu output\n", i);
+      std::lock_guard<std::mutex> lock(mutex);
+      failed = true;
+      cv.notify_all();
+      break;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    emitted = i + 1;
+    cv.notify_all();
   }
 
-  return 0;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return failed ? -1 : 0;
 }
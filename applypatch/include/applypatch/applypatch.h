@@ -19,10 +19,14 @@
 
 #include <stdint.h>
 
+#include <atomic>
 #include <functional>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <ostream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <openssl/sha.h>
@@ -30,13 +34,138 @@
 // Forward declaration to avoid including "edify/expr.h" in the header.
 struct Value;
 
+// Forward declaration to avoid including "otautil/sysutil.h" in the header.
+class MemMapping;
+
 struct FileContents {
   uint8_t sha1[SHA_DIGEST_LENGTH];
   std::vector<unsigned char> data;
+  // If set, the contents are mapped read-only from the file instead of being copied into 'data',
+  // which is then empty.
+  std::shared_ptr<MemMapping> mapping;
+
+  // Returns the contents, whether they're mapped or held in 'data'.
+  const unsigned char* contents() const;
+  size_t size() const;
 };
 
 using SinkFn = std::function<size_t(const unsigned char*, size_t)>;
 
+// A sink that lends its own memory for the output, so that the streaming patchers can deflate the
+// patched data straight into it instead of going through an intermediate buffer. The sink decides
+// how much output it takes at a time.
+class ZeroCopySink {
+ public:
+  virtual ~ZeroCopySink() = default;
+
+  // Returns a buffer for the next piece of output and sets 'size' to its (non-zero) size, or
+  // returns nullptr on error.
+  virtual uint8_t* GetBuffer(size_t* size) = 0;
+
+  // Takes the first 'size' bytes of the buffer returned by the last GetBuffer() call as output.
+  // Returns false on error.
+  virtual bool Commit(size_t size) = 0;
+};
+
+// Reads the source data of a patch on demand, so that the source doesn't have to be loaded into
+// memory as a whole.
+class PatchSourceReader {
+ public:
+  virtual ~PatchSourceReader() = default;
+
+  // Returns the size of the source in bytes.
+  virtual size_t size() const = 0;
+
+  // Reads 'len' bytes at 'offset' into 'buffer'. Returns false on error.
+  virtual bool Read(size_t offset, uint8_t* buffer, size_t len) const = 0;
+
+  // Returns the source data if all of it is already in memory, or nullptr otherwise.
+  virtual const uint8_t* data() const {
+    return nullptr;
+  }
+};
+
+// A PatchSourceReader over a buffer in memory.
+class MemorySourceReader : public PatchSourceReader {
+ public:
+  MemorySourceReader(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  size_t size() const override {
+    return size_;
+  }
+  bool Read(size_t offset, uint8_t* buffer, size_t len) const override;
+  const uint8_t* data() const override {
+    return data_;
+  }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+};
+
+// A PatchSourceReader that reads the first 'size' bytes of the given fd (e.g. a block device) with
+// pread(2). It doesn't take the ownership of the fd.
+class FdSourceReader : public PatchSourceReader {
+ public:
+  FdSourceReader(int fd, size_t size) : fd_(fd), size_(size) {}
+
+  size_t size() const override {
+    return size_;
+  }
+  bool Read(size_t offset, uint8_t* buffer, size_t len) const override;
+
+ private:
+  int fd_;
+  size_t size_;
+};
+
+// A cache of the inflated source of the deflate chunks of imgdiff patches, for the patches that
+// share source chunks to inflate each of them once: e.g. the pieces of a large APK that imgdiff
+// splits into several commands, which all patch from the same source entries. A chunk is keyed by
+// the SHA-1 of its compressed data and its inflated size, so an entry holds wherever the chunk is
+// in the source of a later patch, and whatever has been written since. The least recently used
+// chunks are evicted to stay within 'capacity' bytes of inflated data. It's thread-safe.
+class InflateCache {
+ public:
+  explicit InflateCache(size_t capacity) : capacity_(capacity) {}
+
+  // Returns the key of the deflate chunk of 'len' bytes at 'data', inflated to 'expanded_len'.
+  static std::string Key(const uint8_t* data, size_t len, size_t expanded_len);
+
+  // Returns the inflated data of the chunk with 'key', or nullptr if it isn't cached.
+  std::shared_ptr<const std::vector<uint8_t>> Get(const std::string& key);
+
+  // Keeps a copy of the 'size' bytes at 'data' as the inflated data of the chunk with 'key',
+  // unless that's larger than the capacity.
+  void Put(const std::string& key, const uint8_t* data, size_t size);
+
+  // Lowers the capacity by 'bytes' (or to 0), evicting the least recently used chunks to fit.
+  // Returns how much the capacity was lowered by.
+  size_t Shrink(size_t bytes);
+
+  // Returns the inflated bytes in the cache.
+  size_t size() const;
+  size_t hits() const;
+  size_t misses() const;
+
+ private:
+  struct Entry {
+    std::string key;
+    std::shared_ptr<const std::vector<uint8_t>> data;
+  };
+
+  void EvictToCapacity();
+
+  std::atomic<size_t> capacity_;
+  mutable std::mutex mutex_;
+  // The entries from the most to the least recently used.
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  size_t used_{ 0 };
+  size_t hits_{ 0 };
+  size_t misses_{ 0 };
+};
+
 // applypatch.cpp
 
 int ShowLicenses();
@@ -79,6 +208,18 @@ std::ostream& operator<<(std::ostream& os, const Partition& partition);
 bool PatchPartition(const Partition& target, const Partition& source, const Value& patch,
                     const Value* bonus, bool backup_source);
 
+// Same as the above without a backup, but the source contents come from 'load_source', which is
+// only called if the target doesn't have the desired hash yet. It returns the contents of the
+// source partition, or nullptr if they can't be loaded, so that they can be shared by several
+// targets patched from the same source (see LoadPartitionContents()).
+bool PatchPartition(const Partition& target,
+                    const std::function<const FileContents*()>& load_source, const Value& patch,
+                    const Value* bonus);
+
+// Loads the contents of the given partition, mapped if possible, into 'file' if they have the
+// desired hash. It will NOT look for the backup on /cache.
+bool LoadPartitionContents(const Partition& partition, FileContents* file);
+
 // Returns whether the contents of the eMMC target or the cached file match the embedded hash.
 // It will look for the backup on /cache if the given partition doesn't match the checksum.
 bool PatchPartitionCheck(const Partition& target, const Partition& source);
@@ -96,6 +237,10 @@ bool FlashPartition(const Partition& target, const std::string& source_filename)
 // Reads a file into memory; stores the file contents and associated metadata in *file.
 bool LoadFileContents(const std::string& filename, FileContents* file);
 
+// Same as LoadFileContents(), but maps the file read-only instead of copying it, so only
+// 'file->contents()' is valid.
+bool MapFileContents(const std::string& filename, FileContents* file);
+
 // Saves the given FileContents object to the given filename.
 bool SaveFileContents(const std::string& filename, const FileContents* file);
 
@@ -109,6 +254,11 @@ void ShowBSDiffLicense();
 int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value& patch,
                      size_t patch_offset, SinkFn sink);
 
+// Same as above, but the source data is the range (src_start, src_len) of 'source', which is read
+// on demand unless it's already in memory.
+int ApplyBSDiffPatch(const PatchSourceReader& source, size_t src_start, size_t src_len,
+                     const Value& patch, size_t patch_offset, SinkFn sink);
+
 // imgpatch.cpp
 
 // Applies the imgdiff-patch given in 'patch' to the source data given by (old_data, old_size), with
@@ -117,6 +267,22 @@ int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
                     const Value* bonus_data);
 
+// Streaming version of the above. The source chunks are read from 'source' as they're patched, and
+// the buffers that the deflate chunks get inflated into are reused. The peak memory use is then
+// bounded by the largest inflated source chunk, rather than the size of the whole source. If
+// 'zero_copy_sink' is given, the recompressed output of the deflate chunks goes to it directly,
+// while the output of the other chunks still goes to 'sink'. If 'inflate_cache' is given, the
+// deflate chunks of a source in memory are taken from it, or kept in it once inflated.
+int ApplyImagePatch(const PatchSourceReader& source, const Value& patch, SinkFn sink,
+                    const Value* bonus_data, ZeroCopySink* zero_copy_sink = nullptr,
+                    InflateCache* inflate_cache = nullptr);
+
+// Same as the in-memory ApplyImagePatch(), but patches up to 'num_threads' chunks at a time. Each
+// chunk is patched into a buffer of its own, and the buffers are passed to 'sink' in order as they
+// complete, with at most 2 * 'num_threads' chunks held in memory.
+int ApplyImagePatchInParallel(const unsigned char* old_data, size_t old_size, const Value& patch,
+                              SinkFn sink, const Value* bonus_data, size_t num_threads);
+
 // freecache.cpp
 
 // Checks whether /cache partition has at least 'bytes'-byte free space. Returns true immediately
@@ -125,7 +291,9 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
 bool CheckAndFreeSpaceOnCache(size_t bytes);
 
 // Removes the files in |dirname| until we have at least |bytes_needed| bytes of free space on the
-// partition. |space_checker| should return the size of the free space, or -1 on error.
+// partition. |space_checker| should return the size of the free space, or -1 on error. The files
+// expected to free enough space are deleted together, with a single check of the free space after
+// them; the rest are only deleted one by one if that wasn't enough.
 bool RemoveFilesInDirectory(size_t bytes_needed, const std::string& dirname,
                             const std::function<int64_t(const std::string&)>& space_checker);
 #endif
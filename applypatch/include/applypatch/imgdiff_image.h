@@ -21,15 +21,54 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include <map>
+#include <memory>
+#include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include <android-base/mapped_file.h>
 #include <bsdiff/bsdiff.h>
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
 
 #include "imgdiff.h"
 #include "otautil/rangeset.h"
+#include "suffix_array_cache.h"
+
+// The contents of an input file: either read into memory, or (in the low-memory mode) mapped
+// read-only.
+class FileContent {
+ public:
+  FileContent() = default;
+  FileContent(std::vector<uint8_t> data) : data_(std::move(data)) {}
+
+  // Reads the file at |filename|, or maps it if |map| is true.
+  bool Load(const std::string& filename, bool map);
+
+  const uint8_t* data() const {
+    return mapped_ ? reinterpret_cast<const uint8_t*>(mapped_->data()) : data_.data();
+  }
+  size_t size() const {
+    return mapped_ ? mapped_->size() : data_.size();
+  }
+  const uint8_t& operator[](size_t i) const {
+    return data()[i];
+  }
+  const uint8_t* begin() const {
+    return data();
+  }
+  const uint8_t* end() const {
+    return data() + size();
+  }
+
+ private:
+  std::vector<uint8_t> data_;
+  std::shared_ptr<android::base::MappedFile> mapped_;
+};
+
+class PatchSpool;
 
 class ImageChunk {
  public:
@@ -40,6 +79,8 @@ class ImageChunk {
 
   ImageChunk(int type, size_t start, const std::vector<uint8_t>* file_content, size_t raw_data_len,
              std::string entry_name = {});
+  ImageChunk(int type, size_t start, const FileContent* file_content, size_t raw_data_len,
+             std::string entry_name = {});
 
   int GetType() const {
     return type_;
@@ -59,14 +100,32 @@ class ImageChunk {
     return compress_level_;
   }
 
+  // A zip entry's content is identified by the CRC-32 and length of its uncompressed data, as
+  // recorded in the central directory. Chunks that aren't a whole zip entry have no content key.
+  using ContentKey = std::pair<uint32_t, uint64_t>;
+  const std::optional<ContentKey>& GetContentKey() const {
+    return content_key_;
+  }
+  void SetContentKey(uint32_t crc32, uint64_t uncompressed_length) {
+    content_key_.emplace(crc32, uncompressed_length);
+  }
+
   // CHUNK_DEFLATE will return the uncompressed data for diff, while other types will simply return
-  // the raw data.
+  // the raw data. DataForPatch() can't be used on a deflate chunk that doesn't keep its uncompressed
+  // data; see LoadDataForPatch().
   const uint8_t* DataForPatch() const;
   size_t DataLengthForPatch() const;
 
+  // Returns the data for diff like DataForPatch(), inflating it into |storage| first if the chunk
+  // doesn't keep it. Returns nullptr if the data fails to inflate.
+  const uint8_t* LoadDataForPatch(std::vector<uint8_t>* storage) const;
+
   void Dump(size_t index) const;
 
   void SetUncompressedData(std::vector<uint8_t> data);
+  // In the low-memory mode, a deflate chunk keeps only the length of its uncompressed data, and
+  // inflates the raw data again each time it's needed.
+  void SetUncompressedLength(size_t length);
   bool SetBonusData(const std::vector<uint8_t>& bonus_data);
 
   bool operator==(const ImageChunk& other) const;
@@ -101,11 +160,13 @@ class ImageChunk {
                         bsdiff::SuffixArrayIndexInterface** bsdiff_cache);
 
  private:
-  bool TryReconstruction(int level);
+  // Inflates the raw data (without the bonus data) into |data|.
+  bool Inflate(std::vector<uint8_t>* data) const;
 
-  int type_;                                    // CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_RAW
-  size_t start_;                                // offset of chunk in the original input file
-  const std::vector<uint8_t>* input_file_ptr_;  // ptr to the full content of original input file
+  int type_;                   // CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_RAW
+  size_t start_;               // offset of chunk in the original input file
+  const uint8_t* input_data_;  // the full content of original input file
+  size_t input_size_;          // the size of the original input file
   size_t raw_data_len_;
 
   // deflate encoder parameters
@@ -114,6 +175,12 @@ class ImageChunk {
   // --- for CHUNK_DEFLATE chunks only: ---
   std::vector<uint8_t> uncompressed_data_;
   std::string entry_name_;  // used for zip entries
+  std::optional<ContentKey> content_key_;
+  // In the low-memory mode, the length of the uncompressed data (which isn't kept), and the bonus
+  // data to append to it.
+  bool inflate_on_demand_{ false };
+  size_t uncompressed_len_{ 0 };
+  std::vector<uint8_t> bonus_data_;
 };
 
 // PatchChunk stores the patch data between a source chunk and a target chunk. It also keeps track
@@ -122,6 +189,10 @@ class PatchChunk {
  public:
   PatchChunk(const ImageChunk& tgt, const ImageChunk& src, std::vector<uint8_t> data);
 
+  // Construct a patch whose data has been written to |spool|, at |offset|.
+  PatchChunk(const ImageChunk& tgt, const ImageChunk& src, const PatchSpool* spool, size_t offset,
+             size_t size);
+
   // Construct a CHUNK_RAW patch from the target data directly.
   explicit PatchChunk(const ImageChunk& tgt);
 
@@ -154,13 +225,23 @@ class PatchChunk {
   size_t target_compress_level_;  // the deflate compression level of the target chunk.
 
   std::vector<uint8_t> data_;  // storage for the patch data
+  // The patch data in |spool_| at |spool_offset_|, rather than in |data_|, in the low-memory mode.
+  const PatchSpool* spool_{ nullptr };
+  size_t spool_offset_{ 0 };
+  // The target data of a CHUNK_RAW patch, which is written from the target file.
+  const uint8_t* raw_data_{ nullptr };
+  size_t data_size_;
 };
 
 // Interface for zip_mode and image_mode images. We initialize the image from an input file and
 // split the file content into a list of image chunks.
 class Image {
  public:
-  explicit Image(bool is_source) : is_source_(is_source) {}
+  // In the |low_memory| mode, the input file is mapped rather than read, the deflate chunks are
+  // inflated only while their patches are made, and the patches are spooled to disk as they are
+  // made rather than kept until the end.
+  explicit Image(bool is_source, bool low_memory = false)
+      : is_source_(is_source), low_memory_(low_memory) {}
 
   virtual ~Image() {}
 
@@ -198,16 +279,45 @@ class Image {
   }
 
  protected:
-  bool ReadFile(const std::string& filename, std::vector<uint8_t>* file_content);
+  bool ReadFile(const std::string& filename, FileContent* file_content);
+
+  bool is_source_;                  // True if it's for source chunks.
+  bool low_memory_;                 // True for the low-memory mode.
+  std::vector<ImageChunk> chunks_;  // Internal storage of ImageChunk.
+  FileContent file_content_;        // The whole input file, in memory or mapped.
+};
+
+// The cost model that ZipModeImage::SplitZipModeImageWithLimit() picks the split points with.
+// Applying a split piece on the device holds its source ranges, its patch and the largest pair of
+// inflated deflate chunks in memory at once; the peak of these over the pieces is the memory that
+// a --block-limit update needs.
+struct SplitCostModel {
+  // Whether to pick the split points to lower the peak. Otherwise each piece takes chunks until
+  // its source reaches the block limit.
+  bool minimize_peak = false;
+  // How much larger, in percent, the estimated total patch may get than with the pieces filled up
+  // to the block limit, in exchange for a lower peak.
+  size_t patch_slack_percent = 10;
+  // The estimated size of the patch of a changed chunk against its source, in percent of the
+  // target data. A chunk without a source is estimated at its whole size.
+  size_t diff_patch_percent = 25;
+};
+
+// The predicted device-side memory of applying a split piece.
+struct SplitCost {
+  size_t src_size = 0;      // The source ranges, in whole blocks.
+  size_t patch_size = 0;    // The estimated patch.
+  size_t inflate_size = 0;  // The largest pair of inflated source and target deflate chunks.
 
-  bool is_source_;                     // True if it's for source chunks.
-  std::vector<ImageChunk> chunks_;     // Internal storage of ImageChunk.
-  std::vector<uint8_t> file_content_;  // Store the whole input file in memory.
+  size_t PeakMemory() const {
+    return src_size + patch_size + inflate_size;
+  }
 };
 
 class ZipModeImage : public Image {
  public:
-  explicit ZipModeImage(bool is_source, size_t limit = 0) : Image(is_source), limit_(limit) {}
+  explicit ZipModeImage(bool is_source, size_t limit = 0, bool low_memory = false)
+      : Image(is_source, low_memory), limit_(limit) {}
 
   bool Initialize(const std::string& filename) override;
 
@@ -217,6 +327,7 @@ class ZipModeImage : public Image {
   void Initialize(const std::vector<ImageChunk>& chunks, const std::vector<uint8_t>& file_content) {
     chunks_ = chunks;
     file_content_ = file_content;
+    IndexChunksByContent();
   }
 
   // The pesudo source chunk for bsdiff if there's no match for the given target chunk. It's in
@@ -229,13 +340,23 @@ class ZipModeImage : public Image {
 
   const ImageChunk* FindChunkByName(const std::string& name, bool find_normal = false) const;
 
+  // Find the source chunk to diff |tgt_chunk| against: the one with the same entry name, or else
+  // one with the same content (e.g. for an entry that was renamed or moved). Search for normal
+  // chunks also if |find_normal| is true.
+  ImageChunk* FindSourceChunk(const ImageChunk& tgt_chunk, bool find_normal = false);
+
+  const ImageChunk* FindSourceChunk(const ImageChunk& tgt_chunk, bool find_normal = false) const;
+
   // Verify that we can reconstruct the deflate chunks; also change the type to CHUNK_NORMAL if
   // src and tgt are identical.
   static bool CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image);
 
-  // Compute the patch between tgt & src images, and write the data into |patch_name|.
+  // Compute the patch between tgt & src images, and write the data into |patch_name|. The chunk
+  // patches are computed on up to |num_threads| threads. The source suffix arrays come from
+  // |sa_cache| if given.
   static bool GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, size_t num_threads = 1,
+                              const SuffixArrayCache* sa_cache = nullptr);
 
   // Compute the patch based on the lists of split src and tgt images. Generate patches for each
   // pair of split pieces and write the data to |patch_name|. If |debug_dir| is specified, write
@@ -244,18 +365,24 @@ class ZipModeImage : public Image {
                               const std::vector<ZipModeImage>& split_src_images,
                               const std::vector<SortedRangeSet>& split_src_ranges,
                               const std::string& patch_name, const std::string& split_info_file,
-                              const std::string& debug_dir);
+                              const std::string& debug_dir, size_t num_threads = 1,
+                              const SuffixArrayCache* sa_cache = nullptr);
 
-  // Split the tgt chunks and src chunks based on the size limit.
+  // Split the tgt chunks and src chunks based on the size limit. The split points are picked with
+  // |cost_model|; the predicted cost of each piece goes into |split_costs| if given.
   static bool SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
                                          const ZipModeImage& src_image,
                                          std::vector<ZipModeImage>* split_tgt_images,
                                          std::vector<ZipModeImage>* split_src_images,
-                                         std::vector<SortedRangeSet>* split_src_ranges);
+                                         std::vector<SortedRangeSet>* split_src_ranges,
+                                         const SplitCostModel& cost_model = {},
+                                         std::vector<SplitCost>* split_costs = nullptr);
 
  private:
   // Initialize image chunks based on the zip entries.
   bool InitializeChunks(const std::string& filename, ZipArchiveHandle handle);
+  // Index the source chunks by their content keys, keeping the first chunk for each key.
+  void IndexChunksByContent();
   // Add the a zip entry to the list.
   bool AddZipEntryToChunks(ZipArchiveHandle handle, const std::string& entry_name,
                            ZipEntry64* entry);
@@ -277,18 +404,29 @@ class ZipModeImage : public Image {
                                          std::vector<ZipModeImage>* split_tgt_images,
                                          std::vector<ZipModeImage>* split_src_images);
 
+  // Returns the indices of the tgt chunks that start a new split piece, picked by |cost_model| to
+  // lower the peak memory of the pieces.
+  static std::vector<size_t> PlanSplitPoints(const ZipModeImage& tgt_image,
+                                             const ZipModeImage& src_image,
+                                             const SplitCostModel& cost_model);
+
   // Function that actually iterates the tgt_chunks and makes patches.
   static bool GeneratePatchesInternal(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                      std::vector<PatchChunk>* patch_chunks);
+                                      std::vector<PatchChunk>* patch_chunks, size_t num_threads,
+                                      const SuffixArrayCache* sa_cache, PatchSpool* spool);
 
   // size limit in bytes of each chunk. Also, if the length of one zip_entry exceeds the limit,
   // we'll split that entry into several smaller chunks in advance.
   size_t limit_;
+
+  // The index into chunks_ of the source chunk for each content key.
+  std::map<ImageChunk::ContentKey, size_t> chunks_by_content_;
 };
 
 class ImageModeImage : public Image {
  public:
-  explicit ImageModeImage(bool is_source) : Image(is_source) {}
+  explicit ImageModeImage(bool is_source, bool low_memory = false)
+      : Image(is_source, low_memory) {}
 
   // Initialize the image chunks list by searching the magic numbers in an image file.
   bool Initialize(const std::string& filename) override;
@@ -300,9 +438,11 @@ class ImageModeImage : public Image {
   static bool CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image);
 
   // In image mode, generate patches against the given source chunks and bonus_data; write the
-  // result to |patch_name|.
+  // result to |patch_name|. The chunk patches are computed on up to |num_threads| threads. The
+  // source suffix arrays come from |sa_cache| if given.
   static bool GeneratePatches(const ImageModeImage& tgt_image, const ImageModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, size_t num_threads = 1,
+                              const SuffixArrayCache* sa_cache = nullptr);
 };
 
 #endif  // _APPLYPATCH_IMGDIFF_IMAGE_H
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_SUFFIX_ARRAY_H
+#define _APPLYPATCH_SUFFIX_ARRAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sorts the suffixes of the |size| bytes at |text| into |sa| on up to |num_threads| threads, by
+// prefix doubling: the suffixes are sorted by their first 7 bytes, then the groups that still tie
+// are sorted by the ranks of the suffixes |h| bytes further on, for h = 7, 14, 28... until no ties
+// are left. The groups are sorted in parallel, and so are the large groups themselves.
+//
+// The suffix array of a text is unique, so the result is the same as that of divsufsort(), and so
+// are the bsdiff patches made with it. It takes two to three times the memory of |sa| on top of it,
+// and the work grows with the log of the longest repeat in |text|; it only beats divsufsort() for
+// large texts, given a few threads. Returns false if |size| doesn't fit in the entries of |sa|.
+bool ParallelSuffixSort(const uint8_t* text, size_t size, int32_t* sa, size_t num_threads);
+bool ParallelSuffixSort(const uint8_t* text, size_t size, int64_t* sa, size_t num_threads);
+
+#endif  // _APPLYPATCH_SUFFIX_ARRAY_H
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_SUFFIX_ARRAY_CACHE_H
+#define _APPLYPATCH_SUFFIX_ARRAY_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include <bsdiff/bsdiff.h>
+
+// The suffix arrays of at least this many bytes are sorted by ParallelSuffixSort() when more than
+// one thread is given, rather than by divsufsort(). Both give the same array.
+static constexpr size_t kMinParallelSuffixSortSize = 16 * 1024 * 1024;
+
+// Builds the suffix array index of |data| in memory, on up to |num_threads| threads if it's large.
+// Returns nullptr on failure. |data| must outlive the returned index.
+std::unique_ptr<bsdiff::SuffixArrayIndexInterface> CreateSuffixArrayIndex(const uint8_t* data,
+                                                                          size_t size,
+                                                                          size_t num_threads);
+
+// SuffixArrayCache keeps the suffix arrays that bsdiff searches the source chunks with in a
+// directory, keyed by the SHA-256 of the chunk data. Diffing many targets against the same source
+// (e.g. one build against a number of later ones) then only sorts each source chunk once; the later
+// runs map the saved array instead.
+//
+// The cache files are only valid for the machine that wrote them (they are stored in host byte
+// order). A file that fails to load is rebuilt and replaced.
+class SuffixArrayCache {
+ public:
+  explicit SuffixArrayCache(std::string dir) : dir_(std::move(dir)) {}
+
+  // Returns the suffix array index of |data|, mapping it from the cache if present, or building and
+  // saving it otherwise (on up to |num_threads| threads, as CreateSuffixArrayIndex() does). A
+  // failure to save only logs a warning, and returns the in-memory index. Returns nullptr if the
+  // index can't be built at all. |data| must outlive the returned index.
+  std::unique_ptr<bsdiff::SuffixArrayIndexInterface> Get(const uint8_t* data, size_t size,
+                                                         size_t num_threads = 1) const;
+
+  // Returns the path of the cache file for |data|.
+  std::string CachePath(const uint8_t* data, size_t size) const;
+
+ private:
+  std::string dir_;
+};
+
+#endif  // _APPLYPATCH_SUFFIX_ARRAY_CACHE_H
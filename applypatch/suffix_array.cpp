@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "applypatch/suffix_array.h"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// The suffixes are first sorted by this many bytes, packed into a 64-bit key with the length of
+// the suffix (if shorter), which makes a shorter suffix sort before the longer ones it prefixes.
+static constexpr size_t kPrefixBytes = 7;
+// The pieces that one thread sorts on its own are no smaller than this many entries.
+static constexpr size_t kMinSortPiece = 4096;
+// The groups of ties are handed to the threads in batches of about this many entries.
+static constexpr size_t kGroupBatchEntries = 64 * 1024;
+
+namespace {
+
+// The entries [begin, end) of the suffix array, whose suffixes tie so far.
+struct Group {
+  size_t begin;
+  size_t end;
+};
+
+// Runs |fn(i)| for each i in [0, count) on up to |num_threads| threads.
+template <typename Fn>
+void ParallelFor(size_t count, size_t num_threads, const Fn& fn) {
+  std::atomic<size_t> next{ 0 };
+  auto worker = [&next, count, &fn]() {
+    size_t i;
+    while ((i = next++) < count) {
+      fn(i);
+    }
+  };
+  num_threads = std::min(num_threads, count);
+  if (num_threads <= 1) {
+    worker();
+    return;
+  }
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// Sorts [first, last) on up to |num_threads| threads: the pieces are sorted on their own, then
+// merged pairwise.
+template <typename T, typename Compare>
+void ParallelSort(T* first, T* last, size_t num_threads, const Compare& comp) {
+  size_t size = last - first;
+  size_t pieces = std::min(num_threads, std::max<size_t>(size / kMinSortPiece, 1));
+  if (pieces <= 1) {
+    std::sort(first, last, comp);
+    return;
+  }
+  std::vector<size_t> bounds(pieces + 1);
+  for (size_t i = 0; i <= pieces; i++) {
+    bounds[i] = size * i / pieces;
+  }
+  ParallelFor(pieces, pieces,
+              [&](size_t i) { std::sort(first + bounds[i], first + bounds[i + 1], comp); });
+  for (size_t width = 1; width < pieces; width *= 2) {
+    ParallelFor((pieces + 2 * width - 1) / (2 * width), num_threads, [&](size_t i) {
+      size_t begin = i * 2 * width;
+      size_t middle = std::min(begin + width, pieces);
+      size_t end = std::min(begin + 2 * width, pieces);
+      if (middle < end) {
+        std::inplace_merge(first + bounds[begin], first + bounds[middle], first + bounds[end],
+                           comp);
+      }
+    });
+  }
+}
+
+// Splits |groups| into batches of whole groups of about kGroupBatchEntries entries each, returning
+// the index of the first group of each batch, plus the end.
+std::vector<size_t> BatchGroups(const std::vector<Group>& groups) {
+  std::vector<size_t> batches{ 0 };
+  size_t entries = 0;
+  for (size_t i = 0; i < groups.size(); i++) {
+    entries += groups[i].end - groups[i].begin;
+    if (entries >= kGroupBatchEntries) {
+      batches.push_back(i + 1);
+      entries = 0;
+    }
+  }
+  if (batches.back() != groups.size()) {
+    batches.push_back(groups.size());
+  }
+  return batches;
+}
+
+template <typename T>
+class SuffixSorter {
+ public:
+  SuffixSorter(const uint8_t* text, size_t size, T* sa, size_t num_threads)
+      : text_(text), size_(size), sa_(sa), num_threads_(num_threads), rank_(size) {}
+
+  void Sort() {
+    std::vector<Group> groups = SortPrefixes();
+    std::vector<T> keys(size_);
+    for (size_t h = kPrefixBytes; !groups.empty(); h *= 2) {
+      // The ranks stay as they are while the groups are sorted by the ranks |h| bytes on; the new
+      // ranks are only given once all the groups are sorted.
+      auto key = [this, h](T pos) -> T {
+        size_t next = static_cast<size_t>(pos) + h;
+        return next < size_ ? rank_[next] : -1;
+      };
+
+      // The groups too large for the batches are sorted one at a time, on all the threads.
+      std::vector<Group> small_groups;
+      for (const auto& group : groups) {
+        if (group.end - group.begin < kGroupBatchEntries) {
+          small_groups.push_back(group);
+        } else {
+          SortGroup(group, key, num_threads_, &keys);
+        }
+      }
+      std::vector<size_t> batches = BatchGroups(small_groups);
+      ParallelFor(batches.size() - 1, num_threads_, [&](size_t i) {
+        for (size_t g = batches[i]; g < batches[i + 1]; g++) {
+          SortGroup(small_groups[g], key, 1, &keys);
+        }
+      });
+
+      groups = Rank(groups, [&keys](size_t j) { return keys[j]; });
+    }
+  }
+
+ private:
+  // Sorts the suffixes by their first kPrefixBytes bytes, and returns the groups of ties. They're
+  // put in buckets by their first two bytes first, which are then sorted on their own.
+  std::vector<Group> SortPrefixes() {
+    // The bucket of a single byte suffix comes before those of the longer suffixes it prefixes.
+    auto bucket = [this](size_t pos) -> size_t {
+      return text_[pos] * 257 + (pos + 1 < size_ ? text_[pos + 1] + 1 : 0);
+    };
+    static constexpr size_t kBuckets = 256 * 257;
+
+    // Each thread counts the bucket sizes over a piece of the text, then places its suffixes.
+    size_t pieces = std::min(num_threads_, std::max<size_t>(size_ / kGroupBatchEntries, 1));
+    std::vector<std::vector<size_t>> offsets(pieces, std::vector<size_t>(kBuckets));
+    auto piece_begin = [this, pieces](size_t i) { return size_ * i / pieces; };
+    ParallelFor(pieces, pieces, [&](size_t i) {
+      for (size_t pos = piece_begin(i); pos < piece_begin(i + 1); pos++) {
+        offsets[i][bucket(pos)]++;
+      }
+    });
+    std::vector<Group> buckets;
+    size_t offset = 0;
+    for (size_t b = 0; b < kBuckets; b++) {
+      size_t begin = offset;
+      for (size_t i = 0; i < pieces; i++) {
+        size_t count = offsets[i][b];
+        offsets[i][b] = offset;
+        offset += count;
+      }
+      if (offset > begin) {
+        buckets.push_back(Group{ begin, offset });
+      }
+    }
+    ParallelFor(pieces, pieces, [&](size_t i) {
+      for (size_t pos = piece_begin(i); pos < piece_begin(i + 1); pos++) {
+        sa_[offsets[i][bucket(pos)]++] = static_cast<T>(pos);
+      }
+    });
+
+    auto prefix = [this](T pos) {
+      size_t length = std::min(size_ - pos, kPrefixBytes);
+      uint64_t key = 0;
+      for (size_t k = 0; k < kPrefixBytes; k++) {
+        key = (key << 8) | (k < length ? text_[pos + k] : 0);
+      }
+      return (key << 8) | length;
+    };
+    std::vector<Group> small_buckets;
+    for (const auto& group : buckets) {
+      if (group.end - group.begin < kGroupBatchEntries) {
+        small_buckets.push_back(group);
+      } else {
+        SortGroup(group, prefix, num_threads_);
+      }
+    }
+    std::vector<size_t> batches = BatchGroups(small_buckets);
+    ParallelFor(batches.size() - 1, num_threads_, [&](size_t i) {
+      for (size_t g = batches[i]; g < batches[i + 1]; g++) {
+        SortGroup(small_buckets[g], prefix, 1);
+      }
+    });
+    return Rank(buckets, [this, &prefix](size_t j) { return prefix(sa_[j]); });
+  }
+
+  // Sorts the entries of |group| by the |key| of their suffixes, which goes to |keys| if given.
+  template <typename Key>
+  void SortGroup(const Group& group, const Key& key, size_t num_threads,
+                 std::vector<T>* keys = nullptr) {
+    // Sorting the keys along with the suffixes is faster than looking them up on each comparison.
+    using KeyType = decltype(key(T{}));
+    size_t size = group.end - group.begin;
+    std::vector<std::pair<KeyType, T>> entries(size);
+    for (size_t j = 0; j < size; j++) {
+      T pos = sa_[group.begin + j];
+      entries[j] = { key(pos), pos };
+    }
+    ParallelSort(entries.data(), entries.data() + size, num_threads,
+                 [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (size_t j = 0; j < size; j++) {
+      if (keys != nullptr) {
+        (*keys)[group.begin + j] = entries[j].first;
+      }
+      sa_[group.begin + j] = entries[j].second;
+    }
+  }
+
+  // Gives the suffixes in |groups|, each sorted by |key| of their entries, the rank of the first
+  // entry with the same key, and returns the groups that still tie.
+  template <typename Key>
+  std::vector<Group> Rank(const std::vector<Group>& groups, const Key& key) {
+    std::vector<size_t> batches = BatchGroups(groups);
+    std::vector<std::vector<Group>> ties(batches.size() - 1);
+    ParallelFor(batches.size() - 1, num_threads_, [&](size_t i) {
+      for (size_t g = batches[i]; g < batches[i + 1]; g++) {
+        const Group& group = groups[g];
+        size_t head = group.begin;
+        for (size_t j = group.begin; j < group.end; j++) {
+          if (key(j) != key(head)) {
+            if (j - head > 1) {
+              ties[i].push_back(Group{ head, j });
+            }
+            head = j;
+          }
+          rank_[sa_[j]] = static_cast<T>(head);
+        }
+        if (group.end - head > 1) {
+          ties[i].push_back(Group{ head, group.end });
+        }
+      }
+    });
+
+    std::vector<Group> result;
+    for (const auto& batch_ties : ties) {
+      result.insert(result.end(), batch_ties.begin(), batch_ties.end());
+    }
+    return result;
+  }
+
+  const uint8_t* text_;
+  size_t size_;
+  T* sa_;
+  size_t num_threads_;
+  // The rank of each suffix: the first entry of its group in |sa_|.
+  std::vector<T> rank_;
+};
+
+template <typename T>
+bool SortSuffixes(const uint8_t* text, size_t size, T* sa, size_t num_threads) {
+  if (size > static_cast<size_t>(std::numeric_limits<T>::max())) {
+    return false;
+  }
+  SuffixSorter<T>(text, size, sa, std::max<size_t>(num_threads, 1)).Sort();
+  return true;
+}
+
+}  // namespace
+
+bool ParallelSuffixSort(const uint8_t* text, size_t size, int32_t* sa, size_t num_threads) {
+  return SortSuffixes(text, size, sa, num_threads);
+}
+
+bool ParallelSuffixSort(const uint8_t* text, size_t size, int64_t* sa, size_t num_threads) {
+  return SortSuffixes(text, size, sa, num_threads);
+}
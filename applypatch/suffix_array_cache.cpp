@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "applypatch/suffix_array_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <divsufsort.h>
+#include <divsufsort64.h>
+#include <openssl/sha.h>
+
+#include "applypatch/suffix_array.h"
+#include "otautil/print_sha1.h"
+
+// The header of a cache file, followed by |text_size| suffix array entries of |width| bytes each.
+struct SuffixArrayFileHeader {
+  char magic[8];
+  uint64_t text_size;
+  uint32_t width;
+  uint32_t reserved;
+};
+
+static constexpr char kSuffixArrayMagic[8] = { 'I', 'M', 'G', 'D', 'S', 'A', '0', '1' };
+
+// A suffix array index over |text|, of 32-bit or 64-bit entries, which are either owned or mapped
+// from a cache file.
+class CachedSuffixArrayIndex : public bsdiff::SuffixArrayIndexInterface {
+ public:
+  CachedSuffixArrayIndex(const uint8_t* text, size_t size, size_t width, std::vector<uint8_t> owned)
+      : text_(text), size_(size), width_(width), owned_(std::move(owned)), sa_(owned_.data()) {}
+
+  CachedSuffixArrayIndex(const uint8_t* text, size_t size, size_t width, void* map, size_t map_size)
+      : text_(text),
+        size_(size),
+        width_(width),
+        map_(map),
+        map_size_(map_size),
+        sa_(static_cast<const uint8_t*>(map) + sizeof(SuffixArrayFileHeader)) {}
+
+  ~CachedSuffixArrayIndex() override {
+    if (map_ != nullptr) {
+      munmap(map_, map_size_);
+    }
+  }
+
+  void SearchPrefix(const uint8_t* target, size_t length, size_t* out_length,
+                    uint64_t* out_pos) const override {
+    if (width_ == sizeof(int32_t)) {
+      Search(reinterpret_cast<const int32_t*>(sa_), target, length, out_length, out_pos);
+    } else {
+      Search(reinterpret_cast<const int64_t*>(sa_), target, length, out_length, out_pos);
+    }
+  }
+
+ private:
+  size_t MatchLength(size_t pos, const uint8_t* target, size_t length) const {
+    size_t limit = std::min(size_ - pos, length);
+    size_t i = 0;
+    while (i < limit && text_[pos + i] == target[i]) {
+      i++;
+    }
+    return i;
+  }
+
+  // Binary searches the sorted suffixes for the one sharing the longest prefix with |target|. It
+  // ends up between the two neighbouring suffixes that |target| sorts in between.
+  template <typename T>
+  void Search(const T* sa, const uint8_t* target, size_t length, size_t* out_length,
+              uint64_t* out_pos) const {
+    if (size_ == 0) {
+      *out_length = 0;
+      *out_pos = 0;
+      return;
+    }
+    size_t lo = 0;
+    size_t hi = size_ - 1;
+    while (hi - lo >= 2) {
+      size_t mid = lo + (hi - lo) / 2;
+      size_t pos = static_cast<size_t>(sa[mid]);
+      size_t suffix_length = size_ - pos;
+      int cmp = memcmp(text_ + pos, target, std::min(suffix_length, length));
+      if (cmp < 0 || (cmp == 0 && suffix_length < length)) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    size_t lo_pos = static_cast<size_t>(sa[lo]);
+    size_t hi_pos = static_cast<size_t>(sa[hi]);
+    size_t lo_length = MatchLength(lo_pos, target, length);
+    size_t hi_length = MatchLength(hi_pos, target, length);
+    if (lo_length > hi_length) {
+      *out_length = lo_length;
+      *out_pos = lo_pos;
+    } else {
+      *out_length = hi_length;
+      *out_pos = hi_pos;
+    }
+  }
+
+  const uint8_t* text_;
+  size_t size_;
+  size_t width_;
+  std::vector<uint8_t> owned_;
+  void* map_{ nullptr };
+  size_t map_size_{ 0 };
+  const uint8_t* sa_;
+};
+
+// Sorts the suffixes of |data| into |sa|, with 32-bit entries when they fit. Large arrays are
+// sorted on up to |num_threads| threads.
+static bool BuildSuffixArray(const uint8_t* data, size_t size, size_t num_threads, size_t* width,
+                             std::vector<uint8_t>* sa) {
+  bool parallel = num_threads > 1 && size >= kMinParallelSuffixSortSize;
+  if (size < static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
+    *width = sizeof(int32_t);
+    sa->resize(size * sizeof(int32_t));
+    if (parallel) {
+      return ParallelSuffixSort(data, size, reinterpret_cast<int32_t*>(sa->data()), num_threads);
+    }
+    return divsufsort(data, reinterpret_cast<saidx_t*>(sa->data()), size) == 0;
+  }
+  *width = sizeof(int64_t);
+  sa->resize(size * sizeof(int64_t));
+  if (parallel) {
+    return ParallelSuffixSort(data, size, reinterpret_cast<int64_t*>(sa->data()), num_threads);
+  }
+  return divsufsort64(data, reinterpret_cast<saidx64_t*>(sa->data()), size) == 0;
+}
+
+// Writes the suffix array to |path| through a temporary file, so that concurrent runs never see a
+// partial file.
+static bool SaveSuffixArray(const std::string& path, size_t size, size_t width,
+                            const std::vector<uint8_t>& sa) {
+  std::string temp_path = path + ".XXXXXX";
+  android::base::unique_fd fd(mkstemp(temp_path.data()));
+  if (fd == -1) {
+    PLOG(WARNING) << "Failed to create " << temp_path;
+    return false;
+  }
+  // mkstemp() creates the file as 0600; let the other users of a shared cache read it.
+  fchmod(fd, 0644);
+
+  SuffixArrayFileHeader header = {};
+  memcpy(header.magic, kSuffixArrayMagic, sizeof(header.magic));
+  header.text_size = size;
+  header.width = width;
+  if (!android::base::WriteFully(fd, &header, sizeof(header)) ||
+      !android::base::WriteFully(fd, sa.data(), sa.size())) {
+    PLOG(WARNING) << "Failed to write " << temp_path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    PLOG(WARNING) << "Failed to rename " << temp_path << " to " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Maps the suffix array of |data| from |path|. Returns nullptr if the file is missing or doesn't
+// hold an array of the expected size.
+static std::unique_ptr<bsdiff::SuffixArrayIndexInterface> LoadSuffixArray(const std::string& path,
+                                                                          const uint8_t* data,
+                                                                          size_t size) {
+  android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      PLOG(WARNING) << "Failed to open " << path;
+    }
+    return nullptr;
+  }
+
+  SuffixArrayFileHeader header;
+  struct stat sb;
+  if (!android::base::ReadFully(fd, &header, sizeof(header)) || fstat(fd, &sb) != 0) {
+    PLOG(WARNING) << "Failed to read " << path;
+    return nullptr;
+  }
+  if (memcmp(header.magic, kSuffixArrayMagic, sizeof(header.magic)) != 0 ||
+      header.text_size != size ||
+      (header.width != sizeof(int32_t) && header.width != sizeof(int64_t)) ||
+      static_cast<uint64_t>(sb.st_size) != sizeof(header) + size * header.width) {
+    LOG(WARNING) << "Ignoring invalid suffix array cache " << path;
+    return nullptr;
+  }
+
+  size_t map_size = static_cast<size_t>(sb.st_size);
+  void* map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    PLOG(WARNING) << "Failed to map " << path;
+    return nullptr;
+  }
+  return std::make_unique<CachedSuffixArrayIndex>(data, size, header.width, map, map_size);
+}
+
+std::unique_ptr<bsdiff::SuffixArrayIndexInterface> CreateSuffixArrayIndex(const uint8_t* data,
+                                                                          size_t size,
+                                                                          size_t num_threads) {
+  size_t width;
+  std::vector<uint8_t> sa;
+  if (!BuildSuffixArray(data, size, num_threads, &width, &sa)) {
+    LOG(ERROR) << "Failed to build the suffix array of " << size << " bytes";
+    return nullptr;
+  }
+  return std::make_unique<CachedSuffixArrayIndex>(data, size, width, std::move(sa));
+}
+
+std::string SuffixArrayCache::CachePath(const uint8_t* data, size_t size) const {
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(data, size, digest);
+  return dir_ + "/" + print_hex(digest, SHA256_DIGEST_LENGTH) + ".sa";
+}
+
+std::unique_ptr<bsdiff::SuffixArrayIndexInterface> SuffixArrayCache::Get(const uint8_t* data,
+                                                                         size_t size,
+                                                                         size_t num_threads) const {
+  std::string path = CachePath(data, size);
+  if (auto index = LoadSuffixArray(path, data, size); index) {
+    return index;
+  }
+
+  size_t width;
+  std::vector<uint8_t> sa;
+  if (!BuildSuffixArray(data, size, num_threads, &width, &sa)) {
+    LOG(ERROR) << "Failed to build the suffix array of " << size << " bytes";
+    return nullptr;
+  }
+  SaveSuffixArray(path, size, width, sa);
+  return std::make_unique<CachedSuffixArrayIndex>(data, size, width, std::move(sa));
+}
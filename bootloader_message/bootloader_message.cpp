@@ -18,11 +18,16 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <iterator>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -50,6 +55,14 @@ std::string get_misc_blk_device(std::string* err) {
   if (g_misc_device_for_test.has_value() && !g_misc_device_for_test->empty()) {
     return *g_misc_device_for_test;
   }
+
+  // The default fstab doesn't change while the process runs, so it's only searched once.
+  static std::mutex mutex;
+  static std::string misc_blk_device;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!misc_blk_device.empty()) {
+    return misc_blk_device;
+  }
   Fstab fstab;
   if (!ReadDefaultFstab(&fstab)) {
     *err = "failed to read default fstab";
@@ -57,7 +70,8 @@ std::string get_misc_blk_device(std::string* err) {
   }
   for (const auto& entry : fstab) {
     if (entry.mount_point == "/misc") {
-      return entry.blk_device;
+      misc_blk_device = entry.blk_device;
+      return misc_blk_device;
     }
   }
 
@@ -199,13 +213,14 @@ bool write_bootloader_message_to(const std::vector<std::string>& options,
 }
 
 bool update_bootloader_message(const std::vector<std::string>& options, std::string* err) {
+  auto misc = MiscPartition::Open(err);
   bootloader_message boot;
-  if (!read_bootloader_message(&boot, err)) {
+  if (!misc || !misc->ReadBootloaderMessage(&boot, err)) {
     return false;
   }
   update_bootloader_message_in_struct(&boot, options);
 
-  return write_bootloader_message(boot, err);
+  return misc->WriteBootloaderMessage(boot, err);
 }
 
 bool update_bootloader_message_in_struct(bootloader_message* boot,
@@ -229,8 +244,9 @@ bool update_bootloader_message_in_struct(bootloader_message* boot,
 }
 
 bool write_reboot_bootloader(std::string* err) {
+  auto misc = MiscPartition::Open(err);
   bootloader_message boot;
-  if (!read_bootloader_message(&boot, err)) {
+  if (!misc || !misc->ReadBootloaderMessage(&boot, err)) {
     return false;
   }
   if (boot.command[0] != '\0') {
@@ -238,7 +254,7 @@ bool write_reboot_bootloader(std::string* err) {
     return false;
   }
   strlcpy(boot.command, "bootonce-bootloader", sizeof(boot.command));
-  return write_bootloader_message(boot, err);
+  return misc->WriteBootloaderMessage(boot, err);
 }
 
 bool read_wipe_package(std::string* package_data, size_t size, std::string* err) {
@@ -340,6 +356,16 @@ bool WriteMiscControlMessage(const misc_control_message& message, std::string* e
                                        offsetof(misc_system_space_layout, control_message), err);
 }
 
+bool ReadMiscWipeMessage(misc_wipe_message* message, std::string* err) {
+  return ReadMiscPartitionSystemSpace(message, sizeof(*message),
+                                      offsetof(misc_system_space_layout, wipe_message), err);
+}
+
+bool WriteMiscWipeMessage(const misc_wipe_message& message, std::string* err) {
+  return WriteMiscPartitionSystemSpace(&message, sizeof(message),
+                                       offsetof(misc_system_space_layout, wipe_message), err);
+}
+
 bool CheckReservedSystemSpaceEmpty(bool* empty, std::string* err) {
   constexpr size_t kReservedSize = SYSTEM_SPACE_SIZE_IN_MISC - sizeof(misc_system_space_layout);
 
@@ -357,6 +383,115 @@ bool CheckReservedSystemSpaceEmpty(bool* empty, std::string* err) {
   return true;
 }
 
+std::unique_ptr<MiscPartition> MiscPartition::Open(std::string* err) {
+  std::string misc_blk_device = get_misc_blk_device(err);
+  if (misc_blk_device.empty()) {
+    return nullptr;
+  }
+  return OpenDevice(misc_blk_device, err);
+}
+
+std::unique_ptr<MiscPartition> MiscPartition::OpenDevice(const std::string& misc_blk_device,
+                                                         std::string* err) {
+  if (!wait_for_device(misc_blk_device, err)) {
+    return nullptr;
+  }
+  int fd = open(misc_blk_device.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd == -1 && (errno == EACCES || errno == EROFS)) {
+    // Can still be read from; the writes will fail.
+    fd = open(misc_blk_device.c_str(), O_RDONLY | O_CLOEXEC);
+  }
+  if (fd == -1) {
+    *err = android::base::StringPrintf("failed to open %s: %s", misc_blk_device.c_str(),
+                                       strerror(errno));
+    return nullptr;
+  }
+  return std::unique_ptr<MiscPartition>(new MiscPartition(misc_blk_device, fd));
+}
+
+MiscPartition::~MiscPartition() {
+  close(fd_);
+}
+
+bool MiscPartition::ReadMessage(bootloader_message* boot, std::string* err) const {
+  if (!android::base::ReadFullyAtOffset(fd_, boot, sizeof(*boot),
+                                        BOOTLOADER_MESSAGE_OFFSET_IN_MISC)) {
+    *err = android::base::StringPrintf("failed to read %s: %s", device_.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool MiscPartition::ReadBootloaderMessage(bootloader_message* boot, std::string* err) {
+  if (!cached_) {
+    bootloader_message message;
+    if (!ReadMessage(&message, err)) {
+      return false;
+    }
+    cached_ = message;
+  }
+  *boot = *cached_;
+  return true;
+}
+
+bool MiscPartition::WriteBootloaderMessage(const bootloader_message& boot, std::string* err) {
+  // A device that can't be read yet (e.g. an empty file) gets the whole message.
+  if (!cached_) {
+    bootloader_message message;
+    std::string read_err;
+    if (ReadMessage(&message, &read_err)) {
+      cached_ = message;
+    }
+  }
+
+  static constexpr std::pair<size_t, size_t> kFields[] = {
+    { offsetof(bootloader_message, command), sizeof(bootloader_message::command) },
+    { offsetof(bootloader_message, status), sizeof(bootloader_message::status) },
+    { offsetof(bootloader_message, recovery), sizeof(bootloader_message::recovery) },
+    { offsetof(bootloader_message, stage), sizeof(bootloader_message::stage) },
+    { offsetof(bootloader_message, reserved), sizeof(bootloader_message::reserved) },
+  };
+  const auto* data = reinterpret_cast<const char*>(&boot);
+  // The cache is dropped until the write succeeds, so the fields to compare with are copied out of
+  // it first.
+  bootloader_message old_message;
+  const char* old_data = nullptr;
+  if (cached_) {
+    old_message = *cached_;
+    old_data = reinterpret_cast<const char*>(&old_message);
+  }
+  cached_.reset();
+
+  // Write each run of changed fields at once.
+  bool written = false;
+  for (size_t i = 0; i < std::size(kFields);) {
+    const auto& [offset, size] = kFields[i++];
+    if (old_data != nullptr && memcmp(data + offset, old_data + offset, size) == 0) {
+      continue;
+    }
+    size_t end = offset + size;
+    while (i < std::size(kFields) &&
+           (old_data == nullptr ||
+            memcmp(data + kFields[i].first, old_data + kFields[i].first, kFields[i].second) != 0)) {
+      end = kFields[i].first + kFields[i].second;
+      i++;
+    }
+    if (!android::base::WriteFullyAtOffset(fd_, data + offset, end - offset,
+                                           BOOTLOADER_MESSAGE_OFFSET_IN_MISC + offset)) {
+      *err = android::base::StringPrintf("failed to write %s: %s", device_.c_str(),
+                                         strerror(errno));
+      return false;
+    }
+    written = true;
+  }
+  if (written && fsync(fd_) == -1) {
+    *err = android::base::StringPrintf("failed to fsync %s: %s", device_.c_str(), strerror(errno));
+    return false;
+  }
+  cached_ = boot;
+  return true;
+}
+
 extern "C" bool write_reboot_bootloader(void) {
   std::string err;
   return write_reboot_bootloader(&err);
@@ -115,6 +115,20 @@ struct misc_control_message {
   uint8_t reserved[51];
 } __attribute__((packed));
 
+// Holds the progress of the secure wipe of the partitions in a wipe package, so that an
+// interrupted wipe can resume. The partitions are identified by their index in the list of the
+// wipe package, and the list itself by |wipe_id|. Partitions past the last entry aren't
+// checkpointed.
+#define MISC_WIPE_MESSAGE_MAX_PARTITIONS 29
+struct misc_wipe_message {
+  uint8_t version;
+  uint32_t magic;
+  uint32_t wipe_id;
+  // The MiB wiped from the start of each partition.
+  uint32_t wiped_mib[MISC_WIPE_MESSAGE_MAX_PARTITIONS];
+  uint8_t reserved[3];
+} __attribute__((packed));
+
 #define MISC_VIRTUAL_AB_MESSAGE_VERSION 2
 #define MISC_VIRTUAL_AB_MAGIC_HEADER 0x56740AB0
 
@@ -139,6 +153,9 @@ struct misc_control_message {
 #define MISC_CONTROL_MAGIC_HEADER 0x736d6f72
 #define MISC_CONTROL_16KB_BEFORE 0x1
 
+#define MISC_WIPE_MESSAGE_VERSION 1
+#define MISC_WIPE_MAGIC_HEADER 0x77697065
+
 #if (__STDC_VERSION__ >= 201112L) || defined(__cplusplus)
 static_assert(sizeof(struct misc_virtual_ab_message) == 64,
               "struct misc_virtual_ab_message has wrong size");
@@ -148,6 +165,8 @@ static_assert(sizeof(struct misc_kcmdline_message) == 64,
               "struct misc_kcmdline_message has wrong size");
 static_assert(sizeof(struct misc_control_message) == 64,
               "struct misc_control_message has wrong size");
+static_assert(sizeof(struct misc_wipe_message) == 128,
+              "struct misc_wipe_message has wrong size");
 #endif
 
 // This struct is not meant to be used directly, rather, it is to make
@@ -157,6 +176,7 @@ struct misc_system_space_layout {
   misc_memtag_message memtag_message;
   misc_kcmdline_message kcmdline_message;
   misc_control_message control_message;
+  misc_wipe_message wipe_message;
 } __attribute__((packed));
 
 #if (__STDC_VERSION__ >= 201112L) || defined(__cplusplus)
@@ -166,10 +186,13 @@ static_assert(sizeof(struct misc_system_space_layout) % 64 == 0,
 
 #ifdef __cplusplus
 
+#include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
-// Gets the block device name of /misc partition.
+// Gets the block device name of /misc partition. The name found in the fstab is kept for the later
+// calls.
 std::string get_misc_blk_device(std::string* err);
 // Return the block device name for the bootloader message partition and waits
 // for the device for up to 10 seconds. In case of error returns the empty
@@ -241,9 +264,51 @@ bool WriteMiscKcmdlineMessage(const misc_kcmdline_message& message, std::string*
 bool ReadMiscControlMessage(misc_control_message* message, std::string* err);
 bool WriteMiscControlMessage(const misc_control_message& message, std::string* err);
 
+// Read or write the wipe message from system space in /misc.
+bool ReadMiscWipeMessage(misc_wipe_message* message, std::string* err);
+bool WriteMiscWipeMessage(const misc_wipe_message& message, std::string* err);
+
 // Check reserved system space.
 bool CheckReservedSystemSpaceEmpty(bool* empty, std::string* err);
 
+// MiscPartition reads and writes the bootloader message of a misc partition, for the callers that
+// do so repeatedly (e.g. the updater, which gets and sets the stage of a multi-stage package). It
+// opens the device once, keeps the message it last read or wrote, and only writes the fields that
+// differ from it, with a single fsync. Since it doesn't see the writes of other processes, nor
+// those of the functions above, the caller must be the only writer of the BCB while it's in use.
+class MiscPartition {
+ public:
+  // Opens the /misc partition of the default fstab. Returns nullptr and sets |err| on error.
+  static std::unique_ptr<MiscPartition> Open(std::string* err);
+
+  // Opens |misc_blk_device|, waiting for it to show up like read_bootloader_message_from().
+  static std::unique_ptr<MiscPartition> OpenDevice(const std::string& misc_blk_device,
+                                                   std::string* err);
+
+  ~MiscPartition();
+
+  const std::string& device() const {
+    return device_;
+  }
+
+  // Reads the bootloader message into |boot|, from the device only if it isn't cached.
+  bool ReadBootloaderMessage(bootloader_message* boot, std::string* err);
+
+  // Writes |boot| as the bootloader message. Only the fields that differ from the cached message
+  // (read first if needed) are written; nothing is if none of them does. On error, the cache is
+  // dropped, as the message on the device is unknown.
+  bool WriteBootloaderMessage(const bootloader_message& boot, std::string* err);
+
+ private:
+  MiscPartition(const std::string& device, int fd) : device_(device), fd_(fd) {}
+
+  bool ReadMessage(bootloader_message* boot, std::string* err) const;
+
+  const std::string device_;
+  const int fd_;
+  std::optional<bootloader_message> cached_;
+};
+
 #else
 
 #include <stdbool.h>
@@ -22,15 +22,23 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include <android-base/logging.h>
 #include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
+#include "edify/profiler.h"
+#include "edify/updater_interface.h"
 #include "otautil/error_code.h"
 
 // Functions should:
@@ -42,12 +50,24 @@ static bool BooleanString(const std::string& s) {
     return !s.empty();
 }
 
+// Calls the function of |expr|, recording it with the profiler of |state| if there's one.
+static Value* Call(State* state, const std::unique_ptr<Expr>& expr) {
+  ScriptProfiler* profiler = state->profiler;
+  if (profiler == nullptr || !profiler->Profiles(expr.get())) {
+    return expr->fn(expr->name.data(), state, expr->argv);
+  }
+  ScriptProfiler::Sample begin = ScriptProfiler::Now();
+  Value* result = expr->fn(expr->name.data(), state, expr->argv);
+  profiler->Record(expr.get(), begin, ScriptProfiler::Now());
+  return result;
+}
+
 bool Evaluate(State* state, const std::unique_ptr<Expr>& expr, std::string* result) {
     if (result == nullptr) {
         return false;
     }
 
-    std::unique_ptr<Value> v(expr->fn(expr->name.c_str(), state, expr->argv));
+    std::unique_ptr<Value> v(Call(state, expr));
     if (!v) {
         return false;
     }
@@ -56,12 +76,12 @@ bool Evaluate(State* state, const std::unique_ptr<Expr>& expr, std::string* resu
       return false;
     }
 
-    *result = v->data;
+    *result = std::move(v->MutableData());
     return true;
 }
 
 Value* EvaluateValue(State* state, const std::unique_ptr<Expr>& expr) {
-    return expr->fn(expr->name.c_str(), state, expr->argv);
+    return Call(state, expr);
 }
 
 Value* StringValue(const char* str) {
@@ -71,24 +91,26 @@ Value* StringValue(const char* str) {
     return new Value(Value::Type::STRING, str);
 }
 
-Value* StringValue(const std::string& str) {
-    return StringValue(str.c_str());
+Value* StringValue(std::string str) {
+    return new Value(Value::Type::STRING, std::move(str));
 }
 
 Value* ConcatFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
     if (argv.empty()) {
         return StringValue("");
     }
+    // The first string is moved into the result, and the others are appended to it.
     std::string result;
+    std::string str;
     for (size_t i = 0; i < argv.size(); ++i) {
-        std::string str;
-        if (!Evaluate(state, argv[i], &str)) {
+        if (!Evaluate(state, argv[i], i == 0 ? &result : &str)) {
             return nullptr;
         }
         result += str;
+        str.clear();
     }
 
-    return StringValue(result);
+    return StringValue(std::move(result));
 }
 
 Value* IfElseFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
@@ -148,7 +170,7 @@ Value* SleepFn(const char* name, State* state, const std::vector<std::unique_ptr
     }
     sleep(v);
 
-    return StringValue(val);
+    return StringValue(std::move(val));
 }
 
 Value* StdoutFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
@@ -184,7 +206,7 @@ Value* LogicalOrFn(const char* name, State* state,
     if (!BooleanString(left)) {
         return EvaluateValue(state, argv[1]);
     } else {
-        return StringValue(left);
+        return StringValue(std::move(left));
     }
 }
 
@@ -210,8 +232,7 @@ Value* SubstringFn(const char* name, State* state,
         return nullptr;
     }
 
-    std::string result = (haystack.find(needle) != std::string::npos) ? "t" : "";
-    return StringValue(result);
+    return StringValue(haystack.find(needle) != std::string::npos ? "t" : "");
 }
 
 Value* EqualityFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
@@ -251,6 +272,133 @@ Value* SequenceFn(const char* name, State* state, const std::vector<std::unique_
     return EvaluateValue(state, argv[1]);
 }
 
+// The updater that a branch of parallel() sees. It sends the commands of all the branches one at
+// a time, and turns their progress into that of the whole: each branch moves its share of the
+// progress bar segment that parallel() runs in.
+class ParallelBranchUpdater : public UpdaterInterface {
+ public:
+  struct Shared {
+    UpdaterInterface* updater;
+    std::mutex mutex;
+    // The progress of each branch, within its share.
+    std::vector<double> progress;
+  };
+
+  ParallelBranchUpdater(Shared* shared, size_t branch) : shared_(shared), branch_(branch) {}
+
+  void WriteToCommandPipe(const std::string_view message, bool flush) const override {
+    std::lock_guard<std::mutex> lock(shared_->mutex);
+    shared_->updater->WriteToCommandPipe(message, flush);
+  }
+
+  void UiPrint(const std::string_view message) const override {
+    std::lock_guard<std::mutex> lock(shared_->mutex);
+    shared_->updater->UiPrint(message);
+  }
+
+  void ShowProgress(double fraction, int seconds) const override {
+    // The segments belong to the script around parallel(); a branch can't start one of its own.
+    LOG(WARNING) << "Ignoring show_progress(" << fraction << ", " << seconds
+                 << ") in a branch of parallel()";
+  }
+
+  void SetProgress(double fraction, bool flush) const override {
+    std::lock_guard<std::mutex> lock(shared_->mutex);
+    shared_->progress[branch_] = fraction;
+    double total = 0;
+    for (double progress : shared_->progress) {
+      total += progress;
+    }
+    shared_->updater->SetProgress(total / shared_->progress.size(), flush);
+  }
+
+  std::string FindBlockDeviceName(const std::string_view name) const override {
+    return shared_->updater->FindBlockDeviceName(name);
+  }
+
+  UpdaterRuntimeInterface* GetRuntime() const override {
+    return shared_->updater->GetRuntime();
+  }
+  ZipArchiveHandle GetPackageHandle() const override {
+    return shared_->updater->GetPackageHandle();
+  }
+  std::string GetResult() const override {
+    return shared_->updater->GetResult();
+  }
+  uint8_t* GetMappedPackageAddress() const override {
+    return shared_->updater->GetMappedPackageAddress();
+  }
+  size_t GetMappedPackageLength() const override {
+    return shared_->updater->GetMappedPackageLength();
+  }
+  int GetPackageFd() const override {
+    return shared_->updater->GetPackageFd();
+  }
+
+ private:
+  Shared* shared_;
+  size_t branch_;
+};
+
+Value* ParallelFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
+  if (argv.empty()) {
+    return StringValue("");
+  }
+  if (state->updater == nullptr) {
+    // Nothing to share between the branches (e.g. in the tests of the language); run them in turn.
+    std::unique_ptr<Value> result;
+    for (const auto& arg : argv) {
+      result.reset(EvaluateValue(state, arg));
+      if (!result) {
+        return nullptr;
+      }
+    }
+    return result.release();
+  }
+
+  ParallelBranchUpdater::Shared shared;
+  shared.updater = state->updater;
+  shared.progress.resize(argv.size(), 0.0);
+
+  struct Branch {
+    std::unique_ptr<ParallelBranchUpdater> updater;
+    std::unique_ptr<State> state;
+    std::unique_ptr<Value> result;
+  };
+  std::vector<Branch> branches(argv.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < argv.size(); i++) {
+    Branch& branch = branches[i];
+    branch.updater = std::make_unique<ParallelBranchUpdater>(&shared, i);
+    branch.state = std::make_unique<State>(state->script, branch.updater.get());
+    branch.state->is_retry = state->is_retry;
+    branch.state->profiler = state->profiler;
+    threads.emplace_back([&branch, &arg = argv[i]]() {
+      branch.result.reset(EvaluateValue(branch.state.get(), arg));
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // Report the failure of the first branch that failed, in the order of the arguments, whichever
+  // failed first in time.
+  for (const auto& branch : branches) {
+    if (!branch.result) {
+      state->errmsg += branch.state->errmsg;
+      state->error_code = branch.state->error_code;
+      state->cause_code = branch.state->cause_code;
+      return nullptr;
+    }
+  }
+  for (const auto& branch : branches) {
+    if (branch.state->cause_code != kNoCause) {
+      state->cause_code = branch.state->cause_code;
+    }
+  }
+  return branches.back().result.release();
+}
+
 Value* LessThanIntFn(const char* name, State* state,
                      const std::vector<std::unique_ptr<Expr>>& argv) {
     if (argv.size() != 2) {
@@ -308,9 +456,29 @@ Value* GreaterThanIntFn(const char* name, State* state,
 }
 
 Value* Literal(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
-    return StringValue(name);
+    // The value refers to the interned contents of the literal, rather than copying them.
+    return new Value(Value::Type::STRING, name, nullptr);
+}
+
+// The names of the Exprs. A large script calls the same few functions (e.g. set_metadata() or
+// range_sha1()) thousands of times, and repeats the same literals (paths, digests) about as often,
+// so they're kept once each. The pool is looked up without copying the name, and under a lock, as
+// scripts may be parsed on several threads at once.
+static std::mutex name_pool_lock;
+static std::deque<std::string> name_pool;
+static std::unordered_set<std::string_view> name_pool_index;
+
+static std::string_view InternName(std::string_view name) {
+  std::lock_guard<std::mutex> lock(name_pool_lock);
+  if (auto it = name_pool_index.find(name); it != name_pool_index.end()) {
+    return *it;
+  }
+  return *name_pool_index.emplace(name_pool.emplace_back(name)).first;
 }
 
+Expr::Expr(Function fn, std::string_view name, int start, int end)
+    : fn(fn), name(InternName(name)), start(start), end(end) {}
+
 // -----------------------------------------------------------------
 //   the function table
 // -----------------------------------------------------------------
@@ -322,11 +490,8 @@ void RegisterFunction(const std::string& name, Function fn) {
 }
 
 Function FindFunction(const std::string& name) {
-    if (fn_table.find(name) == fn_table.end()) {
-        return nullptr;
-    } else {
-        return fn_table[name];
-    }
+    auto it = fn_table.find(name);
+    return it == fn_table.end() ? nullptr : it->second;
 }
 
 void RegisterBuiltins() {
@@ -334,6 +499,7 @@ void RegisterBuiltins() {
     RegisterFunction("abort", AbortFn);
     RegisterFunction("assert", AssertFn);
     RegisterFunction("concat", ConcatFn);
+    RegisterFunction("parallel", ParallelFn);
     RegisterFunction("is_substring", SubstringFn);
     RegisterFunction("stdout", StdoutFn);
     RegisterFunction("sleep", SleepFn);
@@ -362,13 +528,13 @@ bool ReadArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
     if (start + len > argv.size()) {
         return false;
     }
+    args->reserve(args->size() + len);
     for (size_t i = start; i < start + len; ++i) {
-        std::string var;
-        if (!Evaluate(state, argv[i], &var)) {
+        // Evaluated in place, so that each string is moved from its value into |args|.
+        if (!Evaluate(state, argv[i], &args->emplace_back())) {
             args->clear();
             return false;
         }
-        args->push_back(var);
     }
     return true;
 }
@@ -388,6 +554,7 @@ bool ReadValueArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
     if (len == 0 || start + len > argv.size()) {
         return false;
     }
+    args->reserve(args->size() + len);
     for (size_t i = start; i < start + len; ++i) {
         std::unique_ptr<Value> v(EvaluateValue(state, argv[i]));
         if (!v) {
@@ -21,6 +21,7 @@
 
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "edify/updater_interface.h"
@@ -29,6 +30,8 @@
 enum ErrorCode : int;
 enum CauseCode : int;
 
+class ScriptProfiler;
+
 struct State {
   State(const std::string& script, UpdaterInterface* cookie);
 
@@ -52,6 +55,9 @@ struct State {
   CauseCode cause_code;
 
   bool is_retry = false;
+
+  // Records the time and the I/O of the statements and the builtin calls, if set.
+  ScriptProfiler* profiler = nullptr;
 };
 
 struct Value {
@@ -60,10 +66,42 @@ struct Value {
     BLOB = 2,
   };
 
-  Value(Type type, std::string str) : type(type), data(std::move(str)) {}
+  Value(Type type, std::string str) : type(type), owned_(std::move(str)) {}
+
+  // A BLOB that refers to |bytes| instead of holding a copy of them, e.g. an entry stored in the
+  // mapped package, or a slice of a buffer shared with other values. |owner|, if any, keeps the
+  // bytes valid for as long as the value (or a copy of it) refers to them; without one, they must
+  // outlive the value.
+  Value(std::string_view bytes, std::shared_ptr<const void> owner)
+      : Value(Type::BLOB, bytes, std::move(owner)) {}
+  // The same, for a value of any |type|, e.g. a STRING that refers to a literal of the script.
+  Value(Type type, std::string_view bytes, std::shared_ptr<const void> owner)
+      : type(type), shared_(bytes), owner_(std::move(owner)), is_shared_(true) {}
+
+  // The contents of the value.
+  std::string_view data() const {
+    return is_shared_ ? shared_ : std::string_view(owned_);
+  }
+
+  // Returns the contents as a string of the value's own, which the caller may change (or move
+  // out). A value that refers to shared bytes copies them first, and drops its reference.
+  std::string& MutableData() {
+    if (is_shared_) {
+      owned_.assign(shared_);
+      shared_ = {};
+      owner_.reset();
+      is_shared_ = false;
+    }
+    return owned_;
+  }
 
   Type type;
-  std::string data;
+
+ private:
+  std::string owned_;
+  std::string_view shared_;
+  std::shared_ptr<const void> owner_;
+  bool is_shared_{ false };
 };
 
 struct Expr;
@@ -72,16 +110,16 @@ using Function = Value* (*)(const char* name, State* state,
                             const std::vector<std::unique_ptr<Expr>>& argv);
 
 struct Expr {
+  // Resolved by the parser, which fails on an unknown function: a script never starts running
+  // with a call that can't be made, even in a branch that it wouldn't take.
   Function fn;
-  std::string name;
+  // The name of the function, or the contents of a literal. It's interned: the Exprs with the same
+  // name share it, and it stays valid (and NUL-terminated) for as long as the process runs.
+  std::string_view name;
   std::vector<std::unique_ptr<Expr>> argv;
   int start, end;
 
-  Expr(Function fn, const std::string& name, int start, int end) :
-    fn(fn),
-    name(name),
-    start(start),
-    end(end) {}
+  Expr(Function fn, std::string_view name, int start, int end);
 };
 
 // Evaluate the input expr, return the resulting Value.
@@ -112,6 +150,13 @@ Value* IfElseFn(const char* name, State* state, const std::vector<std::unique_pt
 Value* AssertFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv);
 Value* AbortFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv);
 
+// parallel(expr, ...) evaluates its arguments at the same time, each on a thread of its own, and
+// returns the value of the last one. The arguments must not depend on each other, e.g. the
+// block_image_update() of different partitions. If any of them fails, parallel() fails with the
+// error of the first one that failed (in the order of the arguments), once they're all done. Each
+// argument moves its share of the progress bar; show_progress() is ignored in them.
+Value* ParallelFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv);
+
 // Register a new function.  The same Function may be registered under
 // multiple names, but a given name should only be used once.
 void RegisterFunction(const std::string& name, Function fn);
@@ -152,7 +197,8 @@ Value* ErrorAbort(State* state, CauseCode cause_code, const char* format, ...)
 // Copying the string into a Value.
 Value* StringValue(const char* str);
 
-Value* StringValue(const std::string& str);
+// Moving the string into a Value.
+Value* StringValue(std::string str);
 
 int ParseString(const std::string& str, std::unique_ptr<Expr>* root, int* error_count);
 
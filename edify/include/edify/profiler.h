@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Expr;
+
+// ScriptProfiler records where the evaluation of a script goes: the wall time, the CPU time and the
+// bytes read from and written to storage, for each top-level statement (those chained by ';') and
+// each call of a builtin function, attributed to its place in the script. The CPU time and the I/O
+// are those of the whole process, so that the worker threads of a builtin (e.g. the ones of
+// block_image_update()) count towards it. The numbers of a call include those of the calls in its
+// arguments.
+//
+// It's enabled by setting State::profiler, and can be shared by the States of parallel().
+class ScriptProfiler {
+ public:
+  // The usage of the process at a point of the evaluation.
+  struct Sample {
+    uint64_t wall_ns = 0;
+    uint64_t cpu_ns = 0;
+    uint64_t read_bytes = 0;
+    uint64_t write_bytes = 0;
+  };
+
+  // The usage of what's profiled, between two samples.
+  struct Usage {
+    size_t calls = 0;
+    uint64_t wall_ns = 0;
+    uint64_t cpu_ns = 0;
+    uint64_t read_bytes = 0;
+    uint64_t write_bytes = 0;
+
+    void Add(const Sample& begin, const Sample& end);
+  };
+
+  // Profiles |script|, parsed into |root|.
+  ScriptProfiler(const std::string& script, const Expr* root);
+
+  static Sample Now();
+
+  // Returns whether the evaluation of |expr| gets recorded: it's a top-level statement, or the call
+  // of a builtin.
+  bool Profiles(const Expr* expr) const;
+
+  // Records that the evaluation of |expr| started at |begin| and ended at |end|.
+  void Record(const Expr* expr, const Sample& begin, const Sample& end);
+
+  // Returns the report of the profile, a line per statement in the order of the script, then per
+  // builtin and per call for the ones that took the longest.
+  std::string Summary() const;
+
+ private:
+  // The line and column of |offset| in the script, and the source from there (shortened).
+  std::string Describe(int offset, int end) const;
+
+  const std::string& script_;
+  // The offsets of the starts of the lines of the script.
+  std::vector<int> line_starts_;
+  // The index in |statements_| of each top-level statement.
+  std::unordered_map<const Expr*, size_t> statement_index_;
+
+  mutable std::mutex mutex_;
+  std::vector<std::pair<const Expr*, Usage>> statements_;
+  std::map<std::string, Usage, std::less<>> builtins_;
+  std::unordered_map<const Expr*, Usage> calls_;
+};
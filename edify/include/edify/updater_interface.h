@@ -36,6 +36,14 @@ class UpdaterInterface {
   // Sends over the message to recovery to print it on the screen.
   virtual void UiPrint(const std::string_view message) const = 0;
 
+  // Tells recovery to fill up the next |fraction| of the progress bar over |seconds| seconds, or
+  // as SetProgress() moves it if |seconds| is zero.
+  virtual void ShowProgress(double fraction, int seconds) const = 0;
+
+  // Tells recovery to set the progress bar to |fraction| of the segment of the last
+  // ShowProgress().
+  virtual void SetProgress(double fraction, bool flush = false) const = 0;
+
   // Given the name of the block device, returns |name| for updates on the device; or the file path
   // to the fake block device for simulations.
   virtual std::string FindBlockDeviceName(const std::string_view name) const = 0;
@@ -45,4 +53,6 @@ class UpdaterInterface {
   virtual std::string GetResult() const = 0;
   virtual uint8_t* GetMappedPackageAddress() const = 0;
   virtual size_t GetMappedPackageLength() const = 0;
+  // Returns the file that the package is mapped from, or -1 if it's mapped from a block map.
+  virtual int GetPackageFd() const = 0;
 };
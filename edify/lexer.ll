@@ -22,14 +22,15 @@
 #include "yydefs.h"
 #include "parser.h"
 
-int gLine = 1;
-int gColumn = 1;
-int gPos = 0;
+#define ADVANCE do {yylloc->start=yyextra->pos; yylloc->end=yyextra->pos+yyleng; \
+                    yyextra->column+=yyleng; yyextra->pos+=yyleng;} while(0)
 
-std::string string_buffer;
+#define ADVANCE_STR(c) do {yyextra->column+=yyleng; yyextra->pos+=yyleng; \
+                           yyextra->string_buffer.push_back(c);} while(0)
 
-#define ADVANCE do {yylloc.start=gPos; yylloc.end=gPos+yyleng; \
-                    gColumn+=yyleng; gPos+=yyleng;} while(0)
+// Hands a STRING token to the parser, with its text constructed from the arguments.
+#define RETURN_STRING(...) do {yylval->str = &yyextra->tokens.emplace_back(__VA_ARGS__); \
+                               return STRING;} while(0)
 
 %}
 
@@ -38,52 +39,55 @@ std::string string_buffer;
 %option noinput
 %option nounput
 %option noyywrap
+%option reentrant
+%option bison-bridge
+%option bison-locations
+%option extra-type="ParseState*"
 
 %%
 
 
 \" {
     BEGIN(STR);
-    string_buffer.clear();
-    yylloc.start = gPos;
-    ++gColumn;
-    ++gPos;
+    yyextra->string_buffer.clear();
+    yylloc->start = yyextra->pos;
+    ++yyextra->column;
+    ++yyextra->pos;
 }
 
 <STR>{
   \" {
-      ++gColumn;
-      ++gPos;
+      ++yyextra->column;
+      ++yyextra->pos;
       BEGIN(INITIAL);
-      yylval.str = strdup(string_buffer.c_str());
-      yylloc.end = gPos;
-      return STRING;
+      yylloc->end = yyextra->pos;
+      RETURN_STRING(yyextra->string_buffer);
   }
 
-  \\n   { gColumn += yyleng; gPos += yyleng; string_buffer.push_back('\n'); }
-  \\t   { gColumn += yyleng; gPos += yyleng; string_buffer.push_back('\t'); }
-  \\\"  { gColumn += yyleng; gPos += yyleng; string_buffer.push_back('\"'); }
-  \\\\  { gColumn += yyleng; gPos += yyleng; string_buffer.push_back('\\'); }
+  \\n   ADVANCE_STR('\n');
+  \\t   ADVANCE_STR('\t');
+  \\\"  ADVANCE_STR('\"');
+  \\\\  ADVANCE_STR('\\');
 
   \\x[0-9a-fA-F]{2} {
-      gColumn += yyleng;
-      gPos += yyleng;
+      yyextra->column += yyleng;
+      yyextra->pos += yyleng;
       int val;
       sscanf(yytext+2, "%x", &val);
-      string_buffer.push_back(static_cast<char>(val));
+      yyextra->string_buffer.push_back(static_cast<char>(val));
   }
 
   \n {
-      ++gLine;
-      ++gPos;
-      gColumn = 1;
-      string_buffer.push_back(yytext[0]);
+      ++yyextra->line;
+      ++yyextra->pos;
+      yyextra->column = 1;
+      yyextra->string_buffer.push_back(yytext[0]);
   }
 
   . {
-      ++gColumn;
-      ++gPos;
-      string_buffer.push_back(yytext[0]);
+      ++yyextra->column;
+      ++yyextra->pos;
+      yyextra->string_buffer.push_back(yytext[0]);
   }
 }
 
@@ -94,8 +98,7 @@ endif             ADVANCE; return ENDIF;
 
 [a-zA-Z0-9_:/.]+ {
   ADVANCE;
-  yylval.str = strdup(yytext);
-  return STRING;
+  RETURN_STRING(yytext, yyleng);
 }
 
 \&\&              ADVANCE; return AND;
@@ -107,6 +110,6 @@ endif             ADVANCE; return ENDIF;
 
 [ \t]+            ADVANCE;
 
-(#.*)?\n          gPos += yyleng; ++gLine; gColumn = 1;
+(#.*)?\n          yyextra->pos += yyleng; ++yyextra->line; yyextra->column = 1;
 
 .                 return BAD;
@@ -27,18 +27,16 @@
 #include <android-base/macros.h>
 
 #include "edify/expr.h"
-#include "yydefs.h"
 #include "parser.h"
 
-extern int gLine;
-extern int gColumn;
-
-void yyerror(std::unique_ptr<Expr>* root, int* error_count, const char* s);
-int yyparse(std::unique_ptr<Expr>* root, int* error_count);
+void yyerror(YYLTYPE* loc, yyscan_t scanner, std::unique_ptr<Expr>* root, int* error_count,
+             const char* s);
 
 struct yy_buffer_state;
-void yy_switch_to_buffer(struct yy_buffer_state* new_buffer);
-struct yy_buffer_state* yy_scan_string(const char* yystr);
+struct yy_buffer_state* yy_scan_string(const char* yystr, yyscan_t scanner);
+int yylex_init_extra(ParseState* state, yyscan_t* scanner);
+int yylex_destroy(yyscan_t scanner);
+ParseState* yyget_extra(yyscan_t scanner);
 
 // Convenience function for building expressions with a fixed number
 // of arguments.
@@ -55,10 +53,19 @@ static Expr* Build(Function fn, YYLTYPE loc, size_t count, ...) {
 
 %}
 
+%code requires {
+#include "yydefs.h"
+}
+
+%code provides {
+int yylex(YYSTYPE* lval, YYLTYPE* lloc, yyscan_t scanner);
+}
+
 %locations
+%define api.pure full
 
 %union {
-    char* str;
+    const std::string* str;
     Expr* expr;
     std::vector<std::unique_ptr<Expr>>* args;
 }
@@ -71,6 +78,8 @@ static Expr* Build(Function fn, YYLTYPE loc, size_t count, ...) {
 %destructor { delete $$; } expr
 %destructor { delete $$; } arglist
 
+%lex-param {yyscan_t scanner}
+%parse-param {yyscan_t scanner}
 %parse-param {std::unique_ptr<Expr>* root}
 %parse-param {int* error_count}
 %define parse.error verbose
@@ -90,7 +99,7 @@ input:  expr           { root->reset($1); }
 ;
 
 expr:  STRING {
-    $$ = new Expr(Literal, $1, @$.start, @$.end);
+    $$ = new Expr(Literal, *$1, @$.start, @$.end);
 }
 |  '(' expr ')'                      { $$ = $2; $$->start=@$.start; $$->end=@$.end; }
 |  expr ';'                          { $$ = $1; $$->start=@1.start; $$->end=@1.end; }
@@ -105,14 +114,17 @@ expr:  STRING {
 |  IF expr THEN expr ENDIF           { $$ = Build(IfElseFn, @$, 2, $2, $4); }
 |  IF expr THEN expr ELSE expr ENDIF { $$ = Build(IfElseFn, @$, 3, $2, $4, $6); }
 | STRING '(' arglist ')' {
-    Function fn = FindFunction($1);
+    Function fn = FindFunction(*$1);
     if (fn == nullptr) {
-        std::string msg = "unknown function \"" + std::string($1) + "\"";
-        yyerror(root, error_count, msg.c_str());
+        std::string msg = "unknown function \"" + *$1 + "\"";
+        yyerror(&@$, scanner, root, error_count, msg.c_str());
+        // YYERROR drops the symbols of the rule without running their destructors.
+        delete $3;
         YYERROR;
     }
-    $$ = new Expr(fn, $1, @$.start, @$.end);
+    $$ = new Expr(fn, *$1, @$.start, @$.end);
     $$->argv = std::move(*$3);
+    delete $3;
 }
 ;
 
@@ -131,15 +143,26 @@ arglist:    /* empty */ {
 
 %%
 
-void yyerror(std::unique_ptr<Expr>* root, int* error_count, const char* s) {
+void yyerror(YYLTYPE* loc, yyscan_t scanner, std::unique_ptr<Expr>* root, int* error_count,
+             const char* s) {
   if (strlen(s) == 0) {
     s = "syntax error";
   }
-  printf("line %d col %d: %s\n", gLine, gColumn, s);
+  const ParseState* state = yyget_extra(scanner);
+  printf("line %d col %d: %s\n", state->line, state->column, s);
   ++*error_count;
 }
 
 int ParseString(const std::string& str, std::unique_ptr<Expr>* root, int* error_count) {
-  yy_switch_to_buffer(yy_scan_string(str.c_str()));
-  return yyparse(root, error_count);
+  ParseState state;
+  yyscan_t scanner;
+  if (yylex_init_extra(&state, &scanner) != 0) {
+    printf("failed to create the scanner\n");
+    ++*error_count;
+    return 1;
+  }
+  yy_scan_string(str.c_str(), scanner);
+  int result = yyparse(scanner, root, error_count);
+  yylex_destroy(scanner);
+  return result;
 }
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "edify/profiler.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string_view>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+#include "edify/expr.h"
+
+// The calls that Summary() lists one by one, besides the totals per builtin.
+static constexpr size_t kSlowestCalls = 10;
+// The source that Summary() shows for a statement or a call, at most.
+static constexpr size_t kMaxSourceLength = 60;
+
+static uint64_t NowNs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void ScriptProfiler::Usage::Add(const Sample& begin, const Sample& end) {
+  calls++;
+  wall_ns += end.wall_ns - begin.wall_ns;
+  cpu_ns += end.cpu_ns - begin.cpu_ns;
+  read_bytes += end.read_bytes - begin.read_bytes;
+  write_bytes += end.write_bytes - begin.write_bytes;
+}
+
+ScriptProfiler::ScriptProfiler(const std::string& script, const Expr* root) : script_(script) {
+  line_starts_.push_back(0);
+  for (size_t i = 0; i < script.size(); i++) {
+    if (script[i] == '\n') {
+      line_starts_.push_back(i + 1);
+    }
+  }
+
+  // "a; b; c" parses into SequenceFn(SequenceFn(a, b), c).
+  std::vector<const Expr*> statements;
+  for (const Expr* expr = root; expr != nullptr;) {
+    if (expr->fn == SequenceFn && expr->argv.size() == 2) {
+      statements.push_back(expr->argv[1].get());
+      expr = expr->argv[0].get();
+    } else {
+      statements.push_back(expr);
+      expr = nullptr;
+    }
+  }
+  std::reverse(statements.begin(), statements.end());
+  for (const Expr* statement : statements) {
+    statement_index_.emplace(statement, statements_.size());
+    statements_.emplace_back(statement, Usage{});
+  }
+}
+
+ScriptProfiler::Sample ScriptProfiler::Now() {
+  Sample sample;
+  sample.wall_ns = NowNs(CLOCK_MONOTONIC);
+  sample.cpu_ns = NowNs(CLOCK_PROCESS_CPUTIME_ID);
+  // The bytes that the process made the storage read and write (not those served by the cache).
+  std::string io;
+  if (android::base::ReadFileToString("/proc/self/io", &io)) {
+    for (const auto& line : android::base::Split(io, "\n")) {
+      std::string_view value = line;
+      if (android::base::ConsumePrefix(&value, "read_bytes: ")) {
+        android::base::ParseUint(std::string(value), &sample.read_bytes);
+      } else if (android::base::ConsumePrefix(&value, "write_bytes: ")) {
+        android::base::ParseUint(std::string(value), &sample.write_bytes);
+      }
+    }
+  }
+  return sample;
+}
+
+bool ScriptProfiler::Profiles(const Expr* expr) const {
+  return (expr->fn != Literal && expr->name != "(operator)") || statement_index_.count(expr) != 0;
+}
+
+void ScriptProfiler::Record(const Expr* expr, const Sample& begin, const Sample& end) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (auto it = statement_index_.find(expr); it != statement_index_.end()) {
+    statements_[it->second].second.Add(begin, end);
+  }
+  if (expr->fn != Literal && expr->name != "(operator)") {
+    auto it = builtins_.find(expr->name);
+    if (it == builtins_.end()) {
+      it = builtins_.emplace(std::string(expr->name), Usage{}).first;
+    }
+    it->second.Add(begin, end);
+    calls_[expr].Add(begin, end);
+  }
+}
+
+std::string ScriptProfiler::Describe(int offset, int end) const {
+  size_t line = std::upper_bound(line_starts_.begin(), line_starts_.end(), offset) -
+                line_starts_.begin();
+  size_t length = std::max(end - offset, 0);
+  std::string source = script_.substr(offset, std::min(length, kMaxSourceLength));
+  std::replace(source.begin(), source.end(), '\n', ' ');
+  return android::base::StringPrintf("%zu:%d %s%s", line, offset - line_starts_[line - 1] + 1,
+                                     source.c_str(), length > kMaxSourceLength ? "..." : "");
+}
+
+static std::string FormatUsage(const ScriptProfiler::Usage& usage) {
+  return android::base::StringPrintf("%8.3fs wall %8.3fs cpu %10.1fMiB read %10.1fMiB written",
+                                     usage.wall_ns / 1e9, usage.cpu_ns / 1e9,
+                                     usage.read_bytes / 1048576.0, usage.write_bytes / 1048576.0);
+}
+
+std::string ScriptProfiler::Summary() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string summary = "Script profile, by statement:\n";
+  for (const auto& [statement, usage] : statements_) {
+    if (usage.calls == 0) {
+      continue;
+    }
+    summary += "  " + FormatUsage(usage) + "  " + Describe(statement->start, statement->end) + "\n";
+  }
+
+  std::vector<std::pair<std::string_view, Usage>> builtins(builtins_.begin(), builtins_.end());
+  std::stable_sort(builtins.begin(), builtins.end(),
+                   [](const auto& a, const auto& b) { return a.second.wall_ns > b.second.wall_ns; });
+  summary += "By builtin:\n";
+  for (const auto& [name, usage] : builtins) {
+    summary += android::base::StringPrintf("  %s %6zu calls  %.*s\n", FormatUsage(usage).c_str(),
+                                           usage.calls, static_cast<int>(name.size()),
+                                           name.data());
+  }
+
+  std::vector<std::pair<const Expr*, Usage>> calls(calls_.begin(), calls_.end());
+  std::sort(calls.begin(), calls.end(), [](const auto& a, const auto& b) {
+    return a.second.wall_ns != b.second.wall_ns ? a.second.wall_ns > b.second.wall_ns
+                                                : a.first->start < b.first->start;
+  });
+  calls.resize(std::min(calls.size(), kSlowestCalls));
+  summary += "Slowest calls:\n";
+  for (const auto& [call, usage] : calls) {
+    summary += "  " + FormatUsage(usage) + "  " + Describe(call->start, call->end) + "\n";
+  }
+  return summary;
+}
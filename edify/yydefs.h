@@ -17,6 +17,9 @@
 #ifndef _YYDEFS_H_
 #define _YYDEFS_H_
 
+#include <deque>
+#include <string>
+
 #define YYLTYPE YYLTYPE
 typedef struct {
     int start, end;
@@ -33,6 +36,23 @@ typedef struct {
         } \
     } while (0)
 
-int yylex();
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void* yyscan_t;
+#endif
+
+// The state of one ParseString() call, as the extra data of its (reentrant) scanner, so that
+// scripts can be parsed on several threads at once.
+struct ParseState {
+  int line = 1;
+  int column = 1;
+  int pos = 0;
+  // The contents of the string literal being scanned.
+  std::string string_buffer;
+  // The text of the STRING tokens, which the parser refers to until it builds their Exprs. A deque
+  // doesn't move its elements as it grows, and most tokens fit in the string itself, so a token
+  // takes no allocation of its own and is freed with the parse, including on a syntax error.
+  std::deque<std::string> tokens;
+};
 
 #endif
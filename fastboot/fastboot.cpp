@@ -24,10 +24,10 @@
 #include <vector>
 
 #include <android-base/logging.h>
-#include <android-base/properties.h>
 #include <android-base/strings.h>
 #include <bootloader_message/bootloader_message.h>
 
+#include "otautil/device_info.h"
 #include "recovery_ui/ui.h"
 
 static const std::vector<std::pair<std::string, Device::BuiltinAction>> kFastbootMenuActions{
@@ -38,11 +38,14 @@ static const std::vector<std::pair<std::string, Device::BuiltinAction>> kFastboo
 };
 
 void FillDefaultFastbootLines(std::vector<std::string>& title_lines) {
-  std::string bootloader_version = android::base::GetProperty("ro.bootloader", "");
-  std::string baseband_version = android::base::GetProperty("ro.build.expect.baseband", "");
-  std::string hw_version = android::base::GetProperty(
-      "ro.boot.hardware.revision", android::base::GetProperty("ro.revision", ""));
-  title_lines.push_back("Product name - " + android::base::GetProperty("ro.product.device", ""));
+  const DeviceInfo& info = DeviceInfo::Get();
+  std::string bootloader_version = info.GetProperty("ro.bootloader");
+  std::string baseband_version = info.GetProperty("ro.build.expect.baseband");
+  std::string hw_version = info.GetProperty("ro.boot.hardware.revision");
+  if (hw_version.empty()) {
+    hw_version = info.GetProperty("ro.revision");
+  }
+  title_lines.push_back("Product name - " + info.GetProperty("ro.product.device"));
   if (!android::base::EqualsIgnoreCase(bootloader_version, "unknown")) {
     title_lines.push_back("Bootloader version - " + bootloader_version);
   }
@@ -50,25 +53,26 @@ void FillDefaultFastbootLines(std::vector<std::string>& title_lines) {
     title_lines.push_back("Baseband version - " + baseband_version);
   }
   title_lines.push_back(std::string("Secure boot - ") +
-                        ((android::base::GetProperty("ro.secure", "") == "1") ? "yes" : "no"));
+                        ((info.GetProperty("ro.secure") == "1") ? "yes" : "no"));
   if (!android::base::EqualsIgnoreCase(hw_version, "0")) {
     title_lines.push_back("HW version - " + hw_version);
   }
 }
 
 void FillWearableFastbootLines(std::vector<std::string>& title_lines) {
+  const DeviceInfo& info = DeviceInfo::Get();
   title_lines.push_back("Android Fastboot");
-  title_lines.push_back(android::base::GetProperty("ro.product.device", "") + " - " +
-                        android::base::GetProperty("ro.revision", ""));
-  title_lines.push_back(android::base::GetProperty("ro.bootloader", ""));
+  title_lines.push_back(info.GetProperty("ro.product.device") + " - " +
+                        info.GetProperty("ro.revision"));
+  title_lines.push_back(info.GetProperty("ro.bootloader"));
 
   const size_t max_baseband_len = 24;
-  const std::string& baseband = android::base::GetProperty("ro.build.expect.baseband", "");
+  const std::string& baseband = info.GetProperty("ro.build.expect.baseband");
   title_lines.push_back(baseband.length() > max_baseband_len
                             ? baseband.substr(0, max_baseband_len - 3) + "..."
                             : baseband);
 
-  title_lines.push_back("Serial #: " + android::base::GetProperty("ro.serialno", ""));
+  title_lines.push_back("Serial #: " + info.GetProperty("ro.serialno"));
 }
 
 Device::BuiltinAction StartFastboot(Device* device, const std::vector<std::string>& /* args */) {
@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "block_cache.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+// Slabs are about this size, but always hold at least one block.
+static constexpr size_t kSlabSize = 1024 * 1024;
+
+BlockCache::BlockCache(uint32_t block_size, uint32_t file_blocks, uint32_t max_blocks)
+    : block_size_(block_size),
+      max_blocks_(std::min(max_blocks, file_blocks)),
+      slab_slots_(std::max<uint32_t>(1, kSlabSize / block_size)) {
+  if (max_blocks_ > 0) {
+    slot_of_block_.resize(file_blocks, kNoSlot);
+  }
+}
+
+uint8_t* BlockCache::SlotData(uint32_t slot) const {
+  return slabs_[slot / slab_slots_].get() + static_cast<size_t>(slot % slab_slots_) * block_size_;
+}
+
+void BlockCache::Unlink(uint32_t slot) {
+  Slot& s = slots_[slot];
+  if (s.prev != kNoSlot) {
+    slots_[s.prev].next = s.next;
+  } else {
+    lru_head_ = s.next;
+  }
+  if (s.next != kNoSlot) {
+    slots_[s.next].prev = s.prev;
+  } else {
+    lru_tail_ = s.prev;
+  }
+  s.prev = s.next = kNoSlot;
+}
+
+void BlockCache::PushFront(uint32_t slot) {
+  Slot& s = slots_[slot];
+  s.prev = kNoSlot;
+  s.next = lru_head_;
+  if (lru_head_ != kNoSlot) {
+    slots_[lru_head_].prev = slot;
+  }
+  lru_head_ = slot;
+  if (lru_tail_ == kNoSlot) {
+    lru_tail_ = slot;
+  }
+}
+
+uint32_t BlockCache::AllocateSlot() {
+  if (size_ < max_blocks_) {
+    uint32_t slot = slots_.size();
+    if (slot % slab_slots_ == 0) {
+      size_t slab_blocks = std::min(slab_slots_, max_blocks_ - slot);
+      slabs_.emplace_back(new uint8_t[slab_blocks * block_size_]);
+    }
+    slots_.push_back({ 0, kNoSlot, kNoSlot, false });
+    size_++;
+    return slot;
+  }
+
+  uint32_t slot = lru_tail_;
+  CHECK_NE(slot, kNoSlot);
+  Unlink(slot);
+  slot_of_block_[slots_[slot].block] = kNoSlot;
+  evictions_++;
+  return slot;
+}
+
+void BlockCache::MoveSlot(uint32_t from, uint32_t to) {
+  Slot s = slots_[from];
+  slots_[to] = s;
+  memcpy(SlotData(to), SlotData(from), block_size_);
+  slot_of_block_[s.block] = to;
+  if (s.pinned) {
+    return;
+  }
+  if (s.prev != kNoSlot) {
+    slots_[s.prev].next = to;
+  } else {
+    lru_head_ = to;
+  }
+  if (s.next != kNoSlot) {
+    slots_[s.next].prev = to;
+  } else {
+    lru_tail_ = to;
+  }
+}
+
+void BlockCache::Shrink(uint32_t max_blocks) {
+  max_blocks = std::max(max_blocks, pinned_ + 1);
+  if (max_blocks >= max_blocks_) {
+    return;
+  }
+  max_blocks_ = max_blocks;
+
+  // Evict down to the new size, then move the blocks left in the slots past it into the slots
+  // freed below it. The slots in use are then all below |size_|, as AllocateSlot() expects.
+  std::vector<bool> in_use(slots_.size(), true);
+  std::vector<uint32_t> holes;
+  while (size_ > max_blocks_) {
+    uint32_t slot = lru_tail_;
+    CHECK_NE(slot, kNoSlot);
+    Unlink(slot);
+    slot_of_block_[slots_[slot].block] = kNoSlot;
+    in_use[slot] = false;
+    size_--;
+    evictions_++;
+  }
+  for (uint32_t slot = 0; slot < size_; slot++) {
+    if (!in_use[slot]) {
+      holes.push_back(slot);
+    }
+  }
+  for (uint32_t slot = size_; slot < slots_.size(); slot++) {
+    if (in_use[slot]) {
+      MoveSlot(slot, holes.back());
+      holes.pop_back();
+    }
+  }
+  slots_.resize(size_);
+  slabs_.resize((size_ + slab_slots_ - 1) / slab_slots_);
+}
+
+const uint8_t* BlockCache::Lookup(uint32_t block) {
+  if (!Contains(block)) {
+    return nullptr;
+  }
+  uint32_t slot = slot_of_block_[block];
+  if (!slots_[slot].pinned) {
+    Unlink(slot);
+    PushFront(slot);
+  }
+  hits_++;
+  return SlotData(slot);
+}
+
+bool BlockCache::Fetch(uint32_t block, uint8_t* data) {
+  const uint8_t* cached = Lookup(block);
+  if (cached == nullptr) {
+    misses_++;
+    return false;
+  }
+  memcpy(data, cached, block_size_);
+  return true;
+}
+
+void BlockCache::Enter(uint32_t block, const uint8_t* data) {
+  if (max_blocks_ == 0 || block >= slot_of_block_.size()) {
+    return;
+  }
+  uint32_t slot = slot_of_block_[block];
+  if (slot != kNoSlot) {
+    if (slots_[slot].pinned) {
+      memcpy(SlotData(slot), data, block_size_);
+      return;
+    }
+    Unlink(slot);
+  } else {
+    slot = AllocateSlot();
+    slots_[slot].block = block;
+    slot_of_block_[block] = slot;
+  }
+  memcpy(SlotData(slot), data, block_size_);
+  PushFront(slot);
+}
+
+bool BlockCache::Pin(uint32_t block, const uint8_t* data) {
+  if (block >= slot_of_block_.size()) {
+    return false;
+  }
+  uint32_t slot = slot_of_block_[block];
+  if (slot == kNoSlot || !slots_[slot].pinned) {
+    if (pinned_ + 1 >= max_blocks_) {
+      return false;
+    }
+    Enter(block, data);
+    slot = slot_of_block_[block];
+    Unlink(slot);
+    slots_[slot].pinned = true;
+    pinned_++;
+    return true;
+  }
+  memcpy(SlotData(slot), data, block_size_);
+  return true;
+}
@@ -16,23 +16,33 @@
 
 #include "fuse_provider.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <functional>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <openssl/sha.h>
 
 #include "fuse_sideload.h"
+#include "otautil/print_sha1.h"
 #include "otautil/sysutil.h"
 
+// Spill files are named sideload-<file size>-<block size>-<SHA-256 of the first block>.spill.
+static constexpr const char* kSpillFilePrefix = "sideload-";
+static constexpr const char* kSpillFileSuffix = ".spill";
+
 FuseFileDataProvider::FuseFileDataProvider(const std::string& path, uint32_t block_size) {
   struct stat sb;
   if (stat(path.c_str(), &sb) == -1) {
@@ -158,3 +168,160 @@ std::unique_ptr<FuseDataProvider> FuseBlockDataProvider::CreateFromBlockMap(
 void FuseBlockDataProvider::Close() {
   fd_.reset();
 }
+
+FuseSpillDataProvider::FuseSpillDataProvider(std::unique_ptr<FuseDataProvider> source,
+                                             android::base::unique_fd&& fd, std::string path,
+                                             std::vector<bool> spilled)
+    : FuseDataProvider(source->file_size(), source->fuse_block_size()),
+      source_(std::move(source)),
+      fd_(std::move(fd)),
+      path_(std::move(path)),
+      file_blocks_(spilled.size()),
+      spilled_(std::move(spilled)) {}
+
+void FuseSpillDataProvider::RemoveSpillFiles(const std::string& spill_dir) {
+  std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(spill_dir.c_str()), closedir);
+  if (!dir) {
+    return;
+  }
+  dirent* de;
+  while ((de = readdir(dir.get())) != nullptr) {
+    std::string name = de->d_name;
+    if (android::base::StartsWith(name, kSpillFilePrefix) &&
+        android::base::EndsWith(name, kSpillFileSuffix)) {
+      std::string path = spill_dir + "/" + name;
+      if (unlink(path.c_str()) == -1) {
+        PLOG(WARNING) << "Failed to remove " << path;
+      }
+    }
+  }
+}
+
+std::unique_ptr<FuseDataProvider> FuseSpillDataProvider::Create(
+    std::unique_ptr<FuseDataProvider> source, const std::string& spill_dir) {
+  uint64_t file_size = source->file_size();
+  uint32_t block_size = source->fuse_block_size();
+  if (!source->Valid() || file_size == 0 || block_size == 0 ||
+      (file_size - 1) / block_size >= UINT32_MAX) {
+    return source;
+  }
+  uint32_t file_blocks = (file_size - 1) / block_size + 1;
+
+  // The first block names the spill file. It's fetched from the source, and kept.
+  uint32_t first_block_size = std::min<uint64_t>(file_size, block_size);
+  std::vector<uint8_t> first_block(first_block_size);
+  if (!source->ReadBlockAlignedData(first_block.data(), first_block_size, 0)) {
+    return source;
+  }
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(first_block.data(), first_block_size, digest);
+  std::string path = android::base::StringPrintf(
+      "%s/%s%" PRIu64 "-%" PRIu32 "-%s%s", spill_dir.c_str(), kSpillFilePrefix, file_size,
+      block_size, print_hex(digest, sizeof(digest)).c_str(), kSpillFileSuffix);
+
+  uint64_t data_size = static_cast<uint64_t>(file_blocks) * block_size;
+  uint64_t spill_size = data_size + file_blocks;
+  std::vector<bool> spilled(file_blocks, false);
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDWR | O_CLOEXEC)));
+  struct stat sb;
+  std::vector<uint8_t> markers(file_blocks);
+  if (fd != -1 && fstat(fd, &sb) == 0 && static_cast<uint64_t>(sb.st_size) == spill_size &&
+      android::base::ReadFullyAtOffset(fd, markers.data(), markers.size(), data_size)) {
+    for (uint32_t i = 0; i < file_blocks; i++) {
+      spilled[i] = markers[i] != 0;
+    }
+    LOG(INFO) << "Resuming from " << path << " with "
+              << std::count(spilled.begin(), spilled.end(), true) << " of " << file_blocks
+              << " blocks";
+  } else {
+    // Only one package is spilled at a time; drop whatever is left of the previous one.
+    fd.reset();
+    RemoveSpillFiles(spill_dir);
+
+    struct statvfs vfs;
+    if (statvfs(spill_dir.c_str(), &vfs) == -1) {
+      PLOG(WARNING) << "Failed to statvfs " << spill_dir << ", not spilling";
+      return source;
+    }
+    if (static_cast<uint64_t>(vfs.f_bavail) * vfs.f_frsize < spill_size) {
+      LOG(WARNING) << "Not enough space in " << spill_dir << " to spill " << spill_size
+                   << " bytes";
+      return source;
+    }
+    fd.reset(TEMP_FAILURE_RETRY(
+        open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)));
+    if (fd == -1 || ftruncate(fd, spill_size) == -1) {
+      PLOG(WARNING) << "Failed to create " << path << ", not spilling";
+      unlink(path.c_str());
+      return source;
+    }
+  }
+
+  auto provider = std::unique_ptr<FuseSpillDataProvider>(
+      new FuseSpillDataProvider(std::move(source), std::move(fd), path, std::move(spilled)));
+  if (!provider->spilled_[0]) {
+    provider->Spill(first_block.data(), first_block_size, 0, 1);
+  }
+  return provider;
+}
+
+void FuseSpillDataProvider::Spill(const uint8_t* data, uint32_t size, uint32_t start_block,
+                                  uint32_t count) const {
+  // A failed write only costs a refetch after the next interruption; the read itself goes on.
+  uint64_t offset = static_cast<uint64_t>(start_block) * fuse_block_size_;
+  if (!android::base::WriteFullyAtOffset(fd_, data, size, offset)) {
+    PLOG(WARNING) << "Failed to spill " << size << " bytes at offset " << offset;
+    return;
+  }
+  // The markers go after the data, so that an interrupted write leaves the blocks unmarked.
+  std::vector<uint8_t> markers(count, 1);
+  uint64_t markers_offset = static_cast<uint64_t>(file_blocks_) * fuse_block_size_ + start_block;
+  if (!android::base::WriteFullyAtOffset(fd_, markers.data(), count, markers_offset)) {
+    PLOG(WARNING) << "Failed to mark " << count << " spilled blocks at " << start_block;
+    return;
+  }
+  std::fill_n(spilled_.begin() + start_block, count, true);
+}
+
+bool FuseSpillDataProvider::ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
+                                                 uint32_t start_block) const {
+  uint32_t count = (fetch_size + fuse_block_size_ - 1) / fuse_block_size_;
+  if (fetch_size == 0 || start_block >= file_blocks_ || count > file_blocks_ - start_block) {
+    LOG(ERROR) << "Out of bound read, start block: " << start_block
+               << ", fetch size: " << fetch_size << ", file size " << file_size_;
+    return false;
+  }
+
+  // Serve each run of spilled blocks from the spill file, and fetch each run of missing ones from
+  // the source in one call.
+  for (uint32_t i = 0; i < count;) {
+    bool in_spill = spilled_[start_block + i];
+    uint32_t end = i + 1;
+    while (end < count && spilled_[start_block + end] == in_spill) {
+      end++;
+    }
+    uint64_t offset = static_cast<uint64_t>(i) * fuse_block_size_;
+    uint32_t size = std::min<uint64_t>(static_cast<uint64_t>(end - i) * fuse_block_size_,
+                                       fetch_size - offset);
+    uint64_t spill_offset = static_cast<uint64_t>(start_block + i) * fuse_block_size_;
+    if (in_spill && android::base::ReadFullyAtOffset(fd_, buffer + offset, size, spill_offset)) {
+      i = end;
+      continue;
+    }
+    if (!source_->ReadBlockAlignedData(buffer + offset, size, start_block + i)) {
+      return false;
+    }
+    Spill(buffer + offset, size, start_block + i, end - i);
+    i = end;
+  }
+  return true;
+}
+
+uint32_t FuseSpillDataProvider::spilled_blocks() const {
+  return std::count(spilled_.begin(), spilled_.end(), true);
+}
+
+void FuseSpillDataProvider::Close() {
+  source_->Close();
+  fd_.reset();
+}
@@ -32,6 +32,15 @@
 // different than it did on the first read, the reader of the file
 // will see their read fail with EINVAL.
 //
+// The blocks are compared by their SHA-256, or by a cheaper checksum
+// when the provider reads from the device's own storage (see
+// FuseIntegrity).
+//
+// This holds for every provider, including those reading from the
+// device's own storage, whose file could change under us too: each
+// reply is served from a block that was checked against its first
+// read, never straight from the provider's fd.
+//
 // The other file, "/sideload/exit", is used to control the subprocess
 // that creates this filesystem.  Calling stat() on the exit file
 // causes the filesystem to be unmounted and the adb process on the
@@ -46,24 +55,41 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>  // PATH_MAX
+#include <inttypes.h>
 #include <linux/fuse.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/mount.h>
 #include <sys/param.h>  // MIN
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <android-base/memory.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <openssl/sha.h>
+#include <xxhash.h>
+
+#include "block_cache.h"
+#include "otautil/block_hash.h"
+#include "otautil/memory_governor.h"
 
 static constexpr uint64_t PACKAGE_FILE_ID = FUSE_ROOT_ID + 1;
 static constexpr uint64_t EXIT_FLAG_ID = FUSE_ROOT_ID + 2;
@@ -71,9 +97,37 @@ static constexpr uint64_t EXIT_FLAG_ID = FUSE_ROOT_ID + 2;
 static constexpr int NO_STATUS = 1;
 static constexpr int NO_STATUS_EXIT = 2;
 
-using SHA256Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+// The digest of a block. Only the first digest_size bytes are used, depending on the provider's
+// FuseIntegrity.
+using BlockDigest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+
+// Read-ahead starts after this many consecutive fetches of sequential blocks. It then keeps up to
+// kReadAheadWindowSize bytes past the block being read fetched, asking the provider for at most
+// kReadAheadBatchSize bytes at a time.
+static constexpr uint32_t kReadAheadTrigger = 2;
+static constexpr uint64_t kReadAheadWindowSize = 4 * 1024 * 1024;
+static constexpr uint64_t kReadAheadBatchSize = 1024 * 1024;
+
+// Number of threads serving FUSE requests, so that a read waiting for the host doesn't hold up the
+// reads of cached blocks (e.g. the updater's while the verifier is hashing the package).
+static constexpr size_t kFuseWorkerThreads = 4;
 
-#define INSTALL_REQUIRED_MEMORY (500 * 1024 * 1024)
+// The largest read the kernel may send us, when the block size is smaller. 1 MiB (256 pages) is the
+// most that kernels negotiating FUSE_MAX_PAGES accept; older ones cap reads at 32 pages.
+static constexpr uint32_t kFuseMaxRead = 1024 * 1024;
+
+// At most 1/kPinnedCacheShare of the block cache is pinned, by pin_package_metadata().
+static constexpr uint32_t kPinnedCacheShare = 4;
+
+// The zip records that pin_package_metadata() reads, as laid out in the zip APPNOTE.
+static constexpr uint32_t kZipEocdSignature = 0x06054b50;
+static constexpr uint32_t kZipCdEntrySignature = 0x02014b50;
+static constexpr uint32_t kZipLocalHeaderSignature = 0x04034b50;
+static constexpr size_t kZipEocdSize = 22;
+static constexpr size_t kZipCdEntrySize = 46;
+static constexpr size_t kZipLocalHeaderSize = 30;
+
+class ReadAhead;
 
 struct fuse_data {
   android::base::unique_fd ffd;  // file descriptor for the fuse socket
@@ -85,86 +139,88 @@ struct fuse_data {
   uint32_t block_size;   // block size that the adb host is using to send the file to us
   uint32_t file_blocks;  // file size in block_size blocks
 
+  uint32_t max_read;  // the largest read the kernel may send
+
   uid_t uid;
   gid_t gid;
 
-  uint32_t curr_block;  // cache the block most recently used
-  uint8_t* block_data;
-
-  uint8_t* extra_block;  // another block of storage for reads that span two blocks
-
-  std::vector<SHA256Digest>
-      hashes;  // SHA-256 hash of each block (all zeros if block hasn't been read yet)
-
-  // Block cache
-  uint32_t block_cache_max_size;  // Max allowed block cache size
-  uint32_t block_cache_size;      // Current block cache size
-  uint8_t** block_cache;          // Block cache data
+  FuseIntegrity integrity;       // how blocks are checked against their first read
+  size_t digest_size;            // bytes of each digest in |hashes|
+  std::vector<uint8_t> hashes;   // digest of each block, |digest_size| bytes each
+  std::vector<bool> verified;    // whether each block has been read (and |hashes| set)
+
+  std::unique_ptr<BlockCache> block_cache;  // Verified blocks, to avoid refetching from the host
+
+  // The FUSE workers and the read-ahead thread share the members below. |lock| guards |hashes|,
+  // |verified|, |block_cache|, |fetching| and the exit status. |provider_lock| serializes the
+  // calls to |provider|, unless it supports concurrent reads. Neither is held while waiting for
+  // the other.
+  std::mutex lock;
+  std::mutex provider_lock;
+  std::condition_variable fetch_done;
+  std::vector<bool> fetching;  // blocks that some thread is fetching from the provider
+
+  std::unique_ptr<ReadAhead> read_ahead;  // null if the cache is disabled
+
+  // The memory of |block_cache|, from the MemoryGovernor. It's released before the cache is
+  // destroyed, so that the governor doesn't shrink a destroyed cache.
+  std::unique_ptr<MemoryGovernor::Reservation> cache_reservation;
+
+  android::base::unique_fd exit_event;  // eventfd signalled when a worker stops the filesystem
+  bool exited;
+  int exit_result;
+
+  // Counters for FuseSideloadStats.
+  std::atomic<uint64_t> requests;
+  std::atomic<uint64_t> read_requests;
+  std::atomic<uint64_t> provider_reads;
+  std::atomic<uint64_t> hash_cpu_ns;
 };
 
-static uint64_t free_memory() {
-  uint64_t mem = 0;
-  FILE* fp = fopen("/proc/meminfo", "r");
-  if (fp) {
-    char buf[256];
-    char* linebuf = buf;
-    size_t buflen = sizeof(buf);
-    while (getline(&linebuf, &buflen, fp) > 0) {
-      char* key = buf;
-      char* val = strchr(buf, ':');
-      *val = '\0';
-      ++val;
-      if (strcmp(key, "MemFree") == 0) {
-        mem += strtoul(val, nullptr, 0) * 1024;
-      }
-      if (strcmp(key, "Buffers") == 0) {
-        mem += strtoul(val, nullptr, 0) * 1024;
-      }
-      if (strcmp(key, "Cached") == 0) {
-        mem += strtoul(val, nullptr, 0) * 1024;
-      }
-    }
-    fclose(fp);
-  }
-  return mem;
-}
-
-static int block_cache_fetch(struct fuse_data* fd, uint32_t block) {
-  if (fd->block_cache == nullptr) {
-    return -1;
-  }
-  if (fd->block_cache[block] == nullptr) {
-    return -1;
-  }
-  memcpy(fd->block_data, fd->block_cache[block], fd->block_size);
-  return 0;
-}
+// The state of each thread serving FUSE requests.
+struct fuse_worker {
+  uint32_t curr_block;  // cache the block most recently used
+  std::vector<uint8_t> block_data;
 
-static void block_cache_enter(struct fuse_data* fd, uint32_t block) {
-  if (!fd->block_cache) return;
-  if (fd->block_cache_size == fd->block_cache_max_size) {
-    // Evict a block from the cache.  Since the file is typically read
-    // sequentially, start looking from the block behind the current
-    // block and proceed backward.
-    int n;
-    for (n = fd->curr_block - 1; n != (int)fd->curr_block; --n) {
-      if (n < 0) {
-        n = fd->file_blocks - 1;
-      }
-      if (fd->block_cache[n]) {
-        free(fd->block_cache[n]);
-        fd->block_cache[n] = nullptr;
-        fd->block_cache_size--;
-        break;
-      }
-    }
-  }
+  std::vector<uint8_t> read_data;  // storage for reads that span blocks
 
-  fd->block_cache[block] = (uint8_t*)malloc(fd->block_size);
-  memcpy(fd->block_cache[block], fd->block_data, fd->block_size);
+  std::vector<uint8_t> request_buffer;
+};
 
-  fd->block_cache_size++;
-}
+// Fetches blocks ahead of a sequential reader on a background thread, so that they are verified
+// and in the block cache by the time the kernel asks for them. The blocks of each batch are
+// requested from the provider with a single call, and hashed while the FUSE loop keeps serving
+// other reads.
+class ReadAhead {
+ public:
+  explicit ReadAhead(fuse_data* fd);
+  ~ReadAhead();
+
+  // Tells about a block that a reader is fetching. Once the fetches look sequential, starts
+  // fetching the window of blocks that follows.
+  void NoteFetch(uint32_t block);
+
+ private:
+  void Run();
+  // Fetches and caches the uncached blocks from |start| up to |end|, in one provider call. Returns
+  // the block to continue from, or |end| on a failure.
+  uint32_t FetchBatch(uint32_t start, uint32_t end);
+
+  fuse_data* fd_;
+  uint32_t window_blocks_;
+  uint32_t batch_blocks_;
+  std::vector<uint8_t> buffer_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  uint32_t next_{ 0 };
+  uint32_t end_{ 0 };
+  bool exit_{ false };
+  uint32_t last_fetched_{ UINT32_MAX };  // the block that NoteFetch() was called with last
+  uint32_t sequential_fetches_{ 0 };     // consecutive fetches that followed the previous block
+
+  std::thread thread_;
+};
 
 static void fuse_reply(const fuse_data* fd, uint64_t unique, const void* data, size_t len) {
   fuse_out_header hdr;
@@ -196,7 +252,7 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
     return -1;
   }
 
-  fuse_init_out out;
+  fuse_init_out out = {};
   out.minor = MIN(req->minor, FUSE_KERNEL_MINOR_VERSION);
   size_t fuse_struct_size = sizeof(out);
 #if defined(FUSE_COMPAT_22_INIT_OUT_SIZE)
@@ -212,6 +268,17 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   out.major = FUSE_KERNEL_VERSION;
   out.max_readahead = req->max_readahead;
   out.flags = 0;
+  // Let the kernel send several reads at once, for the workers to serve in parallel.
+  if (req->flags & FUSE_ASYNC_READ) {
+    out.flags |= FUSE_ASYNC_READ;
+  }
+#if defined(FUSE_MAX_PAGES)
+  // Raise the 32-page default limit on the size of a read to max_read.
+  if (req->minor >= 28 && (req->flags & FUSE_MAX_PAGES)) {
+    out.flags |= FUSE_MAX_PAGES;
+    out.max_pages = (fd->max_read + 4095) / 4096;
+  }
+#endif
   out.max_background = 32;
   out.congestion_threshold = 32;
   out.max_write = 4096;
@@ -282,6 +349,12 @@ static int handle_open(void* /* data */, const fuse_data* fd, const fuse_in_head
 
   fuse_open_out out = {};
   out.fh = 10;  // an arbitrary number; we always use the same handle
+  // Keep the pages of the package that the kernel has cached across opens. The package is read
+  // once to verify it and once more by the installer (e.g. update_engine_sideload, which opens it
+  // in a process of its own), and the kernel would otherwise drop the pages on the second open, for
+  // the installer to fetch the whole package from the host again. The pages only ever hold what
+  // a first read returned, since the file can't change for the lifetime of the mount.
+  out.open_flags = FOPEN_KEEP_CACHE;
   fuse_reply(fd, hdr->unique, &out, sizeof(out));
   return NO_STATUS;
 }
@@ -294,66 +367,384 @@ static int handle_release(void* /* data */, fuse_data* /* fd */, const fuse_in_h
   return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(fuse_data* fd, uint64_t block) {
-  if (block == fd->curr_block) {
-    return 0;
+// Reads |fetch_size| bytes from |start_block| of the provider, serializing the call with the others
+// unless the provider supports concurrent reads.
+static bool read_from_provider(fuse_data* fd, uint8_t* buffer, uint32_t fetch_size,
+                               uint32_t start_block) {
+  fd->provider_reads++;
+  if (fd->provider->SupportsConcurrentReads()) {
+    return fd->provider->ReadBlockAlignedData(buffer, fetch_size, start_block);
   }
+  std::lock_guard<std::mutex> lock(fd->provider_lock);
+  return fd->provider->ReadBlockAlignedData(buffer, fetch_size, start_block);
+}
 
-  if (block >= fd->file_blocks) {
-    memset(fd->block_data, 0, fd->block_size);
-    fd->curr_block = block;
-    return 0;
+static uint64_t thread_cpu_time_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Computes the digests of the |count| blocks at |data| into |digests|. The SHA-256 digests of a
+// batch are computed together, see otautil/block_hash.h.
+static void digest_blocks(fuse_data* fd, const uint8_t* data, uint32_t count,
+                          BlockDigest* digests) {
+  uint64_t start_ns = thread_cpu_time_ns();
+  switch (fd->integrity) {
+    case FuseIntegrity::kSha256:
+      static_assert(sizeof(BlockDigest) == SHA256_DIGEST_LENGTH);
+      HashBlocks(BlockHashAlgorithm::kSha256, data, fd->block_size, count,
+                 reinterpret_cast<uint8_t*>(digests));
+      break;
+    case FuseIntegrity::kChecksum:
+      for (uint32_t i = 0; i < count; i++) {
+        XXH64_hash_t checksum = XXH64(data + static_cast<size_t>(i) * fd->block_size,
+                                      fd->block_size, 0);
+        static_assert(sizeof(checksum) <= sizeof(BlockDigest));
+        memcpy(digests[i].data(), &checksum, sizeof(checksum));
+      }
+      break;
   }
+  fd->hash_cpu_ns += thread_cpu_time_ns() - start_ns;
+}
 
-  if (block_cache_fetch(fd, block) == 0) {
-    fd->curr_block = block;
-    return 0;
+// Verifies the digest of a block we just got from the host, and caches it if it's good. Must be
+// called with fd->lock held.
+//
+// - If this is the first time we've read this block, store the new digest and accept the block.
+// - If the digest of the just-received data matches the stored one, accept it.
+// - Otherwise, return -EIO for the read.
+static int verify_block(fuse_data* fd, uint32_t block, const uint8_t* data,
+                        const BlockDigest& digest) {
+  uint8_t* stored = fd->hashes.data() + static_cast<size_t>(block) * fd->digest_size;
+  if (!fd->verified[block]) {
+    memcpy(stored, digest.data(), fd->digest_size);
+    fd->verified[block] = true;
+  } else if (memcmp(stored, digest.data(), fd->digest_size) != 0) {
+    return -EIO;
   }
+  fd->block_cache->Enter(block, data);
+  return 0;
+}
 
-  uint32_t fetch_size = fd->block_size;
-  if (block * fd->block_size + fetch_size > fd->file_size) {
-    // If we're reading the last (partial) block of the file, expect a shorter response from the
-    // host, and pad the rest of the block with zeroes.
-    fetch_size = fd->file_size - (block * fd->block_size);
-    memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+// Returns the number of bytes the host sends for |count| blocks starting from |block|, which is
+// short of |count| * block_size for the last (partial) block of the file.
+static uint32_t fetch_size_of(const fuse_data* fd, uint32_t block, uint32_t count) {
+  uint64_t start = static_cast<uint64_t>(block) * fd->block_size;
+  return std::min<uint64_t>(static_cast<uint64_t>(count) * fd->block_size, fd->file_size - start);
+}
+
+ReadAhead::ReadAhead(fuse_data* fd)
+    : fd_(fd),
+      window_blocks_(std::max<uint64_t>(1, kReadAheadWindowSize / fd->block_size)),
+      batch_blocks_(std::max<uint64_t>(1, kReadAheadBatchSize / fd->block_size)) {
+  // Blocks fetched ahead must still be cached when they're read; leave room for the rest.
+  window_blocks_ = std::max<uint32_t>(1, std::min(window_blocks_, fd->block_cache->max_size() / 2));
+  batch_blocks_ = std::min(batch_blocks_, window_blocks_);
+  buffer_.resize(static_cast<size_t>(batch_blocks_) * fd->block_size);
+  thread_ = std::thread(&ReadAhead::Run, this);
+}
+
+ReadAhead::~ReadAhead() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    exit_ = true;
   }
+  cv_.notify_one();
+  thread_.join();
+}
 
-  if (!fd->provider->ReadBlockAlignedData(fd->block_data, fetch_size, block)) {
-    return -EIO;
+void ReadAhead::NoteFetch(uint32_t block) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (block == static_cast<uint64_t>(last_fetched_) + 1) {
+      sequential_fetches_++;
+    } else if (block != last_fetched_) {
+      sequential_fetches_ = 0;
+    }
+    last_fetched_ = block;
+    if (sequential_fetches_ < kReadAheadTrigger) {
+      return;
+    }
+
+    // Move the window along with the reader, dropping the old one if the reader jumped.
+    uint32_t start = block + 1;
+    uint32_t end =
+        std::min<uint64_t>(fd_->file_blocks, static_cast<uint64_t>(start) + window_blocks_);
+    if (start > next_ || next_ > end) {
+      next_ = start;
+    }
+    end_ = end;
   }
+  cv_.notify_one();
+}
 
-  fd->curr_block = block;
+uint32_t ReadAhead::FetchBatch(uint32_t start, uint32_t end) {
+  uint32_t count = 0;
+  {
+    std::lock_guard<std::mutex> lock(fd_->lock);
+    auto wanted = [this](uint32_t block) {
+      return !fd_->block_cache->Contains(block) && !fd_->fetching[block];
+    };
+    while (start < end && !wanted(start)) {
+      start++;
+    }
+    // The cache may have shrunk since the window was set; don't fetch more than it can keep.
+    uint32_t batch_blocks =
+        std::min(batch_blocks_, std::max<uint32_t>(1, fd_->block_cache->max_size() / 2));
+    while (start + count < end && count < batch_blocks && wanted(start + count)) {
+      fd_->fetching[start + count] = true;
+      count++;
+    }
+    if (count == 0) {
+      return start;
+    }
+  }
 
-  // Verify the hash of the block we just got from the host.
-  //
-  // - If the hash of the just-received data matches the stored hash for the block, accept it.
-  // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
-  //   time we've read this block).
-  // - Otherwise, return -EINVAL for the read.
+  uint32_t fetch_size = fetch_size_of(fd_, start, count);
+  bool fetched = read_from_provider(fd_, buffer_.data(), fetch_size, start);
 
-  SHA256Digest hash;
-  SHA256(fd->block_data, fd->block_size, hash.data());
+  std::vector<BlockDigest> digests(count);
+  if (fetched) {
+    // Pad the last (partial) block of the file, as fetch_block() does.
+    size_t batch_size = static_cast<size_t>(count) * fd_->block_size;
+    memset(buffer_.data() + fetch_size, 0, batch_size - fetch_size);
+    digest_blocks(fd_, buffer_.data(), count, digests.data());
+  }
 
-  const SHA256Digest& blockhash = fd->hashes[block];
-  if (hash == blockhash) {
-    return 0;
+  {
+    std::lock_guard<std::mutex> lock(fd_->lock);
+    // A block that fails verification is just left out of the cache; the worker reading it fetches
+    // it again and reports the error to the reader.
+    for (uint32_t i = 0; i < count; i++) {
+      if (fetched) {
+        verify_block(fd_, start + i, buffer_.data() + static_cast<size_t>(i) * fd_->block_size,
+                     digests[i]);
+      }
+      fd_->fetching[start + i] = false;
+    }
+  }
+  fd_->fetch_done.notify_all();
+  return fetched ? start + count : end;
+}
+
+void ReadAhead::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    cv_.wait(lock, [this] { return exit_ || next_ < end_; });
+    if (exit_) {
+      return;
+    }
+    uint32_t start = next_;
+    uint32_t end = std::min(end_, start + window_blocks_);
+    lock.unlock();
+    uint32_t next = FetchBatch(start, end);
+    lock.lock();
+    // Unless a new window was requested in the meantime, carry on from where the batch ended.
+    if (next_ == start) {
+      next_ = next;
+    }
+  }
+}
+
+// Fetches the blocks that cover |length| bytes at |offset| of the file (but not those in the cache
+// already), and pins them in the block cache. Copies the bytes to |data| if it isn't null. Fails
+// if the blocks can't be fetched, or if pinning them would take more than 1/kPinnedCacheShare of
+// the cache. Must be called with fd->lock held in |lock|, which is released while the provider is
+// read, as in fetch_block().
+static bool pin_region(fuse_data* fd, std::unique_lock<std::mutex>* lock, uint64_t offset,
+                       uint64_t length, std::vector<uint8_t>* data) {
+  if (length == 0 || offset > fd->file_size || length > fd->file_size - offset) {
+    return false;
+  }
+  uint32_t first = offset / fd->block_size;
+  uint32_t count = (offset + length - 1) / fd->block_size - first + 1;
+  if (fd->block_cache->pinned() + count > fd->block_cache->max_size() / kPinnedCacheShare) {
+    return false;
+  }
+
+  std::vector<uint8_t> buffer(static_cast<size_t>(count) * fd->block_size);
+  for (uint32_t i = 0; i < count;) {
+    uint8_t* out = buffer.data() + static_cast<size_t>(i) * fd->block_size;
+    uint32_t block = first + i;
+    fd->fetch_done.wait(*lock, [fd, block] { return !fd->fetching[block]; });
+    if (const uint8_t* cached = fd->block_cache->Lookup(first + i); cached != nullptr) {
+      memcpy(out, cached, fd->block_size);
+      i++;
+      continue;
+    }
+    // Fetch the run of uncached blocks in one call.
+    uint32_t run = 1;
+    while (i + run < count && !fd->block_cache->Contains(first + i + run) &&
+           !fd->fetching[first + i + run]) {
+      run++;
+    }
+    for (uint32_t j = 0; j < run; j++) {
+      fd->fetching[first + i + j] = true;
+    }
+    lock->unlock();
+
+    uint32_t fetch_size = fetch_size_of(fd, first + i, run);
+    memset(out + fetch_size, 0, static_cast<size_t>(run) * fd->block_size - fetch_size);
+    bool fetched = read_from_provider(fd, out, fetch_size, first + i);
+    std::vector<BlockDigest> digests(run);
+    if (fetched) {
+      digest_blocks(fd, out, run, digests.data());
+    }
+
+    lock->lock();
+    for (uint32_t j = 0; j < run; j++) {
+      fd->fetching[first + i + j] = false;
+    }
+    fd->fetch_done.notify_all();
+    if (!fetched) {
+      return false;
+    }
+    for (uint32_t j = 0; j < run; j++) {
+      uint8_t* block_data = out + static_cast<size_t>(j) * fd->block_size;
+      if (verify_block(fd, first + i + j, block_data, digests[j]) != 0) {
+        return false;
+      }
+    }
+    i += run;
   }
 
-  for (uint8_t i : blockhash) {
-    if (i != 0) {
-      fd->curr_block = -1;
-      return -EIO;
+  for (uint32_t i = 0; i < count; i++) {
+    if (!fd->block_cache->Pin(first + i, buffer.data() + static_cast<size_t>(i) * fd->block_size)) {
+      return false;
     }
   }
+  if (data != nullptr) {
+    size_t start = offset - static_cast<uint64_t>(first) * fd->block_size;
+    data->assign(buffer.begin() + start, buffer.begin() + start + length);
+  }
+  return true;
+}
 
-  fd->hashes[block] = hash;
-  block_cache_enter(fd, block);
+// Pins the parts of a zip package that are read at random when it's opened: the end of central
+// directory record (and the comment that holds the signature), the central directory, and the
+// META-INF/ entries (the metadata and the signature files). This way, opening the package never
+// waits for the host, however much of the cache the sequential reads of the install go through.
+// Packages that aren't zips, or are zip64, only get their tail pinned. Must be called with fd->lock
+// held in |lock|.
+static void pin_package_metadata(fuse_data* fd, std::unique_lock<std::mutex>* lock) {
+  // The EOCD record ends the file, followed by a comment of up to 64 KiB.
+  uint64_t tail_size = std::min<uint64_t>(fd->file_size, kZipEocdSize + UINT16_MAX);
+  uint64_t tail_offset = fd->file_size - tail_size;
+  std::vector<uint8_t> tail;
+  if (tail_size < kZipEocdSize || !pin_region(fd, lock, tail_offset, tail_size, &tail)) {
+    return;
+  }
+  size_t eocd = tail_size - kZipEocdSize;
+  while (android::base::get_unaligned<uint32_t>(&tail[eocd]) != kZipEocdSignature) {
+    if (eocd == 0) {
+      return;
+    }
+    eocd--;
+  }
+  uint32_t cd_size = android::base::get_unaligned<uint32_t>(&tail[eocd + 12]);
+  uint32_t cd_offset = android::base::get_unaligned<uint32_t>(&tail[eocd + 16]);
+  if (static_cast<uint64_t>(cd_offset) + cd_size > tail_offset + eocd) {
+    return;
+  }
+
+  std::vector<uint8_t> cd;
+  if (cd_size == 0 || !pin_region(fd, lock, cd_offset, cd_size, &cd)) {
+    return;
+  }
+  for (size_t entry = 0; entry + kZipCdEntrySize <= cd.size();) {
+    if (android::base::get_unaligned<uint32_t>(&cd[entry]) != kZipCdEntrySignature) {
+      return;
+    }
+    uint32_t compressed_size = android::base::get_unaligned<uint32_t>(&cd[entry + 20]);
+    uint16_t name_length = android::base::get_unaligned<uint16_t>(&cd[entry + 28]);
+    uint16_t extra_length = android::base::get_unaligned<uint16_t>(&cd[entry + 30]);
+    uint16_t comment_length = android::base::get_unaligned<uint16_t>(&cd[entry + 32]);
+    uint32_t local_header_offset = android::base::get_unaligned<uint32_t>(&cd[entry + 42]);
+    if (entry + kZipCdEntrySize + name_length > cd.size()) {
+      return;
+    }
+    std::string name(reinterpret_cast<const char*>(&cd[entry + kZipCdEntrySize]), name_length);
+    if (android::base::StartsWith(name, "META-INF/")) {
+      // The local header repeats the name, but may have an extra field of its own.
+      std::vector<uint8_t> local_header;
+      if (!pin_region(fd, lock, local_header_offset, kZipLocalHeaderSize, &local_header) ||
+          android::base::get_unaligned<uint32_t>(local_header.data()) !=
+              kZipLocalHeaderSignature) {
+        return;
+      }
+      uint64_t data_length = android::base::get_unaligned<uint16_t>(&local_header[26]) +
+                             android::base::get_unaligned<uint16_t>(&local_header[28]) +
+                             static_cast<uint64_t>(compressed_size);
+      if (data_length > 0 &&
+          !pin_region(fd, lock, local_header_offset + kZipLocalHeaderSize, data_length, nullptr)) {
+        return;
+      }
+    }
+    entry += kZipCdEntrySize + name_length + extra_length + comment_length;
+  }
+}
+
+// Fetch a block from the host into w->curr_block and w->block_data.
+// Returns 0 on successful fetch, negative otherwise.
+static int fetch_block(fuse_data* fd, fuse_worker* w, uint64_t block) {
+  if (block == w->curr_block) {
+    return 0;
+  }
+
+  uint8_t* block_data = w->block_data.data();
+  if (block >= fd->file_blocks) {
+    memset(block_data, 0, fd->block_size);
+    w->curr_block = block;
+    return 0;
+  }
+
+  if (fd->read_ahead) {
+    fd->read_ahead->NoteFetch(block);
+  }
+
+  // Give memory back if the device runs short of it. The cache is shrunk under |fd->lock|, so this
+  // can't be called with it held.
+  MemoryGovernor::Get().Rebalance();
+
+  std::unique_lock<std::mutex> lock(fd->lock);
+  // If another thread is already fetching this block, wait for it and take its copy.
+  fd->fetch_done.wait(lock, [fd, block] { return !fd->fetching[block]; });
+  if (fd->block_cache->Fetch(block, block_data)) {
+    w->curr_block = block;
+    return 0;
+  }
+  fd->fetching[block] = true;
+  lock.unlock();
+
+  uint32_t fetch_size = fetch_size_of(fd, block, 1);
+  // If we're reading the last (partial) block of the file, expect a shorter response from the
+  // host, and pad the rest of the block with zeroes.
+  memset(block_data + fetch_size, 0, fd->block_size - fetch_size);
+
+  bool fetched = read_from_provider(fd, block_data, fetch_size, block);
+
+  BlockDigest digest;
+  if (fetched) {
+    digest_blocks(fd, block_data, 1, &digest);
+  }
+
+  lock.lock();
+  fd->fetching[block] = false;
+  fd->fetch_done.notify_all();
+  if (!fetched) {
+    w->curr_block = -1;
+    return -EIO;
+  }
+  if (verify_block(fd, block, block_data, digest) != 0) {
+    w->curr_block = -1;
+    return -EIO;
+  }
+  w->curr_block = block;
   return 0;
 }
 
-static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
+static int handle_read(void* data, fuse_data* fd, fuse_worker* w, const fuse_in_header* hdr) {
   if (hdr->nodeid != PACKAGE_FILE_ID) return -ENOENT;
 
   const fuse_read_in* req = static_cast<const fuse_read_in*>(data);
@@ -373,52 +764,191 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   outhdr.error = 0;
   outhdr.unique = hdr->unique;
 
-  struct iovec vec[3];
+  struct iovec vec[2];
   vec[0].iov_base = &outhdr;
   vec[0].iov_len = sizeof(outhdr);
 
-  uint32_t block = offset / fd->block_size;
-  int result = fetch_block(fd, block);
+  uint64_t block = offset / fd->block_size;
+  uint32_t block_offset = offset - (block * fd->block_size);
+
+  // A read within a single cached block is replied straight from the cache, saving the copy to
+  // block_data. The cache lock is held until the reply is written, so the block can't be evicted.
+  if (size + block_offset <= fd->block_size && block != w->curr_block &&
+      block < fd->file_blocks) {
+    if (fd->read_ahead) {
+      fd->read_ahead->NoteFetch(block);
+    }
+    std::lock_guard<std::mutex> lock(fd->lock);
+    if (const uint8_t* cached = fd->block_cache->Lookup(block); cached != nullptr) {
+      vec[1].iov_base = const_cast<uint8_t*>(cached + block_offset);
+      vec[1].iov_len = size;
+      if (writev(fd->ffd, vec, 2) == -1) {
+        printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
+      }
+      return NO_STATUS;
+    }
+  }
+
+  int result = fetch_block(fd, w, block);
   if (result != 0) return result;
 
   // Two cases:
   //
   //   - the read request is entirely within this block. In this case we can reply immediately.
   //
-  //   - the read request goes over into the next block. Note that since we mount the filesystem
-  //     with max_read=block_size, a read can never span more than two blocks. In this case we copy
-  //     the block to extra_block and issue a fetch for the following block.
-
-  uint32_t block_offset = offset - (block * fd->block_size);
+  //   - the read request goes over into the following blocks (up to max_read bytes). In this case
+  //     we copy the pieces of each block to read_data.
 
-  int vec_used;
   if (size + block_offset <= fd->block_size) {
     // First case: the read fits entirely in the first block.
 
-    vec[1].iov_base = fd->block_data + block_offset;
+    vec[1].iov_base = w->block_data.data() + block_offset;
     vec[1].iov_len = size;
-    vec_used = 2;
   } else {
-    // Second case: the read spills over into the next block.
+    // Second case: the read spills over into the next blocks.
 
-    memcpy(fd->extra_block, fd->block_data + block_offset, fd->block_size - block_offset);
-    vec[1].iov_base = fd->extra_block;
-    vec[1].iov_len = fd->block_size - block_offset;
-
-    result = fetch_block(fd, block + 1);
-    if (result != 0) return result;
-    vec[2].iov_base = fd->block_data;
-    vec[2].iov_len = size - vec[1].iov_len;
-    vec_used = 3;
+    if (w->read_data.size() < size) {
+      w->read_data.resize(size);
+    }
+    uint32_t copied = 0;
+    for (;;) {
+      uint32_t to_copy = std::min(size - copied, fd->block_size - block_offset);
+      memcpy(w->read_data.data() + copied, w->block_data.data() + block_offset, to_copy);
+      copied += to_copy;
+      if (copied == size) {
+        break;
+      }
+      block++;
+      block_offset = 0;
+      result = fetch_block(fd, w, block);
+      if (result != 0) return result;
+    }
+    vec[1].iov_base = w->read_data.data();
+    vec[1].iov_len = size;
   }
 
-  if (writev(fd->ffd, vec, vec_used) == -1) {
+  if (writev(fd->ffd, vec, 2) == -1) {
     printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
   }
   return NO_STATUS;
 }
 
-int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char* mount_point) {
+// Serves FUSE requests until the exit flag is stat'ed (returning 0), the filesystem goes away
+// (returning -1) or another worker stops (returning NO_STATUS).
+static int run_fuse_worker(fuse_data* fd) {
+  fuse_worker w;
+  w.curr_block = -1;
+  w.block_data.resize(fd->block_size);
+  w.request_buffer.resize(sizeof(fuse_in_header) + PATH_MAX * 8);
+
+  // /dev/fuse is non-blocking, so that a worker that loses the race for a request goes back to
+  // waiting for the next one (or for the exit event).
+  pollfd fds[2] = {
+    { .fd = fd->ffd.get(), .events = POLLIN },
+    { .fd = fd->exit_event.get(), .events = POLLIN },
+  };
+  for (;;) {
+    if (TEMP_FAILURE_RETRY(poll(fds, 2, -1)) == -1) {
+      perror("poll");
+      return -1;
+    }
+    if (fds[1].revents & POLLIN) {
+      return NO_STATUS;
+    }
+
+    ssize_t len =
+        TEMP_FAILURE_RETRY(read(fd->ffd, w.request_buffer.data(), w.request_buffer.size()));
+    if (len == -1) {
+      if (errno == EAGAIN) {
+        continue;
+      }
+      perror("read request");
+      if (errno == ENODEV) {
+        return -1;
+      }
+      continue;
+    }
+
+    if (static_cast<size_t>(len) < sizeof(fuse_in_header)) {
+      fprintf(stderr, "request too short: len=%zd\n", len);
+      continue;
+    }
+
+    fuse_in_header* hdr = reinterpret_cast<fuse_in_header*>(w.request_buffer.data());
+    void* data = w.request_buffer.data() + sizeof(fuse_in_header);
+    fd->requests++;
+
+    int result = -ENOSYS;
+
+    switch (hdr->opcode) {
+      case FUSE_INIT:
+        result = handle_init(data, fd, hdr);
+        break;
+
+      case FUSE_LOOKUP:
+        result = handle_lookup(data, fd, hdr);
+        break;
+
+      case FUSE_GETATTR:
+        result = handle_getattr(data, fd, hdr);
+        break;
+
+      case FUSE_OPEN:
+        result = handle_open(data, fd, hdr);
+        break;
+
+      case FUSE_READ:
+        fd->read_requests++;
+        result = handle_read(data, fd, &w, hdr);
+        break;
+
+      case FUSE_FLUSH:
+        result = handle_flush(data, fd, hdr);
+        break;
+
+      case FUSE_RELEASE:
+        result = handle_release(data, fd, hdr);
+        break;
+
+      default:
+        fprintf(stderr, "unknown fuse request opcode %d\n", hdr->opcode);
+        break;
+    }
+
+    if (result == NO_STATUS_EXIT) {
+      return 0;
+    }
+
+    if (result != NO_STATUS) {
+      fuse_out_header outhdr;
+      outhdr.len = sizeof(outhdr);
+      outhdr.error = result;
+      outhdr.unique = hdr->unique;
+      TEMP_FAILURE_RETRY(write(fd->ffd, &outhdr, sizeof(outhdr)));
+    }
+  }
+}
+
+// Runs a worker, and stops all the others once it's done.
+static void run_fuse_worker_until_exit(fuse_data* fd) {
+  int result = run_fuse_worker(fd);
+  if (result == NO_STATUS) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(fd->lock);
+    if (!fd->exited) {
+      fd->exited = true;
+      fd->exit_result = result;
+    }
+  }
+  if (eventfd_write(fd->exit_event, 1) != 0) {
+    perror("eventfd_write");
+  }
+}
+
+int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char* mount_point,
+                      FuseSideloadStats* stats) {
   // If something's already mounted on our mountpoint, try to remove it. (Mostly in case of a
   // previous abnormal exit.)
   umount2(mount_point, MNT_FORCE);
@@ -442,9 +972,6 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
   fd.block_size = block_size;
   fd.file_blocks = (file_size == 0) ? 0 : (((file_size - 1) / block_size) + 1);
 
-  uint64_t mem = free_memory();
-  uint64_t avail = mem - (INSTALL_REQUIRED_MEMORY + fd.file_blocks * sizeof(uint8_t*));
-
   int result;
   if (fd.file_blocks > (1 << 18)) {
     fprintf(stderr, "file has too many blocks (%u)\n", fd.file_blocks);
@@ -452,42 +979,61 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
     goto done;
   }
 
-  // All hashes will be zero-initialized.
-  fd.hashes.resize(fd.file_blocks);
+  fd.integrity = provider->integrity();
+  fd.digest_size =
+      fd.integrity == FuseIntegrity::kSha256 ? SHA256_DIGEST_LENGTH : sizeof(XXH64_hash_t);
+  fd.hashes.resize(static_cast<size_t>(fd.file_blocks) * fd.digest_size);
+  fd.verified.resize(fd.file_blocks);
+  fd.fetching.resize(fd.file_blocks);
   fd.uid = getuid();
   fd.gid = getgid();
+  fd.max_read = std::max(block_size, kFuseMaxRead);
 
-  fd.curr_block = -1;
-  fd.block_data = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.block_data == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
-    result = -1;
-    goto done;
+  {
+    // The cache must be at least 1% of the file size or two blocks, whichever is larger. It gives
+    // memory back when the governor asks (e.g. as the updater allocates its stashes).
+    uint64_t min_size = std::max<uint64_t>(2, fd.file_blocks / 100) * fd.block_size;
+    uint64_t max_size = static_cast<uint64_t>(fd.file_blocks) * fd.block_size;
+    MemoryConsumer consumer;
+    consumer.usage = [&fd]() {
+      std::lock_guard<std::mutex> lock(fd.lock);
+      return fd.block_cache ? static_cast<size_t>(fd.block_cache->size()) * fd.block_size : 0;
+    };
+    consumer.shrink = [&fd](size_t bytes) {
+      std::lock_guard<std::mutex> lock(fd.lock);
+      if (!fd.block_cache) {
+        return size_t{ 0 };
+      }
+      uint32_t max_blocks = fd.block_cache->max_size();
+      uint64_t blocks = std::min<uint64_t>(max_blocks, (bytes + fd.block_size - 1) / fd.block_size);
+      fd.block_cache->Shrink(max_blocks - blocks);
+      return static_cast<size_t>(max_blocks - fd.block_cache->max_size()) * fd.block_size;
+    };
+    if (fd.file_blocks >= 2) {
+      fd.cache_reservation =
+          MemoryGovernor::Get().Reserve("fuse block cache", MemoryPriority::kCache,
+                                        std::min(min_size, max_size), max_size, consumer);
+    }
+    uint32_t max_blocks = fd.cache_reservation ? fd.cache_reservation->bytes() / fd.block_size : 0;
+    fd.block_cache = std::make_unique<BlockCache>(fd.block_size, fd.file_blocks, max_blocks);
   }
-  fd.extra_block = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.extra_block == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for extra_block\n", block_size);
-    result = -1;
-    goto done;
+  if (fd.block_cache->max_size() > 0) {
+    {
+      // Nothing else is running yet, but the cache is still only touched under the lock.
+      std::unique_lock<std::mutex> lock(fd.lock);
+      pin_package_metadata(&fd, &lock);
+    }
+    fd.read_ahead = std::make_unique<ReadAhead>(&fd);
   }
 
-  fd.block_cache_max_size = 0;
-  fd.block_cache_size = 0;
-  fd.block_cache = nullptr;
-  if (mem > avail) {
-    uint32_t max_size = avail / fd.block_size;
-    if (max_size > fd.file_blocks) {
-      max_size = fd.file_blocks;
-    }
-    // The cache must be at least 1% of the file size or two blocks,
-    // whichever is larger.
-    if (max_size >= fd.file_blocks / 100 && max_size >= 2) {
-      fd.block_cache_max_size = max_size;
-      fd.block_cache = (uint8_t**)calloc(fd.file_blocks, sizeof(uint8_t*));
-    }
+  fd.exit_event.reset(eventfd(0, EFD_CLOEXEC));
+  if (fd.exit_event == -1) {
+    perror("eventfd");
+    result = -1;
+    goto done;
   }
 
-  fd.ffd.reset(open("/dev/fuse", O_RDWR));
+  fd.ffd.reset(open("/dev/fuse", O_RDWR | O_NONBLOCK));
   if (fd.ffd == -1) {
     perror("open /dev/fuse");
     result = -1;
@@ -497,7 +1043,7 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
   {
     std::string opts = android::base::StringPrintf(
         "fd=%d,user_id=%d,group_id=%d,max_read=%u,allow_other,rootmode=040000", fd.ffd.get(),
-        fd.uid, fd.gid, block_size);
+        fd.uid, fd.gid, fd.max_read);
 
     result = mount("/dev/fuse", mount_point, "fuse", MS_NOSUID | MS_NODEV | MS_RDONLY | MS_NOEXEC,
                    opts.c_str());
@@ -507,77 +1053,20 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
     }
   }
 
-  uint8_t request_buffer[sizeof(fuse_in_header) + PATH_MAX * 8];
-  for (;;) {
-    ssize_t len = TEMP_FAILURE_RETRY(read(fd.ffd, request_buffer, sizeof(request_buffer)));
-    if (len == -1) {
-      perror("read request");
-      if (errno == ENODEV) {
-        result = -1;
-        break;
-      }
-      continue;
-    }
-
-    if (static_cast<size_t>(len) < sizeof(fuse_in_header)) {
-      fprintf(stderr, "request too short: len=%zd\n", len);
-      continue;
-    }
-
-    fuse_in_header* hdr = reinterpret_cast<fuse_in_header*>(request_buffer);
-    void* data = request_buffer + sizeof(fuse_in_header);
-
-    result = -ENOSYS;
-
-    switch (hdr->opcode) {
-      case FUSE_INIT:
-        result = handle_init(data, &fd, hdr);
-        break;
-
-      case FUSE_LOOKUP:
-        result = handle_lookup(data, &fd, hdr);
-        break;
-
-      case FUSE_GETATTR:
-        result = handle_getattr(data, &fd, hdr);
-        break;
-
-      case FUSE_OPEN:
-        result = handle_open(data, &fd, hdr);
-        break;
-
-      case FUSE_READ:
-        result = handle_read(data, &fd, hdr);
-        break;
-
-      case FUSE_FLUSH:
-        result = handle_flush(data, &fd, hdr);
-        break;
-
-      case FUSE_RELEASE:
-        result = handle_release(data, &fd, hdr);
-        break;
-
-      default:
-        fprintf(stderr, "unknown fuse request opcode %d\n", hdr->opcode);
-        break;
+  {
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < kFuseWorkerThreads; i++) {
+      workers.emplace_back(run_fuse_worker_until_exit, &fd);
     }
-
-    if (result == NO_STATUS_EXIT) {
-      result = 0;
-      break;
-    }
-
-    if (result != NO_STATUS) {
-      fuse_out_header outhdr;
-      outhdr.len = sizeof(outhdr);
-      outhdr.error = result;
-      outhdr.unique = hdr->unique;
-      TEMP_FAILURE_RETRY(write(fd.ffd, &outhdr, sizeof(outhdr)));
+    run_fuse_worker_until_exit(&fd);
+    for (auto& worker : workers) {
+      worker.join();
     }
+    result = fd.exit_result;
   }
 
 done:
+  fd.read_ahead.reset();
   provider->Close();
 
   if (umount2(mount_point, MNT_DETACH) == -1) {
@@ -585,15 +1074,24 @@ done:
   }
 
   if (fd.block_cache) {
-    uint32_t n;
-    for (n = 0; n < fd.file_blocks; ++n) {
-      free(fd.block_cache[n]);
+    printf("fuse_sideload block cache: %" PRIu32 " of %" PRIu32 " blocks (%" PRIu32
+           " pinned), %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions\n",
+           fd.block_cache->size(), fd.block_cache->max_size(), fd.block_cache->pinned(),
+           fd.block_cache->hits(), fd.block_cache->misses(), fd.block_cache->evictions());
+  }
+  if (stats != nullptr) {
+    *stats = {};
+    stats->requests = fd.requests;
+    stats->read_requests = fd.read_requests;
+    stats->provider_reads = fd.provider_reads;
+    stats->hash_cpu_ns = fd.hash_cpu_ns;
+    if (fd.block_cache) {
+      stats->cache_hits = fd.block_cache->hits();
+      stats->cache_misses = fd.block_cache->misses();
+      stats->cache_evictions = fd.block_cache->evictions();
+      stats->pinned_blocks = fd.block_cache->pinned();
     }
-    free(fd.block_cache);
   }
 
-  free(fd.block_data);
-  free(fd.extra_block);
-
   return result;
 }
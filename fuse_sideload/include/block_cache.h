@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+// A cache of up to |max_blocks| fixed-size blocks of a file, evicting the least recently used block
+// when full. Lookups, insertions and evictions are all O(1). The block data lives in slabs of
+// slots that are allocated as the cache grows, so a large cache neither costs a malloc() per block
+// nor reserves its full size up front.
+//
+// Blocks may also be pinned, which keeps them in the cache for good, out of the eviction order.
+// This is meant for the few blocks that are read at random and must not be pushed out by long
+// sequential reads (e.g. the central directory of a zip).
+//
+// BlockCache isn't thread-safe; callers sharing one must serialize the calls.
+class BlockCache {
+ public:
+  // Creates a cache for a file of |file_blocks| blocks of |block_size| bytes. A |max_blocks| of 0
+  // disables caching: every Fetch() misses and Enter() does nothing.
+  BlockCache(uint32_t block_size, uint32_t file_blocks, uint32_t max_blocks);
+
+  BlockCache(const BlockCache&) = delete;
+  BlockCache& operator=(const BlockCache&) = delete;
+
+  // Copies |block| to |data| and marks it as the most recently used, if it's in the cache. Returns
+  // whether it was.
+  bool Fetch(uint32_t block, uint8_t* data);
+
+  // Same as Fetch(), but returns the cached data in place rather than copying it, or nullptr on a
+  // miss. The data stays valid until the next Enter(). A miss isn't counted, as the caller is
+  // expected to go on to fetch the block (and Fetch() it).
+  const uint8_t* Lookup(uint32_t block);
+
+  // Returns whether |block| is in the cache, without counting a hit or miss or touching its place
+  // in the eviction order.
+  bool Contains(uint32_t block) const {
+    return block < slot_of_block_.size() && slot_of_block_[block] != kNoSlot;
+  }
+
+  // Adds (or refreshes) |block| with the contents of |data|, evicting the least recently used
+  // block if the cache is full. A pinned block stays pinned.
+  void Enter(uint32_t block, const uint8_t* data);
+
+  // Same as Enter(), but also pins |block| so that it's never evicted. Fails if the cache can't
+  // take more pinned blocks: at least one slot is always left for the unpinned ones.
+  bool Pin(uint32_t block, const uint8_t* data);
+
+  // Lowers the capacity of the cache to |max_blocks|, evicting the least recently used blocks to
+  // fit, and frees the slabs that are no longer needed. The pinned blocks stay, and so does one
+  // slot for the unpinned ones. As with Enter(), this invalidates the data returned by Lookup().
+  void Shrink(uint32_t max_blocks);
+
+  uint32_t size() const {
+    return size_;
+  }
+  uint32_t max_size() const {
+    return max_blocks_;
+  }
+  uint32_t pinned() const {
+    return pinned_;
+  }
+  uint64_t hits() const {
+    return hits_;
+  }
+  uint64_t misses() const {
+    return misses_;
+  }
+  uint64_t evictions() const {
+    return evictions_;
+  }
+
+ private:
+  static constexpr uint32_t kNoSlot = UINT32_MAX;
+
+  // A slot holds one cached block, and links into the LRU list (most recent at |lru_head_|),
+  // unless it's pinned.
+  struct Slot {
+    uint32_t block;
+    uint32_t prev;
+    uint32_t next;
+    bool pinned;
+  };
+
+  uint8_t* SlotData(uint32_t slot) const;
+  // Returns a slot for a new block, either a newly allocated one or the evicted LRU one.
+  uint32_t AllocateSlot();
+  void Unlink(uint32_t slot);
+  void PushFront(uint32_t slot);
+  // Moves the block in slot |from| to the free slot |to|, keeping its place in the LRU list.
+  void MoveSlot(uint32_t from, uint32_t to);
+
+  const uint32_t block_size_;
+  uint32_t max_blocks_;
+  // Number of slots in each slab.
+  uint32_t slab_slots_;
+
+  // The slot of each block of the file, or kNoSlot if it isn't cached.
+  std::vector<uint32_t> slot_of_block_;
+  std::vector<Slot> slots_;
+  std::vector<std::unique_ptr<uint8_t[]>> slabs_;
+
+  uint32_t lru_head_{ kNoSlot };
+  uint32_t lru_tail_{ kNoSlot };
+  uint32_t size_{ 0 };
+  uint32_t pinned_{ 0 };
+
+  uint64_t hits_{ 0 };
+  uint64_t misses_{ 0 };
+  uint64_t evictions_{ 0 };
+};
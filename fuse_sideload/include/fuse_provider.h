@@ -20,11 +20,21 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <android-base/unique_fd.h>
 
 #include "otautil/rangeset.h"
 
+// How fuse_sideload checks that every read of a block returns the same data as the first one.
+enum class FuseIntegrity {
+  // SHA-256 of every block, for sources that may be hostile (i.e. the adb host).
+  kSha256,
+  // A fast non-cryptographic checksum (XXH64), for trusted local sources. The package signature
+  // is verified on the data anyway; this only catches the source changing under us by accident.
+  kChecksum,
+};
+
 // This is the base class to read data from source and provide the data to FUSE.
 class FuseDataProvider {
  public:
@@ -44,6 +54,16 @@ class FuseDataProvider {
   virtual bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
                                     uint32_t start_block) const = 0;
 
+  // Returns whether ReadBlockAlignedData() may be called from several threads at once.
+  virtual bool SupportsConcurrentReads() const {
+    return false;
+  }
+
+  // Returns how the blocks from this provider are checked.
+  virtual FuseIntegrity integrity() const {
+    return FuseIntegrity::kSha256;
+  }
+
   virtual bool Valid() const = 0;
 
   virtual void Close() {}
@@ -68,6 +88,11 @@ class FuseFileDataProvider : public FuseDataProvider {
   bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
                             uint32_t start_block) const override;
 
+  // Reads with pread(2), which needs no serialization.
+  bool SupportsConcurrentReads() const override {
+    return true;
+  }
+
   bool Valid() const override {
     return fd_ != -1;
   }
@@ -93,6 +118,16 @@ class FuseBlockDataProvider : public FuseDataProvider {
   bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
                             uint32_t start_block) const override;
 
+  // Reads with pread(2), which needs no serialization.
+  bool SupportsConcurrentReads() const override {
+    return true;
+  }
+
+  // A block map points at the device's own storage, which the host can't change.
+  FuseIntegrity integrity() const override {
+    return FuseIntegrity::kChecksum;
+  }
+
   bool Valid() const override {
     return fd_ != -1;
   }
@@ -109,3 +144,59 @@ class FuseBlockDataProvider : public FuseDataProvider {
   // The block ranges from the source block device that consist of the file
   RangeSet ranges_;
 };
+
+// This class reads through another provider (i.e. the adb host), and keeps a copy of the blocks it
+// gets in a spill file. If the transfer is interrupted (e.g. by a flaky cable), a later transfer
+// of the same package picks up the spill file, and only asks the source for the blocks it doesn't
+// have yet. Packages are told apart by their size, block size and the SHA-256 of their first block.
+//
+// The spill file lives in a directory of the caller's choosing, holding at most one of them.
+// Note that it takes as much space as the package, which comes out of RAM on a tmpfs.
+class FuseSpillDataProvider : public FuseDataProvider {
+ public:
+  // Wraps |source| with a spill file in |spill_dir|, creating it or resuming from an existing one.
+  // Returns |source| itself if the spill file can't be set up (e.g. there isn't enough space), as
+  // the transfer can still go on without it.
+  static std::unique_ptr<FuseDataProvider> Create(std::unique_ptr<FuseDataProvider> source,
+                                                  const std::string& spill_dir);
+
+  // Removes the spill files in |spill_dir|, once they're no longer needed (e.g. the package has
+  // been installed).
+  static void RemoveSpillFiles(const std::string& spill_dir);
+
+  bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
+                            uint32_t start_block) const override;
+
+  FuseIntegrity integrity() const override {
+    return source_->integrity();
+  }
+
+  bool Valid() const override {
+    return source_->Valid() && fd_ != -1;
+  }
+
+  void Close() override;
+
+  const std::string& path() const {
+    return path_;
+  }
+
+  // Returns the number of blocks currently in the spill file.
+  uint32_t spilled_blocks() const;
+
+ private:
+  FuseSpillDataProvider(std::unique_ptr<FuseDataProvider> source, android::base::unique_fd&& fd,
+                        std::string path, std::vector<bool> spilled);
+
+  // Writes the |count| blocks that the source returned from |start_block| to the spill file.
+  void Spill(const uint8_t* data, uint32_t size, uint32_t start_block, uint32_t count) const;
+
+  std::unique_ptr<FuseDataProvider> source_;
+  // The spill file: the blocks of the package (at their offset in the package), followed by one
+  // byte per block that is set once the block has been written.
+  android::base::unique_fd fd_;
+  std::string path_;
+  uint32_t file_blocks_;
+  // Whether each block is in the spill file.
+  mutable std::vector<bool> spilled_;
+};
@@ -17,6 +17,8 @@
 #ifndef __FUSE_SIDELOAD_H
 #define __FUSE_SIDELOAD_H
 
+#include <stdint.h>
+
 #include <memory>
 
 #include "fuse_provider.h"
@@ -28,7 +30,22 @@ static constexpr const char* FUSE_SIDELOAD_HOST_PATHNAME = "/sideload/package.zi
 static constexpr const char* FUSE_SIDELOAD_HOST_EXIT_FLAG = "exit";
 static constexpr const char* FUSE_SIDELOAD_HOST_EXIT_PATHNAME = "/sideload/exit";
 
+// What a run_fuse_sideload() session did, e.g. for benchmarks.
+struct FuseSideloadStats {
+  uint64_t requests;         // FUSE requests served
+  uint64_t read_requests;    // FUSE_READ requests among them
+  uint64_t provider_reads;   // calls to FuseDataProvider::ReadBlockAlignedData()
+  uint64_t hash_cpu_ns;      // CPU time spent computing the block digests
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t cache_evictions;
+  uint32_t pinned_blocks;
+};
+
+// Serves the data of |provider| as FUSE_SIDELOAD_HOST_FILENAME under |mount_point|, until the exit
+// flag is stat'ed. Fills in |stats| on return if it isn't null.
 int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider,
-                      const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT);
+                      const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT,
+                      FuseSideloadStats* stats = nullptr);
 
 #endif
@@ -43,6 +43,7 @@
 
 #include "fuse_sideload.h"
 #include "install/install.h"
+#include "install/storage_benchmark.h"
 #include "install/wipe_data.h"
 #include "minadbd/types.h"
 #include "otautil/sysutil.h"
@@ -388,6 +389,10 @@ InstallResult ApplyFromAdb(Device* device, bool rescue_mode, Device::BuiltinActi
       bool result = WipeData(device);
       return std::make_pair(result, true);
     });
+    command_map.emplace(MinadbdCommand::kBenchmarkStorage, [ui]() {
+      bool result = BenchmarkStorage(ui);
+      return std::make_pair(result, true);
+    });
     command_map.emplace(MinadbdCommand::kNoOp, []() { return std::make_pair(true, true); });
 
     ui->Print("\n\nWaiting for rescue commands...\n");
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "install/directory_listing.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+
+using namespace std::chrono_literals;
+
+// How often the listing tells about new entries as it reads.
+static constexpr auto kUpdateInterval = 200ms;
+// What one getdents64(2) reads at most.
+static constexpr size_t kReadBufferSize = 32 * 1024;
+
+struct CachedListing {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  std::vector<std::string> files;
+  std::vector<std::string> dirs;
+  // When it was last used, to evict the least recently used listing.
+  uint64_t last_used;
+};
+
+static std::mutex cache_mutex;
+static std::map<std::string, CachedListing> cache;
+static uint64_t cache_clock = 0;
+
+// Merges the sorted |batch| into the sorted |entries|.
+static void MergeSorted(std::vector<std::string>* entries, std::vector<std::string>* batch) {
+  std::sort(batch->begin(), batch->end());
+  size_t middle = entries->size();
+  entries->insert(entries->end(), std::make_move_iterator(batch->begin()),
+                  std::make_move_iterator(batch->end()));
+  std::inplace_merge(entries->begin(), entries->begin() + middle, entries->end());
+  batch->clear();
+}
+
+DirectoryListing::DirectoryListing(const std::string& path, std::function<void()> on_update)
+    : path_(path), on_update_(std::move(on_update)) {
+  fd_.reset(open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  struct stat sb;
+  if (fd_ == -1 || fstat(fd_, &sb) != 0) {
+    PLOG(ERROR) << "error opening " << path;
+    return;
+  }
+  ok_ = true;
+  dev_ = sb.st_dev;
+  ino_ = sb.st_ino;
+  mtime_ = sb.st_mtim;
+
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (auto it = cache.find(path_); it != cache.end()) {
+      const CachedListing& cached = it->second;
+      if (cached.dev == dev_ && cached.ino == ino_ && cached.mtime.tv_sec == mtime_.tv_sec &&
+          cached.mtime.tv_nsec == mtime_.tv_nsec) {
+        files_ = cached.files;
+        dirs_ = cached.dirs;
+        complete_ = true;
+        it->second.last_used = ++cache_clock;
+        fd_.reset();
+        return;
+      }
+      cache.erase(it);
+    }
+  }
+
+  reader_ = std::thread(&DirectoryListing::Read, this);
+}
+
+DirectoryListing::~DirectoryListing() {
+  stopped_ = true;
+  if (reader_.joinable()) {
+    reader_.join();
+  }
+}
+
+std::vector<std::string> DirectoryListing::GetEntries(bool* complete) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<std::string> entries;
+  entries.reserve(files_.size() + dirs_.size());
+  entries.insert(entries.end(), files_.begin(), files_.end());
+  entries.insert(entries.end(), dirs_.begin(), dirs_.end());
+  *complete = complete_;
+  return entries;
+}
+
+void DirectoryListing::ClearCache() {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  cache.clear();
+}
+
+void DirectoryListing::Read() {
+  std::vector<char> buffer(kReadBufferSize);
+  std::vector<std::string> files;
+  std::vector<std::string> dirs;
+  auto last_update = std::chrono::steady_clock::time_point::min();
+  bool updated = false;
+  bool read_whole = false;
+
+  while (!stopped_) {
+    long size = syscall(SYS_getdents64, fd_.get(), buffer.data(), buffer.size());
+    if (size <= 0) {
+      if (size == -1) {
+        PLOG(ERROR) << "Failed to read " << path_;
+      }
+      read_whole = size == 0;
+      break;
+    }
+
+    for (long offset = 0; offset < size;) {
+      const auto* de = reinterpret_cast<const struct dirent64*>(buffer.data() + offset);
+      offset += de->d_reclen;
+      std::string name(de->d_name);
+      if (de->d_type == DT_DIR) {
+        // Skip "." and ".." entries.
+        if (name == "." || name == "..") continue;
+        dirs.push_back(name + "/");
+      } else if (de->d_type == DT_REG && (android::base::EndsWithIgnoreCase(name, ".zip") ||
+                                          android::base::EndsWithIgnoreCase(name, ".map"))) {
+        files.push_back(std::move(name));
+      }
+    }
+
+    if (!files.empty() || !dirs.empty()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      MergeSorted(&files_, &files);
+      MergeSorted(&dirs_, &dirs);
+      updated = true;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (updated && now - last_update >= kUpdateInterval) {
+      on_update_();
+      last_update = now;
+      updated = false;
+    }
+  }
+  fd_.reset();
+
+  if (!read_whole) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    complete_ = true;
+
+    std::lock_guard<std::mutex> cache_lock(cache_mutex);
+    if (cache.size() >= kMaxCachedListings) {
+      cache.erase(std::min_element(cache.begin(), cache.end(), [](const auto& a, const auto& b) {
+        return a.second.last_used < b.second.last_used;
+      }));
+    }
+    cache[path_] = CachedListing{ dev_, ino_, mtime_, files_, dirs_, ++cache_clock };
+  }
+  if (updated) {
+    on_update_();
+  }
+}
@@ -16,7 +16,6 @@
 
 #include "install/fuse_install.h"
 
-#include <dirent.h>
 #include <signal.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
@@ -36,7 +35,9 @@
 #include "bootloader_message/bootloader_message.h"
 #include "fuse_provider.h"
 #include "fuse_sideload.h"
+#include "install/directory_listing.h"
 #include "install/install.h"
+#include "otautil/sched_policy.h"
 #include "recovery_utils/roots.h"
 
 using android::volmgr::VolumeInfo;
@@ -58,47 +59,41 @@ static void SetSdcardUpdateBootloaderMessage() {
 
 // Returns the selected filename, or an empty string.
 static std::string BrowseDirectory(const std::string& path, Device* device, RecoveryUI* ui) {
-  std::unique_ptr<DIR, decltype(&closedir)> d(opendir(path.c_str()), closedir);
-  if (!d) {
-    PLOG(ERROR) << "error opening " << path;
+  // The menu is refreshed as batches of entries are read.
+  DirectoryListing listing(path, [ui]() { ui->RefreshMenu(); });
+  if (!listing.ok()) {
     return "";
   }
 
-  std::vector<std::string> dirs;
-  std::vector<std::string> entries{ "../" };  // "../" is always the first entry.
-
-  dirent* de;
-  while ((de = readdir(d.get())) != nullptr) {
-    std::string name(de->d_name);
-
-    if (de->d_type == DT_DIR) {
-      // Skip "." and ".." entries.
-      if (name == "." || name == "..") continue;
-      dirs.push_back(name + "/");
-    } else if (de->d_type == DT_REG && (android::base::EndsWithIgnoreCase(name, ".zip") ||
-                                        android::base::EndsWithIgnoreCase(name, ".map"))) {
-      entries.push_back(name);
-    }
-  }
-
-  std::sort(dirs.begin(), dirs.end());
-  std::sort(entries.begin(), entries.end());
-
-  // Append dirs to the entries list.
-  entries.insert(entries.end(), dirs.begin(), dirs.end());
-
   std::vector<std::string> headers{ "Choose a package to install:", path };
+  std::vector<std::string> entries;
 
   size_t chosen_item = 0;
   while (true) {
+    bool complete;
+    std::vector<std::string> listed = listing.GetEntries(&complete);
+    // "../" is always the first entry.
+    listed.insert(listed.begin(), "../");
+    // Keep the same entry highlighted, as entries show up before it.
+    if (chosen_item < entries.size()) {
+      auto it = std::find(listed.begin(), listed.end(), entries[chosen_item]);
+      chosen_item = it == listed.end() ? 0 : it - listed.begin();
+    }
+    entries = std::move(listed);
+
     chosen_item = ui->ShowMenu(
         headers, entries, chosen_item, true,
-        std::bind(&Device::HandleMenuKey, device, std::placeholders::_1, std::placeholders::_2));
+        std::bind(&Device::HandleMenuKey, device, std::placeholders::_1, std::placeholders::_2),
+        true /* refreshable */);
 
     // Return if WaitKey() was interrupted.
     if (chosen_item == static_cast<size_t>(RecoveryUI::KeyError::INTERRUPTED)) {
       return "";
     }
+    if (chosen_item == Device::kRefresh) {
+      chosen_item = ui->GetLastMenuSelection();
+      continue;
+    }
     if (chosen_item == Device::kGoHome) {
       return "@";
     }
@@ -150,6 +145,8 @@ InstallResult InstallWithFuseFromPath(std::string_view path, Device* device) {
   auto ui = device->GetUI();
   pid_t child;
   if ((child = fork()) == 0) {
+    // For the FUSE server, which hashes the blocks that it serves.
+    SchedPolicy::Get().Apply(ThreadClass::kCompute);
     bool status = StartInstallPackageFuse(path);
 
     _exit(status ? EXIT_SUCCESS : EXIT_FAILURE);
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+// The packages (.zip files and block maps) and the subdirectories in a directory, to browse for a
+// package to install. The directory is read in the background, in batches of getdents64(2), so
+// that the entries can be shown as they're found, rather than once a directory with thousands of
+// files has been read whole. Listings read whole are cached, for as long as the directory (its
+// device, inode and mtime) stays the same, so that going back to a directory shows it at once.
+class DirectoryListing {
+ public:
+  // The most listings that are cached.
+  static constexpr size_t kMaxCachedListings = 16;
+
+  // Starts listing |path|. |on_update| is called (from another thread) when entries have been
+  // added, at most once per update interval, and when the listing is complete.
+  DirectoryListing(const std::string& path, std::function<void()> on_update);
+
+  // Stops the reading, if it's not done.
+  ~DirectoryListing();
+
+  // Returns whether the directory could be opened.
+  bool ok() const {
+    return ok_;
+  }
+
+  // Returns the packages, then the subdirectories (with a trailing '/'), found so far, each sorted.
+  // Sets |complete| to whether the directory has been read whole.
+  std::vector<std::string> GetEntries(bool* complete);
+
+  // Forgets the cached listings.
+  static void ClearCache();
+
+ private:
+  void Read();
+
+  const std::string path_;
+  const std::function<void()> on_update_;
+  bool ok_{ false };
+  android::base::unique_fd fd_;
+  // The identity of the directory as it was opened, to cache the listing with.
+  dev_t dev_{ 0 };
+  ino_t ino_{ 0 };
+  struct timespec mtime_ {};
+
+  std::mutex mutex_;
+  std::vector<std::string> files_;
+  std::vector<std::string> dirs_;
+  bool complete_{ false };
+
+  std::atomic<bool> stopped_{ false };
+  std::thread reader_;
+};
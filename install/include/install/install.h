@@ -25,6 +25,7 @@
 #include <ziparchive/zip_archive.h>
 
 #include "otautil/package.h"
+#include "otautil/package_metadata.h"
 #include "recovery_ui/device.h"
 #include "recovery_ui/ui.h"
 
@@ -64,6 +65,7 @@ bool ReadMetadataFromPackage(ZipArchiveHandle zip, std::map<std::string, std::st
 // Checks if the metadata in the OTA package has expected values. Mandatory checks: ota-type,
 // pre-device and serial number (if presents). A/B OTA specific checks: pre-build version,
 // fingerprint, timestamp.
+bool CheckPackageMetadata(const PackageMetadata& metadata, OtaType ota_type, RecoveryUI* ui);
 bool CheckPackageMetadata(const std::map<std::string, std::string>& metadata, OtaType ota_type,
                           RecoveryUI* ui);
 
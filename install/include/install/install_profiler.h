@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Records the phases of an install (e.g. mounting, verifying the package, running each stage of
+// the updater), with the time, the CPU time and the I/O that each of them took, for last_install.
+//
+// The CPU time and the I/O are those of the whole recovery process, plus the update binary while
+// it runs (see SetChild()), which it's reaped into after it exits. Phases may overlap (e.g. the
+// package is verified while the update binary is being extracted), in which case they share the
+// counters for the overlap.
+class InstallProfiler {
+ public:
+  InstallProfiler();
+
+  // Starts the phase |name|. Anything but letters and digits in the name is replaced with '_'.
+  // Does nothing if a phase of that name is already running.
+  void BeginPhase(const std::string& name);
+
+  // Ends the phase |name|, if it's running.
+  void EndPhase(const std::string& name);
+
+  // Ends all the phases that are still running, e.g. those that an error skipped the end of.
+  void EndAllPhases();
+
+  // Sets the child process (the update binary), whose counters add to the phases while it runs;
+  // or -1 once it has been reaped.
+  void SetChild(pid_t pid);
+
+  // Returns the lines for last_install, one per ended phase in the order they started:
+  //   phase_<name>: <start ms> <duration ms> <cpu ms> <KiBs read> <KiBs written>
+  // where the start is relative to the construction of the profiler, and the I/O is what reached
+  // the storage (read_bytes and write_bytes of /proc/<pid>/io).
+  std::vector<std::string> GetLogLines() const;
+
+  // Returns the same as GetLogLines(), as the entries of the install metrics (see
+  // otautil/install_metrics.h): "phase_<name>_ms", "phase_<name>_cpu_ms", "phase_<name>_read_KiBs"
+  // and "phase_<name>_written_KiBs" for each ended phase.
+  std::vector<std::pair<std::string, int64_t>> GetMetrics() const;
+
+ private:
+  struct Counters {
+    int64_t time_ms;
+    int64_t cpu_ms;
+    int64_t read_bytes;
+    int64_t write_bytes;
+  };
+
+  struct Phase {
+    std::string name;
+    Counters begin;
+    std::optional<Counters> end;
+  };
+
+  // Reads the counters now. Must be called with |mutex_| held.
+  Counters ReadCounters() const;
+
+  const std::chrono::steady_clock::time_point start_;
+
+  mutable std::mutex mutex_;
+  pid_t child_{ -1 };
+  std::vector<Phase> phases_;
+};
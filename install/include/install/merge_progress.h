@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <string>
+
+// Follows the progress of a snapshot merge (as SnapshotManager::GetUpdateState() reports it, in
+// percent), to tell its throughput and how long it still has to go, while recovery waits for it.
+class MergeProgressMonitor {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // The weight of the latest rate in the smoothed rate.
+  static constexpr double kRateSmoothing = 0.3;
+  // The longest time without a report, when the progress doesn't reach another whole percent.
+  static constexpr std::chrono::seconds kReportInterval{ 30 };
+
+  // Records that the merge is |progress| percent done at |now|. Returns whether it's worth
+  // reporting: on the first sample, at each whole percent, and every report interval otherwise.
+  bool Update(double progress, Clock::time_point now);
+
+  double progress() const {
+    return progress_;
+  }
+
+  // Percent merged per second, or 0 until there's a rate to tell.
+  double rate() const {
+    return rate_;
+  }
+
+  // The time the merge should still take at the current rate, if there's one.
+  std::optional<std::chrono::seconds> remaining() const;
+
+  // Describes the progress, e.g. "42.0% (1.50%/s, about 0:39 left)".
+  std::string Describe() const;
+
+ private:
+  bool started_{ false };
+  double progress_{ 0 };
+  double rate_{ 0 };
+  Clock::time_point last_sample_;
+  Clock::time_point last_report_;
+  int last_reported_percent_{ -1 };
+};
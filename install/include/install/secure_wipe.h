@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bootloader_message/bootloader_message.h"
+
+// Secure-wiping a large partition with a single BLKSECDISCARD (or BLKDISCARD, BLKZEROOUT) can take
+// minutes without any progress, and starts over from scratch if it's interrupted. The partition
+// is thus wiped in chunks instead, several of them in flight at once, so that the progress can be
+// shown and checkpointed in misc as the chunks complete.
+
+struct SecureWipeOptions {
+  static constexpr uint64_t kDefaultChunkSize = 256 * 1024 * 1024;
+  static constexpr size_t kDefaultQueueDepth = 4;
+
+  // The size of each request, a multiple of 1 MiB.
+  uint64_t chunk_size = kDefaultChunkSize;
+  // How many requests are in flight at once.
+  size_t queue_depth = kDefaultQueueDepth;
+};
+
+// Wipes [offset, offset + length) of a device.
+using WipeRangeFn = std::function<bool(uint64_t offset, uint64_t length)>;
+// Takes the end of the part of the range that's wiped: everything below it is.
+using WipeProgressFn = std::function<void(uint64_t wiped)>;
+
+// Wipes [start, end) with |wipe_range|, in chunks as set by |options|. |progress| (if set) is
+// called, never concurrently, as the wiped part grows. On a failed chunk, no more chunks are
+// started and it returns false once the chunks in flight complete.
+bool WipeInChunks(uint64_t start, uint64_t end, const SecureWipeOptions& options,
+                  const WipeRangeFn& wipe_range, const WipeProgressFn& progress);
+
+// The wipe progress of the partitions in a wipe package, in misc. A checkpoint for another list of
+// partitions (or none at all) is ignored, and the wipe starts from the beginning of each.
+class WipeCheckpoint {
+ public:
+  // How far the wiped part of a partition grows between writes to misc.
+  static constexpr uint64_t kCheckpointInterval = 1024 * 1024 * 1024;
+
+  explicit WipeCheckpoint(const std::vector<std::string>& partitions);
+
+  // Returns how much of the partition at |index| of the list (from its start) is already wiped.
+  uint64_t Wiped(size_t index);
+
+  // Records that the first |wiped| bytes of the partition at |index| are wiped. It's written to
+  // misc once |kCheckpointInterval| more is wiped since the last write, or at once with |force|.
+  void Update(size_t index, uint64_t wiped, bool force = false);
+
+  // Removes the checkpoint, once the whole wipe is done.
+  void Clear();
+
+ private:
+  std::mutex mutex_;
+  misc_wipe_message message_{};
+  // What was last written to misc for each partition.
+  std::vector<uint64_t> written_;
+};
@@ -20,7 +20,12 @@
 #include <ota_metadata.pb.h>
 #include <ziparchive/zip_archive.h>
 
+#include "otautil/package_metadata.h"
+
 bool ViolatesSPLDowngrade(const build::tools::releasetools::OtaMetadata& metadata,
                           std::string_view current_spl);
 
 bool ViolatesSPLDowngrade(ZipArchiveHandle zip, std::string_view current_spl);
+
+// Checks the OtaMetadata kept in |metadata|, if it has any.
+bool ViolatesSPLDowngrade(const PackageMetadata& metadata, std::string_view current_spl);
@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "recovery_ui/ui.h"
+
+// Measures the I/O profile of the storage with a scratch file on /cache (see otautil/io_profile.h),
+// and saves it to Paths::io_profile_file() for the installs and wipes to calibrate their
+// parallelism with. Nothing but the scratch file is written. Returns true on success.
+bool BenchmarkStorage(RecoveryUI* ui);
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Runs the jobs of a wipe (the discards of WipeAbDevice(), the formats of WipeData()) at the same
+// time, as they mostly target separate block devices, and the time is spent waiting on the
+// storage rather than the CPU. A job can wait for other jobs, where the order matters.
+//
+// The jobs run regardless of how the jobs they wait for did, as a wipe proceeds past the parts it
+// fails to wipe; the order only matters for what's left on storage if the wipe is interrupted.
+class WipeExecutor {
+ public:
+  using Job = std::function<bool()>;
+  // Takes the fraction of the wipe that's done, from 0 to 1.
+  using ProgressFn = std::function<void(double)>;
+
+  static constexpr size_t kMaxConcurrentJobs = 4;
+
+  explicit WipeExecutor(size_t max_concurrent_jobs = kMaxConcurrentJobs);
+
+  // Adds a job, named |name| for the logs, that starts once the jobs in |after| are done. |weight|
+  // is its share of the progress, relative to the other jobs. Returns the id of the job, which
+  // later jobs can wait for.
+  size_t Add(std::string name, Job job, std::vector<size_t> after = {}, uint64_t weight = 1);
+
+  // Runs all the jobs, calling |progress| (if set) as each of them finishes. Returns whether all of
+  // them succeeded.
+  bool Run(const ProgressFn& progress = nullptr);
+
+ private:
+  struct Entry {
+    std::string name;
+    Job job;
+    std::vector<size_t> after;
+    uint64_t weight;
+    bool started{ false };
+    bool done{ false };
+  };
+
+  const size_t max_concurrent_jobs_;
+  std::vector<Entry> jobs_;
+};
@@ -32,6 +32,7 @@
 #include <condition_variable>
 #include <filesystem>
 #include <functional>
+#include <future>
 #include <limits>
 #include <mutex>
 #include <thread>
@@ -47,14 +48,19 @@
 #include <android-base/unique_fd.h>
 
 #include "bootloader_message/bootloader_message.h"
+#include "install/install_profiler.h"
 #include "install/snapshot_utils.h"
 #include "install/spl_check.h"
 #include "install/wipe_data.h"
 #include "install/wipe_device.h"
+#include "otautil/device_info.h"
 #include "otautil/error_code.h"
+#include "otautil/install_metrics.h"
 #include "otautil/package.h"
 #include "otautil/paths.h"
+#include "otautil/sched_policy.h"
 #include "otautil/sysutil.h"
+#include "otautil/updater_commands.h"
 #include "otautil/verifier.h"
 #include "private/setup_commands.h"
 #include "recovery_ui/device.h"
@@ -81,48 +87,27 @@ static constexpr float VERIFICATION_PROGRESS_FRACTION = 0.25;
 static constexpr auto&& RELEASE_KEYS_TAG = "release-keys";
 // If brick packages are smaller than |MEMORY_PACKAGE_LIMIT|, read the entire package into memory
 static constexpr size_t MEMORY_PACKAGE_LIMIT = 1024 * 1024;
+// The entries that the install reads right after the metadata.
+static constexpr const char* AB_OTA_PAYLOAD_PROPERTIES = "payload_properties.txt";
+static constexpr const char* UPDATE_BINARY_NAME = "META-INF/com/google/android/update-binary";
 
 static std::condition_variable finish_log_temperature;
-static bool isInStringList(const std::string& target_token, const std::string& str_list,
-                           const std::string& deliminator);
+static bool isInStringList(std::string_view target_token, std::string_view str_list,
+                           std::string_view deliminator);
 
 bool ReadMetadataFromPackage(ZipArchiveHandle zip, std::map<std::string, std::string>* metadata) {
   CHECK(metadata != nullptr);
 
-  static constexpr const char* METADATA_PATH = "META-INF/com/android/metadata";
-  ZipEntry64 entry;
-  if (FindEntry(zip, METADATA_PATH, &entry) != 0) {
+  auto package_metadata = PackageMetadata::Read(zip);
+  if (!package_metadata) {
     return false;
   }
-
-  uint32_t length = entry.uncompressed_length;
-  std::string metadata_string(length, '\0');
-  int32_t err =
-      ExtractToMemory(zip, &entry, reinterpret_cast<uint8_t*>(&metadata_string[0]), length);
-  if (err != 0) {
-    LOG(ERROR) << "Failed to extract " << METADATA_PATH << ": " << ErrorCodeString(err);
-    return false;
+  for (const auto& [key, value] : package_metadata->entries()) {
+    metadata->emplace(key, value);
   }
-
-  for (const std::string& line : android::base::Split(metadata_string, "\n")) {
-    size_t eq = line.find('=');
-    if (eq != std::string::npos) {
-      metadata->emplace(android::base::Trim(line.substr(0, eq)),
-                        android::base::Trim(line.substr(eq + 1)));
-    }
-  }
-
   return true;
 }
 
-// Gets the value for the given key in |metadata|. Returns an emtpy string if the key isn't
-// present.
-static std::string get_value(const std::map<std::string, std::string>& metadata,
-                             const std::string& key) {
-  const auto& it = metadata.find(key);
-  return (it == metadata.end()) ? "" : it->second;
-}
-
 static std::string OtaTypeToString(OtaType type) {
   switch (type) {
     case OtaType::AB:
@@ -134,39 +119,48 @@ static std::string OtaTypeToString(OtaType type) {
   }
 }
 
+// Logs the error |code| of the install to last_install, and to the install metrics.
+static void LogErrorCode(std::vector<std::string>* log_buffer, ErrorCode code) {
+  log_buffer->push_back(android::base::StringPrintf("error: %d", code));
+  AppendInstallMetrics(Paths::Get().temporary_install_metrics_file(), { { "error", code } });
+}
+
 // Read the build.version.incremental of src/tgt from the metadata and log it to last_install.
-static void ReadSourceTargetBuild(const std::map<std::string, std::string>& metadata,
+static void ReadSourceTargetBuild(const PackageMetadata& metadata,
                                   std::vector<std::string>* log_buffer) {
   // Examples of the pre-build and post-build strings in metadata:
   //   pre-build-incremental=2943039
   //   post-build-incremental=2951741
-  auto source_build = get_value(metadata, "pre-build-incremental");
+  auto source_build = metadata.Get("pre-build-incremental");
   if (!source_build.empty()) {
-    log_buffer->push_back("source_build: " + source_build);
+    log_buffer->push_back("source_build: " + std::string(source_build));
+    if (int64_t version; android::base::ParseInt(std::string(source_build), &version)) {
+      AppendInstallMetrics(Paths::Get().temporary_install_metrics_file(),
+                           { { "source_build", version } });
+    }
   }
 
-  auto target_build = get_value(metadata, "post-build-incremental");
+  auto target_build = metadata.Get("post-build-incremental");
   if (!target_build.empty()) {
-    log_buffer->push_back("target_build: " + target_build);
+    log_buffer->push_back("target_build: " + std::string(target_build));
   }
 }
 
 // Checks the build version, fingerprint and timestamp in the metadata of the A/B package.
 // Downgrading is not allowed unless explicitly enabled in the package and only for
 // incremental packages.
-static bool CheckAbSpecificMetadata(const std::map<std::string, std::string>& metadata,
-                                    RecoveryUI* ui) {
+static bool CheckAbSpecificMetadata(const PackageMetadata& metadata, RecoveryUI* ui) {
   // Incremental updates should match the current build.
-  auto device_pre_build = android::base::GetProperty("ro.build.version.incremental", "");
-  auto pkg_pre_build = get_value(metadata, "pre-build-incremental");
+  auto device_pre_build = DeviceInfo::Get().GetProperty("ro.build.version.incremental");
+  auto pkg_pre_build = metadata.Get("pre-build-incremental");
   if (!pkg_pre_build.empty() && pkg_pre_build != device_pre_build) {
     LOG(ERROR) << "Package is for source build " << pkg_pre_build << " but expected "
                << device_pre_build;
     return false;
   }
 
-  auto device_fingerprint = android::base::GetProperty("ro.build.fingerprint", "");
-  auto pkg_pre_build_fingerprint = get_value(metadata, "pre-build");
+  auto device_fingerprint = DeviceInfo::Get().GetProperty("ro.build.fingerprint");
+  auto pkg_pre_build_fingerprint = metadata.Get("pre-build");
   if (!pkg_pre_build_fingerprint.empty() &&
       !isInStringList(device_fingerprint, pkg_pre_build_fingerprint, FINGERPRING_SEPARATOR)) {
     LOG(ERROR) << "Package is for source build " << pkg_pre_build_fingerprint << " but expected "
@@ -177,15 +171,15 @@ static bool CheckAbSpecificMetadata(const std::map<std::string, std::string>& me
   // Check for downgrade version.
   bool undeclared_downgrade = false;
   int64_t build_timestamp =
-      android::base::GetIntProperty("ro.build.date.utc", std::numeric_limits<int64_t>::max());
+      DeviceInfo::Get().GetIntProperty("ro.build.date.utc", std::numeric_limits<int64_t>::max());
   int64_t pkg_post_timestamp = 0;
   // We allow to full update to the same version we are running, in case there
   // is a problem with the current copy of that version.
-  auto pkg_post_timestamp_string = get_value(metadata, "post-timestamp");
+  auto pkg_post_timestamp_string = metadata.Get("post-timestamp");
   if (pkg_post_timestamp_string.empty() ||
-      !android::base::ParseInt(pkg_post_timestamp_string, &pkg_post_timestamp) ||
+      !android::base::ParseInt(std::string(pkg_post_timestamp_string), &pkg_post_timestamp) ||
       pkg_post_timestamp < build_timestamp) {
-    if (get_value(metadata, "ota-downgrade") != "yes") {
+    if (metadata.Get("ota-downgrade") != "yes") {
       LOG(ERROR) << "Update package is older than the current build, expected a build "
                     "newer than timestamp "
                  << build_timestamp << " but package has timestamp " << pkg_post_timestamp
@@ -205,9 +199,8 @@ static bool CheckAbSpecificMetadata(const std::map<std::string, std::string>& me
   return true;
 }
 
-bool CheckPackageMetadata(const std::map<std::string, std::string>& metadata, OtaType ota_type,
-                          RecoveryUI* ui) {
-  auto package_ota_type = get_value(metadata, "ota-type");
+bool CheckPackageMetadata(const PackageMetadata& metadata, OtaType ota_type, RecoveryUI* ui) {
+  auto package_ota_type = metadata.Get("ota-type");
   auto expected_ota_type = OtaTypeToString(ota_type);
   if (ota_type != OtaType::AB && ota_type != OtaType::BRICK) {
     LOG(INFO) << "Skip package metadata check for ota type " << expected_ota_type;
@@ -220,8 +213,8 @@ bool CheckPackageMetadata(const std::map<std::string, std::string>& metadata, Ot
     return false;
   }
 
-  auto device = android::base::GetProperty("ro.product.device", "");
-  auto pkg_device = get_value(metadata, "pre-device");
+  auto device = DeviceInfo::Get().GetProperty("ro.product.device");
+  auto pkg_device = metadata.Get("pre-device");
   // device name can be a | separated list, so need to check
   if (pkg_device.empty() || !isInStringList(device, pkg_device, FINGERPRING_SEPARATOR ":" ",")) {
     LOG(ERROR) << "Package is for product " << pkg_device << " but expected " << device;
@@ -232,11 +225,11 @@ bool CheckPackageMetadata(const std::map<std::string, std::string>& metadata, Ot
   // numbers split by "|"; e.g. serialno=serialno1|serialno2|serialno3 ... We will fail the
   // verification if the device's serialno doesn't match any of these carried numbers.
 
-  auto pkg_serial_no = get_value(metadata, "serialno");
+  auto pkg_serial_no = metadata.Get("serialno");
   if (!pkg_serial_no.empty()) {
-    auto device_serial_no = android::base::GetProperty("ro.serialno", "");
+    auto device_serial_no = DeviceInfo::Get().GetProperty("ro.serialno");
     bool serial_number_match = false;
-    for (const auto& number : android::base::Split(pkg_serial_no, "|")) {
+    for (const auto& number : android::base::Split(std::string(pkg_serial_no), "|")) {
       if (device_serial_no == android::base::Trim(number)) {
         serial_number_match = true;
       }
@@ -246,7 +239,7 @@ bool CheckPackageMetadata(const std::map<std::string, std::string>& metadata, Ot
       return false;
     }
   } else if (ota_type == OtaType::BRICK) {
-    const auto device_build_tag = android::base::GetProperty("ro.build.tags", "");
+    const auto device_build_tag = DeviceInfo::Get().GetProperty("ro.build.tags");
     if (device_build_tag.empty()) {
       LOG(ERROR) << "Unable to determine device build tags, serial number is missing from package. "
                     "Rejecting the brick OTA package.";
@@ -269,10 +262,18 @@ bool CheckPackageMetadata(const std::map<std::string, std::string>& metadata, Ot
   return true;
 }
 
+bool CheckPackageMetadata(const std::map<std::string, std::string>& metadata, OtaType ota_type,
+                          RecoveryUI* ui) {
+  std::string text;
+  for (const auto& [key, value] : metadata) {
+    text += key + "=" + value + "\n";
+  }
+  return CheckPackageMetadata(PackageMetadata(std::move(text)), ota_type, ui);
+}
+
 static std::string ExtractPayloadProperties(ZipArchiveHandle zip) {
   // For A/B updates we extract the payload properties to a buffer and obtain the RAW payload offset
   // in the zip file.
-  static constexpr const char* AB_OTA_PAYLOAD_PROPERTIES = "payload_properties.txt";
   ZipEntry64 properties_entry;
   if (FindEntry(zip, AB_OTA_PAYLOAD_PROPERTIES, &properties_entry) != 0) {
     return {};
@@ -295,10 +296,38 @@ static std::string ExtractPayloadProperties(ZipArchiveHandle zip) {
   return payload_properties;
 }
 
+// Asks the kernel to read ahead the start of the payload, which update_engine_sideload reads first
+// (the header, the manifest and the first operations), so that it finds them in the page cache
+// rather than reading them cold. The readahead goes on in the background, while the properties
+// are extracted, the package verification is waited on and the child is forked. For a package on
+// the FUSE mount of a sideload, it fetches the blocks from the host into the block cache.
+static void PrefetchPayload(const std::string& package, uint64_t offset, uint64_t length) {
+  static constexpr uint64_t kPayloadPrefetchSize = 16 * 1024 * 1024;
+
+  android::base::unique_fd fd(open(package.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1) {
+    PLOG(WARNING) << "Failed to open " << package << " to prefetch the payload";
+    return;
+  }
+  if (int err = posix_fadvise(fd.get(), offset, std::min(length, kPayloadPrefetchSize),
+                              POSIX_FADV_WILLNEED);
+      err != 0) {
+    LOG(WARNING) << "Failed to prefetch the payload of " << package << ": " << strerror(err);
+  }
+}
+
 bool SetUpAbUpdateCommands(const std::string& package, ZipArchiveHandle zip, int status_fd,
                            std::vector<std::string>* cmd) {
   CHECK(cmd != nullptr);
 
+  static constexpr const char* AB_OTA_PAYLOAD = "payload.bin";
+  ZipEntry64 payload_entry;
+  if (FindEntry(zip, AB_OTA_PAYLOAD, &payload_entry) != 0) {
+    LOG(ERROR) << "Failed to find " << AB_OTA_PAYLOAD;
+    return false;
+  }
+  PrefetchPayload(package, payload_entry.offset, payload_entry.uncompressed_length);
+
   // For A/B updates we extract the payload properties to a buffer and obtain the RAW payload offset
   // in the zip file.
   const auto payload_properties = ExtractPayloadProperties(zip);
@@ -306,12 +335,6 @@ bool SetUpAbUpdateCommands(const std::string& package, ZipArchiveHandle zip, int
     return false;
   }
 
-  static constexpr const char* AB_OTA_PAYLOAD = "payload.bin";
-  ZipEntry64 payload_entry;
-  if (FindEntry(zip, AB_OTA_PAYLOAD, &payload_entry) != 0) {
-    LOG(ERROR) << "Failed to find " << AB_OTA_PAYLOAD;
-    return false;
-  }
   long payload_offset = payload_entry.offset;
   *cmd = {
     "/system/bin/update_engine_sideload",
@@ -328,7 +351,6 @@ bool SetUpNonAbUpdateCommands(const std::string& package, ZipArchiveHandle zip,
   CHECK(cmd != nullptr);
 
   // In non-A/B updates we extract the update binary from the package.
-  static constexpr const char* UPDATE_BINARY_NAME = "META-INF/com/google/android/update-binary";
   ZipEntry64 binary_entry;
   if (FindEntry(zip, UPDATE_BINARY_NAME, &binary_entry) != 0) {
     LOG(ERROR) << "Failed to find update binary " << UPDATE_BINARY_NAME;
@@ -385,19 +407,43 @@ static bool PerformPowerwashIfRequired(ZipArchiveHandle zip, Device *device) {
   return true;
 }
 
-// If the package contains an update binary, extract it and run it.
+// Hints |package| to read ahead the data of the entry |name| in |zip|, if there's such an entry.
+static void PrefetchEntry(Package* package, ZipArchiveHandle zip, const char* name) {
+  ZipEntry64 entry;
+  if (zip != nullptr && FindEntry(zip, name, &entry) == 0) {
+    package->Prefetch(entry.offset, entry.compressed_length);
+  }
+}
+
+// If the package contains an update binary, extract it and run it. The checks and the extraction
+// may run before the package is verified; |wait_for_verification| is called before anything is
+// written to the device, and the install stops there if it returns false.
 static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
                                      std::vector<std::string>* log_buffer, int retry_count,
-                                     int* max_temperature, Device* device) {
+                                     int* max_temperature, Device* device,
+                                     const std::function<bool()>& wait_for_verification,
+                                     InstallProfiler* profiler) {
   auto ui = device->GetUI();
-  std::map<std::string, std::string> metadata;
+  profiler->BeginPhase("metadata");
   auto zip = package->GetZipArchiveHandle();
-  bool has_metadata = ReadMetadataFromPackage(zip, &metadata);
-
-  const bool package_is_ab = has_metadata && get_value(metadata, "ota-type") == OtaTypeToString(OtaType::AB);
-  const bool package_is_brick = get_value(metadata, "ota-type") == OtaTypeToString(OtaType::BRICK);
+  // The metadata is read once, and kept on the package for the other checks.
+  const PackageMetadata* package_metadata = package->GetMetadata();
+  bool has_metadata = package_metadata != nullptr;
+  PackageMetadata no_metadata;
+  const PackageMetadata& metadata = has_metadata ? *package_metadata : no_metadata;
+
+  const bool package_is_ab =
+      has_metadata && metadata.Get("ota-type") == OtaTypeToString(OtaType::AB);
+  const bool package_is_brick = metadata.Get("ota-type") == OtaTypeToString(OtaType::BRICK);
+  // The entry that the install extracts first is read ahead while the metadata is checked.
+  if (!package_is_brick) {
+    PrefetchEntry(package, zip, package_is_ab ? AB_OTA_PAYLOAD_PROPERTIES : UPDATE_BINARY_NAME);
+  }
   if (package_is_brick) {
     LOG(INFO) << "Installing a brick package";
+    if (!wait_for_verification()) {
+      return INSTALL_CORRUPT;
+    }
     if (package->GetType() == PackageType::kFile &&
         package->GetPackageSize() < MEMORY_PACKAGE_LIMIT) {
       std::vector<uint8_t> content(package->GetPackageSize());
@@ -408,13 +454,14 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
     }
     return WipeAbDevice(device, package) ? INSTALL_SUCCESS : INSTALL_ERROR;
   }
-  bool device_supports_ab = android::base::GetBoolProperty("ro.build.ab_update", false);
+  bool device_supports_ab = DeviceInfo::Get().GetBoolProperty("ro.build.ab_update", false);
   bool ab_device_supports_nonab = true;
   bool device_only_supports_ab = device_supports_ab && !ab_device_supports_nonab;
-  bool device_supports_virtual_ab = android::base::GetBoolProperty("ro.virtual_ab.enabled", false);
+  bool device_supports_virtual_ab =
+      DeviceInfo::Get().GetBoolProperty("ro.virtual_ab.enabled", false);
 
-  const auto current_spl = android::base::GetProperty("ro.build.version.security_patch", "");
-  if (ViolatesSPLDowngrade(zip, current_spl)) {
+  const auto current_spl = DeviceInfo::Get().GetProperty("ro.build.version.security_patch");
+  if (ViolatesSPLDowngrade(metadata, current_spl)) {
     LOG(WARNING) << "This is SPL downgrade";
   }
 
@@ -443,21 +490,19 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
   //   still calls CheckPackageMetadata to get a meaningful error message.
   if (package_is_ab || device_only_supports_ab) {
     if (!CheckPackageMetadata(metadata, OtaType::AB, ui)) {
-      log_buffer->push_back(android::base::StringPrintf("error: %d", kUpdateBinaryCommandFailure));
+      LogErrorCode(log_buffer, kUpdateBinaryCommandFailure);
       return INSTALL_ERROR;
     }
   }
 
-  if (!package_is_ab && !logical_partitions_mapped()) {
-    CreateSnapshotPartitions();
-    map_logical_partitions();
-  } else if (package_is_ab && device_supports_virtual_ab && logical_partitions_mapped()) {
+  if (package_is_ab && device_supports_virtual_ab && logical_partitions_mapped()) {
     LOG(ERROR) << "Logical partitions are mapped. "
                << "Please reboot recovery before installing an OTA update.";
     return INSTALL_ERROR;
   }
 
   ReadSourceTargetBuild(metadata, log_buffer);
+  profiler->EndPhase("metadata");
 
   // The updater in child process writes to the pipe to communicate with recovery.
   android::base::unique_fd pipe_read, pipe_write;
@@ -499,29 +544,52 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
   //   log <string>
   //       updater requests logging the string (e.g. cause of the failure).
   //
+  //   stage <string>
+  //       updater has set the stage of a multi-stage install; the install phases that follow are
+  //       timed as that stage.
+  //
+  // An updater that accepts the offer of kBinaryCommandsEnv sends the same commands as frames
+  // instead, which take no formatting or parsing (see otautil/updater_commands.h).
+  //
 
   std::string package_path = package->GetPath();
 
+  profiler->BeginPhase("extract");
   std::vector<std::string> args;
   if (auto setup_result =
           package_is_ab
               ? SetUpAbUpdateCommands(package_path, zip, pipe_write.get(), &args)
               : SetUpNonAbUpdateCommands(package_path, zip, retry_count, pipe_write.get(), &args);
       !setup_result) {
-    log_buffer->push_back(android::base::StringPrintf("error: %d", kUpdateBinaryCommandFailure));
+    LogErrorCode(log_buffer, kUpdateBinaryCommandFailure);
     return INSTALL_CORRUPT;
   }
+  profiler->EndPhase("extract");
+
+  // Everything from here on changes the device, so the package must have been verified by now.
+  if (!wait_for_verification()) {
+    return INSTALL_CORRUPT;
+  }
+
+  profiler->BeginPhase("spawn");
+  if (!package_is_ab && !logical_partitions_mapped()) {
+    CreateSnapshotPartitions();
+    map_logical_partitions();
+  }
 
   pid_t pid = fork();
   if (pid == -1) {
     PLOG(ERROR) << "Failed to fork update binary";
-    log_buffer->push_back(android::base::StringPrintf("error: %d", kForkUpdateBinaryFailure));
+    LogErrorCode(log_buffer, kForkUpdateBinaryFailure);
     return INSTALL_ERROR;
   }
 
   if (pid == 0) {
     umask(022);
     pipe_read.reset();
+    if (!package_is_ab) {
+      setenv(kBinaryCommandsEnv, "1", 1);
+    }
 
     // Convert the std::string vector to a NULL-terminated char* vector suitable for execv.
     auto chr_args = StringVectorToNullTerminatedArray(args);
@@ -533,71 +601,77 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
     _exit(EXIT_FAILURE);
   }
   pipe_write.reset();
+  profiler->SetChild(pid);
+  profiler->EndPhase("spawn");
+  profiler->BeginPhase("updater");
 
   std::atomic<bool> logger_finished(false);
   std::thread temperature_logger(log_max_temperature, max_temperature, std::ref(logger_finished));
 
   *wipe_cache = false;
   bool retry_update = false;
-
-  char buffer[1024];
-  FILE* from_child = android::base::Fdopen(std::move(pipe_read), "r");
-  while (fgets(buffer, sizeof(buffer), from_child) != nullptr) {
-    std::string line(buffer);
-    size_t space = line.find_first_of(" \n");
-    std::string command(line.substr(0, space));
-    if (command.empty()) continue;
-
-    // Get rid of the leading and trailing space and/or newline.
-    std::string args = space == std::string::npos ? "" : android::base::Trim(line.substr(space));
-
-    if (command == "progress") {
-      std::vector<std::string> tokens = android::base::Split(args, " ");
-      double fraction;
-      int seconds;
-      if (tokens.size() == 2 && android::base::ParseDouble(tokens[0].c_str(), &fraction) &&
-          android::base::ParseInt(tokens[1], &seconds)) {
-        ui->ShowProgress(fraction * (1 - VERIFICATION_PROGRESS_FRACTION), seconds);
-      } else {
-        LOG(ERROR) << "invalid \"progress\" parameters: " << line;
+  std::string stage_phase;
+
+  {
+    UpdaterCommandReader from_child(std::move(pipe_read));
+    UpdaterCommand command;
+    while (from_child.Next(&command)) {
+      switch (command.type) {
+        case UpdaterCommandType::PROGRESS:
+          ui->ShowProgress(command.fraction * (1 - VERIFICATION_PROGRESS_FRACTION),
+                           command.seconds);
+          break;
+        case UpdaterCommandType::SET_PROGRESS:
+          ui->SetProgress(command.fraction);
+          break;
+        case UpdaterCommandType::UI_PRINT:
+          ui->PrintOnScreenOnly("%s\n", command.text.c_str());
+          fflush(stdout);
+          break;
+        case UpdaterCommandType::WIPE_CACHE:
+          *wipe_cache = true;
+          break;
+        case UpdaterCommandType::CLEAR_DISPLAY:
+          ui->SetBackground(RecoveryUI::NONE);
+          break;
+        case UpdaterCommandType::ENABLE_REBOOT:
+          // packages can explicitly request that they want the user
+          // to be able to reboot during installation (useful for
+          // debugging packages that don't exit).
+          ui->SetEnableReboot(true);
+          break;
+        case UpdaterCommandType::RETRY_UPDATE:
+          retry_update = true;
+          break;
+        case UpdaterCommandType::LOG:
+          // Save the logging request from updater and write to last_install later.
+          log_buffer->push_back(command.text);
+          break;
+        case UpdaterCommandType::STAGE:
+          if (!stage_phase.empty()) {
+            profiler->EndPhase(stage_phase);
+          }
+          stage_phase = "stage_" + command.text;
+          profiler->BeginPhase(stage_phase);
+          break;
+        case UpdaterCommandType::INVALID:
+          LOG(ERROR) << "invalid command parameters: " << command.text;
+          break;
+        case UpdaterCommandType::TEXT:
+          LOG(ERROR) << "unknown command [" << command.text << "]";
+          break;
       }
-    } else if (command == "set_progress") {
-      std::vector<std::string> tokens = android::base::Split(args, " ");
-      double fraction;
-      if (tokens.size() == 1 && android::base::ParseDouble(tokens[0].c_str(), &fraction)) {
-        ui->SetProgress(fraction);
-      } else {
-        LOG(ERROR) << "invalid \"set_progress\" parameters: " << line;
-      }
-    } else if (command == "ui_print") {
-      ui->PrintOnScreenOnly("%s\n", args.c_str());
-      fflush(stdout);
-    } else if (command == "wipe_cache") {
-      *wipe_cache = true;
-    } else if (command == "clear_display") {
-      ui->SetBackground(RecoveryUI::NONE);
-    } else if (command == "enable_reboot") {
-      // packages can explicitly request that they want the user
-      // to be able to reboot during installation (useful for
-      // debugging packages that don't exit).
-      ui->SetEnableReboot(true);
-    } else if (command == "retry_update") {
-      retry_update = true;
-    } else if (command == "log") {
-      if (!args.empty()) {
-        // Save the logging request from updater and write to last_install later.
-        log_buffer->push_back(args);
-      } else {
-        LOG(ERROR) << "invalid \"log\" parameters: " << line;
-      }
-    } else {
-      LOG(ERROR) << "unknown command [" << command << "]";
     }
+    // Closes the pipe. An updater that's still writing (past a malformed frame) gets EPIPE.
   }
-  fclose(from_child);
 
   int status;
   waitpid(pid, &status, 0);
+  if (!stage_phase.empty()) {
+    profiler->EndPhase(stage_phase);
+  }
+  profiler->EndPhase("updater");
+  profiler->SetChild(-1);
 
   logger_finished.store(true);
   finish_log_temperature.notify_one();
@@ -630,21 +704,40 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
 
 static InstallResult VerifyAndInstallPackage(Package* package, bool* wipe_cache,
                                              std::vector<std::string>* log_buffer, int retry_count,
-                                             int* max_temperature, Device* device) {
+                                             int* max_temperature, Device* device,
+                                             InstallProfiler* profiler) {
   auto ui = device->GetUI();
   ui->SetBackground(RecoveryUI::INSTALLING_UPDATE);
   // Give verification half the progress bar...
   ui->SetProgressType(RecoveryUI::DETERMINATE);
   ui->ShowProgress(VERIFICATION_PROGRESS_FRACTION, VERIFICATION_PROGRESS_TIME);
 
-  /*
-  if (!verify_package(package, ui)) {
-    log_buffer->push_back(android::base::StringPrintf("error: %d", kZipVerificationFailure));
-    if (!ui->IsTextVisible() || !ask_to_continue_unverified(ui->GetDevice())) {
-        return INSTALL_CORRUPT;
+  // Verification is off unless the device asks for it. When on, the whole-file hash runs in the
+  // background while TryUpdateBinary() reads the metadata, runs the checks and extracts the
+  // update binary, which then waits for the result before touching the device.
+  std::future<bool> verified;
+  if (DeviceInfo::Get().GetBoolProperty("ro.recovery.verify_package", false)) {
+    verified = std::async(std::launch::async, [package, ui, profiler]() {
+      profiler->BeginPhase("verify");
+      bool result = verify_package(package, ui);
+      profiler->EndPhase("verify");
+      return result;
+    });
+  }
+  const auto wait_for_verification = [&]() {
+    if (!verified.valid()) {
+      return true;
     }
-  }
-   */
+    // How long the install is held up by the verification, as opposed to overlapped with it.
+    profiler->BeginPhase("verify_wait");
+    bool result = verified.get();
+    profiler->EndPhase("verify_wait");
+    if (result) {
+      return true;
+    }
+    LogErrorCode(log_buffer, kZipVerificationFailure);
+    return ui->IsTextVisible() && ask_to_continue_unverified(device);
+  };
 
   // Verify and install the contents of the package.
   ui->Print("Installing update...\n");
@@ -652,8 +745,8 @@ static InstallResult VerifyAndInstallPackage(Package* package, bool* wipe_cache,
     ui->Print("Retry attempt: %d\n", retry_count);
   }
   ui->SetEnableReboot(false);
-  auto result =
-      TryUpdateBinary(package, wipe_cache, log_buffer, retry_count, max_temperature, device);
+  auto result = TryUpdateBinary(package, wipe_cache, log_buffer, retry_count, max_temperature,
+                                device, wait_for_verification, profiler);
   ui->SetEnableReboot(true);
   ui->Print("\n");
 
@@ -664,6 +757,7 @@ InstallResult InstallPackage(Package* package, const std::string_view package_id
                              bool should_wipe_cache, int retry_count, Device* device) {
   auto ui = device->GetUI();
   auto start = std::chrono::system_clock::now();
+  InstallProfiler profiler;
 
   int start_temperature = GetMaxValueFromThermalZone();
   int max_temperature = start_temperature;
@@ -671,26 +765,51 @@ InstallResult InstallPackage(Package* package, const std::string_view package_id
   InstallResult result;
   std::vector<std::string> log_buffer;
 
+  // The verification runs on this thread, and the updater inherits its policy. The thread goes back
+  // to the menus afterwards.
+  ScopedSchedPolicy sched_policy(&SchedPolicy::Get(), ThreadClass::kCompute);
+
   ui->Print("Supported API: %d\n", kRecoveryApiVersion);
 
+  // The updater appends to the trace (if enabled) and to the metrics, so drop the ones from any
+  // earlier install.
+  unlink(Paths::Get().temporary_update_trace_file().c_str());
+  const std::string& metrics_file = Paths::Get().temporary_install_metrics_file();
+  unlink(metrics_file.c_str());
+
   ui->Print("Finding update package...\n");
   LOG(INFO) << "Update package id: " << package_id;
   if (!package) {
-    log_buffer.push_back(android::base::StringPrintf("error: %d", kMapFileFailure));
+    LogErrorCode(&log_buffer, kMapFileFailure);
     result = INSTALL_CORRUPT;
-  } else if (setup_install_mounts() != 0) {
-    LOG(ERROR) << "failed to set up expected mounts for install; aborting";
-    result = INSTALL_ERROR;
   } else {
-    bool updater_wipe_cache = false;
-    result = VerifyAndInstallPackage(package, &updater_wipe_cache, &log_buffer, retry_count,
-                                     &max_temperature, device);
-    should_wipe_cache = should_wipe_cache || updater_wipe_cache;
+    profiler.BeginPhase("mount");
+    int mount_result = setup_install_mounts();
+    profiler.EndPhase("mount");
+    if (mount_result != 0) {
+      LOG(ERROR) << "failed to set up expected mounts for install; aborting";
+      result = INSTALL_ERROR;
+    } else {
+      bool updater_wipe_cache = false;
+      result = VerifyAndInstallPackage(package, &updater_wipe_cache, &log_buffer, retry_count,
+                                       &max_temperature, device, &profiler);
+      should_wipe_cache = should_wipe_cache || updater_wipe_cache;
+    }
   }
+  profiler.EndAllPhases();
+  profiler.BeginPhase("finish");
 
   // Measure the time spent to apply OTA update in seconds.
   std::chrono::duration<double> duration = std::chrono::system_clock::now() - start;
   int time_total = static_cast<int>(duration.count());
+  std::vector<std::pair<std::string, int64_t>> metrics = {
+    { "result", result == INSTALL_SUCCESS ? 1 : 0 },
+    { "time_total", time_total },
+    { "retry", retry_count },
+  };
+  if (package_id == "/sideload/package.zip") {
+    metrics.emplace_back("sideload", 1);
+  }
 
   bool has_cache = volume_for_mount_point("/cache") != nullptr;
   // Skip logging the uncrypt_status on devices without /cache.
@@ -706,6 +825,14 @@ InstallResult InstallPackage(Package* package, const std::string_view package_id
         LOG(WARNING) << "corrupted uncrypt_status: " << uncrypt_status;
       } else {
         log_buffer.push_back(android::base::Trim(uncrypt_status));
+        // e.g. "uncrypt_time: 10\nuncrypt_error: 0\n".
+        for (const auto& line : android::base::Split(uncrypt_status, "\n")) {
+          auto pieces = android::base::Split(line, ":");
+          if (int64_t value; pieces.size() == 2 &&
+                             android::base::ParseInt(android::base::Trim(pieces[1]), &value)) {
+            metrics.emplace_back(android::base::Trim(pieces[0]), value);
+          }
+        }
       }
     }
   }
@@ -722,14 +849,24 @@ InstallResult InstallPackage(Package* package, const std::string_view package_id
   max_temperature = std::max(end_temperature, max_temperature);
   if (start_temperature > 0) {
     log_buffer.push_back("temperature_start: " + std::to_string(start_temperature));
+    metrics.emplace_back("temperature_start", start_temperature);
   }
   if (end_temperature > 0) {
     log_buffer.push_back("temperature_end: " + std::to_string(end_temperature));
+    metrics.emplace_back("temperature_end", end_temperature);
   }
   if (max_temperature > 0) {
     log_buffer.push_back("temperature_max: " + std::to_string(max_temperature));
+    metrics.emplace_back("temperature_max", max_temperature);
   }
 
+  profiler.EndPhase("finish");
+  auto phase_lines = profiler.GetLogLines();
+  log_buffer.insert(log_buffer.end(), phase_lines.begin(), phase_lines.end());
+  auto phase_metrics = profiler.GetMetrics();
+  metrics.insert(metrics.end(), phase_metrics.begin(), phase_metrics.end());
+  AppendInstallMetrics(metrics_file, metrics);
+
   std::string log_content =
       android::base::Join(log_header, "\n") + "\n" + android::base::Join(log_buffer, "\n") + "\n";
   const std::string& install_file = Paths::Get().temporary_install_file();
@@ -761,7 +898,9 @@ bool verify_package(Package* package, RecoveryUI* ui) {
   // Verify package.
   ui->Print("Verifying update package...\n");
   auto t0 = std::chrono::system_clock::now();
+  package->PrepareForAccess(PackageAccess::kVerify);
   int err = verify_file(package, loaded_keys);
+  package->PrepareForAccess(PackageAccess::kInstall);
   std::chrono::duration<double> duration = std::chrono::system_clock::now() - t0;
   ui->Print("Update package verification took %.1f s (result %d).\n", duration.count(), err);
   if (err != VERIFY_SUCCESS) {
@@ -822,13 +961,22 @@ bool SetupPackageMount(const std::string& package_path, bool* should_use_fuse) {
 // list delimited by `deliminator`
 // E.X. isInStringList("a", "a|b|c|d", "|") => true
 // E.X. isInStringList("abc", "abc", "|") => true
-static bool isInStringList(const std::string& target_token, const std::string& str_list,
-                           const std::string& deliminator) {
+static bool isInStringList(std::string_view target_token, std::string_view str_list,
+                           std::string_view deliminator) {
   if (target_token.length() > str_list.length()) {
     return false;
   } else if (target_token.length() == str_list.length() || deliminator.length() == 0) {
     return target_token == str_list;
   }
-  auto&& list = android::base::Split(str_list, deliminator);
-  return std::find(list.begin(), list.end(), target_token) != list.end();
+  // Scans the tokens in place, split at any of the characters in |deliminator|.
+  while (true) {
+    size_t end = str_list.find_first_of(deliminator);
+    if (str_list.substr(0, end) == target_token) {
+      return true;
+    }
+    if (end == std::string_view::npos) {
+      return false;
+    }
+    str_list.remove_prefix(end + 1);
+  }
 }
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "install/install_profiler.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+// Adds the read_bytes and write_bytes in |io_file| (e.g. /proc/self/io) to |read_bytes| and
+// |write_bytes|. Missing counters (e.g. no CONFIG_TASK_IO_ACCOUNTING) count as zero.
+static void ReadIoCounters(const std::string& io_file, int64_t* read_bytes, int64_t* write_bytes) {
+  std::string content;
+  if (!android::base::ReadFileToString(io_file, &content)) {
+    return;
+  }
+  for (const auto& line : android::base::Split(content, "\n")) {
+    std::vector<std::string> pieces = android::base::Split(line, ":");
+    int64_t value;
+    if (pieces.size() != 2 || !android::base::ParseInt(android::base::Trim(pieces[1]), &value)) {
+      continue;
+    }
+    if (pieces[0] == "read_bytes") {
+      *read_bytes += value;
+    } else if (pieces[0] == "write_bytes") {
+      *write_bytes += value;
+    }
+  }
+}
+
+// Returns the user and system time of the process |pid| in ms, from /proc/<pid>/stat.
+static int64_t ReadProcessCpuMs(pid_t pid) {
+  std::string content;
+  if (!android::base::ReadFileToString(android::base::StringPrintf("/proc/%d/stat", pid),
+                                       &content)) {
+    return 0;
+  }
+  // The fields after the command (which may have spaces) start with the state; utime and stime
+  // are the 14th and 15th fields.
+  size_t command_end = content.rfind(')');
+  if (command_end == std::string::npos) {
+    return 0;
+  }
+  std::vector<std::string> fields = android::base::Split(content.substr(command_end + 2), " ");
+  int64_t utime, stime;
+  if (fields.size() < 13 || !android::base::ParseInt(fields[11], &utime) ||
+      !android::base::ParseInt(fields[12], &stime)) {
+    return 0;
+  }
+  return (utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
+}
+
+static int64_t RusageCpuMs(int who) {
+  struct rusage usage;
+  if (getrusage(who, &usage) != 0) {
+    return 0;
+  }
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+}
+
+static std::string PhaseName(std::string name) {
+  std::replace_if(
+      name.begin(), name.end(), [](char c) { return !isalnum(static_cast<unsigned char>(c)); },
+      '_');
+  return name;
+}
+
+InstallProfiler::InstallProfiler() : start_(std::chrono::steady_clock::now()) {}
+
+InstallProfiler::Counters InstallProfiler::ReadCounters() const {
+  Counters counters = {};
+  counters.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::steady_clock::now() - start_)
+                         .count();
+  // The children that have been reaped count towards RUSAGE_CHILDREN and /proc/self/io.
+  counters.cpu_ms = RusageCpuMs(RUSAGE_SELF) + RusageCpuMs(RUSAGE_CHILDREN);
+  ReadIoCounters("/proc/self/io", &counters.read_bytes, &counters.write_bytes);
+  if (child_ != -1) {
+    counters.cpu_ms += ReadProcessCpuMs(child_);
+    ReadIoCounters(android::base::StringPrintf("/proc/%d/io", child_), &counters.read_bytes,
+                   &counters.write_bytes);
+  }
+  return counters;
+}
+
+void InstallProfiler::BeginPhase(const std::string& name) {
+  std::string phase_name = PhaseName(name);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& phase : phases_) {
+    if (phase.name == phase_name && !phase.end) {
+      return;
+    }
+  }
+  phases_.push_back({ phase_name, ReadCounters(), std::nullopt });
+}
+
+void InstallProfiler::EndPhase(const std::string& name) {
+  std::string phase_name = PhaseName(name);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& phase : phases_) {
+    if (phase.name == phase_name && !phase.end) {
+      phase.end = ReadCounters();
+    }
+  }
+}
+
+void InstallProfiler::EndAllPhases() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Counters now = ReadCounters();
+  for (auto& phase : phases_) {
+    if (!phase.end) {
+      phase.end = now;
+    }
+  }
+}
+
+void InstallProfiler::SetChild(pid_t pid) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  child_ = pid;
+}
+
+std::vector<std::string> InstallProfiler::GetLogLines() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<std::string> lines;
+  for (const auto& phase : phases_) {
+    if (!phase.end) {
+      continue;
+    }
+    const Counters& begin = phase.begin;
+    const Counters& end = *phase.end;
+    lines.push_back(android::base::StringPrintf(
+        "phase_%s: %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64, phase.name.c_str(),
+        begin.time_ms, end.time_ms - begin.time_ms, std::max<int64_t>(end.cpu_ms - begin.cpu_ms, 0),
+        std::max<int64_t>(end.read_bytes - begin.read_bytes, 0) / 1024,
+        std::max<int64_t>(end.write_bytes - begin.write_bytes, 0) / 1024));
+  }
+  return lines;
+}
+
+std::vector<std::pair<std::string, int64_t>> InstallProfiler::GetMetrics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<std::pair<std::string, int64_t>> metrics;
+  for (const auto& phase : phases_) {
+    if (!phase.end) {
+      continue;
+    }
+    const Counters& begin = phase.begin;
+    const Counters& end = *phase.end;
+    std::string name = "phase_" + phase.name;
+    metrics.emplace_back(name + "_ms", end.time_ms - begin.time_ms);
+    metrics.emplace_back(name + "_cpu_ms", std::max<int64_t>(end.cpu_ms - begin.cpu_ms, 0));
+    metrics.emplace_back(name + "_read_KiBs",
+                         std::max<int64_t>(end.read_bytes - begin.read_bytes, 0) / 1024);
+    metrics.emplace_back(name + "_written_KiBs",
+                         std::max<int64_t>(end.write_bytes - begin.write_bytes, 0) / 1024);
+  }
+  return metrics;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "install/merge_progress.h"
+
+#include <inttypes.h>
+#include <math.h>
+
+#include <algorithm>
+
+#include <android-base/stringprintf.h>
+
+bool MergeProgressMonitor::Update(double progress, Clock::time_point now) {
+  progress = std::clamp(progress, 0.0, 100.0);
+  if (started_) {
+    double seconds = std::chrono::duration<double>(now - last_sample_).count();
+    if (seconds > 0) {
+      // The merge doesn't go backwards; a lower progress would be a new merge (phase), so the rate
+      // starts over.
+      if (progress < progress_) {
+        rate_ = 0;
+      } else {
+        double rate = (progress - progress_) / seconds;
+        rate_ = rate_ == 0 ? rate : kRateSmoothing * rate + (1 - kRateSmoothing) * rate_;
+      }
+    }
+  }
+  started_ = true;
+  progress_ = progress;
+  last_sample_ = now;
+
+  int percent = static_cast<int>(floor(progress));
+  if (percent == last_reported_percent_ && now - last_report_ < kReportInterval) {
+    return false;
+  }
+  last_reported_percent_ = percent;
+  last_report_ = now;
+  return true;
+}
+
+std::optional<std::chrono::seconds> MergeProgressMonitor::remaining() const {
+  if (rate_ <= 0) {
+    return std::nullopt;
+  }
+  return std::chrono::seconds(static_cast<int64_t>(ceil((100 - progress_) / rate_)));
+}
+
+std::string MergeProgressMonitor::Describe() const {
+  std::string description = android::base::StringPrintf("%.1f%%", progress_);
+  if (auto left = remaining(); left) {
+    int64_t seconds = left->count();
+    description += android::base::StringPrintf(" (%.2f%%/s, about %" PRId64 ":%02" PRId64 " left)",
+                                               rate_, seconds / 60, seconds % 60);
+  }
+  return description;
+}
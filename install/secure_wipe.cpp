@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "install/secure_wipe.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <openssl/sha.h>
+
+static constexpr uint64_t kMiB = 1024 * 1024;
+
+bool WipeInChunks(uint64_t start, uint64_t end, const SecureWipeOptions& options,
+                  const WipeRangeFn& wipe_range, const WipeProgressFn& progress) {
+  if (start >= end) {
+    return true;
+  }
+  uint64_t chunk_size = std::max(options.chunk_size / kMiB * kMiB, kMiB);
+  size_t chunks = (end - start + chunk_size - 1) / chunk_size;
+
+  std::mutex mutex;
+  size_t next = 0;
+  // The chunks wiped so far, and the count of them wiped from |start| without a gap.
+  std::vector<bool> wiped(chunks);
+  size_t wiped_prefix = 0;
+  bool failed = false;
+
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!failed && next < chunks) {
+      size_t chunk = next++;
+      uint64_t offset = start + chunk * chunk_size;
+      uint64_t length = std::min(chunk_size, end - offset);
+      lock.unlock();
+
+      bool result = wipe_range(offset, length);
+
+      lock.lock();
+      if (!result) {
+        failed = true;
+        continue;
+      }
+      wiped[chunk] = true;
+      size_t prefix = wiped_prefix;
+      while (wiped_prefix < chunks && wiped[wiped_prefix]) {
+        wiped_prefix++;
+      }
+      if (wiped_prefix != prefix && progress) {
+        progress(std::min(start + wiped_prefix * chunk_size, end));
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < std::min(std::max<size_t>(options.queue_depth, 1), chunks); i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+  return !failed;
+}
+
+// Identifies the wipe by its list of partitions.
+static uint32_t GetWipeId(const std::vector<std::string>& partitions) {
+  std::string list = android::base::Join(partitions, '\n');
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(list.data()), list.size(), digest);
+  uint32_t wipe_id;
+  memcpy(&wipe_id, digest, sizeof(wipe_id));
+  return wipe_id;
+}
+
+WipeCheckpoint::WipeCheckpoint(const std::vector<std::string>& partitions)
+    : written_(partitions.size()) {
+  uint32_t wipe_id = GetWipeId(partitions);
+  std::string err;
+  misc_wipe_message message;
+  if (!ReadMiscWipeMessage(&message, &err)) {
+    LOG(WARNING) << "Failed to read the wipe checkpoint: " << err;
+  } else if (message.magic == MISC_WIPE_MAGIC_HEADER &&
+             message.version == MISC_WIPE_MESSAGE_VERSION && message.wipe_id == wipe_id) {
+    message_ = message;
+    for (size_t i = 0; i < written_.size() && i < MISC_WIPE_MESSAGE_MAX_PARTITIONS; i++) {
+      written_[i] = message_.wiped_mib[i] * kMiB;
+    }
+    LOG(INFO) << "Resuming the wipe from its checkpoint";
+    return;
+  }
+  message_.version = MISC_WIPE_MESSAGE_VERSION;
+  message_.magic = MISC_WIPE_MAGIC_HEADER;
+  message_.wipe_id = wipe_id;
+}
+
+uint64_t WipeCheckpoint::Wiped(size_t index) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return index < written_.size() ? written_[index] : 0;
+}
+
+void WipeCheckpoint::Update(size_t index, uint64_t wiped, bool force) {
+  if (index >= MISC_WIPE_MESSAGE_MAX_PARTITIONS) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t wiped_mib = wiped / kMiB;
+  if (index >= written_.size() || wiped_mib * kMiB <= written_[index] ||
+      (!force && wiped < written_[index] + kCheckpointInterval)) {
+    return;
+  }
+  message_.wiped_mib[index] = static_cast<uint32_t>(std::min<uint64_t>(wiped_mib, UINT32_MAX));
+  std::string err;
+  if (!WriteMiscWipeMessage(message_, &err)) {
+    LOG(WARNING) << "Failed to write the wipe checkpoint: " << err;
+    return;
+  }
+  written_[index] = message_.wiped_mib[index] * kMiB;
+}
+
+void WipeCheckpoint::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string err;
+  if (!WriteMiscWipeMessage({}, &err)) {
+    LOG(WARNING) << "Failed to clear the wipe checkpoint: " << err;
+  }
+}
@@ -19,6 +19,8 @@
 #include <android-base/properties.h>
 #include <libsnapshot/snapshot.h>
 
+#include "install/merge_progress.h"
+
 #include "recovery_ui/device.h"
 #include "recovery_ui/ui.h"
 #include "recovery_utils/roots.h"
@@ -38,12 +40,28 @@ bool FinishPendingSnapshotMerges(Device* device) {
     return false;
   }
 
+  // The callback is only called while a merge is in progress, once per poll of its state. The
+  // progress bar follows the merge, and the log gets a line per percent (or every so often).
+  MergeProgressMonitor monitor;
+  bool merging = false;
   auto callback = [&]() -> void {
     double progress;
     sm->GetUpdateState(&progress);
-    ui->Print("Waiting for merge to complete: %.2f\n", progress);
+    if (!merging) {
+      merging = true;
+      ui->SetProgressType(RecoveryUI::DETERMINATE);
+      ui->ShowProgress(1.0, 0);
+    }
+    ui->SetProgress(progress / 100);
+    if (monitor.Update(progress, MergeProgressMonitor::Clock::now())) {
+      ui->Print("Waiting for merge to complete: %s\n", monitor.Describe().c_str());
+    }
   };
-  if (!sm->HandleImminentDataWipe(callback)) {
+  bool merged = sm->HandleImminentDataWipe(callback);
+  if (merging) {
+    ui->SetProgressType(RecoveryUI::INDETERMINATE);
+  }
+  if (!merged) {
     ui->Print("Unable to check merge status and/or complete update merge.\n");
     return false;
   }
@@ -46,6 +46,17 @@ bool ViolatesSPLDowngrade(const build::tools::releasetools::OtaMetadata& metadat
   return false;
 }
 
+// Parses the |size| bytes of serialized OtaMetadata at |data|, and checks them.
+static bool ViolatesSPLDowngrade(const void* data, size_t size, std::string_view current_spl) {
+  using build::tools::releasetools::OtaMetadata;
+  OtaMetadata metadata;
+  if (!metadata.ParseFromArray(data, size)) {
+    LOG(ERROR) << "Failed to parse ota_medata";
+    return false;
+  }
+  return ViolatesSPLDowngrade(metadata, current_spl);
+}
+
 bool ViolatesSPLDowngrade(ZipArchiveHandle zip, std::string_view current_spl) {
   static constexpr auto&& OTA_OTA_METADATA = "META-INF/com/android/metadata.pb";
   ZipEntry64 metadata_entry;
@@ -68,11 +79,16 @@ bool ViolatesSPLDowngrade(ZipArchiveHandle zip, std::string_view current_spl) {
     LOG(ERROR) << "Failed to extract " << OTA_OTA_METADATA << ": " << ErrorCodeString(err);
     return false;
   }
-  using build::tools::releasetools::OtaMetadata;
-  OtaMetadata metadata;
-  if (!metadata.ParseFromArray(ota_metadata.data(), ota_metadata.size())) {
-    LOG(ERROR) << "Failed to parse ota_medata";
+  return ViolatesSPLDowngrade(ota_metadata.data(), ota_metadata.size(), current_spl);
+}
+
+bool ViolatesSPLDowngrade(const PackageMetadata& metadata, std::string_view current_spl) {
+  const std::string& ota_metadata = metadata.ota_metadata();
+  if (ota_metadata.empty()) {
+    LOG(WARNING) << "Failed to find OtaMetadata in the package, treating this as "
+                    "non-spl-downgrade, permit OTA install. If device bricks after installing, "
+                    "check kernel log to see if /data failed to decrypt";
     return false;
   }
-  return ViolatesSPLDowngrade(metadata, current_spl);
+  return ViolatesSPLDowngrade(ota_metadata.data(), ota_metadata.size(), current_spl);
 }
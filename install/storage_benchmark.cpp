@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "install/storage_benchmark.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <fs_mgr/roots.h>
+
+#include "otautil/io_profile.h"
+#include "otautil/paths.h"
+#include "recovery_utils/roots.h"
+
+bool BenchmarkStorage(RecoveryUI* ui) {
+  if (volume_for_mount_point("/cache") == nullptr) {
+    ui->Print("No /cache partition found.\n");
+    return false;
+  }
+
+  ui->Print("\n-- Benchmarking storage...\n");
+  std::string profile_file = Paths::Get().io_profile_file();
+  std::string dir = android::base::Dirname(profile_file);
+  if (ensure_path_mounted(dir) != 0) {
+    ui->Print("Failed to mount %s.\n", dir.c_str());
+    return false;
+  }
+  if (mkdir(dir.c_str(), 0770) != 0 && errno != EEXIST) {
+    PLOG(ERROR) << "Failed to create " << dir;
+    return false;
+  }
+
+  IoProfile profile;
+  if (!MeasureIoProfile(dir, IoBenchmarkOptions(), &profile)) {
+    ui->Print("Storage benchmark failed.\n");
+    return false;
+  }
+  ui->Print("Sequential read:  %" PRIu64 " KiB/s\n", profile.seq_read_kib_per_sec);
+  ui->Print("Sequential write: %" PRIu64 " KiB/s\n", profile.seq_write_kib_per_sec);
+  ui->Print("Random read:      %" PRIu64 " IOPS, %" PRIu64 " IOPS at depth %" PRIu64 "\n",
+            profile.rand_read_iops, profile.rand_read_iops_at_depth, profile.queue_depth);
+  ui->Print("Random write:     %" PRIu64 " IOPS\n", profile.rand_write_iops);
+  ui->Print("Discard:          %" PRIu64 " KiB/s\n", profile.discard_kib_per_sec);
+  ui->Print("fsync latency:    %" PRIu64 " us\n", profile.fsync_latency_us);
+
+  if (!profile.Write(profile_file)) {
+    ui->Print("Failed to save the I/O profile.\n");
+    return false;
+  }
+  ui->Print("Saved the I/O profile to %s.\n", profile_file.c_str());
+  return true;
+}
@@ -18,20 +18,29 @@
 
 #include <fcntl.h>
 #include <linux/fs.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/ioctl.h>
 
+#include <algorithm>
+#include <chrono>
 #include <functional>
+#include <mutex>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
 #include <fs_mgr/roots.h>
 #include <libdm/dm.h>
+#include <volume_manager/UeventWaiter.h>
 
 #include "bootloader_message/bootloader_message.h"
+#include "install/secure_wipe.h"
 #include "install/snapshot_utils.h"
+#include "install/wipe_executor.h"
+#include "otautil/io_profile.h"
 #include "recovery_ui/ui.h"
 #include "recovery_utils/logging.h"
 #include "recovery_utils/roots.h"
@@ -40,11 +49,70 @@ constexpr const char* CACHE_ROOT = "/cache";
 constexpr const char* DATA_ROOT = "/data";
 constexpr const char* METADATA_ROOT = "/metadata";
 
-static bool EraseVolume(const char* volume, RecoveryUI* ui, std::string_view new_fstype) {
+// Takes how much of the device of a volume is discarded, out of its size.
+using DiscardProgressFn = std::function<void(uint64_t discarded, uint64_t size)>;
+
+// Discards the whole of |blk_device| in chunks, before the mkfs tools get to it, so that the
+// progress of what takes most of the time of a format (a single BLKDISCARD in mke2fs or make_f2fs,
+// or in the wipe of a metadata encrypted device) can be shown as it goes, and the throughput of
+// each volume logged. Once it's done, format_volume() skips the discard.
+//
+// Returns false if the device can't be discarded (e.g. it doesn't support it), leaving it all to
+// format_volume().
+static bool DiscardVolume(const char* volume, const std::string& blk_device, RecoveryUI* ui,
+                          const DiscardProgressFn& progress) {
+  android::base::unique_fd fd(open(blk_device.c_str(), O_WRONLY | O_CLOEXEC));
+  uint64_t size = 0;
+  if (fd == -1 || ioctl(fd, BLKGETSIZE64, &size) == -1 || size == 0) {
+    PLOG(WARNING) << "Failed to get the size of " << blk_device << ", not discarding it";
+    return false;
+  }
+
+  // Try the first chunk alone, so that a device without discard support fails quickly, once.
+  SecureWipeOptions options;
+  auto discard = [&fd](uint64_t offset, uint64_t length) {
+    uint64_t range[2] = { offset, length };
+    if (ioctl(fd, BLKDISCARD, &range) == -1) {
+      PLOG(WARNING) << "BLKDISCARD failed at " << offset;
+      return false;
+    }
+    return true;
+  };
+  auto start_time = std::chrono::steady_clock::now();
+  uint64_t first = std::min(options.chunk_size, size);
+  if (!discard(0, first)) {
+    return false;
+  }
+  if (progress) {
+    progress(first, size);
+  }
+  if (!WipeInChunks(first, size, options, discard, [&progress, size](uint64_t discarded) {
+        if (progress) {
+          progress(discarded, size);
+        }
+      })) {
+    return false;
+  }
+
+  std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start_time;
+  double mib = static_cast<double>(size) / (1024 * 1024);
+  double throughput = duration.count() > 0 ? mib / duration.count() : 0;
+  LOG(INFO) << "Discarded " << blk_device << " (" << volume << "): " << size << " bytes in "
+            << duration.count() << " s, " << throughput << " MiB/s";
+  ui->Print("Discarded %s: %.0f MiB in %.1f s (%.0f MiB/s)\n", volume, mib, duration.count(),
+            throughput);
+
+  unsigned int zeroes = 0;
+  NoteBlockDeviceWiped(blk_device, ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes != 0);
+  return true;
+}
+
+static bool EraseVolume(const char* volume, RecoveryUI* ui, std::string_view new_fstype,
+                        const DiscardProgressFn& progress = nullptr) {
   LOG(INFO) << "Erasing volume " << volume << " with new filesystem type " << new_fstype;
   bool is_cache = (strcmp(volume, CACHE_ROOT) == 0);
 
-  std::vector<saved_log_file> log_files;
+  saved_logs log_files;
   if (is_cache) {
     // If we're reformatting /cache, we load any past logs (i.e. "/cache/recovery/last_*") and the
     // current log ("/cache/recovery/log") into memory, so we can restore them after the reformat.
@@ -55,17 +123,20 @@ static bool EraseVolume(const char* volume, RecoveryUI* ui, std::string_view new
 
   Volume* vol = volume_for_mount_point(volume);
   if (vol->fs_mgr_flags.logical) {
+    // Volumes may be erased at the same time, and the mapping is done once for all of them.
+    static std::mutex logical_partitions_lock;
+    std::lock_guard<std::mutex> lock(logical_partitions_lock);
     android::dm::DeviceMapper& dm = android::dm::DeviceMapper::Instance();
 
     map_logical_partitions();
-    // map_logical_partitions is non-blocking, so check for some limited time
-    // if it succeeded
-    for (int i = 0; i < 500; i++) {
-      if (vol->blk_device[0] == '/' ||
-          dm.GetState(vol->blk_device) == android::dm::DmDeviceState::ACTIVE)
-        break;
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
-    }
+    // map_logical_partitions is non-blocking, so wait for some limited time for the device to be
+    // activated.
+    android::volmgr::UeventWaiter::WaitFor(
+        [&dm, vol]() {
+          return vol->blk_device[0] == '/' ||
+                 dm.GetState(vol->blk_device) == android::dm::DmDeviceState::ACTIVE;
+        },
+        std::chrono::milliseconds(500));
 
     if (vol->blk_device[0] != '/' && !dm.GetDmDevicePathByName(vol->blk_device, &vol->blk_device)) {
       PLOG(ERROR) << "Failed to find dm device path for " << vol->blk_device;
@@ -100,6 +171,12 @@ static bool EraseVolume(const char* volume, RecoveryUI* ui, std::string_view new
     return false;
   }
 
+  // Only a volume that takes the whole of its device is discarded up front: what follows a shorter
+  // one (e.g. a crypto footer) isn't ours to discard.
+  if (progress && vol->length == 0) {
+    DiscardVolume(volume, blk_device, ui, progress);
+  }
+
   int result = format_volume(volume, "", new_fstype);
 
   if (is_cache) {
@@ -143,14 +220,56 @@ bool WipeData(Device* device, bool keep_memtag_mode, std::string_view data_fstyp
 
   bool success = device->PreWipeData();
   if (success) {
-    success &= EraseVolume(DATA_ROOT, ui, data_fstype);
+    // The volumes are formatted at the same time, except that with metadata encryption, /data
+    // waits for /metadata: once its key is gone, /data can't be read back even if formatting it
+    // is interrupted.
+    WipeExecutor executor(
+        GetProfiledQueueDepth(WipeExecutor::kMaxConcurrentJobs, WipeExecutor::kMaxConcurrentJobs));
+    std::vector<size_t> data_after;
+    // The progress is the average of that of the volumes: the share of its device discarded, until
+    // it's formatted.
+    std::mutex progress_lock;
+    std::vector<double> fractions;
+    auto add_volume = [&](const char* volume, std::vector<size_t> after = {}) {
+      size_t index = fractions.size();
+      fractions.push_back(0);
+      auto set_fraction = [&, index](double fraction) {
+        std::lock_guard<std::mutex> lock(progress_lock);
+        fractions[index] = std::max(fractions[index], fraction);
+        double sum = 0;
+        for (double f : fractions) {
+          sum += f;
+        }
+        ui->SetProgress(sum / fractions.size());
+      };
+      return executor.Add(
+          volume,
+          [ui, data_fstype, volume, set_fraction]() {
+            bool result =
+                EraseVolume(volume, ui, data_fstype, [&set_fraction](uint64_t discarded,
+                                                                     uint64_t size) {
+                  set_fraction(static_cast<double>(discarded) / size);
+                });
+            set_fraction(1);
+            return result;
+          },
+          std::move(after));
+    };
+    if (volume_for_mount_point(METADATA_ROOT) != nullptr) {
+      size_t metadata = add_volume(METADATA_ROOT);
+      Volume* data = volume_for_mount_point(DATA_ROOT);
+      if (data != nullptr && !data->metadata_key_dir.empty()) {
+        data_after.push_back(metadata);
+      }
+    }
+    add_volume(DATA_ROOT, data_after);
     bool has_cache = volume_for_mount_point("/cache") != nullptr;
     if (has_cache) {
-      success &= EraseVolume(CACHE_ROOT, ui, data_fstype);
-    }
-    if (volume_for_mount_point(METADATA_ROOT) != nullptr) {
-      success &= EraseVolume(METADATA_ROOT, ui, data_fstype);
+      add_volume(CACHE_ROOT);
     }
+    ui->SetProgressType(RecoveryUI::DETERMINATE);
+    ui->ShowProgress(1.0, 0);
+    success &= executor.Run();
   }
   if (keep_memtag_mode) {
     ui->Print("NOT resetting memtag message as per request...\n");
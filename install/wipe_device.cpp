@@ -22,22 +22,28 @@
 #include <stdint.h>
 #include <sys/ioctl.h>
 
-#include <map>
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <string>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/properties.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <ziparchive/zip_archive.h>
 
 #include "bootloader_message/bootloader_message.h"
 #include "install/install.h"
+#include "install/secure_wipe.h"
+#include "install/wipe_executor.h"
+#include "otautil/io_profile.h"
 #include "otautil/package.h"
 #include "recovery_ui/device.h"
 #include "recovery_ui/ui.h"
+#include "recovery_utils/roots.h"
 
 std::vector<std::string> GetWipePartitionList(Package* wipe_package) {
   ZipArchiveHandle zip = wipe_package->GetZipArchiveHandle();
@@ -90,22 +96,50 @@ std::vector<std::string> GetWipePartitionList(Package* wipe_package) {
   return result;
 }
 
-// Secure-wipes a given partition. It uses BLKSECDISCARD, if supported. Otherwise, it goes with
-// BLKDISCARD (if device supports BLKDISCARDZEROES) or BLKZEROOUT.
-static bool SecureWipePartition(const std::string& partition) {
+// Returns the size of |partition|, or 0 if it can't be read.
+static uint64_t GetPartitionSize(const std::string& partition) {
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(partition.c_str(), O_RDONLY)));
+  uint64_t size;
+  if (fd == -1 || ioctl(fd, BLKGETSIZE64, &size) == -1) {
+    return 0;
+  }
+  return size;
+}
+
+// Secure-wipes a given partition, the one at |index| of the wipe package, from where |checkpoint|
+// left it. It uses BLKSECDISCARD, if supported. Otherwise, it goes with BLKDISCARD (if device
+// supports BLKDISCARDZEROES) or BLKZEROOUT.
+static bool SecureWipePartition(const std::string& partition, const SecureWipeOptions& options,
+                                WipeCheckpoint* checkpoint, size_t index,
+                                const WipeProgressFn& progress) {
   android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(partition.c_str(), O_WRONLY)));
   if (fd == -1) {
     PLOG(ERROR) << "Failed to open \"" << partition << "\"";
     return false;
   }
 
-  uint64_t range[2] = { 0, 0 };
-  if (ioctl(fd, BLKGETSIZE64, &range[1]) == -1 || range[1] == 0) {
+  uint64_t size = 0;
+  if (ioctl(fd, BLKGETSIZE64, &size) == -1 || size == 0) {
     PLOG(ERROR) << "Failed to get partition size";
     return false;
   }
-  LOG(INFO) << "Secure-wiping \"" << partition << "\" from " << range[0] << " to " << range[1];
+  uint64_t start = std::min(checkpoint->Wiped(index), size);
+  LOG(INFO) << "Secure-wiping \"" << partition << "\" from " << start << " to " << size;
+  if (start == size) {
+    LOG(INFO) << "  Already done";
+    NoteBlockDeviceWiped(partition, false);
+    return true;
+  }
+  auto report = [&](uint64_t wiped) {
+    checkpoint->Update(index, wiped, wiped == size);
+    if (progress) {
+      progress(wiped);
+    }
+  };
 
+  // Try BLKSECDISCARD on the first chunk, to pick the request for the rest of them.
+  uint64_t range[2] = { start, std::min(options.chunk_size, size - start) };
+  unsigned long request = BLKSECDISCARD;
   LOG(INFO) << "  Trying BLKSECDISCARD...";
   if (ioctl(fd, BLKSECDISCARD, &range) == -1) {
     PLOG(WARNING) << "  Failed";
@@ -114,19 +148,31 @@ static bool SecureWipePartition(const std::string& partition) {
     unsigned int zeroes;
     if (ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes != 0) {
       LOG(INFO) << "  Trying BLKDISCARD...";
-      if (ioctl(fd, BLKDISCARD, &range) == -1) {
-        PLOG(ERROR) << "  Failed";
-        return false;
-      }
+      request = BLKDISCARD;
     } else {
       LOG(INFO) << "  Trying BLKZEROOUT...";
-      if (ioctl(fd, BLKZEROOUT, &range) == -1) {
-        PLOG(ERROR) << "  Failed";
-        return false;
-      }
+      request = BLKZEROOUT;
     }
+  } else {
+    start += range[1];
+    report(start);
+  }
+
+  if (!WipeInChunks(start, size, options, [&fd, request](uint64_t offset, uint64_t length) {
+        uint64_t range[2] = { offset, length };
+        if (ioctl(fd, request, &range) == -1) {
+          PLOG(ERROR) << "  Failed at " << offset;
+          return false;
+        }
+        return true;
+      }, report)) {
+    return false;
   }
 
+  // Let a format that follows skip what the wipe did already.
+  unsigned int zeroes = 0;
+  NoteBlockDeviceWiped(partition, request == BLKZEROOUT ||
+                                      (ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes != 0));
   LOG(INFO) << "  Done";
   return true;
 }
@@ -143,8 +189,7 @@ static std::unique_ptr<Package> ReadWipePackage(size_t wipe_package_size) {
     return nullptr;
   }
 
-  return Package::CreateMemoryPackage(
-      std::vector<uint8_t>(wipe_package.begin(), wipe_package.end()), nullptr);
+  return Package::AdoptMemoryPackage(std::move(wipe_package), nullptr);
 }
 
 // Checks if the wipe package matches expectation. If the check passes, reads the list of
@@ -157,19 +202,13 @@ static bool CheckWipePackage(Package* wipe_package, RecoveryUI* ui) {
     return false;
   }
 
-  ZipArchiveHandle zip = wipe_package->GetZipArchiveHandle();
-  if (!zip) {
-    LOG(ERROR) << "Failed to get ZipArchiveHandle";
-    return false;
-  }
-
-  std::map<std::string, std::string> metadata;
-  if (!ReadMetadataFromPackage(zip, &metadata)) {
+  const PackageMetadata* metadata = wipe_package->GetMetadata();
+  if (metadata == nullptr) {
     LOG(ERROR) << "Failed to parse metadata in the zip file";
     return false;
   }
 
-  return CheckPackageMetadata(metadata, OtaType::BRICK, ui);
+  return CheckPackageMetadata(*metadata, OtaType::BRICK, ui);
 }
 
 bool WipeAbDevice(Device* device, size_t wipe_package_size) {
@@ -198,9 +237,49 @@ bool WipeAbDevice(Device* device, Package* wipe_package) {
     return false;
   }
 
+  // The chunk size (in MiB) and the queue depth can be tuned for the storage of the device.
+  static constexpr uint64_t kMiB = 1024 * 1024;
+  SecureWipeOptions options;
+  options.chunk_size = android::base::GetUintProperty<uint64_t>("ro.recovery.secure_wipe_chunk_mb",
+                                                                options.chunk_size / kMiB, 65536) *
+                       kMiB;
+  options.queue_depth = android::base::GetUintProperty<size_t>(
+      "ro.recovery.secure_wipe_queue_depth", options.queue_depth, 64);
+  WipeCheckpoint checkpoint(partition_list);
+
+  // The progress is the share of the bytes of all the partitions that are wiped.
+  std::vector<uint64_t> sizes;
+  uint64_t total_size = 0;
   for (const auto& partition : partition_list) {
-    // Proceed anyway even if it fails to wipe some partition.
-    SecureWipePartition(partition);
+    sizes.push_back(GetPartitionSize(partition));
+    total_size += sizes.back();
+  }
+  std::atomic<uint64_t> total_wiped = 0;
+  ui->SetProgressType(RecoveryUI::DETERMINATE);
+  ui->ShowProgress(1.0, 0);
+
+  // The partitions are independent of each other, so they're wiped at the same time.
+  WipeExecutor executor(
+      GetProfiledQueueDepth(WipeExecutor::kMaxConcurrentJobs, WipeExecutor::kMaxConcurrentJobs));
+  for (size_t i = 0; i < partition_list.size(); i++) {
+    executor.Add(partition_list[i], [&, i]() {
+      // The part wiped before an interruption counts at once.
+      uint64_t reported = std::min(checkpoint.Wiped(i), sizes[i]);
+      total_wiped += reported;
+      auto progress = [&](uint64_t wiped) {
+        if (wiped > reported) {
+          total_wiped += wiped - reported;
+          reported = wiped;
+        }
+        if (total_size > 0) {
+          ui->SetProgress(static_cast<float>(total_wiped) / total_size);
+        }
+      };
+      return SecureWipePartition(partition_list[i], options, &checkpoint, i, progress);
+    });
   }
+  // Proceed anyway even if it fails to wipe some partition.
+  executor.Run();
+  checkpoint.Clear();
   return true;
 }
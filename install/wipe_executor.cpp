@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "install/wipe_executor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <android-base/logging.h>
+
+WipeExecutor::WipeExecutor(size_t max_concurrent_jobs)
+    : max_concurrent_jobs_(std::max<size_t>(max_concurrent_jobs, 1)) {}
+
+size_t WipeExecutor::Add(std::string name, Job job, std::vector<size_t> after, uint64_t weight) {
+  // Jobs can only wait for the ones added before them, so there can't be a cycle.
+  for (size_t id : after) {
+    CHECK_LT(id, jobs_.size()) << name << " waits for an unknown job";
+  }
+  jobs_.push_back(Entry{ std::move(name), std::move(job), std::move(after), weight });
+  return jobs_.size() - 1;
+}
+
+bool WipeExecutor::Run(const ProgressFn& progress) {
+  uint64_t total_weight = 0;
+  for (const auto& entry : jobs_) {
+    total_weight += entry.weight;
+  }
+
+  std::mutex mutex;
+  std::condition_variable job_done;
+  uint64_t done_weight = 0;
+  size_t remaining = jobs_.size();
+  bool success = true;
+
+  // Returns the next job that can start, or |jobs_.size()| if there's none yet. Must be called
+  // with |mutex| held.
+  auto next_job = [this]() {
+    for (size_t id = 0; id < jobs_.size(); id++) {
+      const auto& entry = jobs_[id];
+      if (!entry.started && std::all_of(entry.after.begin(), entry.after.end(),
+                                        [this](size_t after) { return jobs_[after].done; })) {
+        return id;
+      }
+    }
+    return jobs_.size();
+  };
+
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      size_t id;
+      job_done.wait(lock, [&]() { return remaining == 0 || (id = next_job()) < jobs_.size(); });
+      if (remaining == 0) {
+        return;
+      }
+      auto& entry = jobs_[id];
+      entry.started = true;
+      lock.unlock();
+
+      LOG(INFO) << "Wiping " << entry.name;
+      auto start = std::chrono::steady_clock::now();
+      bool result = entry.job();
+      std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+      LOG(INFO) << (result ? "Wiped " : "Failed to wipe ") << entry.name << " in "
+                << duration.count() << " s";
+
+      lock.lock();
+      entry.done = true;
+      success &= result;
+      remaining--;
+      done_weight += entry.weight;
+      if (progress && total_weight > 0) {
+        progress(static_cast<double>(done_weight) / total_weight);
+      }
+      job_done.notify_all();
+    }
+  };
+
+  // The calling thread is one of the workers.
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < std::min(max_concurrent_jobs_, jobs_.size()); i++) {
+    workers.emplace_back(worker);
+  }
+  if (!jobs_.empty()) {
+    worker();
+  }
+  for (auto& thread : workers) {
+    thread.join();
+  }
+  return success;
+}
@@ -20,20 +20,153 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+#include <string>
+
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <lz4.h>
+
 #include "adb.h"
 #include "adb_io.h"
 
-bool FuseAdbDataProvider::ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
-                                               uint32_t start_block) const {
-  if (!WriteFdFmt(fd_, "%08u", start_block)) {
-    fprintf(stderr, "failed to write to adb host: %s\n", strerror(errno));
+// Older hosts serve the requests one at a time, so there is no point in queueing many of them; a
+// few are enough to hide the round trip between two blocks.
+static constexpr uint32_t kLegacyWindow = 16;
+
+// Length of a block number on the wire, as in "%08u".
+static constexpr size_t kBlockNumberLength = 8;
+
+FuseAdbDataProvider::FuseAdbDataProvider(int fd, uint64_t file_size, uint32_t block_size,
+                                         uint32_t window, Compression compression,
+                                         uint32_t max_run)
+    : FuseDataProvider(file_size, block_size),
+      fd_(fd),
+      tagged_replies_(window != 0),
+      window_(window == 0 ? kLegacyWindow : std::min(window, kMaxWindow)),
+      compression_(window == 0 ? Compression::kNone : compression),
+      max_run_(1) {
+  if (window != 0 && max_run > 1 && block_size != 0) {
+    max_run_ = std::max(1U, std::min(max_run, kMaxRunSize / block_size));
+  }
+}
+
+bool FuseAdbDataProvider::ReadCompressedBlock(uint8_t* data, uint32_t size) const {
+  char length_text[kBlockNumberLength + 1] = {};
+  if (!ReadFdExactly(fd_, length_text, kBlockNumberLength)) {
+    fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
+    return false;
+  }
+  uint32_t length;
+  uint32_t max_length = LZ4_compressBound(size);
+  if (!android::base::ParseUint(length_text, &length, max_length)) {
+    fprintf(stderr, "invalid compressed length \"%s\" from adb host\n", length_text);
+    return false;
+  }
+  // Blocks that don't compress are sent as they are.
+  if (length == size) {
+    if (!ReadFdExactly(fd_, data, size)) {
+      fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  std::vector<char> compressed(length);
+  if (!ReadFdExactly(fd_, compressed.data(), length)) {
+    fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
+    return false;
+  }
+  if (LZ4_decompress_safe(compressed.data(), reinterpret_cast<char*>(data), length, size) !=
+      static_cast<int>(size)) {
+    fprintf(stderr, "failed to decompress block from adb host\n");
     return false;
   }
+  return true;
+}
+
+bool FuseAdbDataProvider::ReadReply(uint8_t* buffer, uint32_t fetch_size, uint32_t start_block,
+                                    const std::vector<uint32_t>& runs, std::vector<bool>* received,
+                                    uint32_t* index) const {
+  if (tagged_replies_) {
+    char block_number[kBlockNumberLength + 1] = {};
+    if (!ReadFdExactly(fd_, block_number, kBlockNumberLength)) {
+      fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
+      return false;
+    }
+    uint32_t block;
+    if (!android::base::ParseUint(block_number, &block) || block < start_block ||
+        block - start_block >= runs.size() || runs[block - start_block] == 0 ||
+        (*received)[block - start_block]) {
+      fprintf(stderr, "unexpected reply from adb host for block \"%s\"\n", block_number);
+      return false;
+    }
+    *index = block - start_block;
+  } else {
+    // Replies come in the order of the requests.
+    for (*index = 0; runs[*index] == 0 || (*received)[*index]; (*index)++) {
+    }
+  }
 
-  if (!ReadFdExactly(fd_, buffer, fetch_size)) {
+  uint32_t offset = 0;
+  uint32_t size = fetch_size;
+  if (runs.size() > 1) {
+    offset = *index * fuse_block_size_;
+    size = std::min(runs[*index] * fuse_block_size_, fetch_size - offset);
+  }
+  if (compression_ == Compression::kLz4) {
+    if (!ReadCompressedBlock(buffer + offset, size)) {
+      return false;
+    }
+  } else if (!ReadFdExactly(fd_, buffer + offset, size)) {
     fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
     return false;
   }
+  (*received)[*index] = true;
+  return true;
+}
+
+bool FuseAdbDataProvider::ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
+                                               uint32_t start_block) const {
+  // The host answers each request with one block, or one run of blocks. A fetch of several blocks
+  // (from the fuse read-ahead) keeps up to |window_| requests in flight, sending a new one as each
+  // reply arrives, so that the transfer isn't bound by the round trip of every request.
+  uint32_t blocks = 1;
+  if (fuse_block_size_ != 0 && fetch_size > fuse_block_size_) {
+    blocks = (fetch_size + fuse_block_size_ - 1) / fuse_block_size_;
+  }
+  // Runs only grow while the fetches are sequential.
+  uint32_t run = start_block == next_block_ ? next_run_ : 1;
+  std::vector<uint32_t> runs(blocks, 0);
+  std::vector<bool> received(blocks, false);
+  uint32_t requested = 0;
+  uint32_t outstanding = 0;
+  for (uint32_t answered = 0; answered < blocks; outstanding--) {
+    std::string requests;
+    for (; requested < blocks && outstanding < window_; outstanding++) {
+      uint32_t count = std::min(run, blocks - requested);
+      if (max_run_ > 1) {
+        requests += android::base::StringPrintf("%08u%08u", start_block + requested, count);
+      } else {
+        requests += android::base::StringPrintf("%08u", start_block + requested);
+      }
+      runs[requested] = count;
+      requested += count;
+      run = std::min(run * 2, max_run_);
+    }
+    if (!requests.empty() && !WriteFdExactly(fd_, requests.data(), requests.size())) {
+      fprintf(stderr, "failed to write to adb host: %s\n", strerror(errno));
+      return false;
+    }
+
+    uint32_t index;
+    if (!ReadReply(buffer, fetch_size, start_block, runs, &received, &index)) {
+      return false;
+    }
+    answered += runs[index];
+  }
 
+  next_block_ = start_block + blocks;
+  next_run_ = run;
   return true;
 }
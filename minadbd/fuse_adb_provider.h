@@ -18,13 +18,44 @@
 
 #include <stdint.h>
 
+#include <vector>
+
 #include "fuse_provider.h"
 
 // This class reads data from adb server.
+//
+// The device requests a block by sending its number as "%08u", and the host answers with the
+// block data (the last block of the file being partial). Several requests are kept outstanding at
+// a time, up to the window size. Older hosts answer the requests strictly in order. Hosts that ask
+// for a window in the sideload-host arguments may instead answer in any order, by prefixing each
+// block with its number in the same "%08u" format.
+//
+// Such hosts may also ask for compressed replies. The block number is then followed by the "%08u"
+// length of the payload, and the payload: the block verbatim if the length is the block size, or
+// the block compressed as an LZ4 block otherwise.
+//
+// Hosts that also give a run limit in the sideload-host arguments serve runs of blocks. Each
+// request is then the "%08u" number of the first block followed by the "%08u" count of blocks,
+// and the reply is the number of the first block followed by the whole run (compressed as a
+// single payload, if asked), so that the long sequential reads of an install move in large USB
+// transfers. Runs start at one block, for the scattered reads of the zip metadata, and double with
+// each request that follows on from the previous one, up to the limit.
 class FuseAdbDataProvider : public FuseDataProvider {
  public:
-  FuseAdbDataProvider(int fd, uint64_t file_size, uint32_t block_size)
-      : FuseDataProvider(file_size, block_size), fd_(fd) {}
+  enum class Compression {
+    kNone,
+    kLz4,
+  };
+
+  // The most requests that may be outstanding, whatever window a host asks for.
+  static constexpr uint32_t kMaxWindow = 256;
+  // The largest run to request at once, whatever run limit a host asks for.
+  static constexpr uint32_t kMaxRunSize = 1024 * 1024;
+
+  // A |window| of 0 talks to an older host, which answers in order and without block numbers.
+  // Compressed replies and runs (a |max_run| above 1) need a window.
+  FuseAdbDataProvider(int fd, uint64_t file_size, uint32_t block_size, uint32_t window = 0,
+                      Compression compression = Compression::kNone, uint32_t max_run = 1);
 
   bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
                             uint32_t start_block) const override;
@@ -34,6 +65,29 @@ class FuseAdbDataProvider : public FuseDataProvider {
   }
 
  private:
+  // Reads the reply to one of the runs that have been requested from |start_block|, into its place
+  // in |buffer|. |runs| holds the length of the run requested from each block (0 for the blocks
+  // not requested, or inside a run), and |received| tracks the runs that have been answered. Sets
+  // |index| to the block that the answered run starts from.
+  bool ReadReply(uint8_t* buffer, uint32_t fetch_size, uint32_t start_block,
+                 const std::vector<uint32_t>& runs, std::vector<bool>* received,
+                 uint32_t* index) const;
+  // Reads a compressed reply of |size| bytes once decompressed, into |data|.
+  bool ReadCompressedBlock(uint8_t* data, uint32_t size) const;
+
   // The underlying source to read data from (i.e. the one that talks to the host).
   int fd_;
+  // Whether the host prefixes each reply with the block number, and may reorder them.
+  bool tagged_replies_;
+  // The most requests to keep outstanding.
+  uint32_t window_;
+  Compression compression_;
+  // The longest run to request, in blocks; 1 if the host only serves single blocks.
+  uint32_t max_run_;
+
+  // The calls are serialized (see FuseDataProvider::SupportsConcurrentReads()), so the run length
+  // to carry on with may be kept here: |next_block_| follows the last block fetched, and
+  // |next_run_| is the run length to request from it.
+  mutable uint32_t next_block_{ UINT32_MAX };
+  mutable uint32_t next_run_{ 1 };
 };
@@ -20,9 +20,12 @@
 #include <sys/socket.h>
 
 #include <string>
+#include <thread>
 
+#include <android-base/stringprintf.h>
 #include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
+#include <lz4.h>
 
 #include "adb_io.h"
 #include "fuse_adb_provider.h"
@@ -67,6 +70,194 @@ TEST(fuse_adb_provider, read_block_adb) {
   ASSERT_EQ(EWOULDBLOCK, errno);
 }
 
+TEST(fuse_adb_provider, read_block_adb_multiple_blocks) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(std::move(device_socket), 10, 4);
+
+  fcntl(host_socket, F_SETFL, O_NONBLOCK);
+
+  // Three blocks of 4 bytes, the last one partial.
+  const char expected_data[] = "0123456789";
+  char block_data[sizeof(expected_data)] = {};
+  ASSERT_TRUE(WriteFdExactly(host_socket, expected_data, strlen(expected_data)));
+  ASSERT_TRUE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data),
+                                        sizeof(expected_data) - 1, 0));
+
+  // All three blocks were requested at once.
+  const char expected_requests[] = "000000000000000100000002";
+  char requests[sizeof(expected_requests)] = {};
+  ASSERT_TRUE(ReadFdExactly(host_socket, requests, strlen(expected_requests)));
+  ASSERT_STREQ(expected_requests, requests);
+  ASSERT_STREQ(expected_data, block_data);
+
+  char tmp;
+  errno = 0;
+  ASSERT_EQ(-1, read(host_socket, &tmp, 1));
+  ASSERT_EQ(EWOULDBLOCK, errno);
+}
+
+TEST(fuse_adb_provider, read_block_adb_out_of_order) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(std::move(device_socket), 10, 4, 8);
+
+  fcntl(host_socket, F_SETFL, O_NONBLOCK);
+
+  // A host that asked for a window tags each block with its number, and may answer in any order.
+  const char replies[] = "0000000289" "000000000123" "000000014567";
+  ASSERT_TRUE(WriteFdExactly(host_socket, replies, strlen(replies)));
+  char block_data[11] = {};
+  ASSERT_TRUE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data), 10, 0));
+  ASSERT_STREQ("0123456789", block_data);
+
+  const char expected_requests[] = "000000000000000100000002";
+  char requests[sizeof(expected_requests)] = {};
+  ASSERT_TRUE(ReadFdExactly(host_socket, requests, strlen(expected_requests)));
+  ASSERT_STREQ(expected_requests, requests);
+}
+
+TEST(fuse_adb_provider, read_block_adb_window) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(std::move(device_socket), 10, 4, 2);
+
+  // With a window of 2, the third block is only requested once one of the first two is answered.
+  std::thread host([&host_socket]() {
+    char requests[17] = {};
+    ASSERT_TRUE(ReadFdExactly(host_socket, requests, 16));
+    ASSERT_STREQ("0000000000000001", requests);
+
+    fcntl(host_socket, F_SETFL, O_NONBLOCK);
+    char tmp;
+    errno = 0;
+    ASSERT_EQ(-1, read(host_socket, &tmp, 1));
+    ASSERT_EQ(EWOULDBLOCK, errno);
+    fcntl(host_socket, F_SETFL, 0);
+
+    ASSERT_TRUE(WriteFdExactly(host_socket, "000000014567", 12));
+    char request[9] = {};
+    ASSERT_TRUE(ReadFdExactly(host_socket, request, 8));
+    ASSERT_STREQ("00000002", request);
+    ASSERT_TRUE(WriteFdExactly(host_socket, "0000000289" "000000000123", 22));
+  });
+
+  char block_data[11] = {};
+  ASSERT_TRUE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data), 10, 0));
+  host.join();
+  ASSERT_STREQ("0123456789", block_data);
+}
+
+TEST(fuse_adb_provider, read_block_adb_unexpected_block) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(std::move(device_socket), 10, 4, 8);
+
+  // Block 1 is answered twice, and block 0 never.
+  const char replies[] = "000000014567" "000000014567";
+  ASSERT_TRUE(WriteFdExactly(host_socket, replies, strlen(replies)));
+  char block_data[8];
+  ASSERT_FALSE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data), 8, 0));
+}
+
+TEST(fuse_adb_provider, read_block_adb_runs) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(std::move(device_socket), 40, 4, 8,
+                           FuseAdbDataProvider::Compression::kNone, 4);
+
+  fcntl(host_socket, F_SETFL, O_NONBLOCK);
+
+  // The runs double from one block, up to the limit of 4, and are answered in any order.
+  const char replies[] = "00000003" "CDEFGHIJKLMNOPQR" "00000000" "0123" "00000001" "456789AB";
+  ASSERT_TRUE(WriteFdExactly(host_socket, replies, strlen(replies)));
+  char block_data[29] = {};
+  ASSERT_TRUE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data), 28, 0));
+  ASSERT_STREQ("0123456789ABCDEFGHIJKLMNOPQR", block_data);
+
+  const char expected_requests[] = "0000000000000001" "0000000100000002" "0000000300000004";
+  char requests[sizeof(expected_requests)] = {};
+  ASSERT_TRUE(ReadFdExactly(host_socket, requests, strlen(expected_requests)));
+  ASSERT_STREQ(expected_requests, requests);
+
+  // A fetch that follows on carries on with the longest run.
+  ASSERT_TRUE(WriteFdExactly(host_socket, "00000007" "abcdefghijkl", 20));
+  ASSERT_TRUE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data), 12, 7));
+  ASSERT_EQ("abcdefghijkl", std::string(block_data, 12));
+  char request[17] = {};
+  ASSERT_TRUE(ReadFdExactly(host_socket, request, 16));
+  ASSERT_STREQ("0000000700000003", request);
+
+  // Random reads start over from a single block.
+  ASSERT_TRUE(WriteFdExactly(host_socket, "00000002" "89AB" "00000003" "CDEF", 24));
+  ASSERT_TRUE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data), 8, 2));
+  ASSERT_EQ("89ABCDEF", std::string(block_data, 8));
+  const char expected_random_requests[] = "0000000200000001" "0000000300000001";
+  char random_requests[sizeof(expected_random_requests)] = {};
+  ASSERT_TRUE(ReadFdExactly(host_socket, random_requests, strlen(expected_random_requests)));
+  ASSERT_STREQ(expected_random_requests, random_requests);
+
+  char tmp;
+  errno = 0;
+  ASSERT_EQ(-1, read(host_socket, &tmp, 1));
+  ASSERT_EQ(EWOULDBLOCK, errno);
+}
+
+TEST(fuse_adb_provider, read_block_adb_compressed) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(std::move(device_socket), 8192, 4096, 8,
+                           FuseAdbDataProvider::Compression::kLz4);
+
+  // Block 0 is sent compressed, and block 1 verbatim (its length being the block size).
+  std::string block0(4096, '\0');
+  std::string block1(4096, 'x');
+  std::string compressed(LZ4_compressBound(block0.size()), '\0');
+  int compressed_size =
+      LZ4_compress_default(block0.data(), compressed.data(), block0.size(), compressed.size());
+  ASSERT_GT(compressed_size, 0);
+  compressed.resize(compressed_size);
+
+  std::string replies = "00000001" "00004096" + block1 +
+                        android::base::StringPrintf("00000000%08d", compressed_size) + compressed;
+  std::thread host([&host_socket, &replies]() {
+    ASSERT_TRUE(WriteFdExactly(host_socket, replies.data(), replies.size()));
+  });
+
+  std::string block_data(8192, '\0');
+  ASSERT_TRUE(
+      data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data.data()), 8192, 0));
+  host.join();
+  ASSERT_EQ(block0 + block1, block_data);
+}
+
+TEST(fuse_adb_provider, read_block_adb_corrupt_compressed) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(std::move(device_socket), 4096, 4096, 8,
+                           FuseAdbDataProvider::Compression::kLz4);
+
+  // A payload that doesn't decompress to a whole block.
+  const char replies[] = "00000000" "00000004" "\x30" "abc";
+  ASSERT_TRUE(WriteFdExactly(host_socket, replies, strlen(replies)));
+  std::string block_data(4096, '\0');
+  ASSERT_FALSE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data.data()), 4096, 0));
+}
+
 TEST(fuse_adb_provider, read_block_adb_fail_write) {
   android::base::unique_fd device_socket;
   android::base::unique_fd host_socket;
@@ -24,8 +24,11 @@
 #include <unistd.h>
 
 #include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <string_view>
@@ -45,10 +48,20 @@
 #include "fuse_adb_provider.h"
 #include "fuse_sideload.h"
 #include "minadbd/types.h"
+#include "otautil/device_info.h"
 #include "recovery_utils/battery_utils.h"
 #include "services.h"
 #include "sysdeps.h"
 
+// A directory to keep a copy of the package being sideloaded, so that it resumes where it left off
+// if the connection drops (see FuseSpillDataProvider). Unset by default, as the copy takes as much
+// space as the package.
+static constexpr const char* kSideloadSpillDirProperty = "ro.recovery.sideload_spill_dir";
+
+// Recovery stops waiting for commands after 300s without any; rescue queries send a no-op command
+// to keep it waiting, unless another command has been sent more recently than this.
+static constexpr auto kHeartbeatInterval = std::chrono::seconds(60);
+
 static int minadbd_socket = -1;
 static bool rescue_mode = false;
 static std::string sideload_mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT;
@@ -59,6 +72,10 @@ void SetMinadbdSocketFd(int socket_fd) {
 
 void SetMinadbdRescueMode(bool rescue) {
   rescue_mode = rescue;
+  // Rescue hosts poll the battery level; have it sampled ahead of their queries.
+  if (rescue) {
+    BatterySampler::Get().Start();
+  }
 }
 
 void SetSideloadMountPoint(const std::string& path) {
@@ -79,6 +96,60 @@ static bool WriteCommandToFd(MinadbdCommand cmd, int fd) {
 
 // Blocks and reads the command status from |fd|. Returns false if the received message has a
 // format error.
+static bool WaitForCommandStatus(int fd, MinadbdCommandStatus* status);
+
+// Recovery runs the commands one at a time, and answers each with a status that doesn't say which
+// command it's for. As the services run on threads of their own, a command is only sent once the
+// status of the one before it has been read.
+static std::mutex command_mutex;
+static std::condition_variable command_done;
+static bool command_in_flight = false;
+static std::chrono::steady_clock::time_point last_command_end;
+
+// Waits for the command in flight, if any, then sends |cmd| to recovery. The caller must read its
+// status with EndCommand().
+static bool BeginCommand(MinadbdCommand cmd) {
+  std::unique_lock<std::mutex> lock(command_mutex);
+  command_done.wait(lock, []() { return !command_in_flight; });
+  if (!WriteCommandToFd(cmd, minadbd_socket)) {
+    return false;
+  }
+  command_in_flight = true;
+  return true;
+}
+
+// Reads the status of the command in flight.
+static bool EndCommand(MinadbdCommandStatus* status) {
+  bool result = WaitForCommandStatus(minadbd_socket, status);
+  {
+    std::lock_guard<std::mutex> lock(command_mutex);
+    command_in_flight = false;
+    last_command_end = std::chrono::steady_clock::now();
+  }
+  command_done.notify_all();
+  return result;
+}
+
+// Sends a no-op command to keep recovery waiting for commands, unless a command is in flight (e.g.
+// an install) or one finished within kHeartbeatInterval, which do the same.
+static MinadbdErrorCode SendHeartbeat() {
+  {
+    std::lock_guard<std::mutex> lock(command_mutex);
+    if (command_in_flight ||
+        std::chrono::steady_clock::now() - last_command_end < kHeartbeatInterval) {
+      return kMinadbdSuccess;
+    }
+    if (!WriteCommandToFd(MinadbdCommand::kNoOp, minadbd_socket)) {
+      return kMinadbdSocketIOError;
+    }
+    command_in_flight = true;
+  }
+  if (MinadbdCommandStatus status; !EndCommand(&status)) {
+    return kMinadbdMessageFormatError;
+  }
+  return kMinadbdSuccess;
+}
+
 static bool WaitForCommandStatus(int fd, MinadbdCommandStatus* status) {
   char buffer[kMinadbdMessageSize];
   if (!android::base::ReadFully(fd, buffer, kMinadbdMessageSize)) {
@@ -99,31 +170,59 @@ static bool WaitForCommandStatus(int fd, MinadbdCommandStatus* status) {
 
 static MinadbdErrorCode RunAdbFuseSideload(int sfd, const std::string& args,
                                            MinadbdCommandStatus* status) {
+  // <file-size>:<block-size>[:<window>[:<compression>[:<max-run>]]], where newer hosts give a
+  // window to keep that many requests outstanding and answer them in any order, optionally "lz4"
+  // (or "none") to send the blocks compressed, and optionally the most blocks they serve for a
+  // single request (see FuseAdbDataProvider).
   auto pieces = android::base::Split(args, ":");
   int64_t file_size;
   int block_size;
-  if (pieces.size() != 2 || !android::base::ParseInt(pieces[0], &file_size) || file_size <= 0 ||
-      !android::base::ParseInt(pieces[1], &block_size) || block_size <= 0) {
+  uint32_t window = 0;
+  uint32_t max_run = 1;
+  auto compression = FuseAdbDataProvider::Compression::kNone;
+  if (pieces.size() < 2 || pieces.size() > 5 || !android::base::ParseInt(pieces[0], &file_size) ||
+      file_size <= 0 || !android::base::ParseInt(pieces[1], &block_size) || block_size <= 0 ||
+      (pieces.size() >= 3 && (!android::base::ParseUint(pieces[2], &window) || window == 0)) ||
+      (pieces.size() == 5 && (!android::base::ParseUint(pieces[4], &max_run) || max_run == 0))) {
     LOG(ERROR) << "bad sideload-host arguments: " << args;
     return kMinadbdHostCommandArgumentError;
   }
+  if (pieces.size() >= 4) {
+    if (pieces[3] == "lz4") {
+      compression = FuseAdbDataProvider::Compression::kLz4;
+    } else if (pieces[3] != "none") {
+      LOG(ERROR) << "unsupported sideload-host compression: " << pieces[3];
+      return kMinadbdHostCommandArgumentError;
+    }
+  }
 
-  LOG(INFO) << "sideload-host file size " << file_size << ", block size " << block_size;
+  LOG(INFO) << "sideload-host file size " << file_size << ", block size " << block_size
+            << ", window " << window << ", compression "
+            << (pieces.size() >= 4 ? pieces[3] : "none") << ", max run " << max_run;
 
-  if (!WriteCommandToFd(MinadbdCommand::kInstall, minadbd_socket)) {
+  if (!BeginCommand(MinadbdCommand::kInstall)) {
     return kMinadbdSocketIOError;
   }
 
-  auto adb_data_reader = std::make_unique<FuseAdbDataProvider>(sfd, file_size, block_size);
+  std::unique_ptr<FuseDataProvider> adb_data_reader = std::make_unique<FuseAdbDataProvider>(
+      sfd, file_size, block_size, window, compression, max_run);
+  std::string spill_dir = android::base::GetProperty(kSideloadSpillDirProperty, "");
+  if (!spill_dir.empty()) {
+    adb_data_reader = FuseSpillDataProvider::Create(std::move(adb_data_reader), spill_dir);
+  }
   if (int result = run_fuse_sideload(std::move(adb_data_reader), sideload_mount_point.c_str());
       result != 0) {
     LOG(ERROR) << "Failed to start fuse";
     return kMinadbdFuseStartError;
   }
 
-  if (!WaitForCommandStatus(minadbd_socket, status)) {
+  if (!EndCommand(status)) {
     return kMinadbdMessageFormatError;
   }
+  // The package is kept across failed attempts only, for the retry to resume from.
+  if (!spill_dir.empty() && *status == MinadbdCommandStatus::kSuccess) {
+    FuseSpillDataProvider::RemoveSpillFiles(spill_dir);
+  }
 
   // Signal host-side adb to stop. For sideload mode, we always send kMinadbdServicesExitSuccess
   // (i.e. "DONEDONE") regardless of the install result. For rescue mode, we send failure message on
@@ -195,12 +294,10 @@ static void RescueInstallHostService(unique_fd sfd, const std::string& args) {
   }
 }
 
-// Answers the query on a given property |prop|, by writing the result to the given |sfd|. The
-// result will be newline-terminated, so nonexistent or nonallowed query will be answered with "\n".
-// If given an empty string, dumps all the supported properties (analogous to `adb shell getprop`)
-// in lines, e.g. "[prop]: [value]".
-static void RescueGetpropHostService(unique_fd sfd, const std::string& prop) {
-  constexpr const char* kRescueBatteryLevelProp = "rescue.battery_level";
+constexpr const char* kRescueBatteryLevelProp = "rescue.battery_level";
+
+// The properties that rescue mode answers queries on.
+static const std::set<std::string>& GetRescueAllowedProps() {
   static const std::set<std::string> kGetpropAllowedProps = {
     // clang-format off
     kRescueBatteryLevelProp,
@@ -215,26 +312,45 @@ static void RescueGetpropHostService(unique_fd sfd, const std::string& prop) {
     "ro.product.vendor.device",
     // clang-format on
   };
+  return kGetpropAllowedProps;
+}
 
-  auto query_prop = [](const std::string& key) {
-    if (key == kRescueBatteryLevelProp) {
-      auto battery_info = GetBatteryInfo();
-      return std::to_string(battery_info.capacity);
+// Returns the latest battery level sampled, only waiting for the first sample.
+static std::string GetBatteryLevel() {
+  return std::to_string(BatterySampler::Get().Wait().capacity);
+}
+
+// Returns the allowed properties in lines, e.g. "[prop]: [value]", leaving out the empty ones.
+static std::string DumpRescueProps() {
+  std::map<std::string, std::string> values;
+  for (const auto& key : GetRescueAllowedProps()) {
+    if (key != kRescueBatteryLevelProp) {
+      values[key] = DeviceInfo::Get().GetProperty(key);
     }
-    return android::base::GetProperty(key, "");
-  };
+  }
+  values[kRescueBatteryLevelProp] = GetBatteryLevel();
 
   std::string result;
-  if (prop.empty()) {
-    for (const auto& key : kGetpropAllowedProps) {
-      auto value = query_prop(key);
-      if (value.empty()) {
-        continue;
-      }
+  for (const auto& [key, value] : values) {
+    if (!value.empty()) {
       result += "[" + key + "]: [" + value + "]\n";
     }
-  } else if (kGetpropAllowedProps.find(prop) != kGetpropAllowedProps.end()) {
-    result = query_prop(prop) + "\n";
+  }
+  return result;
+}
+
+// Answers the query on a given property |prop|, by writing the result to the given |sfd|. The
+// result will be newline-terminated, so nonexistent or nonallowed query will be answered with "\n".
+// If given an empty string, dumps all the supported properties (analogous to `adb shell getprop`)
+// in lines, e.g. "[prop]: [value]".
+static void RescueGetpropHostService(unique_fd sfd, const std::string& prop) {
+  std::string result;
+  if (prop.empty()) {
+    result = DumpRescueProps();
+  } else if (prop == kRescueBatteryLevelProp) {
+    result = GetBatteryLevel() + "\n";
+  } else if (GetRescueAllowedProps().count(prop) != 0) {
+    result = DeviceInfo::Get().GetProperty(prop) + "\n";
   }
   if (result.empty()) {
     result = "\n";
@@ -244,11 +360,23 @@ static void RescueGetpropHostService(unique_fd sfd, const std::string& prop) {
   }
 
   // Send heartbeat signal to keep the rescue service alive.
-  if (!WriteCommandToFd(MinadbdCommand::kNoOp, minadbd_socket)) {
-    exit(kMinadbdSocketIOError);
+  if (auto error = SendHeartbeat(); error != kMinadbdSuccess) {
+    exit(error);
   }
-  if (MinadbdCommandStatus status; !WaitForCommandStatus(minadbd_socket, &status)) {
-    exit(kMinadbdMessageFormatError);
+}
+
+// Answers with all the allowed properties at once, as RescueGetpropHostService() does for an empty
+// |prop|, framed by their size in 8 decimal digits, so that a host driving many devices gets them
+// in one read without waiting for the connection to close.
+static void RescueGetpropsHostService(unique_fd sfd, const std::string& /* args */) {
+  std::string props = DumpRescueProps();
+  std::string result = android::base::StringPrintf("%08zu", props.size()) + props;
+  if (!android::base::WriteFully(sfd, result.data(), result.size())) {
+    exit(kMinadbdHostSocketIOError);
+  }
+
+  if (auto error = SendHeartbeat(); error != kMinadbdSuccess) {
+    exit(error);
   }
 }
 
@@ -268,11 +396,11 @@ static void RebootHostService(unique_fd /* sfd */, const std::string& target) {
   } else {
     command = MinadbdCommand::kRebootAndroid;
   }
-  if (!WriteCommandToFd(command, minadbd_socket)) {
+  if (!BeginCommand(command)) {
     exit(kMinadbdSocketIOError);
   }
   MinadbdCommandStatus status;
-  if (!WaitForCommandStatus(minadbd_socket, &status)) {
+  if (!EndCommand(&status)) {
     exit(kMinadbdMessageFormatError);
   }
 }
@@ -291,9 +419,37 @@ static void WipeDeviceService(unique_fd fd, const std::string& args) {
     exit(kMinadbdHostCommandArgumentError);
   }
 
-  WriteCommandToFd(MinadbdCommand::kWipeData, minadbd_socket);
+  if (!BeginCommand(MinadbdCommand::kWipeData)) {
+    exit(kMinadbdSocketIOError);
+  }
   MinadbdCommandStatus status;
-  if (!WaitForCommandStatus(minadbd_socket, &status)) {
+  if (!EndCommand(&status)) {
+    exit(kMinadbdMessageFormatError);
+  }
+
+  std::string response = (status == MinadbdCommandStatus::kSuccess) ? kMinadbdServicesExitSuccess
+                                                                    : kMinadbdServicesExitFailure;
+  response += std::string(message_size - response.size(), '\0');
+  if (!android::base::WriteFully(fd, response.c_str(), response.size())) {
+    exit(kMinadbdHostSocketIOError);
+  }
+}
+
+// Runs the storage benchmark of recovery, which saves the I/O profile of the device. Replies with
+// the outcome, padded to <message-size>.
+static void BenchmarkStorageService(unique_fd fd, const std::string& args) {
+  size_t message_size;
+  if (!android::base::ParseUint(args, &message_size) ||
+      message_size < strlen(kMinadbdServicesExitSuccess)) {
+    LOG(ERROR) << "Failed to parse benchmark message size in " << args;
+    exit(kMinadbdHostCommandArgumentError);
+  }
+
+  if (!BeginCommand(MinadbdCommand::kBenchmarkStorage)) {
+    exit(kMinadbdSocketIOError);
+  }
+  MinadbdCommandStatus status;
+  if (!EndCommand(&status)) {
     exit(kMinadbdMessageFormatError);
   }
 
@@ -325,7 +481,7 @@ unique_fd daemon_service_to_fd(std::string_view name, atransport* /* transport *
   // Rescue-specific services.
   if (rescue_mode) {
     if (android::base::ConsumePrefix(&name, "rescue-install:")) {
-      // rescue-install:<file-size>:<block-size>
+      // rescue-install:<file-size>:<block-size>[:<window>[:<compression>[:<max-run>]]]
       std::string args(name);
       return create_service_thread(
           "rescue-install", std::bind(RescueInstallHostService, std::placeholders::_1, args));
@@ -334,11 +490,20 @@ unique_fd daemon_service_to_fd(std::string_view name, atransport* /* transport *
       std::string args(name);
       return create_service_thread(
           "rescue-getprop", std::bind(RescueGetpropHostService, std::placeholders::_1, args));
+    } else if (name == "rescue-getprops") {
+      return create_service_thread(
+          "rescue-getprops",
+          std::bind(RescueGetpropsHostService, std::placeholders::_1, std::string()));
     } else if (android::base::ConsumePrefix(&name, "rescue-wipe:")) {
       // rescue-wipe:target:<message-size>
       std::string args(name);
       return create_service_thread("rescue-wipe",
                                    std::bind(WipeDeviceService, std::placeholders::_1, args));
+    } else if (android::base::ConsumePrefix(&name, "rescue-benchmark:")) {
+      // rescue-benchmark:<message-size>
+      std::string args(name);
+      return create_service_thread(
+          "rescue-benchmark", std::bind(BenchmarkStorageService, std::placeholders::_1, args));
     }
 
     return unique_fd{};
@@ -350,7 +515,7 @@ unique_fd daemon_service_to_fd(std::string_view name, atransport* /* transport *
     // (that supports sideload-host).
     exit(kMinadbdAdbVersionError);
   } else if (android::base::ConsumePrefix(&name, "sideload-host:")) {
-    // sideload-host:<file-size>:<block-size>
+    // sideload-host:<file-size>:<block-size>[:<window>[:<compression>[:<max-run>]]]
     std::string args(name);
     return create_service_thread("sideload-host",
                                  std::bind(SideloadHostService, std::placeholders::_1, args));
@@ -16,6 +16,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <strings.h>
 #include <sys/mount.h>
@@ -28,6 +29,7 @@
 #include <vector>
 
 #include <android-base/file.h>
+#include <android-base/parseint.h>
 #include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
 
@@ -125,6 +127,21 @@ TEST_F(MinadbdServicesTest, SideloadHostService_wrong_size_argument) {
               ::testing::ExitedWithCode(kMinadbdHostCommandArgumentError), "");
 }
 
+TEST_F(MinadbdServicesTest, SideloadHostService_wrong_window_argument) {
+  ASSERT_EXIT(ExecuteCommandAndWaitForExit("sideload-host:4096:4096:0"),
+              ::testing::ExitedWithCode(kMinadbdHostCommandArgumentError), "");
+}
+
+TEST_F(MinadbdServicesTest, SideloadHostService_unsupported_compression) {
+  ASSERT_EXIT(ExecuteCommandAndWaitForExit("sideload-host:4096:4096:8:gzip"),
+              ::testing::ExitedWithCode(kMinadbdHostCommandArgumentError), "");
+}
+
+TEST_F(MinadbdServicesTest, SideloadHostService_wrong_max_run_argument) {
+  ASSERT_EXIT(ExecuteCommandAndWaitForExit("sideload-host:4096:4096:8:none:0"),
+              ::testing::ExitedWithCode(kMinadbdHostCommandArgumentError), "");
+}
+
 TEST_F(MinadbdServicesTest, SideloadHostService_wrong_block_size) {
   ASSERT_EXIT(ExecuteCommandAndWaitForExit("sideload-host:10:20"),
               ::testing::ExitedWithCode(kMinadbdFuseStartError), "");
@@ -211,3 +228,47 @@ TEST_F(MinadbdServicesTest, SideloadHostService_read_data_from_fuse) {
 
   ASSERT_EXIT(test_body(), ::testing::ExitedWithCode(kMinadbdSuccess), "");
 }
+
+TEST_F(MinadbdServicesTest, RescueGetpropsHostService) {
+  auto read_props = [](int fd) {
+    std::string size_string(8, '\0');
+    if (!android::base::ReadFully(fd, size_string.data(), size_string.size())) {
+      return std::string();
+    }
+    size_t size;
+    if (!android::base::ParseUint(size_string, &size)) {
+      return std::string();
+    }
+    std::string props(size, '\0');
+    if (!android::base::ReadFully(fd, props.data(), size)) {
+      return std::string();
+    }
+    return props;
+  };
+
+  auto test_body = [&]() {
+    SetMinadbdRescueMode(true);
+    unique_fd fd = daemon_service_to_fd("rescue-getprops", nullptr);
+    ASSERT_NE(-1, fd);
+    std::string props = read_props(fd);
+    ASSERT_NE(std::string::npos, props.find("[rescue.battery_level]: [")) << props;
+
+    // The first query keeps recovery waiting for commands.
+    ReadAndCheckCommandMessage(recovery_socket_, MinadbdCommand::kNoOp);
+    WriteMinadbdCommandStatus(MinadbdCommandStatus::kSuccess);
+    char c;
+    ASSERT_EQ(0, TEMP_FAILURE_RETRY(read(fd, &c, 1)));
+
+    // The next one needs no heartbeat, as recovery has just answered one.
+    unique_fd second_fd = daemon_service_to_fd("rescue-getprops", nullptr);
+    ASSERT_NE(-1, second_fd);
+    ASSERT_EQ(props, read_props(second_fd));
+    ASSERT_EQ(0, TEMP_FAILURE_RETRY(read(second_fd, &c, 1)));
+    struct pollfd pfd = { .fd = recovery_socket_.get(), .events = POLLIN, .revents = 0 };
+    ASSERT_EQ(0, poll(&pfd, 1, 100));
+
+    exit(kMinadbdSuccess);
+  };
+
+  ASSERT_EXIT(test_body(), ::testing::ExitedWithCode(kMinadbdSuccess), "");
+}
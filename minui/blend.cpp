@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/blend.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+uint32_t BlendPixel(uint32_t pix, uint32_t color, uint32_t alpha_mask, uint8_t alpha) {
+  if (alpha == 0) return pix;
+  uint32_t out = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t pix_c = (pix >> shift) & 0xff;
+    uint32_t cur_c = (color >> shift) & 0xff;
+    out |= ((pix_c * (255 - alpha) + cur_c * alpha) / 255) << shift;
+  }
+  return (out & ~alpha_mask) | (color & alpha_mask);
+}
+
+// Returns the alpha of a pixel with |coverage| drawn at |alpha|.
+static inline uint8_t ScaleAlpha(uint8_t coverage, uint8_t alpha) {
+  return alpha == 255 ? coverage : (static_cast<uint32_t>(coverage) * alpha) / 255;
+}
+
+// The vector kernels divide by 255 as (x + 1 + (x >> 8)) >> 8, which is exact for the x < 65535
+// that blending two bytes gives.
+#if defined(__ARM_NEON)
+
+static inline uint8x8_t Div255(uint16x8_t x) {
+  return vshrn_n_u16(vaddq_u16(vaddq_u16(x, vdupq_n_u16(1)), vshrq_n_u16(x, 8)), 8);
+}
+
+// Blends |color| onto the 8 pixels at |dst| at the alphas in |a|.
+static inline void BlendEight(uint32_t* dst, uint8x8_t a, const uint8x8x4_t& color,
+                              const uint8x8x4_t& alpha_mask) {
+  uint8_t* p = reinterpret_cast<uint8_t*>(dst);
+  uint8x8x4_t pix = vld4_u8(p);
+  uint8x8_t inv = vmvn_u8(a);
+  uint8x8_t transparent = vceq_u8(a, vdup_n_u8(0));
+  uint8x8x4_t out;
+  for (int i = 0; i < 4; i++) {
+    out.val[i] = Div255(vmlal_u8(vmull_u8(pix.val[i], inv), color.val[i], a));
+    out.val[i] = vbsl_u8(alpha_mask.val[i], color.val[i], out.val[i]);
+    out.val[i] = vbsl_u8(transparent, pix.val[i], out.val[i]);
+  }
+  vst4_u8(p, out);
+}
+
+// Splits |value| into the vectors of its bytes, as vld4_u8() would for pixels of that value.
+static inline uint8x8x4_t SplatBytes(uint32_t value) {
+  uint8x8x4_t result;
+  for (int i = 0; i < 4; i++) {
+    result.val[i] = vdup_n_u8((value >> (8 * i)) & 0xff);
+  }
+  return result;
+}
+
+static int BlendFillVector(uint32_t* dst, int count, uint32_t color, uint32_t alpha_mask,
+                           uint8_t alpha) {
+  uint8x8x4_t color_bytes = SplatBytes(color);
+  uint8x8x4_t mask_bytes = SplatBytes(alpha_mask);
+  uint8x8_t a = vdup_n_u8(alpha);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    BlendEight(dst + i, a, color_bytes, mask_bytes);
+  }
+  return i;
+}
+
+static int BlendMaskVector(uint32_t* dst, const uint8_t* coverage, int count, uint32_t color,
+                           uint32_t alpha_mask, uint8_t alpha) {
+  uint8x8x4_t color_bytes = SplatBytes(color);
+  uint8x8x4_t mask_bytes = SplatBytes(alpha_mask);
+  uint8x8_t scale = vdup_n_u8(alpha);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    uint8x8_t a = vld1_u8(coverage + i);
+    if (vget_lane_u64(vreinterpret_u64_u8(a), 0) == 0) continue;
+    if (alpha < 255) a = Div255(vmull_u8(a, scale));
+    BlendEight(dst + i, a, color_bytes, mask_bytes);
+  }
+  return i;
+}
+
+#elif defined(__SSE2__)
+
+static inline __m128i Div255(__m128i x) {
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)),
+                        8);
+}
+
+// Blends |color16| (a pixel in each half, as 16-bit lanes) onto the 4 pixels at |dst| at the alphas
+// in |a_lo| and |a_hi| (for the first and the last two pixels, as 16-bit lanes).
+static inline void BlendFour(uint32_t* dst, __m128i a_lo, __m128i a_hi, __m128i color16,
+                             __m128i alpha_mask, __m128i alpha_bits) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i max = _mm_set1_epi16(255);
+  __m128i pix = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst));
+  __m128i pix_lo = _mm_unpacklo_epi8(pix, zero);
+  __m128i pix_hi = _mm_unpackhi_epi8(pix, zero);
+  __m128i lo = _mm_add_epi16(_mm_mullo_epi16(pix_lo, _mm_sub_epi16(max, a_lo)),
+                             _mm_mullo_epi16(color16, a_lo));
+  __m128i hi = _mm_add_epi16(_mm_mullo_epi16(pix_hi, _mm_sub_epi16(max, a_hi)),
+                             _mm_mullo_epi16(color16, a_hi));
+  __m128i out = _mm_packus_epi16(Div255(lo), Div255(hi));
+  out = _mm_or_si128(_mm_andnot_si128(alpha_mask, out), alpha_bits);
+  __m128i transparent = _mm_cmpeq_epi32(_mm_packus_epi16(a_lo, a_hi), zero);
+  out = _mm_or_si128(_mm_and_si128(transparent, pix), _mm_andnot_si128(transparent, out));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), out);
+}
+
+static int BlendFillVector(uint32_t* dst, int count, uint32_t color, uint32_t alpha_mask,
+                           uint8_t alpha) {
+  __m128i color16 = _mm_unpacklo_epi8(_mm_set1_epi32(color), _mm_setzero_si128());
+  __m128i mask = _mm_set1_epi32(alpha_mask);
+  __m128i alpha_bits = _mm_set1_epi32(color & alpha_mask);
+  __m128i a = _mm_set1_epi16(alpha);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    BlendFour(dst + i, a, a, color16, mask, alpha_bits);
+  }
+  return i;
+}
+
+static int BlendMaskVector(uint32_t* dst, const uint8_t* coverage, int count, uint32_t color,
+                           uint32_t alpha_mask, uint8_t alpha) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i color16 = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+  __m128i mask = _mm_set1_epi32(alpha_mask);
+  __m128i alpha_bits = _mm_set1_epi32(color & alpha_mask);
+  __m128i scale = _mm_set1_epi16(alpha);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    uint32_t a4;
+    memcpy(&a4, coverage + i, sizeof(a4));
+    if (a4 == 0) continue;
+    // Spread each coverage byte over the four bytes of its pixel, then widen them.
+    __m128i a = _mm_cvtsi32_si128(a4);
+    a = _mm_unpacklo_epi8(a, a);
+    a = _mm_unpacklo_epi16(a, a);
+    __m128i a_lo = _mm_unpacklo_epi8(a, zero);
+    __m128i a_hi = _mm_unpackhi_epi8(a, zero);
+    if (alpha < 255) {
+      a_lo = Div255(_mm_mullo_epi16(a_lo, scale));
+      a_hi = Div255(_mm_mullo_epi16(a_hi, scale));
+    }
+    BlendFour(dst + i, a_lo, a_hi, color16, mask, alpha_bits);
+  }
+  return i;
+}
+
+#else
+
+static int BlendFillVector(uint32_t*, int, uint32_t, uint32_t, uint8_t) {
+  return 0;
+}
+
+static int BlendMaskVector(uint32_t*, const uint8_t*, int, uint32_t, uint32_t, uint8_t) {
+  return 0;
+}
+
+#endif
+
+void BlendFill(uint32_t* dst, int count, uint32_t color, uint32_t alpha_mask, uint8_t alpha) {
+  if (alpha == 0) return;
+  if (alpha == 255) {
+    std::fill_n(dst, count, color);
+    return;
+  }
+  for (int i = BlendFillVector(dst, count, color, alpha_mask, alpha); i < count; i++) {
+    dst[i] = BlendPixel(dst[i], color, alpha_mask, alpha);
+  }
+}
+
+void BlendMask(uint32_t* dst, const uint8_t* coverage, int count, uint32_t color,
+               uint32_t alpha_mask, uint8_t alpha) {
+  if (alpha == 0) return;
+  for (int i = BlendMaskVector(dst, coverage, count, color, alpha_mask, alpha); i < count; i++) {
+    dst[i] = BlendPixel(dst[i], color, alpha_mask, ScaleAlpha(coverage[i], alpha));
+  }
+}
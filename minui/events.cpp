@@ -22,14 +22,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <functional>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <android-base/properties.h>
 #include <android-base/strings.h>
@@ -64,6 +71,30 @@ static size_t g_ev_count = 0;
 static size_t g_ev_dev_count = 0;
 static size_t g_ev_misc_count = 0;
 
+// The eventfd that ev_wake() signals, or -1. Owned by its entry in ev_fdinfo.
+static int g_wake_fd = -1;
+
+// The timers are kept in a hashed timing wheel: a timer due at tick T (of kTimerTick since
+// g_timer_epoch) sits in slot T % kTimerSlots, so that adding and canceling one take constant time,
+// and running the due ones only looks at the slots of the ticks that have passed.
+constexpr std::chrono::milliseconds kTimerTick{ 10 };
+constexpr size_t kTimerSlots = 256;
+
+struct TimerInfo {
+  int id;
+  uint64_t tick;
+  ev_timer_callback cb;
+};
+
+// The pending timers, which may be added or canceled from any thread.
+static std::mutex g_timers_mutex;
+static const std::chrono::steady_clock::time_point g_timer_epoch = std::chrono::steady_clock::now();
+static std::list<TimerInfo> g_timer_wheel[kTimerSlots];
+static std::unordered_map<int, std::list<TimerInfo>::iterator> g_timer_index;
+// The last tick whose timers have run.
+static uint64_t g_timer_tick = 0;
+static int g_next_timer_id = 1;
+
 static bool should_skip_ev_rel() {
   static bool prop = android::base::GetBoolProperty("ro.recovery.skip_ev_rel_input", false);
   return prop;
@@ -150,13 +181,27 @@ static int inotify_cb(int fd, __unused uint32_t epevents) {
   return 0;
 }
 
+static int wake_cb(int fd, __unused uint32_t epevents) {
+  uint64_t count;
+  TEMP_FAILURE_RETRY(read(fd, &count, sizeof(count)));
+  return 0;
+}
+
 int ev_init(ev_callback input_cb, bool allow_touch_inputs) {
   g_epoll_fd.reset();
 
-  android::base::unique_fd epoll_fd(epoll_create1(EPOLL_CLOEXEC));
-  if (epoll_fd == -1) {
+  // The epoll fd and the eventfd to wake it up are set up first, so that timers and ev_wake() work
+  // even without any input devices.
+  g_epoll_fd.reset(epoll_create1(EPOLL_CLOEXEC));
+  if (g_epoll_fd == -1) {
+    return -1;
+  }
+  android::base::unique_fd wake_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  int wake_fd_value = wake_fd.get();
+  if (wake_fd == -1 || ev_add_fd(std::move(wake_fd), wake_cb) != 0) {
     return -1;
   }
+  g_wake_fd = wake_fd_value;
 
   android::base::unique_fd inotify_fd(inotify_init1(IN_CLOEXEC));
   if (inotify_fd.get() == -1) {
@@ -186,7 +231,7 @@ int ev_init(ev_callback input_cb, bool allow_touch_inputs) {
     epoll_event ev;
     ev.events = EPOLLIN | EPOLLWAKEUP;
     ev.data.ptr = &ev_fdinfo[g_ev_count];
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
       epoll_ctl_failed = true;
       continue;
     }
@@ -198,12 +243,10 @@ int ev_init(ev_callback input_cb, bool allow_touch_inputs) {
     if (g_ev_dev_count == MAX_DEVICES) break;
   }
 
-  if (epoll_ctl_failed && !g_ev_count) {
+  if (epoll_ctl_failed && !g_ev_dev_count) {
     return -1;
   }
 
-  g_epoll_fd.reset(epoll_fd.release());
-
   g_saved_input_cb = input_cb;
   g_allow_touch_inputs = allow_touch_inputs;
   ev_add_fd(std::move(inotify_fd), inotify_cb);
@@ -235,6 +278,7 @@ int ev_add_fd(android::base::unique_fd&& fd, ev_callback cb) {
 }
 
 void ev_exit(void) {
+  g_wake_fd = -1;
   while (g_ev_count > 0) {
     ev_fdinfo[--g_ev_count].fd.reset();
   }
@@ -242,11 +286,83 @@ void ev_exit(void) {
   g_ev_dev_count = 0;
   g_saved_input_cb = nullptr;
   g_epoll_fd.reset();
+
+  std::lock_guard<std::mutex> lock(g_timers_mutex);
+  for (auto& slot : g_timer_wheel) {
+    slot.clear();
+  }
+  g_timer_index.clear();
+}
+
+void ev_wake() {
+  if (g_wake_fd != -1) {
+    uint64_t count = 1;
+    TEMP_FAILURE_RETRY(write(g_wake_fd, &count, sizeof(count)));
+  }
+}
+
+// Returns the tick at |time|, rounded down.
+static uint64_t tick_at(std::chrono::steady_clock::time_point time) {
+  return (time - g_timer_epoch) / kTimerTick;
+}
+
+int ev_add_timer(std::chrono::milliseconds delay, ev_timer_callback cb) {
+  int id;
+  {
+    std::lock_guard<std::mutex> lock(g_timers_mutex);
+    id = g_next_timer_id++;
+    // Rounded up, so that the timer never runs early, and never in a tick that's already run.
+    uint64_t tick = tick_at(std::chrono::steady_clock::now() + delay + kTimerTick -
+                            std::chrono::nanoseconds(1));
+    tick = std::max(tick, g_timer_tick + 1);
+    auto& slot = g_timer_wheel[tick % kTimerSlots];
+    g_timer_index.emplace(id, slot.insert(slot.end(), { id, tick, std::move(cb) }));
+  }
+  // The ev_wait() in progress may need to return sooner.
+  ev_wake();
+  return id;
+}
+
+void ev_cancel_timer(int id) {
+  std::lock_guard<std::mutex> lock(g_timers_mutex);
+  auto it = g_timer_index.find(id);
+  if (it != g_timer_index.end()) {
+    g_timer_wheel[it->second->tick % kTimerSlots].erase(it->second);
+    g_timer_index.erase(it);
+  }
+}
+
+// Returns the time until the next tick with a timer that's due, or -1 if there are no timers, in
+// the units of ev_wait(). Timers more than a turn of the wheel away wake it up once per turn.
+static int time_to_next_timer() {
+  std::lock_guard<std::mutex> lock(g_timers_mutex);
+  if (g_timer_index.empty()) {
+    return -1;
+  }
+  uint64_t next_tick = g_timer_tick + kTimerSlots;
+  for (uint64_t tick = g_timer_tick + 1; tick < next_tick; tick++) {
+    const auto& slot = g_timer_wheel[tick % kTimerSlots];
+    if (std::any_of(slot.begin(), slot.end(),
+                    [tick](const TimerInfo& timer) { return timer.tick <= tick; })) {
+      next_tick = tick;
+      break;
+    }
+  }
+  auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+      g_timer_epoch + next_tick * kTimerTick - std::chrono::steady_clock::now());
+  return std::max<int>(remaining.count(), 0);
 }
 
 int ev_wait(int timeout) {
+  int timer_timeout = time_to_next_timer();
+  if (timer_timeout != -1 && (timeout < 0 || timer_timeout < timeout)) {
+    timeout = timer_timeout;
+  }
   g_polled_events_count = epoll_wait(g_epoll_fd, g_polled_events, g_ev_count, timeout);
-  if (g_polled_events_count <= 0) {
+  if (g_polled_events_count < 0) {
+    g_polled_events_count = 0;
+  }
+  if (g_polled_events_count == 0 && time_to_next_timer() != 0) {
     return -1;
   }
   return 0;
@@ -260,13 +376,46 @@ void ev_dispatch(void) {
       cb(fdi->fd, g_polled_events[n].events);
     }
   }
+  g_polled_events_count = 0;
+
+  // The timers that are due are taken out before running any, so that their callbacks can add or
+  // cancel timers.
+  std::list<TimerInfo> due;
+  {
+    std::lock_guard<std::mutex> lock(g_timers_mutex);
+    uint64_t now_tick = tick_at(std::chrono::steady_clock::now());
+    uint64_t last_tick = std::min(now_tick, g_timer_tick + kTimerSlots);
+    for (uint64_t tick = g_timer_tick + 1; tick <= last_tick; tick++) {
+      auto& slot = g_timer_wheel[tick % kTimerSlots];
+      for (auto it = slot.begin(); it != slot.end();) {
+        auto timer = it++;
+        if (timer->tick <= now_tick) {
+          g_timer_index.erase(timer->id);
+          due.splice(due.end(), slot, timer);
+        }
+      }
+    }
+    g_timer_tick = std::max(g_timer_tick, now_tick);
+  }
+  // In the order they were due, then in the order they were added.
+  due.sort([](const TimerInfo& a, const TimerInfo& b) {
+    return a.tick < b.tick || (a.tick == b.tick && a.id < b.id);
+  });
+  for (const auto& timer : due) {
+    timer.cb();
+  }
 }
 
 int ev_get_input(int fd, uint32_t epevents, input_event* ev) {
+  return ev_get_inputs(fd, epevents, ev, 1) == 1 ? 0 : -1;
+}
+
+int ev_get_inputs(int fd, uint32_t epevents, input_event* events, size_t count) {
   if (epevents & EPOLLIN) {
-    ssize_t r = TEMP_FAILURE_RETRY(read(fd, ev, sizeof(*ev)));
-    if (r == sizeof(*ev)) {
-      return 0;
+    // evdev only returns whole events, and as many as are pending (up to |count|).
+    ssize_t r = TEMP_FAILURE_RETRY(read(fd, events, sizeof(*events) * count));
+    if (r >= static_cast<ssize_t>(sizeof(*events))) {
+      return r / sizeof(*events);
     }
   }
   if (epevents & EPOLLHUP) {
@@ -21,16 +21,28 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <cmath>
 #include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <android-base/properties.h>
 
 #include "graphics_drm.h"
 #include "graphics_fbdev.h"
+#include "graphics_memory.h"
 #include "minui/minui.h"
+#include "private/blend.h"
+#include "private/resources.h"
+#include "private/text.h"
 
 static GRFont* gr_font = nullptr;
 static GRFont* gr_font_menu = nullptr;
+// Enough for the lines of a screen of text, plus the menu.
+static TextRunCache text_runs(128);
 static MinuiBackend* gr_backend = nullptr;
 
 static int overscan_offset_x = 0;
@@ -47,6 +59,144 @@ static PixelFormat pixel_format = PixelFormat::UNKNOWN;
 // For example, it will fist try DRM, then try FBDEV if DRM is unavailable.
 constexpr auto default_backends = { GraphicsBackend::DRM, GraphicsBackend::FBDEV };
 
+// The screen size of GraphicsBackend::MEMORY. gr_init() uses it in place of the default backends
+// once set with gr_use_memory_backend().
+static int memory_backend_width = 0;
+static int memory_backend_height = 0;
+
+// Whether the current frame was started with gr_begin_partial_update() (and not cleared since),
+// the regions drawn in it, and the regions drawn in the last two frames flipped, newest first. With
+// up to three buffers, the drawing surface holds one of the two frames before the one on the
+// screen, so it may differ from the screen only in |flipped_damage|.
+static bool partial_frame = false;
+static std::vector<GRRect> frame_damage;
+static std::vector<GRRect> flipped_damage[2];
+// Past this many regions in a frame, they're merged into their bounding box.
+static constexpr size_t kMaxDamageRects = 16;
+
+// What gr_set_draw_surface() puts aside while the drawing functions draw into another surface: the
+// frame to flip, and the state of the frame that drawing into the other surface mustn't change.
+struct FrameState {
+  GRSurface* draw;
+  int overscan_offset_x;
+  int overscan_offset_y;
+  bool partial_frame;
+  std::vector<GRRect> damage;
+};
+static std::optional<FrameState> saved_frame;
+
+// With gr_set_round_clip(), the visible columns of each row of a drawing surface of
+// |clip_spans_width| x |clip_spans_height|, as [first, last) pairs.
+static bool round_clip = false;
+static std::vector<std::pair<int, int>> clip_spans;
+static int clip_spans_width = 0;
+static int clip_spans_height = 0;
+
+static GRRect FullSurfaceRect() {
+  return { 0, 0, static_cast<int>(gr_draw->width), static_cast<int>(gr_draw->height) };
+}
+
+// Returns the region that |rect| of an image of |width| x |height| takes once the image is rotated
+// by |rotation|, the way PrerotateSurface() rotates it.
+static GRRect RotateRect(const GRRect& rect, GRRotation rotation, int width, int height) {
+  switch (rotation) {
+    case GRRotation::RIGHT:
+      return { height - rect.y - rect.height, rect.x, rect.height, rect.width };
+    case GRRotation::DOWN:
+      return { width - rect.x - rect.width, height - rect.y - rect.height, rect.width,
+               rect.height };
+    case GRRotation::LEFT:
+      return { rect.y, width - rect.x - rect.width, rect.height, rect.width };
+    default:
+      return rect;
+  }
+}
+
+// Returns the region of the drawing surface that holds the region |rect| of the screen (with the
+// overscan offsets applied). It may stick out of the surface by a column (see PixelAt()).
+static GRRect SurfaceRect(const GRRect& rect) {
+  int surface_width = gr_draw->width;
+  int surface_height = gr_draw->height;
+  bool swapped = rotation == GRRotation::LEFT || rotation == GRRotation::RIGHT;
+  GRRect result = RotateRect(rect, rotation, swapped ? surface_height : surface_width,
+                             swapped ? surface_width : surface_height);
+  // PixelAt() puts row y at column surface_width - y, one past the mirrored one.
+  if (rotation == GRRotation::RIGHT) {
+    result.x++;
+  }
+  return result;
+}
+
+// Returns |rect| clipped to the drawing surface. The result may be empty.
+static GRRect ClipToSurface(const GRRect& rect) {
+  int surface_width = gr_draw->width;
+  int surface_height = gr_draw->height;
+  int left = std::max(rect.x, 0);
+  int top = std::max(rect.y, 0);
+  int right = std::max(std::min(rect.x + rect.width, surface_width), left);
+  int bottom = std::max(std::min(rect.y + rect.height, surface_height), top);
+  return { left, top, right - left, bottom - top };
+}
+
+// Records the region at (x, y) drawn by the caller, in screen coordinates (with the overscan
+// offsets applied), as a region of the drawing surface.
+static void AddDamage(int x, int y, int width, int height) {
+  if (!partial_frame || width <= 0 || height <= 0) return;
+
+  GRRect rect = ClipToSurface(SurfaceRect({ x, y, width, height }));
+  if (rect.width == 0 || rect.height == 0) return;
+  int left = rect.x;
+  int top = rect.y;
+  int right = rect.x + rect.width;
+  int bottom = rect.y + rect.height;
+
+  if (frame_damage.size() == kMaxDamageRects) {
+    for (const auto& r : frame_damage) {
+      left = std::min(left, r.x);
+      top = std::min(top, r.y);
+      right = std::max(right, r.x + r.width);
+      bottom = std::max(bottom, r.y + r.height);
+    }
+    frame_damage.clear();
+    rect = { left, top, right - left, bottom - top };
+  }
+  frame_damage.push_back(rect);
+}
+
+// Narrows the |width| pixels from column |x| of the row |y| of the drawing surface to those that
+// gr_set_round_clip() leaves visible. Returns false if none of them is.
+static bool ClipRow(int y, int* x, int* width) {
+  if (!round_clip) return true;
+
+  int surface_width = gr_draw->width;
+  int surface_height = gr_draw->height;
+  if (surface_width != clip_spans_width || surface_height != clip_spans_height) {
+    // The circle inscribed in the screen is inscribed in the surface too, whatever the rotation.
+    // A row keeps the pixels that the circle touches at all.
+    double radius = std::min(surface_width, surface_height) / 2.0;
+    double center_x = surface_width / 2.0;
+    double center_y = surface_height / 2.0;
+    clip_spans.assign(surface_height, { 0, 0 });
+    for (int row = 0; row < surface_height; ++row) {
+      double dy = std::max({ 0.0, row - center_y, center_y - (row + 1) });
+      if (dy >= radius) continue;
+      double half = std::sqrt(radius * radius - dy * dy);
+      clip_spans[row] = { std::max(0, static_cast<int>(std::floor(center_x - half))),
+                          std::min(surface_width, static_cast<int>(std::ceil(center_x + half))) };
+    }
+    clip_spans_width = surface_width;
+    clip_spans_height = surface_height;
+  }
+
+  auto [first, last] = clip_spans[y];
+  int left = std::max(*x, first);
+  int right = std::min(*x + *width, last);
+  if (left >= right) return false;
+  *x = left;
+  *width = right - left;
+  return true;
+}
+
 static bool outside(int x, int y) {
   auto swapped = (rotation == GRRotation::LEFT || rotation == GRRotation::RIGHT);
   return x < 0 || x >= (swapped ? gr_draw->height : gr_draw->width) || y < 0 ||
@@ -70,7 +220,7 @@ int gr_measure(const GRFont* font, const char* s) {
     return -1;
   }
 
-  return font->char_width * strlen(s);
+  return font->char_width * CountCodePoints(s);
 }
 
 int gr_font_size(const GRFont* font, int* x, int* y) {
@@ -83,48 +233,6 @@ int gr_font_size(const GRFont* font, int* x, int* y) {
   return 0;
 }
 
-// Blends gr_current onto pix value, assumes alpha as most significant byte.
-static inline uint32_t pixel_blend_argb(uint8_t alpha, uint32_t pix) {
-  if (alpha == 255) return gr_current;
-  if (alpha == 0) return pix;
-  uint32_t pix_r = pix & 0xff;
-  uint32_t pix_g = pix & 0xff00;
-  uint32_t pix_b = pix & 0xff0000;
-  uint32_t cur_r = gr_current & 0xff;
-  uint32_t cur_g = gr_current & 0xff00;
-  uint32_t cur_b = gr_current & 0xff0000;
-
-  uint32_t out_r = (pix_r * (255 - alpha) + cur_r * alpha) / 255;
-  uint32_t out_g = (pix_g * (255 - alpha) + cur_g * alpha) / 255;
-  uint32_t out_b = (pix_b * (255 - alpha) + cur_b * alpha) / 255;
-
-  return (out_r & 0xff) | (out_g & 0xff00) | (out_b & 0xff0000) | (gr_current & 0xff000000);
-}
-
-static inline uint32_t pixel_blend_rgba(uint8_t alpha, uint32_t pix) {
-  if (alpha == 255) return gr_current;
-  if (alpha == 0) return pix;
-  uint32_t pix_r = pix & 0xff00;
-  uint32_t pix_g = pix & 0xff0000;
-  uint32_t pix_b = pix & 0xff000000;
-  uint32_t cur_r = gr_current & 0xff00;
-  uint32_t cur_g = gr_current & 0xff0000;
-  uint32_t cur_b = gr_current & 0xff000000;
-
-  uint32_t out_r = (pix_r * (255 - alpha) + cur_r * alpha) / 255;
-  uint32_t out_g = (pix_g * (255 - alpha) + cur_g * alpha) / 255;
-  uint32_t out_b = (pix_b * (255 - alpha) + cur_b * alpha) / 255;
-
-  return (gr_current & 0xff) | (out_r & 0xff00) | (out_g & 0xff0000) | (out_b & 0xff000000);
-}
-
-static inline uint32_t pixel_blend(uint8_t alpha, uint32_t pix) {
-  if (pixel_format == PixelFormat::RGBA) {
-    return pixel_blend_rgba(alpha, pix);
-  }
-  return pixel_blend_argb(alpha, pix);
-}
-
 static inline uint32_t get_alphamask() {
   if (pixel_format == PixelFormat::RGBA) {
     return 0x000000ff;
@@ -188,18 +296,80 @@ static uint32_t* PixelAt(GRSurface* surface, int x, int y, int row_pixels) {
   return nullptr;
 }
 
-static void TextBlend(const uint8_t* src_p, int src_row_bytes, uint32_t* dst_p, int dst_row_pixels,
-                      int width, int height) {
+// The rows to draw a region of an image with, in the layout of the drawing surface: |height| rows
+// of |width| pixels, starting at |src| (|src_row_bytes| apart) and at |dst| (a row of the drawing
+// surface apart), which is at (x, y) of the drawing surface.
+struct DrawRows {
+  const uint8_t* src;
+  size_t src_row_bytes;
+  uint8_t* dst;
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+// Finds the rows to draw the region (sx, sy, w, h) of |source| at (dx, dy) of the screen with. On a
+// rotated screen, they come from the copy of |source| rotated at load time. Returns false if it has
+// none for the current rotation, in which case the caller needs to rotate the pixels as it draws.
+static bool GetDrawRows(const GRSurface* source, int sx, int sy, int w, int h, int dx, int dy,
+                        DrawRows* rows) {
+  const GRSurface* image = source;
+  GRRect src = { sx, sy, w, h };
+  if (rotation != GRRotation::NONE) {
+    if (!source->rotated || source->rotated_for != rotation) return false;
+    image = source->rotated.get();
+    src = RotateRect(src, rotation, source->width, source->height);
+  }
+
+  // The image and the drawing surface are rotated alike, so clipping the region on the drawing
+  // surface moves its start on the image by as much.
+  GRRect unclipped = SurfaceRect({ dx, dy, w, h });
+  GRRect dst = ClipToSurface(unclipped);
+  src.x += dst.x - unclipped.x;
+  src.y += dst.y - unclipped.y;
+
+  rows->src = image->data() + src.y * image->row_bytes + src.x * image->pixel_bytes;
+  rows->src_row_bytes = image->row_bytes;
+  rows->dst = gr_draw->data() + dst.y * gr_draw->row_bytes + dst.x * gr_draw->pixel_bytes;
+  rows->x = dst.x;
+  rows->y = dst.y;
+  rows->width = dst.width;
+  rows->height = dst.height;
+  return true;
+}
+
+// Blends the region (sx, sy, w, h) of the alpha mask |source| in the current color at (dx, dy).
+static void TextBlend(const GRSurface* source, int sx, int sy, int w, int h, int dx, int dy) {
   uint8_t alpha_current = get_alpha(gr_current);
-  for (int j = 0; j < height; ++j) {
+  uint32_t alpha_mask = get_alphamask();
+  DrawRows rows;
+  if (GetDrawRows(source, sx, sy, w, h, dx, dy, &rows)) {
+    for (int j = 0; j < rows.height; ++j) {
+      int x = rows.x;
+      int width = rows.width;
+      if (ClipRow(rows.y + j, &x, &width)) {
+        BlendMask(reinterpret_cast<uint32_t*>(rows.dst) + (x - rows.x), rows.src + (x - rows.x),
+                  width, gr_current, alpha_mask, alpha_current);
+      }
+      rows.src += rows.src_row_bytes;
+      rows.dst += gr_draw->row_bytes;
+    }
+    return;
+  }
+
+  int dst_row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
+  const uint8_t* src_p = source->data() + sy * source->row_bytes + sx;
+  uint32_t* dst_p = PixelAt(gr_draw, dx, dy, dst_row_pixels);
+  for (int j = 0; j < h; ++j) {
     const uint8_t* sx = src_p;
     uint32_t* px = dst_p;
-    for (int i = 0; i < width; ++i, incr_x(&px, dst_row_pixels)) {
+    for (int i = 0; i < w; ++i, incr_x(&px, dst_row_pixels)) {
       uint8_t a = *sx++;
       if (alpha_current < 255) a = (static_cast<uint32_t>(a) * alpha_current) / 255;
-      *px = pixel_blend(a, *px);
+      *px = BlendPixel(*px, gr_current, alpha_mask, a);
     }
-    src_p += src_row_bytes;
+    src_p += source->row_bytes;
     incr_y(&dst_p, dst_row_pixels);
   }
 }
@@ -217,24 +387,19 @@ void gr_text(const GRFont* font, int x, int y, const char* s, bool bold) {
   x += overscan_offset_x;
   y += overscan_offset_y;
 
-  unsigned char ch;
-  while ((ch = *s++)) {
-    if (outside(x, y) || outside(x + font->char_width - 1, y + font->char_height - 1)) break;
+  if (font->char_width <= 0 || outside(x, y) || outside(x, y + font->char_height - 1)) return;
 
-    if (ch < ' ' || ch > '~') {
-      ch = '?';
-    }
-
-    int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
-    const uint8_t* src_p = font->texture->data() + ((ch - ' ') * font->char_width) +
-                           (bold ? font->char_height * font->texture->row_bytes : 0);
-    uint32_t* dst_p = PixelAt(gr_draw, x, y, row_pixels);
+  // Only the glyphs that fit on the screen are drawn, so there's no need to composite more than a
+  // screen width of them.
+  bool swapped = rotation == GRRotation::LEFT || rotation == GRRotation::RIGHT;
+  int screen_width = swapped ? gr_draw->height : gr_draw->width;
+  const GRSurface* run = text_runs.Get(font, bold, s, screen_width / font->char_width, rotation);
+  if (run == nullptr) return;
 
-    TextBlend(src_p, font->texture->row_bytes, dst_p, row_pixels, font->char_width,
-              font->char_height);
-
-    x += font->char_width;
-  }
+  int width = std::min<int>(run->width, (screen_width - x) / font->char_width * font->char_width);
+  if (width <= 0) return;
+  TextBlend(run, 0, 0, width, font->char_height, x, y);
+  AddDamage(x, y, width, font->char_height);
 }
 
 void gr_texticon(int x, int y, const GRSurface* icon) {
@@ -250,10 +415,8 @@ void gr_texticon(int x, int y, const GRSurface* icon) {
 
   if (outside(x, y) || outside(x + icon->width - 1, y + icon->height - 1)) return;
 
-  int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
-  const uint8_t* src_p = icon->data();
-  uint32_t* dst_p = PixelAt(gr_draw, x, y, row_pixels);
-  TextBlend(src_p, icon->row_bytes, dst_p, row_pixels, icon->width, icon->height);
+  TextBlend(icon, 0, 0, icon->width, icon->height, x, y);
+  AddDamage(x, y, icon->width, icon->height);
 }
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
@@ -268,6 +431,8 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
 }
 
 void gr_clear() {
+  partial_frame = false;
+  frame_damage.clear();
   if ((gr_current & 0xff) == ((gr_current >> 8) & 0xff) &&
       (gr_current & 0xff) == ((gr_current >> 16) & 0xff) &&
       (gr_current & 0xff) == ((gr_current >> 24) & 0xff) &&
@@ -294,18 +459,22 @@ void gr_fill(int x1, int y1, int x2, int y2) {
 
   if (outside(x1, y1) || outside(x2 - 1, y2 - 1)) return;
 
-  int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
-  uint32_t* p = PixelAt(gr_draw, x1, y1, row_pixels);
   uint8_t alpha = get_alpha(gr_current);
-  if (alpha > 0) {
-    for (int y = y1; y < y2; ++y) {
-      uint32_t* px = p;
-      for (int x = x1; x < x2; ++x) {
-        *px = pixel_blend(alpha, *px);
-        incr_x(&px, row_pixels);
-      }
-      incr_y(&p, row_pixels);
+  uint32_t alpha_mask = get_alphamask();
+  if (alpha == 0) return;
+  AddDamage(x1, y1, x2 - x1, y2 - y1);
+
+  // A rectangle on the screen is a rectangle on the drawing surface too, whatever the rotation.
+  GRRect rect = ClipToSurface(SurfaceRect({ x1, y1, x2 - x1, y2 - y1 }));
+  uint8_t* p = gr_draw->data() + rect.y * gr_draw->row_bytes + rect.x * gr_draw->pixel_bytes;
+  for (int y = 0; y < rect.height; ++y) {
+    int x = rect.x;
+    int width = rect.width;
+    if (ClipRow(rect.y + y, &x, &width)) {
+      BlendFill(reinterpret_cast<uint32_t*>(p) + (x - rect.x), width, gr_current, alpha_mask,
+                alpha);
     }
+    p += gr_draw->row_bytes;
   }
 }
 
@@ -321,8 +490,21 @@ void gr_blit(const GRSurface* source, int sx, int sy, int w, int h, int dx, int
   dy += overscan_offset_y;
 
   if (outside(dx, dy) || outside(dx + w - 1, dy + h - 1)) return;
-
-  if (rotation != GRRotation::NONE) {
+  AddDamage(dx, dy, w, h);
+
+  DrawRows rows;
+  if (GetDrawRows(source, sx, sy, w, h, dx, dy, &rows)) {
+    for (int i = 0; i < rows.height; ++i) {
+      int x = rows.x;
+      int width = rows.width;
+      if (ClipRow(rows.y + i, &x, &width)) {
+        size_t skipped = (x - rows.x) * source->pixel_bytes;
+        memcpy(rows.dst + skipped, rows.src + skipped, width * source->pixel_bytes);
+      }
+      rows.src += rows.src_row_bytes;
+      rows.dst += gr_draw->row_bytes;
+    }
+  } else {
     int src_row_pixels = source->row_bytes / source->pixel_bytes;
     int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
     const uint32_t* src_py =
@@ -339,15 +521,6 @@ void gr_blit(const GRSurface* source, int sx, int sy, int w, int h, int dx, int
       src_py += src_row_pixels;
       incr_y(&dst_py, row_pixels);
     }
-  } else {
-    const uint8_t* src_p = source->data() + sy * source->row_bytes + sx * source->pixel_bytes;
-    uint8_t* dst_p = gr_draw->data() + dy * gr_draw->row_bytes + dx * gr_draw->pixel_bytes;
-
-    for (int i = 0; i < h; ++i) {
-      memcpy(dst_p, src_p, w * source->pixel_bytes);
-      src_p += source->row_bytes;
-      dst_p += gr_draw->row_bytes;
-    }
   }
 }
 
@@ -366,30 +539,114 @@ unsigned int gr_get_height(const GRSurface* surface) {
 }
 
 int gr_init_font(const char* name, GRFont** dest) {
-  GRFont* font = static_cast<GRFont*>(calloc(1, sizeof(*gr_font)));
-  if (font == nullptr) {
-    return -1;
-  }
-
-  int res = res_create_alpha_surface(name, &(font->texture));
+  auto font = std::make_unique<GRFont>();
+  std::string glyphs;
+  int res = res_create_font_surface(name, &font->texture, &glyphs);
   if (res < 0) {
-    free(font);
     return res;
   }
 
-  // The font image should be a 96x2 array of character images.  The
-  // columns are the printable ASCII characters 0x20 - 0x7f.  The
-  // top row is regular text; the bottom row is bold.
-  font->char_width = font->texture->width / 96;
+  // The font image should be a 2-row array of character images. Without a "Glyphs" text chunk, it
+  // has 96 columns, for the printable ASCII characters 0x20 - 0x7f (with 0x7f, DEL, drawn as '?').
+  // The top row is regular text; the bottom row is bold.
+  size_t glyph_count = 96;
+  if (glyphs.empty()) {
+    font->glyph_ranges = { { 0x20, 0x7e } };
+  } else if (ParseGlyphRanges(glyphs, &font->glyph_ranges) && !font->glyph_ranges.empty()) {
+    glyph_count = CountGlyphs(font->glyph_ranges);
+  } else {
+    printf("gr_init_font: invalid glyphs \"%s\" in %s\n", glyphs.c_str(), name);
+    res_free_surface(font->texture);
+    return -1;
+  }
+  font->char_width = font->texture->width / glyph_count;
   font->char_height = font->texture->height / 2;
 
-  *dest = font;
+  *dest = font.release();
 
   return 0;
 }
 
+void gr_set_round_clip(bool enabled) {
+  round_clip = enabled;
+}
+
+bool gr_set_draw_surface(GRSurface* surface) {
+  if (surface == nullptr) {
+    if (saved_frame) {
+      gr_draw = saved_frame->draw;
+      overscan_offset_x = saved_frame->overscan_offset_x;
+      overscan_offset_y = saved_frame->overscan_offset_y;
+      partial_frame = saved_frame->partial_frame;
+      frame_damage = std::move(saved_frame->damage);
+      saved_frame.reset();
+    }
+    return true;
+  }
+
+  const GRSurface* frame = saved_frame ? saved_frame->draw : gr_draw;
+  if (frame == nullptr || rotation != GRRotation::NONE ||
+      surface->pixel_bytes != frame->pixel_bytes) {
+    return false;
+  }
+  if (!saved_frame) {
+    saved_frame = FrameState{ gr_draw, overscan_offset_x, overscan_offset_y, partial_frame,
+                              std::move(frame_damage) };
+  }
+  gr_draw = surface;
+  overscan_offset_x = 0;
+  overscan_offset_y = 0;
+  partial_frame = false;
+  frame_damage.clear();
+  return true;
+}
+
 void gr_flip() {
+  gr_set_draw_surface(nullptr);
+  std::vector<GRRect> damage = gr_damage();
+  gr_backend->SetDamage(damage);
   gr_draw = gr_backend->Flip();
+  flipped_damage[1] = std::move(flipped_damage[0]);
+  flipped_damage[0] = std::move(damage);
+  partial_frame = false;
+  frame_damage.clear();
+}
+
+bool gr_begin_partial_update() {
+  // Copying again would undo what's been drawn since.
+  if (partial_frame) {
+    return true;
+  }
+  const GRSurface* front = gr_backend->GetFrontSurface();
+  if (front == nullptr || gr_draw == nullptr || front->width != gr_draw->width ||
+      front->height != gr_draw->height || front->row_bytes != gr_draw->row_bytes) {
+    return false;
+  }
+  if (front != gr_draw) {
+    for (const auto& damage : flipped_damage) {
+      for (const auto& rect : damage) {
+        size_t offset = rect.y * gr_draw->row_bytes + rect.x * gr_draw->pixel_bytes;
+        for (int row = 0; row < rect.height; ++row) {
+          memcpy(gr_draw->data() + offset, front->data() + offset,
+                 rect.width * gr_draw->pixel_bytes);
+          offset += gr_draw->row_bytes;
+        }
+      }
+    }
+  }
+  partial_frame = true;
+  frame_damage.clear();
+  return true;
+}
+
+std::vector<GRRect> gr_damage() {
+  if (gr_draw == nullptr) {
+    return {};
+  }
+  if (!partial_frame) {
+    return { FullSurfaceRect() };
+  }
+  return frame_damage;
 }
 
 std::unique_ptr<MinuiBackend> create_backend(GraphicsBackend backend) {
@@ -398,15 +655,25 @@ std::unique_ptr<MinuiBackend> create_backend(GraphicsBackend backend) {
       return std::make_unique<MinuiBackendDrm>();
     case GraphicsBackend::FBDEV:
       return std::make_unique<MinuiBackendFbdev>();
+    case GraphicsBackend::MEMORY:
+      return std::make_unique<MinuiBackendMemory>(memory_backend_width, memory_backend_height);
     default:
       return nullptr;
   }
 }
 
 int gr_init() {
+  if (memory_backend_width > 0 && memory_backend_height > 0) {
+    return gr_init({ GraphicsBackend::MEMORY });
+  }
   return gr_init(default_backends);
 }
 
+void gr_use_memory_backend(int width, int height) {
+  memory_backend_width = width;
+  memory_backend_height = height;
+}
+
 int gr_init(std::initializer_list<GraphicsBackend> backends) {
   // pixel_format needs to be set before loading any resources or initializing backends.
   std::string format = android::base::GetProperty("ro.minui.pixel_format", "");
@@ -495,9 +762,11 @@ int gr_init(std::initializer_list<GraphicsBackend> backends) {
 }
 
 void gr_exit() {
+  gr_set_draw_surface(nullptr);
   delete gr_backend;
   gr_backend = nullptr;
 
+  text_runs.Clear();
   delete gr_font;
   gr_font = nullptr;
 }
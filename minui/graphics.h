@@ -17,6 +17,8 @@
 #ifndef _GRAPHICS_H_
 #define _GRAPHICS_H_
 
+#include <vector>
+
 #include "minui/minui.h"
 
 class MinuiBackend {
@@ -34,6 +36,18 @@ class MinuiBackend {
   // be displayed, and returns a new drawing surface.
   virtual GRSurface* Flip() = 0;
 
+  // Sets the regions, in the coordinates of the drawing surface, that the next Flip() needs to make
+  // visible: those that may differ from the frame on the screen. Backends that copy or push the
+  // frame out may limit that to the regions; the others can ignore them.
+  virtual void SetDamage(const std::vector<GRRect>& /* damage */) {}
+
+  // Returns the surface that holds the frame on the screen, to read it back for a partial update.
+  // That may be the drawing surface itself, if Flip() copies it out. Returns nullptr if the frame
+  // can't be read back.
+  virtual const GRSurface* GetFrontSurface() {
+    return nullptr;
+  }
+
   // Blank (or unblank) the default screen.
   virtual void Blank(bool) = 0;
 
@@ -20,11 +20,13 @@
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <memory>
+#include <vector>
 
 #include <android-base/macros.h>
 #include <android-base/stringprintf.h>
@@ -189,12 +191,18 @@ void MinuiBackendDrm::Blank(bool blank, DrmConnector index) {
     return;
   }
 
+  std::unique_lock<std::mutex> lock(flip_mutex_);
+  WaitForFlips(lock, *drmInterface);
   if (blank) {
     DrmDisableCrtc(drm_fd, drmInterface->monitor_crtc);
   } else {
-    DrmEnableCrtc(drm_fd, drmInterface->monitor_crtc,
-                  drmInterface->GRSurfaceDrms[drmInterface->current_buffer],
-                  &drmInterface->monitor_connector->connector_id);
+    // Show the last frame, or any buffer but the one being drawn into if there's none yet.
+    auto& display = drm[index];
+    int buffer = display.last_buffer != -1 ? display.last_buffer
+                                           : (display.current_buffer + 1) % kBuffers;
+    DrmEnableCrtc(drm_fd, display.monitor_crtc, display.GRSurfaceDrms[buffer],
+                  &display.monitor_connector->connector_id);
+    display.displayed_buffer = buffer;
 
     active_display = index;
   }
@@ -387,12 +395,13 @@ GRSurface* MinuiBackendDrm::Init() {
       int width = drm[i].monitor_crtc->mode.hdisplay;
       int height = drm[i].monitor_crtc->mode.vdisplay;
 
-      drm[i].GRSurfaceDrms[0] = GRSurfaceDrm::Create(drm_fd, width, height);
-      drm[i].GRSurfaceDrms[1] = GRSurfaceDrm::Create(drm_fd, width, height);
-      if (!drm[i].GRSurfaceDrms[0] || !drm[i].GRSurfaceDrms[1]) {
-        fprintf(stderr, "Failed to create GRSurfaceDrm, drm index=%d\n", i);
-        drmModeFreeResources(res);
-        return nullptr;
+      for (auto& surface : drm[i].GRSurfaceDrms) {
+        surface = GRSurfaceDrm::Create(drm_fd, width, height);
+        if (!surface) {
+          fprintf(stderr, "Failed to create GRSurfaceDrm, drm index=%d\n", i);
+          drmModeFreeResources(res);
+          return nullptr;
+        }
       }
 
       drm[i].current_buffer = 0;
@@ -408,6 +417,16 @@ GRSurface* MinuiBackendDrm::Init() {
                      &drm[DRM_MAIN].monitor_connector->connector_id)) {
     return nullptr;
   }
+  drm[DRM_MAIN].displayed_buffer = 1;
+  drm[DRM_MAIN].last_buffer = 1;
+
+  stop_event_fd_.reset(eventfd(0, EFD_CLOEXEC));
+  if (stop_event_fd_ == -1) {
+    perror("Failed to create the eventfd");
+    return nullptr;
+  }
+  event_loop_running_ = true;
+  event_thread_ = std::thread(&MinuiBackendDrm::EventLoop, this);
 
   return drm[DRM_MAIN].GRSurfaceDrms[0].get();
 }
@@ -417,54 +436,171 @@ static void page_flip_complete(__unused int fd,
                                __unused unsigned int tv_sec,
                                __unused unsigned int tv_usec,
                                void *user_data) {
-  *static_cast<bool*>(user_data) = false;
+  *static_cast<bool*>(user_data) = true;
 }
 
-GRSurface* MinuiBackendDrm::Flip() {
-  GRSurface* surface = NULL;
-  DrmInterface* current_drm = &drm[active_display];
-  bool ongoing_flip = true;
-
-  if (!current_drm->monitor_connector) {
-    fprintf(stderr, "Unsupported. active_display = %d\n", active_display);
-    return nullptr;
+int MinuiBackendDrm::FreeBuffer(const DrmInterface& drm_interface) {
+  for (int i = 0; i < kBuffers; i++) {
+    if (i != drm_interface.displayed_buffer && i != drm_interface.pending_buffer &&
+        i != drm_interface.queued_buffer) {
+      return i;
+    }
   }
+  return -1;
+}
 
-  if (drmModePageFlip(drm_fd, current_drm->monitor_crtc->crtc_id,
-                      current_drm->GRSurfaceDrms[current_drm->current_buffer]->fb_id,
-                      DRM_MODE_PAGE_FLIP_EVENT, &ongoing_flip) != 0) {
+bool MinuiBackendDrm::SubmitFlip(DrmInterface* drm_interface, int buffer) {
+  drm_interface->flip_completed = false;
+  if (drmModePageFlip(drm_fd, drm_interface->monitor_crtc->crtc_id,
+                      drm_interface->GRSurfaceDrms[buffer]->fb_id, DRM_MODE_PAGE_FLIP_EVENT,
+                      &drm_interface->flip_completed) != 0) {
     fprintf(stderr, "Failed to drmModePageFlip, active_display=%d", active_display);
-    return nullptr;
+    return false;
   }
+  drm_interface->pending_buffer = buffer;
+  return true;
+}
 
-  while (ongoing_flip) {
-    struct pollfd fds = {
-      .fd = drm_fd,
-      .events = POLLIN
+void MinuiBackendDrm::EventLoop() {
+  while (true) {
+    struct pollfd fds[] = {
+      { .fd = drm_fd, .events = POLLIN },
+      { .fd = stop_event_fd_.get(), .events = POLLIN },
     };
-
-    if (poll(&fds, 1, -1) == -1 || !(fds.revents & POLLIN)) {
+    if (TEMP_FAILURE_RETRY(poll(fds, 2, -1)) == -1) {
       perror("Failed to poll() on drm fd");
       break;
     }
+    if (fds[1].revents & POLLIN) {
+      break;
+    }
+    if (!(fds[0].revents & POLLIN)) {
+      fprintf(stderr, "Failed to poll() on drm fd: revents 0x%x\n", fds[0].revents);
+      break;
+    }
 
+    std::lock_guard<std::mutex> lock(flip_mutex_);
     drmEventContext evctx = {
       .version = DRM_EVENT_CONTEXT_VERSION,
       .page_flip_handler = page_flip_complete
     };
-
     if (drmHandleEvent(drm_fd, &evctx) != 0) {
       perror("Failed to drmHandleEvent");
       break;
     }
+
+    // The buffer flipped to is now on the screen, and the frame waiting for it goes next.
+    for (auto& drm_interface : drm) {
+      if (!drm_interface.flip_completed || drm_interface.pending_buffer == -1) continue;
+      drm_interface.flip_completed = false;
+      drm_interface.displayed_buffer = drm_interface.pending_buffer;
+      drm_interface.pending_buffer = -1;
+      if (int queued = drm_interface.queued_buffer; queued != -1) {
+        drm_interface.queued_buffer = -1;
+        SubmitFlip(&drm_interface, queued);
+      }
+    }
+    flip_cv_.notify_all();
   }
 
-  current_drm->current_buffer = 1 - current_drm->current_buffer;
-  surface = current_drm->GRSurfaceDrms[current_drm->current_buffer].get();
-  return surface;
+  // Without the event loop, Flip() and Blank() can't wait for the flips any longer.
+  std::lock_guard<std::mutex> lock(flip_mutex_);
+  event_loop_running_ = false;
+  flip_cv_.notify_all();
+}
+
+void MinuiBackendDrm::WaitForFlips(std::unique_lock<std::mutex>& lock,
+                                   const DrmInterface& drm_interface) {
+  flip_cv_.wait(lock, [this, &drm_interface]() {
+    return !event_loop_running_ ||
+           (drm_interface.pending_buffer == -1 && drm_interface.queued_buffer == -1);
+  });
+}
+
+GRSurface* MinuiBackendDrm::Flip() {
+  std::unique_lock<std::mutex> lock(flip_mutex_);
+  DrmInterface* current_drm = &drm[active_display];
+
+  if (!current_drm->monitor_connector) {
+    fprintf(stderr, "Unsupported. active_display = %d\n", active_display);
+    return nullptr;
+  }
+  if (!event_loop_running_) {
+    fprintf(stderr, "Failed to flip without the drm event loop\n");
+    return nullptr;
+  }
+
+  // Displays that refresh from their own memory only need to get the regions that changed. Drivers
+  // that don't track damage on the framebuffer reject this, and take the full page flip.
+  int drawn = current_drm->current_buffer;
+  if (!damage_clips_.empty()) {
+    drmModeDirtyFB(drm_fd, current_drm->GRSurfaceDrms[drawn]->fb_id, damage_clips_.data(),
+                   damage_clips_.size());
+    damage_clips_.clear();
+  }
+
+  // The flip is submitted right away if none is in progress. Otherwise the frame waits for the
+  // flip in progress to complete, and the event loop submits it then.
+  if (current_drm->pending_buffer == -1) {
+    if (!SubmitFlip(current_drm, drawn)) {
+      return nullptr;
+    }
+  } else {
+    current_drm->queued_buffer = drawn;
+  }
+  current_drm->last_buffer = drawn;
+
+  // There's a free buffer to draw the next frame into, unless a flip was in progress already. Only
+  // then does this wait, for that flip to complete (i.e. at most a refresh).
+  flip_cv_.wait(lock, [this, current_drm]() {
+    return !event_loop_running_ || FreeBuffer(*current_drm) != -1;
+  });
+  int next = FreeBuffer(*current_drm);
+  if (next == -1) {
+    fprintf(stderr, "Failed to find a free buffer, active_display = %d\n", active_display);
+    return nullptr;
+  }
+  current_drm->current_buffer = next;
+  return current_drm->GRSurfaceDrms[next].get();
+}
+
+void MinuiBackendDrm::SetDamage(const std::vector<GRRect>& damage) {
+  damage_clips_.clear();
+  const auto& surface = drm[active_display].GRSurfaceDrms[drm[active_display].current_buffer];
+  // A damage of the whole frame is what a page flip does anyway.
+  if (!surface || (damage.size() == 1 && damage[0].width == static_cast<int>(surface->width) &&
+                   damage[0].height == static_cast<int>(surface->height))) {
+    return;
+  }
+  for (const auto& rect : damage) {
+    damage_clips_.push_back(drmModeClip{
+        .x1 = static_cast<uint16_t>(rect.x),
+        .y1 = static_cast<uint16_t>(rect.y),
+        .x2 = static_cast<uint16_t>(rect.x + rect.width),
+        .y2 = static_cast<uint16_t>(rect.y + rect.height),
+    });
+  }
+}
+
+const GRSurface* MinuiBackendDrm::GetFrontSurface() {
+  // The frame on the screen, or about to be.
+  std::lock_guard<std::mutex> lock(flip_mutex_);
+  const DrmInterface& current_drm = drm[active_display];
+  if (current_drm.last_buffer == -1) {
+    return nullptr;
+  }
+  return current_drm.GRSurfaceDrms[current_drm.last_buffer].get();
 }
 
 MinuiBackendDrm::~MinuiBackendDrm() {
+  if (event_thread_.joinable()) {
+    uint64_t stop = 1;
+    if (TEMP_FAILURE_RETRY(write(stop_event_fd_.get(), &stop, sizeof(stop))) == -1) {
+      perror("Failed to stop the drm event loop");
+    }
+    event_thread_.join();
+  }
+
   for (int i = 0; i < DRM_MAX; i++) {
     if (drm[i].monitor_connector) {
       DrmDisableCrtc(drm_fd, drm[i].monitor_crtc);
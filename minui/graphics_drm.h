@@ -19,8 +19,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
+#include <android-base/unique_fd.h>
 #include <xf86drmMode.h>
 
 #include "graphics.h"
@@ -58,6 +63,8 @@ class MinuiBackendDrm : public MinuiBackend {
 
   GRSurface* Init() override;
   GRSurface* Flip() override;
+  void SetDamage(const std::vector<GRRect>& damage) override;
+  const GRSurface* GetFrontSurface() override;
   void Blank(bool) override;
   void Blank(bool blank, DrmConnector index) override;
   bool HasMultipleConnectors() override;
@@ -69,14 +76,48 @@ class MinuiBackendDrm : public MinuiBackend {
   void DisableNonMainCrtcs(int fd, drmModeRes* resources, drmModeCrtc* main_crtc);
   bool FindAndSetMonitor(int fd, drmModeRes* resources);
 
+  // Each display gets a buffer on the screen, one for a page flip in progress, and one to draw the
+  // next frame into while the flip completes.
+  static constexpr int kBuffers = 3;
+
   struct DrmInterface {
-    std::unique_ptr<GRSurfaceDrm> GRSurfaceDrms[2];
+    std::unique_ptr<GRSurfaceDrm> GRSurfaceDrms[kBuffers];
+    // The buffer to draw into, the one on the screen, the one a flip is in progress to, the one
+    // waiting for that flip to complete (to be flipped to next), and the one with the last frame
+    // passed to Flip(). -1 for none.
     int current_buffer{ 0 };
+    int displayed_buffer{ -1 };
+    int pending_buffer{ -1 };
+    int queued_buffer{ -1 };
+    int last_buffer{ -1 };
+    // Set by the page flip event handler.
+    bool flip_completed{ false };
     drmModeCrtc* monitor_crtc{ nullptr };
     drmModeConnector* monitor_connector{ nullptr };
     uint32_t selected_mode{ 0 };
   } drm[DRM_MAX];
 
+  // Returns a buffer of |drm_interface| that's free to draw into, or -1 if there's none.
+  static int FreeBuffer(const DrmInterface& drm_interface);
+  // Starts a page flip of |drm_interface| to |buffer|. Should only be called with flip_mutex_ held.
+  bool SubmitFlip(DrmInterface* drm_interface, int buffer);
+  // Waits for the page flip events, and moves the buffers along as flips complete.
+  void EventLoop();
+  // Waits until |drm_interface| has no flip in progress. Should only be called with flip_mutex_
+  // held, through |lock|.
+  void WaitForFlips(std::unique_lock<std::mutex>& lock, const DrmInterface& drm_interface);
+
   int drm_fd{ -1 };
   DrmConnector active_display = DRM_MAIN;
+  // The regions of the frame that the next Flip() shows that changed, as DRM clips.
+  std::vector<drmModeClip> damage_clips_;
+
+  // Guards the buffer indices of the displays, which the event loop moves along as page flips
+  // complete, and signals each move.
+  std::mutex flip_mutex_;
+  std::condition_variable flip_cv_;
+  std::thread event_thread_;
+  bool event_loop_running_{ false };
+  // Written to stop the event loop.
+  android::base::unique_fd stop_event_fd_;
 };
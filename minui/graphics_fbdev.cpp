@@ -168,9 +168,29 @@ GRSurface* MinuiBackendFbdev::Flip() {
     // displaying the other buffer instead.
     gr_draw = gr_framebuffer[displayed_buffer].get();
     SetDisplayedFramebuffer(1 - displayed_buffer);
-  } else {
+  } else if (damage_.empty()) {
     // Copy from the in-memory surface to the framebuffer.
     memcpy(gr_framebuffer[0]->buffer_, gr_draw->buffer_, gr_draw->height * gr_draw->row_bytes);
+  } else {
+    // Or just the regions that changed.
+    for (const auto& rect : damage_) {
+      size_t offset = rect.y * gr_draw->row_bytes + rect.x * gr_draw->pixel_bytes;
+      for (int row = 0; row < rect.height; ++row) {
+        memcpy(gr_framebuffer[0]->buffer_ + offset, gr_draw->buffer_ + offset,
+               rect.width * gr_draw->pixel_bytes);
+        offset += gr_draw->row_bytes;
+      }
+    }
   }
+  damage_.clear();
   return gr_draw;
 }
+
+void MinuiBackendFbdev::SetDamage(const std::vector<GRRect>& damage) {
+  damage_ = damage;
+}
+
+const GRSurface* MinuiBackendFbdev::GetFrontSurface() {
+  // Without double buffering, the in-memory surface keeps the frame that was copied out.
+  return double_buffered ? gr_framebuffer[displayed_buffer].get() : gr_draw;
+}
@@ -55,6 +55,8 @@ class MinuiBackendFbdev : public MinuiBackend {
 
   GRSurface* Init() override;
   GRSurface* Flip() override;
+  void SetDamage(const std::vector<GRRect>& damage) override;
+  const GRSurface* GetFrontSurface() override;
   void Blank(bool) override;
   void Blank(bool blank, DrmConnector index) override;
   bool HasMultipleConnectors() override;
@@ -67,6 +69,9 @@ class MinuiBackendFbdev : public MinuiBackend {
   GRSurfaceFbdev* gr_draw{ nullptr };
   bool double_buffered;
   std::vector<uint8_t> memory_buffer;
+  // The regions to copy to the framebuffer on the next Flip(), if not double buffered. Empty for
+  // the whole frame.
+  std::vector<GRRect> damage_;
   size_t displayed_buffer{ 0 };
   fb_var_screeninfo vi;
   android::base::unique_fd fb_fd;
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "graphics_memory.h"
+
+#include <stdio.h>
+#include <string.h>
+
+GRSurface* MinuiBackendMemory::Init() {
+  if (width_ <= 0 || height_ <= 0) {
+    fprintf(stderr, "Invalid size for the memory backend: %dx%d\n", width_, height_);
+    return nullptr;
+  }
+  constexpr size_t kPixelBytes = 4;
+  for (auto& surface : surfaces_) {
+    surface = GRSurface::Create(width_, height_, width_ * kPixelBytes, kPixelBytes);
+    if (!surface) {
+      fprintf(stderr, "Failed to allocate a %dx%d surface\n", width_, height_);
+      return nullptr;
+    }
+    memset(surface->data(), 0, surface->data_size());
+  }
+  front_ = 0;
+  return surfaces_[1].get();
+}
+
+GRSurface* MinuiBackendMemory::Flip() {
+  front_ = 1 - front_;
+  return surfaces_[1 - front_].get();
+}
+
+const GRSurface* MinuiBackendMemory::GetFrontSurface() {
+  return surfaces_[front_].get();
+}
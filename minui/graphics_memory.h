@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <memory>
+
+#include "graphics.h"
+#include "minui/minui.h"
+
+// A backend that draws into two in-memory surfaces and shows nothing, for benchmarks and tests that
+// run without a display. Flip() swaps the surfaces, as a double-buffered display would.
+class MinuiBackendMemory : public MinuiBackend {
+ public:
+  MinuiBackendMemory(int width, int height) : width_(width), height_(height) {}
+  ~MinuiBackendMemory() override = default;
+
+  GRSurface* Init() override;
+  GRSurface* Flip() override;
+  const GRSurface* GetFrontSurface() override;
+  void Blank(bool) override {}
+  void Blank(bool, DrmConnector) override {}
+  bool HasMultipleConnectors() override {
+    return false;
+  }
+
+ private:
+  int width_;
+  int height_;
+  std::unique_ptr<GRSurface> surfaces_[2];
+  // The index of the surface on the "screen"; the other one is drawn into.
+  size_t front_{ 0 };
+};
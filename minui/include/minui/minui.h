@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <string>
@@ -32,6 +33,13 @@
 // Graphics.
 //
 
+enum class GRRotation : int {
+  NONE = 0,
+  RIGHT = 1,
+  DOWN = 2,
+  LEFT = 3,
+};
+
 class GRSurface {
  public:
   static constexpr size_t kSurfaceDataAlignment = 8;
@@ -65,10 +73,19 @@ class GRSurface {
   size_t row_bytes;
   size_t pixel_bytes;
 
+  // A copy of the image rotated by |rotated_for|, laid out like the drawing surface of a screen
+  // with that rotation, so that drawing it copies whole rows. The res_create_*_surface() functions
+  // keep one for the rotation at load time.
+  std::unique_ptr<GRSurface> rotated;
+  GRRotation rotated_for{ GRRotation::NONE };
+
  protected:
   GRSurface(size_t width, size_t height, size_t row_bytes, size_t pixel_bytes)
       : width(width), height(height), row_bytes(row_bytes), pixel_bytes(pixel_bytes) {}
 
+  // Set by the subclasses that override data().
+  size_t data_size_{ 0 };
+
  private:
   // The deleter for data_, whose data is allocated via aligned_alloc(3).
   struct DataDeleter {
@@ -78,22 +95,30 @@ class GRSurface {
   };
 
   std::unique_ptr<uint8_t, DataDeleter> data_;
-  size_t data_size_;
 
   DISALLOW_COPY_AND_ASSIGN(GRSurface);
 };
 
 struct GRFont {
+  // The code points from |first| to |last|.
+  struct GlyphRange {
+    uint32_t first;
+    uint32_t last;
+  };
+
   GRSurface* texture;
   int char_width;
   int char_height;
+  // The code points of the glyphs in |texture|, in order.
+  std::vector<GlyphRange> glyph_ranges;
 };
 
-enum class GRRotation : int {
-  NONE = 0,
-  RIGHT = 1,
-  DOWN = 2,
-  LEFT = 3,
+// A rectangle of pixels, from (x, y) to (x + width, y + height).
+struct GRRect {
+  int x;
+  int y;
+  int width;
+  int height;
 };
 
 enum class PixelFormat : int {
@@ -109,6 +134,8 @@ enum class GraphicsBackend : int {
   UNKNOWN = 0,
   DRM = 1,
   FBDEV = 2,
+  // Draws into memory and shows nothing. See gr_use_memory_backend().
+  MEMORY = 3,
 };
 
 // Initializes the default graphics backend and loads font file. Returns 0 on success, or -1 on
@@ -119,6 +146,10 @@ int gr_init();
 // Supports backend selection for minui client.
 int gr_init(std::initializer_list<GraphicsBackend> backends);
 
+// Makes gr_init() use GraphicsBackend::MEMORY, with a |width| x |height| screen, in place of the
+// default backends. For benchmarks and tests of the drawing code, which don't need a display.
+void gr_use_memory_backend(int width, int height);
+
 // Frees the allocated resources. The function is idempotent, and safe to be called if gr_init()
 // didn't finish successfully.
 void gr_exit();
@@ -132,10 +163,32 @@ int gr_overscan_offset_y();
 GRRotation gr_touch_rotation();
 
 void gr_flip();
+
+// Starts a frame that only redraws part of the screen, keeping the rest of the frame on the screen.
+// With double or triple buffering the drawing surface holds an earlier frame, so the regions drawn
+// in the last two frames are copied over from the screen first. Returns false if the backend can't
+// read back the frame on the screen, in which case the caller needs to redraw the whole frame.
+// Calling it again in the same frame does nothing.
+//
+// The drawing functions record the regions they touch in a partial frame, and gr_flip() lets the
+// backend push only those to the display. A gr_clear() makes the whole frame drawn again. Frames
+// that aren't started with this are drawn whole.
+bool gr_begin_partial_update();
+
+// Returns the regions drawn in the current frame, in the coordinates of the drawing surface (i.e.
+// after the rotation). A frame that isn't partial is one region that covers the whole surface.
+std::vector<GRRect> gr_damage();
+
 void gr_fb_blank(bool blank);
 void gr_fb_blank(bool blank, int index);
 bool gr_has_multiple_connectors();
 
+// Makes gr_fill(), gr_blit(), gr_text() and gr_texticon() skip the pixels outside the circle
+// inscribed in the screen, for round displays that show nothing else. gr_clear() still clears the
+// whole surface. The pixels drawn one at a time (for images that aren't prerotated to match the
+// screen) aren't clipped.
+void gr_set_round_clip(bool enabled);
+
 // Clears entire surface to current color.
 void gr_clear();
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
@@ -145,18 +198,33 @@ void gr_texticon(int x, int y, const GRSurface* icon);
 
 const GRFont* gr_sys_font();
 const GRFont* gr_menu_font();
+// Loads the font image |name|: a row of glyphs of the same width, with the bold ones in a second
+// row (optional). The glyphs are those of the printable ASCII characters, 0x20 - 0x7f, unless a
+// "Glyphs" text chunk lists their code points, as comma-separated code points or ranges of them
+// (e.g. "32-126,160-255,8364").
 int gr_init_font(const char* name, GRFont** dest);
+// Draws the UTF-8 string |s|, as much of it as fits on the screen. Code points without a glyph in
+// the font are drawn as '?'. Lines drawn recently are kept composited, to draw them again faster.
 void gr_text(const GRFont* font, int x, int y, const char* s, bool bold);
-// Returns -1 if font is nullptr.
+// Returns the width of the UTF-8 string |s| in |font|. Returns -1 if font is nullptr.
 int gr_measure(const GRFont* font, const char* s);
 // Returns -1 if font is nullptr.
 int gr_font_size(const GRFont* font, int* x, int* y);
 
 void gr_blit(const GRSurface* source, int sx, int sy, int w, int h, int dx, int dy);
+
+// Makes the drawing functions draw into |surface| in place of the frame, until it's called again
+// with nullptr (or until gr_flip()), e.g. to draw once what gr_blit() then copies to several places
+// of the frame. The surface is drawn without the overscan offsets, which apply to the blits, and
+// doesn't count as damage; gr_fb_width() and gr_fb_height() give its size meanwhile. Returns false,
+// leaving the drawing functions as they were, if the screen is rotated or |surface| doesn't have
+// the pixel size of the frame.
+bool gr_set_draw_surface(GRSurface* surface);
 unsigned int gr_get_width(const GRSurface* surface);
 unsigned int gr_get_height(const GRSurface* surface);
 
-// Sets rotation, flips gr_fb_width/height if 90 degree rotation difference
+// Sets rotation, flips gr_fb_width/height if 90 degree rotation difference. Surfaces loaded before
+// (other than the fonts) are drawn rotated pixel by pixel.
 void gr_rotate(GRRotation rotation);
 
 // Sets touch rotation
@@ -177,6 +245,7 @@ struct input_event;
 using ev_callback = std::function<int(int fd, uint32_t epevents)>;
 using ev_set_key_callback = std::function<int(int code, int value)>;
 using ev_set_sw_callback = std::function<int(int code, int value)>;
+using ev_timer_callback = std::function<void()>;
 
 int ev_init(ev_callback input_cb, bool allow_touch_inputs = false);
 void ev_exit();
@@ -191,9 +260,23 @@ int ev_sync_sw_state(const ev_set_sw_callback& set_sw_cb);
 //    0 : don't block
 //  < 0 : block forever
 //  > 0 : block for 'timeout' milliseconds
+// Also returns once a timer is due, or ev_wake() is called.
 int ev_wait(int timeout);
 
+// Wakes up the ev_wait() in progress, or makes the next one return at once. Can be called from
+// any thread.
+void ev_wake();
+
+// Runs |cb| from ev_dispatch(), on the thread that waits for events, once |delay| has passed.
+// Returns the id of the timer, for ev_cancel_timer(). Can be called from any thread.
+int ev_add_timer(std::chrono::milliseconds delay, ev_timer_callback cb);
+// Cancels the timer |id|, unless it's already run (or is running).
+void ev_cancel_timer(int id);
+
 int ev_get_input(int fd, uint32_t epevents, input_event* ev);
+// Reads up to |count| of the pending events of |fd| into |events| with a single read. Returns the
+// number of events read, or -1.
+int ev_get_inputs(int fd, uint32_t epevents, input_event* events, size_t count);
 void ev_dispatch();
 int ev_get_epollfd();
 
@@ -212,6 +295,13 @@ bool matches_locale(const std::string& prefix, const std::string& locale);
 // color (with gr_text() or gr_texticon()).
 //
 // All these functions load PNG images from "/res/images/${name}.png".
+// On a rotated screen (see gr_rotate()), they also keep a copy of each
+// image rotated to match, in GRSurface::rotated.
+//
+// If "/res/images/resources.bundle" holds an image already converted
+// (see minui/tools/resource_bundler.cpp), res_create_display_surface()
+// and res_create_localized_alpha_surface() return a surface that points
+// into the mapped bundle instead of decoding the PNG.
 
 // Load a single display surface from a PNG image.
 int res_create_display_surface(const char* name, GRSurface** pSurface);
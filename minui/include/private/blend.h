@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// The pixel blending kernels of minui. They work on 32-bit pixels of any of the supported formats:
+// |alpha_mask| selects the alpha byte of the format, which blended pixels take from |color|, while
+// the other three bytes are blended as (pixel * (255 - alpha) + color * alpha) / 255.
+//
+// BlendFill() and BlendMask() work on a row of contiguous pixels, with NEON or SSE2 where
+// available.
+// BlendPixel() is the scalar version, for a single pixel (e.g. when drawing rotated).
+
+// Returns |pix| with |color| blended onto it at |alpha|. A zero |alpha| leaves |pix| unchanged.
+uint32_t BlendPixel(uint32_t pix, uint32_t color, uint32_t alpha_mask, uint8_t alpha);
+
+// Blends |color| at |alpha| onto the |count| pixels at |dst|.
+void BlendFill(uint32_t* dst, int count, uint32_t color, uint32_t alpha_mask, uint8_t alpha);
+
+// Blends |color| onto the |count| pixels at |dst|, each at the alpha of its byte in |coverage|
+// (e.g. a glyph of a font texture) scaled by |alpha|. Pixels with no coverage are left unchanged.
+void BlendMask(uint32_t* dst, const uint8_t* coverage, int count, uint32_t color,
+               uint32_t alpha_mask, uint8_t alpha);
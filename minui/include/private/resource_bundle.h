@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "minui/minui.h"
+
+// A resource bundle holds images already converted the way res_create_display_surface() and
+// res_create_localized_alpha_surface() would convert them, so that they can be drawn straight from
+// a read-only mapping of the file, with no decoding and no copies. It's generated on the host by
+// minui_resource_bundler, from the PNG images of a resource dir.
+//
+// The file, in the byte order of the device, holds:
+//   ResourceBundleHeader
+//   ResourceBundleEntry[header.entry_count]
+//   the pixels of each entry (height rows of row_bytes), at |offset| bytes from the start of the
+//   file, aligned to kResourceBundleAlignment.
+
+static constexpr char kResourceBundleMagic[8] = { 'M', 'I', 'N', 'U', 'I', 'R', 'E', 'S' };
+static constexpr uint32_t kResourceBundleVersion = 1;
+static constexpr size_t kResourceBundleAlignment = 64;
+// The name the bundle has in the resource dir.
+static constexpr const char* kResourceBundleName = "resources.bundle";
+
+enum class ResourceBundleType : uint32_t {
+  // A display surface, in the pixel format of the bundle.
+  DISPLAY = 1,
+  // The image for one locale of a localized alpha surface.
+  LOCALIZED_ALPHA = 2,
+};
+
+struct ResourceBundleHeader {
+  char magic[8];
+  uint32_t version;
+  // The PixelFormat of the display surfaces. The bundle holds no display surface for any other
+  // pixel format.
+  uint32_t pixel_format;
+  uint32_t entry_count;
+  uint32_t reserved;
+};
+
+struct ResourceBundleEntry {
+  // The name of the image, as passed to res_create_*_surface() (i.e. without the ".png").
+  char name[64];
+  // The locale of a LOCALIZED_ALPHA image, as in its PNG. The images of each name are in the order
+  // of the PNG, so that looking up a locale finds the same image as the PNG would.
+  char locale[32];
+  uint32_t type;
+  uint32_t width;
+  uint32_t height;
+  uint32_t row_bytes;
+  uint32_t pixel_bytes;
+  uint32_t reserved;
+  uint64_t offset;
+};
+
+static_assert(sizeof(ResourceBundleHeader) == 24, "Unexpected ResourceBundleHeader size");
+static_assert(sizeof(ResourceBundleEntry) == 128, "Unexpected ResourceBundleEntry size");
+
+class ResourceBundle : public std::enable_shared_from_this<ResourceBundle> {
+ public:
+  // Maps the bundle at |path|. Returns nullptr if there's none, or it isn't valid.
+  static std::shared_ptr<ResourceBundle> Open(const std::string& path);
+
+  ~ResourceBundle();
+
+  PixelFormat pixel_format() const {
+    return static_cast<PixelFormat>(header_->pixel_format);
+  }
+
+  // Returns the display surface |name|, or nullptr if the bundle doesn't hold one (or holds none
+  // for |pixel_format|). The surface points into the mapping, and keeps the bundle mapped.
+  std::unique_ptr<GRSurface> FindDisplaySurface(const std::string& name, PixelFormat pixel_format);
+
+  // Returns the image of the localized alpha surface |name| for |locale|, matched like
+  // res_create_localized_alpha_surface() does, or nullptr if the bundle doesn't hold one.
+  std::unique_ptr<GRSurface> FindLocalizedSurface(const std::string& name,
+                                                  const std::string& locale);
+
+ private:
+  ResourceBundle(uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  // Checks the header and entries; every entry must lie within the file.
+  bool Validate();
+
+  std::unique_ptr<GRSurface> CreateSurface(const ResourceBundleEntry& entry);
+
+  uint8_t* data_;
+  size_t size_;
+  const ResourceBundleHeader* header_{ nullptr };
+  const ResourceBundleEntry* entries_{ nullptr };
+};
+
+// An image to write into a bundle.
+struct ResourceBundleImage {
+  std::string name;
+  // Only for ResourceBundleType::LOCALIZED_ALPHA.
+  std::string locale;
+  ResourceBundleType type;
+  const GRSurface* surface;
+};
+
+// Writes |images| into a bundle at |path|, with display surfaces in |pixel_format|. Returns false
+// on error, e.g. a name or locale that doesn't fit.
+bool WriteResourceBundle(const std::string& path, PixelFormat pixel_format,
+                         const std::vector<ResourceBundleImage>& images);
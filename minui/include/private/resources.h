@@ -20,9 +20,13 @@
 
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <png.h>
 
+#include "minui/minui.h"
+
 // This class handles the PNG file parsing. It also holds the ownership of the PNG pointer and the
 // opened file pointer. Both will be destroyed / closed when this object goes out of scope.
 class PngHandler {
@@ -85,3 +89,16 @@ class PngHandler {
 
 // Overrides the default resource dir, for testing purpose.
 void res_set_resource_dir(const std::string&);
+
+// Loads a font image like res_create_alpha_surface(), along with the value of its "Glyphs" text
+// chunk in |glyphs| (empty if it has none).
+int res_create_font_surface(const char* name, GRSurface** pSurface, std::string* glyphs);
+
+// Keeps a copy of |surface| rotated by |rotation| in surface->rotated, replacing any earlier one
+// (or drops it for GRRotation::NONE). Without enough memory, the surface is left without a copy.
+void PrerotateSurface(GRSurface* surface, GRRotation rotation);
+
+// Loads the image of every locale of the localized image |name|, in the order of the PNG (as
+// res_create_localized_alpha_surface() matches them), into |surfaces|. Not pre-rotated.
+int res_create_all_localized_alpha_surfaces(
+    const char* name, std::vector<std::pair<std::string, std::unique_ptr<GRSurface>>>* surfaces);
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+#include "minui/minui.h"
+
+// Text in minui is UTF-8. A font texture holds a row of glyphs of the same size, for the code
+// points in GRFont::glyph_ranges, with the bold ones in a second row. Code points without a glyph
+// are drawn as '?'.
+
+// Decodes the code point at the start of |text| into |*code_point|, and moves |text| past it.
+// Invalid sequences decode as U+FFFD, a byte at a time. Returns false at the end of |text|.
+bool NextCodePoint(std::string_view* text, uint32_t* code_point);
+
+// Returns the number of code points in |text|.
+size_t CountCodePoints(std::string_view text);
+
+// Parses |str| as comma-separated glyph ranges, each a code point or two joined by '-' (e.g.
+// "32-126,160-255,8364"), as in the "Glyphs" text chunk of a font image.
+bool ParseGlyphRanges(const std::string& str, std::vector<GRFont::GlyphRange>* ranges);
+
+// Returns the number of glyphs for |ranges|.
+size_t CountGlyphs(const std::vector<GRFont::GlyphRange>& ranges);
+
+// Returns the index in the texture of |font| of the glyph for |code_point|, or of the one for '?'
+// if it has none. Returns -1 if the font has neither.
+int GlyphIndex(const GRFont& font, uint32_t code_point);
+
+// Keeps the text runs drawn recently, each composited from the glyphs of its font into an alpha
+// surface, so that drawing one again blends whole rows at once instead of a glyph at a time. Holds
+// up to |max_runs| of them, dropping the least recently used.
+class TextRunCache {
+ public:
+  explicit TextRunCache(size_t max_runs) : max_runs_(max_runs) {}
+
+  // Returns the alpha surface of |text| in |font|, composited from up to its first |max_glyphs|
+  // glyphs and pre-rotated for |rotation|. Returns nullptr for an empty run, or on error. The
+  // surface stays valid until the next call, or Clear().
+  const GRSurface* Get(const GRFont* font, bool bold, std::string_view text, size_t max_glyphs,
+                       GRRotation rotation);
+
+  // Drops all the runs, e.g. as the fonts they're composited from go away.
+  void Clear();
+
+  size_t size() const {
+    return runs_.size();
+  }
+
+ private:
+  using Key = std::tuple<const GRFont*, bool, std::string>;
+
+  struct TextRun {
+    Key key;
+    size_t max_glyphs;
+    std::unique_ptr<GRSurface> surface;
+  };
+
+  size_t max_runs_;
+  // The runs, most recently used first.
+  std::list<TextRun> runs_;
+  std::map<Key, std::list<TextRun>::iterator, std::less<>> index_;
+};
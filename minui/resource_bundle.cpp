@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/resource_bundle.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+
+#include "private/resources.h"
+
+// A surface whose pixels are in the mapping of a resource bundle.
+class MappedSurface : public GRSurface {
+ public:
+  MappedSurface(const ResourceBundleEntry& entry, uint8_t* data,
+                std::shared_ptr<ResourceBundle> bundle)
+      : GRSurface(entry.width, entry.height, entry.row_bytes, entry.pixel_bytes),
+        data_(data),
+        bundle_(std::move(bundle)) {
+    data_size_ = row_bytes * height;
+  }
+
+  uint8_t* data() override {
+    return data_;
+  }
+
+ private:
+  uint8_t* data_;
+  std::shared_ptr<ResourceBundle> bundle_;
+};
+
+std::shared_ptr<ResourceBundle> ResourceBundle::Open(const std::string& path) {
+  android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1) {
+    return nullptr;
+  }
+  struct stat sb;
+  if (fstat(fd, &sb) != 0 || static_cast<size_t>(sb.st_size) < sizeof(ResourceBundleHeader)) {
+    fprintf(stderr, "Invalid resource bundle %s\n", path.c_str());
+    return nullptr;
+  }
+  // Privately writable, though nothing should write to the images: a stray write changes only the
+  // pages it touches.
+  void* data = mmap(nullptr, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s: %s\n", path.c_str(), strerror(errno));
+    return nullptr;
+  }
+
+  // Cannot use std::make_shared to access non-public ctor.
+  std::shared_ptr<ResourceBundle> bundle(
+      new ResourceBundle(static_cast<uint8_t*>(data), sb.st_size));
+  if (!bundle->Validate()) {
+    fprintf(stderr, "Invalid resource bundle %s\n", path.c_str());
+    return nullptr;
+  }
+  return bundle;
+}
+
+ResourceBundle::~ResourceBundle() {
+  munmap(data_, size_);
+}
+
+bool ResourceBundle::Validate() {
+  auto header = reinterpret_cast<const ResourceBundleHeader*>(data_);
+  if (memcmp(header->magic, kResourceBundleMagic, sizeof(kResourceBundleMagic)) != 0 ||
+      header->version != kResourceBundleVersion) {
+    return false;
+  }
+  size_t entries_size = static_cast<size_t>(header->entry_count) * sizeof(ResourceBundleEntry);
+  if (entries_size > size_ - sizeof(ResourceBundleHeader)) {
+    return false;
+  }
+  auto entries = reinterpret_cast<const ResourceBundleEntry*>(data_ + sizeof(*header));
+  for (size_t i = 0; i < header->entry_count; i++) {
+    const auto& entry = entries[i];
+    uint64_t pixels_size = static_cast<uint64_t>(entry.row_bytes) * entry.height;
+    if (entry.name[sizeof(entry.name) - 1] != '\0' ||
+        entry.locale[sizeof(entry.locale) - 1] != '\0' || entry.width == 0 || entry.height == 0 ||
+        entry.pixel_bytes == 0 ||
+        static_cast<uint64_t>(entry.width) * entry.pixel_bytes > entry.row_bytes ||
+        entry.offset % kResourceBundleAlignment != 0 || entry.offset > size_ ||
+        pixels_size > size_ - entry.offset) {
+      return false;
+    }
+  }
+
+  header_ = header;
+  entries_ = entries;
+  return true;
+}
+
+std::unique_ptr<GRSurface> ResourceBundle::CreateSurface(const ResourceBundleEntry& entry) {
+  return std::make_unique<MappedSurface>(entry, data_ + entry.offset, shared_from_this());
+}
+
+std::unique_ptr<GRSurface> ResourceBundle::FindDisplaySurface(const std::string& name,
+                                                              PixelFormat pixel_format) {
+  if (pixel_format != this->pixel_format()) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < header_->entry_count; i++) {
+    const auto& entry = entries_[i];
+    if (entry.type == static_cast<uint32_t>(ResourceBundleType::DISPLAY) && name == entry.name) {
+      return CreateSurface(entry);
+    }
+  }
+  return nullptr;
+}
+
+std::unique_ptr<GRSurface> ResourceBundle::FindLocalizedSurface(const std::string& name,
+                                                                const std::string& locale) {
+  for (size_t i = 0; i < header_->entry_count; i++) {
+    const auto& entry = entries_[i];
+    if (entry.type == static_cast<uint32_t>(ResourceBundleType::LOCALIZED_ALPHA) &&
+        name == entry.name && matches_locale(entry.locale, locale)) {
+      return CreateSurface(entry);
+    }
+  }
+  return nullptr;
+}
+
+bool WriteResourceBundle(const std::string& path, PixelFormat pixel_format,
+                         const std::vector<ResourceBundleImage>& images) {
+  ResourceBundleHeader header = {};
+  memcpy(header.magic, kResourceBundleMagic, sizeof(header.magic));
+  header.version = kResourceBundleVersion;
+  header.pixel_format = static_cast<uint32_t>(pixel_format);
+  header.entry_count = images.size();
+
+  auto align = [](uint64_t offset) {
+    return (offset + kResourceBundleAlignment - 1) / kResourceBundleAlignment *
+           kResourceBundleAlignment;
+  };
+  std::vector<ResourceBundleEntry> entries(images.size());
+  uint64_t offset = align(sizeof(header) + entries.size() * sizeof(ResourceBundleEntry));
+  for (size_t i = 0; i < images.size(); i++) {
+    const auto& image = images[i];
+    auto& entry = entries[i];
+    if (image.name.size() >= sizeof(entry.name) || image.locale.size() >= sizeof(entry.locale)) {
+      fprintf(stderr, "Name or locale too long for the resource bundle: %s %s\n",
+              image.name.c_str(), image.locale.c_str());
+      return false;
+    }
+    memcpy(entry.name, image.name.c_str(), image.name.size());
+    memcpy(entry.locale, image.locale.c_str(), image.locale.size());
+    entry.type = static_cast<uint32_t>(image.type);
+    entry.width = image.surface->width;
+    entry.height = image.surface->height;
+    entry.row_bytes = image.surface->row_bytes;
+    entry.pixel_bytes = image.surface->pixel_bytes;
+    entry.offset = offset;
+    offset = align(offset + static_cast<uint64_t>(entry.row_bytes) * entry.height);
+  }
+
+  std::string content(offset, '\0');
+  memcpy(content.data(), &header, sizeof(header));
+  memcpy(content.data() + sizeof(header), entries.data(),
+         entries.size() * sizeof(ResourceBundleEntry));
+  for (size_t i = 0; i < images.size(); i++) {
+    memcpy(content.data() + entries[i].offset, images[i].surface->data(),
+           entries[i].row_bytes * entries[i].height);
+  }
+  if (!android::base::WriteStringToFile(content, path)) {
+    fprintf(stderr, "Failed to write %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
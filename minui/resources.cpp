@@ -29,6 +29,7 @@
 
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <regex>
 #include <string>
 #include <vector>
@@ -37,9 +38,27 @@
 #include <png.h>
 
 #include "minui/minui.h"
+#include "private/resource_bundle.h"
 
 static std::string g_resource_dir{ "/res/images" };
 
+// Returns the resource bundle of the resource dir, mapping it on first use, or nullptr if there's
+// none. Surfaces may be loaded from several threads.
+static std::shared_ptr<ResourceBundle> GetResourceBundle() {
+  static std::mutex mutex;
+  static std::shared_ptr<ResourceBundle> bundle;
+  static std::string bundle_dir;
+  static bool opened = false;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!opened || bundle_dir != g_resource_dir) {
+    bundle_dir = g_resource_dir;
+    bundle = ResourceBundle::Open(bundle_dir + "/" + kResourceBundleName);
+    opened = true;
+  }
+  return bundle;
+}
+
 std::unique_ptr<GRSurface> GRSurface::Create(size_t width, size_t height, size_t row_bytes,
                                              size_t pixel_bytes) {
   if (width == 0 || row_bytes == 0 || height == 0 || pixel_bytes == 0) return nullptr;
@@ -60,9 +79,51 @@ std::unique_ptr<GRSurface> GRSurface::Clone() const {
   auto result = GRSurface::Create(width, height, row_bytes, pixel_bytes);
   if (!result) return nullptr;
   memcpy(result->data(), data(), data_size_);
+  if (rotated) {
+    result->rotated = rotated->Clone();
+    result->rotated_for = result->rotated ? rotated_for : GRRotation::NONE;
+  }
   return result;
 }
 
+void PrerotateSurface(GRSurface* surface, GRRotation rotation) {
+  surface->rotated.reset();
+  surface->rotated_for = GRRotation::NONE;
+  if (rotation == GRRotation::NONE) return;
+
+  size_t width = surface->width;
+  size_t height = surface->height;
+  size_t pixel_bytes = surface->pixel_bytes;
+  bool swapped = rotation == GRRotation::LEFT || rotation == GRRotation::RIGHT;
+  size_t rotated_width = swapped ? height : width;
+  auto rotated = GRSurface::Create(rotated_width, swapped ? width : height,
+                                   rotated_width * pixel_bytes, pixel_bytes);
+  if (!rotated) return;
+
+  // The same mapping as the drawing functions use for the screen.
+  for (size_t y = 0; y < height; ++y) {
+    const uint8_t* src = surface->data() + y * surface->row_bytes;
+    for (size_t x = 0; x < width; ++x, src += pixel_bytes) {
+      size_t rotated_x = x;
+      size_t rotated_y = y;
+      if (rotation == GRRotation::RIGHT) {
+        rotated_x = height - 1 - y;
+        rotated_y = x;
+      } else if (rotation == GRRotation::DOWN) {
+        rotated_x = width - 1 - x;
+        rotated_y = height - 1 - y;
+      } else if (rotation == GRRotation::LEFT) {
+        rotated_x = y;
+        rotated_y = width - 1 - x;
+      }
+      memcpy(rotated->data() + rotated_y * rotated->row_bytes + rotated_x * pixel_bytes, src,
+             pixel_bytes);
+    }
+  }
+  surface->rotated = std::move(rotated);
+  surface->rotated_for = rotation;
+}
+
 PngHandler::PngHandler(const std::string& name) {
   std::string res_path = g_resource_dir + "/" + name + ".png";
   png_fp_.reset(fopen(res_path.c_str(), "rbe"));
@@ -215,6 +276,14 @@ static void TransformRgbToDraw(const uint8_t* input_row, uint8_t* output_row, in
 int res_create_display_surface(const char* name, GRSurface** pSurface) {
   *pSurface = nullptr;
 
+  if (auto bundle = GetResourceBundle(); bundle) {
+    if (auto surface = bundle->FindDisplaySurface(name, gr_pixel_format()); surface) {
+      PrerotateSurface(surface.get(), gr_get_rotation());
+      *pSurface = surface.release();
+      return 0;
+    }
+  }
+
   PngHandler png_handler(name);
   if (!png_handler) return png_handler.error_code();
 
@@ -241,6 +310,7 @@ int res_create_display_surface(const char* name, GRSurface** pSurface) {
                        png_handler.channels(), width);
   }
 
+  PrerotateSurface(surface.get(), gr_get_rotation());
   *pSurface = surface.release();
 
   return 0;
@@ -316,6 +386,9 @@ int res_create_multi_display_surface(const char* name, int* frames, int* fps,
     TransformRgbToDraw(p_row.data(), out_row, png_handler.channels(), width);
   }
 
+  for (int i = 0; i < *frames; ++i) {
+    PrerotateSurface(surface[i], gr_get_rotation());
+  }
   *pSurface = surface;
 
 exit:
@@ -330,12 +403,8 @@ exit:
   return result;
 }
 
-int res_create_alpha_surface(const char* name, GRSurface** pSurface) {
-  *pSurface = nullptr;
-
-  PngHandler png_handler(name);
-  if (!png_handler) return png_handler.error_code();
-
+// Reads the grayscale image of |png_handler| into an alpha surface.
+static int CreateAlphaSurface(const PngHandler& png_handler, GRSurface** pSurface) {
   if (png_handler.channels() != 1) {
     return -7;
   }
@@ -359,6 +428,38 @@ int res_create_alpha_surface(const char* name, GRSurface** pSurface) {
   return 0;
 }
 
+int res_create_alpha_surface(const char* name, GRSurface** pSurface) {
+  *pSurface = nullptr;
+
+  PngHandler png_handler(name);
+  if (!png_handler) return png_handler.error_code();
+  int result = CreateAlphaSurface(png_handler, pSurface);
+  if (result == 0) {
+    PrerotateSurface(*pSurface, gr_get_rotation());
+  }
+  return result;
+}
+
+int res_create_font_surface(const char* name, GRSurface** pSurface, std::string* glyphs) {
+  *pSurface = nullptr;
+  glyphs->clear();
+
+  PngHandler png_handler(name);
+  if (!png_handler) return png_handler.error_code();
+
+  png_textp text;
+  int num_text;
+  if (png_get_text(png_handler.png_ptr(), png_handler.info_ptr(), &text, &num_text)) {
+    for (int i = 0; i < num_text; ++i) {
+      if (text[i].key && strcmp(text[i].key, "Glyphs") == 0 && text[i].text) {
+        *glyphs = text[i].text;
+      }
+    }
+  }
+  // Not pre-rotated, as gr_text() draws the text runs composited from it.
+  return CreateAlphaSurface(png_handler, pSurface);
+}
+
 void res_set_resource_dir(const std::string& dirname) {
   g_resource_dir = dirname;
 }
@@ -427,6 +528,14 @@ int res_create_localized_alpha_surface(const char* name,
     return 0;
   }
 
+  if (auto bundle = GetResourceBundle(); bundle) {
+    if (auto surface = bundle->FindLocalizedSurface(name, locale); surface) {
+      PrerotateSurface(surface.get(), gr_get_rotation());
+      *pSurface = surface.release();
+      return 0;
+    }
+  }
+
   PngHandler png_handler(name);
   if (!png_handler) return png_handler.error_code();
 
@@ -465,6 +574,7 @@ int res_create_localized_alpha_surface(const char* name,
         memcpy(surface->data() + i * w, row.data(), w);
       }
 
+      PrerotateSurface(surface.get(), gr_get_rotation());
       *pSurface = surface.release();
       return 0;
     }
@@ -477,6 +587,48 @@ int res_create_localized_alpha_surface(const char* name,
   return -10;
 }
 
+int res_create_all_localized_alpha_surfaces(
+    const char* name, std::vector<std::pair<std::string, std::unique_ptr<GRSurface>>>* surfaces) {
+  surfaces->clear();
+
+  PngHandler png_handler(name);
+  if (!png_handler) return png_handler.error_code();
+
+  if (png_handler.channels() != 1) {
+    return -7;
+  }
+
+  png_structp png_ptr = png_handler.png_ptr();
+  png_uint_32 width = png_handler.width();
+  png_uint_32 height = png_handler.height();
+
+  std::vector<uint8_t> row(width);
+  for (png_uint_32 y = 0; y < height; ++y) {
+    png_read_row(png_ptr, row.data(), nullptr);
+    int w = (row[1] << 8) | row[0];
+    int h = (row[3] << 8) | row[2];
+    std::string loc(reinterpret_cast<char*>(&row[5]), strnlen(reinterpret_cast<char*>(&row[5]),
+                                                               width - 5));
+
+    if (y + 1 + h > height || w > static_cast<int>(width)) {
+      printf("Read exceeds the image boundary, y %u, w %d, h %d, height %u\n", y, w, h, height);
+      return -8;
+    }
+
+    auto surface = GRSurface::Create(w, h, w, 1);
+    if (!surface) {
+      return -9;
+    }
+    for (int i = 0; i < h; ++i, ++y) {
+      png_read_row(png_ptr, row.data(), nullptr);
+      memcpy(surface->data() + i * w, row.data(), w);
+    }
+    surfaces->emplace_back(std::move(loc), std::move(surface));
+  }
+
+  return 0;
+}
+
 void res_free_surface(GRSurface* surface) {
   delete(surface);
 }
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/text.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+#include "private/resources.h"
+
+static constexpr uint32_t kReplacementCharacter = 0xfffd;
+
+bool NextCodePoint(std::string_view* text, uint32_t* code_point) {
+  if (text->empty()) return false;
+
+  auto byte = [text](size_t i) { return static_cast<uint8_t>((*text)[i]); };
+  uint8_t lead = byte(0);
+  size_t length;
+  uint32_t value;
+  if (lead < 0x80) {
+    *code_point = lead;
+    text->remove_prefix(1);
+    return true;
+  } else if ((lead & 0xe0) == 0xc0) {
+    length = 2;
+    value = lead & 0x1f;
+  } else if ((lead & 0xf0) == 0xe0) {
+    length = 3;
+    value = lead & 0x0f;
+  } else if ((lead & 0xf8) == 0xf0) {
+    length = 4;
+    value = lead & 0x07;
+  } else {
+    length = 0;
+  }
+
+  bool valid = length != 0 && text->size() >= length;
+  for (size_t i = 1; valid && i < length; i++) {
+    valid = (byte(i) & 0xc0) == 0x80;
+    value = (value << 6) | (byte(i) & 0x3f);
+  }
+  // Overlong forms, surrogates and values past the last code point are invalid too.
+  static constexpr uint32_t kMinValue[] = { 0, 0, 0x80, 0x800, 0x10000 };
+  if (!valid || value < kMinValue[length] || value > 0x10ffff ||
+      (value >= 0xd800 && value <= 0xdfff)) {
+    *code_point = kReplacementCharacter;
+    text->remove_prefix(1);
+    return true;
+  }
+  *code_point = value;
+  text->remove_prefix(length);
+  return true;
+}
+
+size_t CountCodePoints(std::string_view text) {
+  size_t count = 0;
+  uint32_t code_point;
+  while (NextCodePoint(&text, &code_point)) {
+    count++;
+  }
+  return count;
+}
+
+bool ParseGlyphRanges(const std::string& str, std::vector<GRFont::GlyphRange>* ranges) {
+  ranges->clear();
+  for (const auto& item : android::base::Split(str, ",")) {
+    auto pieces = android::base::Split(android::base::Trim(item), "-");
+    GRFont::GlyphRange range;
+    if (pieces.size() > 2 || !android::base::ParseUint(pieces[0], &range.first) ||
+        !android::base::ParseUint(pieces.back(), &range.last) || range.first > range.last) {
+      return false;
+    }
+    ranges->push_back(range);
+  }
+  return true;
+}
+
+size_t CountGlyphs(const std::vector<GRFont::GlyphRange>& ranges) {
+  size_t count = 0;
+  for (const auto& range : ranges) {
+    count += range.last - range.first + 1;
+  }
+  return count;
+}
+
+int GlyphIndex(const GRFont& font, uint32_t code_point) {
+  for (uint32_t c : { code_point, static_cast<uint32_t>('?') }) {
+    int index = 0;
+    for (const auto& range : font.glyph_ranges) {
+      if (c >= range.first && c <= range.last) {
+        return index + static_cast<int>(c - range.first);
+      }
+      index += range.last - range.first + 1;
+    }
+  }
+  return -1;
+}
+
+// Composites the first |max_glyphs| glyphs of |text| in |font| into an alpha surface.
+static std::unique_ptr<GRSurface> CompositeTextRun(const GRFont& font, bool bold,
+                                                   std::string_view text, size_t max_glyphs) {
+  size_t glyphs = std::min(CountCodePoints(text), max_glyphs);
+  if (glyphs == 0) return nullptr;
+
+  size_t width = glyphs * font.char_width;
+  auto surface = GRSurface::Create(width, font.char_height, width, 1);
+  if (!surface) return nullptr;
+
+  const GRSurface* texture = font.texture;
+  const uint8_t* glyph_rows = texture->data() + (bold ? font.char_height * texture->row_bytes : 0);
+  uint32_t code_point;
+  for (size_t i = 0; i < glyphs && NextCodePoint(&text, &code_point); i++) {
+    uint8_t* dst = surface->data() + i * font.char_width;
+    int index = GlyphIndex(font, code_point);
+    if (index == -1) {
+      for (int y = 0; y < font.char_height; y++) {
+        memset(dst + y * surface->row_bytes, 0, font.char_width);
+      }
+      continue;
+    }
+    const uint8_t* src = glyph_rows + index * font.char_width;
+    for (int y = 0; y < font.char_height; y++) {
+      memcpy(dst + y * surface->row_bytes, src + y * texture->row_bytes, font.char_width);
+    }
+  }
+  return surface;
+}
+
+const GRSurface* TextRunCache::Get(const GRFont* font, bool bold, std::string_view text,
+                                   size_t max_glyphs, GRRotation rotation) {
+  // Looking up by a string_view saves copying the text on a hit.
+  auto it = index_.find(std::make_tuple(font, bold, text));
+  if (it != index_.end()) {
+    runs_.splice(runs_.begin(), runs_, it->second);
+  } else {
+    if (max_runs_ == 0) return nullptr;
+    if (runs_.size() == max_runs_) {
+      index_.erase(runs_.back().key);
+      runs_.pop_back();
+    }
+    runs_.push_front(TextRun{ Key(font, bold, std::string(text)), 0, nullptr });
+    index_.emplace(runs_.front().key, runs_.begin());
+  }
+
+  TextRun& run = runs_.front();
+  if (!run.surface || run.max_glyphs != max_glyphs) {
+    run.surface = CompositeTextRun(*font, bold, text, max_glyphs);
+    run.max_glyphs = max_glyphs;
+  }
+  if (run.surface && run.surface->rotated_for != rotation) {
+    PrerotateSurface(run.surface.get(), rotation);
+  }
+  return run.surface.get();
+}
+
+void TextRunCache::Clear() {
+  index_.clear();
+  runs_.clear();
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Generates the resource bundle (see minui/include/private/resource_bundle.h) of a resource dir,
+// for the recovery image to map at boot instead of decoding the PNGs:
+//   minui_resource_bundler --pixel_format=<ABGR|RGBX|BGRA|ARGB|RGBA> <images dir> <output file>
+//
+// The images are converted by the same code as on the device. The "*_text.png" images hold
+// localized text (see tools/recovery_l10n), and the font images are left out, as they're only
+// loaded by gr_init_font().
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <android-base/strings.h>
+
+#include "minui/minui.h"
+#include "private/resource_bundle.h"
+#include "private/resources.h"
+
+static PixelFormat pixel_format = PixelFormat::UNKNOWN;
+
+// The conversions in resources.cpp go by these; the bundle holds the images unrotated.
+PixelFormat gr_pixel_format() {
+  return pixel_format;
+}
+
+GRRotation gr_get_rotation() {
+  return GRRotation::NONE;
+}
+
+static void Usage(const char* name) {
+  fprintf(stderr, "usage: %s --pixel_format=<ABGR|RGBX|BGRA|ARGB|RGBA> <images dir> <output>\n",
+          name);
+}
+
+int main(int argc, char** argv) {
+  static const std::map<std::string, PixelFormat> kPixelFormats = {
+    { "ABGR", PixelFormat::ABGR }, { "RGBX", PixelFormat::RGBX }, { "BGRA", PixelFormat::BGRA },
+    { "ARGB", PixelFormat::ARGB }, { "RGBA", PixelFormat::RGBA },
+  };
+
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (android::base::ConsumePrefix(&arg, "--pixel_format=")) {
+      auto it = kPixelFormats.find(std::string(arg));
+      if (it == kPixelFormats.end()) {
+        fprintf(stderr, "Unknown pixel format %s\n", argv[i]);
+        return 1;
+      }
+      pixel_format = it->second;
+    } else {
+      args.emplace_back(arg);
+    }
+  }
+  if (args.size() != 2 || pixel_format == PixelFormat::UNKNOWN) {
+    Usage(argv[0]);
+    return 1;
+  }
+  const std::string& images_dir = args[0];
+  const std::string& output = args[1];
+
+  dirent** namelist;
+  int n = scandir(images_dir.c_str(), &namelist, nullptr, alphasort);
+  if (n == -1) {
+    fprintf(stderr, "Failed to scan %s: %s\n", images_dir.c_str(), strerror(errno));
+    return 1;
+  }
+  std::vector<std::string> names;
+  for (int i = 0; i < n; i++) {
+    std::string_view name = namelist[i]->d_name;
+    if (android::base::ConsumeSuffix(&name, ".png") && !android::base::StartsWith(name, "font")) {
+      names.emplace_back(name);
+    }
+    free(namelist[i]);
+  }
+  free(namelist);
+
+  std::vector<std::unique_ptr<GRSurface>> surfaces;
+  std::vector<ResourceBundleImage> images;
+  for (const auto& name : names) {
+    std::string path = images_dir + "/" + name + ".png";
+    if (android::base::EndsWith(name, "_text")) {
+      std::vector<std::pair<std::string, std::unique_ptr<GRSurface>>> localized;
+      if (int result = res_create_all_localized_alpha_surfaces(path.c_str(), &localized);
+          result < 0) {
+        fprintf(stderr, "Failed to load %s (error %d)\n", path.c_str(), result);
+        return 1;
+      }
+      for (auto& [locale, surface] : localized) {
+        images.push_back({ name, locale, ResourceBundleType::LOCALIZED_ALPHA, surface.get() });
+        surfaces.push_back(std::move(surface));
+      }
+    } else {
+      GRSurface* surface;
+      if (int result = res_create_display_surface(path.c_str(), &surface); result < 0) {
+        fprintf(stderr, "Failed to load %s (error %d)\n", path.c_str(), result);
+        return 1;
+      }
+      images.push_back({ name, "", ResourceBundleType::DISPLAY, surface });
+      surfaces.emplace_back(surface);
+    }
+  }
+
+  if (!WriteResourceBundle(output, pixel_format, images)) {
+    return 1;
+  }
+  printf("Wrote %zu images from %s to %s\n", images.size(), images_dir.c_str(), output.c_str());
+  return 0;
+}
@@ -72,18 +72,23 @@ bool asn1_context::decode_length(size_t* out_len) {
 /**
  * Returns the constructed type and advances the pointer. E.g. A0 -> 0
  */
-asn1_context* asn1_context::asn1_constructed_get() {
+bool asn1_context::asn1_constructed_get(asn1_context* constructed) {
   int type = get_byte();
   if (type == -1 || (type & kMaskConstructed) != kTagConstructed) {
-    return nullptr;
+    return false;
   }
   size_t length;
   if (!decode_length(&length) || length > length_) {
-    return nullptr;
+    return false;
   }
-  asn1_context* app_ctx = new asn1_context(p_, length);
-  app_ctx->app_type_ = type & kMaskAppType;
-  return app_ctx;
+  *constructed = asn1_context(p_, length);
+  constructed->app_type_ = type & kMaskAppType;
+  return true;
+}
+
+asn1_context* asn1_context::asn1_constructed_get() {
+  asn1_context constructed;
+  return asn1_constructed_get(&constructed) ? new asn1_context(constructed) : nullptr;
 }
 
 bool asn1_context::asn1_constructed_skip_all() {
@@ -103,26 +108,38 @@ int asn1_context::asn1_constructed_type() const {
   return app_type_;
 }
 
-asn1_context* asn1_context::asn1_sequence_get() {
+bool asn1_context::asn1_sequence_get(asn1_context* sequence) {
   if ((get_byte() & kMaskTag) != kTagSequence) {
-    return nullptr;
+    return false;
   }
   size_t length;
   if (!decode_length(&length) || length > length_) {
-    return nullptr;
+    return false;
   }
-  return new asn1_context(p_, length);
+  *sequence = asn1_context(p_, length);
+  return true;
 }
 
-asn1_context* asn1_context::asn1_set_get() {
+asn1_context* asn1_context::asn1_sequence_get() {
+  asn1_context sequence;
+  return asn1_sequence_get(&sequence) ? new asn1_context(sequence) : nullptr;
+}
+
+bool asn1_context::asn1_set_get(asn1_context* set) {
   if ((get_byte() & kMaskTag) != kTagSet) {
-    return nullptr;
+    return false;
   }
   size_t length;
   if (!decode_length(&length) || length > length_) {
-    return nullptr;
+    return false;
   }
-  return new asn1_context(p_, length);
+  *set = asn1_context(p_, length);
+  return true;
+}
+
+asn1_context* asn1_context::asn1_set_get() {
+  asn1_context set;
+  return asn1_set_get(&set) ? new asn1_context(set) : nullptr;
 }
 
 bool asn1_context::asn1_sequence_next() {
@@ -154,3 +171,14 @@ bool asn1_context::asn1_octet_string_get(const uint8_t** octet_string, size_t* l
   *octet_string = p_;
   return true;
 }
+
+bool asn1_context::asn1_element_get(const uint8_t** element, size_t* length) {
+  const uint8_t* start = p_;
+  size_t remaining = length_;
+  if (!asn1_sequence_next()) {
+    return false;
+  }
+  *element = start;
+  *length = remaining - length_;
+  return true;
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/block_hash.h"
+
+#include <string.h>
+
+#if defined(__aarch64__) || defined(__arm__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+#include <openssl/sha.h>
+
+size_t BlockDigestSize(BlockHashAlgorithm algorithm) {
+  return algorithm == BlockHashAlgorithm::kSha256 ? SHA256_DIGEST_LENGTH : SHA_DIGEST_LENGTH;
+}
+
+// Returns whether the CPU has SHA-256 instructions, which BoringSSL uses.
+static bool HasSha256Instructions() {
+#if defined(__aarch64__)
+  return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#elif defined(__arm__)
+  return (getauxval(AT_HWCAP2) & HWCAP2_SHA2) != 0;
+#elif defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  // CPUID.(EAX=7,ECX=0):EBX.SHA[bit 29].
+  return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1U << 29)) != 0;
+#else
+  return false;
+#endif
+}
+
+BlockHashImplementation GetBlockHashImplementation() {
+  static const BlockHashImplementation implementation = []() {
+    auto implementation = HasSha256Instructions() ? BlockHashImplementation::kOneAtATime
+                                                  : BlockHashImplementation::kMultiBuffer;
+    LOG(INFO) << "Hashing blocks "
+              << (implementation == BlockHashImplementation::kOneAtATime ? "one at a time"
+                                                                         : "in multiple buffers");
+    return implementation;
+  }();
+  return implementation;
+}
+
+template <typename Context, int (*Init)(Context*), int (*Update)(Context*, const void*, size_t),
+          int (*Final)(uint8_t*, Context*)>
+static void HashOneAtATime(const uint8_t* data, size_t block_size, size_t count, uint8_t* digests,
+                           size_t digest_size, const uint8_t* salt, size_t salt_size) {
+  Context salted;
+  Init(&salted);
+  Update(&salted, salt, salt_size);
+  for (size_t i = 0; i < count; i++) {
+    Context ctx = salted;
+    Update(&ctx, data + i * block_size, block_size);
+    Final(digests + i * digest_size, &ctx);
+  }
+}
+
+// The multi-buffer SHA-256 runs the same rounds on kMultiBufferLanes messages, one in each lane of
+// the vectors. The compiler turns the vector operations into NEON or SSE2 instructions.
+typedef uint32_t Lanes __attribute__((vector_size(sizeof(uint32_t) * kMultiBufferLanes)));
+
+static constexpr uint32_t kSha256RoundConstants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static constexpr uint32_t kSha256InitialState[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static constexpr size_t kSha256ChunkSize = 64;
+
+static inline Lanes RotateRight(Lanes x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t LoadBigEndian(const uint8_t* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+// Runs the compression function over one chunk of each lane.
+static void Sha256Compress(Lanes state[8], const uint8_t* const chunks[kMultiBufferLanes]) {
+  Lanes w[64];
+  for (size_t t = 0; t < 16; t++) {
+    for (size_t lane = 0; lane < kMultiBufferLanes; lane++) {
+      w[t][lane] = LoadBigEndian(chunks[lane] + 4 * t);
+    }
+  }
+  for (size_t t = 16; t < 64; t++) {
+    Lanes s0 = RotateRight(w[t - 15], 7) ^ RotateRight(w[t - 15], 18) ^ (w[t - 15] >> 3);
+    Lanes s1 = RotateRight(w[t - 2], 17) ^ RotateRight(w[t - 2], 19) ^ (w[t - 2] >> 10);
+    w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+  }
+
+  Lanes a = state[0], b = state[1], c = state[2], d = state[3];
+  Lanes e = state[4], f = state[5], g = state[6], h = state[7];
+  for (size_t t = 0; t < 64; t++) {
+    Lanes s1 = RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+    Lanes ch = (e & f) ^ (~e & g);
+    Lanes t1 = h + s1 + ch + kSha256RoundConstants[t] + w[t];
+    Lanes s0 = RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+    Lanes maj = (a & b) ^ (a & c) ^ (b & c);
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + s0 + maj;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+// Copies the chunk at |offset| of the padded message (the salt, the block, then the SHA-256
+// padding for a message of |message_size| bytes) into |chunk|.
+static void AssembleChunk(const uint8_t* salt, size_t salt_size, const uint8_t* block,
+                          size_t message_size, size_t offset, uint8_t* chunk) {
+  memset(chunk, 0, kSha256ChunkSize);
+  size_t end = offset + kSha256ChunkSize;
+  if (offset < salt_size) {
+    memcpy(chunk, salt + offset, std::min(end, salt_size) - offset);
+  }
+  if (end > salt_size && offset < message_size) {
+    size_t begin = std::max(offset, salt_size);
+    memcpy(chunk + begin - offset, block + begin - salt_size, std::min(end, message_size) - begin);
+  }
+  if (message_size >= offset && message_size < end) {
+    chunk[message_size - offset] = 0x80;
+  }
+  // The length in bits goes at the end of the last chunk.
+  size_t padded_size = (message_size + 8) / kSha256ChunkSize * kSha256ChunkSize + kSha256ChunkSize;
+  if (end == padded_size) {
+    uint64_t bits = static_cast<uint64_t>(message_size) * 8;
+    for (size_t i = 0; i < 8; i++) {
+      chunk[kSha256ChunkSize - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+    }
+  }
+}
+
+// Hashes kMultiBufferLanes blocks at |data| at once.
+static void HashSha256MultiBuffer(const uint8_t* data, size_t block_size, uint8_t* digests,
+                                  const uint8_t* salt, size_t salt_size) {
+  Lanes state[8];
+  for (size_t i = 0; i < 8; i++) {
+    state[i] = Lanes{} + kSha256InitialState[i];
+  }
+
+  size_t message_size = salt_size + block_size;
+  size_t padded_size = (message_size + 8) / kSha256ChunkSize * kSha256ChunkSize + kSha256ChunkSize;
+  uint8_t assembled[kMultiBufferLanes][kSha256ChunkSize];
+  const uint8_t* chunks[kMultiBufferLanes];
+  for (size_t offset = 0; offset < padded_size; offset += kSha256ChunkSize) {
+    // Most chunks lie within the blocks, and are hashed in place.
+    bool in_place = offset >= salt_size && offset + kSha256ChunkSize <= message_size;
+    for (size_t lane = 0; lane < kMultiBufferLanes; lane++) {
+      const uint8_t* block = data + lane * block_size;
+      if (in_place) {
+        chunks[lane] = block + offset - salt_size;
+      } else {
+        AssembleChunk(salt, salt_size, block, message_size, offset, assembled[lane]);
+        chunks[lane] = assembled[lane];
+      }
+    }
+    Sha256Compress(state, chunks);
+  }
+
+  for (size_t lane = 0; lane < kMultiBufferLanes; lane++) {
+    uint8_t* digest = digests + lane * SHA256_DIGEST_LENGTH;
+    for (size_t i = 0; i < 8; i++) {
+      uint32_t word = state[i][lane];
+      digest[4 * i] = word >> 24;
+      digest[4 * i + 1] = word >> 16;
+      digest[4 * i + 2] = word >> 8;
+      digest[4 * i + 3] = word;
+    }
+  }
+}
+
+void HashBlocksWith(BlockHashImplementation implementation, BlockHashAlgorithm algorithm,
+                    const uint8_t* data, size_t block_size, size_t count, uint8_t* digests,
+                    const uint8_t* salt, size_t salt_size) {
+  if (algorithm == BlockHashAlgorithm::kSha1) {
+    HashOneAtATime<SHA_CTX, SHA1_Init, SHA1_Update, SHA1_Final>(
+        data, block_size, count, digests, SHA_DIGEST_LENGTH, salt, salt_size);
+    return;
+  }
+
+  size_t hashed = 0;
+  if (implementation == BlockHashImplementation::kMultiBuffer) {
+    for (; hashed + kMultiBufferLanes <= count; hashed += kMultiBufferLanes) {
+      HashSha256MultiBuffer(data + hashed * block_size, block_size,
+                            digests + hashed * SHA256_DIGEST_LENGTH, salt, salt_size);
+    }
+  }
+  // The blocks left over from the lanes.
+  HashOneAtATime<SHA256_CTX, SHA256_Init, SHA256_Update, SHA256_Final>(
+      data + hashed * block_size, block_size, count - hashed,
+      digests + hashed * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH, salt, salt_size);
+}
+
+void HashBlocks(BlockHashAlgorithm algorithm, const uint8_t* data, size_t block_size, size_t count,
+                uint8_t* digests, const uint8_t* salt, size_t salt_size) {
+  HashBlocksWith(GetBlockHashImplementation(), algorithm, data, block_size, count, digests, salt,
+                 salt_size);
+}
@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/block_set.h"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+static constexpr size_t kChunkBits = 16;
+static constexpr size_t kChunkSize = 1 << kChunkBits;
+// Above this many blocks, a chunk takes less space as a bitmap than as an array.
+static constexpr size_t kMaxArrayBlocks = 4096;
+static constexpr size_t kBitmapWords = kChunkSize / 64;
+
+// Appends the blocks [start, end) to |runs|, merged into the last run if they follow it.
+static void AddRun(std::vector<Range>* runs, size_t start, size_t end) {
+  if (!runs->empty() && runs->back().second == start) {
+    runs->back().second = end;
+  } else {
+    runs->emplace_back(start, end);
+  }
+}
+
+// Returns the word with the bits [first, last) set.
+static uint64_t BitMask(size_t first, size_t last) {
+  uint64_t bits = last - first == 64 ? ~uint64_t{ 0 } : (uint64_t{ 1 } << (last - first)) - 1;
+  return bits << first;
+}
+
+static bool TestBit(const std::vector<uint64_t>& bitmap, uint16_t bit) {
+  return (bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+void BlockSet::Chunk::ToBitmap() {
+  if (is_bitmap()) {
+    return;
+  }
+  bitmap.assign(kBitmapWords, 0);
+  for (uint16_t low : array) {
+    bitmap[low / 64] |= uint64_t{ 1 } << (low % 64);
+  }
+  array.clear();
+  array.shrink_to_fit();
+}
+
+void BlockSet::Chunk::Normalize() {
+  if (is_bitmap() && blocks <= kMaxArrayBlocks) {
+    array.clear();
+    array.reserve(blocks);
+    for (size_t word = 0; word < kBitmapWords; word++) {
+      for (uint64_t bits = bitmap[word]; bits != 0; bits &= bits - 1) {
+        array.push_back(word * 64 + __builtin_ctzll(bits));
+      }
+    }
+    bitmap.clear();
+    bitmap.shrink_to_fit();
+  } else if (!is_bitmap() && blocks > kMaxArrayBlocks) {
+    ToBitmap();
+  }
+}
+
+BlockSet::BlockSet(const RangeSet& ranges) {
+  for (const auto& range : ranges) {
+    Insert(range);
+  }
+}
+
+BlockSet::Chunk* BlockSet::GetChunk(uint32_t key) {
+  auto it = std::lower_bound(chunks_.begin(), chunks_.end(), key,
+                             [](const Chunk& chunk, uint32_t key) { return chunk.key < key; });
+  if (it == chunks_.end() || it->key != key) {
+    it = chunks_.insert(it, Chunk{ key, 0, {}, {} });
+  }
+  return &*it;
+}
+
+void BlockSet::Insert(const Range& range) {
+  for (size_t start = range.first; start < range.second;) {
+    uint32_t key = start >> kChunkBits;
+    size_t chunk_end = std::min(range.second, (static_cast<size_t>(key) + 1) << kChunkBits);
+    size_t low = start & (kChunkSize - 1);
+    size_t high = low + (chunk_end - start);
+    start = chunk_end;
+
+    Chunk* chunk = GetChunk(key);
+    size_t blocks_before = chunk->blocks;
+    if (!chunk->is_bitmap() && chunk->blocks + (high - low) > kMaxArrayBlocks) {
+      chunk->ToBitmap();
+    }
+    if (chunk->is_bitmap()) {
+      for (size_t word = low / 64; word <= (high - 1) / 64; word++) {
+        // The bits of [low, high) in this word.
+        size_t first = std::max(low, word * 64) - word * 64;
+        size_t last = std::min(high, word * 64 + 64) - word * 64;
+        uint64_t mask = BitMask(first, last);
+        chunk->blocks += __builtin_popcountll(mask & ~chunk->bitmap[word]);
+        chunk->bitmap[word] |= mask;
+      }
+    } else {
+      std::vector<uint16_t> merged;
+      merged.reserve(chunk->array.size() + (high - low));
+      auto it = std::lower_bound(chunk->array.begin(), chunk->array.end(), low);
+      merged.insert(merged.end(), chunk->array.begin(), it);
+      for (size_t low_bits = low; low_bits < high; low_bits++) {
+        merged.push_back(low_bits);
+      }
+      merged.insert(merged.end(), std::upper_bound(it, chunk->array.end(), high - 1),
+                    chunk->array.end());
+      chunk->array = std::move(merged);
+      chunk->blocks = chunk->array.size();
+    }
+    blocks_ += chunk->blocks - blocks_before;
+  }
+}
+
+bool BlockSet::Contains(size_t block) const {
+  uint32_t key = block >> kChunkBits;
+  auto it = std::lower_bound(chunks_.begin(), chunks_.end(), key,
+                             [](const Chunk& chunk, uint32_t key) { return chunk.key < key; });
+  if (it == chunks_.end() || it->key != key) {
+    return false;
+  }
+  uint16_t low = block & (kChunkSize - 1);
+  if (it->is_bitmap()) {
+    return TestBit(it->bitmap, low);
+  }
+  return std::binary_search(it->array.begin(), it->array.end(), low);
+}
+
+void BlockSet::Combine(Chunk* chunk, const Chunk& other, Op op) {
+  if (!chunk->is_bitmap() && !other.is_bitmap()) {
+    std::vector<uint16_t> result;
+    const auto& a = chunk->array;
+    const auto& b = other.array;
+    switch (op) {
+      case Op::kUnion:
+        std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(result));
+        break;
+      case Op::kIntersection:
+        std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(result));
+        break;
+      case Op::kDifference:
+        std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(result));
+        break;
+    }
+    chunk->array = std::move(result);
+    chunk->blocks = chunk->array.size();
+    chunk->Normalize();
+    return;
+  }
+
+  // An array filtered by a bitmap stays an array.
+  if (!chunk->is_bitmap() && op != Op::kUnion) {
+    bool keep_set = op == Op::kIntersection;
+    auto& a = chunk->array;
+    a.erase(std::remove_if(a.begin(), a.end(),
+                           [&](uint16_t low) { return TestBit(other.bitmap, low) != keep_set; }),
+            a.end());
+    chunk->blocks = a.size();
+    return;
+  }
+
+  chunk->ToBitmap();
+  Chunk other_bitmap;
+  const std::vector<uint64_t>* bits = &other.bitmap;
+  if (!other.is_bitmap()) {
+    other_bitmap = other;
+    other_bitmap.ToBitmap();
+    bits = &other_bitmap.bitmap;
+  }
+  chunk->blocks = 0;
+  for (size_t word = 0; word < kBitmapWords; word++) {
+    uint64_t& w = chunk->bitmap[word];
+    switch (op) {
+      case Op::kUnion:
+        w |= (*bits)[word];
+        break;
+      case Op::kIntersection:
+        w &= (*bits)[word];
+        break;
+      case Op::kDifference:
+        w &= ~(*bits)[word];
+        break;
+    }
+    chunk->blocks += __builtin_popcountll(w);
+  }
+  chunk->Normalize();
+}
+
+void BlockSet::Update() {
+  chunks_.erase(std::remove_if(chunks_.begin(), chunks_.end(),
+                               [](const Chunk& chunk) { return chunk.blocks == 0; }),
+                chunks_.end());
+  blocks_ = 0;
+  for (const auto& chunk : chunks_) {
+    blocks_ += chunk.blocks;
+  }
+}
+
+BlockSet& BlockSet::operator|=(const BlockSet& other) {
+  std::vector<Chunk> result;
+  result.reserve(chunks_.size() + other.chunks_.size());
+  auto it = chunks_.begin();
+  auto other_it = other.chunks_.begin();
+  while (it != chunks_.end() || other_it != other.chunks_.end()) {
+    if (other_it == other.chunks_.end() || (it != chunks_.end() && it->key < other_it->key)) {
+      result.push_back(std::move(*it++));
+    } else if (it == chunks_.end() || other_it->key < it->key) {
+      result.push_back(*other_it++);
+    } else {
+      Combine(&*it, *other_it++, Op::kUnion);
+      result.push_back(std::move(*it++));
+    }
+  }
+  chunks_ = std::move(result);
+  Update();
+  return *this;
+}
+
+BlockSet& BlockSet::operator&=(const BlockSet& other) {
+  auto other_it = other.chunks_.begin();
+  for (auto& chunk : chunks_) {
+    while (other_it != other.chunks_.end() && other_it->key < chunk.key) {
+      ++other_it;
+    }
+    if (other_it != other.chunks_.end() && other_it->key == chunk.key) {
+      Combine(&chunk, *other_it, Op::kIntersection);
+    } else {
+      chunk.blocks = 0;
+    }
+  }
+  Update();
+  return *this;
+}
+
+BlockSet& BlockSet::operator-=(const BlockSet& other) {
+  auto other_it = other.chunks_.begin();
+  for (auto& chunk : chunks_) {
+    while (other_it != other.chunks_.end() && other_it->key < chunk.key) {
+      ++other_it;
+    }
+    if (other_it != other.chunks_.end() && other_it->key == chunk.key) {
+      Combine(&chunk, *other_it, Op::kDifference);
+    }
+  }
+  Update();
+  return *this;
+}
+
+bool BlockSet::Overlaps(const BlockSet& other) const {
+  auto other_it = other.chunks_.begin();
+  for (const auto& chunk : chunks_) {
+    while (other_it != other.chunks_.end() && other_it->key < chunk.key) {
+      ++other_it;
+    }
+    if (other_it == other.chunks_.end()) {
+      return false;
+    }
+    if (other_it->key != chunk.key) {
+      continue;
+    }
+    // Tests the blocks of the array (or the smaller one) against the other chunk.
+    const Chunk* a = &chunk;
+    const Chunk* b = &*other_it;
+    if (a->is_bitmap() && (!b->is_bitmap() || b->blocks < a->blocks)) {
+      std::swap(a, b);
+    }
+    if (a->is_bitmap()) {
+      for (size_t word = 0; word < kBitmapWords; word++) {
+        if (a->bitmap[word] & b->bitmap[word]) {
+          return true;
+        }
+      }
+    } else {
+      for (uint16_t low : a->array) {
+        if (b->is_bitmap() ? TestBit(b->bitmap, low)
+                           : std::binary_search(b->array.begin(), b->array.end(), low)) {
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+bool BlockSet::operator==(const BlockSet& other) const {
+  if (blocks_ != other.blocks_ || chunks_.size() != other.chunks_.size()) {
+    return false;
+  }
+  // The representation of each chunk only depends on its number of blocks.
+  for (size_t i = 0; i < chunks_.size(); i++) {
+    const Chunk& a = chunks_[i];
+    const Chunk& b = other.chunks_[i];
+    if (a.key != b.key || a.array != b.array || a.bitmap != b.bitmap) {
+      return false;
+    }
+  }
+  return true;
+}
+
+RangeSet BlockSet::ToRangeSet() const {
+  std::vector<Range> runs;
+  for (const auto& chunk : chunks_) {
+    size_t base = static_cast<size_t>(chunk.key) << kChunkBits;
+    if (!chunk.is_bitmap()) {
+      for (uint16_t low : chunk.array) {
+        AddRun(&runs, base + low, base + low + 1);
+      }
+      continue;
+    }
+    for (size_t word = 0; word < kBitmapWords; word++) {
+      uint64_t bits = chunk.bitmap[word];
+      size_t word_base = base + word * 64;
+      while (bits != 0) {
+        // Each run of set bits, from its lowest one.
+        size_t first = __builtin_ctzll(bits);
+        uint64_t run = bits + (uint64_t{ 1 } << first);
+        size_t last = run == 0 ? 64 : __builtin_ctzll(run);
+        AddRun(&runs, word_base + first, word_base + last);
+        bits = last == 64 ? 0 : bits & (~uint64_t{ 0 } << last);
+      }
+    }
+  }
+  if (runs.empty()) {
+    return {};
+  }
+  return RangeSet(std::move(runs));
+}
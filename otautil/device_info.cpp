@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/device_info.h"
+
+#include <android-base/parsebool.h>
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+
+// The properties in the snapshot; they all need to be read-only.
+static const char* const kDeviceInfoProperties[] = {
+  // clang-format off
+  "ro.boot.hardware.revision",
+  "ro.bootloader",
+  "ro.build.ab_update",
+  "ro.build.date.utc",
+  "ro.build.expect.baseband",
+  "ro.build.fingerprint",
+  "ro.build.flavor",
+  "ro.build.id",
+  "ro.build.product",
+  "ro.build.tags",
+  "ro.build.version.incremental",
+  "ro.build.version.security_patch",
+  "ro.product.device",
+  "ro.product.vendor.device",
+  "ro.recovery.verify_package",
+  "ro.revision",
+  "ro.secure",
+  "ro.serialno",
+  "ro.virtual_ab.enabled",
+  // clang-format on
+};
+
+const DeviceInfo& DeviceInfo::Get() {
+  static const DeviceInfo device_info;
+  return device_info;
+}
+
+DeviceInfo::DeviceInfo() {
+  for (const auto& name : kDeviceInfoProperties) {
+    properties_.emplace(name, android::base::GetProperty(name, ""));
+  }
+}
+
+std::string DeviceInfo::GetProperty(const std::string& name) const {
+  if (auto it = properties_.find(name); it != properties_.end()) {
+    return it->second;
+  }
+  return android::base::GetProperty(name, "");
+}
+
+bool DeviceInfo::GetBoolProperty(const std::string& name, bool default_value) const {
+  switch (android::base::ParseBool(GetProperty(name))) {
+    case android::base::ParseBoolResult::kTrue:
+      return true;
+    case android::base::ParseBoolResult::kFalse:
+      return false;
+    case android::base::ParseBoolResult::kError:
+      return default_value;
+  }
+  return default_value;
+}
+
+int64_t DeviceInfo::GetIntProperty(const std::string& name, int64_t default_value) const {
+  int64_t value;
+  return android::base::ParseInt(GetProperty(name), &value) ? value : default_value;
+}
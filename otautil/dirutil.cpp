@@ -18,13 +18,21 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include <android-base/unique_fd.h>
 #include <selinux/label.h>
 #include <selinux/selinux.h>
 
@@ -82,97 +90,163 @@ int mkdir_recursively(const std::string& input_path, mode_t mode, bool strip_fil
     return -1;
   }
 
-  // Walk up the path from the root and make each level.
-  size_t prev_end = 0;
-  while (prev_end < path.size()) {
-    size_t next_end = path.find('/', prev_end + 1);
-    if (next_end == std::string::npos) {
+  // The ends of the levels of the path, e.g. "/a", "/a/b" and "/a/b/c" for "/a/b/c/".
+  std::vector<size_t> ends;
+  for (size_t end = path.find('/', 1); end != std::string::npos; end = path.find('/', end + 1)) {
+    ends.push_back(end);
+  }
+
+  // Find the deepest level that exists already, going up from the one right above the path (which
+  // is known to be missing), rather than checking every level from the root.
+  size_t level = ends.size() - 1;
+  while (level > 0) {
+    DirStatus status = dir_status(path.substr(0, ends[level - 1]));
+    if (status == DirStatus::DDIR) {
       break;
+    } else if (status == DirStatus::DILLEGAL) {
+      return -1;
+    }
+    level--;
+  }
+
+  // Then make each missing level.
+  for (; level < ends.size(); level++) {
+    std::string dir_path = path.substr(0, ends[level]);
+    char* secontext = nullptr;
+    if (sehnd) {
+      selabel_lookup(const_cast<selabel_handle*>(sehnd), &secontext, dir_path.c_str(), mode);
+      setfscreatecon(secontext);
     }
-    std::string dir_path = path.substr(0, next_end);
-    // Check this part of the path and make a new directory if necessary.
-    switch (dir_status(dir_path)) {
-      case DirStatus::DILLEGAL:
-        // Could happen if some other process/thread is messing with the filesystem.
+    int err = mkdir(dir_path.c_str(), mode);
+    if (secontext) {
+      freecon(secontext);
+      setfscreatecon(nullptr);
+    }
+    if (err != 0) {
+      // Could happen if some other process/thread is messing with the filesystem.
+      if (errno != EEXIST || dir_status(dir_path) != DirStatus::DDIR) {
         return -1;
-      case DirStatus::DMISSING: {
-        char* secontext = nullptr;
-        if (sehnd) {
-          selabel_lookup(const_cast<selabel_handle*>(sehnd), &secontext, dir_path.c_str(), mode);
-          setfscreatecon(secontext);
-        }
-        int err = mkdir(dir_path.c_str(), mode);
-        if (secontext) {
-          freecon(secontext);
-          setfscreatecon(nullptr);
-        }
-        if (err != 0) {
+      }
+      continue;
+    }
+    if (timestamp != NULL && utime(dir_path.c_str(), timestamp)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// The directory entries are read this much at a time, with getdents64(2) (whose entries are laid
+// out as struct dirent64).
+static constexpr size_t kDirentBufferSize = 64 * 1024;
+
+// The subdirectories of the top directory are removed by up to this many threads.
+static constexpr size_t kMaxUnlinkWorkers = 4;
+
+static int UnlinkDirAt(int parent_fd, const char* name);
+
+// Removes everything in the directory open at |fd|. The subdirectories are removed too, unless
+// |subdirs| is given, in which case their names are added to it instead. Returns 0 on success, or
+// -1 (and sets errno) on the first failure.
+static int UnlinkDirContents(int fd, std::vector<std::string>* subdirs) {
+  std::vector<uint8_t> buffer(kDirentBufferSize);
+  while (true) {
+    long size = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+    if (size == -1) {
+      return -1;
+    }
+    if (size == 0) {
+      return 0;
+    }
+    for (long offset = 0; offset < size;) {
+      auto entry = reinterpret_cast<const struct dirent64*>(buffer.data() + offset);
+      offset += entry->d_reclen;
+      const char* name = entry->d_name;
+      if (!strcmp(name, ".") || !strcmp(name, "..")) {
+        continue;
+      }
+
+      bool is_dir = entry->d_type == DT_DIR;
+      if (entry->d_type == DT_UNKNOWN) {
+        struct stat sb;
+        if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
           return -1;
         }
-        if (timestamp != NULL && utime(dir_path.c_str(), timestamp)) {
+        is_dir = S_ISDIR(sb.st_mode);
+      }
+      if (!is_dir) {
+        if (unlinkat(fd, name, 0) != 0) {
           return -1;
         }
-        break;
+      } else if (subdirs != nullptr) {
+        subdirs->emplace_back(name);
+      } else if (UnlinkDirAt(fd, name) != 0) {
+        return -1;
       }
-      default:
-        // Already exists.
-        break;
     }
-    prev_end = next_end;
   }
-  return 0;
 }
 
-int dirUnlinkHierarchy(const char* path) {
-  struct stat st;
-  DIR* dir;
-  struct dirent* de;
-  int fail = 0;
-
-  /* is it a file or directory? */
-  if (lstat(path, &st) < 0) {
+// Removes the directory |name| in |parent_fd|, and everything in it.
+static int UnlinkDirAt(int parent_fd, const char* name) {
+  android::base::unique_fd fd(
+      openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+  if (fd == -1 || UnlinkDirContents(fd, nullptr) != 0) {
     return -1;
   }
+  fd.reset();
+  return unlinkat(parent_fd, name, AT_REMOVEDIR);
+}
 
-  /* a file, so unlink it */
-  if (!S_ISDIR(st.st_mode)) {
+int dirUnlinkHierarchy(const char* path) {
+  // Open it as a directory, which fails for anything else (a symlink included) without following
+  // it; that's then unlinked.
+  android::base::unique_fd fd(open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+  if (fd == -1) {
+    if (errno != ENOTDIR && errno != ELOOP) {
+      return -1;
+    }
     return unlink(path);
   }
 
-  /* a directory, so open handle */
-  dir = opendir(path);
-  if (dir == NULL) {
+  // The files go first; the subdirectories are independent of each other, so they're removed in
+  // parallel.
+  std::vector<std::string> subdirs;
+  if (UnlinkDirContents(fd, &subdirs) != 0) {
     return -1;
   }
 
-  /* recurse over components */
-  errno = 0;
-  while ((de = readdir(dir)) != NULL) {
-    // TODO: don't blow the stack
-    char dn[PATH_MAX];
-    if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
-      continue;
-    }
-    snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-    if (dirUnlinkHierarchy(dn) < 0) {
-      fail = 1;
-      break;
+  std::mutex mutex;
+  size_t next = 0;
+  int error = 0;
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (next < subdirs.size() && error == 0) {
+      const std::string& name = subdirs[next++];
+      lock.unlock();
+      int result = UnlinkDirAt(fd, name.c_str());
+      int saved_errno = errno;
+      lock.lock();
+      if (result != 0 && error == 0) {
+        error = saved_errno;
+      }
     }
-    errno = 0;
+  };
+
+  std::vector<std::thread> threads;
+  size_t workers = std::min<size_t>(std::thread::hardware_concurrency(), kMaxUnlinkWorkers);
+  for (size_t i = 1; i < std::min(workers, subdirs.size()); i++) {
+    threads.emplace_back(worker);
   }
-  /* in case readdir or unlink_recursive failed */
-  if (fail || errno < 0) {
-    int save = errno;
-    closedir(dir);
-    errno = save;
-    return -1;
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
   }
-
-  /* close directory handle */
-  if (closedir(dir) < 0) {
+  if (error != 0) {
+    errno = error;
     return -1;
   }
 
-  /* delete target directory */
+  fd.reset();
   return rmdir(path);
 }
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hashes batches of same-sized blocks, each on its own: the blocks of a package that
+// fuse_sideload verifies, or the blocks of a partition that the verity hash tree is built from.
+//
+// Blocks are hashed either one at a time with BoringSSL, which uses the SHA instructions of the
+// CPU (ARMv8 Crypto Extensions, x86 SHA extensions) where there are any, or, for SHA-256 on the
+// CPUs that have none, kMultiBufferLanes blocks at a time in the lanes of the SIMD registers
+// (NEON, SSE2). The fastest one for the CPU is picked at runtime.
+
+enum class BlockHashAlgorithm {
+  kSha1,
+  kSha256,
+};
+
+enum class BlockHashImplementation {
+  kOneAtATime,
+  kMultiBuffer,
+};
+
+// The number of blocks that the multi-buffer implementation hashes at a time.
+constexpr size_t kMultiBufferLanes = 4;
+
+// Returns the size of the digests of |algorithm|.
+size_t BlockDigestSize(BlockHashAlgorithm algorithm);
+
+// Returns the implementation that HashBlocks() uses on this CPU.
+BlockHashImplementation GetBlockHashImplementation();
+
+// Hashes the |count| blocks of |block_size| bytes at |data|, each prefixed with the |salt_size|
+// bytes of |salt| (e.g. for a verity hash tree), into the |count| digests at |digests|.
+void HashBlocks(BlockHashAlgorithm algorithm, const uint8_t* data, size_t block_size, size_t count,
+                uint8_t* digests, const uint8_t* salt = nullptr, size_t salt_size = 0);
+
+// Same as HashBlocks(), with the given |implementation|, for the tests and benchmarks. The
+// multi-buffer implementation only does SHA-256, and hashes SHA-1 blocks one at a time.
+void HashBlocksWith(BlockHashImplementation implementation, BlockHashAlgorithm algorithm,
+                    const uint8_t* data, size_t block_size, size_t count, uint8_t* digests,
+                    const uint8_t* salt = nullptr, size_t salt_size = 0);
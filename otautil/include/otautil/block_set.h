@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include "otautil/rangeset.h"
+
+// A set of block numbers, for the set algebra over whole partitions (millions of blocks) that would
+// take a lot of sorting and merging of Ranges as a RangeSet.
+//
+// As in a roaring bitmap, the blocks are grouped into chunks of 65536 by their high bits. Each
+// chunk that holds blocks keeps their low 16 bits in a sorted array while there are at most 4096
+// of them, and in a bitmap of 8 KiB otherwise. So sparse and dense sets both stay compact, and
+// unions, intersections and differences work a chunk (or a 64-bit word of a bitmap) at a time.
+class BlockSet {
+ public:
+  BlockSet() = default;
+
+  // Holds the blocks of |ranges|, which may overlap.
+  explicit BlockSet(const RangeSet& ranges);
+
+  // Returns the blocks as a RangeSet of sorted and coalesced ranges, or an empty RangeSet if there
+  // are none.
+  RangeSet ToRangeSet() const;
+
+  // Adds the blocks [range.first, range.second).
+  void Insert(const Range& range);
+
+  bool Contains(size_t block) const;
+
+  // Returns whether some blocks are in both sets.
+  bool Overlaps(const BlockSet& other) const;
+
+  // Returns the number of blocks in the set.
+  size_t blocks() const {
+    return blocks_;
+  }
+
+  bool empty() const {
+    return blocks_ == 0;
+  }
+
+  BlockSet& operator|=(const BlockSet& other);
+  BlockSet& operator&=(const BlockSet& other);
+  BlockSet& operator-=(const BlockSet& other);
+
+  friend BlockSet operator|(BlockSet a, const BlockSet& b) {
+    return a |= b;
+  }
+
+  friend BlockSet operator&(BlockSet a, const BlockSet& b) {
+    return a &= b;
+  }
+
+  friend BlockSet operator-(BlockSet a, const BlockSet& b) {
+    return a -= b;
+  }
+
+  bool operator==(const BlockSet& other) const;
+
+  bool operator!=(const BlockSet& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  // The blocks of a chunk: either the sorted |array| of their low bits, or the |bitmap| of them.
+  struct Chunk {
+    uint32_t key;
+    size_t blocks;
+    std::vector<uint16_t> array;
+    std::vector<uint64_t> bitmap;
+
+    bool is_bitmap() const {
+      return !bitmap.empty();
+    }
+
+    // Switches to the representation that suits the number of blocks.
+    void Normalize();
+    void ToBitmap();
+  };
+
+  // Returns the chunk with |key|, adding an empty one if needed.
+  Chunk* GetChunk(uint32_t key);
+
+  enum class Op { kUnion, kIntersection, kDifference };
+
+  // Replaces |chunk| with the result of |op| on it and |other|, a chunk of the same key.
+  static void Combine(Chunk* chunk, const Chunk& other, Op op);
+
+  // Recomputes |blocks_|, and drops the empty chunks.
+  void Update();
+
+  // Sorted by key.
+  std::vector<Chunk> chunks_;
+  size_t blocks_ = 0;
+};
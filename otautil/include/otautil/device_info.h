@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+// A snapshot of the read-only properties that describe the device (its name, bootloader, baseband
+// and build) and the install checks, read once per process on the first use. They can't change
+// once the device booted, so that the fastboot menu, the rescue queries from minadbd and the
+// install checks don't go through the property service each time they need them. The snapshot is
+// immutable once read, and safe to use from any thread.
+class DeviceInfo {
+ public:
+  // Returns the snapshot of this process, reading it first if needed.
+  static const DeviceInfo& Get();
+
+  // Returns the value of the property |name|, from the snapshot if it's one of the properties in
+  // it, reading it otherwise. Returns an empty string if the property isn't set.
+  std::string GetProperty(const std::string& name) const;
+
+  // Returns the property |name| parsed as a boolean or an integer, as android::base does, or
+  // |default_value| if it's not set or doesn't parse.
+  bool GetBoolProperty(const std::string& name, bool default_value) const;
+  int64_t GetIntProperty(const std::string& name, int64_t default_value) const;
+
+ private:
+  DeviceInfo();
+
+  std::map<std::string, std::string> properties_;
+};
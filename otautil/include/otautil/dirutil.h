@@ -42,7 +42,9 @@ int mkdir_recursively(const std::string& path, mode_t mode, bool strip_filename,
 int mkdir_recursively(const std::string& input_path, mode_t mode, bool strip_filename,
                       const selabel_handle* sehnd, const struct utimbuf* timestamp);
 
-// rm -rf <path>
+// rm -rf <path>. Symlinks are removed, never followed. The entries are removed relative to the fds
+// of their directories, and the subdirectories of |path| by a few threads in parallel. Returns 0 on
+// success; returns -1 (and sets errno) on the first failure.
 int dirUnlinkHierarchy(const char* path);
 
 #endif  // OTAUTIL_DIRUTIL_H_
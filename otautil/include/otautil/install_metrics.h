@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The install metrics are a binary record of the numbers that last_install reports (e.g. the time
+// the install took, the bytes written to each partition, the error code), so that recovery-persist
+// and the framework can read them without parsing the text log. The updater and InstallPackage()
+// append to Paths::temporary_install_metrics_file() as the install goes, and copy_logs() saves it
+// as last_install_metrics along with last_install.
+//
+// The file holds a header, then the entries, all little-endian:
+//   header: "IMET" <u32 version>
+//   entry:  <u16 name size> <u16 value size> <name> <value>
+// The entries are named after the last_install lines that they stand for (e.g. "time_total",
+// "bytes_written_system"), and the same name may show up more than once (e.g. for each stage of
+// the install). The value of an entry is an int64. Readers skip the values of any other size, which
+// is how new types of values can be added without another version; the version changes only with
+// the layout.
+
+constexpr uint32_t kInstallMetricsVersion = 1;
+
+// Appends the |metrics| (in name, value pairs) to the metrics file at |path|, which is created if
+// needed. Returns false on error.
+bool AppendInstallMetrics(const std::string& path,
+                          const std::vector<std::pair<std::string, int64_t>>& metrics);
+
+// Reads the metrics file at |path| one entry at a time, calling |callback| with the name and the
+// value of each, until it returns false. Returns false if the file can't be read or is malformed,
+// after passing on the entries up to the error.
+bool ReadInstallMetrics(const std::string& path,
+                        const std::function<bool(const std::string&, int64_t)>& callback);
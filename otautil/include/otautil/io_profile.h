@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+// The I/O profile of the storage of the device, as measured by MeasureIoProfile() ("Benchmark
+// storage" in recovery, or the rescue-benchmark service of minadbd) and kept in
+// Paths::io_profile_file(). The block image updates, update_verifier and the wipes take the queue
+// depth from it to choose how much I/O to keep in flight, and fall back to their own defaults on a
+// device that hasn't been profiled.
+//
+// The profile is stored as "key=value" lines, one per field below; unknown keys are ignored, so
+// that fields can be added later.
+struct IoProfile {
+  // Sequential throughput, in requests of 1 MiB.
+  uint64_t seq_read_kib_per_sec{ 0 };
+  uint64_t seq_write_kib_per_sec{ 0 };
+  // Random reads and writes of 4 KiB per second, one at a time.
+  uint64_t rand_read_iops{ 0 };
+  uint64_t rand_write_iops{ 0 };
+  // Random reads of 4 KiB per second, with |queue_depth| of them in flight.
+  uint64_t rand_read_iops_at_depth{ 0 };
+  // Discard throughput, 1 MiB at a time, or 0 if the file system doesn't punch holes.
+  uint64_t discard_kib_per_sec{ 0 };
+  // The median latency of an fsync(2) after a write of 4 KiB.
+  uint64_t fsync_latency_us{ 0 };
+  // The number of random reads in flight past which doubling them gains less than 10% of the
+  // throughput, i.e. the parallelism that the storage can make use of.
+  uint64_t queue_depth{ 0 };
+
+  // Reads the profile at |path| into |profile|. Returns false if the file is missing, or doesn't
+  // hold a valid queue depth.
+  static bool Read(const std::string& path, IoProfile* profile);
+
+  // Writes the profile to |path|, atomically. Returns false on failure.
+  bool Write(const std::string& path) const;
+
+  // Returns the "key=value" lines of the profile.
+  std::string ToString() const;
+};
+
+struct IoBenchmarkOptions {
+  // The size of the scratch file. The directory needs twice as much free space.
+  uint64_t file_size{ 64 * 1024 * 1024 };
+  // The number of random reads or writes of each measurement.
+  size_t random_ops{ 2048 };
+  // The deepest queue tried for the random reads.
+  size_t max_queue_depth{ 32 };
+};
+
+// Measures the I/O profile of the storage that |dir| is on, with a scratch file that it creates in
+// |dir| and deletes afterwards; nothing else is written. The reads and writes bypass the page cache
+// where the file system supports O_DIRECT. Returns false if there isn't enough free space, or on
+// I/O errors.
+bool MeasureIoProfile(const std::string& dir, const IoBenchmarkOptions& options,
+                      IoProfile* profile);
+
+// Returns the queue depth of the profile at Paths::io_profile_file(), capped at |max_depth|, or
+// |default_depth| if the device hasn't been profiled.
+size_t GetProfiledQueueDepth(size_t default_depth, size_t max_depth = SIZE_MAX);
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+
+// A log sink that appends lines to a ring buffer in memory, and writes them out to a file in
+// batches from a thread of its own, instead of with a write(2) per line. Appending is lock-free:
+// a line reserves its space with an atomic add, is copied in, and is committed once the lines
+// reserved before it are, so that the output keeps the order of the reservations. A line only
+// waits if the ring is full, until the flusher has written enough of it out.
+//
+// The flusher writes out the ring once it's half full, or once per flush interval, so that the
+// file is never far behind. Flush() writes out all that's been appended so far, and the buffer
+// set with FlushLogBufferOnExit() is also flushed at exit(3) and on fatal signals (including the
+// abort of LOG(FATAL)), so that no lines are lost when the process ends or crashes.
+class LogBuffer {
+ public:
+  static constexpr size_t kDefaultCapacity = 256 * 1024;
+  static constexpr std::chrono::milliseconds kDefaultFlushInterval{ 100 };
+
+  // Writes to |fd|, which stays owned by the caller. |capacity| is rounded up to a power of two.
+  explicit LogBuffer(int fd, size_t capacity = kDefaultCapacity,
+                     std::chrono::milliseconds flush_interval = kDefaultFlushInterval);
+  // Flushes the buffer, and stops the flusher.
+  ~LogBuffer();
+
+  LogBuffer(const LogBuffer&) = delete;
+  LogBuffer& operator=(const LogBuffer&) = delete;
+
+  // Appends |line| and a newline. Lines too large for the ring are written out at once instead.
+  void Append(std::string_view line);
+
+  // Writes out all the lines appended so far.
+  void Flush();
+
+  // Like Flush(), but only makes async-signal-safe calls and takes no lock. Meant for a process
+  // that's about to die; a line that's being appended concurrently may be lost.
+  void FlushFromSignalHandler();
+
+ private:
+  // Writes out the committed lines, from |flushed_| on.
+  void WriteCommitted();
+  void FlusherLoop();
+
+  const int fd_;
+  const size_t capacity_;
+  const std::chrono::milliseconds flush_interval_;
+  std::unique_ptr<char[]> data_;
+
+  // The counts of bytes reserved, committed (copied in, along with all those before them) and
+  // written out since the start. Their values modulo |capacity_| are offsets into |data_|.
+  std::atomic<uint64_t> reserved_{ 0 };
+  std::atomic<uint64_t> committed_{ 0 };
+  std::atomic<uint64_t> flushed_{ 0 };
+
+  // Serializes the writes of the flusher and Flush().
+  std::mutex write_mutex_;
+
+  // Wakes the flusher up before its interval, when the ring fills up.
+  std::mutex flusher_mutex_;
+  std::condition_variable flusher_cv_;
+  bool stop_{ false };
+  std::thread flusher_;
+};
+
+// Flushes |buffer| at exit(3), on fatal signals (SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV) and on
+// LOG(FATAL), until it's set to nullptr. The signals are then handled as they were before. There's
+// one such buffer per process.
+void FlushLogBufferOnExit(LogBuffer* buffer);
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// The priorities of the memory that a MemoryGovernor hands out.
+enum class MemoryPriority {
+  // Memory that only makes things faster, and may be given back at any time: the FUSE block cache,
+  // the inflated patch sources and the animation frames.
+  kCache,
+  // Memory that an install can't do without (e.g. the stashes of a block-based update). Caches are
+  // shrunk to make room for it.
+  kRequired,
+};
+
+// How a MemoryGovernor sees the memory behind a reservation.
+struct MemoryConsumer {
+  // Returns how much of the reservation is in use (and so already accounted for in MemAvailable).
+  // Without it, none of the reservation counts as in use, for as long as it's held.
+  std::function<size_t()> usage;
+  // Gives back |bytes| of the reservation if it can, freeing what it no longer fits in, and returns
+  // how much it gave back (which may be more or less than asked). Only kCache reservations are
+  // shrunk.
+  std::function<size_t(size_t bytes)> shrink;
+};
+
+// Splits the memory of the device between the caches and buffers of recovery, so that together
+// they don't run a low-memory (e.g. 2 GiB) device out of memory. Each subsystem reserves its budget
+// up front, and the governor grants what fits in the available memory (MemAvailable in
+// /proc/meminfo) past a headroom that depends on the priority: the caches leave a large headroom
+// to everything else, the required memory only a small one. When a required reservation doesn't
+// fit, or when Rebalance() finds the available memory below the cache headroom, the caches are
+// shrunk, the largest first.
+//
+// The available memory is shared with other processes, which is how the updater and recovery
+// cooperate: the stashes that the updater allocates lower MemAvailable, so the next Rebalance() in
+// recovery shrinks the FUSE block cache and the animation frames to make up for them.
+//
+// The callbacks of the consumers run on the thread that calls Reserve() or Rebalance(), with the
+// governor's lock held: they must not call back into the governor, and neither Reserve() nor
+// Rebalance() may be called with a lock held that the callbacks take.
+class MemoryGovernor {
+ public:
+  class Reservation;
+
+  // The headroom of each priority, and the least time between two rebalances.
+  static constexpr size_t kDefaultCacheHeadroom = 512 * 1024 * 1024;
+  static constexpr size_t kDefaultRequiredHeadroom = 32 * 1024 * 1024;
+  static constexpr std::chrono::milliseconds kDefaultRebalanceInterval{ 1000 };
+
+  // Returns the governor of this process, for the memory in /proc/meminfo.
+  static MemoryGovernor& Get();
+
+  MemoryGovernor(const std::string& meminfo_path, size_t cache_headroom, size_t required_headroom,
+                 std::chrono::milliseconds rebalance_interval);
+
+  MemoryGovernor(const MemoryGovernor&) = delete;
+  MemoryGovernor& operator=(const MemoryGovernor&) = delete;
+
+  // Reserves between |min_bytes| and |max_bytes| for |name|, as much as fits. Returns nullptr if
+  // not even |min_bytes| fits, after shrinking the caches for a kRequired reservation. The
+  // reservation is released when the returned object is destroyed.
+  std::unique_ptr<Reservation> Reserve(const std::string& name, MemoryPriority priority,
+                                       size_t min_bytes, size_t max_bytes,
+                                       MemoryConsumer consumer = {});
+
+  // Shrinks the caches if the available memory fell below the cache headroom. This does nothing
+  // if called again within the rebalance interval, so it's cheap to call from a busy loop. Returns
+  // how much the caches gave back.
+  size_t Rebalance();
+
+  // Returns the memory available to new reservations of |priority|.
+  size_t GetAvailable(MemoryPriority priority);
+
+ private:
+  struct Entry {
+    std::string name;
+    MemoryPriority priority;
+    size_t granted;
+    MemoryConsumer consumer;
+  };
+
+  // Reads MemAvailable (or an estimate of it on older kernels) in bytes. Returns false if it can't
+  // be read, in which case the governor grants every reservation in full.
+  bool ReadAvailableMemory(size_t* bytes) const;
+  // Returns how much of the reservations isn't in use yet, and so isn't accounted for in
+  // MemAvailable. Must be called with |mutex_| held.
+  size_t GetOutstanding() const;
+  // Returns the room left for reservations of |priority|, or SIZE_MAX if the available memory is
+  // unknown. Must be called with |mutex_| held.
+  size_t GetRoom(MemoryPriority priority) const;
+  // Asks the caches to give back |bytes| in all, the largest first. Returns how much they gave
+  // back. Must be called with |mutex_| held.
+  size_t ShrinkCaches(size_t bytes);
+
+  const std::string meminfo_path_;
+  const size_t cache_headroom_;
+  const size_t required_headroom_;
+  const std::chrono::milliseconds rebalance_interval_;
+
+  std::mutex mutex_;
+  std::list<Entry> entries_;
+  std::chrono::steady_clock::time_point last_rebalance_;
+};
+
+// The memory reserved from a MemoryGovernor, which is given back on destruction.
+class MemoryGovernor::Reservation {
+ public:
+  ~Reservation();
+
+  Reservation(const Reservation&) = delete;
+  Reservation& operator=(const Reservation&) = delete;
+
+  // Returns how much memory is granted: what Reserve() granted, less what the consumer freed when
+  // shrunk since.
+  size_t bytes() const;
+
+ private:
+  friend class MemoryGovernor;
+
+  Reservation(MemoryGovernor* governor, std::list<Entry>::iterator entry)
+      : governor_(governor), entry_(entry) {}
+
+  MemoryGovernor* governor_;
+  std::list<Entry>::iterator entry_;
+};
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+// A copy of the mount table (/proc/self/mounts by default), read again only once the table has
+// changed. The kernel flags every mount and unmount to poll(2) on an open /proc/self/mounts, so
+// checking for a change costs a syscall, instead of reading and parsing the whole table: callers
+// that ask if a volume is mounted in a loop don't read the table over and over. A table that
+// can't be watched that way (e.g. a regular file, in tests) is read on every Refresh().
+//
+// Not thread-safe: callers that share a table serialize the calls to it.
+class MountTable {
+ public:
+  struct Mount {
+    std::string device;
+    std::string mount_point;
+    std::string filesystem;
+    std::string flags;
+  };
+
+  explicit MountTable(const std::string& path = "/proc/self/mounts");
+
+  // Brings the copy up to date, reading the table if it changed since it was last read. Returns
+  // false if it can't be read.
+  bool Refresh();
+
+  // Has the next Refresh() read the table, whether or not it's known to have changed.
+  void Invalidate() {
+    stale_ = true;
+  }
+
+  // Returns the (first) mount at |mount_point|, or nullptr. Valid until the next Refresh().
+  Mount* FindByMountPoint(std::string_view mount_point);
+
+  // Returns the mounts of |device|, in the order of the table. Valid until the next Refresh().
+  std::vector<const Mount*> FindByDevice(std::string_view device) const;
+
+  const std::vector<Mount>& mounts() const {
+    return mounts_;
+  }
+
+  // The number of times the table has been read.
+  size_t reads() const {
+    return reads_;
+  }
+
+ private:
+  // Returns whether the kernel flags a change since the last call.
+  bool PollChanged();
+
+  const std::string path_;
+  // The table, kept open to be polled for changes, or -1 if it can't be.
+  android::base::unique_fd watch_fd_;
+  bool watch_opened_{ false };
+  bool stale_{ true };
+  size_t reads_{ 0 };
+
+  std::vector<Mount> mounts_;
+  std::map<std::string, size_t, std::less<>> by_mount_point_;
+  std::multimap<std::string, size_t, std::less<>> by_device_;
+};
@@ -22,10 +22,13 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <ziparchive/zip_archive.h>
 
+#include "otautil/package_metadata.h"
 #include "otautil/verifier.h"
 
 enum class PackageType {
@@ -33,6 +36,14 @@ enum class PackageType {
   kFile,
 };
 
+// The phase of the install that is about to read the package.
+enum class PackageAccess {
+  // The package is hashed front to back.
+  kVerify,
+  // The zip entries are read, with little order.
+  kInstall,
+};
+
 // This class serves as a wrapper for an OTA update package. It aims to provide the common
 // interface for both packages loaded in memory and packages read from fd.
 class Package : public VerifierInterface {
@@ -41,6 +52,18 @@ class Package : public VerifierInterface {
       const std::string& path, const std::function<void(float)>& set_progress);
   static std::unique_ptr<Package> CreateMemoryPackage(
       std::vector<uint8_t> content, const std::function<void(float)>& set_progress);
+  // Creates a package of the bytes in |content|, a contiguous container of bytes or chars (e.g. a
+  // std::vector<uint8_t> or a std::string) that's moved in, and kept with no copy.
+  template <typename Container>
+  static std::unique_ptr<Package> AdoptMemoryPackage(
+      Container&& content, const std::function<void(float)>& set_progress) {
+    static_assert(!std::is_lvalue_reference_v<Container>, "the content must be moved in");
+    static_assert(sizeof(typename Container::value_type) == 1, "the content must be bytes");
+    auto owner = std::make_shared<Container>(std::move(content));
+    auto addr = reinterpret_cast<const uint8_t*>(owner->data());
+    uint64_t size = owner->size();
+    return CreateMemoryPackage(std::move(owner), addr, size, set_progress);
+  }
   static std::unique_ptr<Package> CreateFilePackage(const std::string& path,
                                                     const std::function<void(float)>& set_progress);
 
@@ -53,10 +76,27 @@ class Package : public VerifierInterface {
   // Opens the package as a zip file and returns the ZipArchiveHandle.
   virtual ZipArchiveHandle GetZipArchiveHandle() = 0;
 
+  // Returns the metadata of the package, read from the zip on the first call and kept for the
+  // checks that follow, or nullptr if the package has none.
+  const PackageMetadata* GetMetadata();
+
+  // Tunes the kernel's paging of the package for the phase that follows.
+  virtual void PrepareForAccess(PackageAccess access) = 0;
+
   // Updates the progress in fraction during package verification.
   void SetProgress(float progress) override;
 
  protected:
   // An optional function to update the progress.
   std::function<void(float)> set_progress_;
+
+ private:
+  // The metadata, once read (successfully or not).
+  bool metadata_read_ = false;
+  std::unique_ptr<PackageMetadata> metadata_;
+
+  // Creates a package of the |size| bytes at |addr|, which stay valid as long as |owner| is held.
+  static std::unique_ptr<Package> CreateMemoryPackage(
+      std::shared_ptr<const void> owner, const uint8_t* addr, uint64_t size,
+      const std::function<void(float)>& set_progress);
 };
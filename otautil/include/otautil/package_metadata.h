@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <ziparchive/zip_archive.h>
+
+// The metadata of an OTA package, read once: the "key=value" lines of
+// META-INF/com/android/metadata, and the serialized OtaMetadata of META-INF/com/android/metadata.pb.
+// The keys and values are views into the text that the object holds, indexed by a vector sorted by
+// key; the object is therefore never copied.
+class PackageMetadata {
+ public:
+  // Parses the "key=value" lines of |text|, trimming the keys and the values. As with a std::map
+  // filled in order, the first of the lines with the same key wins.
+  explicit PackageMetadata(std::string text = "", std::string ota_metadata = "");
+
+  PackageMetadata(const PackageMetadata&) = delete;
+  PackageMetadata& operator=(const PackageMetadata&) = delete;
+
+  // Reads the metadata entries of |zip|. Returns nullptr if the metadata entry is missing or can't
+  // be read; a missing metadata.pb only leaves ota_metadata() empty.
+  static std::unique_ptr<PackageMetadata> Read(ZipArchiveHandle zip);
+
+  // Returns the value of |key|, or an empty string if the key isn't present.
+  std::string_view Get(std::string_view key) const;
+
+  // Returns the (key, value) pairs, sorted by key.
+  const std::vector<std::pair<std::string_view, std::string_view>>& entries() const {
+    return index_;
+  }
+
+  // Returns the serialized OtaMetadata protobuf, or an empty string if the package has none.
+  const std::string& ota_metadata() const {
+    return ota_metadata_;
+  }
+
+ private:
+  std::string text_;
+  std::string ota_metadata_;
+  std::vector<std::pair<std::string_view, std::string_view>> index_;
+};
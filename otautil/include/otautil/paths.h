@@ -22,7 +22,8 @@
 #include <android-base/macros.h>
 
 // A singleton class to maintain the update related paths. The paths should be only set once at the
-// start of the program.
+// start of the program, before it starts any thread; from then on they're only read, which any
+// thread can do without locking.
 class Paths {
  public:
   static Paths& Get();
@@ -41,6 +42,13 @@ class Paths {
     cache_temp_source_ = temp_source;
   }
 
+  std::string io_profile_file() const {
+    return io_profile_file_;
+  }
+  void set_io_profile_file(const std::string& profile_file) {
+    io_profile_file_ = profile_file;
+  }
+
   std::string last_command_file() const {
     return last_command_file_;
   }
@@ -69,6 +77,13 @@ class Paths {
     temporary_install_file_ = install_file;
   }
 
+  std::string temporary_install_metrics_file() const {
+    return temporary_install_metrics_file_;
+  }
+  void set_temporary_install_metrics_file(const std::string& metrics_file) {
+    temporary_install_metrics_file_ = metrics_file;
+  }
+
   std::string temporary_log_file() const {
     return temporary_log_file_;
   }
@@ -76,6 +91,13 @@ class Paths {
     temporary_log_file_ = log_file;
   }
 
+  std::string temporary_startup_trace_file() const {
+    return temporary_startup_trace_file_;
+  }
+  void set_temporary_startup_trace_file(const std::string& trace_file) {
+    temporary_startup_trace_file_ = trace_file;
+  }
+
   std::string temporary_update_binary() const {
     return temporary_update_binary_;
   }
@@ -83,6 +105,13 @@ class Paths {
     temporary_update_binary_ = update_binary;
   }
 
+  std::string temporary_update_trace_file() const {
+    return temporary_update_trace_file_;
+  }
+  void set_temporary_update_trace_file(const std::string& trace_file) {
+    temporary_update_trace_file_ = trace_file;
+  }
+
  private:
   Paths();
   DISALLOW_COPY_AND_ASSIGN(Paths);
@@ -96,6 +125,9 @@ class Paths {
   // the cached file contains the bits we want and use it as the source instead.
   std::string cache_temp_source_;
 
+  // Path to the I/O profile of the storage, as measured by the storage benchmark of recovery.
+  std::string io_profile_file_;
+
   // Path to the last command file.
   std::string last_command_file_;
 
@@ -108,11 +140,21 @@ class Paths {
   // Path to the temporary file that contains the install result.
   std::string temporary_install_file_;
 
+  // Path to the temporary file that contains the install metrics, in the binary format of
+  // otautil/install_metrics.h.
+  std::string temporary_install_metrics_file_;
+
   // Path to the temporary log file while under recovery.
   std::string temporary_log_file_;
 
+  // Path to the temporary file that contains the trace of the recovery startup.
+  std::string temporary_startup_trace_file_;
+
   // Path to the temporary update binary while installing a non-A/B package.
   std::string temporary_update_binary_;
+
+  // Path to the temporary file that contains the per-command trace of block image updates.
+  std::string temporary_update_trace_file_;
 };
 
 #endif  // _OTAUTIL_PATHS_H_
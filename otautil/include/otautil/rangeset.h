@@ -20,6 +20,7 @@
 
 #include <optional>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -32,8 +33,8 @@ class RangeSet {
   explicit RangeSet(std::vector<Range>&& pairs);
 
   // Parses the given string into a RangeSet. Returns the parsed RangeSet, or an empty RangeSet on
-  // errors.
-  static RangeSet Parse(const std::string& range_text);
+  // errors. The text is scanned in place, with no allocation but the one for the ranges.
+  static RangeSet Parse(std::string_view range_text);
 
   // Appends the given Range to the current RangeSet.
   bool PushBack(Range range);
@@ -43,17 +44,18 @@ class RangeSet {
 
   std::string ToString() const;
 
-  // Gets the block number for the i-th (starting from 0) block in the RangeSet.
+  // Gets the block number for the i-th (starting from 0) block in the RangeSet, in O(log n).
   size_t GetBlockNumber(size_t idx) const;
 
   // Returns whether the current RangeSet overlaps with other. RangeSet has half-closed half-open
   // bounds. For example, "3,5" contains blocks 3 and 4. So "3,5" and "5,7" are not overlapped.
+  // Large RangeSets are compared with a merge of their sorted ranges, in O(n log n + m log m).
   bool Overlaps(const RangeSet& other) const;
 
   // Returns a subset of ranges starting from |start_index| with respect to the original range. The
   // output range will have |num_of_blocks| blocks in size. Returns std::nullopt if the input is
   // invalid. e.g. RangeSet({{0, 5}, {10, 15}}).GetSubRanges(1, 5) returns
-  // RangeSet({{1, 5}, {10, 11}}).
+  // RangeSet({{1, 5}, {10, 11}}). The first range is found in O(log n).
   std::optional<RangeSet> GetSubRanges(size_t start_index, size_t num_of_blocks) const;
 
   // Returns a vector of RangeSets that contain the same set of blocks represented by the current
@@ -82,14 +84,6 @@ class RangeSet {
     return ranges_.cend();
   }
 
-  std::vector<Range>::iterator begin() {
-    return ranges_.begin();
-  }
-
-  std::vector<Range>::iterator end() {
-    return ranges_.end();
-  }
-
   std::vector<Range>::const_iterator begin() const {
     return ranges_.begin();
   }
@@ -126,8 +120,17 @@ class RangeSet {
   }
 
  protected:
+  // Returns the index in |ranges_| of the range that holds the i-th block.
+  size_t FindRangeIndex(size_t idx) const;
+
+  // Recomputes |offsets_| after a change to |ranges_|.
+  void UpdateOffsets();
+
   // Actual limit for each value and the total number are both INT_MAX.
   std::vector<Range> ranges_;
+  // The number of blocks in the ranges before each of |ranges_|, for the binary searches by block
+  // index.
+  std::vector<size_t> offsets_;
   size_t blocks_;
 };
 
@@ -172,6 +175,6 @@ class SortedRangeSet : public RangeSet {
   //
   // An offset of 65546 falls into the 16-th block in a file. Block 16 is contained as the 10-th
   // item in SortedRangeSet("1-9 15-19"). So its data can be found at offset 40970 (i.e. 4096 * 10
-  // + 10) in a range represented by this SortedRangeSet.
+  // + 10) in a range represented by this SortedRangeSet. The block is found in O(log n).
   size_t GetOffsetInRangeSet(size_t old_offset) const;
 };
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sched.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+// The kinds of threads that a SchedPolicy places apart.
+enum class ThreadClass {
+  // The heavy lifting of an install: verifying, patching and hashing, in recovery as in the
+  // updater and the FUSE server that it starts.
+  kCompute,
+  // Rendering and input handling, which only need to keep up with the screen.
+  kUi,
+};
+
+// The settings of a SchedPolicy, which a device may change (see Device::GetSchedOptions()).
+struct SchedOptions {
+  // Whether to pin the threads to the big or the little cores.
+  bool pin_threads = true;
+  // The nice values of the thread classes.
+  int compute_nice = 0;
+  int ui_nice = 0;
+  // The best-effort I/O priorities of the thread classes, from 0 (the highest) to 7, or -1 to keep
+  // the inherited one.
+  int compute_io_priority = 0;
+  int ui_io_priority = 7;
+};
+
+// Places the threads of recovery on a heterogeneous (big.LITTLE) CPU: the compute threads on the
+// big cores and the UI threads on the little ones, so that the bsdiff and SHA work of an install
+// doesn't end up on a little core while an animation keeps a big one busy. The cores are told apart
+// by their capacity in sysfs (cpu_capacity, or cpufreq/cpuinfo_max_freq without it): the little
+// cores are the ones of the lowest capacity, and the big cores all the others. Threads are left on
+// all the cores when these are all alike, or when the capacity of any of them is unknown.
+//
+// A policy applies to the calling thread, and so to the threads and processes that it starts from
+// then on (e.g. the updater inherits the policy of the thread that forks it). ScopedSchedPolicy
+// undoes it, for the threads that go back to other work afterwards.
+class SchedPolicy {
+ public:
+  // Returns the policy for the CPUs in /sys/devices/system/cpu.
+  static SchedPolicy& Get();
+
+  explicit SchedPolicy(const std::string& cpu_dir);
+
+  void SetOptions(const SchedOptions& options);
+
+  // Returns the CPUs that the threads of |thread_class| are pinned to, or an empty list if they
+  // aren't pinned.
+  std::vector<int> GetCpus(ThreadClass thread_class);
+
+  // Applies the affinity, nice value and I/O priority of |thread_class| to the calling thread.
+  // Returns false if any of them fails to apply.
+  bool Apply(ThreadClass thread_class);
+
+ private:
+  // Reads the capacities of the CPUs into |big_cpus_| and |little_cpus_|, on the first call. Must
+  // be called with |mutex_| held.
+  void MaybeReadTopology();
+
+  const std::string cpu_dir_;
+
+  std::mutex mutex_;
+  SchedOptions options_;
+  bool topology_read_{ false };
+  std::vector<int> big_cpus_;
+  std::vector<int> little_cpus_;
+};
+
+// Applies the policy of |thread_class| to the calling thread for the lifetime of the object, and
+// then restores the affinity, nice value and I/O priority that the thread had before. Must be
+// destroyed on the thread that created it.
+class ScopedSchedPolicy {
+ public:
+  ScopedSchedPolicy(SchedPolicy* policy, ThreadClass thread_class);
+  ~ScopedSchedPolicy();
+
+  ScopedSchedPolicy(const ScopedSchedPolicy&) = delete;
+  ScopedSchedPolicy& operator=(const ScopedSchedPolicy&) = delete;
+
+ private:
+  // The settings to restore, if they could be read.
+  bool affinity_saved_{ false };
+  cpu_set_t affinity_;
+  bool nice_saved_{ false };
+  int nice_{ 0 };
+  int io_priority_{ -1 };
+};
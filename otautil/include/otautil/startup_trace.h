@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/macros.h>
+
+// Records the steps of the recovery startup (e.g. parsing the volume table, reading the BCB,
+// initializing the graphics), with the time that each of them took on which thread. Once recovery
+// is up, the trace is written to Paths::temporary_startup_trace_file() in the JSON trace event
+// format, which Perfetto and chrome://tracing open, and copy_logs() saves it with the other logs.
+//
+// The timestamps are those of CLOCK_BOOTTIME, so that the trace also shows how long it took to get
+// to recovery since the (re)boot.
+class StartupTrace {
+ public:
+  // Returns the trace of the current recovery process.
+  static StartupTrace& Get();
+
+  // Returns the CLOCK_BOOTTIME time, in microseconds.
+  static uint64_t NowUs();
+
+  // Records the step |name| that ran from |begin_us| to |end_us| on the calling thread.
+  void AddEvent(const std::string& name, uint64_t begin_us, uint64_t end_us);
+
+  // Returns the trace, as a JSON object with the events in the order they ended, and the build
+  // fingerprint in "otherData".
+  std::string ToJson() const;
+
+  // Writes the trace to |path|. Returns false on error.
+  bool Write(const std::string& path) const;
+
+ private:
+  struct Event {
+    std::string name;
+    uint64_t begin_us;
+    uint64_t end_us;
+    pid_t tid;
+  };
+
+  mutable std::mutex mutex_;
+  std::vector<Event> events_;
+};
+
+// Records the time spent in its scope as the step |name| of the startup trace.
+class ScopedStartupTrace {
+ public:
+  explicit ScopedStartupTrace(const std::string& name)
+      : name_(name), begin_us_(StartupTrace::NowUs()) {}
+
+  ~ScopedStartupTrace() {
+    StartupTrace::Get().AddEvent(name_, begin_us_, StartupTrace::NowUs());
+  }
+
+ private:
+  const std::string name_;
+  const uint64_t begin_us_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedStartupTrace);
+};
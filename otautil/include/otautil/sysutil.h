@@ -78,14 +78,39 @@ class BlockMapData {
  */
 class MemMapping {
  public:
+  // How the mapping is about to be read, for Advise().
+  enum class Access {
+    // Front to back, once (e.g. to verify a package): aggressive read-ahead, and the pages that
+    // were read go first under memory pressure.
+    kSequential,
+    // Here and there (e.g. zip entries): the kernel's default read-around.
+    kNormal,
+  };
+
   ~MemMapping();
   // Map a file into a private, read-only memory segment. If 'filename' begins with an '@'
   // character, it is a map of blocks to be mapped, otherwise it is treated as an ordinary file.
   bool MapFile(const std::string& filename);
+  // Map the first 'size' bytes of the given file into a private, read-only memory segment. Unlike
+  // MapFile(), this also works for block devices, whose size can't be found with fstat(2).
+  bool MapDevice(const std::string& path, size_t size);
   size_t ranges() const {
     return ranges_.size();
   };
 
+  // Advises the kernel of how the whole mapping is about to be read.
+  bool Advise(Access access) const;
+
+  // Faults in the pages of [offset, offset + size) of the mapping, reading them from the file if
+  // needed, so that the reads that follow don't fault one page (or read-around window) at a time.
+  // Returns false if they couldn't be prefaulted, e.g. because the kernel predates
+  // MADV_POPULATE_READ (Linux 5.14); they're then faulted in on first access as usual.
+  bool Prefault(size_t offset, size_t size) const;
+
+  // Starts reading the pages of [offset, offset + size) of the mapping in the background
+  // (MADV_WILLNEED), without waiting for them as Prefault() does.
+  bool WillNeed(size_t offset, size_t size) const;
+
   unsigned char* addr;  // start of data
   size_t length;        // length of data
 
@@ -97,6 +122,7 @@ class MemMapping {
 
   bool MapBlockFile(const std::string& filename);
   bool MapFD(int fd);
+  bool MapFD(int fd, size_t size);
 
   std::vector<MappedRange> ranges_;
 };
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scales the parallelism of an install (the worker threads that patch, hash or extract, and the
+// depth of the I/O queues) with the thermal headroom of the device: full speed while it's well
+// below its thermal limits, down to a single worker at them. A cool device thus runs as fast as it
+// can, instead of the install being tuned for the worst case.
+//
+// The limits are the lowest passive, hot or critical trip point of each thermal zone in sysfs, and
+// the headroom is the smallest distance of a zone to its limit. Zones without trip points aren't
+// considered, so a device that exposes none is never throttled. The temperatures are sampled at
+// most once per sample interval, as the callers ask for their scale. Slowing down takes effect at
+// once, while speeding up again is limited to one step per sample, so that the parallelism doesn't
+// bounce around a limit.
+class ThermalThrottle {
+ public:
+  // The headroom (in millidegree Celsius) from which the install runs at full speed.
+  static constexpr int kFullSpeedHeadroom = 10000;
+  // The most that the level can go up by per sample.
+  static constexpr double kSpeedUpStep = 0.25;
+  static constexpr std::chrono::milliseconds kSampleInterval{ 2000 };
+
+  // Returns the throttle for the thermal zones in /sys/class/thermal.
+  static ThermalThrottle& Get();
+
+  explicit ThermalThrottle(const std::string& thermal_dir,
+                           std::chrono::milliseconds sample_interval = kSampleInterval);
+
+  // Returns how many of |max| workers (or I/Os in flight) to run now, between 1 and |max|.
+  size_t Scale(size_t max);
+
+  // Returns the current level, from 0 (at the thermal limits) to 1 (full speed).
+  double level();
+
+ private:
+  struct Zone {
+    std::string temp_path;
+    int limit;
+  };
+
+  // Reads the temperatures and updates |level_|, if the sample interval has passed. Must be called
+  // with |mutex_| held.
+  void MaybeSample();
+
+  const std::string thermal_dir_;
+  const std::chrono::milliseconds sample_interval_;
+
+  std::mutex mutex_;
+  // The zones with trip points, found on the first sample.
+  std::vector<Zone> zones_;
+  bool sampled_{ false };
+  std::chrono::steady_clock::time_point last_sample_;
+  double level_{ 1.0 };
+};
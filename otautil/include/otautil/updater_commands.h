@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+// The commands that the updater sends to recovery through the command pipe (see TryUpdateBinary()
+// for what they do). They're text lines, or frames in the binary form of the protocol: an 8-byte
+// header with the type and the size of the payload, then the payload. The progress commands have
+// fixed-size payloads (a double fraction, and an int32_t of seconds for PROGRESS), the others have
+// their string argument, if any. Both ends run on the same device, so the numbers are in its byte
+// order.
+//
+// Recovery offers the binary form by setting kBinaryCommandsEnv to "1" for the updater. The
+// updater accepts it by sending the text line kBinaryCommandsAccept, and sends frames from then
+// on. Updaters that predate the binary form ignore the offer, and keep to text.
+
+constexpr const char* kBinaryCommandsEnv = "RECOVERY_BINARY_COMMANDS";
+constexpr const char* kBinaryCommandsAccept = "binary_commands";
+
+enum class UpdaterCommandType : uint8_t {
+  // A command without a binary form of its own, as its text line in |text|. Also any command that
+  // the reader doesn't know.
+  TEXT = 0,
+  PROGRESS = 1,
+  SET_PROGRESS = 2,
+  UI_PRINT = 3,
+  LOG = 4,
+  STAGE = 5,
+  WIPE_CACHE = 6,
+  CLEAR_DISPLAY = 7,
+  ENABLE_REBOOT = 8,
+  RETRY_UPDATE = 9,
+  // A known command with invalid arguments, as its text line in |text|. Never sent.
+  INVALID = 255,
+};
+
+struct UpdaterCommand {
+  UpdaterCommandType type{ UpdaterCommandType::TEXT };
+  // For PROGRESS and SET_PROGRESS.
+  double fraction{ 0 };
+  // For PROGRESS.
+  int seconds{ 0 };
+  // The argument of UI_PRINT, LOG and STAGE, or the line of TEXT and INVALID.
+  std::string text;
+};
+
+// Returns the text line of |command|, without the newline.
+std::string FormatUpdaterCommandLine(const UpdaterCommand& command);
+
+// Appends the frame of |command| to |frame|.
+void EncodeUpdaterCommandFrame(const UpdaterCommand& command, std::string* frame);
+
+// Parses a text line of the protocol (without the newline) into |command|. Returns false for a line
+// without a command, which is to be skipped.
+bool ParseUpdaterCommandLine(std::string_view line, UpdaterCommand* command);
+
+// Reads the commands from the command pipe, in either form, switching to frames when the updater
+// accepts the binary form.
+class UpdaterCommandReader {
+ public:
+  // The largest line or frame payload taken. Longer lines are split, and larger frames are an
+  // error.
+  static constexpr size_t kMaxCommandSize = 1024 * 1024;
+
+  explicit UpdaterCommandReader(android::base::unique_fd fd);
+
+  // Reads the next command into |command|. Returns false once the updater closes the pipe, or on a
+  // read error or a malformed frame (after which the rest can't be read).
+  bool Next(UpdaterCommand* command);
+
+  // Whether the updater has accepted the binary form.
+  bool binary() const {
+    return binary_;
+  }
+
+ private:
+  // Reads more of the pipe into |buffer_|, keeping the data that's yet to be taken. Returns false
+  // at the end of the pipe, or on error.
+  bool Fill();
+  bool NextFrame(UpdaterCommand* command);
+
+  android::base::unique_fd fd_;
+  std::vector<char> buffer_;
+  // The data that's yet to be taken, in |buffer_|.
+  size_t start_{ 0 };
+  size_t end_{ 0 };
+  bool eof_{ false };
+  bool binary_{ false };
+};
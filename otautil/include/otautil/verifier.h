@@ -57,6 +57,9 @@ struct Certificate {
   KeyType key_type;
   std::unique_ptr<RSA, RSADeleter> rsa;
   std::unique_ptr<EC_KEY, ECKEYDeleter> ec;
+  // The DER IssuerAndSerialNumber of the certificate, which a PKCS#7 SignerInfo names its signer
+  // by, or empty if unknown.
+  std::vector<uint8_t> signer_id;
 };
 
 class VerifierInterface {
@@ -69,10 +72,15 @@ class VerifierInterface {
   // Reads |byte_count| data starting from |offset|, and puts the result in |buffer|.
   virtual bool ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint64_t offset) = 0;
 
-  // Updates the hash contexts for |length| bytes data starting from |start|.
+  // Updates the hash contexts for |length| bytes data starting from |start|. The data may be fed
+  // in several chunks, in order; for each chunk, the hashers may run concurrently.
   virtual bool UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers, uint64_t start,
                                   uint64_t length) = 0;
 
+  // Hints that the |length| bytes at |offset| are about to be read, so that they can be read ahead
+  // in the background. It doesn't block, and doesn't fail; the default does nothing.
+  virtual void Prefetch(uint64_t /* offset */, uint64_t /* length */) {}
+
   // Updates the progress in fraction during package verification.
   virtual void SetProgress(float progress) = 0;
 };
@@ -94,7 +102,9 @@ bool CheckECKey(const std::unique_ptr<EC_KEY, ECKEYDeleter>& ec_key);
 bool LoadCertificateFromBuffer(const std::vector<uint8_t>& pem_content, Certificate* cert);
 
 // Iterates over the zip entries with the suffix "x509.pem" and returns a list of recognized
-// certificates. Returns an empty list if we fail to parse any of the entries.
+// certificates. Returns an empty list if we fail to parse any of the entries. The keys are parsed
+// once per process, and parsed again only once the zip changes (by its device, inode, size or
+// mtime).
 std::vector<Certificate> LoadKeysFromZipfile(const std::string& zip_name);
 
 #define VERIFY_SUCCESS 0
@@ -17,13 +17,63 @@
 #ifndef _OTAUTIL_ZIPUTIL_H
 #define _OTAUTIL_ZIPUTIL_H
 
+#include <stdint.h>
 #include <utime.h>
 
+#include <functional>
 #include <string>
+#include <vector>
 
+#include <android-base/unique_fd.h>
 #include <selinux/label.h>
 #include <ziparchive/zip_archive.h>
 
+// The default cap on the uncompressed bytes of the entries that ExtractEntriesInParallel() has in
+// flight at a time.
+constexpr uint64_t kMaxExtractionBytesInFlight = 256 * 1024 * 1024;
+
+// A zip entry to extract with ExtractEntriesInParallel(), and the file to write it to.
+struct EntryExtraction {
+  ZipEntry64 entry;
+  // The path of the file, for the logs.
+  std::string path;
+  // Opens the file. It's called on the thread that extracts the entry, right before, so that only
+  // the files in flight are open.
+  std::function<android::base::unique_fd()> open;
+};
+
+// The package that ExtractEntriesInParallel() extracts from, when it's mapped in memory (i.e. open
+// with OpenArchiveFromMemory()). The entries stored uncompressed are then copied straight from it
+// to their files, rather than through the buffers of libziparchive, and their CRC-32 is checked
+// over the same pages as they're written.
+struct ExtractionSource {
+  const uint8_t* addr = nullptr;
+  size_t length = 0;
+  // The file that the package is mapped from, or -1 if there's no such file (e.g. it's mapped from
+  // a block map). The copies are then sendfile(2)'d from it, so that their contents never go
+  // through user space.
+  int fd = -1;
+};
+
+// Extracts each of the |extractions| to its file, and fsync()s and closes it, with up to |workers|
+// of them at a time. An extraction only starts while the uncompressed size of those in flight
+// stays within |max_bytes_in_flight| (an entry larger than that runs alone), which bounds the
+// dirty pages and buffers that build up. Returns false if any extraction fails; the others still
+// run. The entries stored uncompressed are copied from |source| if it's given.
+bool ExtractEntriesInParallel(ZipArchiveHandle zip, std::vector<EntryExtraction>* extractions,
+                              size_t workers,
+                              uint64_t max_bytes_in_flight = kMaxExtractionBytesInFlight,
+                              const ExtractionSource* source = nullptr);
+
+// Writes the entry of |extraction| to |fd| front to back, in writes of the same size (1 MiB) at
+// offsets aligned to it, and fsync()s it, but leaves it open. |written| is called with each chunk
+// once it's written, e.g. to hash it or to report the progress, so that the file needn't be read
+// back. Only a chunk is in memory at a time. The entries stored uncompressed are copied from
+// |source| if it's given.
+bool StreamEntryToFile(ZipArchiveHandle zip, const EntryExtraction& extraction, int fd,
+                       const std::function<void(const uint8_t*, size_t)>& written,
+                       const ExtractionSource* source = nullptr);
+
 /*
  * Inflate all files under zip_path to the directory specified by
  * dest_path, which must exist and be a writable directory. The zip_path
@@ -48,10 +98,17 @@
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
+ * The directories are created first, each one once, and kept open so that the files (and the
+ * directories) in them are created relative to them. Then the files are inflated by up to |workers|
+ * threads with ExtractEntriesInParallel(), the largest first, within |max_bytes_in_flight| and from
+ * |source| if it's given. Once they're all written, the directories holding them are fsync()'d.
+ *
  * Returns true on success, false on failure.
  */
 bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
                              const std::string& dest_path, const struct utimbuf* timestamp,
-                             struct selabel_handle* sehnd);
+                             struct selabel_handle* sehnd, size_t workers = 1,
+                             uint64_t max_bytes_in_flight = kMaxExtractionBytesInFlight,
+                             const ExtractionSource* source = nullptr);
 
 #endif  // _OTAUTIL_ZIPUTIL_H
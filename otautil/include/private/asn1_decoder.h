@@ -20,17 +20,28 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// A cursor over a DER buffer, which it doesn't own. It's a small value type: the contexts of the
+// nested elements can live on the stack, and parsing doesn't allocate.
 class asn1_context {
  public:
+  asn1_context() : asn1_context(nullptr, 0) {}
   asn1_context(const uint8_t* buffer, size_t length) : p_(buffer), length_(length), app_type_(0) {}
   int asn1_constructed_type() const;
+  // Each of these reads the header of the next element, and points the given context at its
+  // contents. They return false, leaving the given context alone, if the element doesn't fit.
+  bool asn1_constructed_get(asn1_context* constructed);
+  bool asn1_sequence_get(asn1_context* sequence);
+  bool asn1_set_get(asn1_context* set);
+  // The same, with the child context on the heap. They return nullptr on failure.
   asn1_context* asn1_constructed_get();
-  bool asn1_constructed_skip_all();
   asn1_context* asn1_sequence_get();
   asn1_context* asn1_set_get();
+  bool asn1_constructed_skip_all();
   bool asn1_sequence_next();
   bool asn1_oid_get(const uint8_t** oid, size_t* length);
   bool asn1_octet_string_get(const uint8_t** octet_string, size_t* length);
+  // Gets the whole encoding (tag, length and contents) of the next element, and skips it.
+  bool asn1_element_get(const uint8_t** element, size_t* length);
 
  private:
   static constexpr int kMaskConstructed = 0xE0;
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/install_metrics.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <memory>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+static constexpr char kInstallMetricsMagic[] = "IMET";
+static constexpr size_t kInstallMetricsMagicSize = 4;
+
+template <typename T>
+static void AppendLittleEndian(std::string* buffer, T value) {
+  for (size_t i = 0; i < sizeof(T); i++) {
+    buffer->push_back(static_cast<char>(static_cast<uint64_t>(value) >> (8 * i)));
+  }
+}
+
+template <typename T>
+static T ReadLittleEndian(const uint8_t* data) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    value |= static_cast<uint64_t>(data[i]) << (8 * i);
+  }
+  return static_cast<T>(value);
+}
+
+bool AppendInstallMetrics(const std::string& path,
+                          const std::vector<std::pair<std::string, int64_t>>& metrics) {
+  android::base::unique_fd fd(
+      open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return false;
+  }
+  struct stat sb;
+  if (fstat(fd, &sb) != 0) {
+    PLOG(ERROR) << "Failed to stat " << path;
+    return false;
+  }
+
+  std::string buffer;
+  if (sb.st_size == 0) {
+    buffer.append(kInstallMetricsMagic, kInstallMetricsMagicSize);
+    AppendLittleEndian<uint32_t>(&buffer, kInstallMetricsVersion);
+  }
+  for (const auto& [name, value] : metrics) {
+    if (name.empty() || name.size() > UINT16_MAX) {
+      LOG(ERROR) << "Invalid install metric name: " << name;
+      return false;
+    }
+    AppendLittleEndian<uint16_t>(&buffer, name.size());
+    AppendLittleEndian<uint16_t>(&buffer, sizeof(int64_t));
+    buffer += name;
+    AppendLittleEndian<int64_t>(&buffer, value);
+  }
+  // A single write, so that an entry never ends up torn between the updater and recovery.
+  if (!android::base::WriteFully(fd, buffer.data(), buffer.size())) {
+    PLOG(ERROR) << "Failed to write " << path;
+    return false;
+  }
+  return true;
+}
+
+bool ReadInstallMetrics(const std::string& path,
+                        const std::function<bool(const std::string&, int64_t)>& callback) {
+  std::unique_ptr<FILE, decltype(&fclose)> fp(fopen(path.c_str(), "rbe"), fclose);
+  if (!fp) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return false;
+  }
+
+  uint8_t header[kInstallMetricsMagicSize + sizeof(uint32_t)];
+  if (fread(header, sizeof(header), 1, fp.get()) != 1 ||
+      memcmp(header, kInstallMetricsMagic, kInstallMetricsMagicSize) != 0) {
+    LOG(ERROR) << "Invalid install metrics header in " << path;
+    return false;
+  }
+  uint32_t version = ReadLittleEndian<uint32_t>(header + kInstallMetricsMagicSize);
+  if (version != kInstallMetricsVersion) {
+    LOG(ERROR) << "Unsupported install metrics version " << version << " in " << path;
+    return false;
+  }
+
+  std::string name;
+  while (true) {
+    uint8_t entry[2 * sizeof(uint16_t)];
+    size_t read = fread(entry, 1, sizeof(entry), fp.get());
+    if (read == 0 && feof(fp.get())) {
+      return true;
+    }
+    if (read != sizeof(entry)) {
+      LOG(ERROR) << "Truncated install metrics entry in " << path;
+      return false;
+    }
+    uint16_t name_size = ReadLittleEndian<uint16_t>(entry);
+    uint16_t value_size = ReadLittleEndian<uint16_t>(entry + sizeof(uint16_t));
+    name.resize(name_size);
+    if (name_size == 0 || fread(name.data(), name_size, 1, fp.get()) != 1) {
+      LOG(ERROR) << "Invalid install metrics entry in " << path;
+      return false;
+    }
+    if (value_size != sizeof(int64_t)) {
+      if (fseek(fp.get(), value_size, SEEK_CUR) != 0) {
+        PLOG(ERROR) << "Failed to skip install metric " << name << " in " << path;
+        return false;
+      }
+      continue;
+    }
+    uint8_t value[sizeof(int64_t)];
+    if (fread(value, sizeof(value), 1, fp.get()) != 1) {
+      LOG(ERROR) << "Truncated install metric " << name << " in " << path;
+      return false;
+    }
+    if (!callback(name, ReadLittleEndian<int64_t>(value))) {
+      return true;
+    }
+  }
+}
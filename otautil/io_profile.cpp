@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/io_profile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/falloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/scopeguard.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+
+#include "otautil/paths.h"
+
+// The size of the sequential and the random requests.
+static constexpr size_t kSequentialSize = 1024 * 1024;
+static constexpr size_t kRandomSize = 4096;
+static constexpr size_t kFsyncSamples = 16;
+
+// The fields of the profile, by their key in the file.
+static constexpr std::pair<const char*, uint64_t IoProfile::*> kFields[] = {
+  { "seq_read_kib_per_sec", &IoProfile::seq_read_kib_per_sec },
+  { "seq_write_kib_per_sec", &IoProfile::seq_write_kib_per_sec },
+  { "rand_read_iops", &IoProfile::rand_read_iops },
+  { "rand_write_iops", &IoProfile::rand_write_iops },
+  { "rand_read_iops_at_depth", &IoProfile::rand_read_iops_at_depth },
+  { "discard_kib_per_sec", &IoProfile::discard_kib_per_sec },
+  { "fsync_latency_us", &IoProfile::fsync_latency_us },
+  { "queue_depth", &IoProfile::queue_depth },
+};
+
+bool IoProfile::Read(const std::string& path, IoProfile* profile) {
+  std::string content;
+  if (!android::base::ReadFileToString(path, &content)) {
+    return false;
+  }
+  IoProfile result;
+  for (const auto& line : android::base::Split(content, "\n")) {
+    size_t equal = line.find('=');
+    if (equal == std::string::npos) {
+      continue;
+    }
+    std::string key = line.substr(0, equal);
+    for (const auto& [name, field] : kFields) {
+      if (key == name && !android::base::ParseUint(line.substr(equal + 1), &(result.*field))) {
+        LOG(WARNING) << "Invalid \"" << line << "\" in " << path;
+        return false;
+      }
+    }
+  }
+  if (result.queue_depth == 0) {
+    LOG(WARNING) << "No queue depth in " << path;
+    return false;
+  }
+  *profile = result;
+  return true;
+}
+
+bool IoProfile::Write(const std::string& path) const {
+  std::string temp_path = path + ".tmp";
+  if (!android::base::WriteStringToFile(ToString(), temp_path)) {
+    PLOG(ERROR) << "Failed to write " << temp_path;
+    return false;
+  }
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    PLOG(ERROR) << "Failed to rename " << temp_path << " to " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::string IoProfile::ToString() const {
+  std::string result;
+  for (const auto& [name, field] : kFields) {
+    result += android::base::StringPrintf("%s=%" PRIu64 "\n", name, this->*field);
+  }
+  return result;
+}
+
+using Clock = std::chrono::steady_clock;
+
+static double SecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Returns |amount| per second over |seconds|, or per microsecond for a run too short to measure.
+static uint64_t Rate(double amount, double seconds) {
+  return static_cast<uint64_t>(amount / std::max(seconds, 1e-6));
+}
+
+using AlignedBuffer = std::unique_ptr<uint8_t, decltype(&free)>;
+
+// Returns a buffer of |size| bytes aligned for O_DIRECT, filled with pseudo-random bytes so that
+// storage that compresses or deduplicates doesn't skew the writes.
+static AlignedBuffer AllocateBuffer(size_t size) {
+  void* data = nullptr;
+  if (posix_memalign(&data, kRandomSize, size) != 0) {
+    return AlignedBuffer(nullptr, free);
+  }
+  std::mt19937 random(size);
+  for (size_t i = 0; i < size; i++) {
+    static_cast<uint8_t*>(data)[i] = static_cast<uint8_t>(random());
+  }
+  return AlignedBuffer(static_cast<uint8_t*>(data), free);
+}
+
+// Drops the pages of |fd| from the page cache, for the reads that don't bypass it.
+static void DropCache(int fd) {
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// Does |ops| random reads (or writes) of 4 KiB in the first |blocks| blocks of |fd|, with |depth|
+// of them in flight. Returns the rate in IOPS, or 0 on I/O errors.
+static uint64_t RandomIo(int fd, uint64_t blocks, size_t ops, size_t depth, bool write) {
+  std::atomic<size_t> next{ 0 };
+  std::atomic<bool> failed{ false };
+  auto worker = [&](size_t index) {
+    AlignedBuffer buffer = AllocateBuffer(kRandomSize);
+    if (!buffer) {
+      LOG(ERROR) << "Failed to allocate the I/O buffer";
+      failed = true;
+      return;
+    }
+    std::mt19937_64 random(depth * 1000 + index);
+    std::uniform_int_distribution<uint64_t> block(0, blocks - 1);
+    while (!failed && next++ < ops) {
+      off64_t offset = static_cast<off64_t>(block(random) * kRandomSize);
+      bool result = write ? android::base::WriteFullyAtOffset(fd, buffer.get(), kRandomSize, offset)
+                          : android::base::ReadFullyAtOffset(fd, buffer.get(), kRandomSize, offset);
+      if (!result) {
+        PLOG(ERROR) << "Failed to " << (write ? "write" : "read") << " at " << offset;
+        failed = true;
+      }
+    }
+  };
+
+  DropCache(fd);
+  auto start = Clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < depth; i++) {
+    threads.emplace_back(worker, i);
+  }
+  worker(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  // The writes are only done once they're on the storage.
+  if (write && !failed && fdatasync(fd) != 0) {
+    PLOG(ERROR) << "Failed to sync the writes";
+    failed = true;
+  }
+  return failed ? 0 : Rate(ops, SecondsSince(start));
+}
+
+// Writes or reads the first |size| bytes of |fd| in requests of 1 MiB. Returns the rate in KiB/s,
+// or 0 on I/O errors.
+static uint64_t SequentialIo(int fd, uint64_t size, uint8_t* buffer, bool write) {
+  DropCache(fd);
+  auto start = Clock::now();
+  for (uint64_t offset = 0; offset < size; offset += kSequentialSize) {
+    bool result = write ? android::base::WriteFullyAtOffset(fd, buffer, kSequentialSize, offset)
+                        : android::base::ReadFullyAtOffset(fd, buffer, kSequentialSize, offset);
+    if (!result) {
+      PLOG(ERROR) << "Failed to " << (write ? "write" : "read") << " at " << offset;
+      return 0;
+    }
+  }
+  if (write && fdatasync(fd) != 0) {
+    PLOG(ERROR) << "Failed to sync the writes";
+    return 0;
+  }
+  return Rate(size / 1024.0, SecondsSince(start));
+}
+
+// Returns the median latency in microseconds of an fsync(2) after a write of 4 KiB, or 0 on
+// errors.
+static uint64_t FsyncLatency(int fd, uint8_t* buffer) {
+  std::vector<double> latencies;
+  for (size_t i = 0; i < kFsyncSamples; i++) {
+    if (!android::base::WriteFullyAtOffset(fd, buffer, kRandomSize, i * kRandomSize)) {
+      PLOG(ERROR) << "Failed to write at " << i * kRandomSize;
+      return 0;
+    }
+    auto start = Clock::now();
+    if (fsync(fd) != 0) {
+      PLOG(ERROR) << "Failed to fsync";
+      return 0;
+    }
+    latencies.push_back(SecondsSince(start) * 1e6);
+  }
+  std::nth_element(latencies.begin(), latencies.begin() + kFsyncSamples / 2, latencies.end());
+  return std::max<uint64_t>(latencies[kFsyncSamples / 2], 1);
+}
+
+// Punches out the first |size| bytes of |fd| 1 MiB at a time, which the file system turns into
+// discards of the underlying blocks. Returns the rate in KiB/s, or 0 if that's not supported.
+static uint64_t DiscardRate(int fd, uint64_t size) {
+  auto start = Clock::now();
+  for (uint64_t offset = 0; offset < size; offset += kSequentialSize) {
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, kSequentialSize) != 0) {
+      PLOG(WARNING) << "Failed to punch a hole at " << offset;
+      return 0;
+    }
+  }
+  if (fdatasync(fd) != 0) {
+    PLOG(WARNING) << "Failed to sync the discards";
+    return 0;
+  }
+  return Rate(size / 1024.0, SecondsSince(start));
+}
+
+bool MeasureIoProfile(const std::string& dir, const IoBenchmarkOptions& options,
+                      IoProfile* profile) {
+  uint64_t file_size = options.file_size / kSequentialSize * kSequentialSize;
+  if (file_size == 0 || options.random_ops == 0) {
+    LOG(ERROR) << "Invalid benchmark options";
+    return false;
+  }
+  struct statvfs sv;
+  if (statvfs(dir.c_str(), &sv) != 0) {
+    PLOG(ERROR) << "Failed to statvfs " << dir;
+    return false;
+  }
+  if (static_cast<uint64_t>(sv.f_bavail) * sv.f_frsize < 2 * file_size) {
+    LOG(ERROR) << "Not enough free space in " << dir << " for a scratch file of " << file_size
+               << " bytes";
+    return false;
+  }
+
+  std::string path = dir + "/io_benchmark.tmp";
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_DIRECT | O_CLOEXEC,
+                              0600)));
+  if (fd == -1 && errno == EINVAL) {
+    LOG(WARNING) << dir << " doesn't support O_DIRECT; measuring buffered I/O";
+    fd.reset(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)));
+  }
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to create " << path;
+    return false;
+  }
+  // The scratch file goes away however the measurements end.
+  auto remove_file = android::base::make_scope_guard([&path]() { unlink(path.c_str()); });
+
+  AlignedBuffer buffer = AllocateBuffer(kSequentialSize);
+  if (!buffer) {
+    LOG(ERROR) << "Failed to allocate the I/O buffer";
+    return false;
+  }
+
+  IoProfile result;
+  uint64_t blocks = file_size / kRandomSize;
+  result.seq_write_kib_per_sec = SequentialIo(fd, file_size, buffer.get(), true);
+  if (result.seq_write_kib_per_sec == 0) {
+    return false;
+  }
+  result.seq_read_kib_per_sec = SequentialIo(fd, file_size, buffer.get(), false);
+  if (result.seq_read_kib_per_sec == 0) {
+    return false;
+  }
+
+  // Double the random reads in flight until that stops paying off.
+  result.rand_read_iops = RandomIo(fd, blocks, options.random_ops, 1, false);
+  if (result.rand_read_iops == 0) {
+    return false;
+  }
+  result.queue_depth = 1;
+  result.rand_read_iops_at_depth = result.rand_read_iops;
+  for (size_t depth = 2; depth <= options.max_queue_depth; depth *= 2) {
+    uint64_t iops = RandomIo(fd, blocks, options.random_ops, depth, false);
+    if (iops == 0) {
+      return false;
+    }
+    if (iops < result.rand_read_iops_at_depth + result.rand_read_iops_at_depth / 10) {
+      break;
+    }
+    result.queue_depth = depth;
+    result.rand_read_iops_at_depth = iops;
+  }
+
+  result.rand_write_iops = RandomIo(fd, blocks, options.random_ops, 1, true);
+  if (result.rand_write_iops == 0) {
+    return false;
+  }
+  result.fsync_latency_us = FsyncLatency(fd, buffer.get());
+  if (result.fsync_latency_us == 0) {
+    return false;
+  }
+  // Last, as it leaves no data to read.
+  result.discard_kib_per_sec = DiscardRate(fd, file_size);
+
+  LOG(INFO) << "Measured the I/O profile of " << dir << ":\n" << result.ToString();
+  *profile = result;
+  return true;
+}
+
+size_t GetProfiledQueueDepth(size_t default_depth, size_t max_depth) {
+  IoProfile profile;
+  if (!IoProfile::Read(Paths::Get().io_profile_file(), &profile)) {
+    return default_depth;
+  }
+  return std::clamp<uint64_t>(profile.queue_depth, 1, std::max<size_t>(max_depth, 1));
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/log_buffer.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+
+#include <android-base/file.h>
+
+static size_t RoundUpToPowerOfTwo(size_t size) {
+  size_t rounded = 1;
+  while (rounded < size) {
+    rounded <<= 1;
+  }
+  return rounded;
+}
+
+LogBuffer::LogBuffer(int fd, size_t capacity, std::chrono::milliseconds flush_interval)
+    : fd_(fd),
+      capacity_(RoundUpToPowerOfTwo(std::max<size_t>(capacity, 2))),
+      flush_interval_(flush_interval),
+      data_(new char[capacity_]) {
+  flusher_ = std::thread(&LogBuffer::FlusherLoop, this);
+}
+
+LogBuffer::~LogBuffer() {
+  {
+    std::lock_guard<std::mutex> lock(flusher_mutex_);
+    stop_ = true;
+  }
+  flusher_cv_.notify_one();
+  flusher_.join();
+  Flush();
+}
+
+void LogBuffer::Append(std::string_view line) {
+  uint64_t size = line.size() + 1;
+  if (size > capacity_ / 2) {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    WriteCommitted();
+    android::base::WriteFully(fd_, line.data(), line.size());
+    android::base::WriteFully(fd_, "\n", 1);
+    return;
+  }
+
+  uint64_t start = reserved_.fetch_add(size, std::memory_order_relaxed);
+  uint64_t end = start + size;
+  // Makes room by writing out what's been committed, or waits for the lines before this one to be
+  // committed so that they can be.
+  while (end - flushed_.load(std::memory_order_acquire) > capacity_) {
+    if (committed_.load(std::memory_order_acquire) > flushed_.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(write_mutex_);
+      WriteCommitted();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  size_t mask = capacity_ - 1;
+  size_t offset = start & mask;
+  size_t first = std::min(line.size(), capacity_ - offset);
+  memcpy(&data_[offset], line.data(), first);
+  memcpy(&data_[0], line.data() + first, line.size() - first);
+  data_[(start + line.size()) & mask] = '\n';
+
+  while (committed_.load(std::memory_order_acquire) != start) {
+    std::this_thread::yield();
+  }
+  committed_.store(end, std::memory_order_release);
+
+  // Wakes the flusher up once per half a ring of lines, without waiting for its interval.
+  if (start / (capacity_ / 2) != end / (capacity_ / 2)) {
+    flusher_cv_.notify_one();
+  }
+}
+
+void LogBuffer::WriteCommitted() {
+  size_t mask = capacity_ - 1;
+  uint64_t flushed = flushed_.load(std::memory_order_relaxed);
+  uint64_t committed = committed_.load(std::memory_order_acquire);
+  while (flushed < committed) {
+    size_t offset = flushed & mask;
+    size_t size = std::min<uint64_t>(committed - flushed, capacity_ - offset);
+    // On errors the lines are dropped, rather than holding up the ones to come.
+    android::base::WriteFully(fd_, &data_[offset], size);
+    flushed += size;
+  }
+  flushed_.store(flushed, std::memory_order_release);
+}
+
+void LogBuffer::Flush() {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  WriteCommitted();
+}
+
+void LogBuffer::FlushFromSignalHandler() {
+  WriteCommitted();
+}
+
+void LogBuffer::FlusherLoop() {
+  std::unique_lock<std::mutex> lock(flusher_mutex_);
+  while (!stop_) {
+    flusher_cv_.wait_for(lock, flush_interval_);
+    lock.unlock();
+    Flush();
+    lock.lock();
+  }
+}
+
+static constexpr int kFatalSignals[] = { SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV };
+static struct sigaction previous_actions[std::size(kFatalSignals)];
+static std::atomic<LogBuffer*> exit_log_buffer;
+
+static void FlushAtExit() {
+  if (LogBuffer* buffer = exit_log_buffer.load(); buffer != nullptr) {
+    buffer->Flush();
+  }
+}
+
+static void FlushOnFatalSignal(int signal) {
+  if (LogBuffer* buffer = exit_log_buffer.exchange(nullptr); buffer != nullptr) {
+    buffer->FlushFromSignalHandler();
+  }
+  // Hands the signal over to the previous action, once this handler returns (or, for a fault, once
+  // the faulting instruction runs again).
+  for (size_t i = 0; i < std::size(kFatalSignals); i++) {
+    if (kFatalSignals[i] == signal) {
+      sigaction(signal, &previous_actions[i], nullptr);
+    }
+  }
+  raise(signal);
+}
+
+void FlushLogBufferOnExit(LogBuffer* buffer) {
+  static std::once_flag handlers_installed;
+  exit_log_buffer = buffer;
+  std::call_once(handlers_installed, []() {
+    atexit(FlushAtExit);
+    struct sigaction action = {};
+    action.sa_handler = FlushOnFatalSignal;
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < std::size(kFatalSignals); i++) {
+      sigaction(kFatalSignals[i], &action, &previous_actions[i]);
+    }
+  });
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/memory_governor.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+MemoryGovernor& MemoryGovernor::Get() {
+  static MemoryGovernor governor("/proc/meminfo", kDefaultCacheHeadroom, kDefaultRequiredHeadroom,
+                                 kDefaultRebalanceInterval);
+  return governor;
+}
+
+MemoryGovernor::MemoryGovernor(const std::string& meminfo_path, size_t cache_headroom,
+                               size_t required_headroom,
+                               std::chrono::milliseconds rebalance_interval)
+    : meminfo_path_(meminfo_path),
+      cache_headroom_(cache_headroom),
+      required_headroom_(required_headroom),
+      rebalance_interval_(rebalance_interval) {}
+
+bool MemoryGovernor::ReadAvailableMemory(size_t* bytes) const {
+  std::string content;
+  if (!android::base::ReadFileToString(meminfo_path_, &content)) {
+    PLOG(WARNING) << "Failed to read " << meminfo_path_;
+    return false;
+  }
+  // The lines look like "MemAvailable:    1234567 kB".
+  uint64_t mem_available = UINT64_MAX;
+  uint64_t estimate = 0;
+  bool found = false;
+  for (const auto& line : android::base::Split(content, "\n")) {
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string key = line.substr(0, colon);
+    std::string value = android::base::Trim(line.substr(colon + 1));
+    if (android::base::EndsWith(value, "kB")) {
+      value = android::base::Trim(value.substr(0, value.size() - 2));
+    }
+    uint64_t kib;
+    if (!android::base::ParseUint(value, &kib)) {
+      continue;
+    }
+    if (key == "MemAvailable") {
+      mem_available = kib;
+    } else if (key == "MemFree" || key == "Buffers" || key == "Cached") {
+      estimate += kib;
+      found = true;
+    }
+  }
+  if (mem_available == UINT64_MAX && !found) {
+    LOG(WARNING) << "No available memory in " << meminfo_path_;
+    return false;
+  }
+  uint64_t kib = mem_available != UINT64_MAX ? mem_available : estimate;
+  *bytes = std::min<uint64_t>(kib, SIZE_MAX / 1024) * 1024;
+  return true;
+}
+
+size_t MemoryGovernor::GetOutstanding() const {
+  size_t outstanding = 0;
+  for (const auto& entry : entries_) {
+    size_t used = entry.consumer.usage ? std::min(entry.consumer.usage(), entry.granted) : 0;
+    outstanding += entry.granted - used;
+  }
+  return outstanding;
+}
+
+size_t MemoryGovernor::GetRoom(MemoryPriority priority) const {
+  size_t available;
+  if (!ReadAvailableMemory(&available)) {
+    return SIZE_MAX;
+  }
+  size_t headroom = priority == MemoryPriority::kCache ? cache_headroom_ : required_headroom_;
+  size_t taken = headroom + GetOutstanding();
+  return available > taken ? available - taken : 0;
+}
+
+size_t MemoryGovernor::GetAvailable(MemoryPriority priority) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return GetRoom(priority);
+}
+
+size_t MemoryGovernor::ShrinkCaches(size_t bytes) {
+  std::vector<std::pair<size_t, Entry*>> caches;
+  for (auto& entry : entries_) {
+    if (entry.priority == MemoryPriority::kCache && entry.consumer.shrink && entry.granted > 0) {
+      size_t used = entry.consumer.usage ? entry.consumer.usage() : entry.granted;
+      caches.emplace_back(used, &entry);
+    }
+  }
+  std::sort(caches.begin(), caches.end(),
+            [](const auto& a, const auto& b) { return a.first > b.first; });
+
+  size_t freed = 0;
+  for (const auto& [used, entry] : caches) {
+    if (freed >= bytes) {
+      break;
+    }
+    // What a cache gives back is taken off its grant for good, or it would count as outstanding.
+    size_t entry_freed = std::min(entry->consumer.shrink(bytes - freed), entry->granted);
+    entry->granted -= entry_freed;
+    freed += entry_freed;
+    LOG(INFO) << "Shrank " << entry->name << " by " << entry_freed << " bytes, to "
+              << entry->granted;
+  }
+  return freed;
+}
+
+std::unique_ptr<MemoryGovernor::Reservation> MemoryGovernor::Reserve(const std::string& name,
+                                                                     MemoryPriority priority,
+                                                                     size_t min_bytes,
+                                                                     size_t max_bytes,
+                                                                     MemoryConsumer consumer) {
+  CHECK_LE(min_bytes, max_bytes);
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t room = GetRoom(priority);
+  if (room < max_bytes && priority == MemoryPriority::kRequired) {
+    ShrinkCaches(max_bytes - room);
+    room = GetRoom(priority);
+  }
+  if (room < min_bytes) {
+    LOG(WARNING) << "Not reserving " << min_bytes << " bytes for " << name << ": only " << room
+                 << " available";
+    return nullptr;
+  }
+
+  size_t granted = std::min(room, max_bytes);
+  LOG(INFO) << "Reserved " << granted << " bytes for " << name;
+  auto entry = entries_.insert(entries_.end(),
+                               Entry{ name, priority, granted, std::move(consumer) });
+  return std::unique_ptr<Reservation>(new Reservation(this, entry));
+}
+
+size_t MemoryGovernor::Rebalance() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto now = std::chrono::steady_clock::now();
+  if (last_rebalance_ != std::chrono::steady_clock::time_point() &&
+      now - last_rebalance_ < rebalance_interval_) {
+    return 0;
+  }
+  last_rebalance_ = now;
+
+  size_t available;
+  if (!ReadAvailableMemory(&available)) {
+    return 0;
+  }
+  size_t outstanding = GetOutstanding();
+  size_t unreserved = available > outstanding ? available - outstanding : 0;
+  if (unreserved >= cache_headroom_) {
+    return 0;
+  }
+  return ShrinkCaches(cache_headroom_ - unreserved);
+}
+
+size_t MemoryGovernor::Reservation::bytes() const {
+  std::lock_guard<std::mutex> lock(governor_->mutex_);
+  return entry_->granted;
+}
+
+MemoryGovernor::Reservation::~Reservation() {
+  std::lock_guard<std::mutex> lock(governor_->mutex_);
+  governor_->entries_.erase(entry_);
+}
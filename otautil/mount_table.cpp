@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/mount_table.h"
+
+#include <fcntl.h>
+#include <mntent.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/vfs.h>
+
+#include <android-base/logging.h>
+
+#ifndef PROC_SUPER_MAGIC
+#define PROC_SUPER_MAGIC 0x9fa0
+#endif
+
+MountTable::MountTable(const std::string& path) : path_(path) {}
+
+bool MountTable::PollChanged() {
+  // Opened on first use rather than on construction, as tables are often static.
+  if (!watch_opened_) {
+    watch_opened_ = true;
+    watch_fd_.reset(open(path_.c_str(), O_RDONLY | O_CLOEXEC));
+    struct statfs sf;
+    if (watch_fd_ != -1 && (fstatfs(watch_fd_, &sf) != 0 || sf.f_type != PROC_SUPER_MAGIC)) {
+      watch_fd_.reset();
+    }
+  }
+  if (watch_fd_ == -1) {
+    return true;
+  }
+
+  struct pollfd pfd = { watch_fd_.get(), POLLPRI, 0 };
+  if (poll(&pfd, 1, 0) == -1) {
+    PLOG(WARNING) << "Failed to poll " << path_;
+    return true;
+  }
+  return (pfd.revents & (POLLERR | POLLPRI)) != 0;
+}
+
+bool MountTable::Refresh() {
+  // Polling clears the flag, so it's done before reading: a change made meanwhile is flagged to the
+  // next poll.
+  if (PollChanged()) {
+    stale_ = true;
+  }
+  if (!stale_) {
+    return true;
+  }
+
+  FILE* fp = setmntent(path_.c_str(), "re");
+  if (fp == nullptr) {
+    PLOG(ERROR) << "Failed to open " << path_;
+    return false;
+  }
+  mounts_.clear();
+  by_mount_point_.clear();
+  by_device_.clear();
+  mntent* e;
+  while ((e = getmntent(fp)) != nullptr) {
+    by_mount_point_.emplace(e->mnt_dir, mounts_.size());
+    by_device_.emplace(e->mnt_fsname, mounts_.size());
+    mounts_.push_back(Mount{ e->mnt_fsname, e->mnt_dir, e->mnt_type, e->mnt_opts });
+  }
+  endmntent(fp);
+
+  stale_ = false;
+  reads_++;
+  return true;
+}
+
+MountTable::Mount* MountTable::FindByMountPoint(std::string_view mount_point) {
+  if (auto it = by_mount_point_.find(mount_point); it != by_mount_point_.end()) {
+    return &mounts_[it->second];
+  }
+  return nullptr;
+}
+
+std::vector<const MountTable::Mount*> MountTable::FindByDevice(std::string_view device) const {
+  // The multimap keeps the entries with the same key in the order they were added.
+  std::vector<const Mount*> result;
+  auto [begin, end] = by_device_.equal_range(device);
+  for (auto it = begin; it != end; ++it) {
+    result.push_back(&mounts_[it->second]);
+  }
+  return result;
+}
@@ -16,9 +16,13 @@
 
 #include "otautil/package.h"
 
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <future>
+
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
@@ -26,6 +30,35 @@
 
 #include "otautil/error_code.h"
 #include "otautil/sysutil.h"
+#include "otautil/thermal_throttle.h"
+
+// Packages are hashed in chunks of this size. A FilePackage keeps two of them, reading the next
+// chunk while the hashers run over the current one. On a Nexus 5X, experiment showed 16MiB beat
+// 1MiB by 6% faster for a 1196MiB full OTA and 60% for an 89MiB incremental OTA. http://b/28135231.
+static constexpr uint64_t kHashChunkSize = 16 * MiB;
+
+// Feeds |size| bytes at |data| to all the |hashers|. With more than one (e.g. SHA-1 and SHA-256 for
+// a mix of keys), they run concurrently, each on its own thread but the first, unless the device is
+// getting too hot for that.
+static void RunHashers(const std::vector<HasherUpdateCallback>& hashers, const uint8_t* data,
+                       uint64_t size) {
+  if (ThermalThrottle::Get().Scale(hashers.size()) < hashers.size()) {
+    for (const auto& hasher : hashers) {
+      hasher(data, size);
+    }
+    return;
+  }
+  std::vector<std::future<void>> others;
+  for (size_t i = 1; i < hashers.size(); i++) {
+    others.emplace_back(std::async(std::launch::async, std::cref(hashers[i]), data, size));
+  }
+  if (!hashers.empty()) {
+    hashers[0](data, size);
+  }
+  for (auto& other : others) {
+    other.wait();
+  }
+}
 
 // This class wraps the package in memory, i.e. a memory mapped package, or a package loaded
 // to a string/vector.
@@ -35,8 +68,9 @@ class MemoryPackage : public Package {
   MemoryPackage(const std::string& path, std::unique_ptr<MemMapping> map,
                 const std::function<void(float)>& set_progress);
 
-  // Constructs the class from the package bytes in |content|.
-  MemoryPackage(std::vector<uint8_t> content, const std::function<void(float)>& set_progress);
+  // Constructs the class from the |size| package bytes at |addr|, owned by |content|.
+  MemoryPackage(std::shared_ptr<const void> content, const uint8_t* addr, uint64_t size,
+                const std::function<void(float)>& set_progress);
 
   ~MemoryPackage() override;
 
@@ -58,18 +92,22 @@ class MemoryPackage : public Package {
 
   ZipArchiveHandle GetZipArchiveHandle() override;
 
+  void PrepareForAccess(PackageAccess access) override;
+
   bool UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers, uint64_t start,
                           uint64_t length) override;
 
+  void Prefetch(uint64_t offset, uint64_t length) override;
+
  private:
   const uint8_t* addr_;    // Start address of the package in memory.
   uint64_t package_size_;  // Package size in bytes.
 
   // The memory mapped package.
   std::unique_ptr<MemMapping> map_;
-  // A copy of the package content, valid only if we create the class with the exact bytes of
+  // The owner of the package content, valid only if we create the class with the exact bytes of
   // the package.
-  std::vector<uint8_t> package_content_;
+  std::shared_ptr<const void> package_content_;
   // The physical path to the package, empty if we create the class with the package content.
   std::string path_;
 
@@ -77,6 +115,16 @@ class MemoryPackage : public Package {
   ZipArchiveHandle zip_handle_;
 };
 
+const PackageMetadata* Package::GetMetadata() {
+  if (!metadata_read_) {
+    if (ZipArchiveHandle zip = GetZipArchiveHandle(); zip != nullptr) {
+      metadata_ = PackageMetadata::Read(zip);
+    }
+    metadata_read_ = true;
+  }
+  return metadata_.get();
+}
+
 void Package::SetProgress(float progress) {
   if (set_progress_) {
     set_progress_(progress);
@@ -106,9 +154,15 @@ class FilePackage : public Package {
 
   ZipArchiveHandle GetZipArchiveHandle() override;
 
+  void PrepareForAccess(PackageAccess access) override;
+
   bool UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers, uint64_t start,
                           uint64_t length) override;
 
+  // The kernel reads the range ahead, through the page cache. For a package read through
+  // fuse_sideload, that turns into FUSE reads, which prime its block cache.
+  void Prefetch(uint64_t offset, uint64_t length) override;
+
  private:
   android::base::unique_fd fd_;  // The underlying fd to the open package.
   uint64_t package_size_;
@@ -147,7 +201,13 @@ std::unique_ptr<Package> Package::CreateFilePackage(
 
 std::unique_ptr<Package> Package::CreateMemoryPackage(
     std::vector<uint8_t> content, const std::function<void(float)>& set_progress) {
-  return std::make_unique<MemoryPackage>(std::move(content), set_progress);
+  return AdoptMemoryPackage(std::move(content), set_progress);
+}
+
+std::unique_ptr<Package> Package::CreateMemoryPackage(
+    std::shared_ptr<const void> owner, const uint8_t* addr, uint64_t size,
+    const std::function<void(float)>& set_progress) {
+  return std::make_unique<MemoryPackage>(std::move(owner), addr, size, set_progress);
 }
 
 MemoryPackage::MemoryPackage(const std::string& path, std::unique_ptr<MemMapping> map,
@@ -158,12 +218,10 @@ MemoryPackage::MemoryPackage(const std::string& path, std::unique_ptr<MemMapping
   set_progress_ = set_progress;
 }
 
-MemoryPackage::MemoryPackage(std::vector<uint8_t> content,
-                             const std::function<void(float)>& set_progress)
-    : package_content_(std::move(content)), zip_handle_(nullptr) {
-  CHECK(!package_content_.empty());
-  addr_ = package_content_.data();
-  package_size_ = package_content_.size();
+MemoryPackage::MemoryPackage(std::shared_ptr<const void> content, const uint8_t* addr,
+                             uint64_t size, const std::function<void(float)>& set_progress)
+    : addr_(addr), package_size_(size), package_content_(std::move(content)), zip_handle_(nullptr) {
+  CHECK_GT(package_size_, 0U);
   set_progress_ = set_progress;
 }
 
@@ -191,12 +249,35 @@ bool MemoryPackage::UpdateHashAtOffset(const std::vector<HasherUpdateCallback>&
     return false;
   }
 
-  for (const auto& hasher : hashers) {
-    hasher(addr_ + start, length);
+  // Hashed in chunks as well, so that the hashers (e.g. a progress update) look the same as with a
+  // FilePackage. A mapped package gets the next chunk faulted in while the current one is hashed.
+  for (uint64_t offset = 0; offset < length; offset += kHashChunkSize) {
+    uint64_t size = std::min(length - offset, kHashChunkSize);
+    uint64_t next = offset + size;
+    std::future<bool> prefault;
+    if (map_ && next < length) {
+      prefault = std::async(std::launch::async, &MemMapping::Prefault, map_.get(), start + next,
+                            std::min(length - next, kHashChunkSize));
+    }
+    RunHashers(hashers, addr_ + start + offset, size);
   }
   return true;
 }
 
+void MemoryPackage::Prefetch(uint64_t offset, uint64_t length) {
+  // The content of a package in memory is there already.
+  if (map_ && length > 0) {
+    map_->WillNeed(offset, length);
+  }
+}
+
+void MemoryPackage::PrepareForAccess(PackageAccess access) {
+  if (map_) {
+    map_->Advise(access == PackageAccess::kVerify ? MemMapping::Access::kSequential
+                                                  : MemMapping::Access::kNormal);
+  }
+}
+
 ZipArchiveHandle MemoryPackage::GetZipArchiveHandle() {
   if (zip_handle_) {
     return zip_handle_;
@@ -247,23 +328,57 @@ bool FilePackage::UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& ha
     return false;
   }
 
+  // The range is read once, front to back; let the kernel read ahead accordingly.
+  if (length > 0) {
+    posix_fadvise(fd_.get(), start, length, POSIX_FADV_SEQUENTIAL);
+  }
+
+  // Reads the chunk at |offset| (relative to |start|) into |buffer|.
+  auto read_chunk = [this, start, length](std::vector<uint8_t>* buffer, uint64_t offset) {
+    buffer->resize(std::min(length - offset, kHashChunkSize));
+    return ReadFullyAtOffset(buffer->data(), buffer->size(), start + offset);
+  };
+
+  // Double buffering: while the hashers run over one buffer, the next chunk is read into the other.
+  // |buffers| outlives |pending|, whose destructor waits for an outstanding read.
+  std::vector<uint8_t> buffers[2];
+  std::future<bool> pending;
+  if (length > 0) {
+    pending = std::async(std::launch::async, read_chunk, &buffers[0], 0);
+  }
   uint64_t so_far = 0;
-  while (so_far < length) {
-    uint64_t read_size = std::min<uint64_t>(length - so_far, 16 * MiB);
-    std::vector<uint8_t> buffer(read_size);
-    if (!ReadFullyAtOffset(buffer.data(), read_size, start + so_far)) {
+  for (size_t current = 0; so_far < length; current ^= 1) {
+    if (!pending.get()) {
       return false;
     }
-
-    for (const auto& hasher : hashers) {
-      hasher(buffer.data(), read_size);
+    const std::vector<uint8_t>& buffer = buffers[current];
+    so_far += buffer.size();
+    if (so_far < length) {
+      pending = std::async(std::launch::async, read_chunk, &buffers[current ^ 1], so_far);
     }
-    so_far += read_size;
+
+    RunHashers(hashers, buffer.data(), buffer.size());
   }
 
   return true;
 }
 
+void FilePackage::Prefetch(uint64_t offset, uint64_t length) {
+  if (offset >= package_size_ || length == 0) {
+    return;
+  }
+  length = std::min(length, package_size_ - offset);
+  if (int err = posix_fadvise(fd_.get(), offset, length, POSIX_FADV_WILLNEED); err != 0) {
+    LOG(WARNING) << "Failed to prefetch " << length << " bytes at offset " << offset << ": "
+                 << strerror(err);
+  }
+}
+
+void FilePackage::PrepareForAccess(PackageAccess access) {
+  posix_fadvise(fd_.get(), 0, 0,
+                access == PackageAccess::kVerify ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL);
+}
+
 ZipArchiveHandle FilePackage::GetZipArchiveHandle() {
   if (zip_handle_) {
     return zip_handle_;
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/package_metadata.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <limits>
+
+#include <android-base/logging.h>
+
+static constexpr const char* METADATA_PATH = "META-INF/com/android/metadata";
+static constexpr const char* OTA_METADATA_PATH = "META-INF/com/android/metadata.pb";
+
+static std::string_view Trim(std::string_view s) {
+  static constexpr const char* kWhitespace = " \t\n\v\f\r";
+  size_t first = s.find_first_not_of(kWhitespace);
+  if (first == std::string_view::npos) {
+    return {};
+  }
+  return s.substr(first, s.find_last_not_of(kWhitespace) - first + 1);
+}
+
+PackageMetadata::PackageMetadata(std::string text, std::string ota_metadata)
+    : text_(std::move(text)), ota_metadata_(std::move(ota_metadata)) {
+  std::string_view rest = text_;
+  while (!rest.empty()) {
+    size_t end = std::min(rest.find('\n'), rest.size());
+    std::string_view line = rest.substr(0, end);
+    rest.remove_prefix(std::min(end + 1, rest.size()));
+    if (size_t eq = line.find('='); eq != std::string_view::npos) {
+      index_.emplace_back(Trim(line.substr(0, eq)), Trim(line.substr(eq + 1)));
+    }
+  }
+  // Stable, so that the first line of a key stays first.
+  std::stable_sort(index_.begin(), index_.end(),
+                   [](const auto& a, const auto& b) { return a.first < b.first; });
+}
+
+// Extracts the entry |name| of |zip| into |content|.
+static bool ExtractEntry(ZipArchiveHandle zip, const char* name, std::string* content) {
+  ZipEntry64 entry;
+  if (FindEntry(zip, name, &entry) != 0) {
+    return false;
+  }
+  if (entry.uncompressed_length > std::numeric_limits<size_t>::max()) {
+    LOG(ERROR) << "Failed to extract " << name << " because its uncompressed size "
+               << entry.uncompressed_length << " exceeds the size of the address space";
+    return false;
+  }
+  content->resize(entry.uncompressed_length);
+  if (int32_t err = ExtractToMemory(zip, &entry, reinterpret_cast<uint8_t*>(content->data()),
+                                    content->size());
+      err != 0) {
+    LOG(ERROR) << "Failed to extract " << name << ": " << ErrorCodeString(err);
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<PackageMetadata> PackageMetadata::Read(ZipArchiveHandle zip) {
+  std::string text;
+  if (!ExtractEntry(zip, METADATA_PATH, &text)) {
+    return nullptr;
+  }
+  std::string ota_metadata;
+  if (!ExtractEntry(zip, OTA_METADATA_PATH, &ota_metadata)) {
+    ota_metadata.clear();
+  }
+  return std::make_unique<PackageMetadata>(std::move(text), std::move(ota_metadata));
+}
+
+std::string_view PackageMetadata::Get(std::string_view key) const {
+  auto it = std::lower_bound(index_.begin(), index_.end(), key,
+                             [](const auto& entry, std::string_view k) { return entry.first < k; });
+  return (it == index_.end() || it->first != key) ? std::string_view() : it->second;
+}
@@ -18,12 +18,16 @@
 
 constexpr const char kDefaultCacheLogDirectory[] = "/cache/recovery";
 constexpr const char kDefaultCacheTempSource[] = "/cache/saved.file";
+constexpr const char kDefaultIoProfileFile[] = "/cache/recovery/io_profile";
 constexpr const char kDefaultLastCommandFile[] = "/cache/recovery/last_command";
 constexpr const char kDefaultResourceDirectory[] = "/res/images";
 constexpr const char kDefaultStashDirectoryBase[] = "/cache/recovery";
 constexpr const char kDefaultTemporaryInstallFile[] = "/tmp/last_install";
+constexpr const char kDefaultTemporaryInstallMetricsFile[] = "/tmp/last_install_metrics";
 constexpr const char kDefaultTemporaryLogFile[] = "/tmp/recovery.log";
+constexpr const char kDefaultTemporaryStartupTraceFile[] = "/tmp/startup_trace.json";
 constexpr const char kDefaultTemporaryUpdateBinary[] = "/tmp/update-binary";
+constexpr const char kDefaultTemporaryUpdateTraceFile[] = "/tmp/last_update_trace";
 
 Paths& Paths::Get() {
   static Paths paths;
@@ -33,9 +37,13 @@ Paths& Paths::Get() {
 Paths::Paths()
     : cache_log_directory_(kDefaultCacheLogDirectory),
       cache_temp_source_(kDefaultCacheTempSource),
+      io_profile_file_(kDefaultIoProfileFile),
       last_command_file_(kDefaultLastCommandFile),
       resource_dir_(kDefaultResourceDirectory),
       stash_directory_base_(kDefaultStashDirectoryBase),
       temporary_install_file_(kDefaultTemporaryInstallFile),
+      temporary_install_metrics_file_(kDefaultTemporaryInstallMetricsFile),
       temporary_log_file_(kDefaultTemporaryLogFile),
-      temporary_update_binary_(kDefaultTemporaryUpdateBinary) {}
+      temporary_startup_trace_file_(kDefaultTemporaryStartupTraceFile),
+      temporary_update_binary_(kDefaultTemporaryUpdateBinary),
+      temporary_update_trace_file_(kDefaultTemporaryUpdateTraceFile) {}
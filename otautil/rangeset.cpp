@@ -16,18 +16,18 @@
 
 #include "otautil/rangeset.h"
 
+#include <ctype.h>
 #include <limits.h>
 #include <stddef.h>
 
 #include <algorithm>
+#include <charconv>
+#include <iterator>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <android-base/logging.h>
-#include <android-base/parseint.h>
-#include <android-base/stringprintf.h>
-#include <android-base/strings.h>
 
 RangeSet::RangeSet(std::vector<Range>&& pairs) {
   blocks_ = 0;
@@ -36,6 +36,8 @@ RangeSet::RangeSet(std::vector<Range>&& pairs) {
     return;
   }
 
+  ranges_.reserve(pairs.size());
+  offsets_.reserve(pairs.size());
   for (const auto& range : pairs) {
     if (!PushBack(range)) {
       Clear();
@@ -44,15 +46,43 @@ RangeSet::RangeSet(std::vector<Range>&& pairs) {
   }
 }
 
-RangeSet RangeSet::Parse(const std::string& range_text) {
-  std::vector<std::string> pieces = android::base::Split(range_text, ",");
-  if (pieces.size() < 3) {
+// Parses the decimal number, after optional leading spaces, at the start of |*text| up to the next
+// comma or the end of the text; then consumes the number and the comma.
+static bool ConsumeUint(std::string_view* text, size_t* value) {
+  size_t pos = 0;
+  while (pos < text->size() && isspace(static_cast<unsigned char>((*text)[pos]))) {
+    pos++;
+  }
+  size_t digits_start = pos;
+  size_t result = 0;
+  for (; pos < text->size() && (*text)[pos] != ','; pos++) {
+    char c = (*text)[pos];
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    result = result * 10 + (c - '0');
+    if (result > static_cast<size_t>(INT_MAX)) {
+      return false;
+    }
+  }
+  if (pos == digits_start) {
+    return false;
+  }
+  text->remove_prefix(std::min(pos + 1, text->size()));
+  *value = result;
+  return true;
+}
+
+RangeSet RangeSet::Parse(std::string_view range_text) {
+  size_t pieces = std::count(range_text.begin(), range_text.end(), ',') + 1;
+  if (pieces < 3) {
     LOG(ERROR) << "Invalid range text: " << range_text;
     return {};
   }
 
+  std::string_view text = range_text;
   size_t num;
-  if (!android::base::ParseUint(pieces[0], &num, static_cast<size_t>(INT_MAX))) {
+  if (!ConsumeUint(&text, &num)) {
     LOG(ERROR) << "Failed to parse the number of tokens: " << range_text;
     return {};
   }
@@ -64,17 +94,17 @@ RangeSet RangeSet::Parse(const std::string& range_text) {
     LOG(ERROR) << "Number of tokens must be even: " << range_text;
     return {};
   }
-  if (num != pieces.size() - 1) {
+  if (num != pieces - 1) {
     LOG(ERROR) << "Mismatching number of tokens: " << range_text;
     return {};
   }
 
   std::vector<Range> pairs;
+  pairs.reserve(num / 2);
   for (size_t i = 0; i < num; i += 2) {
     size_t first;
     size_t second;
-    if (!android::base::ParseUint(pieces[i + 1], &first, static_cast<size_t>(INT_MAX)) ||
-        !android::base::ParseUint(pieces[i + 2], &second, static_cast<size_t>(INT_MAX))) {
+    if (!ConsumeUint(&text, &first) || !ConsumeUint(&text, &second)) {
       return {};
     }
     pairs.emplace_back(first, second);
@@ -94,13 +124,30 @@ bool RangeSet::PushBack(Range range) {
   }
 
   ranges_.push_back(std::move(range));
+  offsets_.push_back(blocks_);
   blocks_ += sz;
   return true;
 }
 
 void RangeSet::Clear() {
   ranges_.clear();
+  offsets_.clear();
+  blocks_ = 0;
+}
+
+void RangeSet::UpdateOffsets() {
+  offsets_.clear();
+  offsets_.reserve(ranges_.size());
   blocks_ = 0;
+  for (const auto& [begin, end] : ranges_) {
+    offsets_.push_back(blocks_);
+    blocks_ += end - begin;
+  }
+}
+
+size_t RangeSet::FindRangeIndex(size_t idx) const {
+  // The last range that starts at or before the i-th block.
+  return std::upper_bound(offsets_.cbegin(), offsets_.cend(), idx) - offsets_.cbegin() - 1;
 }
 
 std::vector<RangeSet> RangeSet::Split(size_t groups) const {
@@ -148,8 +195,16 @@ std::string RangeSet::ToString() const {
     return "";
   }
   std::string result = std::to_string(ranges_.size() * 2);
+  result.reserve(ranges_.size() * 16);
+  // Each number takes up to 20 digits, plus the comma.
+  char buffer[2 * 21];
   for (const auto& [begin, end] : ranges_) {
-    result += android::base::StringPrintf(",%zu,%zu", begin, end);
+    char* p = buffer;
+    *p++ = ',';
+    p = std::to_chars(p, p + 20, begin).ptr;
+    *p++ = ',';
+    p = std::to_chars(p, p + 20, end).ptr;
+    result.append(buffer, p);
   }
 
   return result;
@@ -159,27 +214,44 @@ std::string RangeSet::ToString() const {
 size_t RangeSet::GetBlockNumber(size_t idx) const {
   CHECK_LT(idx, blocks_) << "Out of bound index " << idx << " (total blocks: " << blocks_ << ")";
 
-  for (const auto& [begin, end] : ranges_) {
-    if (idx < end - begin) {
-      return begin + idx;
-    }
-    idx -= (end - begin);
-  }
-
-  CHECK(false) << "Failed to find block number for index " << idx;
-  return 0;  // Unreachable, but to make compiler happy.
+  size_t i = FindRangeIndex(idx);
+  return ranges_[i].first + (idx - offsets_[i]);
 }
 
 // RangeSet has half-closed half-open bounds. For example, "3,5" contains blocks 3 and 4. So "3,5"
 // and "5,7" are not overlapped.
 bool RangeSet::Overlaps(const RangeSet& other) const {
-  for (const auto& [begin, end] : ranges_) {
-    for (const auto& [other_begin, other_end] : other.ranges_) {
-      // [begin, end) vs [other_begin, other_end)
-      if (!(other_begin >= end || begin >= other_end)) {
-        return true;
+  // Below this many ranges on either side, comparing all the pairs is cheaper than sorting.
+  static constexpr size_t kPairwiseOverlapLimit = 8;
+
+  if (std::min(size(), other.size()) <= kPairwiseOverlapLimit) {
+    for (const auto& [begin, end] : ranges_) {
+      for (const auto& [other_begin, other_end] : other.ranges_) {
+        // [begin, end) vs [other_begin, other_end)
+        if (!(other_begin >= end || begin >= other_end)) {
+          return true;
+        }
       }
     }
+    return false;
+  }
+
+  // Walks both sets of ranges in order of their starts. A range that ends before the start of the
+  // current range on the other side can't overlap with any of the ranges left there.
+  std::vector<Range> sorted(ranges_);
+  std::vector<Range> other_sorted(other.ranges_);
+  std::sort(sorted.begin(), sorted.end());
+  std::sort(other_sorted.begin(), other_sorted.end());
+  auto it = sorted.cbegin();
+  auto other_it = other_sorted.cbegin();
+  while (it != sorted.cend() && other_it != other_sorted.cend()) {
+    if (it->second <= other_it->first) {
+      ++it;
+    } else if (other_it->second <= it->first) {
+      ++other_it;
+    } else {
+      return true;
+    }
   }
   return false;
 }
@@ -199,16 +271,12 @@ std::optional<RangeSet> RangeSet::GetSubRanges(size_t start_index, size_t num_of
   }
 
   RangeSet result;
-  size_t current_index = 0;
-  for (const auto& [range_start, range_end] : ranges_) {
+  size_t first_range = FindRangeIndex(start_index);
+  size_t current_index = offsets_[first_range];
+  for (auto it = ranges_.cbegin() + first_range; it != ranges_.cend(); ++it) {
+    const auto& [range_start, range_end] = *it;
     CHECK_LT(range_start, range_end);
     size_t blocks_in_range = range_end - range_start;
-    // Linear search to skip the ranges until we reach start_block.
-    if (current_index + blocks_in_range <= start_index) {
-      current_index += blocks_in_range;
-      continue;
-    }
-
     size_t trimmed_range_start = range_start;
     // We have found the first block range to read, trim the heading blocks.
     if (current_index < start_index) {
@@ -239,6 +307,7 @@ std::optional<RangeSet> RangeSet::GetSubRanges(size_t start_index, size_t num_of
 // Ranges in the the set should be mutually exclusive; and they're sorted by the start block.
 SortedRangeSet::SortedRangeSet(std::vector<Range>&& pairs) : RangeSet(std::move(pairs)) {
   std::sort(ranges_.begin(), ranges_.end());
+  UpdateOffsets();
 }
 
 void SortedRangeSet::Insert(const Range& to_insert) {
@@ -264,12 +333,11 @@ void SortedRangeSet::Insert(const SortedRangeSet& rs) {
       to_insert.second = std::max(to_insert.second, it->second);
     } else {
       ranges_.push_back(to_insert);
-      blocks_ += (to_insert.second - to_insert.first);
       to_insert = *it;
     }
   }
   ranges_.push_back(to_insert);
-  blocks_ += (to_insert.second - to_insert.first);
+  UpdateOffsets();
 }
 
 // Compute the block range the file occupies, and insert that range.
@@ -295,21 +363,17 @@ bool SortedRangeSet::Overlaps(size_t start, size_t len) const {
 // + 10) in a range represented by this SortedRangeSet.
 size_t SortedRangeSet::GetOffsetInRangeSet(size_t old_offset) const {
   size_t old_block_start = old_offset / kBlockSize;
-  size_t new_block_start = 0;
-  for (const auto& [start, end] : ranges_) {
-    // Find the index of old_block_start.
-    if (old_block_start >= end) {
-      new_block_start += (end - start);
-    } else if (old_block_start >= start) {
-      new_block_start += (old_block_start - start);
-      return (new_block_start * kBlockSize + old_offset % kBlockSize);
-    } else {
-      CHECK(false) << "block_start " << old_block_start
-                   << " is missing between two ranges: " << ToString();
-      return 0;
-    }
-  }
-  CHECK(false) << "block_start " << old_block_start
-               << " exceeds the limit of current RangeSet: " << ToString();
-  return 0;
+  // The last range that starts at or before old_block_start.
+  auto it = std::upper_bound(ranges_.cbegin(), ranges_.cend(), old_block_start,
+                             [](size_t block, const Range& range) { return block < range.first; });
+  CHECK(it != ranges_.cbegin()) << "block_start " << old_block_start
+                                << " is missing between two ranges: " << ToString();
+  --it;
+  CHECK_LT(old_block_start, it->second) << "block_start " << old_block_start
+                                        << (it + 1 == ranges_.cend()
+                                                ? " exceeds the limit of current RangeSet: "
+                                                : " is missing between two ranges: ")
+                                        << ToString();
+  size_t new_block_start = offsets_[it - ranges_.cbegin()] + (old_block_start - it->first);
+  return new_block_start * kBlockSize + old_offset % kBlockSize;
 }
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/sched_policy.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+// From linux/ioprio.h, which isn't available to userspace everywhere.
+static constexpr int kIoprioWhoProcess = 1;
+static constexpr int kIoprioClassBe = 2;
+static constexpr int kIoprioClassShift = 13;
+
+static bool ReadUint(const std::string& path, uint64_t* value) {
+  std::string content;
+  return android::base::ReadFileToString(path, &content) &&
+         android::base::ParseUint(android::base::Trim(content), value);
+}
+
+SchedPolicy& SchedPolicy::Get() {
+  static SchedPolicy policy("/sys/devices/system/cpu");
+  return policy;
+}
+
+SchedPolicy::SchedPolicy(const std::string& cpu_dir) : cpu_dir_(cpu_dir) {}
+
+void SchedPolicy::SetOptions(const SchedOptions& options) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  options_ = options;
+}
+
+void SchedPolicy::MaybeReadTopology() {
+  if (topology_read_) {
+    return;
+  }
+  topology_read_ = true;
+
+  std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(cpu_dir_.c_str()), closedir);
+  if (!dir) {
+    PLOG(WARNING) << "Failed to open " << cpu_dir_;
+    return;
+  }
+  std::map<int, uint64_t> capacities;
+  while (dirent* entry = readdir(dir.get())) {
+    std::string_view name = entry->d_name;
+    int cpu;
+    if (!android::base::ConsumePrefix(&name, "cpu") ||
+        !android::base::ParseInt(std::string(name), &cpu, 0)) {
+      continue;
+    }
+    std::string cpu_path = cpu_dir_ + "/" + entry->d_name;
+    uint64_t capacity;
+    if (!ReadUint(cpu_path + "/cpu_capacity", &capacity) &&
+        !ReadUint(cpu_path + "/cpufreq/cpuinfo_max_freq", &capacity)) {
+      LOG(INFO) << "Unknown capacity of cpu" << cpu << "; not pinning threads";
+      return;
+    }
+    capacities.emplace(cpu, capacity);
+  }
+  if (capacities.empty()) {
+    return;
+  }
+
+  uint64_t min_capacity = std::min_element(capacities.begin(), capacities.end(),
+                                           [](const auto& a, const auto& b) {
+                                             return a.second < b.second;
+                                           })->second;
+  for (const auto& [cpu, capacity] : capacities) {
+    (capacity == min_capacity ? little_cpus_ : big_cpus_).push_back(cpu);
+  }
+  if (big_cpus_.empty()) {
+    little_cpus_.clear();
+    return;
+  }
+  LOG(INFO) << "Big cores: " << android::base::Join(big_cpus_, ",")
+            << ", little cores: " << android::base::Join(little_cpus_, ",");
+}
+
+std::vector<int> SchedPolicy::GetCpus(ThreadClass thread_class) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!options_.pin_threads) {
+    return {};
+  }
+  MaybeReadTopology();
+  return thread_class == ThreadClass::kCompute ? big_cpus_ : little_cpus_;
+}
+
+bool SchedPolicy::Apply(ThreadClass thread_class) {
+  std::vector<int> cpus = GetCpus(thread_class);
+  SchedOptions options;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    options = options_;
+  }
+  bool compute = thread_class == ThreadClass::kCompute;
+
+  bool result = true;
+  if (!cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+      CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+      PLOG(WARNING) << "Failed to pin the thread to cpus " << android::base::Join(cpus, ",");
+      result = false;
+    }
+  }
+  // On Linux, these apply to the calling thread alone.
+  if (setpriority(PRIO_PROCESS, 0, compute ? options.compute_nice : options.ui_nice) != 0) {
+    PLOG(WARNING) << "Failed to set the nice value of the thread";
+    result = false;
+  }
+  int io_priority = compute ? options.compute_io_priority : options.ui_io_priority;
+  if (io_priority >= 0 &&
+      syscall(SYS_ioprio_set, kIoprioWhoProcess, 0,
+              (kIoprioClassBe << kIoprioClassShift) | std::min(io_priority, 7)) != 0) {
+    PLOG(WARNING) << "Failed to set the I/O priority of the thread";
+    result = false;
+  }
+  return result;
+}
+
+ScopedSchedPolicy::ScopedSchedPolicy(SchedPolicy* policy, ThreadClass thread_class) {
+  CPU_ZERO(&affinity_);
+  affinity_saved_ = sched_getaffinity(0, sizeof(affinity_), &affinity_) == 0;
+  // getpriority() may return -1 as a nice value.
+  errno = 0;
+  nice_ = getpriority(PRIO_PROCESS, 0);
+  nice_saved_ = errno == 0;
+  io_priority_ = syscall(SYS_ioprio_get, kIoprioWhoProcess, 0);
+  if (!affinity_saved_ || !nice_saved_ || io_priority_ < 0) {
+    PLOG(WARNING) << "Failed to read the scheduling settings of the thread";
+  }
+
+  policy->Apply(thread_class);
+}
+
+ScopedSchedPolicy::~ScopedSchedPolicy() {
+  if (affinity_saved_ && sched_setaffinity(0, sizeof(affinity_), &affinity_) != 0) {
+    PLOG(WARNING) << "Failed to restore the affinity of the thread";
+  }
+  if (nice_saved_ && setpriority(PRIO_PROCESS, 0, nice_) != 0) {
+    PLOG(WARNING) << "Failed to restore the nice value of the thread";
+  }
+  if (io_priority_ >= 0 && syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, io_priority_) != 0) {
+    PLOG(WARNING) << "Failed to restore the I/O priority of the thread";
+  }
+}
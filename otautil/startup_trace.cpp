@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/startup_trace.h"
+
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+
+// Returns |value| as a JSON string literal.
+static std::string JsonString(const std::string& value) {
+  std::string result = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      result += android::base::StringPrintf("\\u%04x", c);
+    } else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+StartupTrace& StartupTrace::Get() {
+  static StartupTrace trace;
+  return trace;
+}
+
+uint64_t StartupTrace::NowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void StartupTrace::AddEvent(const std::string& name, uint64_t begin_us, uint64_t end_us) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  events_.push_back(Event{ name, begin_us, end_us, gettid() });
+}
+
+std::string StartupTrace::ToJson() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string json = "{\"traceEvents\":[";
+  pid_t pid = getpid();
+  for (size_t i = 0; i < events_.size(); i++) {
+    const Event& event = events_[i];
+    json += android::base::StringPrintf(
+        "%s\n{\"name\":%s,\"cat\":\"startup\",\"ph\":\"X\",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64
+        ",\"pid\":%d,\"tid\":%d}",
+        i == 0 ? "" : ",", JsonString(event.name).c_str(), event.begin_us,
+        event.end_us - event.begin_us, pid, event.tid);
+  }
+  json += "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"build\":" +
+          JsonString(android::base::GetProperty("ro.build.fingerprint", "")) + "}}\n";
+  return json;
+}
+
+bool StartupTrace::Write(const std::string& path) const {
+  if (!android::base::WriteStringToFile(ToJson(), path)) {
+    PLOG(ERROR) << "Failed to write the startup trace to " << path;
+    return false;
+  }
+  return true;
+}
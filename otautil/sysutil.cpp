@@ -22,84 +22,180 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <limits>
 #include <string>
+#include <string_view>
 #include <vector>
 
-#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/properties.h>
-#include <android-base/strings.h>
+#include <android-base/scopeguard.h>
 #include <android-base/unique_fd.h>
 #include <cutils/android_reboot.h>
 
+// Block maps that still have more ranges than this once the contiguous ones are merged aren't
+// mapped, as each range takes a VMA (out of vm.max_map_count, 65530 by default) and an mmap() call.
+// Callers fall back to reading such packages through the block map with pread(), as
+// FuseBlockDataProvider does.
+static constexpr size_t kMaxMappedBlockRanges = 8192;
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+// Consumes the decimal number, after optional leading spaces or tabs, at the start of |*text|.
+static bool ConsumeNumber(std::string_view* text, uint64_t* value) {
+  size_t pos = text->find_first_not_of(" \t");
+  if (pos == std::string_view::npos) {
+    return false;
+  }
+  uint64_t result = 0;
+  size_t digits_start = pos;
+  for (; pos < text->size() && (*text)[pos] >= '0' && (*text)[pos] <= '9'; pos++) {
+    uint64_t digit = (*text)[pos] - '0';
+    if (result > (std::numeric_limits<uint64_t>::max() - digit) / 10) {
+      return false;
+    }
+    result = result * 10 + digit;
+  }
+  if (pos == digits_start) {
+    return false;
+  }
+  text->remove_prefix(pos);
+  *value = result;
+  return true;
+}
+
+// Moves the next line of |*text| (without the newline) to |*line|. Returns false at the end.
+static bool NextLine(std::string_view* text, std::string_view* line) {
+  if (text->empty()) {
+    return false;
+  }
+  size_t newline = text->find('\n');
+  *line = text->substr(0, newline);
+  text->remove_prefix(newline == std::string_view::npos ? text->size() : newline + 1);
+  return true;
+}
+
+// Parses a line of |count| numbers into |values|, allowing only spaces and tabs after them.
+static bool ParseNumbers(std::string_view line, size_t count, uint64_t* values) {
+  for (size_t i = 0; i < count; i++) {
+    if (!ConsumeNumber(&line, &values[i])) {
+      return false;
+    }
+  }
+  return line.find_first_not_of(" \t\r") == std::string_view::npos;
+}
+
 BlockMapData BlockMapData::ParseBlockMapFile(const std::string& block_map_path) {
-  std::string content;
-  if (!android::base::ReadFileToString(block_map_path, &content)) {
+  // The block map is parsed in place over a mapping of the file, as it can hold hundreds of
+  // thousands of ranges on a fragmented /data.
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(block_map_path.c_str(), O_RDONLY)));
+  struct stat sb;
+  if (fd == -1 || fstat(fd, &sb) == -1) {
     PLOG(ERROR) << "Failed to read " << block_map_path;
     return {};
   }
-
-  std::vector<std::string> lines = android::base::Split(android::base::Trim(content), "\n");
-  if (lines.size() < 4) {
-    LOG(ERROR) << "Block map file is too short: " << lines.size();
+  if (sb.st_size == 0) {
+    LOG(ERROR) << "Block map file is empty";
+    return {};
+  }
+  void* content_addr = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (content_addr == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map " << block_map_path;
     return {};
   }
+  auto unmap = android::base::make_scope_guard([&]() { munmap(content_addr, sb.st_size); });
+  madvise(content_addr, sb.st_size, MADV_SEQUENTIAL);
+
+  std::string_view text(static_cast<const char*>(content_addr), sb.st_size);
+  size_t first = text.find_first_not_of(" \t\r\n");
+  size_t last = text.find_last_not_of(" \t\r\n");
+  text = first == std::string_view::npos ? std::string_view()
+                                         : text.substr(first, last - first + 1);
+
+  std::string_view line[3];
+  for (size_t i = 0; i < 3; i++) {
+    if (!NextLine(&text, &line[i]) || text.empty()) {
+      LOG(ERROR) << "Block map file is too short: " << (i + 1) << " lines";
+      return {};
+    }
+  }
 
-  const std::string& block_dev = lines[0];
+  std::string block_dev(line[0]);
 
-  uint64_t file_size;
-  uint32_t blksize;
-  if (sscanf(lines[1].c_str(), "%" SCNu64 "%" SCNu32, &file_size, &blksize) != 2) {
-    LOG(ERROR) << "Failed to parse file size and block size: " << lines[1];
+  uint64_t sizes[2];
+  if (!ParseNumbers(line[1], 2, sizes) || sizes[1] > std::numeric_limits<uint32_t>::max()) {
+    LOG(ERROR) << "Failed to parse file size and block size: " << line[1];
     return {};
   }
+  uint64_t file_size = sizes[0];
+  uint32_t blksize = sizes[1];
 
   if (file_size == 0 || blksize == 0) {
     LOG(ERROR) << "Invalid size in block map file: size " << file_size << ", blksize " << blksize;
     return {};
   }
 
-  size_t range_count;
-  if (sscanf(lines[2].c_str(), "%zu", &range_count) != 1) {
-    LOG(ERROR) << "Failed to parse block map header: " << lines[2];
+  uint64_t range_count;
+  if (!ParseNumbers(line[2], 1, &range_count)) {
+    LOG(ERROR) << "Failed to parse block map header: " << line[2];
     return {};
   }
 
   uint64_t blocks = ((file_size - 1) / blksize) + 1;
-  if (blocks > std::numeric_limits<uint32_t>::max() || range_count == 0 ||
-      lines.size() != 3 + range_count) {
+  if (blocks > std::numeric_limits<uint32_t>::max() || range_count == 0) {
     LOG(ERROR) << "Invalid data in block map file: size " << file_size << ", blksize " << blksize
-               << ", range_count " << range_count << ", lines " << lines.size();
+               << ", range_count " << range_count;
     return {};
   }
 
-  RangeSet ranges;
+  // Each range takes 4 bytes at least ("0 1\n"), which bounds the reservation for bogus counts.
+  // Ranges that follow each other on the block device (uncrypt writes one per extent, and extents
+  // are often split) are merged as they're read.
+  std::vector<Range> ranges;
+  ranges.reserve(std::min<uint64_t>(range_count, text.size() / 4 + 1));
   uint64_t remaining_blocks = blocks;
-  for (size_t i = 0; i < range_count; ++i) {
-    const std::string& line = lines[i + 3];
-    uint64_t start, end;
-    if (sscanf(line.c_str(), "%" SCNu64 "%" SCNu64, &start, &end) != 2) {
-      LOG(ERROR) << "failed to parse range " << i << ": " << line;
+  for (uint64_t i = 0; i < range_count; ++i) {
+    std::string_view range_line;
+    if (!NextLine(&text, &range_line)) {
+      LOG(ERROR) << "Invalid data in block map file: " << i << " of " << range_count
+                 << " ranges";
       return {};
     }
+    uint64_t range[2];
+    if (!ParseNumbers(range_line, 2, range)) {
+      LOG(ERROR) << "failed to parse range " << i << ": " << range_line;
+      return {};
+    }
+    auto [start, end] = range;
     uint64_t range_blocks = end - start;
     if (end <= start || range_blocks > remaining_blocks) {
       LOG(ERROR) << "Invalid range: " << start << " " << end;
       return {};
     }
-    ranges.PushBack({ start, end });
+    if (!ranges.empty() && ranges.back().second == start) {
+      ranges.back().second = end;
+    } else {
+      ranges.emplace_back(start, end);
+    }
     remaining_blocks -= range_blocks;
   }
 
+  if (!text.empty()) {
+    LOG(ERROR) << "Invalid data in block map file: more than " << range_count << " ranges";
+    return {};
+  }
   if (remaining_blocks != 0) {
     LOG(ERROR) << "Invalid ranges: remaining blocks " << remaining_blocks;
     return {};
   }
 
-  return BlockMapData(block_dev, file_size, blksize, std::move(ranges));
+  return BlockMapData(block_dev, file_size, blksize, RangeSet(std::move(ranges)));
 }
 
 bool MemMapping::MapFD(int fd) {
@@ -108,17 +204,20 @@ bool MemMapping::MapFD(int fd) {
     PLOG(ERROR) << "fstat(" << fd << ") failed";
     return false;
   }
+  return MapFD(fd, sb.st_size);
+}
 
-  void* memPtr = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+bool MemMapping::MapFD(int fd, size_t size) {
+  void* memPtr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
   if (memPtr == MAP_FAILED) {
-    PLOG(ERROR) << "mmap(" << sb.st_size << ", R, PRIVATE, " << fd << ", 0) failed";
+    PLOG(ERROR) << "mmap(" << size << ", R, PRIVATE, " << fd << ", 0) failed";
     return false;
   }
 
   addr = static_cast<unsigned char*>(memPtr);
-  length = sb.st_size;
+  length = size;
   ranges_.clear();
-  ranges_.emplace_back(MappedRange{ memPtr, static_cast<size_t>(sb.st_size) });
+  ranges_.emplace_back(MappedRange{ memPtr, size });
 
   return true;
 }
@@ -134,6 +233,13 @@ bool MemMapping::MapBlockFile(const std::string& filename) {
     return false;
   }
 
+  // ParseBlockMapFile() has already merged the contiguous ranges, so each one takes a mapping.
+  const RangeSet& mapped_ranges = block_map_data.block_ranges();
+  if (mapped_ranges.size() > kMaxMappedBlockRanges) {
+    LOG(ERROR) << "Block map is too fragmented to map: " << mapped_ranges.size() << " ranges";
+    return false;
+  }
+
   // Reserve enough contiguous address space for the whole file.
   uint32_t blksize = block_map_data.block_size();
   uint64_t blocks = ((block_map_data.file_size() - 1) / blksize) + 1;
@@ -154,7 +260,7 @@ bool MemMapping::MapBlockFile(const std::string& filename) {
 
   auto next = static_cast<unsigned char*>(reserve);
   size_t remaining_size = blocks * blksize;
-  for (const auto& [start, end] : block_map_data.block_ranges()) {
+  for (const auto& [start, end] : mapped_ranges) {
     size_t range_size = (end - start) * blksize;
     void* range_start = mmap(next, range_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
                              static_cast<off_t>(start) * blksize);
@@ -177,7 +283,7 @@ bool MemMapping::MapBlockFile(const std::string& filename) {
   addr = static_cast<unsigned char*>(reserve);
   length = block_map_data.file_size();
 
-  LOG(INFO) << "mmapped " << block_map_data.block_ranges().size() << " ranges";
+  LOG(INFO) << "mmapped " << mapped_ranges.size() << " ranges";
 
   return true;
 }
@@ -210,6 +316,87 @@ bool MemMapping::MapFile(const std::string& fn) {
   return true;
 }
 
+bool MemMapping::MapDevice(const std::string& path, size_t size) {
+  if (size == 0) {
+    LOG(ERROR) << "Can't map zero bytes of " << path;
+    return false;
+  }
+
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY)));
+  if (fd == -1) {
+    PLOG(ERROR) << "Unable to open '" << path << "'";
+    return false;
+  }
+
+  // Accessing the mapping past the end of the file would raise SIGBUS.
+  off64_t file_size = lseek64(fd, 0, SEEK_END);
+  if (file_size == -1) {
+    PLOG(ERROR) << "Failed to get the size of '" << path << "'";
+    return false;
+  }
+  if (static_cast<uint64_t>(file_size) < size) {
+    LOG(ERROR) << "'" << path << "' has " << file_size << " bytes, fewer than " << size;
+    return false;
+  }
+
+  if (!MapFD(fd, size)) {
+    LOG(ERROR) << "Map of '" << path << "' failed";
+    return false;
+  }
+  return true;
+}
+
+bool MemMapping::Advise(Access access) const {
+  int advice = access == Access::kSequential ? MADV_SEQUENTIAL : MADV_NORMAL;
+  for (const auto& range : ranges_) {
+    if (madvise(range.addr, range.length, advice) == -1) {
+      PLOG(WARNING) << "Failed to madvise(" << range.addr << ", " << range.length << ", "
+                    << advice << ")";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MemMapping::Prefault(size_t offset, size_t size) const {
+  // Checked once: an older kernel rejects the advice, for every mapping.
+  static std::atomic<bool> unsupported = false;
+  if (unsupported || offset >= length) {
+    return false;
+  }
+  size = std::min(size, length - offset);
+
+  // The ranges of a block map are mapped back to back, so the whole mapping can be advised at once.
+  uintptr_t page_size = getpagesize();
+  uintptr_t start = reinterpret_cast<uintptr_t>(addr + offset) & ~(page_size - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(addr + offset + size);
+  if (madvise(reinterpret_cast<void*>(start), end - start, MADV_POPULATE_READ) == -1) {
+    if (errno == EINVAL) {
+      unsupported = true;
+    } else {
+      PLOG(WARNING) << "Failed to prefault " << size << " bytes at offset " << offset;
+    }
+    return false;
+  }
+  return true;
+}
+
+bool MemMapping::WillNeed(size_t offset, size_t size) const {
+  if (offset >= length) {
+    return false;
+  }
+  size = std::min(size, length - offset);
+
+  uintptr_t page_size = getpagesize();
+  uintptr_t start = reinterpret_cast<uintptr_t>(addr + offset) & ~(page_size - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(addr + offset + size);
+  if (madvise(reinterpret_cast<void*>(start), end - start, MADV_WILLNEED) == -1) {
+    PLOG(WARNING) << "Failed to madvise(MADV_WILLNEED) " << size << " bytes at offset " << offset;
+    return false;
+  }
+  return true;
+}
+
 MemMapping::~MemMapping() {
   for (const auto& range : ranges_) {
     if (munmap(range.addr, range.length) == -1) {
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/thermal_throttle.h"
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+static bool ReadInt(const std::string& path, int* value) {
+  std::string content;
+  return android::base::ReadFileToString(path, &content) &&
+         android::base::ParseInt(android::base::Trim(content), value);
+}
+
+ThermalThrottle& ThermalThrottle::Get() {
+  static ThermalThrottle throttle("/sys/class/thermal");
+  return throttle;
+}
+
+ThermalThrottle::ThermalThrottle(const std::string& thermal_dir,
+                                 std::chrono::milliseconds sample_interval)
+    : thermal_dir_(thermal_dir), sample_interval_(sample_interval) {}
+
+size_t ThermalThrottle::Scale(size_t max) {
+  if (max <= 1) {
+    return max;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  MaybeSample();
+  return 1 + std::lround((max - 1) * level_);
+}
+
+double ThermalThrottle::level() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  MaybeSample();
+  return level_;
+}
+
+void ThermalThrottle::MaybeSample() {
+  auto now = std::chrono::steady_clock::now();
+  if (sampled_ && now - last_sample_ < sample_interval_) {
+    return;
+  }
+
+  if (!sampled_) {
+    std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(thermal_dir_.c_str()), closedir);
+    dirent* de;
+    while (dir && (de = readdir(dir.get())) != nullptr) {
+      if (!android::base::StartsWith(de->d_name, "thermal_zone")) {
+        continue;
+      }
+      std::string zone_dir = thermal_dir_ + "/" + de->d_name;
+      int limit = std::numeric_limits<int>::max();
+      for (size_t i = 0;; i++) {
+        std::string trip_point = zone_dir + "/trip_point_" + std::to_string(i);
+        std::string type;
+        int temp;
+        if (!android::base::ReadFileToString(trip_point + "_type", &type) ||
+            !ReadInt(trip_point + "_temp", &temp)) {
+          break;
+        }
+        // Active trip points only turn on cooling devices (e.g. fans).
+        type = android::base::Trim(type);
+        if ((type == "passive" || type == "hot" || type == "critical") && temp > 0) {
+          limit = std::min(limit, temp);
+        }
+      }
+      if (limit != std::numeric_limits<int>::max()) {
+        zones_.push_back({ zone_dir + "/temp", limit });
+      }
+    }
+    LOG(INFO) << "Throttling the install on " << zones_.size() << " thermal zones";
+  }
+  sampled_ = true;
+  last_sample_ = now;
+
+  int headroom = kFullSpeedHeadroom;
+  for (const auto& zone : zones_) {
+    int temp;
+    if (ReadInt(zone.temp_path, &temp)) {
+      headroom = std::min(headroom, zone.limit - temp);
+    }
+  }
+
+  double target = std::clamp(static_cast<double>(headroom) / kFullSpeedHeadroom, 0.0, 1.0);
+  double level = target < level_ ? target : std::min(target, level_ + kSpeedUpStep);
+  if (level != level_) {
+    LOG(INFO) << "Thermal headroom " << headroom / 1000.0 << "C, running the install at "
+              << static_cast<int>(level * 100) << "%";
+    level_ = level;
+  }
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/updater_commands.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+#include <android-base/parsedouble.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+struct FrameHeader {
+  uint8_t type;
+  uint8_t reserved[3];
+  uint32_t size;
+};
+static_assert(sizeof(FrameHeader) == 8, "FrameHeader must be 8 bytes");
+
+struct ProgressPayload {
+  double fraction;
+  int32_t seconds;
+  int32_t reserved;
+};
+static_assert(sizeof(ProgressPayload) == 16, "ProgressPayload must be 16 bytes");
+
+static constexpr size_t kBufferSize = 64 * 1024;
+
+// The text names of the commands, in the order of UpdaterCommandType.
+static constexpr const char* kCommandNames[] = {
+  "",      "progress",   "set_progress",  "ui_print",      "log",
+  "stage", "wipe_cache", "clear_display", "enable_reboot", "retry_update",
+};
+
+std::string FormatUpdaterCommandLine(const UpdaterCommand& command) {
+  switch (command.type) {
+    case UpdaterCommandType::PROGRESS:
+      return android::base::StringPrintf("progress %f %d", command.fraction, command.seconds);
+    case UpdaterCommandType::SET_PROGRESS:
+      return android::base::StringPrintf("set_progress %f", command.fraction);
+    case UpdaterCommandType::UI_PRINT:
+    case UpdaterCommandType::LOG:
+    case UpdaterCommandType::STAGE:
+      return kCommandNames[static_cast<size_t>(command.type)] + (" " + command.text);
+    case UpdaterCommandType::WIPE_CACHE:
+    case UpdaterCommandType::CLEAR_DISPLAY:
+    case UpdaterCommandType::ENABLE_REBOOT:
+    case UpdaterCommandType::RETRY_UPDATE:
+      return kCommandNames[static_cast<size_t>(command.type)];
+    case UpdaterCommandType::TEXT:
+    case UpdaterCommandType::INVALID:
+      return command.text;
+  }
+  return command.text;
+}
+
+void EncodeUpdaterCommandFrame(const UpdaterCommand& command, std::string* frame) {
+  CHECK_NE(command.type, UpdaterCommandType::INVALID);
+  FrameHeader header = { static_cast<uint8_t>(command.type), {}, 0 };
+  ProgressPayload progress = { command.fraction, command.seconds, 0 };
+  std::string_view payload;
+  switch (command.type) {
+    case UpdaterCommandType::PROGRESS:
+      payload = std::string_view(reinterpret_cast<const char*>(&progress), sizeof(progress));
+      break;
+    case UpdaterCommandType::SET_PROGRESS:
+      payload = std::string_view(reinterpret_cast<const char*>(&progress.fraction),
+                                 sizeof(progress.fraction));
+      break;
+    case UpdaterCommandType::TEXT:
+    case UpdaterCommandType::UI_PRINT:
+    case UpdaterCommandType::LOG:
+    case UpdaterCommandType::STAGE:
+      payload = command.text;
+      break;
+    default:
+      break;
+  }
+  header.size = payload.size();
+  frame->append(reinterpret_cast<const char*>(&header), sizeof(header));
+  frame->append(payload);
+}
+
+bool ParseUpdaterCommandLine(std::string_view line, UpdaterCommand* command) {
+  size_t space = line.find(' ');
+  std::string_view name = line.substr(0, space);
+  if (name.empty()) {
+    return false;
+  }
+  // Get rid of the leading and trailing spaces.
+  std::string args =
+      space == std::string_view::npos ? "" : android::base::Trim(std::string(line.substr(space)));
+
+  *command = {};
+  command->type = UpdaterCommandType::TEXT;
+  for (size_t i = 1; i < std::size(kCommandNames); i++) {
+    if (name == kCommandNames[i]) {
+      command->type = static_cast<UpdaterCommandType>(i);
+      break;
+    }
+  }
+
+  switch (command->type) {
+    case UpdaterCommandType::PROGRESS: {
+      std::vector<std::string> tokens = android::base::Split(args, " ");
+      if (tokens.size() != 2 ||
+          !android::base::ParseDouble(tokens[0].c_str(), &command->fraction) ||
+          !android::base::ParseInt(tokens[1], &command->seconds)) {
+        command->type = UpdaterCommandType::INVALID;
+      }
+      break;
+    }
+    case UpdaterCommandType::SET_PROGRESS:
+      if (args.empty() || args.find(' ') != std::string::npos ||
+          !android::base::ParseDouble(args.c_str(), &command->fraction)) {
+        command->type = UpdaterCommandType::INVALID;
+      }
+      break;
+    case UpdaterCommandType::LOG:
+      if (args.empty()) {
+        command->type = UpdaterCommandType::INVALID;
+      }
+      command->text = std::move(args);
+      break;
+    case UpdaterCommandType::UI_PRINT:
+    case UpdaterCommandType::STAGE:
+      command->text = std::move(args);
+      break;
+    default:
+      break;
+  }
+  if (command->type == UpdaterCommandType::TEXT || command->type == UpdaterCommandType::INVALID) {
+    command->text = line;
+  }
+  return true;
+}
+
+UpdaterCommandReader::UpdaterCommandReader(android::base::unique_fd fd)
+    : fd_(std::move(fd)), buffer_(kBufferSize) {}
+
+bool UpdaterCommandReader::Fill() {
+  if (eof_) {
+    return false;
+  }
+  if (start_ > 0) {
+    std::copy(buffer_.begin() + start_, buffer_.begin() + end_, buffer_.begin());
+    end_ -= start_;
+    start_ = 0;
+  }
+  if (end_ == buffer_.size()) {
+    buffer_.resize(buffer_.size() * 2);
+  }
+  ssize_t n = TEMP_FAILURE_RETRY(read(fd_.get(), buffer_.data() + end_, buffer_.size() - end_));
+  if (n <= 0) {
+    if (n == -1) {
+      PLOG(ERROR) << "Failed to read the command pipe";
+    }
+    eof_ = true;
+    return false;
+  }
+  end_ += n;
+  return true;
+}
+
+bool UpdaterCommandReader::NextFrame(UpdaterCommand* command) {
+  FrameHeader header;
+  while (end_ - start_ < sizeof(header)) {
+    if (!Fill()) {
+      if (end_ != start_) {
+        LOG(ERROR) << "Truncated command frame";
+      }
+      return false;
+    }
+  }
+  memcpy(&header, buffer_.data() + start_, sizeof(header));
+  if (header.size > kMaxCommandSize) {
+    LOG(ERROR) << "Command frame of type " << static_cast<int>(header.type) << " is too large ("
+               << header.size << " bytes)";
+    return false;
+  }
+  while (end_ - start_ < sizeof(header) + header.size) {
+    if (!Fill()) {
+      LOG(ERROR) << "Truncated command frame";
+      return false;
+    }
+  }
+  const char* payload = buffer_.data() + start_ + sizeof(header);
+  start_ += sizeof(header) + header.size;
+
+  *command = {};
+  command->type = static_cast<UpdaterCommandType>(header.type);
+  size_t expected_size = 0;
+  switch (command->type) {
+    case UpdaterCommandType::PROGRESS: {
+      ProgressPayload progress;
+      expected_size = sizeof(progress);
+      if (header.size == expected_size) {
+        memcpy(&progress, payload, sizeof(progress));
+        command->fraction = progress.fraction;
+        command->seconds = progress.seconds;
+      }
+      break;
+    }
+    case UpdaterCommandType::SET_PROGRESS:
+      expected_size = sizeof(command->fraction);
+      if (header.size == expected_size) {
+        memcpy(&command->fraction, payload, sizeof(command->fraction));
+      }
+      break;
+    case UpdaterCommandType::TEXT:
+      // Any command of the text protocol, which is parsed as such.
+      if (!ParseUpdaterCommandLine(std::string_view(payload, header.size), command)) {
+        command->type = UpdaterCommandType::INVALID;
+      }
+      return true;
+    case UpdaterCommandType::LOG:
+      command->text.assign(payload, header.size);
+      if (command->text.empty()) {
+        command->type = UpdaterCommandType::INVALID;
+        command->text = "log";
+      }
+      return true;
+    case UpdaterCommandType::UI_PRINT:
+    case UpdaterCommandType::STAGE:
+      command->text.assign(payload, header.size);
+      return true;
+    case UpdaterCommandType::WIPE_CACHE:
+    case UpdaterCommandType::CLEAR_DISPLAY:
+    case UpdaterCommandType::ENABLE_REBOOT:
+    case UpdaterCommandType::RETRY_UPDATE:
+      break;
+    default:
+      // Skipped, as the size says how long it is.
+      command->type = UpdaterCommandType::TEXT;
+      command->text = android::base::StringPrintf("<frame of type %d>", header.type);
+      return true;
+  }
+  if (header.size != expected_size) {
+    command->type = UpdaterCommandType::INVALID;
+    command->text = android::base::StringPrintf("<frame of type %d, with %u bytes>", header.type,
+                                                header.size);
+  }
+  return true;
+}
+
+bool UpdaterCommandReader::Next(UpdaterCommand* command) {
+  while (true) {
+    if (binary_) {
+      return NextFrame(command);
+    }
+
+    // Find the end of the line, reading more of the pipe until there's one.
+    size_t scanned = 0;
+    size_t length;
+    bool has_newline = false;
+    while (true) {
+      auto line_start = buffer_.begin() + start_;
+      auto newline = std::find(line_start + scanned, buffer_.begin() + end_, '\n');
+      if (newline != buffer_.begin() + end_) {
+        length = newline - line_start;
+        has_newline = true;
+        break;
+      }
+      scanned = end_ - start_;
+      if (scanned >= kMaxCommandSize) {
+        length = kMaxCommandSize;
+        break;
+      }
+      if (!Fill()) {
+        // The last line may have no newline.
+        if (scanned == 0) {
+          return false;
+        }
+        length = scanned;
+        break;
+      }
+    }
+
+    std::string_view line(buffer_.data() + start_, length);
+    start_ += length + (has_newline ? 1 : 0);
+    if (line == kBinaryCommandsAccept) {
+      binary_ = true;
+      continue;
+    }
+    if (ParseUpdaterCommandLine(line, command)) {
+      return true;
+    }
+  }
+}
@@ -18,24 +18,360 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/unique_fd.h>
 #include <selinux/label.h>
 #include <selinux/selinux.h>
 #include <ziparchive/zip_archive.h>
+#include <zlib.h>
 
 #include "otautil/dirutil.h"
 
 static constexpr mode_t UNZIP_DIRMODE = 0755;
 static constexpr mode_t UNZIP_FILEMODE = 0644;
 
+// Stored entries are copied (and their CRC-32 computed) this much at a time.
+static constexpr size_t kStoredCopyChunkSize = 1024 * 1024;
+
+// Copies the stored entry of |extraction| from |source| to |fd|, and checks its CRC-32.
+static bool CopyStoredEntry(const ExtractionSource& source, const EntryExtraction& extraction,
+                            int fd) {
+  const ZipEntry64& entry = extraction.entry;
+  if (entry.offset < 0 || static_cast<uint64_t>(entry.offset) > source.length ||
+      entry.uncompressed_length > source.length - entry.offset) {
+    LOG(ERROR) << "Entry \"" << extraction.path << "\" is out of the package";
+    return false;
+  }
+
+  const uint8_t* data = source.addr + entry.offset;
+  bool use_sendfile = source.fd != -1;
+  off_t offset = entry.offset;
+  uLong crc = crc32(0L, Z_NULL, 0);
+  for (uint64_t copied = 0; copied < entry.uncompressed_length;) {
+    size_t size = std::min<uint64_t>(kStoredCopyChunkSize, entry.uncompressed_length - copied);
+    if (use_sendfile) {
+      ssize_t sent = TEMP_FAILURE_RETRY(sendfile(fd, source.fd, &offset, size));
+      if (sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        // Not supported between these files; write from the mapping instead.
+        use_sendfile = false;
+        continue;
+      }
+      if (sent <= 0) {
+        PLOG(ERROR) << "Error copying \"" << extraction.path << "\"";
+        return false;
+      }
+      size = sent;
+    } else if (!android::base::WriteFully(fd, data + copied, size)) {
+      PLOG(ERROR) << "Error writing \"" << extraction.path << "\"";
+      return false;
+    }
+    crc = crc32(crc, data + copied, size);
+    copied += size;
+  }
+
+  if (crc != entry.crc32) {
+    LOG(ERROR) << "Entry \"" << extraction.path << "\" has CRC-32 " << std::hex << crc
+               << ", expected " << entry.crc32;
+    return false;
+  }
+  return true;
+}
+
+static bool ExtractEntry(ZipArchiveHandle zip, const EntryExtraction& extraction,
+                         const ExtractionSource* source) {
+  android::base::unique_fd fd = extraction.open();
+  if (fd == -1) {
+    return false;
+  }
+
+  if (source != nullptr && extraction.entry.method == kCompressStored) {
+    if (!CopyStoredEntry(*source, extraction, fd)) {
+      return false;
+    }
+  } else if (int err = ExtractEntryToFile(zip, &extraction.entry, fd); err != 0) {
+    LOG(ERROR) << "Error extracting \"" << extraction.path << "\" : " << ErrorCodeString(err);
+    return false;
+  }
+
+  if (fsync(fd) != 0) {
+    PLOG(ERROR) << "Error syncing file descriptor when extracting \"" << extraction.path << "\"";
+    return false;
+  }
+
+  if (close(fd.release()) != 0) {
+    PLOG(ERROR) << "Error closing \"" << extraction.path << "\"";
+    return false;
+  }
+  return true;
+}
+
+// StreamEntryToFile() writes this much at a time.
+static constexpr size_t kStreamChunkSize = 1024 * 1024;
+
+namespace {
+
+// Gathers the output of ProcessZipEntryContents() into chunks of |kStreamChunkSize|.
+struct StreamedEntry {
+  int fd;
+  const std::string& path;
+  const std::function<void(const uint8_t*, size_t)>& written;
+  std::vector<uint8_t> chunk;
+  size_t chunk_size = 0;
+
+  bool Flush() {
+    if (chunk_size == 0) {
+      return true;
+    }
+    if (!android::base::WriteFully(fd, chunk.data(), chunk_size)) {
+      PLOG(ERROR) << "Error writing \"" << path << "\"";
+      return false;
+    }
+    written(chunk.data(), chunk_size);
+    chunk_size = 0;
+    return true;
+  }
+
+  static bool Process(const uint8_t* data, size_t size, void* cookie) {
+    auto streamed = static_cast<StreamedEntry*>(cookie);
+    while (size > 0) {
+      size_t to_copy = std::min(size, streamed->chunk.size() - streamed->chunk_size);
+      memcpy(streamed->chunk.data() + streamed->chunk_size, data, to_copy);
+      streamed->chunk_size += to_copy;
+      data += to_copy;
+      size -= to_copy;
+      if (streamed->chunk_size == streamed->chunk.size() && !streamed->Flush()) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+}  // namespace
+
+bool StreamEntryToFile(ZipArchiveHandle zip, const EntryExtraction& extraction, int fd,
+                       const std::function<void(const uint8_t*, size_t)>& written,
+                       const ExtractionSource* source) {
+  const ZipEntry64& entry = extraction.entry;
+  if (source != nullptr && entry.method == kCompressStored) {
+    if (entry.offset < 0 || static_cast<uint64_t>(entry.offset) > source->length ||
+        entry.uncompressed_length > source->length - entry.offset) {
+      LOG(ERROR) << "Entry \"" << extraction.path << "\" is out of the package";
+      return false;
+    }
+    const uint8_t* data = source->addr + entry.offset;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    for (uint64_t copied = 0; copied < entry.uncompressed_length;) {
+      size_t size = std::min<uint64_t>(kStreamChunkSize, entry.uncompressed_length - copied);
+      if (!android::base::WriteFully(fd, data + copied, size)) {
+        PLOG(ERROR) << "Error writing \"" << extraction.path << "\"";
+        return false;
+      }
+      crc = crc32(crc, data + copied, size);
+      written(data + copied, size);
+      copied += size;
+    }
+    if (crc != entry.crc32) {
+      LOG(ERROR) << "Entry \"" << extraction.path << "\" has CRC-32 " << std::hex << crc
+                 << ", expected " << entry.crc32;
+      return false;
+    }
+  } else {
+    // A chunk, or less for a smaller entry.
+    size_t chunk_size = std::clamp<uint64_t>(entry.uncompressed_length, 1, kStreamChunkSize);
+    StreamedEntry streamed{ fd, extraction.path, written, std::vector<uint8_t>(chunk_size) };
+    if (int err = ProcessZipEntryContents(zip, &entry, StreamedEntry::Process, &streamed);
+        err != 0) {
+      LOG(ERROR) << "Error extracting \"" << extraction.path << "\" : " << ErrorCodeString(err);
+      return false;
+    }
+    if (!streamed.Flush()) {
+      return false;
+    }
+  }
+
+  if (fsync(fd) != 0) {
+    PLOG(ERROR) << "Error syncing file descriptor when extracting \"" << extraction.path << "\"";
+    return false;
+  }
+  return true;
+}
+
+bool ExtractEntriesInParallel(ZipArchiveHandle zip, std::vector<EntryExtraction>* extractions,
+                              size_t workers, uint64_t max_bytes_in_flight,
+                              const ExtractionSource* source) {
+  std::mutex mutex;
+  std::condition_variable fits;
+  size_t next = 0;
+  uint64_t bytes_in_flight = 0;
+  bool success = true;
+
+  // Each worker takes the entries in order, waiting for the ones in flight when the next one
+  // doesn't fit.
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      fits.wait(lock, [&]() {
+        return next == extractions->size() || bytes_in_flight == 0 ||
+               bytes_in_flight + (*extractions)[next].entry.uncompressed_length <=
+                   max_bytes_in_flight;
+      });
+      if (next == extractions->size()) {
+        return;
+      }
+      const EntryExtraction& extraction = (*extractions)[next++];
+      uint64_t size = extraction.entry.uncompressed_length;
+      bytes_in_flight += size;
+
+      lock.unlock();
+      bool extracted = ExtractEntry(zip, extraction, source);
+      lock.lock();
+
+      bytes_in_flight -= size;
+      success = success && extracted;
+      fits.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min(workers, extractions->size()); i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return success;
+}
+
+namespace {
+
+// The directories that the files of ExtractPackageRecursive() go to, and their parents up to the
+// destination. Each one is created (or found) once, and kept open so that the files and the
+// directories in it are created relative to it, without resolving its path again.
+class ExtractionDirs {
+ public:
+  ExtractionDirs(std::string root, struct selabel_handle* sehnd, const struct utimbuf* timestamp)
+      : root_(std::move(root)), sehnd_(sehnd), timestamp_(timestamp) {}
+
+  // Creates |dir|, a directory under the root (or the root itself), and its missing parents, unless
+  // that's done already.
+  bool Create(const std::string& dir) {
+    if (dirs_.count(dir) != 0) {
+      return true;
+    }
+    if (dir.size() <= root_.size()) {
+      if (mkdir_recursively(dir, UNZIP_DIRMODE, false, sehnd_, timestamp_) != 0) {
+        PLOG(ERROR) << "failed to create dir " << dir;
+        return false;
+      }
+      return Keep(dir, AT_FDCWD, dir);
+    }
+    if (!Create(android::base::Dirname(dir))) {
+      return false;
+    }
+
+    auto [dirfd, name] = At(dir);
+    char* secontext = nullptr;
+    if (sehnd_ && selabel_lookup(sehnd_, &secontext, dir.c_str(), UNZIP_DIRMODE) == 0) {
+      setfscreatecon(secontext);
+    }
+    bool created = mkdirat(dirfd, name.c_str(), UNZIP_DIRMODE) == 0;
+    int saved_errno = errno;
+    if (secontext) {
+      freecon(secontext);
+      setfscreatecon(nullptr);
+    }
+    if (!created && saved_errno != EEXIST) {
+      errno = saved_errno;
+      PLOG(ERROR) << "failed to create dir " << dir;
+      return false;
+    }
+    if (created && timestamp_ != nullptr) {
+      struct timespec times[2] = { { timestamp_->actime, 0 }, { timestamp_->modtime, 0 } };
+      if (utimensat(dirfd, name.c_str(), times, 0) != 0) {
+        PLOG(ERROR) << "Error touching \"" << dir << "\"";
+        return false;
+      }
+    }
+    return Keep(dir, dirfd, name);
+  }
+
+  // Returns the directory fd and the name to pass to the *at() calls for |path|, whose directory
+  // has been created. Past the limit on the open directories, that's AT_FDCWD and the full path.
+  std::pair<int, std::string> At(const std::string& path) const {
+    auto it = dirs_.find(android::base::Dirname(path));
+    if (it == dirs_.end() || it->second == -1) {
+      return { AT_FDCWD, path };
+    }
+    return { it->second.get(), android::base::Basename(path) };
+  }
+
+  // Makes the names in the directories (and the new directories themselves) durable.
+  bool Sync() const {
+    for (const auto& [dir, fd] : dirs_) {
+      android::base::unique_fd reopened;
+      if (fd == -1) {
+        reopened.reset(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+      }
+      if ((fd == -1 && reopened == -1) || fsync(fd == -1 ? reopened.get() : fd.get()) != 0) {
+        PLOG(ERROR) << "Error syncing directory \"" << dir << "\"";
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  // Up to this many directories are kept open; the others are used by their paths.
+  static constexpr size_t kMaxOpenDirs = 256;
+
+  // Opens |dir|, which is |name| in |dirfd|, and checks that it's a directory.
+  bool Keep(const std::string& dir, int dirfd, const std::string& name) {
+    android::base::unique_fd fd;
+    if (dirs_.size() < kMaxOpenDirs) {
+      fd.reset(openat(dirfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+      if (fd == -1) {
+        PLOG(ERROR) << "failed to open dir " << dir;
+        return false;
+      }
+    } else if (struct stat sb; fstatat(dirfd, name.c_str(), &sb, 0) != 0 || !S_ISDIR(sb.st_mode)) {
+      LOG(ERROR) << "failed to create dir " << dir;
+      return false;
+    }
+    dirs_.emplace(dir, std::move(fd));
+    return true;
+  }
+
+  const std::string root_;
+  struct selabel_handle* sehnd_;
+  const struct utimbuf* timestamp_;
+  // The fds of the directories, or -1 for the ones past kMaxOpenDirs.
+  std::map<std::string, android::base::unique_fd> dirs_;
+};
+
+}  // namespace
+
 bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
                              const std::string& dest_path, const struct utimbuf* timestamp,
-                             struct selabel_handle* sehnd) {
+                             struct selabel_handle* sehnd, size_t workers,
+                             uint64_t max_bytes_in_flight, const ExtractionSource* source) {
   if (!zip_path.empty() && zip_path[0] == '/') {
     LOG(ERROR) << "ExtractPackageRecursive(): zip_path must be a relative path " << zip_path;
     return false;
@@ -62,9 +398,14 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
   }
 
   std::unique_ptr<void, decltype(&EndIteration)> guard(cookie, EndIteration);
-  ZipEntry entry;
+  ZipEntry64 entry;
   std::string name;
-  int extractCount = 0;
+  std::vector<EntryExtraction> extractions;
+  // The directories are created here, as the workers could race to create the same one.
+  ExtractionDirs dirs(dest_path.size() > 1 && dest_path.back() == '/'
+                          ? dest_path.substr(0, dest_path.size() - 1)
+                          : dest_path,
+                      sehnd, timestamp);
   while (Next(cookie, &entry, &name) == 0) {
     CHECK_LE(prefix_path.size(), name.size());
     std::string path = target_dir + name.substr(prefix_path.size());
@@ -73,43 +414,58 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
       continue;
     }
 
-    if (mkdir_recursively(path.c_str(), UNZIP_DIRMODE, true, sehnd, timestamp) != 0) {
+    if (!dirs.Create(android::base::Dirname(path))) {
       LOG(ERROR) << "failed to create dir for " << path;
       return false;
     }
 
-    char* secontext = NULL;
-    if (sehnd) {
-      selabel_lookup(sehnd, &secontext, path.c_str(), UNZIP_FILEMODE);
-      setfscreatecon(secontext);
-    }
-    android::base::unique_fd fd(open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, UNZIP_FILEMODE));
-    if (fd == -1) {
-      PLOG(ERROR) << "Can't create target file \"" << path << "\"";
-      return false;
-    }
-    if (secontext) {
-      freecon(secontext);
-      setfscreatecon(NULL);
+    // The fscreate context is per thread, so it's set by the worker that creates the file.
+    std::string secontext;
+    if (char* context = nullptr;
+        sehnd && selabel_lookup(sehnd, &context, path.c_str(), UNZIP_FILEMODE) == 0) {
+      secontext = context;
+      freecon(context);
     }
+    auto open_file = [path, secontext, at = dirs.At(path)]() {
+      if (!secontext.empty()) {
+        setfscreatecon(secontext.c_str());
+      }
+      android::base::unique_fd fd(openat(at.first, at.second.c_str(),
+                                         O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, UNZIP_FILEMODE));
+      if (fd == -1) {
+        PLOG(ERROR) << "Can't create target file \"" << path << "\"";
+      }
+      if (!secontext.empty()) {
+        setfscreatecon(NULL);
+      }
+      return fd;
+    };
+    extractions.push_back({ entry, path, open_file });
+  }
 
-    int err = ExtractEntryToFile(zip, &entry, fd);
-    if (err != 0) {
-      LOG(ERROR) << "Error extracting \"" << path << "\" : " << ErrorCodeString(err);
-      return false;
-    }
+  // The largest entries go first, so that a large one doesn't start last and keep a single worker
+  // busy after the others are done.
+  std::stable_sort(extractions.begin(), extractions.end(), [](const auto& a, const auto& b) {
+    return a.entry.uncompressed_length > b.entry.uncompressed_length;
+  });
+  if (!ExtractEntriesInParallel(zip, &extractions, workers, max_bytes_in_flight, source)) {
+    return false;
+  }
 
-    if (fsync(fd) != 0) {
-      PLOG(ERROR) << "Error syncing file descriptor when extracting \"" << path << "\"";
-      return false;
-    }
+  // The files are synced as they're extracted; this makes their names in the directories (and the
+  // new directories themselves) durable too.
+  if (!dirs.Sync()) {
+    return false;
+  }
 
-    if (timestamp != nullptr && utime(path.c_str(), timestamp)) {
-      PLOG(ERROR) << "Error touching \"" << path << "\"";
+  int extractCount = 0;
+  for (const auto& extraction : extractions) {
+    if (timestamp != nullptr && utime(extraction.path.c_str(), timestamp)) {
+      PLOG(ERROR) << "Error touching \"" << extraction.path << "\"";
       return false;
     }
 
-    LOG(INFO) << "Extracted file \"" << path << "\"";
+    LOG(INFO) << "Extracted file \"" << extraction.path << "\"";
     ++extractCount;
   }
 
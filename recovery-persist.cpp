@@ -30,16 +30,22 @@
 //    --force-persist  ignore /cache mount, always rotate in the contents.
 //
 
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <array>
+#include <map>
 #include <string>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <private/android_logger.h> /* private pmsg functions */
 
@@ -51,6 +57,8 @@ constexpr const char* LAST_PMSG_FILE = "/sys/fs/pstore/pmsg-ramoops-0";
 constexpr const char* LAST_KMSG_FILE = "/data/misc/recovery/last_kmsg";
 constexpr const char* LAST_CONSOLE_FILE = "/sys/fs/pstore/console-ramoops-0";
 constexpr const char* ALT_LAST_CONSOLE_FILE = "/sys/fs/pstore/console-ramoops";
+// The fingerprints of the pstore files as of the last run, one "<name> <fingerprint>" line each.
+constexpr const char* PERSIST_STATE_FILE = "/data/misc/recovery/persist_state";
 
 // close a file, log an error if the error indicator is set
 static void check_and_fclose(FILE *fp, const char *name) {
@@ -139,6 +147,7 @@ bool compare_file(const char* file1, const char* file2) {
     auto bytes_remain = file_size(file1);
     while (bytes_remain > 0) {
         const auto bytes_to_read = std::min<size_t>(bytes_remain, buf1.size());
+        bytes_remain -= bytes_to_read;
 
         if (!android::base::ReadFully(fd1, buf1.data(), bytes_to_read)) {
             LOG(ERROR) << "Failed to read from " << file1;
@@ -155,13 +164,69 @@ bool compare_file(const char* file1, const char* file2) {
     return true;
 }
 
-void rotate_last_kmsg() {
+// Returns the size and the FNV-1a digest of |path| as "<size>:<digest>", or an empty string if it
+// can't be read. The pstore files are small and live in RAM, so this is much cheaper than decoding
+// them and comparing the result against the files in /data.
+static std::string file_fingerprint(const char* path) {
+  android::base::unique_fd fd(open(path, O_RDONLY | O_CLOEXEC));
+  if (fd == -1) {
+    return "";
+  }
+  uint64_t digest = 0xcbf29ce484222325ULL;
+  uint64_t size = 0;
+  std::array<uint8_t, 1024 * 16> buf{};
+  ssize_t bytes;
+  while ((bytes = TEMP_FAILURE_RETRY(read(fd, buf.data(), buf.size()))) > 0) {
+    for (ssize_t i = 0; i < bytes; i++) {
+      digest = (digest ^ buf[i]) * 0x100000001b3ULL;
+    }
+    size += bytes;
+  }
+  if (bytes == -1) {
+    return "";
+  }
+  return android::base::StringPrintf("%" PRIu64 ":%016" PRIx64, size, digest);
+}
+
+static std::map<std::string, std::string> read_persist_state() {
+  std::map<std::string, std::string> state;
+  std::string content;
+  if (!android::base::ReadFileToString(PERSIST_STATE_FILE, &content)) {
+    return state;
+  }
+  for (const auto& line : android::base::Split(content, "\n")) {
+    auto pieces = android::base::Split(line, " ");
+    if (pieces.size() == 2) {
+      state[pieces[0]] = pieces[1];
+    }
+  }
+  return state;
+}
+
+static void write_persist_state(const std::map<std::string, std::string>& state) {
+  std::string content;
+  for (const auto& [name, fingerprint] : state) {
+    if (!fingerprint.empty()) {
+      content += name + " " + fingerprint + "\n";
+    }
+  }
+  if (!android::base::WriteStringToFile(content, PERSIST_STATE_FILE)) {
+    PLOG(ERROR) << "Failed to write " << PERSIST_STATE_FILE;
+  }
+}
+
+// |console_persisted| tells that the console log is the one copied into last_kmsg by a previous
+// run, so there's no need to compare them.
+void rotate_last_kmsg(bool console_persisted) {
     if (rotated) {
         return;
     }
     if (!file_exists(LAST_CONSOLE_FILE) && !file_exists(ALT_LAST_CONSOLE_FILE)) {
         return;
     }
+    if (console_persisted && file_exists(LAST_KMSG_FILE)) {
+        return;
+    }
     if (!compare_file(LAST_KMSG_FILE, LAST_CONSOLE_FILE) &&
         !compare_file(LAST_KMSG_FILE, ALT_LAST_CONSOLE_FILE)) {
         rotate_logs(LAST_LOG_FILE, LAST_KMSG_FILE);
@@ -200,8 +265,10 @@ int main(int argc, char **argv) {
     if (has_cache) {
       // Collects and reports the non-a/b update metrics from last_install; and removes the file
       // to avoid duplicate report.
-      if (file_exists(LAST_INSTALL_FILE_IN_CACHE) && unlink(LAST_INSTALL_FILE_IN_CACHE) == -1) {
-        PLOG(ERROR) << "Failed to unlink " << LAST_INSTALL_FILE_IN_CACHE;
+      for (const char* file : { LAST_INSTALL_FILE_IN_CACHE, LAST_INSTALL_METRICS_FILE_IN_CACHE }) {
+        if (file_exists(file) && unlink(file) == -1) {
+          PLOG(ERROR) << "Failed to unlink " << file;
+        }
       }
 
       // TBD: Future location to move content from /cache/recovery to /data/misc/recovery/
@@ -216,18 +283,31 @@ int main(int argc, char **argv) {
       return 0;
     }
 
-    // Take last pmsg file contents and send it off to the logsave
-    __android_log_pmsg_file_read(
-        LOG_ID_SYSTEM, ANDROID_LOG_INFO, "recovery/", logsave, NULL);
+    // pstore keeps its contents across the reboots that don't go through recovery, and those have
+    // been persisted already. Only decode pmsg, and compare the console log, if they changed since.
+    std::map<std::string, std::string> state = read_persist_state();
+    std::map<std::string, std::string> new_state = state;
+    new_state["pmsg"] = file_fingerprint(LAST_PMSG_FILE);
+    new_state["console"] = file_exists(LAST_CONSOLE_FILE) ? file_fingerprint(LAST_CONSOLE_FILE)
+                                                          : file_fingerprint(ALT_LAST_CONSOLE_FILE);
+
+    if (new_state["pmsg"].empty() || new_state["pmsg"] != state["pmsg"] ||
+        !file_exists(LAST_LOG_FILE)) {
+      // Take last pmsg file contents and send it off to the logsave
+      __android_log_pmsg_file_read(
+          LOG_ID_SYSTEM, ANDROID_LOG_INFO, "recovery/", logsave, NULL);
+    }
 
     // For those device without /cache, the last_install file has been copied to
     // /data/misc/recovery from pmsg. Looks for the sideload history only.
     if (!has_cache) {
-      if (file_exists(LAST_INSTALL_FILE) && unlink(LAST_INSTALL_FILE) == -1) {
-        PLOG(ERROR) << "Failed to unlink " << LAST_INSTALL_FILE;
+      for (const char* file : { LAST_INSTALL_FILE, LAST_INSTALL_METRICS_FILE }) {
+        if (file_exists(file) && unlink(file) == -1) {
+          PLOG(ERROR) << "Failed to unlink " << file;
+        }
       }
     }
-    rotate_last_kmsg();
+    rotate_last_kmsg(!new_state["console"].empty() && new_state["console"] == state["console"]);
 
     /* Is there a last console log too? */
     if (rotated) {
@@ -238,5 +318,9 @@ int main(int argc, char **argv) {
       }
     }
 
+    if (new_state != state) {
+      write_persist_state(new_state);
+    }
+
     return 0;
 }
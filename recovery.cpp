@@ -50,9 +50,11 @@
 #include "install/fuse_install.h"
 #include "install/install.h"
 #include "install/snapshot_utils.h"
+#include "install/storage_benchmark.h"
 #include "install/wipe_data.h"
 #include "install/wipe_device.h"
 #include "otautil/error_code.h"
+#include "otautil/install_metrics.h"
 #include "otautil/package.h"
 #include "otautil/paths.h"
 #include "otautil/sysutil.h"
@@ -149,6 +151,7 @@ static void FinishRecovery(RecoveryUI* ui) {
   }
 
   copy_logs(save_current_log);
+  WaitForLogsCopied();
 
   // Reset to normal system boot so recovery won't cycle indefinitely.
   std::string err;
@@ -632,6 +635,11 @@ change_menu:
         set_slot(device);
         break;
 
+      case Device::BENCHMARK_STORAGE:
+        save_current_log = true;
+        BenchmarkStorage(ui);
+        break;
+
       case Device::RUN_GRAPHICS_TEST:
         run_graphics_test(ui);
         break;
@@ -680,7 +688,7 @@ static bool IsBatteryOk(int* required_battery_level) {
   constexpr int BATTERY_OK_PERCENTAGE = 20;
   constexpr int BATTERY_WITH_CHARGER_OK_PERCENTAGE = 15;
 
-  auto battery_info = GetBatteryInfo();
+  auto battery_info = BatterySampler::Get().Wait();
   *required_battery_level =
       battery_info.charging ? BATTERY_WITH_CHARGER_OK_PERCENTAGE : BATTERY_OK_PERCENTAGE;
   return battery_info.capacity >= *required_battery_level;
@@ -729,6 +737,9 @@ static void log_failure_code(ErrorCode code, const std::string& update_package)
   if (!android::base::WriteStringToFile(log_content, install_file)) {
     PLOG(ERROR) << "Failed to write " << install_file;
   }
+  const std::string& metrics_file = Paths::Get().temporary_install_metrics_file();
+  unlink(metrics_file.c_str());
+  AppendInstallMetrics(metrics_file, { { "result", 0 }, { "error", code } });
 
   // Also write the info into last_log.
   LOG(INFO) << log_content;
@@ -855,6 +866,12 @@ Device::BuiltinAction start_recovery(Device* device, const std::vector<std::stri
   }
   optind = 1;
 
+  // The battery check before an install may wait for the battery profile to load. Sample the
+  // battery in the background meanwhile.
+  if (update_package != nullptr && retry_count == 0) {
+    BatterySampler::Get().Start();
+  }
+
   printf("stage is [%s]\n", device->GetStage().value_or("").c_str());
   printf("reason is [%s]\n", device->GetReason().value_or("").c_str());
 
@@ -935,6 +952,12 @@ Device::BuiltinAction start_recovery(Device* device, const std::vector<std::stri
         set_retry_bootloader_message(retry_count + 1, args);
       }
 
+      // Nobody watches an install that starts with the text screen off, so the UI may leave the
+      // CPU to the updater until it's done.
+      if (!ui->IsTextVisible()) {
+        ui->SetHeadlessMode(device->GetHeadlessInstallMode());
+      }
+
       bool should_use_fuse = false;
       if (!SetupPackageMount(update_package, &should_use_fuse)) {
         LOG(INFO) << "Failed to set up the package access, skipping installation";
@@ -949,13 +972,15 @@ Device::BuiltinAction start_recovery(Device* device, const std::vector<std::stri
         status = InstallPackage(memory_package.get(), update_package, should_wipe_cache,
                                 retry_count, device);
       } else {
-        // We may fail to memory map the package on 32 bit builds for packages with 2GiB+ size.
-        // In such cases, we will try to install the package with fuse. This is not the default
+        // We may fail to memory map the package on 32 bit builds for packages with 2GiB+ size, or
+        // when its block map is too fragmented. In such cases, we will try to install the package
+        // with fuse, which reads it through the block map with pread(). This is not the default
         // installation method because it introduces a layer of indirection from the kernel space.
         LOG(WARNING) << "Failed to memory map package " << update_package
                      << "; falling back to install with fuse";
         status = InstallWithFuseFromPath(update_package, device);
       }
+      ui->SetHeadlessMode(RecoveryUI::HeadlessMode::NONE);
       if (status != INSTALL_SUCCESS) {
         ui->Print("Installation aborted.\n");
 
@@ -964,6 +989,7 @@ Device::BuiltinAction start_recovery(Device* device, const std::vector<std::stri
         static constexpr int RETRY_LIMIT = 4;
         if (status == INSTALL_RETRY && retry_count < RETRY_LIMIT) {
           copy_logs(save_current_log);
+          WaitForLogsCopied();
           retry_count += 1;
           set_retry_bootloader_message(retry_count, args);
           // Print retry count on screen.
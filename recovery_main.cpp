@@ -36,6 +36,7 @@
 
 #include <atomic>
 #include <filesystem>
+#include <future>
 #include <string>
 #include <thread>
 #include <vector>
@@ -57,6 +58,8 @@
 #include "install/wipe_data.h"
 #include "otautil/boot_state.h"
 #include "otautil/paths.h"
+#include "otautil/sched_policy.h"
+#include "otautil/startup_trace.h"
 #include "otautil/sysutil.h"
 #include "recovery.h"
 #include "recovery_ui/device.h"
@@ -296,38 +299,43 @@ static void redirect_stdio(const char* filename) {
 
     auto start = std::chrono::steady_clock::now();
 
-    // Child logger to actually write to the log file.
+    // Child logger to actually write to the log file. The lines that arrive together (e.g. a batch
+    // from the log buffer of the updater) are written out together, with a write per read from the
+    // pipe rather than one per line.
     FILE* log_fp = fopen(filename, "ae");
     if (log_fp == nullptr) {
       PLOG(ERROR) << "fopen \"" << filename << "\" failed";
       _exit(EXIT_FAILURE);
     }
+    static constexpr size_t kReadSize = 64 * 1024;
+    setvbuf(log_fp, nullptr, _IOFBF, 2 * kReadSize);
 
-    FILE* pipe_fp = android::base::Fdopen(std::move(pipe_read), "r");
-    if (pipe_fp == nullptr) {
-      PLOG(ERROR) << "fdopen failed";
-      check_and_fclose(log_fp, filename);
-      _exit(EXIT_FAILURE);
-    }
-
-    char* line = nullptr;
-    size_t len = 0;
-    while (getline(&line, &len, pipe_fp) != -1) {
+    std::string pending;
+    std::vector<char> buffer(kReadSize);
+    ssize_t bytes_read;
+    while ((bytes_read = TEMP_FAILURE_RETRY(read(pipe_read, buffer.data(), buffer.size()))) > 0) {
       auto now = std::chrono::steady_clock::now();
       double duration =
           std::chrono::duration_cast<std::chrono::duration<double>>(now - start).count();
-      if (line[0] == '\n') {
-        fprintf(log_fp, "[%12.6lf]\n", duration);
-      } else {
-        fprintf(log_fp, "[%12.6lf] %s", duration, line);
+      pending.append(buffer.data(), bytes_read);
+      size_t line = 0;
+      for (size_t end; (end = pending.find('\n', line)) != std::string::npos; line = end + 1) {
+        if (end == line) {
+          fprintf(log_fp, "[%12.6lf]\n", duration);
+        } else {
+          fprintf(log_fp, "[%12.6lf] %.*s\n", duration, static_cast<int>(end - line),
+                  pending.data() + line);
+        }
       }
+      pending.erase(0, line);
       fflush(log_fp);
     }
 
-    PLOG(ERROR) << "getline failed";
+    PLOG(ERROR) << "read failed";
 
-    fclose(pipe_fp);
-    free(line);
+    if (!pending.empty()) {
+      fprintf(log_fp, "%s\n", pending.c_str());
+    }
     check_and_fclose(log_fp, filename);
     _exit(EXIT_FAILURE);
   } else {
@@ -413,7 +421,38 @@ void load_recovery_modules() {
     closedir(dir);
 }
 
+// Creates the device with the make_device() of librecovery_ui_ext.so if there's one, or the
+// default one otherwise.
+static Device* MakeDevice() {
+  ScopedStartupTrace trace("make_device");
+  static constexpr const char* kDefaultLibRecoveryUIExt = "librecovery_ui_ext.so";
+  // Intentionally not calling dlclose(3) to avoid potential gotchas (e.g. `make_device` may have
+  // handed out pointers to code or static [or thread-local] data and doesn't collect them all back
+  // in on dlclose).
+  void* librecovery_ui_ext = dlopen(kDefaultLibRecoveryUIExt, RTLD_NOW);
+
+  using MakeDeviceType = decltype(&make_device);
+  MakeDeviceType make_device_func = nullptr;
+  if (librecovery_ui_ext == nullptr) {
+    printf("Failed to dlopen %s: %s\n", kDefaultLibRecoveryUIExt, dlerror());
+  } else {
+    reinterpret_cast<void*&>(make_device_func) = dlsym(librecovery_ui_ext, "make_device");
+    if (make_device_func == nullptr) {
+      printf("Failed to dlsym make_device: %s\n", dlerror());
+    }
+  }
+
+  if (make_device_func == nullptr) {
+    printf("Falling back to the default make_device() instead\n");
+    return make_device();
+  }
+  printf("Loading make_device from %s\n", kDefaultLibRecoveryUIExt);
+  return (*make_device_func)();
+}
+
 int main(int argc, char** argv) {
+  uint64_t startup_begin_us = StartupTrace::NowUs();
+
   // We don't have logcat yet under recovery; so we'll print error on screen and log to stdout
   // (which is redirected to recovery.log) as we used to do.
   android::base::InitLogging(argv, &UiLogger);
@@ -437,13 +476,27 @@ int main(int argc, char** argv) {
   // instances with different timestamps.
   redirect_stdio(Paths::Get().temporary_log_file().c_str());
 
+  // The steps below don't depend on each other up to the UI initialization: creating the device
+  // (which loads librecovery_ui_ext.so) and loading the file contexts run meanwhile, while
+  // parsing the volume table, reading the BCB and the locale from /cache happen in order.
+  auto device_future = std::async(std::launch::async, MakeDevice);
+  auto sehandle_future = std::async(std::launch::async, []() {
+    ScopedStartupTrace trace("file_contexts");
+    return selinux_android_file_context_handle();
+  });
+
   load_volume_table();
   if (android::base::GetBoolProperty("ro.recovery.load_modules", false)) {
-      load_recovery_modules();
+    ScopedStartupTrace trace("load_recovery_modules");
+    load_recovery_modules();
   }
 
   std::string stage;
-  std::vector<std::string> args = get_args(argc, argv, &stage);
+  std::vector<std::string> args;
+  {
+    ScopedStartupTrace trace("get_args");
+    args = get_args(argc, argv, &stage);
+  }
   auto args_to_parse = StringVectorToNullTerminatedArray(args);
 
   static constexpr struct option OPTIONS[] = {
@@ -501,36 +554,15 @@ int main(int argc, char** argv) {
     }
   }
 
-  static constexpr const char* kDefaultLibRecoveryUIExt = "librecovery_ui_ext.so";
-  // Intentionally not calling dlclose(3) to avoid potential gotchas (e.g. `make_device` may have
-  // handed out pointers to code or static [or thread-local] data and doesn't collect them all back
-  // in on dlclose).
-  void* librecovery_ui_ext = dlopen(kDefaultLibRecoveryUIExt, RTLD_NOW);
-
-  using MakeDeviceType = decltype(&make_device);
-  MakeDeviceType make_device_func = nullptr;
-  if (librecovery_ui_ext == nullptr) {
-    printf("Failed to dlopen %s: %s\n", kDefaultLibRecoveryUIExt, dlerror());
-  } else {
-    reinterpret_cast<void*&>(make_device_func) = dlsym(librecovery_ui_ext, "make_device");
-    if (make_device_func == nullptr) {
-      printf("Failed to dlsym make_device: %s\n", dlerror());
-    }
-  }
-
-  Device* device;
-  if (make_device_func == nullptr) {
-    printf("Falling back to the default make_device() instead\n");
-    device = make_device();
-  } else {
-    printf("Loading make_device from %s\n", kDefaultLibRecoveryUIExt);
-    device = (*make_device_func)();
-  }
+  Device* device = device_future.get();
+  // Before the UI starts its threads, which apply the policy as they start.
+  SchedPolicy::Get().SetOptions(device->GetSchedOptions());
 
   if (android::base::GetBoolProperty("ro.boot.quiescent", false)) {
     printf("Quiescent recovery mode.\n");
     device->ResetUI(new StubRecoveryUI());
   } else {
+    ScopedStartupTrace trace("ui_init");
     if (!device->GetUI()->Init(locale)) {
       printf("Failed to initialize UI; using stub UI instead.\n");
       device->ResetUI(new StubRecoveryUI());
@@ -541,8 +573,13 @@ int main(int argc, char** argv) {
   device->SetBootState(&boot_state);
   ui = device->GetUI();
 
+  // Show the first frame as soon as the UI is up.
+  ui->SetBackground(RecoveryUI::NONE);
+  if (show_text) ui->ShowText(true);
+
   if (!HasCache()) {
     device->RemoveMenuItemForAction(Device::WIPE_CACHE);
+    device->RemoveMenuItemForAction(Device::BENCHMARK_STORAGE);
   }
 
   if (android::base::GetBoolProperty("ro.build.ab_update", false)) {
@@ -576,13 +613,10 @@ int main(int argc, char** argv) {
     device->RemoveMenuItemForAction(Device::SWAP_SLOT);
   }
 
-  ui->SetBackground(RecoveryUI::NONE);
-  if (show_text) ui->ShowText(true);
-
   LOG(INFO) << "Starting recovery (pid " << getpid() << ") on " << ctime(&start);
   LOG(INFO) << "locale is [" << locale << "]";
 
-  auto sehandle = selinux_android_file_context_handle();
+  auto sehandle = sehandle_future.get();
   selinux_android_set_sehandle(sehandle);
   if (!sehandle) {
     ui->Print("Warning: No file_contexts\n");
@@ -600,6 +634,9 @@ int main(int argc, char** argv) {
     android::base::SetProperty("service.adb.root", "1");
   }
 
+  StartupTrace::Get().AddEvent("recovery_main", startup_begin_us, StartupTrace::NowUs());
+  StartupTrace::Get().Write(Paths::Get().temporary_startup_trace_file());
+
   while (true) {
     // We start adbd in recovery for the device with userdebug build or a unlocked bootloader.
     std::string usb_config =
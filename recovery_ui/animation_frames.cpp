@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "recovery_ui/animation_frames.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+// Returns a copy of the |width| x |height| pixels of |surface| at |x|, |y|.
+static std::unique_ptr<GRSurface> Crop(const GRSurface* surface, size_t x, size_t y, size_t width,
+                                       size_t height) {
+  size_t pixel_bytes = surface->pixel_bytes;
+  auto result = GRSurface::Create(width, height, width * pixel_bytes, pixel_bytes);
+  if (!result) return nullptr;
+  for (size_t row = 0; row < height; row++) {
+    memcpy(result->data() + row * result->row_bytes,
+           surface->data() + (y + row) * surface->row_bytes + x * pixel_bytes, width * pixel_bytes);
+  }
+  return result;
+}
+
+// Copies all of |source| to |x|, |y| of |surface|.
+static void Paste(GRSurface* surface, size_t x, size_t y, const GRSurface* source) {
+  size_t pixel_bytes = source->pixel_bytes;
+  for (size_t row = 0; row < source->height; row++) {
+    memcpy(surface->data() + (y + row) * surface->row_bytes + x * pixel_bytes,
+           source->data() + row * source->row_bytes, source->width * pixel_bytes);
+  }
+}
+
+// Returns where the |width| x |height| pixels at |x|, |y| of a |surface_width| x |surface_height|
+// image are in its copy rotated by |rotation| (as by PrerotateSurface()).
+static std::pair<size_t, size_t> RotatedOrigin(GRRotation rotation, size_t surface_width,
+                                               size_t surface_height, size_t x, size_t y,
+                                               size_t width, size_t height) {
+  switch (rotation) {
+    case GRRotation::RIGHT:
+      return { surface_height - y - height, x };
+    case GRRotation::DOWN:
+      return { surface_width - x - width, surface_height - y - height };
+    case GRRotation::LEFT:
+      return { y, surface_width - x - width };
+    case GRRotation::NONE:
+      break;
+  }
+  return { x, y };
+}
+
+static size_t SurfaceSize(const GRSurface* surface) {
+  if (!surface) return 0;
+  return surface->row_bytes * surface->height + SurfaceSize(surface->rotated.get());
+}
+
+AnimationFrames::Delta AnimationFrames::Diff(const GRSurface* from,
+                                             std::unique_ptr<GRSurface> to) {
+  Delta delta;
+  if (!to) return delta;
+  if (!from || from->width != to->width || from->height != to->height ||
+      from->pixel_bytes != to->pixel_bytes || from->rotated_for != to->rotated_for ||
+      !from->rotated != !to->rotated) {
+    delta.pixels = std::move(to);
+    delta.replace = true;
+    return delta;
+  }
+
+  // The bounding rectangle of the pixels that differ.
+  size_t width = to->width;
+  size_t height = to->height;
+  size_t pixel_bytes = to->pixel_bytes;
+  size_t top = height;
+  size_t bottom = 0;
+  size_t left = width;
+  size_t right = 0;
+  for (size_t y = 0; y < height; y++) {
+    const uint8_t* from_row = from->data() + y * from->row_bytes;
+    const uint8_t* to_row = to->data() + y * to->row_bytes;
+    if (memcmp(from_row, to_row, width * pixel_bytes) == 0) continue;
+    top = std::min(top, y);
+    bottom = y + 1;
+    auto same = [from_row, to_row, pixel_bytes](size_t x) {
+      return memcmp(from_row + x * pixel_bytes, to_row + x * pixel_bytes, pixel_bytes) == 0;
+    };
+    size_t x = 0;
+    while (x < left && same(x)) {
+      x++;
+    }
+    left = x;
+    x = width;
+    while (x > right && same(x - 1)) {
+      x--;
+    }
+    right = x;
+  }
+  if (top == height) return delta;
+
+  delta.x = left;
+  delta.y = top;
+  delta.pixels = Crop(to.get(), left, top, right - left, bottom - top);
+  if (delta.pixels && to->rotated) {
+    bool swapped = to->rotated_for == GRRotation::LEFT || to->rotated_for == GRRotation::RIGHT;
+    auto [x, y] =
+        RotatedOrigin(to->rotated_for, width, height, left, top, right - left, bottom - top);
+    delta.pixels->rotated = Crop(to->rotated.get(), x, y, swapped ? bottom - top : right - left,
+                                 swapped ? right - left : bottom - top);
+    delta.pixels->rotated_for = delta.pixels->rotated ? to->rotated_for : GRRotation::NONE;
+  }
+  if (!delta.pixels || (to->rotated && !delta.pixels->rotated)) {
+    // Without the memory for the change, keep the frame whole.
+    delta.x = 0;
+    delta.y = 0;
+    delta.pixels = std::move(to);
+    delta.replace = true;
+  }
+  return delta;
+}
+
+void AnimationFrames::Apply(const Delta& delta) {
+  if (!delta.pixels) return;
+  if (delta.replace) {
+    canvas_ = delta.pixels->Clone();
+    return;
+  }
+  Paste(canvas_.get(), delta.x, delta.y, delta.pixels.get());
+  if (canvas_->rotated && delta.pixels->rotated) {
+    auto [x, y] = RotatedOrigin(canvas_->rotated_for, canvas_->width, canvas_->height, delta.x,
+                                delta.y, delta.pixels->width, delta.pixels->height);
+    Paste(canvas_->rotated.get(), x, y, delta.pixels->rotated.get());
+  }
+}
+
+void AnimationFrames::Add(std::unique_ptr<GRSurface> frame) {
+  if (frozen_ || added_ == count_) return;
+  size_t index = added_++;
+  if (index == 0) {
+    if (loop_ && count_ > 1) {
+      deltas_.resize(count_);
+      if (frame) first_ = frame->Clone();
+    }
+    canvas_ = std::move(frame);
+    shown_ = 0;
+    return;
+  }
+
+  Show(index - 1);
+  Delta delta = Diff(canvas_.get(), std::move(frame));
+  Apply(delta);
+  shown_ = index;
+  if (!loop_) return;
+
+  deltas_[index] = std::move(delta);
+  if (index == count_ - 1) {
+    deltas_[0] = Diff(canvas_.get(), std::move(first_));
+  }
+}
+
+void AnimationFrames::Show(size_t index) {
+  if (frozen_ || index >= added_ || index == shown_) return;
+  // Only a looping animation that has all its frames can go round to the first frame again.
+  if (index < shown_ && (!loop_ || added_ < count_)) return;
+  while (shown_ != index) {
+    shown_ = (shown_ + 1) % count_;
+    Apply(deltas_[shown_]);
+  }
+}
+
+void AnimationFrames::Clear() {
+  added_ = 0;
+  shown_ = 0;
+  canvas_.reset();
+  first_.reset();
+  deltas_.clear();
+}
+
+void AnimationFrames::Freeze() {
+  frozen_ = true;
+  first_.reset();
+  deltas_.clear();
+  deltas_.shrink_to_fit();
+}
+
+size_t AnimationFrames::data_size() const {
+  size_t size = SurfaceSize(canvas_.get()) + SurfaceSize(first_.get());
+  for (const auto& delta : deltas_) {
+    size += SurfaceSize(delta.pixels.get());
+  }
+  return size;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "recovery_ui/bitmap_loader.h"
+
+#include <algorithm>
+#include <utility>
+
+BitmapLoader::BitmapLoader(std::vector<Job> jobs, size_t threads, size_t max_ahead)
+    : jobs_(std::move(jobs)),
+      bitmaps_(jobs_.size()),
+      states_(jobs_.size(), State::PENDING),
+      max_ahead_(std::max<size_t>(max_ahead, 1)) {
+  threads = std::min(threads, jobs_.size());
+  for (size_t i = 0; i < threads; i++) {
+    threads_.emplace_back(&BitmapLoader::Run, this);
+  }
+}
+
+BitmapLoader::~BitmapLoader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  ahead_cv_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+size_t BitmapLoader::DefaultThreads() {
+  // Decoding is CPU bound; leave a core to the UI and the rest of recovery.
+  size_t cpus = std::thread::hardware_concurrency();
+  return std::clamp<size_t>(cpus > 1 ? cpus - 1 : 1, 1, 4);
+}
+
+void BitmapLoader::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopped_) {
+    // Skip the jobs that Take() has run itself.
+    while (next_job_ < jobs_.size() && states_[next_job_] != State::PENDING) {
+      next_job_++;
+    }
+    if (next_job_ == jobs_.size()) break;
+    if (ahead_ >= max_ahead_) {
+      ahead_cv_.wait(lock);
+      continue;
+    }
+
+    size_t index = next_job_++;
+    states_[index] = State::RUNNING;
+    ahead_++;
+    lock.unlock();
+    auto bitmap = jobs_[index]();
+    lock.lock();
+    bitmaps_[index] = std::move(bitmap);
+    states_[index] = State::DONE;
+    done_cv_.notify_all();
+  }
+}
+
+std::unique_ptr<GRSurface> BitmapLoader::Take(size_t index) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (index >= jobs_.size()) return nullptr;
+
+  // A job that no thread has got to yet runs right here, rather than after all the ones before it.
+  if (states_[index] == State::PENDING) {
+    states_[index] = State::TAKEN;
+    lock.unlock();
+    return jobs_[index]();
+  }
+  done_cv_.wait(lock, [this, index]() { return states_[index] != State::RUNNING; });
+  if (states_[index] == State::TAKEN) {
+    return nullptr;
+  }
+  states_[index] = State::TAKEN;
+  ahead_--;
+  ahead_cv_.notify_all();
+  return std::move(bitmaps_[index]);
+}
@@ -23,6 +23,7 @@
 #include <vector>
 
 #include <android-base/logging.h>
+#include <android-base/properties.h>
 
 #include "otautil/boot_state.h"
 #include "recovery_ui/ui.h"
@@ -46,6 +47,7 @@ static std::vector<menu_action_t> g_advanced_actions{
   { "View recovery logs", Device::VIEW_RECOVERY_LOGS },
   { "Enable ADB", Device::ENABLE_ADB },
   { "Switch slot", Device::SWAP_SLOT },
+  { "Benchmark storage", Device::BENCHMARK_STORAGE },
   { "Run graphics test", Device::RUN_GRAPHICS_TEST },
   { "Run locale test", Device::RUN_LOCALE_TEST },
   { "Enter rescue", Device::ENTER_RESCUE },
@@ -187,3 +189,23 @@ std::optional<std::string> Device::GetReason() const {
 std::optional<std::string> Device::GetStage() const {
   return boot_state_ ? std::make_optional(boot_state_->stage()) : std::nullopt;
 }
+
+SchedOptions Device::GetSchedOptions() const {
+  SchedOptions options;
+  options.pin_threads = android::base::GetBoolProperty("ro.recovery.pin_threads", true);
+  return options;
+}
+
+RecoveryUI::HeadlessMode Device::GetHeadlessInstallMode() const {
+  std::string mode = android::base::GetProperty("ro.recovery.ui.headless_install", "");
+  if (mode == "progress") {
+    return RecoveryUI::HeadlessMode::MINIMAL_PROGRESS;
+  }
+  if (mode == "screen_off") {
+    return RecoveryUI::HeadlessMode::SCREEN_OFF;
+  }
+  if (!mode.empty()) {
+    LOG(WARNING) << "Unknown ro.recovery.ui.headless_install: " << mode;
+  }
+  return RecoveryUI::HeadlessMode::NONE;
+}
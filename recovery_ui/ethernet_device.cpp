@@ -19,13 +19,19 @@
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <arpa/inet.h>
+#include <errno.h>
 #include <ifaddrs.h>
-#include <linux/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include <functional>
+
+#include "minui/minui.h"
 #include "recovery_ui/device.h"
 #include "recovery_ui/ethernet_device.h"
 #include "recovery_ui/ethernet_ui.h"
@@ -42,6 +48,7 @@ EthernetDevice::EthernetDevice(EthernetRecoveryUI* ui, std::string interface)
 }
 
 void EthernetDevice::PreRecovery() {
+  interface_up_ = false;
   SetInterfaceFlags(0, IFF_UP);
   SetTitleIPv6LinkLocalAddress(false);
 }
@@ -54,9 +61,69 @@ void EthernetDevice::PreFastboot() {
     return;
   }
 
+  // The link-local address may only come a while after the interface is up (once the duplicate
+  // address detection is done), so it's shown when the kernel announces it.
+  interface_up_ = true;
+  StartAddressMonitor();
   SetTitleIPv6LinkLocalAddress(true);
 }
 
+void EthernetDevice::StartAddressMonitor() {
+  if (address_monitor_started_) {
+    return;
+  }
+
+  android::base::unique_fd fd(
+      socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to open netlink socket";
+    return;
+  }
+  struct sockaddr_nl addr = {};
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = RTMGRP_IPV6_IFADDR;
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+    PLOG(ERROR) << "Failed to bind netlink socket";
+    return;
+  }
+  if (ev_add_fd(std::move(fd), std::bind(&EthernetDevice::OnAddressEvent, this,
+                                         std::placeholders::_1, std::placeholders::_2)) != 0) {
+    LOG(ERROR) << "Failed to listen to the address changes of " << interface_;
+    return;
+  }
+  address_monitor_started_ = true;
+}
+
+int EthernetDevice::OnAddressEvent(int fd, uint32_t /* epevents */) {
+  unsigned int index = if_nametoindex(interface_.c_str());
+  bool changed = false;
+  char buffer[8192];
+  ssize_t len;
+  while ((len = TEMP_FAILURE_RETRY(recv(fd, buffer, sizeof(buffer), 0))) > 0) {
+    for (auto nh = reinterpret_cast<struct nlmsghdr*>(buffer); NLMSG_OK(nh, len);
+         nh = NLMSG_NEXT(nh, len)) {
+      if (nh->nlmsg_type != RTM_NEWADDR && nh->nlmsg_type != RTM_DELADDR) {
+        continue;
+      }
+      auto ifa = reinterpret_cast<struct ifaddrmsg*>(NLMSG_DATA(nh));
+      if (ifa->ifa_family == AF_INET6 && ifa->ifa_index == index &&
+          ifa->ifa_scope == RT_SCOPE_LINK) {
+        changed = true;
+      }
+    }
+  }
+  if (len == -1 && errno == ENOBUFS) {
+    // Some messages were dropped, which may have been ours.
+    changed = true;
+  }
+
+  // The UI only redraws the screen if the address is a new one.
+  if (changed && interface_up_) {
+    SetTitleIPv6LinkLocalAddress(true);
+  }
+  return 0;
+}
+
 int EthernetDevice::SetInterfaceFlags(const unsigned set, const unsigned clr) {
   struct ifreq ifr;
 
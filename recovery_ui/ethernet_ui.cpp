@@ -16,17 +16,31 @@
 
 #include "recovery_ui/ethernet_ui.h"
 
+#include <mutex>
+
 #include <android-base/logging.h>
 
 void EthernetRecoveryUI::SetTitle(const std::vector<std::string>& lines) {
-  ScreenRecoveryUI::SetTitle(lines);
+  std::lock_guard<std::mutex> lg(updateMutex);
+  title_ = lines;
+  UpdateTitleLinesLocked();
+}
+
+void EthernetRecoveryUI::SetIPv6LinkLocalAddress(const std::string& address) {
+  std::lock_guard<std::mutex> lg(updateMutex);
+  if (address == address_) {
+    return;
+  }
+  address_ = address;
+  UpdateTitleLinesLocked();
+  update_screen_locked();
+}
+
+void EthernetRecoveryUI::UpdateTitleLinesLocked() {
+  title_lines_ = title_;
 
   // Append IP address, if any
   if (!address_.empty()) {
     title_lines_.push_back("IPv6 link-local address - " + address_);
   }
 }
-
-void EthernetRecoveryUI::SetIPv6LinkLocalAddress(const std::string& address) {
-  address_ = address;
-}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+#include <vector>
+
+#include "minui/minui.h"
+
+// The frames of an animation, kept as the frame on show plus, for each frame, the rectangle of
+// pixels that differ from the frame before it. Memory then scales with the animated region of the
+// frames, rather than with their number. The frames are added, and shown, in order. A looping
+// animation also keeps the change from its last frame back to the first one; the others drop each
+// change once shown, as they only play once.
+class AnimationFrames {
+ public:
+  AnimationFrames() = default;
+  AnimationFrames(size_t count, bool loop) : count_(count), loop_(loop) {}
+
+  size_t size() const {
+    return count_;
+  }
+
+  // The number of frames added so far.
+  size_t added() const {
+    return added_;
+  }
+
+  // Returns the frame on show, or nullptr if there's none (e.g. if the frames failed to load).
+  const GRSurface* current() const {
+    return canvas_.get();
+  }
+
+  // Adds the next frame, and shows it. |frame| may be nullptr if it failed to load, which keeps the
+  // frame before it on show.
+  void Add(std::unique_ptr<GRSurface> frame);
+
+  // Shows frame |index|, which must have been added, by playing the changes from the frame on show.
+  // Going back (other than to the first frame of a looping animation) isn't supported.
+  void Show(size_t index);
+
+  // Drops all the frames, keeping the count.
+  void Clear();
+
+  // Keeps only the frame on show, and drops the others for good: Add() and Show() do nothing from
+  // then on.
+  void Freeze();
+
+  // Returns the number of bytes of pixels held.
+  size_t data_size() const;
+
+ private:
+  // The change to a frame from the one before it: |pixels| are to be copied to |x|, |y|. A frame of
+  // another size replaces the frame on show whole.
+  struct Delta {
+    size_t x{ 0 };
+    size_t y{ 0 };
+    std::unique_ptr<GRSurface> pixels;
+    bool replace{ false };
+  };
+
+  // Returns the change from |from| (which may be nullptr) to |to|.
+  static Delta Diff(const GRSurface* from, std::unique_ptr<GRSurface> to);
+
+  void Apply(const Delta& delta);
+
+  size_t count_{ 0 };
+  bool loop_{ false };
+  size_t added_{ 0 };
+  size_t shown_{ 0 };
+  bool frozen_{ false };
+
+  std::unique_ptr<GRSurface> canvas_;
+  // The first frame of a looping animation, until the change back to it from the last frame is
+  // known.
+  std::unique_ptr<GRSurface> first_;
+  // The change to each frame; deltas_[0] is the change from the last frame to the first.
+  std::vector<Delta> deltas_;
+};
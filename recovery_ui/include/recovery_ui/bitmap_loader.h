@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "minui/minui.h"
+
+// Runs jobs that load bitmaps (e.g. decode PNG images) on background threads, in order, and hands
+// out each bitmap as it's needed. The first ones can then be drawn while the rest still load.
+class BitmapLoader {
+ public:
+  using Job = std::function<std::unique_ptr<GRSurface>()>;
+
+  // Starts running |jobs| on up to |threads| threads (none at all leaves each job to Take()). The
+  // threads hold at most |max_ahead| bitmaps (counting the ones in progress) that are yet to be
+  // taken, so that loading ahead doesn't take more memory than that.
+  BitmapLoader(std::vector<Job> jobs, size_t threads,
+               size_t max_ahead = std::numeric_limits<size_t>::max());
+
+  // Waits for the jobs in progress; the ones not started yet are dropped.
+  ~BitmapLoader();
+
+  // Returns the bitmap of the job at |index|, waiting for it if it's in progress, or running it if
+  // it hasn't started. Returns nullptr if the job failed, or its bitmap has been taken already.
+  std::unique_ptr<GRSurface> Take(size_t index);
+
+  // Returns the number of threads to load bitmaps with, by default.
+  static size_t DefaultThreads();
+
+ private:
+  void Run();
+
+  std::vector<Job> jobs_;
+
+  std::mutex mutex_;
+  std::condition_variable done_cv_;
+  // Wakes the threads up when a bitmap is taken, or on stopping.
+  std::condition_variable ahead_cv_;
+  enum class State {
+    PENDING,
+    RUNNING,
+    DONE,
+    TAKEN,
+  };
+
+  // The next job for the threads to consider, the bitmaps of the jobs done, and the state of each
+  // job.
+  size_t next_job_{ 0 };
+  std::vector<std::unique_ptr<GRSurface>> bitmaps_;
+  std::vector<State> states_;
+  // The number of bitmaps that the threads load, or have loaded, and are yet to be taken.
+  size_t ahead_{ 0 };
+  size_t max_ahead_;
+  bool stopped_{ false };
+
+  std::vector<std::thread> threads_;
+};
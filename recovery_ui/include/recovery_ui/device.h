@@ -25,6 +25,7 @@
 #include <string>
 #include <vector>
 
+#include "otautil/sched_policy.h"
 #include "ui.h"
 
 class BootState;
@@ -72,6 +73,7 @@ class Device {
     WIPE_SYSTEM = 100,
     ENABLE_ADB = 101,
     SWAP_SLOT = 102,
+    BENCHMARK_STORAGE = 103,
     MENU_BASE = 200,
     MENU_WIPE = 202,
     MENU_ADVANCED = 203,
@@ -159,6 +161,16 @@ class Device {
     return true;
   }
 
+  // Returns how to show an install that runs unattended, i.e. from the BCB with the text screen
+  // off. Defaults to the "ro.recovery.ui.headless_install" property: "progress" for
+  // RecoveryUI::HeadlessMode::MINIMAL_PROGRESS, "screen_off" for SCREEN_OFF, and NONE otherwise.
+  virtual RecoveryUI::HeadlessMode GetHeadlessInstallMode() const;
+
+  // Returns how to place the compute and UI threads on the CPUs (see otautil/sched_policy.h).
+  // Defaults to the SchedOptions defaults, with the threads pinned unless the
+  // "ro.recovery.pin_threads" property is false.
+  virtual SchedOptions GetSchedOptions() const;
+
   void SetBootState(const BootState* state);
   // The getters for reason and stage may return std::nullopt until StartRecovery() is called. It's
   // the caller's responsibility to perform the check and handle the exception.
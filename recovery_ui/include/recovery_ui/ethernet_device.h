@@ -19,6 +19,11 @@
 
 #include "device.h"
 
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
 #include <android-base/unique_fd.h>
 
 // Forward declaration to avoid including "ethernet_ui.h".
@@ -36,8 +41,19 @@ class EthernetDevice : public Device {
   int SetInterfaceFlags(const unsigned set, const unsigned clr);
   void SetTitleIPv6LinkLocalAddress(const bool interface_up);
 
+  // Starts listening to the address changes of the interface on a netlink socket, in the event
+  // loop of the UI, so that the address on the screen follows them without polling. Does nothing
+  // if it's already listening.
+  void StartAddressMonitor();
+  // Reads the pending netlink messages on |fd|, and updates the address if any of them is about a
+  // link-local address of the interface.
+  int OnAddressEvent(int fd, uint32_t epevents);
+
   android::base::unique_fd ctl_sock_;
   std::string interface_;
+  // Whether the interface was brought up for fastboot, and the address is to be shown.
+  std::atomic<bool> interface_up_{ false };
+  bool address_monitor_started_{ false };
 };
 
 #endif  // _ETHERNET_RECOVERY_DEVICE_H
@@ -17,6 +17,9 @@
 #ifndef RECOVERY_ETHERNET_UI_H
 #define RECOVERY_ETHERNET_UI_H
 
+#include <string>
+#include <vector>
+
 #include "screen_ui.h"
 
 class EthernetRecoveryUI : public ScreenRecoveryUI {
@@ -24,10 +27,16 @@ class EthernetRecoveryUI : public ScreenRecoveryUI {
   EthernetRecoveryUI() {}
   void SetTitle(const std::vector<std::string>& lines) override;
 
-  // For EthernetDevice
+  // For EthernetDevice. Redraws the screen if the address changed. Can be called from any thread.
   void SetIPv6LinkLocalAddress(const std::string& address = "");
 
  private:
+  // Sets |title_lines_| to the title, plus the address if any. Must be called with |updateMutex|
+  // held.
+  void UpdateTitleLinesLocked();
+
+  // The title without the address.
+  std::vector<std::string> title_;
   std::string address_;
 };
 
@@ -20,16 +20,28 @@
 #include <stdio.h>
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "animation_frames.h"
+#include "otautil/memory_governor.h"
 #include "ui.h"
 
 // From minui/minui.h.
 class GRSurface;
+// From recovery_ui/bitmap_loader.h.
+class BitmapLoader;
+// From recovery_ui/text_buffer.h.
+class TextBuffer;
+// From recovery_ui/text_file_view.h.
+class TextFileView;
 
 enum class UIElement {
   BATTERY_LOW,
@@ -41,7 +53,9 @@ enum class UIElement {
   SCROLLBAR,
   LOG,
   TEXT_FILL,
-  INFO
+  INFO,
+  // The opaque background of the text screen.
+  BACKGROUND
 };
 
 // Interface to draw the UI elements on the screen.
@@ -106,6 +120,12 @@ class Menu {
   virtual int DrawHeader(int x, int y) const = 0;
   // Iterates over the menu items and displays each of them at offset x, y.
   virtual int DrawItems(int x, int y, int screen_width, bool long_press) const = 0;
+  // Redraws only the items whose selection changed since they were last drawn, where they were
+  // drawn. Returns false, having drawn nothing, if the rest of the menu needs a redraw too (e.g. it
+  // scrolled), in which case the caller redraws the whole screen.
+  virtual bool DrawSelectionChange(bool /* long_press */) const {
+    return false;
+  }
   virtual size_t ItemsCount() const = 0;
   virtual bool IsMain() const = 0;
   virtual void SetMenuHeight(int height) = 0;
@@ -132,6 +152,7 @@ class TextMenu : public Menu {
   int Scroll(int updown) override;
   int DrawHeader(int x, int y) const override;
   int DrawItems(int x, int y, int screen_width, bool long_press) const override;
+  bool DrawSelectionChange(bool long_press) const override;
   size_t ItemsCount() const override;
 
   bool IsMain() const override {
@@ -195,6 +216,24 @@ class TextMenu : public Menu {
 
   // Height in pixels of each character.
   int char_height_;
+
+  // Where and how the items were last drawn, for DrawSelectionChange().
+  struct DrawnItems {
+    int x;
+    // The top of the first visible item.
+    int items_y;
+    int screen_width;
+    bool long_press;
+    size_t menu_start;
+    int selection;
+  };
+  mutable std::optional<DrawnItems> drawn_items_;
+
+  // Draws the item at |index|, highlighted if it's the selection, at offset x, y. Returns the
+  // offset it should be moving along Y-axis.
+  int DrawItem(size_t index, int x, int y, int screen_width, bool long_press) const;
+  // Draws the scroll bar of the items that start at |items_y|, if they overflow the screen.
+  void DrawItemsScrollBar(int items_y) const;
 };
 
 // This class uses GRSurface's as the menu header and items.
@@ -298,6 +337,7 @@ class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
   void SetProgressType(ProgressType type) override;
   void ShowProgress(float portion, float seconds) override;
   void SetProgress(float fraction) override;
+  void SetHeadlessMode(HeadlessMode mode) override;
 
   void SetStage(int current, int max) override;
 
@@ -388,6 +428,12 @@ class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
   virtual int SelectMenu(int sel);
   virtual int SelectMenu(const Point& point);
   virtual int ScrollMenu(int updown);
+  // Redraws the screen for a change to the menu, unless the redraw is deferred. Must be called
+  // with |updateMutex| held.
+  void update_menu_locked();
+  // Redraws only the menu items whose selection changed, in a partial update. Returns false if
+  // the whole screen needs a redraw instead. Must be called with |updateMutex| held.
+  virtual bool update_menu_selection_locked();
 
   // Returns the help message displayed on top of the menu.
   virtual std::vector<std::string> GetMenuHelpMessage() const;
@@ -404,14 +450,36 @@ class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
   const GRSurface* GetCurrentText() const;
 
   void BattMonitorThreadLoop();
+  // Draws the frames of the animation and of the timed progress bar, as well as the progress
+  // bar moves from SetProgress() and the text left by Print(), at most one frame per
+  // FrameInterval(). It sleeps while there's nothing to draw, or the screen is off.
   void ProgressThreadLoop();
-
-  virtual void ShowFile(FILE*);
+  // Returns the time between two frames of the progress thread: 1/animation_fps_, and no less than
+  // 20ms; or a second in a headless mode. Should only be called with updateMutex locked.
+  std::chrono::steady_clock::duration FrameInterval() const;
+  void OnScreensaverChanged(bool screen_off) override;
+  // Returns the width of the progress bar filled up to |fraction| of the current scope, in pixels.
+  int ProgressPixels(float fraction) const;
+
+  // Pages through |file|, until a key other than those that page (or search) is pressed.
+  virtual void ShowFile(TextFileView* file);
+  // Shows the page of |file| from |top_row|, with a prompt in the last row.
+  void ShowFilePage(TextFileView* file, size_t top_row);
   virtual void PrintV(const char*, bool, va_list);
   void PutChar(char);
   void ClearText();
 
   virtual void LoadAnimation();
+  // Shows the current animation frame, taking it from |frame_loader_| if it's yet to be added.
+  // Should only be called with updateMutex held.
+  void ShowCurrentFrame();
+  // Reserves the memory of the animation, which stops on the frame on show (see FreezeAnimation())
+  // when not enough memory can be spared or the governor asks for it back.
+  void ReserveAnimationMemory();
+  // Stops the animation on the frame on show (the first loop frame if still in the intro), and
+  // drops the other frames. Returns false if it was already stopped. Should only be called with
+  // updateMutex held.
+  bool FreezeAnimation();
   std::unique_ptr<GRSurface> LoadBitmap(const std::string& filename);
   std::unique_ptr<GRSurface> LoadLocalizedBitmap(const std::string& filename);
 
@@ -470,14 +538,18 @@ class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
   std::unique_ptr<GRSurface> back_icon_sel_;
   std::unique_ptr<GRSurface> fastbootd_logo_;
 
-  // current_icon_ points to one of the frames in intro_frames_ or loop_frames_, indexed by
+  // current_icon_ points to the frame on show of intro_frames_ or loop_frames_, indexed by
   // current_frame_, or error_icon_.
   Icon current_icon_;
   std::unique_ptr<GRSurface> error_icon_;
-  std::vector<std::unique_ptr<GRSurface>> intro_frames_;
-  std::vector<std::unique_ptr<GRSurface>> loop_frames_;
+  AnimationFrames intro_frames_;
+  AnimationFrames loop_frames_;
+  // Loads the frames past the first ones in the background, the intro frames then the loop frames.
+  std::unique_ptr<BitmapLoader> frame_loader_;
   size_t current_frame_;
   bool intro_done_;
+  // Set once the animation stops on the frame on show, to give its memory back.
+  bool animation_frozen_{ false };
 
   // progress_bar and stage_marker images.
   std::unique_ptr<GRSurface> progress_bar_empty_;
@@ -496,8 +568,7 @@ class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
   size_t text_cols_, text_rows_;
 
   // Log text overlay, displayed when a magic key is pressed.
-  char** text_;
-  size_t text_col_, text_row_;
+  std::unique_ptr<TextBuffer> text_;
 
   bool show_text;
   bool show_text_ever;  // has show_text ever been true?
@@ -506,12 +577,33 @@ class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
 
   std::unique_ptr<Menu> menu_;
   int menu_start_y_;
+  // Set by ShowMenu() while more keys are queued up for the menu, so that a burst of them (e.g.
+  // from a fast swipe) only redraws it after the last one. |menu_redraw_deferred_| tells that a
+  // change has been left to draw. Both are only used by the thread that shows the menu.
+  bool defer_menu_redraw_{ false };
+  bool menu_redraw_deferred_{ false };
 
   // An alternate text screen, swapped with 'text_' when we're viewing a log file.
-  char** file_viewer_text_;
+  std::unique_ptr<TextBuffer> file_viewer_text_;
 
   std::thread progress_thread_;
   std::atomic<bool> progress_thread_stopped_{ false };
+  // Wakes the progress thread up on stopping, and on the changes that start (or stop) the
+  // animation or a move of the progress bar. Waited on with updateMutex.
+  std::condition_variable progress_cv_;
+  // Whether SetProgress() has moved the progress bar, for the progress thread to draw in its next
+  // frame.
+  bool progress_changed_{ false };
+  // Whether Print() has added text to the text screen that's yet to be drawn. The progress thread
+  // draws it in its next frame, so that a burst of lines costs one redraw per frame at most.
+  bool text_changed_{ false };
+  // When the text screen was last drawn for Print().
+  std::chrono::steady_clock::time_point text_drawn_time_;
+  // Whether the screensaver has turned the screen off.
+  bool screen_off_{ false };
+  // Set by SetHeadlessMode(). Stops the animation and the battery monitor, and slows the progress
+  // thread down; or with HeadlessMode::SCREEN_OFF, stops drawing altogether.
+  HeadlessMode headless_mode_{ HeadlessMode::NONE };
 
   int stage, max_stage;
 
@@ -525,9 +617,14 @@ class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
   bool rtl_locale_;
 
   std::mutex updateMutex;
+  // The memory of the animation frames, from the MemoryGovernor. Declared after them and
+  // updateMutex, which its shrink callback uses, to be released first.
+  std::unique_ptr<MemoryGovernor::Reservation> animation_reservation_;
 
   std::thread batt_monitor_thread_;
   std::atomic<bool> batt_monitor_thread_stopped_{ false };
+  // Wakes the battery monitor thread up on stopping. Waited on with updateMutex.
+  std::condition_variable batt_monitor_cv_;
   int32_t batt_capacity_;
   bool charging_;
 
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// The rows of the text screen, as a ring that drops the oldest row when a new one doesn't fit. The
+// characters of all the rows live in one allocation, each row NUL-terminated in a slot of
+// |columns| + 1 bytes, next to its length and its width in pixels; so drawing the screen is one
+// pass over the rows, from the oldest to the newest, with nothing left to measure.
+//
+// A logical line longer than a row wraps, at its last space if the row has one, onto rows marked
+// as continued.
+class TextBuffer {
+ public:
+  struct Row {
+    // The text of the row, NUL-terminated.
+    const char* text;
+    size_t length;
+    int width;
+    // Whether the row continues the logical line of the row before it.
+    bool continued;
+  };
+
+  // A buffer of |rows| rows of |columns| characters, each |char_width| pixels wide.
+  TextBuffer(size_t rows, size_t columns, int char_width);
+
+  TextBuffer(const TextBuffer&) = delete;
+  TextBuffer& operator=(const TextBuffer&) = delete;
+
+  size_t rows() const {
+    return rows_;
+  }
+
+  size_t columns() const {
+    return columns_;
+  }
+
+  // The number of rows in use, up to rows(). The last one is where the text goes next, so it counts
+  // even while it's empty.
+  size_t size() const {
+    return count_;
+  }
+
+  // Returns row |index|, from the oldest (0) to the newest (size() - 1).
+  Row GetRow(size_t index) const;
+
+  // Appends |text|, starting a new row at each newline.
+  void Append(std::string_view text);
+
+  // Appends |row| as a whole row (cut to columns(), and not wrapped), followed by a newline unless
+  // |newline| is false.
+  void AppendRow(std::string_view row, bool newline = true);
+
+  // Empties the buffer.
+  void Clear();
+
+ private:
+  struct RowInfo {
+    size_t length;
+    int width;
+    bool continued;
+  };
+
+  char* RowText(size_t slot) {
+    return chars_.get() + slot * (columns_ + 1);
+  }
+
+  size_t LastSlot() const {
+    return (first_ + count_ - 1) % rows_;
+  }
+
+  // Appends a character to the last row, wrapping the logical line if the row is full.
+  void PutChar(char ch);
+  // Starts a new row, dropping the oldest one if the buffer is full.
+  void NewRow(bool continued);
+  // Sets the length of the row in |slot|, and updates its width.
+  void SetLength(size_t slot, size_t length);
+
+  const size_t rows_;
+  const size_t columns_;
+  const int char_width_;
+
+  std::unique_ptr<char[]> chars_;
+  std::vector<RowInfo> row_info_;
+  // The slot of the oldest row, and the number of rows in use.
+  size_t first_{ 0 };
+  size_t count_{ 0 };
+};
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A text file as rows of the screen: its lines, wrapped at a number of columns. The file is mapped
+// rather than read, and the offsets of the rows are indexed as far as they're asked for, so that
+// paging through a large log (or jumping to its end) costs no more than finding the line breaks.
+class TextFileView {
+ public:
+  static constexpr size_t npos = std::string_view::npos;
+
+  // Maps the file at |path| (or reads it, if it can't be mapped, e.g. on procfs), to show it in
+  // rows of |columns| characters. Returns nullptr on error, with errno set.
+  static std::unique_ptr<TextFileView> Open(const std::string& path, size_t columns);
+
+  TextFileView(std::string_view data, size_t columns);
+  ~TextFileView();
+
+  TextFileView(const TextFileView&) = delete;
+  TextFileView& operator=(const TextFileView&) = delete;
+
+  // The size of the file, in bytes.
+  size_t size() const {
+    return data_.size();
+  }
+
+  // Returns the number of rows of the whole file. Indexes it to the end.
+  size_t RowCount();
+
+  // Returns row |index|, without its newline, or an empty view past the last row.
+  std::string_view Row(size_t index);
+
+  // Returns the offset in the file of row |index|, or size() past the last row.
+  size_t RowOffset(size_t index);
+
+  // Returns the first row at or after |from_row| where |query| starts, or npos if there's none.
+  size_t FindRow(std::string_view query, size_t from_row);
+
+ private:
+  // Indexes the rows up to (and including) row |index|, or to the end of the file. Returns whether
+  // the row exists.
+  bool IndexTo(size_t index);
+  // Indexes the rows up to the one that holds |offset|, and returns that row.
+  size_t RowAt(size_t offset);
+  // Indexes the next row. Returns false at the end of the file.
+  bool IndexNext();
+
+  std::string_view data_;
+  const size_t columns_;
+  // The mapping of the file, if |data_| points into one.
+  void* map_{ nullptr };
+  // The contents of the file, if it couldn't be mapped.
+  std::string contents_;
+
+  // The offsets of the rows indexed so far, plus that of the row after them.
+  std::vector<size_t> row_offsets_{ 0 };
+  bool indexed_{ false };
+};
@@ -94,6 +94,17 @@ class RecoveryUI {
     DETERMINATE,
   };
 
+  // How an unattended install is shown, to leave the CPU (and the thermal headroom) to the updater.
+  enum class HeadlessMode {
+    // Drawn as usual.
+    NONE,
+    // The background and the progress bar only, redrawn at a low rate. No animation, and no
+    // battery updates.
+    MINIMAL_PROGRESS,
+    // The panel is turned off, and nothing is drawn.
+    SCREEN_OFF,
+  };
+
   enum KeyAction {
     ENQUEUE,
     TOGGLE,
@@ -179,6 +190,10 @@ class RecoveryUI {
   // ShowProgress).
   virtual void SetProgress(float fraction) = 0;
 
+  // Switches to the headless |mode| for an unattended install, or back to the normal UI with
+  // HeadlessMode::NONE (which redraws the screen).
+  virtual void SetHeadlessMode(HeadlessMode /* mode */) {}
+
   // --- text log ---
 
   virtual void ShowText(bool visible) = 0;
@@ -222,6 +237,10 @@ class RecoveryUI {
   // Erases any queued-up keys.
   virtual void FlushKeys();
 
+  // Returns whether there are keys (or touches) queued up, that WaitInputEvent() would return
+  // without waiting.
+  bool HasQueuedInputEvents();
+
   // Called on each key press, even while operations are in progress. Return value indicates whether
   // an immediate operation should be triggered (toggling the display, rebooting the device), or if
   // the key should be enqueued for use by the main thread.
@@ -298,9 +317,21 @@ class RecoveryUI {
 
   // Notify of volume state change
   void onVolumeChanged() {
+    RefreshMenu();
+  }
+
+  // Has a refreshable menu that's showing return Device::kRefresh, for the caller to show it again
+  // with its items up to date. Can be called from any thread.
+  void RefreshMenu() {
     EnqueueKey(KEY_REFRESH);
   }
 
+  // Returns the item that was highlighted as the last menu returned, e.g. to keep it highlighted
+  // as a refreshed menu is shown again.
+  size_t GetLastMenuSelection() const {
+    return last_menu_selection_;
+  }
+
   bool IsSideloadAutoReboot() const {
     return sideload_auto_reboot_;
   }
@@ -313,6 +344,9 @@ class RecoveryUI {
   void EnqueueKey(int key_code);
   void EnqueueTouch(const Point& pos);
 
+  // Called when the screensaver turns the screen off, or back on.
+  virtual void OnScreensaverChanged(bool /* screen_off */) {}
+
   // The normal and dimmed brightness percentages (default: 50 and 25, which means 50% and 25% of
   // the max_brightness). Because the absolute values may vary across devices. These two values can
   // be configured via subclassing. Setting brightness_normal_ to 0 to disable screensaver.
@@ -328,6 +362,9 @@ class RecoveryUI {
 
   bool sideload_auto_reboot_;
 
+  // Set by ShowMenu() as it returns.
+  size_t last_menu_selection_{ 0 };
+
  private:
   enum class ScreensaverState {
     DISABLED,
@@ -349,6 +386,7 @@ class RecoveryUI {
   void OnTouchTrack();
   void OnTouchRelease();
   int OnInputEvent(int fd, uint32_t epevents);
+  void ProcessInputEvent(int fd, const input_event& ev);
   void ProcessKey(int key_code, int updown);
   void TimeKey(int key_code, int count);
 
@@ -370,6 +408,8 @@ class RecoveryUI {
   int key_last_down;
   bool key_long_press;
   int key_down_count;
+  // The ev_add_timer() timer that tells if the last key down is a long press.
+  int long_press_timer_{ 0 };
   bool enable_reboot;
 
   int rel_sum;
@@ -396,6 +436,8 @@ class RecoveryUI {
   bool touch_saw_x_;
   bool touch_saw_y_;
   bool touch_reported_;
+  // Whether the touch moved, and OnTouchTrack() is due once the events read along are processed.
+  bool touch_track_pending_{ false };
   Point touch_pos_;
   Point touch_start_;
   Point touch_track_;
@@ -17,6 +17,7 @@
 #ifndef RECOVERY_VR_UI_H
 #define RECOVERY_VR_UI_H
 
+#include <memory>
 #include <string>
 
 #include "screen_ui.h"
@@ -40,6 +41,39 @@ class VrRecoveryUI : public ScreenRecoveryUI {
   void DrawFill(int x, int y, int w, int h) const override;
   void DrawTextIcon(int x, int y, const GRSurface* surface) const override;
   int DrawTextLine(int x, int y, const std::string& line, bool bold) const override;
+
+  // Draw each frame once into |eye_surface_|, then blit it to both eyes.
+  void update_screen_locked() override;
+  void update_progress_locked() override;
+  // The menu is drawn into |eye_surface_| with the rest of the frame, so it's always redrawn whole.
+  bool update_menu_selection_locked() override;
+
+ private:
+  // Calls |draw| with the horizontal offset of each eye: 0 while drawing into |eye_surface_|, or
+  // the offset of each half of the screen otherwise.
+  template <typename F>
+  void ForEachEye(F draw) const {
+    if (drawing_eye_) {
+      draw(0);
+    } else {
+      draw(stereo_offset_);
+      draw(ScreenWidth() - stereo_offset_);
+    }
+  }
+
+  // Makes the drawing functions draw into |eye_surface_|, (re)creating it as needed. Returns false
+  // if the screen doesn't allow it (e.g. it's rotated), in which case the elements are drawn twice
+  // into the frame as they come.
+  bool BeginEyeFrame();
+  // Draws into the frame again, and blits |eye_surface_| to both eyes.
+  void EndEyeFrame();
+
+  std::unique_ptr<GRSurface> eye_surface_;
+  // Whether the drawing functions draw into |eye_surface_|.
+  bool drawing_eye_{ false };
+  // Whether |eye_surface_| holds a whole frame, so that a progress update only needs to draw the
+  // foreground over it.
+  bool eye_frame_drawn_{ false };
 };
 
 #endif  // RECOVERY_VR_UI_H
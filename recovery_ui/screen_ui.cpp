@@ -35,6 +35,7 @@
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <aidl/android/hardware/health/BatteryStatus.h>
@@ -49,8 +50,14 @@
 #include <healthd/BatteryMonitor.h>
 
 #include "minui/minui.h"
+#include "otautil/memory_governor.h"
 #include "otautil/paths.h"
+#include "otautil/sched_policy.h"
+#include "otautil/startup_trace.h"
+#include "recovery_ui/bitmap_loader.h"
 #include "recovery_ui/device.h"
+#include "recovery_ui/text_buffer.h"
+#include "recovery_ui/text_file_view.h"
 #include "recovery_ui/ui.h"
 
 enum DirectRenderManager {
@@ -183,9 +190,37 @@ int TextMenu::DrawHeader(int x, int y) const {
   return offset;
 }
 
+int TextMenu::DrawItem(size_t index, int x, int y, int screen_width, bool long_press) const {
+  if (index == static_cast<size_t>(selection())) {
+    // Draw the highlight bar.
+    draw_funcs_.SetColor(long_press ? UIElement::MENU_SEL_BG_ACTIVE : UIElement::MENU_SEL_BG);
+
+    int bar_height = draw_funcs_.MenuItemPadding() + char_height_ + draw_funcs_.MenuItemPadding();
+    draw_funcs_.DrawHighlightBar(0, y, screen_width, bar_height);
+
+    // Colored text for the selected item.
+    draw_funcs_.SetColor(UIElement::MENU_SEL_FG);
+  }
+  int offset = draw_funcs_.DrawTextLine(x, y, TextItem(index), false /* bold */);
+
+  draw_funcs_.SetColor(UIElement::MENU);
+  return offset;
+}
+
+void TextMenu::DrawItemsScrollBar(int items_y) const {
+  std::string unused;
+  if (ItemsOverflow(&unused)) {
+    int padding = draw_funcs_.MenuItemPadding();
+    int container_height = max_display_items_ * (2 * padding + char_height_);
+    int bar_height = container_height / (text_items_.size() - max_display_items_ + 1);
+    int start_y = items_y + bar_height * menu_start_;
+    draw_funcs_.SetColor(UIElement::SCROLLBAR);
+    draw_funcs_.DrawScrollBar(start_y, bar_height);
+  }
+}
+
 int TextMenu::DrawItems(int x, int y, int screen_width, bool long_press) const {
   int offset = 0;
-  int padding = draw_funcs_.MenuItemPadding();
 
   draw_funcs_.SetColor(UIElement::MENU);
   offset += draw_funcs_.DrawHorizontalRule(y + offset) + 4;
@@ -193,32 +228,39 @@ int TextMenu::DrawItems(int x, int y, int screen_width, bool long_press) const {
   int item_container_offset = offset; // store it for drawing scrollbar on most top
 
   for (size_t i = MenuStart(); i < MenuEnd(); ++i) {
-    if (i == selection()) {
-      // Draw the highlight bar.
-      draw_funcs_.SetColor(long_press ? UIElement::MENU_SEL_BG_ACTIVE : UIElement::MENU_SEL_BG);
+    offset += DrawItem(i, x, y + offset, screen_width, long_press);
+  }
+  offset += draw_funcs_.DrawHorizontalRule(y + offset);
 
-      int bar_height = padding + char_height_ + padding;
-      draw_funcs_.DrawHighlightBar(0, y + offset, screen_width, bar_height);
+  DrawItemsScrollBar(y + item_container_offset);
 
-      // Colored text for the selected item.
-      draw_funcs_.SetColor(UIElement::MENU_SEL_FG);
-    }
-    offset += draw_funcs_.DrawTextLine(x, y + offset, TextItem(i), false /* bold */);
+  drawn_items_ = DrawnItems{ x, y + item_container_offset, screen_width, long_press, menu_start_,
+                             selection() };
+  return offset;
+}
 
-    draw_funcs_.SetColor(UIElement::MENU);
+bool TextMenu::DrawSelectionChange(bool long_press) const {
+  // The back arrow is drawn by the caller, outside of the items.
+  if (!drawn_items_ || drawn_items_->menu_start != menu_start_ ||
+      drawn_items_->long_press != long_press || drawn_items_->selection < 0 || selection() < 0) {
+    return false;
   }
-  offset += draw_funcs_.DrawHorizontalRule(y + offset);
 
-  std::string unused;
-  if (ItemsOverflow(&unused)) {
-    int container_height = max_display_items_ * (2 * padding + char_height_);
-    int bar_height = container_height / (text_items_.size() - max_display_items_ + 1);
-    int start_y = y + item_container_offset + bar_height * menu_start_;
-    draw_funcs_.SetColor(UIElement::SCROLLBAR);
-    draw_funcs_.DrawScrollBar(start_y, bar_height);
+  int item_height = draw_funcs_.MenuItemHeight();
+  for (int index : { drawn_items_->selection, selection() }) {
+    // A selection that scrolled the menu would have moved |menu_start_|.
+    CHECK_LT(static_cast<size_t>(index), MenuEnd());
+    int y = drawn_items_->items_y + (index - static_cast<int>(menu_start_)) * item_height;
+    draw_funcs_.SetColor(UIElement::BACKGROUND);
+    draw_funcs_.DrawHighlightBar(0, y, drawn_items_->screen_width, item_height);
+    draw_funcs_.SetColor(UIElement::MENU);
+    DrawItem(index, drawn_items_->x, y, drawn_items_->screen_width, long_press);
   }
+  // The highlight bars span the width of the screen, so the scroll bar is drawn over them again.
+  DrawItemsScrollBar(drawn_items_->items_y);
 
-  return offset;
+  drawn_items_->selection = selection();
+  return true;
 }
 
 GraphicMenu::GraphicMenu(const GRSurface* graphic_headers,
@@ -401,12 +443,8 @@ ScreenRecoveryUI::ScreenRecoveryUI()
       pagesIdentical(false),
       text_cols_(0),
       text_rows_(0),
-      text_(nullptr),
-      text_col_(0),
-      text_row_(0),
       show_text(false),
       show_text_ever(false),
-      file_viewer_text_(nullptr),
       stage(-1),
       max_stage(-1),
       locale_(""),
@@ -416,22 +454,27 @@ ScreenRecoveryUI::ScreenRecoveryUI()
       is_graphics_available(false) {}
 
 ScreenRecoveryUI::~ScreenRecoveryUI() {
-  batt_monitor_thread_stopped_ = true;
+  {
+    std::lock_guard<std::mutex> lg(updateMutex);
+    batt_monitor_thread_stopped_ = true;
+    progress_thread_stopped_ = true;
+  }
+  batt_monitor_cv_.notify_all();
+  progress_cv_.notify_all();
   if (batt_monitor_thread_.joinable()) {
     batt_monitor_thread_.join();
   }
-
-  progress_thread_stopped_ = true;
   if (progress_thread_.joinable()) {
     progress_thread_.join();
   }
+  frame_loader_.reset();
   // No-op if gr_init() (via Init()) was not called or had failed.
   gr_exit();
 }
 
 const GRSurface* ScreenRecoveryUI::GetCurrentFrame() const {
   if (current_icon_ == INSTALLING_UPDATE || current_icon_ == ERASING) {
-    return intro_done_ ? loop_frames_[current_frame_].get() : intro_frames_[current_frame_].get();
+    return intro_done_ ? loop_frames_.current() : intro_frames_.current();
   }
   return error_icon_.get();
 }
@@ -481,7 +524,7 @@ static constexpr int kLayouts[LAYOUT_MAX][DIMENSION_MAX] = {
 
 int ScreenRecoveryUI::GetAnimationBaseline() const {
   return GetTextBaseline() - PixelsFromDp(kLayouts[layout_][ICON]) -
-         gr_get_height(loop_frames_[0].get());
+         gr_get_height(loop_frames_.current());
 }
 
 int ScreenRecoveryUI::GetTextBaseline() const {
@@ -490,7 +533,7 @@ int ScreenRecoveryUI::GetTextBaseline() const {
 }
 
 int ScreenRecoveryUI::GetProgressBaseline() const {
-  int elements_sum = gr_get_height(loop_frames_[0].get()) + PixelsFromDp(kLayouts[layout_][ICON]) +
+  int elements_sum = gr_get_height(loop_frames_.current()) + PixelsFromDp(kLayouts[layout_][ICON]) +
                      gr_get_height(installing_text_.get()) + PixelsFromDp(kLayouts[layout_][TEXT]) +
                      gr_get_height(progress_bar_fill_.get());
   int bottom_gap = (ScreenHeight() - elements_sum) / 2;
@@ -626,6 +669,9 @@ void ScreenRecoveryUI::SetColor(UIElement e) const {
     case UIElement::TEXT_FILL:
       gr_color(0, 0, 0, 160);
       break;
+    case UIElement::BACKGROUND:
+      gr_color(0, 0, 0, 255);
+      break;
     default:
       gr_color(255, 255, 255, 255);
       break;
@@ -822,7 +868,7 @@ void ScreenRecoveryUI::draw_screen_locked() {
     return;
   }
 
-  gr_color(0, 0, 0, 255);
+  SetColor(UIElement::BACKGROUND);
   gr_clear();
 
   draw_menu_and_text_buffer_locked(GetMenuHelpMessage());
@@ -867,16 +913,20 @@ void ScreenRecoveryUI::draw_menu_and_text_buffer_locked(
     }
   }
 
-  // Display from the bottom up, until we hit the top of the screen, the bottom of the menu, or
-  // we've displayed the entire text buffer.
+  // Display the newest rows that fit between the bottom of the menu and the bottom of the screen,
+  // top down.
   SetColor(UIElement::LOG);
-  int row = text_row_;
-  size_t count = 0;
-  for (int ty = ScreenHeight() - margin_height_ - char_height_; ty >= y && count < text_rows_;
-       ty -= char_height_, ++count) {
-    DrawTextLine(margin_width_, ty, text_[row], false);
-    --row;
-    if (row < 0) row = text_rows_ - 1;
+  int bottom = ScreenHeight() - margin_height_ - char_height_;
+  if (bottom < y) {
+    return;
+  }
+  size_t visible = std::min<size_t>(text_->size(), (bottom - y) / char_height_ + 1);
+  int ty = bottom - static_cast<int>(visible - 1) * char_height_;
+  for (size_t i = text_->size() - visible; i < text_->size(); ++i, ty += char_height_) {
+    TextBuffer::Row row = text_->GetRow(i);
+    if (row.width > 0) {
+      DrawTextLine(margin_width_, ty, row.text, false);
+    }
   }
 }
 
@@ -937,6 +987,9 @@ void ScreenRecoveryUI::draw_battery_capacity_locked() {
 // Redraw everything on the screen and flip the screen (make it visible).
 // Should only be called with updateMutex locked.
 void ScreenRecoveryUI::update_screen_locked() {
+  if (headless_mode_ == HeadlessMode::SCREEN_OFF) {
+    return;
+  }
   draw_screen_locked();
   gr_flip();
 }
@@ -944,7 +997,14 @@ void ScreenRecoveryUI::update_screen_locked() {
 // Updates only the progress bar, if possible, otherwise redraws the screen.
 // Should only be called with updateMutex locked.
 void ScreenRecoveryUI::update_progress_locked() {
-  if (show_text || !pagesIdentical) {
+  if (headless_mode_ == HeadlessMode::SCREEN_OFF) {
+    return;
+  }
+  // A partial update keeps the background on the screen, so that only the animation frame and the
+  // progress bar are redrawn and pushed out. Without one, both pages need the background first.
+  if (!show_text && gr_begin_partial_update()) {
+    draw_foreground_locked();
+  } else if (show_text || !pagesIdentical) {
     draw_screen_locked();  // Must redraw the whole screen
     pagesIdentical = true;
   } else {
@@ -958,6 +1018,8 @@ void ScreenRecoveryUI::BattMonitorThreadLoop() {
   using aidl::android::hardware::health::BatteryStatus;
   using android::hardware::health::InitHealthdConfig;
 
+  SchedPolicy::Get().Apply(ThreadClass::kUi);
+
   auto config = std::make_unique<healthd_config>();
   InitHealthdConfig(config.get());
 
@@ -968,109 +1030,168 @@ void ScreenRecoveryUI::BattMonitorThreadLoop() {
   bool is_first_call = true;
 
   while (!batt_monitor_thread_stopped_) {
-    bool redraw = false;
+    // The battery monitor may take a while to answer (seconds, while it reinitializes), so it's
+    // only the values read that are applied with updateMutex held.
+    auto charge_status = static_cast<BatteryStatus>(batt_monitor->getChargeStatus());
+    // Treat unknown status as on charger.
+    bool charging = (charge_status != BatteryStatus::DISCHARGING &&
+                     charge_status != BatteryStatus::NOT_CHARGING &&
+                     charge_status != BatteryStatus::FULL);
+
+    android::BatteryProperty prop;
+    android::base::Timer t;
+    android::status_t status;
+    while (t.duration() < 5s) {
+      status = batt_monitor->getProperty(android::BATTERY_PROP_CAPACITY, &prop);
+      if (status == android::OK || !is_first_call) {
+        break;
+      }
+
+      LOG(WARNING) << "Trying again for reinitializing battery info";
+      batt_monitor->init(config.get());
+      std::this_thread::sleep_for(100ms);
+    }
+    is_first_call = false;
+
+    // If we can't read battery percentage, it may be a device without battery. In this
+    // situation, use 100 as a fake battery percentage.
+    bool retry = false;
+    if (status != android::OK) {
+      prop.valueInt64 = 100;
+      if (retry_count++ < BATT_MONITOR_INIT_RETRY_MAX) {
+        LOG(WARNING) << "Retry count for reinitialization:" << retry_count;
+        retry = true;
+      }
+    }
+
     {
       std::lock_guard<std::mutex> lg(updateMutex);
-
-      auto charge_status = static_cast<BatteryStatus>(batt_monitor->getChargeStatus());
-      // Treat unknown status as on charger.
-      bool charging = (charge_status != BatteryStatus::DISCHARGING &&
-                       charge_status != BatteryStatus::NOT_CHARGING &&
-                       charge_status != BatteryStatus::FULL);
+      bool redraw = false;
       if (charging_ != charging) {
         charging_ = charging;
         redraw = true;
       }
-
-      android::BatteryProperty prop;
-      android::base::Timer t;
-      android::status_t status;
-      while (t.duration() < 5s) {
-        status = batt_monitor->getProperty(android::BATTERY_PROP_CAPACITY, &prop);
-        if (status == android::OK || !is_first_call) {
-          break;
-        }
-
-        LOG(WARNING) << "Trying again for reinitializing battery info";
-        if (redraw) update_screen_locked();
-        batt_monitor->init(config.get());
-        std::this_thread::sleep_for(100ms);
-      }
-      is_first_call = false;
-
-      // If we can't read battery percentage, it may be a device without battery. In this
-      // situation, use 100 as a fake battery percentage.
-      if (status != android::OK) {
-        prop.valueInt64 = 100;
-        if (retry_count++ < BATT_MONITOR_INIT_RETRY_MAX) {
-          LOG(WARNING) << "Retry count for reinitialization:" << retry_count;
-          if (redraw) update_screen_locked();
-
-          // Try reinit
-          batt_monitor->init(config.get());
-          std::this_thread::sleep_for(100ms);
-          continue;
-        }
-      }
-
       int32_t batt_capacity = static_cast<int32_t>(prop.valueInt64);
-      if (batt_capacity_ != batt_capacity) {
+      if (!retry && batt_capacity_ != batt_capacity) {
         batt_capacity_ = batt_capacity;
         redraw = true;
       }
-
       if (redraw) update_screen_locked();
     }
-    std::this_thread::sleep_for(5s);
+
+    if (retry) {
+      // Try reinit
+      batt_monitor->init(config.get());
+      std::this_thread::sleep_for(100ms);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(updateMutex);
+    batt_monitor_cv_.wait_for(lock, 5s, [this]() { return batt_monitor_thread_stopped_.load(); });
+    // Nothing shows the battery in a headless mode.
+    batt_monitor_cv_.wait(lock, [this]() {
+      return batt_monitor_thread_stopped_ || headless_mode_ == HeadlessMode::NONE;
+    });
   }
 }
 
+std::chrono::steady_clock::duration ScreenRecoveryUI::FrameInterval() const {
+  using std::chrono::steady_clock;
+  if (headless_mode_ != HeadlessMode::NONE) {
+    return 1s;
+  }
+  // minimum of 20ms delay between frames
+  return std::max<steady_clock::duration>(
+      std::chrono::duration_cast<steady_clock::duration>(
+          std::chrono::duration<double>(1.0 / animation_fps_)),
+      20ms);
+}
+
 void ScreenRecoveryUI::ProgressThreadLoop() {
-  double interval = 1.0 / animation_fps_;
+  using std::chrono::steady_clock;
+  SchedPolicy::Get().Apply(ThreadClass::kUi);
+  steady_clock::time_point next_frame = steady_clock::now();
+
+  std::unique_lock<std::mutex> lock(updateMutex);
   while (!progress_thread_stopped_) {
-    double start = now();
-    bool redraw = false;
-    {
-      std::lock_guard<std::mutex> lg(updateMutex);
+    // Give memory back if the device runs short of it. The animation is frozen with updateMutex
+    // held, so it can't be held here.
+    lock.unlock();
+    MemoryGovernor::Get().Rebalance();
+    lock.lock();
+    if (progress_thread_stopped_) break;
+
+    steady_clock::duration interval = FrameInterval();
+    // update the installation animation, if active
+    // skip this if we have a text overlay (too expensive to update), or in a headless mode
+    bool animate = (current_icon_ == INSTALLING_UPDATE || current_icon_ == ERASING) &&
+                   !show_text && headless_mode_ == HeadlessMode::NONE && !animation_frozen_;
+    // move the progress bar forward on timed intervals, if configured
+    bool timed_progress =
+        progressBarType == DETERMINATE && progressScopeDuration > 0 && progress < 1.0;
+    if (screen_off_ || headless_mode_ == HeadlessMode::SCREEN_OFF ||
+        (!animate && !timed_progress && !progress_changed_ && !text_changed_)) {
+      // Nothing to draw until the state changes.
+      progress_cv_.wait(lock);
+      continue;
+    }
 
-      // update the installation animation, if active
-      // skip this if we have a text overlay (too expensive to update)
-      if ((current_icon_ == INSTALLING_UPDATE || current_icon_ == ERASING) && !show_text) {
-        if (!intro_done_) {
-          if (current_frame_ == intro_frames_.size() - 1) {
-            intro_done_ = true;
-            current_frame_ = 0;
-          } else {
-            ++current_frame_;
-          }
+    // Coalesce the changes until the next frame is due.
+    steady_clock::time_point start = steady_clock::now();
+    if (start < next_frame) {
+      progress_cv_.wait_until(lock, next_frame);
+      continue;
+    }
+    // Don't catch up on the frames missed while idle (or slow).
+    next_frame = (start - next_frame < interval) ? next_frame + interval : start + interval;
+
+    bool redraw = progress_changed_;
+    progress_changed_ = false;
+    bool redraw_text = text_changed_ && show_text;
+    text_changed_ = false;
+    if (animate) {
+      if (!intro_done_) {
+        if (current_frame_ == intro_frames_.size() - 1) {
+          intro_done_ = true;
+          current_frame_ = 0;
+          intro_frames_.Clear();
         } else {
-          current_frame_ = (current_frame_ + 1) % loop_frames_.size();
+          ++current_frame_;
         }
-
-        redraw = true;
+      } else {
+        current_frame_ = (current_frame_ + 1) % loop_frames_.size();
       }
+      ShowCurrentFrame();
 
-      // move the progress bar forward on timed intervals, if configured
-      int duration = progressScopeDuration;
-      if (progressBarType == DETERMINATE && duration > 0) {
-        double elapsed = now() - progressScopeTime;
-        float p = 1.0 * elapsed / duration;
-        if (p > 1.0) p = 1.0;
-        if (p > progress) {
-          progress = p;
-          redraw = true;
-        }
+      redraw = true;
+    }
+
+    if (timed_progress) {
+      double elapsed = now() - progressScopeTime;
+      float p = 1.0 * elapsed / progressScopeDuration;
+      if (p > 1.0) p = 1.0;
+      if (p > progress) {
+        // Skip updates that aren't visibly different.
+        redraw |= ProgressPixels(progress) != ProgressPixels(p);
+        progress = p;
       }
+    }
 
-      if (redraw) update_progress_locked();
+    if (redraw_text) {
+      text_drawn_time_ = start;
+      update_screen_locked();
+    } else if (redraw) {
+      update_progress_locked();
     }
+  }
+}
 
-    double end = now();
-    // minimum of 20ms delay between frames
-    double delay = interval - (end - start);
-    if (delay < 0.02) delay = 0.02;
-    usleep(static_cast<useconds_t>(delay * 1000000));
+void ScreenRecoveryUI::OnScreensaverChanged(bool screen_off) {
+  {
+    std::lock_guard<std::mutex> lg(updateMutex);
+    screen_off_ = screen_off;
   }
+  progress_cv_.notify_all();
 }
 
 std::unique_ptr<GRSurface> ScreenRecoveryUI::LoadBitmap(const std::string& filename) {
@@ -1097,15 +1218,6 @@ std::unique_ptr<GRSurface> ScreenRecoveryUI::LoadLocalizedBitmap(const std::stri
   return nullptr;
 }
 
-static char** Alloc2d(size_t rows, size_t cols) {
-  char** result = new char*[rows];
-  for (size_t i = 0; i < rows; ++i) {
-    result[i] = new char[cols];
-    memset(result[i], 0, cols);
-  }
-  return result;
-}
-
 // Choose the right background string to display during update.
 void ScreenRecoveryUI::SetSystemUpdateText(bool security_update) {
   if (security_update) {
@@ -1157,10 +1269,14 @@ static bool InitGraphics() {
 }
 
 bool ScreenRecoveryUI::Init(const std::string& locale) {
+  ScopedStartupTrace trace("ScreenRecoveryUI::Init");
   RecoveryUI::Init(locale);
 
-  if (!InitGraphics()) {
-    return false;
+  {
+    ScopedStartupTrace gr_init_trace("gr_init");
+    if (!InitGraphics()) {
+      return false;
+    }
   }
   is_graphics_available = true;
 
@@ -1179,33 +1295,43 @@ bool ScreenRecoveryUI::Init(const std::string& locale) {
   // Are we the large variant of our base layout?
   if (gr_fb_height() > PixelsFromDp(800)) ++layout_;
 
-  text_ = Alloc2d(text_rows_, text_cols_ + 1);
-  file_viewer_text_ = Alloc2d(text_rows_, text_cols_ + 1);
-
-  text_col_ = text_row_ = 0;
+  text_ = std::make_unique<TextBuffer>(text_rows_, text_cols_, char_width_);
+  file_viewer_text_ = std::make_unique<TextBuffer>(text_rows_, text_cols_, char_width_);
 
   // Set up the locale info.
   SetLocale(locale);
 
-  error_icon_ = LoadBitmap("icon_error");
-
-  progress_bar_empty_ = LoadBitmap("progress_empty");
-  progress_bar_fill_ = LoadBitmap("progress_fill");
-  stage_marker_empty_ = LoadBitmap("stage_empty");
-  stage_marker_fill_ = LoadBitmap("stage_fill");
-
-  erasing_text_ = LoadLocalizedBitmap("erasing_text");
-  no_command_text_ = LoadLocalizedBitmap("no_command_text");
-  error_text_ = LoadLocalizedBitmap("error_text");
-
-  back_icon_ = LoadBitmap("ic_back");
-  back_icon_sel_ = LoadBitmap("ic_back_sel");
+  // The bitmaps are decoded in parallel. Each image of localized text holds all the locales, and
+  // takes the longest.
+  std::vector<std::pair<std::unique_ptr<GRSurface>*, BitmapLoader::Job>> bitmaps = {
+    { &error_icon_, [this]() { return LoadBitmap("icon_error"); } },
+    { &progress_bar_empty_, [this]() { return LoadBitmap("progress_empty"); } },
+    { &progress_bar_fill_, [this]() { return LoadBitmap("progress_fill"); } },
+    { &stage_marker_empty_, [this]() { return LoadBitmap("stage_empty"); } },
+    { &stage_marker_fill_, [this]() { return LoadBitmap("stage_fill"); } },
+    { &erasing_text_, [this]() { return LoadLocalizedBitmap("erasing_text"); } },
+    { &no_command_text_, [this]() { return LoadLocalizedBitmap("no_command_text"); } },
+    { &error_text_, [this]() { return LoadLocalizedBitmap("error_text"); } },
+    { &back_icon_, [this]() { return LoadBitmap("ic_back"); } },
+    { &back_icon_sel_, [this]() { return LoadBitmap("ic_back_sel"); } },
+  };
   if (android::base::GetBoolProperty("ro.boot.dynamic_partitions", false) ||
       android::base::GetBoolProperty("ro.fastbootd.available", false)) {
-    lineage_logo_ = LoadBitmap("logo_image_switch");
-    fastbootd_logo_ = LoadBitmap("fastbootd");
+    bitmaps.emplace_back(&lineage_logo_, [this]() { return LoadBitmap("logo_image_switch"); });
+    bitmaps.emplace_back(&fastbootd_logo_, [this]() { return LoadBitmap("fastbootd"); });
   } else {
-    lineage_logo_ = LoadBitmap("logo_image");
+    bitmaps.emplace_back(&lineage_logo_, [this]() { return LoadBitmap("logo_image"); });
+  }
+  {
+    ScopedStartupTrace bitmaps_trace("load_bitmaps");
+    std::vector<BitmapLoader::Job> jobs;
+    for (auto& bitmap : bitmaps) {
+      jobs.push_back(std::move(bitmap.second));
+    }
+    BitmapLoader loader(std::move(jobs), BitmapLoader::DefaultThreads());
+    for (size_t i = 0; i < bitmaps.size(); i++) {
+      *bitmaps[i].first = loader.Take(i);
+    }
   }
 
   // Background text for "installing_update" could be "installing update" or
@@ -1214,7 +1340,11 @@ bool ScreenRecoveryUI::Init(const std::string& locale) {
 
   LoadWipeDataMenuText();
 
-  LoadAnimation();
+  {
+    ScopedStartupTrace animation_trace("load_animation");
+    LoadAnimation();
+  }
+  ReserveAnimationMemory();
 
   // Keep the battery capacity updated.
   batt_monitor_thread_ = std::thread(&ScreenRecoveryUI::BattMonitorThreadLoop, this);
@@ -1259,17 +1389,81 @@ void ScreenRecoveryUI::LoadAnimation() {
   std::sort(intro_frame_names.begin(), intro_frame_names.end());
   std::sort(loop_frame_names.begin(), loop_frame_names.end());
 
-  intro_frames_.clear();
-  intro_frames_.reserve(intro_frames);
-  for (const auto& frame_name : intro_frame_names) {
-    intro_frames_.emplace_back(LoadBitmap(frame_name));
+  // Only the first intro frame and the first loop frame (which the layout goes by) are needed
+  // right away. The rest are decoded in the background, a few frames ahead of the animation, and
+  // ShowCurrentFrame() adds each one as the animation gets to it. Only the changes from one frame
+  // to the next are kept.
+  std::vector<BitmapLoader::Job> jobs;
+  for (const auto& names : { intro_frame_names, loop_frame_names }) {
+    for (const auto& frame_name : names) {
+      jobs.emplace_back([this, frame_name]() { return LoadBitmap(frame_name); });
+    }
+  }
+  size_t threads = BitmapLoader::DefaultThreads();
+  frame_loader_ = std::make_unique<BitmapLoader>(std::move(jobs), threads, threads);
+
+  intro_frames_ = AnimationFrames(intro_frames, false);
+  if (intro_frames > 0) {
+    intro_frames_.Add(frame_loader_->Take(0));
+  }
+  loop_frames_ = AnimationFrames(loop_frames, true);
+  loop_frames_.Add(frame_loader_->Take(intro_frames));
+}
+
+void ScreenRecoveryUI::ShowCurrentFrame() {
+  AnimationFrames& frames = intro_done_ ? loop_frames_ : intro_frames_;
+  if (current_frame_ < frames.added()) {
+    frames.Show(current_frame_);
+    return;
+  }
+  if (!frame_loader_) return;
+  size_t index = intro_done_ ? intro_frames_.size() + current_frame_ : current_frame_;
+  frames.Add(frame_loader_->Take(index));
+  if (intro_done_ && loop_frames_.added() == loop_frames_.size()) {
+    // All the frames have been taken.
+    frame_loader_.reset();
+  }
+}
+
+void ScreenRecoveryUI::ReserveAnimationMemory() {
+  // The animation holds the frame on show, the first loop frame until the last one is added, the
+  // frames that |frame_loader_| decodes ahead, and the changes between the frames (which are
+  // usually small). The frames are alike in size.
+  const GRSurface* frame = loop_frames_.current();
+  size_t frame_size = frame != nullptr ? frame->row_bytes * frame->height : 0;
+  size_t max_size = frame_size * (3 + BitmapLoader::DefaultThreads());
+
+  MemoryConsumer consumer;
+  consumer.usage = [this]() {
+    std::lock_guard<std::mutex> lg(updateMutex);
+    return intro_frames_.data_size() + loop_frames_.data_size();
+  };
+  consumer.shrink = [this, max_size](size_t) {
+    std::lock_guard<std::mutex> lg(updateMutex);
+    if (!FreezeAnimation()) return size_t{ 0 };
+    size_t used = intro_frames_.data_size() + loop_frames_.data_size();
+    return max_size > used ? max_size - used : 0;
+  };
+  animation_reservation_ = MemoryGovernor::Get().Reserve("animation", MemoryPriority::kCache, 0,
+                                                         max_size, consumer);
+  if (!animation_reservation_ || animation_reservation_->bytes() < max_size) {
+    LOG(WARNING) << "Not enough memory to play the animation";
+    std::lock_guard<std::mutex> lg(updateMutex);
+    FreezeAnimation();
   }
+}
 
-  loop_frames_.clear();
-  loop_frames_.reserve(loop_frames);
-  for (const auto& frame_name : loop_frame_names) {
-    loop_frames_.emplace_back(LoadBitmap(frame_name));
+bool ScreenRecoveryUI::FreezeAnimation() {
+  if (animation_frozen_) return false;
+  animation_frozen_ = true;
+  frame_loader_.reset();
+  if (!intro_done_) {
+    intro_done_ = true;
+    current_frame_ = 0;
+    intro_frames_.Clear();
   }
+  loop_frames_.Freeze();
+  return true;
 }
 
 void ScreenRecoveryUI::SetBackground(Icon icon) {
@@ -1277,6 +1471,7 @@ void ScreenRecoveryUI::SetBackground(Icon icon) {
 
   current_icon_ = icon;
   update_screen_locked();
+  progress_cv_.notify_all();
 }
 
 void ScreenRecoveryUI::SetProgressType(ProgressType type) {
@@ -1288,6 +1483,7 @@ void ScreenRecoveryUI::SetProgressType(ProgressType type) {
   progressScopeSize = 0;
   progress = 0;
   update_progress_locked();
+  progress_cv_.notify_all();
 }
 
 void ScreenRecoveryUI::ShowProgress(float portion, float seconds) {
@@ -1299,6 +1495,7 @@ void ScreenRecoveryUI::ShowProgress(float portion, float seconds) {
   progressScopeDuration = seconds;
   progress = 0;
   update_progress_locked();
+  progress_cv_.notify_all();
 }
 
 void ScreenRecoveryUI::SetProgress(float fraction) {
@@ -1306,16 +1503,43 @@ void ScreenRecoveryUI::SetProgress(float fraction) {
   if (fraction < 0.0) fraction = 0.0;
   if (fraction > 1.0) fraction = 1.0;
   if (progressBarType == DETERMINATE && fraction > progress) {
-    // Skip updates that aren't visibly different.
-    int width = gr_get_width(progress_bar_empty_.get());
-    float scale = width * progressScopeSize;
-    if ((int)(progress * scale) != (int)(fraction * scale)) {
-      progress = fraction;
-      update_progress_locked();
+    // Skip updates that aren't visibly different. The progress thread draws the others, along with
+    // the animation frame.
+    if (ProgressPixels(progress) != ProgressPixels(fraction)) {
+      progress_changed_ = true;
+      progress_cv_.notify_all();
     }
+    progress = fraction;
   }
 }
 
+void ScreenRecoveryUI::SetHeadlessMode(HeadlessMode mode) {
+  {
+    std::lock_guard<std::mutex> lg(updateMutex);
+    if (headless_mode_ == mode) {
+      return;
+    }
+    if (mode == HeadlessMode::SCREEN_OFF) {
+      gr_fb_blank(true);
+    } else if (headless_mode_ == HeadlessMode::SCREEN_OFF) {
+      gr_fb_blank(false);
+    }
+    headless_mode_ = mode;
+    // Both pages need the current background again, after the screen was off or left alone.
+    pagesIdentical = false;
+    if (mode == HeadlessMode::NONE) {
+      update_screen_locked();
+    }
+  }
+  progress_cv_.notify_all();
+  batt_monitor_cv_.notify_all();
+}
+
+int ScreenRecoveryUI::ProgressPixels(float fraction) const {
+  int width = gr_get_width(progress_bar_empty_.get());
+  return static_cast<int>(fraction * width * progressScopeSize);
+}
+
 void ScreenRecoveryUI::SetStage(int current, int max) {
   std::lock_guard<std::mutex> lg(updateMutex);
   stage = current;
@@ -1332,16 +1556,19 @@ void ScreenRecoveryUI::PrintV(const char* fmt, bool copy_to_stdout, va_list ap)
 
   std::lock_guard<std::mutex> lg(updateMutex);
   if (text_rows_ > 0 && text_cols_ > 0) {
-    for (const char* ptr = str.c_str(); *ptr != '\0'; ++ptr) {
-      if (*ptr == '\n' || text_col_ >= text_cols_) {
-        text_[text_row_][text_col_] = '\0';
-        text_col_ = 0;
-        text_row_ = (text_row_ + 1) % text_rows_;
+    text_->Append(str);
+    if (show_text) {
+      // A lone line is drawn right away. The ones that follow it within a frame interval are left
+      // for the progress thread to draw together.
+      auto now_time = std::chrono::steady_clock::now();
+      if (!text_changed_ && now_time - text_drawn_time_ >= FrameInterval()) {
+        text_drawn_time_ = now_time;
+        update_screen_locked();
+      } else {
+        text_changed_ = true;
+        progress_cv_.notify_one();
       }
-      if (*ptr != '\n') text_[text_row_][text_col_++] = *ptr;
     }
-    text_[text_row_][text_col_] = '\0';
-    update_screen_locked();
   }
 }
 
@@ -1361,102 +1588,100 @@ void ScreenRecoveryUI::PrintOnScreenOnly(const char* fmt, ...) {
 
 void ScreenRecoveryUI::PutChar(char ch) {
   std::lock_guard<std::mutex> lg(updateMutex);
-  if (ch != '\n') text_[text_row_][text_col_++] = ch;
-  if (ch == '\n' || text_col_ >= text_cols_) {
-    text_col_ = 0;
-    ++text_row_;
-  }
+  text_->Append(std::string_view(&ch, 1));
 }
 
 void ScreenRecoveryUI::ClearText() {
   std::lock_guard<std::mutex> lg(updateMutex);
-  text_col_ = 0;
-  text_row_ = 0;
-  for (size_t i = 0; i < text_rows_; ++i) {
-    memset(text_[i], 0, text_cols_ + 1);
-  }
+  text_->Clear();
 }
 
-void ScreenRecoveryUI::ShowFile(FILE* fp) {
-  std::vector<off_t> offsets;
-  offsets.push_back(ftello(fp));
-  ClearText();
-
-  struct stat sb;
-  fstat(fileno(fp), &sb);
+void ScreenRecoveryUI::ShowFilePage(TextFileView* file, size_t top_row) {
+  std::lock_guard<std::mutex> lg(updateMutex);
+  size_t page_rows = text_rows_ - 1;
+  text_->Clear();
+  for (size_t i = 0; i < page_rows; ++i) {
+    text_->AppendRow(file->Row(top_row + i));
+  }
+  size_t end = file->RowOffset(top_row + page_rows);
+  int percent =
+      file->size() == 0 ? 100 : static_cast<int>(100 * (double(end) / double(file->size())));
+  text_->AppendRow(android::base::StringPrintf("--(%d%% of %zu bytes)--", percent, file->size()),
+                   false);
+  update_screen_locked();
+}
 
-  bool show_prompt = false;
+void ScreenRecoveryUI::ShowFile(TextFileView* file) {
+  if (text_rows_ < 2) {
+    return;
+  }
+  size_t page_rows = text_rows_ - 1;
+  size_t top_row = 0;
   while (true) {
-    if (show_prompt) {
-      PrintOnScreenOnly("--(%d%% of %d bytes)--",
-                        static_cast<int>(100 * (double(ftello(fp)) / double(sb.st_size))),
-                        static_cast<int>(sb.st_size));
-      Redraw();
-      while (show_prompt) {
-        show_prompt = false;
-        InputEvent evt = WaitInputEvent();
-        if (evt.type() == EventType::EXTRA) {
-          if (evt.key() == static_cast<int>(KeyError::INTERRUPTED)) {
-            return;
-          }
+    ShowFilePage(file, top_row);
+
+    bool moved = false;
+    while (!moved) {
+      InputEvent evt = WaitInputEvent();
+      if (evt.type() == EventType::EXTRA) {
+        if (evt.key() == static_cast<int>(KeyError::INTERRUPTED)) {
+          return;
         }
-        if (evt.type() != EventType::KEY) {
-          show_prompt = true;
-          continue;
+      }
+      if (evt.type() != EventType::KEY) {
+        continue;
+      }
+      int key = evt.key();
+      if (key == KEY_POWER || key == KEY_ENTER || key == KEY_BACKSPACE || key == KEY_BACK ||
+          key == KEY_HOME || key == KEY_HOMEPAGE) {
+        return;
+      } else if (key == KEY_UP || key == KEY_VOLUMEUP || key == KEY_SCROLLUP) {
+        if (top_row > 0) {
+          top_row -= std::min(top_row, page_rows);
+          moved = true;
+        }
+      } else if (key == KEY_END) {
+        // The last page, which indexes the rest of the file.
+        size_t rows = file->RowCount();
+        size_t last_page = rows > page_rows ? rows - page_rows : 0;
+        moved = last_page != top_row;
+        top_row = last_page;
+      } else if (key == KEY_SEARCH || key == KEY_FIND) {
+        // The next page that starts with an error line (as logged by recovery and the updater).
+        if (size_t row = file->FindRow("\nE:", top_row); row != TextFileView::npos) {
+          top_row = row + 1;
+          moved = true;
         }
-        if (evt.key() == KEY_POWER || evt.key() == KEY_ENTER || evt.key() == KEY_BACKSPACE ||
-            evt.key() == KEY_BACK || evt.key() == KEY_HOME || evt.key() == KEY_HOMEPAGE) {
+      } else {
+        // Any other key goes to the next page, or out past the last one.
+        if (file->RowOffset(top_row + page_rows) >= file->size()) {
           return;
-        } else if (evt.key() == KEY_UP || evt.key() == KEY_VOLUMEUP || evt.key() == KEY_SCROLLUP) {
-          if (offsets.size() <= 1) {
-            show_prompt = true;
-          } else {
-            offsets.pop_back();
-            fseek(fp, offsets.back(), SEEK_SET);
-          }
-        } else {
-          if (feof(fp)) {
-            return;
-          }
-          offsets.push_back(ftello(fp));
         }
-      }
-      ClearText();
-    }
-
-    int ch = getc(fp);
-    if (ch == EOF) {
-      while (text_row_ < text_rows_ - 1) PutChar('\n');
-      show_prompt = true;
-    } else {
-      PutChar(ch);
-      if (text_col_ == 0 && text_row_ >= text_rows_ - 1) {
-        show_prompt = true;
+        top_row += page_rows;
+        moved = true;
       }
     }
   }
 }
 
 void ScreenRecoveryUI::ShowFile(const std::string& filename) {
-  std::unique_ptr<FILE, decltype(&fclose)> fp(fopen(filename.c_str(), "re"), fclose);
-  if (!fp) {
+  auto file = TextFileView::Open(filename, text_cols_);
+  if (!file) {
     Print("  Unable to open %s: %s\n", filename.c_str(), strerror(errno));
     return;
   }
 
-  char** old_text = text_;
-  size_t old_text_col = text_col_;
-  size_t old_text_row = text_row_;
-
   // Swap in the alternate screen and clear it.
-  text_ = file_viewer_text_;
+  {
+    std::lock_guard<std::mutex> lg(updateMutex);
+    std::swap(text_, file_viewer_text_);
+  }
   ClearText();
 
-  ShowFile(fp.get());
+  ShowFile(file.get());
 
-  text_ = old_text;
-  text_col_ = old_text_col;
-  text_row_ = old_text_row;
+  std::lock_guard<std::mutex> lg(updateMutex);
+  std::swap(text_, file_viewer_text_);
 }
 
 std::unique_ptr<Menu> ScreenRecoveryUI::CreateMenu(
@@ -1495,7 +1720,7 @@ int ScreenRecoveryUI::SelectMenu(int sel) {
     sel = menu_->Select(sel);
 
     if (sel != old_sel) {
-      update_screen_locked();
+      update_menu_locked();
     }
   }
   return sel;
@@ -1568,11 +1793,38 @@ int ScreenRecoveryUI::ScrollMenu(int updown) {
   int sel = Device::kNoAction;
   if (menu_) {
     sel = menu_->Scroll(updown);
-    update_screen_locked();
+    update_menu_locked();
   }
   return sel;
 }
 
+void ScreenRecoveryUI::update_menu_locked() {
+  if (defer_menu_redraw_) {
+    menu_redraw_deferred_ = true;
+    return;
+  }
+  menu_redraw_deferred_ = false;
+  if (!update_menu_selection_locked()) {
+    update_screen_locked();
+  }
+}
+
+bool ScreenRecoveryUI::update_menu_selection_locked() {
+  if (headless_mode_ == HeadlessMode::SCREEN_OFF) {
+    return true;
+  }
+  // Moving the selection within the visible items leaves the rest of the screen as it is.
+  if (!show_text || !menu_ || !gr_begin_partial_update()) {
+    return false;
+  }
+  if (!menu_->DrawSelectionChange(IsLongPress())) {
+    // The full redraw that follows clears the screen, which makes the frame whole again.
+    return false;
+  }
+  gr_flip();
+  return true;
+}
+
 size_t ScreenRecoveryUI::ShowMenu(std::unique_ptr<Menu>&& menu, bool menu_only,
                                   const std::function<int(int, bool)>& key_handler,
                                   bool refreshable) {
@@ -1593,6 +1845,7 @@ size_t ScreenRecoveryUI::ShowMenu(std::unique_ptr<Menu>&& menu, bool menu_only,
   int chosen_item = -1;
   while (chosen_item < 0) {
     InputEvent evt = WaitInputEvent();
+    defer_menu_redraw_ = evt.type() != EventType::EXTRA && HasQueuedInputEvents();
     if (evt.type() == EventType::EXTRA) {
       if (evt.key() == static_cast<int>(KeyError::INTERRUPTED)) {
         // WaitKey() was interrupted.
@@ -1666,12 +1919,20 @@ size_t ScreenRecoveryUI::ShowMenu(std::unique_ptr<Menu>&& menu, bool menu_only,
       chosen_item = action;
     }
 
+    // The last key of a burst draws what the ones before it changed, even if it changes nothing.
+    if (!defer_menu_redraw_ && menu_redraw_deferred_) {
+      std::lock_guard<std::mutex> lg(updateMutex);
+      update_menu_locked();
+    }
+
     if (chosen_item == Device::kGoBack || chosen_item == Device::kGoHome ||
         chosen_item == Device::kDoSideload || chosen_item == Device::kRefresh) {
       break;
     }
   }
+  defer_menu_redraw_ = menu_redraw_deferred_ = false;
 
+  last_menu_selection_ = std::max(selected, 0);
   menu_.reset();
 
   return chosen_item;
@@ -1732,6 +1993,7 @@ void ScreenRecoveryUI::ShowText(bool visible) {
   show_text = visible;
   if (show_text) show_text_ever = true;
   update_screen_locked();
+  progress_cv_.notify_all();
 }
 
 void ScreenRecoveryUI::Redraw() {
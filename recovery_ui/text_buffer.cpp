@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "recovery_ui/text_buffer.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+TextBuffer::TextBuffer(size_t rows, size_t columns, int char_width)
+    : rows_(columns == 0 ? 0 : rows),
+      columns_(columns),
+      char_width_(char_width),
+      chars_(new char[rows_ * (columns_ + 1)]),
+      row_info_(rows_) {
+  Clear();
+}
+
+TextBuffer::Row TextBuffer::GetRow(size_t index) const {
+  size_t slot = (first_ + index) % rows_;
+  const RowInfo& info = row_info_[slot];
+  return Row{ chars_.get() + slot * (columns_ + 1), info.length, info.width, info.continued };
+}
+
+void TextBuffer::Append(std::string_view text) {
+  if (rows_ == 0) {
+    return;
+  }
+  for (char ch : text) {
+    if (ch == '\n') {
+      NewRow(false);
+    } else {
+      PutChar(ch);
+    }
+  }
+}
+
+void TextBuffer::AppendRow(std::string_view row, bool newline) {
+  if (rows_ == 0) {
+    return;
+  }
+  size_t slot = LastSlot();
+  size_t length = row_info_[slot].length;
+  size_t copied = std::min(row.size(), columns_ - length);
+  memcpy(RowText(slot) + length, row.data(), copied);
+  SetLength(slot, length + copied);
+  if (newline) {
+    NewRow(false);
+  }
+}
+
+void TextBuffer::Clear() {
+  first_ = 0;
+  count_ = 0;
+  if (rows_ > 0) {
+    NewRow(false);
+  }
+}
+
+void TextBuffer::PutChar(char ch) {
+  size_t slot = LastSlot();
+  if (row_info_[slot].length < columns_) {
+    RowText(slot)[row_info_[slot].length] = ch;
+    SetLength(slot, row_info_[slot].length + 1);
+    return;
+  }
+
+  // The row is full: move the word being cut (if it has a space before it) onto the next row.
+  std::string_view full(RowText(slot), columns_);
+  size_t space = ch == ' ' ? columns_ : full.rfind(' ');
+  std::string_view tail;
+  if (space != std::string_view::npos && space > 0 && space < columns_) {
+    tail = full.substr(space + 1);
+  }
+  NewRow(true);
+  size_t next = LastSlot();
+  // With a single row, the new row takes the place of the full one, and the word is cut instead.
+  if (next != slot && !tail.empty()) {
+    memcpy(RowText(next), tail.data(), tail.size());
+    SetLength(next, tail.size());
+    SetLength(slot, space);
+  }
+  if (ch != ' ') {
+    PutChar(ch);
+  }
+}
+
+void TextBuffer::NewRow(bool continued) {
+  if (count_ < rows_) {
+    count_++;
+  } else {
+    first_ = (first_ + 1) % rows_;
+  }
+  size_t slot = LastSlot();
+  row_info_[slot] = RowInfo{ 0, 0, continued };
+  RowText(slot)[0] = '\0';
+}
+
+void TextBuffer::SetLength(size_t slot, size_t length) {
+  char* text = RowText(slot);
+  text[length] = '\0';
+  // As gr_measure() does: the width of each UTF-8 code point, i.e. of each byte that doesn't
+  // continue one.
+  size_t code_points = std::count_if(text, text + length, [](char c) {
+    return (static_cast<unsigned char>(c) & 0xc0) != 0x80;
+  });
+  row_info_[slot].length = length;
+  row_info_[slot].width = static_cast<int>(code_points) * char_width_;
+}
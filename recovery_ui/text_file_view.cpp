@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "recovery_ui/text_file_view.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+
+std::unique_ptr<TextFileView> TextFileView::Open(const std::string& path, size_t columns) {
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+  struct stat sb;
+  if (fd == -1 || fstat(fd, &sb) == -1) {
+    return nullptr;
+  }
+
+  if (S_ISREG(sb.st_mode) && sb.st_size > 0) {
+    void* map = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      auto view = std::make_unique<TextFileView>(
+          std::string_view(static_cast<const char*>(map), sb.st_size), columns);
+      view->map_ = map;
+      return view;
+    }
+  }
+
+  // The files with no size of their own (e.g. in procfs or pstore) are read instead.
+  std::string contents;
+  if (!android::base::ReadFdToString(fd, &contents)) {
+    return nullptr;
+  }
+  auto view = std::make_unique<TextFileView>(std::string_view(), columns);
+  view->contents_ = std::move(contents);
+  view->data_ = view->contents_;
+  return view;
+}
+
+TextFileView::TextFileView(std::string_view data, size_t columns)
+    : data_(data), columns_(std::max<size_t>(columns, 1)) {}
+
+TextFileView::~TextFileView() {
+  if (map_ != nullptr) {
+    munmap(map_, data_.size());
+  }
+}
+
+bool TextFileView::IndexNext() {
+  size_t start = row_offsets_.back();
+  if (start >= data_.size()) {
+    indexed_ = true;
+    return false;
+  }
+  // A row ends at a newline, or once it fills the columns. A newline right after a full row ends
+  // that row, rather than making an empty one.
+  size_t length = std::min(columns_, data_.size() - start);
+  const void* newline = memchr(data_.data() + start, '\n', length);
+  size_t end;
+  if (newline != nullptr) {
+    end = static_cast<const char*>(newline) - data_.data() + 1;
+  } else {
+    end = start + length;
+    if (end < data_.size() && data_[end] == '\n') {
+      end++;
+    }
+  }
+  row_offsets_.push_back(end);
+  return true;
+}
+
+bool TextFileView::IndexTo(size_t index) {
+  while (row_offsets_.size() <= index + 1) {
+    if (indexed_ || !IndexNext()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t TextFileView::RowCount() {
+  while (!indexed_ && IndexNext()) {
+  }
+  return row_offsets_.size() - 1;
+}
+
+size_t TextFileView::RowOffset(size_t index) {
+  if (!IndexTo(index)) {
+    return data_.size();
+  }
+  return row_offsets_[index];
+}
+
+std::string_view TextFileView::Row(size_t index) {
+  if (!IndexTo(index)) {
+    return {};
+  }
+  size_t start = row_offsets_[index];
+  std::string_view row = data_.substr(start, row_offsets_[index + 1] - start);
+  if (!row.empty() && row.back() == '\n') {
+    row.remove_suffix(1);
+  }
+  return row;
+}
+
+size_t TextFileView::RowAt(size_t offset) {
+  while (row_offsets_.back() <= offset && !indexed_ && IndexNext()) {
+  }
+  auto it = std::upper_bound(row_offsets_.begin(), row_offsets_.end(), offset);
+  return it - row_offsets_.begin() - 1;
+}
+
+size_t TextFileView::FindRow(std::string_view query, size_t from_row) {
+  size_t from = RowOffset(from_row);
+  size_t found = data_.find(query, from);
+  if (found == std::string_view::npos) {
+    return npos;
+  }
+  return RowAt(found);
+}
@@ -39,6 +39,8 @@
 #include <volume_manager/VolumeManager.h>
 
 #include "minui/minui.h"
+#include "otautil/sched_policy.h"
+#include "otautil/startup_trace.h"
 #include "otautil/sysutil.h"
 
 using namespace std::chrono_literals;
@@ -97,11 +99,12 @@ RecoveryUI::RecoveryUI()
 }
 
 RecoveryUI::~RecoveryUI() {
-  ev_exit();
   input_thread_stopped_ = true;
+  ev_wake();
   if (input_thread_.joinable()) {
     input_thread_.join();
   }
+  ev_exit();
 }
 
 void RecoveryUI::OnTouchDeviceDetected(int fd) {
@@ -207,8 +210,12 @@ bool RecoveryUI::InitScreensaver() {
 }
 
 bool RecoveryUI::Init(const std::string& /* locale */) {
-  ev_init(std::bind(&RecoveryUI::OnInputEvent, this, std::placeholders::_1, std::placeholders::_2),
-          touch_screen_allowed_);
+  {
+    ScopedStartupTrace trace("ev_init");
+    ev_init(
+        std::bind(&RecoveryUI::OnInputEvent, this, std::placeholders::_1, std::placeholders::_2),
+        touch_screen_allowed_);
+  }
 
   ev_iterate_available_keys(std::bind(&RecoveryUI::OnKeyDetected, this, std::placeholders::_1));
 
@@ -235,10 +242,12 @@ bool RecoveryUI::Init(const std::string& /* locale */) {
     LOG(INFO) << "Screensaver disabled";
   }
 
-  // Create a separate thread that handles input events.
+  // Create a separate thread that handles input events, and the timers of the key presses. It
+  // sleeps until there's one of them, or until ev_wake() (to stop it).
   input_thread_ = std::thread([this]() {
+    SchedPolicy::Get().Apply(ThreadClass::kUi);
     while (!this->input_thread_stopped_) {
-      if (!ev_wait(500)) {
+      if (!ev_wait(-1)) {
         ev_dispatch();
       }
     }
@@ -311,12 +320,27 @@ void RecoveryUI::OnTouchRelease() {
   EnqueueTouch(touch_pos_);
 }
 
+// Reads the pending events of |fd| in a batch, so that a touch panel reporting at a high rate
+// wakes the input thread up once per batch rather than once per event. A swipe is tracked once
+// per batch too, from the last position in it.
 int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
-  struct input_event ev;
-  if (ev_get_input(fd, epevents, &ev) == -1) {
+  static constexpr size_t kMaxEvents = 64;
+  input_event events[kMaxEvents];
+  int count = ev_get_inputs(fd, epevents, events, kMaxEvents);
+  if (count == -1) {
     return -1;
   }
+  for (int i = 0; i < count; i++) {
+    ProcessInputEvent(fd, events[i]);
+  }
+  if (touch_track_pending_) {
+    touch_track_pending_ = false;
+    OnTouchTrack();
+  }
+  return 0;
+}
 
+void RecoveryUI::ProcessInputEvent(int fd, const input_event& ev) {
   // Touch inputs handling.
   //
   // Per the doc Multi-touch Protocol at below, there are two protocols.
@@ -338,17 +362,23 @@ int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
       // There might be multiple SYN_REPORT events. Only report press/release once.
       if (!touch_reported_ && touch_finger_down_) {
         if (touch_saw_x_ && touch_saw_y_) {
+          touch_track_pending_ = false;
           OnTouchPress();
           touch_reported_ = true;
           touch_saw_x_ = touch_saw_y_ = false;
         }
       } else if (touch_reported_ && !touch_finger_down_) {
+        // The release tells swipes from touches by what's been tracked.
+        if (touch_track_pending_) {
+          touch_track_pending_ = false;
+          OnTouchTrack();
+        }
         OnTouchRelease();
         touch_reported_ = false;
         touch_saw_x_ = touch_saw_y_ = false;
       }
     }
-    return 0;
+    return;
   }
 
   if (ev.type == EV_REL) {
@@ -378,7 +408,7 @@ int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
       touch_slot_ = ev.value;
     }
     // Ignore other fingers.
-    if (touch_slot_ > 0) return 0;
+    if (touch_slot_ > 0) return;
 
     switch (ev.code) {
       case ABS_MT_POSITION_X:
@@ -386,7 +416,7 @@ int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
         touch_saw_x_ = true;
         touch_pos_.x(ev.value * gr_fb_width_real() / (touch_max_.x() - touch_min_.x()));
         if (touch_reported_ && touch_saw_y_) {
-          OnTouchTrack();
+          touch_track_pending_ = true;
           touch_saw_x_ = touch_saw_y_ = false;
         }
         break;
@@ -396,7 +426,7 @@ int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
         touch_saw_y_ = true;
         touch_pos_.y(ev.value * gr_fb_height_real() / (touch_max_.y() - touch_min_.y()));
         if (touch_reported_ && touch_saw_x_) {
-          OnTouchTrack();
+          touch_track_pending_ = true;
           touch_saw_x_ = touch_saw_y_ = false;
         }
         break;
@@ -406,7 +436,7 @@ int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
         if (ev.value < 0) touch_finger_down_ = false;
         break;
     }
-    return 0;
+    return;
   }
 
   if (ev.type == EV_KEY && ev.code <= KEY_MAX) {
@@ -421,7 +451,7 @@ int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
       // additional scrolling (because in ScreenRecoveryUI::ShowFile(), we consider keys other than
       // KEY_POWER and KEY_UP as KEY_DOWN).
       if (ev.code == BTN_TOUCH || ev.code == BTN_TOOL_FINGER) {
-        return 0;
+        return;
       }
     }
 
@@ -432,8 +462,6 @@ int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
   if (ev.type == EV_SW) {
     SetSwCallback(ev.code, ev.value);
   }
-
-  return 0;
 }
 
 // Processes a key-up or -down event. A key is "registered" when it is pressed and then released,
@@ -444,7 +472,7 @@ int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
 // We also keep track of which keys are currently down so that CheckKey() can call IsKeyPressed()
 // to see what other keys are held when a key is registered.
 //
-// updown == 1 for key down events; 0 for key up events
+// updown == 1 for key down events; 0 for key up events; 2 for the autorepeats of a key held down
 void RecoveryUI::ProcessKey(int key_code, int updown) {
   bool register_key = false;
   bool long_press = false;
@@ -452,12 +480,18 @@ void RecoveryUI::ProcessKey(int key_code, int updown) {
   {
     std::lock_guard<std::mutex> lg(key_press_mutex);
     key_pressed[key_code] = updown;
+    if (updown == 2) {
+      // An autorepeat of a key that's held down, which is still the same press.
+      return;
+    }
+    // Either way, the last key down is no longer held without other keys in between.
+    ev_cancel_timer(long_press_timer_);
     if (updown) {
       ++key_down_count;
       key_last_down = key_code;
       key_long_press = false;
-      std::thread time_key_thread(&RecoveryUI::TimeKey, this, key_code, key_down_count);
-      time_key_thread.detach();
+      long_press_timer_ = ev_add_timer(
+          750ms, [this, key_code, count = key_down_count]() { TimeKey(key_code, count); });
     } else {
       if (key_last_down == key_code) {
         long_press = key_long_press;
@@ -491,8 +525,8 @@ void RecoveryUI::ProcessKey(int key_code, int updown) {
   }
 }
 
+// Runs 750 ms ("long") after the key press |count|, from the input thread.
 void RecoveryUI::TimeKey(int key_code, int count) {
-  std::this_thread::sleep_for(750ms);  // 750 ms == "long"
   bool long_press = false;
   {
     std::lock_guard<std::mutex> lg(key_press_mutex);
@@ -524,6 +558,7 @@ void RecoveryUI::EnqueueTouch(const Point& pos) {
 }
 
 void RecoveryUI::SetScreensaverState(ScreensaverState state) {
+  bool was_off = screensaver_state_ == ScreensaverState::OFF;
   switch (state) {
     case ScreensaverState::NORMAL:
       if (android::base::WriteStringToFile(std::to_string(brightness_normal_value_),
@@ -556,6 +591,9 @@ void RecoveryUI::SetScreensaverState(ScreensaverState state) {
     default:
       LOG(ERROR) << "Invalid screensaver state";
   }
+  if (was_off != (screensaver_state_ == ScreensaverState::OFF)) {
+    OnScreensaverChanged(!was_off);
+  }
 }
 
 RecoveryUI::InputEvent RecoveryUI::WaitInputEvent() {
@@ -663,6 +701,11 @@ void RecoveryUI::FlushKeys() {
   event_queue_len = 0;
 }
 
+bool RecoveryUI::HasQueuedInputEvents() {
+  std::lock_guard<std::mutex> lg(event_queue_mutex);
+  return event_queue_len > 0;
+}
+
 RecoveryUI::KeyAction RecoveryUI::CheckKey(int key, bool is_long_press) {
   {
     std::lock_guard<std::mutex> lg(key_press_mutex);
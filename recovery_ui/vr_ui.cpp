@@ -16,18 +16,24 @@
 
 #include "recovery_ui/vr_ui.h"
 
+#include <algorithm>
+
 #include <android-base/properties.h>
 
 #include "minui/minui.h"
 
 constexpr int kDefaultStereoOffset = 0;
 
+// Eye frames are 32-bit, like the frames of all the backends.
+constexpr size_t kEyePixelBytes = 4;
+
 VrRecoveryUI::VrRecoveryUI()
     : stereo_offset_(
           android::base::GetIntProperty("ro.recovery.ui.stereo_offset", kDefaultStereoOffset)) {}
 
 int VrRecoveryUI::ScreenWidth() const {
-  return gr_fb_width() / 2;
+  // The eye surface is the whole screen to the elements drawn into it.
+  return drawing_eye_ ? gr_fb_width() : gr_fb_width() / 2;
 }
 
 int VrRecoveryUI::ScreenHeight() const {
@@ -36,37 +42,107 @@ int VrRecoveryUI::ScreenHeight() const {
 
 void VrRecoveryUI::DrawSurface(const GRSurface* surface, int sx, int sy, int w, int h, int dx,
                                int dy) const {
-  gr_blit(surface, sx, sy, w, h, dx + stereo_offset_, dy);
-  gr_blit(surface, sx, sy, w, h, dx - stereo_offset_ + ScreenWidth(), dy);
+  ForEachEye([&](int offset) { gr_blit(surface, sx, sy, w, h, dx + offset, dy); });
 }
 
 void VrRecoveryUI::DrawTextIcon(int x, int y, const GRSurface* surface) const {
-  gr_texticon(x + stereo_offset_, y, surface);
-  gr_texticon(x - stereo_offset_ + ScreenWidth(), y, surface);
+  ForEachEye([&](int offset) { gr_texticon(x + offset, y, surface); });
 }
 
 int VrRecoveryUI::DrawTextLine(int x, int y, const std::string& line, bool bold) const {
-  gr_text(gr_sys_font(), x + stereo_offset_, y, line.c_str(), bold);
-  gr_text(gr_sys_font(), x - stereo_offset_ + ScreenWidth(), y, line.c_str(), bold);
+  ForEachEye([&](int offset) { gr_text(gr_sys_font(), x + offset, y, line.c_str(), bold); });
   return char_height_ + 4;
 }
 
 int VrRecoveryUI::DrawHorizontalRule(int y) const {
   y += 4;
-  gr_fill(margin_width_ + stereo_offset_, y, ScreenWidth() - margin_width_ + stereo_offset_, y + 2);
-  gr_fill(ScreenWidth() + margin_width_ - stereo_offset_, y,
-          gr_fb_width() - margin_width_ - stereo_offset_, y + 2);
+  ForEachEye([&](int offset) {
+    gr_fill(offset + margin_width_, y, offset + ScreenWidth() - margin_width_, y + 2);
+  });
   return y + 4;
 }
 
 void VrRecoveryUI::DrawHighlightBar(int /* x */, int y, int /* width */, int height) const {
-  gr_fill(margin_width_ + stereo_offset_, y, ScreenWidth() - margin_width_ + stereo_offset_,
-          y + height);
-  gr_fill(ScreenWidth() + margin_width_ - stereo_offset_, y,
-          gr_fb_width() - margin_width_ - stereo_offset_, y + height);
+  ForEachEye([&](int offset) {
+    gr_fill(offset + margin_width_, y, offset + ScreenWidth() - margin_width_, y + height);
+  });
 }
 
 void VrRecoveryUI::DrawFill(int x, int y, int w, int h) const {
-  gr_fill(x + stereo_offset_, y, w, h);
-  gr_fill(x - stereo_offset_ + ScreenWidth(), y, w, h);
+  ForEachEye([&](int offset) { gr_fill(x + offset, y, w, h); });
+}
+
+bool VrRecoveryUI::BeginEyeFrame() {
+  size_t width = ScreenWidth();
+  size_t height = ScreenHeight();
+  if (!eye_surface_ || eye_surface_->width != width || eye_surface_->height != height) {
+    eye_surface_ = GRSurface::Create(width, height, width * kEyePixelBytes, kEyePixelBytes);
+    eye_frame_drawn_ = false;
+  }
+  if (!eye_surface_ || !gr_set_draw_surface(eye_surface_.get())) {
+    eye_frame_drawn_ = false;
+    return false;
+  }
+  drawing_eye_ = true;
+  return true;
+}
+
+void VrRecoveryUI::EndEyeFrame() {
+  gr_set_draw_surface(nullptr);
+  drawing_eye_ = false;
+
+  // The eyes cover the screen exactly, unless they're apart (or overlap), or there's an overscan.
+  int width = eye_surface_->width;
+  if (stereo_offset_ != 0 || 2 * width != gr_fb_width() || gr_overscan_offset_x() != 0 ||
+      gr_overscan_offset_y() != 0) {
+    gr_color(0, 0, 0, 255);
+    gr_clear();
+  }
+  // gr_blit() copies whole rows with memcpy(), skipping the parts of an eye that are off the
+  // screen.
+  for (int dx : { stereo_offset_, width - stereo_offset_ }) {
+    int sx = std::max(0, -dx);
+    int w = std::min(width, gr_fb_width() - dx) - sx;
+    if (w > 0) {
+      gr_blit(eye_surface_.get(), sx, 0, w, eye_surface_->height, dx + sx, 0);
+    }
+  }
+}
+
+void VrRecoveryUI::update_screen_locked() {
+  if (headless_mode_ == HeadlessMode::SCREEN_OFF) {
+    return;
+  }
+  if (!BeginEyeFrame()) {
+    ScreenRecoveryUI::update_screen_locked();
+    return;
+  }
+  draw_screen_locked();
+  eye_frame_drawn_ = true;
+  EndEyeFrame();
+  gr_flip();
+}
+
+void VrRecoveryUI::update_progress_locked() {
+  if (headless_mode_ == HeadlessMode::SCREEN_OFF) {
+    return;
+  }
+  if (!BeginEyeFrame()) {
+    ScreenRecoveryUI::update_progress_locked();
+    return;
+  }
+  // The eye surface keeps the last frame, as a partial update would, so that only the animation
+  // frame and the progress bar need drawing again.
+  if (show_text || !eye_frame_drawn_) {
+    draw_screen_locked();
+    eye_frame_drawn_ = true;
+  } else {
+    draw_foreground_locked();
+  }
+  EndEyeFrame();
+  gr_flip();
+}
+
+bool VrRecoveryUI::update_menu_selection_locked() {
+  return false;
 }
@@ -80,6 +80,8 @@ static void InitWristOrientation() {
 
 bool WearRecoveryUI::Init(const std::string& locale) {
   auto result = ScreenRecoveryUI::Init(locale);
+  // Nothing shows outside the circle, so there's no point in drawing there.
+  gr_set_round_clip(is_screen_circle_);
   auto wrist_orientation_enabled =
       android::base::GetBoolProperty("config.enable_wristorientation", false);
   LOG(INFO) << "WearRecoveryUI::Init(): enable_wristorientation=" << wrist_orientation_enabled;
@@ -247,7 +249,16 @@ size_t WearRecoveryUI::GetProgressFrameIndex(float fraction) const {
 
 // TODO merge drawing routines with screen_ui
 void WearRecoveryUI::update_progress_locked() {
-  draw_screen_locked();
+  if (headless_mode_ == HeadlessMode::SCREEN_OFF) {
+    return;
+  }
+  // The progress frames are opaque, so a partial update only needs to draw them (and the
+  // animation frame) over the background already on the screen.
+  if (!show_text && is_screen_circle_ && gr_begin_partial_update()) {
+    draw_circle_foreground_locked();
+  } else {
+    draw_screen_locked();
+  }
   gr_flip();
 }
 
@@ -19,18 +19,32 @@
 #include <stdint.h>
 #include <unistd.h>
 
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
 #include <android-base/logging.h>
 #include <android/binder_manager.h>
 #include <health-shim/shim.h>
 #include <healthhalutils/HealthHalUtils.h>
 
-BatteryInfo GetBatteryInfo() {
+using aidl::android::hardware::health::IHealth;
+
+// Samples are taken every kSampleInterval, or every kLowBatterySampleInterval while discharging at
+// or below kLowBatteryCapacity.
+static constexpr auto kSampleInterval = std::chrono::seconds(60);
+static constexpr auto kLowBatterySampleInterval = std::chrono::seconds(10);
+static constexpr int32_t kLowBatteryCapacity = 30;
+
+static constexpr uint64_t kSampleChargingBit = 1ULL << 32;
+static constexpr uint64_t kSampleValidBit = 1ULL << 33;
+
+// Returns the health service, or nullptr if there's none.
+static std::shared_ptr<IHealth> GetHealthService() {
   using android::hardware::health::V2_0::get_health_service;
   using HidlHealth = android::hardware::health::V2_0::IHealth;
-  using aidl::android::hardware::health::BatteryStatus;
   using aidl::android::hardware::health::HealthShim;
-  using aidl::android::hardware::health::IHealth;
-  using aidl::android::hardware::health::toString;
   using std::string_literals::operator""s;
 
   auto service_name = IHealth::descriptor + "/default"s;
@@ -49,6 +63,14 @@ BatteryInfo GetBatteryInfo() {
   if (health == nullptr) {
     LOG(WARNING) << "No health implementation is found; assuming defaults";
   }
+  return health;
+}
+
+// Reads the battery status from |health|, which may be nullptr. The |initial| read of the process
+// waits for the battery profile to load, and logs the values read.
+static BatteryInfo ReadBatteryInfo(const std::shared_ptr<IHealth>& health, bool initial) {
+  using aidl::android::hardware::health::BatteryStatus;
+  using aidl::android::hardware::health::toString;
 
   int wait_second = 0;
   while (true) {
@@ -75,15 +97,17 @@ BatteryInfo GetBatteryInfo() {
       }
     }
 
-    LOG(INFO) << "charge_status " << toString(charge_status) << ", charging " << charging
-              << ", capacity " << capacity;
+    if (initial) {
+      LOG(INFO) << "charge_status " << toString(charge_status) << ", charging " << charging
+                << ", capacity " << capacity;
+    }
 
     constexpr int BATTERY_READ_TIMEOUT_IN_SEC = 10;
     // At startup, the battery drivers in devices like N5X/N6P take some time to load
     // the battery profile. Before the load finishes, it reports value 50 as a fake
     // capacity. BATTERY_READ_TIMEOUT_IN_SEC is set that the battery drivers are expected
     // to finish loading the battery profile earlier than 10 seconds after kernel startup.
-    if (capacity == 50) {
+    if (initial && capacity == 50) {
       if (wait_second < BATTERY_READ_TIMEOUT_IN_SEC) {
         LOG(INFO) << "Battery capacity == 50, waiting "
                   << (BATTERY_READ_TIMEOUT_IN_SEC - wait_second)
@@ -96,11 +120,77 @@ BatteryInfo GetBatteryInfo() {
     // If we can't read battery percentage, it may be a device without battery. In this
     // situation, use 100 as a fake battery percentage.
     if (capacity == INT32_MIN) {
-      LOG(WARNING) << "Using fake battery capacity 100.";
+      if (initial) {
+        LOG(WARNING) << "Using fake battery capacity 100.";
+      }
       capacity = 100;
     }
 
-    LOG(INFO) << "GetBatteryInfo() reporting charging " << charging << ", capacity " << capacity;
+    if (initial) {
+      LOG(INFO) << "GetBatteryInfo() reporting charging " << charging << ", capacity "
+                << capacity;
+    }
     return BatteryInfo{ charging, capacity };
   }
 }
+
+BatteryInfo GetBatteryInfo() {
+  return ReadBatteryInfo(GetHealthService(), true);
+}
+
+BatterySampler& BatterySampler::Get() {
+  static BatterySampler sampler;
+  return sampler;
+}
+
+void BatterySampler::Start() {
+  std::call_once(started_, [this]() { std::thread(&BatterySampler::SampleLoop, this).detach(); });
+}
+
+std::optional<BatteryInfo> BatterySampler::Latest() const {
+  uint64_t sample = sample_.load(std::memory_order_acquire);
+  if ((sample & kSampleValidBit) == 0) {
+    return std::nullopt;
+  }
+  return BatteryInfo{ (sample & kSampleChargingBit) != 0,
+                      static_cast<int32_t>(static_cast<uint32_t>(sample)) };
+}
+
+BatteryInfo BatterySampler::Wait() {
+  if (auto info = Latest(); info) {
+    return *info;
+  }
+  Start();
+  std::unique_lock<std::mutex> lock(first_sample_mutex_);
+  first_sample_cv_.wait(lock, [this]() { return Latest().has_value(); });
+  return *Latest();
+}
+
+void BatterySampler::Publish(const BatteryInfo& info) {
+  uint64_t sample = kSampleValidBit | static_cast<uint32_t>(info.capacity);
+  if (info.charging) {
+    sample |= kSampleChargingBit;
+  }
+  if (sample_.exchange(sample, std::memory_order_acq_rel) & kSampleValidBit) {
+    return;
+  }
+  // Wake up the readers waiting for the first sample.
+  std::lock_guard<std::mutex> lock(first_sample_mutex_);
+  first_sample_cv_.notify_all();
+}
+
+void BatterySampler::SampleLoop() {
+  auto health = GetHealthService();
+  BatteryInfo info = ReadBatteryInfo(health, true);
+  Publish(info);
+  while (true) {
+    bool low = !info.charging && info.capacity <= kLowBatteryCapacity;
+    std::this_thread::sleep_for(low ? kLowBatterySampleInterval : kSampleInterval);
+    BatteryInfo next = ReadBatteryInfo(health, false);
+    if (next.charging != info.charging || next.capacity != info.capacity) {
+      LOG(INFO) << "Battery now charging " << next.charging << ", capacity " << next.capacity;
+    }
+    info = next;
+    Publish(info);
+  }
+}
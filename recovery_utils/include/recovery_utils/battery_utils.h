@@ -18,6 +18,11 @@
 
 #include <stdint.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+
 struct BatteryInfo {
   // Whether the device is on charger. Note that the value will be `true` if the battery status is
   // unknown (BATTERY_STATUS_UNKNOWN).
@@ -31,3 +36,37 @@ struct BatteryInfo {
 
 // Returns the battery status for OTA installation purpose.
 BatteryInfo GetBatteryInfo();
+
+// Samples the battery status on a background thread, so that its readers never wait for the health
+// HAL (which may take seconds to answer, or to settle on a real capacity at startup). The latest
+// sample is published as a single atomic word.
+//
+// The first sample is taken as GetBatteryInfo() takes it. The next ones come every minute, or every
+// 10 seconds while discharging at a low capacity, when they matter the most.
+class BatterySampler {
+ public:
+  // Returns the sampler of the process.
+  static BatterySampler& Get();
+
+  // Starts sampling, unless it's started already. The sampling thread runs as long as the process.
+  void Start();
+
+  // Returns the latest sample, or std::nullopt if there's none yet. Never blocks.
+  std::optional<BatteryInfo> Latest() const;
+
+  // Returns the latest sample, starting the sampling and waiting for the first sample if needed.
+  BatteryInfo Wait();
+
+ private:
+  BatterySampler() = default;
+
+  void SampleLoop();
+  void Publish(const BatteryInfo& info);
+
+  // The latest sample: the capacity in the low 32 bits, then a bit each for whether the device is
+  // charging and whether there's a sample at all.
+  std::atomic<uint64_t> sample_{ 0 };
+  std::once_flag started_;
+  std::mutex first_sample_mutex_;
+  std::condition_variable first_sample_cv_;
+};
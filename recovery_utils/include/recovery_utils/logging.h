@@ -33,6 +33,15 @@ struct selabel_handle;
 struct saved_log_file {
   std::string name;
   struct stat sb;
+  // Where the contents are in the data of the saved_logs.
+  size_t offset;
+  size_t size;
+};
+
+// The log files in /cache/recovery, kept in memory while /cache is formatted. Their contents are
+// all in |data|, one after the other.
+struct saved_logs {
+  std::vector<saved_log_file> files;
   std::string data;
 };
 
@@ -53,13 +62,25 @@ void rotate_logs(const char* last_log_file, const char* last_kmsg_file);
 void check_and_fclose(FILE* fp, const std::string& name);
 
 void copy_log_file_to_pmsg(const std::string& source, const std::string& destination);
+
+// Copies the logs of the current session to pmsg and, if there's a /cache partition, to
+// /cache/recovery. Does nothing unless |save_current_log|. The copy runs in the background; the
+// log files are opened (and the old ones rotated) before this returns, and the copy is complete
+// once WaitForLogsCopied() returns. Must not be called from more than one thread.
 void copy_logs(bool save_current_log);
+// Waits for the copy started by the last copy_logs(), if any, to finish. Needed before /cache is
+// unmounted or formatted, and before rebooting.
+void WaitForLogsCopied();
 void reset_tmplog_offset();
 
 void save_kernel_log(const char* destination);
 
-std::vector<saved_log_file> ReadLogFilesToMemory();
+// Reads the log files in /cache/recovery to restore after a format, except for those that
+// copy_logs() writes again from the logs of the current session as the restore completes.
+saved_logs ReadLogFilesToMemory();
 
-bool RestoreLogFilesAfterFormat(const std::vector<saved_log_file>& log_files);
+// Writes back the log files saved by ReadLogFilesToMemory(), with a single sync of the file system
+// for all of them, then copies the logs of the current session.
+bool RestoreLogFilesAfterFormat(const saved_logs& logs);
 
 #endif  //_LOGGING_H
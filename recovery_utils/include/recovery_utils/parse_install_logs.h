@@ -24,6 +24,10 @@
 
 constexpr const char* LAST_INSTALL_FILE = "/data/misc/recovery/last_install";
 constexpr const char* LAST_INSTALL_FILE_IN_CACHE = "/cache/recovery/last_install";
+constexpr const char* LAST_INSTALL_METRICS_FILE = "/data/misc/recovery/last_install_metrics";
+constexpr const char* LAST_INSTALL_METRICS_FILE_IN_CACHE = "/cache/recovery/last_install_metrics";
+constexpr const char* LAST_UPDATE_TRACE_FILE = "/data/misc/recovery/last_update_trace";
+constexpr const char* LAST_UPDATE_TRACE_FILE_IN_CACHE = "/cache/recovery/last_update_trace";
 
 // Parses the metrics of update applied under recovery mode in |lines|, and returns a map with
 // "name: value".
@@ -31,3 +35,17 @@ std::map<std::string, int64_t> ParseRecoveryUpdateMetrics(const std::vector<std:
 // Parses the sideload history and update metrics in the last_install file. Returns a map with
 // entries as "metrics_name: value". If no such file exists, returns an empty map.
 std::map<std::string, int64_t> ParseLastInstall(const std::string& file_name);
+// Reads the install metrics (see otautil/install_metrics.h) in the given file, and returns the
+// same metrics as ParseLastInstall() does for the matching last_install. Unlike last_install, the
+// file is read as it goes, without holding it in memory. If no such file exists, returns an empty
+// map.
+std::map<std::string, int64_t> ParseLastInstallMetrics(const std::string& file_name);
+
+// Summarizes the per-command trace of block image updates in |lines| (in CSV, as written by the
+// updater when ro.updater.trace_commands is set). Returns a map with the number of commands, the
+// blocks and the time spent (in ms) in each stage for each command type, e.g.
+// "ota_trace_bsdiff_count: 10" and "ota_trace_bsdiff_patch_ms: 1500", along with the number of
+// the stashes loaded.
+std::map<std::string, int64_t> ParseUpdateTrace(const std::vector<std::string>& lines);
+// Summarizes the update trace in the given file. If no such file exists, returns an empty map.
+std::map<std::string, int64_t> ParseLastUpdateTrace(const std::string& file_name);
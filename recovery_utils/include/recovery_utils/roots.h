@@ -55,6 +55,12 @@ int format_volume(const std::string& volume);
 int format_volume(const std::string& volume, const std::string& directory,
                   std::string_view new_fstype);
 
+// Records that the whole of |blk_device| was just discarded or zeroed out, and whether it reads
+// back zeroes, so that the next format_volume() of it skips the work that's already done: the
+// discard, and with |reads_zeroes|, the zeroing of the journal. Mounting its volume, or formatting
+// it, forgets the record.
+void NoteBlockDeviceWiped(const std::string& blk_device, bool reads_zeroes);
+
 // Ensure that all and only the volumes that packages expect to find
 // mounted (/tmp and /cache) are mounted.  Returns 0 on success.
 int setup_install_mounts();
@@ -18,14 +18,19 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/klog.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <future>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <utility>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -42,8 +47,11 @@
 
 constexpr const char* LOG_FILE = "/cache/recovery/log";
 constexpr const char* LAST_INSTALL_FILE = "/cache/recovery/last_install";
+constexpr const char* LAST_INSTALL_METRICS_FILE = "/cache/recovery/last_install_metrics";
+constexpr const char* LAST_UPDATE_TRACE_FILE = "/cache/recovery/last_update_trace";
 constexpr const char* LAST_KMSG_FILE = "/cache/recovery/last_kmsg";
 constexpr const char* LAST_LOG_FILE = "/cache/recovery/last_log";
+constexpr const char* LAST_STARTUP_TRACE_FILE = "/cache/recovery/last_startup_trace";
 
 constexpr const char* LAST_KMSG_FILTER = "recovery/last_kmsg";
 constexpr const char* LAST_LOG_FILTER = "recovery/last_log";
@@ -56,20 +64,20 @@ void SetLoggingSehandle(selabel_handle* handle) {
   logging_sehandle = handle;
 }
 
-// fopen(3)'s the given file, by mounting volumes and making parent dirs as necessary. Returns the
-// file pointer, or nullptr on error.
-static FILE* fopen_path(const std::string& path, const char* mode, const selabel_handle* sehandle) {
+// open(2)'s the given file for writing, by mounting volumes and making parent dirs as necessary.
+// Returns the fd, or -1 on error.
+static android::base::unique_fd open_path_for_write(const std::string& path, bool append,
+                                                    const selabel_handle* sehandle) {
   if (ensure_path_mounted(path) != 0) {
     LOG(ERROR) << "Can't mount " << path;
-    return nullptr;
+    return {};
   }
 
-  // When writing, try to create the containing directory, if necessary. Use generous permissions,
-  // the system (init.rc) will reset them.
-  if (strchr("wa", mode[0])) {
-    mkdir_recursively(path, 0777, true, sehandle);
-  }
-  return fopen(path.c_str(), mode);
+  // Try to create the containing directory, if necessary. Use generous permissions, the system
+  // (init.rc) will reset them.
+  mkdir_recursively(path, 0777, true, sehandle);
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+  return android::base::unique_fd(TEMP_FAILURE_RETRY(open(path.c_str(), flags, 0666)));
 }
 
 void check_and_fclose(FILE* fp, const std::string& name) {
@@ -133,13 +141,14 @@ ssize_t logrotate(log_id_t id, char prio, const char* filename, const char* buf,
 // Rename last_log -> last_log.1 -> last_log.2 -> ... -> last_log.$max.
 // Similarly rename last_kmsg -> last_kmsg.1 -> ... -> last_kmsg.$max.
 // Overwrite any existing last_log.$max and last_kmsg.$max.
+// Logs should only be rotated once.
+static bool logs_rotated = false;
+
 void rotate_logs(const char* last_log_file, const char* last_kmsg_file) {
-  // Logs should only be rotated once.
-  static bool rotated = false;
-  if (rotated) {
+  if (logs_rotated) {
     return;
   }
-  rotated = true;
+  logs_rotated = true;
 
   for (int i = KEEP_LOG_COUNT - 1; i >= 0; --i) {
     std::string old_log = android::base::StringPrintf("%s", last_log_file);
@@ -171,38 +180,122 @@ void copy_log_file_to_pmsg(const std::string& source, const std::string& destina
   __pmsg_write(destination, content);
 }
 
-// How much of the temp log we have copied to the copy in cache.
+// How much of the temp log we have copied to the copy in cache. Only the log writer (see
+// copy_logs()) touches it while a copy is pending.
 static off_t tmplog_offset = 0;
 
+// The copy of the logs started by the last copy_logs(), if it's still pending.
+static std::future<void> pending_log_copy;
+
 void reset_tmplog_offset() {
+  WaitForLogsCopied();
   tmplog_offset = 0;
 }
 
-static void copy_log_file(const std::string& source, const std::string& destination, bool append) {
-  FILE* dest_fp = fopen_path(destination, append ? "ae" : "we", logging_sehandle);
-  if (dest_fp == nullptr) {
-    PLOG(ERROR) << "Can't open " << destination;
-  } else {
-    FILE* source_fp = fopen(source.c_str(), "re");
-    if (source_fp != nullptr) {
-      if (append) {
-        fseeko(source_fp, tmplog_offset, SEEK_SET);  // Since last write
-      }
-      char buf[4096];
-      size_t bytes;
-      while ((bytes = fread(buf, 1, sizeof(buf), source_fp)) != 0) {
-        fwrite(buf, 1, bytes, dest_fp);
+namespace {
+
+// A log file in /cache to copy a source into, opened by copy_logs() and written by the log writer.
+struct LogDestination {
+  std::string path;
+  android::base::unique_fd fd;
+  // Whether to append what was added to the source since the last copy, rather than all of it.
+  bool append;
+  mode_t mode;
+  bool system_owned;
+};
+
+// A log of the current session, to copy into pmsg and its destinations with a single read.
+struct LogSource {
+  std::string path;
+  std::string pmsg_name;
+  std::vector<LogDestination> destinations;
+};
+
+}  // namespace
+
+// Sets the permissions of |destination| and fsync(2)'s it. Closes its fd.
+static void FinishLogDestination(LogDestination* destination) {
+  if (fchmod(destination->fd, destination->mode) == -1 ||
+      (destination->system_owned && fchown(destination->fd, AID_SYSTEM, AID_SYSTEM) == -1)) {
+    PLOG(WARNING) << "Failed to set the permissions of " << destination->path;
+  }
+  if (fsync(destination->fd) == -1) {
+    PLOG(ERROR) << "Failed to fsync " << destination->path;
+  }
+  destination->fd.reset();
+}
+
+// Reads the kernel log into |buffer|.
+static bool ReadKernelLog(std::string* buffer) {
+  int klog_buf_len = klogctl(KLOG_SIZE_BUFFER, 0, 0);
+  if (klog_buf_len <= 0) {
+    PLOG(ERROR) << "Error getting klog size";
+    return false;
+  }
+
+  buffer->assign(klog_buf_len, 0);
+  int n = klogctl(KLOG_READ_ALL, buffer->data(), klog_buf_len);
+  if (n == -1) {
+    PLOG(ERROR) << "Error in reading klog";
+    return false;
+  }
+  buffer->resize(n);
+  return true;
+}
+
+// The log writer: copies each source to pmsg and to its destinations, then the kernel log to its
+// destinations, and fsync(2)'s the files it wrote and |log_dir|.
+static void WriteLogs(std::vector<LogSource> sources, std::vector<LogDestination> kmsg,
+                      android::base::unique_fd log_dir) {
+  for (auto& source : sources) {
+    // A missing source (e.g. no install this session) still truncates its destinations.
+    std::string content;
+    android::base::ReadFileToString(source.path, &content);
+    // Always write to pmsg, this allows the OTA logs to be caught in `logcat -L`.
+    __pmsg_write(source.pmsg_name, content);
+
+    for (auto& destination : source.destinations) {
+      std::string_view data = content;
+      if (destination.append) {
+        data.remove_prefix(std::min<size_t>(tmplog_offset, data.size()));
+        tmplog_offset = content.size();
       }
-      if (append) {
-        tmplog_offset = ftello(source_fp);
+      if (!android::base::WriteFully(destination.fd, data.data(), data.size())) {
+        PLOG(ERROR) << "Failed to write " << destination.path;
       }
-      check_and_fclose(source_fp, source);
+      FinishLogDestination(&destination);
     }
-    check_and_fclose(dest_fp, destination);
   }
+
+  std::string buffer;
+  for (auto& destination : kmsg) {
+    if (ReadKernelLog(&buffer) && !android::base::WriteStringToFd(buffer, destination.fd)) {
+      PLOG(ERROR) << "Failed to write " << destination.path;
+    }
+    FinishLogDestination(&destination);
+  }
+
+  // The rotated and newly created logs are only durable once their directory is.
+  if (log_dir != -1 && fsync(log_dir) == -1) {
+    PLOG(ERROR) << "Failed to fsync " << CACHE_LOG_DIR;
+  }
+}
+
+// Opens |path| to copy a log into, and adds it to |destinations|.
+static void AddLogDestination(std::vector<LogDestination>* destinations, const std::string& path,
+                              bool append, mode_t mode, bool system_owned) {
+  android::base::unique_fd fd = open_path_for_write(path, append, logging_sehandle);
+  if (fd == -1) {
+    PLOG(ERROR) << "Can't open " << path;
+    return;
+  }
+  destinations->push_back(LogDestination{ path, std::move(fd), append, mode, system_owned });
 }
 
 void copy_logs(bool save_current_log) {
+  // Copies are done in order, so that the log in cache gets each part of the temp log once.
+  WaitForLogsCopied();
+
   // We only rotate and record the log of the current session if explicitly requested. This usually
   // happens after wipes, installation from BCB or menu selections. This is to avoid unnecessary
   // rotation (and possible deletion) of log files, if it does not do anything loggable.
@@ -210,53 +303,82 @@ void copy_logs(bool save_current_log) {
     return;
   }
 
-  // Always write to pmsg, this allows the OTA logs to be caught in `logcat -L`.
-  copy_log_file_to_pmsg(Paths::Get().temporary_log_file(), LAST_LOG_FILE);
-  copy_log_file_to_pmsg(Paths::Get().temporary_install_file(), LAST_INSTALL_FILE);
+  std::vector<LogSource> sources;
+  sources.push_back({ Paths::Get().temporary_log_file(), LAST_LOG_FILE, {} });
+  sources.push_back({ Paths::Get().temporary_install_file(), LAST_INSTALL_FILE, {} });
+  const std::string& install_metrics_file = Paths::Get().temporary_install_metrics_file();
+  if (access(install_metrics_file.c_str(), F_OK) == 0) {
+    sources.push_back({ install_metrics_file, LAST_INSTALL_METRICS_FILE, {} });
+  }
+  // The update trace only exists if the updater has been asked to record it.
+  const std::string& update_trace_file = Paths::Get().temporary_update_trace_file();
+  if (access(update_trace_file.c_str(), F_OK) == 0) {
+    sources.push_back({ update_trace_file, LAST_UPDATE_TRACE_FILE, {} });
+  }
+  const std::string& startup_trace_file = Paths::Get().temporary_startup_trace_file();
+  if (access(startup_trace_file.c_str(), F_OK) == 0) {
+    sources.push_back({ startup_trace_file, LAST_STARTUP_TRACE_FILE, {} });
+  }
 
-  // We can do nothing for now if there's no /cache partition.
-  if (!HasCache()) {
-    return;
+  // We can do nothing but write to pmsg if there's no /cache partition. Otherwise, the files to
+  // copy to are rotated and opened here, so that only the log writer does any file I/O, and
+  // nothing else touches the mounts from its thread.
+  std::vector<LogDestination> kmsg;
+  android::base::unique_fd log_dir;
+  if (HasCache()) {
+    ensure_path_mounted(LAST_LOG_FILE);
+    ensure_path_mounted(LAST_KMSG_FILE);
+    rotate_logs(LAST_LOG_FILE, LAST_KMSG_FILE);
+
+    // Copy logs to cache so the system can find out what happened.
+    AddLogDestination(&sources[0].destinations, LOG_FILE, true, 0600, true);
+    AddLogDestination(&sources[0].destinations, LAST_LOG_FILE, false, 0640, false);
+    AddLogDestination(&sources[1].destinations, LAST_INSTALL_FILE, false, 0644, true);
+    // The metrics and the traces are copied to the files that their pmsg entries are named after.
+    for (size_t i = 2; i < sources.size(); i++) {
+      AddLogDestination(&sources[i].destinations, sources[i].pmsg_name, false, 0644, true);
+    }
+    AddLogDestination(&kmsg, LAST_KMSG_FILE, false, 0600, true);
+    log_dir.reset(TEMP_FAILURE_RETRY(open(CACHE_LOG_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
   }
 
-  ensure_path_mounted(LAST_LOG_FILE);
-  ensure_path_mounted(LAST_KMSG_FILE);
-  rotate_logs(LAST_LOG_FILE, LAST_KMSG_FILE);
-
-  // Copy logs to cache so the system can find out what happened.
-  copy_log_file(Paths::Get().temporary_log_file(), LOG_FILE, true);
-  copy_log_file(Paths::Get().temporary_log_file(), LAST_LOG_FILE, false);
-  copy_log_file(Paths::Get().temporary_install_file(), LAST_INSTALL_FILE, false);
-  save_kernel_log(LAST_KMSG_FILE);
-  chmod(LOG_FILE, 0600);
-  chown(LOG_FILE, AID_SYSTEM, AID_SYSTEM);
-  chmod(LAST_KMSG_FILE, 0600);
-  chown(LAST_KMSG_FILE, AID_SYSTEM, AID_SYSTEM);
-  chmod(LAST_LOG_FILE, 0640);
-  chmod(LAST_INSTALL_FILE, 0644);
-  chown(LAST_INSTALL_FILE, AID_SYSTEM, AID_SYSTEM);
-  sync();
+  pending_log_copy = std::async(std::launch::async, WriteLogs, std::move(sources), std::move(kmsg),
+                                std::move(log_dir));
+}
+
+void WaitForLogsCopied() {
+  if (pending_log_copy.valid()) {
+    pending_log_copy.get();
+  }
 }
 
 // Read from kernel log into buffer and write out to file.
 void save_kernel_log(const char* destination) {
-  int klog_buf_len = klogctl(KLOG_SIZE_BUFFER, 0, 0);
-  if (klog_buf_len <= 0) {
-    PLOG(ERROR) << "Error getting klog size";
-    return;
+  std::string buffer;
+  if (ReadKernelLog(&buffer)) {
+    android::base::WriteStringToFile(buffer, destination);
   }
+}
 
-  std::string buffer(klog_buf_len, 0);
-  int n = klogctl(KLOG_READ_ALL, &buffer[0], klog_buf_len);
-  if (n == -1) {
-    PLOG(ERROR) << "Error in reading klog";
-    return;
+// Returns whether the copy_logs() that follows a restore writes |path| again, from a log of the
+// current session, so that there's no need to save it: the last_* log and kernel log once they
+// aren't to be rotated anymore, the last install log, and the install metrics and the update
+// trace if there are some.
+static bool IsRewrittenByCopyLogs(const std::string& path) {
+  if (path == LAST_LOG_FILE || path == LAST_KMSG_FILE) {
+    return logs_rotated;
+  }
+  if (path == LAST_UPDATE_TRACE_FILE) {
+    return access(Paths::Get().temporary_update_trace_file().c_str(), F_OK) == 0;
+  }
+  if (path == LAST_INSTALL_METRICS_FILE) {
+    return access(Paths::Get().temporary_install_metrics_file().c_str(), F_OK) == 0;
   }
-  buffer.resize(n);
-  android::base::WriteStringToFile(buffer, destination);
+  return path == LAST_INSTALL_FILE;
 }
 
-std::vector<saved_log_file> ReadLogFilesToMemory() {
+saved_logs ReadLogFilesToMemory() {
+  WaitForLogsCopied();
   ensure_path_mounted("/cache");
 
   struct dirent* de;
@@ -268,10 +390,15 @@ std::vector<saved_log_file> ReadLogFilesToMemory() {
     return {};
   }
 
-  std::vector<saved_log_file> log_files;
+  // Find the files and their sizes first, to read them all into a single buffer.
+  saved_logs logs;
+  size_t total_size = 0;
   while ((de = readdir(d.get())) != nullptr) {
     if (strncmp(de->d_name, "last_", 5) == 0 || strcmp(de->d_name, "log") == 0) {
       std::string path = android::base::StringPrintf("%s/%s", CACHE_LOG_DIR, de->d_name);
+      if (IsRewrittenByCopyLogs(path)) {
+        continue;
+      }
 
       struct stat sb;
       if (stat(path.c_str(), &sb) != 0) {
@@ -280,22 +407,29 @@ std::vector<saved_log_file> ReadLogFilesToMemory() {
       }
       // Truncate files to 512kb
       size_t read_size = std::min<size_t>(sb.st_size, 1 << 19);
-      std::string data(read_size, '\0');
-
-      android::base::unique_fd log_fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY)));
-      if (log_fd == -1 || !android::base::ReadFully(log_fd, data.data(), read_size)) {
-        PLOG(ERROR) << "Failed to read log file " << path;
-        continue;
-      }
-
-      log_files.emplace_back(saved_log_file{ path, sb, data });
+      logs.files.push_back(saved_log_file{ path, sb, total_size, read_size });
+      total_size += read_size;
     }
   }
 
-  return log_files;
+  logs.data.resize(total_size);
+  size_t saved_size = 0;
+  for (auto& log : logs.files) {
+    android::base::unique_fd log_fd(TEMP_FAILURE_RETRY(open(log.name.c_str(), O_RDONLY)));
+    if (log_fd == -1 ||
+        !android::base::ReadFully(log_fd, logs.data.data() + saved_size, log.size)) {
+      PLOG(ERROR) << "Failed to read log file " << log.name;
+      log.size = 0;
+    }
+    // Close the gap left by a file that failed to read.
+    log.offset = saved_size;
+    saved_size += log.size;
+  }
+  logs.data.resize(saved_size);
+  return logs;
 }
 
-bool RestoreLogFilesAfterFormat(const std::vector<saved_log_file>& log_files) {
+bool RestoreLogFilesAfterFormat(const saved_logs& logs) {
   // Re-create the log dir and write back the log entries.
   if (ensure_path_mounted(CACHE_LOG_DIR) != 0) {
     PLOG(ERROR) << "Failed to mount " << CACHE_LOG_DIR;
@@ -307,13 +441,26 @@ bool RestoreLogFilesAfterFormat(const std::vector<saved_log_file>& log_files) {
     return false;
   }
 
-  for (const auto& log : log_files) {
-    if (!android::base::WriteStringToFile(log.data, log.name, log.sb.st_mode, log.sb.st_uid,
-                                          log.sb.st_gid)) {
+  for (const auto& log : logs.files) {
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(
+        open(log.name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW,
+             log.sb.st_mode & 07777)));
+    if (fd == -1 || fchmod(fd, log.sb.st_mode & 07777) == -1 ||
+        fchown(fd, log.sb.st_uid, log.sb.st_gid) == -1 ||
+        !android::base::WriteFully(fd, logs.data.data() + log.offset, log.size)) {
       PLOG(ERROR) << "Failed to write to " << log.name;
     }
   }
 
+  // One sync makes all the files and the directory durable, rather than an fsync(2) each.
+  if (!logs.files.empty()) {
+    android::base::unique_fd log_dir(
+        TEMP_FAILURE_RETRY(open(CACHE_LOG_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+    if (log_dir == -1 || syncfs(log_dir) == -1) {
+      PLOG(ERROR) << "Failed to sync " << CACHE_LOG_DIR;
+    }
+  }
+
   // Any part of the log we'd copied to cache is now gone.
   // Reset the pointer so we copy from the beginning of the temp
   // log.
@@ -18,6 +18,7 @@
 
 #include <unistd.h>
 
+#include <iterator>
 #include <optional>
 
 #include <android-base/file.h>
@@ -26,6 +27,8 @@
 #include <android-base/properties.h>
 #include <android-base/strings.h>
 
+#include "otautil/install_metrics.h"
+
 constexpr const char* OTA_SIDELOAD_METRICS = "ota_sideload";
 
 // Here is an example of lines in last_install:
@@ -33,11 +36,86 @@ constexpr const char* OTA_SIDELOAD_METRICS = "ota_sideload";
 // time_total: 101
 // bytes_written_vendor: 51074
 // bytes_stashed_vendor: 200
+// phase_verify: 150 4200 3900 1048576 0
+//
+// A phase line (see InstallProfiler) holds the start, the duration and the CPU time (in ms), then
+// the KiBs read and written, of that phase of the install.
+
+// Turns the entries of last_install, or of the install metrics, into the metrics to report.
+class UpdateMetricsBuilder {
+ public:
+  // Adds the entry |name| (e.g. "time_total", or "phase_verify_ms" for the duration of a phase).
+  void Add(const std::string& name, int64_t value) {
+    constexpr unsigned int kMiB = 1024 * 1024;
+    if (android::base::StartsWith(name, "phase_")) {
+      // A phase that ran more than once (e.g. a stage) is summed up.
+      metrics_["ota_" + name] += value;
+    } else if (android::base::StartsWith(name, "bytes_written")) {
+      bytes_written_in_mib_ = bytes_written_in_mib_.value_or(0) + value / kMiB;
+    } else if (android::base::StartsWith(name, "bytes_stashed")) {
+      bytes_stashed_in_mib_ = bytes_stashed_in_mib_.value_or(0) + value / kMiB;
+    } else if (android::base::StartsWith(name, "time")) {
+      metrics_.emplace("ota_time_total", value);
+    } else if (android::base::StartsWith(name, "uncrypt_time")) {
+      metrics_.emplace("ota_uncrypt_time", value);
+    } else if (android::base::StartsWith(name, "source_build")) {
+      metrics_.emplace("ota_source_version", value);
+    } else if (android::base::StartsWith(name, "temperature_start")) {
+      metrics_.emplace("ota_temperature_start", value);
+    } else if (android::base::StartsWith(name, "temperature_end")) {
+      metrics_.emplace("ota_temperature_end", value);
+    } else if (android::base::StartsWith(name, "temperature_max")) {
+      metrics_.emplace("ota_temperature_max", value);
+    } else if (android::base::StartsWith(name, "error")) {
+      metrics_.emplace("ota_non_ab_error_code", value);
+    } else if (android::base::StartsWith(name, "cause")) {
+      metrics_.emplace("ota_non_ab_cause_code", value);
+    }
+  }
+
+  std::map<std::string, int64_t> Build() {
+    std::map<std::string, int64_t> metrics = metrics_;
+    if (bytes_written_in_mib_) {
+      metrics.emplace("ota_written_in_MiBs", bytes_written_in_mib_.value());
+    }
+    if (bytes_stashed_in_mib_) {
+      metrics.emplace("ota_stashed_in_MiBs", bytes_stashed_in_mib_.value());
+    }
+    return metrics;
+  }
+
+ private:
+  std::optional<int64_t> bytes_written_in_mib_;
+  std::optional<int64_t> bytes_stashed_in_mib_;
+  std::map<std::string, int64_t> metrics_;
+};
+
+// Adds the phase |name| (e.g. "phase_verify") to |builder|, as "phase_verify_ms",
+// "phase_verify_cpu_ms", "phase_verify_read_KiBs" and "phase_verify_written_KiBs".
+static void ParsePhase(const std::string& name, const std::string& values,
+                       UpdateMetricsBuilder* builder) {
+  static constexpr const char* kSuffixes[] = { "_ms", "_cpu_ms", "_read_KiBs", "_written_KiBs" };
+  std::vector<std::string> fields = android::base::Split(values, " ");
+  std::vector<int64_t> parsed;
+  for (const auto& field : fields) {
+    int64_t value;
+    if (!android::base::ParseInt(field, &value, static_cast<int64_t>(0))) {
+      break;
+    }
+    parsed.push_back(value);
+  }
+  if (parsed.size() != std::size(kSuffixes) + 1) {
+    LOG(ERROR) << "Failed to parse phase " << name << ": " << values;
+    return;
+  }
+  // The start of the phase is only for reading the timeline; it makes no metric.
+  for (size_t i = 0; i < std::size(kSuffixes); i++) {
+    builder->Add(name + kSuffixes[i], parsed[i + 1]);
+  }
+}
+
 std::map<std::string, int64_t> ParseRecoveryUpdateMetrics(const std::vector<std::string>& lines) {
-  constexpr unsigned int kMiB = 1024 * 1024;
-  std::optional<int64_t> bytes_written_in_mib;
-  std::optional<int64_t> bytes_stashed_in_mib;
-  std::map<std::string, int64_t> metrics;
+  UpdateMetricsBuilder builder;
   for (const auto& line : lines) {
     size_t num_index = line.find(':');
     if (num_index == std::string::npos) {
@@ -46,43 +124,19 @@ std::map<std::string, int64_t> ParseRecoveryUpdateMetrics(const std::vector<std:
     }
 
     std::string num_string = android::base::Trim(line.substr(num_index + 1));
+    if (android::base::StartsWith(line, "phase_")) {
+      ParsePhase(line.substr(0, num_index), num_string, &builder);
+      continue;
+    }
+
     int64_t parsed_num;
     if (!android::base::ParseInt(num_string, &parsed_num)) {
       LOG(ERROR) << "Failed to parse numbers in " << line;
       continue;
     }
-
-    if (android::base::StartsWith(line, "bytes_written")) {
-      bytes_written_in_mib = bytes_written_in_mib.value_or(0) + parsed_num / kMiB;
-    } else if (android::base::StartsWith(line, "bytes_stashed")) {
-      bytes_stashed_in_mib = bytes_stashed_in_mib.value_or(0) + parsed_num / kMiB;
-    } else if (android::base::StartsWith(line, "time")) {
-      metrics.emplace("ota_time_total", parsed_num);
-    } else if (android::base::StartsWith(line, "uncrypt_time")) {
-      metrics.emplace("ota_uncrypt_time", parsed_num);
-    } else if (android::base::StartsWith(line, "source_build")) {
-      metrics.emplace("ota_source_version", parsed_num);
-    } else if (android::base::StartsWith(line, "temperature_start")) {
-      metrics.emplace("ota_temperature_start", parsed_num);
-    } else if (android::base::StartsWith(line, "temperature_end")) {
-      metrics.emplace("ota_temperature_end", parsed_num);
-    } else if (android::base::StartsWith(line, "temperature_max")) {
-      metrics.emplace("ota_temperature_max", parsed_num);
-    } else if (android::base::StartsWith(line, "error")) {
-      metrics.emplace("ota_non_ab_error_code", parsed_num);
-    } else if (android::base::StartsWith(line, "cause")) {
-      metrics.emplace("ota_non_ab_cause_code", parsed_num);
-    }
+    builder.Add(line.substr(0, num_index), parsed_num);
   }
-
-  if (bytes_written_in_mib) {
-    metrics.emplace("ota_written_in_MiBs", bytes_written_in_mib.value());
-  }
-  if (bytes_stashed_in_mib) {
-    metrics.emplace("ota_stashed_in_MiBs", bytes_stashed_in_mib.value());
-  }
-
-  return metrics;
+  return builder.Build();
 }
 
 std::map<std::string, int64_t> ParseLastInstall(const std::string& file_name) {
@@ -112,3 +166,93 @@ std::map<std::string, int64_t> ParseLastInstall(const std::string& file_name) {
 
   return metrics;
 }
+
+std::map<std::string, int64_t> ParseLastInstallMetrics(const std::string& file_name) {
+  if (access(file_name.c_str(), F_OK) != 0) {
+    return {};
+  }
+
+  UpdateMetricsBuilder builder;
+  bool sideload = false;
+  // Whatever could be read of a malformed file is still reported.
+  ReadInstallMetrics(file_name, [&builder, &sideload](const std::string& name, int64_t value) {
+    if (name == "sideload") {
+      sideload = value != 0;
+    } else {
+      builder.Add(name, value);
+    }
+    return true;
+  });
+
+  auto metrics = builder.Build();
+  if (sideload) {
+    int type = (android::base::GetProperty("ro.build.type", "") == "user") ? 1 : 0;
+    metrics.emplace(OTA_SIDELOAD_METRICS, type);
+  }
+  return metrics;
+}
+
+// Here is an example of lines in last_update_trace:
+// partition,index,command,blocks,read_us,patch_us,write_us,fsync_us,stash_loads,stash_memory_hits
+// system,0,bsdiff,10,2301,15010,820,4077,1,1
+// system,1,new,512,43211,0,6928,5120,0,0
+// Newer traces have more columns (the I/O counts of the commands), which don't go in the metrics.
+std::map<std::string, int64_t> ParseUpdateTrace(const std::vector<std::string>& lines) {
+  constexpr size_t kFields = 10;
+  static constexpr const char* kStageNames[] = { "read", "patch", "write", "fsync" };
+  std::map<std::string, int64_t> metrics;
+  for (const auto& line : lines) {
+    if (line.empty() || android::base::StartsWith(line, "partition,")) {
+      continue;
+    }
+    std::vector<std::string> fields = android::base::Split(line, ",");
+    if (fields.size() < kFields || fields[2].empty()) {
+      LOG(WARNING) << "Skip parsing " << line;
+      continue;
+    }
+
+    std::vector<int64_t> values;
+    for (size_t i = 3; i < kFields; i++) {
+      int64_t value;
+      if (!android::base::ParseInt(fields[i], &value, static_cast<int64_t>(0))) {
+        break;
+      }
+      values.push_back(value);
+    }
+    if (values.size() != kFields - 3) {
+      LOG(ERROR) << "Failed to parse numbers in " << line;
+      continue;
+    }
+
+    std::string prefix = "ota_trace_" + fields[2];
+    metrics[prefix + "_count"]++;
+    metrics[prefix + "_blocks"] += values[0];
+    for (size_t i = 0; i < std::size(kStageNames); i++) {
+      // Keep the time in us until all the lines are summed up.
+      metrics[prefix + "_" + kStageNames[i] + "_ms"] += values[i + 1];
+    }
+    metrics["ota_trace_stash_loads"] += values[5];
+    metrics["ota_trace_stash_memory_hits"] += values[6];
+  }
+
+  for (auto& [name, value] : metrics) {
+    if (android::base::EndsWith(name, "_ms")) {
+      value /= 1000;
+    }
+  }
+  return metrics;
+}
+
+std::map<std::string, int64_t> ParseLastUpdateTrace(const std::string& file_name) {
+  if (access(file_name.c_str(), F_OK) != 0) {
+    return {};
+  }
+
+  std::string content;
+  if (!android::base::ReadFileToString(file_name, &content)) {
+    PLOG(ERROR) << "Failed to read " << file_name;
+    return {};
+  }
+
+  return ParseUpdateTrace(android::base::Split(content, "\n"));
+}
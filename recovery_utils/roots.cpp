@@ -27,12 +27,17 @@
 #include <sys/mount.h>
 
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <blkid/blkid.h>
 #include <ext4_utils/ext4_utils.h>
@@ -41,6 +46,8 @@
 #include <fs_mgr/roots.h>
 #include <fs_mgr_dm_linear.h>
 
+#include "otautil/mount_table.h"
+#include "otautil/startup_trace.h"
 #include "otautil/sysutil.h"
 
 using android::fs_mgr::Fstab;
@@ -61,6 +68,16 @@ static void write_fstab_entry(const FstabEntry& entry, FILE* file) {
 
 static Fstab fstab;
 
+// The volumes of |fstab| by mount point (the first entry of each, as GetEntryForMountPoint() finds
+// them), to look up the volume of a path without scanning the whole table for each of its parent
+// directories. Built once the table is loaded, as it's not modified after that.
+static std::unordered_map<std::string, FstabEntry*> volumes_by_mount_point;
+
+// What's mounted, as of the last mount or unmount seen. Volumes may be mounted and unmounted at the
+// same time, hence the lock.
+static std::mutex mount_table_lock;
+static MountTable mount_table;
+
 constexpr const char* CACHE_ROOT = "/cache";
 
 FstabEntry* fstab_entry_for_mount_point_detect_fs(const std::string& path) {
@@ -83,6 +100,7 @@ FstabEntry* fstab_entry_for_mount_point_detect_fs(const std::string& path) {
 }
 
 void load_volume_table() {
+  ScopedStartupTrace trace("load_volume_table");
   if (!ReadDefaultFstab(&fstab)) {
     LOG(ERROR) << "Failed to read default fstab";
     return;
@@ -124,42 +142,138 @@ void load_volume_table() {
   } else {
     LOG(ERROR) << "Unable to create /etc/fstab";
   }
+
+  volumes_by_mount_point.clear();
+  for (auto& entry : fstab) {
+    volumes_by_mount_point.emplace(entry.mount_point, &entry);
+  }
 }
 
 Volume* volume_for_mount_point(const std::string& mount_point) {
-  return android::fs_mgr::GetEntryForMountPoint(&fstab, mount_point);
+  auto it = volumes_by_mount_point.find(mount_point);
+  return it == volumes_by_mount_point.end() ? nullptr : it->second;
+}
+
+// Returns the volume that |path| is on, or nullptr, like GetEntryForPath(): the volume mounted at
+// |path| itself, or at its closest parent directory other than "/".
+static FstabEntry* volume_for_path(const std::string& path) {
+  if (path.empty()) {
+    return nullptr;
+  }
+  std::string dir = path;
+  while (true) {
+    if (FstabEntry* v = volume_for_mount_point(dir); v != nullptr) {
+      return v;
+    }
+    dir = android::base::Dirname(dir);
+    if (dir == "." || dir == "/") {
+      return nullptr;
+    }
+  }
+}
+
+// Returns whether the volume that |path| is on is known to be mounted at |mount_point| (at its own
+// mount point if empty), in which case EnsurePathMounted() would have nothing to do.
+static bool is_path_mounted(const std::string& path, const std::string& mount_point) {
+  const FstabEntry* v = volume_for_path(path);
+  if (v == nullptr) {
+    return false;
+  }
+  if (v->fs_type == "ramdisk") {
+    return true;
+  }
+  const std::string& target = mount_point.empty() ? v->mount_point : mount_point;
+  std::lock_guard<std::mutex> lock(mount_table_lock);
+  return mount_table.Refresh() && mount_table.FindByMountPoint(target) != nullptr;
+}
+
+// Has the mount table read again, after a mount or an unmount.
+static void invalidate_mount_table() {
+  std::lock_guard<std::mutex> lock(mount_table_lock);
+  mount_table.Invalidate();
+}
+
+// The block devices wiped whole since they were last formatted or mounted, by device number, and
+// whether they read back zeroes. Volumes may be formatted at the same time, hence the lock.
+static std::mutex wiped_devices_lock;
+static std::map<dev_t, bool> wiped_devices;
+
+// Returns the device number of the block device at |blk_device|, or 0 if it's not one.
+static dev_t get_block_device_number(const std::string& blk_device) {
+  struct stat sb;
+  if (stat(blk_device.c_str(), &sb) != 0 || !S_ISBLK(sb.st_mode)) {
+    return 0;
+  }
+  return sb.st_rdev;
+}
+
+void NoteBlockDeviceWiped(const std::string& blk_device, bool reads_zeroes) {
+  if (dev_t rdev = get_block_device_number(blk_device); rdev != 0) {
+    std::lock_guard<std::mutex> lock(wiped_devices_lock);
+    wiped_devices[rdev] = reads_zeroes;
+  }
+}
+
+// Forgets the wipe of the block device of the volume that |path| is on, as it may be written to.
+static void forget_wiped_device(const std::string& path) {
+  if (const FstabEntry* v = volume_for_path(path); v != nullptr) {
+    if (dev_t rdev = get_block_device_number(v->blk_device); rdev != 0) {
+      std::lock_guard<std::mutex> lock(wiped_devices_lock);
+      wiped_devices.erase(rdev);
+    }
+  }
 }
 
 // Mount the volume specified by path at the given mount_point.
 int ensure_path_mounted_at(const std::string& path, const std::string& mount_point) {
-  return android::fs_mgr::EnsurePathMounted(&fstab, path, mount_point) ? 0 : -1;
+  forget_wiped_device(path);
+  if (is_path_mounted(path, mount_point)) {
+    return 0;
+  }
+  bool mounted = android::fs_mgr::EnsurePathMounted(&fstab, path, mount_point);
+  invalidate_mount_table();
+  return mounted ? 0 : -1;
 }
 
 int ensure_path_mounted(const std::string& path) {
   // Mount at the default mount point.
-  return android::fs_mgr::EnsurePathMounted(&fstab, path) ? 0 : -1;
+  return ensure_path_mounted_at(path, "");
 }
 
 int ensure_path_unmounted(const std::string& path) {
-  return android::fs_mgr::EnsurePathUnmounted(&fstab, path) ? 0 : -1;
+  // Nothing to do if the volume isn't mounted; EnsurePathUnmounted() handles the rest, including
+  // the errors for unknown volumes and the ramdisk.
+  if (const FstabEntry* v = volume_for_path(path); v != nullptr && v->fs_type != "ramdisk") {
+    std::lock_guard<std::mutex> lock(mount_table_lock);
+    if (mount_table.Refresh() && mount_table.FindByMountPoint(v->mount_point) == nullptr) {
+      return 0;
+    }
+  }
+  bool unmounted = android::fs_mgr::EnsurePathUnmounted(&fstab, path);
+  invalidate_mount_table();
+  return unmounted ? 0 : -1;
 }
 
 int ensure_volume_unmounted(const std::string& blk_device) {
-  android::fs_mgr::Fstab mounted_fstab;
-  if (!android::fs_mgr::ReadFstabFromFile("/proc/mounts", &mounted_fstab)) {
-    LOG(ERROR) << "Failed to read /proc/mounts";
-    return -1;
+  /* find any entries with the volume */
+  std::vector<std::string> mount_points;
+  {
+    std::lock_guard<std::mutex> lock(mount_table_lock);
+    if (!mount_table.Refresh()) {
+      LOG(ERROR) << "Failed to read /proc/mounts";
+      return -1;
+    }
+    for (const auto* mount : mount_table.FindByDevice(blk_device)) {
+      mount_points.push_back(mount->mount_point);
+    }
   }
 
-  /* find any entries with the volume */
-  for (auto& entry : mounted_fstab) {
-    if (entry.blk_device == blk_device) {
-      int result = umount(entry.mount_point.c_str());
-      if (result == -1) {
-        LOG(ERROR) << "Failed to unmount " << blk_device << " from " << entry.mount_point << ": "
-                   << errno;
-        return -1;
-      }
+  for (const auto& mount_point : mount_points) {
+    int result = umount(mount_point.c_str());
+    invalidate_mount_table();
+    if (result == -1) {
+      LOG(ERROR) << "Failed to unmount " << blk_device << " from " << mount_point << ": " << errno;
+      return -1;
     }
   }
   return 0;
@@ -206,9 +320,36 @@ static int64_t get_file_size(int fd, uint64_t reserve_len) {
   return computed_size;
 }
 
+// What the mkfs tools can skip on a block device.
+struct FormatPlan {
+  // The device needs a discard: it wasn't wiped since it was last written to.
+  bool discard{ true };
+  // The device reads back zeroes, so the inode tables and the journal needn't be zeroed out.
+  bool zeroed{ false };
+};
+
+// Plans the format of |blk_device| from what's known of it, using up the record of its wipe (as
+// the format writes to it). On a device that reads back zeroes, ext4 leaves the inode tables
+// uninitialized, for the kernel (ext4lazyinit) to go over after the first mount, and the journal
+// as it is.
+static FormatPlan plan_format(const std::string& blk_device) {
+  FormatPlan plan;
+  if (dev_t rdev = get_block_device_number(blk_device); rdev != 0) {
+    std::lock_guard<std::mutex> lock(wiped_devices_lock);
+    if (auto it = wiped_devices.find(rdev); it != wiped_devices.end()) {
+      plan.discard = false;
+      plan.zeroed = it->second;
+      wiped_devices.erase(it);
+    }
+  }
+  LOG(INFO) << "format_volume: " << blk_device << (plan.discard ? " needs" : " needs no")
+            << " discard, and is" << (plan.zeroed ? "" : " not") << " known to read zeroes";
+  return plan;
+}
+
 int format_volume(const std::string& volume, const std::string& directory,
                   std::string_view new_fstype) {
-  const FstabEntry* v = android::fs_mgr::GetEntryForPath(&fstab, volume);
+  const FstabEntry* v = volume_for_path(volume);
   if (v == nullptr) {
     LOG(ERROR) << "unknown volume \"" << volume << "\"";
     return -1;
@@ -252,14 +393,21 @@ int format_volume(const std::string& volume, const std::string& directory,
     }
   }
 
+  FormatPlan plan = plan_format(v->blk_device);
+
   // If the raw disk will be used as a metadata encrypted device mapper target,
   // next boot will do encrypt_in_place the raw disk. While fs_mgr mounts /data
   // as RO to avoid write file operations before encrypt_inplace, this code path
   // is not well tested so we would like to avoid it if possible. For safety,
   // let vold do the formatting on boot for metadata encrypted devices, except
   // when user specified a new fstype. Because init formats /data according
-  // to fstab, it's difficult to override the fstab in init.
+  // to fstab, it's difficult to override the fstab in init. A device that was just wiped whole
+  // needs nothing more.
   if (!v->metadata_key_dir.empty() && length == 0 && new_fstype.empty()) {
+    if (!plan.discard) {
+      LOG(INFO) << "format_volume: metadata encrypted " << v->blk_device << " is already wiped";
+      return 0;
+    }
     android::base::unique_fd fd(open(v->blk_device.c_str(), O_RDWR));
     if (fd == -1) {
       PLOG(ERROR) << "format_volume: failed to open " << v->blk_device;
@@ -300,11 +448,23 @@ int format_volume(const std::string& volume, const std::string& directory,
     if (v->logical_blk_size != 0 && v->logical_blk_size < 8192) {
       raid_stride = 8192 / kBlockSize;
     }
+    // mke2fs only takes the last -E, so the extended options are all passed at once.
+    std::vector<std::string> extended_options;
     if (v->erase_blk_size != 0 && v->logical_blk_size != 0) {
-      mke2fs_args.push_back("-E");
-      mke2fs_args.push_back(
+      extended_options.push_back(
           android::base::StringPrintf("stride=%d,stripe-width=%d", raid_stride, raid_stripe_width));
     }
+    if (!plan.discard) {
+      extended_options.push_back("nodiscard");
+    }
+    if (plan.zeroed) {
+      extended_options.push_back("lazy_itable_init=1");
+      extended_options.push_back("lazy_journal_init=1");
+    }
+    if (!extended_options.empty()) {
+      mke2fs_args.push_back("-E");
+      mke2fs_args.push_back(android::base::Join(extended_options, ','));
+    }
     mke2fs_args.push_back(v->blk_device);
     if (length != 0) {
       mke2fs_args.push_back(std::to_string(length / kBlockSize));
@@ -349,6 +509,10 @@ int format_volume(const std::string& volume, const std::string& directory,
     make_f2fs_cmd.push_back("-O");
     make_f2fs_cmd.push_back("extra_attr");
   }
+  if (!plan.discard) {
+    make_f2fs_cmd.push_back("-t");
+    make_f2fs_cmd.push_back("0");
+  }
   make_f2fs_cmd.push_back(v->blk_device);
   if (length >= kSectorSize) {
     make_f2fs_cmd.push_back(std::to_string(length / kSectorSize));
@@ -421,7 +585,7 @@ void map_logical_partitions() {
 }
 
 bool dm_find_system() {
-  auto rec = GetEntryForPath(&fstab, android::fs_mgr::GetSystemRoot());
+  auto rec = volume_for_path(android::fs_mgr::GetSystemRoot());
   if (!rec->fs_mgr_flags.logical) {
     return false;
   }
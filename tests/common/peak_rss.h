@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTA_PEAK_RSS_H
+#define _OTA_PEAK_RSS_H
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+
+// Resets the peak RSS (VmHWM) of the process, so that each benchmark reports its own peak rather
+// than the highest one so far. Needs Linux 4.0 or later; older kernels just keep the old peak.
+[[maybe_unused]] static void ResetPeakRss() {
+  android::base::WriteStringToFile("5", "/proc/self/clear_refs");
+}
+
+// Returns the peak RSS of the process in KiB, or 0 if it can't be read.
+[[maybe_unused]] static double PeakRssKb() {
+  std::string status;
+  if (!android::base::ReadFileToString("/proc/self/status", &status)) {
+    return 0;
+  }
+  for (const auto& line : android::base::Split(status, "\n")) {
+    uint64_t value;
+    if (sscanf(line.c_str(), "VmHWM: %" SCNu64, &value) == 1) {
+      return value;
+    }
+  }
+  return 0;
+}
+
+#endif  // _OTA_PEAK_RSS_H
@@ -14,6 +14,20 @@
  * limitations under the License.
  */
 
+// Besides the crashes, the fuzzer can look for inputs that take too long to verify. With
+// VERIFY_PACKAGE_FUZZER_BUDGET_US set, it reports each input slower per byte than all before it,
+// and aborts on an input that takes longer than the budget, which libFuzzer then keeps as a crash
+// artifact. Such inputs belong in tests/testdata/verify_perf_*, which
+// VerifierTest.PathologicalInputs_BoundedWork checks in presubmit.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+
+#include <android-base/parseint.h>
+
 #include "fuzzer/FuzzedDataProvider.h"
 
 #include "install/install.h"
@@ -24,6 +38,38 @@ std::unique_ptr<Package> CreatePackage(std::vector<uint8_t>& content) {
   return Package::CreateMemoryPackage(content, [](float) -> void {});
 }
 
+// Returns the budget per input from VERIFY_PACKAGE_FUZZER_BUDGET_US, or 0 if there's none.
+static uint64_t GetBudgetUs() {
+  uint64_t budget_us = 0;
+  if (const char* env = getenv("VERIFY_PACKAGE_FUZZER_BUDGET_US");
+      env != nullptr && !android::base::ParseUint(env, &budget_us)) {
+    fprintf(stderr, "Invalid VERIFY_PACKAGE_FUZZER_BUDGET_US: %s\n", env);
+    abort();
+  }
+  return budget_us;
+}
+
+static void CheckVerificationTime(std::chrono::steady_clock::duration duration, size_t size) {
+  static const uint64_t budget_us = GetBudgetUs();
+  static double slowest_us_per_byte = 0;
+  if (budget_us == 0) {
+    return;
+  }
+
+  uint64_t duration_us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+  double us_per_byte = static_cast<double>(duration_us) / size;
+  if (us_per_byte > slowest_us_per_byte) {
+    slowest_us_per_byte = us_per_byte;
+    fprintf(stderr, "Slowest input so far: %zu bytes verified in %" PRIu64 " us\n", size,
+            duration_us);
+  }
+  if (duration_us > budget_us) {
+    fprintf(stderr, "Verifying %zu bytes took %" PRIu64 " us, over the budget of %" PRIu64 " us\n",
+            size, duration_us, budget_us);
+    abort();
+  }
+}
+
 extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
   FuzzedDataProvider data_provider(data, size);
   auto package_contents = data_provider.ConsumeRemainingBytes<uint8_t>();
@@ -32,6 +78,8 @@ extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
   }
   auto package = CreatePackage(package_contents);
   StubRecoveryUI ui;
+  auto start = std::chrono::steady_clock::now();
   verify_package(package.get(), &ui);
+  CheckVerificationTime(std::chrono::steady_clock::now() - start, package_contents.size());
   return 0;
 }
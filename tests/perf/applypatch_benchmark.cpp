@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks of the patch engines: imgdiff generation, ApplyImagePatch(), ApplyBSDiffPatch() and
+// PatchPartition(). Each one runs over a number of source/target corpora and reports the target
+// throughput, the peak RSS and the patch size. All the corpora are loaded before the first run, so
+// the peak RSS includes them; compare it across builds rather than reading it as an absolute cost.
+//
+// The corpora default to the pairs in testdata/. Real-world inputs can be given instead, as
+//   recovery_host_benchmark --corpus=<name>:<zip|image>:<source>:<target> [...]
+// where "zip" runs imgdiff in zip mode (APKs, zips) and "image" in image mode (boot images).
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <applypatch/applypatch.h>
+#include <applypatch/imgdiff.h>
+#include <benchmark/benchmark.h>
+#include <bsdiff/bsdiff.h>
+#include <openssl/sha.h>
+
+#include "common/peak_rss.h"
+#include "common/test_constants.h"
+#include "edify/expr.h"
+#include "otautil/print_sha1.h"
+
+struct Corpus {
+  std::string name;
+  bool zip_mode;
+  std::string source;
+  std::string target;
+
+  std::string source_data;
+  std::string target_data;
+  std::string source_sha1;
+  std::string target_sha1;
+  std::string imgdiff_patch;
+  std::string bsdiff_patch;
+};
+
+static std::string Sha1Of(const std::string& data) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(data.data()), data.size(), digest);
+  return print_sha1(digest);
+}
+
+// Runs imgdiff on the corpus, writing the patch to |patch_path|.
+static bool RunImgdiff(const Corpus& corpus, const std::string& patch_path) {
+  std::vector<const char*> args{ "imgdiff" };
+  if (corpus.zip_mode) {
+    args.push_back("-z");
+  }
+  args.push_back(corpus.source.c_str());
+  args.push_back(corpus.target.c_str());
+  args.push_back(patch_path.c_str());
+  return imgdiff(args.size(), args.data()) == 0;
+}
+
+// Loads the corpus files and generates the patches that the apply benchmarks use.
+static bool PrepareCorpus(Corpus* corpus) {
+  if (!android::base::ReadFileToString(corpus->source, &corpus->source_data) ||
+      !android::base::ReadFileToString(corpus->target, &corpus->target_data)) {
+    PLOG(ERROR) << "Failed to read corpus " << corpus->name;
+    return false;
+  }
+  corpus->source_sha1 = Sha1Of(corpus->source_data);
+  corpus->target_sha1 = Sha1Of(corpus->target_data);
+
+  TemporaryFile imgdiff_patch;
+  if (!RunImgdiff(*corpus, imgdiff_patch.path) ||
+      !android::base::ReadFileToString(imgdiff_patch.path, &corpus->imgdiff_patch)) {
+    LOG(ERROR) << "Failed to generate the imgdiff patch of corpus " << corpus->name;
+    return false;
+  }
+
+  TemporaryFile bsdiff_patch;
+  if (bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(corpus->source_data.data()),
+                     corpus->source_data.size(),
+                     reinterpret_cast<const uint8_t*>(corpus->target_data.data()),
+                     corpus->target_data.size(), bsdiff_patch.path, nullptr) != 0 ||
+      !android::base::ReadFileToString(bsdiff_patch.path, &corpus->bsdiff_patch)) {
+    LOG(ERROR) << "Failed to generate the bsdiff patch of corpus " << corpus->name;
+    return false;
+  }
+  return true;
+}
+
+// Sets the counters that every benchmark reports.
+static void ReportCounters(benchmark::State& state, const Corpus& corpus, size_t patch_size) {
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * corpus.target_data.size());
+  state.counters["peak_rss_kb"] = PeakRssKb();
+  state.counters["patch_bytes"] = patch_size;
+  state.counters["target_bytes"] = corpus.target_data.size();
+}
+
+static void BM_Imgdiff(benchmark::State& state, const Corpus* corpus) {
+  TemporaryFile patch_file;
+  ResetPeakRss();
+  for (auto _ : state) {
+    if (!RunImgdiff(*corpus, patch_file.path)) {
+      state.SkipWithError("imgdiff failed");
+      return;
+    }
+  }
+  ReportCounters(state, *corpus, corpus->imgdiff_patch.size());
+}
+
+static void BM_ApplyImagePatch(benchmark::State& state, const Corpus* corpus) {
+  Value patch(Value::Type::BLOB, corpus->imgdiff_patch);
+  ResetPeakRss();
+  for (auto _ : state) {
+    size_t written = 0;
+    int result = ApplyImagePatch(
+        reinterpret_cast<const unsigned char*>(corpus->source_data.data()),
+        corpus->source_data.size(), patch,
+        [&written](const unsigned char* /* data */, size_t len) {
+          written += len;
+          return len;
+        },
+        nullptr);
+    if (result != 0 || written != corpus->target_data.size()) {
+      state.SkipWithError("ApplyImagePatch failed");
+      return;
+    }
+  }
+  ReportCounters(state, *corpus, corpus->imgdiff_patch.size());
+}
+
+static void BM_ApplyBSDiffPatch(benchmark::State& state, const Corpus* corpus) {
+  Value patch(Value::Type::BLOB, corpus->bsdiff_patch);
+  ResetPeakRss();
+  for (auto _ : state) {
+    size_t written = 0;
+    int result = ApplyBSDiffPatch(
+        reinterpret_cast<const unsigned char*>(corpus->source_data.data()),
+        corpus->source_data.size(), patch, 0, [&written](const unsigned char* /* data */,
+                                                         size_t len) {
+          written += len;
+          return len;
+        });
+    if (result != 0 || written != corpus->target_data.size()) {
+      state.SkipWithError("ApplyBSDiffPatch failed");
+      return;
+    }
+  }
+  ReportCounters(state, *corpus, corpus->bsdiff_patch.size());
+}
+
+// Runs the whole PatchPartition() flow, including loading the source and writing and verifying
+// the target. Note that the verification drops the caches and sleeps for a second, unless
+// ro.applypatch.direct_verify is set and the target file supports O_DIRECT.
+static void BM_PatchPartition(benchmark::State& state, const Corpus* corpus) {
+  Value patch(Value::Type::BLOB, corpus->imgdiff_patch);
+  Partition source(corpus->source, corpus->source_data.size(), corpus->source_sha1);
+  TemporaryFile target_file;
+  Partition target(target_file.path, corpus->target_data.size(), corpus->target_sha1);
+  ResetPeakRss();
+  for (auto _ : state) {
+    // Start from an empty target, so that PatchPartition() can't take its early exit.
+    state.PauseTiming();
+    if (ftruncate(target_file.fd, 0) != 0) {
+      state.SkipWithError("Failed to truncate the target");
+      return;
+    }
+    state.ResumeTiming();
+
+    if (!PatchPartition(target, source, patch, nullptr, false)) {
+      state.SkipWithError("PatchPartition failed");
+      return;
+    }
+  }
+  ReportCounters(state, *corpus, corpus->imgdiff_patch.size());
+}
+
+// Parses a --corpus=<name>:<zip|image>:<source>:<target> flag.
+static bool ParseCorpus(const std::string& arg, Corpus* corpus) {
+  std::vector<std::string> pieces = android::base::Split(arg, ":");
+  if (pieces.size() != 4 || (pieces[1] != "zip" && pieces[1] != "image")) {
+    return false;
+  }
+  corpus->name = pieces[0];
+  corpus->zip_mode = pieces[1] == "zip";
+  corpus->source = pieces[2];
+  corpus->target = pieces[3];
+  return true;
+}
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv);
+  // imgdiff and applypatch log every chunk at INFO.
+  android::base::SetMinimumLogSeverity(android::base::WARNING);
+
+  std::vector<Corpus> corpora;
+  std::vector<char*> benchmark_args;
+  for (int i = 0; i < argc; i++) {
+    if (android::base::StartsWith(argv[i], "--corpus=")) {
+      Corpus corpus;
+      if (!ParseCorpus(argv[i] + strlen("--corpus="), &corpus)) {
+        fprintf(stderr, "Invalid %s, expecting --corpus=<name>:<zip|image>:<source>:<target>\n",
+                argv[i]);
+        return 1;
+      }
+      corpora.push_back(std::move(corpus));
+    } else {
+      benchmark_args.push_back(argv[i]);
+    }
+  }
+  if (corpora.empty()) {
+    corpora = {
+      { "deflate_zip", true, from_testdata_base("deflate_src.zip"),
+        from_testdata_base("deflate_tgt.zip") },
+      { "gzipped_image", false, from_testdata_base("gzipped_source"),
+        from_testdata_base("gzipped_target") },
+      { "boot_to_recovery", false, from_testdata_base("boot.img"),
+        from_testdata_base("recovery.img") },
+    };
+  }
+
+  // Corpora that fail to load are skipped, so that one missing file doesn't stop the whole run.
+  // The vector isn't modified past this point, as the benchmarks keep pointers into it.
+  std::vector<Corpus> prepared;
+  for (auto& corpus : corpora) {
+    if (PrepareCorpus(&corpus)) {
+      prepared.push_back(std::move(corpus));
+    }
+  }
+  if (prepared.empty()) {
+    fprintf(stderr, "No usable corpus\n");
+    return 1;
+  }
+  for (const auto& corpus : prepared) {
+    benchmark::RegisterBenchmark(("BM_Imgdiff/" + corpus.name).c_str(), BM_Imgdiff, &corpus)
+        ->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark(("BM_ApplyImagePatch/" + corpus.name).c_str(),
+                                 BM_ApplyImagePatch, &corpus)
+        ->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark(("BM_ApplyBSDiffPatch/" + corpus.name).c_str(),
+                                 BM_ApplyBSDiffPatch, &corpus)
+        ->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark(("BM_PatchPartition/" + corpus.name).c_str(), BM_PatchPartition,
+                                 &corpus)
+        ->Unit(benchmark::kMillisecond);
+  }
+
+  int benchmark_argc = benchmark_args.size();
+  benchmark::Initialize(&benchmark_argc, benchmark_args.data());
+  if (benchmark::ReportUnrecognizedArguments(benchmark_argc, benchmark_args.data())) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
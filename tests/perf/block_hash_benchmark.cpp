@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks of HashBlocks() with each implementation, over batches of blocks as its callers hash
+// them: 4 KiB blocks with a salt for the verity hash tree, and fuse_sideload's 64 KiB blocks. The
+// implementation that HashBlocks() picks for the CPU is printed first.
+//
+// The benchmarks are named BM_<implementation>_<algorithm>/<block size>/<salt size>.
+
+#include <stdio.h>
+
+#include <vector>
+
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+
+#include "otautil/block_hash.h"
+
+// The blocks hashed per call, e.g. a read-ahead batch of fuse_sideload.
+static constexpr size_t kBatchBlocks = 64;
+
+static void RunHashBlocks(benchmark::State& state, BlockHashImplementation implementation,
+                          BlockHashAlgorithm algorithm) {
+  size_t block_size = state.range(0);
+  std::vector<uint8_t> salt(state.range(1), 0xa5);
+  std::vector<uint8_t> data(block_size * kBatchBlocks);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i * 7);
+  }
+  std::vector<uint8_t> digests(kBatchBlocks * BlockDigestSize(algorithm));
+
+  for (auto _ : state) {
+    HashBlocksWith(implementation, algorithm, data.data(), block_size, kBatchBlocks,
+                   digests.data(), salt.data(), salt.size());
+    benchmark::DoNotOptimize(digests.data());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+
+static void BM_OneAtATime_Sha256(benchmark::State& state) {
+  RunHashBlocks(state, BlockHashImplementation::kOneAtATime, BlockHashAlgorithm::kSha256);
+}
+
+static void BM_MultiBuffer_Sha256(benchmark::State& state) {
+  RunHashBlocks(state, BlockHashImplementation::kMultiBuffer, BlockHashAlgorithm::kSha256);
+}
+
+static void BM_OneAtATime_Sha1(benchmark::State& state) {
+  RunHashBlocks(state, BlockHashImplementation::kOneAtATime, BlockHashAlgorithm::kSha1);
+}
+
+static void BlockArgs(benchmark::internal::Benchmark* b) {
+  b->Args({ 4096, 32 })->Args({ 65536, 0 });
+}
+
+BENCHMARK(BM_OneAtATime_Sha256)->Apply(BlockArgs);
+BENCHMARK(BM_MultiBuffer_Sha256)->Apply(BlockArgs);
+BENCHMARK(BM_OneAtATime_Sha1)->Apply(BlockArgs);
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv);
+  printf("HashBlocks() hashes %s\n",
+         GetBlockHashImplementation() == BlockHashImplementation::kOneAtATime
+             ? "one block at a time"
+             : "multiple blocks at a time");
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
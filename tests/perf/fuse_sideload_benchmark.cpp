@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks of fuse_sideload. Each run mounts a synthetic package with run_fuse_sideload(), served
+// by a provider that takes a given latency per call and bandwidth (like the adb host over USB), and
+// reads it back through the mount. Besides the throughput, it reports the CPU time spent hashing
+// the blocks, the block cache hit ratio and the number of FUSE requests and provider calls, so
+// that cache and read-ahead designs can be compared.
+//
+// Mounting needs root and /dev/fuse, on the host as on a device:
+//   recovery_fuse_benchmark [--package_size_mb=<n>] [--block_size=<n>] [<benchmark flags>]
+//
+// The benchmarks are named BM_<pattern>/<latency in us>/<bandwidth in MB/s, 0 for unlimited>.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+
+#include "fuse_provider.h"
+#include "fuse_sideload.h"
+
+static uint64_t package_size = 64 * 1024 * 1024;
+static uint32_t block_size = 65536;
+
+// Serves a package whose blocks are filled with their block number, taking |latency_us| per call
+// plus the time to move the data at |bandwidth_mbps|. Calls are serialized, as with adb.
+class SyntheticDataProvider : public FuseDataProvider {
+ public:
+  SyntheticDataProvider(uint64_t file_size, uint32_t block_size, uint32_t latency_us,
+                        uint32_t bandwidth_mbps)
+      : FuseDataProvider(file_size, block_size),
+        latency_us_(latency_us),
+        bandwidth_mbps_(bandwidth_mbps) {}
+
+  bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
+                            uint32_t start_block) const override {
+    for (uint32_t offset = 0; offset < fetch_size; offset += fuse_block_size_) {
+      memset(buffer + offset, start_block + offset / fuse_block_size_,
+             std::min(fuse_block_size_, fetch_size - offset));
+    }
+    uint64_t delay_us = latency_us_;
+    if (bandwidth_mbps_ != 0) {
+      delay_us += static_cast<uint64_t>(fetch_size) / bandwidth_mbps_;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+    return true;
+  }
+
+  bool Valid() const override {
+    return true;
+  }
+
+ private:
+  uint32_t latency_us_;
+  uint32_t bandwidth_mbps_;
+};
+
+// Reads |size| bytes at |offset| of the package, in reads of up to 1 MiB.
+static bool ReadRange(int fd, uint64_t offset, uint64_t size, std::vector<uint8_t>* buffer) {
+  while (size > 0) {
+    size_t to_read = std::min<uint64_t>(size, buffer->size());
+    if (!android::base::ReadFullyAtOffset(fd, buffer->data(), to_read, offset)) {
+      return false;
+    }
+    offset += to_read;
+    size -= to_read;
+  }
+  return true;
+}
+
+// The whole package, front to back, as verify_file() hashes it.
+static bool ReadSequential(int fd, std::vector<uint8_t>* buffer, uint64_t* bytes_read) {
+  *bytes_read = package_size;
+  return ReadRange(fd, 0, package_size, buffer);
+}
+
+// What opening the package and installing it looks like: the tail (EOCD and central directory),
+// scattered small reads (the local headers and the metadata entries), then the whole package,
+// then the opening reads again as the updater opens the package for itself.
+static bool ReadZipPattern(int fd, std::vector<uint8_t>* buffer, uint64_t* bytes_read) {
+  static constexpr uint64_t kTailSize = 64 * 1024;
+  static constexpr size_t kRandomReads = 32;
+  static constexpr uint64_t kRandomReadSize = 4096;
+
+  uint64_t tail_size = std::min(package_size, kTailSize);
+  std::mt19937_64 random(0);
+  std::uniform_int_distribution<uint64_t> offsets(0, package_size - kRandomReadSize);
+  *bytes_read = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    if (!ReadRange(fd, package_size - tail_size, tail_size, buffer)) {
+      return false;
+    }
+    *bytes_read += tail_size;
+    for (size_t i = 0; i < kRandomReads; i++) {
+      if (!ReadRange(fd, offsets(random), kRandomReadSize, buffer)) {
+        return false;
+      }
+      *bytes_read += kRandomReadSize;
+    }
+    if (pass == 0) {
+      if (!ReadRange(fd, 0, package_size, buffer)) {
+        return false;
+      }
+      *bytes_read += package_size;
+    }
+  }
+  return true;
+}
+
+using ReadPattern = bool (*)(int, std::vector<uint8_t>*, uint64_t*);
+
+static void RunSideload(benchmark::State& state, ReadPattern pattern) {
+  uint32_t latency_us = state.range(0);
+  uint32_t bandwidth_mbps = state.range(1);
+  std::vector<uint8_t> buffer(1024 * 1024);
+
+  uint64_t bytes = 0;
+  FuseSideloadStats totals = {};
+  for (auto _ : state) {
+    state.PauseTiming();
+    TemporaryDir mount_point;
+    FuseSideloadStats stats;
+    std::atomic<bool> server_done = false;
+    std::thread server([&mount_point, &stats, &server_done, latency_us, bandwidth_mbps]() {
+      auto provider = std::make_unique<SyntheticDataProvider>(package_size, block_size, latency_us,
+                                                              bandwidth_mbps);
+      run_fuse_sideload(std::move(provider), mount_point.path, &stats);
+      server_done = true;
+    });
+
+    std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+    struct stat sb;
+    while (stat(package.c_str(), &sb) != 0 || static_cast<uint64_t>(sb.st_size) != package_size) {
+      if (server_done) {
+        server.join();
+        state.SkipWithError("Failed to mount the package (not running as root?)");
+        return;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    android::base::unique_fd fd(open(package.c_str(), O_RDONLY));
+    state.ResumeTiming();
+
+    uint64_t bytes_read = 0;
+    bool read = fd != -1 && pattern(fd, &buffer, &bytes_read);
+
+    state.PauseTiming();
+    fd.reset();
+    std::string exit_flag = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
+    stat(exit_flag.c_str(), &sb);
+    server.join();
+    if (!read) {
+      state.SkipWithError("Failed to read the package");
+      return;
+    }
+    bytes += bytes_read;
+    totals.requests += stats.requests;
+    totals.read_requests += stats.read_requests;
+    totals.provider_reads += stats.provider_reads;
+    totals.hash_cpu_ns += stats.hash_cpu_ns;
+    totals.cache_hits += stats.cache_hits;
+    totals.cache_misses += stats.cache_misses;
+    state.ResumeTiming();
+  }
+
+  state.SetBytesProcessed(bytes);
+  auto average = benchmark::Counter::kAvgIterations;
+  state.counters["fuse_requests"] = benchmark::Counter(totals.requests, average);
+  state.counters["fuse_reads"] = benchmark::Counter(totals.read_requests, average);
+  state.counters["provider_reads"] = benchmark::Counter(totals.provider_reads, average);
+  state.counters["hash_cpu_ms"] = benchmark::Counter(totals.hash_cpu_ns / 1e6, average);
+  uint64_t lookups = totals.cache_hits + totals.cache_misses;
+  state.counters["cache_hit_ratio"] =
+      lookups == 0 ? 0 : static_cast<double>(totals.cache_hits) / lookups;
+}
+
+static void BM_Sequential(benchmark::State& state) {
+  RunSideload(state, ReadSequential);
+}
+
+static void BM_ZipPattern(benchmark::State& state) {
+  RunSideload(state, ReadZipPattern);
+}
+
+// No delay at all (the cost of fuse_sideload itself), then a USB 2.0 and a USB 3.0 link.
+static void LinkArgs(benchmark::internal::Benchmark* b) {
+  b->Args({ 0, 0 })->Args({ 1000, 40 })->Args({ 200, 400 });
+}
+
+BENCHMARK(BM_Sequential)->Apply(LinkArgs)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_ZipPattern)->Apply(LinkArgs)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv);
+
+  std::vector<char*> benchmark_args;
+  for (int i = 0; i < argc; i++) {
+    std::string_view arg = argv[i];
+    uint64_t size_mb;
+    if (android::base::ConsumePrefix(&arg, "--package_size_mb=")) {
+      if (!android::base::ParseUint(std::string(arg), &size_mb) || size_mb == 0) {
+        fprintf(stderr, "Invalid %s\n", argv[i]);
+        return 1;
+      }
+      package_size = size_mb * 1024 * 1024;
+    } else if (android::base::ConsumePrefix(&arg, "--block_size=")) {
+      if (!android::base::ParseUint(std::string(arg), &block_size) || block_size < 4096) {
+        fprintf(stderr, "Invalid %s\n", argv[i]);
+        return 1;
+      }
+    } else {
+      benchmark_args.push_back(argv[i]);
+    }
+  }
+
+  int benchmark_argc = benchmark_args.size();
+  benchmark::Initialize(&benchmark_argc, benchmark_args.data());
+  if (benchmark::ReportUnrecognizedArguments(benchmark_argc, benchmark_args.data())) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -0,0 +1,328 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks of the minui drawing primitives and of ScreenRecoveryUI frames and prints, drawn with
+// GraphicsBackend::MEMORY so that they measure the drawing itself rather than the display.
+//
+//   recovery_minui_benchmark [--res_dir=<dir>] [<benchmark flags>]
+//
+// The font and the images come from |--res_dir| (the testdata of the benchmark by default; a
+// recovery image has its resources in /res/images). The benchmarks are named
+// BM_<function>/<width>/<height>[/<argument>], where the argument is the rotation for BM_Blit, the
+// alpha for BM_Fill and whether the text screen is shown for BM_DrawScreen. Frame sized operations
+// report their throughput in pixels per second.
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <benchmark/benchmark.h>
+
+#include "common/test_constants.h"
+#include "minui/minui.h"
+#include "otautil/paths.h"
+#include "private/resources.h"
+#include "recovery_ui/screen_ui.h"
+
+static std::string res_dir;
+
+// Sets up minui with an in-memory |width| x |height| screen for the scope of a benchmark.
+class MemoryGraphics {
+ public:
+  MemoryGraphics(int width, int height) {
+    gr_use_memory_backend(width, height);
+    initialized_ = gr_init() == 0;
+  }
+
+  ~MemoryGraphics() {
+    gr_exit();
+    gr_use_memory_backend(0, 0);
+  }
+
+  bool initialized() const {
+    return initialized_;
+  }
+
+ private:
+  bool initialized_;
+};
+
+static void SetPixelsProcessed(benchmark::State& state, int64_t pixels_per_iteration) {
+  state.counters["pixels"] = benchmark::Counter(state.iterations() * pixels_per_iteration,
+                                                benchmark::Counter::kIsRate);
+}
+
+static void BM_Clear(benchmark::State& state) {
+  MemoryGraphics graphics(state.range(0), state.range(1));
+  if (!graphics.initialized()) {
+    state.SkipWithError("Failed to initialize the graphics");
+    return;
+  }
+
+  gr_color(0, 0, 0, 255);
+  for (auto _ : state) {
+    gr_clear();
+  }
+  SetPixelsProcessed(state, static_cast<int64_t>(gr_fb_width()) * gr_fb_height());
+}
+
+// Fills the middle half of the screen, opaque (a plain fill) or translucent (a blend).
+static void BM_Fill(benchmark::State& state) {
+  MemoryGraphics graphics(state.range(0), state.range(1));
+  if (!graphics.initialized()) {
+    state.SkipWithError("Failed to initialize the graphics");
+    return;
+  }
+
+  int width = gr_fb_width();
+  int height = gr_fb_height();
+  gr_color(0x33, 0x66, 0x99, state.range(2));
+  for (auto _ : state) {
+    gr_fill(0, height / 4, width, height * 3 / 4);
+  }
+  SetPixelsProcessed(state, static_cast<int64_t>(width) * (height * 3 / 4 - height / 4));
+}
+
+// Blits a square image of half the screen width (about the size of the recovery animation) to the
+// middle of the screen, in the rotation of the argument.
+static void BM_Blit(benchmark::State& state) {
+  MemoryGraphics graphics(state.range(0), state.range(1));
+  if (!graphics.initialized()) {
+    state.SkipWithError("Failed to initialize the graphics");
+    return;
+  }
+
+  gr_rotate(static_cast<GRRotation>(state.range(2)));
+  int width = gr_fb_width();
+  int height = gr_fb_height();
+  int size = std::min(width, height) / 2;
+  auto source = GRSurface::Create(size, size, size * 4, 4);
+  if (!source) {
+    state.SkipWithError("Failed to allocate the image");
+    return;
+  }
+  uint8_t* data = source->data();
+  for (size_t i = 0; i < source->data_size(); i++) {
+    data[i] = static_cast<uint8_t>(i * 7);
+  }
+
+  for (auto _ : state) {
+    gr_blit(source.get(), 0, 0, size, size, (width - size) / 2, (height - size) / 2);
+  }
+  SetPixelsProcessed(state, static_cast<int64_t>(size) * size);
+  gr_rotate(GRRotation::NONE);
+}
+
+// Draws a screenful of log lines with the system font. The lines are the same on every frame, as
+// on a redraw of the text screen, unless |unique| is set.
+static void DrawText(benchmark::State& state, bool unique) {
+  MemoryGraphics graphics(state.range(0), state.range(1));
+  if (!graphics.initialized() || gr_sys_font() == nullptr) {
+    state.SkipWithError("Failed to initialize the graphics or the font");
+    return;
+  }
+
+  int char_width;
+  int char_height;
+  gr_font_size(gr_sys_font(), &char_width, &char_height);
+  int rows = gr_fb_height() / char_height;
+  int columns = gr_fb_width() / char_width;
+  std::vector<std::string> lines;
+  for (int row = 0; row < rows; row++) {
+    std::string line =
+        android::base::StringPrintf("I:[%d] Patching system image after verification", row);
+    line.resize(std::min<size_t>(line.size(), columns), ' ');
+    lines.push_back(line);
+  }
+
+  gr_color(255, 255, 255, 255);
+  size_t frame = 0;
+  for (auto _ : state) {
+    for (int row = 0; row < rows; row++) {
+      if (unique) {
+        state.PauseTiming();
+        lines[row][0] = "0123456789"[(frame + row) % 10];
+        lines[row][1] = "0123456789"[(frame / 10 + row) % 10];
+        state.ResumeTiming();
+      }
+      gr_text(gr_sys_font(), 0, row * char_height, lines[row].c_str(), row % 8 == 0);
+    }
+    frame++;
+  }
+  state.counters["chars"] =
+      benchmark::Counter(state.iterations() * rows * columns, benchmark::Counter::kIsRate);
+}
+
+static void BM_Text(benchmark::State& state) {
+  DrawText(state, false);
+}
+
+static void BM_TextUnique(benchmark::State& state) {
+  DrawText(state, true);
+}
+
+// Draws the "Installing system update" text of the background screen.
+static void BM_TextIcon(benchmark::State& state) {
+  MemoryGraphics graphics(state.range(0), state.range(1));
+  if (!graphics.initialized()) {
+    state.SkipWithError("Failed to initialize the graphics");
+    return;
+  }
+
+  GRSurface* icon_surface = nullptr;
+  for (const auto& density : { "xxxhdpi", "xxhdpi", "xhdpi", "hdpi", "mdpi" }) {
+    std::string name = android::base::StringPrintf("res-%s/images/installing_text", density);
+    if (res_create_localized_alpha_surface(name.c_str(), "en-US", &icon_surface) == 0) {
+      break;
+    }
+  }
+  std::unique_ptr<GRSurface> icon(icon_surface);
+  if (!icon) {
+    state.SkipWithError("Failed to load installing_text");
+    return;
+  }
+
+  int x = (gr_fb_width() - static_cast<int>(icon->width)) / 2;
+  int y = (gr_fb_height() - static_cast<int>(icon->height)) / 2;
+  gr_color(255, 255, 255, 255);
+  for (auto _ : state) {
+    gr_texticon(x, y, icon.get());
+  }
+  SetPixelsProcessed(state, static_cast<int64_t>(icon->width) * icon->height);
+}
+
+class BenchmarkScreenRecoveryUI : public ScreenRecoveryUI {
+ public:
+  // Draws the whole screen and flips it, as on any change of the screen.
+  void DrawFrame() {
+    std::lock_guard<std::mutex> lg(updateMutex);
+    update_screen_locked();
+  }
+};
+
+// Draws a whole frame of ScreenRecoveryUI: the error screen (a background image and text), or the
+// text screen full of log lines.
+static void BM_DrawScreen(benchmark::State& state) {
+  gr_use_memory_backend(state.range(0), state.range(1));
+  auto ui = std::make_unique<BenchmarkScreenRecoveryUI>();
+  if (!ui->Init("en-US")) {
+    ui.reset();
+    gr_use_memory_backend(0, 0);
+    state.SkipWithError("Failed to initialize the UI");
+    return;
+  }
+
+  ui->SetBackground(RecoveryUI::ERROR);
+  if (state.range(2) != 0) {
+    ui->ShowText(true);
+    for (int i = 0; i < 100; i++) {
+      ui->PrintOnScreenOnly("I:[%d] Patching system image after verification\n", i);
+    }
+  }
+  for (auto _ : state) {
+    ui->DrawFrame();
+  }
+
+  ui.reset();
+  gr_use_memory_backend(0, 0);
+}
+
+// Prints log lines onto the text screen, as fast as an updater sends them with ui_print.
+static void BM_Print(benchmark::State& state) {
+  gr_use_memory_backend(state.range(0), state.range(1));
+  auto ui = std::make_unique<BenchmarkScreenRecoveryUI>();
+  if (!ui->Init("en-US")) {
+    ui.reset();
+    gr_use_memory_backend(0, 0);
+    state.SkipWithError("Failed to initialize the UI");
+    return;
+  }
+
+  ui->ShowText(true);
+  int line = 0;
+  for (auto _ : state) {
+    ui->PrintOnScreenOnly("I:[%d] Patching system image after verification\n", line++);
+  }
+  state.counters["lines"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+
+  ui.reset();
+  gr_use_memory_backend(0, 0);
+}
+
+// 720p, 1080p and 1440p phones, in portrait.
+static void ResolutionArgs(benchmark::internal::Benchmark* b) {
+  b->Args({ 720, 1280 })->Args({ 1080, 1920 })->Args({ 1440, 2560 });
+}
+
+static void FillArgs(benchmark::internal::Benchmark* b) {
+  for (int alpha : { 255, 128 }) {
+    b->Args({ 720, 1280, alpha })->Args({ 1080, 1920, alpha })->Args({ 1440, 2560, alpha });
+  }
+}
+
+static void BlitArgs(benchmark::internal::Benchmark* b) {
+  for (int r = static_cast<int>(GRRotation::NONE); r <= static_cast<int>(GRRotation::LEFT); r++) {
+    b->Args({ 720, 1280, r })->Args({ 1080, 1920, r })->Args({ 1440, 2560, r });
+  }
+}
+
+static void DrawScreenArgs(benchmark::internal::Benchmark* b) {
+  for (int text : { 0, 1 }) {
+    b->Args({ 720, 1280, text })->Args({ 1080, 1920, text })->Args({ 1440, 2560, text });
+  }
+}
+
+BENCHMARK(BM_Clear)->Apply(ResolutionArgs);
+BENCHMARK(BM_Fill)->Apply(FillArgs);
+BENCHMARK(BM_Blit)->Apply(BlitArgs);
+BENCHMARK(BM_Text)->Apply(ResolutionArgs);
+BENCHMARK(BM_TextUnique)->Apply(ResolutionArgs);
+BENCHMARK(BM_TextIcon)->Apply(ResolutionArgs);
+BENCHMARK(BM_DrawScreen)->Apply(DrawScreenArgs)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Print)->Apply(ResolutionArgs)->UseRealTime();
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv);
+
+  res_dir = from_testdata_base("");
+  std::vector<char*> benchmark_args;
+  for (int i = 0; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (android::base::ConsumePrefix(&arg, "--res_dir=")) {
+      res_dir = arg;
+    } else {
+      benchmark_args.push_back(argv[i]);
+    }
+  }
+  Paths::Get().set_resource_dir(res_dir);
+  res_set_resource_dir(res_dir);
+
+  int benchmark_argc = benchmark_args.size();
+  benchmark::Initialize(&benchmark_argc, benchmark_args.data());
+  if (benchmark::ReportUnrecognizedArguments(benchmark_argc, benchmark_args.data())) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
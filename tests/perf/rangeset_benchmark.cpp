@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks of the RangeSet operations on the update paths: parsing and printing the ranges of
+// transfer list commands, Split(), Overlaps() and GetSubRanges() as the updater and update_verifier
+// use them, SortedRangeSet::Insert() and GetOffsetInRangeSet() as imgdiff uses them, and
+// BlockMapData::ParseBlockMapFile() as uncrypt'd packages are opened.
+//
+// The benchmarks are named BM_<operation>/<number of ranges>. By default they run over synthetic
+// ranges shaped like those of a fragmented partition (runs of 1 to 64 blocks with gaps of 1 to 256
+// blocks, in increasing order). Ranges captured on a device can be given instead, as
+//   recovery_rangeset_benchmark [--ranges=<file>] [--block_map=<file>] [<benchmark flags>]
+// where <file> for --ranges holds a RangeSet in text form (e.g. the source ranges of a command in
+// a transfer list), and --block_map a block map written by uncrypt. Those run as
+// BM_<operation>/captured.
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <benchmark/benchmark.h>
+
+#include "otautil/rangeset.h"
+#include "otautil/sysutil.h"
+
+static std::string captured_ranges_path;
+static std::string captured_block_map_path;
+
+// Returns |count| increasing, non-contiguous ranges, the same ones for the same |seed|.
+static std::vector<Range> MakeRanges(size_t count, uint32_t seed) {
+  std::mt19937 random(seed);
+  std::uniform_int_distribution<size_t> run(1, 64);
+  std::uniform_int_distribution<size_t> gap(1, 256);
+  std::vector<Range> ranges;
+  ranges.reserve(count);
+  size_t block = 0;
+  for (size_t i = 0; i < count; i++) {
+    block += gap(random);
+    size_t end = block + run(random);
+    ranges.emplace_back(block, end);
+    block = end;
+  }
+  return ranges;
+}
+
+static RangeSet MakeRangeSet(size_t count, uint32_t seed = 0) {
+  return RangeSet(MakeRanges(count, seed));
+}
+
+// Returns the block map of a file that spans |ranges| of /dev/block/by-name/userdata.
+static std::string MakeBlockMap(const RangeSet& ranges) {
+  std::string content = "/dev/block/by-name/userdata\n" + std::to_string(ranges.blocks() * 4096) +
+                        " 4096\n" + std::to_string(ranges.size()) + "\n";
+  for (const auto& [start, end] : ranges) {
+    content += std::to_string(start) + " " + std::to_string(end) + "\n";
+  }
+  return content;
+}
+
+// Runs |operation| over |ranges|, reporting the throughput in ranges.
+template <typename Operation>
+static void RunOnRanges(benchmark::State& state, const RangeSet& ranges, Operation operation) {
+  for (auto _ : state) {
+    operation(ranges);
+  }
+  state.SetItemsProcessed(state.iterations() * ranges.size());
+}
+
+static void Parse(benchmark::State& state, const RangeSet& ranges) {
+  std::string text = ranges.ToString();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(RangeSet::Parse(text));
+  }
+  state.SetItemsProcessed(state.iterations() * ranges.size());
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+
+static void ToString(benchmark::State& state, const RangeSet& ranges) {
+  RunOnRanges(state, ranges,
+              [](const RangeSet& rs) { benchmark::DoNotOptimize(rs.ToString()); });
+}
+
+// Into as many groups as the updater's verification threads, or update_verifier's.
+static void Split(benchmark::State& state, const RangeSet& ranges) {
+  RunOnRanges(state, ranges, [](const RangeSet& rs) { benchmark::DoNotOptimize(rs.Split(16)); });
+}
+
+// Against another set of the same size over the same span, so that they overlap only near the end
+// and the whole of both has to be looked at.
+static void Overlaps(benchmark::State& state, const RangeSet& ranges) {
+  std::vector<Range> shifted;
+  shifted.reserve(ranges.size());
+  for (const auto& [start, end] : ranges) {
+    shifted.emplace_back(end, end + 1);
+  }
+  shifted.back() = { ranges.crbegin()->first, ranges.crbegin()->first + 1 };
+  RangeSet other(std::move(shifted));
+  RunOnRanges(state, ranges,
+              [&other](const RangeSet& rs) { benchmark::DoNotOptimize(rs.Overlaps(other)); });
+}
+
+// 1 MiB worth of blocks at random offsets, as the updater reads a command's source in chunks.
+static void GetSubRanges(benchmark::State& state, const RangeSet& ranges) {
+  static constexpr size_t kSubRangeBlocks = 256;
+  size_t sub_range_blocks = std::min(kSubRangeBlocks, ranges.blocks());
+  std::mt19937 random(0);
+  std::uniform_int_distribution<size_t> start(0, ranges.blocks() - sub_range_blocks);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ranges.GetSubRanges(start(random), sub_range_blocks));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// A batch of ranges inserted one at a time, as imgdiff records the blocks of each split chunk.
+static void SortedInsert(benchmark::State& state, const RangeSet& ranges) {
+  static constexpr size_t kInserts = 16;
+  std::vector<Range> sorted(ranges.begin(), ranges.end());
+  std::sort(sorted.begin(), sorted.end());
+  SortedRangeSet base(std::move(sorted));
+  std::mt19937 random(0);
+  std::uniform_int_distribution<size_t> block(0, ranges.crbegin()->second);
+  for (auto _ : state) {
+    state.PauseTiming();
+    SortedRangeSet rs = base;
+    state.ResumeTiming();
+    for (size_t i = 0; i < kInserts; i++) {
+      size_t start = block(random);
+      rs.Insert({ start, start + 1 });
+    }
+    benchmark::DoNotOptimize(rs.blocks());
+  }
+  state.SetItemsProcessed(state.iterations() * kInserts);
+}
+
+// Offsets within random blocks of the set.
+static void GetOffsetInRangeSet(benchmark::State& state, const RangeSet& ranges) {
+  std::vector<Range> sorted(ranges.begin(), ranges.end());
+  std::sort(sorted.begin(), sorted.end());
+  SortedRangeSet rs(std::move(sorted));
+  std::mt19937 random(0);
+  std::uniform_int_distribution<size_t> index(0, rs.size() - 1);
+  std::vector<size_t> offsets(1024);
+  for (auto& offset : offsets) {
+    const auto& [start, end] = rs[index(random)];
+    offset = (start + random() % (end - start)) * SortedRangeSet::kBlockSize + 10;
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(rs.GetOffsetInRangeSet(offsets[i++ % offsets.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+static void ParseBlockMapFile(benchmark::State& state, const std::string& block_map_path) {
+  size_t ranges = 0;
+  for (auto _ : state) {
+    auto block_map_data = BlockMapData::ParseBlockMapFile(block_map_path);
+    if (!block_map_data) {
+      state.SkipWithError("Failed to parse the block map");
+      return;
+    }
+    ranges = block_map_data.block_ranges().size();
+  }
+  state.SetItemsProcessed(state.iterations() * ranges);
+}
+
+using RangeSetBenchmark = void (*)(benchmark::State&, const RangeSet&);
+
+static void RegisterRangeSetBenchmark(const char* name, RangeSetBenchmark run) {
+  benchmark::RegisterBenchmark(name, [run](benchmark::State& state) {
+    run(state, MakeRangeSet(state.range(0)));
+  })->RangeMultiplier(8)->Range(1 << 10, 1 << 20);
+}
+
+static void RegisterBenchmarks() {
+  const std::vector<std::pair<const char*, RangeSetBenchmark>> benchmarks = {
+    { "BM_Parse", Parse },
+    { "BM_ToString", ToString },
+    { "BM_Split", Split },
+    { "BM_Overlaps", Overlaps },
+    { "BM_GetSubRanges", GetSubRanges },
+    { "BM_SortedInsert", SortedInsert },
+    { "BM_GetOffsetInRangeSet", GetOffsetInRangeSet },
+  };
+  for (const auto& [name, run] : benchmarks) {
+    RegisterRangeSetBenchmark(name, run);
+  }
+
+  benchmark::RegisterBenchmark("BM_ParseBlockMapFile", [](benchmark::State& state) {
+    TemporaryFile block_map;
+    if (!android::base::WriteStringToFile(MakeBlockMap(MakeRangeSet(state.range(0))),
+                                          block_map.path)) {
+      state.SkipWithError("Failed to write the block map");
+      return;
+    }
+    ParseBlockMapFile(state, block_map.path);
+  })->RangeMultiplier(8)->Range(1 << 10, 1 << 20);
+
+  if (!captured_ranges_path.empty()) {
+    std::string content;
+    if (!android::base::ReadFileToString(captured_ranges_path, &content)) {
+      PLOG(FATAL) << "Failed to read " << captured_ranges_path;
+    }
+    RangeSet captured = RangeSet::Parse(android::base::Trim(content));
+    if (!captured) {
+      LOG(FATAL) << "Failed to parse the ranges in " << captured_ranges_path;
+    }
+    for (const auto& [name, run] : benchmarks) {
+      benchmark::RegisterBenchmark((std::string(name) + "/captured").c_str(),
+                                   [run, captured](benchmark::State& state) {
+                                     run(state, captured);
+                                   });
+    }
+  }
+  if (!captured_block_map_path.empty()) {
+    benchmark::RegisterBenchmark("BM_ParseBlockMapFile/captured", [](benchmark::State& state) {
+      ParseBlockMapFile(state, captured_block_map_path);
+    });
+  }
+}
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv);
+
+  std::vector<char*> benchmark_args;
+  for (int i = 0; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (android::base::ConsumePrefix(&arg, "--ranges=")) {
+      captured_ranges_path = arg;
+    } else if (android::base::ConsumePrefix(&arg, "--block_map=")) {
+      captured_block_map_path = arg;
+    } else {
+      benchmark_args.push_back(argv[i]);
+    }
+  }
+
+  int benchmark_argc = benchmark_args.size();
+  benchmark::Initialize(&benchmark_argc, benchmark_args.data());
+  if (benchmark::ReportUnrecognizedArguments(benchmark_argc, benchmark_args.data())) {
+    return 1;
+  }
+  RegisterBenchmarks();
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// End-to-end benchmarks of the block image updates, run through Updater::RunUpdate() with the
+// SimulatorRuntime as update_simulator runs a package. Each one builds a synthetic source
+// target-files with a raw system image, and a package that updates it:
+//   BM_FullUpdate         "new" commands writing the whole target image from system.new.dat.
+//   BM_IncrementalVerify  block_image_verify() of bsdiff commands patching the source image.
+//   BM_IncrementalUpdate  block_image_update() of the same commands.
+// Besides the throughput (of the image size), each reports the peak RSS, the read and write
+// syscalls of the process (from /proc/self/io) and the I/O counts of the commands from their
+// traces (see kTraceCommandsProperty in blockimg.cpp): the reads, writes, discards and fsyncs.
+// block_image_verify() writes no trace, so BM_IncrementalVerify only has the syscalls.
+//
+// The benchmarks are named BM_<phase>/<extents per command>. A command updates 1 MiB of the image,
+// split into that many extents spread across the image, like the files of a fragmented partition.
+// The image size can be set with
+//   recovery_update_benchmark [--image_size_mb=<n>] [<benchmark flags>]
+//
+// The packages of a fragmentation are built by its first benchmark, and its source image is
+// extracted once (through a SourceImageCache) then cloned for each run, outside of the timed part.
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <benchmark/benchmark.h>
+#include <bsdiff/bsdiff.h>
+#include <openssl/sha.h>
+#include <ziparchive/zip_writer.h>
+
+#include "common/peak_rss.h"
+#include "otautil/paths.h"
+#include "otautil/print_sha1.h"
+#include "otautil/rangeset.h"
+#include "updater/blockimg.h"
+#include "updater/build_info.h"
+#include "updater/install.h"
+#include "updater/simulator_runtime.h"
+#include "updater/updater.h"
+
+static constexpr size_t kBlockSize = 4096;
+// The blocks updated by each command.
+static constexpr size_t kCommandBlocks = 256;
+// One byte in every that many blocks of the target image differs from the source image.
+static constexpr size_t kChangedBlockInterval = 16;
+
+static size_t image_blocks = 64 * 1024 * 1024 / kBlockSize;
+
+// The source target-files and the packages of a fragmentation.
+struct Update {
+  std::string source_target_files;
+  std::string full_package;
+  std::string verify_package;
+  std::string incremental_package;
+};
+
+// Holds all the files built by the benchmarks, including the cached source images.
+static std::unique_ptr<TemporaryDir> work_dir;
+
+static std::string Sha1Hex(std::string_view data) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(data.data()), data.size(), digest);
+  return print_sha1(digest);
+}
+
+static bool WriteZip(const std::string& path, const std::map<std::string, std::string>& entries) {
+  std::unique_ptr<FILE, decltype(&fclose)> zip_file(fopen(path.c_str(), "wbe"), fclose);
+  if (!zip_file) {
+    PLOG(ERROR) << "Failed to create " << path;
+    return false;
+  }
+  ZipWriter writer(zip_file.get());
+  for (const auto& [name, data] : entries) {
+    if (writer.StartEntry(name.c_str(), 0) != 0 ||
+        writer.WriteBytes(data.data(), data.size()) != 0 || writer.FinishEntry() != 0) {
+      LOG(ERROR) << "Failed to add " << name << " to " << path;
+      return false;
+    }
+  }
+  return writer.Finish() == 0;
+}
+
+static bool CreateBsdiffPatch(const std::string& source, const std::string& target,
+                              std::string* patch) {
+  TemporaryFile patch_file;
+  return bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(source.data()), source.size(),
+                        reinterpret_cast<const uint8_t*>(target.data()), target.size(),
+                        patch_file.path, nullptr) == 0 &&
+         android::base::ReadFileToString(patch_file.path, patch);
+}
+
+// Returns the blocks of |image| in |ranges|, in order.
+static std::string ReadRanges(const std::string& image, const RangeSet& ranges) {
+  std::string data;
+  for (const auto& [begin, end] : ranges) {
+    data.append(image, begin * kBlockSize, (end - begin) * kBlockSize);
+  }
+  return data;
+}
+
+// Writes the package at |path|, that runs |block_function| with the transfer list of |commands|.
+static bool WritePackage(const std::string& path, const std::string& block_function,
+                         const std::vector<std::string>& commands, size_t blocks_written,
+                         const std::string& new_data, const std::string& patch_data) {
+  std::vector<std::string> transfer_list = { "4", std::to_string(blocks_written), "0", "0" };
+  transfer_list.insert(transfer_list.end(), commands.begin(), commands.end());
+  std::string script =
+      block_function +
+      R"(("/dev/block/by-name/system", package_extract_file("system.transfer.list"), )"
+      R"("system.new.dat", "system.patch.dat") || abort("Failed to update system.");)";
+  return WriteZip(path, { { "system.new.dat", new_data },
+                          { "system.patch.dat", patch_data },
+                          { "system.transfer.list", android::base::Join(transfer_list, '\n') },
+                          { "META-INF/com/google/android/updater-script", script } });
+}
+
+// Builds the source target-files and the packages for |extents| extents per command, or returns
+// nullptr if they can't be built.
+static const Update* GetUpdate(size_t extents) {
+  static std::map<size_t, Update> updates;
+  if (auto it = updates.find(extents); it != updates.end()) {
+    return &it->second;
+  }
+
+  std::mt19937 random(extents);
+  std::string source(image_blocks * kBlockSize, '\0');
+  for (auto& byte : source) {
+    byte = static_cast<char>(random());
+  }
+  std::string target = source;
+  for (size_t block = 0; block < image_blocks; block += kChangedBlockInterval) {
+    target[block * kBlockSize + random() % kBlockSize] ^= 0xff;
+  }
+
+  // Extent |e| of command |c| is the |e| * |commands| + |c|-th run of |extent_blocks| blocks.
+  size_t commands = image_blocks / kCommandBlocks;
+  size_t extent_blocks = kCommandBlocks / extents;
+  std::vector<std::string> new_commands;
+  std::vector<std::string> bsdiff_commands;
+  std::string new_data;
+  std::string patch_data;
+  for (size_t c = 0; c < commands; c++) {
+    std::vector<Range> pairs;
+    for (size_t e = 0; e < extents; e++) {
+      size_t begin = (e * commands + c) * extent_blocks;
+      pairs.emplace_back(begin, begin + extent_blocks);
+    }
+    RangeSet ranges(std::move(pairs));
+    std::string source_data = ReadRanges(source, ranges);
+    std::string target_data = ReadRanges(target, ranges);
+
+    new_commands.push_back("new " + ranges.ToString());
+    new_data += target_data;
+
+    std::string patch;
+    if (!CreateBsdiffPatch(source_data, target_data, &patch)) {
+      LOG(ERROR) << "Failed to create the patch of command " << c;
+      return nullptr;
+    }
+    bsdiff_commands.push_back(android::base::StringPrintf(
+        "bsdiff %zu %zu %s %s %s %zu %s", patch_data.size(), patch.size(),
+        Sha1Hex(source_data).c_str(), Sha1Hex(target_data).c_str(), ranges.ToString().c_str(),
+        ranges.blocks(), ranges.ToString().c_str()));
+    patch_data += patch;
+  }
+
+  std::string fstab = "/dev/block/by-name/system /system ext4 ro,barrier=1 wait\n";
+  std::map<std::string, std::string> source_entries = {
+    { "META/misc_info.txt", "" },
+    { "RECOVERY/RAMDISK/etc/recovery.fstab", fstab },
+    { "SYSTEM/build.prop", "ro.product.system.device=benchmark\n" },
+    { "IMAGES/system.img", source },
+  };
+
+  std::string prefix = android::base::StringPrintf("%s/%zu_", work_dir->path, extents);
+  Update update = {
+    .source_target_files = prefix + "source.zip",
+    .full_package = prefix + "full.zip",
+    .verify_package = prefix + "verify.zip",
+    .incremental_package = prefix + "incremental.zip",
+  };
+  size_t blocks = commands * kCommandBlocks;
+  if (!WriteZip(update.source_target_files, source_entries) ||
+      !WritePackage(update.full_package, "block_image_update", new_commands, blocks, new_data,
+                    "") ||
+      !WritePackage(update.verify_package, "block_image_verify", bsdiff_commands, blocks, "",
+                    patch_data) ||
+      !WritePackage(update.incremental_package, "block_image_update", bsdiff_commands, blocks, "",
+                    patch_data)) {
+    return nullptr;
+  }
+  return &updates.emplace(extents, std::move(update)).first->second;
+}
+
+// The read and write syscalls of the process so far, from /proc/self/io.
+struct SyscallCounts {
+  uint64_t reads = 0;
+  uint64_t writes = 0;
+};
+
+static SyscallCounts GetSyscallCounts() {
+  SyscallCounts counts;
+  std::string io;
+  if (android::base::ReadFileToString("/proc/self/io", &io)) {
+    for (const auto& line : android::base::Split(io, "\n")) {
+      sscanf(line.c_str(), "syscr: %" SCNu64, &counts.reads);
+      sscanf(line.c_str(), "syscw: %" SCNu64, &counts.writes);
+    }
+  }
+  return counts;
+}
+
+// Adds up the columns of the command trace in |trace| into |totals|, by column name.
+static bool AddTrace(const std::string& trace, std::map<std::string, uint64_t>* totals) {
+  auto lines = android::base::Split(android::base::Trim(trace), "\n");
+  auto columns = android::base::Split(lines[0], ",");
+  for (size_t i = 1; i < lines.size(); i++) {
+    auto fields = android::base::Split(lines[i], ",");
+    if (fields.size() != columns.size()) {
+      return false;
+    }
+    // The partition, the index and the command come first.
+    for (size_t j = 3; j < fields.size(); j++) {
+      uint64_t value;
+      if (!android::base::ParseUint(fields[j], &value)) {
+        return false;
+      }
+      (*totals)[columns[j]] += value;
+    }
+  }
+  return true;
+}
+
+// Runs |package| against a fresh copy of the source images of |source_target_files|, and adds the
+// syscalls of the update and its command trace to |totals|. Only the update itself is timed.
+static bool RunPackage(benchmark::State& state, const std::string& source_target_files,
+                       const std::string& package, std::map<std::string, uint64_t>* totals) {
+  TemporaryFile temp_saved_source;
+  TemporaryFile temp_last_command;
+  TemporaryDir temp_stash_base;
+  TemporaryFile temp_update_trace;
+  Paths::Get().set_cache_temp_source(temp_saved_source.path);
+  Paths::Get().set_last_command_file(temp_last_command.path);
+  Paths::Get().set_stash_directory_base(temp_stash_base.path);
+  Paths::Get().set_temporary_update_trace_file(temp_update_trace.path);
+
+  TemporaryDir image_dir;
+  BuildInfo build_info(image_dir.path, false);
+  build_info.SetSourceCacheDir(work_dir->path);
+  if (!build_info.ParseTargetFile(source_target_files, false)) {
+    return false;
+  }
+  auto runtime = std::make_unique<SimulatorRuntime>(&build_info);
+  runtime->set_trace_commands(true);
+  Updater updater(std::move(runtime));
+  TemporaryFile cmd_pipe;
+  if (!updater.Init(cmd_pipe.release(), package, false)) {
+    return false;
+  }
+
+  SyscallCounts syscalls_before = GetSyscallCounts();
+  state.ResumeTiming();
+  bool succeeded = updater.RunUpdate();
+  state.PauseTiming();
+  SyscallCounts syscalls_after = GetSyscallCounts();
+  (*totals)["read_syscalls"] += syscalls_after.reads - syscalls_before.reads;
+  (*totals)["write_syscalls"] += syscalls_after.writes - syscalls_before.writes;
+
+  std::string trace;
+  return succeeded && android::base::ReadFileToString(temp_update_trace.path, &trace) &&
+         AddTrace(trace, totals);
+}
+
+using PackageOf = std::string Update::*;
+
+static void RunBenchmark(benchmark::State& state, PackageOf package) {
+  const Update* update = GetUpdate(state.range(0));
+  if (update == nullptr) {
+    state.SkipWithError("Failed to build the packages");
+    return;
+  }
+
+  ResetPeakRss();
+  std::map<std::string, uint64_t> totals;
+  for (auto _ : state) {
+    state.PauseTiming();
+    if (!RunPackage(state, update->source_target_files, update->*package, &totals)) {
+      state.SkipWithError("Failed to run the update");
+      return;
+    }
+    state.ResumeTiming();
+  }
+
+  state.SetBytesProcessed(state.iterations() * image_blocks * kBlockSize);
+  state.counters["peak_rss_kb"] = PeakRssKb();
+  auto average = benchmark::Counter::kAvgIterations;
+  for (const auto& name :
+       { "read_syscalls", "write_syscalls", "reads", "writes", "fsyncs", "discards" }) {
+    state.counters[name] = benchmark::Counter(totals[name], average);
+  }
+}
+
+static void BM_FullUpdate(benchmark::State& state) {
+  RunBenchmark(state, &Update::full_package);
+}
+
+static void BM_IncrementalVerify(benchmark::State& state) {
+  RunBenchmark(state, &Update::verify_package);
+}
+
+static void BM_IncrementalUpdate(benchmark::State& state) {
+  RunBenchmark(state, &Update::incremental_package);
+}
+
+// Contiguous commands, then increasingly fragmented ones.
+static void FragmentationArgs(benchmark::internal::Benchmark* b) {
+  b->Arg(1)->Arg(16)->Arg(256);
+}
+
+BENCHMARK(BM_FullUpdate)->Apply(FragmentationArgs)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_IncrementalVerify)
+    ->Apply(FragmentationArgs)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+BENCHMARK(BM_IncrementalUpdate)
+    ->Apply(FragmentationArgs)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv);
+  // The updater logs every command.
+  android::base::SetMinimumLogSeverity(android::base::WARNING);
+
+  std::vector<char*> benchmark_args;
+  for (int i = 0; i < argc; i++) {
+    std::string_view arg = argv[i];
+    uint64_t size_mb;
+    if (android::base::ConsumePrefix(&arg, "--image_size_mb=")) {
+      if (!android::base::ParseUint(std::string(arg), &size_mb) || size_mb == 0) {
+        fprintf(stderr, "Invalid %s\n", argv[i]);
+        return 1;
+      }
+      image_blocks = size_mb * 1024 * 1024 / kBlockSize;
+    } else {
+      benchmark_args.push_back(argv[i]);
+    }
+  }
+
+  int benchmark_argc = benchmark_args.size();
+  benchmark::Initialize(&benchmark_argc, benchmark_args.data());
+  if (benchmark::ReportUnrecognizedArguments(benchmark_argc, benchmark_args.data())) {
+    return 1;
+  }
+
+  RegisterBuiltins();
+  RegisterInstallFunctions();
+  RegisterBlockImageFunctions();
+  work_dir = std::make_unique<TemporaryDir>();
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "minui/minui.h"
+#include "private/resources.h"
+#include "recovery_ui/animation_frames.h"
+
+static constexpr size_t kWidth = 64;
+static constexpr size_t kHeight = 48;
+
+// Returns frame |index| of an animation: a 4x4 square moving across a static background.
+static std::unique_ptr<GRSurface> Frame(size_t index) {
+  auto frame = GRSurface::Create(kWidth, kHeight, kWidth * 4, 4);
+  for (size_t y = 0; y < kHeight; y++) {
+    uint32_t* row = reinterpret_cast<uint32_t*>(frame->data() + y * frame->row_bytes);
+    for (size_t x = 0; x < kWidth; x++) {
+      row[x] = x * 0x10000 + y;
+    }
+  }
+  for (size_t y = 20; y < 24; y++) {
+    uint32_t* row = reinterpret_cast<uint32_t*>(frame->data() + y * frame->row_bytes);
+    for (size_t x = 4 * index; x < 4 * index + 4; x++) {
+      row[x] = 0xffffffff;
+    }
+  }
+  return frame;
+}
+
+static std::vector<uint8_t> Pixels(const GRSurface* surface) {
+  return std::vector<uint8_t>(surface->data(),
+                              surface->data() + surface->row_bytes * surface->height);
+}
+
+TEST(AnimationFramesTest, Loop) {
+  static constexpr size_t kFrames = 8;
+  AnimationFrames frames(kFrames, true);
+  ASSERT_EQ(kFrames, frames.size());
+  ASSERT_EQ(nullptr, frames.current());
+
+  for (size_t i = 0; i < kFrames; i++) {
+    frames.Add(Frame(i));
+    ASSERT_EQ(i + 1, frames.added());
+    ASSERT_EQ(Pixels(Frame(i).get()), Pixels(frames.current())) << i;
+  }
+
+  // Twice round the loop, from the last frame back to the first.
+  for (size_t i = 0; i < 2 * kFrames; i++) {
+    frames.Show(i % kFrames);
+    ASSERT_EQ(Pixels(Frame(i % kFrames).get()), Pixels(frames.current())) << i;
+  }
+  frames.Show(2);
+  ASSERT_EQ(Pixels(Frame(2).get()), Pixels(frames.current()));
+
+  // The frame on show, plus the squares' moves (8x4 pixels, or 28x4 for the last to the first).
+  size_t frame_size = kWidth * kHeight * 4;
+  ASSERT_EQ(frame_size + (7 * 8 * 4 + 32 * 4) * 4, frames.data_size());
+}
+
+TEST(AnimationFramesTest, PlayOnce) {
+  AnimationFrames frames(3, false);
+  for (size_t i = 0; i < 3; i++) {
+    frames.Add(Frame(i));
+    ASSERT_EQ(Pixels(Frame(i).get()), Pixels(frames.current())) << i;
+    // Only the frame on show is kept.
+    ASSERT_EQ(kWidth * kHeight * 4, frames.data_size());
+  }
+
+  // Can't go back.
+  frames.Show(0);
+  ASSERT_EQ(Pixels(Frame(2).get()), Pixels(frames.current()));
+
+  frames.Clear();
+  ASSERT_EQ(3U, frames.size());
+  ASSERT_EQ(0U, frames.added());
+  ASSERT_EQ(nullptr, frames.current());
+}
+
+TEST(AnimationFramesTest, UnchangedAndMissingFrames) {
+  AnimationFrames frames(4, true);
+  frames.Add(Frame(0));
+  frames.Add(Frame(0));
+  // A frame that failed to load keeps the frame before it on show.
+  frames.Add(nullptr);
+  ASSERT_EQ(Pixels(Frame(0).get()), Pixels(frames.current()));
+
+  // A frame of another size replaces the frame on show.
+  auto small = GRSurface::Create(2, 2, 8, 4);
+  memset(small->data(), 0x5a, small->data_size());
+  frames.Add(small->Clone());
+  ASSERT_EQ(Pixels(small.get()), Pixels(frames.current()));
+
+  frames.Show(0);
+  ASSERT_EQ(Pixels(Frame(0).get()), Pixels(frames.current()));
+  frames.Show(3);
+  ASSERT_EQ(Pixels(small.get()), Pixels(frames.current()));
+}
+
+TEST(AnimationFramesTest, Rotated) {
+  for (auto rotation : { GRRotation::RIGHT, GRRotation::DOWN, GRRotation::LEFT }) {
+    auto rotated_frame = [rotation](size_t index) {
+      auto frame = Frame(index);
+      PrerotateSurface(frame.get(), rotation);
+      return frame;
+    };
+
+    AnimationFrames frames(3, true);
+    for (size_t i = 0; i < 3; i++) {
+      frames.Add(rotated_frame(i));
+    }
+    for (size_t i = 0; i < 6; i++) {
+      frames.Show(i % 3);
+      auto expected = rotated_frame(i % 3);
+      ASSERT_EQ(rotation, frames.current()->rotated_for);
+      ASSERT_EQ(Pixels(expected->rotated.get()), Pixels(frames.current()->rotated.get()))
+          << static_cast<int>(rotation) << " " << i;
+    }
+  }
+}
+
+TEST(AnimationFramesTest, Freeze) {
+  AnimationFrames frames(4, true);
+  frames.Add(Frame(0));
+  frames.Add(Frame(1));
+  frames.Freeze();
+  // Only the frame on show is kept, and stays on show.
+  ASSERT_EQ(kWidth * kHeight * 4, frames.data_size());
+  ASSERT_EQ(Pixels(Frame(1).get()), Pixels(frames.current()));
+
+  frames.Add(Frame(2));
+  ASSERT_EQ(2U, frames.added());
+  frames.Show(0);
+  ASSERT_EQ(Pixels(Frame(1).get()), Pixels(frames.current()));
+}
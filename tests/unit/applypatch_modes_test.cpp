@@ -193,6 +193,64 @@ TEST_F(ApplyPatchModesTest, CheckModeNonEmmcTarget) {
   ASSERT_NE(0, InvokeApplyPatchModes({ "applypatch", "--check", from_testdata_base("boot.img") }));
 }
 
+TEST_F(ApplyPatchModesTest, BatchMode) {
+  // A second target patched from the same source, and one flashed.
+  TemporaryFile patched_file;
+  std::string recovery_file = from_testdata_base("recovery.img");
+  std::string patched_target = GetEmmcTargetString(recovery_file, patched_file.path);
+  TemporaryFile flashed_file;
+  std::string flashed_target = GetEmmcTargetString(recovery_file, flashed_file.path);
+
+  TemporaryFile manifest;
+  std::string patch = from_testdata_base("recovery-from-boot.p");
+  std::string bonus = from_testdata_base("bonus.file");
+  std::string content = "# Patches from boot.img.\n"
+                        "patch " + target + " " + source + " " + patch + " " + bonus + "\n"
+                        "patch " + patched_target + "  " + source + " " + patch + " " + bonus + "\n"
+                        "\n"
+                        "flash " + flashed_target + " " + recovery_file + "\n"
+                        "check " + recovery + "\n";
+  ASSERT_TRUE(android::base::WriteStringToFile(content, manifest.path));
+  ASSERT_EQ(0, InvokeApplyPatchModes({ "applypatch", "--batch", manifest.path }));
+  VerifyPatchedTarget(target);
+  VerifyPatchedTarget(patched_target);
+  VerifyPatchedTarget(flashed_target);
+
+  // Running it again finds all the targets already done.
+  ASSERT_EQ(0, InvokeApplyPatchModes({ "applypatch", "--batch", manifest.path }));
+}
+
+TEST_F(ApplyPatchModesTest, BatchModeFailedEntry) {
+  // The target isn't patched yet, but the other entries still run.
+  TemporaryFile manifest;
+  std::string content = "check " + target + "\n"
+                        "check " + recovery + "\n";
+  ASSERT_TRUE(android::base::WriteStringToFile(content, manifest.path));
+  ASSERT_EQ(1, InvokeApplyPatchModes({ "applypatch", "--batch", manifest.path }));
+}
+
+TEST_F(ApplyPatchModesTest, BatchModeInvalidManifest) {
+  TemporaryFile manifest;
+  auto run_batch = [&manifest](const std::string& content) {
+    EXPECT_TRUE(android::base::WriteStringToFile(content, manifest.path));
+    return InvokeApplyPatchModes({ "applypatch", "--batch", manifest.path });
+  };
+
+  ASSERT_EQ(2, InvokeApplyPatchModes({ "applypatch", "--batch", "/doesntexist" }));
+  ASSERT_EQ(2, run_batch("verify " + recovery + "\n"));
+  ASSERT_EQ(2, run_batch("check " + recovery + " " + source + "\n"));
+  ASSERT_EQ(2, run_batch("patch " + target + " " + source + "\n"));
+  ASSERT_EQ(2, run_batch("check " + from_testdata_base("boot.img") + "\n"));
+
+  // An entry may not write what another one reads or writes.
+  std::string recovery_file = from_testdata_base("recovery.img");
+  ASSERT_EQ(2, run_batch("check " + target + "\n"
+                         "flash " + target + " " + recovery_file + "\n"));
+  std::string patch = from_testdata_base("recovery-from-boot-with-bonus.p");
+  ASSERT_EQ(2, run_batch("patch " + target + " " + source + " " + patch + "\n"
+                         "flash " + source + " " + from_testdata_base("boot.img") + "\n"));
+}
+
 TEST_F(ApplyPatchModesTest, ShowLicenses) {
   ASSERT_EQ(0, InvokeApplyPatchModes({ "applypatch", "--license" }));
 }
@@ -154,6 +154,19 @@ TEST_F(ApplyPatchTest, PatchPartitionWithoutBonusFile) {
   ASSERT_TRUE(PatchPartition(target_partition, source_partition, patch, nullptr, false));
 }
 
+TEST_F(ApplyPatchTest, FlashPartition) {
+  ASSERT_TRUE(FlashPartition(target_partition, target_file));
+  ASSERT_TRUE(CheckPartition(target_partition));
+
+  // Flashing again finds the partition already up to date.
+  ASSERT_TRUE(FlashPartition(target_partition, target_file));
+}
+
+TEST_F(ApplyPatchTest, FlashPartition_MismatchingSource) {
+  ASSERT_FALSE(FlashPartition(target_partition, source_file));
+  ASSERT_FALSE(CheckPartition(target_partition));
+}
+
 class FreeCacheTest : public ::testing::Test {
  protected:
   static constexpr size_t PARTITION_SIZE = 4096 * 10;
@@ -222,6 +235,35 @@ TEST_F(FreeCacheTest, FreeCacheSmoke) {
   ASSERT_EQ(4096 * 9, MockFreeSpaceChecker(mock_cache.path));
 }
 
+TEST_F(FreeCacheTest, FreeCacheChecksSpaceOnce) {
+  std::vector<std::string> files = { "file1", "file2", "file3" };
+  AddFilesToDir(mock_cache.path, files);
+
+  // The files to delete are planned by their sizes, so the free space is checked before and after.
+  size_t checks = 0;
+  auto checker = [&checks](const std::string& dirname) -> int64_t {
+    checks++;
+    return MockFreeSpaceChecker(dirname);
+  };
+  ASSERT_TRUE(RemoveFilesInDirectory(4096 * 9, mock_cache.path, checker));
+  ASSERT_EQ(std::vector<std::string>{ "file3" }, FindFilesInDir(mock_cache.path));
+  ASSERT_EQ(2U, checks);
+}
+
+TEST_F(FreeCacheTest, FreeCachePlanFallsShort) {
+  std::vector<std::string> files = { "file1", "file2", "file3", "file4" };
+  AddFilesToDir(mock_cache.path, files);
+
+  // Each file frees only half the space it's expected to, so the plan of one file falls short, and
+  // another file is deleted afterwards.
+  auto checker = [](const std::string& dirname) -> int64_t {
+    return 4096 * 5 - 2048 * FindFilesInDir(dirname).size();
+  };
+  ASSERT_EQ(4096 * 3, checker(mock_cache.path));
+  ASSERT_TRUE(RemoveFilesInDirectory(4096 * 4, mock_cache.path, checker));
+  ASSERT_EQ((std::vector<std::string>{ "file3", "file4" }), FindFilesInDir(mock_cache.path));
+}
+
 TEST_F(FreeCacheTest, FreeCacheFreeSpaceCheckerError) {
   std::vector<std::string> files{ "file1", "file2", "file3" };
   AddFilesToDir(mock_cache.path, files);
@@ -247,6 +289,26 @@ TEST_F(FreeCacheTest, FreeCacheOpenFile) {
   ASSERT_EQ(std::vector<std::string>{ "file1" }, FindFilesInDir(mock_cache.path));
 }
 
+TEST_F(FreeCacheTest, FreeCacheOpenFileThroughHardLink) {
+  std::vector<std::string> files = { "file1", "file2" };
+  AddFilesToDir(mock_cache.path, files);
+
+  // file1 is open by us through another name, which is gone by the time the cache is cleaned up.
+  std::string file1_path = mock_cache.path + "/file1"s;
+  std::string link_path = mock_cache.path + "/subdir"s;
+  ASSERT_EQ(0, mkdir(link_path.c_str(), 0755));
+  link_path += "/link";
+  ASSERT_EQ(0, link(file1_path.c_str(), link_path.c_str()));
+  android::base::unique_fd fd(open(link_path.c_str(), O_RDONLY));
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(0, unlink(link_path.c_str()));
+  ASSERT_EQ(0, rmdir(android::base::Dirname(link_path).c_str()));
+
+  // file1 can't be deleted, as the open file is matched by inode rather than by path.
+  ASSERT_FALSE(RemoveFilesInDirectory(4096 * 10, mock_cache.path, MockFreeSpaceChecker));
+  ASSERT_EQ(std::vector<std::string>{ "file1" }, FindFilesInDir(mock_cache.path));
+}
+
 TEST_F(FreeCacheTest, FreeCacheLogsSmoke) {
   std::vector<std::string> log_files = { "last_log", "last_log.1", "last_kmsg.2", "last_log.5",
                                          "last_log.10" };
@@ -199,3 +199,71 @@ TEST(Asn1DecoderTest, OctetStringGet_Success) {
   ASSERT_EQ(1U, length);
   ASSERT_EQ(0xAAU, *string);
 }
+
+TEST(Asn1DecoderTest, ElementGet_Success) {
+  uint8_t data[] = { 0x30, 0x03, 0x02, 0x01, 0x01, 0x04, 0x01, 0xAA };
+  asn1_context ctx(data, sizeof(data));
+  const uint8_t* element;
+  size_t length;
+  ASSERT_TRUE(ctx.asn1_element_get(&element, &length));
+  ASSERT_EQ(5U, length);
+  ASSERT_EQ(data, element);
+
+  // The element is skipped, including its contents.
+  const uint8_t* string;
+  ASSERT_TRUE(ctx.asn1_octet_string_get(&string, &length));
+  ASSERT_EQ(1U, length);
+  ASSERT_EQ(0xAAU, *string);
+}
+
+TEST(Asn1DecoderTest, ElementGet_TooSmall_Failure) {
+  uint8_t data[] = { 0x30, 0x03, 0x02 };
+  asn1_context ctx(data, sizeof(data));
+  const uint8_t* element;
+  size_t length;
+  ASSERT_FALSE(ctx.asn1_element_get(&element, &length));
+}
+
+TEST(Asn1DecoderTest, ValueGet_Empty_Failure) {
+  uint8_t empty[] = {};
+  asn1_context ctx(empty, sizeof(empty));
+  asn1_context child;
+  ASSERT_FALSE(ctx.asn1_constructed_get(&child));
+  ASSERT_FALSE(ctx.asn1_sequence_get(&child));
+  ASSERT_FALSE(ctx.asn1_set_get(&child));
+}
+
+TEST(Asn1DecoderTest, ValueGet_LengthTooBig_Failure) {
+  uint8_t constructed[] = { 0xA0, 0x8a, 0xA5, 0x5A, 0xA5, 0x5A,
+                            0xA5, 0x5A, 0xA5, 0x5A, 0xA5, 0x5A };
+  asn1_context constructed_ctx(constructed, sizeof(constructed));
+  asn1_context child;
+  ASSERT_FALSE(constructed_ctx.asn1_constructed_get(&child));
+
+  uint8_t sequence[] = { 0x30, 0x03, 0x01, 0x00 };
+  asn1_context sequence_ctx(sequence, sizeof(sequence));
+  ASSERT_FALSE(sequence_ctx.asn1_sequence_get(&child));
+
+  uint8_t set[] = { 0x31, 0x82, 0x00 };
+  asn1_context set_ctx(set, sizeof(set));
+  ASSERT_FALSE(set_ctx.asn1_set_get(&child));
+}
+
+TEST(Asn1DecoderTest, ValueGet_Nested_Success) {
+  uint8_t data[] = { 0xA3, 0x08, 0x30, 0x06, 0x31, 0x04, 0x04, 0x02, 0x55, 0xAA };
+  asn1_context ctx(data, sizeof(data));
+  asn1_context constructed;
+  ASSERT_TRUE(ctx.asn1_constructed_get(&constructed));
+  ASSERT_EQ(3, constructed.asn1_constructed_type());
+  asn1_context sequence;
+  ASSERT_TRUE(constructed.asn1_sequence_get(&sequence));
+  asn1_context set;
+  ASSERT_TRUE(sequence.asn1_set_get(&set));
+
+  const uint8_t* string;
+  size_t length;
+  ASSERT_TRUE(set.asn1_octet_string_get(&string, &length));
+  ASSERT_EQ(2U, length);
+  ASSERT_EQ(0x55U, string[0]);
+  ASSERT_EQ(0xAAU, string[1]);
+}
@@ -25,3 +25,16 @@ TEST(BatteryInfoTest, GetBatteryInfo) {
   ASSERT_LE(0, info.capacity);
   ASSERT_LE(info.capacity, 100);
 }
+
+TEST(BatteryInfoTest, BatterySampler) {
+  auto& sampler = BatterySampler::Get();
+  auto info = sampler.Wait();
+  ASSERT_LE(0, info.capacity);
+  ASSERT_LE(info.capacity, 100);
+
+  // Once there's a sample, it's there for the taking.
+  auto latest = sampler.Latest();
+  ASSERT_TRUE(latest.has_value());
+  ASSERT_LE(0, latest->capacity);
+  ASSERT_LE(latest->capacity, 100);
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "minui/minui.h"
+#include "recovery_ui/bitmap_loader.h"
+
+// Returns a job that loads a 1x1 bitmap of height |index| + 1, counting the calls in |runs|.
+static BitmapLoader::Job BitmapJob(size_t index, std::atomic<int>* runs) {
+  return [index, runs]() {
+    (*runs)++;
+    return GRSurface::Create(1, index + 1, 1, 1);
+  };
+}
+
+TEST(BitmapLoaderTest, Take) {
+  std::atomic<int> runs = 0;
+  std::vector<BitmapLoader::Job> jobs;
+  for (size_t i = 0; i < 10; i++) {
+    jobs.push_back(BitmapJob(i, &runs));
+  }
+  BitmapLoader loader(std::move(jobs), 3);
+  for (size_t i : { 9, 0, 5, 1, 2, 3, 4, 6, 7, 8 }) {
+    auto bitmap = loader.Take(i);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(i + 1, bitmap->height);
+  }
+  ASSERT_EQ(10, runs);
+
+  // Each bitmap can be taken once.
+  ASSERT_EQ(nullptr, loader.Take(0));
+  ASSERT_EQ(nullptr, loader.Take(10));
+}
+
+TEST(BitmapLoaderTest, NoThreads) {
+  std::atomic<int> runs = 0;
+  BitmapLoader loader({ BitmapJob(0, &runs), BitmapJob(1, &runs) }, 0);
+  ASSERT_EQ(0, runs);
+
+  // Each job runs as it's taken.
+  auto bitmap = loader.Take(1);
+  ASSERT_NE(nullptr, bitmap);
+  ASSERT_EQ(2U, bitmap->height);
+  ASSERT_EQ(1, runs);
+}
+
+TEST(BitmapLoaderTest, FailedJob) {
+  BitmapLoader loader({ []() { return nullptr; } }, 1);
+  ASSERT_EQ(nullptr, loader.Take(0));
+}
+
+TEST(BitmapLoaderTest, DropsPendingJobs) {
+  std::atomic<int> runs = 0;
+  {
+    std::vector<BitmapLoader::Job> jobs;
+    for (size_t i = 0; i < 10; i++) {
+      jobs.push_back([&runs]() {
+        runs++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return GRSurface::Create(1, 1, 1, 1);
+      });
+    }
+    BitmapLoader loader(std::move(jobs), 1);
+    ASSERT_NE(nullptr, loader.Take(0));
+  }
+  // The job in progress finishes, but not the ones behind it.
+  ASSERT_LT(runs, 10);
+}
+
+TEST(BitmapLoaderTest, MaxAhead) {
+  std::atomic<int> runs = 0;
+  std::vector<BitmapLoader::Job> jobs;
+  for (size_t i = 0; i < 10; i++) {
+    jobs.push_back(BitmapJob(i, &runs));
+  }
+  BitmapLoader loader(std::move(jobs), 4, 2);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  ASSERT_EQ(2, runs);
+
+  // Taking a bitmap lets the threads load the next one.
+  ASSERT_NE(nullptr, loader.Take(0));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  ASSERT_EQ(3, runs);
+
+  for (size_t i = 1; i < 10; i++) {
+    auto bitmap = loader.Take(i);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(i + 1, bitmap->height);
+  }
+  ASSERT_EQ(10, runs);
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "block_cache.h"
+
+static constexpr uint32_t kBlockSize = 4096;
+
+static std::vector<uint8_t> Block(uint8_t value) {
+  return std::vector<uint8_t>(kBlockSize, value);
+}
+
+TEST(BlockCacheTest, FetchAndEnter) {
+  BlockCache cache(kBlockSize, 10, 4);
+  std::vector<uint8_t> data(kBlockSize);
+  ASSERT_FALSE(cache.Fetch(3, data.data()));
+
+  cache.Enter(3, Block('a').data());
+  ASSERT_TRUE(cache.Fetch(3, data.data()));
+  ASSERT_EQ(Block('a'), data);
+
+  // Entering a cached block again replaces its contents.
+  cache.Enter(3, Block('b').data());
+  ASSERT_TRUE(cache.Fetch(3, data.data()));
+  ASSERT_EQ(Block('b'), data);
+
+  ASSERT_EQ(1U, cache.size());
+  ASSERT_EQ(2U, cache.hits());
+  ASSERT_EQ(1U, cache.misses());
+}
+
+TEST(BlockCacheTest, Lookup) {
+  BlockCache cache(kBlockSize, 10, 4);
+  ASSERT_EQ(nullptr, cache.Lookup(2));
+
+  cache.Enter(2, Block('a').data());
+  const uint8_t* cached = cache.Lookup(2);
+  ASSERT_NE(nullptr, cached);
+  ASSERT_EQ(Block('a'), std::vector<uint8_t>(cached, cached + kBlockSize));
+
+  // Only hits are counted; a miss is left for the Fetch() that follows it.
+  ASSERT_EQ(1U, cache.hits());
+  ASSERT_EQ(0U, cache.misses());
+}
+
+TEST(BlockCacheTest, EvictsLeastRecentlyUsed) {
+  BlockCache cache(kBlockSize, 10, 3);
+  for (uint32_t block = 0; block < 3; block++) {
+    cache.Enter(block, Block('0' + block).data());
+  }
+
+  // Touch block 0, so that block 1 becomes the least recently used.
+  std::vector<uint8_t> data(kBlockSize);
+  ASSERT_TRUE(cache.Fetch(0, data.data()));
+
+  cache.Enter(5, Block('5').data());
+  ASSERT_EQ(3U, cache.size());
+  ASSERT_EQ(1U, cache.evictions());
+  ASSERT_FALSE(cache.Fetch(1, data.data()));
+
+  for (uint32_t block : { 0, 2, 5 }) {
+    ASSERT_TRUE(cache.Fetch(block, data.data())) << block;
+    ASSERT_EQ(Block('0' + block), data);
+  }
+}
+
+TEST(BlockCacheTest, SpansSlabs) {
+  // 1 MiB slabs hold 16 blocks of 64 KiB, so 40 blocks take three slabs (the last one partial).
+  static constexpr uint32_t kLargeBlockSize = 65536;
+  BlockCache cache(kLargeBlockSize, 100, 40);
+  for (uint32_t block = 0; block < 100; block++) {
+    cache.Enter(block, std::vector<uint8_t>(kLargeBlockSize, block).data());
+  }
+  ASSERT_EQ(40U, cache.size());
+  ASSERT_EQ(60U, cache.evictions());
+
+  std::vector<uint8_t> data(kLargeBlockSize);
+  for (uint32_t block = 0; block < 100; block++) {
+    if (block < 60) {
+      ASSERT_FALSE(cache.Fetch(block, data.data())) << block;
+    } else {
+      ASSERT_TRUE(cache.Fetch(block, data.data())) << block;
+      ASSERT_EQ(std::vector<uint8_t>(kLargeBlockSize, block), data);
+    }
+  }
+}
+
+TEST(BlockCacheTest, Disabled) {
+  BlockCache cache(kBlockSize, 10, 0);
+  cache.Enter(1, Block('a').data());
+
+  std::vector<uint8_t> data(kBlockSize);
+  ASSERT_FALSE(cache.Fetch(1, data.data()));
+  ASSERT_EQ(0U, cache.size());
+}
+
+TEST(BlockCacheTest, CapsAtFileSize) {
+  BlockCache cache(kBlockSize, 2, 100);
+  ASSERT_EQ(2U, cache.max_size());
+
+  // Blocks past the end of the file are never cached.
+  cache.Enter(2, Block('a').data());
+  std::vector<uint8_t> data(kBlockSize);
+  ASSERT_FALSE(cache.Fetch(2, data.data()));
+}
+
+TEST(BlockCacheTest, PinnedBlocksAreNotEvicted) {
+  BlockCache cache(kBlockSize, 10, 3);
+  ASSERT_TRUE(cache.Pin(0, Block('0').data()));
+  ASSERT_TRUE(cache.Pin(1, Block('1').data()));
+  // The last slot is kept for unpinned blocks.
+  ASSERT_FALSE(cache.Pin(2, Block('2').data()));
+  ASSERT_EQ(2U, cache.pinned());
+
+  // Sequential reads cycle through the one unpinned slot, and leave the pinned blocks alone.
+  std::vector<uint8_t> data(kBlockSize);
+  for (uint32_t block = 2; block < 10; block++) {
+    cache.Enter(block, Block('0' + block).data());
+    ASSERT_TRUE(cache.Fetch(0, data.data()));
+  }
+  ASSERT_EQ(3U, cache.size());
+  ASSERT_EQ(7U, cache.evictions());
+  for (uint32_t block : { 0, 1, 9 }) {
+    ASSERT_TRUE(cache.Fetch(block, data.data())) << block;
+    ASSERT_EQ(Block('0' + block), data);
+  }
+
+  // Entering a pinned block again replaces its contents, and keeps it pinned.
+  cache.Enter(1, Block('x').data());
+  ASSERT_EQ(2U, cache.pinned());
+  ASSERT_TRUE(cache.Fetch(1, data.data()));
+  ASSERT_EQ(Block('x'), data);
+}
+
+TEST(BlockCacheTest, PinCachedBlock) {
+  BlockCache cache(kBlockSize, 10, 2);
+  cache.Enter(4, Block('a').data());
+  ASSERT_TRUE(cache.Pin(4, Block('b').data()));
+  ASSERT_EQ(1U, cache.size());
+
+  cache.Enter(5, Block('5').data());
+  cache.Enter(6, Block('6').data());
+  std::vector<uint8_t> data(kBlockSize);
+  ASSERT_TRUE(cache.Fetch(4, data.data()));
+  ASSERT_EQ(Block('b'), data);
+  ASSERT_FALSE(cache.Fetch(5, data.data()));
+}
+
+TEST(BlockCacheTest, Shrink) {
+  // 1 MiB slabs hold 16 blocks of 64 KiB.
+  static constexpr uint32_t kLargeBlockSize = 65536;
+  BlockCache cache(kLargeBlockSize, 100, 40);
+  ASSERT_TRUE(cache.Pin(0, std::vector<uint8_t>(kLargeBlockSize, 0).data()));
+  for (uint32_t block = 1; block < 40; block++) {
+    cache.Enter(block, std::vector<uint8_t>(kLargeBlockSize, block).data());
+  }
+  // Touch block 1, so that it's kept over the most recently entered ones.
+  std::vector<uint8_t> data(kLargeBlockSize);
+  ASSERT_TRUE(cache.Fetch(1, data.data()));
+
+  cache.Shrink(10);
+  ASSERT_EQ(10U, cache.max_size());
+  ASSERT_EQ(10U, cache.size());
+  ASSERT_EQ(30U, cache.evictions());
+  for (uint32_t block = 0; block < 40; block++) {
+    bool cached = block <= 1 || block >= 32;
+    ASSERT_EQ(cached, cache.Fetch(block, data.data())) << block;
+    if (cached) {
+      ASSERT_EQ(std::vector<uint8_t>(kLargeBlockSize, block), data);
+    }
+  }
+
+  // The cache keeps working as before, at the new size.
+  for (uint32_t block = 50; block < 60; block++) {
+    cache.Enter(block, std::vector<uint8_t>(kLargeBlockSize, block).data());
+  }
+  ASSERT_EQ(10U, cache.size());
+  ASSERT_TRUE(cache.Fetch(0, data.data()));
+  ASSERT_EQ(std::vector<uint8_t>(kLargeBlockSize, 0), data);
+  for (uint32_t block = 51; block < 60; block++) {
+    ASSERT_TRUE(cache.Fetch(block, data.data())) << block;
+    ASSERT_EQ(std::vector<uint8_t>(kLargeBlockSize, block), data);
+  }
+
+  // Pinned blocks are never evicted, and one slot is left for the others.
+  cache.Shrink(0);
+  ASSERT_EQ(2U, cache.max_size());
+  ASSERT_TRUE(cache.Fetch(0, data.data()));
+  ASSERT_EQ(1U, cache.pinned());
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "otautil/block_hash.h"
+
+// Returns |count| blocks of |block_size| bytes, each of different contents.
+static std::vector<uint8_t> MakeBlocks(size_t block_size, size_t count) {
+  std::vector<uint8_t> data(block_size * count);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i * 7 + i / block_size);
+  }
+  return data;
+}
+
+// Returns the digests of the salted blocks, hashed with SHA256() and SHA1().
+static std::vector<uint8_t> ExpectedDigests(BlockHashAlgorithm algorithm,
+                                            const std::vector<uint8_t>& data, size_t block_size,
+                                            const std::vector<uint8_t>& salt) {
+  std::vector<uint8_t> digests;
+  for (size_t offset = 0; offset < data.size(); offset += block_size) {
+    std::vector<uint8_t> message(salt);
+    message.insert(message.end(), data.begin() + offset, data.begin() + offset + block_size);
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    if (algorithm == BlockHashAlgorithm::kSha256) {
+      SHA256(message.data(), message.size(), digest);
+    } else {
+      SHA1(message.data(), message.size(), digest);
+    }
+    digests.insert(digests.end(), digest, digest + BlockDigestSize(algorithm));
+  }
+  return digests;
+}
+
+TEST(BlockHashTest, MatchesSha) {
+  std::vector<std::vector<uint8_t>> salts = { {}, std::vector<uint8_t>(32, 0xa5),
+                                              std::vector<uint8_t>(70, 0x5a) };
+  // Block sizes that end at each spot of the padding.
+  for (size_t block_size : { 1, 55, 56, 64, 100, 4096, 65536 }) {
+    for (const auto& salt : salts) {
+      for (size_t count : { 1, 4, 9 }) {
+        auto data = MakeBlocks(block_size, count);
+        for (auto algorithm : { BlockHashAlgorithm::kSha1, BlockHashAlgorithm::kSha256 }) {
+          auto expected = ExpectedDigests(algorithm, data, block_size, salt);
+          for (auto implementation :
+               { BlockHashImplementation::kOneAtATime, BlockHashImplementation::kMultiBuffer }) {
+            std::vector<uint8_t> digests(count * BlockDigestSize(algorithm));
+            HashBlocksWith(implementation, algorithm, data.data(), block_size, count,
+                           digests.data(), salt.data(), salt.size());
+            ASSERT_EQ(expected, digests)
+                << "block size " << block_size << ", salt size " << salt.size() << ", count "
+                << count << ", implementation " << static_cast<int>(implementation);
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(BlockHashTest, HashBlocks) {
+  auto data = MakeBlocks(4096, 6);
+  std::vector<uint8_t> digests(6 * SHA256_DIGEST_LENGTH);
+  HashBlocks(BlockHashAlgorithm::kSha256, data.data(), 4096, 6, digests.data());
+  ASSERT_EQ(ExpectedDigests(BlockHashAlgorithm::kSha256, data, 4096, {}), digests);
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "otautil/rangeset.h"
+#include "private/block_io.h"
+
+static constexpr size_t kBlockSize = 4096;
+
+// Returns an image of 'blocks' blocks, where each block is filled with its block number.
+static std::string MakeImage(size_t blocks) {
+  std::string image;
+  for (size_t i = 0; i < blocks; i++) {
+    image += std::string(kBlockSize, static_cast<char>('a' + i));
+  }
+  return image;
+}
+
+TEST(BlockIoTest, ReadBlocksAt) {
+  TemporaryFile temp_file;
+  std::string image = MakeImage(10);
+  ASSERT_TRUE(android::base::WriteStringToFile(image, temp_file.path));
+
+  // Adjacent ranges get merged; the output follows the order in the RangeSet.
+  RangeSet ranges = RangeSet::Parse("6,7,9,9,10,1,3");
+  std::vector<uint8_t> buffer(ranges.blocks() * kBlockSize);
+  ASSERT_TRUE(ReadBlocksAt(temp_file.fd, ranges, kBlockSize, buffer.data()));
+
+  std::string expected = image.substr(7 * kBlockSize, 3 * kBlockSize) +
+                         image.substr(1 * kBlockSize, 2 * kBlockSize);
+  ASSERT_EQ(expected, std::string(buffer.begin(), buffer.end()));
+
+  // The file offset is left untouched.
+  ASSERT_EQ(0, lseek(temp_file.fd, 0, SEEK_CUR));
+}
+
+TEST(BlockIoTest, ReadBlocksAt_PastEnd) {
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(MakeImage(2), temp_file.path));
+
+  RangeSet ranges = RangeSet::Parse("2,1,3");
+  std::vector<uint8_t> buffer(ranges.blocks() * kBlockSize);
+  ASSERT_FALSE(ReadBlocksAt(temp_file.fd, ranges, kBlockSize, buffer.data()));
+}
+
+TEST(BlockIoTest, ReadBlocksAt_Locations) {
+  TemporaryFile temp_file;
+  std::string image = MakeImage(10);
+  ASSERT_TRUE(android::base::WriteStringToFile(image, temp_file.path));
+
+  // Blocks 7-9 go to 4-5 and 0, blocks 1-2 to 1 and 6; blocks 2-3 of the buffer are left alone.
+  RangeSet ranges = RangeSet::Parse("4,7,10,1,3");
+  RangeSet locations = RangeSet::Parse("6,4,6,0,2,6,7");
+  std::vector<uint8_t> buffer(7 * kBlockSize, 'x');
+  ASSERT_TRUE(ReadBlocksAt(temp_file.fd, ranges, kBlockSize, buffer.data(), locations));
+
+  std::string expected = image.substr(9 * kBlockSize, kBlockSize) +
+                         image.substr(1 * kBlockSize, kBlockSize) +
+                         std::string(2 * kBlockSize, 'x') +
+                         image.substr(7 * kBlockSize, 2 * kBlockSize) +
+                         image.substr(2 * kBlockSize, kBlockSize);
+  ASSERT_EQ(expected, std::string(buffer.begin(), buffer.end()));
+
+  // The block counts must match.
+  ASSERT_FALSE(ReadBlocksAt(temp_file.fd, ranges, kBlockSize, buffer.data(),
+                            RangeSet::Parse("2,0,4")));
+}
+
+TEST(BlockIoTest, ReadBlocksAt_ManyLocations) {
+  // More locations than a single preadv(2) call can take: block i goes to block 2099 - i.
+  constexpr size_t kBlocks = 2100;
+  TemporaryFile temp_file;
+  std::string image;
+  for (size_t i = 0; i < kBlocks; i++) {
+    image += std::string(kBlockSize, static_cast<char>(i));
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(image, temp_file.path));
+
+  std::vector<Range> reversed;
+  for (size_t i = kBlocks; i > 0; i--) {
+    reversed.emplace_back(i - 1, i);
+  }
+  std::vector<uint8_t> buffer(kBlocks * kBlockSize);
+  ASSERT_TRUE(ReadBlocksAt(temp_file.fd, RangeSet({ Range{ 0, kBlocks } }), kBlockSize,
+                           buffer.data(), RangeSet(std::move(reversed))));
+  for (size_t i = 0; i < kBlocks; i++) {
+    ASSERT_EQ(static_cast<uint8_t>(kBlocks - 1 - i), buffer[i * kBlockSize]) << i;
+  }
+}
+
+TEST(BlockIoTest, WriteBlocksAt) {
+  TemporaryFile temp_file;
+  std::string image = MakeImage(8);
+  ASSERT_TRUE(android::base::WriteStringToFile(image, temp_file.path));
+
+  RangeSet ranges = RangeSet::Parse("4,5,6,0,2");
+  std::string data = std::string(kBlockSize, 'x') + std::string(2 * kBlockSize, 'y');
+  ASSERT_TRUE(WriteBlocksAt(temp_file.fd, ranges, kBlockSize,
+                            reinterpret_cast<const uint8_t*>(data.data())));
+
+  image.replace(5 * kBlockSize, kBlockSize, data.substr(0, kBlockSize));
+  image.replace(0, 2 * kBlockSize, data.substr(kBlockSize));
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &updated));
+  ASSERT_EQ(image, updated);
+}
+
+TEST(BlockIoTest, ZeroBlocksAt) {
+  // Zero more blocks than a single pwritev(2) call can take.
+  constexpr size_t kBlocks = 2100;
+  TemporaryFile temp_file;
+  std::string image(kBlocks * kBlockSize, 'a');
+  ASSERT_TRUE(android::base::WriteStringToFile(image, temp_file.path));
+
+  RangeSet ranges = RangeSet::Parse("4,1,2,3,2099");
+  ASSERT_TRUE(ZeroBlocksAt(temp_file.fd, ranges, kBlockSize));
+
+  image.replace(1 * kBlockSize, kBlockSize, kBlockSize, '\0');
+  image.replace(3 * kBlockSize, 2096 * kBlockSize, 2096 * kBlockSize, '\0');
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &updated));
+  ASSERT_EQ(image, updated);
+}
+
+TEST(BlockIoTest, ZeroBlocksAt_PastEnd) {
+  // Like writing the zeros, zeroing the blocks past the end of a file extends it.
+  TemporaryFile temp_file;
+  std::string image = MakeImage(2);
+  ASSERT_TRUE(android::base::WriteStringToFile(image, temp_file.path));
+
+  RangeSet ranges = RangeSet::Parse("2,1,4");
+  ASSERT_TRUE(ZeroBlocksAt(temp_file.fd, ranges, kBlockSize));
+
+  image.replace(1 * kBlockSize, kBlockSize, kBlockSize, '\0');
+  image += std::string(2 * kBlockSize, '\0');
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &updated));
+  ASSERT_EQ(image, updated);
+}
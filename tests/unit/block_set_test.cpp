@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+
+#include <random>
+#include <set>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "otautil/block_set.h"
+#include "otautil/rangeset.h"
+
+// Returns the blocks of |set| one by one.
+static std::set<size_t> Blocks(const BlockSet& set) {
+  std::set<size_t> result;
+  for (const auto& [begin, end] : set.ToRangeSet()) {
+    for (size_t block = begin; block < end; block++) {
+      result.insert(block);
+    }
+  }
+  return result;
+}
+
+TEST(BlockSetTest, RangeSetConversions) {
+  BlockSet set(RangeSet::Parse("6,10,20,5,12,100000,100002"));
+  ASSERT_EQ(17U, set.blocks());
+  ASSERT_EQ(RangeSet::Parse("4,5,20,100000,100002"), set.ToRangeSet());
+
+  ASSERT_TRUE(set.Contains(5));
+  ASSERT_TRUE(set.Contains(100001));
+  ASSERT_FALSE(set.Contains(20));
+  ASSERT_FALSE(set.Contains(65541));
+
+  ASSERT_TRUE(BlockSet().empty());
+  ASSERT_FALSE(BlockSet().ToRangeSet());
+}
+
+TEST(BlockSetTest, DenseChunks) {
+  // Ranges across the chunks of 65536 blocks, with enough blocks to need bitmaps.
+  BlockSet set(RangeSet::Parse("4,60000,140000,200000,200001"));
+  ASSERT_EQ(80001U, set.blocks());
+  ASSERT_EQ(RangeSet::Parse("4,60000,140000,200000,200001"), set.ToRangeSet());
+
+  // Down to an array again, and back.
+  set -= BlockSet(RangeSet::Parse("2,61000,139990"));
+  ASSERT_EQ(RangeSet::Parse("6,60000,61000,139990,140000,200000,200001"), set.ToRangeSet());
+  set |= BlockSet(RangeSet::Parse("2,61000,139990"));
+  ASSERT_EQ(RangeSet::Parse("4,60000,140000,200000,200001"), set.ToRangeSet());
+  ASSERT_EQ(BlockSet(RangeSet::Parse("4,200000,200001,60000,140000")), set);
+}
+
+TEST(BlockSetTest, SetAlgebra) {
+  BlockSet a(RangeSet::Parse("4,0,100,200,300"));
+  BlockSet b(RangeSet::Parse("4,50,150,250,260"));
+
+  ASSERT_EQ(RangeSet::Parse("4,0,150,200,300"), (a | b).ToRangeSet());
+  ASSERT_EQ(RangeSet::Parse("4,50,100,250,260"), (a & b).ToRangeSet());
+  ASSERT_EQ(RangeSet::Parse("6,0,50,200,250,260,300"), (a - b).ToRangeSet());
+  ASSERT_EQ(RangeSet::Parse("2,100,150"), (b - a).ToRangeSet());
+
+  ASSERT_TRUE(a.Overlaps(b));
+  ASSERT_FALSE((a - b).Overlaps(b));
+  ASSERT_FALSE((a & b).empty());
+  ASSERT_TRUE((a - a).empty());
+}
+
+TEST(BlockSetTest, MatchesStdSet) {
+  std::mt19937 random(0);
+  // Sparse and dense sets, over a few chunks.
+  for (size_t max_length : { 10, 3000 }) {
+    std::vector<BlockSet> sets;
+    std::vector<std::set<size_t>> expected;
+    for (size_t i = 0; i < 4; i++) {
+      BlockSet set;
+      std::set<size_t> blocks;
+      for (size_t j = 0; j < 100; j++) {
+        size_t start = random() % 300000;
+        size_t length = random() % max_length + 1;
+        set.Insert({ start, start + length });
+        for (size_t block = start; block < start + length; block++) {
+          blocks.insert(block);
+        }
+      }
+      ASSERT_EQ(blocks.size(), set.blocks());
+      ASSERT_EQ(blocks, Blocks(set));
+      sets.push_back(std::move(set));
+      expected.push_back(std::move(blocks));
+    }
+
+    for (size_t i = 0; i < sets.size(); i++) {
+      for (size_t j = 0; j < sets.size(); j++) {
+        std::set<size_t> set_union;
+        std::set<size_t> intersection;
+        std::set<size_t> difference;
+        for (size_t block : expected[i]) {
+          (expected[j].count(block) ? intersection : difference).insert(block);
+          set_union.insert(block);
+        }
+        set_union.insert(expected[j].begin(), expected[j].end());
+
+        ASSERT_EQ(set_union, Blocks(sets[i] | sets[j]));
+        ASSERT_EQ(intersection, Blocks(sets[i] & sets[j]));
+        ASSERT_EQ(difference, Blocks(sets[i] - sets[j]));
+        ASSERT_EQ(intersection.size(), (sets[i] & sets[j]).blocks());
+        ASSERT_EQ(!intersection.empty(), sets[i].Overlaps(sets[j]));
+      }
+    }
+  }
+}
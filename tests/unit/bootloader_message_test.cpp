@@ -118,3 +118,50 @@ TEST(BootloaderMessageTest, update_bootloader_message_recovery_options_long) {
   ASSERT_EQ(std::string(sizeof(boot.reserved), '\0'),
             std::string(boot.reserved, sizeof(boot.reserved)));
 }
+
+TEST(BootloaderMessageTest, MiscPartition_WritesChangedFields) {
+  TemporaryFile temp_misc;
+  bootloader_message boot = {};
+  strlcpy(boot.command, "command", sizeof(boot.command));
+  strlcpy(boot.stage, "1/3", sizeof(boot.stage));
+  std::string err;
+  ASSERT_TRUE(write_bootloader_message_to(boot, temp_misc.path, &err)) << err;
+
+  auto misc = MiscPartition::OpenDevice(temp_misc.path, &err);
+  ASSERT_NE(nullptr, misc) << err;
+  bootloader_message boot_read;
+  ASSERT_TRUE(misc->ReadBootloaderMessage(&boot_read, &err)) << err;
+  ASSERT_STREQ("1/3", boot_read.stage);
+
+  // Change the command behind the accessor's back. The cached message is still returned, and
+  // only the stage is written.
+  bootloader_message outside = boot;
+  strlcpy(outside.command, "outside", sizeof(outside.command));
+  ASSERT_TRUE(write_bootloader_message_to(outside, temp_misc.path, &err)) << err;
+  ASSERT_TRUE(misc->ReadBootloaderMessage(&boot_read, &err)) << err;
+  ASSERT_STREQ("command", boot_read.command);
+
+  strlcpy(boot_read.stage, "2/3", sizeof(boot_read.stage));
+  ASSERT_TRUE(misc->WriteBootloaderMessage(boot_read, &err)) << err;
+
+  bootloader_message boot_verify;
+  ASSERT_TRUE(read_bootloader_message_from(&boot_verify, temp_misc.path, &err)) << err;
+  ASSERT_STREQ("outside", boot_verify.command);
+  ASSERT_STREQ("2/3", boot_verify.stage);
+}
+
+TEST(BootloaderMessageTest, MiscPartition_WritesWholeMessageToEmptyDevice) {
+  TemporaryFile temp_misc;
+  std::string err;
+  auto misc = MiscPartition::OpenDevice(temp_misc.path, &err);
+  ASSERT_NE(nullptr, misc) << err;
+
+  bootloader_message boot = {};
+  strlcpy(boot.recovery, "recovery\n--wipe_data\n", sizeof(boot.recovery));
+  ASSERT_TRUE(misc->WriteBootloaderMessage(boot, &err)) << err;
+
+  bootloader_message boot_verify;
+  ASSERT_TRUE(read_bootloader_message_from(&boot_verify, temp_misc.path, &err)) << err;
+  ASSERT_EQ(std::string(reinterpret_cast<const char*>(&boot), sizeof(boot)),
+            std::string(reinterpret_cast<const char*>(&boot_verify), sizeof(boot_verify)));
+}
@@ -15,6 +15,7 @@
  */
 
 #include <algorithm>
+#include <map>
 #include <string>
 
 #include <android-base/strings.h>
@@ -385,6 +386,191 @@ TEST(CommandsTest, Parse_InvalidNumberOfArgs) {
   }
 }
 
+TEST(CommandsTest, GroupIndependentCommands) {
+  std::vector<std::string> lines{
+    "zero 2,0,2",
+    "move 1d74d1a60332fd38cf9405f1bae67917888da6cb 2,10,12 2 2,2,4",
+    // Reads the target of the first command.
+    "move 1d74d1a60332fd38cf9405f1bae67917888da6cb 2,12,14 2 2,0,2",
+    "bsdiff 0 148 f201a4e04bd3860da6ad47b957ef424d58a58f8c "
+    "9d5d223b4bc5c45dbd25a799c4f1a98466731599 2,14,16 2 2,4,6",
+    // Stashes end the batch.
+    "stash 1d74d1a60332fd38cf9405f1bae67917888da6cb 2,20,22",
+    "zero 2,30,32",
+    // Source overlaps its own target.
+    "move 1d74d1a60332fd38cf9405f1bae67917888da6cb 2,40,42 2 2,41,43",
+    "zero 2,50,52",
+  };
+  std::vector<Command> commands;
+  for (size_t i = 0; i < lines.size(); i++) {
+    std::string err;
+    commands.push_back(Command::Parse(lines[i], i, &err));
+    ASSERT_TRUE(commands.back()) << err;
+  }
+
+  std::vector<std::pair<size_t, size_t>> expected{
+    { 0, 2 }, { 2, 4 }, { 4, 5 }, { 5, 6 }, { 6, 7 }, { 7, 8 },
+  };
+  ASSERT_EQ(expected, GroupIndependentCommands(commands, 64, 1024));
+
+  // Honors the batch size and block limits.
+  expected = { { 0, 1 }, { 1, 2 }, { 2, 3 }, { 3, 4 }, { 4, 5 }, { 5, 6 }, { 6, 7 }, { 7, 8 } };
+  ASSERT_EQ(expected, GroupIndependentCommands(commands, 1, 1024));
+  ASSERT_EQ(expected, GroupIndependentCommands(commands, 64, 3));
+}
+
+TEST(CommandsTest, FindReplayableStashes) {
+  const std::string hash_a = "1d74d1a60332fd38cf9405f1bae67917888da6cb";
+  const std::string hash_b = "f201a4e04bd3860da6ad47b957ef424d58a58f8c";
+  const std::string hash_c = "9d5d223b4bc5c45dbd25a799c4f1a98466731599";
+  std::vector<std::string> lines{
+    // Used by the move, which doesn't touch any block read or written before.
+    "stash " + hash_a + " 2,0,1",
+    "zero 2,10,11",
+    "move " + hash_a + " 2,3,4 1 - " + hash_a + ":2,0,1",
+    "free " + hash_a,
+    // The command using the stash overwrites the stashed blocks.
+    "stash " + hash_b + " 2,4,5",
+    "move " + hash_b + " 2,4,5 1 - " + hash_b + ":2,0,1",
+    "free " + hash_b,
+    // Never used.
+    "stash " + hash_c + " 2,5,6",
+    "free " + hash_c,
+    // Never freed.
+    "stash " + hash_a + " 2,6,7",
+  };
+  std::vector<Command> commands;
+  for (size_t i = 0; i < lines.size(); i++) {
+    std::string err;
+    commands.push_back(Command::Parse(lines[i], i, &err));
+    ASSERT_TRUE(commands.back()) << err;
+  }
+
+  std::map<size_t, size_t> expected{ { 0, 2 }, { 7, 7 } };
+  ASSERT_EQ(expected, FindReplayableStashes(commands, 64));
+
+  // The free command is out of the window.
+  expected = { { 7, 7 } };
+  ASSERT_EQ(expected, FindReplayableStashes(commands, 2));
+
+  // An invalid command ends the search.
+  commands[1] = Command();
+  expected = { { 7, 7 } };
+  ASSERT_EQ(expected, FindReplayableStashes(commands, 64));
+}
+
+TEST(CommandsTest, CountStashReferences) {
+  const std::string hash_a = "1d74d1a60332fd38cf9405f1bae67917888da6cb";
+  const std::string hash_b = "f201a4e04bd3860da6ad47b957ef424d58a58f8c";
+  std::vector<std::string> lines{
+    "stash " + hash_a + " 2,0,1",
+    // The same data, stashed again from other blocks, before the first stash is freed.
+    "stash " + hash_a + " 2,5,6",
+    "stash " + hash_b + " 2,1,2",
+    "free " + hash_a,
+    "move " + hash_a + " 2,3,4 1 - " + hash_a + ":2,0,1",
+    "free " + hash_a,
+    "free " + hash_b,
+    // Stashed again after its last free, and freed once more than stashed.
+    "stash " + hash_a + " 2,0,1",
+    "free " + hash_a,
+    "free " + hash_a,
+  };
+  std::vector<Command> commands;
+  for (size_t i = 0; i < lines.size(); i++) {
+    std::string err;
+    commands.push_back(Command::Parse(lines[i], i, &err));
+    ASSERT_TRUE(commands.back()) << err;
+  }
+
+  StashReferences references = CountStashReferences(commands);
+  ASSERT_EQ(std::set<size_t>{ 1 }, references.held_stashes);
+  ASSERT_EQ(std::set<size_t>{ 3 }, references.held_frees);
+}
+
+TEST(CommandsTest, PlanStashes) {
+  const std::string hash_a = "1d74d1a60332fd38cf9405f1bae67917888da6cb";
+  const std::string hash_b = "f201a4e04bd3860da6ad47b957ef424d58a58f8c";
+  const std::string hash_c = "9eedf00d11061549e32503cadf054ec6fbfa7a23";
+  const std::string hash_d = "a6cbdf3f416960f02189d3a814ec7e9e95c44a0d";
+  std::vector<std::string> lines{
+    "stash " + hash_a + " 2,0,4",
+    "stash " + hash_b + " 2,4,6",
+    "stash " + hash_c + " 2,6,9",
+    // A move whose source overlaps its target, which stashes its 2 source blocks.
+    "move " + hash_d + " 2,20,22 2 2,21,23",
+    "free " + hash_a,
+    "free " + hash_b,
+    "free " + hash_c,
+    "free " + hash_d,
+  };
+  std::vector<Command> commands;
+  for (size_t i = 0; i < lines.size(); i++) {
+    std::string err;
+    commands.push_back(Command::Parse(lines[i], i, &err));
+    ASSERT_TRUE(commands.back()) << err;
+  }
+  StashReferences references = CountStashReferences(commands);
+
+  // Without memory, all the stashes go to files, plus the overlapping source during the move.
+  StashPlan plan = PlanStashes(commands, references, {}, 0, {});
+  ASSERT_TRUE(plan.memory_stashes.empty());
+  ASSERT_TRUE(plan.memory_headroom.empty());
+  ASSERT_EQ(11U, plan.peak_blocks);
+  ASSERT_EQ(3U, plan.peak_index);
+
+  // Stashes 0 and 2 are replayable, but only the first one fits in the memory. Stash 2 can still
+  // go to memory if it compresses into the block left over.
+  std::map<size_t, size_t> replayable{ { 0, 0 }, { 2, 2 } };
+  plan = PlanStashes(commands, references, replayable, 5, {});
+  ASSERT_EQ(std::set<size_t>{ 0 }, plan.memory_stashes);
+  ASSERT_EQ((std::map<size_t, size_t>{ { 2, 1 } }), plan.memory_headroom);
+  ASSERT_EQ(7U, plan.peak_blocks);
+  ASSERT_EQ(3U, plan.peak_index);
+
+  // The files left by an earlier attempt count, until they get freed.
+  plan = PlanStashes(commands, references, replayable, 8, { { hash_d, 10 } });
+  ASSERT_EQ((std::set<size_t>{ 0, 2 }), plan.memory_stashes);
+  ASSERT_EQ(14U, plan.peak_blocks);
+  ASSERT_EQ(3U, plan.peak_index);
+}
+
+TEST(CommandsTest, PlanSourceCache) {
+  const std::string hash = "1d74d1a60332fd38cf9405f1bae67917888da6cb";
+  std::vector<std::string> lines{
+    "stash " + hash + " 2,0,4",
+    "move " + hash + " 2,10,12 2 2,2,4",
+    "bsdiff 0 148 " + hash + " " + hash + " 2,20,22 2 2,0,2",
+    "zero 2,0,1",
+    // Reads block 0 after it's been written, so it can't come from the cache.
+    "move " + hash + " 2,30,31 1 2,0,1",
+  };
+  std::vector<Command> commands;
+  for (size_t i = 0; i < lines.size(); i++) {
+    std::string err;
+    commands.push_back(Command::Parse(lines[i], i, &err));
+    ASSERT_TRUE(commands.back()) << err;
+  }
+
+  // The stash keeps all of its blocks for the move and the bsdiff.
+  SourceCachePlan plan = PlanSourceCache(commands, 4, {});
+  ASSERT_EQ((std::map<size_t, RangeSet>{ { 0, RangeSet({ { 0, 4 } }) } }), plan.keep);
+  ASSERT_EQ((std::set<size_t>{ 1, 2 }), plan.hits);
+
+  // With a block less, block 0 gets evicted before the bsdiff.
+  plan = PlanSourceCache(commands, 3, {});
+  ASSERT_EQ(std::set<size_t>{ 1 }, plan.hits);
+
+  // The commands left out of the cache don't need their blocks kept.
+  plan = PlanSourceCache(commands, 4, { 2 });
+  ASSERT_EQ((std::map<size_t, RangeSet>{ { 0, RangeSet({ { 2, 4 } }) } }), plan.keep);
+  ASSERT_EQ(std::set<size_t>{ 1 }, plan.hits);
+
+  plan = PlanSourceCache(commands, 0, {});
+  ASSERT_TRUE(plan.keep.empty());
+  ASSERT_TRUE(plan.hits.empty());
+}
+
 TEST(SourceInfoTest, Overlaps) {
   ASSERT_TRUE(SourceInfo("1d74d1a60332fd38cf9405f1bae67917888da6cb",
                          RangeSet({ { 7, 9 }, { 16, 20 } }), {}, {})
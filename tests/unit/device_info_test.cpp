@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/properties.h>
+#include <gtest/gtest.h>
+
+#include "otautil/device_info.h"
+
+TEST(DeviceInfoTest, MatchesProperties) {
+  const DeviceInfo& info = DeviceInfo::Get();
+  for (const auto& name : { "ro.build.fingerprint", "ro.product.device", "ro.serialno",
+                            "ro.build.version.security_patch", "ro.nonexistent.property" }) {
+    ASSERT_EQ(android::base::GetProperty(name, ""), info.GetProperty(name)) << name;
+  }
+  ASSERT_EQ(android::base::GetBoolProperty("ro.build.ab_update", false),
+            info.GetBoolProperty("ro.build.ab_update", false));
+}
+
+TEST(DeviceInfoTest, Defaults) {
+  const DeviceInfo& info = DeviceInfo::Get();
+  ASSERT_TRUE(info.GetBoolProperty("ro.nonexistent.property", true));
+  ASSERT_FALSE(info.GetBoolProperty("ro.nonexistent.property", false));
+  ASSERT_EQ(-1, info.GetIntProperty("ro.nonexistent.property", -1));
+  ASSERT_EQ(android::base::GetIntProperty<int64_t>("ro.build.date.utc", 123),
+            info.GetIntProperty("ro.build.date.utc", 123));
+}
+
+TEST(DeviceInfoTest, ConcurrentReaders) {
+  std::string expected = DeviceInfo::Get().GetProperty("ro.product.device");
+  std::vector<std::thread> readers;
+  std::vector<int> mismatches(8);
+  for (size_t i = 0; i < mismatches.size(); i++) {
+    readers.emplace_back([&expected, &mismatches, i]() {
+      for (int j = 0; j < 1000; j++) {
+        if (DeviceInfo::Get().GetProperty("ro.product.device") != expected) {
+          mismatches[i]++;
+        }
+      }
+    });
+  }
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  ASSERT_EQ(std::vector<int>(mismatches.size()), mismatches);
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <gtest/gtest.h>
+
+#include "install/directory_listing.h"
+
+using namespace std::chrono_literals;
+
+class DirectoryListingTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    DirectoryListing::ClearCache();
+  }
+
+  void TearDown() override {
+    DirectoryListing::ClearCache();
+  }
+
+  void CreateFile(const std::string& name) {
+    ASSERT_TRUE(android::base::WriteStringToFile("", dir_.path + ("/" + name)));
+  }
+
+  // Waits for the whole of |listing| to be read, and returns its entries.
+  static std::vector<std::string> ReadWhole(DirectoryListing* listing) {
+    bool complete = false;
+    std::vector<std::string> entries;
+    for (int i = 0; i < 1000 && !complete; i++) {
+      entries = listing->GetEntries(&complete);
+      if (!complete) std::this_thread::sleep_for(10ms);
+    }
+    EXPECT_TRUE(complete);
+    return entries;
+  }
+
+  TemporaryDir dir_;
+};
+
+TEST_F(DirectoryListingTest, Entries) {
+  CreateFile("b.zip");
+  CreateFile("a.ZIP");
+  CreateFile("c.map");
+  CreateFile("notes.txt");
+  ASSERT_EQ(0, mkdir((dir_.path + std::string("/sub")).c_str(), 0755));
+  ASSERT_EQ(0, mkdir((dir_.path + std::string("/other")).c_str(), 0755));
+
+  std::atomic<int> updates = 0;
+  DirectoryListing listing(dir_.path, [&updates]() { updates++; });
+  ASSERT_TRUE(listing.ok());
+  std::vector<std::string> expected{ "a.ZIP", "b.zip", "c.map", "other/", "sub/" };
+  ASSERT_EQ(expected, ReadWhole(&listing));
+  ASSERT_LE(1, updates);
+}
+
+TEST_F(DirectoryListingTest, ManyEntries) {
+  // More than a single getdents64(2) reads.
+  std::vector<std::string> expected;
+  for (int i = 0; i < 3000; i++) {
+    std::string name = android::base::StringPrintf("package-%04d.zip", i);
+    CreateFile(name);
+    expected.push_back(name);
+  }
+  DirectoryListing listing(dir_.path, []() {});
+  ASSERT_EQ(expected, ReadWhole(&listing));
+}
+
+TEST_F(DirectoryListingTest, Cached) {
+  CreateFile("a.zip");
+  {
+    DirectoryListing listing(dir_.path, []() {});
+    ASSERT_EQ(std::vector<std::string>{ "a.zip" }, ReadWhole(&listing));
+  }
+
+  // A cached listing is complete from the start, and is not read again.
+  std::atomic<int> updates = 0;
+  {
+    DirectoryListing listing(dir_.path, [&updates]() { updates++; });
+    bool complete = false;
+    ASSERT_EQ(std::vector<std::string>{ "a.zip" }, listing.GetEntries(&complete));
+    ASSERT_TRUE(complete);
+  }
+  ASSERT_EQ(0, updates);
+
+  // Changing the directory makes the listing stale.
+  CreateFile("b.zip");
+  struct timespec times[2] = { { 0, UTIME_OMIT }, { 1000, 0 } };
+  ASSERT_EQ(0, utimensat(AT_FDCWD, dir_.path, times, 0));
+  DirectoryListing listing(dir_.path, []() {});
+  std::vector<std::string> expected{ "a.zip", "b.zip" };
+  ASSERT_EQ(expected, ReadWhole(&listing));
+}
+
+TEST_F(DirectoryListingTest, MissingDirectory) {
+  DirectoryListing listing(dir_.path + std::string("/missing"), []() {});
+  ASSERT_FALSE(listing.ok());
+  bool complete;
+  ASSERT_TRUE(listing.GetEntries(&complete).empty());
+}
@@ -139,3 +139,37 @@ TEST(DirUtilTest, unlink_smoke) {
   // Verify it's gone.
   ASSERT_EQ(-1, access((path + "/a").c_str(), F_OK));
 }
+
+TEST(DirUtilTest, unlink_large_tree) {
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/a";
+  ASSERT_EQ(0, mkdir(path.c_str(), 0700));
+  // More entries than a getdents64 batch holds, in several subdirectories.
+  for (size_t i = 0; i < 8; i++) {
+    std::string dir = path + "/" + std::to_string(i);
+    ASSERT_EQ(0, mkdir(dir.c_str(), 0700));
+    ASSERT_EQ(0, mkdir((dir + "/nested").c_str(), 0700));
+    for (size_t j = 0; j < 1000; j++) {
+      ASSERT_TRUE(android::base::WriteStringToFile("", dir + "/nested/" + std::to_string(j)));
+    }
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile("", path + "/file"));
+
+  // The symlinks are removed, not followed.
+  TemporaryDir outside;
+  std::string outside_file = std::string(outside.path) + "/keep";
+  ASSERT_TRUE(android::base::WriteStringToFile("", outside_file));
+  ASSERT_EQ(0, symlink(outside.path, (path + "/0/link").c_str()));
+
+  ASSERT_EQ(0, dirUnlinkHierarchy(path.c_str()));
+  ASSERT_EQ(-1, access(path.c_str(), F_OK));
+  ASSERT_EQ(0, access(outside_file.c_str(), F_OK));
+  ASSERT_EQ(0, unlink(outside_file.c_str()));
+
+  // Nor is a symlink given as the path.
+  std::string link = std::string(td.path) + "/link";
+  ASSERT_EQ(0, symlink(outside.path, link.c_str()));
+  ASSERT_EQ(0, dirUnlinkHierarchy(link.c_str()));
+  ASSERT_EQ(-1, access(link.c_str(), F_OK));
+  ASSERT_EQ(0, access(outside.path, F_OK));
+}
@@ -15,11 +15,16 @@
  */
 
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
 
 #include "edify/expr.h"
+#include "edify/profiler.h"
+#include "edify/updater_interface.h"
 
 static void expect(const std::string& expr_str, const char* expected) {
   std::unique_ptr<Expr> e;
@@ -164,4 +169,182 @@ TEST_F(EdifyTest, unknown_function) {
   error_count = 0;
   EXPECT_EQ(1, ParseString(script3, &expr, &error_count));
   EXPECT_EQ(1, error_count);
+  // Unknown functions fail the parse even where the script would never call them.
+  const char* script4 = "if \"\" then unknown_function() endif";
+  error_count = 0;
+  EXPECT_EQ(1, ParseString(script4, &expr, &error_count));
+  EXPECT_EQ(1, error_count);
+}
+
+TEST_F(EdifyTest, parse_on_threads) {
+  // Each parse has a scanner of its own, so the Exprs, their locations and the errors of one
+  // script don't leak into the others.
+  std::vector<std::thread> threads;
+  std::vector<std::string> results(4);
+  std::vector<int> errors(4);
+  for (size_t i = 0; i < results.size(); i++) {
+    threads.emplace_back([i, &results, &errors]() {
+      std::string script = "concat(\"a\n\", \"" + std::to_string(i) + "\", \"\\x62\")";
+      for (int pass = 0; pass < 100; pass++) {
+        std::unique_ptr<Expr> e;
+        int error_count = 0;
+        if (ParseString(script, &e, &error_count) != 0 || error_count != 0 ||
+            e->end != static_cast<int>(script.size())) {
+          errors[i]++;
+          continue;
+        }
+        State state(script, nullptr);
+        Evaluate(&state, e, &results[i]);
+        ParseString("line1;\nunknown_function()", &e, &error_count);
+        if (error_count != 1) {
+          errors[i]++;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (size_t i = 0; i < results.size(); i++) {
+    ASSERT_EQ(0, errors[i]);
+    ASSERT_EQ("a\n" + std::to_string(i) + "b", results[i]);
+  }
+}
+
+// Records the progress that the script reports.
+class ProgressUpdater : public UpdaterInterface {
+ public:
+  void WriteToCommandPipe(const std::string_view, bool) const override {}
+  void UiPrint(const std::string_view) const override {}
+  void ShowProgress(double, int) const override {
+    show_progress_calls++;
+  }
+  void SetProgress(double fraction, bool) const override {
+    std::lock_guard<std::mutex> lock(mutex);
+    progress.push_back(fraction);
+  }
+  std::string FindBlockDeviceName(const std::string_view name) const override {
+    return std::string(name);
+  }
+  UpdaterRuntimeInterface* GetRuntime() const override {
+    return nullptr;
+  }
+  ZipArchiveHandle GetPackageHandle() const override {
+    return nullptr;
+  }
+  std::string GetResult() const override {
+    return "";
+  }
+  uint8_t* GetMappedPackageAddress() const override {
+    return nullptr;
+  }
+  size_t GetMappedPackageLength() const override {
+    return 0;
+  }
+  int GetPackageFd() const override {
+    return -1;
+  }
+
+  mutable std::mutex mutex;
+  mutable std::vector<double> progress;
+  mutable int show_progress_calls = 0;
+};
+
+// done() finishes the progress of its part of the script, and returns its argument.
+static Value* DoneFn(const char* name, State* state,
+                     const std::vector<std::unique_ptr<Expr>>& argv) {
+  state->updater->ShowProgress(0.5, 0);
+  state->updater->SetProgress(1.0);
+  return EvaluateValue(state, argv[0]);
+}
+
+static bool ParseAndEvaluate(const std::string& script, State* state, std::string* result) {
+  std::unique_ptr<Expr> e;
+  int error_count = 0;
+  if (ParseString(script, &e, &error_count) != 0) {
+    return false;
+  }
+  return Evaluate(state, e, result);
+}
+
+TEST_F(EdifyTest, parallel) {
+  expect("parallel(a, b, c)", "c");
+  expect("parallel(a, abort(), c)", nullptr);
+
+  RegisterFunction("done", DoneFn);
+  ProgressUpdater updater;
+  std::string script = "parallel(done(a), done(b))";
+  State state(script, &updater);
+  std::string result;
+  ASSERT_TRUE(ParseAndEvaluate(script, &state, &result));
+  ASSERT_EQ("b", result);
+  // Each branch moved its half of the progress bar, one at a time; show_progress() was dropped.
+  ASSERT_EQ((std::vector<double>{ 0.5, 1.0 }), updater.progress);
+  ASSERT_EQ(0, updater.show_progress_calls);
+}
+
+TEST_F(EdifyTest, parallel_errors) {
+  ProgressUpdater updater;
+  // The error is that of the first argument to fail, whichever fails first in time.
+  for (int i = 0; i < 20; i++) {
+    std::string script = "parallel(a, abort(\"first\"), abort(\"second\"))";
+    State state(script, &updater);
+    std::string result;
+    ASSERT_FALSE(ParseAndEvaluate(script, &state, &result));
+    ASSERT_EQ("first", state.errmsg);
+  }
+}
+
+TEST_F(EdifyTest, profiler) {
+  std::string script = "concat(a, b);\nif is_substring(a, abc) then\n  concat(c, d)\nendif";
+  std::unique_ptr<Expr> e;
+  int error_count = 0;
+  ASSERT_EQ(0, ParseString(script, &e, &error_count));
+
+  ScriptProfiler profiler(script, e.get());
+  State state(script, nullptr);
+  state.profiler = &profiler;
+  std::string result;
+  ASSERT_TRUE(Evaluate(&state, e, &result));
+  ASSERT_EQ("cd", result);
+
+  // The statements are listed at their place in the script, then the builtins and their calls.
+  std::string summary = profiler.Summary();
+  size_t statements = summary.find("by statement:");
+  size_t builtins = summary.find("By builtin:");
+  size_t calls = summary.find("Slowest calls:");
+  ASSERT_NE(std::string::npos, statements);
+  ASSERT_LT(statements, builtins);
+  ASSERT_LT(builtins, calls);
+  ASSERT_NE(std::string::npos, summary.find("1:1 concat(a, b)\n", statements));
+  ASSERT_NE(std::string::npos,
+            summary.find("2:1 if is_substring(a, abc) then   concat(c, d) endif\n", statements));
+  ASSERT_NE(std::string::npos, summary.find("2 calls  concat\n", builtins));
+  ASSERT_NE(std::string::npos, summary.find("1 calls  is_substring\n", builtins));
+  ASSERT_NE(std::string::npos, summary.find("3:3 concat(c, d)\n", calls));
+}
+
+TEST(EdifyValueTest, SharedBlob) {
+  auto buffer = std::make_shared<std::string>("shared contents");
+  Value value(std::string_view(*buffer).substr(7), buffer);
+  ASSERT_EQ(Value::Type::BLOB, value.type);
+  ASSERT_EQ("contents", value.data());
+  ASSERT_EQ(buffer->data() + 7, value.data().data());
+
+  // Copies share the bytes, and keep them alive.
+  Value copy = value;
+  std::weak_ptr<std::string> weak_buffer = buffer;
+  buffer.reset();
+  ASSERT_FALSE(weak_buffer.expired());
+  ASSERT_EQ(value.data().data(), copy.data().data());
+
+  // Changing a value copies the bytes first, and leaves the others alone.
+  copy.MutableData() += "!";
+  ASSERT_EQ("contents!", copy.data());
+  ASSERT_EQ("contents", value.data());
+  ASSERT_NE(value.data().data(), copy.data().data());
+
+  value.MutableData();
+  ASSERT_TRUE(weak_buffer.expired());
+  ASSERT_EQ("contents", value.data());
 }
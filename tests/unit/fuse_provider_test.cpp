@@ -102,3 +102,100 @@ TEST(FuseBlockMapTest, ReadBlockAlignedData_large_fuse_block) {
   std::string expected = content.substr(16384, 4096) + content.substr(24576, 15904);
   ASSERT_EQ(std::vector<uint8_t>(expected.begin(), expected.end()), result);
 }
+
+// Reads from a file like the adb host would, counting the blocks, and failing (like a dropped
+// connection would) once |fail_after| blocks have been read.
+class FlakyFileDataProvider : public FuseDataProvider {
+ public:
+  FlakyFileDataProvider(const std::string& path, uint32_t block_size, uint32_t fail_after)
+      : file_(path, block_size), fail_after_(fail_after) {
+    file_size_ = file_.file_size();
+    fuse_block_size_ = block_size;
+  }
+
+  bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
+                            uint32_t start_block) const override {
+    uint32_t blocks = (fetch_size + fuse_block_size_ - 1) / fuse_block_size_;
+    if (blocks_read_ + blocks > fail_after_) {
+      return false;
+    }
+    blocks_read_ += blocks;
+    return file_.ReadBlockAlignedData(buffer, fetch_size, start_block);
+  }
+
+  bool Valid() const override {
+    return file_.Valid();
+  }
+
+  static uint32_t blocks_read_;
+
+ private:
+  FuseFileDataProvider file_;
+  uint32_t fail_after_;
+};
+
+uint32_t FlakyFileDataProvider::blocks_read_ = 0;
+
+TEST(FuseSpillTest, ResumesAfterFailure) {
+  std::string content;
+  for (char c = 0; c < 10; c++) {
+    content += std::string(4096, 'a' + c);
+  }
+  content.resize(content.size() - 100);
+  TemporaryFile package;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, package.path));
+  TemporaryDir spill_dir;
+
+  // The first transfer gets blocks 0-4, and fails on the rest (as the source gives at most 6).
+  FlakyFileDataProvider::blocks_read_ = 0;
+  std::string spill_path;
+  {
+    auto provider = FuseSpillDataProvider::Create(
+        std::make_unique<FlakyFileDataProvider>(package.path, 4096, 6), spill_dir.path);
+    auto spill = static_cast<FuseSpillDataProvider*>(provider.get());
+    ASSERT_EQ(1U, spill->spilled_blocks());
+    spill_path = spill->path();
+
+    std::vector<uint8_t> result(content.size());
+    ASSERT_TRUE(provider->ReadBlockAlignedData(result.data(), 5 * 4096, 0));
+    ASSERT_EQ(std::vector<uint8_t>(content.begin(), content.begin() + 5 * 4096),
+              std::vector<uint8_t>(result.begin(), result.begin() + 5 * 4096));
+    ASSERT_FALSE(provider->ReadBlockAlignedData(result.data(), content.size(), 0));
+    ASSERT_EQ(5U, spill->spilled_blocks());
+  }
+
+  // The next transfer of the same package only fetches block 0 again (to find the spill file), and
+  // the 5 missing ones.
+  FlakyFileDataProvider::blocks_read_ = 0;
+  auto provider = FuseSpillDataProvider::Create(
+      std::make_unique<FlakyFileDataProvider>(package.path, 4096, 6), spill_dir.path);
+  ASSERT_EQ(spill_path, static_cast<FuseSpillDataProvider*>(provider.get())->path());
+  std::vector<uint8_t> result(content.size());
+  ASSERT_TRUE(provider->ReadBlockAlignedData(result.data(), content.size(), 0));
+  ASSERT_EQ(std::vector<uint8_t>(content.begin(), content.end()), result);
+  ASSERT_EQ(6U, FlakyFileDataProvider::blocks_read_);
+
+  FuseSpillDataProvider::RemoveSpillFiles(spill_dir.path);
+  ASSERT_EQ(-1, access(spill_path.c_str(), F_OK));
+}
+
+TEST(FuseSpillTest, ReplacesOtherPackage) {
+  TemporaryFile package1;
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(8192, 'a'), package1.path));
+  TemporaryFile package2;
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(8192, 'b'), package2.path));
+  TemporaryDir spill_dir;
+
+  auto provider1 = FuseSpillDataProvider::Create(
+      std::make_unique<FuseFileDataProvider>(package1.path, 4096), spill_dir.path);
+  std::string spill_path1 = static_cast<FuseSpillDataProvider*>(provider1.get())->path();
+  auto provider2 = FuseSpillDataProvider::Create(
+      std::make_unique<FuseFileDataProvider>(package2.path, 4096), spill_dir.path);
+  std::string spill_path2 = static_cast<FuseSpillDataProvider*>(provider2.get())->path();
+
+  // Packages of the same size still get different spill files, and only the latest is kept.
+  ASSERT_NE(spill_path1, spill_path2);
+  ASSERT_EQ(-1, access(spill_path1.c_str(), F_OK));
+  ASSERT_EQ(0, access(spill_path2.c_str(), F_OK));
+  FuseSpillDataProvider::RemoveSpillFiles(spill_dir.path);
+}
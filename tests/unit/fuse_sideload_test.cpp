@@ -14,14 +14,21 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <functional>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
 
 #include "fuse_provider.h"
@@ -58,20 +65,11 @@ TEST(SideloadTest, run_fuse_sideload_wrong_parameters) {
   ASSERT_EQ(-1, run_fuse_sideload(std::move(provider_too_many_blocks)));
 }
 
-TEST(SideloadTest, run_fuse_sideload) {
-  const std::vector<std::string> blocks = {
-    std::string(2048, 'a') + std::string(2048, 'b'),
-    std::string(2048, 'c') + std::string(2048, 'd'),
-    std::string(2048, 'e') + std::string(2048, 'f'),
-    std::string(2048, 'g') + std::string(2048, 'h'),
-  };
-  const std::string content = android::base::Join(blocks, "");
-  ASSERT_EQ(16384U, content.size());
-
-  TemporaryFile temp_file;
-  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
-
-  auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
+// Serves the data of |provider| over fuse_sideload, and calls |read_package| with the path of the
+// package once it's mounted.
+static void RunFuseSideload(std::unique_ptr<FuseDataProvider> provider,
+                            const std::function<void(const std::string&)>& read_package) {
+  ASSERT_TRUE(provider);
   ASSERT_TRUE(provider->Valid());
   TemporaryDir mount_point;
   pid_t pid = fork();
@@ -98,9 +96,7 @@ TEST(SideloadTest, run_fuse_sideload) {
     FAIL() << "Timed out waiting for the fuse-provided package.";
   }
 
-  std::string content_via_fuse;
-  ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
-  ASSERT_EQ(content, content_via_fuse);
+  read_package(package);
 
   std::string exit_flag = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
   struct stat sb;
@@ -110,3 +106,140 @@ TEST(SideloadTest, run_fuse_sideload) {
   ASSERT_EQ(0, WEXITSTATUS(status));
   ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
 }
+
+TEST(SideloadTest, run_fuse_sideload) {
+  const std::vector<std::string> blocks = {
+    std::string(2048, 'a') + std::string(2048, 'b'),
+    std::string(2048, 'c') + std::string(2048, 'd'),
+    std::string(2048, 'e') + std::string(2048, 'f'),
+    std::string(2048, 'g') + std::string(2048, 'h'),
+  };
+  const std::string content = android::base::Join(blocks, "");
+  ASSERT_EQ(16384U, content.size());
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+  auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
+  RunFuseSideload(std::move(provider), [&content](const std::string& package) {
+    std::string content_via_fuse;
+    ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
+    ASSERT_EQ(content, content_via_fuse);
+  });
+}
+
+// Reads spanning several blocks, from several threads at once, and of a partial last block.
+TEST(SideloadTest, run_fuse_sideload_concurrent_reads) {
+  std::string content;
+  for (size_t i = 0; i < 1000; i++) {
+    content += std::string(4096 + 37, 'a' + i % 26);
+  }
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+  auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
+  RunFuseSideload(std::move(provider), [&content](const std::string& package) {
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < 4; i++) {
+      readers.emplace_back([&content, &package, i]() {
+        android::base::unique_fd fd(open(package.c_str(), O_RDONLY));
+        ASSERT_NE(-1, fd);
+        // Each reader starts at a different offset, and reads in pieces of 3 blocks.
+        std::string buffer(3 * 4096, '\0');
+        for (size_t offset = i * 1024 * 1024 % content.size(); offset < content.size();
+             offset += buffer.size()) {
+          size_t to_read = std::min(buffer.size(), content.size() - offset);
+          ASSERT_TRUE(android::base::ReadFullyAtOffset(fd, buffer.data(), to_read, offset));
+          ASSERT_EQ(content.substr(offset, to_read), buffer.substr(0, to_read)) << offset;
+        }
+      });
+    }
+    for (auto& reader : readers) {
+      reader.join();
+    }
+  });
+}
+
+// A package on a block device, checked with checksums rather than SHA-256.
+TEST(SideloadTest, run_fuse_sideload_block_map) {
+  // The package takes blocks 3-4 and 1 (in this order) of the device, and part of block 6.
+  std::string device(7 * 4096, '\0');
+  std::string content;
+  for (size_t block : { 3, 4, 1, 6 }) {
+    std::string data(4096, 'a' + block);
+    device.replace(block * 4096, 4096, data);
+    content += data;
+  }
+  content.resize(3 * 4096 + 100);
+
+  TemporaryFile fake_block_device;
+  ASSERT_TRUE(android::base::WriteStringToFile(device, fake_block_device.path));
+  TemporaryFile block_map;
+  std::vector<std::string> lines = {
+    fake_block_device.path, std::to_string(content.size()) + " 4096", "3", "3 5", "1 2", "6 7",
+  };
+  ASSERT_TRUE(android::base::WriteStringToFile(android::base::Join(lines, "\n"), block_map.path));
+
+  auto provider = FuseBlockDataProvider::CreateFromBlockMap(block_map.path, 4096);
+  ASSERT_EQ(FuseIntegrity::kChecksum, provider->integrity());
+  RunFuseSideload(std::move(provider), [&content](const std::string& package) {
+    // Read it twice: the second read gets the same data.
+    for (size_t i = 0; i < 2; i++) {
+      std::string content_via_fuse;
+      ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
+      ASSERT_EQ(content, content_via_fuse);
+    }
+  });
+}
+
+// A file changed under the provider after the first read doesn't change what the package reads:
+// each read either returns the data of the first one, or fails.
+TEST(SideloadTest, run_fuse_sideload_file_changed) {
+  std::string content(16 * 4096, 'a');
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+  auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
+  RunFuseSideload(std::move(provider), [&content, &temp_file](const std::string& package) {
+    std::string content_via_fuse;
+    ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
+    ASSERT_EQ(content, content_via_fuse);
+
+    ASSERT_TRUE(android::base::WriteStringToFile(std::string(content.size(), 'b'), temp_file.path));
+    android::base::unique_fd fd(open(package.c_str(), O_RDONLY));
+    ASSERT_NE(-1, fd);
+    // Drop the package from the page cache, so that the reads go to fuse_sideload again.
+    ASSERT_EQ(0, posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED));
+    std::string buffer(4096, '\0');
+    for (size_t offset = 0; offset < content.size(); offset += buffer.size()) {
+      if (android::base::ReadFullyAtOffset(fd, buffer.data(), buffer.size(), offset)) {
+        ASSERT_EQ(content.substr(offset, buffer.size()), buffer) << offset;
+      }
+    }
+  });
+}
+
+// The pages read through one open of the package stay cached for the next open (e.g. the
+// installer's, after the verifier's), rather than being fetched from the provider again.
+TEST(SideloadTest, run_fuse_sideload_keeps_cache_across_opens) {
+  std::string content(64 * 4096, 'k');
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+  auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
+  RunFuseSideload(std::move(provider), [&content](const std::string& package) {
+    std::string content_via_fuse;
+    ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
+    ASSERT_EQ(content, content_via_fuse);
+
+    android::base::unique_fd fd(open(package.c_str(), O_RDONLY));
+    ASSERT_NE(-1, fd);
+    void* map = mmap(nullptr, content.size(), PROT_READ, MAP_SHARED, fd, 0);
+    ASSERT_NE(MAP_FAILED, map);
+    std::vector<unsigned char> resident(content.size() / 4096);
+    ASSERT_EQ(0, mincore(map, content.size(), resident.data()));
+    munmap(map, content.size());
+    for (size_t i = 0; i < resident.size(); i++) {
+      ASSERT_TRUE(resident[i] & 1) << "page " << i;
+    }
+  });
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "updater/device_model.h"
+
+TEST(DeviceModelTest, ParseProfile) {
+  auto profile = DeviceProfile::Parse(
+      "# A slow device\nread_latency_us=100\nread_mbps=200\nwrite_mbps=50\nfsync_latency_us=2000\n");
+  ASSERT_TRUE(profile);
+  ASSERT_EQ(100, profile->read_latency_us);
+  ASSERT_EQ(200, profile->read_mbps);
+  ASSERT_EQ(50, profile->write_mbps);
+  ASSERT_EQ(2000, profile->fsync_latency_us);
+  // The missing keys are free.
+  ASSERT_EQ(0, profile->write_latency_us);
+  ASSERT_EQ(0, profile->patch_mbps);
+
+  ASSERT_FALSE(DeviceProfile::Parse("read_mbps=fast\n"));
+  ASSERT_FALSE(DeviceProfile::Parse("read_mbps=-1\n"));
+  ASSERT_FALSE(DeviceProfile::Parse("unknown_mbps=1\n"));
+}
+
+TEST(DeviceModelTest, Estimate) {
+  DeviceProfile profile;
+  profile.read_latency_us = 1000;
+  profile.read_mbps = 100;
+  profile.write_mbps = 10;
+  profile.fsync_latency_us = 10000;
+  profile.patch_mbps = 1;
+
+  // The host timings (the columns in between) don't count.
+  std::string trace =
+      "partition,index,command,blocks,read_us,patch_us,write_us,fsync_us,stash_loads,"
+      "stash_memory_hits,reads,read_bytes,writes,write_bytes,discards,discard_bytes,fsyncs,"
+      "hash_bytes,patch_bytes\n"
+      "system,0,bsdiff,10,5,5,5,5,0,0,2,1000000,1,1000000,0,0,1,0,2000000\n"
+      "system,1,new,20,5,5,5,5,0,0,0,0,4,10000000,0,0,1,0,0\n"
+      "vendor,0,bsdiff,30,5,5,5,5,0,0,0,0,0,0,0,0,0,0,1000000\n";
+  InstallTimeEstimate estimate(profile);
+  ASSERT_TRUE(estimate.AddTrace(trace));
+  // system/bsdiff: 2 * 1ms + 10ms + 100ms + 10ms + 2s; system/new: 1s + 10ms; vendor/bsdiff: 1s.
+  ASSERT_NEAR(2.122 + 1.01 + 1, estimate.seconds(), 1e-9);
+  ASSERT_EQ(
+      "Estimated time of the block image updates: 4.1s\n"
+      "  system: 3.1s\n"
+      "    bsdiff: 1 commands, 10 blocks, 2.1s\n"
+      "    new: 1 commands, 20 blocks, 1.0s\n"
+      "  vendor: 1.0s\n"
+      "    bsdiff: 1 commands, 30 blocks, 1.0s",
+      estimate.Summary());
+}
+
+TEST(DeviceModelTest, MalformedTrace) {
+  InstallTimeEstimate estimate(DeviceProfile{});
+  // A trace from before the I/O counts.
+  ASSERT_FALSE(estimate.AddTrace(
+      "partition,index,command,blocks,read_us,patch_us,write_us,fsync_us,stash_loads,"
+      "stash_memory_hits\nsystem,0,new,1,0,0,0,0,0,0\n"));
+  ASSERT_FALSE(estimate.AddTrace("system,0,new,1\n"));
+}
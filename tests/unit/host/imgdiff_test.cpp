@@ -17,6 +17,7 @@
 #include <stdio.h>
 
 #include <algorithm>
+#include <filesystem>
 #include <string>
 #include <tuple>
 #include <vector>
@@ -25,6 +26,7 @@
 #include <android-base/memory.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <applypatch/applypatch.h>
 #include <applypatch/imgdiff.h>
 #include <applypatch/imgdiff_image.h>
 #include <applypatch/imgpatch.h>
@@ -32,6 +34,7 @@
 #include <ziparchive/zip_writer.h>
 
 #include "common/test_constants.h"
+#include "edify/expr.h"
 
 using android::base::get_unaligned;
 
@@ -90,11 +93,137 @@ static void GenerateTarget(const std::string& src, const std::string& patch, std
                                }));
 }
 
+// Applies the patch through the streaming ApplyImagePatch(), which reads the source from a file.
+static void GenerateTargetStreaming(const std::string& src, const std::string& patch,
+                                    std::string* patched) {
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFd(src, src_file.fd));
+
+  patched->clear();
+  FdSourceReader source(src_file.fd, src.size());
+  Value patch_value(Value::Type::BLOB, patch);
+  ASSERT_EQ(0, ApplyImagePatch(source, patch_value,
+                               [&](const unsigned char* data, size_t len) {
+                                 patched->append(reinterpret_cast<const char*>(data), len);
+                                 return len;
+                               },
+                               nullptr));
+}
+
+// Applies the patch with ApplyImagePatchInParallel().
+static void GenerateTargetInParallel(const std::string& src, const std::string& patch,
+                                     std::string* patched) {
+  patched->clear();
+  Value patch_value(Value::Type::BLOB, patch);
+  ASSERT_EQ(0, ApplyImagePatchInParallel(reinterpret_cast<const unsigned char*>(src.data()),
+                                         src.size(), patch_value,
+                                         [&](const unsigned char* data, size_t len) {
+                                           patched->append(reinterpret_cast<const char*>(data),
+                                                           len);
+                                           return len;
+                                         },
+                                         nullptr, 4));
+}
+
+// Applies the patch twice through the streaming ApplyImagePatch() with an InflateCache, from a
+// source in memory. The second pass takes the inflated source of all the deflate chunks from the
+// cache.
+static void GenerateTargetWithInflateCache(const std::string& src, const std::string& patch,
+                                           std::string* patched) {
+  InflateCache cache(64 * 1024 * 1024);
+  MemorySourceReader source(reinterpret_cast<const uint8_t*>(src.data()), src.size());
+  Value patch_value(Value::Type::BLOB, patch);
+  for (int pass = 0; pass < 2; pass++) {
+    patched->clear();
+    ASSERT_EQ(0, ApplyImagePatch(source, patch_value,
+                                 [&](const unsigned char* data, size_t len) {
+                                   patched->append(reinterpret_cast<const char*>(data), len);
+                                   return len;
+                                 },
+                                 nullptr, nullptr, &cache));
+  }
+  ASSERT_EQ(cache.misses(), cache.hits());
+}
+
+// A ZeroCopySink that lends |buffer_size| bytes at a time, and appends the bytes committed to
+// |output|, where the SinkFn output goes too. GetBuffer() fails once |fail_after| bytes have been
+// committed.
+class TestZeroCopySink : public ZeroCopySink {
+ public:
+  TestZeroCopySink(std::string* output, size_t buffer_size, size_t fail_after = SIZE_MAX)
+      : output_(output), buffer_(buffer_size), fail_after_(fail_after) {}
+
+  uint8_t* GetBuffer(size_t* size) override {
+    if (committed_ >= fail_after_) {
+      return nullptr;
+    }
+    *size = buffer_.size();
+    return buffer_.data();
+  }
+
+  bool Commit(size_t size) override {
+    EXPECT_LE(size, buffer_.size());
+    output_->append(reinterpret_cast<const char*>(buffer_.data()), size);
+    committed_ += size;
+    if (size < buffer_.size()) {
+      partial_commits_++;
+    }
+    return true;
+  }
+
+  size_t committed() const {
+    return committed_;
+  }
+
+  size_t partial_commits() const {
+    return partial_commits_;
+  }
+
+ private:
+  std::string* output_;
+  std::vector<uint8_t> buffer_;
+  size_t fail_after_;
+  size_t committed_{ 0 };
+  size_t partial_commits_{ 0 };
+};
+
+// Applies the patch through the streaming ApplyImagePatch(), with the deflate chunks recompressed
+// into the |buffer_size| bytes lent by a ZeroCopySink. Returns the result of ApplyImagePatch().
+static int GenerateTargetZeroCopy(const std::string& src, const std::string& patch,
+                                  TestZeroCopySink* zero_copy_sink, std::string* patched) {
+  MemorySourceReader source(reinterpret_cast<const uint8_t*>(src.data()), src.size());
+  Value patch_value(Value::Type::BLOB, patch);
+  return ApplyImagePatch(source, patch_value,
+                         [&](const unsigned char* data, size_t len) {
+                           patched->append(reinterpret_cast<const char*>(data), len);
+                           return len;
+                         },
+                         nullptr, zero_copy_sink);
+}
+
 static void verify_patched_image(const std::string& src, const std::string& patch,
                                  const std::string& tgt) {
   std::string patched;
   GenerateTarget(src, patch, &patched);
   ASSERT_EQ(tgt, patched);
+
+  std::string streamed;
+  GenerateTargetStreaming(src, patch, &streamed);
+  ASSERT_EQ(tgt, streamed);
+
+  std::string parallel;
+  GenerateTargetInParallel(src, patch, &parallel);
+  ASSERT_EQ(tgt, parallel);
+
+  std::string cached;
+  GenerateTargetWithInflateCache(src, patch, &cached);
+  ASSERT_EQ(tgt, cached);
+
+  // A buffer that isn't block aligned, so that the deflate output goes out in odd-sized pieces.
+  std::string zero_copied;
+  TestZeroCopySink zero_copy_sink(&zero_copied, 4093);
+  ASSERT_EQ(0, GenerateTargetZeroCopy(src, patch, &zero_copy_sink, &zero_copied));
+  ASSERT_EQ(tgt, zero_copied);
 }
 
 TEST(ImgdiffTest, invalid_args) {
@@ -383,6 +512,52 @@ TEST(ImgdiffTest, image_mode_simple) {
   verify_patched_image(src, patch, tgt);
 }
 
+TEST(ImgpatchTest, image_mode_zero_copy_sink) {
+  std::string gzipped_source;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("gzipped_source"),
+                                              &gzipped_source));
+  const std::string src = "abcdefg" + gzipped_source;
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+
+  std::string gzipped_target;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("gzipped_target"),
+                                              &gzipped_target));
+  const std::string tgt = "abcdefgxyz" + gzipped_target;
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  // The deflate chunk goes to the sink, in between the raw chunks that go to the SinkFn. Lending
+  // more than the rest of the deflate output leaves the last Commit() short.
+  for (size_t buffer_size : { 1, 100, 4093 }) {
+    std::string patched;
+    TestZeroCopySink zero_copy_sink(&patched, buffer_size);
+    ASSERT_EQ(0, GenerateTargetZeroCopy(src, patch, &zero_copy_sink, &patched)) << buffer_size;
+    ASSERT_EQ(tgt, patched) << buffer_size;
+    ASSERT_GT(zero_copy_sink.committed(), 0U);
+    if (buffer_size > 1) {
+      ASSERT_GT(zero_copy_sink.partial_commits(), 0U) << buffer_size;
+    }
+  }
+
+  // A sink that fails to lend memory fails the patching, whether at the start of the deflate
+  // output or in the middle of it.
+  for (size_t fail_after : { 0, 100 }) {
+    std::string patched;
+    TestZeroCopySink zero_copy_sink(&patched, 1, fail_after);
+    ASSERT_EQ(-1, GenerateTargetZeroCopy(src, patch, &zero_copy_sink, &patched)) << fail_after;
+    ASSERT_EQ(fail_after, zero_copy_sink.committed());
+  }
+}
+
 TEST(ImgdiffTest, image_mode_bad_gzip) {
   // Modify the uncompressed length in the gzip footer.
   const std::vector<char> src_data = { 'a',    'b',    'c',    'd',    'e',    'f',    'g',
@@ -799,6 +974,84 @@ TEST(ImgdiffTest, zip_mode_split_image_smoke) {
   ASSERT_EQ("2,30,34", split_src_ranges[3].ToString());
 }
 
+TEST(ImgdiffTest, zip_mode_split_image_cost_model) {
+  std::vector<uint8_t> content;
+  content.reserve(4096 * 50);
+  uint8_t n = 0;
+  generate_n(back_inserter(content), 4096 * 50, [&n]() { return n++ / 4096; });
+
+  // "a" and "b" come from the source, while "n1" to "n4" are new data.
+  ZipModeImage tgt_image(false, 4096 * 10);
+  std::vector<ImageChunk> tgt_chunks = ConstructImageChunks(content, { { "a", 4096 * 2 },
+                                                                       { "n1", 4096 * 3 },
+                                                                       { "n2", 4096 * 3 },
+                                                                       { "n3", 4096 * 3 },
+                                                                       { "n4", 4096 * 3 },
+                                                                       { "b", 4096 * 2 },
+                                                                       { "CD", 200 } });
+  tgt_image.Initialize(std::move(tgt_chunks),
+                       std::vector<uint8_t>(content.begin(), content.begin() + 65736));
+
+  ZipModeImage src_image(true, 4096 * 10);
+  std::vector<ImageChunk> src_chunks =
+      ConstructImageChunks(content, { { "a", 4096 * 2 }, { "b", 4096 * 2 }, { "CD", 5000 } });
+  src_image.Initialize(std::move(src_chunks),
+                       std::vector<uint8_t>(content.begin(), content.begin() + 21384));
+
+  // Filled up to the block limit, all the new data goes into a single piece.
+  std::vector<ZipModeImage> split_tgt_images;
+  std::vector<ZipModeImage> split_src_images;
+  std::vector<SortedRangeSet> split_src_ranges;
+  std::vector<SplitCost> split_costs;
+  ZipModeImage::SplitZipModeImageWithLimit(tgt_image, src_image, &split_tgt_images,
+                                           &split_src_images, &split_src_ranges, {}, &split_costs);
+  ASSERT_EQ(static_cast<size_t>(1), split_tgt_images.size());
+  ASSERT_EQ(static_cast<size_t>(1), split_costs.size());
+  ASSERT_EQ(static_cast<size_t>(4096 * 6), split_costs[0].src_size);
+  size_t patch_size = split_costs[0].patch_size;
+  size_t peak = split_costs[0].PeakMemory();
+
+  // The cost model splits the new data between the pieces with "a" and "b", and leaves the
+  // central directory on its own.
+  SplitCostModel cost_model;
+  cost_model.minimize_peak = true;
+  split_tgt_images.clear();
+  split_src_images.clear();
+  split_src_ranges.clear();
+  ZipModeImage::SplitZipModeImageWithLimit(tgt_image, src_image, &split_tgt_images,
+                                           &split_src_images, &split_src_ranges, cost_model,
+                                           &split_costs);
+  ASSERT_EQ(static_cast<size_t>(3), split_tgt_images.size());
+  ASSERT_EQ(static_cast<size_t>(3), split_costs.size());
+  ASSERT_EQ("2,0,2", split_src_ranges[0].ToString());
+  ASSERT_EQ("2,2,4", split_src_ranges[1].ToString());
+  ASSERT_EQ("2,4,6", split_src_ranges[2].ToString());
+  ASSERT_EQ(static_cast<size_t>(4096 * 8), split_tgt_images[0][0].DataLengthForPatch());
+
+  size_t max_peak = 0;
+  size_t total_patch_size = 0;
+  for (const auto& cost : split_costs) {
+    max_peak = std::max(max_peak, cost.PeakMemory());
+    total_patch_size += cost.patch_size;
+  }
+  ASSERT_LT(max_peak, peak);
+  ASSERT_LE(total_patch_size, patch_size + patch_size * cost_model.patch_slack_percent / 100);
+
+  // Without any slack, the estimated patch stays as with the pieces filled up to the block limit.
+  cost_model.patch_slack_percent = 0;
+  split_tgt_images.clear();
+  split_src_images.clear();
+  split_src_ranges.clear();
+  ZipModeImage::SplitZipModeImageWithLimit(tgt_image, src_image, &split_tgt_images,
+                                           &split_src_images, &split_src_ranges, cost_model,
+                                           &split_costs);
+  total_patch_size = 0;
+  for (const auto& cost : split_costs) {
+    total_patch_size += cost.patch_size;
+  }
+  ASSERT_EQ(patch_size, total_patch_size);
+}
+
 TEST(ImgdiffTest, zip_mode_store_large_apk) {
   // Construct src and tgt zip files with limit = 10 blocks.
   //     src              tgt
@@ -969,6 +1222,274 @@ TEST(ImgdiffTest, zip_mode_no_match_source) {
   GenerateAndCheckSplitTarget(debug_dir.path, 1, tgt);
 }
 
+TEST(ImgdiffTest, zip_mode_renamed_entries) {
+  // Generate 10 blocks of random data.
+  std::string random_data;
+  random_data.reserve(4096 * 10);
+  generate_n(back_inserter(random_data), 4096 * 10, []() { return rand() % 256; });
+
+  // "a" and "d" are renamed to "renamed" and "moved/d"; "b" keeps its name but changes.
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  construct_deflate_entry({ { "renamed", 0, 4 }, { "b", 5, 3 } }, &tgt_writer, random_data);
+  construct_store_entry({ { "moved/d", 2, 'd' } }, &tgt_writer);
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  construct_deflate_entry({ { "a", 0, 4 }, { "b", 4, 4 } }, &src_writer, random_data);
+  construct_store_entry({ { "d", 2, 'd' } }, &src_writer);
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  ZipModeImage src_image(true);
+  ZipModeImage tgt_image(false);
+  ASSERT_TRUE(src_image.Initialize(src_file.path));
+  ASSERT_TRUE(tgt_image.Initialize(tgt_file.path));
+
+  // The entries are matched by name first, and by content otherwise.
+  std::vector<std::string> matches;
+  for (const auto& chunk : tgt_image) {
+    if (chunk.GetEntryName().empty()) {
+      continue;
+    }
+    const ImageChunk* src_chunk = src_image.FindSourceChunk(chunk, true);
+    matches.push_back(src_chunk == nullptr ? "" : src_chunk->GetEntryName());
+  }
+  ASSERT_EQ((std::vector<std::string>{ "a", "b", "d" }), matches);
+
+  // Normal source chunks are only matched on request.
+  auto moved = std::find_if(tgt_image.cbegin(), tgt_image.cend(), [](const ImageChunk& chunk) {
+    return chunk.GetEntryName() == "moved/d";
+  });
+  ASSERT_NE(tgt_image.cend(), moved);
+  ASSERT_EQ(nullptr, src_image.FindSourceChunk(*moved));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file.path, &src));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  verify_patched_image(src, patch, tgt);
+}
+
+TEST(ImgdiffTest, zip_mode_num_threads) {
+  // Generate 20 blocks of random data.
+  std::string random_data;
+  random_data.reserve(4096 * 20);
+  generate_n(back_inserter(random_data), 4096 * 20, []() { return rand() % 256; });
+
+  // "c" and "d" have no matching source entries, so they share the pseudo source.
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  construct_deflate_entry({ { "a", 0, 4 }, { "b", 4, 4 }, { "c", 8, 4 }, { "d", 13, 5 } },
+                          &tgt_writer, random_data);
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  construct_deflate_entry({ { "a", 1, 4 }, { "b", 5, 3 }, { "e", 10, 8 } }, &src_writer,
+                          random_data);
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  // The patch doesn't depend on the number of threads.
+  TemporaryFile threaded_patch_file;
+  std::vector<const char*> threaded_args = {
+    "imgdiff", "-z", "--num-threads=4", src_file.path, tgt_file.path, threaded_patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(threaded_args.size(), threaded_args.data()));
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  std::string threaded_patch;
+  ASSERT_TRUE(android::base::ReadFileToString(threaded_patch_file.path, &threaded_patch));
+  ASSERT_EQ(patch, threaded_patch);
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file.path, &src));
+  verify_patched_image(src, threaded_patch, tgt);
+
+  std::vector<const char*> invalid_args = {
+    "imgdiff", "-z", "--num-threads=0", src_file.path, tgt_file.path, threaded_patch_file.path,
+  };
+  ASSERT_EQ(1, imgdiff(invalid_args.size(), invalid_args.data()));
+}
+
+TEST(ImgdiffTest, zip_mode_low_memory) {
+  // Generate 20 blocks of random data.
+  std::string random_data;
+  random_data.reserve(4096 * 20);
+  generate_n(back_inserter(random_data), 4096 * 20, []() { return rand() % 256; });
+
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  construct_deflate_entry({ { "a", 0, 4 }, { "b", 4, 4 }, { "c", 8, 4 } }, &tgt_writer,
+                          random_data);
+  construct_store_entry({ { "d", 4, 'd' } }, &tgt_writer);
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  construct_deflate_entry({ { "a", 1, 4 }, { "b", 5, 3 }, { "e", 10, 8 } }, &src_writer,
+                          random_data);
+  construct_store_entry({ { "d", 2, 'd' } }, &src_writer);
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  // The low-memory mode generates the same patch.
+  TemporaryFile low_memory_patch_file;
+  std::vector<const char*> low_memory_args = {
+    "imgdiff", "-z", "--low-memory", "--num-threads=2", src_file.path, tgt_file.path,
+    low_memory_patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(low_memory_args.size(), low_memory_args.data()));
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  std::string low_memory_patch;
+  ASSERT_TRUE(android::base::ReadFileToString(low_memory_patch_file.path, &low_memory_patch));
+  ASSERT_EQ(patch, low_memory_patch);
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file.path, &src));
+  verify_patched_image(src, low_memory_patch, tgt);
+}
+
+TEST(ImgdiffTest, image_mode_low_memory) {
+  std::string gzipped_source_path = from_testdata_base("gzipped_source");
+  std::string gzipped_source;
+  ASSERT_TRUE(android::base::ReadFileToString(gzipped_source_path, &gzipped_source));
+  const std::string src = "abcdefg" + gzipped_source;
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+
+  std::string gzipped_target_path = from_testdata_base("gzipped_target");
+  std::string gzipped_target;
+  ASSERT_TRUE(android::base::ReadFileToString(gzipped_target_path, &gzipped_target));
+  const std::string tgt = "abcdefgxyz" + gzipped_target;
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  TemporaryFile low_memory_patch_file;
+  std::vector<const char*> low_memory_args = {
+    "imgdiff", "--low-memory", src_file.path, tgt_file.path, low_memory_patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(low_memory_args.size(), low_memory_args.data()));
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  std::string low_memory_patch;
+  ASSERT_TRUE(android::base::ReadFileToString(low_memory_patch_file.path, &low_memory_patch));
+  ASSERT_EQ(patch, low_memory_patch);
+
+  verify_patched_image(src, low_memory_patch, tgt);
+}
+
+TEST(ImgdiffTest, zip_mode_sa_cache_dir) {
+  // Generate 20 blocks of random data.
+  std::string random_data;
+  random_data.reserve(4096 * 20);
+  generate_n(back_inserter(random_data), 4096 * 20, []() { return rand() % 256; });
+
+  // "c" has no matching source entry, so it uses the pseudo source.
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  construct_deflate_entry({ { "a", 0, 4 }, { "b", 4, 4 }, { "c", 8, 4 } }, &tgt_writer,
+                          random_data);
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  construct_deflate_entry({ { "a", 1, 4 }, { "b", 5, 3 }, { "e", 10, 8 } }, &src_writer,
+                          random_data);
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  // The cache directory is created on the first run.
+  TemporaryDir temp_dir;
+  std::string cache_dir = std::string(temp_dir.path) + "/sa_cache";
+  std::string cache_arg = "--sa-cache-dir=" + cache_dir;
+  auto cache_files = [&cache_dir]() {
+    std::vector<std::string> files;
+    for (const auto& entry : std::filesystem::directory_iterator(cache_dir)) {
+      files.push_back(entry.path().filename());
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+  };
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", cache_arg.c_str(), src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  auto files = cache_files();
+  ASSERT_FALSE(files.empty());
+
+  // The second run loads the saved suffix arrays, and generates the same patch.
+  TemporaryFile cached_patch_file;
+  std::vector<const char*> cached_args = {
+    "imgdiff", "-z", "--num-threads=2", cache_arg.c_str(), src_file.path, tgt_file.path,
+    cached_patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(cached_args.size(), cached_args.data()));
+  ASSERT_EQ(files, cache_files());
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  std::string cached_patch;
+  ASSERT_TRUE(android::base::ReadFileToString(cached_patch_file.path, &cached_patch));
+  ASSERT_EQ(patch, cached_patch);
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file.path, &src));
+  verify_patched_image(src, cached_patch, tgt);
+}
+
 TEST(ImgdiffTest, zip_mode_large_enough_limit) {
   // Generate 20 blocks of random data.
   std::string random_data;
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include <divsufsort.h>
+#include <divsufsort64.h>
+#include <gtest/gtest.h>
+
+#include "applypatch/suffix_array.h"
+
+// Checks ParallelSuffixSort() against divsufsort(), with 32-bit and 64-bit entries.
+static void CheckSuffixArray(const std::vector<uint8_t>& text) {
+  std::vector<saidx_t> expected(text.size());
+  ASSERT_EQ(0, divsufsort(text.data(), expected.data(), text.size()));
+
+  for (size_t num_threads : { 1, 3, 8 }) {
+    std::vector<int32_t> sa(text.size());
+    ASSERT_TRUE(ParallelSuffixSort(text.data(), text.size(), sa.data(), num_threads));
+    ASSERT_EQ(std::vector<int32_t>(expected.begin(), expected.end()), sa)
+        << text.size() << " bytes on " << num_threads << " threads";
+  }
+
+  std::vector<saidx64_t> expected64(text.size());
+  ASSERT_EQ(0, divsufsort64(text.data(), expected64.data(), text.size()));
+  std::vector<int64_t> sa64(text.size());
+  ASSERT_TRUE(ParallelSuffixSort(text.data(), text.size(), sa64.data(), 4));
+  ASSERT_EQ(std::vector<int64_t>(expected64.begin(), expected64.end()), sa64);
+}
+
+TEST(SuffixArrayTest, Small) {
+  CheckSuffixArray({});
+  CheckSuffixArray({ 'a' });
+  CheckSuffixArray({ 'b', 'a', 'n', 'a', 'n', 'a' });
+  // Suffixes that are prefixes of others, and zeros that pad the shorter ones.
+  CheckSuffixArray({ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 });
+  CheckSuffixArray({ 'a', 0, 'a', 0, 0, 'a', 0, 0, 0, 'a', 0, 0, 0, 0 });
+}
+
+TEST(SuffixArrayTest, Random) {
+  std::mt19937 random(0);
+  std::vector<uint8_t> text(3 * 1024 * 1024 + 17);
+  for (auto& byte : text) {
+    byte = random();
+  }
+  CheckSuffixArray(text);
+
+  // A small alphabet gives longer ties.
+  for (auto& byte : text) {
+    byte = random() % 4;
+  }
+  CheckSuffixArray(text);
+}
+
+TEST(SuffixArrayTest, Repetitive) {
+  // Runs of zeros and a repeated block, as in images, make large groups that tie for many rounds.
+  std::mt19937 random(0);
+  std::vector<uint8_t> block(4096);
+  for (auto& byte : block) {
+    byte = random();
+  }
+  std::vector<uint8_t> text(1024 * 1024, 0);
+  for (size_t i = 0; i < 64; i++) {
+    text.insert(text.end(), block.begin(), block.end());
+  }
+  text.insert(text.end(), 512 * 1024, 0);
+  text.push_back(1);
+  CheckSuffixArray(text);
+}
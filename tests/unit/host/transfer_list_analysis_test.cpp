@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+
+#include "private/commands.h"
+#include "updater/transfer_list_analysis.h"
+
+static TransferListAnalysis Analyze(const std::vector<std::string>& commands) {
+  std::vector<std::string> lines = { "4", "0", "2", "20" };
+  lines.insert(lines.end(), commands.begin(), commands.end());
+  std::string err;
+  auto transfer_list = TransferList::Parse(android::base::Join(lines, "\n"), &err);
+  EXPECT_TRUE(transfer_list) << err;
+  TransferListAnalysis analysis;
+  EXPECT_TRUE(AnalyzeTransferList(transfer_list, &analysis, &err)) << err;
+  return analysis;
+}
+
+TEST(TransferListAnalysisTest, IndependentCommands) {
+  auto analysis = Analyze({
+      "new 2,0,4",
+      "new 2,4,8",
+      "zero 2,8,10",
+  });
+  ASSERT_EQ(2U, analysis.command_counts["new"]);
+  ASSERT_EQ(1U, analysis.command_counts["zero"]);
+  ASSERT_EQ(10U, analysis.blocks_written);
+  ASSERT_EQ(10U, analysis.unique_blocks_written);
+  ASSERT_EQ(8U, analysis.new_blocks);
+  ASSERT_EQ(10U, analysis.total_work);
+  ASSERT_EQ(4U, analysis.critical_path_work);
+  ASSERT_EQ(1U, analysis.critical_path_commands);
+}
+
+TEST(TransferListAnalysisTest, DependentCommands) {
+  std::string src_hash(40, 'a');
+  std::string tgt_hash(40, 'b');
+  auto analysis = Analyze({
+      "stash " + src_hash + " 2,0,2",
+      "new 2,0,2",
+      // Moves the stash to blocks 10-11, then blocks 10-11 to 12-13.
+      "move " + src_hash + " 2,10,12 2 - " + src_hash + ":2,0,2",
+      "free " + src_hash,
+      "move " + tgt_hash + " 2,12,14 2 2,10,12",
+  });
+  ASSERT_EQ(2U, analysis.blocks_stashed);
+  ASSERT_EQ(2U, analysis.blocks_loaded_from_stash);
+  ASSERT_EQ(2U, analysis.peak_stash_blocks);
+  ASSERT_EQ(1U, analysis.peak_stash_entries);
+  ASSERT_EQ(6U, analysis.blocks_written);
+  ASSERT_EQ(4U, analysis.blocks_read);
+  // stash (2 read + 2 stashed) -> move (2 loaded + 2 written) -> move (2 read + 2 written); the new
+  // command only has to wait for the stash.
+  ASSERT_EQ(12U, analysis.critical_path_work);
+  ASSERT_EQ(3U, analysis.critical_path_commands);
+  ASSERT_EQ(14U, analysis.total_work);
+}
+
+TEST(TransferListAnalysisTest, Fragmentation) {
+  auto analysis = Analyze({
+      "zero 6,0,1,2,3,4,8",
+      "zero 2,10,11",
+  });
+  // One command with 3 target ranges, one with 1.
+  ASSERT_EQ((std::map<size_t, size_t>{ { 1, 1 }, { 2, 1 } }), analysis.ranges_per_command);
+  // Ranges of 1, 1, 4 and 1 blocks.
+  ASSERT_EQ((std::map<size_t, size_t>{ { 1, 3 }, { 4, 1 } }), analysis.blocks_per_range);
+}
+
+TEST(TransferListAnalysisTest, MissingStash) {
+  std::vector<std::string> lines = { "4", "2", "0", "0", "move " + std::string(40, 'a') +
+                                                          " 2,0,2 2 - " + std::string(40, 'a') +
+                                                          ":2,0,2" };
+  std::string err;
+  auto transfer_list = TransferList::Parse(android::base::Join(lines, "\n"), &err);
+  ASSERT_TRUE(transfer_list) << err;
+  TransferListAnalysis analysis;
+  ASSERT_FALSE(AnalyzeTransferList(transfer_list, &analysis, &err));
+}
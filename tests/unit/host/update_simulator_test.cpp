@@ -16,6 +16,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/stat.h>
 
 #include <map>
 #include <string>
@@ -50,11 +51,11 @@ constexpr uint8_t SPARSE_SYSTEM_HEADER[] = {
   0x6d, 0x2e, 0x69, 0x6d, 0x67, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 };
 
-static void AddZipEntries(int fd, const std::map<string, string>& entries) {
+static void AddZipEntries(int fd, const std::map<string, string>& entries, size_t flags = 0) {
   FILE* zip_file = fdopen(fd, "w");
   ZipWriter writer(zip_file);
   for (const auto& pair : entries) {
-    ASSERT_EQ(0, writer.StartEntry(pair.first.c_str(), 0));
+    ASSERT_EQ(0, writer.StartEntry(pair.first.c_str(), flags));
     ASSERT_EQ(0, writer.WriteBytes(pair.second.data(), pair.second.size()));
     ASSERT_EQ(0, writer.FinishEntry());
   }
@@ -166,6 +167,64 @@ TEST_F(DISABLED_UpdateSimulatorTest, TargetFile_ExtractImage) {
   ASSERT_EQ(expected_content, content);
 }
 
+TEST_F(DISABLED_UpdateSimulatorTest, TargetFile_ExtractStoredAndDeflatedImages) {
+  // Larger than the buffer that the inflated data is written out with.
+  string boot_img_string;
+  for (size_t i = 0; i < 3 * 1024 * 1024; i++) {
+    boot_img_string += static_cast<char>(i % 251);
+  }
+  std::map<string, string> entries = {
+    { "META/misc_info.txt", "" },
+    { "RECOVERY/RAMDISK/system/etc/recovery.fstab", fstab_content_ },
+    { "IMAGES/boot.img", boot_img_string },
+  };
+
+  for (size_t flags : { size_t{ 0 }, size_t{ ZipWriter::kCompress } }) {
+    TemporaryFile zip_file;
+    AddZipEntries(zip_file.release(), entries, flags);
+    TargetFile target_file(zip_file.path, false);
+    ASSERT_TRUE(target_file.Open());
+    ASSERT_TRUE(target_file.EntryExists("IMAGES/boot.img"));
+    ASSERT_FALSE(target_file.EntryExists("IMAGES/recovery.img"));
+
+    std::vector<FstabInfo> fstab_info;
+    ASSERT_TRUE(target_file.ParseFstabInfo(&fstab_info));
+    ASSERT_EQ(7U, fstab_info.size());
+
+    TemporaryDir temp_dir;
+    TemporaryFile image;
+    ASSERT_TRUE(target_file.ExtractImage(
+        "IMAGES/boot.img", FstabInfo("/dev/boot", "boot", "emmc"), temp_dir.path, &image));
+    string content;
+    ASSERT_TRUE(android::base::ReadFileToString(image.path, &content));
+    ASSERT_EQ(boot_img_string, content) << flags;
+  }
+}
+
+TEST_F(DISABLED_UpdateSimulatorTest, TargetFile_ExtractedInput) {
+  TemporaryDir input_dir;
+  for (const auto& directory : { "/META", "/IMAGES" }) {
+    ASSERT_EQ(0, mkdir((input_dir.path + string(directory)).c_str(), 0755));
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile("", input_dir.path + string("/META/misc_info.txt")));
+  ASSERT_TRUE(
+      android::base::WriteStringToFile("boot.img", input_dir.path + string("/IMAGES/boot.img")));
+
+  TargetFile target_file(input_dir.path, true);
+  ASSERT_TRUE(target_file.Open());
+  ASSERT_TRUE(target_file.EntryExists("IMAGES/boot.img"));
+  ASSERT_FALSE(target_file.EntryExists("IMAGES/recovery.img"));
+  ASSERT_FALSE(target_file.EntryExists("IMAGES"));
+
+  TemporaryDir temp_dir;
+  TemporaryFile image;
+  ASSERT_TRUE(target_file.ExtractImage(
+      "IMAGES/boot.img", FstabInfo("/dev/boot", "boot", "emmc"), temp_dir.path, &image));
+  string content;
+  ASSERT_TRUE(android::base::ReadFileToString(image.path, &content));
+  ASSERT_EQ("boot.img", content);
+}
+
 TEST_F(DISABLED_UpdateSimulatorTest, TargetFile_ParseFstabInfo) {
   TemporaryFile zip_file;
   AddZipEntries(zip_file.release(),
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+
+#include "install/install_profiler.h"
+#include "recovery_utils/parse_install_logs.h"
+
+TEST(InstallProfilerTest, Phases) {
+  InstallProfiler profiler;
+  profiler.BeginPhase("mount");
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  profiler.EndPhase("mount");
+
+  // Overlapping phases; beginning a running phase again does nothing.
+  profiler.BeginPhase("verify");
+  profiler.BeginPhase("stage 1/3");
+  profiler.BeginPhase("verify");
+  profiler.EndPhase("stage 1/3");
+
+  // A phase that's still running isn't logged, until EndAllPhases().
+  std::vector<std::string> lines = profiler.GetLogLines();
+  ASSERT_EQ(2U, lines.size());
+  ASSERT_TRUE(android::base::StartsWith(lines[0], "phase_mount: 0 ")) << lines[0];
+  ASSERT_TRUE(android::base::StartsWith(lines[1], "phase_stage_1_3: ")) << lines[1];
+
+  profiler.EndAllPhases();
+  lines = profiler.GetLogLines();
+  ASSERT_EQ(3U, lines.size());
+  ASSERT_TRUE(android::base::StartsWith(lines[1], "phase_verify: ")) << lines[1];
+
+  auto metrics = ParseRecoveryUpdateMetrics(lines);
+  ASSERT_GE(metrics["ota_phase_mount_ms"], 20);
+  ASSERT_EQ(1U, metrics.count("ota_phase_verify_cpu_ms"));
+  ASSERT_EQ(1U, metrics.count("ota_phase_stage_1_3_written_KiBs"));
+}
+
+TEST(InstallProfilerTest, ChildCpuTime) {
+  InstallProfiler profiler;
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  if (pid == 0) {
+    // Spin for a while.
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+    while (std::chrono::steady_clock::now() < end) {
+    }
+    _exit(0);
+  }
+
+  profiler.SetChild(pid);
+  profiler.BeginPhase("updater");
+  int status;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  profiler.EndPhase("updater");
+  profiler.SetChild(-1);
+
+  // The CPU time of the child is counted once it has been reaped.
+  auto metrics = ParseRecoveryUpdateMetrics(profiler.GetLogLines());
+  ASSERT_GE(metrics["ota_phase_updater_cpu_ms"], 100);
+}
@@ -98,8 +98,7 @@ TEST(InstallTest, read_wipe_ab_partition_list) {
   std::string wipe_package;
   ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &wipe_package));
 
-  auto package = Package::CreateMemoryPackage(
-      std::vector<uint8_t>(wipe_package.begin(), wipe_package.end()), nullptr);
+  auto package = Package::AdoptMemoryPackage(std::move(wipe_package), nullptr);
 
   auto read_partition_list = GetWipePartitionList(package.get());
   std::vector<std::string> expected = {
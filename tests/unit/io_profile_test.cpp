@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "otautil/io_profile.h"
+#include "otautil/paths.h"
+
+TEST(IoProfileTest, WriteAndRead) {
+  IoProfile profile;
+  profile.seq_read_kib_per_sec = 300000;
+  profile.seq_write_kib_per_sec = 150000;
+  profile.rand_read_iops = 5000;
+  profile.rand_write_iops = 3000;
+  profile.rand_read_iops_at_depth = 40000;
+  profile.discard_kib_per_sec = 2000000;
+  profile.fsync_latency_us = 800;
+  profile.queue_depth = 16;
+
+  TemporaryDir temp_dir;
+  std::string path = std::string(temp_dir.path) + "/io_profile";
+  ASSERT_TRUE(profile.Write(path));
+
+  IoProfile read;
+  ASSERT_TRUE(IoProfile::Read(path, &read));
+  ASSERT_EQ(profile.ToString(), read.ToString());
+  ASSERT_EQ(16U, read.queue_depth);
+}
+
+TEST(IoProfileTest, Read_Invalid) {
+  TemporaryFile temp_file;
+  IoProfile profile;
+
+  // Unknown keys are ignored, but the queue depth is required.
+  ASSERT_TRUE(android::base::WriteStringToFile("some_later_field=1\nqueue_depth=4\n",
+                                               temp_file.path));
+  ASSERT_TRUE(IoProfile::Read(temp_file.path, &profile));
+  ASSERT_EQ(4U, profile.queue_depth);
+
+  ASSERT_TRUE(android::base::WriteStringToFile("rand_read_iops=100\n", temp_file.path));
+  ASSERT_FALSE(IoProfile::Read(temp_file.path, &profile));
+
+  ASSERT_TRUE(android::base::WriteStringToFile("queue_depth=four\n", temp_file.path));
+  ASSERT_FALSE(IoProfile::Read(temp_file.path, &profile));
+
+  ASSERT_FALSE(IoProfile::Read(std::string(temp_file.path) + ".missing", &profile));
+}
+
+TEST(IoProfileTest, GetProfiledQueueDepth) {
+  TemporaryFile temp_file;
+  std::string saved = Paths::Get().io_profile_file();
+  Paths::Get().set_io_profile_file(temp_file.path);
+
+  // Not profiled.
+  ASSERT_EQ(8U, GetProfiledQueueDepth(8));
+
+  ASSERT_TRUE(android::base::WriteStringToFile("queue_depth=16\n", temp_file.path));
+  ASSERT_EQ(16U, GetProfiledQueueDepth(8));
+  ASSERT_EQ(4U, GetProfiledQueueDepth(8, 4));
+
+  Paths::Get().set_io_profile_file(saved);
+}
+
+TEST(IoProfileTest, MeasureIoProfile) {
+  TemporaryDir temp_dir;
+  IoBenchmarkOptions options;
+  options.file_size = 4 * 1024 * 1024;
+  options.random_ops = 64;
+  options.max_queue_depth = 4;
+
+  IoProfile profile;
+  ASSERT_TRUE(MeasureIoProfile(temp_dir.path, options, &profile));
+  ASSERT_GT(profile.seq_read_kib_per_sec, 0U);
+  ASSERT_GT(profile.seq_write_kib_per_sec, 0U);
+  ASSERT_GT(profile.rand_read_iops, 0U);
+  ASSERT_GT(profile.rand_write_iops, 0U);
+  ASSERT_GE(profile.rand_read_iops_at_depth, profile.rand_read_iops);
+  ASSERT_GT(profile.fsync_latency_us, 0U);
+  ASSERT_GE(profile.queue_depth, 1U);
+  ASSERT_LE(profile.queue_depth, 4U);
+
+  // The scratch file is gone.
+  std::string scratch = std::string(temp_dir.path) + "/io_benchmark.tmp";
+  ASSERT_EQ(-1, access(scratch.c_str(), F_OK));
+}
+
+TEST(IoProfileTest, MeasureIoProfile_NoRoom) {
+  TemporaryDir temp_dir;
+  IoBenchmarkOptions options;
+  options.file_size = UINT64_MAX / 4;
+
+  IoProfile profile;
+  ASSERT_FALSE(MeasureIoProfile(temp_dir.path, options, &profile));
+}
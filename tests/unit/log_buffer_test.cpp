@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+
+#include "otautil/log_buffer.h"
+
+static std::string ReadLog(const TemporaryFile& file) {
+  std::string content;
+  EXPECT_TRUE(android::base::ReadFileToString(file.path, &content));
+  return content;
+}
+
+TEST(LogBufferTest, AppendAndFlush) {
+  TemporaryFile temp_file;
+  LogBuffer buffer(temp_file.fd, 1024, std::chrono::hours(1));
+  buffer.Append("first");
+  buffer.Append("");
+  buffer.Append("third");
+  ASSERT_EQ("", ReadLog(temp_file));
+
+  buffer.Flush();
+  ASSERT_EQ("first\n\nthird\n", ReadLog(temp_file));
+}
+
+TEST(LogBufferTest, FlushesPeriodically) {
+  TemporaryFile temp_file;
+  LogBuffer buffer(temp_file.fd, 1024, std::chrono::milliseconds(10));
+  buffer.Append("line");
+  for (int i = 0; i < 500 && ReadLog(temp_file).empty(); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_EQ("line\n", ReadLog(temp_file));
+}
+
+TEST(LogBufferTest, FlushesOnDestruction) {
+  TemporaryFile temp_file;
+  {
+    LogBuffer buffer(temp_file.fd, 1024, std::chrono::hours(1));
+    buffer.Append("line");
+  }
+  ASSERT_EQ("line\n", ReadLog(temp_file));
+}
+
+TEST(LogBufferTest, WrapsAround) {
+  TemporaryFile temp_file;
+  std::string expected;
+  {
+    // Far more than the ring holds, so that the lines wrap around it and wait for room.
+    LogBuffer buffer(temp_file.fd, 64, std::chrono::hours(1));
+    for (int i = 0; i < 1000; i++) {
+      std::string line = "line " + std::to_string(i);
+      buffer.Append(line);
+      expected += line + "\n";
+    }
+    // Too large for the ring, so it's written out at once, after the lines before it.
+    std::string large(100, 'x');
+    buffer.Append(large);
+    expected += large + "\n";
+  }
+  ASSERT_EQ(expected, ReadLog(temp_file));
+}
+
+TEST(LogBufferTest, ConcurrentAppends) {
+  static constexpr int kThreads = 8;
+  static constexpr int kLines = 2000;
+
+  TemporaryFile temp_file;
+  {
+    LogBuffer buffer(temp_file.fd, 4096, std::chrono::milliseconds(1));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+      threads.emplace_back([&buffer, t]() {
+        for (int i = 0; i < kLines; i++) {
+          buffer.Append(std::to_string(t) + " " + std::to_string(i));
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  // Every line is there whole, and the lines of each thread are in order.
+  std::vector<int> next(kThreads, 0);
+  auto lines = android::base::Split(ReadLog(temp_file), "\n");
+  ASSERT_EQ("", lines.back());
+  lines.pop_back();
+  ASSERT_EQ(static_cast<size_t>(kThreads * kLines), lines.size());
+  for (const auto& line : lines) {
+    int t, i;
+    ASSERT_EQ(2, sscanf(line.c_str(), "%d %d", &t, &i)) << line;
+    ASSERT_EQ(next[t]++, i);
+  }
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <gtest/gtest.h>
+
+#include "otautil/memory_governor.h"
+
+static constexpr size_t kMiB = 1024 * 1024;
+
+class MemoryGovernorTest : public ::testing::Test {
+ protected:
+  // Sets MemAvailable in the fake /proc/meminfo.
+  void SetAvailable(size_t bytes) {
+    available_ = bytes;
+    std::string meminfo = android::base::StringPrintf(
+        "MemTotal:        2000000 kB\nMemFree:           10000 kB\nMemAvailable:    %8zu kB\n",
+        bytes / 1024);
+    ASSERT_TRUE(android::base::WriteStringToFile(meminfo, meminfo_.path));
+  }
+
+  // Returns a shrink callback for a cache that uses |*used| bytes, and gives back what it frees to
+  // MemAvailable.
+  std::function<size_t(size_t)> Shrinker(size_t* used) {
+    return [this, used](size_t bytes) {
+      size_t freed = std::min(bytes, *used);
+      *used -= freed;
+      SetAvailable(available_ + freed);
+      return freed;
+    };
+  }
+
+  TemporaryFile meminfo_;
+  size_t available_{ 0 };
+};
+
+TEST_F(MemoryGovernorTest, GrantsWhatFits) {
+  SetAvailable(300 * kMiB);
+  MemoryGovernor governor(meminfo_.path, 100 * kMiB, 10 * kMiB, std::chrono::milliseconds(0));
+  ASSERT_EQ(200 * kMiB, governor.GetAvailable(MemoryPriority::kCache));
+  ASSERT_EQ(290 * kMiB, governor.GetAvailable(MemoryPriority::kRequired));
+
+  auto cache = governor.Reserve("cache", MemoryPriority::kCache, kMiB, 150 * kMiB);
+  ASSERT_NE(nullptr, cache);
+  ASSERT_EQ(150 * kMiB, cache->bytes());
+
+  // The first reservation isn't in use yet, so it's held back from the next ones.
+  auto other = governor.Reserve("other", MemoryPriority::kCache, kMiB, 150 * kMiB);
+  ASSERT_NE(nullptr, other);
+  ASSERT_EQ(50 * kMiB, other->bytes());
+
+  ASSERT_EQ(nullptr, governor.Reserve("too large", MemoryPriority::kCache, kMiB, kMiB));
+
+  // Releasing the reservations gives the memory back.
+  cache.reset();
+  other.reset();
+  ASSERT_EQ(200 * kMiB, governor.GetAvailable(MemoryPriority::kCache));
+}
+
+TEST_F(MemoryGovernorTest, UsedMemoryIsNotCountedTwice) {
+  SetAvailable(300 * kMiB);
+  MemoryGovernor governor(meminfo_.path, 100 * kMiB, 10 * kMiB, std::chrono::milliseconds(0));
+  size_t used = 0;
+  auto cache = governor.Reserve("cache", MemoryPriority::kCache, kMiB, 150 * kMiB,
+                                { [&used]() { return used; }, nullptr });
+  ASSERT_NE(nullptr, cache);
+  ASSERT_EQ(50 * kMiB, governor.GetAvailable(MemoryPriority::kCache));
+
+  // Memory in use shows up in MemAvailable instead.
+  used = 100 * kMiB;
+  SetAvailable(200 * kMiB);
+  ASSERT_EQ(50 * kMiB, governor.GetAvailable(MemoryPriority::kCache));
+}
+
+TEST_F(MemoryGovernorTest, RequiredMemoryShrinksCaches) {
+  SetAvailable(300 * kMiB);
+  MemoryGovernor governor(meminfo_.path, 100 * kMiB, 10 * kMiB, std::chrono::milliseconds(0));
+  size_t small_used = 0;
+  size_t large_used = 0;
+  auto small = governor.Reserve("small", MemoryPriority::kCache, kMiB, 50 * kMiB,
+                                { [&small_used]() { return small_used; }, Shrinker(&small_used) });
+  auto large = governor.Reserve("large", MemoryPriority::kCache, kMiB, 150 * kMiB,
+                                { [&large_used]() { return large_used; }, Shrinker(&large_used) });
+  ASSERT_NE(nullptr, small);
+  ASSERT_NE(nullptr, large);
+  ASSERT_EQ(150 * kMiB, large->bytes());
+
+  // Fill both caches.
+  small_used = 50 * kMiB;
+  large_used = 150 * kMiB;
+  SetAvailable(100 * kMiB);
+  ASSERT_EQ(90 * kMiB, governor.GetAvailable(MemoryPriority::kRequired));
+
+  // The largest cache is shrunk first, and only as much as needed.
+  auto stash = governor.Reserve("stash", MemoryPriority::kRequired, 100 * kMiB, 120 * kMiB);
+  ASSERT_NE(nullptr, stash);
+  ASSERT_EQ(50 * kMiB, small_used);
+  ASSERT_EQ(120 * kMiB, large_used);
+  ASSERT_EQ(120 * kMiB, large->bytes());
+}
+
+TEST_F(MemoryGovernorTest, Rebalance) {
+  SetAvailable(300 * kMiB);
+  MemoryGovernor governor(meminfo_.path, 100 * kMiB, 10 * kMiB, std::chrono::milliseconds(0));
+  size_t used = 0;
+  auto cache = governor.Reserve("cache", MemoryPriority::kCache, kMiB, 150 * kMiB,
+                                { [&used]() { return used; }, Shrinker(&used) });
+  ASSERT_NE(nullptr, cache);
+  used = 150 * kMiB;
+  SetAvailable(150 * kMiB);
+  ASSERT_EQ(0U, governor.Rebalance());
+
+  // Another process takes 80 MiB, which leaves 30 MiB short of the cache headroom.
+  SetAvailable(70 * kMiB);
+  ASSERT_EQ(30 * kMiB, governor.Rebalance());
+  ASSERT_EQ(120 * kMiB, used);
+  ASSERT_EQ(120 * kMiB, cache->bytes());
+}
+
+TEST_F(MemoryGovernorTest, RebalanceInterval) {
+  SetAvailable(300 * kMiB);
+  MemoryGovernor governor(meminfo_.path, 100 * kMiB, 10 * kMiB, std::chrono::hours(1));
+  size_t shrinks = 0;
+  auto cache = governor.Reserve("cache", MemoryPriority::kCache, kMiB, 150 * kMiB,
+                                { nullptr, [&shrinks](size_t bytes) {
+                                   shrinks++;
+                                   return bytes;
+                                 } });
+  ASSERT_NE(nullptr, cache);
+  SetAvailable(50 * kMiB);
+  ASSERT_NE(0U, governor.Rebalance());
+  ASSERT_EQ(0U, governor.Rebalance());
+  ASSERT_EQ(1U, shrinks);
+}
+
+TEST_F(MemoryGovernorTest, OlderKernel) {
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      "MemTotal: 2000000 kB\nMemFree: 100000 kB\nBuffers: 50000 kB\nCached: 50000 kB\n",
+      meminfo_.path));
+  MemoryGovernor governor(meminfo_.path, 0, 0, std::chrono::milliseconds(0));
+  ASSERT_EQ(200000U * 1024, governor.GetAvailable(MemoryPriority::kCache));
+}
+
+TEST(MemoryGovernorNoMeminfoTest, GrantsInFull) {
+  MemoryGovernor governor("/nonexistent", 100 * kMiB, 10 * kMiB, std::chrono::milliseconds(0));
+  auto reservation = governor.Reserve("cache", MemoryPriority::kCache, kMiB, 150 * kMiB);
+  ASSERT_NE(nullptr, reservation);
+  ASSERT_EQ(150 * kMiB, reservation->bytes());
+}
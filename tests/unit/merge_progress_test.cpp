@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+
+#include <gtest/gtest.h>
+
+#include "install/merge_progress.h"
+
+using namespace std::chrono_literals;
+
+TEST(MergeProgressMonitorTest, ReportsWholePercents) {
+  MergeProgressMonitor monitor;
+  auto start = MergeProgressMonitor::Clock::now();
+  ASSERT_TRUE(monitor.Update(10.2, start));
+  ASSERT_FALSE(monitor.Update(10.7, start + 1s));
+  ASSERT_TRUE(monitor.Update(11.1, start + 2s));
+  ASSERT_FALSE(monitor.Update(11.1, start + 3s));
+
+  // A stalled merge is still reported every so often.
+  ASSERT_TRUE(monitor.Update(11.1, start + 3s + MergeProgressMonitor::kReportInterval));
+}
+
+TEST(MergeProgressMonitorTest, Rate) {
+  MergeProgressMonitor monitor;
+  auto start = MergeProgressMonitor::Clock::now();
+  monitor.Update(0, start);
+  ASSERT_EQ(0, monitor.rate());
+  ASSERT_FALSE(monitor.remaining());
+
+  monitor.Update(10, start + 10s);
+  ASSERT_DOUBLE_EQ(1, monitor.rate());
+  ASSERT_EQ(90s, monitor.remaining());
+
+  // The rate is smoothed over the samples.
+  monitor.Update(30, start + 20s);
+  ASSERT_DOUBLE_EQ(0.3 * 2 + 0.7 * 1, monitor.rate());
+  ASSERT_EQ("30.0% (1.30%/s, about 0:54 left)", monitor.Describe());
+}
+
+TEST(MergeProgressMonitorTest, ProgressGoesBack) {
+  MergeProgressMonitor monitor;
+  auto start = MergeProgressMonitor::Clock::now();
+  monitor.Update(50, start);
+  monitor.Update(60, start + 10s);
+  ASSERT_TRUE(monitor.Update(5, start + 11s));
+  ASSERT_EQ(0, monitor.rate());
+  ASSERT_EQ("5.0%", monitor.Describe());
+}
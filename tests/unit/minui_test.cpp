@@ -17,12 +17,19 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <chrono>
 #include <limits>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #include <gtest/gtest.h>
 
 #include "minui/minui.h"
+#include "private/blend.h"
+#include "private/text.h"
 
 TEST(GRSurfaceTest, Create_aligned) {
   auto surface = GRSurface::Create(9, 11, 9, 1);
@@ -52,3 +59,333 @@ TEST(GRSurfaceTest, Clone) {
   ASSERT_EQ(std::vector(image->data(), image->data() + image->data_size()),
             std::vector(image_copy->data(), image_copy->data() + image->data_size()));
 }
+
+TEST(GraphicsTest, MemoryBackend) {
+  gr_use_memory_backend(64, 48);
+  ASSERT_EQ(0, gr_init());
+  ASSERT_EQ(64, gr_fb_width());
+  ASSERT_EQ(48, gr_fb_height());
+
+  gr_rotate(GRRotation::RIGHT);
+  ASSERT_EQ(48, gr_fb_width());
+  ASSERT_EQ(64, gr_fb_height());
+  gr_rotate(GRRotation::NONE);
+
+  // The frame on the "screen" can be read back, for partial updates.
+  gr_color(255, 255, 255, 255);
+  gr_fill(0, 0, 10, 10);
+  gr_flip();
+  ASSERT_TRUE(gr_begin_partial_update());
+  gr_flip();
+
+  gr_exit();
+  gr_use_memory_backend(0, 0);
+}
+
+TEST(GraphicsTest, SetDrawSurface) {
+  gr_use_memory_backend(64, 48);
+  ASSERT_EQ(0, gr_init());
+  gr_flip();
+  ASSERT_TRUE(gr_begin_partial_update());
+
+  auto surface = GRSurface::Create(16, 8, 16 * 4, 4);
+  ASSERT_TRUE(surface);
+  ASSERT_TRUE(gr_set_draw_surface(surface.get()));
+  ASSERT_EQ(16, gr_fb_width());
+  ASSERT_EQ(8, gr_fb_height());
+  gr_color(0, 0, 0, 255);
+  gr_clear();
+  gr_color(255, 255, 255, 255);
+  gr_fill(2, 0, 4, 8);
+  ASSERT_TRUE(gr_set_draw_surface(nullptr));
+  ASSERT_EQ(64, gr_fb_width());
+
+  // Only the two filled columns of the surface are white.
+  const uint32_t* row = reinterpret_cast<const uint32_t*>(surface->data());
+  for (int x = 0; x < 16; x++) {
+    ASSERT_EQ(x == 2 || x == 3, row[x] == 0xffffffff) << x;
+  }
+
+  // Drawing into the surface left the partial frame alone, and blitting it makes the damage.
+  ASSERT_TRUE(gr_damage().empty());
+  gr_blit(surface.get(), 0, 0, 16, 8, 10, 20);
+  auto damage = gr_damage();
+  ASSERT_EQ(1U, damage.size());
+  ASSERT_EQ(10, damage[0].x);
+  ASSERT_EQ(20, damage[0].y);
+  ASSERT_EQ(16, damage[0].width);
+  ASSERT_EQ(8, damage[0].height);
+
+  // Rotated screens, and surfaces of another pixel size, can't be drawn into.
+  auto alpha_surface = GRSurface::Create(16, 8, 16, 1);
+  ASSERT_TRUE(alpha_surface);
+  ASSERT_FALSE(gr_set_draw_surface(alpha_surface.get()));
+  gr_rotate(GRRotation::RIGHT);
+  ASSERT_FALSE(gr_set_draw_surface(surface.get()));
+  ASSERT_EQ(48, gr_fb_width());
+  gr_rotate(GRRotation::NONE);
+  gr_flip();
+
+  gr_exit();
+  gr_use_memory_backend(0, 0);
+}
+
+TEST(GraphicsTest, RoundClip) {
+  gr_use_memory_backend(64, 48);
+  ASSERT_EQ(0, gr_init());
+
+  auto surface = GRSurface::Create(20, 10, 20 * 4, 4);
+  ASSERT_TRUE(surface);
+  ASSERT_TRUE(gr_set_draw_surface(surface.get()));
+  gr_color(0, 0, 0, 255);
+  gr_clear();
+  gr_set_round_clip(true);
+  gr_color(255, 255, 255, 255);
+  gr_fill(0, 0, 20, 10);
+  gr_set_round_clip(false);
+  ASSERT_TRUE(gr_set_draw_surface(nullptr));
+
+  // The circle of 10 pixels sits in the middle of the surface; the rows across its middle are
+  // filled from one side of it to the other, and the first row only around the center.
+  auto white = [&surface](int x, int y) {
+    return reinterpret_cast<const uint32_t*>(surface->data() + y * surface->row_bytes)[x] ==
+           0xffffffff;
+  };
+  for (int x = 0; x < 20; x++) {
+    ASSERT_EQ(x >= 5 && x < 15, white(x, 5)) << x;
+  }
+  ASSERT_TRUE(white(9, 0));
+  ASSERT_TRUE(white(10, 0));
+  ASSERT_FALSE(white(5, 0));
+  ASSERT_FALSE(white(14, 9));
+
+  gr_exit();
+  gr_use_memory_backend(0, 0);
+}
+
+TEST(BlendTest, BlendPixel) {
+  // The alpha byte is taken from the color, and the others are blended.
+  ASSERT_EQ(0xff808080, BlendPixel(0x00000000, 0xffffffff, 0xff000000, 128));
+  ASSERT_EQ(0x808080ff, BlendPixel(0x00000000, 0xffffffff, 0x000000ff, 128));
+  ASSERT_EQ(0x20406080, BlendPixel(0x11223344, 0x20406080, 0xff000000, 255));
+  // No alpha leaves the pixel alone, alpha byte included.
+  ASSERT_EQ(0x11223344, BlendPixel(0x11223344, 0x20406080, 0xff000000, 0));
+}
+
+// The row kernels must match BlendPixel() exactly, at every alpha and for any row length (for the
+// vector loops and the tails after them).
+TEST(BlendTest, BlendFill) {
+  std::vector<uint32_t> pixels(37);
+  for (auto& pix : pixels) {
+    pix = (rand() << 16) ^ rand();
+  }
+  for (uint32_t alpha_mask : { 0xff000000U, 0x000000ffU }) {
+    for (int alpha = 0; alpha < 256; alpha++) {
+      for (size_t count : { 1, 4, 8, 37 }) {
+        std::vector<uint32_t> dst(pixels);
+        BlendFill(dst.data(), count, 0x80c0ff40, alpha_mask, alpha);
+        for (size_t i = 0; i < dst.size(); i++) {
+          uint32_t expected =
+              i < count ? BlendPixel(pixels[i], 0x80c0ff40, alpha_mask, alpha) : pixels[i];
+          ASSERT_EQ(expected, dst[i]) << "alpha " << alpha << ", count " << count << ", at " << i;
+        }
+      }
+    }
+  }
+}
+
+TEST(BlendTest, BlendMask) {
+  std::vector<uint32_t> pixels(37);
+  std::vector<uint8_t> coverage(pixels.size());
+  for (size_t i = 0; i < pixels.size(); i++) {
+    pixels[i] = (rand() << 16) ^ rand();
+    // Glyphs are mostly blank or solid.
+    coverage[i] = i % 3 == 0 ? 0 : i % 5 == 0 ? 255 : rand() % 256;
+  }
+  // Plus a run of blank pixels long enough for a vector.
+  std::fill_n(coverage.begin() + 16, 8, 0);
+
+  for (uint32_t alpha_mask : { 0xff000000U, 0x000000ffU }) {
+    for (int alpha = 0; alpha < 256; alpha++) {
+      std::vector<uint32_t> dst(pixels);
+      BlendMask(dst.data(), coverage.data(), dst.size(), 0x80c0ff40, alpha_mask, alpha);
+      for (size_t i = 0; i < dst.size(); i++) {
+        uint8_t a = coverage[i] * alpha / 255;
+        ASSERT_EQ(BlendPixel(pixels[i], 0x80c0ff40, alpha_mask, a), dst[i])
+            << "alpha " << alpha << ", at " << i;
+      }
+    }
+  }
+}
+
+static std::vector<uint32_t> DecodeUtf8(std::string_view text) {
+  std::vector<uint32_t> result;
+  uint32_t code_point;
+  while (NextCodePoint(&text, &code_point)) {
+    result.push_back(code_point);
+  }
+  return result;
+}
+
+TEST(TextTest, NextCodePoint) {
+  ASSERT_EQ((std::vector<uint32_t>{ 'a', 0xe9, 0x20ac, 0x1f600 }),
+            DecodeUtf8("a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80"));
+  ASSERT_EQ(4U, CountCodePoints("a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80"));
+  ASSERT_EQ(0U, CountCodePoints(""));
+
+  // A stray continuation byte, a truncated sequence, an overlong form and a surrogate.
+  ASSERT_EQ((std::vector<uint32_t>{ 0xfffd, 'a' }), DecodeUtf8("\x80" "a"));
+  ASSERT_EQ((std::vector<uint32_t>{ 0xfffd, 0xfffd }), DecodeUtf8("\xe2\x82"));
+  ASSERT_EQ((std::vector<uint32_t>{ 0xfffd, 0xfffd }), DecodeUtf8("\xc0\xaf"));
+  ASSERT_EQ((std::vector<uint32_t>{ 0xfffd, 0xfffd, 0xfffd }), DecodeUtf8("\xed\xa0\x80"));
+}
+
+TEST(TextTest, ParseGlyphRanges) {
+  std::vector<GRFont::GlyphRange> ranges;
+  ASSERT_TRUE(ParseGlyphRanges("32-126, 160-255,8364", &ranges));
+  ASSERT_EQ(3U, ranges.size());
+  ASSERT_EQ(160U, ranges[1].first);
+  ASSERT_EQ(255U, ranges[1].last);
+  ASSERT_EQ(8364U, ranges[2].first);
+  ASSERT_EQ(8364U, ranges[2].last);
+  ASSERT_EQ(95U + 96U + 1U, CountGlyphs(ranges));
+
+  ASSERT_FALSE(ParseGlyphRanges("", &ranges));
+  ASSERT_FALSE(ParseGlyphRanges("32-", &ranges));
+  ASSERT_FALSE(ParseGlyphRanges("126-32", &ranges));
+  ASSERT_FALSE(ParseGlyphRanges("1-2-3", &ranges));
+}
+
+// A font of 1x1 glyphs for 'a' - 'c', '?' and U+00E9, with the bold ones at 100 plus their index.
+class TextRunCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    texture_ = GRSurface::Create(5, 2, 5, 1);
+    ASSERT_TRUE(texture_);
+    for (uint8_t i = 0; i < 5; i++) {
+      texture_->data()[i] = i + 1;
+      texture_->data()[texture_->row_bytes + i] = 100 + i;
+    }
+    font_.texture = texture_.get();
+    font_.char_width = 1;
+    font_.char_height = 1;
+    font_.glyph_ranges = { { 'a', 'c' }, { '?', '?' }, { 0xe9, 0xe9 } };
+  }
+
+  static std::vector<uint8_t> Pixels(const GRSurface* surface) {
+    return std::vector<uint8_t>(surface->data(), surface->data() + surface->width);
+  }
+
+  std::unique_ptr<GRSurface> texture_;
+  GRFont font_;
+};
+
+TEST_F(TextRunCacheTest, GlyphIndex) {
+  ASSERT_EQ(0, GlyphIndex(font_, 'a'));
+  ASSERT_EQ(2, GlyphIndex(font_, 'c'));
+  ASSERT_EQ(4, GlyphIndex(font_, 0xe9));
+  ASSERT_EQ(3, GlyphIndex(font_, 'z'));
+
+  font_.glyph_ranges = { { 'a', 'c' } };
+  ASSERT_EQ(-1, GlyphIndex(font_, 'z'));
+}
+
+TEST_F(TextRunCacheTest, Composite) {
+  TextRunCache cache(4);
+  const GRSurface* run = cache.Get(&font_, false, "ab\xc3\xa9z", 100, GRRotation::NONE);
+  ASSERT_NE(nullptr, run);
+  ASSERT_EQ((std::vector<uint8_t>{ 1, 2, 5, 4 }), Pixels(run));
+  ASSERT_EQ(nullptr, run->rotated);
+
+  run = cache.Get(&font_, true, "ca", 100, GRRotation::NONE);
+  ASSERT_NE(nullptr, run);
+  ASSERT_EQ((std::vector<uint8_t>{ 102, 100 }), Pixels(run));
+
+  // Only up to |max_glyphs|.
+  run = cache.Get(&font_, false, "abcabc", 4, GRRotation::NONE);
+  ASSERT_NE(nullptr, run);
+  ASSERT_EQ((std::vector<uint8_t>{ 1, 2, 3, 1 }), Pixels(run));
+
+  run = cache.Get(&font_, false, "abc", 100, GRRotation::DOWN);
+  ASSERT_NE(nullptr, run);
+  ASSERT_EQ(GRRotation::DOWN, run->rotated_for);
+  ASSERT_EQ((std::vector<uint8_t>{ 3, 2, 1 }), Pixels(run->rotated.get()));
+
+  ASSERT_EQ(nullptr, cache.Get(&font_, false, "", 100, GRRotation::NONE));
+}
+
+TEST_F(TextRunCacheTest, EvictsLeastRecentlyUsed) {
+  TextRunCache cache(2);
+  const GRSurface* a = cache.Get(&font_, false, "a", 100, GRRotation::NONE);
+  ASSERT_NE(nullptr, cache.Get(&font_, false, "b", 100, GRRotation::NONE));
+  // A hit returns the same surface, and makes "a" the most recently used.
+  ASSERT_EQ(a, cache.Get(&font_, false, "a", 100, GRRotation::NONE));
+  ASSERT_NE(nullptr, cache.Get(&font_, false, "c", 100, GRRotation::NONE));
+  ASSERT_EQ(2U, cache.size());
+  ASSERT_EQ(a, cache.Get(&font_, false, "a", 100, GRRotation::NONE));
+
+  cache.Clear();
+  ASSERT_EQ(0U, cache.size());
+}
+
+TEST(EventsTest, Timers) {
+  // Timers work without any input devices (e.g. on the host).
+  ev_init([](int, uint32_t) { return 0; });
+
+  std::vector<int> fired;
+  ev_add_timer(std::chrono::milliseconds(20), [&fired]() { fired.push_back(2); });
+  ev_add_timer(std::chrono::milliseconds(10), [&fired]() { fired.push_back(1); });
+  int canceled = ev_add_timer(std::chrono::milliseconds(5), [&fired]() { fired.push_back(0); });
+  ev_cancel_timer(canceled);
+
+  auto start = std::chrono::steady_clock::now();
+  while (fired.size() < 2) {
+    ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(10));
+    if (!ev_wait(-1)) {
+      ev_dispatch();
+    }
+  }
+  ASSERT_EQ((std::vector<int>{ 1, 2 }), fired);
+  ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+
+  ev_exit();
+}
+
+TEST(EventsTest, Wake) {
+  ev_init([](int, uint32_t) { return 0; });
+
+  // Without any fds becoming ready or timers, only ev_wake() ends the wait.
+  std::thread waker([]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ev_wake();
+  });
+  ASSERT_EQ(0, ev_wait(-1));
+  ev_dispatch();
+  waker.join();
+
+  // The wakeup has been read, so there's nothing more to wait for.
+  ASSERT_EQ(-1, ev_wait(0));
+
+  ev_exit();
+}
+
+TEST(EventsTest, TimersPastATurnOfTheWheel) {
+  ev_init([](int, uint32_t) { return 0; });
+
+  // Due after more than a turn of the wheel, and sharing its slot with one that's due sooner.
+  std::vector<int> fired;
+  ev_add_timer(std::chrono::milliseconds(2570), [&fired]() { fired.push_back(2); });
+  ev_add_timer(std::chrono::milliseconds(10), [&fired]() { fired.push_back(1); });
+
+  auto start = std::chrono::steady_clock::now();
+  while (fired.size() < 2) {
+    ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(10));
+    if (!ev_wait(-1)) {
+      ev_dispatch();
+    }
+  }
+  ASSERT_EQ((std::vector<int>{ 1, 2 }), fired);
+  ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(2570));
+
+  ev_exit();
+}
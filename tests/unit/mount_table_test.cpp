@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "otautil/mount_table.h"
+
+TEST(MountTableTest, Find) {
+  TemporaryFile mounts;
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      "/dev/block/sda1 /cache ext4 rw,noatime 0 0\n"
+      "tmpfs /tmp tmpfs rw 0 0\n"
+      "/dev/block/sda1 /mnt/with\\040space ext4 ro 0 0\n"
+      "/dev/block/sda2 /cache f2fs rw 0 0\n",
+      mounts.path));
+
+  MountTable table(mounts.path);
+  ASSERT_TRUE(table.Refresh());
+  ASSERT_EQ(4U, table.mounts().size());
+
+  // The first mount wins, as for mounts on top of each other.
+  MountTable::Mount* cache = table.FindByMountPoint("/cache");
+  ASSERT_NE(nullptr, cache);
+  ASSERT_EQ("/dev/block/sda1", cache->device);
+  ASSERT_EQ("ext4", cache->filesystem);
+  ASSERT_EQ("rw,noatime", cache->flags);
+  ASSERT_EQ(nullptr, table.FindByMountPoint("/data"));
+  ASSERT_EQ(nullptr, table.FindByMountPoint("/cache/recovery"));
+
+  auto sda1 = table.FindByDevice("/dev/block/sda1");
+  ASSERT_EQ(2U, sda1.size());
+  ASSERT_EQ("/cache", sda1[0]->mount_point);
+  ASSERT_EQ("/mnt/with space", sda1[1]->mount_point);
+  ASSERT_TRUE(table.FindByDevice("/dev/block/sda3").empty());
+}
+
+TEST(MountTableTest, RefreshFile) {
+  TemporaryFile mounts;
+  ASSERT_TRUE(android::base::WriteStringToFile("tmpfs /tmp tmpfs rw 0 0\n", mounts.path));
+  MountTable table(mounts.path);
+  ASSERT_TRUE(table.Refresh());
+  ASSERT_NE(nullptr, table.FindByMountPoint("/tmp"));
+
+  // A table that can't be watched for changes is read every time.
+  ASSERT_TRUE(android::base::WriteStringToFile("tmpfs /mnt tmpfs rw 0 0\n", mounts.path));
+  ASSERT_TRUE(table.Refresh());
+  ASSERT_EQ(2U, table.reads());
+  ASSERT_EQ(nullptr, table.FindByMountPoint("/tmp"));
+  ASSERT_NE(nullptr, table.FindByMountPoint("/mnt"));
+}
+
+TEST(MountTableTest, RefreshProcMounts) {
+  MountTable table;
+  ASSERT_TRUE(table.Refresh());
+  ASSERT_EQ(1U, table.reads());
+  ASSERT_NE(nullptr, table.FindByMountPoint("/"));
+
+  // Unchanged, so it's not read again unless asked to.
+  ASSERT_TRUE(table.Refresh());
+  ASSERT_EQ(1U, table.reads());
+  table.Invalidate();
+  ASSERT_TRUE(table.Refresh());
+  ASSERT_EQ(2U, table.reads());
+}
+
+TEST(MountTableTest, MissingTable) {
+  MountTable table("/proc/there/is/no/such/file");
+  ASSERT_FALSE(table.Refresh());
+  ASSERT_TRUE(table.mounts().empty());
+}
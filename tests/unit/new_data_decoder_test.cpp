@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <brotli/encode.h>
+#include <gtest/gtest.h>
+#include <lz4frame.h>
+#include <zstd.h>
+
+#include "private/new_data_decoder.h"
+
+// Collects the decoded data, handing out at most |space| bytes at a time.
+class VectorSink : public NewDataSink {
+ public:
+  explicit VectorSink(size_t space) : space_(space) {}
+
+  uint8_t* AcquireSpace(size_t* size) override {
+    buffer_.resize(space_);
+    *size = space_;
+    return buffer_.data();
+  }
+
+  void CommitSpace(size_t size) override {
+    data_.insert(data_.end(), buffer_.begin(), buffer_.begin() + size);
+  }
+
+  const std::vector<uint8_t>& data() const {
+    return data_;
+  }
+
+ private:
+  size_t space_;
+  std::vector<uint8_t> buffer_;
+  std::vector<uint8_t> data_;
+};
+
+class NewDataDecoderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Compressible, but not trivially so.
+    std::mt19937 random(0);
+    data_.resize(3 * 1024 * 1024 + 123);
+    for (size_t i = 0; i < data_.size(); i++) {
+      data_[i] = (i / 512) % 2 == 0 ? 0 : random() % 16;
+    }
+  }
+
+  // Decodes |input| given in chunks of |chunk_size|, and checks the output against |data_|, less
+  // the first |skip| bytes.
+  void Decode(const std::string& name, const std::vector<uint8_t>& input, size_t max_workers = 4,
+              size_t skip = 0) {
+    std::vector<uint8_t> expected(data_.begin() + skip, data_.end());
+    for (size_t chunk_size : { 7, 65536, 1 << 20 }) {
+      VectorSink sink(4096);
+      auto decoder = CreateNewDataDecoder(name, &sink, max_workers, skip);
+      for (size_t offset = 0; offset < input.size(); offset += chunk_size) {
+        ASSERT_TRUE(decoder->Decode(input.data() + offset,
+                                    std::min(chunk_size, input.size() - offset)));
+      }
+      ASSERT_TRUE(decoder->Finish());
+      ASSERT_EQ(expected, sink.data()) << name << " in chunks of " << chunk_size;
+    }
+  }
+
+  // Compresses |data_| into zstd frames of |frame_size| bytes each, with or without their content
+  // size.
+  std::vector<uint8_t> ZstdFrames(size_t frame_size, bool content_size) {
+    std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+    ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_contentSizeFlag, content_size ? 1 : 0);
+    std::vector<uint8_t> output;
+    for (size_t offset = 0; offset < data_.size(); offset += frame_size) {
+      size_t size = std::min(frame_size, data_.size() - offset);
+      std::vector<uint8_t> frame(ZSTD_compressBound(size));
+      size_t compressed =
+          ZSTD_compress2(cctx.get(), frame.data(), frame.size(), data_.data() + offset, size);
+      EXPECT_FALSE(ZSTD_isError(compressed));
+      output.insert(output.end(), frame.begin(), frame.begin() + compressed);
+    }
+    return output;
+  }
+
+  std::vector<uint8_t> data_;
+};
+
+TEST_F(NewDataDecoderTest, Uncompressed) {
+  Decode("system.new.dat", data_);
+}
+
+TEST_F(NewDataDecoderTest, Brotli) {
+  std::vector<uint8_t> encoded(BrotliEncoderMaxCompressedSize(data_.size()));
+  size_t encoded_size = encoded.size();
+  ASSERT_TRUE(BrotliEncoderCompress(5, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE, data_.size(),
+                                    data_.data(), &encoded_size, encoded.data()));
+  encoded.resize(encoded_size);
+  Decode("system.new.dat.br", encoded);
+
+  // A truncated stream fails at the end.
+  VectorSink sink(4096);
+  auto decoder = CreateNewDataDecoder("system.new.dat.br", &sink, 1);
+  ASSERT_TRUE(decoder->Decode(encoded.data(), encoded.size() / 2));
+  ASSERT_FALSE(decoder->Finish());
+}
+
+TEST_F(NewDataDecoderTest, Zstd) {
+  // Independent frames, decoded in parallel or on a single thread.
+  std::vector<uint8_t> frames = ZstdFrames(1024 * 1024, true);
+  Decode("system.new.dat.zst", frames);
+  Decode("system.new.dat.zst", frames, 1);
+
+  // Frames without their content size, or too large to decode in parallel, are streamed.
+  Decode("system.new.dat.zst", ZstdFrames(1024 * 1024, false));
+  Decode("system.new.dat.zst", ZstdFrames(data_.size(), true));
+}
+
+TEST_F(NewDataDecoderTest, ZstdMixedFrames) {
+  std::vector<uint8_t> parallel = ZstdFrames(256 * 1024, true);
+  std::vector<uint8_t> streamed = ZstdFrames(256 * 1024, false);
+  // Decoding the same data twice over: the streamed frames must come out behind the others.
+  std::vector<uint8_t> input = parallel;
+  input.insert(input.end(), streamed.begin(), streamed.end());
+  std::vector<uint8_t> data = data_;
+  data_.insert(data_.end(), data.begin(), data.end());
+  Decode("system.new.dat.zst", input);
+}
+
+TEST_F(NewDataDecoderTest, ZstdInvalid) {
+  std::vector<uint8_t> frames = ZstdFrames(1024 * 1024, true);
+  VectorSink sink(4096);
+  auto decoder = CreateNewDataDecoder("system.new.dat.zst", &sink, 4);
+  ASSERT_TRUE(decoder->Decode(frames.data(), frames.size() - 1));
+  ASSERT_FALSE(decoder->Finish());
+
+  std::vector<uint8_t> garbage(4096, 'x');
+  decoder = CreateNewDataDecoder("system.new.dat.zst", &sink, 4);
+  ASSERT_FALSE(decoder->Decode(garbage.data(), garbage.size()));
+}
+
+TEST_F(NewDataDecoderTest, Lz4) {
+  std::vector<uint8_t> encoded(LZ4F_compressFrameBound(data_.size(), nullptr));
+  size_t encoded_size =
+      LZ4F_compressFrame(encoded.data(), encoded.size(), data_.data(), data_.size(), nullptr);
+  ASSERT_FALSE(LZ4F_isError(encoded_size));
+  encoded.resize(encoded_size);
+  Decode("system.new.dat.lz4", encoded);
+
+  VectorSink sink(4096);
+  auto decoder = CreateNewDataDecoder("system.new.dat.lz4", &sink, 1);
+  ASSERT_TRUE(decoder->Decode(encoded.data(), encoded.size() - 1));
+  ASSERT_FALSE(decoder->Finish());
+}
+
+TEST_F(NewDataDecoderTest, Skip) {
+  std::vector<uint8_t> encoded(BrotliEncoderMaxCompressedSize(data_.size()));
+  size_t encoded_size = encoded.size();
+  ASSERT_TRUE(BrotliEncoderCompress(5, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE, data_.size(),
+                                    data_.data(), &encoded_size, encoded.data()));
+  encoded.resize(encoded_size);
+  Decode("system.new.dat.br", encoded, 1, 1024 * 1024 + 4096);
+  Decode("system.new.dat", data_, 1, 12345);
+
+  // The skipped zstd frames end on a frame boundary, or in the middle of a frame; the frames come
+  // with or without their content size.
+  for (size_t skip : { 0, 4096, 1024 * 1024, 2 * 1024 * 1024 + 4096 }) {
+    Decode("system.new.dat.zst", ZstdFrames(1024 * 1024, true), 4, skip);
+    Decode("system.new.dat.zst", ZstdFrames(1024 * 1024, true), 1, skip);
+    Decode("system.new.dat.zst", ZstdFrames(1024 * 1024, false), 4, skip);
+  }
+  // All of it.
+  Decode("system.new.dat.zst", ZstdFrames(1024 * 1024, true), 4, data_.size());
+}
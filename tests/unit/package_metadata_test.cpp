@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
+
+#include "otautil/package.h"
+#include "otautil/package_metadata.h"
+
+static void BuildZipArchive(const std::map<std::string, std::string>& file_map, int fd) {
+  FILE* zip_file = fdopen(fd, "w");
+  ZipWriter writer(zip_file);
+  for (const auto& [name, content] : file_map) {
+    ASSERT_EQ(0, writer.StartEntry(name.c_str(), kCompressDeflated));
+    ASSERT_EQ(0, writer.WriteBytes(content.data(), content.size()));
+    ASSERT_EQ(0, writer.FinishEntry());
+  }
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(zip_file));
+}
+
+TEST(PackageMetadataTest, Parse) {
+  PackageMetadata metadata(" ota-type = AB\npre-device=a|b\r\nno value line\nempty=\n=no key\n");
+  ASSERT_EQ("AB", metadata.Get("ota-type"));
+  ASSERT_EQ("a|b", metadata.Get("pre-device"));
+  ASSERT_EQ("", metadata.Get("empty"));
+  ASSERT_EQ("no key", metadata.Get(""));
+  ASSERT_EQ("", metadata.Get("missing"));
+  ASSERT_EQ("", metadata.Get("no value line"));
+  ASSERT_TRUE(metadata.ota_metadata().empty());
+
+  ASSERT_EQ(4U, metadata.entries().size());
+  ASSERT_TRUE(std::is_sorted(metadata.entries().begin(), metadata.entries().end()));
+}
+
+TEST(PackageMetadataTest, DuplicateKeys) {
+  // The first line wins, as it did with the std::map that was filled in order.
+  PackageMetadata metadata("b=1\na=first\nc=3\na=second\n");
+  ASSERT_EQ("first", metadata.Get("a"));
+  ASSERT_EQ("1", metadata.Get("b"));
+  ASSERT_EQ("3", metadata.Get("c"));
+}
+
+TEST(PackageMetadataTest, Read) {
+  TemporaryFile temp_file;
+  BuildZipArchive({ { "META-INF/com/android/metadata", "ota-type=BRICK\n" },
+                    { "META-INF/com/android/metadata.pb", "\x0a\x01\x02" } },
+                  temp_file.release());
+
+  ZipArchiveHandle zip;
+  ASSERT_EQ(0, OpenArchive(temp_file.path, &zip));
+  auto metadata = PackageMetadata::Read(zip);
+  ASSERT_NE(nullptr, metadata);
+  ASSERT_EQ("BRICK", metadata->Get("ota-type"));
+  ASSERT_EQ("\x0a\x01\x02", metadata->ota_metadata());
+  CloseArchive(zip);
+}
+
+TEST(PackageMetadataTest, Read_NoEntry) {
+  TemporaryFile temp_file;
+  BuildZipArchive({ { "META-INF/com/android/metadata.pb", "" } }, temp_file.release());
+
+  ZipArchiveHandle zip;
+  ASSERT_EQ(0, OpenArchive(temp_file.path, &zip));
+  ASSERT_EQ(nullptr, PackageMetadata::Read(zip));
+  CloseArchive(zip);
+}
+
+TEST(PackageMetadataTest, CachedOnPackage) {
+  TemporaryFile temp_file;
+  BuildZipArchive({ { "META-INF/com/android/metadata", "ota-type=AB\n" } }, temp_file.release());
+
+  auto package = Package::CreateFilePackage(temp_file.path, nullptr);
+  ASSERT_NE(nullptr, package);
+  const PackageMetadata* metadata = package->GetMetadata();
+  ASSERT_NE(nullptr, metadata);
+  ASSERT_EQ("AB", metadata->Get("ota-type"));
+  ASSERT_EQ(metadata, package->GetMetadata());
+}
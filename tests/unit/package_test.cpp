@@ -59,6 +59,11 @@ void PackageTest::SetUp() {
   auto file_package = Package::CreateFilePackage(temp_file_.path, nullptr);
   ASSERT_TRUE(file_package);
   packages_.emplace_back(std::move(file_package));
+
+  // And a package of the bytes, moved in.
+  auto adopted_package = Package::AdoptMemoryPackage(std::string(file_content_), nullptr);
+  ASSERT_TRUE(adopted_package);
+  packages_.emplace_back(std::move(adopted_package));
 }
 
 TEST_F(PackageTest, ReadFullyAtOffset_success) {
@@ -80,6 +85,20 @@ TEST_F(PackageTest, ReadFullyAtOffset_failure) {
   }
 }
 
+TEST_F(PackageTest, Prefetch) {
+  for (const auto& package : packages_) {
+    // Only a hint: ranges at or past the end are clamped or ignored, and reads work as before.
+    package->Prefetch(0, file_content_.size());
+    package->Prefetch(10, file_content_.size() * 2);
+    package->Prefetch(file_content_.size(), 4096);
+    package->Prefetch(0, 0);
+
+    std::vector<uint8_t> buffer(file_content_.size());
+    ASSERT_TRUE(package->ReadFullyAtOffset(buffer.data(), file_content_.size(), 0));
+    ASSERT_EQ(file_content_, std::string(buffer.begin(), buffer.end()));
+  }
+}
+
 TEST_F(PackageTest, UpdateHashAtOffset_sha1_hash) {
   // Check that the hash matches for first half of the file.
   uint64_t hash_size = file_content_.size() / 2;
@@ -99,6 +118,54 @@ TEST_F(PackageTest, UpdateHashAtOffset_sha1_hash) {
   }
 }
 
+TEST_F(PackageTest, UpdateHashAtOffset_multiple_chunks) {
+  // Large enough for the range to be read and hashed in several chunks, the last one partial.
+  std::string content(40 * MiB + 123, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>(i * 7 + i / 4096);
+  }
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  uint64_t start = 1000;
+  uint64_t hash_size = content.size() - start - 1;
+  std::vector<uint8_t> expected_sha(SHA256_DIGEST_LENGTH);
+  SHA256(reinterpret_cast<uint8_t*>(content.data()) + start, hash_size, expected_sha.data());
+
+  std::vector<std::unique_ptr<Package>> packages;
+  packages.emplace_back(Package::CreateMemoryPackage(temp_file.path, nullptr));
+  packages.emplace_back(Package::CreateFilePackage(temp_file.path, nullptr));
+  for (const auto& package : packages) {
+    ASSERT_TRUE(package);
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    uint64_t hashed = 0;
+    size_t chunks = 0;
+    std::vector<HasherUpdateCallback> hashers{
+      std::bind(&SHA256_Update, &ctx, std::placeholders::_1, std::placeholders::_2),
+      [&hashed, &chunks](const uint8_t* /* addr */, uint64_t size) {
+        hashed += size;
+        chunks++;
+      },
+    };
+    ASSERT_TRUE(package->UpdateHashAtOffset(hashers, start, hash_size));
+
+    std::vector<uint8_t> calculated_sha(SHA256_DIGEST_LENGTH);
+    SHA256_Final(calculated_sha.data(), &ctx);
+    ASSERT_EQ(expected_sha, calculated_sha);
+    ASSERT_EQ(hash_size, hashed);
+    ASSERT_EQ(3U, chunks);
+  }
+}
+
+TEST_F(PackageTest, UpdateHashAtOffset_failure) {
+  for (const auto& package : packages_) {
+    std::vector<HasherUpdateCallback> hashers{ [](const uint8_t*, uint64_t) {} };
+    // Out of bound read.
+    ASSERT_FALSE(package->UpdateHashAtOffset(hashers, 10, file_content_.size()));
+  }
+}
+
 TEST_F(PackageTest, GetZipArchiveHandle_extract_entry) {
   for (const auto& package : packages_) {
     ZipArchiveHandle zip = package->GetZipArchiveHandle();
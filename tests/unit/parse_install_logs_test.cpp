@@ -16,12 +16,14 @@
 
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/strings.h>
 #include <gtest/gtest.h>
 
+#include "otautil/install_metrics.h"
 #include "recovery_utils/parse_install_logs.h"
 
 TEST(ParseInstallLogsTest, EmptyFile) {
@@ -72,3 +74,151 @@ TEST(ParseInstallLogsTest, ParseRecoveryUpdateMetrics) {
 
   ASSERT_EQ(expected_result, metrics);
 }
+
+TEST(ParseInstallLogsTest, ParseRecoveryUpdateMetrics_Phases) {
+  std::vector<std::string> lines = {
+    "/cache/recovery/ota.zip",
+    "1",
+    "time_total: 30",
+    "phase_mount: 0 120 10 64 0",
+    "phase_verify: 130 9000 8500 1048576 0",
+    "phase_stage_1_3: 9200 4000 2000 2048 307200",
+    "phase_stage_1_3: 13300 1000 500 0 102400",
+    "phase_updater: 9150 bad 0 0 0",
+    "phase_finish: 14400 50",
+  };
+
+  auto metrics = ParseRecoveryUpdateMetrics(lines);
+
+  std::map<std::string, int64_t> expected_result = {
+    { "ota_time_total", 30 },
+    { "ota_phase_mount_ms", 120 },
+    { "ota_phase_mount_cpu_ms", 10 },
+    { "ota_phase_mount_read_KiBs", 64 },
+    { "ota_phase_mount_written_KiBs", 0 },
+    { "ota_phase_verify_ms", 9000 },
+    { "ota_phase_verify_cpu_ms", 8500 },
+    { "ota_phase_verify_read_KiBs", 1048576 },
+    { "ota_phase_verify_written_KiBs", 0 },
+    { "ota_phase_stage_1_3_ms", 5000 },
+    { "ota_phase_stage_1_3_cpu_ms", 2500 },
+    { "ota_phase_stage_1_3_read_KiBs", 2048 },
+    { "ota_phase_stage_1_3_written_KiBs", 409600 },
+  };
+
+  ASSERT_EQ(expected_result, metrics);
+}
+
+TEST(ParseInstallLogsTest, ParseUpdateTrace) {
+  std::vector<std::string> lines = {
+    "partition,index,command,blocks,read_us,patch_us,write_us,fsync_us,stash_loads,"
+    "stash_memory_hits",
+    "system,0,stash,10,1500,0,0,2500,0,0",
+    "system,1,bsdiff,20,1000,300000,40000,1000,1,1",
+    "system,2,bsdiff,30,1000,700000,60000,1000,2,0",
+    "vendor,0,new,512,25000,0,80000,3000,0,0,4,2097152,8,2097152,0,0,1,0,0",
+    "vendor,1,new,invalid,0,0,0,0,0,0",
+    "vendor,2,zero",
+    "",
+  };
+
+  auto metrics = ParseUpdateTrace(lines);
+
+  std::map<std::string, int64_t> expected_result = {
+    { "ota_trace_stash_count", 1 },        { "ota_trace_stash_blocks", 10 },
+    { "ota_trace_stash_read_ms", 1 },      { "ota_trace_stash_patch_ms", 0 },
+    { "ota_trace_stash_write_ms", 0 },     { "ota_trace_stash_fsync_ms", 2 },
+    { "ota_trace_bsdiff_count", 2 },       { "ota_trace_bsdiff_blocks", 50 },
+    { "ota_trace_bsdiff_read_ms", 2 },     { "ota_trace_bsdiff_patch_ms", 1000 },
+    { "ota_trace_bsdiff_write_ms", 100 },  { "ota_trace_bsdiff_fsync_ms", 2 },
+    { "ota_trace_new_count", 1 },          { "ota_trace_new_blocks", 512 },
+    { "ota_trace_new_read_ms", 25 },       { "ota_trace_new_patch_ms", 0 },
+    { "ota_trace_new_write_ms", 80 },      { "ota_trace_new_fsync_ms", 3 },
+    { "ota_trace_stash_loads", 3 },        { "ota_trace_stash_memory_hits", 1 },
+  };
+
+  ASSERT_EQ(expected_result, metrics);
+}
+
+TEST(ParseInstallLogsTest, ParseLastUpdateTrace_MissingFile) {
+  ASSERT_TRUE(ParseLastUpdateTrace("/doesntexist/last_update_trace").empty());
+}
+
+TEST(ParseInstallLogsTest, ParseLastInstallMetrics) {
+  TemporaryFile metrics_file;
+  // As the updater and then recovery append them.
+  ASSERT_TRUE(AppendInstallMetrics(
+      metrics_file.path, { { "bytes_written_system", 1200 * 1024 * 1024 },
+                           { "bytes_stashed_system", 300 * 1024 * 1024 },
+                           { "bytes_written_vendor", 40 * 1024 * 1024 },
+                           { "bytes_stashed_vendor", 50 * 1024 * 1024 } }));
+  ASSERT_TRUE(AppendInstallMetrics(metrics_file.path, { { "error", 22 }, { "cause", 55 } }));
+  ASSERT_TRUE(AppendInstallMetrics(
+      metrics_file.path,
+      { { "result", 0 }, { "time_total", 300 }, { "uncrypt_time", 40 },
+        { "source_build", 4973410 }, { "temperature_start", 37000 },
+        { "temperature_end", 38000 }, { "temperature_max", 39000 }, { "phase_verify_ms", 9000 },
+        { "phase_stage_1_3_ms", 4000 }, { "phase_stage_1_3_ms", 1000 } }));
+
+  std::map<std::string, int64_t> expected_result = {
+    { "ota_time_total", 300 },         { "ota_uncrypt_time", 40 },
+    { "ota_source_version", 4973410 }, { "ota_written_in_MiBs", 1240 },
+    { "ota_stashed_in_MiBs", 350 },    { "ota_temperature_start", 37000 },
+    { "ota_temperature_end", 38000 },  { "ota_temperature_max", 39000 },
+    { "ota_non_ab_error_code", 22 },   { "ota_non_ab_cause_code", 55 },
+    { "ota_phase_verify_ms", 9000 },   { "ota_phase_stage_1_3_ms", 5000 },
+  };
+  ASSERT_EQ(expected_result, ParseLastInstallMetrics(metrics_file.path));
+
+  ASSERT_TRUE(AppendInstallMetrics(metrics_file.path, { { "sideload", 1 } }));
+  ASSERT_EQ(1U, ParseLastInstallMetrics(metrics_file.path).count("ota_sideload"));
+}
+
+TEST(ParseInstallLogsTest, ParseLastInstallMetrics_MissingFile) {
+  ASSERT_TRUE(ParseLastInstallMetrics("/doesntexist/last_install_metrics").empty());
+}
+
+TEST(ParseInstallLogsTest, ReadInstallMetrics_SkipsUnknownValues) {
+  TemporaryFile metrics_file;
+  ASSERT_TRUE(AppendInstallMetrics(metrics_file.path, { { "time_total", 30 } }));
+  // An entry "build" with a 3-byte value, then "retry" with an int64.
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(metrics_file.path, &content));
+  content += std::string("\x05\x00\x03\x00", 4) + "build" + "abc";
+  content += std::string("\x05\x00\x08\x00", 4) + "retry" + std::string("\x02\0\0\0\0\0\0\0", 8);
+  ASSERT_TRUE(android::base::WriteStringToFile(content, metrics_file.path));
+
+  std::vector<std::pair<std::string, int64_t>> entries;
+  ASSERT_TRUE(ReadInstallMetrics(metrics_file.path, [&entries](const std::string& name,
+                                                               int64_t value) {
+    entries.emplace_back(name, value);
+    return true;
+  }));
+  std::vector<std::pair<std::string, int64_t>> expected = { { "time_total", 30 }, { "retry", 2 } };
+  ASSERT_EQ(expected, entries);
+}
+
+TEST(ParseInstallLogsTest, ReadInstallMetrics_Malformed) {
+  TemporaryFile metrics_file;
+  ASSERT_TRUE(AppendInstallMetrics(metrics_file.path, { { "time_total", 30 }, { "retry", 1 } }));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(metrics_file.path, &content));
+
+  // The entries before a truncated one are still read.
+  ASSERT_TRUE(
+      android::base::WriteStringToFile(content.substr(0, content.size() - 3), metrics_file.path));
+  std::vector<std::string> names;
+  auto callback = [&names](const std::string& name, int64_t) {
+    names.push_back(name);
+    return true;
+  };
+  ASSERT_FALSE(ReadInstallMetrics(metrics_file.path, callback));
+  ASSERT_EQ(std::vector<std::string>{ "time_total" }, names);
+
+  // A file in another format (or version) is rejected as a whole.
+  content[0] = 'X';
+  ASSERT_TRUE(android::base::WriteStringToFile(content, metrics_file.path));
+  names.clear();
+  ASSERT_FALSE(ReadInstallMetrics(metrics_file.path, callback));
+  ASSERT_TRUE(names.empty());
+}
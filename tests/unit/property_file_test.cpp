@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "private/property_file.h"
+
+TEST(PropertyFileTest, Parse) {
+  PropertyFile properties(
+      "# comment\n"
+      "ro.product.device=foo\n"
+      "\n"
+      "  ro.build.id = ABC123  \n"
+      "no equal sign\n"
+      "ro.product.device=bar\n"
+      "ro.empty=\n"
+      "ro.value=a=b");
+  ASSERT_EQ(4U, properties.properties().size());
+  ASSERT_EQ("foo", *properties.Find("ro.product.device"));
+  ASSERT_EQ("ABC123", *properties.Find("ro.build.id"));
+  ASSERT_EQ("", *properties.Find("ro.empty"));
+  ASSERT_EQ("a=b", *properties.Find("ro.value"));
+  ASSERT_EQ(nullptr, properties.Find("# comment"));
+  ASSERT_EQ(nullptr, properties.Find("ro.missing"));
+}
+
+TEST(PropertyFileTest, Cache) {
+  PropertyFileCache cache;
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile("ro.a=1\n", temp_file.path));
+
+  int reads = 0;
+  auto read = [&reads, &temp_file](std::string* content) {
+    reads++;
+    return android::base::ReadFileToString(temp_file.path, content);
+  };
+  auto properties = cache.Load(temp_file.path, read);
+  ASSERT_NE(nullptr, properties);
+  ASSERT_EQ("1", *properties->Find("ro.a"));
+  ASSERT_EQ(properties, cache.Load(temp_file.path, read));
+  ASSERT_EQ(1, reads);
+
+  // A change to the file (here with a new size) is read again.
+  ASSERT_TRUE(android::base::WriteStringToFile("ro.a=22\n", temp_file.path));
+  properties = cache.Load(temp_file.path, read);
+  ASSERT_EQ("22", *properties->Find("ro.a"));
+  ASSERT_EQ(2, reads);
+
+  // As is one with the same size but a new mtime.
+  ASSERT_TRUE(android::base::WriteStringToFile("ro.a=33\n", temp_file.path));
+  struct timeval times[2] = { { 12345, 0 }, { 12345, 0 } };
+  ASSERT_EQ(0, utimes(temp_file.path, times));
+  ASSERT_EQ("33", *cache.Load(temp_file.path, read)->Find("ro.a"));
+  ASSERT_EQ(3, reads);
+
+  // Files that don't exist aren't cached, and failed reads give nullptr.
+  auto fake = [](std::string* content) {
+    *content = "ro.fake=1";
+    return true;
+  };
+  ASSERT_EQ("1", *cache.Load("/doesntexist/build.prop", fake)->Find("ro.fake"));
+  ASSERT_EQ(nullptr, cache.Load("/doesntexist/build.prop", [](std::string*) { return false; }));
+}
@@ -19,6 +19,8 @@
 
 #include <limits>
 #include <optional>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -48,9 +50,13 @@ TEST(RangeSetTest, Parse_smoke) {
   ASSERT_EQ((Range{ 1, 10 }), rs2[1]);
   ASSERT_EQ(static_cast<size_t>(14), rs2.blocks());
 
-  // Leading zeros are fine. But android::base::ParseUint() doesn't like trailing zeros like "10 ".
+  // Leading spaces are fine, but not trailing ones like "10 ".
   ASSERT_EQ(rs, RangeSet::Parse(" 2, 1,   10"));
   ASSERT_FALSE(RangeSet::Parse("2,1,10 "));
+
+  // A RangeSet in the middle of a line.
+  std::string_view line = "move 4,15,20,1,10 14";
+  ASSERT_EQ(rs2, RangeSet::Parse(line.substr(5, 12)));
 }
 
 TEST(RangeSetTest, Parse_InvalidCases) {
@@ -67,6 +73,13 @@ TEST(RangeSetTest, Parse_InvalidCases) {
   // Invalid tokens.
   ASSERT_FALSE(RangeSet::Parse("2,1,10a"));
   ASSERT_FALSE(RangeSet::Parse("2,,10"));
+  ASSERT_FALSE(RangeSet::Parse("2,1,"));
+  ASSERT_FALSE(RangeSet::Parse("2,+1,10"));
+
+  // Block numbers are limited to INT_MAX.
+  ASSERT_TRUE(RangeSet::Parse("2,1,2147483647"));
+  ASSERT_FALSE(RangeSet::Parse("2,1,2147483648"));
+  ASSERT_FALSE(RangeSet::Parse("2,1,99999999999999999999999"));
 
   // Empty or negative range.
   ASSERT_FALSE(RangeSet::Parse("2,2,2"));
@@ -124,6 +137,25 @@ TEST(RangeSetTest, Overlaps) {
   ASSERT_FALSE(RangeSet::Parse("2,5,7").Overlaps(RangeSet::Parse("2,3,5")));
 }
 
+TEST(RangeSetTest, Overlaps_large) {
+  // Enough ranges on both sides to compare the sorted ranges, given out of order.
+  std::vector<Range> even;
+  std::vector<Range> odd;
+  for (size_t i = 0; i < 100; i++) {
+    even.emplace_back(20 * (99 - i), 20 * (99 - i) + 10);
+    odd.emplace_back(20 * i + 10, 20 * i + 20);
+  }
+  RangeSet r1(std::move(even));
+  RangeSet r2{ std::vector<Range>(odd) };
+  ASSERT_FALSE(r1.Overlaps(r2));
+  ASSERT_FALSE(r2.Overlaps(r1));
+
+  odd.back() = { 1985, 1986 };
+  RangeSet r3(std::move(odd));
+  ASSERT_TRUE(r1.Overlaps(r3));
+  ASSERT_TRUE(r3.Overlaps(r1));
+}
+
 TEST(RangeSetTest, Split) {
   RangeSet rs1 = RangeSet::Parse("2,1,2");
   ASSERT_TRUE(rs1);
@@ -215,6 +247,34 @@ TEST(RangeSetTest, GetBlockNumber) {
   ASSERT_EXIT(rs.GetBlockNumber(9), ::testing::KilledBySignal(SIGABRT), "");
 }
 
+TEST(RangeSetTest, GetBlockNumber_many_ranges) {
+  // Ranges of 1 to 5 blocks, with gaps in between.
+  std::vector<Range> pairs;
+  std::vector<size_t> blocks;
+  for (size_t i = 0; i < 1000; i++) {
+    size_t start = 10 * i;
+    pairs.emplace_back(start, start + i % 5 + 1);
+    for (size_t block = start; block < start + i % 5 + 1; block++) {
+      blocks.push_back(block);
+    }
+  }
+  RangeSet rs(std::move(pairs));
+  ASSERT_EQ(blocks.size(), rs.blocks());
+  for (size_t i = 0; i < blocks.size(); i++) {
+    ASSERT_EQ(blocks[i], rs.GetBlockNumber(i)) << i;
+  }
+
+  // The sub ranges cover the same blocks, whatever range they start in.
+  for (size_t start : { 0, 1, 2, 1500, 2998, 2999 }) {
+    auto sub_ranges = rs.GetSubRanges(start, blocks.size() - start);
+    ASSERT_TRUE(sub_ranges);
+    ASSERT_EQ(blocks.size() - start, sub_ranges->blocks());
+    for (size_t i = 0; i < sub_ranges->blocks(); i++) {
+      ASSERT_EQ(blocks[start + i], sub_ranges->GetBlockNumber(i));
+    }
+  }
+}
+
 TEST(RangeSetTest, equality) {
   ASSERT_EQ(RangeSet::Parse("2,1,6"), RangeSet::Parse("2,1,6"));
 
@@ -313,4 +373,7 @@ TEST(SortedRangeSetTest, file_range) {
   ::testing::FLAGS_gtest_death_test_style = "threadsafe";
   // block#10 not in range.
   ASSERT_EXIT(rs.GetOffsetInRangeSet(40970), ::testing::KilledBySignal(SIGABRT), "");
+  // Blocks before the first range or after the last one.
+  ASSERT_EXIT(rs.GetOffsetInRangeSet(10), ::testing::KilledBySignal(SIGABRT), "");
+  ASSERT_EXIT(rs.GetOffsetInRangeSet(4096 * 20), ::testing::KilledBySignal(SIGABRT), "");
 }
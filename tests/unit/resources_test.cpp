@@ -17,6 +17,8 @@
 #include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <memory>
 #include <string>
@@ -29,6 +31,7 @@
 
 #include "common/test_constants.h"
 #include "minui/minui.h"
+#include "private/resource_bundle.h"
 #include "private/resources.h"
 
 static const std::string kLocale = "zu";
@@ -86,6 +89,133 @@ TEST(ResourcesTest, res_create_multi_display_surface) {
   free(frames);
 }
 
+TEST(ResourcesTest, PrerotateSurface) {
+  // A 3x2 image: 0 1 2
+  //              3 4 5
+  auto surface = GRSurface::Create(3, 2, 3, 1);
+  ASSERT_NE(nullptr, surface);
+  for (uint8_t i = 0; i < 6; i++) {
+    surface->data()[i] = i;
+  }
+
+  auto rotated_pixels = [&surface]() {
+    return std::vector<uint8_t>(surface->rotated->data(),
+                                surface->rotated->data() + surface->rotated->row_bytes *
+                                                               surface->rotated->height);
+  };
+
+  PrerotateSurface(surface.get(), GRRotation::RIGHT);
+  ASSERT_EQ(GRRotation::RIGHT, surface->rotated_for);
+  ASSERT_EQ(2U, surface->rotated->width);
+  ASSERT_EQ(3U, surface->rotated->height);
+  ASSERT_EQ((std::vector<uint8_t>{ 3, 0, 4, 1, 5, 2 }), rotated_pixels());
+
+  PrerotateSurface(surface.get(), GRRotation::DOWN);
+  ASSERT_EQ(GRRotation::DOWN, surface->rotated_for);
+  ASSERT_EQ(3U, surface->rotated->width);
+  ASSERT_EQ(2U, surface->rotated->height);
+  ASSERT_EQ((std::vector<uint8_t>{ 5, 4, 3, 2, 1, 0 }), rotated_pixels());
+
+  PrerotateSurface(surface.get(), GRRotation::LEFT);
+  ASSERT_EQ(GRRotation::LEFT, surface->rotated_for);
+  ASSERT_EQ((std::vector<uint8_t>{ 2, 5, 1, 4, 0, 3 }), rotated_pixels());
+
+  // The clone keeps the rotated copy.
+  auto clone = surface->Clone();
+  ASSERT_NE(nullptr, clone);
+  ASSERT_EQ(GRRotation::LEFT, clone->rotated_for);
+  ASSERT_NE(nullptr, clone->rotated);
+
+  PrerotateSurface(surface.get(), GRRotation::NONE);
+  ASSERT_EQ(GRRotation::NONE, surface->rotated_for);
+  ASSERT_EQ(nullptr, surface->rotated);
+}
+
+static std::vector<uint8_t> Pixels(const GRSurface* surface) {
+  return std::vector<uint8_t>(surface->data(),
+                              surface->data() + surface->row_bytes * surface->height);
+}
+
+TEST(ResourcesTest, ResourceBundle) {
+  GRSurface* png_surface;
+  std::string png_path = from_testdata_base("loop00000.png");
+  ASSERT_EQ(0, res_create_display_surface(png_path.c_str(), &png_surface));
+  std::unique_ptr<GRSurface> display(png_surface);
+  auto en = GRSurface::Create(2, 1, 2, 1);
+  auto zh = GRSurface::Create(3, 2, 3, 1);
+  ASSERT_TRUE(en && zh);
+  memset(en->data(), 'e', en->data_size());
+  memset(zh->data(), 'z', zh->data_size());
+
+  TemporaryDir dir;
+  std::string bundle_path = std::string(dir.path) + "/" + kResourceBundleName;
+  std::vector<ResourceBundleImage> images = {
+    { "loop00000", "", ResourceBundleType::DISPLAY, display.get() },
+    { "test_text", "en", ResourceBundleType::LOCALIZED_ALPHA, en.get() },
+    { "test_text", "zh-CN", ResourceBundleType::LOCALIZED_ALPHA, zh.get() },
+  };
+  ASSERT_TRUE(WriteResourceBundle(bundle_path, gr_pixel_format(), images));
+  res_set_resource_dir(dir.path);
+
+  // Without the PNGs in the dir, the images can only come from the bundle.
+  GRSurface* surface;
+  ASSERT_EQ(0, res_create_display_surface("loop00000", &surface));
+  std::unique_ptr<GRSurface> bundled(surface);
+  ASSERT_EQ(display->width, bundled->width);
+  ASSERT_EQ(display->height, bundled->height);
+  ASSERT_EQ(Pixels(display.get()), Pixels(bundled.get()));
+
+  ASSERT_EQ(0, res_create_localized_alpha_surface("test_text", "zh-Hans-CN", &surface));
+  std::unique_ptr<GRSurface> localized(surface);
+  ASSERT_EQ(3U, localized->width);
+  ASSERT_EQ(Pixels(zh.get()), Pixels(localized.get()));
+  ASSERT_EQ(0, res_create_localized_alpha_surface("test_text", "en-GB", &surface));
+  localized.reset(surface);
+  ASSERT_EQ(Pixels(en.get()), Pixels(localized.get()));
+  ASSERT_GT(0, res_create_localized_alpha_surface("test_text", "fr", &surface));
+  ASSERT_GT(0, res_create_display_surface("test_text", &surface));
+
+  // The surfaces keep the bundle mapped.
+  res_set_resource_dir("/res/images");
+  ASSERT_EQ(0, unlink(bundle_path.c_str()));
+  ASSERT_EQ(Pixels(display.get()), Pixels(bundled.get()));
+}
+
+TEST(ResourcesTest, ResourceBundleMismatch) {
+  GRSurface* png_surface;
+  std::string png_path = from_testdata_base("loop00000.png");
+  ASSERT_EQ(0, res_create_display_surface(png_path.c_str(), &png_surface));
+  std::unique_ptr<GRSurface> display(png_surface);
+  std::vector<ResourceBundleImage> images = {
+    { "loop00000", "", ResourceBundleType::DISPLAY, display.get() },
+  };
+
+  // Display surfaces in another pixel format are ignored.
+  TemporaryDir dir;
+  std::string bundle_path = std::string(dir.path) + "/" + kResourceBundleName;
+  PixelFormat other_format =
+      gr_pixel_format() == PixelFormat::BGRA ? PixelFormat::ABGR : PixelFormat::BGRA;
+  ASSERT_TRUE(WriteResourceBundle(bundle_path, other_format, images));
+  res_set_resource_dir(dir.path);
+  GRSurface* surface;
+  ASSERT_GT(0, res_create_display_surface("loop00000", &surface));
+  ASSERT_EQ(0, unlink(bundle_path.c_str()));
+
+  // So is a truncated bundle.
+  TemporaryDir truncated_dir;
+  bundle_path = std::string(truncated_dir.path) + "/" + kResourceBundleName;
+  ASSERT_TRUE(WriteResourceBundle(bundle_path, gr_pixel_format(), images));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(bundle_path, &content));
+  content.pop_back();
+  ASSERT_TRUE(android::base::WriteStringToFile(content, bundle_path));
+  res_set_resource_dir(truncated_dir.path);
+  ASSERT_GT(0, res_create_display_surface("loop00000", &surface));
+  ASSERT_EQ(0, unlink(bundle_path.c_str()));
+
+  res_set_resource_dir("/res/images");
+}
+
 class ResourcesTest : public testing::TestWithParam<std::string> {
  public:
   static std::vector<std::string> png_list;
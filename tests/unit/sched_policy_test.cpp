@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "otautil/sched_policy.h"
+
+class SchedPolicyTest : public ::testing::Test {
+ protected:
+  std::string CpuDir(int cpu) const {
+    return std::string(cpu_dir_.path) + "/cpu" + std::to_string(cpu);
+  }
+
+  // Adds |cpu| with |capacity| in cpu_capacity, or in cpufreq/cpuinfo_max_freq if |max_freq|.
+  void AddCpu(int cpu, int capacity, bool max_freq = false) {
+    ASSERT_EQ(0, mkdir(CpuDir(cpu).c_str(), 0755));
+    std::string path = CpuDir(cpu) + "/cpu_capacity";
+    if (max_freq) {
+      ASSERT_EQ(0, mkdir((CpuDir(cpu) + "/cpufreq").c_str(), 0755));
+      path = CpuDir(cpu) + "/cpufreq/cpuinfo_max_freq";
+    }
+    if (capacity > 0) {
+      ASSERT_TRUE(android::base::WriteStringToFile(std::to_string(capacity) + "\n", path));
+    }
+  }
+
+  TemporaryDir cpu_dir_;
+};
+
+TEST_F(SchedPolicyTest, BigLittle) {
+  for (int cpu = 0; cpu < 8; cpu++) {
+    AddCpu(cpu, cpu < 4 ? 400 : 1024);
+  }
+  // Other entries of the directory aren't CPUs.
+  ASSERT_EQ(0, mkdir((std::string(cpu_dir_.path) + "/cpufreq").c_str(), 0755));
+  ASSERT_TRUE(android::base::WriteStringToFile("0-7\n", std::string(cpu_dir_.path) + "/online"));
+
+  SchedPolicy policy(cpu_dir_.path);
+  ASSERT_EQ((std::vector<int>{ 4, 5, 6, 7 }), policy.GetCpus(ThreadClass::kCompute));
+  ASSERT_EQ((std::vector<int>{ 0, 1, 2, 3 }), policy.GetCpus(ThreadClass::kUi));
+
+  SchedOptions options;
+  options.pin_threads = false;
+  policy.SetOptions(options);
+  ASSERT_TRUE(policy.GetCpus(ThreadClass::kCompute).empty());
+  ASSERT_TRUE(policy.GetCpus(ThreadClass::kUi).empty());
+}
+
+TEST_F(SchedPolicyTest, ThreeClusters) {
+  // The compute threads take the middle cores as well as the prime one.
+  AddCpu(0, 250);
+  AddCpu(1, 250);
+  AddCpu(2, 700);
+  AddCpu(3, 700);
+  AddCpu(10, 1024);
+  SchedPolicy policy(cpu_dir_.path);
+  ASSERT_EQ((std::vector<int>{ 2, 3, 10 }), policy.GetCpus(ThreadClass::kCompute));
+  ASSERT_EQ((std::vector<int>{ 0, 1 }), policy.GetCpus(ThreadClass::kUi));
+}
+
+TEST_F(SchedPolicyTest, MaxFrequency) {
+  AddCpu(0, 1800000, true);
+  AddCpu(1, 2800000, true);
+  SchedPolicy policy(cpu_dir_.path);
+  ASSERT_EQ(std::vector<int>{ 1 }, policy.GetCpus(ThreadClass::kCompute));
+  ASSERT_EQ(std::vector<int>{ 0 }, policy.GetCpus(ThreadClass::kUi));
+}
+
+TEST_F(SchedPolicyTest, UniformCpus) {
+  for (int cpu = 0; cpu < 4; cpu++) {
+    AddCpu(cpu, 1024);
+  }
+  SchedPolicy policy(cpu_dir_.path);
+  ASSERT_TRUE(policy.GetCpus(ThreadClass::kCompute).empty());
+  ASSERT_TRUE(policy.GetCpus(ThreadClass::kUi).empty());
+}
+
+TEST_F(SchedPolicyTest, UnknownCapacity) {
+  AddCpu(0, 400);
+  AddCpu(1, 0);
+  AddCpu(2, 1024);
+  SchedPolicy policy(cpu_dir_.path);
+  ASSERT_TRUE(policy.GetCpus(ThreadClass::kCompute).empty());
+  ASSERT_TRUE(policy.GetCpus(ThreadClass::kUi).empty());
+}
+
+TEST_F(SchedPolicyTest, Apply) {
+  SchedPolicy policy("/doesntexist");
+  SchedOptions options;
+  options.compute_io_priority = 3;
+  options.ui_io_priority = -1;
+  policy.SetOptions(options);
+
+  // Applied to new threads, to leave the test process alone.
+  int compute_priority = -1;
+  std::thread([&]() {
+    ASSERT_TRUE(policy.Apply(ThreadClass::kCompute));
+    compute_priority = syscall(SYS_ioprio_get, 1, 0);
+  }).join();
+  // IOPRIO_CLASS_BE, level 3.
+  ASSERT_EQ((2 << 13) | 3, compute_priority);
+
+  std::thread([&]() {
+    int inherited = syscall(SYS_ioprio_get, 1, 0);
+    ASSERT_TRUE(policy.Apply(ThreadClass::kUi));
+    ASSERT_EQ(inherited, syscall(SYS_ioprio_get, 1, 0));
+  }).join();
+}
+
+TEST_F(SchedPolicyTest, ScopedSchedPolicy) {
+  std::thread([&]() {
+    cpu_set_t original;
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(original), &original));
+    std::vector<int> allowed;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &original)) {
+        allowed.push_back(cpu);
+      }
+    }
+    // The compute threads go to the big core, if there are two cores to tell apart.
+    if (allowed.size() >= 2) {
+      AddCpu(allowed[0], 400);
+      AddCpu(allowed[1], 1024);
+    }
+    SchedPolicy policy(cpu_dir_.path);
+    SchedOptions options;
+    options.compute_nice = 5;
+    options.compute_io_priority = 3;
+    policy.SetOptions(options);
+
+    int nice = getpriority(PRIO_PROCESS, 0);
+    int io_priority = syscall(SYS_ioprio_get, 1, 0);
+    {
+      ScopedSchedPolicy scoped_policy(&policy, ThreadClass::kCompute);
+      ASSERT_EQ(5, getpriority(PRIO_PROCESS, 0));
+      ASSERT_EQ((2 << 13) | 3, syscall(SYS_ioprio_get, 1, 0));
+      if (allowed.size() >= 2) {
+        cpu_set_t pinned;
+        ASSERT_EQ(0, sched_getaffinity(0, sizeof(pinned), &pinned));
+        ASSERT_EQ(1, CPU_COUNT(&pinned));
+        ASSERT_TRUE(CPU_ISSET(allowed[1], &pinned));
+      }
+    }
+
+    cpu_set_t restored;
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(restored), &restored));
+    ASSERT_TRUE(CPU_EQUAL(&original, &restored));
+    ASSERT_EQ(nice, getpriority(PRIO_PROCESS, 0));
+    ASSERT_EQ(io_priority, syscall(SYS_ioprio_get, 1, 0));
+  }).join();
+}
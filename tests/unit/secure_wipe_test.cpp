@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "install/secure_wipe.h"
+
+extern void SetMiscBlockDeviceForTest(std::string_view misc_device);
+
+static constexpr uint64_t kMiB = 1024 * 1024;
+
+TEST(SecureWipeTest, WipeInChunks) {
+  SecureWipeOptions options;
+  options.chunk_size = 4 * kMiB;
+  options.queue_depth = 3;
+  std::mutex mutex;
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  std::atomic<int> running = 0;
+  std::atomic<int> most_running = 0;
+  std::vector<uint64_t> progress;
+  ASSERT_TRUE(WipeInChunks(
+      kMiB, 18 * kMiB, options,
+      [&](uint64_t offset, uint64_t length) {
+        int now = ++running;
+        int most = most_running;
+        while (now > most && !most_running.compare_exchange_weak(most, now)) {
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        --running;
+        std::lock_guard<std::mutex> lock(mutex);
+        ranges.emplace_back(offset, length);
+        return true;
+      },
+      [&progress](uint64_t wiped) { progress.push_back(wiped); }));
+
+  std::sort(ranges.begin(), ranges.end());
+  ASSERT_EQ((std::vector<std::pair<uint64_t, uint64_t>>{
+                { kMiB, 4 * kMiB },
+                { 5 * kMiB, 4 * kMiB },
+                { 9 * kMiB, 4 * kMiB },
+                { 13 * kMiB, 4 * kMiB },
+                { 17 * kMiB, kMiB },
+            }),
+            ranges);
+  ASSERT_EQ(3, most_running);
+  // The progress only grows, and ends with the whole range.
+  ASSERT_FALSE(progress.empty());
+  ASSERT_TRUE(std::is_sorted(progress.begin(), progress.end()));
+  ASSERT_EQ(18 * kMiB, progress.back());
+}
+
+TEST(SecureWipeTest, WipeInChunksFailure) {
+  SecureWipeOptions options;
+  options.chunk_size = kMiB;
+  options.queue_depth = 1;
+  uint64_t progress = 0;
+  size_t calls = 0;
+  ASSERT_FALSE(WipeInChunks(
+      0, 10 * kMiB, options,
+      [&calls](uint64_t offset, uint64_t) {
+        calls++;
+        return offset != 3 * kMiB;
+      },
+      [&progress](uint64_t wiped) { progress = wiped; }));
+  // No chunk is started after the failed one, and the progress stops before it.
+  ASSERT_EQ(4U, calls);
+  ASSERT_EQ(3 * kMiB, progress);
+}
+
+class WipeCheckpointTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // The system space of misc starts at 32 KiB.
+    ASSERT_TRUE(android::base::WriteStringToFile(std::string(64 * 1024, '\0'), misc_.path));
+    SetMiscBlockDeviceForTest(misc_.path);
+  }
+
+  void TearDown() override {
+    SetMiscBlockDeviceForTest("");
+  }
+
+  TemporaryFile misc_;
+};
+
+TEST_F(WipeCheckpointTest, Resume) {
+  std::vector<std::string> partitions{ "/dev/block/a", "/dev/block/b" };
+  {
+    WipeCheckpoint checkpoint(partitions);
+    ASSERT_EQ(0U, checkpoint.Wiped(0));
+    // Written once it moves by the checkpoint interval, or when forced.
+    checkpoint.Update(0, kMiB);
+    checkpoint.Update(1, WipeCheckpoint::kCheckpointInterval + kMiB + 100);
+    checkpoint.Update(0, 7 * kMiB, true);
+  }
+
+  WipeCheckpoint checkpoint(partitions);
+  ASSERT_EQ(7 * kMiB, checkpoint.Wiped(0));
+  ASSERT_EQ(WipeCheckpoint::kCheckpointInterval + kMiB, checkpoint.Wiped(1));
+  ASSERT_EQ(0U, checkpoint.Wiped(2));
+
+  // A checkpoint for another list of partitions doesn't apply.
+  ASSERT_EQ(0U, WipeCheckpoint({ "/dev/block/a" }).Wiped(0));
+
+  checkpoint.Clear();
+  ASSERT_EQ(0U, WipeCheckpoint(partitions).Wiped(0));
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "otautil/print_sha1.h"
+#include "otautil/rangeset.h"
+#include "private/sha1_pipeline.h"
+
+static constexpr size_t kBlockSize = 4096;
+
+static std::string Sha1(const std::string& data) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(data.data()), data.size(), digest);
+  return print_sha1(digest);
+}
+
+// Returns 'size' bytes of non-repeating data.
+static std::string MakeData(size_t size) {
+  std::string data;
+  for (size_t i = 0; data.size() < size; i++) {
+    data += std::to_string(i) + ",";
+  }
+  data.resize(size);
+  return data;
+}
+
+TEST(Sha1PipelineTest, Empty) {
+  Sha1Pipeline pipeline;
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  pipeline.Finish(digest);
+  ASSERT_EQ(Sha1(""), print_sha1(digest));
+}
+
+TEST(Sha1PipelineTest, SingleChunk) {
+  std::string data = MakeData(10000);
+  Sha1Pipeline pipeline;
+  pipeline.Submit(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  pipeline.Finish(digest);
+  ASSERT_EQ(Sha1(data), print_sha1(digest));
+}
+
+TEST(Sha1PipelineTest, MultipleChunks) {
+  std::string data = MakeData(1000000);
+  Sha1Pipeline pipeline;
+  // Chunks of varying sizes, in order.
+  size_t offset = 0;
+  for (size_t size = 1; offset < data.size(); size = size * 3 + 7) {
+    size = std::min(size, data.size() - offset);
+    pipeline.Submit(reinterpret_cast<const uint8_t*>(data.data()) + offset, size);
+    offset += size;
+  }
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  pipeline.Finish(digest);
+  ASSERT_EQ(Sha1(data), print_sha1(digest));
+}
+
+TEST(Sha1PipelineTest, WaitForChunks) {
+  std::string data = MakeData(64 * kBlockSize);
+  std::vector<uint8_t> buffer(kBlockSize);
+  Sha1Pipeline pipeline;
+  // Reuses a single buffer, waiting for each chunk to be hashed before overwriting it.
+  for (size_t offset = 0; offset < data.size(); offset += kBlockSize) {
+    pipeline.Wait(0);
+    std::copy(data.begin() + offset, data.begin() + offset + kBlockSize, buffer.begin());
+    pipeline.Submit(buffer.data(), buffer.size());
+  }
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  pipeline.Finish(digest);
+  ASSERT_EQ(Sha1(data), print_sha1(digest));
+}
+
+TEST(Sha1PipelineTest, Sha1BlocksAt) {
+  TemporaryFile temp_file;
+  std::string image = MakeData(1000 * kBlockSize);
+  ASSERT_TRUE(android::base::WriteStringToFile(image, temp_file.path));
+
+  // Spans multiple read chunks, in the order given by the RangeSet.
+  RangeSet ranges = RangeSet::Parse("4,700,1000,0,500");
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  ASSERT_TRUE(Sha1BlocksAt(temp_file.fd, ranges, kBlockSize, digest));
+  ASSERT_EQ(Sha1(image.substr(700 * kBlockSize) + image.substr(0, 500 * kBlockSize)),
+            print_sha1(digest));
+}
+
+TEST(Sha1PipelineTest, Sha1BlocksAt_PastEnd) {
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(MakeData(2 * kBlockSize), temp_file.path));
+
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  ASSERT_FALSE(Sha1BlocksAt(temp_file.fd, RangeSet::Parse("2,1,3"), kBlockSize, digest));
+}
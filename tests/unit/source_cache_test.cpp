@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "otautil/rangeset.h"
+#include "private/source_cache.h"
+
+static constexpr size_t kBlockSize = 4096;
+
+// Returns the data of |blocks| blocks, each filled with its block number starting at |first|.
+static std::vector<uint8_t> Blocks(size_t first, size_t blocks) {
+  std::vector<uint8_t> data;
+  for (size_t i = 0; i < blocks; i++) {
+    data.insert(data.end(), kBlockSize, static_cast<uint8_t>(first + i));
+  }
+  return data;
+}
+
+TEST(SourceBlockCacheTest, PutAndGet) {
+  SourceBlockCache cache(8, kBlockSize);
+  std::vector<uint8_t> buffer(4 * kBlockSize);
+  ASSERT_FALSE(cache.Get(RangeSet({ { 0, 1 } }), buffer.data()));
+
+  // Keep blocks 1 and 3 of 0-3.
+  cache.Put(RangeSet({ { 0, 4 } }), RangeSet({ { 1, 2 }, { 3, 4 } }), Blocks(0, 4).data());
+  ASSERT_EQ(2U, cache.size());
+  ASSERT_FALSE(cache.Get(RangeSet({ { 0, 2 } }), buffer.data()));
+
+  // The blocks come out in the order of the ranges asked for.
+  ASSERT_TRUE(cache.Get(RangeSet({ { 3, 4 }, { 1, 2 } }), buffer.data()));
+  std::vector<uint8_t> expected = Blocks(3, 1);
+  std::vector<uint8_t> block_1 = Blocks(1, 1);
+  expected.insert(expected.end(), block_1.begin(), block_1.end());
+  ASSERT_EQ(expected, std::vector<uint8_t>(buffer.begin(), buffer.begin() + 2 * kBlockSize));
+  ASSERT_EQ(1U, cache.hits());
+}
+
+TEST(SourceBlockCacheTest, EvictsLeastRecentlyUsed) {
+  SourceBlockCache cache(3, kBlockSize);
+  RangeSet src({ { 10, 13 } });
+  cache.Put(src, RangeSet({ { 0, 3 } }), Blocks(10, 3).data());
+
+  // Touch block 10, so that block 11 becomes the least recently used.
+  std::vector<uint8_t> buffer(3 * kBlockSize);
+  ASSERT_TRUE(cache.Get(RangeSet({ { 10, 11 } }), buffer.data()));
+
+  cache.Put(RangeSet({ { 20, 21 } }), RangeSet({ { 0, 1 } }), Blocks(20, 1).data());
+  ASSERT_EQ(3U, cache.size());
+  ASSERT_FALSE(cache.Get(RangeSet({ { 11, 12 } }), buffer.data()));
+  ASSERT_TRUE(cache.Get(RangeSet({ { 10, 11 }, { 12, 13 }, { 20, 21 } }), buffer.data()));
+  std::vector<uint8_t> expected = Blocks(10, 1);
+  for (size_t block : { 12, 20 }) {
+    std::vector<uint8_t> data = Blocks(block, 1);
+    expected.insert(expected.end(), data.begin(), data.end());
+  }
+  ASSERT_EQ(expected, buffer);
+}
+
+TEST(SourceBlockCacheTest, Invalidate) {
+  SourceBlockCache cache(4, kBlockSize);
+  cache.Put(RangeSet({ { 0, 4 } }), RangeSet({ { 0, 4 } }), Blocks(0, 4).data());
+  cache.Invalidate(RangeSet({ { 1, 2 }, { 8, 10 } }));
+  ASSERT_EQ(3U, cache.size());
+
+  std::vector<uint8_t> buffer(4 * kBlockSize);
+  ASSERT_FALSE(cache.Get(RangeSet({ { 0, 2 } }), buffer.data()));
+
+  // The freed slot takes a new block, with no eviction.
+  cache.Put(RangeSet({ { 1, 2 } }), RangeSet({ { 0, 1 } }), Blocks(101, 1).data());
+  ASSERT_EQ(4U, cache.size());
+  ASSERT_TRUE(cache.Get(RangeSet({ { 0, 4 } }), buffer.data()));
+  std::vector<uint8_t> expected = Blocks(0, 1);
+  for (size_t block : { 101, 2, 3 }) {
+    std::vector<uint8_t> data = Blocks(block, 1);
+    expected.insert(expected.end(), data.begin(), data.end());
+  }
+  ASSERT_EQ(expected, buffer);
+}
+
+TEST(SourceBlockCacheTest, TracksOnly) {
+  // A block size of 0 tracks the blocks without their data.
+  SourceBlockCache cache(2, 0);
+  cache.Put(RangeSet({ { 0, 3 } }), RangeSet({ { 0, 3 } }), nullptr);
+  ASSERT_EQ(2U, cache.size());
+  ASSERT_FALSE(cache.Get(RangeSet({ { 0, 1 } }), nullptr));
+  ASSERT_TRUE(cache.Get(RangeSet({ { 1, 3 } }), nullptr));
+}
+
+TEST(SourceBlockCacheTest, Disabled) {
+  SourceBlockCache cache(0, kBlockSize);
+  cache.Put(RangeSet({ { 0, 1 } }), RangeSet({ { 0, 1 } }), Blocks(0, 1).data());
+  std::vector<uint8_t> buffer(kBlockSize);
+  ASSERT_FALSE(cache.Get(RangeSet({ { 0, 1 } }), buffer.data()));
+  ASSERT_EQ(0U, cache.size());
+}
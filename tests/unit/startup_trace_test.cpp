@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+
+#include "otautil/startup_trace.h"
+
+TEST(StartupTraceTest, ToJson) {
+  StartupTrace trace;
+  trace.AddEvent("load_volume_table", 1000, 1500);
+  trace.AddEvent("ui \"init\"", 2000, 4500);
+
+  std::string json = trace.ToJson();
+  ASSERT_TRUE(android::base::StartsWith(json, "{\"traceEvents\":[")) << json;
+  ASSERT_NE(std::string::npos,
+            json.find("{\"name\":\"load_volume_table\",\"cat\":\"startup\",\"ph\":\"X\","
+                      "\"ts\":1000,\"dur\":500,"))
+      << json;
+  // Names are escaped.
+  ASSERT_NE(std::string::npos, json.find("{\"name\":\"ui \\\"init\\\"\",")) << json;
+  ASSERT_NE(std::string::npos, json.find("\"ts\":2000,\"dur\":2500,")) << json;
+  ASSERT_NE(std::string::npos, json.find("\"otherData\":{\"build\":")) << json;
+}
+
+TEST(StartupTraceTest, ScopedStartupTrace) {
+  uint64_t begin_us = StartupTrace::NowUs();
+  { ScopedStartupTrace trace("scoped_step"); }
+  ASSERT_GE(StartupTrace::NowUs(), begin_us);
+
+  std::string json = StartupTrace::Get().ToJson();
+  ASSERT_NE(std::string::npos, json.find("{\"name\":\"scoped_step\",")) << json;
+}
+
+TEST(StartupTraceTest, Write) {
+  StartupTrace trace;
+  trace.AddEvent("get_args", 10, 20);
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(trace.Write(temp_file.path));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &content));
+  ASSERT_EQ(trace.ToJson(), content);
+}
@@ -50,6 +50,42 @@ TEST(SysUtilTest, ParseBlockMapFile_smoke) {
             block_map_data.block_ranges());
 }
 
+TEST(SysUtilTest, ParseBlockMapFile_merges_contiguous_ranges) {
+  std::vector<std::string> content = {
+    "/dev/abc", "  40960\t4096 ", "4", "0 3", "3 5", "8 10", "5 8", "",
+  };
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(android::base::Join(content, '\n'), temp_file.path));
+
+  auto block_map_data = BlockMapData::ParseBlockMapFile(temp_file.path);
+  ASSERT_TRUE(block_map_data);
+  ASSERT_EQ(40960, block_map_data.file_size());
+  ASSERT_EQ(RangeSet(std::vector<Range>{
+                { 0, 5 },
+                { 8, 10 },
+                { 5, 8 },
+            }),
+            block_map_data.block_ranges());
+}
+
+TEST(SysUtilTest, ParseBlockMapFile_invalid_numbers) {
+  std::vector<std::string> content = {
+    "/dev/abc", "40960 4096", "1", "0 10",
+  };
+
+  TemporaryFile temp_file;
+  for (const auto& range : { "0 10x", "-1 9", "0", "0 99999999999999999999999" }) {
+    content[3] = range;
+    ASSERT_TRUE(
+        android::base::WriteStringToFile(android::base::Join(content, '\n'), temp_file.path));
+    ASSERT_FALSE(BlockMapData::ParseBlockMapFile(temp_file.path)) << range;
+  }
+
+  ASSERT_TRUE(android::base::WriteStringToFile("", temp_file.path));
+  ASSERT_FALSE(BlockMapData::ParseBlockMapFile(temp_file.path));
+}
+
 TEST(SysUtilTest, ParseBlockMapFile_invalid_line_count) {
   std::vector<std::string> content = {
     "/dev/abc", "49652 4096", "2", "1000 1008", "2100 2102", "30 33",
@@ -102,6 +138,43 @@ TEST(SysUtilTest, MapFileRegularFile) {
   ASSERT_EQ(1U, mapping.ranges());
 }
 
+TEST(SysUtilTest, AdviseAndPrefault) {
+  TemporaryFile temp_file;
+  std::string content(3 * 4096 + 100, 'x');
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  MemMapping mapping;
+  ASSERT_TRUE(mapping.MapFile(temp_file.path));
+  ASSERT_TRUE(mapping.Advise(MemMapping::Access::kSequential));
+  ASSERT_TRUE(mapping.Advise(MemMapping::Access::kNormal));
+
+  // Prefaulting is best effort (it needs Linux 5.14), but never changes the contents.
+  mapping.Prefault(4096 + 10, 2 * 4096);
+  // Nothing is past the end, and a range that runs past it is clamped.
+  ASSERT_FALSE(mapping.Prefault(content.size(), 1));
+  mapping.Prefault(content.size() - 10, 4096);
+  ASSERT_EQ(content, std::string(reinterpret_cast<const char*>(mapping.addr), mapping.length));
+}
+
+TEST(SysUtilTest, MapDevice) {
+  TemporaryFile temp_file;
+  std::string content = "abcdefgh";
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  // MemMapping::MapDevice() maps the given number of bytes from the start of the file.
+  MemMapping mapping;
+  ASSERT_TRUE(mapping.MapDevice(temp_file.path, 5));
+  ASSERT_EQ(5U, mapping.length);
+  ASSERT_EQ(1U, mapping.ranges());
+  ASSERT_EQ("abcde", std::string(reinterpret_cast<const char*>(mapping.addr), mapping.length));
+
+  // It refuses to map past the end of the file, or nothing at all.
+  MemMapping too_long;
+  ASSERT_FALSE(too_long.MapDevice(temp_file.path, content.size() + 1));
+  MemMapping empty;
+  ASSERT_FALSE(empty.MapDevice(temp_file.path, 0));
+}
+
 TEST(SysUtilTest, MapFileBlockMap) {
   // Create a file that has 10 blocks.
   TemporaryFile package;
@@ -138,15 +211,40 @@ TEST(SysUtilTest, MapFileBlockMap) {
   ASSERT_EQ(file_size, mapping.length);
   ASSERT_EQ(1U, mapping.ranges());
 
-  // Multiple ranges.
+  // Multiple ranges, contiguous on the device, are mapped as one.
   block_map_content = std::string(package.path) + "\n40960 4096\n3\n0 3\n3 5\n5 10\n";
   ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
 
+  ASSERT_TRUE(mapping.MapFile(filename));
+  ASSERT_EQ(file_size, mapping.length);
+  ASSERT_EQ(1U, mapping.ranges());
+
+  // Multiple ranges elsewhere on the device.
+  block_map_content = std::string(package.path) + "\n40960 4096\n4\n0 3\n5 8\n8 10\n3 5\n";
+  ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
+
   ASSERT_TRUE(mapping.MapFile(filename));
   ASSERT_EQ(file_size, mapping.length);
   ASSERT_EQ(3U, mapping.ranges());
 }
 
+TEST(SysUtilTest, MapFileBlockMapTooFragmented) {
+  TemporaryFile package;
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(4096 * 20002, 'a'), package.path));
+
+  // Every other block of the device, so that no two ranges can be merged.
+  std::string block_map_content = std::string(package.path) + "\n" +
+                                  std::to_string(4096 * 10001) + " 4096\n10001\n";
+  for (size_t block = 0; block < 20002; block += 2) {
+    block_map_content += std::to_string(block) + " " + std::to_string(block + 1) + "\n";
+  }
+  TemporaryFile block_map_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
+
+  MemMapping mapping;
+  ASSERT_FALSE(mapping.MapFile(std::string("@") + block_map_file.path));
+}
+
 TEST(SysUtilTest, MapFileBlockMapInvalidBlockMap) {
   MemMapping mapping;
   TemporaryFile temp_file;
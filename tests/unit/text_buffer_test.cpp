@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "recovery_ui/text_buffer.h"
+
+static std::vector<std::string> Rows(const TextBuffer& buffer) {
+  std::vector<std::string> rows;
+  for (size_t i = 0; i < buffer.size(); i++) {
+    rows.emplace_back(buffer.GetRow(i).text);
+  }
+  return rows;
+}
+
+TEST(TextBufferTest, Append) {
+  TextBuffer buffer(4, 10, 2);
+  ASSERT_EQ(1U, buffer.size());
+  ASSERT_EQ(std::vector<std::string>{ "" }, Rows(buffer));
+
+  buffer.Append("first\n\nthi");
+  buffer.Append("rd");
+  ASSERT_EQ((std::vector<std::string>{ "first", "", "third" }), Rows(buffer));
+
+  TextBuffer::Row row = buffer.GetRow(0);
+  ASSERT_EQ(5U, row.length);
+  ASSERT_EQ(10, row.width);
+  ASSERT_FALSE(row.continued);
+  ASSERT_EQ(0, buffer.GetRow(1).width);
+
+  // UTF-8 code points are measured as one character each.
+  buffer.Append("\n\xc3\xa9t\xc3\xa9");
+  row = buffer.GetRow(3);
+  ASSERT_EQ(5U, row.length);
+  ASSERT_EQ(6, row.width);
+}
+
+TEST(TextBufferTest, DropsOldestRows) {
+  TextBuffer buffer(3, 10, 1);
+  buffer.Append("1\n2\n3\n4\n5");
+  ASSERT_EQ((std::vector<std::string>{ "3", "4", "5" }), Rows(buffer));
+
+  buffer.Append("\n");
+  ASSERT_EQ((std::vector<std::string>{ "4", "5", "" }), Rows(buffer));
+
+  buffer.Clear();
+  ASSERT_EQ(std::vector<std::string>{ "" }, Rows(buffer));
+}
+
+TEST(TextBufferTest, WrapsAtWords) {
+  TextBuffer buffer(8, 10, 1);
+  buffer.Append("E:failed to open the package\nabcdefghijklmnop\n");
+  ASSERT_EQ((std::vector<std::string>{ "E:failed", "to open", "the", "package", "abcdefghij",
+                                       "klmnop", "" }),
+            Rows(buffer));
+  std::vector<bool> continued;
+  for (size_t i = 0; i < buffer.size(); i++) {
+    continued.push_back(buffer.GetRow(i).continued);
+  }
+  ASSERT_EQ((std::vector<bool>{ false, true, true, true, false, true, false }), continued);
+  ASSERT_EQ(7, buffer.GetRow(1).width);
+
+  // A space that falls at the end of a row is dropped, rather than starting the next one.
+  buffer.Clear();
+  buffer.Append("0123456789 next");
+  ASSERT_EQ((std::vector<std::string>{ "0123456789", "next" }), Rows(buffer));
+}
+
+TEST(TextBufferTest, AppendRow) {
+  TextBuffer buffer(3, 4, 1);
+  buffer.AppendRow("row that doesn't wrap");
+  buffer.AppendRow("");
+  buffer.AppendRow("end", false);
+  ASSERT_EQ((std::vector<std::string>{ "row ", "", "end" }), Rows(buffer));
+  ASSERT_FALSE(buffer.GetRow(0).continued);
+}
+
+TEST(TextBufferTest, Empty) {
+  TextBuffer buffer(0, 10, 1);
+  buffer.Append("text\n");
+  buffer.AppendRow("text");
+  ASSERT_EQ(0U, buffer.size());
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <string_view>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "recovery_ui/text_file_view.h"
+
+TEST(TextFileViewTest, Rows) {
+  TextFileView view("first\n\nthird line, which wraps\nlast", 10);
+  ASSERT_EQ("first", view.Row(0));
+  ASSERT_EQ("", view.Row(1));
+  ASSERT_EQ("third line", view.Row(2));
+  ASSERT_EQ(", which wr", view.Row(3));
+  ASSERT_EQ("aps", view.Row(4));
+  ASSERT_EQ("last", view.Row(5));
+  ASSERT_EQ("", view.Row(6));
+  ASSERT_EQ(6U, view.RowCount());
+
+  ASSERT_EQ(0U, view.RowOffset(0));
+  ASSERT_EQ(7U, view.RowOffset(2));
+  ASSERT_EQ(view.size(), view.RowOffset(6));
+  ASSERT_EQ(view.size(), view.RowOffset(100));
+}
+
+TEST(TextFileViewTest, FullRowBeforeNewline) {
+  // A line of exactly the width takes one row, not one plus an empty one.
+  TextFileView view("0123456789\nnext\n", 10);
+  ASSERT_EQ(2U, view.RowCount());
+  ASSERT_EQ("0123456789", view.Row(0));
+  ASSERT_EQ("next", view.Row(1));
+}
+
+TEST(TextFileViewTest, JumpAhead) {
+  std::string data;
+  for (int i = 0; i < 1000; i++) {
+    data += "line " + std::to_string(i) + "\n";
+  }
+  TextFileView view(data, 80);
+  ASSERT_EQ("line 999", view.Row(999));
+  ASSERT_EQ("line 500", view.Row(500));
+  ASSERT_EQ(1000U, view.RowCount());
+}
+
+TEST(TextFileViewTest, FindRow) {
+  TextFileView view("I:one\nE:two\nI:three\nE:four\n", 80);
+  ASSERT_EQ(1U, view.FindRow("E:", 0));
+  ASSERT_EQ(3U, view.FindRow("E:", 2));
+  ASSERT_EQ(TextFileView::npos, view.FindRow("E:", 4));
+  ASSERT_EQ(TextFileView::npos, view.FindRow("missing", 0));
+
+  // A match in the middle of a row is in that row.
+  ASSERT_EQ(2U, view.FindRow("three", 0));
+}
+
+TEST(TextFileViewTest, Open) {
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile("a\nb\n", temp_file.path));
+  auto view = TextFileView::Open(temp_file.path, 80);
+  ASSERT_NE(nullptr, view);
+  ASSERT_EQ(4U, view->size());
+  ASSERT_EQ(2U, view->RowCount());
+  ASSERT_EQ("b", view->Row(1));
+
+  // Empty files can't be mapped, and are read instead.
+  ASSERT_TRUE(android::base::WriteStringToFile("", temp_file.path));
+  view = TextFileView::Open(temp_file.path, 80);
+  ASSERT_NE(nullptr, view);
+  ASSERT_EQ(0U, view->RowCount());
+  ASSERT_EQ("", view->Row(0));
+
+  ASSERT_EQ(nullptr, TextFileView::Open("/nonexistent", 80));
+}
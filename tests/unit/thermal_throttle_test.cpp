@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "otautil/thermal_throttle.h"
+
+class ThermalThrottleTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // A zone with a passive trip point at 80C, one with only an active (fan) trip point, and one
+    // without trip points at all.
+    AddZone(0, { { "active", 40000 }, { "passive", 80000 }, { "critical", 100000 } });
+    AddZone(1, { { "active", 30000 } });
+    AddZone(2, {});
+    SetTemperature(1, 90000);
+    SetTemperature(2, 95000);
+  }
+
+  void TearDown() override {
+    for (const auto& path : files_) {
+      unlink(path.c_str());
+    }
+    for (int zone = 2; zone >= 0; zone--) {
+      rmdir(ZoneDir(zone).c_str());
+    }
+  }
+
+  std::string ZoneDir(int zone) const {
+    return std::string(thermal_dir_.path) + "/thermal_zone" + std::to_string(zone);
+  }
+
+  void AddZone(int zone, const std::vector<std::pair<std::string, int>>& trip_points) {
+    ASSERT_EQ(0, mkdir(ZoneDir(zone).c_str(), 0755));
+    for (size_t i = 0; i < trip_points.size(); i++) {
+      std::string trip_point = ZoneDir(zone) + "/trip_point_" + std::to_string(i);
+      WriteFile(trip_point + "_type", trip_points[i].first + "\n");
+      WriteFile(trip_point + "_temp", std::to_string(trip_points[i].second) + "\n");
+    }
+    SetTemperature(zone, 30000);
+  }
+
+  void SetTemperature(int zone, int temperature) {
+    WriteFile(ZoneDir(zone) + "/temp", std::to_string(temperature) + "\n");
+  }
+
+  void WriteFile(const std::string& path, const std::string& content) {
+    ASSERT_TRUE(android::base::WriteStringToFile(content, path));
+    files_.push_back(path);
+  }
+
+  TemporaryDir thermal_dir_;
+  std::vector<std::string> files_;
+};
+
+TEST_F(ThermalThrottleTest, ScalesWithHeadroom) {
+  ThermalThrottle throttle(thermal_dir_.path, std::chrono::milliseconds(0));
+  // Only zone 0 has a limit, and it's far from it.
+  ASSERT_EQ(8U, throttle.Scale(8));
+  ASSERT_EQ(1U, throttle.Scale(1));
+
+  // 5C from the passive trip point.
+  SetTemperature(0, 75000);
+  ASSERT_EQ(5U, throttle.Scale(8));
+  ASSERT_DOUBLE_EQ(0.5, throttle.level());
+
+  // At or past the limit, down to a single worker.
+  SetTemperature(0, 81000);
+  ASSERT_EQ(1U, throttle.Scale(8));
+  ASSERT_EQ(1U, throttle.Scale(2));
+
+  // Speeding up again takes a few samples.
+  SetTemperature(0, 30000);
+  ASSERT_EQ(3U, throttle.Scale(8));
+  ASSERT_EQ(5U, throttle.Scale(8));
+  ASSERT_EQ(6U, throttle.Scale(8));
+  ASSERT_EQ(8U, throttle.Scale(8));
+  ASSERT_EQ(8U, throttle.Scale(8));
+}
+
+TEST_F(ThermalThrottleTest, SampleInterval) {
+  ThermalThrottle throttle(thermal_dir_.path, std::chrono::hours(1));
+  ASSERT_EQ(8U, throttle.Scale(8));
+
+  // Not sampled again for a while.
+  SetTemperature(0, 90000);
+  ASSERT_EQ(8U, throttle.Scale(8));
+}
+
+TEST(ThermalThrottleNoZonesTest, FullSpeed) {
+  TemporaryDir thermal_dir;
+  ThermalThrottle throttle(thermal_dir.path, std::chrono::milliseconds(0));
+  ASSERT_EQ(4U, throttle.Scale(4));
+  ASSERT_DOUBLE_EQ(1.0, throttle.level());
+
+  ThermalThrottle missing("/doesntexist", std::chrono::milliseconds(0));
+  ASSERT_EQ(4U, missing.Scale(4));
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "otautil/print_sha1.h"
+#include "otautil/rangeset.h"
+#include "private/tree_hash.h"
+
+static constexpr size_t kBlockSize = 4096;
+static constexpr size_t kSegmentBlocks = kTreeHashSegmentSize / kBlockSize;
+
+// Returns 'size' bytes of non-repeating data.
+static std::string MakeData(size_t size) {
+  std::string data;
+  for (size_t i = 0; data.size() < size; i++) {
+    data += std::to_string(i) + ",";
+  }
+  data.resize(size);
+  return data;
+}
+
+// Computes the tree hash of 'data' the straightforward way.
+static std::string TreeHash(const std::string& data) {
+  std::string digests;
+  for (size_t offset = 0; offset < data.size(); offset += kTreeHashSegmentSize) {
+    std::string segment = data.substr(offset, kTreeHashSegmentSize);
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t*>(segment.data()), segment.size(), digest);
+    digests.append(reinterpret_cast<const char*>(digest), sizeof(digest));
+  }
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(digests.data()), digests.size(), digest);
+  return print_hex(digest, sizeof(digest));
+}
+
+TEST(TreeHashTest, Sha256TreeBlocksAt) {
+  TemporaryFile temp_file;
+  std::string image = MakeData(3 * kTreeHashSegmentSize);
+  ASSERT_TRUE(android::base::WriteStringToFile(image, temp_file.path));
+
+  // Segments span the ranges, which are hashed in the order given by the RangeSet; the last
+  // segment is shorter.
+  size_t blocks = image.size() / kBlockSize;
+  RangeSet ranges({ { kSegmentBlocks + 3, blocks }, { 0, kSegmentBlocks } });
+  std::string expected = TreeHash(image.substr((kSegmentBlocks + 3) * kBlockSize) +
+                                  image.substr(0, kTreeHashSegmentSize));
+  for (size_t workers : { 1, 2, 8 }) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    ASSERT_TRUE(Sha256TreeBlocksAt(temp_file.fd, ranges, kBlockSize, workers, digest));
+    ASSERT_EQ(expected, print_hex(digest, sizeof(digest))) << workers;
+  }
+}
+
+TEST(TreeHashTest, Sha256TreeBlocksAt_SingleBlock) {
+  TemporaryFile temp_file;
+  std::string image = MakeData(2 * kBlockSize);
+  ASSERT_TRUE(android::base::WriteStringToFile(image, temp_file.path));
+
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  ASSERT_TRUE(Sha256TreeBlocksAt(temp_file.fd, RangeSet::Parse("2,1,2"), kBlockSize, 4, digest));
+  ASSERT_EQ(TreeHash(image.substr(kBlockSize)), print_hex(digest, sizeof(digest)));
+}
+
+TEST(TreeHashTest, Sha256TreeBlocksAt_PastEnd) {
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(MakeData(kTreeHashSegmentSize), temp_file.path));
+
+  RangeSet ranges({ { 0, 3 * kSegmentBlocks } });
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  ASSERT_FALSE(Sha256TreeBlocksAt(temp_file.fd, ranges, kBlockSize, 4, digest));
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <gtest/gtest.h>
+#include <volume_manager/UeventWaiter.h>
+
+using android::volmgr::UeventWaiter;
+using namespace std::chrono_literals;
+
+class UeventWaiterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    UeventWaiter::SetListening(true);
+  }
+
+  void TearDown() override {
+    UeventWaiter::SetListening(false);
+  }
+};
+
+TEST_F(UeventWaiterTest, ReadyAtOnce) {
+  int calls = 0;
+  ASSERT_TRUE(UeventWaiter::WaitFor([&calls]() { return ++calls > 0; }, 0ms));
+  ASSERT_EQ(1, calls);
+}
+
+TEST_F(UeventWaiterTest, WakesOnEvent) {
+  std::atomic<bool> ready = false;
+  std::atomic<int> calls = 0;
+  std::thread notifier([&ready]() {
+    std::this_thread::sleep_for(50ms);
+    ready = true;
+    UeventWaiter::Notify();
+  });
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_TRUE(UeventWaiter::WaitFor(
+      [&ready, &calls]() {
+        calls++;
+        return ready.load();
+      },
+      10s));
+  notifier.join();
+  ASSERT_LT(std::chrono::steady_clock::now() - start, 5s);
+  // While listening, the state is only checked on events: once at first, and once on the event.
+  ASSERT_EQ(2, calls);
+}
+
+TEST_F(UeventWaiterTest, Timeout) {
+  int calls = 0;
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_FALSE(UeventWaiter::WaitFor(
+      [&calls]() {
+        calls++;
+        return false;
+      },
+      50ms));
+  ASSERT_GE(std::chrono::steady_clock::now() - start, 50ms);
+  ASSERT_LE(calls, 2);
+}
+
+TEST_F(UeventWaiterTest, PollsWithoutListening) {
+  UeventWaiter::SetListening(false);
+  int calls = 0;
+  ASSERT_TRUE(UeventWaiter::WaitFor([&calls]() { return ++calls == 3; }, 10s));
+  ASSERT_EQ(3, calls);
+}
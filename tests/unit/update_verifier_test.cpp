@@ -17,8 +17,10 @@
 #include <update_verifier/update_verifier.h>
 
 #include <functional>
+#include <map>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -75,6 +77,9 @@ class UpdateVerifierTest : public ::testing::Test {
       if (partition.find("fingerprint") != partition.end()) {
         info.set_fingerprint(partition.at("fingerprint"));
       }
+      if (partition.find("changed_ranges") != partition.end()) {
+        info.set_changed_ranges(partition.at("changed_ranges"));
+      }
 
       *result.add_partitions() = info;
     }
@@ -82,6 +87,30 @@ class UpdateVerifierTest : public ::testing::Test {
     return result.SerializeAsString();
   }
 
+  void SetIncremental(bool incremental) {
+    verifier_.set_incremental(incremental);
+  }
+
+  const std::map<std::string, RangeSet>& partition_map() const {
+    return verifier_.partition_map_;
+  }
+
+  const std::map<std::string, RangeSet>& deferred_map() const {
+    return verifier_.deferred_map_;
+  }
+
+  bool ReadBlocks(const std::string& block_device, const RangeSet& ranges) {
+    return verifier_.ReadBlocks({ { "system", block_device, ranges } });
+  }
+
+  bool ReadBlocks(const std::vector<std::pair<std::string, RangeSet>>& partitions) {
+    std::vector<UpdateVerifier::PartitionBlocks> blocks;
+    for (const auto& [block_device, ranges] : partitions) {
+      blocks.push_back({ "partition" + std::to_string(blocks.size()), block_device, ranges });
+    }
+    return verifier_.ReadBlocks(blocks);
+  }
+
   bool verity_supported;
   UpdateVerifier verifier_;
 
@@ -217,3 +246,86 @@ TEST_F(UpdateVerifierTest, verify_image_protobuf_fingerprint_mismatch) {
   ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
   ASSERT_FALSE(verifier_.ParseCareMap());
 }
+
+TEST_F(UpdateVerifierTest, ReadBlocks) {
+  // 2500 blocks of 4096 bytes, so that the ranges below span several reads.
+  TemporaryFile image;
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(2500 * 4096, 'a'), image.path));
+
+  ASSERT_TRUE(ReadBlocks(image.path, RangeSet::Parse("4,0,1,10,2500")));
+  ASSERT_TRUE(ReadBlocks(image.path, RangeSet::Parse("2,2499,2500")));
+
+  // Blocks past the end of the image can't be read.
+  ASSERT_FALSE(ReadBlocks(image.path, RangeSet::Parse("4,0,10,2000,2501")));
+  ASSERT_FALSE(ReadBlocks("/doesntexist", RangeSet::Parse("2,0,1")));
+}
+
+TEST_F(UpdateVerifierTest, ReadBlocks_partitions) {
+  TemporaryFile system_image;
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(3000 * 4096, 'a'), system_image.path));
+  TemporaryFile vendor_image;
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(100 * 4096, 'b'), vendor_image.path));
+
+  ASSERT_TRUE(ReadBlocks({ { system_image.path, RangeSet::Parse("2,0,3000") },
+                           { vendor_image.path, RangeSet::Parse("4,0,10,50,100") } }));
+
+  // A failure on any partition fails the verification.
+  ASSERT_FALSE(ReadBlocks({ { system_image.path, RangeSet::Parse("2,0,3000") },
+                            { vendor_image.path, RangeSet::Parse("2,0,101") } }));
+  ASSERT_FALSE(ReadBlocks({ { system_image.path, RangeSet::Parse("2,0,3000") },
+                            { "/doesntexist", RangeSet::Parse("2,0,1") } }));
+}
+
+TEST_F(UpdateVerifierTest, ParseCareMap_incremental) {
+  std::vector<std::unordered_map<std::string, std::string>> partitions = {
+    {
+        { "name", "system" },
+        { "ranges", "4,0,100,200,300" },
+        { "id", property_id_ },
+        { "fingerprint", fingerprint_ },
+        { "changed_ranges", "4,50,150,250,260" },
+    },
+    {
+        { "name", "vendor" },
+        { "ranges", "2,0,10" },
+        { "id", property_id_ },
+        { "fingerprint", fingerprint_ },
+    },
+  };
+  ASSERT_TRUE(android::base::WriteStringToFile(ConstructProto(partitions), care_map_pb_));
+
+  // All the blocks are read on the first boot by default.
+  SetIncremental(false);
+  ASSERT_TRUE(verifier_.ParseCareMap());
+  ASSERT_EQ(2U, partition_map().size());
+  ASSERT_EQ(RangeSet::Parse("4,0,100,200,300"), partition_map().at("system"));
+  ASSERT_FALSE(verifier_.HasDeferredPartitions());
+
+  // Only the changed blocks in the incremental mode, with the others deferred.
+  SetIncremental(true);
+  ASSERT_TRUE(verifier_.ParseCareMap());
+  ASSERT_EQ(RangeSet::Parse("4,50,100,250,260"), partition_map().at("system"));
+  ASSERT_EQ(RangeSet::Parse("2,0,10"), partition_map().at("vendor"));
+  ASSERT_TRUE(verifier_.HasDeferredPartitions());
+  ASSERT_EQ(1U, deferred_map().size());
+  ASSERT_EQ(RangeSet::Parse("6,0,50,200,250,260,300"), deferred_map().at("system"));
+}
+
+TEST_F(UpdateVerifierTest, ParseCareMap_incremental_unchanged_partition) {
+  std::vector<std::unordered_map<std::string, std::string>> partitions = {
+    {
+        { "name", "system" },
+        { "ranges", "2,0,100" },
+        { "id", property_id_ },
+        { "fingerprint", fingerprint_ },
+        { "changed_ranges", "2,200,300" },
+    },
+  };
+  ASSERT_TRUE(android::base::WriteStringToFile(ConstructProto(partitions), care_map_pb_));
+
+  // Nothing to read on the first boot, but the care map is still valid.
+  SetIncremental(true);
+  ASSERT_TRUE(verifier_.ParseCareMap());
+  ASSERT_TRUE(partition_map().empty());
+  ASSERT_EQ(RangeSet::Parse("2,0,100"), deferred_map().at("system"));
+}
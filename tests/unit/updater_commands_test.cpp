@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "otautil/updater_commands.h"
+
+// Reads all the commands that |data| holds through an UpdaterCommandReader.
+static std::vector<UpdaterCommand> ReadCommands(const std::string& data, bool* binary = nullptr) {
+  TemporaryFile temp_file;
+  EXPECT_TRUE(android::base::WriteStringToFile(data, temp_file.path));
+  UpdaterCommandReader reader(android::base::unique_fd(open(temp_file.path, O_RDONLY)));
+  std::vector<UpdaterCommand> commands;
+  UpdaterCommand command;
+  while (reader.Next(&command)) {
+    commands.push_back(command);
+  }
+  if (binary != nullptr) {
+    *binary = reader.binary();
+  }
+  return commands;
+}
+
+static UpdaterCommand MakeCommand(UpdaterCommandType type, const std::string& text = "",
+                                  double fraction = 0, int seconds = 0) {
+  UpdaterCommand command;
+  command.type = type;
+  command.text = text;
+  command.fraction = fraction;
+  command.seconds = seconds;
+  return command;
+}
+
+static void ExpectCommand(const UpdaterCommand& expected, const UpdaterCommand& command) {
+  EXPECT_EQ(expected.type, command.type);
+  EXPECT_EQ(expected.text, command.text);
+  EXPECT_DOUBLE_EQ(expected.fraction, command.fraction);
+  EXPECT_EQ(expected.seconds, command.seconds);
+}
+
+static const std::vector<UpdaterCommand> kCommands = {
+  MakeCommand(UpdaterCommandType::PROGRESS, "", 0.25, 10),
+  MakeCommand(UpdaterCommandType::SET_PROGRESS, "", 0.5),
+  MakeCommand(UpdaterCommandType::UI_PRINT, "Patching system image"),
+  MakeCommand(UpdaterCommandType::LOG, "error: 22"),
+  MakeCommand(UpdaterCommandType::STAGE, "2/3"),
+  MakeCommand(UpdaterCommandType::WIPE_CACHE),
+  MakeCommand(UpdaterCommandType::CLEAR_DISPLAY),
+  MakeCommand(UpdaterCommandType::ENABLE_REBOOT),
+  MakeCommand(UpdaterCommandType::RETRY_UPDATE),
+  MakeCommand(UpdaterCommandType::TEXT, "new_command with args"),
+};
+
+TEST(UpdaterCommandsTest, TextLines) {
+  std::string data;
+  for (const auto& command : kCommands) {
+    data += FormatUpdaterCommandLine(command) + "\n";
+  }
+  ASSERT_EQ("progress 0.250000 10\n", FormatUpdaterCommandLine(kCommands[0]) + "\n");
+
+  bool binary;
+  auto commands = ReadCommands(data, &binary);
+  ASSERT_FALSE(binary);
+  ASSERT_EQ(kCommands.size(), commands.size());
+  for (size_t i = 0; i < commands.size(); i++) {
+    ExpectCommand(kCommands[i], commands[i]);
+  }
+}
+
+TEST(UpdaterCommandsTest, TextLines_Invalid) {
+  auto commands = ReadCommands(
+      "progress 0.5\n"
+      "set_progress x\n"
+      "log\n"
+      "\n"
+      " ui_print leading space\n"
+      "ui_print   trimmed  \n"
+      "ui_print no newline");
+  ASSERT_EQ(5U, commands.size());
+  ExpectCommand(MakeCommand(UpdaterCommandType::INVALID, "progress 0.5"), commands[0]);
+  ExpectCommand(MakeCommand(UpdaterCommandType::INVALID, "set_progress x"), commands[1]);
+  ExpectCommand(MakeCommand(UpdaterCommandType::INVALID, "log"), commands[2]);
+  ExpectCommand(MakeCommand(UpdaterCommandType::UI_PRINT, "trimmed"), commands[3]);
+  ExpectCommand(MakeCommand(UpdaterCommandType::UI_PRINT, "no newline"), commands[4]);
+}
+
+TEST(UpdaterCommandsTest, Frames) {
+  // The updater accepts the binary form with a text line, and sends frames from then on.
+  std::string data = "ui_print before\n" + std::string(kBinaryCommandsAccept) + "\n";
+  for (const auto& command : kCommands) {
+    EncodeUpdaterCommandFrame(command, &data);
+  }
+  // A TEXT frame holds any text line, including those of the commands with frames of their own.
+  EncodeUpdaterCommandFrame(MakeCommand(UpdaterCommandType::TEXT, "set_progress 0.75"), &data);
+  // Long strings are taken whole.
+  std::string long_text(300000, 'x');
+  EncodeUpdaterCommandFrame(MakeCommand(UpdaterCommandType::UI_PRINT, long_text), &data);
+
+  bool binary;
+  auto commands = ReadCommands(data, &binary);
+  ASSERT_TRUE(binary);
+  ASSERT_EQ(kCommands.size() + 3, commands.size());
+  ExpectCommand(MakeCommand(UpdaterCommandType::UI_PRINT, "before"), commands[0]);
+  for (size_t i = 0; i < kCommands.size(); i++) {
+    ExpectCommand(kCommands[i], commands[i + 1]);
+  }
+  ExpectCommand(MakeCommand(UpdaterCommandType::SET_PROGRESS, "", 0.75),
+                commands[kCommands.size() + 1]);
+  ExpectCommand(MakeCommand(UpdaterCommandType::UI_PRINT, long_text),
+                commands[kCommands.size() + 2]);
+}
+
+TEST(UpdaterCommandsTest, Frames_Malformed) {
+  std::string data = std::string(kBinaryCommandsAccept) + "\n";
+  EncodeUpdaterCommandFrame(MakeCommand(UpdaterCommandType::WIPE_CACHE), &data);
+  // A truncated frame ends the commands.
+  std::string frame;
+  EncodeUpdaterCommandFrame(MakeCommand(UpdaterCommandType::UI_PRINT, "truncated"), &frame);
+  data += frame.substr(0, frame.size() - 1);
+
+  auto commands = ReadCommands(data);
+  ASSERT_EQ(1U, commands.size());
+  ExpectCommand(MakeCommand(UpdaterCommandType::WIPE_CACHE), commands[0]);
+
+  // So does a frame that's too large.
+  data = std::string(kBinaryCommandsAccept) + "\n";
+  EncodeUpdaterCommandFrame(
+      MakeCommand(UpdaterCommandType::LOG,
+                  std::string(UpdaterCommandReader::kMaxCommandSize + 1, 'x')),
+      &data);
+  ASSERT_TRUE(ReadCommands(data).empty());
+}
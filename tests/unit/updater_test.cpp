@@ -22,6 +22,7 @@
 
 #include <algorithm>
 #include <memory>
+#include <random>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -40,8 +41,10 @@
 #include <verity/hash_tree_builder.h>
 #include <ziparchive/zip_archive.h>
 #include <ziparchive/zip_writer.h>
+#include <zlib.h>
 
 #include "applypatch/applypatch.h"
+#include "applypatch/imgdiff.h"
 #include "common/test_constants.h"
 #include "edify/expr.h"
 #include "otautil/error_code.h"
@@ -131,9 +134,31 @@ static Value* BlobToString(const char* name, State* state,
   return args[0].release();
 }
 
+// An UpdaterRuntime whose properties can be overridden by the tests.
+class TestUpdaterRuntime : public UpdaterRuntime {
+ public:
+  TestUpdaterRuntime() : UpdaterRuntime(nullptr) {}
+
+  std::string GetProperty(const std::string_view key,
+                          const std::string_view default_value) const override {
+    auto it = properties_.find(std::string(key));
+    if (it != properties_.end()) {
+      return it->second;
+    }
+    return UpdaterRuntime::GetProperty(key, default_value);
+  }
+
+  void SetProperty(const std::string& key, const std::string& value) {
+    properties_[key] = value;
+  }
+
+ private:
+  std::unordered_map<std::string, std::string> properties_;
+};
+
 class UpdaterTestBase {
  protected:
-  UpdaterTestBase() : updater_(std::make_unique<UpdaterRuntime>(nullptr)) {}
+  UpdaterTestBase() : updater_(std::make_unique<TestUpdaterRuntime>()) {}
 
   void SetUp() {
     RegisterBuiltins();
@@ -146,7 +171,9 @@ class UpdaterTestBase {
     Paths::Get().set_last_command_file(temp_last_command_.path);
     Paths::Get().set_stash_directory_base(temp_stash_base_.path);
 
-    last_command_file_ = temp_last_command_.path;
+    // Each partition keeps its own last command file, named after its stash directory.
+    last_command_file_ =
+        std::string(temp_last_command_.path) + "." + GetSha1(image_temp_file_.path);
     image_file_ = image_temp_file_.path;
   }
 
@@ -168,6 +195,12 @@ class UpdaterTestBase {
     std::string script = is_verify ? "block_image_verify" : "block_image_update";
     script += R"((")" + image_file + R"(", package_extract_file("transfer_list"), ")" + new_data +
               R"(", "patch_data"))";
+    RunScript(script, std::move(entries), result, cause_code);
+  }
+
+  // Runs the edify |script| in an update package built from |entries|.
+  void RunScript(const std::string& script, PackageEntries entries, const std::string& result,
+                 CauseCode cause_code = kNoCause) {
     entries.emplace(Updater::SCRIPT_NAME, script);
 
     // Build the update package.
@@ -193,6 +226,11 @@ class UpdaterTestBase {
     ASSERT_EQ(cause_code, received_cause_code);
   }
 
+  // Overrides the property |key| as read by the updater functions.
+  void SetProperty(const std::string& key, const std::string& value) {
+    static_cast<TestUpdaterRuntime*>(updater_.GetRuntime())->SetProperty(key, value);
+  }
+
   TemporaryFile temp_saved_source_;
   TemporaryDir temp_stash_base_;
   std::string last_command_file_;
@@ -547,9 +585,10 @@ TEST_F(UpdaterTest, package_extract_dir) {
 
 // TODO: Test extracting to block device.
 TEST_F(UpdaterTest, package_extract_file) {
-  // package_extract_file expects 1 or 2 arguments.
+  // package_extract_file expects 1 or 3 arguments, or pairs of arguments.
   expect(nullptr, "package_extract_file()", kArgsParsingFailure);
-  expect(nullptr, "package_extract_file(\"arg1\", \"arg2\", \"arg3\")", kArgsParsingFailure);
+  expect(nullptr, "package_extract_file(\"arg1\", \"arg2\", \"arg3\", \"arg4\", \"arg5\")",
+         kArgsParsingFailure);
 
   std::string zip_path = from_testdata_base("ziptest_valid.zip");
   ZipArchiveHandle handle;
@@ -583,6 +622,44 @@ TEST_F(UpdaterTest, package_extract_file) {
   script = "package_extract_file(\"a.txt\", \"/dev/full\")";
   expect("", script, kNoCause, &updater_);
 
+  // Several pairs extract all the entries.
+  TemporaryFile temp_file2;
+  script = "package_extract_file(\"a.txt\", \"" + std::string(temp_file1.path) +
+           "\", \"b/d.txt\", \"" + std::string(temp_file2.path) + "\")";
+  expect("t", script, kNoCause, &updater_);
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file1.path, &data));
+  ASSERT_EQ(kATxtContents, data);
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file2.path, &data));
+  ASSERT_EQ(kDTxtContents, data);
+
+  // And fail if any of them fails.
+  script = "package_extract_file(\"a.txt\", \"" + std::string(temp_file1.path) +
+           "\", \"b.txt\", \"/dev/full\")";
+  expect("", script, kNoCause, &updater_);
+  script = "package_extract_file(\"a.txt\", \"" + std::string(temp_file1.path) +
+           "\", \"doesntexist\", \"" + std::string(temp_file2.path) + "\")";
+  expect("", script, kNoCause, &updater_);
+
+  // Three-argument version, which checks the digest of what it streams to the file.
+  script = "package_extract_file(\"a.txt\", \"" + std::string(temp_file1.path) + "\", \"" +
+           kATxtSha1Sum + "\")";
+  expect("t", script, kNoCause, &updater_);
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file1.path, &data));
+  ASSERT_EQ(kATxtContents, data);
+  script = "package_extract_file(\"a.txt\", \"" + std::string(temp_file1.path) +
+           "\", \"f300881fdf1d87a9481d1619e69d5365a93bca8b4ca8e94f1a8b26c117f7d7c4\")";
+  expect("t", script, kNoCause, &updater_);
+
+  // A mismatch, or a digest that's neither SHA-1 nor SHA-256, fails it.
+  script = "package_extract_file(\"b.txt\", \"" + std::string(temp_file1.path) + "\", \"" +
+           kATxtSha1Sum + "\")";
+  expect("", script, kNoCause, &updater_);
+  script = "package_extract_file(\"a.txt\", \"" + std::string(temp_file1.path) + "\", \"abcd\")";
+  expect("", script, kNoCause, &updater_);
+  script = "package_extract_file(\"doesntexist\", \"" + std::string(temp_file1.path) + "\", \"" +
+           kATxtSha1Sum + "\")";
+  expect("", script, kNoCause, &updater_);
+
   // One-argument version. package_extract_file() gives a VAL_BLOB, which needs to be converted to
   // VAL_STRING for equality test.
   script = "blob_to_string(package_extract_file(\"a.txt\")) == \"" + kATxtContents + "\"";
@@ -596,6 +673,59 @@ TEST_F(UpdaterTest, package_extract_file) {
   expect(nullptr, script, kPackageExtractFileFailure, &updater_);
 }
 
+TEST_F(UpdaterTest, set_metadata_recursive) {
+  // One file at the top, and a few subtrees for the workers to share.
+  TemporaryDir td;
+  std::string root(td.path);
+  ASSERT_TRUE(android::base::WriteStringToFile("a", root + "/a.txt"));
+  for (const auto& dir : { "/b", "/c", "/d", "/e" }) {
+    ASSERT_EQ(0, mkdir((root + dir).c_str(), 0755));
+    ASSERT_EQ(0, mkdir((root + dir + "/f").c_str(), 0755));
+    ASSERT_TRUE(android::base::WriteStringToFile("g", root + dir + "/f/g.txt"));
+    ASSERT_EQ(0, symlink("g.txt", (root + dir + "/f/h").c_str()));
+  }
+
+  auto mode = [](const std::string& path) {
+    struct stat sb;
+    EXPECT_EQ(0, lstat(path.c_str(), &sb)) << path;
+    return sb.st_mode & 07777;
+  };
+  std::string script = "set_metadata_recursive(\"" + root + "\", \"dmode\", 0750, \"fmode\", 0640)";
+  expect("", script, kNoCause);
+  ASSERT_EQ(0750U, mode(root));
+  ASSERT_EQ(0640U, mode(root + "/a.txt"));
+  for (const auto& dir : { "/b", "/c", "/d", "/e" }) {
+    ASSERT_EQ(0750U, mode(root + dir));
+    ASSERT_EQ(0750U, mode(root + dir + "/f"));
+    ASSERT_EQ(0640U, mode(root + dir + "/f/g.txt"));
+  }
+
+  // Already in place, so there's nothing to change the second time.
+  expect("", script, kNoCause);
+  ASSERT_EQ(0640U, mode(root + "/b/f/g.txt"));
+
+  // Directories get their mode after their contents, even one without the search permission.
+  script = "set_metadata_recursive(\"" + root + "/b\", \"dmode\", 0600, \"fmode\", 0444)";
+  expect("", script, kNoCause);
+  ASSERT_EQ(0600U, mode(root + "/b"));
+  ASSERT_EQ(0, chmod((root + "/b").c_str(), 0750));
+  ASSERT_EQ(0600U, mode(root + "/b/f"));
+  ASSERT_EQ(0, chmod((root + "/b/f").c_str(), 0750));
+  ASSERT_EQ(0444U, mode(root + "/b/f/g.txt"));
+
+  // The top-level path is lstat()'d first.
+  expect(nullptr, "set_metadata_recursive(\"" + root + "/doesntexist\", \"mode\", 0644)",
+         kSetMetadataFailure);
+
+  for (const auto& dir : { "/b", "/c", "/d", "/e" }) {
+    ASSERT_EQ(0, unlink((root + dir + "/f/h").c_str()));
+    ASSERT_EQ(0, unlink((root + dir + "/f/g.txt").c_str()));
+    ASSERT_EQ(0, rmdir((root + dir + "/f").c_str()));
+    ASSERT_EQ(0, rmdir((root + dir).c_str()));
+  }
+  ASSERT_EQ(0, unlink((root + "/a.txt").c_str()));
+}
+
 TEST_F(UpdaterTest, read_file) {
   // read_file() expects one argument.
   expect(nullptr, "read_file()", kArgsParsingFailure);
@@ -664,6 +794,54 @@ TEST_F(UpdaterTest, compute_hash_tree_smoke) {
   ASSERT_EQ(expected_root_hash, HashTreeBuilder::BytesArrayToString(digest));
 }
 
+TEST_F(UpdaterTest, compute_hash_tree_multiple_levels) {
+  // 1100 source blocks around a 10-block hash tree, which takes multiple read chunks and two tree
+  // levels.
+  std::string data;
+  for (size_t i = 0; i < 1110; i++) {
+    data += std::string(4096, (i >= 600 && i < 610) ? 0 : static_cast<char>(i * 7));
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(data, image_file_));
+
+  // Builds the expected hash tree with HashTreeBuilder.
+  std::string salt = "aee087a5be3b982978c923f566a94613496b417f2af592639bc80d141e34dfe7";
+  std::vector<unsigned char> salt_bytes;
+  ASSERT_TRUE(HashTreeBuilder::ParseBytesArrayFromString(salt, &salt_bytes));
+  HashTreeBuilder builder(4096, HashTreeBuilder::HashFunction("sha256"));
+  ASSERT_TRUE(builder.Initialize(1100 * 4096, salt_bytes));
+  std::string source = data.substr(0, 600 * 4096) + data.substr(610 * 4096);
+  ASSERT_TRUE(builder.Update(reinterpret_cast<const unsigned char*>(source.data()), source.size()));
+  ASSERT_TRUE(builder.BuildHashTree());
+  std::string expected_root_hash = HashTreeBuilder::BytesArrayToString(builder.root_hash());
+
+  TemporaryFile expected_tree_file;
+  ASSERT_TRUE(builder.WriteHashTreeToFd(expected_tree_file.fd, 0));
+  std::string expected_tree;
+  ASSERT_TRUE(android::base::ReadFileToString(expected_tree_file.path, &expected_tree));
+  ASSERT_EQ(10 * 4096, expected_tree.size());
+
+  // hash_tree_ranges, source_ranges, hash_algorithm, salt_hex, root_hash
+  std::vector<std::string> tokens{ "compute_hash_tree", "2,600,610", "4,0,600,610,1110", "sha256",
+                                   salt, expected_root_hash };
+  std::vector<std::string> transfer_list{
+    "4", "2", "0", "2", android::base::Join(tokens, " "),
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, "\n") },
+  };
+
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+  ASSERT_EQ(data.size(), updated.size());
+  ASSERT_EQ(source, updated.substr(0, 600 * 4096) + updated.substr(610 * 4096));
+  ASSERT_EQ(expected_tree, updated.substr(600 * 4096, 10 * 4096));
+}
+
 TEST_F(UpdaterTest, compute_hash_tree_root_mismatch) {
   std::string data;
   for (size_t i = 0; i < 128; i++) {
@@ -769,8 +947,15 @@ TEST_F(UpdaterTest, set_stage) {
   ASSERT_TRUE(write_bootloader_message_to(boot, temp_file, &err));
 
   // Write with set_stage().
+  TemporaryFile cmd_pipe;
+  SetUpdaterCmdPipe(cmd_pipe.release());
   std::string script("set_stage(\"" + temp_file + "\", \"1/3\")");
-  expect(tf.path, script, kNoCause);
+  expect(tf.path, script, kNoCause, &updater_);
+
+  // Recovery is told about the new stage.
+  std::string cmd;
+  ASSERT_TRUE(android::base::ReadFileToString(cmd_pipe.path, &cmd));
+  ASSERT_EQ("stage 1/3\n", cmd);
 
   // Verify.
   bootloader_message boot_verify;
@@ -942,6 +1127,250 @@ TEST_F(UpdaterTest, block_image_update_patch_underrun) {
   RunBlockImageUpdate(false, entries, image_file_, "", kPatchApplicationFailure);
 }
 
+// Generates the bsdiff patch from |source| to |target|.
+static std::string GetBsdiffPatch(std::string_view source, std::string_view target) {
+  TemporaryFile patch_file;
+  CHECK_EQ(0, bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(source.data()), source.size(),
+                             reinterpret_cast<const uint8_t*>(target.data()), target.size(),
+                             patch_file.path, nullptr));
+  std::string patch;
+  CHECK(android::base::ReadFileToString(patch_file.path, &patch));
+  return patch;
+}
+
+struct TestPatchSegment {
+  uint32_t src_start;
+  uint32_t src_blocks;
+  uint32_t tgt_blocks;
+  std::string patch;
+};
+
+// Packs |segments| into a segmented patch, with the target windows following each other.
+static std::string GetSegmentedPatch(const std::vector<TestPatchSegment>& segments) {
+  std::string header = "SEGDIFF1";
+  auto append = [&header](uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      header += static_cast<char>(value >> (8 * i));
+    }
+  };
+  append(segments.size(), 4);
+  size_t patch_offset = header.size() + segments.size() * 32;
+  uint32_t tgt_start = 0;
+  for (const auto& segment : segments) {
+    append(segment.src_start, 4);
+    append(segment.src_blocks, 4);
+    append(tgt_start, 4);
+    append(segment.tgt_blocks, 4);
+    append(patch_offset, 8);
+    append(segment.patch.size(), 8);
+    tgt_start += segment.tgt_blocks;
+    patch_offset += segment.patch.size();
+  }
+  for (const auto& segment : segments) {
+    header += segment.patch;
+  }
+  return header;
+}
+
+// Returns the entries of a v5 update of the given 6-block image, which patches its first four
+// blocks into blocks 0, 3, 4 and 5 with the bsdiff (or the given |command|) |patch|.
+static PackageEntries GetEntriesForSplitTarget(const std::string& source, const std::string& target,
+                                               const std::string& patch,
+                                               const std::string& command = "bsdiff") {
+  std::string src_hash = GetSha1(std::string_view(source).substr(0, 4096 * 4));
+  std::string tgt_hash = GetSha1(target.substr(0, 4096) + target.substr(4096 * 3));
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "5",
+    "4",
+    "0",
+    "0",
+    android::base::StringPrintf("%s 0 %zu %s %s 4,0,1,3,6 4 2,0,4", command.c_str(),
+                                patch.size(), src_hash.c_str(), tgt_hash.c_str()),
+    // clang-format on
+  };
+  return {
+    { "new_data", "" },
+    { "patch_data", patch },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+}
+
+TEST_F(UpdaterTest, block_image_update_segmented_patch) {
+  std::string source;
+  for (char c : std::string("abcdef")) {
+    source += std::string(4096, c);
+  }
+  std::string t0 = std::string(4000, 'a') + std::string(96, 'x');
+  std::string t1 = std::string(4096, 'y');
+  std::string t2 = std::string(96, 'z') + std::string(4000, 'c');
+  std::string t3 = std::string(4096, 'd');
+  ASSERT_TRUE(android::base::WriteStringToFile(source, image_file_));
+
+  // Blocks "a b" patch to the first two target blocks, and "c d" to the last two.
+  std::string patch = GetSegmentedPatch({
+      { 0, 2, 2, GetBsdiffPatch(std::string_view(source).substr(0, 4096 * 2), t0 + t1) },
+      { 2, 2, 2, GetBsdiffPatch(std::string_view(source).substr(4096 * 2, 4096 * 2), t2 + t3) },
+  });
+  std::string target = t0 + source.substr(4096, 4096 * 2) + t1 + t2 + t3;
+  RunBlockImageUpdate(false, GetEntriesForSplitTarget(source, target, patch), image_file_, "t");
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+  ASSERT_EQ(target, updated);
+}
+
+TEST_F(UpdaterTest, block_image_update_segmented_patch_invalid) {
+  std::string source;
+  for (char c : std::string("abcdef")) {
+    source += std::string(4096, c);
+  }
+  std::string target = std::string(4096, 'x') + source.substr(4096, 4096 * 2) +
+                       std::string(4096 * 3, 'y');
+  ASSERT_TRUE(android::base::WriteStringToFile(source, image_file_));
+
+  // The segments leave out the last target block.
+  std::string patch = GetSegmentedPatch({
+      { 0, 4, 3,
+        GetBsdiffPatch(std::string_view(source).substr(0, 4096 * 4),
+                       std::string(4096, 'x') + std::string(4096 * 2, 'y')) },
+  });
+  RunBlockImageUpdate(false, GetEntriesForSplitTarget(source, target, patch), image_file_, "",
+                      kPatchApplicationFailure);
+}
+
+// Runs the patches with the given ro.updater.patch_output_buffer_kb, which is rounded up to whole
+// blocks, and falls back to the default if invalid or out of range. 0 disables the write buffer.
+class PatchOutputBufferTest : public UpdaterTestBase, public testing::TestWithParam<std::string> {
+ protected:
+  void SetUp() override {
+    UpdaterTestBase::SetUp();
+    SetProperty("ro.updater.patch_output_buffer_kb", GetParam());
+  }
+
+  void TearDown() override {
+    UpdaterTestBase::TearDown();
+  }
+};
+
+INSTANTIATE_TEST_CASE_P(OutputBufferSizes, PatchOutputBufferTest,
+                        ::testing::Values("0", "4", "5", "1024", "65537", "99999999999", "abc"));
+
+// Returns the raw deflate stream of |data|, compressed with the parameters of the deflate chunks of
+// GetImgdiffPatch().
+static std::string Deflate(std::string_view data) {
+  z_stream strm = {};
+  CHECK_EQ(Z_OK, deflateInit2(&strm, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY));
+  std::string output(deflateBound(&strm, data.size()), '\0');
+  strm.next_in = reinterpret_cast<const Bytef*>(data.data());
+  strm.avail_in = data.size();
+  strm.next_out = reinterpret_cast<Bytef*>(output.data());
+  strm.avail_out = output.size();
+  CHECK_EQ(Z_STREAM_END, deflate(&strm, Z_FINISH));
+  output.resize(strm.total_out);
+  deflateEnd(&strm);
+  return output;
+}
+
+// Packs an imgdiff patch of three chunks: a deflate chunk that patches the raw deflate stream of
+// |deflate_src| at the start of the source into the deflate stream of |deflate_tgt|, a raw chunk of
+// |raw|, and a normal chunk that patches the |normal_src_len| bytes at |normal_src_start| into
+// |normal_tgt|.
+static std::string GetImgdiffPatch(std::string_view source, std::string_view deflate_src,
+                                   std::string_view deflate_tgt, std::string_view raw,
+                                   size_t normal_src_start, size_t normal_src_len,
+                                   std::string_view normal_tgt) {
+  std::string deflate_patch = GetBsdiffPatch(deflate_src, deflate_tgt);
+  std::string normal_patch =
+      GetBsdiffPatch(source.substr(normal_src_start, normal_src_len), normal_tgt);
+
+  std::string header = "IMGDIFF2";
+  auto append = [&header](uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      header += static_cast<char>(value >> (8 * i));
+    }
+  };
+  size_t patch_offset = 12 + (4 + 60) + (4 + 4 + raw.size()) + (4 + 24);
+  append(3, 4);
+
+  append(CHUNK_DEFLATE, 4);
+  append(0, 8);
+  append(Deflate(deflate_src).size(), 8);
+  append(patch_offset, 8);
+  append(deflate_src.size(), 8);
+  append(deflate_tgt.size(), 8);
+  for (int value : { 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY }) {
+    append(static_cast<uint32_t>(value), 4);
+  }
+
+  append(CHUNK_RAW, 4);
+  append(raw.size(), 4);
+  header += raw;
+
+  append(CHUNK_NORMAL, 4);
+  append(normal_src_start, 8);
+  append(normal_src_len, 8);
+  append(patch_offset + deflate_patch.size(), 8);
+
+  CHECK_EQ(patch_offset, header.size());
+  return header + deflate_patch + normal_patch;
+}
+
+TEST_P(PatchOutputBufferTest, bsdiff) {
+  std::string source;
+  for (char c : std::string("abcdef")) {
+    source += std::string(4096, c);
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(source, image_file_));
+
+  // The target blocks are in two ranges, so that the output crosses a range boundary.
+  std::string patched = std::string(4000, 'a') + std::string(4096 * 2 + 96, 'x') +
+                        std::string(96, 'y') + std::string(4000, 'd');
+  std::string patch = GetBsdiffPatch(std::string_view(source).substr(0, 4096 * 4), patched);
+  std::string target = patched.substr(0, 4096) + source.substr(4096, 4096 * 2) +
+                       patched.substr(4096);
+  RunBlockImageUpdate(false, GetEntriesForSplitTarget(source, target, patch), image_file_, "t");
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+  ASSERT_EQ(target, updated);
+}
+
+TEST_P(PatchOutputBufferTest, imgdiff) {
+  // The deflate output is longer than the first target range, and isn't block aligned, so the
+  // raw and normal chunks that follow it are written at unaligned offsets.
+  std::mt19937 random(0);
+  std::string deflate_src(6000, '\0');
+  std::generate(deflate_src.begin(), deflate_src.end(),
+                [&random]() { return static_cast<char>(random()); });
+  std::string deflate_tgt = deflate_src;
+  std::fill(deflate_tgt.begin() + 1000, deflate_tgt.begin() + 2000, 'z');
+  std::string deflated_src = Deflate(deflate_src);
+  std::string deflated_tgt = Deflate(deflate_tgt);
+  ASSERT_GT(deflated_tgt.size(), 4096U);
+  ASSERT_LT(deflated_tgt.size(), 4096U * 2);
+
+  std::string source = deflated_src + std::string(4096 * 2 - deflated_src.size(), 's');
+  for (char c : std::string("cdef")) {
+    source += std::string(4096, c);
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(source, image_file_));
+
+  std::string raw(100, 'r');
+  std::string normal_tgt(4096 * 4 - deflated_tgt.size() - raw.size(), 'n');
+  std::string patch =
+      GetImgdiffPatch(source, deflate_src, deflate_tgt, raw, 4096 * 2, 4096 * 2, normal_tgt);
+  std::string patched = deflated_tgt + raw + normal_tgt;
+  std::string target = patched.substr(0, 4096) + source.substr(4096, 4096 * 2) +
+                       patched.substr(4096);
+  RunBlockImageUpdate(false, GetEntriesForSplitTarget(source, target, patch, "imgdiff"),
+                      image_file_, "t");
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+  ASSERT_EQ(target, updated);
+}
+
 TEST_F(UpdaterTest, block_image_update_fail) {
   std::string src_content(4096 * 2, 'e');
   std::string src_hash = GetSha1(src_content);
@@ -978,6 +1407,185 @@ TEST_F(UpdaterTest, block_image_update_fail) {
   ASSERT_EQ(0, rmdir(stash_base.c_str()));
 }
 
+TEST_F(UpdaterTest, block_image_update_move_chained) {
+  // The second move reads the block written by the first one, which must not be served from any
+  // source data read ahead of time.
+  std::string src_content =
+      std::string(4096, 'a') + std::string(4096, 'b') + std::string(4096, 'c');
+  std::string hash_a = GetSha1(std::string(4096, 'a'));
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "2",
+    "0",
+    "0",
+    "move " + hash_a + " 2,1,2 1 2,0,1",
+    "move " + hash_a + " 2,2,3 1 2,1,2",
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, image_file_));
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+  ASSERT_EQ(std::string(4096 * 3, 'a'), updated);
+}
+
+TEST_F(UpdaterTest, block_image_update_independent_commands) {
+  // The first three commands don't touch the same blocks and may run concurrently, while the last
+  // move reads the block written by the first one.
+  std::string src_content;
+  for (char c : std::string("abcdef")) {
+    src_content += std::string(4096, c);
+  }
+  std::string hash_a = GetSha1(std::string(4096, 'a'));
+  std::string hash_b = GetSha1(std::string(4096, 'b'));
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "4",
+    "0",
+    "0",
+    "move " + hash_a + " 2,4,5 1 2,0,1",
+    "move " + hash_b + " 2,5,6 1 2,1,2",
+    "zero 2,2,3",
+    "move " + hash_a + " 2,3,4 1 2,4,5",
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, image_file_));
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+  std::string expected = std::string(4096, 'a') + std::string(4096, 'b') + std::string(4096, '\0') +
+                         std::string(4096, 'a') + std::string(4096, 'a') + std::string(4096, 'b');
+  ASSERT_EQ(expected, updated);
+}
+
+TEST_F(UpdaterTest, block_image_update_after_verify) {
+  // The update takes the source blocks kept by the verify, including the ones of the stash.
+  std::string src_content;
+  for (char c : std::string("abcdef")) {
+    src_content += std::string(4096, c);
+  }
+  std::string hash_a = GetSha1(std::string(4096, 'a'));
+  std::string hash_c = GetSha1(std::string(4096, 'c'));
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "2",
+    "1",
+    "1",
+    "stash " + hash_c + " 2,2,3",
+    "move " + hash_a + " 2,4,5 1 2,0,1",
+    "move " + hash_c + " 2,5,6 1 - " + hash_c + ":2,0,1",
+    "free " + hash_c,
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, image_file_));
+  RunBlockImageUpdate(true, entries, image_file_, "t");
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+  std::string expected = std::string(4096, 'a') + std::string(4096, 'b') + std::string(4096, 'c') +
+                         std::string(4096, 'd') + std::string(4096, 'a') + std::string(4096, 'c');
+  ASSERT_EQ(expected, updated);
+}
+
+TEST_F(UpdaterTest, block_image_update_short_lived_stash) {
+  // The stash is freed right after its only use, so it doesn't need to be saved to /cache.
+  std::string src_content =
+      std::string(4096, 'a') + std::string(4096, 'b') + std::string(4096, 'c');
+  std::string hash_a = GetSha1(std::string(4096, 'a'));
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "2",
+    "1",
+    "1",
+    "stash " + hash_a + " 2,0,1",
+    "move " + hash_a + " 2,2,3 1 - " + hash_a + ":2,0,1",
+    "free " + hash_a,
+    "zero 2,0,1",
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, image_file_));
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+  ASSERT_EQ(std::string(4096, '\0') + std::string(4096, 'b') + std::string(4096, 'a'), updated);
+}
+
+TEST_F(UpdaterTest, block_image_update_duplicate_stash) {
+  // The data is stashed twice before its first free, which must keep it for the move.
+  std::string src_content = std::string(4096, 'a') + std::string(4096, 'b') +
+                            std::string(4096, 'c') + std::string(4096, 'a');
+  std::string hash_a = GetSha1(std::string(4096, 'a'));
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "1",
+    "1",
+    "1",
+    "stash " + hash_a + " 2,0,1",
+    "stash " + hash_a + " 2,3,4",
+    "free " + hash_a,
+    "move " + hash_a + " 2,2,3 1 - " + hash_a + ":2,0,1",
+    "free " + hash_a,
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, image_file_));
+  RunBlockImageUpdate(true, entries, image_file_, "t");
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+  ASSERT_EQ(std::string(4096, 'a') + std::string(4096, 'b') + std::string(4096, 'a') +
+                std::string(4096, 'a'),
+            updated);
+
+  // The stash is gone after its last free.
+  std::string stash_dir = std::string(temp_stash_base_.path) + "/" + GetSha1(image_file_);
+  ASSERT_EQ(-1, access((stash_dir + "/" + hash_a).c_str(), F_OK));
+}
+
 TEST_F(UpdaterTest, new_data_over_write) {
   std::vector<std::string> transfer_list{
     // clang-format off
@@ -1139,6 +1747,116 @@ TEST_F(UpdaterTest, last_command_update) {
   ASSERT_EQ(block1 + block2 + block1, updated_contents);
 }
 
+TEST_F(UpdaterTest, last_command_update_parallel) {
+  std::string block1(4096, '1');
+  std::string block2(4096, '2');
+  std::string block3(4096, '3');
+  std::string block4(4096, '4');
+  std::string block5(4096, '5');
+  std::string block6(4096, '6');
+  std::string block1_hash = GetSha1(block1);
+  std::string block3_hash = GetSha1(block3);
+  std::string block4_hash = GetSha1(block4);
+
+  // Interrupt the updates of two partitions at different commands.
+  std::vector<std::string> transfer_list_a_fail{
+    // clang-format off
+    "4",
+    "2",
+    "0",
+    "2",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block1_hash + " 2,1,2 1 2,0,1",
+    "stash " + block3_hash + " 2,2,3",
+    "abort",
+    // clang-format on
+  };
+  std::vector<std::string> transfer_list_b_fail{
+    // clang-format off
+    "4",
+    "1",
+    "0",
+    "1",
+    "stash " + block4_hash + " 2,0,1",
+    "move " + block4_hash + " 2,1,2 1 2,0,1",
+    "abort",
+    // clang-format on
+  };
+
+  std::vector<std::string> transfer_list_a_continue{
+    // clang-format off
+    "4",
+    "2",
+    "0",
+    "2",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block1_hash + " 2,1,2 1 2,0,1",
+    "stash " + block3_hash + " 2,2,3",
+    "move " + block1_hash + " 2,2,3 1 2,0,1",
+    // clang-format on
+  };
+  std::vector<std::string> transfer_list_b_continue{
+    // clang-format off
+    "4",
+    "2",
+    "0",
+    "1",
+    "stash " + block4_hash + " 2,0,1",
+    "move " + block4_hash + " 2,1,2 1 2,0,1",
+    "move " + block4_hash + " 2,2,3 1 2,0,1",
+    // clang-format on
+  };
+
+  TemporaryFile image_b_temp_file;
+  std::string image_b_file = image_b_temp_file.path;
+  std::string last_command_b_file =
+      Paths::Get().last_command_file() + "." + GetSha1(image_b_file);
+  std::string updated_marker_b =
+      std::string(temp_stash_base_.path) + "/" + GetSha1(image_b_file) + ".UPDATED";
+
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2 + block3, image_file_));
+  ASSERT_TRUE(android::base::WriteStringToFile(block4 + block5 + block6, image_b_file));
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list_a", android::base::Join(transfer_list_a_fail, '\n') },
+    { "transfer_list_b", android::base::Join(transfer_list_b_fail, '\n') },
+  };
+  std::string script = R"(parallel(block_image_update(")" + image_file_ +
+                       R"(", package_extract_file("transfer_list_a"), "new_data", "patch_data"),)" +
+                       R"(block_image_update(")" + image_b_file +
+                       R"(", package_extract_file("transfer_list_b"), "new_data", "patch_data")))";
+  RunScript(script, entries, "");
+
+  // Expect each partition to have saved its own last command.
+  std::string last_command_actual;
+  ASSERT_TRUE(android::base::ReadFileToString(last_command_file_, &last_command_actual));
+  EXPECT_EQ("2\n" + transfer_list_a_fail[TransferList::kTransferListHeaderLines + 2],
+            last_command_actual);
+  ASSERT_TRUE(android::base::ReadFileToString(last_command_b_file, &last_command_actual));
+  EXPECT_EQ("1\n" + transfer_list_b_fail[TransferList::kTransferListHeaderLines + 1],
+            last_command_actual);
+
+  // Resume both updates from the reset images. Each one skips the commands that it has done,
+  // regardless of where the other one stopped.
+  entries["transfer_list_a"] = android::base::Join(transfer_list_a_continue, '\n');
+  entries["transfer_list_b"] = android::base::Join(transfer_list_b_continue, '\n');
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2 + block3, image_file_));
+  ASSERT_TRUE(android::base::WriteStringToFile(block4 + block5 + block6, image_b_file));
+  RunScript(script, entries, "t");
+
+  std::string updated_contents;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+  ASSERT_EQ(block1 + block2 + block1, updated_contents);
+  ASSERT_TRUE(android::base::ReadFileToString(image_b_file, &updated_contents));
+  ASSERT_EQ(block4 + block5 + block4, updated_contents);
+
+  ASSERT_EQ(-1, access(last_command_file_.c_str(), R_OK));
+  ASSERT_EQ(-1, access(last_command_b_file.c_str(), R_OK));
+  ASSERT_TRUE(android::base::RemoveFileIfExists(updated_marker_b));
+}
+
 TEST_F(UpdaterTest, last_command_update_unresumable) {
   std::string block1(4096, '1');
   std::string block2(4096, '2');
@@ -1225,6 +1943,53 @@ TEST_F(UpdaterTest, last_command_verify) {
   ASSERT_EQ(-1, access(last_command_file_.c_str(), R_OK));
 }
 
+TEST_F(UpdaterTest, last_command_resume_in_command) {
+  std::string block_a(4096, 'a');
+  std::string block_b(4096, 'b');
+  std::string block_c(4096, 'c');
+  std::string block_d(4096, 'd');
+  std::string garbage(4096, 'x');
+
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "4",
+    "0",
+    "0",
+    "new 2,0,1",
+    "new 2,1,4",
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", block_a + block_b + block_c + block_d },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // The update got interrupted after writing 2 blocks of the second command. Only the rest of it
+  // gets written, with the new data that follows.
+  std::string last_command_content =
+      "0\n" + transfer_list[TransferList::kTransferListHeaderLines] + "\n2";
+  ASSERT_TRUE(android::base::WriteStringToFile(last_command_content, last_command_file_));
+  ASSERT_TRUE(android::base::WriteStringToFile(garbage + block_b + block_c + garbage, image_file_));
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  std::string updated_contents;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+  ASSERT_EQ(garbage + block_b + block_c + block_d, updated_contents);
+  ASSERT_EQ(-1, access(last_command_file_.c_str(), R_OK));
+
+  // The progress that doesn't fit in the command is ignored, and the whole command is written.
+  last_command_content = "0\n" + transfer_list[TransferList::kTransferListHeaderLines] + "\n3";
+  ASSERT_TRUE(android::base::WriteStringToFile(last_command_content, last_command_file_));
+  ASSERT_TRUE(android::base::WriteStringToFile(garbage + garbage + garbage + garbage, image_file_));
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+  ASSERT_EQ(garbage + block_b + block_c + block_d, updated_contents);
+}
+
 class ResumableUpdaterTest : public UpdaterTestBase, public testing::TestWithParam<size_t> {
  protected:
   void SetUp() override {
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -21,6 +22,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -50,8 +52,7 @@ static void LoadKeyFromFile(const std::string& file_name, Certificate* cert) {
 
 static void VerifyFile(const std::string& content, const std::vector<Certificate>& keys,
                        int expected) {
-  auto package =
-      Package::CreateMemoryPackage(std::vector<uint8_t>(content.begin(), content.end()), nullptr);
+  auto package = Package::AdoptMemoryPackage(std::string(content), nullptr);
   ASSERT_NE(nullptr, package);
 
   ASSERT_EQ(expected, verify_file(package.get(), keys));
@@ -246,6 +247,30 @@ TEST(VerifierTest, LoadKeysFromZipfile_multiple_key) {
   VerifyPackageWithCertificates("otasigned_v5.zip", certs);
 }
 
+TEST(VerifierTest, LoadKeysFromZipfile_cached) {
+  TemporaryFile otacerts;
+  BuildCertificateArchive({ from_testdata_base("testkey_v1.x509.pem") }, otacerts.release());
+  std::vector<Certificate> certs = LoadKeysFromZipfile(otacerts.path);
+  ASSERT_EQ(1, certs.size());
+
+  // Loading the same zip again gives the same keys, which outlive the earlier copies.
+  std::vector<Certificate> cached = LoadKeysFromZipfile(otacerts.path);
+  ASSERT_EQ(1, cached.size());
+  ASSERT_EQ(certs[0].rsa.get(), cached[0].rsa.get());
+  certs.clear();
+  VerifyPackageWithCertificates("otasigned_v1.zip", cached);
+
+  // A changed zip is parsed again.
+  android::base::unique_fd fd(open(otacerts.path, O_WRONLY | O_TRUNC));
+  ASSERT_NE(-1, fd);
+  BuildCertificateArchive(
+      { from_testdata_base("testkey_v3.x509.pem"), from_testdata_base("testkey_v4.x509.pem") },
+      fd.release());
+  certs = LoadKeysFromZipfile(otacerts.path);
+  ASSERT_EQ(2, certs.size());
+  VerifyPackageWithCertificates("otasigned_v3.zip", certs);
+}
+
 class VerifierTest : public testing::TestWithParam<std::vector<std::string>> {
  protected:
   void SetUp() override {
@@ -317,6 +342,141 @@ TEST(VerifierTest, BadPackage_SignatureStartOutOfBounds) {
   VerifyFile(package, certs, VERIFY_FAILURE);
 }
 
+// Counts what verify_file() reads and hashes of |package|, to bound its work on any input.
+class CountingPackage : public VerifierInterface {
+ public:
+  explicit CountingPackage(VerifierInterface* package) : package_(package) {}
+
+  uint64_t GetPackageSize() const override {
+    return package_->GetPackageSize();
+  }
+
+  bool ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint64_t offset) override {
+    bytes_read += byte_count;
+    return package_->ReadFullyAtOffset(buffer, byte_count, offset);
+  }
+
+  bool UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers, uint64_t start,
+                          uint64_t length) override {
+    hash_calls++;
+    bytes_hashed += length;
+    return package_->UpdateHashAtOffset(hashers, start, length);
+  }
+
+  void SetProgress(float progress) override {
+    package_->SetProgress(progress);
+  }
+
+  uint64_t bytes_read = 0;
+  uint64_t bytes_hashed = 0;
+  size_t hash_calls = 0;
+
+ private:
+  VerifierInterface* package_;
+};
+
+// Returns the DER encoding of an element of |tag| with |content|.
+static std::string Der(uint8_t tag, const std::string& content) {
+  std::string length;
+  if (content.size() < 0x80) {
+    length.push_back(static_cast<char>(content.size()));
+  } else {
+    for (size_t size = content.size(); size > 0; size >>= 8) {
+      length.insert(length.begin(), static_cast<char>(size & 0xff));
+    }
+    length.insert(length.begin(), static_cast<char>(0x80 | length.size()));
+  }
+  return static_cast<char>(tag) + length + content;
+}
+
+// Returns a PKCS#7 SignedData block with the shape that read_pkcs7() expects, around |signature|.
+static std::string Pkcs7(const std::string& signature) {
+  std::string signer_info = Der(0x30, Der(0x02, "\x01") + Der(0x30, Der(0x02, "\x01")) +
+                                          Der(0x30, "") + Der(0x30, "") + Der(0x04, signature));
+  std::string signed_data = Der(0x30, Der(0x02, "\x01") + Der(0x31, "") + Der(0x30, "") +
+                                          Der(0xA0, "") + Der(0x31, signer_info));
+  return Der(0x30, Der(0x06, "\x01") + Der(0xA0, signed_data));
+}
+
+// Returns a package of |body|, then an EOCD record whose comment is |padding| and |signature|,
+// followed by the footer.
+static std::string SignedPackage(const std::string& body, const std::string& padding,
+                                 const std::string& signature) {
+  size_t signature_start = signature.size() + 6;
+  size_t comment_size = padding.size() + signature_start;
+  std::string footer{ static_cast<char>(signature_start & 0xff),
+                      static_cast<char>(signature_start >> 8),
+                      '\xff',
+                      '\xff',
+                      static_cast<char>(comment_size & 0xff),
+                      static_cast<char>(comment_size >> 8) };
+  std::string eocd = "\x50\x4b\x05\x06"s + std::string(16, '\0') + footer.substr(4, 2);
+  return body + eocd + padding + signature + footer;
+}
+
+// Inputs at the limits of what verify_file() parses, where a regression would cost super-linear
+// time, or hash the package for nothing. Whatever the input, the footer and the EOCD record are
+// read once, and the package is hashed at most once, and only if a key fits the signature.
+TEST(VerifierTest, PathologicalInputs_BoundedWork) {
+  std::vector<Certificate> certs;
+  certs.emplace_back(0, Certificate::KEY_TYPE_RSA, nullptr, nullptr);
+  LoadKeyFromFile(from_testdata_base("testkey_v3.x509.pem"), &certs.back());
+
+  static constexpr uint64_t kMaxTailRead = 6 + 65535 + 22;
+  std::string body(1024 * 1024, 'x');
+  struct Input {
+    std::string name;
+    std::string package;
+    bool hashed;
+  };
+  std::vector<Input> inputs;
+
+  // The largest comment, full of near-misses of the EOCD marker for the scan to go through.
+  std::string near_misses;
+  while (near_misses.size() < 65535 - 400) {
+    near_misses += "\x50\x4b\x05";
+  }
+  inputs.push_back({ "near_misses", SignedPackage(body, near_misses, Pkcs7(std::string(255, 's'))),
+                     false });
+
+  // The largest signature block, as deeply nested sequences that are all truncated.
+  std::string nested;
+  while (nested.size() < 65535 - 6 - 4) {
+    nested += "\x30\x84\x7f\xff";
+  }
+  inputs.push_back({ "nested", SignedPackage(body, "", nested), false });
+
+  // The largest signature block, as a well-formed PKCS#7 block with a huge signature that fits no
+  // key.
+  inputs.push_back({ "huge_signature", SignedPackage(body, "", Pkcs7(std::string(65000, 's'))),
+                     false });
+
+  // A signature of the size of the key, but a bad one: hashed once, then rejected.
+  inputs.push_back(
+      { "bad_signature", SignedPackage(body, "", Pkcs7(std::string(256, 's'))), true });
+
+  // And the fuzzer-found worst cases checked in as testdata/verify_perf_*.
+  std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(from_testdata_base("").c_str()), closedir);
+  ASSERT_NE(nullptr, dir);
+  while (dirent* de = readdir(dir.get())) {
+    if (android::base::StartsWith(de->d_name, "verify_perf_")) {
+      std::string package;
+      ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base(de->d_name), &package));
+      inputs.push_back({ de->d_name, package, true });
+    }
+  }
+
+  for (const auto& input : inputs) {
+    auto package = Package::AdoptMemoryPackage(std::string(input.package), nullptr);
+    ASSERT_NE(nullptr, package);
+    CountingPackage counting(package.get());
+    ASSERT_EQ(VERIFY_FAILURE, verify_file(&counting, certs)) << input.name;
+    ASSERT_LE(counting.bytes_read, kMaxTailRead) << input.name;
+    ASSERT_LE(counting.hash_calls, input.hashed ? 1U : 0U) << input.name;
+    ASSERT_LE(counting.bytes_hashed, input.package.size()) << input.name;
+  }
+}
+
 TEST_P(VerifierSuccessTest, VerifySucceed) {
   ASSERT_EQ(VERIFY_SUCCESS, verify_file(memory_package_.get(), certs_));
   ASSERT_EQ(VERIFY_SUCCESS, verify_file(file_package_.get(), certs_));
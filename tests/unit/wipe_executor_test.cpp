@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "install/wipe_executor.h"
+
+TEST(WipeExecutorTest, RunsJobsAtOnce) {
+  WipeExecutor executor(3);
+  std::atomic<int> running = 0;
+  std::atomic<int> most_running = 0;
+  for (int i = 0; i < 6; i++) {
+    executor.Add("job" + std::to_string(i), [&running, &most_running]() {
+      int now = ++running;
+      int most = most_running;
+      while (now > most && !most_running.compare_exchange_weak(most, now)) {
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      --running;
+      return true;
+    });
+  }
+  ASSERT_TRUE(executor.Run());
+  ASSERT_EQ(3, most_running);
+}
+
+TEST(WipeExecutorTest, Dependencies) {
+  WipeExecutor executor;
+  std::mutex mutex;
+  std::vector<std::string> order;
+  auto job = [&mutex, &order](const std::string& name, int sleep_ms) {
+    return [&mutex, &order, name, sleep_ms]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(name);
+      return true;
+    };
+  };
+  size_t metadata = executor.Add("metadata", job("metadata", 100));
+  executor.Add("data", job("data", 0), { metadata });
+  executor.Add("cache", job("cache", 0));
+  ASSERT_TRUE(executor.Run());
+  ASSERT_EQ((std::vector<std::string>{ "cache", "metadata", "data" }), order);
+}
+
+TEST(WipeExecutorTest, FailedJob) {
+  WipeExecutor executor;
+  size_t failed = executor.Add("failed", []() { return false; });
+  bool ran = false;
+  // A job still runs after a failed one that it waits for.
+  executor.Add("after", [&ran]() { return ran = true; }, { failed });
+  ASSERT_FALSE(executor.Run());
+  ASSERT_TRUE(ran);
+}
+
+TEST(WipeExecutorTest, Progress) {
+  WipeExecutor executor(1);
+  executor.Add("small", []() { return true; }, {}, 1);
+  executor.Add("large", []() { return true; }, {}, 3);
+  std::vector<double> progress;
+  ASSERT_TRUE(executor.Run([&progress](double fraction) { progress.push_back(fraction); }));
+  ASSERT_EQ((std::vector<double>{ 0.25, 1.0 }), progress);
+
+  // Nothing to run.
+  ASSERT_TRUE(WipeExecutor().Run());
+}
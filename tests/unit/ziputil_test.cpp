@@ -15,18 +15,24 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include <string>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
 #include <otautil/ZipUtil.h>
 #include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
 
 #include "common/test_constants.h"
+#include "otautil/dirutil.h"
 
 TEST(ZipUtilTest, invalid_args) {
   std::string zip_path = from_testdata_base("ziptest_valid.zip");
@@ -189,3 +195,229 @@ TEST(ZipUtilTest, set_timestamp) {
 
   CloseArchive(handle);
 }
+
+TEST(ZipUtilTest, extract_in_parallel) {
+  std::string zip_path = from_testdata_base("ziptest_valid.zip");
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_path.c_str(), &handle));
+
+  // Extract the whole package with several workers.
+  TemporaryDir td;
+  ASSERT_TRUE(ExtractPackageRecursive(handle, "", td.path, nullptr, nullptr, 4));
+
+  std::string path(td.path);
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/a.txt", &content));
+  ASSERT_EQ(kATxtContents, content);
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/b/c.txt", &content));
+  ASSERT_EQ(kCTxtContents, content);
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/b/d.txt", &content));
+  ASSERT_EQ(kDTxtContents, content);
+
+  // Clean up the temp files under td.
+  ASSERT_EQ(0, unlink((path + "/a.txt").c_str()));
+  ASSERT_EQ(0, unlink((path + "/b.txt").c_str()));
+  ASSERT_EQ(0, unlink((path + "/b/c.txt").c_str()));
+  ASSERT_EQ(0, unlink((path + "/b/d.txt").c_str()));
+  ASSERT_EQ(0, rmdir((path + "/b").c_str()));
+
+  CloseArchive(handle);
+}
+
+TEST(ZipUtilTest, ExtractEntriesInParallel) {
+  std::string zip_path = from_testdata_base("ziptest_valid.zip");
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_path.c_str(), &handle));
+
+  TemporaryDir td;
+  std::vector<EntryExtraction> extractions;
+  for (const auto& name : { "a.txt", "b/c.txt", "b/d.txt" }) {
+    ZipEntry64 entry;
+    ASSERT_EQ(0, FindEntry(handle, name, &entry));
+    std::string path = std::string(td.path) + "/" + android::base::Basename(name);
+    extractions.push_back({ entry, path, [path]() {
+                             return android::base::unique_fd(
+                                 open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644));
+                           } });
+  }
+
+  // With a cap smaller than any entry, they're extracted one at a time.
+  ASSERT_TRUE(ExtractEntriesInParallel(handle, &extractions, 3, 1));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(std::string(td.path) + "/a.txt", &content));
+  ASSERT_EQ(kATxtContents, content);
+  ASSERT_TRUE(android::base::ReadFileToString(std::string(td.path) + "/c.txt", &content));
+  ASSERT_EQ(kCTxtContents, content);
+  ASSERT_TRUE(android::base::ReadFileToString(std::string(td.path) + "/d.txt", &content));
+  ASSERT_EQ(kDTxtContents, content);
+
+  // A file that can't be opened fails the extraction, but not the others.
+  ASSERT_EQ(0, unlink((std::string(td.path) + "/c.txt").c_str()));
+  extractions[0].open = []() { return android::base::unique_fd(); };
+  ASSERT_FALSE(ExtractEntriesInParallel(handle, &extractions, 3));
+  ASSERT_TRUE(android::base::ReadFileToString(std::string(td.path) + "/c.txt", &content));
+  ASSERT_EQ(kCTxtContents, content);
+
+  for (const auto& name : { "a.txt", "c.txt", "d.txt" }) {
+    ASSERT_EQ(0, unlink((std::string(td.path) + "/" + name).c_str()));
+  }
+  CloseArchive(handle);
+}
+
+TEST(ZipUtilTest, ExtractEntriesInParallel_stored_entries) {
+  // A stored entry that takes a few copies, and a compressed one.
+  std::string image(3 * 1024 * 1024 + 7, '\0');
+  for (size_t i = 0; i < image.size(); i++) {
+    image[i] = static_cast<char>(i * 7 / 4096);
+  }
+  TemporaryFile zip_file;
+  FILE* zip_file_ptr = fdopen(zip_file.release(), "wb");
+  ZipWriter writer(zip_file_ptr);
+  ASSERT_EQ(0, writer.StartEntry("image.img", 0));
+  ASSERT_EQ(0, writer.WriteBytes(image.data(), image.size()));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.StartEntry("a.txt", ZipWriter::kCompress));
+  ASSERT_EQ(0, writer.WriteBytes(kATxtContents.data(), kATxtContents.size()));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(zip_file_ptr));
+
+  std::string package;
+  ASSERT_TRUE(android::base::ReadFileToString(zip_file.path, &package));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(package.data(), package.size(), zip_file.path, &handle));
+
+  TemporaryDir td;
+  std::vector<EntryExtraction> extractions;
+  for (const auto& name : { "image.img", "a.txt" }) {
+    ZipEntry64 entry;
+    ASSERT_EQ(0, FindEntry(handle, name, &entry));
+    std::string path = std::string(td.path) + "/" + name;
+    extractions.push_back({ entry, path, [path]() {
+                             return android::base::unique_fd(
+                                 open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644));
+                           } });
+  }
+  ASSERT_EQ(kCompressStored, extractions[0].entry.method);
+
+  auto check_extracted = [&td, &image]() {
+    std::string content;
+    ASSERT_TRUE(android::base::ReadFileToString(std::string(td.path) + "/image.img", &content));
+    ASSERT_EQ(image, content);
+    ASSERT_TRUE(android::base::ReadFileToString(std::string(td.path) + "/a.txt", &content));
+    ASSERT_EQ(kATxtContents, content);
+  };
+
+  // Sent from the package file.
+  android::base::unique_fd package_fd(open(zip_file.path, O_RDONLY));
+  ASSERT_NE(-1, package_fd);
+  ExtractionSource source{ reinterpret_cast<const uint8_t*>(package.data()), package.size(),
+                           package_fd.get() };
+  ASSERT_TRUE(ExtractEntriesInParallel(handle, &extractions, 2, kMaxExtractionBytesInFlight,
+                                       &source));
+  check_extracted();
+
+  // Written from the mapping.
+  source.fd = -1;
+  ASSERT_TRUE(ExtractEntriesInParallel(handle, &extractions, 2, kMaxExtractionBytesInFlight,
+                                       &source));
+  check_extracted();
+
+  // A corrupt stored entry fails its CRC-32 check.
+  package[extractions[0].entry.offset + image.size() / 2] ^= 0xff;
+  ASSERT_FALSE(ExtractEntriesInParallel(handle, &extractions, 2, kMaxExtractionBytesInFlight,
+                                        &source));
+
+  for (const auto& name : { "image.img", "a.txt" }) {
+    ASSERT_EQ(0, unlink((std::string(td.path) + "/" + name).c_str()));
+  }
+  CloseArchive(handle);
+}
+
+TEST(ZipUtilTest, StreamEntryToFile) {
+  // Entries of a few chunks, stored and compressed.
+  std::string image(2 * 1024 * 1024 + 7, '\0');
+  for (size_t i = 0; i < image.size(); i++) {
+    image[i] = static_cast<char>(i * 7 / 4096);
+  }
+  TemporaryFile zip_file;
+  FILE* zip_file_ptr = fdopen(zip_file.release(), "wb");
+  ZipWriter writer(zip_file_ptr);
+  ASSERT_EQ(0, writer.StartEntry("stored.img", 0));
+  ASSERT_EQ(0, writer.WriteBytes(image.data(), image.size()));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.StartEntry("compressed.img", ZipWriter::kCompress));
+  ASSERT_EQ(0, writer.WriteBytes(image.data(), image.size()));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(zip_file_ptr));
+
+  std::string package;
+  ASSERT_TRUE(android::base::ReadFileToString(zip_file.path, &package));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(package.data(), package.size(), zip_file.path, &handle));
+  ExtractionSource source{ reinterpret_cast<const uint8_t*>(package.data()), package.size() };
+
+  for (const auto& name : { "stored.img", "compressed.img" }) {
+    ZipEntry64 entry;
+    ASSERT_EQ(0, FindEntry(handle, name, &entry));
+    TemporaryFile output;
+    std::string written;
+    std::vector<size_t> chunks;
+    ASSERT_TRUE(StreamEntryToFile(
+        handle, { entry, output.path, nullptr }, output.fd,
+        [&written, &chunks](const uint8_t* data, size_t size) {
+          written.append(reinterpret_cast<const char*>(data), size);
+          chunks.push_back(size);
+        },
+        &source))
+        << name;
+
+    // Whole chunks, but for the last one.
+    ASSERT_EQ((std::vector<size_t>{ 1024 * 1024, 1024 * 1024, 7 }), chunks) << name;
+    ASSERT_EQ(image, written) << name;
+    std::string content;
+    ASSERT_TRUE(android::base::ReadFileToString(output.path, &content));
+    ASSERT_EQ(image, content) << name;
+  }
+  CloseArchive(handle);
+}
+
+TEST(ZipUtilTest, extract_many_dirs) {
+  // More directories than are kept open, and a deep one.
+  TemporaryFile zip_file;
+  FILE* zip_file_ptr = fdopen(zip_file.release(), "wb");
+  ZipWriter writer(zip_file_ptr);
+  std::vector<std::string> names{ "a/b/c/d/e/f.txt" };
+  for (size_t i = 0; i < 300; i++) {
+    names.push_back("dirs/" + std::to_string(i) + "/file.txt");
+  }
+  for (const auto& name : names) {
+    ASSERT_EQ(0, writer.StartEntry(name, ZipWriter::kCompress));
+    ASSERT_EQ(0, writer.WriteBytes(name.data(), name.size()));
+    ASSERT_EQ(0, writer.FinishEntry());
+  }
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(zip_file_ptr));
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_file.path, &handle));
+  constexpr struct utimbuf timestamp = { 1217592000, 1217592000 };
+
+  // The destination is created too.
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/out";
+  ASSERT_TRUE(ExtractPackageRecursive(handle, "", path, &timestamp, nullptr, 4));
+  for (const auto& name : names) {
+    std::string content;
+    ASSERT_TRUE(android::base::ReadFileToString(path + "/" + name, &content)) << name;
+    ASSERT_EQ(name, content);
+  }
+
+  struct stat sb;
+  ASSERT_EQ(0, stat((path + "/dirs/299/file.txt").c_str(), &sb));
+  ASSERT_EQ(timestamp.modtime, sb.st_mtime);
+
+  ASSERT_EQ(0, dirUnlinkHierarchy(path.c_str()));
+  CloseArchive(handle);
+}
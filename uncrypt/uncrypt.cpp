@@ -89,6 +89,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -101,12 +102,17 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
@@ -116,14 +122,21 @@
 #include <cutils/sockets.h>
 #include <fs_mgr.h>
 #include <fstab/fstab.h>
+#include <openssl/sha.h>
 
 #include "otautil/error_code.h"
+#include "otautil/print_sha1.h"
 
 using android::fs_mgr::Fstab;
 using android::fs_mgr::ReadDefaultFstab;
 
-static constexpr int WINDOW_SIZE = 5;
 static constexpr int FIBMAP_RETRY_LIMIT = 3;
+// When the package is encrypted, it's read (and so decrypted) this many blocks at a time, into this
+// many buffers, while the chunks already read are written to the block device.
+static constexpr int COPY_CHUNK_BLOCKS = 512;
+static constexpr size_t COPY_BUFFERS = 3;
+// The number of extents fetched by each FS_IOC_FIEMAP call.
+static constexpr uint32_t FIEMAP_EXTENT_BATCH = 512;
 
 // uncrypt provides three services: SETUP_BCB, CLEAR_BCB and UNCRYPT.
 //
@@ -142,18 +155,6 @@ static const std::string UNCRYPT_SOCKET = "uncrypt";
 
 static Fstab fstab;
 
-static int write_at_offset(unsigned char* buffer, size_t size, int wfd, off64_t offset) {
-    if (TEMP_FAILURE_RETRY(lseek64(wfd, offset, SEEK_SET)) == -1) {
-        PLOG(ERROR) << "error seeking to offset " << offset;
-        return -1;
-    }
-    if (!android::base::WriteFully(wfd, buffer, size)) {
-        PLOG(ERROR) << "error writing offset " << offset;
-        return -1;
-    }
-    return 0;
-}
-
 static void add_block_to_ranges(std::vector<int>& ranges, int new_block) {
     if (!ranges.empty() && new_block == ranges.back()) {
         // If the new block comes immediately after the current range,
@@ -240,10 +241,389 @@ static int RetryFibmap(int fd, const std::string& name, int* block, const int he
   return kUncryptIoctlError;
 }
 
+// The extents of a file, from FS_IOC_FIEMAP, to map its blocks in bulk rather than with a FIBMAP
+// call per block.
+class FileExtents {
+ public:
+  // Reads the extents of the first |size| bytes of |fd|. If FIEMAP isn't supported (e.g. by the
+  // filesystem), none are known, and all the blocks are left to FIBMAP.
+  void Read(int fd, off64_t size, uint32_t block_size) {
+    std::vector<uint8_t> buffer(sizeof(struct fiemap) +
+                                FIEMAP_EXTENT_BATCH * sizeof(struct fiemap_extent));
+    auto fm = reinterpret_cast<struct fiemap*>(buffer.data());
+    uint64_t start = 0;
+    while (start < static_cast<uint64_t>(size)) {
+      memset(buffer.data(), 0, buffer.size());
+      fm->fm_start = start;
+      fm->fm_length = size - start;
+      // Flushes the delayed allocations first, which FIBMAP would do block by block.
+      fm->fm_flags = FIEMAP_FLAG_SYNC;
+      fm->fm_extent_count = FIEMAP_EXTENT_BATCH;
+      if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0) {
+        PLOG(WARNING) << "FIEMAP failed, falling back to FIBMAP";
+        extents_.clear();
+        return;
+      }
+      if (fm->fm_mapped_extents == 0) {
+        break;
+      }
+      for (uint32_t i = 0; i < fm->fm_mapped_extents; i++) {
+        const struct fiemap_extent& extent = fm->fm_extents[i];
+        // Leave out the extents without a plain, block-aligned location on the device, for FIBMAP
+        // to look up (and fail on) as before.
+        constexpr uint32_t kUnmappable = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+                                         FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_NOT_ALIGNED |
+                                         FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL |
+                                         FIEMAP_EXTENT_UNWRITTEN;
+        if ((extent.fe_flags & kUnmappable) == 0 && extent.fe_logical % block_size == 0 &&
+            extent.fe_physical % block_size == 0 && extent.fe_length % block_size == 0) {
+          extents_.push_back({ extent.fe_logical / block_size, extent.fe_physical / block_size,
+                               extent.fe_length / block_size });
+        }
+        start = extent.fe_logical + extent.fe_length;
+      }
+      if (fm->fm_extents[fm->fm_mapped_extents - 1].fe_flags & FIEMAP_EXTENT_LAST) {
+        break;
+      }
+    }
+    LOG(INFO) << "  " << extents_.size() << " extents";
+  }
+
+  // Returns the physical block of the logical |block|, or 0 if it's not in a known extent. The
+  // blocks must be looked up in increasing order.
+  int Find(int block) {
+    while (next_ < extents_.size() &&
+           extents_[next_].logical + extents_[next_].length <= static_cast<uint64_t>(block)) {
+      next_++;
+    }
+    if (next_ == extents_.size() || extents_[next_].logical > static_cast<uint64_t>(block)) {
+      return 0;
+    }
+    uint64_t physical = extents_[next_].physical + (block - extents_[next_].logical);
+    // FIBMAP can't map past INT_MAX either.
+    return physical <= INT_MAX ? static_cast<int>(physical) : 0;
+  }
+
+ private:
+  struct Extent {
+    uint64_t logical;
+    uint64_t physical;
+    uint64_t length;
+  };
+
+  std::vector<Extent> extents_;
+  size_t next_ = 0;
+};
+
+// Finds the physical block of the logical |head_block| of |fd|, from |extents| if it's known there,
+// or with FIBMAP.
+static int FindBlock(int fd, const std::string& name, FileExtents* extents, int head_block,
+                     int* block) {
+  *block = extents->Find(head_block);
+  if (*block != 0) {
+    return kUncryptNoError;
+  }
+
+  *block = head_block;
+  if (ioctl(fd, FIBMAP, block) != 0) {
+    PLOG(ERROR) << "failed to find block " << head_block;
+    return kUncryptIoctlError;
+  }
+  if (*block == 0) {
+    LOG(ERROR) << "failed to find block " << head_block << ", retrying";
+    return RetryFibmap(fd, name, block, head_block);
+  }
+  return kUncryptNoError;
+}
+
+// Updates the progress on |socket| to the share of |done| out of |total|, if it has gone up.
+static void ReportProgress(int64_t done, int64_t total, int* last_progress, int socket) {
+  // Progress must be between [0, 99].
+  int progress = static_cast<int>(100 * (double(done) / double(total)));
+  if (progress > *last_progress) {
+    *last_progress = progress;
+    write_status_to_socket(progress, socket);
+  }
+}
+
+// Adds the physical blocks of the |size| bytes of |fd| to |ranges|, for an unencrypted file.
+static int MapBlocks(int fd, const std::string& path, FileExtents* extents, off64_t size,
+                     size_t blksize, int socket, std::vector<int>* ranges) {
+  int blocks = (size + blksize - 1) / blksize;
+  int last_progress = 0;
+  for (int head_block = 0; head_block < blocks; head_block++) {
+    ReportProgress(head_block, blocks, &last_progress, socket);
+    int block;
+    int error = FindBlock(fd, path, extents, head_block, &block);
+    if (error != kUncryptNoError) {
+      return error;
+    }
+    add_block_to_ranges(*ranges, block);
+  }
+  return kUncryptNoError;
+}
+
+// Writes the |blocks| blocks at |data|, the logical blocks from |first_block| of |fd|, to their
+// physical blocks on |wfd|, and adds these to |ranges|. Each run of blocks that are contiguous on
+// the device is written at once.
+static int WriteChunk(int fd, const std::string& path, FileExtents* extents, int first_block,
+                      int blocks, const uint8_t* data, size_t blksize, int wfd,
+                      std::vector<int>* ranges) {
+  int run_start = 0;
+  int run_block = 0;
+  auto write_run = [&](int end) {
+    if (end == run_start) {
+      return true;
+    }
+    off64_t offset = static_cast<off64_t>(blksize) * run_block;
+    if (!android::base::WriteFullyAtOffset(wfd, data + run_start * blksize,
+                                           (end - run_start) * blksize, offset)) {
+      PLOG(ERROR) << "error writing offset " << offset;
+      return false;
+    }
+    return true;
+  };
+
+  for (int i = 0; i < blocks; i++) {
+    int block;
+    int error = FindBlock(fd, path, extents, first_block + i, &block);
+    if (error != kUncryptNoError) {
+      return error;
+    }
+    add_block_to_ranges(*ranges, block);
+    if (i == 0 || block != run_block + (i - run_start)) {
+      if (!write_run(i)) {
+        return kUncryptWriteError;
+      }
+      run_start = i;
+      run_block = block;
+    }
+  }
+  return write_run(blocks) ? kUncryptNoError : kUncryptWriteError;
+}
+
+// Copies the decrypted contents of the |size| bytes of |fd| to their physical blocks on the block
+// device |wfd|, and adds these to |ranges|. A reader thread reads the file ahead in chunks of
+// COPY_CHUNK_BLOCKS, while this thread maps and writes the chunks already read.
+static int CopyBlocks(int fd, const std::string& path, FileExtents* extents, off64_t size,
+                      size_t blksize, int wfd, int socket, std::vector<int>* ranges) {
+  struct Chunk {
+    int first_block;
+    int blocks;
+    std::vector<uint8_t> data;
+    bool read;
+  };
+
+  int total_blocks = (size + blksize - 1) / blksize;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Chunk> ready;
+  std::vector<std::vector<uint8_t>> free_buffers(COPY_BUFFERS,
+                                                 std::vector<uint8_t>(COPY_CHUNK_BLOCKS * blksize));
+  bool stopped = false;
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  std::thread reader([&]() {
+    for (int first_block = 0; first_block < total_blocks; first_block += COPY_CHUNK_BLOCKS) {
+      std::vector<uint8_t> data;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return stopped || !free_buffers.empty(); });
+        if (stopped) {
+          return;
+        }
+        data = std::move(free_buffers.back());
+        free_buffers.pop_back();
+      }
+
+      int blocks = std::min(COPY_CHUNK_BLOCKS, total_blocks - first_block);
+      off64_t offset = static_cast<off64_t>(blksize) * first_block;
+      size_t to_read = std::min<off64_t>(blocks * blksize, size - offset);
+      bool read = android::base::ReadFullyAtOffset(fd, data.data(), to_read, offset);
+      if (!read) {
+        PLOG(ERROR) << "failed to read " << path;
+      }
+      // The end of the last block is past the end of the file.
+      memset(data.data() + to_read, 0, blocks * blksize - to_read);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.push_back({ first_block, blocks, std::move(data), read });
+      }
+      cv.notify_all();
+      if (!read) {
+        return;
+      }
+    }
+  });
+
+  int result = kUncryptNoError;
+  int last_progress = 0;
+  for (int first_block = 0; first_block < total_blocks; first_block += COPY_CHUNK_BLOCKS) {
+    ReportProgress(first_block, total_blocks, &last_progress, socket);
+    Chunk chunk;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]() { return !ready.empty(); });
+      chunk = std::move(ready.front());
+      ready.pop_front();
+    }
+    if (!chunk.read) {
+      result = kUncryptReadError;
+      break;
+    }
+    result = WriteChunk(fd, path, extents, chunk.first_block, chunk.blocks, chunk.data.data(),
+                        blksize, wfd, ranges);
+    if (result != kUncryptNoError) {
+      break;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      free_buffers.push_back(std::move(chunk.data));
+    }
+    cv.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopped = true;
+  }
+  cv.notify_all();
+  reader.join();
+  return result;
+}
+
+// The package a block map was produced for is recorded next to it, in |map_file| + ".id", so that
+// uncrypting the same package again (e.g. when the install is retried) can reuse the map. The
+// record holds the identity of the file (device, inode, size and mtime), the block device and
+// whether the contents were copied to it, plus the SHA-256 of the first and last blocks of the
+// file.
+static std::string BlockMapRecordFile(const std::string& map_file) {
+  return map_file + ".id";
+}
+
+// Returns the SHA-256 of the |length| bytes at |offset| of |fd|, or an empty string if they can't
+// be read.
+static std::string HashRange(int fd, off64_t offset, size_t length) {
+  std::vector<uint8_t> buffer(length);
+  if (!android::base::ReadFullyAtOffset(fd, buffer.data(), length, offset)) {
+    PLOG(WARNING) << "failed to read " << length << " bytes at " << offset;
+    return "";
+  }
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(buffer.data(), buffer.size(), digest);
+  return print_hex(digest, sizeof(digest));
+}
+
+// Returns the record of the package at |path| with |sb|, read from |fd|, or an empty string if its
+// blocks can't be read.
+static std::string GetBlockMapRecord(int fd, const struct stat& sb, const std::string& blk_dev,
+                                     bool encrypted) {
+  off64_t last_block = (sb.st_size - 1) / sb.st_blksize * sb.st_blksize;
+  std::string first_hash = HashRange(fd, 0, std::min<off64_t>(sb.st_size, sb.st_blksize));
+  std::string last_hash = HashRange(fd, last_block, sb.st_size - last_block);
+  if (first_hash.empty() || last_hash.empty()) {
+    return "";
+  }
+  return android::base::StringPrintf(
+      "file=%ju:%ju:%" PRId64 ":%jd.%09ld\nblk_dev=%s\nencrypted=%d\nfirst=%s\nlast=%s\n",
+      static_cast<uintmax_t>(sb.st_dev), static_cast<uintmax_t>(sb.st_ino),
+      static_cast<int64_t>(sb.st_size), static_cast<intmax_t>(sb.st_mtim.tv_sec),
+      sb.st_mtim.tv_nsec, blk_dev.c_str(), encrypted, first_hash.c_str(), last_hash.c_str());
+}
+
+// Parses the ranges of |map_file|, for a package of |size| bytes in blocks of |blksize| on
+// |blk_dev|, into |ranges|.
+static bool ReadBlockMapRanges(const std::string& map_file, const std::string& blk_dev,
+                               off64_t size, off64_t blksize, std::vector<int64_t>* ranges) {
+  std::string content;
+  if (!android::base::ReadFileToString(map_file, &content)) {
+    return false;
+  }
+  std::vector<std::string> lines = android::base::Split(android::base::Trim(content), "\n");
+  int64_t range_count;
+  if (lines.size() < 3 || lines[0] != blk_dev ||
+      lines[1] != android::base::StringPrintf("%" PRId64 " %" PRId64, static_cast<int64_t>(size),
+                                              static_cast<int64_t>(blksize)) ||
+      !android::base::ParseInt(lines[2], &range_count, INT64_C(1)) ||
+      lines.size() != static_cast<size_t>(range_count) + 3) {
+    return false;
+  }
+
+  int64_t blocks = 0;
+  for (size_t i = 3; i < lines.size(); i++) {
+    std::vector<std::string> pieces = android::base::Split(lines[i], " ");
+    int64_t start;
+    int64_t end;
+    if (pieces.size() != 2 || !android::base::ParseInt(pieces[0], &start, INT64_C(0)) ||
+        !android::base::ParseInt(pieces[1], &end, start + 1)) {
+      return false;
+    }
+    ranges->push_back(start);
+    ranges->push_back(end);
+    blocks += end - start;
+  }
+  return blocks == (size - 1) / blksize + 1;
+}
+
+// Returns whether the existing |map_file| was produced for the package at |path| as it is now, with
+// its blocks still in place on |blk_dev|: the record matches the file, and the first and last
+// blocks read from the device at the mapped locations match the ones read through the file. This
+// takes a few reads whatever the size of the package.
+static bool IsBlockMapCurrent(const std::string& path, const std::string& map_file,
+                              const std::string& blk_dev, bool encrypted) {
+  std::string record;
+  if (!android::base::ReadFileToString(BlockMapRecordFile(map_file), &record)) {
+    return false;
+  }
+  struct stat sb;
+  if (stat(path.c_str(), &sb) != 0 || sb.st_size == 0 || sb.st_blksize == 0) {
+    return false;
+  }
+  std::vector<int64_t> ranges;
+  if (!ReadBlockMapRanges(map_file, blk_dev, sb.st_size, sb.st_blksize, &ranges)) {
+    return false;
+  }
+
+  android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1 || GetBlockMapRecord(fd, sb, blk_dev, encrypted) != record) {
+    return false;
+  }
+
+  // The device is read past its page cache, which may hold blocks from before they were copied.
+  android::base::unique_fd dev_fd(open(blk_dev.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC));
+  if (dev_fd == -1) {
+    PLOG(WARNING) << "failed to open " << blk_dev << " for reading";
+    return false;
+  }
+  void* buffer;
+  if (posix_memalign(&buffer, sb.st_blksize, sb.st_blksize) != 0) {
+    return false;
+  }
+  std::unique_ptr<void, decltype(&free)> buffer_holder(buffer, free);
+  auto block_hash = [&](int64_t block, size_t length) -> std::string {
+    if (!android::base::ReadFullyAtOffset(dev_fd, buffer, sb.st_blksize, block * sb.st_blksize)) {
+      PLOG(WARNING) << "failed to read block " << block << " of " << blk_dev;
+      return "";
+    }
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(static_cast<uint8_t*>(buffer), length, digest);
+    return print_hex(digest, sizeof(digest));
+  };
+  off64_t last_length = sb.st_size - (sb.st_size - 1) / sb.st_blksize * sb.st_blksize;
+  std::string first_hash =
+      block_hash(ranges.front(), std::min<off64_t>(sb.st_size, sb.st_blksize));
+  std::string last_hash = block_hash(ranges.back() - 1, last_length);
+  return !first_hash.empty() && !last_hash.empty() &&
+         record.find("\nfirst=" + first_hash + "\nlast=" + last_hash + "\n") != std::string::npos;
+}
+
 static int ProductBlockMap(const std::string& path, const std::string& map_file,
                            const std::string& blk_dev, bool encrypted, bool f2fs_fs, int socket) {
   std::string err;
-  if (!android::base::RemoveFileIfExists(map_file, &err)) {
+  std::string record_file = BlockMapRecordFile(map_file);
+  if (!android::base::RemoveFileIfExists(record_file, &err) ||
+      !android::base::RemoveFileIfExists(map_file, &err)) {
     LOG(ERROR) << "failed to remove the existing map file " << map_file << ": " << err;
     return kUncryptFileRemoveError;
   }
@@ -281,13 +661,6 @@ static int ProductBlockMap(const std::string& path, const std::string& map_file,
     return kUncryptWriteError;
   }
 
-  std::vector<std::vector<unsigned char>> buffers;
-  if (encrypted) {
-    buffers.resize(WINDOW_SIZE, std::vector<unsigned char>(sb.st_blksize));
-  }
-  int head_block = 0;
-  int head = 0, tail = 0;
-
   android::base::unique_fd fd(open(path.c_str(), O_RDWR));
   if (fd == -1) {
     PLOG(ERROR) << "failed to open " << path << " for reading";
@@ -329,86 +702,16 @@ static int ProductBlockMap(const std::string& path, const std::string& map_file,
         }
     }
 
-    off64_t pos = 0;
-    int last_progress = 0;
-    while (pos < sb.st_size) {
-        // Update the status file, progress must be between [0, 99].
-        int progress = static_cast<int>(100 * (double(pos) / double(sb.st_size)));
-        if (progress > last_progress) {
-            last_progress = progress;
-            write_status_to_socket(progress, socket);
-        }
-
-        if ((tail+1) % WINDOW_SIZE == head) {
-            // write out head buffer
-            int block = head_block;
-            if (ioctl(fd, FIBMAP, &block) != 0) {
-                PLOG(ERROR) << "failed to find block " << head_block;
-                return kUncryptIoctlError;
-            }
-
-            if (block == 0) {
-                LOG(ERROR) << "failed to find block " << head_block << ", retrying";
-                int error = RetryFibmap(fd, path, &block, head_block);
-                if (error != kUncryptNoError) {
-                    return error;
-                }
-            }
+    // Map the blocks from the extents where possible, which takes a few ioctls for the whole file.
+    FileExtents extents;
+    extents.Read(fd, sb.st_size, sb.st_blksize);
 
-            add_block_to_ranges(ranges, block);
-            if (encrypted) {
-                if (write_at_offset(buffers[head].data(), sb.st_blksize, wfd,
-                                    static_cast<off64_t>(sb.st_blksize) * block) != 0) {
-                    return kUncryptWriteError;
-                }
-            }
-            head = (head + 1) % WINDOW_SIZE;
-            ++head_block;
-        }
-
-        // read next block to tail
-        if (encrypted) {
-            size_t to_read = static_cast<size_t>(
-                    std::min(static_cast<off64_t>(sb.st_blksize), sb.st_size - pos));
-            if (!android::base::ReadFully(fd, buffers[tail].data(), to_read)) {
-                PLOG(ERROR) << "failed to read " << path;
-                return kUncryptReadError;
-            }
-            pos += to_read;
-        } else {
-            // If we're not encrypting; we don't need to actually read
-            // anything, just skip pos forward as if we'd read a
-            // block.
-            pos += sb.st_blksize;
-        }
-        tail = (tail+1) % WINDOW_SIZE;
-    }
-
-    while (head != tail) {
-        // write out head buffer
-        int block = head_block;
-        if (ioctl(fd, FIBMAP, &block) != 0) {
-            PLOG(ERROR) << "failed to find block " << head_block;
-            return kUncryptIoctlError;
-        }
-
-        if (block == 0) {
-            LOG(ERROR) << "failed to find block " << head_block << ", retrying";
-            int error = RetryFibmap(fd, path, &block, head_block);
-            if (error != kUncryptNoError) {
-                return error;
-            }
-        }
-
-        add_block_to_ranges(ranges, block);
-        if (encrypted) {
-            if (write_at_offset(buffers[head].data(), sb.st_blksize, wfd,
-                                static_cast<off64_t>(sb.st_blksize) * block) != 0) {
-                return kUncryptWriteError;
-            }
-        }
-        head = (head + 1) % WINDOW_SIZE;
-        ++head_block;
+    int error = encrypted ? CopyBlocks(fd, path, &extents, sb.st_size, sb.st_blksize, wfd, socket,
+                                       &ranges)
+                          : MapBlocks(fd, path, &extents, sb.st_size, sb.st_blksize, socket,
+                                      &ranges);
+    if (error != kUncryptNoError) {
+        return error;
     }
 
     if (!android::base::WriteStringToFd(
@@ -448,6 +751,11 @@ static int ProductBlockMap(const std::string& path, const std::string& map_file,
       PLOG(ERROR) << "failed to rename " << tmp_map_file << " to " << map_file;
       return kUncryptFileRenameError;
     }
+    // Without the record, the map is just produced again next time.
+    std::string record = GetBlockMapRecord(fd, sb, blk_dev, encrypted);
+    if (record.empty() || !android::base::WriteStringToFile(record, record_file)) {
+      LOG(WARNING) << "failed to record the package of " << map_file;
+    }
     // Sync dir to make rename() result written to disk.
     std::string dir_name = android::base::Dirname(map_file);
     android::base::unique_fd dfd(open(dir_name.c_str(), O_RDONLY | O_DIRECTORY));
@@ -497,6 +805,10 @@ static int Uncrypt(const std::string& input_path, const std::string& map_file, i
   // On /data we want to convert the file to a block map so that we can read the package without
   // mounting the partition. On /cache and /sdcard we leave the file alone.
   if (android::base::StartsWith(path, "/data/")) {
+    if (IsBlockMapCurrent(path, map_file, blk_dev, encrypted)) {
+      LOG(INFO) << "reusing block map " << map_file << " of the unchanged package";
+      return 0;
+    }
     LOG(INFO) << "writing block map " << map_file;
     return ProductBlockMap(path, map_file, blk_dev, encrypted, f2fs_fs, socket);
   }
@@ -49,20 +49,46 @@ class UpdateVerifier {
   // Verifies the new boot by reading all the cared blocks for partitions in |partition_map_|.
   bool VerifyPartitions();
 
+  // Returns whether some cared blocks, not changed by the last OTA, are left for
+  // VerifyDeferredPartitions() by the incremental mode.
+  bool HasDeferredPartitions() const {
+    return !deferred_map_.empty();
+  }
+
+  // Reads the cared blocks in |deferred_map_|, once the boot has completed.
+  bool VerifyDeferredPartitions();
+
+  // Overrides ro.update_verifier.incremental, for the next ParseCareMap().
+  void set_incremental(bool incremental);
+
  private:
   friend class UpdateVerifierTest;
   // Finds all the dm-enabled partitions, and returns a map of <partition_name, block_device>.
   std::map<std::string, std::string> FindDmPartitions();
 
-  // Returns true if we successfully read the blocks in |ranges| of the |dm_block_device|.
-  bool ReadBlocks(const std::string partition_name, const std::string& dm_block_device,
-                  const RangeSet& ranges);
+  // The blocks to read on a partition.
+  struct PartitionBlocks {
+    std::string name;
+    std::string dm_block_device;
+    RangeSet ranges;
+  };
+
+  // Returns true if we successfully read the blocks in |ranges| of the |dm_block_device| of all
+  // the |partitions|.
+  bool ReadBlocks(const std::vector<PartitionBlocks>& partitions);
+
+  // Returns true if we successfully read the blocks of all the partitions in |partition_map|.
+  bool ReadPartitionMap(const std::map<std::string, RangeSet>& partition_map);
 
   // Functions to override the care_map_prefix_ and property_reader_, used in test only.
   void set_care_map_prefix(const std::string& prefix);
   void set_property_reader(const std::function<std::string(const std::string&)>& property_reader);
 
   std::map<std::string, RangeSet> partition_map_;
+  // In the incremental mode (ro.update_verifier.incremental), |partition_map_| only holds the
+  // cared blocks changed by the last OTA, and the others are left here.
+  std::map<std::string, RangeSet> deferred_map_;
+  bool incremental_;
   // The path to the care_map excluding the filename extension; default value:
   // "/data/ota_package/care_map"
   std::string care_map_prefix_;
@@ -35,6 +35,13 @@
  *
  * The current slot will be marked as having booted successfully if the verifier reaches the end
  * after the verification.
+ *
+ * With ro.update_verifier.incremental set, and a care map that lists the blocks changed by the last
+ * OTA, only these blocks are read before marking the slot. The other cared blocks are read by the
+ * update_verifier_deferred service once the boot has completed, at an idle I/O priority. The slot
+ * has been marked successful by then, so a failure of these reads can no longer fall back to the
+ * old slot, and is only reported. The pending check is kept in a persistent property, so that a
+ * reboot before it's done runs it again on the next boot.
  */
 
 #include "update_verifier/update_verifier.h"
@@ -49,8 +56,11 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <future>
+#include <memory>
 #include <thread>
+#include <utility>
 
 #include <BootControlClient.h>
 #include <android-base/chrono_utils.h>
@@ -66,6 +76,8 @@
 #include <cutils/android_reboot.h>
 
 #include "care_map.pb.h"
+#include "otautil/block_set.h"
+#include "otautil/io_profile.h"
 
 // TODO(xunchang) remove the prefix and use a default path instead.
 constexpr const char* kDefaultCareMapPrefix = "/data/ota_package/care_map";
@@ -78,8 +90,14 @@ static int dm_name_filter(const dirent* de) {
   return 0;
 }
 
+// Set while the cared blocks left by the incremental mode wait for the update_verifier_deferred
+// service, which runs once the boot has completed. It's persistent, so the check survives a reboot
+// until it's done.
+constexpr const char* kDeferredVerificationProperty = "persist.ota.update_verifier.deferred";
+
 UpdateVerifier::UpdateVerifier()
-    : care_map_prefix_(kDefaultCareMapPrefix),
+    : incremental_(android::base::GetBoolProperty("ro.update_verifier.incremental", false)),
+      care_map_prefix_(kDefaultCareMapPrefix),
       property_reader_([](const std::string& id) { return android::base::GetProperty(id, ""); }) {}
 
 // Iterate the content of "/sys/block/dm-X/dm/name" and find all the dm-wrapped block devices.
@@ -131,53 +149,119 @@ std::map<std::string, std::string> UpdateVerifier::FindDmPartitions() {
   return dm_block_devices;
 }
 
-bool UpdateVerifier::ReadBlocks(const std::string partition_name,
-                                const std::string& dm_block_device, const RangeSet& ranges) {
-  // RangeSet::Split() splits the ranges into multiple groups with same number of blocks (except for
-  // the last group).
-  size_t thread_num = std::thread::hardware_concurrency() ?: 4;
-  std::vector<RangeSet> groups = ranges.Split(thread_num);
-
-  std::vector<std::future<bool>> threads;
-  for (const auto& group : groups) {
-    auto thread_func = [&group, &dm_block_device, &partition_name]() {
-      android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(dm_block_device.c_str(), O_RDONLY)));
-      if (fd.get() == -1) {
-        PLOG(ERROR) << "Error reading " << dm_block_device << " for partition " << partition_name;
-        return false;
-      }
+// Each read covers up to this many blocks, so that the workers can balance the load.
+static constexpr size_t kBlockSize = 4096;
+static constexpr size_t kReadBlocks = 1024;
+
+// Returns the number of reads to keep in flight, from ro.update_verifier.queue_depth, or one per
+// core by default.
+static size_t GetQueueDepth() {
+  // The depth measured by the storage benchmark in recovery, if any, unless set explicitly.
+  size_t default_depth = GetProfiledQueueDepth(std::thread::hardware_concurrency() ?: 4, 64);
+  return android::base::GetUintProperty<size_t>("ro.update_verifier.queue_depth", default_depth,
+                                                 64) ?: 1;
+}
 
-      static constexpr size_t kBlockSize = 4096;
-      std::vector<uint8_t> buf(1024 * kBlockSize);
+// Opens |path| for O_DIRECT reads, so that the verified blocks don't fill the page cache, or for
+// buffered reads if O_DIRECT isn't supported.
+static android::base::unique_fd OpenForVerification(const std::string& path) {
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_DIRECT)));
+  if (fd == -1 && errno == EINVAL) {
+    fd.reset(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY)));
+  }
+  return fd;
+}
 
-      for (const auto& [range_start, range_end] : group) {
-        if (lseek64(fd.get(), static_cast<off64_t>(range_start) * kBlockSize, SEEK_SET) == -1) {
-          PLOG(ERROR) << "lseek to " << range_start << " failed";
+bool UpdateVerifier::ReadBlocks(const std::vector<PartitionBlocks>& partitions) {
+  // A read of the blocks [start, end) of partitions[partition], at |progress| of the way through
+  // the partition.
+  struct Read {
+    size_t partition;
+    size_t start;
+    size_t end;
+    double progress;
+  };
+  std::vector<Read> reads;
+  for (size_t partition = 0; partition < partitions.size(); partition++) {
+    const RangeSet& ranges = partitions[partition].ranges;
+    size_t done = 0;
+    for (const auto& [range_start, range_end] : ranges) {
+      for (size_t start = range_start; start < range_end; start += kReadBlocks) {
+        size_t end = std::min(range_end, start + kReadBlocks);
+        reads.push_back({ partition, start, end, static_cast<double>(done) / ranges.blocks() });
+        done += end - start;
+      }
+    }
+  }
+  // All the partitions go through one queue, interleaved according to their sizes so that they
+  // all finish at about the same time: a small partition doesn't wait for system to be done, and
+  // the device backing each partition stays busy until the end. Within a partition, the reads are
+  // taken in order by the workers as they become free, so its device sees a mostly sequential
+  // stream with |queue_depth| reads in flight (instead of one stream per worker, each in its own
+  // part of the partition).
+  std::stable_sort(reads.begin(), reads.end(),
+                   [](const Read& a, const Read& b) { return a.progress < b.progress; });
+  size_t queue_depth = std::min(GetQueueDepth(), reads.size());
+
+  std::atomic<size_t> next_read = 0;
+  std::atomic<bool> failed = false;
+  auto worker = [&]() {
+    // The block devices are opened as the reads reach them.
+    std::vector<android::base::unique_fd> fds(partitions.size());
+
+    // O_DIRECT needs a buffer aligned to the logical block size of the device.
+    void* buf_addr;
+    if (posix_memalign(&buf_addr, kBlockSize, kReadBlocks * kBlockSize) != 0) {
+      LOG(ERROR) << "Failed to allocate the read buffer";
+      return false;
+    }
+    std::unique_ptr<void, decltype(&free)> buf(buf_addr, free);
+
+    for (size_t i = next_read++; i < reads.size() && !failed; i = next_read++) {
+      const auto& [partition, start, end, progress] = reads[i];
+      const auto& [partition_name, dm_block_device, ranges] = partitions[partition];
+      auto& fd = fds[partition];
+      if (fd == -1) {
+        fd = OpenForVerification(dm_block_device);
+        if (fd == -1) {
+          PLOG(ERROR) << "Error reading " << dm_block_device << " for partition "
+                      << partition_name;
           return false;
         }
-
-        size_t remain = (range_end - range_start) * kBlockSize;
-        while (remain > 0) {
-          size_t to_read = std::min(remain, 1024 * kBlockSize);
-          if (!android::base::ReadFully(fd.get(), buf.data(), to_read)) {
-            PLOG(ERROR) << "Failed to read blocks " << range_start << " to " << range_end;
-            return false;
-          }
-          remain -= to_read;
-        }
       }
-      return true;
-    };
+      if (!android::base::ReadFullyAtOffset(fd, buf.get(), (end - start) * kBlockSize,
+                                            static_cast<off64_t>(start) * kBlockSize)) {
+        PLOG(ERROR) << "Failed to read blocks " << start << " to " << end << " on partition "
+                    << partition_name;
+        return false;
+      }
+    }
+    return true;
+  };
 
-    threads.emplace_back(std::async(std::launch::async, thread_func));
+  std::vector<std::future<bool>> threads;
+  for (size_t i = 0; i < queue_depth; i++) {
+    threads.emplace_back(std::async(std::launch::async, [&]() {
+      bool result = worker();
+      if (!result) {
+        failed = true;
+      }
+      return result;
+    }));
   }
 
   bool ret = true;
   for (auto& t : threads) {
     ret = t.get() && ret;
   }
-  LOG(INFO) << "Finished reading blocks on partition " << partition_name << " @ " << dm_block_device
-            << " with " << thread_num << " threads.";
+  if (ret) {
+    for (const auto& partition : partitions) {
+      LOG(INFO) << "Finished reading blocks on partition " << partition.name << " @ "
+                << partition.dm_block_device;
+    }
+  }
+  LOG(INFO) << "Read " << reads.size() << " chunks on " << partitions.size()
+            << " partitions with " << queue_depth << " reads in flight.";
   return ret;
 }
 
@@ -198,33 +282,45 @@ bool UpdateVerifier::VerifyPartitions() {
 
   if (userspace_snapshots && CheckVerificationStatus()) {
     LOG(INFO) << "Partitions verified by snapuserd daemon";
+    deferred_map_.clear();
     return true;
   }
 
   LOG(INFO) << "Partitions not verified by snapuserd daemon";
 
+  return ReadPartitionMap(partition_map_);
+}
+
+bool UpdateVerifier::VerifyDeferredPartitions() {
+  return ReadPartitionMap(deferred_map_);
+}
+
+bool UpdateVerifier::ReadPartitionMap(const std::map<std::string, RangeSet>& partition_map) {
+  if (partition_map.empty()) {
+    return true;
+  }
+
   auto dm_block_devices = FindDmPartitions();
   if (dm_block_devices.empty()) {
     LOG(ERROR) << "No dm-enabled block device is found.";
     return false;
   }
 
-  for (const auto& [partition_name, ranges] : partition_map_) {
+  std::vector<PartitionBlocks> partitions;
+  for (const auto& [partition_name, ranges] : partition_map) {
     if (dm_block_devices.find(partition_name) == dm_block_devices.end()) {
       LOG(ERROR) << "Failed to find dm block device for " << partition_name;
       return false;
     }
-
-    if (!ReadBlocks(partition_name, dm_block_devices.at(partition_name), ranges)) {
-      return false;
-    }
+    partitions.push_back({ partition_name, dm_block_devices.at(partition_name), ranges });
   }
 
-  return true;
+  return ReadBlocks(partitions);
 }
 
 bool UpdateVerifier::ParseCareMap() {
   partition_map_.clear();
+  deferred_map_.clear();
 
   std::string care_map_name = care_map_prefix_ + ".pb";
   if (access(care_map_name.c_str(), R_OK) == -1) {
@@ -288,10 +384,32 @@ bool UpdateVerifier::ParseCareMap() {
       continue;
     }
 
+    if (incremental_ && !partition.changed_ranges().empty()) {
+      RangeSet changed = RangeSet::Parse(partition.changed_ranges());
+      if (changed) {
+        BlockSet cared_blocks(ranges);
+        BlockSet changed_set(changed);
+        RangeSet changed_blocks = (cared_blocks & changed_set).ToRangeSet();
+        RangeSet unchanged_blocks = (cared_blocks - changed_set).ToRangeSet();
+        LOG(INFO) << "Reading " << changed_blocks.blocks() << " changed blocks of "
+                  << ranges.blocks() << " on partition " << partition.name()
+                  << ", and deferring the others";
+        if (changed_blocks) {
+          partition_map_.emplace(partition.name(), changed_blocks);
+        }
+        if (unchanged_blocks) {
+          deferred_map_.emplace(partition.name(), unchanged_blocks);
+        }
+        continue;
+      }
+      LOG(WARNING) << "Error parsing the changed ranges " << partition.changed_ranges()
+                   << "; reading all the blocks of partition " << partition.name();
+    }
+
     partition_map_.emplace(partition.name(), ranges);
   }
 
-  if (partition_map_.empty()) {
+  if (partition_map_.empty() && deferred_map_.empty()) {
     LOG(WARNING) << "No partition to verify";
     return false;
   }
@@ -303,6 +421,10 @@ void UpdateVerifier::set_care_map_prefix(const std::string& prefix) {
   care_map_prefix_ = prefix;
 }
 
+void UpdateVerifier::set_incremental(bool incremental) {
+  incremental_ = incremental;
+}
+
 void UpdateVerifier::set_property_reader(
     const std::function<std::string(const std::string&)>& property_reader) {
   property_reader_ = property_reader;
@@ -316,11 +438,45 @@ static int reboot_device() {
   while (true) pause();
 }
 
+// Reads the cared blocks deferred by the incremental mode, as the update_verifier_deferred
+// service once the boot has completed (with an idle I/O priority, so as not to slow the device
+// down). The slot has been marked successful already, so a failure is reported rather than
+// rebooting the device, which would only boot the same slot again.
+static int verify_deferred_partitions() {
+  if (!android::base::GetBoolProperty(kDeferredVerificationProperty, false)) {
+    LOG(INFO) << "No deferred verification pending.";
+    return 0;
+  }
+
+  int result = 0;
+  UpdateVerifier verifier;
+  verifier.set_incremental(true);
+  if (!verifier.ParseCareMap()) {
+    LOG(WARNING) << "Failed to parse the care map file, skipping the deferred verification";
+  } else if (!verifier.VerifyDeferredPartitions()) {
+    // In enforcing mode dm-verity has already rebooted the device.
+    LOG(ERROR) << "Failed to verify the deferred blocks in care map file.";
+    result = -1;
+  } else {
+    LOG(INFO) << "Verified the deferred blocks in care map file.";
+  }
+
+  // Reading the same blocks again on the next boot wouldn't succeed either.
+  if (!android::base::SetProperty(kDeferredVerificationProperty, "0")) {
+    LOG(WARNING) << "Failed to reset " << kDeferredVerificationProperty;
+  }
+  return result;
+}
+
 int update_verifier(int argc, char** argv) {
   for (int i = 1; i < argc; i++) {
     LOG(INFO) << "Started with arg " << i << ": " << argv[i];
   }
 
+  if (argc > 1 && strcmp(argv[1], "--deferred") == 0) {
+    return verify_deferred_partitions();
+  }
+
   const auto module = android::hal::BootControlClient::WaitForService();
   if (module == nullptr) {
     LOG(ERROR) << "Error getting bootctrl module.";
@@ -364,6 +520,16 @@ int update_verifier(int argc, char** argv) {
       } else if (!verifier.VerifyPartitions()) {
         LOG(ERROR) << "Failed to verify all blocks in care map file.";
         return reboot_device();
+      } else if (verifier.HasDeferredPartitions()) {
+        // Starts the update_verifier_deferred service once the boot completes.
+        LOG(INFO) << "Deferring the verification of the blocks not changed by the last OTA.";
+        if (!android::base::SetProperty(kDeferredVerificationProperty, "1")) {
+          LOG(ERROR) << "Failed to defer the verification; reading all the blocks.";
+          if (!verifier.VerifyDeferredPartitions()) {
+            LOG(ERROR) << "Failed to verify all blocks in care map file.";
+            return reboot_device();
+          }
+        }
       }
     }
 
@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/block_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "otautil/rangeset.h"
+
+// Merges the Range at 'index' with the ones that follow it contiguously on the device. Sets 'offset'
+// and 'size' to the merged extent in bytes, and returns the number of Range's consumed.
+static size_t MergeRanges(const RangeSet& ranges, size_t index, size_t block_size, off64_t* offset,
+                          size_t* size) {
+  size_t begin = ranges[index].first;
+  size_t end = ranges[index].second;
+  size_t count = 1;
+  while (index + count < ranges.size() && ranges[index + count].first == end) {
+    end = ranges[index + count].second;
+    count++;
+  }
+  *offset = static_cast<off64_t>(begin) * block_size;
+  *size = (end - begin) * block_size;
+  return count;
+}
+
+// Transfers the full extent described by 'iov' at 'offset', resuming after short transfers.
+static bool TransferFully(int fd, off64_t offset, iovec* iov, int iovcnt, bool write) {
+  while (iovcnt > 0) {
+    ssize_t n = write ? pwritev(fd, iov, iovcnt, offset) : preadv(fd, iov, iovcnt, offset);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    if (n == 0) {
+      errno = 0;
+      return false;
+    }
+    offset += n;
+    // Skip over the iovecs that have been fully transferred, and adjust the partial one.
+    while (iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+static bool TransferBlocks(int fd, const RangeSet& ranges, size_t block_size, uint8_t* buffer,
+                           bool write) {
+  for (size_t i = 0; i < ranges.size();) {
+    off64_t offset;
+    size_t size;
+    i += MergeRanges(ranges, i, block_size, &offset, &size);
+
+    iovec iov = { buffer, size };
+    if (!TransferFully(fd, offset, &iov, 1, write)) {
+      return false;
+    }
+    buffer += size;
+  }
+  return true;
+}
+
+bool ReadBlocksAt(int fd, const RangeSet& ranges, size_t block_size, uint8_t* buffer) {
+  return TransferBlocks(fd, ranges, block_size, buffer, false);
+}
+
+bool WriteBlocksAt(int fd, const RangeSet& ranges, size_t block_size, const uint8_t* buffer) {
+  return TransferBlocks(fd, ranges, block_size, const_cast<uint8_t*>(buffer), true);
+}
+
+bool ReadBlocksAt(int fd, const RangeSet& ranges, size_t block_size, uint8_t* buffer,
+                  const RangeSet& locations) {
+  static constexpr size_t kMaxIovecs = std::min(IOV_MAX, 1024);
+
+  if (ranges.blocks() != locations.blocks()) {
+    errno = EINVAL;
+    return false;
+  }
+  // The Range in 'locations' that the next block goes to, and how many blocks of it are filled.
+  size_t loc = 0;
+  size_t filled = 0;
+  std::vector<iovec> iovs;
+  for (size_t i = 0; i < ranges.size();) {
+    off64_t offset;
+    size_t size;
+    i += MergeRanges(ranges, i, block_size, &offset, &size);
+
+    // Split the extent at the boundaries of 'locations', in up to IOV_MAX iovecs per preadv(2).
+    size_t blocks = size / block_size;
+    while (blocks > 0) {
+      iovs.clear();
+      size_t count = 0;
+      while (blocks > 0 && iovs.size() < kMaxIovecs) {
+        size_t n = std::min(blocks, locations[loc].second - locations[loc].first - filled);
+        iovs.push_back({ buffer + (locations[loc].first + filled) * block_size, n * block_size });
+        count += n;
+        blocks -= n;
+        filled += n;
+        if (filled == locations[loc].second - locations[loc].first) {
+          loc++;
+          filled = 0;
+        }
+      }
+      if (!TransferFully(fd, offset, iovs.data(), iovs.size(), false)) {
+        return false;
+      }
+      offset += static_cast<off64_t>(count) * block_size;
+    }
+  }
+  return true;
+}
+
+// Zeroes the extent at 'offset' without writing the zeros ourselves: BLKZEROOUT for a block device
+// (which the kernel turns into a WRITE ZEROES or an unmap where the device guarantees zeros after
+// it, and drops the page cache of the extent), or FALLOC_FL_ZERO_RANGE for a file (e.g. the image
+// of the simulator). Returns false with errno set if that's not supported, or failed.
+static bool OffloadZeroing(int fd, mode_t mode, off64_t offset, size_t size) {
+  if (S_ISBLK(mode)) {
+    uint64_t range[2] = { static_cast<uint64_t>(offset), size };
+    return TEMP_FAILURE_RETRY(ioctl(fd, BLKZEROOUT, &range)) == 0;
+  }
+  if (S_ISREG(mode)) {
+    return TEMP_FAILURE_RETRY(fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, size)) == 0;
+  }
+  errno = EOPNOTSUPP;
+  return false;
+}
+
+// Whether the failure of OffloadZeroing() means it's not supported by the device (or the file
+// system), rather than a failure to zero.
+static bool IsOffloadUnsupported(int error) {
+  return error == EOPNOTSUPP || error == ENOTTY || error == EINVAL || error == ENOSYS;
+}
+
+bool ZeroBlocksAt(int fd, const RangeSet& ranges, size_t block_size) {
+  static constexpr size_t kMaxIovecs = std::min(IOV_MAX, 1024);
+
+  struct stat sb;
+  bool offload = fstat(fd, &sb) == 0 && (S_ISBLK(sb.st_mode) || S_ISREG(sb.st_mode));
+  std::vector<uint8_t> zero;
+  std::vector<iovec> iovs;
+  for (size_t i = 0; i < ranges.size();) {
+    off64_t offset;
+    size_t size;
+    i += MergeRanges(ranges, i, block_size, &offset, &size);
+
+    if (offload) {
+      if (OffloadZeroing(fd, sb.st_mode, offset, size)) {
+        continue;
+      }
+      if (!IsOffloadUnsupported(errno)) {
+        return false;
+      }
+      // Write the zeros for this extent and the rest.
+      offload = false;
+    }
+
+    if (zero.empty()) {
+      zero.resize(block_size, 0);
+    }
+    size_t blocks = size / block_size;
+    while (blocks > 0) {
+      size_t count = std::min(blocks, kMaxIovecs);
+      iovs.assign(count, iovec{ zero.data(), block_size });
+      if (!TransferFully(fd, offset, iovs.data(), count, true)) {
+        return false;
+      }
+      offset += static_cast<off64_t>(count) * block_size;
+      blocks -= count;
+    }
+  }
+  return true;
+}
@@ -32,34 +32,63 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <iterator>
 #include <limits>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/macros.h>
+#include <android-base/parsebool.h>
 #include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <applypatch/applypatch.h>
-#include <brotli/decode.h>
 #include <fec/io.h>
+#include <lz4.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <verity/hash_tree_builder.h>
 #include <ziparchive/zip_archive.h>
 
 #include "edify/expr.h"
 #include "edify/updater_interface.h"
+#include "edify/updater_runtime_interface.h"
+#include "otautil/block_hash.h"
 #include "otautil/dirutil.h"
 #include "otautil/error_code.h"
+#include "otautil/install_metrics.h"
+#include "otautil/io_profile.h"
+#include "otautil/memory_governor.h"
 #include "otautil/paths.h"
 #include "otautil/print_sha1.h"
 #include "otautil/rangeset.h"
+#include "otautil/thermal_throttle.h"
+#include "private/block_io.h"
 #include "private/commands.h"
+#include "private/new_data_decoder.h"
+#include "private/sha1_pipeline.h"
+#include "private/source_cache.h"
+#include "private/tree_hash.h"
 #include "updater/install.h"
 
 #ifdef __ANDROID__
@@ -76,22 +105,104 @@ static constexpr size_t BLOCKSIZE = 4096;
 static constexpr mode_t STASH_DIRECTORY_MODE = 0700;
 static constexpr mode_t STASH_FILE_MODE = 0600;
 static constexpr mode_t MARKER_DIRECTORY_MODE = 0700;
+// The size of the chunks read from a stash file, each of which is hashed while reading the next.
+static constexpr size_t kStashReadChunkSize = 1024 * 1024;
+
+// Thread-local, so that the workers running a batch of commands can report their own failures.
+static thread_local CauseCode failure_type = kNoCause;
+// The updates of different partitions may run at the same time, with parallel(). They all retry
+// or none does, and each has stashes of its own.
+static std::atomic<bool> is_retry = false;
+static thread_local std::unordered_map<std::string, RangeSet> stash_map;
+// The blocks of each partition (keyed by its stashbase) found to have the expected contents by its
+// last block_image_verify(), for block_image_recover() to leave alone.
+static std::mutex verified_blocks_lock;
+static std::map<std::string, std::vector<Range>> verified_blocks;
+
+// The time (in microseconds) a command spends in reading, patching, writing and fsync'ing blocks,
+// and the number of stashes it loads, when tracing is enabled with kTraceCommandsProperty. Along
+// with the I/O it issues (as counts of requests and bytes) and the bytes it hashes and patches,
+// which don't depend on the speed of the device that runs it (e.g. for the simulator to estimate
+// the time it would take on a device).
+struct CommandTrace {
+  uint64_t read_us{ 0 };
+  uint64_t patch_us{ 0 };
+  uint64_t write_us{ 0 };
+  uint64_t fsync_us{ 0 };
+  size_t stash_loads{ 0 };
+  size_t stash_memory_hits{ 0 };
+  uint64_t reads{ 0 };
+  uint64_t read_bytes{ 0 };
+  uint64_t writes{ 0 };
+  uint64_t write_bytes{ 0 };
+  uint64_t discards{ 0 };
+  uint64_t discard_bytes{ 0 };
+  uint64_t fsyncs{ 0 };
+  uint64_t hash_bytes{ 0 };
+  uint64_t patch_bytes{ 0 };
+};
+
+// The trace of the command being executed on the current thread, or nullptr if not tracing.
+static thread_local CommandTrace* current_trace = nullptr;
+
+// TraceTimer adds the time spent in its scope to a field of the current command trace, less the
+// time added to the |excluded| field meanwhile (e.g. the writes made while patching). It doesn't
+// read the clock if tracing is disabled.
+class TraceTimer {
+ public:
+  explicit TraceTimer(uint64_t CommandTrace::*field, uint64_t CommandTrace::*excluded = nullptr)
+      : trace_(current_trace), field_(field), excluded_(excluded) {
+    if (trace_ != nullptr) {
+      excluded_start_ = excluded_ != nullptr ? trace_->*excluded_ : 0;
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~TraceTimer() {
+    if (trace_ != nullptr) {
+      uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - start_)
+                             .count();
+      if (excluded_ != nullptr) {
+        elapsed -= std::min(elapsed, trace_->*excluded_ - excluded_start_);
+      }
+      trace_->*field_ += elapsed;
+    }
+  }
+
+ private:
+  CommandTrace* trace_;
+  uint64_t CommandTrace::*field_;
+  uint64_t CommandTrace::*excluded_;
+  uint64_t excluded_start_{ 0 };
+  std::chrono::steady_clock::time_point start_;
+
+  DISALLOW_COPY_AND_ASSIGN(TraceTimer);
+};
 
-static CauseCode failure_type = kNoCause;
-static bool is_retry = false;
-static std::unordered_map<std::string, RangeSet> stash_map;
+// Adds |requests| and |bytes| to the given fields of the current command trace, if tracing.
+static void TraceIo(uint64_t CommandTrace::*requests_field, uint64_t CommandTrace::*bytes_field,
+                    uint64_t requests, uint64_t bytes) {
+  if (current_trace != nullptr) {
+    if (requests_field != nullptr) {
+      current_trace->*requests_field += requests;
+    }
+    current_trace->*bytes_field += bytes;
+  }
+}
 
-static void DeleteLastCommandFile() {
-  const std::string& last_command_file = Paths::Get().last_command_file();
+static void DeleteLastCommandFile(const std::string& last_command_file) {
   if (unlink(last_command_file.c_str()) == -1 && errno != ENOENT) {
     PLOG(ERROR) << "Failed to unlink: " << last_command_file;
   }
 }
 
-// Parse the last command index of the last update and save the result to |last_command_index|.
-// Return true if we successfully read the index.
-static bool ParseLastCommandFile(size_t* last_command_index) {
-  const std::string& last_command_file = Paths::Get().last_command_file();
+// Parse the last command index of the last update in |last_command_file| and save the result to
+// |last_command_index|. The optional third line of the file holds the number of target blocks that
+// the next command had written when the update got interrupted in the middle of it, which is saved
+// to |next_command_blocks| (or 0 if missing). Return true if we successfully read the index.
+static bool ParseLastCommandFile(const std::string& last_command_file, size_t* last_command_index,
+                                 size_t* next_command_blocks) {
   android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(last_command_file.c_str(), O_RDONLY)));
   if (fd == -1) {
     if (errno != ENOENT) {
@@ -111,7 +222,7 @@ static bool ParseLastCommandFile(size_t* last_command_index) {
   }
 
   std::vector<std::string> lines = android::base::Split(android::base::Trim(content), "\n");
-  if (lines.size() != 2) {
+  if (lines.size() != 2 && lines.size() != 3) {
     LOG(ERROR) << "Unexpected line counts in last command file: " << content;
     return false;
   }
@@ -121,6 +232,12 @@ static bool ParseLastCommandFile(size_t* last_command_index) {
     return false;
   }
 
+  *next_command_blocks = 0;
+  if (lines.size() == 3 && !android::base::ParseUint(lines[2], next_command_blocks)) {
+    LOG(ERROR) << "Failed to parse integer in: " << lines[2];
+    return false;
+  }
+
   return true;
 }
 
@@ -139,11 +256,16 @@ static bool FsyncDir(const std::string& dirname) {
   return true;
 }
 
-// Update the last executed command index in the last_command_file.
-static bool UpdateLastCommandIndex(size_t command_index, const std::string& command_string) {
-  const std::string& last_command_file = Paths::Get().last_command_file();
+// Update the last executed command index in |last_command_file|, along with the number of target
+// blocks that the next command has written so far, if any.
+static bool UpdateLastCommandIndex(const std::string& last_command_file, size_t command_index,
+                                   const std::string& command_string,
+                                   size_t next_command_blocks = 0) {
   std::string last_command_tmp = last_command_file + ".tmp";
   std::string content = std::to_string(command_index) + "\n" + command_string;
+  if (next_command_blocks > 0) {
+    content += "\n" + std::to_string(next_command_blocks);
+  }
   android::base::unique_fd wfd(
       TEMP_FAILURE_RETRY(open(last_command_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0660)));
   if (wfd == -1 || !android::base::WriteStringToFd(content, wfd)) {
@@ -226,21 +348,354 @@ static void allocate(size_t size, std::vector<uint8_t>* buffer) {
   buffer->resize(size);
 }
 
+// Merges the ranges that are adjacent on the device, keeping their order. If |extent_index| is not
+// null, it's filled with the index of the extent that covers each of the given ranges.
+static std::vector<Range> CoalesceRanges(const RangeSet& ranges,
+                                         std::vector<size_t>* extent_index = nullptr) {
+  std::vector<Range> extents;
+  for (const auto& range : ranges) {
+    if (!extents.empty() && extents.back().second == range.first) {
+      extents.back().second = range.second;
+    } else {
+      extents.push_back(range);
+    }
+    if (extent_index != nullptr) {
+      extent_index->push_back(extents.size() - 1);
+    }
+  }
+  return extents;
+}
+
+// Discards the given blocks, with one ioctl per extent of adjacent ranges.
+static bool DiscardRanges(int fd, const RangeSet& ranges, bool force = false) {
+  for (const auto& [begin, end] : CoalesceRanges(ranges)) {
+    if (is_retry || force) {
+      TraceIo(&CommandTrace::discards, &CommandTrace::discard_bytes, 1,
+              static_cast<uint64_t>(end - begin) * BLOCKSIZE);
+    }
+    off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
+    if (!discard_blocks(fd, offset, static_cast<uint64_t>(end - begin) * BLOCKSIZE, force)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * DiscardScheduler issues the BLKDISCARD ioctls for the target blocks on a worker thread, so that
+ * discarding the later ranges of a command overlaps with writing the earlier ones. Adjacent ranges
+ * are coalesced into a single ioctl.
+ *
+ * Schedule() returns one ticket per Range of the given RangeSet. A writer must call WaitFor() with
+ * the ticket of a Range before writing to it, otherwise the discard could wipe the written data.
+ * Since the blocks may still be needed as the source of the same command, a command must only
+ * schedule the discard after loading its source blocks.
+ */
+class DiscardScheduler {
+ public:
+  explicit DiscardScheduler(int fd) : fd_(fd) {
+    worker_ = std::thread(&DiscardScheduler::ThreadLoop, this);
+  }
+
+  ~DiscardScheduler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    cv_.notify_all();
+    worker_.join();
+  }
+
+  std::vector<uint64_t> Schedule(const RangeSet& ranges) {
+    std::vector<size_t> extent_index;
+    std::vector<Range> extents = CoalesceRanges(ranges, &extent_index);
+
+    std::vector<uint64_t> tickets;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      uint64_t first = scheduled_ + 1;
+      for (const auto& extent : extents) {
+        pending_.push_back(extent);
+        // Counted on the scheduling thread, which has the trace of the command.
+        TraceIo(&CommandTrace::discards, &CommandTrace::discard_bytes, 1,
+                static_cast<uint64_t>(extent.second - extent.first) * BLOCKSIZE);
+      }
+      scheduled_ += extents.size();
+      for (size_t index : extent_index) {
+        tickets.push_back(first + index);
+      }
+    }
+    cv_.notify_all();
+    return tickets;
+  }
+
+  // Waits until the discard for the given ticket (and all the ones scheduled before it) has been
+  // issued. Returns false if any discard has failed.
+  bool WaitFor(uint64_t ticket) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this, ticket] { return failed_ || completed_ >= ticket; });
+    return !failed_;
+  }
+
+  bool WaitAll() {
+    uint64_t ticket;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ticket = scheduled_;
+    }
+    return WaitFor(ticket);
+  }
+
+ private:
+  void ThreadLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return stopped_ || !pending_.empty(); });
+      if (stopped_) {
+        return;
+      }
+
+      auto [begin, end] = pending_.front();
+      pending_.pop_front();
+      lock.unlock();
+      bool success = discard_blocks(fd_, static_cast<off64_t>(begin) * BLOCKSIZE,
+                                    static_cast<uint64_t>(end - begin) * BLOCKSIZE, true);
+      lock.lock();
+
+      if (!success) {
+        failed_ = true;
+      }
+      completed_++;
+      cv_.notify_all();
+    }
+  }
+
+  int fd_;
+  // The extents waiting to be discarded.
+  std::deque<Range> pending_;
+  // The number of extents that have been scheduled and discarded respectively.
+  uint64_t scheduled_{ 0 };
+  uint64_t completed_{ 0 };
+  bool failed_{ false };
+  bool stopped_{ false };
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread worker_;
+};
+
+// Whether to write the target blocks with O_DIRECT (see DirectWriter), true by default.
+static constexpr const char* kDirectWriteProperty = "ro.updater.direct_write";
+// The default number of direct writes in flight, unless the storage has been profiled (see
+// GetProfiledQueueDepth()), and the most there may be.
+static constexpr size_t kDefaultDirectWriteDepth = 4;
+static constexpr size_t kMaxDirectWriteDepth = 16;
+
+/**
+ * DirectWriter writes the target blocks with O_DIRECT, bypassing the page cache. Through the page
+ * cache, a full OTA leaves gigabytes of dirty pages behind it, and the fsync at the end of the
+ * update stalls for seconds while the writeback catches up. Direct writes reach the device as they
+ * are made instead, and the memory use stays flat.
+ *
+ * The data is copied into a pool of aligned buffers of kBufferSize bytes, which the worker threads
+ * write out, up to one write per buffer in flight. The callers (a command, or each of the threads
+ * of a command) block for a free buffer, so the patching of the next piece overlaps with the
+ * writes of the previous ones. Each caller tracks its writes with a Group, and must Wait() for them
+ * before the target blocks are read back: the reads go through the page cache of the other fd,
+ * which the kernel keeps coherent with a direct write only once the write completes. Every command
+ * waits for its writes before it returns, so the stash reads of the blocks written by the previous
+ * commands, the source prefetcher and the fsync of the checkpoints all see the data on the device.
+ *
+ * The pieces that aren't block aligned, and the writes that the device refuses (EINVAL, e.g. if it
+ * needs a larger alignment), go through the page cache of the other fd, in order.
+ */
+class DirectWriter {
+ public:
+  static constexpr size_t kBufferSize = 1024 * 1024;
+
+  // The writes of one caller.
+  class Group {
+   private:
+    friend class DirectWriter;
+    size_t pending{ 0 };
+    int error{ 0 };
+  };
+
+  // Opens |path| for direct writes, with up to |depth| writes in flight. |fd| is the block device
+  // opened as usual, for the writes that can't be direct. Returns nullptr if O_DIRECT isn't
+  // supported.
+  static std::unique_ptr<DirectWriter> Open(const std::string& path, int fd, size_t depth) {
+    android::base::unique_fd direct_fd(
+        TEMP_FAILURE_RETRY(open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC)));
+    if (direct_fd == -1) {
+      PLOG(WARNING) << "Failed to open " << path << " with O_DIRECT; writing through page cache";
+      return nullptr;
+    }
+    return std::unique_ptr<DirectWriter>(new DirectWriter(std::move(direct_fd), fd, depth));
+  }
+
+  ~DirectWriter() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      // The callers wait for their writes, so there are none left unless the update failed.
+      cv_.wait(lock, [this] { return pending_.empty() && free_.size() == buffers_.size(); });
+      stopped_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Queues the write of |size| bytes at |data| to |offset|, for |group|. Blocks until the data has
+  // been copied into the pool. Returns false, with errno set, if a write of the group has failed.
+  bool Write(Group* group, const uint8_t* data, size_t size, off64_t offset) {
+    if (size % BLOCKSIZE != 0 || offset % BLOCKSIZE != 0) {
+      // Write the piece after the direct writes before it, which may cover the same blocks.
+      if (!Wait(group)) {
+        return false;
+      }
+      return android::base::WriteFullyAtOffset(fd_, data, size, offset);
+    }
+
+    while (size > 0) {
+      size_t chunk = std::min(size, kBufferSize);
+      size_t buffer;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this, group] { return group->error != 0 || !free_.empty(); });
+        if (group->error != 0) {
+          errno = group->error;
+          return false;
+        }
+        buffer = free_.back();
+        free_.pop_back();
+      }
+      memcpy(buffers_[buffer].get(), data, chunk);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.push_back({ group, buffer, chunk, offset });
+        group->pending++;
+      }
+      cv_.notify_all();
+      data += chunk;
+      size -= chunk;
+      offset += chunk;
+    }
+    return true;
+  }
+
+  // Waits until the writes of |group| complete. Returns false, with errno set, if any has failed.
+  bool Wait(Group* group) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [group] { return group->pending == 0; });
+    if (group->error != 0) {
+      errno = group->error;
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  struct Job {
+    Group* group;
+    size_t buffer;
+    size_t size;
+    off64_t offset;
+  };
+
+  struct FreeDeleter {
+    void operator()(uint8_t* buffer) const {
+      free(buffer);
+    }
+  };
+
+  DirectWriter(android::base::unique_fd direct_fd, int fd, size_t depth)
+      : direct_fd_(std::move(direct_fd)), fd_(fd) {
+    depth = std::clamp<size_t>(depth, 1, kMaxDirectWriteDepth);
+    for (size_t i = 0; i < depth; i++) {
+      void* buffer;
+      CHECK_EQ(posix_memalign(&buffer, BLOCKSIZE, kBufferSize), 0);
+      buffers_.emplace_back(static_cast<uint8_t*>(buffer));
+      free_.push_back(i);
+    }
+    for (size_t i = 0; i < depth; i++) {
+      workers_.emplace_back(&DirectWriter::ThreadLoop, this);
+    }
+  }
+
+  void ThreadLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return stopped_ || !pending_.empty(); });
+      if (stopped_) {
+        return;
+      }
+      Job job = pending_.front();
+      pending_.pop_front();
+      lock.unlock();
+      const uint8_t* data = buffers_[job.buffer].get();
+      bool written = android::base::WriteFullyAtOffset(direct_fd_, data, job.size, job.offset);
+      if (!written && errno == EINVAL) {
+        written = android::base::WriteFullyAtOffset(fd_, data, job.size, job.offset);
+      }
+      int error = written ? 0 : errno;
+      lock.lock();
+
+      if (error != 0 && job.group->error == 0) {
+        job.group->error = error;
+      }
+      job.group->pending--;
+      free_.push_back(job.buffer);
+      cv_.notify_all();
+    }
+  }
+
+  android::base::unique_fd direct_fd_;
+  int fd_;
+  std::vector<std::unique_ptr<uint8_t[], FreeDeleter>> buffers_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // The indices of the buffers that aren't in use, and the writes waiting for a worker.
+  std::vector<size_t> free_;
+  std::deque<Job> pending_;
+  bool stopped_{ false };
+  std::vector<std::thread> workers_;
+};
+
 /**
  * RangeSinkWriter reads data from the given FD, and writes them to the destination specified by the
- * given RangeSet.
+ * given RangeSet. As a ZeroCopySink, it lends a buffer of |buffer_size| bytes (rounded up to whole
+ * blocks) to the patchers, and writes it out once it fills up (or on Flush()). BufferedWrite()
+ * copies into the same buffer, for the patchers that produce their output in small pieces. With a
+ * DirectWriter, the writes are direct, and Wait() must be called once all the data is written.
  */
-class RangeSinkWriter {
+class RangeSinkWriter : public ZeroCopySink {
  public:
-  RangeSinkWriter(int fd, const RangeSet& tgt)
+  RangeSinkWriter(int fd, const RangeSet& tgt, DiscardScheduler* discarder = nullptr,
+                  size_t buffer_size = 0, DirectWriter* direct_writer = nullptr)
       : fd_(fd),
         tgt_(tgt),
+        discarder_(discarder),
+        direct_writer_(direct_writer),
+        buffer_size_((buffer_size + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE),
         next_range_(0),
         current_range_left_(0),
         bytes_written_(0) {
     CHECK_NE(tgt.size(), static_cast<size_t>(0));
+    if (discarder_ != nullptr) {
+      discard_tickets_ = discarder_->Schedule(tgt_);
+    }
   };
 
+  ~RangeSinkWriter() {
+    // The direct writes still in flight (after a failure) refer to |write_group_|.
+    if (direct_writer_ != nullptr) {
+      direct_writer_->Wait(&write_group_);
+    }
+  }
+
   bool Finished() const {
     return next_range_ == tgt_.size() && current_range_left_ == 0;
   }
@@ -251,6 +706,85 @@ class RangeSinkWriter {
 
   // Return number of bytes written; and 0 indicates a writing failure.
   size_t Write(const uint8_t* data, size_t size) {
+    if (!Flush()) {
+      return 0;
+    }
+    return WriteOut(data, size);
+  }
+
+  // Same as Write(), but the data goes through the write buffer (if any), so that the writes out
+  // are of whole buffers, block aligned, whatever the size of the pieces. Flush() must be called
+  // after the last piece.
+  size_t BufferedWrite(const uint8_t* data, size_t size) {
+    if (buffer_size_ == 0) {
+      return Write(data, size);
+    }
+    size_t taken = 0;
+    while (taken < size) {
+      size_t space;
+      uint8_t* buffer = GetBuffer(&space);
+      if (buffer == nullptr) {
+        return 0;
+      }
+      size_t copy = std::min(space, size - taken);
+      memcpy(buffer, data + taken, copy);
+      if (!Commit(copy)) {
+        return 0;
+      }
+      taken += copy;
+    }
+    return taken;
+  }
+
+  uint8_t* GetBuffer(size_t* size) override {
+    CHECK_GT(buffer_size_, static_cast<size_t>(0));
+    if (buffered_ == buffer_size_ && !Flush()) {
+      return nullptr;
+    }
+    size_t space = std::min(buffer_size_, AvailableSpace()) - buffered_;
+    if (space == 0) {
+      LOG(ERROR) << "range sink write overrun; can't buffer more data";
+      return nullptr;
+    }
+    if (buffer_.empty()) {
+      buffer_.resize(buffer_size_);
+    }
+    *size = space;
+    return buffer_.data() + buffered_;
+  }
+
+  bool Commit(size_t size) override {
+    buffered_ += size;
+    return buffered_ < buffer_size_ || Flush();
+  }
+
+  // Writes out the data buffered by the zero-copy writes. Returns false on error.
+  bool Flush() {
+    if (buffered_ == 0) {
+      return true;
+    }
+    size_t size = buffered_;
+    buffered_ = 0;
+    return WriteOut(buffer_.data(), size) == size;
+  }
+
+  // Waits for the direct writes to complete, so that the target blocks can be read back. Returns
+  // false if any has failed.
+  bool Wait() {
+    if (direct_writer_ == nullptr || direct_writer_->Wait(&write_group_)) {
+      return true;
+    }
+    failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
+    PLOG(ERROR) << "Failed to write the target blocks";
+    return false;
+  }
+
+  size_t BytesWritten() const {
+    return bytes_written_;
+  }
+
+ private:
+  size_t WriteOut(const uint8_t* data, size_t size) {
     if (Finished()) {
       LOG(ERROR) << "range sink write overrun; can't write " << size << " bytes";
       return 0;
@@ -268,7 +802,12 @@ class RangeSinkWriter {
         write_now = current_range_left_;
       }
 
-      if (!android::base::WriteFully(fd_, data, write_now)) {
+      TraceTimer timer(&CommandTrace::write_us);
+      TraceIo(&CommandTrace::writes, &CommandTrace::write_bytes, 1, write_now);
+      bool ok = direct_writer_ != nullptr
+                    ? direct_writer_->Write(&write_group_, data, write_now, current_offset_)
+                    : android::base::WriteFullyAtOffset(fd_, data, write_now, current_offset_);
+      if (!ok) {
         failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
         PLOG(ERROR) << "Failed to write " << write_now << " bytes of data";
         break;
@@ -277,6 +816,7 @@ class RangeSinkWriter {
       data += write_now;
       size -= write_now;
 
+      current_offset_ += write_now;
       current_range_left_ -= write_now;
       written += write_now;
     }
@@ -285,11 +825,6 @@ class RangeSinkWriter {
     return written;
   }
 
-  size_t BytesWritten() const {
-    return bytes_written_;
-  }
-
- private:
   // Set up the output cursor, move to next range if needed.
   bool SeekToOutputRange() {
     // We haven't finished the current range yet.
@@ -304,15 +839,18 @@ class RangeSinkWriter {
 
     const Range& range = tgt_[next_range_];
     off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
-    current_range_left_ = (range.second - range.first) * BLOCKSIZE;
-    next_range_++;
+    size_t range_size = (range.second - range.first) * BLOCKSIZE;
 
-    if (!discard_blocks(fd_, offset, current_range_left_)) {
-      return false;
-    }
-    if (!check_lseek(fd_, offset, SEEK_SET)) {
+    if (discarder_ != nullptr) {
+      if (!discarder_->WaitFor(discard_tickets_[next_range_])) {
+        return false;
+      }
+    } else if (!discard_blocks(fd_, offset, range_size)) {
       return false;
     }
+    current_range_left_ = range_size;
+    next_range_++;
+    current_offset_ = offset;
     return true;
   }
 
@@ -320,8 +858,21 @@ class RangeSinkWriter {
   int fd_;
   // The destination ranges for the data.
   const RangeSet& tgt_;
+  // The scheduler that discards the destination ranges ahead of the writes, if any.
+  DiscardScheduler* discarder_;
+  // The discard ticket for each of the destination ranges.
+  std::vector<uint64_t> discard_tickets_;
+  // The writer of the direct writes, if any, and the writes of this writer.
+  DirectWriter* direct_writer_;
+  DirectWriter::Group write_group_;
+  // The buffer lent to the zero-copy writes, allocated on first use, and the bytes buffered in it.
+  size_t buffer_size_;
+  std::vector<uint8_t> buffer_;
+  size_t buffered_{ 0 };
   // The next range that we should write to.
   size_t next_range_;
+  // The device offset to write the next bytes to.
+  off64_t current_offset_{ 0 };
   // The number of bytes to write before moving to the next range.
   size_t current_range_left_;
   // Total bytes written by the writer.
@@ -334,195 +885,811 @@ class RangeSinkWriter {
  * of the archive (it's compressed) without writing it to a temp file, but we can't write each
  * section until it's that transfer's turn to go.
  *
- * To achieve this, we expand the new data from the archive in a background thread, and block that
- * threads 'receive uncompressed data' function until the main thread has reached a point where we
- * want some new data to be written. We signal the background thread with the destination for the
- * data and block the main thread, waiting for the background thread to complete writing that
- * section. Then it signals the main thread to wake up and goes back to blocking waiting for a
- * transfer.
+ * To achieve this, we expand the new data from the archive in a background thread into a bounded
+ * ring buffer (NewDataRing). The background thread keeps decompressing while the main thread
+ * executes the commands that don't need new data, until the ring is full. When the main thread
+ * reaches a 'new' command, it drains the required number of bytes from the ring and writes them to
+ * the target blocks.
  *
- * NewThreadInfo is the struct used to pass information back and forth between the two threads. When
- * the main thread wants some data written, it sets writer to the destination location and signals
- * the condition. When the background thread is done writing, it clears writer and signals the
- * condition again.
+ * NewThreadInfo is the struct used to pass information to the background thread.
  */
+
+// The maximum amount of decompressed new data that is buffered ahead of the 'new' commands.
+static constexpr size_t kNewDataRingSize = 4 * 1024 * 1024;
+// The 'new' commands wait for this much data in the ring (or the rest of their data, if less)
+// before writing it, rather than writing the pieces as they're decoded. The ring size and the
+// command boundaries are whole blocks, so the writes stay block aligned.
+static constexpr size_t kNewDataWriteSize = 1024 * 1024;
+
+/**
+ * NewDataRing is a single-producer single-consumer byte ring. The producer and the consumer only
+ * synchronize through the atomic positions when there's space and data available respectively; they
+ * fall back to sleeping on the condition variable when the ring is full or empty.
+ */
+class NewDataRing : public NewDataSink {
+ public:
+  explicit NewDataRing(size_t capacity) : buffer_(capacity) {
+    CHECK_GT(capacity, static_cast<size_t>(0));
+  }
+
+  // Blocks until there is free space in the ring. Returns the start of the contiguous free space
+  // and sets |size| to its length; or returns nullptr if the consumer has closed the ring.
+  uint8_t* AcquireSpace(size_t* size) override {
+    uint64_t head = head_.load();
+    WaitUntil(&producer_waiting_,
+              [this, head] { return consumer_closed_ || head - tail_.load() < buffer_.size(); });
+    if (consumer_closed_) {
+      return nullptr;
+    }
+    size_t offset = head % buffer_.size();
+    *size = std::min<size_t>(buffer_.size() - (head - tail_.load()), buffer_.size() - offset);
+    return buffer_.data() + offset;
+  }
+
+  // Publishes |size| bytes that have been written to the space returned by AcquireSpace().
+  void CommitSpace(size_t size) override {
+    head_ += size;
+    Wake(&consumer_waiting_);
+  }
+
+  // Marks the end of the data. The consumer can still read the remaining data in the ring.
+  void CloseProducer() {
+    producer_closed_ = true;
+    Wake(nullptr);
+  }
+
+  // Blocks until there are |wanted| bytes of contiguous data in the ring (fewer if the data wraps
+  // around the end of the ring before that, or once the producer has closed the ring). Returns the
+  // start of the contiguous data and sets |size| to its length; or returns nullptr if the producer
+  // has closed the ring and all the data has been consumed.
+  const uint8_t* AcquireData(size_t* size, size_t wanted = 1) {
+    uint64_t tail = tail_.load();
+    wanted = std::clamp<size_t>(wanted, 1, buffer_.size() - tail % buffer_.size());
+    WaitUntil(&consumer_waiting_, [this, tail, wanted] {
+      return producer_closed_ || head_.load() - tail >= wanted;
+    });
+    uint64_t head = head_.load();
+    if (head == tail) {
+      return nullptr;
+    }
+    size_t offset = tail % buffer_.size();
+    *size = std::min<size_t>(head - tail, buffer_.size() - offset);
+    return buffer_.data() + offset;
+  }
+
+  // Frees up |size| bytes from the data returned by AcquireData().
+  void ReleaseData(size_t size) {
+    tail_ += size;
+    Wake(&producer_waiting_);
+  }
+
+  // Stops the producer. Any data still in the ring is dropped.
+  void CloseConsumer() {
+    consumer_closed_ = true;
+    Wake(nullptr);
+  }
+
+  bool producer_closed() const {
+    return producer_closed_;
+  }
+
+ private:
+  template <typename Predicate>
+  void WaitUntil(std::atomic<bool>* waiting, Predicate ready) {
+    if (ready()) {
+      return;
+    }
+    // Announce the wait before checking the condition again, so that the other side either sees
+    // the flag and wakes us up, or has published its update before our check.
+    std::unique_lock<std::mutex> lock(mutex_);
+    *waiting = true;
+    cv_.wait(lock, ready);
+    *waiting = false;
+  }
+
+  // Wakes up the other side if it's waiting. A null |waiting| always notifies.
+  void Wake(std::atomic<bool>* waiting) {
+    if (waiting == nullptr || *waiting) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_all();
+    }
+  }
+
+  std::vector<uint8_t> buffer_;
+  // The total number of bytes that have been produced and consumed respectively.
+  std::atomic<uint64_t> head_{ 0 };
+  std::atomic<uint64_t> tail_{ 0 };
+  std::atomic<bool> producer_closed_{ false };
+  std::atomic<bool> consumer_closed_{ false };
+  std::atomic<bool> producer_waiting_{ false };
+  std::atomic<bool> consumer_waiting_{ false };
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+// The maximum number of threads to decode the new data on, for the codecs that can use them.
+static constexpr size_t kMaxNewDataWorkers = 4;
+
 struct NewThreadInfo {
   ZipArchiveHandle za;
   ZipEntry64 entry{};
-  bool brotli_compressed;
-
-  std::unique_ptr<RangeSinkWriter> writer;
-  BrotliDecoderState* brotli_decoder_state;
-  bool receiver_available;
-
-  pthread_mutex_t mu;
-  pthread_cond_t cv;
+  // The name of the new data entry, which picks its decoder.
+  std::string name;
+  size_t decoder_workers{ 1 };
+  // The bytes at the start of the new data, written by the update that got interrupted, that are
+  // dropped rather than written to the ring.
+  uint64_t skip{ 0 };
+
+  std::unique_ptr<NewDataRing> ring;
 };
 
 static bool receive_new_data(const uint8_t* data, size_t size, void* cookie) {
+  // End the new data receiver on errors, or if the main thread has stopped, e.g. when we encounter
+  // an error when performing block image update.
+  return static_cast<NewDataDecoder*>(cookie)->Decode(data, size);
+}
+
+static void* unzip_new_data(void* cookie) {
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
+  auto decoder =
+      CreateNewDataDecoder(nti->name, nti->ring.get(), nti->decoder_workers, nti->skip);
+  if (ProcessZipEntryContents(nti->za, &nti->entry, receive_new_data, decoder.get()) == 0) {
+    decoder->Finish();
+  }
+  decoder.reset();
+  nti->ring->CloseProducer();
+  return nullptr;
+}
 
-  while (size > 0) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the new data receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
+// Source contains packed data, which we want to move to the locations given in locs in the dest
+// buffer. source and dest may be the same buffer.
+static void MoveRange(uint8_t* dest, const RangeSet& locs, const uint8_t* source) {
+  size_t start = locs.blocks();
+  // Must do the movement backward.
+  for (auto it = locs.crbegin(); it != locs.crend(); it++) {
+    size_t blocks = it->second - it->first;
+    start -= blocks;
+    memmove(dest + (it->first * BLOCKSIZE), source + (start * BLOCKSIZE), blocks * BLOCKSIZE);
+  }
+}
+
+// Reads the blocks in src into buffer, packed, or placed at the block positions in locs if given.
+static int ReadBlocks(const RangeSet& src, std::vector<uint8_t>* buffer, int fd,
+                      const RangeSet& locs = RangeSet()) {
+  TraceTimer timer(&CommandTrace::read_us);
+  TraceIo(&CommandTrace::reads, &CommandTrace::read_bytes, src.size(), src.blocks() * BLOCKSIZE);
+  bool read = locs ? ReadBlocksAt(fd, src, BLOCKSIZE, buffer->data(), locs)
+                   : ReadBlocksAt(fd, src, BLOCKSIZE, buffer->data());
+  if (!read) {
+    failure_type = errno == EIO ? kEioFailure : kFreadFailure;
+    PLOG(ERROR) << "Failed to read " << src.blocks() * BLOCKSIZE << " bytes of data";
+    return -1;
+  }
+  return 0;
+}
+
+// Writes the blocks in |buffer| to the target blocks, directly if given a |direct_writer|, and
+// waits for the writes to complete.
+static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer, int fd,
+                       DiscardScheduler* discarder = nullptr,
+                       DirectWriter* direct_writer = nullptr) {
+  TraceTimer timer(&CommandTrace::write_us);
+  if (discarder != nullptr) {
+    discarder->Schedule(tgt);
+    if (!discarder->WaitAll()) {
+      return -1;
+    }
+  } else if (!DiscardRanges(fd, tgt)) {
+    return -1;
+  }
+
+  TraceIo(&CommandTrace::writes, &CommandTrace::write_bytes, tgt.size(), tgt.blocks() * BLOCKSIZE);
+  bool written;
+  if (direct_writer != nullptr) {
+    DirectWriter::Group group;
+    const uint8_t* data = buffer.data();
+    written = true;
+    for (const auto& [begin, end] : tgt) {
+      size_t size = static_cast<size_t>(end - begin) * BLOCKSIZE;
+      if (!direct_writer->Write(&group, data, size, static_cast<off64_t>(begin) * BLOCKSIZE)) {
+        written = false;
+        break;
       }
-      pthread_cond_wait(&nti->cv, &nti->mu);
+      data += size;
     }
-    pthread_mutex_unlock(&nti->mu);
+    // Even after a failure, as the writes in flight refer to |group|.
+    written = direct_writer->Wait(&group) && written;
+  } else {
+    written = WriteBlocksAt(fd, tgt, BLOCKSIZE, buffer.data());
+  }
+  if (!written) {
+    failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
+    PLOG(ERROR) << "Failed to write " << tgt.blocks() * BLOCKSIZE << " bytes of data";
+    return -1;
+  }
 
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-    size_t write_now = std::min(size, nti->writer->AvailableSpace());
-    if (nti->writer->Write(data, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
-      return false;
+  return 0;
+}
+
+/**
+ * SourcePrefetcher reads the source ranges of upcoming commands on a worker thread, so that the
+ * block device is kept busy while the main thread patches and writes the current command.
+ *
+ * The prefetch plan (the command index and source ranges of each move/bsdiff/imgdiff/stash
+ * command) is fixed at construction time. The worker reads ahead of the consumer by at most
+ * kMaxDepth commands (fewer as the device heats up, see ThermalThrottle) and kMaxBufferedBlocks
+ * blocks. The main thread calls Take() when executing a command, which hands over the prefetched
+ * data if available (packed, or placed at the <src_loc> positions of the command), or returns false
+ * to let the caller fall back to a synchronous ReadBlocks().
+ * Once a command has written its target blocks, the main thread calls Invalidate() so that any
+ * buffered data overlapping these blocks won't be used.
+ *
+ * Read errors on the worker thread are not reported; the main thread retries the read itself and
+ * handles the failure as usual.
+ */
+class SourcePrefetcher {
+ public:
+  static constexpr size_t kMaxDepth = 16;
+  static constexpr size_t kMaxBufferedBlocks = 8192;  // 32 MiB
+
+  SourcePrefetcher(int fd, std::vector<std::pair<size_t, RangeSet>> plan) : fd_(fd) {
+    entries_.reserve(plan.size());
+    for (auto& [cmdindex, src] : plan) {
+      entries_.emplace_back(cmdindex, std::move(src));
     }
+    worker_ = std::thread(&SourcePrefetcher::ThreadLoop, this);
+  }
 
-    data += write_now;
-    size -= write_now;
+  ~SourcePrefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    cv_.notify_all();
+    worker_.join();
+  }
+
+  // Copies the prefetched data for the source ranges |src| of command |cmdindex| into |buffer|,
+  // which must be large enough. Returns false if the data isn't available.
+  bool Take(size_t cmdindex, const RangeSet& src, uint8_t* buffer,
+            const RangeSet& locs = RangeSet()) {
+    size_t max_depth = ThermalThrottle::Get().Scale(kMaxDepth);
+    std::unique_lock<std::mutex> lock(mutex_);
+    max_depth_ = max_depth;
+    // Drop the entries for the commands that have been skipped.
+    while (consumed_ < entries_.size() && entries_[consumed_].cmdindex < cmdindex) {
+      Release(&entries_[consumed_++]);
+    }
+    if (consumed_ == entries_.size() || entries_[consumed_].cmdindex != cmdindex ||
+        entries_[consumed_].src != src) {
+      return false;
+    }
 
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
+    Entry& entry = entries_[consumed_++];
+    // Claim the entry if the worker hasn't started on it; waiting for it would be no faster than
+    // reading it on this thread.
+    if (entry.state == Entry::State::PENDING) {
+      entry.state = Entry::State::SKIPPED;
+    }
+    cv_.notify_all();
+    cv_.wait(lock, [&entry] { return entry.state != Entry::State::READING; });
 
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
+    bool result = entry.state == Entry::State::READY && !entry.invalid;
+    if (result) {
+      if (locs) {
+        MoveRange(buffer, locs, entry.data.data());
+      } else {
+        memcpy(buffer, entry.data.data(), entry.data.size());
+      }
+      hits_++;
+    }
+    Release(&entry);
+    cv_.notify_all();
+    return result;
+  }
+
+  // Discards the buffered data that overlaps with the just written blocks in |tgt|. The entries
+  // that haven't been started yet will read the updated blocks.
+  void Invalidate(const RangeSet& tgt) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = consumed_; i < next_; i++) {
+      if (!entries_[i].invalid && entries_[i].src.Overlaps(tgt)) {
+        entries_[i].invalid = true;
+      }
     }
   }
 
-  return true;
-}
+  size_t hits() const {
+    return hits_;
+  }
 
-static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cookie) {
-  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
+ private:
+  struct Entry {
+    enum class State { PENDING, READING, READY, FAILED, SKIPPED };
+
+    Entry(size_t cmdindex, RangeSet src) : cmdindex(cmdindex), src(std::move(src)) {}
+
+    size_t cmdindex;
+    RangeSet src;
+    State state{ State::PENDING };
+    // Whether the source blocks have been overwritten since (or while) they were read.
+    bool invalid{ false };
+    // Whether the consumer has passed the entry while it was being read.
+    bool dropped{ false };
+    std::vector<uint8_t> data;
+  };
 
-  while (size > 0 || BrotliDecoderHasMoreOutput(nti->brotli_decoder_state)) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
+  // Frees the buffer of a consumed entry. If the worker is still reading into it, the buffer will be
+  // freed by the worker once done. Must be called with mutex_ held.
+  void Release(Entry* entry) {
+    if (entry->state == Entry::State::READING) {
+      entry->dropped = true;
+      return;
+    }
+    if (!entry->data.empty()) {
+      buffered_blocks_ -= entry->src.blocks();
+      if (entry->data.capacity() > spare_.capacity()) {
+        spare_.swap(entry->data);
       }
-      pthread_cond_wait(&nti->cv, &nti->mu);
+      std::vector<uint8_t>().swap(entry->data);
     }
-    pthread_mutex_unlock(&nti->mu);
+  }
 
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
+  // Advances next_ to the next entry to be read, and returns whether it can be started within the
+  // depth and memory limits. Must be called with mutex_ held.
+  bool HasWork() {
+    next_ = std::max(next_, consumed_);
+    // Skip over the entries claimed by the consumer, or too large to be buffered at all.
+    while (next_ < entries_.size() && (entries_[next_].state != Entry::State::PENDING ||
+                                       entries_[next_].src.blocks() > kMaxBufferedBlocks)) {
+      next_++;
+    }
+    return next_ < entries_.size() && next_ - consumed_ < max_depth_ &&
+           buffered_blocks_ + entries_[next_].src.blocks() <= kMaxBufferedBlocks;
+  }
 
-    size_t buffer_size = std::min<size_t>(32768, nti->writer->AvailableSpace());
-    if (buffer_size == 0) {
-      LOG(ERROR) << "No space left in output range";
+  void ThreadLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return stopped_ || HasWork(); });
+      if (stopped_) {
+        return;
+      }
+
+      Entry& entry = entries_[next_++];
+      entry.state = Entry::State::READING;
+      buffered_blocks_ += entry.src.blocks();
+      entry.data.swap(spare_);
+      entry.data.resize(entry.src.blocks() * BLOCKSIZE);
+
+      lock.unlock();
+      bool success = ReadAhead(entry.src, entry.data.data());
+      lock.lock();
+
+      entry.state = success ? Entry::State::READY : Entry::State::FAILED;
+      if (entry.dropped) {
+        Release(&entry);
+      }
+      cv_.notify_all();
+    }
+  }
+
+  // Reads the given ranges with positional reads, which don't change the file offset used by the
+  // main thread.
+  bool ReadAhead(const RangeSet& src, uint8_t* data) {
+    if (!ReadBlocksAt(fd_, src, BLOCKSIZE, data)) {
+      PLOG(WARNING) << "Failed to prefetch " << src.blocks() * BLOCKSIZE << " bytes of data";
       return false;
     }
-    uint8_t buffer[buffer_size];
-    size_t available_in = size;
-    size_t available_out = buffer_size;
-    uint8_t* next_out = buffer;
+    return true;
+  }
+
+  // The block device to read from.
+  int fd_;
+  std::vector<Entry> entries_;
+  // The index of the next entry to be consumed by the main thread.
+  size_t consumed_{ 0 };
+  // The index of the next entry to be read by the worker.
+  size_t next_{ 0 };
+  // The number of blocks currently held by the entries.
+  size_t buffered_blocks_{ 0 };
+  // How many commands to read ahead by, up to kMaxDepth.
+  size_t max_depth_{ kMaxDepth };
+  // A released buffer to be reused by the next read.
+  std::vector<uint8_t> spare_;
+  size_t hits_{ 0 };
+  bool stopped_{ false };
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread worker_;
+};
+
+// The default memory budget for the stashes kept in memory, which can be overridden with
+// kStashMemoryBudgetProperty (in MiB). Setting it to 0 saves all the stashes to files.
+static constexpr size_t kDefaultStashMemoryBudget = 64 * 1024 * 1024;
+static constexpr const char* kStashMemoryBudgetProperty = "ro.updater.stash_memory_budget_mb";
+// Whether to compress the stashes kept in memory, true by default.
+static constexpr const char* kCompressMemoryStashProperty = "ro.updater.compress_memory_stash";
+// The maximum number of commands between a stash and its free command, for the stash to be
+// considered for keeping in memory.
+static constexpr size_t kMaxStashReplayWindow = 64;
+
+/**
+ * MemoryStash holds the stashes that can be recreated by resuming the update from their stash
+ * command (see FindReplayableStashes()), within a memory budget. This avoids writing and fsync'ing
+ * the stash files on /cache for the short-lived stashes.
+ *
+ * Unless disabled with kCompressMemoryStashProperty, the stashes are kept LZ4-compressed, and only
+ * the compressed size counts against the budget. Stashed blocks are often zeros or filesystem
+ * metadata that compress well, so more of the stashes fit in memory.
+ */
+class MemoryStash {
+ public:
+  static constexpr size_t kNoLimit = std::numeric_limits<size_t>::max();
 
-    // The brotli decoder will update |data|, |available_in|, |next_out| and |available_out|.
-    BrotliDecoderResult result = BrotliDecoderDecompressStream(
-        nti->brotli_decoder_state, &available_in, &data, &available_out, &next_out, nullptr);
+  MemoryStash(size_t budget, bool compress) : budget_(budget), compress_(compress) {}
 
-    if (result == BROTLI_DECODER_RESULT_ERROR) {
-      LOG(ERROR) << "Decompression failed with "
-                 << BrotliDecoderErrorString(BrotliDecoderGetErrorCode(nti->brotli_decoder_state));
+  // Keeps the first |blocks| blocks of |buffer| as stash |id|. Returns false if that would exceed
+  // the budget. The stashes put with a |limit| (see StashPlan::memory_headroom) must also fit in
+  // that many bytes along with the others put with one.
+  bool Put(const std::string& id, const std::vector<uint8_t>& buffer, size_t blocks,
+           size_t limit = kNoLimit) {
+    size_t size = blocks * BLOCKSIZE;
+    if (stashes_.find(id) != stashes_.end()) {
+      return true;
+    }
+
+    Stash stash{ size, false, false, {} };
+    if (compress_ && size <= static_cast<size_t>(LZ4_MAX_INPUT_SIZE)) {
+      stash.data.resize(LZ4_compressBound(size));
+      int compressed_size = LZ4_compress_default(reinterpret_cast<const char*>(buffer.data()),
+                                                 reinterpret_cast<char*>(stash.data.data()), size,
+                                                 stash.data.size());
+      // Keep the stashes that don't compress as they are.
+      if (compressed_size > 0 && static_cast<size_t>(compressed_size) < size) {
+        stash.data.resize(compressed_size);
+        stash.data.shrink_to_fit();
+        stash.compressed = true;
+      }
+    }
+    if (!stash.compressed) {
+      stash.data.assign(buffer.begin(), buffer.begin() + size);
+    }
+    if (stash.data.size() > budget_ - used_) {
       return false;
     }
+    if (limit != kNoLimit) {
+      if (limited_used_ > limit || stash.data.size() > limit - limited_used_) {
+        return false;
+      }
+      stash.limited = true;
+      limited_used_ += stash.data.size();
+    }
 
-    LOG(DEBUG) << "bytes to write: " << buffer_size - available_out << ", bytes consumed "
-               << size - available_in << ", decoder status " << result;
+    used_ += stash.data.size();
+    raw_bytes_ += size;
+    stored_bytes_ += stash.data.size();
+    stashes_.emplace(id, std::move(stash));
+    return true;
+  }
 
-    size_t write_now = buffer_size - available_out;
-    if (nti->writer->Write(buffer, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
+  // Copies stash |id| into |buffer|, growing it as needed. Returns false if it's not in memory.
+  bool Get(const std::string& id, std::vector<uint8_t>* buffer) const {
+    auto it = stashes_.find(id);
+    if (it == stashes_.end()) {
       return false;
     }
+    const Stash& stash = it->second;
+    allocate(stash.size, buffer);
+    if (!stash.compressed) {
+      std::copy(stash.data.begin(), stash.data.end(), buffer->begin());
+      return true;
+    }
+    int size = LZ4_decompress_safe(reinterpret_cast<const char*>(stash.data.data()),
+                                   reinterpret_cast<char*>(buffer->data()), stash.data.size(),
+                                   stash.size);
+    if (size < 0 || static_cast<size_t>(size) != stash.size) {
+      LOG(ERROR) << "Failed to decompress stash " << id << ": " << size;
+      return false;
+    }
+    return true;
+  }
+
+  void Free(const std::string& id) {
+    auto it = stashes_.find(id);
+    if (it != stashes_.end()) {
+      used_ -= it->second.data.size();
+      if (it->second.limited) {
+        limited_used_ -= it->second.data.size();
+      }
+      stashes_.erase(it);
+    }
+  }
+
+  // The total size of all the stashes put so far, before and after compression.
+  size_t raw_bytes() const {
+    return raw_bytes_;
+  }
+  size_t stored_bytes() const {
+    return stored_bytes_;
+  }
+
+ private:
+  struct Stash {
+    // The size of the stashed blocks.
+    size_t size;
+    bool compressed;
+    // Whether it was put with a limit.
+    bool limited;
+    std::vector<uint8_t> data;
+  };
+
+  size_t budget_;
+  bool compress_;
+  size_t used_{ 0 };
+  size_t limited_used_{ 0 };
+  size_t raw_bytes_{ 0 };
+  size_t stored_bytes_{ 0 };
+  std::unordered_map<std::string, Stash> stashes_;
+};
+
+// The default memory budget for the source blocks kept by block_image_verify() for the update that
+// follows it, which can be overridden with kVerifiedSourceBudgetProperty (in MiB). Setting it to 0
+// has the update read all of its source blocks again.
+static constexpr size_t kDefaultVerifiedSourceBudget = 64 * 1024 * 1024;
+static constexpr const char* kVerifiedSourceBudgetProperty =
+    "ro.updater.verified_source_budget_mb";
+
+// The default size of the SourceBlockCache of a block_image_verify() or block_image_update(), which
+// can be overridden with kSourceBlockCacheProperty (in MiB). Setting it to 0 disables the cache.
+static constexpr size_t kDefaultSourceBlockCacheSize = 16 * 1024 * 1024;
+static constexpr const char* kSourceBlockCacheProperty = "ro.updater.source_block_cache_mb";
+
+// The default size of the InflateCache of a block_image_update(), which can be overridden with
+// kInflateCacheProperty (in MiB). Setting it to 0 disables the cache.
+static constexpr size_t kDefaultInflateCacheSize = 32 * 1024 * 1024;
+static constexpr const char* kInflateCacheProperty = "ro.updater.inflate_cache_mb";
+
+/**
+ * VerifiedSourceCache keeps the source blocks that block_image_verify() has read and verified
+ * against their hashes, so that the block_image_update() of the same partition, which usually
+ * follows right after, takes them from memory instead of reading them from the device again. It
+ * also saves the verify pass the reads of the source ranges that several commands share (e.g. a
+ * stash and the command that uses it).
+ *
+ * The blocks are keyed by the partition (see GetSourceCacheKey()) and the exact source ranges of a
+ * command. Starting another verify of a partition, or finishing its update, drops its blocks. The
+ * update takes each entry once, and drops the ones that its writes overwrite. The oldest entries
+ * are evicted to stay within the budget. The update still checks the hashes of the blocks it
+ * takes, either way. The entries are kept in a list from the oldest one, and indexed by their key
+ * and ranges for the lookups.
+ *
+ * The cache is shared by all the partitions updated by a package, and may be used by the workers
+ * of a command batch. It's thread-safe.
+ */
+class VerifiedSourceCache {
+ public:
+  void SetBudget(size_t budget) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_ = budget;
+    Evict(0);
+  }
+
+  // Drops the blocks of the partition with |key|.
+  void Reset(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      if (it->key == key) {
+        it = Erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
 
-    // Update the remaining size. The input data ptr is already updated by brotli decoder function.
-    size = available_in;
+  // Keeps the blocks |data| read from |src| of the partition with |key|, if they fit in the budget.
+  void Put(const std::string& key, const RangeSet& src, std::vector<uint8_t> data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string index_key = GetIndexKey(key, src);
+    if (data.size() > budget_ || index_.find(index_key) != index_.end()) {
+      return;
+    }
+    Evict(data.size());
+    used_ += data.size();
+    entries_.push_back(Entry{ key, src, index_key, std::move(data) });
+    index_.emplace(std::move(index_key), std::prev(entries_.end()));
+  }
+
+  // Copies the blocks of |src| of the partition with |key| into |buffer|, which must be large
+  // enough, dropping them from the cache if |take|. The blocks are packed, or placed at the block
+  // positions in |locs| if given. Returns false if they aren't cached.
+  bool Get(const std::string& key, const RangeSet& src, uint8_t* buffer, bool take,
+           const RangeSet& locs = RangeSet()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = Find(key, src);
+    if (it == entries_.end()) {
+      return false;
+    }
+    if (locs) {
+      MoveRange(buffer, locs, it->data.data());
+    } else {
+      memcpy(buffer, it->data.data(), it->data.size());
+    }
+    if (take) {
+      Erase(it);
+    }
+    return true;
+  }
 
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
+  bool Contains(const std::string& key, const RangeSet& src) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Find(key, src) != entries_.end();
+  }
 
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
+  // Drops the blocks of the partition with |key| that overlap the just written blocks in |tgt|.
+  void Invalidate(const std::string& key, const RangeSet& tgt) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      if (it->key == key && it->src.Overlaps(tgt)) {
+        it = Erase(it);
+      } else {
+        ++it;
+      }
     }
   }
 
-  return true;
-}
+ private:
+  struct Entry {
+    std::string key;
+    RangeSet src;
+    std::string index_key;  // the key of the entry in |index_|
+    std::vector<uint8_t> data;
+  };
 
-static void* unzip_new_data(void* cookie) {
-  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
-  if (nti->brotli_compressed) {
-    ProcessZipEntryContents(nti->za, &nti->entry, receive_brotli_new_data, nti);
-  } else {
-    ProcessZipEntryContents(nti->za, &nti->entry, receive_new_data, nti);
+  static std::string GetIndexKey(const std::string& key, const RangeSet& src) {
+    return key + " " + src.ToString();
   }
-  pthread_mutex_lock(&nti->mu);
-  nti->receiver_available = false;
-  if (nti->writer != nullptr) {
-    pthread_cond_broadcast(&nti->cv);
+
+  std::list<Entry>::iterator Find(const std::string& key, const RangeSet& src) {
+    auto it = index_.find(GetIndexKey(key, src));
+    return it == index_.end() ? entries_.end() : it->second;
   }
-  pthread_mutex_unlock(&nti->mu);
-  return nullptr;
-}
 
-static int ReadBlocks(const RangeSet& src, std::vector<uint8_t>* buffer, int fd) {
-  size_t p = 0;
-  for (const auto& [begin, end] : src) {
-    if (!check_lseek(fd, static_cast<off64_t>(begin) * BLOCKSIZE, SEEK_SET)) {
-      return -1;
-    }
+  // Drops the entry at |it|, returning the one after it.
+  std::list<Entry>::iterator Erase(std::list<Entry>::iterator it) {
+    used_ -= it->data.size();
+    index_.erase(it->index_key);
+    return entries_.erase(it);
+  }
 
-    size_t size = (end - begin) * BLOCKSIZE;
-    if (!android::base::ReadFully(fd, buffer->data() + p, size)) {
-      failure_type = errno == EIO ? kEioFailure : kFreadFailure;
-      PLOG(ERROR) << "Failed to read " << size << " bytes of data";
-      return -1;
+  // Evicts the oldest entries until |size| more bytes fit in the budget.
+  void Evict(size_t size) {
+    while (!entries_.empty() && used_ + size > budget_) {
+      Erase(entries_.begin());
     }
-
-    p += size;
   }
 
-  return 0;
-}
+  std::mutex mutex_;
+  size_t budget_{ kDefaultVerifiedSourceBudget };
+  size_t used_{ 0 };
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+};
 
-static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer, int fd) {
-  size_t written = 0;
-  for (const auto& [begin, end] : tgt) {
-    off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
-    size_t size = (end - begin) * BLOCKSIZE;
-    if (!discard_blocks(fd, offset, size)) {
-      return -1;
+static VerifiedSourceCache verified_sources;
+
+// Setting kTraceCommandsProperty to true writes the trace of each executed command to
+// Paths::temporary_update_trace_file(), as a CSV line.
+static constexpr const char* kTraceCommandsProperty = "ro.updater.trace_commands";
+
+/**
+ * CommandTraceWriter appends the command traces of a block image update to the trace file. The
+ * file accumulates the traces of all the partitions updated by a package, and starts with a header
+ * line naming the columns.
+ */
+class CommandTraceWriter {
+ public:
+  static std::unique_ptr<CommandTraceWriter> Open(const std::string& path,
+                                                  const std::string& partition) {
+    android::base::unique_fd fd(
+        TEMP_FAILURE_RETRY(open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)));
+    if (fd == -1) {
+      PLOG(WARNING) << "Failed to open " << path;
+      return nullptr;
     }
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && sb.st_size == 0 &&
+        !android::base::WriteStringToFd("partition,index,command,blocks,read_us,patch_us,write_us,"
+                                        "fsync_us,stash_loads,stash_memory_hits,reads,read_bytes,"
+                                        "writes,write_bytes,discards,discard_bytes,fsyncs,"
+                                        "hash_bytes,patch_bytes\n",
+                                        fd)) {
+      PLOG(WARNING) << "Failed to write " << path;
+      return nullptr;
+    }
+    return std::unique_ptr<CommandTraceWriter>(new CommandTraceWriter(std::move(fd), partition));
+  }
+
+  void Write(size_t index, const std::string& command, size_t blocks, const CommandTrace& trace) {
+    std::string line = android::base::StringPrintf(
+        "%s,%zu,%s,%zu,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%zu,%zu,%" PRIu64 ",%" PRIu64
+        ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+        partition_.c_str(), index, command.c_str(), blocks, trace.read_us, trace.patch_us,
+        trace.write_us, trace.fsync_us, trace.stash_loads, trace.stash_memory_hits, trace.reads,
+        trace.read_bytes, trace.writes, trace.write_bytes, trace.discards, trace.discard_bytes,
+        trace.fsyncs, trace.hash_bytes, trace.patch_bytes);
+    if (!android::base::WriteStringToFd(line, fd_)) {
+      PLOG(WARNING) << "Failed to write the command trace";
+    }
+  }
 
-    if (!check_lseek(fd, offset, SEEK_SET)) {
-      return -1;
+ private:
+  CommandTraceWriter(android::base::unique_fd fd, const std::string& partition)
+      : fd_(std::move(fd)), partition_(partition) {}
+
+  android::base::unique_fd fd_;
+  std::string partition_;
+};
+
+// The space on /cache that the block image updates in progress hold for the stash files they have
+// yet to write. The updates of the partitions may run at the same time (in the branches of
+// parallel()), so each one checks for the space that it needs on top of what the others hold,
+// rather than counting on the same free space.
+static std::mutex stash_space_lock;
+static size_t stash_space_claimed = 0;
+
+// The claim of an update. It holds the space claimed, less what the update has since written to
+// stash files (which takes up the space for real), plus what it has freed again.
+class StashSpaceClaim {
+ public:
+  ~StashSpaceClaim() {
+    std::lock_guard<std::mutex> lock(stash_space_lock);
+    stash_space_claimed -= Held();
+  }
+
+  // Checks that |bytes| are free on /cache besides the space held by all the claims, freeing space
+  // if need be, and adds them to the claim. Returns false if there isn't enough space.
+  bool Claim(size_t bytes) {
+    std::lock_guard<std::mutex> lock(stash_space_lock);
+    if (!CheckAndFreeSpaceOnCache(stash_space_claimed + bytes)) {
+      return false;
     }
+    size_t held = Held();
+    claimed_ += bytes;
+    stash_space_claimed += Held() - held;
+    return true;
+  }
 
-    if (!android::base::WriteFully(fd, buffer.data() + written, size)) {
-      failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
-      PLOG(ERROR) << "Failed to write " << size << " bytes of data";
-      return -1;
+  // Notes that the update has written |bytes| to stash files, or freed them.
+  void NoteWritten(size_t bytes) {
+    Adjust(static_cast<int64_t>(bytes));
+  }
+  void NoteFreed(size_t bytes) {
+    Adjust(-static_cast<int64_t>(bytes));
+  }
+
+ private:
+  size_t Held() const {
+    if (written_ <= 0) {
+      return claimed_;
     }
+    return static_cast<size_t>(written_) >= claimed_ ? 0 : claimed_ - written_;
+  }
 
-    written += size;
+  void Adjust(int64_t written) {
+    std::lock_guard<std::mutex> lock(stash_space_lock);
+    size_t held = Held();
+    written_ += written;
+    stash_space_claimed = stash_space_claimed - held + Held();
   }
 
-  return 0;
-}
+  size_t claimed_{ 0 };
+  // The bytes written to stash files less the ones freed. It goes below 0 as the update frees the
+  // stash files left by an interrupted run, which its claim didn't cover.
+  int64_t written_{ 0 };
+};
 
 // Parameters for transfer list command functions
 struct CommandParameters {
@@ -532,6 +1699,9 @@ struct CommandParameters {
     std::string cmdline;
     std::string freestash;
     std::string stashbase;
+    // The last command file of the partition, which is of its own so that the updates of the
+    // partitions can run at the same time (in the branches of parallel()).
+    std::string last_command_file;
     bool canwrite;
     int createdstash;
     android::base::unique_fd fd;
@@ -545,8 +1715,156 @@ struct CommandParameters {
     std::vector<uint8_t> buffer;
     uint8_t* patch_start;
     bool target_verified;  // The target blocks have expected contents already.
+    size_t cmdindex;
+    // The target blocks at the start of the current command that the interrupted update had
+    // written, when resuming in the middle of a new, zero or erase command.
+    size_t resume_blocks;
+    // Those commands save their progress through |save_progress| (if set) every |progress_blocks|
+    // target blocks, so that resuming doesn't start them over.
+    size_t progress_blocks;
+    std::function<void(size_t)> save_progress;
+    std::unique_ptr<SourcePrefetcher> prefetcher;
+    std::unique_ptr<DiscardScheduler> discarder;
+    // Writes the target blocks with O_DIRECT, unless disabled or unsupported.
+    std::unique_ptr<DirectWriter> direct_writer;
+    std::unique_ptr<MemoryStash> memory_stash;
+    // The memory of |memory_stash|, from the MemoryGovernor.
+    std::unique_ptr<MemoryGovernor::Reservation> stash_reservation;
+    // The stash commands whose stashes may be kept in memory, mapped to the last command that uses
+    // the stash.
+    std::map<size_t, size_t> replayable_stashes;
+    // The same, for the stashes that are currently kept in memory and still needed. The last
+    // command index can't be saved past any of these stash commands until they are done.
+    std::map<size_t, size_t> checkpoint_holds;
+    std::unique_ptr<CommandTraceWriter> tracer;
+    // The stash and free commands that only change the reference count of a stash.
+    StashReferences stash_references;
+    // Where the stashes go, in update mode. The space for the stash files was checked up front.
+    StashPlan stash_plan;
+    // The space on /cache claimed for the stash files.
+    StashSpaceClaim stash_space;
+    // The size of the buffer that imgdiff deflate chunks are recompressed into before being written.
+    size_t patch_output_buffer;
+    // The inflated source chunks of the imgdiff commands, shared by the commands of the run.
+    std::unique_ptr<InflateCache> inflate_cache;
+    // The memory of |inflate_cache|, which gives it back when the governor asks. Declared after
+    // the cache, to be released before it's destroyed.
+    std::unique_ptr<MemoryGovernor::Reservation> inflate_cache_reservation;
+    // The key of the partition in verified_sources, or empty if the cache isn't used.
+    std::string source_cache_key;
+    // In verify mode, the source blocks read by the current command (and their data, if
+    // verified_sources is used), to be kept once they pass the hash check.
+    RangeSet unverified_source;
+    std::vector<uint8_t> unverified_source_data;
+    size_t unverified_source_cmdindex;
+    size_t verified_source_hits;
+    // The source blocks that later commands read again, and the plan of which ones to keep.
+    std::unique_ptr<SourceBlockCache> source_blocks;
+    SourceCachePlan source_cache_plan;
+    // In verify mode, the blocks found to have the expected contents so far.
+    std::vector<Range> verified_blocks;
 };
 
+// Reads the source ranges of the current command, using the cached or prefetched data if available.
+// The blocks are packed at the start of buffer, or placed at the block positions in locs (the
+// <src_loc> of the command) if given: straight from the device, the prefetcher or verified_sources,
+// rather than packed and then moved in place.
+static int ReadSourceBlocks(CommandParameters& params, const RangeSet& src,
+                            std::vector<uint8_t>* buffer, const RangeSet& locs = RangeSet()) {
+  if (locs) {
+    // The blocks kept for later commands and for block_image_update() are taken packed.
+    bool keep = params.source_blocks && params.source_cache_plan.keep.count(params.cmdindex) != 0;
+    if (keep || (!params.canwrite && !params.source_cache_key.empty())) {
+      if (ReadSourceBlocks(params, src, buffer) == -1) {
+        return -1;
+      }
+      MoveRange(buffer->data(), locs, buffer->data());
+      return 0;
+    }
+  }
+
+  bool read = false;
+  bool verified = false;
+  if (params.source_blocks) {
+    TraceTimer timer(&CommandTrace::read_us);
+    read = params.source_blocks->Get(src, buffer->data());
+    if (read && locs) {
+      MoveRange(buffer->data(), locs, buffer->data());
+    }
+  }
+  if (!read && !params.source_cache_key.empty()) {
+    TraceTimer timer(&CommandTrace::read_us);
+    if (verified_sources.Get(params.source_cache_key, src, buffer->data(), params.canwrite,
+                             locs)) {
+      params.verified_source_hits++;
+      read = verified = true;
+    }
+  }
+  if (!read && params.prefetcher) {
+    // Waiting for the prefetched data counts as reading it.
+    TraceTimer timer(&CommandTrace::read_us);
+    if (params.prefetcher->Take(params.cmdindex, src, buffer->data(), locs)) {
+      // The prefetcher did the reads, ahead of the command.
+      TraceIo(&CommandTrace::reads, &CommandTrace::read_bytes, src.size(),
+              src.blocks() * BLOCKSIZE);
+      read = true;
+    }
+  }
+  if (!read && ReadBlocks(src, buffer, params.fd, locs) == -1) {
+    return -1;
+  }
+
+  // Keep the blocks that later commands read again.
+  if (params.source_blocks) {
+    if (auto keep = params.source_cache_plan.keep.find(params.cmdindex);
+        keep != params.source_cache_plan.keep.end()) {
+      params.source_blocks->Put(src, keep->second, buffer->data());
+    }
+  }
+
+  // Only the blocks from verified_sources have passed the hash check already.
+  if (!params.canwrite && !verified) {
+    params.unverified_source = src;
+    params.unverified_source_cmdindex = params.cmdindex;
+    params.unverified_source_data.clear();
+    if (!params.source_cache_key.empty()) {
+      params.unverified_source_data.assign(buffer->begin(),
+                                           buffer->begin() + src.blocks() * BLOCKSIZE);
+    }
+  }
+  return 0;
+}
+
+// In verify mode, keeps the source blocks read by the current command for the update (and notes
+// them as verified for block_image_recover()), now that they have passed the hash check.
+static void KeepVerifiedSource(CommandParameters& params) {
+  if (!params.unverified_source || params.unverified_source_cmdindex != params.cmdindex) {
+    return;
+  }
+  params.verified_blocks.insert(params.verified_blocks.end(), params.unverified_source.begin(),
+                                params.unverified_source.end());
+  if (!params.unverified_source_data.empty()) {
+    verified_sources.Put(params.source_cache_key, params.unverified_source,
+                         std::move(params.unverified_source_data));
+  }
+  params.unverified_source = RangeSet();
+  params.unverified_source_data.clear();
+}
+
+// Lets the prefetcher and the source block caches know that the given target blocks have been
+// written.
+static void InvalidatePrefetchedBlocks(CommandParameters& params, const RangeSet& tgt) {
+  if (params.prefetcher) {
+    params.prefetcher->Invalidate(tgt);
+  }
+  if (params.source_blocks) {
+    params.source_blocks->Invalidate(tgt);
+  }
+  if (!params.source_cache_key.empty()) {
+    verified_sources.Invalidate(params.source_cache_key, tgt);
+  }
+}
+
 // Print the hash in hex for corrupted source blocks (excluding the stashed blocks which is
 // handled separately).
 static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
@@ -622,12 +1940,11 @@ static void PrintHashForCorruptedStashedBlocks(const std::string& id,
   LOG(INFO) << "printing hash in hex for stash_id: " << id;
   CHECK_EQ(src.blocks() * BLOCKSIZE, buffer.size());
 
+  std::vector<uint8_t> digests(src.blocks() * SHA_DIGEST_LENGTH);
+  HashBlocks(BlockHashAlgorithm::kSha1, buffer.data(), BLOCKSIZE, src.blocks(), digests.data());
   for (size_t i = 0; i < src.blocks(); i++) {
     size_t block_num = src.GetBlockNumber(i);
-
-    uint8_t digest[SHA_DIGEST_LENGTH];
-    SHA1(buffer.data() + i * BLOCKSIZE, BLOCKSIZE, digest);
-    std::string hexdigest = print_sha1(digest);
+    std::string hexdigest = print_sha1(digests.data() + i * SHA_DIGEST_LENGTH);
     LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hexdigest;
   }
 }
@@ -655,6 +1972,7 @@ static int VerifyBlocks(const std::string& expected, const std::vector<uint8_t>&
   uint8_t digest[SHA_DIGEST_LENGTH];
   const uint8_t* data = buffer.data();
 
+  TraceIo(nullptr, &CommandTrace::hash_bytes, 0, blocks * BLOCKSIZE);
   SHA1(data, blocks * BLOCKSIZE, digest);
 
   std::string hexdigest = print_sha1(digest);
@@ -670,6 +1988,21 @@ static int VerifyBlocks(const std::string& expected, const std::vector<uint8_t>&
   return 0;
 }
 
+// Checks the SHA-1 of the data submitted to |hasher| against |expected|.
+static bool VerifyDigest(const std::string& expected, Sha1Pipeline* hasher, bool printerror) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  hasher->Finish(digest);
+  std::string hexdigest = print_sha1(digest);
+  if (hexdigest != expected) {
+    if (printerror) {
+      LOG(ERROR) << "failed to verify blocks (expected " << expected << ", read " << hexdigest
+                 << ")";
+    }
+    return false;
+  }
+  return true;
+}
+
 static std::string GetStashFileName(const std::string& base, const std::string& id,
                                     const std::string& postfix) {
   if (base.empty()) {
@@ -756,6 +2089,14 @@ static int LoadStash(const CommandParameters& params, const std::string& id, boo
     }
   }
 
+  if (params.memory_stash && params.memory_stash->Get(id, buffer)) {
+    if (current_trace != nullptr) {
+      current_trace->stash_loads++;
+      current_trace->stash_memory_hits++;
+    }
+    return 0;
+  }
+
   std::string fn = GetStashFileName(params.stashbase, id, "");
 
   struct stat sb;
@@ -783,14 +2124,25 @@ static int LoadStash(const CommandParameters& params, const std::string& id, boo
 
   allocate(sb.st_size, buffer);
 
-  if (!android::base::ReadFully(fd, buffer->data(), sb.st_size)) {
-    failure_type = errno == EIO ? kEioFailure : kFreadFailure;
-    PLOG(ERROR) << "Failed to read " << sb.st_size << " bytes of data";
-    return -1;
+  // When verifying, hash the stash file a chunk at a time while reading the rest of it.
+  Sha1Pipeline hasher;
+  for (size_t offset = 0; offset < static_cast<size_t>(sb.st_size);) {
+    size_t size = std::min<size_t>(kStashReadChunkSize, sb.st_size - offset);
+    TraceTimer timer(&CommandTrace::read_us);
+    TraceIo(&CommandTrace::reads, &CommandTrace::read_bytes, 1, size);
+    if (!android::base::ReadFully(fd, buffer->data() + offset, size)) {
+      failure_type = errno == EIO ? kEioFailure : kFreadFailure;
+      PLOG(ERROR) << "Failed to read " << sb.st_size << " bytes of data";
+      return -1;
+    }
+    if (verify) {
+      TraceIo(nullptr, &CommandTrace::hash_bytes, 0, size);
+      hasher.Submit(buffer->data() + offset, size);
+    }
+    offset += size;
   }
 
-  size_t blocks = sb.st_size / BLOCKSIZE;
-  if (verify && VerifyBlocks(id, *buffer, blocks, true) != 0) {
+  if (verify && !VerifyDigest(id, &hasher, true)) {
     LOG(ERROR) << "unexpected contents in " << fn;
     if (stash_map.find(id) == stash_map.end()) {
       LOG(ERROR) << "failed to find source blocks number for stash " << id
@@ -803,16 +2155,22 @@ static int LoadStash(const CommandParameters& params, const std::string& id, boo
     return -1;
   }
 
+  if (current_trace != nullptr) {
+    current_trace->stash_loads++;
+  }
   return 0;
 }
 
+// Writes the stash |id|, noting the space it takes in |space|, after claiming that space first if
+// |checkspace|.
 static int WriteStash(const std::string& base, const std::string& id, int blocks,
-                      const std::vector<uint8_t>& buffer, bool checkspace, bool* exists) {
+                      const std::vector<uint8_t>& buffer, StashSpaceClaim* space, bool checkspace,
+                      bool* exists) {
   if (base.empty()) {
     return -1;
   }
 
-  if (checkspace && !CheckAndFreeSpaceOnCache(blocks * BLOCKSIZE)) {
+  if (checkspace && !space->Claim(blocks * BLOCKSIZE)) {
     LOG(ERROR) << "not enough space to write stash";
     return -1;
   }
@@ -851,22 +2209,34 @@ static int WriteStash(const std::string& base, const std::string& id, int blocks
     return -1;
   }
 
-  if (!android::base::WriteFully(fd, buffer.data(), blocks * BLOCKSIZE)) {
-    failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
-    PLOG(ERROR) << "Failed to write " << blocks * BLOCKSIZE << " bytes of data";
-    return -1;
+  {
+    TraceTimer timer(&CommandTrace::write_us);
+    TraceIo(&CommandTrace::writes, &CommandTrace::write_bytes, 1, blocks * BLOCKSIZE);
+    if (!android::base::WriteFully(fd, buffer.data(), blocks * BLOCKSIZE)) {
+      failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
+      PLOG(ERROR) << "Failed to write " << blocks * BLOCKSIZE << " bytes of data";
+      return -1;
+    }
   }
 
+  // Count the time to commit the stash file as fsync time.
+  TraceTimer timer(&CommandTrace::fsync_us);
+  TraceIo(nullptr, &CommandTrace::fsyncs, 0, 1);
   if (fsync(fd) == -1) {
     failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
     PLOG(ERROR) << "fsync \"" << fn << "\" failed";
     return -1;
   }
 
+  // A stash file with unexpected contents gets replaced.
+  struct stat sb;
+  size_t replaced = stat(cn.c_str(), &sb) == 0 ? static_cast<size_t>(sb.st_size) : 0;
   if (rename(fn.c_str(), cn.c_str()) == -1) {
     PLOG(ERROR) << "rename(\"" << fn << "\", \"" << cn << "\") failed";
     return -1;
   }
+  space->NoteWritten(blocks * BLOCKSIZE);
+  space->NoteFreed(replaced);
 
   std::string dname = GetStashFileName(base, "", "");
   if (!FsyncDir(dname)) {
@@ -877,9 +2247,11 @@ static int WriteStash(const std::string& base, const std::string& id, int blocks
 }
 
 // Creates a directory for storing stash files and checks if the /cache partition
-// hash enough space for the expected amount of blocks we need to store. Returns
+// hash enough space for the expected amount of blocks we need to store (unless
+// maxblocks is 0, for the caller to check after planning the stashes). Returns
 // >0 if we created the directory, zero if it existed already, and <0 of failure.
-static int CreateStash(State* state, size_t maxblocks, const std::string& base) {
+static int CreateStash(State* state, size_t maxblocks, const std::string& base,
+                       StashSpaceClaim* space) {
   std::string dirname = GetStashFileName(base, "", "");
   struct stat sb;
   int res = stat(dirname.c_str(), &sb);
@@ -906,7 +2278,7 @@ static int CreateStash(State* state, size_t maxblocks, const std::string& base)
       return -1;
     }
 
-    if (!CheckAndFreeSpaceOnCache(max_stash_size)) {
+    if (max_stash_size > 0 && !space->Claim(max_stash_size)) {
       ErrorAbort(state, kStashCreationFailure, "not enough space for stash (%zu needed)",
                  max_stash_size);
       return -1;
@@ -938,7 +2310,7 @@ static int CreateStash(State* state, size_t maxblocks, const std::string& base)
 
   if (max_stash_size > existing) {
     size_t needed = max_stash_size - existing;
-    if (!CheckAndFreeSpaceOnCache(needed)) {
+    if (!space->Claim(needed)) {
       ErrorAbort(state, kStashCreationFailure, "not enough space for stash (%zu more needed)",
                  needed);
       return -1;
@@ -948,31 +2320,34 @@ static int CreateStash(State* state, size_t maxblocks, const std::string& base)
   return 0;  // Using existing directory
 }
 
-static int FreeStash(const std::string& base, const std::string& id) {
+// Returns the stash files left over by an interrupted update, mapped to their sizes in blocks.
+static std::map<std::string, size_t> GetExistingStashes(const std::string& base) {
+  std::map<std::string, size_t> result;
+  EnumerateStash(GetStashFileName(base, "", ""), [&result](const std::string& fn) {
+    struct stat sb;
+    if (stat(fn.c_str(), &sb) == 0) {
+      result.emplace(android::base::Basename(fn), (sb.st_size + BLOCKSIZE - 1) / BLOCKSIZE);
+    }
+  });
+  return result;
+}
+
+// Deletes the stash file |id|, noting the space it gave back in |space|.
+static int FreeStash(const std::string& base, const std::string& id, StashSpaceClaim* space) {
   if (base.empty() || id.empty()) {
     return -1;
   }
 
-  DeleteFile(GetStashFileName(base, id, ""));
+  std::string fn = GetStashFileName(base, id, "");
+  struct stat sb;
+  if (stat(fn.c_str(), &sb) == 0) {
+    space->NoteFreed(static_cast<size_t>(sb.st_size));
+  }
+  DeleteFile(fn);
 
   return 0;
 }
 
-// Source contains packed data, which we want to move to the locations given in locs in the dest
-// buffer. source and dest may be the same buffer.
-static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
-                      const std::vector<uint8_t>& source) {
-  const uint8_t* from = source.data();
-  uint8_t* to = dest.data();
-  size_t start = locs.blocks();
-  // Must do the movement backward.
-  for (auto it = locs.crbegin(); it != locs.crend(); it++) {
-    size_t blocks = it->second - it->first;
-    start -= blocks;
-    memmove(to + (it->first * BLOCKSIZE), from + (start * BLOCKSIZE), blocks * BLOCKSIZE);
-  }
-}
-
 /**
  * We expect to parse the remainder of the parameter tokens as one of:
  *
@@ -1013,18 +2388,21 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
     CHECK(static_cast<bool>(src));
     *overlap = src.Overlaps(tgt);
 
-    if (ReadBlocks(src, &params.buffer, params.fd) == -1) {
+    // <src_loc> only comes with stashes, and places the source blocks among them. They are read
+    // in place, without moving them there afterwards.
+    RangeSet locs;
+    if (params.cpos < params.tokens.size()) {
+      locs = RangeSet::Parse(params.tokens[params.cpos++]);
+      CHECK(static_cast<bool>(locs));
+    }
+    if (ReadSourceBlocks(params, src, &params.buffer, locs) == -1) {
       return -1;
     }
 
     if (params.cpos >= params.tokens.size()) {
-      // no stashes, only source range
+      // no more stashes
       return 0;
     }
-
-    RangeSet locs = RangeSet::Parse(params.tokens[params.cpos++]);
-    CHECK(static_cast<bool>(locs));
-    MoveRange(params.buffer, locs, params.buffer);
   }
 
   // <[stash_id:stash_range]>
@@ -1047,7 +2425,7 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
 
     RangeSet locs = RangeSet::Parse(tokens[1]);
     CHECK(static_cast<bool>(locs));
-    MoveRange(params.buffer, locs, stash);
+    MoveRange(params.buffer.data(), locs, stash.data());
   }
 
   return 0;
@@ -1119,6 +2497,9 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet* tgt, size_t*
 
   // Return now if target blocks already have expected content.
   if (VerifyBlocks(tgthash, tgtbuffer, tgt->blocks(), false) == 0) {
+    if (!params.canwrite) {
+      params.verified_blocks.insert(params.verified_blocks.end(), tgt->begin(), tgt->end());
+    }
     return 1;
   }
 
@@ -1135,9 +2516,10 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet* tgt, size_t*
     if (overlap && params.canwrite) {
       LOG(INFO) << "stashing " << *src_blocks << " overlapping blocks to " << srchash;
 
+      // The space for it was checked with the stash plan.
       bool stash_exists = false;
-      if (WriteStash(params.stashbase, srchash, *src_blocks, params.buffer, true,
-                     &stash_exists) != 0) {
+      if (WriteStash(params.stashbase, srchash, *src_blocks, params.buffer, &params.stash_space,
+                     false, &stash_exists) != 0) {
         LOG(ERROR) << "failed to stash overlapping source blocks";
         return -1;
       }
@@ -1150,6 +2532,7 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet* tgt, size_t*
     }
 
     // Source blocks have expected content, command can proceed.
+    KeepVerifiedSource(params);
     return 0;
   }
 
@@ -1192,16 +2575,18 @@ static int PerformCommandMove(CommandParameters& params) {
     if (status == 0) {
       LOG(INFO) << "  moving " << blocks << " blocks";
 
-      if (WriteBlocks(tgt, params.buffer, params.fd) == -1) {
+      if (WriteBlocks(tgt, params.buffer, params.fd, params.discarder.get(),
+                      params.direct_writer.get()) == -1) {
         return -1;
       }
+      InvalidatePrefetchedBlocks(params, tgt);
     } else {
       LOG(INFO) << "skipping " << blocks << " already moved blocks";
     }
   }
 
   if (!params.freestash.empty()) {
-    FreeStash(params.stashbase, params.freestash);
+    FreeStash(params.stashbase, params.freestash, &params.stash_space);
     params.freestash.clear();
   }
 
@@ -1218,6 +2603,12 @@ static int PerformCommandStash(CommandParameters& params) {
   }
 
   const std::string& id = params.tokens[params.cpos++];
+  if (params.stash_references.held_stashes.count(params.cmdindex) != 0) {
+    // An earlier stash command holds the same data, which is still there: nothing to read, stash
+    // or verify again.
+    LOG(INFO) << "stash " << id << " is already held";
+    return 0;
+  }
   if (LoadStash(params, id, true, &params.buffer, false) == 0) {
     // Stash file already exists and has expected contents. Do not read from source again, as the
     // source may have been already overwritten during a previous attempt.
@@ -1229,7 +2620,7 @@ static int PerformCommandStash(CommandParameters& params) {
 
   size_t blocks = src.blocks();
   allocate(blocks * BLOCKSIZE, &params.buffer);
-  if (ReadBlocks(src, &params.buffer, params.fd) == -1) {
+  if (ReadSourceBlocks(params, src, &params.buffer) == -1) {
     return -1;
   }
   stash_map[id] = src;
@@ -1244,11 +2635,30 @@ static int PerformCommandStash(CommandParameters& params) {
 
   // In verify mode, we don't need to stash any blocks.
   if (!params.canwrite) {
+    KeepVerifiedSource(params);
+    return 0;
+  }
+
+  // Keep the stash in memory if it can be recreated when resuming an interrupted update, and the
+  // stash plan has it in memory, or it compresses into the memory left over. Hold back the last
+  // command index until the commands that use it are done.
+  auto replayable = params.replayable_stashes.find(params.cmdindex);
+  bool planned = params.stash_plan.memory_stashes.count(params.cmdindex) != 0;
+  auto headroom = params.stash_plan.memory_headroom.find(params.cmdindex);
+  if (replayable != params.replayable_stashes.end() && params.memory_stash &&
+      (planned || headroom != params.stash_plan.memory_headroom.end()) &&
+      params.memory_stash->Put(id, params.buffer, blocks,
+                               planned ? MemoryStash::kNoLimit : headroom->second * BLOCKSIZE)) {
+    LOG(INFO) << "stashing " << blocks << " blocks to " << id << " in memory";
+    params.checkpoint_holds.emplace(replayable->first, replayable->second);
+    params.stashed += blocks;
     return 0;
   }
 
+  // The space for the stashes that the plan has in files was checked up front.
   LOG(INFO) << "stashing " << blocks << " blocks to " << id;
-  int result = WriteStash(params.stashbase, id, blocks, params.buffer, false, nullptr);
+  int result = WriteStash(params.stashbase, id, blocks, params.buffer, &params.stash_space, planned,
+                          nullptr);
   if (result == 0) {
     params.stashed += blocks;
   }
@@ -1263,15 +2673,82 @@ static int PerformCommandFree(CommandParameters& params) {
   }
 
   const std::string& id = params.tokens[params.cpos++];
+  if (params.stash_references.held_frees.count(params.cmdindex) != 0) {
+    // Another stash command still holds the stash.
+    LOG(INFO) << "keeping stash " << id << " for its other references";
+    return 0;
+  }
   stash_map.erase(id);
+  if (params.memory_stash) {
+    params.memory_stash->Free(id);
+  }
 
   if (params.createdstash || params.canwrite) {
-    return FreeStash(params.stashbase, id);
+    return FreeStash(params.stashbase, id, &params.stash_space);
   }
 
   return 0;
 }
 
+// Writes the target blocks |tgt| of the current new, zero or erase command with |write|, skipping
+// the ones that the interrupted update had written. The blocks go in pieces of
+// params.progress_blocks, and the progress is saved after each piece but the last.
+static bool WriteInPieces(CommandParameters& params, const RangeSet& tgt,
+                          const std::function<bool(const RangeSet&)>& write) {
+  size_t done = params.resume_blocks;
+  if (done > 0) {
+    LOG(INFO) << "  resuming after " << done << " blocks";
+  }
+  size_t piece_blocks = tgt.blocks();
+  if (params.save_progress && params.progress_blocks > 0) {
+    piece_blocks = params.progress_blocks;
+  }
+  while (done < tgt.blocks()) {
+    size_t blocks = std::min(piece_blocks, tgt.blocks() - done);
+    std::optional<RangeSet> piece = tgt.GetSubRanges(done, blocks);
+    CHECK(piece);
+    if (!write(*piece)) {
+      return false;
+    }
+    done += blocks;
+    if (done == tgt.blocks()) {
+      break;
+    }
+
+    // The progress can only be saved once the blocks are on disk.
+    TraceTimer fsync_timer(&CommandTrace::fsync_us);
+    TraceIo(nullptr, &CommandTrace::fsyncs, 0, 1);
+    if (fsync(params.fd) == -1) {
+      failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
+      PLOG(ERROR) << "fsync failed";
+      return false;
+    }
+    params.save_progress(done);
+  }
+  return true;
+}
+
+// Zeroes the given target blocks, discarding them first if needed.
+static bool WriteZeroBlocks(int fd, const RangeSet& tgt, DiscardScheduler* discarder) {
+  TraceTimer timer(&CommandTrace::write_us);
+  if (discarder != nullptr) {
+    discarder->Schedule(tgt);
+    if (!discarder->WaitAll()) {
+      return false;
+    }
+  } else if (!DiscardRanges(fd, tgt)) {
+    return false;
+  }
+
+  TraceIo(&CommandTrace::writes, &CommandTrace::write_bytes, tgt.size(), tgt.blocks() * BLOCKSIZE);
+  if (!ZeroBlocksAt(fd, tgt, BLOCKSIZE)) {
+    failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
+    PLOG(ERROR) << "Failed to write " << tgt.blocks() * BLOCKSIZE << " bytes of zeros";
+    return false;
+  }
+  return true;
+}
+
 static int PerformCommandZero(CommandParameters& params) {
   if (params.cpos >= params.tokens.size()) {
     LOG(ERROR) << "missing target blocks for zero";
@@ -1283,29 +2760,13 @@ static int PerformCommandZero(CommandParameters& params) {
 
   LOG(INFO) << "  zeroing " << tgt.blocks() << " blocks";
 
-  allocate(BLOCKSIZE, &params.buffer);
-  memset(params.buffer.data(), 0, BLOCKSIZE);
-
   if (params.canwrite) {
-    for (const auto& [begin, end] : tgt) {
-      off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
-      size_t size = (end - begin) * BLOCKSIZE;
-      if (!discard_blocks(params.fd, offset, size)) {
-        return -1;
-      }
-
-      if (!check_lseek(params.fd, offset, SEEK_SET)) {
-        return -1;
-      }
-
-      for (size_t j = begin; j < end; ++j) {
-        if (!android::base::WriteFully(params.fd, params.buffer.data(), BLOCKSIZE)) {
-          failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
-          PLOG(ERROR) << "Failed to write " << BLOCKSIZE << " bytes of data";
-          return -1;
-        }
-      }
+    if (!WriteInPieces(params, tgt, [&params](const RangeSet& piece) {
+          return WriteZeroBlocks(params.fd, piece, params.discarder.get());
+        })) {
+      return -1;
     }
+    InvalidatePrefetchedBlocks(params, tgt);
   }
 
   if (params.cmdname[0] == 'z') {
@@ -1317,6 +2778,34 @@ static int PerformCommandZero(CommandParameters& params) {
   return 0;
 }
 
+// Writes the next tgt.blocks() blocks of the new data to |tgt|.
+static bool WriteNewData(CommandParameters& params, const RangeSet& tgt) {
+  RangeSinkWriter writer(params.fd, tgt, params.discarder.get(), 0, params.direct_writer.get());
+  while (!writer.Finished()) {
+    size_t size;
+    const uint8_t* data;
+    {
+      // Waiting for the new data counts as reading it.
+      TraceTimer timer(&CommandTrace::read_us);
+      data = params.nti.ring->AcquireData(
+          &size, std::min(writer.AvailableSpace(), kNewDataWriteSize));
+    }
+    if (data == nullptr) {
+      LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - writer.BytesWritten())
+                 << " bytes of new data";
+      return false;
+    }
+
+    size_t write_now = std::min(size, writer.AvailableSpace());
+    if (writer.Write(data, write_now) != write_now) {
+      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
+      return false;
+    }
+    params.nti.ring->ReleaseData(write_now);
+  }
+  return writer.Wait();
+}
+
 static int PerformCommandNew(CommandParameters& params) {
   if (params.cpos >= params.tokens.size()) {
     LOG(ERROR) << "missing target blocks for new";
@@ -1329,21 +2818,12 @@ static int PerformCommandNew(CommandParameters& params) {
   if (params.canwrite) {
     LOG(INFO) << " writing " << tgt.blocks() << " blocks of new data";
 
-    pthread_mutex_lock(&params.nti.mu);
-    params.nti.writer = std::make_unique<RangeSinkWriter>(params.fd, tgt);
-    pthread_cond_broadcast(&params.nti.cv);
-
-    while (params.nti.writer != nullptr) {
-      if (!params.nti.receiver_available) {
-        LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - params.nti.writer->BytesWritten())
-                   << " bytes of new data";
-        pthread_mutex_unlock(&params.nti.mu);
-        return -1;
-      }
-      pthread_cond_wait(&params.nti.cv, &params.nti.mu);
+    if (!WriteInPieces(params, tgt,
+                       [&params](const RangeSet& piece) { return WriteNewData(params, piece); })) {
+      return -1;
     }
 
-    pthread_mutex_unlock(&params.nti.mu);
+    InvalidatePrefetchedBlocks(params, tgt);
   }
 
   params.written += tgt.blocks();
@@ -1351,6 +2831,226 @@ static int PerformCommandNew(CommandParameters& params) {
   return 0;
 }
 
+// Applies the bsdiff or imgdiff patch to the |src_size| bytes at |src|, and writes the output to the
+// target blocks, which it must fill exactly. Unless |output_buffer_size| is 0, the output goes
+// through a write buffer of that size: the deflate chunks of an imgdiff patch are recompressed
+// straight into it, and the small writes of bspatch are gathered in it. The inflated source chunks
+// of an imgdiff patch are shared through |inflate_cache| if given. With a |direct_writer|, the
+// writes are direct, and complete by the time this returns.
+static bool ApplyPatch(bool imgdiff, const uint8_t* src, size_t src_size, const uint8_t* patch,
+                       size_t len, int fd, const RangeSet& tgt, DiscardScheduler* discarder,
+                       DirectWriter* direct_writer, size_t output_buffer_size,
+                       InflateCache* inflate_cache) {
+  Value patch_value(std::string_view(reinterpret_cast<const char*>(patch), len), nullptr);
+
+  // The patching time excludes the time spent in writing the output.
+  TraceTimer timer(&CommandTrace::patch_us, &CommandTrace::write_us);
+  TraceIo(nullptr, &CommandTrace::patch_bytes, 0, tgt.blocks() * BLOCKSIZE);
+
+  RangeSinkWriter writer(fd, tgt, discarder, output_buffer_size, direct_writer);
+  if (imgdiff) {
+    MemorySourceReader source(src, src_size);
+    if (ApplyImagePatch(source, patch_value,
+                        std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
+                                  std::placeholders::_2),
+                        nullptr, output_buffer_size > 0 ? &writer : nullptr, inflate_cache) != 0 ||
+        !writer.Flush()) {
+      LOG(ERROR) << "Failed to apply image patch.";
+      failure_type = kPatchApplicationFailure;
+      return false;
+    }
+  } else {
+    if (ApplyBSDiffPatch(src, src_size, patch_value, 0,
+                         std::bind(&RangeSinkWriter::BufferedWrite, &writer,
+                                   std::placeholders::_1, std::placeholders::_2)) != 0 ||
+        !writer.Flush()) {
+      LOG(ERROR) << "Failed to apply bsdiff patch.";
+      failure_type = kPatchApplicationFailure;
+      return false;
+    }
+  }
+
+  // We expect the output of the patcher to fill the tgt ranges exactly.
+  if (!writer.Finished()) {
+    LOG(ERROR) << "Failed to fully write target blocks (range sink underrun): Missing "
+               << writer.AvailableSpace() << " bytes";
+    failure_type = kPatchApplicationFailure;
+    return false;
+  }
+  return writer.Wait();
+}
+
+// The magic of a segmented patch (transfer list v5 and up). See commands.h for the format.
+static constexpr std::string_view kSegmentedPatchMagic = "SEGDIFF1";
+static constexpr size_t kSegmentedPatchHeaderSize = kSegmentedPatchMagic.size() + 4;
+static constexpr size_t kPatchSegmentEntrySize = 4 * 4 + 8 * 2;
+
+// The maximum number of threads that apply the segments of a segmented patch.
+static constexpr size_t kMaxPatchSegmentWorkers = 8;
+
+struct PatchSegment {
+  uint64_t src_start;
+  uint64_t src_blocks;
+  uint64_t tgt_start;
+  uint64_t tgt_blocks;
+  uint64_t patch_offset;
+  uint64_t patch_length;
+};
+
+template <typename T>
+static T ReadLittleEndian(const uint8_t* data) {
+  T value = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    value |= static_cast<T>(data[i]) << (8 * i);
+  }
+  return value;
+}
+
+static bool IsSegmentedPatch(const uint8_t* patch, size_t len) {
+  return len >= kSegmentedPatchMagic.size() &&
+         std::string_view(reinterpret_cast<const char*>(patch), kSegmentedPatchMagic.size()) ==
+             kSegmentedPatchMagic;
+}
+
+// Parses the segment table of the segmented patch |patch|, and checks that the source windows lie
+// within the |src_blocks| source blocks, the segment patches within |patch|, and that the target
+// windows cover the |tgt_blocks| target blocks in order.
+static bool ParsePatchSegments(const uint8_t* patch, size_t len, size_t src_blocks,
+                               size_t tgt_blocks, std::vector<PatchSegment>* segments) {
+  if (len < kSegmentedPatchHeaderSize) {
+    LOG(ERROR) << "segmented patch too short: " << len << " bytes";
+    return false;
+  }
+  uint32_t count = ReadLittleEndian<uint32_t>(patch + kSegmentedPatchMagic.size());
+  if (count == 0 || (len - kSegmentedPatchHeaderSize) / kPatchSegmentEntrySize < count) {
+    LOG(ERROR) << "invalid segment count " << count << " for a patch of " << len << " bytes";
+    return false;
+  }
+
+  segments->clear();
+  uint64_t next_tgt_block = 0;
+  const uint8_t* entry = patch + kSegmentedPatchHeaderSize;
+  for (uint32_t i = 0; i < count; i++, entry += kPatchSegmentEntrySize) {
+    PatchSegment segment{
+      ReadLittleEndian<uint32_t>(entry),      ReadLittleEndian<uint32_t>(entry + 4),
+      ReadLittleEndian<uint32_t>(entry + 8),  ReadLittleEndian<uint32_t>(entry + 12),
+      ReadLittleEndian<uint64_t>(entry + 16), ReadLittleEndian<uint64_t>(entry + 24),
+    };
+    if (segment.src_start + segment.src_blocks > src_blocks ||
+        segment.tgt_start != next_tgt_block || segment.tgt_blocks == 0 ||
+        segment.patch_offset > len || segment.patch_length > len - segment.patch_offset) {
+      LOG(ERROR) << "invalid patch segment " << i << ": source " << segment.src_start << "+"
+                 << segment.src_blocks << ", target " << segment.tgt_start << "+"
+                 << segment.tgt_blocks << ", patch " << segment.patch_offset << "+"
+                 << segment.patch_length;
+      return false;
+    }
+    next_tgt_block += segment.tgt_blocks;
+    segments->push_back(segment);
+  }
+  if (next_tgt_block != tgt_blocks) {
+    LOG(ERROR) << "patch segments cover " << next_tgt_block << " of " << tgt_blocks
+               << " target blocks";
+    return false;
+  }
+  return true;
+}
+
+// Adds the counters of |trace| to |total|.
+static void AddTrace(const CommandTrace& trace, CommandTrace* total) {
+  total->read_us += trace.read_us;
+  total->patch_us += trace.patch_us;
+  total->write_us += trace.write_us;
+  total->fsync_us += trace.fsync_us;
+  total->stash_loads += trace.stash_loads;
+  total->stash_memory_hits += trace.stash_memory_hits;
+  total->reads += trace.reads;
+  total->read_bytes += trace.read_bytes;
+  total->writes += trace.writes;
+  total->write_bytes += trace.write_bytes;
+  total->discards += trace.discards;
+  total->discard_bytes += trace.discard_bytes;
+  total->fsyncs += trace.fsyncs;
+  total->hash_bytes += trace.hash_bytes;
+  total->patch_bytes += trace.patch_bytes;
+}
+
+// Applies the segments of the segmented patch |patch| on up to |workers| threads, each segment
+// into its own window of the target blocks. The times in the trace are summed over the segments.
+static bool ApplySegmentedPatch(bool imgdiff, const std::vector<uint8_t>& buffer, size_t src_blocks,
+                                const uint8_t* patch, size_t len, int fd, const RangeSet& tgt,
+                                DiscardScheduler* discarder, DirectWriter* direct_writer,
+                                size_t output_buffer_size, InflateCache* inflate_cache,
+                                size_t workers) {
+  std::vector<PatchSegment> segments;
+  if (!ParsePatchSegments(patch, len, src_blocks, tgt.blocks(), &segments)) {
+    failure_type = kPatchApplicationFailure;
+    return false;
+  }
+  workers = std::clamp<size_t>(workers, 1, segments.size());
+  LOG(INFO) << "  applying " << segments.size() << " patch segments on " << workers << " threads";
+
+  CommandTrace* trace = current_trace;
+  std::vector<CommandTrace> traces(workers);
+  std::vector<CauseCode> failures(workers, kNoCause);
+  std::atomic<size_t> next{ 0 };
+  std::atomic<bool> failed{ false };
+  auto apply_segments = [&](size_t worker) {
+    current_trace = trace != nullptr ? &traces[worker] : nullptr;
+    size_t index;
+    while (!failed && (index = next++) < segments.size()) {
+      const PatchSegment& segment = segments[index];
+      // The target windows were checked to be within the target ranges.
+      RangeSet segment_tgt = *tgt.GetSubRanges(segment.tgt_start, segment.tgt_blocks);
+      if (!ApplyPatch(imgdiff, buffer.data() + segment.src_start * BLOCKSIZE,
+                      segment.src_blocks * BLOCKSIZE, patch + segment.patch_offset,
+                      segment.patch_length, fd, segment_tgt, discarder, direct_writer,
+                      output_buffer_size, inflate_cache)) {
+        LOG(ERROR) << "Failed to apply patch segment " << index;
+        failures[worker] = failure_type;
+        failed = true;
+      }
+    }
+  };
+
+  // The calling thread takes a share of the segments too.
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < workers; i++) {
+    threads.emplace_back(apply_segments, i);
+  }
+  apply_segments(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  current_trace = trace;
+  for (size_t i = 0; i < workers; i++) {
+    if (trace != nullptr) {
+      AddTrace(traces[i], trace);
+    }
+    if (failures[i] != kNoCause) {
+      failure_type = failures[i];
+    }
+  }
+  return !failed;
+}
+
+// Applies the bsdiff or imgdiff patch to the first |src_blocks| blocks in |buffer|, and writes the
+// output to the target blocks. Since v5, the patch may be a segmented patch, whose segments are
+// applied on up to |workers| threads.
+static bool ApplyDiffPatch(bool imgdiff, const std::vector<uint8_t>& buffer, size_t src_blocks,
+                           const uint8_t* patch, size_t len, int fd, const RangeSet& tgt,
+                           DiscardScheduler* discarder, DirectWriter* direct_writer,
+                           size_t output_buffer_size, InflateCache* inflate_cache, int version,
+                           size_t workers) {
+  if (version >= 5 && IsSegmentedPatch(patch, len)) {
+    return ApplySegmentedPatch(imgdiff, buffer, src_blocks, patch, len, fd, tgt, discarder,
+                               direct_writer, output_buffer_size, inflate_cache, workers);
+  }
+  return ApplyPatch(imgdiff, buffer.data(), src_blocks * BLOCKSIZE, patch, len, fd, tgt, discarder,
+                    direct_writer, output_buffer_size, inflate_cache);
+}
+
 static int PerformCommandDiff(CommandParameters& params) {
   // <offset> <length>
   if (params.cpos + 1 >= params.tokens.size()) {
@@ -1391,37 +3091,16 @@ static int PerformCommandDiff(CommandParameters& params) {
   if (params.canwrite) {
     if (status == 0) {
       LOG(INFO) << "patching " << blocks << " blocks to " << tgt.blocks();
-      Value patch_value(
-          Value::Type::BLOB,
-          std::string(reinterpret_cast<const char*>(params.patch_start + offset), len));
-
-      RangeSinkWriter writer(params.fd, tgt);
-      if (params.cmdname[0] == 'i') {  // imgdiff
-        if (ApplyImagePatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value,
-                            std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
-                                      std::placeholders::_2),
-                            nullptr) != 0) {
-          LOG(ERROR) << "Failed to apply image patch.";
-          failure_type = kPatchApplicationFailure;
-          return -1;
-        }
-      } else {
-        if (ApplyBSDiffPatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value, 0,
-                             std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
-                                       std::placeholders::_2)) != 0) {
-          LOG(ERROR) << "Failed to apply bsdiff patch.";
-          failure_type = kPatchApplicationFailure;
-          return -1;
-        }
-      }
-
-      // We expect the output of the patcher to fill the tgt ranges exactly.
-      if (!writer.Finished()) {
-        LOG(ERROR) << "Failed to fully write target blocks (range sink underrun): Missing "
-                   << writer.AvailableSpace() << " bytes";
-        failure_type = kPatchApplicationFailure;
+      size_t workers = ThermalThrottle::Get().Scale(
+          std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxPatchSegmentWorkers));
+      if (!ApplyDiffPatch(params.cmdname[0] == 'i', params.buffer, blocks,
+                          params.patch_start + offset, len, params.fd, tgt,
+                          params.discarder.get(), params.direct_writer.get(),
+                          params.patch_output_buffer, params.inflate_cache.get(), params.version,
+                          workers)) {
         return -1;
       }
+      InvalidatePrefetchedBlocks(params, tgt);
     } else {
       LOG(INFO) << "skipping " << blocks << " blocks already patched to " << tgt.blocks() << " ["
                 << params.cmdline << "]";
@@ -1429,7 +3108,7 @@ static int PerformCommandDiff(CommandParameters& params) {
   }
 
   if (!params.freestash.empty()) {
-    FreeStash(params.stashbase, params.freestash);
+    FreeStash(params.stashbase, params.freestash, &params.stash_space);
     params.freestash.clear();
   }
 
@@ -1465,21 +3144,243 @@ static int PerformCommandErase(CommandParameters& params) {
   if (params.canwrite) {
     LOG(INFO) << " erasing " << tgt.blocks() << " blocks";
 
-    for (const auto& [begin, end] : tgt) {
-      off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
-      size_t size = (end - begin) * BLOCKSIZE;
-      if (!discard_blocks(params.fd, offset, size, true /* force */)) {
-        return -1;
+    if (!WriteInPieces(params, tgt, [&params](const RangeSet& piece) {
+          return DiscardRanges(params.fd, piece, true /* force */);
+        })) {
+      return -1;
+    }
+    InvalidatePrefetchedBlocks(params, tgt);
+  }
+
+  return 0;
+}
+
+static int PerformCommandAbort(CommandParameters&) {
+  LOG(INFO) << "Aborting as instructed";
+  return -1;
+}
+
+// The number of source blocks read at once when computing a hash tree, and the maximum number of
+// threads hashing them.
+static constexpr size_t kHashTreeChunkBlocks = 512;  // 2 MiB
+static constexpr size_t kMaxHashTreeWorkers = 8;
+
+// Writes the digest of each of the |blocks| blocks in |data|, prefixed with the |salt| that has
+// been fed to |salted|, to |output|. The digests are |digest_size| bytes apart. SHA-1 and SHA-256,
+// which verity uses, go through HashBlocks().
+static bool HashSaltedBlocks(const EVP_MD_CTX* salted, const std::vector<unsigned char>& salt,
+                             const uint8_t* data, size_t blocks, size_t digest_size,
+                             uint8_t* output) {
+  const EVP_MD* md = EVP_MD_CTX_md(salted);
+  if (md == EVP_sha256() || md == EVP_sha1()) {
+    HashBlocks(md == EVP_sha256() ? BlockHashAlgorithm::kSha256 : BlockHashAlgorithm::kSha1, data,
+               BLOCKSIZE, blocks, output, salt.data(), salt.size());
+    return true;
+  }
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+  if (!ctx) {
+    return false;
+  }
+  for (size_t i = 0; i < blocks; i++) {
+    if (!EVP_MD_CTX_copy_ex(ctx.get(), salted) ||
+        !EVP_DigestUpdate(ctx.get(), data + i * BLOCKSIZE, BLOCKSIZE) ||
+        !EVP_DigestFinal_ex(ctx.get(), output + i * digest_size, nullptr)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static size_t RoundUpToBlockSize(size_t size) {
+  return (size + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE;
+}
+
+// Computes the verity hash tree of the |source| blocks, in the same format as HashTreeBuilder: the
+// leaf level holds the salted digests of the source blocks, each upper level holds the salted
+// digests of the blocks in the level below it, until a level fits in one block; each level is
+// padded with zeros to BLOCKSIZE. |tree| gets the levels from the top one down, as they're stored
+// on disk.
+//
+// The source blocks are read in large chunks on the calling thread, while up to
+// kMaxHashTreeWorkers threads (fewer on a hot device) hash the chunks already read. The upper
+// levels, 1/128 of the size with SHA-256, are hashed afterwards. Only digests of a power-of-two
+// size are supported, as the others are padded in the tree.
+static bool ComputeHashTree(int fd, const RangeSet& source, const EVP_MD* md,
+                            const std::vector<unsigned char>& salt, std::vector<uint8_t>* tree,
+                            std::vector<unsigned char>* root_hash) {
+  size_t digest_size = EVP_MD_size(md);
+  CHECK_EQ(digest_size & (digest_size - 1), 0U);
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> salted(EVP_MD_CTX_new(),
+                                                                   EVP_MD_CTX_free);
+  if (!salted || !EVP_DigestInit_ex(salted.get(), md, nullptr) ||
+      !EVP_DigestUpdate(salted.get(), salt.data(), salt.size())) {
+    LOG(ERROR) << "Failed to initialize the digest";
+    return false;
+  }
+
+  std::vector<std::vector<uint8_t>> levels;
+  levels.emplace_back(RoundUpToBlockSize(source.blocks() * digest_size));
+  uint8_t* leaves = levels.back().data();
+
+  struct Chunk {
+    size_t first_block;
+    size_t blocks;
+    std::vector<uint8_t> data;
+  };
+  size_t workers = ThermalThrottle::Get().Scale(
+      std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxHashTreeWorkers));
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Chunk> pending;
+  // One more buffer than the workers, so that the next chunk can be read while all of them hash.
+  std::vector<std::vector<uint8_t>> free_buffers(
+      workers + 1, std::vector<uint8_t>(kHashTreeChunkBlocks * BLOCKSIZE));
+  bool done = false;
+  bool hash_failed = false;
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < workers; i++) {
+    threads.emplace_back([&]() {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+        cv.wait(lock, [&]() { return !pending.empty() || done; });
+        if (pending.empty()) {
+          return;
+        }
+        Chunk chunk = std::move(pending.front());
+        pending.pop_front();
+        lock.unlock();
+        bool hashed = HashSaltedBlocks(salted.get(), salt, chunk.data.data(), chunk.blocks,
+                                       digest_size, leaves + chunk.first_block * digest_size);
+        lock.lock();
+        hash_failed |= !hashed;
+        free_buffers.push_back(std::move(chunk.data));
+        cv.notify_all();
+      }
+    });
+  }
+
+  bool read_failed = false;
+  for (size_t first_block = 0; first_block < source.blocks();) {
+    size_t blocks = std::min(kHashTreeChunkBlocks, source.blocks() - first_block);
+    std::vector<uint8_t> buffer;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]() { return !free_buffers.empty() || hash_failed; });
+      if (hash_failed) {
+        break;
       }
+      buffer = std::move(free_buffers.back());
+      free_buffers.pop_back();
+    }
+
+    auto ranges = source.GetSubRanges(first_block, blocks);
+    CHECK(ranges);
+    if (!ReadBlocksAt(fd, *ranges, BLOCKSIZE, buffer.data())) {
+      failure_type = errno == EIO ? kEioFailure : kFreadFailure;
+      PLOG(ERROR) << "Failed to read data in " << ranges->ToString();
+      read_failed = true;
+      break;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending.push_back(Chunk{ first_block, blocks, std::move(buffer) });
     }
+    cv.notify_all();
+    first_block += blocks;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+  }
+  cv.notify_all();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (read_failed) {
+    return false;
+  }
+  if (hash_failed) {
+    LOG(ERROR) << "Failed to hash the source blocks";
+    return false;
+  }
+
+  while (levels.back().size() > BLOCKSIZE) {
+    size_t blocks = levels.back().size() / BLOCKSIZE;
+    std::vector<uint8_t> upper(RoundUpToBlockSize(blocks * digest_size));
+    if (!HashSaltedBlocks(salted.get(), salt, levels.back().data(), blocks, digest_size,
+                          upper.data())) {
+      LOG(ERROR) << "Failed to hash level " << levels.size() << " of the hash tree";
+      return false;
+    }
+    levels.push_back(std::move(upper));
+  }
+
+  root_hash->resize(digest_size);
+  if (!HashSaltedBlocks(salted.get(), salt, levels.back().data(), 1, digest_size,
+                        root_hash->data())) {
+    LOG(ERROR) << "Failed to compute the root hash";
+    return false;
+  }
+
+  tree->clear();
+  for (auto it = levels.crbegin(); it != levels.crend(); it++) {
+    tree->insert(tree->end(), it->begin(), it->end());
+  }
+  return true;
+}
+
+// Computes the hash tree of the |source| blocks with HashTreeBuilder, and writes it at
+// |write_offset| if |canwrite| is set.
+static bool ComputeHashTreeWithBuilder(int fd, const RangeSet& source, const EVP_MD* md,
+                                       const std::vector<unsigned char>& salt,
+                                       const std::string& expected_root_hash, bool canwrite,
+                                       uint64_t write_offset) {
+  HashTreeBuilder builder(BLOCKSIZE, md);
+  if (!builder.Initialize(static_cast<int64_t>(source.blocks()) * BLOCKSIZE, salt)) {
+    LOG(ERROR) << "Failed to initialize hash tree computation, source " << source.ToString();
+    return false;
+  }
+
+  // Iterates through the blocks in the source ranges, a chunk at a time, and updates the hash
+  // tree structure accordingly.
+  std::vector<uint8_t> buffer(std::min(kHashTreeChunkBlocks, source.blocks()) * BLOCKSIZE);
+  for (size_t first_block = 0; first_block < source.blocks();) {
+    size_t blocks = std::min(kHashTreeChunkBlocks, source.blocks() - first_block);
+    auto ranges = source.GetSubRanges(first_block, blocks);
+    CHECK(ranges);
+    if (!ReadBlocksAt(fd, *ranges, BLOCKSIZE, buffer.data())) {
+      failure_type = errno == EIO ? kEioFailure : kFreadFailure;
+      PLOG(ERROR) << "Failed to read data in " << ranges->ToString();
+      return false;
+    }
+
+    if (!builder.Update(reinterpret_cast<unsigned char*>(buffer.data()), blocks * BLOCKSIZE)) {
+      LOG(ERROR) << "Failed to update hash tree builder";
+      return false;
+    }
+    first_block += blocks;
+  }
+
+  if (!builder.BuildHashTree()) {
+    LOG(ERROR) << "Failed to build hash tree";
+    return false;
   }
 
-  return 0;
-}
+  std::string root_hash_hex = HashTreeBuilder::BytesArrayToString(builder.root_hash());
+  if (root_hash_hex != expected_root_hash) {
+    LOG(ERROR) << "Root hash of the verity hash tree doesn't match the expected value. Expected: "
+               << expected_root_hash << ", actual: " << root_hash_hex;
+    return false;
+  }
 
-static int PerformCommandAbort(CommandParameters&) {
-  LOG(INFO) << "Aborting as instructed";
-  return -1;
+  if (canwrite && !builder.WriteHashTreeToFd(fd, write_offset)) {
+    LOG(ERROR) << "Failed to write hash tree to output";
+    return false;
+  }
+  return true;
 }
 
 // Computes the hash_tree bytes based on the parameters, checks if the root hash of the tree
@@ -1528,53 +3429,45 @@ static int PerformCommandComputeHashTree(CommandParameters& params) {
     return -1;
   }
 
-  // Starts the hash_tree computation.
-  HashTreeBuilder builder(BLOCKSIZE, hash_function);
-  if (!builder.Initialize(static_cast<int64_t>(source_ranges.blocks()) * BLOCKSIZE, salt)) {
-    LOG(ERROR) << "Failed to initialize hash tree computation, source " << source_ranges.ToString()
-               << ", salt " << salt_hex;
-    return -1;
-  }
+  uint64_t write_offset = static_cast<uint64_t>(hash_tree_ranges.GetBlockNumber(0)) * BLOCKSIZE;
 
-  // Iterates through every block in the source_ranges and updates the hash tree structure
-  // accordingly.
-  for (const auto& [begin, end] : source_ranges) {
-    uint8_t buffer[BLOCKSIZE];
-    if (!check_lseek(params.fd, static_cast<off64_t>(begin) * BLOCKSIZE, SEEK_SET)) {
-      PLOG(ERROR) << "Failed to seek to block: " << begin;
+  // Computes the hash tree on multiple threads if the digest size allows. Otherwise, or if the root
+  // hash doesn't match (which fails the command unless HashTreeBuilder disagrees), falls back to
+  // HashTreeBuilder.
+  size_t digest_size = EVP_MD_size(hash_function);
+  if (source_ranges.blocks() > 0 && (digest_size & (digest_size - 1)) == 0) {
+    std::vector<uint8_t> tree;
+    std::vector<unsigned char> root_hash;
+    if (!ComputeHashTree(params.fd, source_ranges, hash_function, salt, &tree, &root_hash)) {
       return -1;
     }
 
-    for (size_t i = begin; i < end; i++) {
-      if (!android::base::ReadFully(params.fd, buffer, BLOCKSIZE)) {
-        failure_type = errno == EIO ? kEioFailure : kFreadFailure;
-        LOG(ERROR) << "Failed to read data in " << begin << ":" << end;
-        return -1;
-      }
-
-      if (!builder.Update(reinterpret_cast<unsigned char*>(buffer), BLOCKSIZE)) {
-        LOG(ERROR) << "Failed to update hash tree builder";
-        return -1;
+    std::string root_hash_hex = HashTreeBuilder::BytesArrayToString(root_hash);
+    if (root_hash_hex == expected_root_hash) {
+      if (params.canwrite) {
+        TraceTimer timer(&CommandTrace::write_us);
+        TraceIo(&CommandTrace::writes, &CommandTrace::write_bytes, 1, tree.size());
+        if (!android::base::WriteFullyAtOffset(params.fd, tree.data(), tree.size(),
+                                               write_offset)) {
+          failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
+          PLOG(ERROR) << "Failed to write hash tree to output";
+          return -1;
+        }
+        InvalidatePrefetchedBlocks(params, hash_tree_ranges);
       }
+      return 0;
     }
+    LOG(WARNING) << "Root hash of the verity hash tree doesn't match the expected value. Expected: "
+                 << expected_root_hash << ", actual: " << root_hash_hex
+                 << "; recomputing it with HashTreeBuilder";
   }
 
-  if (!builder.BuildHashTree()) {
-    LOG(ERROR) << "Failed to build hash tree";
-    return -1;
-  }
-
-  std::string root_hash_hex = HashTreeBuilder::BytesArrayToString(builder.root_hash());
-  if (root_hash_hex != expected_root_hash) {
-    LOG(ERROR) << "Root hash of the verity hash tree doesn't match the expected value. Expected: "
-               << expected_root_hash << ", actual: " << root_hash_hex;
+  if (!ComputeHashTreeWithBuilder(params.fd, source_ranges, hash_function, salt,
+                                  expected_root_hash, params.canwrite, write_offset)) {
     return -1;
   }
-
-  uint64_t write_offset = static_cast<uint64_t>(hash_tree_ranges.GetBlockNumber(0)) * BLOCKSIZE;
-  if (params.canwrite && !builder.WriteHashTreeToFd(params.fd, write_offset)) {
-    LOG(ERROR) << "Failed to write hash tree to output";
-    return -1;
+  if (params.canwrite) {
+    InvalidatePrefetchedBlocks(params, hash_tree_ranges);
   }
 
   // TODO(xunchang) validates the written bytes
@@ -1586,6 +3479,153 @@ using CommandFunction = std::function<int(CommandParameters&)>;
 
 using CommandMap = std::unordered_map<Command::Type, CommandFunction>;
 
+// The maximum number of worker threads that run a batch of independent commands, the maximum
+// number of commands in a batch, and the maximum number of source plus target blocks of a batched
+// command (which bounds the memory used by each worker).
+static constexpr size_t kMaxCommandWorkers = 8;
+static constexpr size_t kMaxBatchSize = 64;
+static constexpr size_t kMaxBatchedCommandBlocks = 8192;  // 32 MiB
+
+struct BatchedCommandResult {
+  bool executed{ false };
+  bool success{ false };
+  bool target_verified{ false };
+  bool isunresumable{ false };
+  CauseCode failure{ kNoCause };
+  CommandTrace trace;
+};
+
+// Executes a zero, move, bsdiff or imgdiff command from a batch of independent commands on a worker
+// thread. Such commands don't use stashes, and their source and target blocks don't overlap, so
+// unlike the command functions it only reads from |params|.
+static BatchedCommandResult RunBatchedCommand(const CommandParameters& params,
+                                              const Command& command) {
+  BatchedCommandResult result;
+  result.executed = true;
+  const RangeSet& tgt = command.target().ranges();
+  if (command.type() == Command::Type::ZERO) {
+    LOG(INFO) << "  zeroing " << tgt.blocks() << " blocks";
+    result.success = WriteZeroBlocks(params.fd, tgt, params.discarder.get());
+    return result;
+  }
+
+  // Return now if target blocks already have expected content.
+  std::vector<uint8_t> tgtbuffer(tgt.blocks() * BLOCKSIZE);
+  if (ReadBlocks(tgt, &tgtbuffer, params.fd) == -1) {
+    return result;
+  }
+  if (VerifyBlocks(command.target().hash(), tgtbuffer, tgt.blocks(), false) == 0) {
+    LOG(INFO) << "skipping " << tgt.blocks() << " already written blocks [" << command.cmdline()
+              << "]";
+    result.target_verified = true;
+    result.success = true;
+    return result;
+  }
+
+  const SourceInfo& source = command.source();
+  std::vector<uint8_t> buffer(source.blocks() * BLOCKSIZE);
+  int fd = params.fd;
+  const std::string& cache_key = params.source_cache_key;
+  if (!source.ReadAll(
+          &buffer, BLOCKSIZE,
+          [fd, &cache_key](const RangeSet& src, std::vector<uint8_t>* data) {
+            if (!cache_key.empty() && verified_sources.Get(cache_key, src, data->data(), true)) {
+              return 0;
+            }
+            return ReadBlocks(src, data, fd);
+          },
+          [](const std::string&, std::vector<uint8_t>*) { return -1; })) {
+    LOG(ERROR) << "failed to read source blocks for [" << command.cmdline() << "]";
+    return result;
+  }
+  if (VerifyBlocks(source.hash(), buffer, source.blocks(), true) != 0) {
+    // Valid source data not available, update cannot be resumed.
+    LOG(ERROR) << "partition has unexpected contents";
+    source.DumpBuffer(buffer, BLOCKSIZE);
+    result.isunresumable = true;
+    return result;
+  }
+
+  if (command.type() == Command::Type::MOVE) {
+    LOG(INFO) << "  moving " << source.blocks() << " blocks";
+    result.success =
+        WriteBlocks(tgt, buffer, fd, params.discarder.get(), params.direct_writer.get()) == 0;
+  } else {
+    LOG(INFO) << "patching " << source.blocks() << " blocks to " << tgt.blocks();
+    result.success = ApplyDiffPatch(command.type() == Command::Type::IMGDIFF, buffer,
+                                    source.blocks(), params.patch_start + command.patch().offset(),
+                                    command.patch().length(), fd, tgt, params.discarder.get(),
+                                    params.direct_writer.get(), params.patch_output_buffer,
+                                    params.inflate_cache.get(), params.version, 1);
+  }
+  return result;
+}
+
+// Runs a batch of independent commands on up to |workers| threads. Each worker claims the next
+// command that hasn't been started yet, so the workers that finish early take over the remaining
+// commands. Returns -1 if any of the commands fails. If tracing, the traces of the executed commands
+// are returned in |traces|.
+static int PerformCommandBatch(CommandParameters& params, const std::vector<Command>& batch,
+                               size_t workers, std::vector<CommandTrace>* traces) {
+  workers = std::min(workers, batch.size());
+  LOG(INFO) << "executing " << batch.size() << " independent commands on " << workers
+            << " threads";
+
+  std::vector<BatchedCommandResult> results(batch.size());
+  std::atomic<size_t> next{ 0 };
+  std::atomic<bool> failed{ false };
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < workers; i++) {
+    threads.emplace_back([&params, &batch, &results, &next, &failed]() {
+      size_t index;
+      while (!failed && (index = next++) < batch.size()) {
+        CommandTrace trace;
+        current_trace = params.tracer ? &trace : nullptr;
+        results[index] = RunBatchedCommand(params, batch[index]);
+        results[index].failure = failure_type;
+        results[index].trace = trace;
+        current_trace = nullptr;
+        if (!results[index].success) {
+          failed = true;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (size_t i = 0; i < batch.size(); i++) {
+    const BatchedCommandResult& result = results[i];
+    if (!result.executed) {
+      continue;
+    }
+    if (result.isunresumable) {
+      params.isunresumable = true;
+    }
+    if (!result.success) {
+      LOG(ERROR) << "failed to execute command [" << batch[i].cmdline() << "]";
+      failure_type = result.failure;
+      return -1;
+    }
+
+    const RangeSet& tgt = batch[i].target().ranges();
+    if (result.target_verified) {
+      if (params.foundwrites) {
+        LOG(WARNING) << "warning: commands executed out of order [" << batch[i].cmdline() << "]";
+      }
+    } else {
+      params.foundwrites = true;
+      InvalidatePrefetchedBlocks(params, tgt);
+    }
+    params.written += tgt.blocks();
+    if (traces != nullptr) {
+      traces->push_back(result.trace);
+    }
+  }
+  return 0;
+}
+
 static bool Sha1DevicePath(const std::string& path, uint8_t digest[SHA_DIGEST_LENGTH]) {
   auto device_name = android::base::Basename(path);
   auto dm_target_name_path = "/sys/block/" + device_name + "/dm/name";
@@ -1623,6 +3663,179 @@ static bool Sha1DevicePath(const std::string& path, uint8_t digest[SHA_DIGEST_LE
   return true;
 }
 
+// Collects the source ranges that will be read from the block device by the commands in the
+// transfer list, skipping the commands before |first_cmdindex|. Lines that fail to parse are
+// skipped here, and will be reported when executing the command.
+static std::vector<std::pair<size_t, RangeSet>> CollectSourceRanges(
+    const std::vector<std::string>& lines, size_t header_lines, const CommandMap& command_map,
+    size_t first_cmdindex) {
+  std::vector<std::pair<size_t, RangeSet>> result;
+  for (size_t i = header_lines + first_cmdindex; i < lines.size(); i++) {
+    const std::string& line = lines[i];
+    size_t cmdindex = i - header_lines;
+    std::string cmdname = line.substr(0, line.find(' '));
+    if (cmdname != "move" && cmdname != "bsdiff" && cmdname != "imgdiff" && cmdname != "stash") {
+      continue;
+    }
+    Command::Type cmd_type = Command::ParseType(cmdname);
+    if (command_map.at(cmd_type) == nullptr) {
+      continue;
+    }
+
+    std::string err;
+    Command command = Command::Parse(line, cmdindex, &err);
+    if (!command) {
+      continue;
+    }
+    const RangeSet& src = cmd_type == Command::Type::STASH ? command.stash().ranges()
+                                                           : command.source().ranges();
+    if (src) {
+      result.emplace_back(cmdindex, src);
+    }
+  }
+  return result;
+}
+
+// Parses the commands in the transfer list from |first_cmdindex| onwards, to plan how to execute
+// them. Lines that fail to parse, as well as abort commands, are kept as placeholders that evaluate
+// to false; the errors will be reported when executing the command.
+static std::vector<Command> ParseCommands(const std::vector<std::string>& lines,
+                                          size_t header_lines, size_t first_cmdindex) {
+  std::vector<Command> commands;
+  for (size_t i = header_lines + first_cmdindex; i < lines.size(); i++) {
+    const std::string& line = lines[i];
+    if (line.empty()) continue;
+
+    if (line.substr(0, line.find(' ')) == "abort") {
+      commands.emplace_back();
+      continue;
+    }
+    std::string err;
+    commands.push_back(Command::Parse(line, i - header_lines, &err));
+  }
+  return commands;
+}
+
+// Groups the given commands into batches of independent commands. A batch doesn't extend past the
+// last use of a replayable stash, because resuming from the stash command must not find any later
+// command executed. Only returns the batches that have more than one command.
+static std::vector<std::vector<Command>> CollectCommandBatches(
+    const std::vector<Command>& commands, const std::map<size_t, size_t>& replayable_stashes) {
+  std::unordered_set<size_t> window_ends;
+  for (const auto& [stash_index, last_use] : replayable_stashes) {
+    window_ends.insert(last_use);
+  }
+
+  std::vector<std::vector<Command>> result;
+  for (const auto& [begin, end] :
+       GroupIndependentCommands(commands, kMaxBatchSize, kMaxBatchedCommandBlocks)) {
+    std::vector<Command> batch;
+    for (size_t i = begin; i < end; i++) {
+      batch.push_back(commands[i]);
+      if (i + 1 == end || window_ends.count(commands[i].index()) != 0) {
+        if (batch.size() > 1) {
+          result.push_back(std::move(batch));
+        }
+        batch.clear();
+      }
+    }
+  }
+  return result;
+}
+
+// Returns the key of the partition open at |fd| in verified_sources. Besides the partition (as in
+// |stashbase|), it covers the inode and the mtime of the device, so that an image file (e.g. with
+// the simulator) that is written to or replaced between the verify and the update isn't taken
+// for the one that was verified.
+static std::string GetSourceCacheKey(int fd, const std::string& stashbase) {
+  struct stat sb;
+  if (fstat(fd, &sb) != 0) {
+    PLOG(WARNING) << "Failed to stat the block device, not keeping the verified source blocks";
+    return "";
+  }
+  return android::base::StringPrintf("%s:%ju:%jd.%09ld", stashbase.c_str(),
+                                     static_cast<uintmax_t>(sb.st_ino),
+                                     static_cast<intmax_t>(sb.st_mtim.tv_sec), sb.st_mtim.tv_nsec);
+}
+
+// Returns the value of the given property as an unsigned integer no greater than |max|, or
+// |default_value| if it's unset or invalid.
+static size_t GetSizeProperty(UpdaterInterface* updater, const char* name, size_t default_value,
+                              size_t max = std::numeric_limits<size_t>::max()) {
+  std::string value = updater->GetRuntime()->GetProperty(name, "");
+  if (value.empty()) {
+    return default_value;
+  }
+  size_t parsed;
+  if (!android::base::ParseUint(value, &parsed, max)) {
+    LOG(WARNING) << "Invalid " << name << ": " << value;
+    return default_value;
+  }
+  return parsed;
+}
+
+// By default, the last command file is saved at most every kDefaultCheckpointCommands commands or
+// kDefaultCheckpointIntervalMs milliseconds, which can be overridden with the properties below.
+// Setting either of them to 0 saves it after every command.
+static constexpr size_t kDefaultCheckpointCommands = 64;
+static constexpr size_t kDefaultCheckpointIntervalMs = 2000;
+static constexpr const char* kCheckpointCommandsProperty = "ro.updater.checkpoint_commands";
+static constexpr const char* kCheckpointIntervalMsProperty = "ro.updater.checkpoint_interval_ms";
+
+// The new, zero and erase commands also save their progress every so many MiB of target blocks, so
+// that resuming one of several GiB doesn't start it over. Setting it to 0 only saves the progress
+// between commands.
+static constexpr size_t kDefaultProgressCheckpointMb = 256;
+static constexpr const char* kProgressCheckpointMbProperty = "ro.updater.progress_checkpoint_mb";
+
+// The patched data goes through a write buffer of this many KiB (rounded up to whole blocks), which
+// is written out as it fills up: the imgdiff deflate chunks are recompressed straight into it, and
+// the bsdiff output is copied into it. Setting it to 0 writes each piece of output as it's produced
+// (32 KiB at a time for the deflate chunks, and as little as a few bytes for bsdiff).
+static constexpr size_t kDefaultPatchOutputBufferKb = 1024;
+static constexpr size_t kMaxPatchOutputBufferKb = 64 * 1024;
+static constexpr const char* kPatchOutputBufferProperty = "ro.updater.patch_output_buffer_kb";
+
+/**
+ * CheckpointPolicy decides when to save the progress of an update to the last command file. Each
+ * save costs an fsync of the file and one of its directory, so the checkpoints are group-committed:
+ * a save happens once |max_commands| commands have been executed or |max_interval| has passed since
+ * the previous one, unless the caller forces it.
+ *
+ * Resuming from an older checkpoint replays the commands after it, which is idempotent because the
+ * block device is fsync'ed after each command, in order. A replayed move, bsdiff or imgdiff finds
+ * its target blocks written already (see LoadSrcTgtVersion3()), a stash whose source blocks have
+ * been overwritten is no longer needed (its users have completed), and zero, new and
+ * compute_hash_tree write the same data again. Holding back the checkpoint for the in-memory
+ * stashes only makes it older. The commands that are not known to be safe to replay (erase) force
+ * a save.
+ */
+class CheckpointPolicy {
+ public:
+  CheckpointPolicy(size_t max_commands, std::chrono::milliseconds max_interval)
+      : max_commands_(max_commands),
+        max_interval_(max_interval),
+        last_save_(std::chrono::steady_clock::now()) {}
+
+  // Counts |commands| executed commands, and returns whether to save the current checkpoint now.
+  bool CommandsDone(size_t commands, bool force) {
+    commands_ += commands;
+    return force || commands_ >= max_commands_ ||
+           std::chrono::steady_clock::now() - last_save_ >= max_interval_;
+  }
+
+  void Saved() {
+    commands_ = 0;
+    last_save_ = std::chrono::steady_clock::now();
+  }
+
+ private:
+  size_t max_commands_;
+  std::chrono::milliseconds max_interval_;
+  size_t commands_{ 0 };
+  std::chrono::steady_clock::time_point last_save_;
+};
+
 static Value* PerformBlockImageUpdate(const char* name, State* state,
                                       const std::vector<std::unique_ptr<Expr>>& argv,
                                       const CommandMap& command_map, bool dryrun) {
@@ -1674,9 +3887,9 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   }
 
   auto updater = state->updater;
-  auto block_device_path = updater->FindBlockDeviceName(blockdev_filename->data);
+  auto block_device_path = updater->FindBlockDeviceName(blockdev_filename->data());
   if (block_device_path.empty()) {
-    LOG(ERROR) << "Block device path for " << blockdev_filename->data << " not found. " << name
+    LOG(ERROR) << "Block device path for " << blockdev_filename->data() << " not found. " << name
                << " failed.";
     return StringValue("");
   }
@@ -1686,18 +3899,18 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("");
   }
 
-  std::string_view path_data(patch_data_fn->data);
+  std::string_view path_data(patch_data_fn->data());
   ZipEntry64 patch_entry;
   if (FindEntry(za, path_data, &patch_entry) != 0) {
-    LOG(ERROR) << name << "(): no file \"" << patch_data_fn->data << "\" in package";
+    LOG(ERROR) << name << "(): no file \"" << patch_data_fn->data() << "\" in package";
     return StringValue("");
   }
   params.patch_start = updater->GetMappedPackageAddress() + patch_entry.offset;
 
-  std::string_view new_data(new_data_fn->data);
+  std::string_view new_data(new_data_fn->data());
   ZipEntry64 new_entry;
   if (FindEntry(za, new_data, &new_entry) != 0) {
-    LOG(ERROR) << name << "(): no file \"" << new_data_fn->data << "\" in package";
+    LOG(ERROR) << name << "(): no file \"" << new_data_fn->data() << "\" in package";
     return StringValue("");
   }
 
@@ -1713,6 +3926,11 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("");
   }
   params.stashbase = print_sha1(digest);
+  params.last_command_file = Paths::Get().last_command_file() + "." + params.stashbase;
+  {
+    std::lock_guard<std::mutex> lock(verified_blocks_lock);
+    verified_blocks.erase(params.stashbase);
+  }
 
   // Possibly do return early on retry, by checking the marker. If the update on this partition has
   // been finished (but interrupted at a later point), there could be leftover on /cache that would
@@ -1735,7 +3953,8 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   }
 
   static constexpr size_t kTransferListHeaderLines = 4;
-  std::vector<std::string> lines = android::base::Split(transfer_list_value->data, "\n");
+  std::vector<std::string> lines =
+      android::base::Split(std::string(transfer_list_value->data()), "\n");
   if (lines.size() < kTransferListHeaderLines) {
     ErrorAbort(state, kArgsParsingFailure, "too few lines in the transfer list [%zu]",
                lines.size());
@@ -1743,7 +3962,7 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   }
 
   // First line in transfer list is the version number.
-  if (!android::base::ParseInt(lines[0], &params.version, 3, 4)) {
+  if (!android::base::ParseInt(lines[0], &params.version, 3, 5)) {
     LOG(ERROR) << "unexpected transfer list version [" << lines[0] << "]";
     return StringValue("");
   }
@@ -1772,25 +3991,195 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("");
   }
 
-  int res = CreateStash(state, stash_max_blocks, params.stashbase);
+  // The update checks the space for the stashes once it has planned them.
+  int res = CreateStash(state, params.canwrite ? 0 : stash_max_blocks, params.stashbase,
+                        &params.stash_space);
   if (res == -1) {
     return StringValue("");
   }
   params.createdstash = res;
 
+  // When performing an update, save the index and cmdline of the current command into the
+  // last_command_file of the partition.
+  // Upon resuming an update, read the saved index first; then
+  //   1. In verification mode, check if the 'move' or 'diff' commands before the saved index has
+  //      the expected target blocks already. If not, these commands cannot be skipped and we need
+  //      to attempt to execute them again. Therefore, we will delete the last_command_file so that
+  //      the update will resume from the start of the transfer list.
+  //   2. In update mode, skip all commands before the saved index. Therefore, we can avoid deleting
+  //      stashes with duplicate id unintentionally (b/69858743); and also speed up the update.
+  // If an update succeeds or is unresumable, delete the last_command_file.
+  // If the update got interrupted in the middle of the command after the saved index, it resumes
+  // from the saved number of target blocks into that command.
+  bool skip_executed_command = true;
+  size_t saved_last_command_index;
+  size_t saved_command_blocks = 0;
+  if (!ParseLastCommandFile(params.last_command_file, &saved_last_command_index,
+                            &saved_command_blocks)) {
+    DeleteLastCommandFile(params.last_command_file);
+    // We failed to parse the last command. Disallow skipping executed commands.
+    skip_executed_command = false;
+    saved_command_blocks = 0;
+  }
+
+  // Set up the cache of verified source blocks: a verify starts it afresh, and the update that
+  // follows takes the blocks from it.
+  size_t verified_source_budget =
+      GetSizeProperty(updater, kVerifiedSourceBudgetProperty, kDefaultVerifiedSourceBudget >> 20,
+                      std::numeric_limits<size_t>::max() >> 20)
+      << 20;
+  verified_sources.SetBudget(verified_source_budget);
+  if (verified_source_budget > 0) {
+    params.source_cache_key = GetSourceCacheKey(params.fd, params.stashbase);
+  }
+  if (!params.canwrite && !params.source_cache_key.empty()) {
+    verified_sources.Reset(params.source_cache_key);
+  }
+
+  // Start reading the source blocks ahead of the commands that need them.
+  size_t first_cmdindex =
+      (params.canwrite && skip_executed_command) ? saved_last_command_index + 1 : 0;
+  auto source_ranges =
+      CollectSourceRanges(lines, kTransferListHeaderLines, command_map, first_cmdindex);
+
+  size_t command_workers = GetProfiledQueueDepth(
+      std::min<size_t>(std::thread::hardware_concurrency(), kMaxCommandWorkers), kMaxCommandWorkers);
+  std::vector<std::vector<Command>> batches;
+  // The reference counts of the stashes are taken over the whole transfer list, so that they also
+  // hold when resuming.
+  std::vector<Command> commands = ParseCommands(lines, kTransferListHeaderLines, 0);
+  params.stash_references = CountStashReferences(commands);
+  std::set<size_t> batched;
+  // The new data written by the commands that are skipped on resume, which the decoder drops.
+  uint64_t new_data_skip = 0;
+  if (params.canwrite) {
+    if (first_cmdindex > 0) {
+      for (const auto& command : commands) {
+        if (command.index() > first_cmdindex) {
+          break;
+        }
+        size_t blocks = command.target().ranges().blocks();
+        if (command.index() == first_cmdindex) {
+          bool resumable = command.type() == Command::Type::NEW ||
+                           command.type() == Command::Type::ZERO ||
+                           command.type() == Command::Type::ERASE;
+          if (saved_command_blocks > 0 && (!resumable || saved_command_blocks >= blocks)) {
+            LOG(WARNING) << "Ignoring the progress of " << saved_command_blocks
+                         << " blocks into command " << first_cmdindex;
+            saved_command_blocks = 0;
+          }
+          blocks = saved_command_blocks;
+        }
+        if (command.type() == Command::Type::NEW) {
+          new_data_skip += static_cast<uint64_t>(blocks) * BLOCKSIZE;
+        }
+      }
+      commands = ParseCommands(lines, kTransferListHeaderLines, first_cmdindex);
+    } else {
+      saved_command_blocks = 0;
+    }
+
+    // Keep the stashes that can be recreated on resume in memory, up to the budget.
+    size_t stash_memory_budget =
+        GetSizeProperty(updater, kStashMemoryBudgetProperty, kDefaultStashMemoryBudget >> 20,
+                        std::numeric_limits<size_t>::max() >> 20)
+        << 20;
+    // The budget shrinks to what the device can spare, taking it from the caches (of recovery as
+    // of the updater) if need be. What doesn't fit goes to the stash files instead.
+    if (stash_memory_budget > 0) {
+      params.stash_reservation = MemoryGovernor::Get().Reserve(
+          "memory stash", MemoryPriority::kRequired, 0, stash_memory_budget);
+      stash_memory_budget = params.stash_reservation ? params.stash_reservation->bytes() : 0;
+    }
+    if (stash_memory_budget > 0) {
+      bool compress =
+          android::base::ParseBool(updater->GetRuntime()->GetProperty(
+              kCompressMemoryStashProperty, "")) != android::base::ParseBoolResult::kFalse;
+      params.memory_stash = std::make_unique<MemoryStash>(stash_memory_budget, compress);
+      params.replayable_stashes = FindReplayableStashes(commands, kMaxStashReplayWindow);
+    }
+
+    // Plan where the stashes go, and check the space for the stash files at their peak up front,
+    // rather than as they get written. The files left by an interrupted update take their share.
+    auto existing_stashes = GetExistingStashes(params.stashbase);
+    params.stash_plan = PlanStashes(commands, params.stash_references, params.replayable_stashes,
+                                    stash_memory_budget / BLOCKSIZE, existing_stashes);
+    size_t existing_blocks = 0;
+    for (const auto& [id, blocks] : existing_stashes) {
+      existing_blocks += blocks;
+    }
+    LOG(INFO) << "planned " << params.stash_plan.memory_stashes.size()
+              << " stashes in memory; stash files peak at " << params.stash_plan.peak_blocks
+              << " blocks at command " << params.stash_plan.peak_index;
+    if (params.stash_plan.peak_blocks > existing_blocks) {
+      size_t needed = (params.stash_plan.peak_blocks - existing_blocks) * BLOCKSIZE;
+      if (!params.stash_space.Claim(needed)) {
+        ErrorAbort(state, kStashCreationFailure, "not enough space for stash (%zu more needed)",
+                   needed);
+        return StringValue("");
+      }
+    }
+
+    // Run the batches of independent commands on multiple threads. Those commands read their own
+    // source blocks, so leave them out of the prefetching.
+    if (command_workers > 1) {
+      batches = CollectCommandBatches(commands, params.replayable_stashes);
+    }
+    for (const auto& batch : batches) {
+      for (const auto& command : batch) {
+        batched.insert(command.index());
+      }
+    }
+    source_ranges.erase(std::remove_if(source_ranges.begin(), source_ranges.end(),
+                                       [&batched](const auto& entry) {
+                                         return batched.count(entry.first) != 0;
+                                       }),
+                        source_ranges.end());
+
+    // Nor do the commands need to read the source blocks kept by the verify.
+    if (!params.source_cache_key.empty()) {
+      source_ranges.erase(std::remove_if(source_ranges.begin(), source_ranges.end(),
+                                         [&params](const auto& entry) {
+                                           return verified_sources.Contains(
+                                               params.source_cache_key, entry.second);
+                                         }),
+                          source_ranges.end());
+    }
+  }
+
+  // Keep the source blocks that later commands read again in memory, so that they read them from
+  // there. Those commands don't need their source blocks prefetched either.
+  size_t source_block_cache_size =
+      GetSizeProperty(updater, kSourceBlockCacheProperty, kDefaultSourceBlockCacheSize >> 20,
+                      std::numeric_limits<size_t>::max() >> 20)
+      << 20;
+  if (source_block_cache_size >= BLOCKSIZE) {
+    size_t capacity = source_block_cache_size / BLOCKSIZE;
+    params.source_cache_plan = PlanSourceCache(commands, capacity, batched);
+    if (!params.source_cache_plan.keep.empty()) {
+      params.source_blocks = std::make_unique<SourceBlockCache>(capacity, BLOCKSIZE);
+      source_ranges.erase(std::remove_if(source_ranges.begin(), source_ranges.end(),
+                                         [&params](const auto& entry) {
+                                           return params.source_cache_plan.hits.count(
+                                                      entry.first) != 0;
+                                         }),
+                          source_ranges.end());
+    }
+  }
+
   // Set up the new data writer.
   if (params.canwrite) {
     params.nti.za = za;
     params.nti.entry = new_entry;
-    params.nti.brotli_compressed = android::base::EndsWith(new_data_fn->data, ".br");
-    if (params.nti.brotli_compressed) {
-      // Initialize brotli decoder state.
-      params.nti.brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+    params.nti.name = new_data_fn->data();
+    params.nti.decoder_workers = ThermalThrottle::Get().Scale(
+        std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxNewDataWorkers));
+    params.nti.ring = std::make_unique<NewDataRing>(kNewDataRingSize);
+    params.nti.skip = new_data_skip;
+    if (new_data_skip > 0) {
+      LOG(INFO) << "skipping " << new_data_skip << " bytes of new data written before";
     }
-    params.nti.receiver_available = true;
 
-    pthread_mutex_init(&params.nti.mu, nullptr);
-    pthread_cond_init(&params.nti.cv, nullptr);
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
@@ -1802,22 +4191,97 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     }
   }
 
-  // When performing an update, save the index and cmdline of the current command into the
-  // last_command_file.
-  // Upon resuming an update, read the saved index first; then
-  //   1. In verification mode, check if the 'move' or 'diff' commands before the saved index has
-  //      the expected target blocks already. If not, these commands cannot be skipped and we need
-  //      to attempt to execute them again. Therefore, we will delete the last_command_file so that
-  //      the update will resume from the start of the transfer list.
-  //   2. In update mode, skip all commands before the saved index. Therefore, we can avoid deleting
-  //      stashes with duplicate id unintentionally (b/69858743); and also speed up the update.
-  // If an update succeeds or is unresumable, delete the last_command_file.
-  bool skip_executed_command = true;
-  size_t saved_last_command_index;
-  if (!ParseLastCommandFile(&saved_last_command_index)) {
-    DeleteLastCommandFile();
-    // We failed to parse the last command. Disallow skipping executed commands.
-    skip_executed_command = false;
+  size_t next_batch = 0;
+  // The last command index saved in this run, and the newer one to save when the policy allows.
+  constexpr size_t kNoCheckpoint = std::numeric_limits<size_t>::max();
+  size_t last_checkpoint = kNoCheckpoint;
+  size_t unsaved_checkpoint = kNoCheckpoint;
+  CheckpointPolicy checkpoint_policy(
+      GetSizeProperty(updater, kCheckpointCommandsProperty, kDefaultCheckpointCommands),
+      std::chrono::milliseconds(GetSizeProperty(updater, kCheckpointIntervalMsProperty,
+                                                kDefaultCheckpointIntervalMs)));
+  auto save_checkpoint = [&](size_t checkpoint) {
+    if (!UpdateLastCommandIndex(params.last_command_file, checkpoint,
+                                lines[checkpoint + kTransferListHeaderLines])) {
+      LOG(WARNING) << "Failed to update the last command file.";
+    }
+    last_checkpoint = checkpoint;
+    unsaved_checkpoint = kNoCheckpoint;
+    checkpoint_policy.Saved();
+  };
+  // Saves the progress into the current command, as the number of its target blocks written on top
+  // of the previous command. That's only a valid checkpoint when no in-memory stash is held, and
+  // the first command can't save it.
+  if (params.canwrite) {
+    params.progress_blocks =
+        (GetSizeProperty(updater, kProgressCheckpointMbProperty, kDefaultProgressCheckpointMb,
+                         std::numeric_limits<size_t>::max() >> 20)
+         << 20) /
+        BLOCKSIZE;
+    params.save_progress = [&](size_t blocks) {
+      if (params.cmdindex == 0 || !params.checkpoint_holds.empty()) {
+        return;
+      }
+      size_t checkpoint = params.cmdindex - 1;
+      if (!UpdateLastCommandIndex(params.last_command_file, checkpoint,
+                                  lines[checkpoint + kTransferListHeaderLines], blocks)) {
+        LOG(WARNING) << "Failed to update the last command file.";
+      }
+      last_checkpoint = checkpoint;
+      unsaved_checkpoint = kNoCheckpoint;
+      checkpoint_policy.Saved();
+    };
+  }
+  if (!source_ranges.empty()) {
+    params.prefetcher = std::make_unique<SourcePrefetcher>(params.fd, std::move(source_ranges));
+  }
+
+  // Target blocks are only discarded when retrying an update, in which case we issue the ioctls
+  // in the background while writing.
+  if (params.canwrite && is_retry) {
+    params.discarder = std::make_unique<DiscardScheduler>(params.fd);
+  }
+
+  if (params.canwrite &&
+      android::base::ParseBool(updater->GetRuntime()->GetProperty(kDirectWriteProperty, "")) !=
+          android::base::ParseBoolResult::kFalse) {
+    params.direct_writer = DirectWriter::Open(
+        block_device_path, params.fd,
+        GetProfiledQueueDepth(kDefaultDirectWriteDepth, kMaxDirectWriteDepth));
+  }
+
+  params.patch_output_buffer = GetSizeProperty(updater, kPatchOutputBufferProperty,
+                                               kDefaultPatchOutputBufferKb, kMaxPatchOutputBufferKb)
+                               << 10;
+
+  // The imgdiff commands that patch the pieces of a split APK inflate the same source chunks.
+  if (params.canwrite) {
+    size_t inflate_cache_size =
+        GetSizeProperty(updater, kInflateCacheProperty, kDefaultInflateCacheSize >> 20,
+                        std::numeric_limits<size_t>::max() >> 20)
+        << 20;
+    if (inflate_cache_size > 0) {
+      params.inflate_cache = std::make_unique<InflateCache>(inflate_cache_size);
+      InflateCache* inflate_cache = params.inflate_cache.get();
+      MemoryConsumer consumer;
+      consumer.usage = [inflate_cache]() { return inflate_cache->size(); };
+      consumer.shrink = [inflate_cache](size_t bytes) { return inflate_cache->Shrink(bytes); };
+      params.inflate_cache_reservation =
+          MemoryGovernor::Get().Reserve("inflate cache", MemoryPriority::kCache, 0,
+                                        inflate_cache_size, consumer);
+      if (!params.inflate_cache_reservation || params.inflate_cache_reservation->bytes() == 0) {
+        params.inflate_cache_reservation.reset();
+        params.inflate_cache.reset();
+      } else {
+        inflate_cache->Shrink(inflate_cache_size - params.inflate_cache_reservation->bytes());
+      }
+    }
+  }
+
+  if (params.canwrite && android::base::ParseBool(updater->GetRuntime()->GetProperty(
+                             kTraceCommandsProperty, "")) == android::base::ParseBoolResult::kTrue) {
+    params.tracer = CommandTraceWriter::Open(Paths::Get().temporary_update_trace_file(),
+                                             android::base::Basename(block_device_path));
   }
 
   int rc = -1;
@@ -1828,11 +4292,18 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     if (line.empty()) continue;
 
     size_t cmdindex = i - kTransferListHeaderLines;
+    params.cmdindex = cmdindex;
     params.tokens = android::base::Split(line, " ");
     params.cpos = 0;
     params.cmdname = params.tokens[params.cpos++];
     params.cmdline = line;
     params.target_verified = false;
+    params.resume_blocks =
+        (params.canwrite && skip_executed_command && cmdindex == saved_last_command_index + 1)
+            ? saved_command_blocks
+            : 0;
+    // Give cache memory back if the device runs short of it, e.g. as the stashes grow.
+    MemoryGovernor::Get().Rebalance();
 
     Command::Type cmd_type = Command::ParseType(params.cmdname);
     if (cmd_type == Command::Type::LAST) {
@@ -1849,16 +4320,34 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
       continue;
     }
 
-    // Skip all commands before the saved last command index when resuming an update, except for
-    // "new" command. Because new commands read in the data sequentially.
-    if (params.canwrite && skip_executed_command && cmdindex <= saved_last_command_index &&
-        cmd_type != Command::Type::NEW) {
+    // Skip all commands before the saved last command index when resuming an update. The new data
+    // of the skipped "new" commands is dropped by the decoder.
+    if (params.canwrite && skip_executed_command && cmdindex <= saved_last_command_index) {
       LOG(INFO) << "Skipping already executed command: " << cmdindex
                 << ", last executed command for previous update: " << saved_last_command_index;
       continue;
     }
 
-    if (performer(params) == -1) {
+    CommandTrace trace;
+    current_trace = params.tracer ? &trace : nullptr;
+    size_t written = params.written;
+    size_t stashed = params.stashed;
+    const std::vector<Command>* batch = nullptr;
+    std::vector<CommandTrace> batch_traces;
+
+    if (next_batch < batches.size() && batches[next_batch].front().index() == cmdindex) {
+      batch = &batches[next_batch++];
+      // The batches are short, so that each one scales its workers to the current temperature.
+      if (PerformCommandBatch(params, *batch, ThermalThrottle::Get().Scale(command_workers),
+                              params.tracer ? &batch_traces : nullptr) == -1) {
+        goto pbiudone;
+      }
+      // Save the checkpoint after the whole batch. If the update gets interrupted in the middle of
+      // a batch, the finished commands will be skipped on resume as their targets are verified.
+      cmdindex = batch->back().index();
+      i = cmdindex + kTransferListHeaderLines;
+      params.cmdline = batch->back().cmdline();
+    } else if (performer(params) == -1) {
       LOG(ERROR) << "failed to execute command [" << line << "]";
       if (cmd_type == Command::Type::COMPUTE_HASH_TREE && failure_type == kNoCause) {
         failure_type = kHashTreeComputationFailure;
@@ -1877,39 +4366,112 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
         LOG(WARNING) << "Previously executed command " << saved_last_command_index << ": "
                      << params.cmdline << " doesn't produce expected target blocks.";
         skip_executed_command = false;
-        DeleteLastCommandFile();
+        DeleteLastCommandFile(params.last_command_file);
       }
     }
 
     if (params.canwrite) {
+      TraceTimer fsync_timer(&CommandTrace::fsync_us);
+      TraceIo(nullptr, &CommandTrace::fsyncs, 0, 1);
       if (fsync(params.fd) == -1) {
         failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
         PLOG(ERROR) << "fsync failed";
         goto pbiudone;
       }
 
-      if (!UpdateLastCommandIndex(cmdindex, params.cmdline)) {
-        LOG(WARNING) << "Failed to update the last command file.";
+      // Release the holds of the in-memory stashes that are no longer needed. While any remains,
+      // save the command before the earliest held stash command instead, so that resuming an
+      // interrupted update recreates the stash.
+      for (auto it = params.checkpoint_holds.begin(); it != params.checkpoint_holds.end();) {
+        it = it->second <= cmdindex ? params.checkpoint_holds.erase(it) : std::next(it);
+      }
+      size_t checkpoint = cmdindex;
+      if (!params.checkpoint_holds.empty()) {
+        checkpoint = params.checkpoint_holds.begin()->first;
+        checkpoint = checkpoint > 0 ? checkpoint - 1 : kNoCheckpoint;
+      }
+      bool save_now = checkpoint_policy.CommandsDone(batch != nullptr ? batch->size() : 1,
+                                                     cmd_type == Command::Type::ERASE);
+      if (checkpoint != kNoCheckpoint && checkpoint != last_checkpoint) {
+        if (save_now) {
+          save_checkpoint(checkpoint);
+        } else {
+          unsaved_checkpoint = checkpoint;
+        }
+      }
+    }
+
+    if (params.tracer) {
+      current_trace = nullptr;
+      if (batch != nullptr) {
+        // The batch is fsync'ed once, after its last command.
+        batch_traces.back().fsync_us += trace.fsync_us;
+        for (size_t j = 0; j < batch->size(); j++) {
+          const Command& command = (*batch)[j];
+          const std::string& command_line = command.cmdline();
+          params.tracer->Write(command.index(), command_line.substr(0, command_line.find(' ')),
+                               command.target().ranges().blocks(), batch_traces[j]);
+        }
+      } else {
+        size_t blocks = cmd_type == Command::Type::STASH ? params.stashed - stashed
+                                                          : params.written - written;
+        params.tracer->Write(cmdindex, params.cmdname, blocks, trace);
       }
+    }
 
-      updater->WriteToCommandPipe(
-          android::base::StringPrintf("set_progress %.4f",
-                                      static_cast<double>(params.written) / total_blocks),
-          true);
+    if (params.canwrite) {
+      updater->SetProgress(static_cast<double>(params.written) / total_blocks, true);
     }
   }
 
   rc = 0;
 
 pbiudone:
+  // Keep the progress made so far if the update fails. The blocks written by the commands up to the
+  // unsaved checkpoint have been fsync'ed already.
+  if (rc != 0 && unsaved_checkpoint != kNoCheckpoint) {
+    save_checkpoint(unsaved_checkpoint);
+  }
+  current_trace = nullptr;
+  params.tracer.reset();
+  if (params.prefetcher) {
+    LOG(INFO) << "used prefetched source blocks for " << params.prefetcher->hits() << " commands";
+    params.prefetcher.reset();
+  }
+  if (params.verified_source_hits > 0) {
+    LOG(INFO) << "used verified source blocks for " << params.verified_source_hits << " commands";
+  }
+  if (params.source_blocks) {
+    LOG(INFO) << "used cached source blocks for " << params.source_blocks->hits() << " commands ("
+              << params.source_cache_plan.hits.size() << " planned)";
+    params.source_blocks.reset();
+  }
+  if (params.inflate_cache) {
+    LOG(INFO) << "used cached inflated source for " << params.inflate_cache->hits() << " of "
+              << params.inflate_cache->hits() + params.inflate_cache->misses()
+              << " imgdiff deflate chunks";
+    params.inflate_cache.reset();
+  }
+  // The update has no more use for the blocks kept by the verify, whatever the outcome.
+  if (params.canwrite && !params.source_cache_key.empty()) {
+    verified_sources.Reset(params.source_cache_key);
+  }
+  // Even a failed verify tells block_image_recover() which blocks it doesn't need to repair. Once
+  // the update writes to the partition, that's no longer known.
+  {
+    std::lock_guard<std::mutex> lock(verified_blocks_lock);
+    if (params.canwrite) {
+      verified_blocks.erase(params.stashbase);
+    } else {
+      verified_blocks[params.stashbase] = std::move(params.verified_blocks);
+    }
+  }
+
   if (params.canwrite) {
-    pthread_mutex_lock(&params.nti.mu);
-    if (params.nti.receiver_available) {
+    if (!params.nti.ring->producer_closed()) {
       LOG(WARNING) << "new data receiver is still available after executing all commands.";
     }
-    params.nti.receiver_available = false;
-    pthread_cond_broadcast(&params.nti.cv);
-    pthread_mutex_unlock(&params.nti.mu);
+    params.nti.ring->CloseConsumer();
     int ret = pthread_join(params.thread, nullptr);
     if (ret != 0) {
       LOG(WARNING) << "pthread join returned with " << strerror(ret);
@@ -1918,6 +4480,10 @@ pbiudone:
     if (rc == 0) {
       LOG(INFO) << "wrote " << params.written << " blocks; expected " << total_blocks;
       LOG(INFO) << "stashed " << params.stashed << " blocks";
+      if (params.memory_stash && params.memory_stash->raw_bytes() > 0) {
+        LOG(INFO) << "kept " << params.memory_stash->raw_bytes() << " bytes of stashes in "
+                  << params.memory_stash->stored_bytes() << " bytes of memory";
+      }
       LOG(INFO) << "max alloc needed was " << params.buffer.size();
 
       const char* partition = strrchr(block_device_path.c_str(), '/');
@@ -1929,11 +4495,16 @@ pbiudone:
             android::base::StringPrintf("log bytes_stashed_%s: %" PRIu64, partition + 1,
                                         static_cast<uint64_t>(params.stashed) * BLOCKSIZE),
             true);
+        std::string name(partition + 1);
+        AppendInstallMetrics(
+            Paths::Get().temporary_install_metrics_file(),
+            { { "bytes_written_" + name, static_cast<int64_t>(params.written) * BLOCKSIZE },
+              { "bytes_stashed_" + name, static_cast<int64_t>(params.stashed) * BLOCKSIZE } });
       }
       // Delete stash only after successfully completing the update, as it may contain blocks needed
       // to complete the update later.
       DeleteStash(params.stashbase);
-      DeleteLastCommandFile();
+      DeleteLastCommandFile(params.last_command_file);
 
       // Create a marker on /cache partition, which allows skipping the update on this partition on
       // retry. The marker will be removed once booting into normal boot, or before starting next
@@ -1942,9 +4513,6 @@ pbiudone:
         LOG(WARNING) << "Failed to set updated marker; continuing";
       }
     }
-
-    pthread_mutex_destroy(&params.nti.mu);
-    pthread_cond_destroy(&params.nti.cv);
   } else if (rc == 0) {
     LOG(INFO) << "verified partition contents; update may be resumed";
   }
@@ -1955,13 +4523,9 @@ pbiudone:
   }
   // params.fd will be automatically closed because it's a unique_fd.
 
-  if (params.nti.brotli_decoder_state != nullptr) {
-    BrotliDecoderDestroyInstance(params.nti.brotli_decoder_state);
-  }
-
   // Delete the last command file if the update cannot be resumed.
   if (params.isunresumable) {
-    DeleteLastCommandFile();
+    DeleteLastCommandFile(params.last_command_file);
   }
 
   // Only delete the stash if the update cannot be resumed, or it's a verification run and we
@@ -2065,9 +4629,15 @@ Value* BlockImageUpdateFn(const char* name, State* state,
   return PerformBlockImageUpdate(name, state, argv, command_map, false);
 }
 
-Value* RangeSha1Fn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
+// The number of threads hashing the segments for range_sha256_tree().
+static constexpr size_t kMaxTreeHashWorkers = 8;
+
+// range_sha1(blockdev, ranges) and range_sha256_tree(blockdev, ranges) return the hex digest of the
+// given blocks of the block device: their SHA-1, or their tree hash (see tree_hash.h).
+static Value* RangeHashFn(const char* name, State* state,
+                          const std::vector<std::unique_ptr<Expr>>& argv, bool tree) {
   if (argv.size() != 2) {
-    ErrorAbort(state, kArgsParsingFailure, "range_sha1 expects 2 arguments, got %zu", argv.size());
+    ErrorAbort(state, kArgsParsingFailure, "%s expects 2 arguments, got %zu", name, argv.size());
     return StringValue("");
   }
 
@@ -2088,9 +4658,9 @@ Value* RangeSha1Fn(const char* name, State* state, const std::vector<std::unique
     return StringValue("");
   }
 
-  auto block_device_path = state->updater->FindBlockDeviceName(blockdev_filename->data);
+  auto block_device_path = state->updater->FindBlockDeviceName(blockdev_filename->data());
   if (block_device_path.empty()) {
-    LOG(ERROR) << "Block device path for " << blockdev_filename->data << " not found. " << name
+    LOG(ERROR) << "Block device path for " << blockdev_filename->data() << " not found. " << name
                << " failed.";
     return StringValue("");
   }
@@ -2103,35 +4673,38 @@ Value* RangeSha1Fn(const char* name, State* state, const std::vector<std::unique
     return StringValue("");
   }
 
-  RangeSet rs = RangeSet::Parse(ranges->data);
+  RangeSet rs = RangeSet::Parse(ranges->data());
   CHECK(static_cast<bool>(rs));
 
-  SHA_CTX ctx;
-  SHA1_Init(&ctx);
-
-  std::vector<uint8_t> buffer(BLOCKSIZE);
-  for (const auto& [begin, end] : rs) {
-    if (!check_lseek(fd, static_cast<off64_t>(begin) * BLOCKSIZE, SEEK_SET)) {
-      ErrorAbort(state, kLseekFailure, "failed to seek %s: %s", block_device_path.c_str(),
-                 strerror(errno));
-      return StringValue("");
-    }
+  // The SHA-1 hashes each chunk of the ranges while reading the next one; the tree hash reads and
+  // hashes the segments on several threads.
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  size_t digest_size = tree ? SHA256_DIGEST_LENGTH : SHA_DIGEST_LENGTH;
+  bool success;
+  if (tree) {
+    size_t workers = ThermalThrottle::Get().Scale(
+        std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxTreeHashWorkers));
+    success = Sha256TreeBlocksAt(fd, rs, BLOCKSIZE, workers, digest);
+  } else {
+    success = Sha1BlocksAt(fd, rs, BLOCKSIZE, digest);
+  }
+  if (!success) {
+    CauseCode cause_code = errno == EIO ? kEioFailure : kFreadFailure;
+    ErrorAbort(state, cause_code, "failed to read %s: %s", block_device_path.c_str(),
+               strerror(errno));
+    return StringValue("");
+  }
 
-    for (size_t j = begin; j < end; ++j) {
-      if (!android::base::ReadFully(fd, buffer.data(), BLOCKSIZE)) {
-        CauseCode cause_code = errno == EIO ? kEioFailure : kFreadFailure;
-        ErrorAbort(state, cause_code, "failed to read %s: %s", block_device_path.c_str(),
-                   strerror(errno));
-        return StringValue("");
-      }
+  return StringValue(print_hex(digest, digest_size));
+}
 
-      SHA1_Update(&ctx, buffer.data(), BLOCKSIZE);
-    }
-  }
-  uint8_t digest[SHA_DIGEST_LENGTH];
-  SHA1_Final(digest, &ctx);
+Value* RangeSha1Fn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
+  return RangeHashFn(name, state, argv, false);
+}
 
-  return StringValue(print_sha1(digest));
+Value* RangeSha256TreeFn(const char* name, State* state,
+                         const std::vector<std::unique_ptr<Expr>>& argv) {
+  return RangeHashFn(name, state, argv, true);
 }
 
 // This function checks if a device has been remounted R/W prior to an incremental
@@ -2159,9 +4732,9 @@ Value* CheckFirstBlockFn(const char* name, State* state,
     return StringValue("");
   }
 
-  auto block_device_path = state->updater->FindBlockDeviceName(arg_filename->data);
+  auto block_device_path = state->updater->FindBlockDeviceName(arg_filename->data());
   if (block_device_path.empty()) {
-    LOG(ERROR) << "Block device path for " << arg_filename->data << " not found. " << name
+    LOG(ERROR) << "Block device path for " << arg_filename->data() << " not found. " << name
                << " failed.";
     return StringValue("");
   }
@@ -2204,6 +4777,9 @@ Value* CheckFirstBlockFn(const char* name, State* state,
   return StringValue("t");
 }
 
+// The number of blocks block_image_recover() reads at once.
+static constexpr size_t kRecoverChunkBlocks = 256;  // 1 MiB
+
 Value* BlockImageRecoverFn(const char* name, State* state,
                            const std::vector<std::unique_ptr<Expr>>& argv) {
   if (argv.size() != 2) {
@@ -2228,15 +4804,16 @@ Value* BlockImageRecoverFn(const char* name, State* state,
     ErrorAbort(state, kArgsParsingFailure, "ranges argument to %s must be string", name);
     return StringValue("");
   }
-  RangeSet rs = RangeSet::Parse(ranges->data);
+  RangeSet rs = RangeSet::Parse(ranges->data());
   if (!rs) {
-    ErrorAbort(state, kArgsParsingFailure, "failed to parse ranges: %s", ranges->data.c_str());
+    ErrorAbort(state, kArgsParsingFailure, "failed to parse ranges: %s",
+               std::string(ranges->data()).c_str());
     return StringValue("");
   }
 
-  auto block_device_path = state->updater->FindBlockDeviceName(filename->data);
+  auto block_device_path = state->updater->FindBlockDeviceName(filename->data());
   if (block_device_path.empty()) {
-    LOG(ERROR) << "Block device path for " << filename->data << " not found. " << name
+    LOG(ERROR) << "Block device path for " << filename->data() << " not found. " << name
                << " failed.";
     return StringValue("");
   }
@@ -2264,19 +4841,59 @@ Value* BlockImageRecoverFn(const char* name, State* state,
     return StringValue("");
   }
 
-  uint8_t buffer[BLOCKSIZE];
-  for (const auto& [begin, end] : rs) {
-    for (size_t j = begin; j < end; ++j) {
-      // Stay within the data area, libfec validates and corrects metadata
-      if (status.data_size <= static_cast<uint64_t>(j) * BLOCKSIZE) {
+  // Stay within the data area, libfec validates and corrects metadata. Leave out the blocks that
+  // the last verify of the partition found to have the expected contents: only the blocks from the
+  // command that failed onwards may need repairs.
+  SortedRangeSet verified;
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  if (Sha1DevicePath(block_device_path, digest)) {
+    std::lock_guard<std::mutex> lock(verified_blocks_lock);
+    if (auto it = verified_blocks.find(print_sha1(digest)); it != verified_blocks.end()) {
+      verified.Insert(SortedRangeSet(std::vector<Range>(it->second)));
+    }
+  }
+  size_t data_blocks = status.data_size / BLOCKSIZE;
+  std::vector<Range> repairs;
+  for (auto [begin, end] : rs) {
+    end = std::min(end, data_blocks);
+    for (const auto& [verified_begin, verified_end] : verified) {
+      if (begin >= end || verified_begin >= end) {
+        break;
+      }
+      if (verified_end <= begin) {
         continue;
       }
-
-      if (fh.pread(buffer, BLOCKSIZE, static_cast<off64_t>(j) * BLOCKSIZE) != BLOCKSIZE) {
-        ErrorAbort(state, kLibfecFailure, "failed to recover %s (block %zu): %s",
-                   block_device_path.c_str(), j, strerror(errno));
+      if (verified_begin > begin) {
+        repairs.emplace_back(begin, verified_begin);
+      }
+      begin = verified_end;
+    }
+    if (begin < end) {
+      repairs.emplace_back(begin, end);
+    }
+  }
+  size_t total_blocks = 0;
+  for (const auto& [begin, end] : repairs) {
+    total_blocks += end - begin;
+  }
+  LOG(INFO) << "checking " << total_blocks << " of " << rs.blocks() << " blocks ("
+            << verified.blocks() << " blocks verified on the partition)";
+
+  // A read of several blocks has libfec decode their RS blocks on as many threads (up to the number
+  // of CPUs), where reading one block at a time would use a single one.
+  std::vector<uint8_t> buffer(kRecoverChunkBlocks * BLOCKSIZE);
+  size_t done = 0;
+  for (const auto& [begin, end] : repairs) {
+    for (size_t block = begin; block < end; block += kRecoverChunkBlocks) {
+      size_t blocks = std::min(kRecoverChunkBlocks, end - block);
+      if (fh.pread(buffer.data(), blocks * BLOCKSIZE, static_cast<off64_t>(block) * BLOCKSIZE) !=
+          static_cast<ssize_t>(blocks * BLOCKSIZE)) {
+        ErrorAbort(state, kLibfecFailure, "failed to recover %s (blocks %zu-%zu): %s",
+                   block_device_path.c_str(), block, block + blocks - 1, strerror(errno));
         return StringValue("");
       }
+      done += blocks;
+      state->updater->SetProgress(static_cast<double>(done) / total_blocks);
 
       // If we want to be able to recover from a situation where rewriting a corrected
       // block doesn't guarantee the same data will be returned when re-read later, we
@@ -2290,6 +4907,9 @@ Value* BlockImageRecoverFn(const char* name, State* state,
       //     read and check if the errors field value has increased.
     }
   }
+  if (fh.get_status(status)) {
+    LOG(INFO) << "corrected " << status.errors << " errors";
+  }
   LOG(INFO) << "..." << block_device_path << " image recovered successfully.";
   return StringValue("t");
 }
@@ -2300,4 +4920,5 @@ void RegisterBlockImageFunctions() {
   RegisterFunction("block_image_recover", BlockImageRecoverFn);
   RegisterFunction("check_first_block", CheckFirstBlockFn);
   RegisterFunction("range_sha1", RangeSha1Fn);
+  RegisterFunction("range_sha256_tree", RangeSha256TreeFn);
 }
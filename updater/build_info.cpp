@@ -16,15 +16,22 @@
 
 #include "updater/build_info.h"
 
+#include <fcntl.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <atomic>
+#include <optional>
 #include <set>
+#include <thread>
 #include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 
+#include "updater/source_image_cache.h"
 #include "updater/target_files.h"
 
 bool BuildInfo::ParseTargetFile(const std::string_view target_file_path, bool extracted_input) {
@@ -42,6 +49,14 @@ bool BuildInfo::ParseTargetFile(const std::string_view target_file_path, bool ex
     return false;
   }
 
+  // Find the image of each partition first, then extract them all at once.
+  struct ImageToExtract {
+    const FstabInfo* fstab_info;
+    std::string entry_name;
+    TemporaryFile* image_file;
+    bool extracted;
+  };
+  std::vector<ImageToExtract> images;
   for (const auto& fstab_info : fstab_info_list) {
     for (const auto& directory : { "IMAGES", "RADIO" }) {
       std::string entry_name = directory + fstab_info.mount_point + ".img";
@@ -51,36 +66,103 @@ bool BuildInfo::ParseTargetFile(const std::string_view target_file_path, bool ex
       }
 
       temp_files_.emplace_back(work_dir_);
-      auto& image_file = temp_files_.back();
-      if (!target_file.ExtractImage(entry_name, fstab_info, work_dir_, &image_file)) {
-        LOG(ERROR) << "Failed to set up source image files.";
-        return false;
-      }
+      images.push_back({ &fstab_info, std::move(entry_name), &temp_files_.back(), false });
+      break;
+    }
+  }
+
+  std::optional<SourceImageCache> cache;
+  if (!source_cache_dir_.empty()) {
+    if (std::string digest; target_file.GetContentDigest(&digest)) {
+      cache.emplace(source_cache_dir_, digest);
+    } else {
+      LOG(WARNING) << "Not caching the images of " << target_file_path;
+    }
+  }
 
-      std::string mapped_path = image_file.path;
-      // Rename the images to more readable ones if we want to keep the image.
-      if (keep_images_) {
-        mapped_path = work_dir_ + fstab_info.mount_point + ".img";
-        image_file.release();
-        if (rename(image_file.path, mapped_path.c_str()) != 0) {
-          PLOG(ERROR) << "Failed to rename " << image_file.path << " to " << mapped_path;
-          return false;
+  // Each worker reads the target file through its own zip handle, so that the inflating (and the
+  // de-sparsing) of the images scale with the cores rather than taking turns.
+  std::atomic<size_t> next_image = 0;
+  auto extract_images = [&images, &next_image, &cache, &target_file_path, extracted_input, this]() {
+    std::optional<TargetFile> worker_target_file;
+    for (size_t i = next_image++; i < images.size(); i = next_image++) {
+      auto& image = images[i];
+      if (cache && cache->Get(image.entry_name, image.image_file)) {
+        image.extracted = true;
+        continue;
+      }
+      // The target file is only opened once there's an image that isn't cached.
+      if (!worker_target_file) {
+        worker_target_file.emplace(std::string(target_file_path), extracted_input);
+        if (!worker_target_file->Open()) {
+          return;
         }
       }
+      image.extracted = worker_target_file->ExtractImage(image.entry_name, *image.fstab_info,
+                                                         work_dir_, image.image_file);
+      if (image.extracted && cache && !cache->Put(image.entry_name, *image.image_file)) {
+        LOG(WARNING) << "Failed to cache " << image.entry_name;
+      }
+    }
+  };
+  size_t num_workers =
+      std::min<size_t>(images.size(), std::max(1U, std::thread::hardware_concurrency()));
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < num_workers; i++) {
+    workers.emplace_back(extract_images);
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
 
-      LOG(INFO) << "Mounted " << fstab_info.mount_point << "\nMapping: " << fstab_info.blockdev_name
-                << " to " << mapped_path;
+  for (const auto& image : images) {
+    const auto& fstab_info = *image.fstab_info;
+    auto& image_file = *image.image_file;
+    if (!image.extracted) {
+      LOG(ERROR) << "Failed to set up source image files.";
+      return false;
+    }
 
-      blockdev_map_.emplace(
-          fstab_info.blockdev_name,
-          FakeBlockDevice(fstab_info.blockdev_name, fstab_info.mount_point, mapped_path));
-      break;
+    std::string mapped_path = image_file.path;
+    // Rename the images to more readable ones if we want to keep the image.
+    if (keep_images_) {
+      mapped_path = work_dir_ + fstab_info.mount_point + ".img";
+      image_file.release();
+      if (rename(image_file.path, mapped_path.c_str()) != 0) {
+        PLOG(ERROR) << "Failed to rename " << image_file.path << " to " << mapped_path;
+        return false;
+      }
     }
+
+    LOG(INFO) << "Mounted " << fstab_info.mount_point << "\nMapping: " << fstab_info.blockdev_name
+              << " to " << mapped_path;
+
+    blockdev_map_.emplace(
+        fstab_info.blockdev_name,
+        FakeBlockDevice(fstab_info.blockdev_name, fstab_info.mount_point, mapped_path));
   }
 
   return true;
 }
 
+bool BuildInfo::CloneFakeBlockDevices(const std::string_view work_dir,
+                                      std::list<TemporaryFile>* clones) {
+  for (auto& [blockdev_name, device] : blockdev_map_) {
+    android::base::unique_fd fd(open(device.mounted_file_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+      PLOG(ERROR) << "Failed to open " << device.mounted_file_path;
+      return false;
+    }
+    auto& clone = clones->emplace_back(std::string(work_dir));
+    if (clone.fd == -1 || !CloneImageFile(fd, clone.fd)) {
+      LOG(ERROR) << "Failed to copy " << device.mounted_file_path << " for " << blockdev_name;
+      return false;
+    }
+    device.mounted_file_path = clone.path;
+  }
+  return true;
+}
+
 std::string BuildInfo::GetProperty(const std::string_view key,
                                    const std::string_view default_value) const {
   // The logic to parse the ro.product properties should be in line with the generation script.
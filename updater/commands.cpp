@@ -19,9 +19,13 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <algorithm>
 #include <functional>
+#include <map>
 #include <ostream>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 #include <android-base/logging.h>
@@ -32,6 +36,7 @@
 
 #include "otautil/print_sha1.h"
 #include "otautil/rangeset.h"
+#include "private/source_cache.h"
 
 using namespace std::string_literals;
 
@@ -312,6 +317,328 @@ bool SourceInfo::Overlaps(const TargetInfo& target) const {
   return ranges_.Overlaps(target.ranges());
 }
 
+// Returns whether the command only reads its source ranges and writes its target ranges, so that
+// it can be reordered against the other commands that don't touch the same blocks.
+static bool IsReorderable(const Command& command, size_t max_blocks) {
+  switch (command.type()) {
+    case Command::Type::ZERO:
+      return command.target().blocks() <= max_blocks;
+    case Command::Type::MOVE:
+    case Command::Type::BSDIFF:
+    case Command::Type::IMGDIFF: {
+      const SourceInfo& source = command.source();
+      return source.stashes().empty() && !source.Overlaps(command.target()) &&
+             source.blocks() + command.target().blocks() <= max_blocks;
+    }
+    default:
+      return false;
+  }
+}
+
+// Returns whether either command writes the blocks that the other one reads or writes.
+static bool Conflicts(const Command& a, const Command& b) {
+  const RangeSet& a_tgt = a.target().ranges();
+  const RangeSet& b_tgt = b.target().ranges();
+  return a_tgt.Overlaps(b_tgt) || a_tgt.Overlaps(b.source().ranges()) ||
+         b_tgt.Overlaps(a.source().ranges());
+}
+
+std::vector<std::pair<size_t, size_t>> GroupIndependentCommands(const std::vector<Command>& commands,
+                                                                size_t max_batch_size,
+                                                                size_t max_blocks) {
+  std::vector<std::pair<size_t, size_t>> batches;
+  size_t begin = 0;
+  for (size_t i = 0; i < commands.size(); i++) {
+    bool joins_batch = i > begin && i - begin < max_batch_size &&
+                       IsReorderable(commands[begin], max_blocks) &&
+                       IsReorderable(commands[i], max_blocks) &&
+                       std::none_of(commands.begin() + begin, commands.begin() + i,
+                                    [&](const Command& other) {
+                                      return Conflicts(other, commands[i]);
+                                    });
+    if (i > begin && !joins_batch) {
+      batches.emplace_back(begin, i);
+      begin = i;
+    }
+  }
+  if (begin < commands.size()) {
+    batches.emplace_back(begin, commands.size());
+  }
+  return batches;
+}
+
+// Returns the blocks that the command reads from the partition.
+static const RangeSet& ReadRanges(const Command& command) {
+  switch (command.type()) {
+    case Command::Type::STASH:
+      return command.stash().ranges();
+    case Command::Type::COMPUTE_HASH_TREE:
+      return command.hash_tree_info().source_ranges();
+    default:
+      return command.source().ranges();
+  }
+}
+
+// Returns the blocks that the command writes to the partition.
+static const RangeSet& WriteRanges(const Command& command) {
+  if (command.type() == Command::Type::COMPUTE_HASH_TREE) {
+    return command.hash_tree_info().hash_tree_ranges();
+  }
+  return command.target().ranges();
+}
+
+std::map<size_t, size_t> FindReplayableStashes(const std::vector<Command>& commands,
+                                               size_t max_window) {
+  std::map<size_t, size_t> result;
+  for (size_t begin = 0; begin < commands.size(); begin++) {
+    if (commands[begin].type() != Command::Type::STASH) {
+      continue;
+    }
+    const std::string& id = commands[begin].stash().id();
+
+    // Find the last use of the stash before it gets freed.
+    bool freed = false;
+    size_t last_use = begin;
+    size_t limit = std::min(commands.size(), begin + 1 + max_window);
+    for (size_t i = begin + 1; i < limit; i++) {
+      const Command& command = commands[i];
+      if (!command || (command.type() == Command::Type::STASH && command.stash().id() == id)) {
+        break;
+      }
+      if (command.type() == Command::Type::FREE && command.stash().id() == id) {
+        freed = true;
+        break;
+      }
+      const auto& stashes = command.source().stashes();
+      if (std::any_of(stashes.begin(), stashes.end(),
+                      [&id](const StashInfo& stash) { return stash.id() == id; })) {
+        last_use = i;
+      }
+    }
+    if (!freed) {
+      continue;
+    }
+
+    // Check that executing the commands again from the stash command gives the same result.
+    bool replayable = true;
+    for (size_t i = begin + 1; i <= last_use && replayable; i++) {
+      const RangeSet& written = WriteRanges(commands[i]);
+      for (size_t j = begin; j < i; j++) {
+        if (written.Overlaps(ReadRanges(commands[j])) ||
+            written.Overlaps(WriteRanges(commands[j]))) {
+          replayable = false;
+          break;
+        }
+      }
+    }
+    if (replayable) {
+      result.emplace(commands[begin].index(), commands[last_use].index());
+    }
+  }
+  return result;
+}
+
+StashReferences CountStashReferences(const std::vector<Command>& commands) {
+  StashReferences result;
+  std::map<std::string, size_t> counts;
+  for (const auto& command : commands) {
+    if (!command) {
+      continue;
+    }
+    if (command.type() == Command::Type::STASH) {
+      if (counts[command.stash().id()]++ > 0) {
+        result.held_stashes.insert(command.index());
+      }
+    } else if (command.type() == Command::Type::FREE) {
+      auto it = counts.find(command.stash().id());
+      if (it == counts.end()) {
+        continue;
+      }
+      if (--it->second > 0) {
+        result.held_frees.insert(command.index());
+      } else {
+        counts.erase(it);
+      }
+    }
+  }
+  return result;
+}
+
+StashPlan PlanStashes(const std::vector<Command>& commands, const StashReferences& references,
+                      const std::map<size_t, size_t>& replayable_stashes,
+                      size_t memory_budget_blocks,
+                      const std::map<std::string, size_t>& existing_stashes) {
+  StashPlan plan;
+  std::map<std::string, size_t> file_stashes = existing_stashes;
+  size_t file_blocks = 0;
+  for (const auto& [id, blocks] : existing_stashes) {
+    file_blocks += blocks;
+  }
+  plan.peak_blocks = file_blocks;
+  plan.peak_index = commands.empty() ? 0 : commands.front().index();
+  auto note_file_blocks = [&plan](size_t blocks, size_t index) {
+    if (blocks > plan.peak_blocks) {
+      plan.peak_blocks = blocks;
+      plan.peak_index = index;
+    }
+  };
+
+  // The stashes in memory, with their blocks and the position of their stash command, and the
+  // blocks they take during each command.
+  std::map<std::string, std::pair<size_t, size_t>> memory_stashes;
+  size_t memory_blocks = 0;
+  std::vector<size_t> memory_usage(commands.size(), 0);
+  // The replayable stashes in files, with the position of their stash command.
+  std::map<std::string, size_t> replayable_files;
+  // The span of positions of those stashes, from the stash to the free command.
+  std::vector<std::pair<size_t, size_t>> headroom_spans;
+
+  for (size_t i = 0; i < commands.size(); i++) {
+    const Command& command = commands[i];
+    if (!command) {
+      continue;
+    }
+    const std::string& id = command.stash().id();
+    if (command.type() == Command::Type::STASH) {
+      if (references.held_stashes.count(command.index()) != 0 || file_stashes.count(id) != 0 ||
+          memory_stashes.count(id) != 0) {
+        // Nothing to stash.
+      } else if (size_t blocks = command.stash().blocks();
+                 replayable_stashes.count(command.index()) != 0 &&
+                 blocks <= memory_budget_blocks - memory_blocks) {
+        plan.memory_stashes.insert(command.index());
+        memory_stashes.emplace(id, std::make_pair(blocks, i));
+        memory_blocks += blocks;
+      } else {
+        if (replayable_stashes.count(command.index()) != 0) {
+          replayable_files.emplace(id, i);
+        }
+        file_stashes.emplace(id, blocks);
+        file_blocks += blocks;
+        note_file_blocks(file_blocks, command.index());
+      }
+    } else if (command.type() == Command::Type::MOVE || command.type() == Command::Type::BSDIFF ||
+               command.type() == Command::Type::IMGDIFF) {
+      if (command.source().Overlaps(command.target())) {
+        note_file_blocks(file_blocks + command.source().blocks(), command.index());
+      }
+    }
+    memory_usage[i] = memory_blocks;
+
+    if (command.type() == Command::Type::FREE &&
+        references.held_frees.count(command.index()) == 0) {
+      if (auto it = memory_stashes.find(id); it != memory_stashes.end()) {
+        memory_blocks -= it->second.first;
+        memory_stashes.erase(it);
+      } else if (auto it = file_stashes.find(id); it != file_stashes.end()) {
+        file_blocks -= it->second;
+        file_stashes.erase(it);
+        if (auto replayable = replayable_files.find(id); replayable != replayable_files.end()) {
+          headroom_spans.emplace_back(replayable->second, i);
+          replayable_files.erase(replayable);
+        }
+      }
+    }
+  }
+
+  // The replayable stashes are freed within a few commands, so their spans are short.
+  for (const auto& [begin, end] : headroom_spans) {
+    size_t most = *std::max_element(memory_usage.begin() + begin, memory_usage.begin() + end + 1);
+    if (most < memory_budget_blocks) {
+      plan.memory_headroom.emplace(commands[begin].index(), memory_budget_blocks - most);
+    }
+  }
+  return plan;
+}
+
+// Returns the source blocks that the command reads, through the SourceBlockCache, from the
+// partition.
+static const RangeSet& CachedReadRanges(const Command& command) {
+  static const RangeSet kNone;
+  switch (command.type()) {
+    case Command::Type::STASH:
+    case Command::Type::MOVE:
+    case Command::Type::BSDIFF:
+    case Command::Type::IMGDIFF:
+      return ReadRanges(command);
+    default:
+      return kNone;
+  }
+}
+
+SourceCachePlan PlanSourceCache(const std::vector<Command>& commands, size_t capacity,
+                                const std::set<size_t>& uncached) {
+  SourceCachePlan plan;
+  if (capacity == 0) {
+    return plan;
+  }
+
+  size_t end_block = 0;
+  for (const auto& command : commands) {
+    if (command) {
+      for (const RangeSet* ranges : { &CachedReadRanges(command), &WriteRanges(command) }) {
+        for (const auto& range : *ranges) {
+          end_block = std::max(end_block, range.second);
+        }
+      }
+    }
+  }
+
+  // Going backwards, find the source blocks that a later command reads before they get written.
+  std::vector<bool> read_later(end_block, false);
+  for (size_t i = commands.size(); i-- > 0;) {
+    const Command& command = commands[i];
+    if (!command) {
+      continue;
+    }
+    for (const auto& [begin, end] : WriteRanges(command)) {
+      std::fill(read_later.begin() + begin, read_later.begin() + end, false);
+    }
+    if (uncached.count(command.index()) != 0) {
+      continue;
+    }
+
+    const RangeSet& src = CachedReadRanges(command);
+    std::vector<Range> keep;
+    size_t position = 0;
+    for (const auto& [begin, end] : src) {
+      for (size_t block = begin; block < end; block++, position++) {
+        if (!read_later[block]) {
+          continue;
+        }
+        if (!keep.empty() && keep.back().second == position) {
+          keep.back().second++;
+        } else {
+          keep.emplace_back(position, position + 1);
+        }
+      }
+      std::fill(read_later.begin() + begin, read_later.begin() + end, true);
+    }
+    if (!keep.empty()) {
+      plan.keep.emplace(command.index(), RangeSet(std::move(keep)));
+    }
+  }
+
+  // Then run the cache to find the hits.
+  SourceBlockCache cache(capacity, 0);
+  for (const auto& command : commands) {
+    if (!command) {
+      continue;
+    }
+    if (uncached.count(command.index()) == 0) {
+      const RangeSet& src = CachedReadRanges(command);
+      if (src && cache.Get(src, nullptr)) {
+        plan.hits.insert(command.index());
+      }
+      if (auto keep = plan.keep.find(command.index()); keep != plan.keep.end()) {
+        cache.Put(src, keep->second, nullptr);
+      }
+    }
+    cache.Invalidate(WriteRanges(command));
+  }
+  return plan;
+}
+
 // Moves blocks in the 'source' vector to the specified locations (as in 'locs') in the 'dest'
 // vector. Note that source and dest may be the same buffer.
 static void MoveRange(std::vector<uint8_t>* dest, const RangeSet& locs,
@@ -404,40 +731,55 @@ std::ostream& operator<<(std::ostream& os, const SourceInfo& source) {
 TransferList TransferList::Parse(const std::string& transfer_list_str, std::string* err) {
   TransferList result{};
 
-  std::vector<std::string> lines = android::base::Split(transfer_list_str, "\n");
+  // The lines are views into |transfer_list_str|, rather than copies, as the list can take several
+  // MiB.
+  std::vector<std::string_view> lines;
+  std::string_view text = transfer_list_str;
+  while (true) {
+    size_t newline = text.find('\n');
+    lines.push_back(text.substr(0, newline));
+    if (newline == std::string_view::npos) break;
+    text.remove_prefix(newline + 1);
+  }
   if (lines.size() < kTransferListHeaderLines) {
     *err = android::base::StringPrintf("too few lines in the transfer list [%zu]", lines.size());
     return TransferList{};
   }
 
   // First line in transfer list is the version number.
-  if (!android::base::ParseInt(lines[0], &result.version_, 3, 4)) {
-    *err = "unexpected transfer list version ["s + lines[0] + "]";
+  std::string header(lines[0]);
+  if (!android::base::ParseInt(header, &result.version_, 3, 5)) {
+    *err = "unexpected transfer list version ["s + header + "]";
     return TransferList{};
   }
 
   // Second line in transfer list is the total number of blocks we expect to write.
-  if (!android::base::ParseUint(lines[1], &result.total_blocks_)) {
-    *err = "unexpected block count ["s + lines[1] + "]";
+  header = lines[1];
+  if (!android::base::ParseUint(header, &result.total_blocks_)) {
+    *err = "unexpected block count ["s + header + "]";
     return TransferList{};
   }
 
   // Third line is how many stash entries are needed simultaneously.
-  if (!android::base::ParseUint(lines[2], &result.stash_max_entries_)) {
+  header = lines[2];
+  if (!android::base::ParseUint(header, &result.stash_max_entries_)) {
     return TransferList{};
   }
 
   // Fourth line is the maximum number of blocks that will be stashed simultaneously.
-  if (!android::base::ParseUint(lines[3], &result.stash_max_blocks_)) {
-    *err = "unexpected maximum stash blocks ["s + lines[3] + "]";
+  header = lines[3];
+  if (!android::base::ParseUint(header, &result.stash_max_blocks_)) {
+    *err = "unexpected maximum stash blocks ["s + header + "]";
     return TransferList{};
   }
 
   // Subsequent lines are all individual transfer commands.
+  result.commands_.reserve(lines.size() - kTransferListHeaderLines);
+  std::string line;
   for (size_t i = kTransferListHeaderLines; i < lines.size(); i++) {
-    const std::string& line = lines[i];
-    if (line.empty()) continue;
+    if (lines[i].empty()) continue;
 
+    line = lines[i];
     size_t cmdindex = i - kTransferListHeaderLines;
     std::string parsing_error;
     Command command = Command::Parse(line, cmdindex, &parsing_error);
@@ -446,7 +788,7 @@ TransferList TransferList::Parse(const std::string& transfer_list_str, std::stri
                                          line.c_str(), parsing_error.c_str());
       return TransferList{};
     }
-    result.commands_.push_back(command);
+    result.commands_.push_back(std::move(command));
   }
 
   return result;
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "updater/device_model.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parsedouble.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+#include "private/property_file.h"
+
+std::optional<DeviceProfile> DeviceProfile::Parse(std::string_view content) {
+  DeviceProfile profile;
+  const std::map<std::string, double DeviceProfile::*, std::less<>> fields = {
+    { "read_latency_us", &DeviceProfile::read_latency_us },
+    { "read_mbps", &DeviceProfile::read_mbps },
+    { "write_latency_us", &DeviceProfile::write_latency_us },
+    { "write_mbps", &DeviceProfile::write_mbps },
+    { "discard_latency_us", &DeviceProfile::discard_latency_us },
+    { "discard_mbps", &DeviceProfile::discard_mbps },
+    { "fsync_latency_us", &DeviceProfile::fsync_latency_us },
+    { "hash_mbps", &DeviceProfile::hash_mbps },
+    { "patch_mbps", &DeviceProfile::patch_mbps },
+  };
+  PropertyFile properties(content);
+  for (const auto& [key, value] : properties.properties()) {
+    auto field = fields.find(key);
+    if (field == fields.end()) {
+      LOG(ERROR) << "Unknown key in the device profile: " << key;
+      return std::nullopt;
+    }
+    if (!android::base::ParseDouble(value.c_str(), &(profile.*field->second), 0.0)) {
+      LOG(ERROR) << "Invalid " << key << " in the device profile: " << value;
+      return std::nullopt;
+    }
+  }
+  return profile;
+}
+
+// The time to move |bytes| at |mbps|, in seconds, or 0 for an unlimited throughput.
+static double TransferSeconds(uint64_t bytes, double mbps) {
+  return mbps > 0 ? bytes / (mbps * 1e6) : 0;
+}
+
+bool InstallTimeEstimate::AddTrace(std::string_view trace) {
+  static constexpr const char* kColumns[] = {
+    "partition", "command", "blocks", "reads",     "read_bytes", "writes",      "write_bytes",
+    "discards",  "discard_bytes",     "fsyncs",    "hash_bytes", "patch_bytes",
+  };
+  enum Column {
+    kPartition,
+    kCommand,
+    kBlocks,
+    kReads,
+    kReadBytes,
+    kWrites,
+    kWriteBytes,
+    kDiscards,
+    kDiscardBytes,
+    kFsyncs,
+    kHashBytes,
+    kPatchBytes,
+  };
+
+  // The trace starts with a header line, which names the columns.
+  std::vector<size_t> column_index;
+  for (const auto& line : android::base::Split(std::string(trace), "\n")) {
+    if (line.empty()) {
+      continue;
+    }
+    auto fields = android::base::Split(line, ",");
+    if (fields[0] == "partition") {
+      column_index.clear();
+      for (const auto& column : kColumns) {
+        auto it = std::find(fields.begin(), fields.end(), column);
+        if (it == fields.end()) {
+          LOG(ERROR) << "The trace has no " << column << " column";
+          return false;
+        }
+        column_index.push_back(it - fields.begin());
+      }
+      continue;
+    }
+    if (column_index.empty() || fields.size() <= *std::max_element(column_index.begin(),
+                                                                    column_index.end())) {
+      LOG(ERROR) << "Malformed line in the trace: " << line;
+      return false;
+    }
+
+    uint64_t values[std::size(kColumns)] = {};
+    for (size_t i = kBlocks; i < std::size(kColumns); i++) {
+      if (!android::base::ParseUint(fields[column_index[i]], &values[i])) {
+        LOG(ERROR) << "Invalid " << kColumns[i] << " in the trace: " << line;
+        return false;
+      }
+    }
+
+    double seconds =
+        (values[kReads] * profile_.read_latency_us + values[kWrites] * profile_.write_latency_us +
+         values[kDiscards] * profile_.discard_latency_us +
+         values[kFsyncs] * profile_.fsync_latency_us) /
+            1e6 +
+        TransferSeconds(values[kReadBytes], profile_.read_mbps) +
+        TransferSeconds(values[kWriteBytes], profile_.write_mbps) +
+        TransferSeconds(values[kDiscardBytes], profile_.discard_mbps) +
+        TransferSeconds(values[kHashBytes], profile_.hash_mbps) +
+        TransferSeconds(values[kPatchBytes], profile_.patch_mbps);
+    auto& cost = costs_[fields[column_index[kPartition]]][fields[column_index[kCommand]]];
+    cost.count++;
+    cost.blocks += values[kBlocks];
+    cost.seconds += seconds;
+    seconds_ += seconds;
+  }
+  return true;
+}
+
+std::string InstallTimeEstimate::Summary() const {
+  std::string summary =
+      android::base::StringPrintf("Estimated time of the block image updates: %.1fs", seconds_);
+  for (const auto& [partition, commands] : costs_) {
+    double partition_seconds = 0;
+    for (const auto& [command, cost] : commands) {
+      partition_seconds += cost.seconds;
+    }
+    summary += android::base::StringPrintf("\n  %s: %.1fs", partition.c_str(), partition_seconds);
+    for (const auto& [command, cost] : commands) {
+      summary += android::base::StringPrintf("\n    %s: %zu commands, %" PRIu64 " blocks, %.1fs",
+                                             command.c_str(), cost.count, cost.blocks,
+                                             cost.seconds);
+    }
+  }
+  return summary;
+}
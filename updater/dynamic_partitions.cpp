@@ -59,7 +59,7 @@ static std::vector<std::string> ReadStringArgs(const char* name, State* state,
 
   std::vector<std::string> ret;
   std::transform(args.begin(), args.end(), std::back_inserter(ret),
-                 [](const auto& arg) { return arg->data; });
+                 [](const auto& arg) { return std::string(arg->data()); });
   return ret;
 }
 
@@ -132,7 +132,7 @@ Value* UpdateDynamicPartitionsFn(const char* name, State* state,
 
   auto updater_runtime = state->updater->GetRuntime();
   if (!updater_runtime->UpdateDynamicPartitions(
-          op_list_value->data, argv.size() > 1 ? super_empty_value->data : empty_string_view)) {
+          op_list_value->data(), argv.size() > 1 ? super_empty_value->data() : empty_string_view)) {
     return StringValue("");
   }
 
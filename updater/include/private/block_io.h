@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "otautil/rangeset.h"
+
+// Positional block I/O helpers for the block-based OTA commands. They don't use or change the file
+// offset of the given fd, so they can be called from multiple threads on the same fd. Adjacent
+// ranges in the given RangeSet are merged into a single transfer, and each transfer is retried
+// until complete. On failure, they return false with errno set (or errno == 0 on an unexpected
+// end of file), and the caller is expected to log the error.
+
+// Reads the blocks in 'ranges' from 'fd' into 'buffer', packed in the order given by 'ranges'.
+bool ReadBlocksAt(int fd, const RangeSet& ranges, size_t block_size, uint8_t* buffer);
+
+// Reads the blocks in 'ranges' from 'fd' into 'buffer', where the i-th block of 'ranges' goes to
+// the i-th block of 'locations' (as with the <src_loc> of a block image command), so the blocks
+// land in place rather than packed. Both RangeSet's must have the same number of blocks.
+bool ReadBlocksAt(int fd, const RangeSet& ranges, size_t block_size, uint8_t* buffer,
+                  const RangeSet& locations);
+
+// Writes the packed data in 'buffer' to the blocks in 'ranges'.
+bool WriteBlocksAt(int fd, const RangeSet& ranges, size_t block_size, const uint8_t* buffer);
+
+// Fills the blocks in 'ranges' with zeros. Each extent is zeroed by the kernel where it can:
+// BLKZEROOUT on a block device, FALLOC_FL_ZERO_RANGE on a file. Without that support, it writes a
+// shared zero block through up to IOV_MAX iovecs per pwritev(2) call.
+bool ZeroBlocksAt(int fd, const RangeSet& ranges, size_t block_size);
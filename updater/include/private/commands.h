@@ -19,8 +19,11 @@
 #include <stdint.h>
 
 #include <functional>
+#include <map>
 #include <ostream>
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <gtest/gtest_prod.h>  // FRIEND_TEST
@@ -135,10 +138,19 @@ class SourceInfo {
     return hash_;
   }
 
+  // The block ranges to be read from the source image, which may be empty for stash-only sources.
+  const RangeSet& ranges() const {
+    return ranges_;
+  }
+
   size_t blocks() const {
     return blocks_;
   }
 
+  const std::vector<StashInfo>& stashes() const {
+    return stashes_;
+  }
+
   bool operator==(const SourceInfo& other) const {
     return hash_ == other.hash_ && ranges_ == other.ranges_ && location_ == other.location_ &&
            stashes_ == other.stashes_;
@@ -232,7 +244,7 @@ class HashTreeInfo {
 
 // Command class holds the info for an update command that performs block-based OTA (BBOTA). Each
 // command consists of one or several args, namely TargetInfo, SourceInfo, StashInfo and PatchInfo.
-// The currently used BBOTA version is v4.
+// The currently used BBOTA version is v4. v5 adds segmented patches (see bsdiff / imgdiff below).
 //
 //    zero <tgt_ranges>
 //      - Fill the indicated blocks with zeros.
@@ -269,6 +281,14 @@ class HashTreeInfo {
 //                                       <[stash_id:stash_location] ...>
 //          (loads data from both of source image and stashes)
 //
+//      Since v5, the patch may be a segmented patch instead: the "SEGDIFF1" magic, followed by
+//      the segment count and, for each segment, six little-endian fields (u32 source start block,
+//      u32 source block count, u32 target start block, u32 target block count, u64 patch offset,
+//      u64 patch length). Each segment is a bsdiff (or imgdiff) patch of its own from the given
+//      window of the source blocks to the given blocks of the target ranges, where the blocks are
+//      counted in the order they are loaded and written. The target windows cover the target
+//      ranges in order, so the segments can be applied in parallel.
+//
 //    stash <stash_id> <src_ranges>
 //      - Load the given source blocks and stash the data in the given slot of the stash table.
 //      - Meaningful args: StashInfo
@@ -407,6 +427,88 @@ class Command {
 
 std::ostream& operator<<(std::ostream& os, const Command& command);
 
+// Splits the given commands into batches of consecutive commands that don't depend on each other,
+// so that the commands within a batch can be executed in any order, or concurrently. Only the
+// zero, move, bsdiff and imgdiff commands that neither use stashes nor read their own target
+// blocks can share a batch, as long as no command in the batch writes the blocks that another one
+// reads or writes. Commands whose source and target blocks add up to more than 'max_blocks', and
+// all the other commands, are put in batches of their own. Each batch holds at most
+// 'max_batch_size' commands. Returns the [begin, end) positions of the batches in 'commands', which
+// cover all the commands in order.
+std::vector<std::pair<size_t, size_t>> GroupIndependentCommands(const std::vector<Command>& commands,
+                                                                size_t max_batch_size,
+                                                                size_t max_blocks);
+
+// Finds the stashes that don't need to be saved to survive an interrupted update, because they can
+// be recreated by resuming the update from the stash command itself. That holds if the stash gets
+// freed within 'max_window' commands, and none of the commands after the stash command up to the
+// last one that uses the stash writes the blocks that an earlier command in that span reads or
+// writes (so that the span can be executed again). Returns a map from the index of each such stash
+// command to the index of the last command that uses the stash (or the stash command itself if the
+// stash is never used). Invalid commands in 'commands' are taken as unknown, ending the search.
+std::map<size_t, size_t> FindReplayableStashes(const std::vector<Command>& commands,
+                                               size_t max_window);
+
+// The stash and free commands that only change the reference count of a stash. Stash ids are the
+// SHA-1 of the stashed data, so a stash command whose id is still held by an earlier one (stashed,
+// and not freed as many times since) has nothing to stash, and a free command that leaves the stash
+// held by another stash command must keep the data.
+struct StashReferences {
+  // The indices of the stash commands whose stash is already held.
+  std::set<size_t> held_stashes;
+  // The indices of the free commands after which the stash is still held.
+  std::set<size_t> held_frees;
+};
+
+// Counts the references to the stashes over 'commands', which must start from the first command of
+// the transfer list for the counts to hold when resuming an update. Invalid commands are skipped.
+StashReferences CountStashReferences(const std::vector<Command>& commands);
+
+// Where the stashes of a transfer list go, worked out ahead of the update by going through its
+// commands (see PlanStashes()).
+struct StashPlan {
+  // The indices of the stash commands whose stash is kept in memory.
+  std::set<size_t> memory_stashes;
+  // For each of the other replayable stash commands, the blocks of memory that the stashes planned
+  // in memory leave over from the stash command up to its free command. Its stash can still be
+  // kept in memory if it compresses into that much (along with the other such stashes).
+  std::map<size_t, size_t> memory_headroom;
+  // The most blocks in the stash files at any one time, and the index of the first command that
+  // reaches it.
+  size_t peak_blocks{ 0 };
+  size_t peak_index{ 0 };
+};
+
+// Plans the stashes over 'commands', as the update executes them. The stashes of the replayable
+// stash commands ('replayable_stashes', from FindReplayableStashes()) are kept in memory while
+// their blocks fit in 'memory_budget_blocks'; the others go to stash files, which start with the
+// 'existing_stashes' (from an interrupted update, as a map from the ids to the blocks). The counts
+// in 'references' (from CountStashReferences()) are honored, and each move, bsdiff or imgdiff
+// command whose source overlaps its target stashes its source blocks to a file for the duration of
+// the command. Invalid commands are skipped.
+StashPlan PlanStashes(const std::vector<Command>& commands, const StashReferences& references,
+                      const std::map<size_t, size_t>& replayable_stashes,
+                      size_t memory_budget_blocks,
+                      const std::map<std::string, size_t>& existing_stashes);
+
+// The plan for the SourceBlockCache of an update (see PlanSourceCache()).
+struct SourceCachePlan {
+  // For each command whose source blocks are read again by a later command before they get
+  // written, the positions of those blocks (in the order of its source blocks), to be cached.
+  std::map<size_t, RangeSet> keep;
+  // The indices of the commands that find all of their source blocks in the cache, and so don't
+  // need them read ahead.
+  std::set<size_t> hits;
+};
+
+// Plans a SourceBlockCache of 'capacity' blocks over 'commands', as the update executes them: each
+// stash, move, bsdiff and imgdiff command looks up its source blocks in the cache, then caches the
+// ones that a later command reads again before they get written. The blocks written by any
+// command get dropped. The commands in 'uncached' (e.g. the ones run in batches) don't use the
+// cache. Invalid commands are skipped.
+SourceCachePlan PlanSourceCache(const std::vector<Command>& commands, size_t capacity,
+                                const std::set<size_t>& uncached);
+
 // TransferList represents the info for a transfer list, which is parsed from input text lines
 // containing commands to transfer data from one place to another on the target partition.
 //
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string_view>
+
+// Where the new data of block_image_update() goes once decoded.
+class NewDataSink {
+ public:
+  virtual ~NewDataSink() = default;
+
+  // Blocks until there is free space. Returns the start of the contiguous free space and sets
+  // |size| to its length; or returns nullptr if the data is no longer wanted.
+  virtual uint8_t* AcquireSpace(size_t* size) = 0;
+
+  // Publishes |size| bytes that have been written to the space returned by AcquireSpace().
+  virtual void CommitSpace(size_t size) = 0;
+
+  // Copies |size| bytes from |data|. Returns false if the data is no longer wanted.
+  bool Write(const uint8_t* data, size_t size);
+};
+
+// Decodes the new data, fed in chunks as it's read from the package, into a NewDataSink.
+class NewDataDecoder {
+ public:
+  virtual ~NewDataDecoder() = default;
+
+  // Decodes the next |size| bytes of the input. Returns false on errors, or if the sink no longer
+  // wants the data.
+  virtual bool Decode(const uint8_t* data, size_t size) = 0;
+
+  // Flushes the rest of the data at the end of the input. Returns false on errors, including a
+  // truncated input.
+  virtual bool Finish() = 0;
+};
+
+// Zstandard frames that record a content size of up to this much are decoded in parallel.
+static constexpr size_t kMaxZstdParallelFrameSize = 8 * 1024 * 1024;
+
+// Returns the decoder for the new data entry |name|, picked by its extension:
+//   .br   Brotli.
+//   .zst  Zstandard. The frames up to kMaxZstdParallelFrameSize are decoded on up to |max_workers|
+//         threads, so the OTA generator should split the data into independent frames of a few
+//         MiB; others are decoded as a stream.
+//   .lz4  LZ4 frames.
+// Any other entry is taken as is.
+// The first |skip| bytes of the output are dropped rather than written to the sink, e.g. for the
+// new data written before an interrupted update. The zstd frames that fall in there whole, and
+// record their content size of up to kMaxZstdParallelFrameSize, are skipped without decoding them;
+// the rest of the data is decoded and dropped.
+std::unique_ptr<NewDataDecoder> CreateNewDataDecoder(std::string_view name, NewDataSink* sink,
+                                                     size_t max_workers, uint64_t skip = 0);
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/stat.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// The properties of a getprop-style file, e.g. build.prop: a "key=value" pair per line, with the
+// whitespace around the keys and the values trimmed. Blank lines, "#" comments and lines without
+// '=' are ignored. If a key is defined more than once, the first definition wins.
+class PropertyFile {
+ public:
+  explicit PropertyFile(std::string_view content);
+
+  // Returns the value of |key|, or nullptr if it isn't defined.
+  const std::string* Find(std::string_view key) const;
+
+  const std::map<std::string, std::string, std::less<>>& properties() const {
+    return properties_;
+  }
+
+ private:
+  std::map<std::string, std::string, std::less<>> properties_;
+};
+
+// PropertyFileCache keeps the parsed property files, so that the scripts that check the same
+// build.prop for many fingerprints read and parse it only once. A cached file is used for as long
+// as the file at its path has the same device, inode, size and mtime. It can be used from several
+// threads.
+class PropertyFileCache {
+ public:
+  static PropertyFileCache& Get();
+
+  // Returns the properties of the file at |path|, reading it with |read| unless the cached copy is
+  // still current, or nullptr if it can't be read. The files that can't be stat()'d (e.g. those
+  // that the simulator fakes) are read every time.
+  std::shared_ptr<const PropertyFile> Load(const std::string& path,
+                                           const std::function<bool(std::string*)>& read);
+
+  void Clear();
+
+ private:
+  struct Entry {
+    struct stat st;
+    std::shared_ptr<const PropertyFile> properties;
+  };
+
+  std::mutex mutex_;
+  std::map<std::string, Entry, std::less<>> entries_;
+};
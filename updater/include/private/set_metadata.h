@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <string>
+
+// The metadata that set_metadata() and set_metadata_recursive() apply, for the keys they're given.
+struct perm_parsed_args {
+  bool has_uid;
+  uid_t uid;
+  bool has_gid;
+  gid_t gid;
+  bool has_mode;
+  mode_t mode;
+  bool has_fmode;
+  mode_t fmode;
+  bool has_dmode;
+  mode_t dmode;
+  bool has_selabel;
+  const char* selabel;
+  bool has_capabilities;
+  uint64_t capabilities;
+};
+
+// Called with the message of each change that fails. It may be called from several threads, but
+// one at a time.
+using MetadataReporter = std::function<void(const std::string&)>;
+
+// Applies |parsed| to |path|, whose lstat() is |st|. The changes that the file already has (e.g. its
+// uid, or its label) are skipped. Returns the number of changes that failed.
+size_t ApplyMetadata(const std::string& path, const struct stat& st, const perm_parsed_args& parsed,
+                     const MetadataReporter& report);
+
+// Applies |parsed| to |path| and, if it's a directory, to everything beneath it, without following
+// symlinks. The walk goes through the directories by their fds, and each directory gets its own
+// metadata after its contents, so that a mode without the search permission doesn't stop it. The
+// subdirectories of |path| are spread over up to |workers| threads. Returns the number of changes
+// that failed, counting the directories that can't be read.
+size_t ApplyMetadataRecursive(const std::string& path, const struct stat& st,
+                              const perm_parsed_args& parsed, size_t workers,
+                              const MetadataReporter& report);
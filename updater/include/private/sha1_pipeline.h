@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <openssl/sha.h>
+
+#include "otautil/rangeset.h"
+
+// Sha1Pipeline computes the SHA-1 of a stream of chunks on a worker thread, so that the caller can
+// read the next chunk while the previous ones are being hashed. The hashing itself is BoringSSL's
+// SHA-1, which uses the ARMv8 (or x86 SHA) instructions when the CPU has them.
+//
+// The submitted data is owned by the caller, and must stay valid until it has been hashed (see
+// Wait()). A single chunk is hashed inline by Finish(), without starting the worker thread.
+class Sha1Pipeline {
+ public:
+  Sha1Pipeline();
+  ~Sha1Pipeline();
+
+  // Queues |size| bytes at |data| for hashing, after the chunks submitted earlier.
+  void Submit(const uint8_t* data, size_t size);
+
+  // Waits until at most |max_pending| of the submitted chunks remain to be hashed, so that the
+  // caller can reuse the memory of the others.
+  void Wait(size_t max_pending);
+
+  // Hashes the remaining chunks and writes the SHA-1 of all the submitted data to |digest|. No
+  // chunks can be submitted afterwards.
+  void Finish(uint8_t digest[SHA_DIGEST_LENGTH]);
+
+ private:
+  void Run();
+
+  SHA_CTX ctx_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // The submitted chunks that haven't been hashed, including the one being hashed.
+  std::deque<std::pair<const uint8_t*, size_t>> pending_;
+  bool finished_{ false };
+  std::thread worker_;
+
+  Sha1Pipeline(const Sha1Pipeline&) = delete;
+  Sha1Pipeline& operator=(const Sha1Pipeline&) = delete;
+};
+
+// Reads the blocks in 'ranges' from 'fd' and computes their SHA-1, hashing each chunk while the
+// next one is being read. Returns false on read failures, with errno set as in ReadBlocksAt().
+bool Sha1BlocksAt(int fd, const RangeSet& ranges, size_t block_size,
+                  uint8_t digest[SHA_DIGEST_LENGTH]);
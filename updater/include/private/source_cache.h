@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "otautil/rangeset.h"
+
+/**
+ * SourceBlockCache holds the source blocks that the commands of a block image update read, for the
+ * later commands that read them again, e.g. a stash and a bsdiff from the same area. It's bounded
+ * to |capacity| blocks, and evicts the least recently used ones. The blocks that get written must
+ * be dropped with Invalidate().
+ *
+ * With a |block_size| of 0, it only tracks which blocks are cached, for PlanSourceCache() to
+ * predict the hits of the real one. It's not thread-safe.
+ */
+class SourceBlockCache {
+ public:
+  SourceBlockCache(size_t capacity, size_t block_size)
+      : capacity_(capacity), block_size_(block_size) {}
+
+  // Caches the blocks at |positions| (in the order of the blocks in |src|) of the data read from
+  // |src|, packed in |data|.
+  void Put(const RangeSet& src, const RangeSet& positions, const uint8_t* data);
+
+  // Copies the blocks in |src| into |buffer|, packed, if they're all cached. Returns false
+  // otherwise.
+  bool Get(const RangeSet& src, uint8_t* buffer);
+
+  // Drops the cached blocks in |ranges|.
+  void Invalidate(const RangeSet& ranges);
+
+  size_t size() const {
+    return index_.size();
+  }
+
+  size_t hits() const {
+    return hits_;
+  }
+
+ private:
+  struct Slot {
+    size_t block;
+    // Where the data of the block is in data_.
+    size_t offset;
+  };
+
+  // Returns the slot of |block|, moved to the most recently used end, or nullptr if not cached.
+  Slot* Touch(size_t block);
+
+  size_t capacity_;
+  size_t block_size_;
+  // The data of all the slots, allocated on first use.
+  std::vector<uint8_t> data_;
+  // The offsets in data_ that no slot holds.
+  std::vector<size_t> free_offsets_;
+  // The slots, from the least to the most recently used.
+  std::list<Slot> lru_;
+  std::unordered_map<size_t, std::list<Slot>::iterator> index_;
+  size_t hits_{ 0 };
+};
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/sha.h>
+
+#include "otautil/rangeset.h"
+
+// The tree hash of a RangeSet, as computed by the range_sha256_tree() builtin, splits the blocks
+// in the RangeSet (in the order it gives) into segments of |kTreeHashSegmentSize| bytes, the last
+// one possibly shorter. The hash is the SHA-256 of the concatenated SHA-256 digests of the
+// segments, so unlike the SHA-1 of range_sha1(), the segments can be read and hashed in parallel.
+//
+// The segment size is part of the format: the OTA generator must use the same one.
+static constexpr size_t kTreeHashSegmentSize = 2 * 1024 * 1024;
+
+// Reads the blocks in 'ranges' from 'fd' and computes their tree hash, on up to |max_workers|
+// threads (at least one). Returns false on read failures, with errno set as in ReadBlocksAt().
+bool Sha256TreeBlocksAt(int fd, const RangeSet& ranges, size_t block_size, size_t max_workers,
+                        uint8_t digest[SHA256_DIGEST_LENGTH]);
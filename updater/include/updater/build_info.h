@@ -51,6 +51,10 @@ class BuildInfo {
   std::string FindBlockDeviceName(const std::string_view name) const;
   // Parses the given target-file, initializes the build properties and extracts the images.
   bool ParseTargetFile(const std::string_view target_file_path, bool extracted_input);
+  // Points the fake block devices to copies of their images, created under |work_dir| and kept in
+  // |clones|, so that an update runs against its own set of block devices. The copies share their
+  // blocks with the images where the filesystem supports reflinks.
+  bool CloneFakeBlockDevices(const std::string_view work_dir, std::list<TemporaryFile>* clones);
 
   std::string GetOemSettings() const {
     return oem_settings_;
@@ -58,6 +62,11 @@ class BuildInfo {
   void SetOemSettings(const std::string_view oem_settings) {
     oem_settings_ = oem_settings;
   }
+  // Sets a directory to keep the extracted images of the source builds in, across simulations. See
+  // SourceImageCache.
+  void SetSourceCacheDir(const std::string_view source_cache_dir) {
+    source_cache_dir_ = source_cache_dir;
+  }
 
  private:
   // A map to store the system properties during simulation.
@@ -71,4 +80,5 @@ class BuildInfo {
   std::list<TemporaryFile> temp_files_;
   std::string work_dir_;  // A temporary directory to store the extracted image files
   bool keep_images_;
+  std::string source_cache_dir_;
 };
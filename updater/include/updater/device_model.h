@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// The speeds of the storage and the CPU of a device, to estimate how long the block image updates
+// of a package would take on it. A profile is a property file of the following keys; a missing key
+// is free (no latency, or unlimited throughput). The throughputs are in MB/s (10^6 bytes).
+//
+//   read_latency_us     The time of each read request.
+//   read_mbps           The read throughput.
+//   write_latency_us    The time of each write request.
+//   write_mbps          The write throughput.
+//   discard_latency_us  The time of each BLKDISCARD.
+//   discard_mbps        The discard throughput.
+//   fsync_latency_us    The time of each fsync().
+//   hash_mbps           The throughput of SHA-1 (and of the hash tree hashing).
+//   patch_mbps          The output throughput of bspatch and imgpatch.
+struct DeviceProfile {
+  double read_latency_us = 0;
+  double read_mbps = 0;
+  double write_latency_us = 0;
+  double write_mbps = 0;
+  double discard_latency_us = 0;
+  double discard_mbps = 0;
+  double fsync_latency_us = 0;
+  double hash_mbps = 0;
+  double patch_mbps = 0;
+
+  // Parses the profile in |content|. Returns std::nullopt (after logging why) for an unknown key or
+  // a value that isn't a non-negative number.
+  static std::optional<DeviceProfile> Parse(std::string_view content);
+};
+
+// InstallTimeEstimate estimates the time the commands of block image updates would take on the
+// device of a profile, from the I/O counts in their traces (see kTraceCommandsProperty in
+// blockimg.cpp). The host timings of the trace are ignored. The estimate covers the I/O, the
+// hashing and the patching of the commands, but not the rest of the script, nor the inflating of
+// the new data of the package.
+class InstallTimeEstimate {
+ public:
+  explicit InstallTimeEstimate(const DeviceProfile& profile) : profile_(profile) {}
+
+  // Adds the commands of the CSV |trace|, as written by blockimg. Returns false if it's malformed.
+  bool AddTrace(std::string_view trace);
+
+  // The estimated time of all the commands added, in seconds.
+  double seconds() const {
+    return seconds_;
+  }
+
+  // Returns the report of the estimate: the total, then per partition and per command.
+  std::string Summary() const;
+
+ private:
+  struct CommandCost {
+    size_t count = 0;
+    uint64_t blocks = 0;
+    double seconds = 0;
+  };
+
+  DeviceProfile profile_;
+  double seconds_ = 0;
+  // The costs per partition, then per command.
+  std::map<std::string, std::map<std::string, CommandCost>> costs_;
+};
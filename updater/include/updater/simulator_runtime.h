@@ -34,6 +34,12 @@ class SimulatorRuntime : public UpdaterRuntimeInterface {
     return true;
   }
 
+  // Makes the block image updates write the traces of their commands, to estimate their time on a
+  // device (see InstallTimeEstimate).
+  void set_trace_commands(bool trace_commands) {
+    trace_commands_ = trace_commands;
+  }
+
   std::string GetProperty(const std::string_view key,
                           const std::string_view default_value) const override;
 
@@ -60,5 +66,6 @@ class SimulatorRuntime : public UpdaterRuntimeInterface {
   std::string FindBlockDeviceName(const std::string_view name) const override;
 
   BuildInfo* source_;
+  bool trace_commands_{ false };
   std::map<std::string, std::string, std::less<>> mounted_partitions_;
 };
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include <android-base/file.h>
+
+// Copies the image file |src_fd| over |dst_fd|, as a reflink (FICLONE) if the filesystem supports
+// it, or else copying only its data, so that its holes stay holes. Returns true on success.
+bool CloneImageFile(int src_fd, int dst_fd);
+
+// This class keeps the raw images extracted from a source target file in a cache directory, so
+// that later simulations against the same source build start from a copy of them instead of
+// extracting them again. The images of each target file live under <cache_dir>/<key>, where the
+// key is TargetFile::GetContentDigest(). The copies are made with CloneImageFile(), so that a run
+// only costs the blocks the OTA writes where the filesystem supports reflinks.
+class SourceImageCache {
+ public:
+  SourceImageCache(const std::string_view cache_dir, const std::string_view key);
+
+  // Copies the cached image of |entry_name| into |image_file|. Returns false if it isn't cached.
+  bool Get(const std::string_view entry_name, TemporaryFile* image_file) const;
+  // Adds |image_file| to the cache as the image of |entry_name|. Returns true on success.
+  bool Put(const std::string_view entry_name, const TemporaryFile& image_file) const;
+
+ private:
+  std::string GetImagePath(const std::string_view entry_name) const;
+
+  std::string dir_;
+};
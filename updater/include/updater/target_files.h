@@ -17,11 +17,13 @@
 #pragma once
 
 #include <map>
+#include <memory>
 #include <string>
 #include <string_view>
 #include <vector>
 
 #include <android-base/file.h>
+#include <android-base/mapped_file.h>
 #include <ziparchive/zip_archive.h>
 
 // This class represents the mount information for each line in a fstab file.
@@ -44,7 +46,13 @@ class TargetFile {
   TargetFile(std::string path, bool extracted_input)
       : path_(std::move(path)), extracted_input_(extracted_input) {}
 
-  // Opens the input target file (or extracted directory) and parses the misc_info.txt.
+  ~TargetFile();
+
+  TargetFile(const TargetFile&) = delete;
+  TargetFile& operator=(const TargetFile&) = delete;
+
+  // Opens the input target file (or extracted directory), indexes its entries and parses the
+  // misc_info.txt.
   bool Open();
   // Parses the build properties in all possible locations and save them in |props_map|
   bool GetBuildProps(std::map<std::string, std::string, std::less<>>* props_map) const;
@@ -52,19 +60,40 @@ class TargetFile {
   bool ParseFstabInfo(std::vector<FstabInfo>* fstab_info_list) const;
   // Returns true if the given entry exists in the target file.
   bool EntryExists(const std::string_view name) const;
-  // Extracts the image file |entry_name|. Returns true on success.
+  // Computes a digest of the contents of a zipped target file into |digest|, from the names, sizes
+  // and CRCs of its entries (which doesn't need to read them). Returns false for an extracted
+  // directory.
+  bool GetContentDigest(std::string* digest) const;
+  // Extracts the image file |entry_name|. Returns true on success. Each TargetFile has its own zip
+  // handle, so images may be extracted at once through different instances.
   bool ExtractImage(const std::string_view entry_name, const FstabInfo& fstab_info,
                     const std::string_view work_dir, TemporaryFile* image_file) const;
 
  private:
-  // Wrapper functions to read the entry from either the zipped target-file, or the extracted input
+  // An entry of the target file, as indexed by Open().
+  struct Entry {
+    uint64_t size;         // The uncompressed size.
+    ZipEntry64 zip_entry;  // Where the entry is in the zip; unused for an extracted directory.
+  };
+
+  // Builds |entries_| from the central directory of the zip, or from the files of the extracted
   // directory.
+  bool IndexEntries();
+  // Wrapper functions to read the entry from either the zipped target-file, or the extracted input
+  // directory. ReadEntry() points |content| into the mapped zip for a stored entry, and into
+  // |storage| otherwise.
+  bool ReadEntry(const std::string_view name, std::string* storage,
+                 std::string_view* content) const;
   bool ReadEntryToString(const std::string_view name, std::string* content) const;
   bool ExtractEntryToTempFile(const std::string_view name, TemporaryFile* temp_file) const;
 
   std::string path_;      // Path to the zipped target-file or an extracted directory.
   bool extracted_input_;  // True if the target-file has been extracted.
   ZipArchiveHandle handle_{ nullptr };
+  // The whole zipped target-file, to read the stored entries from without copying them. Null if
+  // it can't be mapped, in which case they are read through libziparchive.
+  std::unique_ptr<android::base::MappedFile> mapped_zip_;
+  std::map<std::string, Entry, std::less<>> entries_;
 
   // The properties under META/misc_info.txt
   std::map<std::string, std::string, std::less<>> misc_info_;
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include "private/commands.h"
+
+// The analysis of a transfer list, computed from its commands alone (without executing anything),
+// to tell how the update would run on a device, and how the generator of the package or the
+// execution could do better.
+struct TransferListAnalysis {
+  // The number of commands, per command.
+  std::map<std::string, size_t> command_counts;
+
+  // The blocks written to the target, and the distinct target blocks among them.
+  uint64_t blocks_written = 0;
+  uint64_t unique_blocks_written = 0;
+  // The blocks read from the device, for the commands and for the stashes.
+  uint64_t blocks_read = 0;
+  // The blocks written to the stash, and loaded back from it.
+  uint64_t blocks_stashed = 0;
+  uint64_t blocks_loaded_from_stash = 0;
+  // The blocks of new data, and the bytes of patches.
+  uint64_t new_blocks = 0;
+  uint64_t patch_bytes = 0;
+  // The end of the last patch, which patch.dat must reach.
+  uint64_t patch_data_end = 0;
+
+  // The peak of the stash, in blocks and in entries, as the commands run in order.
+  size_t peak_stash_blocks = 0;
+  size_t peak_stash_entries = 0;
+
+  // The work of all the commands, and of the longest chain of commands that depend on one another
+  // (through the blocks they read and write, or the stashes), in blocks read and written. Their
+  // ratio is the speedup that running the independent commands at once could give at best.
+  uint64_t total_work = 0;
+  uint64_t critical_path_work = 0;
+  size_t critical_path_commands = 0;
+  // The number of batches of consecutive independent commands (see GroupIndependentCommands()).
+  size_t independent_batches = 0;
+
+  // The number of commands per number of target ranges, bucketed by powers of two (1, 2-3, 4-7,
+  // ...), and the number of ranges (source and target) per size in blocks, bucketed likewise.
+  std::map<size_t, size_t> ranges_per_command;
+  std::map<size_t, size_t> blocks_per_range;
+
+  // Returns the report of the analysis.
+  std::string Report() const;
+};
+
+// Analyzes the commands of |transfer_list| into |analysis|. Returns false, and sets |err|, if the
+// commands are inconsistent (e.g. a stash is used before it's stashed).
+bool AnalyzeTransferList(const TransferList& transfer_list, TransferListAnalysis* analysis,
+                         std::string* err);
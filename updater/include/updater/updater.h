@@ -23,12 +23,14 @@
 #include <string>
 #include <string_view>
 
+#include <android-base/unique_fd.h>
 #include <ziparchive/zip_archive.h>
 
 #include "edify/expr.h"
 #include "edify/updater_interface.h"
 #include "otautil/error_code.h"
 #include "otautil/sysutil.h"
+#include "otautil/updater_commands.h"
 
 class Updater : public UpdaterInterface {
  public:
@@ -51,6 +53,9 @@ class Updater : public UpdaterInterface {
   // Sends over the message to recovery to print it on the screen.
   void UiPrint(const std::string_view message) const override;
 
+  void ShowProgress(double fraction, int seconds) const override;
+  void SetProgress(double fraction, bool flush = false) const override;
+
   std::string FindBlockDeviceName(const std::string_view name) const override;
 
   UpdaterRuntimeInterface* GetRuntime() const override {
@@ -68,6 +73,9 @@ class Updater : public UpdaterInterface {
   size_t GetMappedPackageLength() const override {
     return mapped_package_.length;
   }
+  int GetPackageFd() const override {
+    return package_fd_.get();
+  }
 
  private:
   friend class UpdaterTestBase;
@@ -82,14 +90,21 @@ class Updater : public UpdaterInterface {
   // Parses the error code embedded in state->errmsg; and reports the error code and cause code.
   void ParseAndReportErrorCode(State* state);
 
+  // Sends |command| to recovery, as a frame if recovery has offered the binary form of the
+  // protocol, or a text line otherwise.
+  void SendCommand(const UpdaterCommand& command, bool flush = false) const;
+
   std::unique_ptr<UpdaterRuntimeInterface> runtime_;
 
   MemMapping mapped_package_;
+  android::base::unique_fd package_fd_;
   ZipArchiveHandle package_handle_{ nullptr };
   std::string updater_script_;
 
   bool is_retry_{ false };
   std::unique_ptr<FILE, decltype(&fclose)> cmd_pipe_{ nullptr, fclose };
+  // Whether the commands go as frames, see otautil/updater_commands.h.
+  bool binary_commands_{ false };
 
   std::string result_;
   std::vector<std::string> skipped_functions_;
@@ -19,27 +19,25 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <ftw.h>
 #include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/capability.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <sys/xattr.h>
 #include <time.h>
 #include <unistd.h>
 #include <utime.h>
 
-#include <linux/xattr.h>
-
+#include <algorithm>
 #include <limits>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -57,6 +55,7 @@
 #include <selinux/label.h>
 #include <selinux/selinux.h>
 #include <ziparchive/zip_archive.h>
+#include <zlib.h>
 
 #include "edify/expr.h"
 #include "edify/updater_interface.h"
@@ -65,7 +64,10 @@
 #include "otautil/error_code.h"
 #include "otautil/print_sha1.h"
 #include "otautil/sysutil.h"
+#include "otautil/thermal_throttle.h"
 #include "otautil/ziputil.h"
+#include "private/property_file.h"
+#include "private/set_metadata.h"
 
 #ifndef __ANDROID__
 #include <cutils/memory.h>  // for strlcpy
@@ -124,6 +126,15 @@ Value* UIPrintFn(const char* name, State* state, const std::vector<std::unique_p
   return StringValue(buffer);
 }
 
+// The most entries that package_extract_dir() and package_extract_file() inflate at a time, fewer
+// as the device heats up.
+static constexpr size_t kMaxExtractionWorkers = 4;
+
+static size_t ExtractionWorkers() {
+  return ThermalThrottle::Get().Scale(
+      std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxExtractionWorkers));
+}
+
 // package_extract_dir(package_dir, dest_dir)
 //   Extracts all files from the package underneath package_dir and writes them to the
 //   corresponding tree beneath dest_dir. Any existing files are overwritten.
@@ -151,73 +162,165 @@ Value* PackageExtractDirFn(const char* name, State* state,
   // To create a consistent system image, never use the clock for timestamps.
   constexpr struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
+  // Stored entries (e.g. firmware blobs) are copied straight from the mapped package.
+  ExtractionSource source{ updater->GetMappedPackageAddress(), updater->GetMappedPackageLength(),
+                           updater->GetPackageFd() };
   bool success = ExtractPackageRecursive(za, zip_path, dest_path, &timestamp,
-                                         updater->GetRuntime()->sehandle());
+                                         updater->GetRuntime()->sehandle(), ExtractionWorkers(),
+                                         kMaxExtractionBytesInFlight,
+                                         source.addr != nullptr ? &source : nullptr);
 
   return StringValue(success ? "t" : "");
 }
 
-// package_extract_file(package_file[, dest_file])
+// Streams |zip_path| from the package to |dest_path|, checking it against |expected_digest| (the
+// hex SHA-1 or SHA-256 of its contents) as it's written, and moving the progress bar through the
+// current segment.
+static bool StreamPackageFile(const char* name, State* state, const std::string& zip_path,
+                              std::string dest_path, const std::string& expected_digest) {
+  bool use_sha256;
+  if (expected_digest.size() == SHA_DIGEST_LENGTH * 2) {
+    use_sha256 = false;
+  } else if (expected_digest.size() == SHA256_DIGEST_LENGTH * 2) {
+    use_sha256 = true;
+  } else {
+    LOG(ERROR) << name << ": invalid digest \"" << expected_digest << "\" for " << zip_path;
+    return false;
+  }
+
+  ZipArchiveHandle za = state->updater->GetPackageHandle();
+  ZipEntry64 entry;
+  if (FindEntry(za, zip_path, &entry) != 0) {
+    LOG(ERROR) << name << ": no " << zip_path << " in package";
+    return false;
+  }
+  if (std::string block_device_name = state->updater->FindBlockDeviceName(dest_path);
+      !block_device_name.empty()) {
+    dest_path = block_device_name;
+  }
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(
+      open(dest_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)));
+  if (fd == -1) {
+    PLOG(ERROR) << name << ": can't open " << dest_path << " for write";
+    return false;
+  }
+
+  SHA_CTX sha1_ctx;
+  SHA256_CTX sha256_ctx;
+  SHA1_Init(&sha1_ctx);
+  SHA256_Init(&sha256_ctx);
+  uint64_t written_bytes = 0;
+  auto written = [&](const uint8_t* data, size_t size) {
+    if (use_sha256) {
+      SHA256_Update(&sha256_ctx, data, size);
+    } else {
+      SHA1_Update(&sha1_ctx, data, size);
+    }
+    written_bytes += size;
+    state->updater->SetProgress(static_cast<double>(written_bytes) / entry.uncompressed_length);
+  };
+  ExtractionSource source{ state->updater->GetMappedPackageAddress(),
+                           state->updater->GetMappedPackageLength(),
+                           state->updater->GetPackageFd() };
+  if (!StreamEntryToFile(za, { entry, dest_path, nullptr }, fd, written,
+                         source.addr != nullptr ? &source : nullptr)) {
+    return false;
+  }
+  if (close(fd.release()) != 0) {
+    PLOG(ERROR) << name << ": failed to close " << dest_path;
+    return false;
+  }
+
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  std::string actual_digest;
+  if (use_sha256) {
+    SHA256_Final(digest, &sha256_ctx);
+    actual_digest = print_hex(digest, SHA256_DIGEST_LENGTH);
+  } else {
+    SHA1_Final(digest, &sha1_ctx);
+    actual_digest = print_sha1(digest);
+  }
+  if (!android::base::EqualsIgnoreCase(actual_digest, expected_digest)) {
+    LOG(ERROR) << name << ": " << dest_path << " has digest " << actual_digest << ", expected "
+               << expected_digest;
+    return false;
+  }
+  return true;
+}
+
+// package_extract_file(package_file[, dest_file[, package_file2, dest_file2, ...]])
 //   Extracts a single package_file from the update package and writes it to dest_file,
 //   overwriting existing files if necessary. Without the dest_file argument, returns the
-//   contents of the package file as a binary blob.
+//   contents of the package file as a binary blob. With several package_file and dest_file pairs,
+//   extracts them all, inflating several entries at a time (e.g. a set of firmware images); it
+//   succeeds only if every one of them does.
+//
+// package_extract_file(package_file, dest_file, digest)
+//   Streams package_file to dest_file (e.g. a firmware image to its block device) in a single pass,
+//   with a chunk in memory at a time, and checks that what it wrote has the given SHA-1 or SHA-256
+//   (in hex), with no need to read it back. It moves the progress bar through the segment of the
+//   last show_progress(, 0) as it writes, like set_progress().
 Value* PackageExtractFileFn(const char* name, State* state,
                             const std::vector<std::unique_ptr<Expr>>& argv) {
-  if (argv.size() < 1 || argv.size() > 2) {
-    return ErrorAbort(state, kArgsParsingFailure, "%s() expects 1 or 2 args, got %zu", name,
-                      argv.size());
+  if (argv.empty() || (argv.size() > 3 && argv.size() % 2 != 0)) {
+    return ErrorAbort(state, kArgsParsingFailure,
+                      "%s() expects 1 arg, 3 args or pairs of args, got %zu", name, argv.size());
   }
 
-  if (argv.size() == 2) {
-    // The two-argument version extracts to a file.
-
+  if (argv.size() == 3) {
     std::vector<std::string> args;
     if (!ReadArgs(state, argv, &args)) {
       return ErrorAbort(state, kArgsParsingFailure, "%s() Failed to parse %zu args", name,
                         argv.size());
     }
-    const std::string& zip_path = args[0];
-    std::string dest_path = args[1];
-
-    ZipArchiveHandle za = state->updater->GetPackageHandle();
-    ZipEntry64 entry;
-    if (FindEntry(za, zip_path, &entry) != 0) {
-      LOG(ERROR) << name << ": no " << zip_path << " in package";
-      return StringValue("");
-    }
+    bool success = StreamPackageFile(name, state, args[0], args[1], args[2]);
+    return StringValue(success ? "t" : "");
+  } else if (argv.size() >= 2) {
+    // The two-argument version (or its pairs) extracts to files.
 
-    // Update the destination of package_extract_file if it's a block device. During simulation the
-    // destination will map to a fake file.
-    if (std::string block_device_name = state->updater->FindBlockDeviceName(dest_path);
-        !block_device_name.empty()) {
-      dest_path = block_device_name;
+    std::vector<std::string> args;
+    if (!ReadArgs(state, argv, &args)) {
+      return ErrorAbort(state, kArgsParsingFailure, "%s() Failed to parse %zu args", name,
+                        argv.size());
     }
 
-    android::base::unique_fd fd(TEMP_FAILURE_RETRY(
-        open(dest_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)));
-    if (fd == -1) {
-      PLOG(ERROR) << name << ": can't open " << dest_path << " for write";
-      return StringValue("");
-    }
+    ZipArchiveHandle za = state->updater->GetPackageHandle();
+    std::vector<EntryExtraction> extractions;
+    for (size_t i = 0; i < args.size(); i += 2) {
+      const std::string& zip_path = args[i];
+      std::string dest_path = args[i + 1];
+
+      ZipEntry64 entry;
+      if (FindEntry(za, zip_path, &entry) != 0) {
+        LOG(ERROR) << name << ": no " << zip_path << " in package";
+        return StringValue("");
+      }
 
-    bool success = true;
-    int32_t ret = ExtractEntryToFile(za, &entry, fd);
-    if (ret != 0) {
-      LOG(ERROR) << name << ": Failed to extract entry \"" << zip_path << "\" ("
-                 << entry.uncompressed_length << " bytes) to \"" << dest_path
-                 << "\": " << ErrorCodeString(ret);
-      success = false;
-    }
-    if (fsync(fd) == -1) {
-      PLOG(ERROR) << "fsync of \"" << dest_path << "\" failed";
-      success = false;
-    }
+      // Update the destination of package_extract_file if it's a block device. During simulation
+      // the destination will map to a fake file.
+      if (std::string block_device_name = state->updater->FindBlockDeviceName(dest_path);
+          !block_device_name.empty()) {
+        dest_path = block_device_name;
+      }
 
-    if (close(fd.release()) != 0) {
-      PLOG(ERROR) << "close of \"" << dest_path << "\" failed";
-      success = false;
+      auto open_file = [name, dest_path]() {
+        android::base::unique_fd fd(TEMP_FAILURE_RETRY(
+            open(dest_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)));
+        if (fd == -1) {
+          PLOG(ERROR) << name << ": can't open " << dest_path << " for write";
+        }
+        return fd;
+      };
+      extractions.push_back({ entry, dest_path, open_file });
     }
 
+    // Stored entries (e.g. raw firmware images) are copied straight from the mapped package.
+    ExtractionSource source{ state->updater->GetMappedPackageAddress(),
+                             state->updater->GetMappedPackageLength(),
+                             state->updater->GetPackageFd() };
+    bool success = ExtractEntriesInParallel(za, &extractions, ExtractionWorkers(),
+                                            kMaxExtractionBytesInFlight,
+                                            source.addr != nullptr ? &source : nullptr);
     return StringValue(success ? "t" : "");
   } else {
     // The one-argument version returns the contents of the file as the result.
@@ -236,6 +339,25 @@ Value* PackageExtractFileFn(const char* name, State* state,
                         zip_path.c_str());
     }
 
+    // An entry stored uncompressed is referred to where it sits in the mapped package, rather than
+    // copied out, so that a large patch (e.g. for patch_partition()) is in memory only once. The
+    // package stays mapped for as long as the script runs.
+    const uint8_t* package = state->updater->GetMappedPackageAddress();
+    size_t package_length = state->updater->GetMappedPackageLength();
+    if (entry.method == kCompressStored && package != nullptr && entry.offset >= 0 &&
+        static_cast<uint64_t>(entry.offset) <= package_length &&
+        entry.uncompressed_length <= package_length - entry.offset) {
+      std::string_view contents(reinterpret_cast<const char*>(package + entry.offset),
+                                entry.uncompressed_length);
+      uLong crc = crc32_z(0L, reinterpret_cast<const Bytef*>(contents.data()), contents.size());
+      if (crc != entry.crc32) {
+        return ErrorAbort(state, kPackageExtractFileFailure,
+                          "%s: Entry \"%s\" has CRC-32 %lx, expected %" PRIx32, name,
+                          zip_path.c_str(), crc, entry.crc32);
+      }
+      return new Value(contents, nullptr);
+    }
+
     std::string buffer;
     if (entry.uncompressed_length > std::numeric_limits<size_t>::max()) {
       return ErrorAbort(state, kPackageExtractFileFailure,
@@ -252,7 +374,7 @@ Value* PackageExtractFileFn(const char* name, State* state,
                         zip_path.c_str(), buffer.size(), ErrorCodeString(ret));
     }
 
-    return new Value(Value::Type::BLOB, buffer);
+    return new Value(Value::Type::BLOB, std::move(buffer));
   }
 }
 
@@ -629,7 +751,7 @@ Value* ShowProgressFn(const char* name, State* state,
                       sec_str.c_str());
   }
 
-  state->updater->WriteToCommandPipe(android::base::StringPrintf("progress %f %d", frac, sec));
+  state->updater->ShowProgress(frac, sec);
 
   return StringValue(frac_str);
 }
@@ -652,7 +774,7 @@ Value* SetProgressFn(const char* name, State* state,
                       frac_str.c_str());
   }
 
-  state->updater->WriteToCommandPipe(android::base::StringPrintf("set_progress %f", frac));
+  state->updater->SetProgress(frac);
 
   return StringValue(frac_str);
 }
@@ -697,23 +819,6 @@ Value* SymlinkFn(const char* name, State* state, const std::vector<std::unique_p
   return StringValue("t");
 }
 
-struct perm_parsed_args {
-  bool has_uid;
-  uid_t uid;
-  bool has_gid;
-  gid_t gid;
-  bool has_mode;
-  mode_t mode;
-  bool has_fmode;
-  mode_t fmode;
-  bool has_dmode;
-  mode_t dmode;
-  bool has_selabel;
-  const char* selabel;
-  bool has_capabilities;
-  uint64_t capabilities;
-};
-
 static struct perm_parsed_args ParsePermArgs(State* state, const std::vector<std::string>& args) {
   struct perm_parsed_args parsed;
   auto updater = state->updater;
@@ -817,108 +922,8 @@ static struct perm_parsed_args ParsePermArgs(State* state, const std::vector<std
   return parsed;
 }
 
-static int ApplyParsedPerms(State* state, const char* filename, const struct stat* statptr,
-                            struct perm_parsed_args parsed) {
-  auto updater = state->updater;
-  int bad = 0;
-
-  if (parsed.has_selabel) {
-    if (lsetfilecon(filename, parsed.selabel) != 0) {
-      updater->UiPrint(android::base::StringPrintf(
-                            "ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
-                            filename, parsed.selabel, strerror(errno)));
-      bad++;
-    }
-  }
-
-  /* ignore symlinks */
-  if (S_ISLNK(statptr->st_mode)) {
-    return bad;
-  }
-
-  if (parsed.has_uid) {
-    if (chown(filename, parsed.uid, -1) < 0) {
-      updater->UiPrint(android::base::StringPrintf(
-                            "ApplyParsedPerms: chown of %s to %d failed: %s\n",
-                            filename, parsed.uid, strerror(errno)));
-      bad++;
-    }
-  }
-
-  if (parsed.has_gid) {
-    if (chown(filename, -1, parsed.gid) < 0) {
-      updater->UiPrint(android::base::StringPrintf(
-                            "ApplyParsedPerms: chgrp of %s to %d failed: %s\n",
-                            filename, parsed.gid, strerror(errno)));
-      bad++;
-    }
-  }
-
-  if (parsed.has_mode) {
-    if (chmod(filename, parsed.mode) < 0) {
-      updater->UiPrint(android::base::StringPrintf(
-                            "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                            filename, parsed.mode, strerror(errno)));
-      bad++;
-    }
-  }
-
-  if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
-    if (chmod(filename, parsed.dmode) < 0) {
-      updater->UiPrint(android::base::StringPrintf(
-                            "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                            filename, parsed.dmode, strerror(errno)));
-      bad++;
-    }
-  }
-
-  if (parsed.has_fmode && S_ISREG(statptr->st_mode)) {
-    if (chmod(filename, parsed.fmode) < 0) {
-      updater->UiPrint(android::base::StringPrintf(
-                            "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                            filename, parsed.fmode, strerror(errno)));
-      bad++;
-    }
-  }
-
-  if (parsed.has_capabilities && S_ISREG(statptr->st_mode)) {
-    if (parsed.capabilities == 0) {
-      if ((removexattr(filename, XATTR_NAME_CAPS) == -1) && (errno != ENODATA)) {
-        // Report failure unless it's ENODATA (attribute not set)
-        updater->UiPrint(android::base::StringPrintf(
-                                "ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n",
-                                filename, parsed.capabilities, strerror(errno)));
-        bad++;
-      }
-    } else {
-      struct vfs_cap_data cap_data;
-      memset(&cap_data, 0, sizeof(cap_data));
-      cap_data.magic_etc = VFS_CAP_REVISION_2 | VFS_CAP_FLAGS_EFFECTIVE;
-      cap_data.data[0].permitted = (uint32_t)(parsed.capabilities & 0xffffffff);
-      cap_data.data[0].inheritable = 0;
-      cap_data.data[1].permitted = (uint32_t)(parsed.capabilities >> 32);
-      cap_data.data[1].inheritable = 0;
-      if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0) {
-        updater->UiPrint(android::base::StringPrintf(
-                                "ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n",
-                                filename, parsed.capabilities, strerror(errno)));
-        bad++;
-      }
-    }
-  }
-
-  return bad;
-}
-
-// nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
-static State* recursive_state;
-
-static int do_SetMetadataRecursive(const char* filename, const struct stat* statptr,
-                                   int /*fileflags*/, struct FTW* /*pfwt*/) {
-  return ApplyParsedPerms(recursive_state, filename, statptr, recursive_parsed_args);
-}
+// The most subtrees that set_metadata_recursive() walks at a time.
+static constexpr size_t kMaxMetadataWorkers = 4;
 
 static Value* SetMetadataFn(const char* name, State* state,
                             const std::vector<std::unique_ptr<Expr>>& argv) {
@@ -939,17 +944,16 @@ static Value* SetMetadataFn(const char* name, State* state,
   }
 
   struct perm_parsed_args parsed = ParsePermArgs(state, args);
-  int bad = 0;
-  bool recursive = (strcmp(name, "set_metadata_recursive") == 0);
-
-  if (recursive) {
-    recursive_parsed_args = parsed;
-    recursive_state = state;
-    bad += nftw(args[0].c_str(), do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-    memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
-    recursive_state = NULL;
+  auto report = [updater = state->updater](const std::string& message) {
+    updater->UiPrint(message);
+  };
+  size_t bad;
+  if (strcmp(name, "set_metadata_recursive") == 0) {
+    size_t workers = ThermalThrottle::Get().Scale(
+        std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxMetadataWorkers));
+    bad = ApplyMetadataRecursive(args[0], sb, parsed, workers, report);
   } else {
-    bad += ApplyParsedPerms(state, args[0].c_str(), &sb, parsed);
+    bad = ApplyMetadata(args[0], sb, parsed, report);
   }
 
   if (bad > 0) {
@@ -993,36 +997,17 @@ Value* FileGetPropFn(const char* name, State* state,
   const std::string& filename = args[0];
   const std::string& key = args[1];
 
-  std::string buffer;
   auto updater_runtime = state->updater->GetRuntime();
-  if (!updater_runtime->ReadFileToString(filename, &buffer)) {
+  auto properties = PropertyFileCache::Get().Load(filename, [&](std::string* content) {
+    return updater_runtime->ReadFileToString(filename, content);
+  });
+  if (!properties) {
     ErrorAbort(state, kFreadFailure, "%s: failed to read %s", name, filename.c_str());
     return nullptr;
   }
 
-  std::vector<std::string> lines = android::base::Split(buffer, "\n");
-  for (size_t i = 0; i < lines.size(); i++) {
-    std::string line = android::base::Trim(lines[i]);
-
-    // comment or blank line: skip to next line
-    if (line.empty() || line[0] == '#') {
-      continue;
-    }
-    size_t equal_pos = line.find('=');
-    if (equal_pos == std::string::npos) {
-      continue;
-    }
-
-    // trim whitespace between key and '='
-    std::string str = android::base::Trim(line.substr(0, equal_pos));
-
-    // not the key we're looking for
-    if (key != str) continue;
-
-    return StringValue(android::base::Trim(line.substr(equal_pos + 1)));
-  }
-
-  return StringValue("");
+  const std::string* value = properties->Find(key);
+  return StringValue(value != nullptr ? *value : "");
 }
 
 // apply_patch_space(bytes)
@@ -1128,6 +1113,16 @@ Value* WriteValueFn(const char* name, State* state, const std::vector<std::uniqu
   return StringValue("t");
 }
 
+// Returns the accessor of the misc partition |filename|, which is kept for the later calls to save
+// rereading the BCB. The updater is the only writer of the BCB while it runs.
+static MiscPartition* GetMiscPartition(const std::string& filename, std::string* err) {
+  static std::unique_ptr<MiscPartition> misc;
+  if (!misc || misc->device() != filename) {
+    misc = MiscPartition::OpenDevice(filename, err);
+  }
+  return misc.get();
+}
+
 // Immediately reboot the device.  Recovery is not finished normally,
 // so if you reboot into recovery it will re-start applying the
 // current package (because nothing has cleared the copy of the
@@ -1153,12 +1148,13 @@ Value* RebootNowFn(const char* name, State* state, const std::vector<std::unique
   // Zero out the 'command' field of the bootloader message. Leave the rest intact.
   bootloader_message boot;
   std::string err;
-  if (!read_bootloader_message_from(&boot, filename, &err)) {
+  MiscPartition* misc = GetMiscPartition(filename, &err);
+  if (misc == nullptr || !misc->ReadBootloaderMessage(&boot, &err)) {
     LOG(ERROR) << name << "(): Failed to read from \"" << filename << "\": " << err;
     return StringValue("");
   }
   memset(boot.command, 0, sizeof(boot.command));
-  if (!write_bootloader_message_to(boot, filename, &err)) {
+  if (!misc->WriteBootloaderMessage(boot, &err)) {
     LOG(ERROR) << name << "(): Failed to write to \"" << filename << "\": " << err;
     return StringValue("");
   }
@@ -1197,15 +1193,18 @@ Value* SetStageFn(const char* name, State* state, const std::vector<std::unique_
   // package installation.
   bootloader_message boot;
   std::string err;
-  if (!read_bootloader_message_from(&boot, filename, &err)) {
+  MiscPartition* misc = GetMiscPartition(filename, &err);
+  if (misc == nullptr || !misc->ReadBootloaderMessage(&boot, &err)) {
     LOG(ERROR) << name << "(): Failed to read from \"" << filename << "\": " << err;
     return StringValue("");
   }
   strlcpy(boot.stage, stagestr.c_str(), sizeof(boot.stage));
-  if (!write_bootloader_message_to(boot, filename, &err)) {
+  if (!misc->WriteBootloaderMessage(boot, &err)) {
     LOG(ERROR) << name << "(): Failed to write to \"" << filename << "\": " << err;
     return StringValue("");
   }
+  // Lets recovery time the install phases of each stage.
+  state->updater->WriteToCommandPipe("stage " + stagestr, true);
 
   return StringValue(filename);
 }
@@ -1225,7 +1224,8 @@ Value* GetStageFn(const char* name, State* state, const std::vector<std::unique_
 
   bootloader_message boot;
   std::string err;
-  if (!read_bootloader_message_from(&boot, filename, &err)) {
+  MiscPartition* misc = GetMiscPartition(filename, &err);
+  if (misc == nullptr || !misc->ReadBootloaderMessage(&boot, &err)) {
     LOG(ERROR) << name << "(): Failed to read from \"" << filename << "\": " << err;
     return StringValue("");
   }
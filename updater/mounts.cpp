@@ -16,64 +16,31 @@
 
 #include "mounts.h"
 
-#include <errno.h>
-#include <fcntl.h>
-#include <mntent.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
 #include <sys/mount.h>
 
 #include <string>
-#include <vector>
 
 #include <android-base/logging.h>
 
-struct MountedVolume {
-  std::string device;
-  std::string mount_point;
-  std::string filesystem;
-  std::string flags;
-};
-
-static std::vector<MountedVolume*> g_mounts_state;
+// Only read again once the kernel flags a change, so that looking up the mounts in a loop (e.g. an
+// is_mounted() per partition) doesn't re-read /proc/mounts every time.
+static MountTable g_mount_table;
 
 bool scan_mounted_volumes() {
-  for (size_t i = 0; i < g_mounts_state.size(); ++i) {
-    delete g_mounts_state[i];
-  }
-  g_mounts_state.clear();
-
-  // Open and read mount table entries.
-  FILE* fp = setmntent("/proc/mounts", "re");
-  if (fp == NULL) {
-    return false;
-  }
-  mntent* e;
-  while ((e = getmntent(fp)) != NULL) {
-    MountedVolume* v = new MountedVolume;
-    v->device = e->mnt_fsname;
-    v->mount_point = e->mnt_dir;
-    v->filesystem = e->mnt_type;
-    v->flags = e->mnt_opts;
-    g_mounts_state.push_back(v);
-  }
-  endmntent(fp);
-  return true;
+  return g_mount_table.Refresh();
 }
 
 MountedVolume* find_mounted_volume_by_mount_point(const char* mount_point) {
-  for (size_t i = 0; i < g_mounts_state.size(); ++i) {
-    if (g_mounts_state[i]->mount_point == mount_point) return g_mounts_state[i];
-  }
-  return nullptr;
+  return g_mount_table.FindByMountPoint(mount_point);
 }
 
 int unmount_mounted_volume(MountedVolume* volume) {
   // Intentionally pass the empty string to umount if the caller tries to unmount a volume they
-  // already unmounted using this function.
+  // already unmounted using this function. The table is read again on the next scan, even if the
+  // unmount fails, to drop that change to the copy.
   std::string mount_point = volume->mount_point;
   volume->mount_point.clear();
+  g_mount_table.Invalidate();
   int result = umount(mount_point.c_str());
   if (result == -1) {
     PLOG(WARNING) << "Failed to umount " << mount_point;
@@ -16,7 +16,9 @@
 
 #pragma once
 
-struct MountedVolume;
+#include "otautil/mount_table.h"
+
+using MountedVolume = MountTable::Mount;
 
 bool scan_mounted_volumes();
 
@@ -0,0 +1,535 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/new_data_decoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <brotli/decode.h>
+#include <lz4frame.h>
+#include <zstd.h>
+
+// The largest zstd frame header, which holds the content size.
+static constexpr size_t kZstdFrameHeaderMaxSize = 18;
+
+bool NewDataSink::Write(const uint8_t* data, size_t size) {
+  while (size > 0) {
+    size_t space;
+    uint8_t* dest = AcquireSpace(&space);
+    if (dest == nullptr) {
+      return false;
+    }
+    size_t write_now = std::min(size, space);
+    memcpy(dest, data, write_now);
+    CommitSpace(write_now);
+    data += write_now;
+    size -= write_now;
+  }
+  return true;
+}
+
+namespace {
+
+// Drops the first |skip| bytes of the data, and passes the rest on to |sink|.
+class SkippingSink : public NewDataSink {
+ public:
+  SkippingSink(NewDataSink* sink, uint64_t skip) : sink_(sink), skip_(skip) {}
+
+  uint8_t* AcquireSpace(size_t* size) override {
+    if (skip_ == 0) {
+      return sink_->AcquireSpace(size);
+    }
+    if (scratch_.empty()) {
+      scratch_.resize(kScratchSize);
+    }
+    *size = std::min<uint64_t>(skip_, scratch_.size());
+    return scratch_.data();
+  }
+
+  void CommitSpace(size_t size) override {
+    if (skip_ == 0) {
+      sink_->CommitSpace(size);
+    } else {
+      skip_ -= size;
+    }
+  }
+
+  // Counts |size| bytes as dropped, for the data that the decoder skipped over without decoding.
+  void Skip(uint64_t size) {
+    CHECK_LE(size, skip_);
+    skip_ -= size;
+  }
+
+  uint64_t remaining() const {
+    return skip_;
+  }
+
+ private:
+  static constexpr size_t kScratchSize = 64 * 1024;
+
+  NewDataSink* sink_;
+  uint64_t skip_;
+  // Where the dropped data gets decoded into.
+  std::vector<uint8_t> scratch_;
+};
+
+// Owns the SkippingSink that |decoder| writes into.
+class SkippingDecoder : public NewDataDecoder {
+ public:
+  SkippingDecoder(std::unique_ptr<SkippingSink> sink, std::unique_ptr<NewDataDecoder> decoder)
+      : sink_(std::move(sink)), decoder_(std::move(decoder)) {}
+
+  bool Decode(const uint8_t* data, size_t size) override {
+    return decoder_->Decode(data, size);
+  }
+
+  bool Finish() override {
+    return decoder_->Finish();
+  }
+
+ private:
+  // Declared first, to outlive the decoder.
+  std::unique_ptr<SkippingSink> sink_;
+  std::unique_ptr<NewDataDecoder> decoder_;
+};
+
+class CopyDecoder : public NewDataDecoder {
+ public:
+  explicit CopyDecoder(NewDataSink* sink) : sink_(sink) {}
+
+  bool Decode(const uint8_t* data, size_t size) override {
+    return sink_->Write(data, size);
+  }
+
+  bool Finish() override {
+    return true;
+  }
+
+ private:
+  NewDataSink* sink_;
+};
+
+class BrotliDecoder : public NewDataDecoder {
+ public:
+  explicit BrotliDecoder(NewDataSink* sink)
+      : sink_(sink), state_(BrotliDecoderCreateInstance(nullptr, nullptr, nullptr)) {}
+
+  ~BrotliDecoder() override {
+    BrotliDecoderDestroyInstance(state_);
+  }
+
+  bool Decode(const uint8_t* data, size_t size) override {
+    while (size > 0 || BrotliDecoderHasMoreOutput(state_)) {
+      size_t buffer_size;
+      uint8_t* next_out = sink_->AcquireSpace(&buffer_size);
+      if (next_out == nullptr) {
+        return false;
+      }
+      size_t available_in = size;
+      size_t available_out = buffer_size;
+
+      // The brotli decoder will update |data|, |available_in|, |next_out| and |available_out|.
+      BrotliDecoderResult result = BrotliDecoderDecompressStream(
+          state_, &available_in, &data, &available_out, &next_out, nullptr);
+      if (result == BROTLI_DECODER_RESULT_ERROR) {
+        LOG(ERROR) << "Decompression failed with "
+                   << BrotliDecoderErrorString(BrotliDecoderGetErrorCode(state_));
+        return false;
+      }
+
+      LOG(DEBUG) << "bytes to write: " << buffer_size - available_out << ", bytes consumed "
+                 << size - available_in << ", decoder status " << result;
+
+      // Decompress straight into the sink and publish the output.
+      sink_->CommitSpace(buffer_size - available_out);
+      size = available_in;
+    }
+    return true;
+  }
+
+  bool Finish() override {
+    if (!BrotliDecoderIsFinished(state_)) {
+      LOG(ERROR) << "Truncated brotli stream";
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  NewDataSink* sink_;
+  BrotliDecoderState* state_;
+};
+
+class Lz4Decoder : public NewDataDecoder {
+ public:
+  explicit Lz4Decoder(NewDataSink* sink) : sink_(sink) {
+    LZ4F_createDecompressionContext(&dctx_, LZ4F_VERSION);
+  }
+
+  ~Lz4Decoder() override {
+    LZ4F_freeDecompressionContext(dctx_);
+  }
+
+  bool Decode(const uint8_t* data, size_t size) override {
+    // The decoder may hold back some output when the space is full, for the next call.
+    bool full = false;
+    while (size > 0 || full) {
+      size_t space;
+      uint8_t* dest = sink_->AcquireSpace(&space);
+      if (dest == nullptr) {
+        return false;
+      }
+      size_t out_size = space;
+      size_t in_size = size;
+      size_t hint = LZ4F_decompress(dctx_, dest, &out_size, data, &in_size, nullptr);
+      if (LZ4F_isError(hint)) {
+        LOG(ERROR) << "Decompression failed with " << LZ4F_getErrorName(hint);
+        return false;
+      }
+      sink_->CommitSpace(out_size);
+      data += in_size;
+      size -= in_size;
+      full = out_size == space;
+      // 0 means the end of a frame, possibly followed by another one.
+      frame_end_ = hint == 0;
+    }
+    return true;
+  }
+
+  bool Finish() override {
+    if (!frame_end_) {
+      LOG(ERROR) << "Truncated lz4 stream";
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  NewDataSink* sink_;
+  LZ4F_dctx* dctx_{ nullptr };
+  bool frame_end_{ false };
+};
+
+/**
+ * ZstdDecoder hands the frames that record their content size (up to kMaxZstdParallelFrameSize) to
+ * a pool of workers, once read in full, and writes their output in order. Each frame is
+ * independent, so they decode in parallel. The other frames are decoded as a stream, which doesn't
+ * need the whole frame in memory. With a |skipper|, the frames that it would drop whole are skipped
+ * over instead, as long as they record their content size.
+ */
+class ZstdDecoder : public NewDataDecoder {
+ public:
+  ZstdDecoder(NewDataSink* sink, size_t max_workers, SkippingSink* skipper)
+      : sink_(sink),
+        max_workers_(max_workers),
+        skipper_(skipper),
+        dstream_(ZSTD_createDStream()) {}
+
+  ~ZstdDecoder() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+    ZSTD_freeDStream(dstream_);
+  }
+
+  bool Decode(const uint8_t* data, size_t size) override {
+    while (size > 0) {
+      if (streaming_) {
+        ZSTD_inBuffer input{ data, size, 0 };
+        if (!Stream(&input)) {
+          return false;
+        }
+        data += input.pos;
+        size -= input.pos;
+        continue;
+      }
+      pending_.insert(pending_.end(), data, data + size);
+      size = 0;
+      if (!ParsePending(false)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool Finish() override {
+    if (!ParsePending(true) || !WriteJobs(0)) {
+      return false;
+    }
+    if (streaming_) {
+      LOG(ERROR) << "Truncated zstd stream";
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  struct Job {
+    std::vector<uint8_t> input;
+    std::vector<uint8_t> output;
+    bool done{ false };
+    bool ok{ false };
+  };
+
+  // Hands the complete frames in |pending_| to the workers, and starts streaming the first frame
+  // that can't be. |final| is set at the end of the input.
+  bool ParsePending(bool final) {
+    size_t offset = 0;
+    while (offset < pending_.size()) {
+      const uint8_t* frame = pending_.data() + offset;
+      size_t available = pending_.size() - offset;
+      if (streaming_) {
+        ZSTD_inBuffer input{ frame, available, 0 };
+        if (!Stream(&input)) {
+          return false;
+        }
+        offset += input.pos;
+        continue;
+      }
+
+      if (available < kZstdFrameHeaderMaxSize && !final) {
+        break;
+      }
+      unsigned long long content_size = ZSTD_getFrameContentSize(frame, available);
+      if (content_size == ZSTD_CONTENTSIZE_ERROR) {
+        LOG(ERROR) << "Invalid zstd frame";
+        return false;
+      }
+      if (skipper_ != nullptr && content_size != ZSTD_CONTENTSIZE_UNKNOWN) {
+        // The frames that are being decoded all go to the sink first, so the frame can only be
+        // skipped once they're done.
+        if (jobs_.empty() && content_size <= skipper_->remaining() &&
+            content_size <= kMaxZstdParallelFrameSize) {
+          size_t frame_size;
+          if (!FindFrameSize(frame, available, content_size, final, &frame_size)) {
+            return false;
+          }
+          if (frame_size == 0) {
+            break;
+          }
+          skipper_->Skip(content_size);
+          offset += frame_size;
+          continue;
+        }
+        if (skipper_->remaining() == 0) {
+          skipper_ = nullptr;
+        }
+      }
+      if (max_workers_ <= 1 || content_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+          content_size > kMaxZstdParallelFrameSize) {
+        // Keep the output in order, behind the frames that are being decoded.
+        if (!WriteJobs(0)) {
+          return false;
+        }
+        streaming_ = true;
+        continue;
+      }
+
+      size_t frame_size;
+      if (!FindFrameSize(frame, available, content_size, final, &frame_size)) {
+        return false;
+      }
+      if (frame_size == 0) {
+        break;
+      }
+      if (!Submit(frame, frame_size, content_size)) {
+        return false;
+      }
+      offset += frame_size;
+    }
+    pending_.erase(pending_.begin(), pending_.begin() + offset);
+    return true;
+  }
+
+  // Sets |frame_size| to the compressed size of the frame at |frame|, or to 0 if the rest of the
+  // frame is yet to come. Returns false if the frame is invalid.
+  bool FindFrameSize(const uint8_t* frame, size_t available, size_t content_size, bool final,
+                     size_t* frame_size) {
+    *frame_size = ZSTD_findFrameCompressedSize(frame, available);
+    if (!ZSTD_isError(*frame_size)) {
+      return true;
+    }
+    *frame_size = 0;
+    // Wait for the rest of the frame, unless there's already more than it could take.
+    if (final || available > ZSTD_compressBound(content_size) + kZstdFrameHeaderMaxSize +
+                                 ZSTD_BLOCKSIZE_MAX) {
+      LOG(ERROR) << "Invalid zstd frame: "
+                 << ZSTD_getErrorName(ZSTD_findFrameCompressedSize(frame, available));
+      return false;
+    }
+    return true;
+  }
+
+  // Decodes the streamed frame from |input|, up to its end.
+  bool Stream(ZSTD_inBuffer* input) {
+    bool full = false;
+    while (input->pos < input->size || full) {
+      size_t space;
+      uint8_t* dest = sink_->AcquireSpace(&space);
+      if (dest == nullptr) {
+        return false;
+      }
+      ZSTD_outBuffer output{ dest, space, 0 };
+      size_t result = ZSTD_decompressStream(dstream_, &output, input);
+      if (ZSTD_isError(result)) {
+        LOG(ERROR) << "Decompression failed with " << ZSTD_getErrorName(result);
+        return false;
+      }
+      sink_->CommitSpace(output.pos);
+      if (result == 0) {
+        streaming_ = false;
+        return true;
+      }
+      full = output.pos == output.size;
+    }
+    return true;
+  }
+
+  bool Submit(const uint8_t* frame, size_t frame_size, size_t content_size) {
+    // Bound the memory held by the frames in flight.
+    if (!WriteJobs(2 * max_workers_ - 1)) {
+      return false;
+    }
+
+    auto job = std::make_shared<Job>();
+    job->input.assign(frame, frame + frame_size);
+    job->output.resize(content_size);
+    jobs_.push_back(job);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queued_.push_back(job);
+    }
+    if (workers_.size() < max_workers_) {
+      workers_.emplace_back(&ZstdDecoder::Work, this);
+    }
+    work_cv_.notify_one();
+    return true;
+  }
+
+  // Writes the output of the jobs in order, waiting for them until at most |max_jobs| are left.
+  bool WriteJobs(size_t max_jobs) {
+    while (!jobs_.empty()) {
+      std::shared_ptr<Job> job = jobs_.front();
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!job->done && jobs_.size() <= max_jobs) {
+          return true;
+        }
+        done_cv_.wait(lock, [&job] { return job->done; });
+      }
+      jobs_.pop_front();
+      if (!job->ok || !sink_->Write(job->output.data(), job->output.size())) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void Work() {
+    std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+    while (true) {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_cv_.wait(lock, [this] { return stopped_ || !queued_.empty(); });
+        if (stopped_) {
+          return;
+        }
+        job = queued_.front();
+        queued_.pop_front();
+      }
+
+      size_t size = ZSTD_decompressDCtx(dctx.get(), job->output.data(), job->output.size(),
+                                        job->input.data(), job->input.size());
+      bool ok = !ZSTD_isError(size) && size == job->output.size();
+      if (!ok) {
+        LOG(ERROR) << "Decompression failed with "
+                   << (ZSTD_isError(size) ? ZSTD_getErrorName(size) : "a content size mismatch");
+      }
+      std::vector<uint8_t>().swap(job->input);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        job->done = true;
+        job->ok = ok;
+      }
+      done_cv_.notify_all();
+    }
+  }
+
+  NewDataSink* sink_;
+  size_t max_workers_;
+  // The sink that drops the skipped data, until the frames are past it.
+  SkippingSink* skipper_;
+  ZSTD_DStream* dstream_;
+  // Whether a frame is being decoded by |dstream_|.
+  bool streaming_{ false };
+  // The input that hasn't been handed out yet, starting at a frame.
+  std::vector<uint8_t> pending_;
+  // The jobs whose output hasn't been written yet, in order.
+  std::deque<std::shared_ptr<Job>> jobs_;
+
+  // The jobs for the workers to take, and the job states, guarded by |mutex_|.
+  std::deque<std::shared_ptr<Job>> queued_;
+  bool stopped_{ false };
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace
+
+std::unique_ptr<NewDataDecoder> CreateNewDataDecoder(std::string_view name, NewDataSink* sink,
+                                                     size_t max_workers, uint64_t skip) {
+  std::unique_ptr<SkippingSink> skipper;
+  if (skip > 0) {
+    skipper = std::make_unique<SkippingSink>(sink, skip);
+    sink = skipper.get();
+  }
+
+  std::unique_ptr<NewDataDecoder> decoder;
+  if (android::base::EndsWith(name, ".br")) {
+    decoder = std::make_unique<BrotliDecoder>(sink);
+  } else if (android::base::EndsWith(name, ".zst")) {
+    decoder =
+        std::make_unique<ZstdDecoder>(sink, std::max<size_t>(max_workers, 1), skipper.get());
+  } else if (android::base::EndsWith(name, ".lz4")) {
+    decoder = std::make_unique<Lz4Decoder>(sink);
+  } else {
+    decoder = std::make_unique<CopyDecoder>(sink);
+  }
+
+  if (skipper) {
+    return std::make_unique<SkippingDecoder>(std::move(skipper), std::move(decoder));
+  }
+  return decoder;
+}
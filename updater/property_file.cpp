@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/property_file.h"
+
+#include <ctype.h>
+#include <sys/stat.h>
+
+static std::string_view Trim(std::string_view s) {
+  size_t begin = 0;
+  while (begin < s.size() && isspace(static_cast<unsigned char>(s[begin]))) {
+    begin++;
+  }
+  size_t end = s.size();
+  while (end > begin && isspace(static_cast<unsigned char>(s[end - 1]))) {
+    end--;
+  }
+  return s.substr(begin, end - begin);
+}
+
+PropertyFile::PropertyFile(std::string_view content) {
+  while (!content.empty()) {
+    size_t newline = content.find('\n');
+    std::string_view line = Trim(content.substr(0, newline));
+    content.remove_prefix(newline == std::string_view::npos ? content.size() : newline + 1);
+
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    size_t equal = line.find('=');
+    if (equal == std::string_view::npos) {
+      continue;
+    }
+    properties_.emplace(Trim(line.substr(0, equal)), Trim(line.substr(equal + 1)));
+  }
+}
+
+const std::string* PropertyFile::Find(std::string_view key) const {
+  auto it = properties_.find(key);
+  return it == properties_.end() ? nullptr : &it->second;
+}
+
+PropertyFileCache& PropertyFileCache::Get() {
+  static PropertyFileCache cache;
+  return cache;
+}
+
+static bool SameFile(const struct stat& a, const struct stat& b) {
+  return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size &&
+         a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+std::shared_ptr<const PropertyFile> PropertyFileCache::Load(
+    const std::string& path, const std::function<bool(std::string*)>& read) {
+  struct stat st;
+  bool cacheable = stat(path.c_str(), &st) == 0;
+  if (cacheable) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (auto it = entries_.find(path); it != entries_.end() && SameFile(it->second.st, st)) {
+      return it->second.properties;
+    }
+  }
+
+  std::string content;
+  if (!read(&content)) {
+    return nullptr;
+  }
+  auto properties = std::make_shared<const PropertyFile>(content);
+
+  // Only what was read from the file that was stat()'d is cached; a file replaced in between is
+  // read again next time.
+  struct stat read_st;
+  if (cacheable && stat(path.c_str(), &read_st) == 0 && SameFile(st, read_st)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_[path] = { st, properties };
+  }
+  return properties;
+}
+
+void PropertyFileCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+}
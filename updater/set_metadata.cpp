@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/set_metadata.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/capability.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <linux/xattr.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+#include <selinux/selinux.h>
+
+namespace {
+
+class MetadataWalker {
+ public:
+  MetadataWalker(const perm_parsed_args& parsed, const MetadataReporter& report)
+      : parsed_(parsed), report_(report) {}
+
+  // Applies the metadata to the entry |name| of the directory |dir_fd|, whose path is |path|.
+  void Apply(int dir_fd, const char* name, const std::string& path, const struct stat& st);
+
+  // Applies the metadata to the directory |name| of |dir_fd| and everything beneath it.
+  void Walk(int dir_fd, const char* name, const std::string& path, const struct stat& st);
+
+  // Lists the entries of the directory |name| of |dir_fd|, with their lstat(). Returns nullptr if
+  // it can't be read.
+  std::unique_ptr<DIR, decltype(&closedir)> OpenDirectory(int dir_fd, const char* name,
+                                                          const std::string& path);
+
+  // Reads the next entry of |dir|, other than "." and "..", into |st|. Returns nullptr at the end.
+  const char* NextEntry(DIR* dir, const std::string& path, struct stat* st);
+
+  size_t failures() const {
+    return failures_;
+  }
+
+ private:
+  void ApplyCapabilities(int dir_fd, const char* name, const std::string& path);
+
+  void Fail(const std::string& message) {
+    failures_++;
+    std::lock_guard<std::mutex> lock(report_mutex_);
+    report_(message);
+  }
+
+  const perm_parsed_args& parsed_;
+  const MetadataReporter& report_;
+  std::mutex report_mutex_;
+  std::atomic<size_t> failures_{ 0 };
+};
+
+void MetadataWalker::Apply(int dir_fd, const char* name, const std::string& path,
+                           const struct stat& st) {
+  if (parsed_.has_selabel) {
+    // There are no *at() versions of the label calls; they go by the path.
+    char* context = nullptr;
+    bool labeled = lgetfilecon(path.c_str(), &context) > 0 && strcmp(context, parsed_.selabel) == 0;
+    freecon(context);
+    if (!labeled && lsetfilecon(path.c_str(), parsed_.selabel) != 0) {
+      Fail(android::base::StringPrintf("set_metadata: lsetfilecon of %s to %s failed: %s\n",
+                                       path.c_str(), parsed_.selabel, strerror(errno)));
+    }
+  }
+
+  // Symlinks only get the label.
+  if (S_ISLNK(st.st_mode)) {
+    return;
+  }
+
+  uid_t uid = parsed_.has_uid && st.st_uid != parsed_.uid ? parsed_.uid : -1;
+  gid_t gid = parsed_.has_gid && st.st_gid != parsed_.gid ? parsed_.gid : -1;
+  bool chowned = false;
+  if (uid != static_cast<uid_t>(-1) || gid != static_cast<gid_t>(-1)) {
+    if (fchownat(dir_fd, name, uid, gid, AT_SYMLINK_NOFOLLOW) == 0) {
+      chowned = true;
+    } else {
+      Fail(android::base::StringPrintf("set_metadata: chown of %s to %d:%d failed: %s\n",
+                                       path.c_str(), static_cast<int>(uid), static_cast<int>(gid),
+                                       strerror(errno)));
+    }
+  }
+
+  // fmode and dmode take over from mode for the files and the directories.
+  std::optional<mode_t> mode;
+  if (parsed_.has_fmode && S_ISREG(st.st_mode)) {
+    mode = parsed_.fmode;
+  } else if (parsed_.has_dmode && S_ISDIR(st.st_mode)) {
+    mode = parsed_.dmode;
+  } else if (parsed_.has_mode) {
+    mode = parsed_.mode;
+  }
+  // A chown() clears the set-user-ID and set-group-ID bits, which the mode may have to set again.
+  if (mode && (chowned || (st.st_mode & 07777) != (*mode & 07777))) {
+    if (fchmodat(dir_fd, name, *mode, 0) != 0) {
+      Fail(android::base::StringPrintf("set_metadata: chmod of %s to %o failed: %s\n",
+                                       path.c_str(), *mode, strerror(errno)));
+    }
+  }
+
+  if (parsed_.has_capabilities && S_ISREG(st.st_mode)) {
+    ApplyCapabilities(dir_fd, name, path);
+  }
+}
+
+void MetadataWalker::ApplyCapabilities(int dir_fd, const char* name, const std::string& path) {
+  // One open of the file, rather than a lookup of the path for each of the xattr calls. They come
+  // after any chown(), which drops the capabilities.
+  android::base::unique_fd fd(openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+  if (fd == -1) {
+    Fail(android::base::StringPrintf("set_metadata: open of %s failed: %s\n", path.c_str(),
+                                     strerror(errno)));
+    return;
+  }
+  struct vfs_cap_data current;
+  ssize_t current_size = fgetxattr(fd, XATTR_NAME_CAPS, &current, sizeof(current));
+
+  if (parsed_.capabilities == 0) {
+    if (current_size == -1 && errno == ENODATA) {
+      return;
+    }
+    if (fremovexattr(fd, XATTR_NAME_CAPS) == -1 && errno != ENODATA) {
+      Fail(android::base::StringPrintf("set_metadata: removexattr of %s to %" PRIx64
+                                       " failed: %s\n",
+                                       path.c_str(), parsed_.capabilities, strerror(errno)));
+    }
+    return;
+  }
+
+  struct vfs_cap_data cap_data;
+  memset(&cap_data, 0, sizeof(cap_data));
+  cap_data.magic_etc = VFS_CAP_REVISION_2 | VFS_CAP_FLAGS_EFFECTIVE;
+  cap_data.data[0].permitted = static_cast<uint32_t>(parsed_.capabilities & 0xffffffff);
+  cap_data.data[0].inheritable = 0;
+  cap_data.data[1].permitted = static_cast<uint32_t>(parsed_.capabilities >> 32);
+  cap_data.data[1].inheritable = 0;
+  if (current_size == sizeof(cap_data) && memcmp(&current, &cap_data, sizeof(cap_data)) == 0) {
+    return;
+  }
+  if (fsetxattr(fd, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) != 0) {
+    Fail(android::base::StringPrintf("set_metadata: setcap of %s to %" PRIx64 " failed: %s\n",
+                                     path.c_str(), parsed_.capabilities, strerror(errno)));
+  }
+}
+
+std::unique_ptr<DIR, decltype(&closedir)> MetadataWalker::OpenDirectory(int dir_fd,
+                                                                        const char* name,
+                                                                        const std::string& path) {
+  std::unique_ptr<DIR, decltype(&closedir)> dir(nullptr, closedir);
+  int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd != -1) {
+    dir.reset(fdopendir(fd));
+    if (!dir) {
+      close(fd);
+    }
+  }
+  if (!dir) {
+    Fail(android::base::StringPrintf("set_metadata: can't read the directory %s: %s\n",
+                                     path.c_str(), strerror(errno)));
+  }
+  return dir;
+}
+
+const char* MetadataWalker::NextEntry(DIR* dir, const std::string& path, struct stat* st) {
+  while (dirent* entry = readdir(dir)) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (fstatat(dirfd(dir), entry->d_name, st, AT_SYMLINK_NOFOLLOW) != 0) {
+      Fail(android::base::StringPrintf("set_metadata: lstat of %s/%s failed: %s\n", path.c_str(),
+                                       entry->d_name, strerror(errno)));
+      continue;
+    }
+    return entry->d_name;
+  }
+  return nullptr;
+}
+
+void MetadataWalker::Walk(int dir_fd, const char* name, const std::string& path,
+                          const struct stat& st) {
+  if (auto dir = OpenDirectory(dir_fd, name, path); dir) {
+    struct stat entry_st;
+    while (const char* entry = NextEntry(dir.get(), path, &entry_st)) {
+      std::string entry_path = path + "/" + entry;
+      if (S_ISDIR(entry_st.st_mode)) {
+        Walk(dirfd(dir.get()), entry, entry_path, entry_st);
+      } else {
+        Apply(dirfd(dir.get()), entry, entry_path, entry_st);
+      }
+    }
+  }
+  Apply(dir_fd, name, path, st);
+}
+
+}  // namespace
+
+size_t ApplyMetadata(const std::string& path, const struct stat& st, const perm_parsed_args& parsed,
+                     const MetadataReporter& report) {
+  MetadataWalker walker(parsed, report);
+  walker.Apply(AT_FDCWD, path.c_str(), path, st);
+  return walker.failures();
+}
+
+size_t ApplyMetadataRecursive(const std::string& path, const struct stat& st,
+                              const perm_parsed_args& parsed, size_t workers,
+                              const MetadataReporter& report) {
+  MetadataWalker walker(parsed, report);
+  if (!S_ISDIR(st.st_mode)) {
+    walker.Apply(AT_FDCWD, path.c_str(), path, st);
+    return walker.failures();
+  }
+  if (workers <= 1) {
+    walker.Walk(AT_FDCWD, path.c_str(), path, st);
+    return walker.failures();
+  }
+
+  // The files at the top are done here, and the subdirectories (e.g. app, bin, lib and so on
+  // under /system) are walked by the workers as they come free.
+  if (auto dir = walker.OpenDirectory(AT_FDCWD, path.c_str(), path); dir) {
+    std::vector<std::pair<std::string, struct stat>> subdirs;
+    struct stat entry_st;
+    while (const char* entry = walker.NextEntry(dir.get(), path, &entry_st)) {
+      if (S_ISDIR(entry_st.st_mode)) {
+        subdirs.emplace_back(entry, entry_st);
+      } else {
+        walker.Apply(dirfd(dir.get()), entry, path + "/" + entry, entry_st);
+      }
+    }
+
+    std::atomic<size_t> next{ 0 };
+    auto worker = [&]() {
+      for (size_t i = next++; i < subdirs.size(); i = next++) {
+        const auto& [name, subdir_st] = subdirs[i];
+        walker.Walk(dirfd(dir.get()), name.c_str(), path + "/" + name, subdir_st);
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(workers, subdirs.size()); i++) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+  walker.Apply(AT_FDCWD, path.c_str(), path, st);
+  return walker.failures();
+}
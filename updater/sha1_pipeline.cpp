@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/sha1_pipeline.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <android-base/logging.h>
+
+#include "otautil/rangeset.h"
+#include "private/block_io.h"
+
+// The size of the chunks read by Sha1BlocksAt().
+static constexpr size_t kReadChunkSize = 4 * 1024 * 1024;
+
+Sha1Pipeline::Sha1Pipeline() {
+  SHA1_Init(&ctx_);
+}
+
+Sha1Pipeline::~Sha1Pipeline() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
+  }
+  cv_.notify_all();
+  if (worker_.joinable()) {
+    worker_.join();
+  }
+}
+
+void Sha1Pipeline::Submit(const uint8_t* data, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  CHECK(!finished_);
+  pending_.emplace_back(data, size);
+  // Defer the worker until there's a second chunk to overlap with.
+  if (!worker_.joinable() && pending_.size() > 1) {
+    worker_ = std::thread(&Sha1Pipeline::Run, this);
+  }
+  cv_.notify_all();
+}
+
+void Sha1Pipeline::Wait(size_t max_pending) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!worker_.joinable() && pending_.size() > max_pending) {
+    worker_ = std::thread(&Sha1Pipeline::Run, this);
+  }
+  cv_.wait(lock, [this, max_pending]() { return pending_.size() <= max_pending; });
+}
+
+void Sha1Pipeline::Finish(uint8_t digest[SHA_DIGEST_LENGTH]) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
+  }
+  cv_.notify_all();
+  if (worker_.joinable()) {
+    worker_.join();
+  }
+  // Without the worker, at most one chunk has been submitted.
+  for (const auto& [data, size] : pending_) {
+    SHA1_Update(&ctx_, data, size);
+  }
+  pending_.clear();
+  SHA1_Final(digest, &ctx_);
+}
+
+void Sha1Pipeline::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this]() { return !pending_.empty() || finished_; });
+    if (pending_.empty()) {
+      return;
+    }
+    // Keep the chunk queued while hashing it, so that Wait() doesn't return early.
+    auto [data, size] = pending_.front();
+    lock.unlock();
+    SHA1_Update(&ctx_, data, size);
+    lock.lock();
+    pending_.pop_front();
+    cv_.notify_all();
+  }
+}
+
+bool Sha1BlocksAt(int fd, const RangeSet& ranges, size_t block_size,
+                  uint8_t digest[SHA_DIGEST_LENGTH]) {
+  size_t chunk_blocks = std::max<size_t>(kReadChunkSize / block_size, 1);
+  // Two buffers: one being hashed while the other one is being read.
+  std::vector<uint8_t> buffers[2];
+  Sha1Pipeline pipeline;
+  size_t chunk = 0;
+  for (size_t first = 0; first < ranges.blocks(); first += chunk_blocks, chunk++) {
+    size_t blocks = std::min(chunk_blocks, ranges.blocks() - first);
+    auto chunk_ranges = ranges.GetSubRanges(first, blocks);
+    CHECK(chunk_ranges);
+
+    // Wait for the chunk that used this buffer earlier to be hashed.
+    std::vector<uint8_t>& buffer = buffers[chunk % 2];
+    pipeline.Wait(1);
+    buffer.resize(blocks * block_size);
+    if (!ReadBlocksAt(fd, *chunk_ranges, block_size, buffer.data())) {
+      return false;
+    }
+    pipeline.Submit(buffer.data(), buffer.size());
+  }
+  pipeline.Finish(digest);
+  return true;
+}
@@ -37,6 +37,9 @@
 
 std::string SimulatorRuntime::GetProperty(const std::string_view key,
                                           const std::string_view default_value) const {
+  if (trace_commands_ && key == "ro.updater.trace_commands") {
+    return "true";
+  }
   return source_->GetProperty(key, default_value);
 }
 
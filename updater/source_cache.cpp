@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/source_cache.h"
+
+#include <string.h>
+
+#include "otautil/rangeset.h"
+
+SourceBlockCache::Slot* SourceBlockCache::Touch(size_t block) {
+  auto it = index_.find(block);
+  if (it == index_.end()) {
+    return nullptr;
+  }
+  lru_.splice(lru_.end(), lru_, it->second);
+  return &*it->second;
+}
+
+void SourceBlockCache::Put(const RangeSet& src, const RangeSet& positions, const uint8_t* data) {
+  if (capacity_ == 0) {
+    return;
+  }
+  if (block_size_ > 0 && data_.empty()) {
+    data_.resize(capacity_ * block_size_);
+    for (size_t i = capacity_; i-- > 0;) {
+      free_offsets_.push_back(i * block_size_);
+    }
+  }
+
+  for (const auto& [begin, end] : positions) {
+    for (size_t position = begin; position < end; position++) {
+      size_t block = src.GetBlockNumber(position);
+      Slot* slot = Touch(block);
+      if (slot == nullptr) {
+        size_t offset = 0;
+        if (index_.size() == capacity_) {
+          offset = lru_.front().offset;
+          index_.erase(lru_.front().block);
+          lru_.pop_front();
+        } else if (block_size_ > 0) {
+          offset = free_offsets_.back();
+          free_offsets_.pop_back();
+        }
+        lru_.push_back(Slot{ block, offset });
+        index_.emplace(block, std::prev(lru_.end()));
+        slot = &lru_.back();
+      }
+      if (block_size_ > 0) {
+        memcpy(data_.data() + slot->offset, data + position * block_size_, block_size_);
+      }
+    }
+  }
+}
+
+bool SourceBlockCache::Get(const RangeSet& src, uint8_t* buffer) {
+  if (index_.empty() || src.blocks() > index_.size()) {
+    return false;
+  }
+  for (const auto& [begin, end] : src) {
+    for (size_t block = begin; block < end; block++) {
+      if (index_.count(block) == 0) {
+        return false;
+      }
+    }
+  }
+
+  uint8_t* dest = buffer;
+  for (const auto& [begin, end] : src) {
+    for (size_t block = begin; block < end; block++) {
+      Slot* slot = Touch(block);
+      if (block_size_ > 0) {
+        memcpy(dest, data_.data() + slot->offset, block_size_);
+        dest += block_size_;
+      }
+    }
+  }
+  hits_++;
+  return true;
+}
+
+void SourceBlockCache::Invalidate(const RangeSet& ranges) {
+  for (const auto& [begin, end] : ranges) {
+    for (size_t block = begin; block < end && !index_.empty(); block++) {
+      auto it = index_.find(block);
+      if (it == index_.end()) {
+        continue;
+      }
+      if (block_size_ > 0) {
+        free_offsets_.push_back(it->second->offset);
+      }
+      lru_.erase(it->second);
+      index_.erase(it);
+    }
+  }
+}
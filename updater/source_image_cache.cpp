@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "updater/source_image_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+bool CloneImageFile(int src_fd, int dst_fd) {
+  if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+    return true;
+  }
+
+  struct stat sb;
+  if (fstat(src_fd, &sb) == -1 || ftruncate64(dst_fd, 0) == -1 ||
+      ftruncate64(dst_fd, sb.st_size) == -1) {
+    PLOG(ERROR) << "Failed to size the copy";
+    return false;
+  }
+  off64_t offset = 0;
+  while (offset < sb.st_size) {
+    off64_t data = lseek64(src_fd, offset, SEEK_DATA);
+    if (data == -1) {
+      if (errno == ENXIO) break;  // Only a hole is left.
+      PLOG(ERROR) << "Failed to seek for data";
+      return false;
+    }
+    off64_t hole = lseek64(src_fd, data, SEEK_HOLE);
+    if (hole == -1) {
+      PLOG(ERROR) << "Failed to seek for a hole";
+      return false;
+    }
+    for (off64_t in = data, out = data; in < hole;) {
+      ssize_t copied = copy_file_range(src_fd, &in, dst_fd, &out, hole - in, 0);
+      if (copied <= 0) {
+        PLOG(ERROR) << "Failed to copy the data at " << in;
+        return false;
+      }
+    }
+    offset = hole;
+  }
+  return true;
+}
+
+SourceImageCache::SourceImageCache(const std::string_view cache_dir, const std::string_view key)
+    : dir_(std::string(cache_dir) + "/" + std::string(key)) {}
+
+std::string SourceImageCache::GetImagePath(const std::string_view entry_name) const {
+  std::string name(entry_name);
+  std::replace(name.begin(), name.end(), '/', '_');
+  return dir_ + "/" + name;
+}
+
+bool SourceImageCache::Get(const std::string_view entry_name, TemporaryFile* image_file) const {
+  auto path = GetImagePath(entry_name);
+  android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1) {
+    return false;
+  }
+  if (!CloneImageFile(fd, image_file->fd)) {
+    LOG(WARNING) << "Failed to copy the cached " << path;
+    return false;
+  }
+  LOG(INFO) << "Using the cached " << path;
+  return true;
+}
+
+bool SourceImageCache::Put(const std::string_view entry_name,
+                           const TemporaryFile& image_file) const {
+  if (mkdir(dir_.c_str(), 0755) == -1 && errno != EEXIST) {
+    PLOG(ERROR) << "Failed to create " << dir_;
+    return false;
+  }
+  // Other simulations may share the cache; the image only shows up under its name once complete.
+  TemporaryFile cached_image(dir_);
+  if (cached_image.fd == -1 || !CloneImageFile(image_file.fd, cached_image.fd)) {
+    return false;
+  }
+  auto path = GetImagePath(entry_name);
+  if (rename(cached_image.path, path.c_str()) == -1) {
+    PLOG(ERROR) << "Failed to rename " << cached_image.path << " to " << path;
+    return false;
+  }
+  close(cached_image.release());
+  return true;
+}
@@ -16,27 +16,74 @@
 
 #include "updater/target_files.h"
 
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <filesystem>
+#include <limits>
 #include <memory>
 
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <openssl/sha.h>
 #include <sparse/sparse.h>
 
+#include "otautil/print_sha1.h"
+#include "private/property_file.h"
+
+// Writes the raw image to |output_fd| as it streams out of libsparse, leaving holes for the
+// don't-care chunks and for the blocks that are all zeros (which includes the zero fill chunks
+// that make up most of an ext4 image). The file is sized up front, so that the simulator only
+// ever allocates the blocks with data, plus the ones the OTA writes.
+class SparseRawWriter {
+ public:
+  static constexpr size_t kBlockSize = 4096;
+
+  explicit SparseRawWriter(int fd) : fd_(fd) {}
+
+  static int Write(void* priv, const void* data, size_t len) {
+    return static_cast<SparseRawWriter*>(priv)->Write(static_cast<const uint8_t*>(data), len);
+  }
+
+ private:
+  int Write(const uint8_t* data, size_t len) {
+    // Skipped chunks come with no data.
+    if (data != nullptr) {
+      for (size_t written = 0; written < len;) {
+        size_t to_write = std::min(len - written, kBlockSize);
+        if (!IsZero(data + written, to_write) &&
+            !android::base::WriteFullyAtOffset(fd_, data + written, to_write, offset_ + written)) {
+          PLOG(ERROR) << "Failed to write the raw image at " << offset_ + written;
+          return -1;
+        }
+        written += to_write;
+      }
+    }
+    offset_ += len;
+    return 0;
+  }
+
+  static bool IsZero(const uint8_t* data, size_t len) {
+    return data[0] == 0 && memcmp(data, data + 1, len - 1) == 0;
+  }
+
+  int fd_;
+  off64_t offset_{ 0 };
+};
+
 static bool SimgToImg(int input_fd, int output_fd) {
   if (lseek64(input_fd, 0, SEEK_SET) == -1) {
     PLOG(ERROR) << "Failed to lseek64 on the input sparse image";
     return false;
   }
 
-  if (lseek64(output_fd, 0, SEEK_SET) == -1) {
-    PLOG(ERROR) << "Failed to lseek64 on the output raw image";
-    return false;
-  }
-
   std::unique_ptr<sparse_file, decltype(&sparse_file_destroy)> s_file(
       sparse_file_import(input_fd, true, false), sparse_file_destroy);
   if (!s_file) {
@@ -44,26 +91,17 @@ static bool SimgToImg(int input_fd, int output_fd) {
     return false;
   }
 
-  if (sparse_file_write(s_file.get(), output_fd, false, false, false) < 0) {
-    PLOG(ERROR) << "Failed to output the raw image file.";
+  // Any earlier content of the output goes away, so the blocks that aren't written read as zeros.
+  int64_t raw_size = sparse_file_len(s_file.get(), false, false);
+  if (raw_size < 0 || ftruncate64(output_fd, 0) == -1 || ftruncate64(output_fd, raw_size) == -1) {
+    PLOG(ERROR) << "Failed to size the raw image to " << raw_size;
     return false;
   }
 
-  return true;
-}
-
-static bool ParsePropertyFile(const std::string_view prop_content,
-                              std::map<std::string, std::string, std::less<>>* props_map) {
-  LOG(INFO) << "Start parsing build property\n";
-  std::vector<std::string> lines = android::base::Split(std::string(prop_content), "\n");
-  for (const auto& line : lines) {
-    if (line.empty() || line[0] == '#') continue;
-    auto pos = line.find('=');
-    if (pos == std::string::npos) continue;
-    std::string key = line.substr(0, pos);
-    std::string value = line.substr(pos + 1);
-    LOG(INFO) << key << ": " << value;
-    props_map->emplace(key, value);
+  SparseRawWriter writer(output_fd);
+  if (sparse_file_callback(s_file.get(), false, false, SparseRawWriter::Write, &writer) < 0) {
+    LOG(ERROR) << "Failed to output the raw image file.";
+    return false;
   }
 
   return true;
@@ -71,13 +109,19 @@ static bool ParsePropertyFile(const std::string_view prop_content,
 
 static bool ParseFstab(const std::string_view fstab, std::vector<FstabInfo>* fstab_info_list) {
   LOG(INFO) << "parsing fstab\n";
-  std::vector<std::string> lines = android::base::Split(std::string(fstab), "\n");
-  for (const auto& line : lines) {
+  for (std::string_view rest = fstab; !rest.empty();) {
+    std::string_view line = rest.substr(0, rest.find('\n'));
+    rest.remove_prefix(std::min(rest.size(), line.size() + 1));
     if (line.empty() || line[0] == '#') continue;
 
     // <block_device>  <mount_point>  <fs_type>  <mount_flags>  optional:<fs_mgr_flags>
-    std::vector<std::string> tokens = android::base::Split(line, " ");
-    tokens.erase(std::remove(tokens.begin(), tokens.end(), ""), tokens.end());
+    std::vector<std::string_view> tokens;
+    for (size_t pos = line.find_first_not_of(' '); pos != std::string_view::npos;
+         pos = line.find_first_not_of(' ', pos)) {
+      size_t end = std::min(line.find(' ', pos), line.size());
+      tokens.push_back(line.substr(pos, end - pos));
+      pos = end;
+    }
     if (tokens.size() != 4 && tokens.size() != 5) {
       LOG(ERROR) << "Unexpected token size: " << tokens.size() << std::endl
                  << "Error parsing fstab line: " << line;
@@ -98,83 +142,211 @@ static bool ParseFstab(const std::string_view fstab, std::vector<FstabInfo>* fst
       continue;
     }
 
-    fstab_info_list->emplace_back(blockdev, mount_point, fs_type);
+    fstab_info_list->emplace_back(std::string(blockdev), std::string(mount_point),
+                                  std::string(fs_type));
   }
 
   return true;
 }
 
-bool TargetFile::EntryExists(const std::string_view name) const {
-  if (extracted_input_) {
-    std::string entry_path = path_ + "/" + std::string(name);
-    if (access(entry_path.c_str(), O_RDONLY) != 0) {
-      PLOG(WARNING) << "Failed to access " << entry_path;
+// Collects the inflated data of a zip entry, and writes it out in chunks of |kBufferSize| rather
+// than in the small pieces that the inflater hands out.
+class BufferedFdWriter {
+ public:
+  static constexpr size_t kBufferSize = 1024 * 1024;
+
+  explicit BufferedFdWriter(int fd) : fd_(fd) {
+    buffer_.reserve(kBufferSize);
+  }
+
+  static bool Append(const uint8_t* data, size_t size, void* cookie) {
+    return static_cast<BufferedFdWriter*>(cookie)->Append(data, size);
+  }
+
+  bool Flush() {
+    if (!android::base::WriteFully(fd_, buffer_.data(), buffer_.size())) {
+      PLOG(ERROR) << "Failed to write the extracted entry";
       return false;
     }
+    buffer_.clear();
     return true;
   }
 
-  CHECK(handle_);
-  ZipEntry64 img_entry;
-  return FindEntry(handle_, name, &img_entry) == 0;
-}
+ private:
+  bool Append(const uint8_t* data, size_t size) {
+    if (buffer_.size() + size > kBufferSize && !Flush()) {
+      return false;
+    }
+    if (size >= kBufferSize) {
+      if (!android::base::WriteFully(fd_, data, size)) {
+        PLOG(ERROR) << "Failed to write the extracted entry";
+        return false;
+      }
+      return true;
+    }
+    buffer_.insert(buffer_.end(), data, data + size);
+    return true;
+  }
 
-bool TargetFile::ReadEntryToString(const std::string_view name, std::string* content) const {
+  int fd_;
+  std::vector<uint8_t> buffer_;
+};
+
+bool TargetFile::IndexEntries() {
   if (extracted_input_) {
-    std::string entry_path = path_ + "/" + std::string(name);
-    return android::base::ReadFileToString(entry_path, content);
+    // The paths of the files all start with the path of the directory, then a separator.
+    size_t prefix_size = (std::filesystem::path(path_) / "").string().size();
+    std::error_code ec;
+    std::filesystem::recursive_directory_iterator it(path_, ec);
+    for (; !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+      if (std::error_code file_ec; it->is_regular_file(file_ec)) {
+        uint64_t size = it->file_size(file_ec);
+        entries_.emplace(it->path().string().substr(prefix_size), Entry{ size, {} });
+      }
+    }
+    if (ec) {
+      LOG(ERROR) << "Failed to list " << path_ << ": " << ec.message();
+      return false;
+    }
+    return true;
   }
 
   CHECK(handle_);
+  void* cookie;
+  if (auto ret = StartIteration(handle_, &cookie); ret != 0) {
+    LOG(ERROR) << "Failed to iterate over " << path_ << ": " << ErrorCodeString(ret);
+    return false;
+  }
   ZipEntry64 entry;
-  if (auto find_err = FindEntry(handle_, name, &entry); find_err != 0) {
-    LOG(ERROR) << "failed to find " << name << " in the package: " << ErrorCodeString(find_err);
+  std::string name;
+  int32_t ret;
+  while ((ret = Next(cookie, &entry, &name)) == 0) {
+    entries_.emplace(name, Entry{ entry.uncompressed_length, entry });
+  }
+  EndIteration(cookie);
+  if (ret != -1) {
+    LOG(ERROR) << "Failed to iterate over " << path_ << ": " << ErrorCodeString(ret);
     return false;
   }
 
-  if (entry.uncompressed_length == 0) {
-    content->clear();
+  // The stored entries (the images, mostly) are read straight out of the mapping.
+  int fd = GetFileDescriptor(handle_);
+  struct stat sb;
+  if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+    mapped_zip_ = android::base::MappedFile::FromFd(fd, 0, sb.st_size, PROT_READ);
+  }
+  if (!mapped_zip_) {
+    PLOG(WARNING) << "Failed to map " << path_;
+  }
+  return true;
+}
+
+bool TargetFile::EntryExists(const std::string_view name) const {
+  return entries_.find(name) != entries_.end();
+}
+
+bool TargetFile::ReadEntry(const std::string_view name, std::string* storage,
+                           std::string_view* content) const {
+  auto it = entries_.find(name);
+  if (it == entries_.end()) {
+    LOG(ERROR) << "failed to find " << name << " in " << path_;
+    return false;
+  }
+  const auto& entry = it->second;
+
+  if (extracted_input_) {
+    std::string entry_path = path_ + "/" + std::string(name);
+    if (!android::base::ReadFileToString(entry_path, storage)) {
+      PLOG(ERROR) << "Failed to read " << entry_path;
+      return false;
+    }
+    *content = *storage;
     return true;
   }
 
-  if (entry.uncompressed_length > std::numeric_limits<size_t>::max()) {
+  if (entry.size == 0) {
+    *content = {};
+    return true;
+  }
+
+  if (entry.size > std::numeric_limits<size_t>::max()) {
     LOG(ERROR) << "Failed to extract " << name
-               << " because's uncompressed size exceeds size of address space. "
-               << entry.uncompressed_length;
+               << " because's uncompressed size exceeds size of address space. " << entry.size;
     return false;
   }
 
-  content->resize(entry.uncompressed_length);
+  if (mapped_zip_ && entry.zip_entry.method == kCompressStored &&
+      entry.zip_entry.offset + entry.size <= mapped_zip_->size()) {
+    *content = std::string_view(mapped_zip_->data() + entry.zip_entry.offset, entry.size);
+    return true;
+  }
+
+  storage->resize(entry.size);
   if (auto extract_err = ExtractToMemory(
-          handle_, &entry, reinterpret_cast<uint8_t*>(&content->at(0)), entry.uncompressed_length);
+          handle_, &entry.zip_entry, reinterpret_cast<uint8_t*>(storage->data()), entry.size);
       extract_err != 0) {
     LOG(ERROR) << "failed to read " << name << " from package: " << ErrorCodeString(extract_err);
     return false;
   }
+  *content = *storage;
+  return true;
+}
 
+bool TargetFile::ReadEntryToString(const std::string_view name, std::string* content) const {
+  std::string_view view;
+  if (!ReadEntry(name, content, &view)) {
+    return false;
+  }
+  if (view.data() != content->data()) {
+    content->assign(view);
+  }
   return true;
 }
 
 bool TargetFile::ExtractEntryToTempFile(const std::string_view name,
                                         TemporaryFile* temp_file) const {
+  auto it = entries_.find(name);
+  if (it == entries_.end()) {
+    LOG(ERROR) << "failed to find " << name << " in " << path_;
+    return false;
+  }
+  const auto& entry = it->second;
+
   if (extracted_input_) {
     std::string entry_path = path_ + "/" + std::string(name);
     return std::filesystem::copy_file(entry_path, temp_file->path,
                                       std::filesystem::copy_options::overwrite_existing);
   }
 
-  CHECK(handle_);
-  ZipEntry64 entry;
-  if (auto find_err = FindEntry(handle_, name, &entry); find_err != 0) {
-    LOG(ERROR) << "failed to find " << name << " in the package: " << ErrorCodeString(find_err);
+  if (lseek64(temp_file->fd, 0, SEEK_SET) == -1 || ftruncate64(temp_file->fd, 0) == -1) {
+    PLOG(ERROR) << "Failed to reset " << temp_file->path;
     return false;
   }
 
-  if (auto status = ExtractEntryToFile(handle_, &entry, temp_file->fd); status != 0) {
+  if (mapped_zip_ && entry.zip_entry.method == kCompressStored &&
+      entry.zip_entry.offset + entry.size <= mapped_zip_->size()) {
+    if (!android::base::WriteFully(temp_file->fd, mapped_zip_->data() + entry.zip_entry.offset,
+                                   entry.size)) {
+      PLOG(ERROR) << "Failed to extract zip entry " << name << " to " << temp_file->path;
+      return false;
+    }
+    return true;
+  }
+
+  BufferedFdWriter writer(temp_file->fd);
+  if (auto status =
+          ProcessZipEntryContents(handle_, &entry.zip_entry, BufferedFdWriter::Append, &writer);
+      status != 0) {
     LOG(ERROR) << "Failed to extract zip entry " << name << " : " << ErrorCodeString(status);
     return false;
   }
-  return true;
+  return writer.Flush();
+}
+
+TargetFile::~TargetFile() {
+  if (handle_ != nullptr) {
+    CloseArchive(handle_);
+  }
 }
 
 bool TargetFile::Open() {
@@ -185,15 +357,39 @@ bool TargetFile::Open() {
     }
   }
 
+  if (!IndexEntries()) {
+    return false;
+  }
+
   // Parse the misc info.
-  std::string misc_info_content;
-  if (!ReadEntryToString("META/misc_info.txt", &misc_info_content)) {
+  std::string storage;
+  std::string_view misc_info_content;
+  if (!ReadEntry("META/misc_info.txt", &storage, &misc_info_content)) {
     return false;
   }
-  if (!ParsePropertyFile(misc_info_content, &misc_info_)) {
+  misc_info_ = PropertyFile(misc_info_content).properties();
+
+  return true;
+}
+
+bool TargetFile::GetContentDigest(std::string* digest) const {
+  if (extracted_input_) {
     return false;
   }
 
+  // The index is sorted by name, so the digest depends only on the contents of the zip (and not
+  // on its layout).
+  std::string content;
+  for (const auto& [name, entry] : entries_) {
+    if (!content.empty()) {
+      content += "\n";
+    }
+    content += android::base::StringPrintf("%s:%08x:%" PRIu64, name.c_str(), entry.zip_entry.crc32,
+                                           entry.size);
+  }
+  uint8_t sha256[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(content.data()), content.size(), sha256);
+  *digest = print_hex(sha256, sizeof(sha256));
   return true;
 }
 
@@ -215,16 +411,23 @@ bool TargetFile::GetBuildProps(std::map<std::string, std::string, std::less<>>*
     "VENDOR/odm/etc/build.prop",
   };
   for (const auto& name : kPropLocations) {
-    std::string build_prop_content;
-    if (!ReadEntryToString(name, &build_prop_content)) {
+    if (!EntryExists(name)) {
       continue;
     }
-    std::map<std::string, std::string, std::less<>> props;
-    if (!ParsePropertyFile(build_prop_content, &props)) {
-      LOG(ERROR) << "Failed to parse build prop in " << name;
-      return false;
+    auto read = [this, &name](std::string* content) { return ReadEntryToString(name, content); };
+    // The files of an extracted target files directory are cached, as file_getprop() does.
+    std::shared_ptr<const PropertyFile> properties;
+    std::string storage;
+    std::string_view content;
+    if (extracted_input_) {
+      properties = PropertyFileCache::Get().Load(path_ + "/" + std::string(name), read);
+    } else if (ReadEntry(name, &storage, &content)) {
+      properties = std::make_shared<const PropertyFile>(content);
     }
-    for (const auto& [key, value] : props) {
+    if (!properties) {
+      continue;
+    }
+    for (const auto& [key, value] : properties->properties()) {
       if (auto it = props_map->find(key); it != props_map->end() && it->second != value) {
         LOG(WARNING) << "Property " << key << " has different values in property files, we got "
                      << it->second << " and " << value;
@@ -247,7 +450,19 @@ bool TargetFile::ExtractImage(const std::string_view entry_name, const FstabInfo
     if (!ExtractEntryToTempFile(entry_name, image_file)) {
       return false;
     }
-  } else {  // treated as ext4 sparse image
+  } else if (extracted_input_) {  // treated as ext4 sparse image
+    // Convert the sparse image to raw, reading it in place.
+    std::string entry_path = path_ + "/" + std::string(entry_name);
+    android::base::unique_fd sparse_fd(open(entry_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (sparse_fd == -1) {
+      PLOG(ERROR) << "Failed to open " << entry_path;
+      return false;
+    }
+    if (!SimgToImg(sparse_fd, image_file->fd)) {
+      LOG(ERROR) << "Failed to convert " << fstab_info.mount_point << " to raw.";
+      return false;
+    }
+  } else {
     TemporaryFile sparse_image{ std::string(work_dir) };
     if (!ExtractEntryToTempFile(entry_name, &sparse_image)) {
       return false;
@@ -272,10 +487,10 @@ bool TargetFile::ParseFstabInfo(std::vector<FstabInfo>* fstab_info_list) const {
     "BOOT/RAMDISK/system/etc/recovery.fstab",
     "BOOT/RAMDISK/etc/recovery.fstab",
   };
-  std::string fstab_content;
+  std::string storage;
+  std::string_view fstab_content;
   for (const auto& name : kRecoveryFstabLocations) {
-    if (std::string content; ReadEntryToString(name, &content)) {
-      fstab_content = std::move(content);
+    if (EntryExists(name) && ReadEntry(name, &storage, &fstab_content)) {
       break;
     }
   }
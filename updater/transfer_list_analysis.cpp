@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "updater/transfer_list_analysis.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+
+// The bucket of |value|: the largest power of two that isn't above it.
+static size_t Bucket(size_t value) {
+  size_t bucket = 1;
+  while (bucket <= value / 2) {
+    bucket *= 2;
+  }
+  return bucket;
+}
+
+// Follows the dependencies between the commands, to find the longest chain of them. A command
+// depends on the last one that wrote the blocks it reads or writes, and on the ones that read the
+// blocks it writes since. The chain ending at each command is measured in blocks of work.
+class DependencyTracker {
+ public:
+  static constexpr size_t kNone = SIZE_MAX;
+
+  // Returns the command (among those added) with the longest chain that a command reading |reads|
+  // and writing |writes| depends on, or kNone.
+  size_t FindDependency(const RangeSet& reads, const RangeSet& writes) {
+    size_t dependency = kNone;
+    auto depend_on = [this, &dependency](size_t command) {
+      if (command != kNone && (dependency == kNone || depths_[command] > depths_[dependency])) {
+        dependency = command;
+      }
+    };
+    ForEachBlock(reads, [this, &depend_on](size_t block) { depend_on(writer_[block]); });
+    ForEachBlock(writes, [this, &depend_on](size_t block) {
+      depend_on(writer_[block]);
+      depend_on(reader_[block]);
+    });
+    return dependency;
+  }
+
+  // Adds the command that reads |reads| and writes |writes|, ending a chain of |depth| blocks of
+  // work. Returns the number of blocks it writes for the first time.
+  size_t Add(const RangeSet& reads, const RangeSet& writes, uint64_t depth) {
+    size_t command = depths_.size();
+    depths_.push_back(depth);
+    ForEachBlock(reads, [this, command](size_t block) {
+      if (reader_[block] == kNone || depths_[reader_[block]] < depths_[command]) {
+        reader_[block] = command;
+      }
+    });
+    size_t first_writes = 0;
+    ForEachBlock(writes, [this, command, &first_writes](size_t block) {
+      if (!written_[block]) {
+        written_[block] = true;
+        first_writes++;
+      }
+      writer_[block] = command;
+      reader_[block] = kNone;
+    });
+    return first_writes;
+  }
+
+  uint64_t depth(size_t command) const {
+    return command == kNone ? 0 : depths_[command];
+  }
+
+ private:
+  template <typename F>
+  void ForEachBlock(const RangeSet& ranges, F&& f) {
+    for (const auto& [begin, end] : ranges) {
+      if (end > writer_.size()) {
+        writer_.resize(end, kNone);
+        reader_.resize(end, kNone);
+        written_.resize(end, false);
+      }
+      for (size_t block = begin; block < end; block++) {
+        f(block);
+      }
+    }
+  }
+
+  // The chain of work ending at each command added.
+  std::vector<uint64_t> depths_;
+  // Per block, the command that last wrote it, the one with the longest chain that read it since,
+  // and whether it has been written at all.
+  std::vector<size_t> writer_;
+  std::vector<size_t> reader_;
+  std::vector<bool> written_;
+};
+
+bool AnalyzeTransferList(const TransferList& transfer_list, TransferListAnalysis* analysis,
+                         std::string* err) {
+  *analysis = {};
+  DependencyTracker tracker;
+  // The size of each stash, and the command that stashed it.
+  std::unordered_map<std::string, std::pair<size_t, size_t>> stashes;
+  size_t stash_blocks = 0;
+  // The number of commands in the chain ending at each command.
+  std::vector<size_t> chain_commands;
+
+  auto count_ranges = [analysis](const RangeSet& ranges) {
+    for (const auto& [begin, end] : ranges) {
+      analysis->blocks_per_range[Bucket(end - begin)]++;
+    }
+  };
+
+  for (const auto& command : transfer_list.commands()) {
+    const std::string& cmdline = command.cmdline();
+    analysis->command_counts[cmdline.substr(0, cmdline.find(' '))]++;
+
+    RangeSet reads;
+    RangeSet writes;
+    const std::vector<StashInfo>* used_stashes = nullptr;
+    switch (command.type()) {
+      case Command::Type::BSDIFF:
+      case Command::Type::IMGDIFF:
+        analysis->patch_bytes += command.patch().length();
+        analysis->patch_data_end = std::max<uint64_t>(
+            analysis->patch_data_end, command.patch().offset() + command.patch().length());
+        [[fallthrough]];
+      case Command::Type::MOVE:
+        reads = command.source().ranges();
+        used_stashes = &command.source().stashes();
+        writes = command.target().ranges();
+        break;
+      case Command::Type::NEW:
+        analysis->new_blocks += command.target().blocks();
+        [[fallthrough]];
+      case Command::Type::ZERO:
+      case Command::Type::ERASE:
+        writes = command.target().ranges();
+        break;
+      case Command::Type::STASH:
+        reads = command.stash().ranges();
+        break;
+      case Command::Type::COMPUTE_HASH_TREE:
+        reads = command.hash_tree_info().source_ranges();
+        writes = command.hash_tree_info().hash_tree_ranges();
+        break;
+      default:
+        break;
+    }
+
+    uint64_t work = reads.blocks() + writes.blocks();
+    size_t dependency = tracker.FindDependency(reads, writes);
+    auto depend_on = [&tracker, &dependency](size_t command) {
+      if (dependency == DependencyTracker::kNone ||
+          tracker.depth(command) > tracker.depth(dependency)) {
+        dependency = command;
+      }
+    };
+    if (used_stashes != nullptr) {
+      for (const auto& stash : *used_stashes) {
+        auto it = stashes.find(stash.id());
+        if (it == stashes.end()) {
+          *err = android::base::StringPrintf("command %zu uses stash %s before it's stashed",
+                                             command.index(), stash.id().c_str());
+          return false;
+        }
+        depend_on(it->second.second);
+        work += stash.blocks();
+        analysis->blocks_loaded_from_stash += stash.blocks();
+      }
+    }
+
+    size_t index = chain_commands.size();
+    if (command.type() == Command::Type::STASH) {
+      // Stashing the same blocks again is a no-op.
+      if (stashes.emplace(command.stash().id(), std::make_pair(command.stash().blocks(), index))
+              .second) {
+        stash_blocks += command.stash().blocks();
+        analysis->blocks_stashed += command.stash().blocks();
+        work += command.stash().blocks();
+      }
+    } else if (command.type() == Command::Type::FREE) {
+      if (auto it = stashes.find(command.stash().id()); it != stashes.end()) {
+        stash_blocks -= it->second.first;
+        stashes.erase(it);
+      }
+    }
+    analysis->peak_stash_blocks = std::max(analysis->peak_stash_blocks, stash_blocks);
+    analysis->peak_stash_entries = std::max(analysis->peak_stash_entries, stashes.size());
+
+    uint64_t depth = tracker.depth(dependency) + work;
+    analysis->unique_blocks_written += tracker.Add(reads, writes, depth);
+    chain_commands.push_back(
+        (dependency == DependencyTracker::kNone ? 0 : chain_commands[dependency]) + (work > 0));
+    if (depth > analysis->critical_path_work) {
+      analysis->critical_path_work = depth;
+      analysis->critical_path_commands = chain_commands.back();
+    }
+
+    analysis->blocks_read += reads.blocks();
+    analysis->blocks_written += writes.blocks();
+    analysis->total_work += work;
+    if (writes.size() > 0) {
+      analysis->ranges_per_command[Bucket(writes.size())]++;
+    }
+    count_ranges(reads);
+    count_ranges(writes);
+  }
+
+  analysis->independent_batches =
+      GroupIndependentCommands(transfer_list.commands(), SIZE_MAX, SIZE_MAX).size();
+  return true;
+}
+
+// Formats the histogram of power-of-two |buckets|, e.g. "     2-3: 10".
+static std::string FormatHistogram(const std::map<size_t, size_t>& buckets) {
+  std::string result;
+  for (const auto& [bucket, count] : buckets) {
+    std::string label = bucket == 1 ? "1" : android::base::StringPrintf("%zu-%zu", bucket,
+                                                                         bucket * 2 - 1);
+    result += android::base::StringPrintf("\n  %15s: %zu", label.c_str(), count);
+  }
+  return result;
+}
+
+static double Ratio(uint64_t numerator, uint64_t denominator) {
+  return denominator == 0 ? 0 : static_cast<double>(numerator) / denominator;
+}
+
+std::string TransferListAnalysis::Report() const {
+  std::string report = "Commands:";
+  for (const auto& [command, count] : command_counts) {
+    report += android::base::StringPrintf("\n  %15s: %zu", command.c_str(), count);
+  }
+
+  report += android::base::StringPrintf(
+      "\nBlocks written: %" PRIu64 " (%" PRIu64 " distinct, %.2fx)"
+      "\nBlocks read: %" PRIu64 " (%.2f per block written)"
+      "\nBlocks stashed: %" PRIu64 ", loaded from the stash: %" PRIu64
+      "\nPeak stash: %zu blocks in %zu entries"
+      "\nNew data: %" PRIu64 " blocks; patches: %" PRIu64 " bytes",
+      blocks_written, unique_blocks_written, Ratio(blocks_written, unique_blocks_written),
+      blocks_read, Ratio(blocks_read, blocks_written), blocks_stashed, blocks_loaded_from_stash,
+      peak_stash_blocks, peak_stash_entries, new_blocks, patch_bytes);
+
+  size_t commands = 0;
+  for (const auto& [command, count] : command_counts) {
+    commands += count;
+  }
+  report += android::base::StringPrintf(
+      "\nWork: %" PRIu64 " blocks; critical path: %" PRIu64 " blocks in %zu commands"
+      " (up to %.1fx parallelism)"
+      "\nBatches of consecutive independent commands: %zu (%.1f commands each)",
+      total_work, critical_path_work, critical_path_commands,
+      Ratio(total_work, critical_path_work), independent_batches,
+      Ratio(commands, independent_batches));
+
+  report += "\nTarget ranges per command:" + FormatHistogram(ranges_per_command);
+  report += "\nBlocks per range:" + FormatHistogram(blocks_per_range);
+  return report;
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Analyzes a transfer list on the host, without executing it: the commands, the blocks read,
+// written and stashed, the peak stash, the longest chain of dependent commands (and so the
+// parallelism available to the updater), and how fragmented the ranges are.
+//
+//   transfer_list_analyzer [--new_data <new.dat[.br]>] [--patch_data <patch.dat>] <transfer.list>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+
+#include "private/commands.h"
+#include "updater/transfer_list_analysis.h"
+
+using namespace std::string_literals;
+
+static void Usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [--new_data <new.dat[.br]>] [--patch_data <patch.dat>] <transfer.list>\n",
+          name);
+}
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv, &android::base::StderrLogger);
+
+  std::string new_data;
+  std::string patch_data;
+  constexpr struct option OPTIONS[] = {
+    { "new_data", required_argument, nullptr, 0 },
+    { "patch_data", required_argument, nullptr, 0 },
+    { nullptr, 0, nullptr, 0 },
+  };
+  int arg;
+  int option_index;
+  while ((arg = getopt_long(argc, argv, "", OPTIONS, &option_index)) != -1) {
+    if (arg != 0) {
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    auto option_name = OPTIONS[option_index].name;
+    if (option_name == "new_data"s) {
+      new_data = optarg;
+    } else if (option_name == "patch_data"s) {
+      patch_data = optarg;
+    }
+  }
+  if (optind + 1 != argc) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::string content;
+  if (!android::base::ReadFileToString(argv[optind], &content)) {
+    PLOG(ERROR) << "Failed to read " << argv[optind];
+    return EXIT_FAILURE;
+  }
+  std::string err;
+  auto transfer_list = TransferList::Parse(content, &err);
+  if (!transfer_list) {
+    LOG(ERROR) << "Failed to parse " << argv[optind] << ": " << err;
+    return EXIT_FAILURE;
+  }
+  TransferListAnalysis analysis;
+  if (!AnalyzeTransferList(transfer_list, &analysis, &err)) {
+    LOG(ERROR) << "Failed to analyze " << argv[optind] << ": " << err;
+    return EXIT_FAILURE;
+  }
+
+  printf("Version %d, %zu blocks to write, stash of up to %zu blocks in %zu entries\n",
+         transfer_list.version(), transfer_list.total_blocks(), transfer_list.stash_max_blocks(),
+         transfer_list.stash_max_entries());
+  printf("%s\n", analysis.Report().c_str());
+
+  // The data files only need to match the transfer list.
+  bool valid = true;
+  struct stat sb;
+  if (!new_data.empty()) {
+    if (stat(new_data.c_str(), &sb) != 0) {
+      PLOG(ERROR) << "Failed to stat " << new_data;
+      return EXIT_FAILURE;
+    }
+    uint64_t raw_size = analysis.new_blocks * 4096;
+    if (android::base::EndsWith(new_data, ".br")) {
+      printf("New data: %jd bytes compressed, %.2fx\n", static_cast<intmax_t>(sb.st_size),
+             sb.st_size == 0 ? 0 : static_cast<double>(raw_size) / sb.st_size);
+    } else if (static_cast<uint64_t>(sb.st_size) != raw_size) {
+      LOG(ERROR) << new_data << " has " << sb.st_size << " bytes, the transfer list needs "
+                 << raw_size;
+      valid = false;
+    }
+  }
+  if (!patch_data.empty()) {
+    if (stat(patch_data.c_str(), &sb) != 0) {
+      PLOG(ERROR) << "Failed to stat " << patch_data;
+      return EXIT_FAILURE;
+    }
+    if (static_cast<uint64_t>(sb.st_size) < analysis.patch_data_end) {
+      LOG(ERROR) << patch_data << " has " << sb.st_size << " bytes, the patches reach "
+                 << analysis.patch_data_end;
+      valid = false;
+    } else {
+      printf("Patch data: %jd bytes, %.1f%% used by the patches\n",
+             static_cast<intmax_t>(sb.st_size),
+             sb.st_size == 0 ? 0 : 100.0 * analysis.patch_bytes / sb.st_size);
+    }
+  }
+  return valid ? EXIT_SUCCESS : EXIT_FAILURE;
+}
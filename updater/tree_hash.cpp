@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/tree_hash.h"
+
+#include <errno.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <android-base/logging.h>
+
+#include "otautil/rangeset.h"
+#include "private/block_io.h"
+
+bool Sha256TreeBlocksAt(int fd, const RangeSet& ranges, size_t block_size, size_t max_workers,
+                        uint8_t digest[SHA256_DIGEST_LENGTH]) {
+  size_t segment_blocks = std::max<size_t>(kTreeHashSegmentSize / block_size, 1);
+  size_t segments = (ranges.blocks() + segment_blocks - 1) / segment_blocks;
+  std::vector<uint8_t> digests(segments * SHA256_DIGEST_LENGTH);
+
+  // Each worker takes the next segment that's left, into a buffer of its own.
+  std::atomic<size_t> next_segment{ 0 };
+  std::atomic<bool> failed{ false };
+  std::mutex error_lock;
+  int error = 0;
+  auto hash_segments = [&]() {
+    std::vector<uint8_t> buffer;
+    for (size_t segment = next_segment++; segment < segments && !failed;
+         segment = next_segment++) {
+      size_t first = segment * segment_blocks;
+      size_t blocks = std::min(segment_blocks, ranges.blocks() - first);
+      auto segment_ranges = ranges.GetSubRanges(first, blocks);
+      CHECK(segment_ranges);
+
+      buffer.resize(blocks * block_size);
+      if (!ReadBlocksAt(fd, *segment_ranges, block_size, buffer.data())) {
+        std::lock_guard<std::mutex> lock(error_lock);
+        if (!failed.exchange(true)) {
+          error = errno;
+        }
+        return;
+      }
+      SHA256(buffer.data(), buffer.size(), digests.data() + segment * SHA256_DIGEST_LENGTH);
+    }
+  };
+
+  size_t workers = std::clamp<size_t>(max_workers, 1, std::max<size_t>(segments, 1));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < workers; i++) {
+    threads.emplace_back(hash_segments);
+  }
+  hash_segments();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (failed) {
+    errno = error;
+    return false;
+  }
+
+  SHA256(digests.data(), digests.size(), digest);
+  return true;
+}
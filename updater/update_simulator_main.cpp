@@ -16,13 +16,24 @@
 
 #include <getopt.h>
 #include <stdlib.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <map>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parsedouble.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
 #include "edify/expr.h"
@@ -30,6 +41,7 @@
 #include "otautil/paths.h"
 #include "updater/blockimg.h"
 #include "updater/build_info.h"
+#include "updater/device_model.h"
 #include "updater/dynamic_partitions.h"
 #include "updater/install.h"
 #include "updater/simulator_runtime.h"
@@ -40,8 +52,11 @@ using namespace std::string_literals;
 void Usage(std::string_view name) {
   LOG(INFO) << "Usage: " << name << "[--oem_settings <oem_property_file>]"
             << "[--skip_functions <skip_function_file>]"
+            << "[--source_cache_dir <source_cache_dir>]"
+            << "[--jobs <jobs>]"
+            << "[--device_profile <device_profile_file> [--max_install_seconds <seconds>]]"
             << " --source <source_target_file>"
-            << " --ota_package <ota_package>";
+            << " --ota_package <ota_package> [--ota_package <ota_package>...]";
 }
 
 Value* SimulatorPlaceHolderFn(const char* name, State* /* state */,
@@ -50,6 +65,124 @@ Value* SimulatorPlaceHolderFn(const char* name, State* /* state */,
   return StringValue("t");
 }
 
+// The model of the device to estimate the install time on, if any, and the longest install time
+// to accept (0 for any).
+static std::optional<DeviceProfile> device_profile;
+static double max_install_seconds = 0;
+
+// Runs the update in |package_name| against the block devices of |source_build_info|. Returns
+// whether the update succeeded (and would take no longer than |max_install_seconds| on the device
+// of |device_profile|).
+static bool RunPackage(BuildInfo* source_build_info, const std::string& package_name) {
+  TemporaryFile temp_saved_source;
+  TemporaryFile temp_last_command;
+  TemporaryDir temp_stash_base;
+  TemporaryFile temp_update_trace;
+
+  Paths::Get().set_cache_temp_source(temp_saved_source.path);
+  Paths::Get().set_last_command_file(temp_last_command.path);
+  Paths::Get().set_stash_directory_base(temp_stash_base.path);
+  Paths::Get().set_temporary_update_trace_file(temp_update_trace.path);
+
+  TemporaryFile cmd_pipe;
+  auto runtime = std::make_unique<SimulatorRuntime>(source_build_info);
+  runtime->set_trace_commands(device_profile.has_value());
+  Updater updater(std::move(runtime));
+  if (!updater.Init(cmd_pipe.release(), package_name, false)) {
+    return false;
+  }
+
+  if (!updater.RunUpdate()) {
+    return false;
+  }
+
+  LOG(INFO) << "\nscript succeeded, result: " << updater.GetResult();
+
+  if (device_profile) {
+    InstallTimeEstimate estimate(*device_profile);
+    std::string trace;
+    if (!android::base::ReadFileToString(temp_update_trace.path, &trace) ||
+        !estimate.AddTrace(trace)) {
+      LOG(ERROR) << "Failed to estimate the install time of " << package_name;
+      return false;
+    }
+    LOG(INFO) << estimate.Summary();
+    if (max_install_seconds > 0 && estimate.seconds() > max_install_seconds) {
+      LOG(ERROR) << package_name << " would take more than " << max_install_seconds
+                 << "s to install";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs each of |package_names| against the source build, in up to |jobs| child processes at once.
+// Each child runs on its own copies of the block devices, so the updates don't see each other's
+// writes; in between, they share the parsed source build and the extracted images. Returns whether
+// all the updates succeeded.
+static bool RunPackages(BuildInfo* source_build_info, const std::vector<std::string>& package_names,
+                        const std::string& work_dir, size_t jobs) {
+  using Clock = std::chrono::steady_clock;
+  struct Run {
+    const std::string* package_name;
+    Clock::time_point start;
+  };
+  std::map<pid_t, Run> running;
+  std::map<std::string, std::pair<bool, Clock::duration>> results;
+
+  auto wait_for_run = [&running, &results]() {
+    int status;
+    pid_t pid = TEMP_FAILURE_RETRY(waitpid(-1, &status, 0));
+    CHECK_NE(pid, -1);
+    auto it = running.find(pid);
+    if (it == running.end()) {
+      return;
+    }
+    bool succeeded = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    results[*it->second.package_name] = { succeeded, Clock::now() - it->second.start };
+    running.erase(it);
+  };
+
+  for (const auto& package_name : package_names) {
+    while (running.size() >= jobs) {
+      wait_for_run();
+    }
+    auto start = Clock::now();
+    pid_t pid = fork();
+    if (pid == -1) {
+      PLOG(ERROR) << "Failed to fork for " << package_name;
+      results[package_name] = { false, Clock::duration::zero() };
+      continue;
+    }
+    if (pid == 0) {
+      // The child owns none of the source build files, so it must not run the destructors.
+      bool succeeded;
+      {
+        std::list<TemporaryFile> clones;
+        succeeded = source_build_info->CloneFakeBlockDevices(work_dir, &clones) &&
+                    RunPackage(source_build_info, package_name);
+      }
+      _exit(succeeded ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    running.emplace(pid, Run{ &package_name, start });
+  }
+  while (!running.empty()) {
+    wait_for_run();
+  }
+
+  bool all_succeeded = true;
+  std::string summary;
+  for (const auto& package_name : package_names) {
+    const auto& [succeeded, duration] = results[package_name];
+    all_succeeded &= succeeded;
+    summary += android::base::StringPrintf(
+        "\n  %s %s in %.1fs", succeeded ? "PASS" : "FAIL", package_name.c_str(),
+        std::chrono::duration<double>(duration).count());
+  }
+  LOG(INFO) << "Simulated " << package_names.size() << " packages:" << summary;
+  return all_succeeded;
+}
+
 int main(int argc, char** argv) {
   // Write the logs to stdout.
   android::base::InitLogging(argv, &android::base::StderrLogger);
@@ -57,16 +190,22 @@ int main(int argc, char** argv) {
   std::string oem_settings;
   std::string skip_function_file;
   std::string source_target_file;
-  std::string package_name;
+  std::vector<std::string> package_names;
   std::string work_dir;
+  std::string source_cache_dir;
   bool keep_images = false;
+  size_t jobs = std::max(1U, std::thread::hardware_concurrency());
 
   constexpr struct option OPTIONS[] = {
+    { "device_profile", required_argument, nullptr, 0 },
+    { "jobs", required_argument, nullptr, 0 },
     { "keep_images", no_argument, nullptr, 0 },
+    { "max_install_seconds", required_argument, nullptr, 0 },
     { "oem_settings", required_argument, nullptr, 0 },
     { "ota_package", required_argument, nullptr, 0 },
     { "skip_functions", required_argument, nullptr, 0 },
     { "source", required_argument, nullptr, 0 },
+    { "source_cache_dir", required_argument, nullptr, 0 },
     { "work_dir", required_argument, nullptr, 0 },
     { nullptr, 0, nullptr, 0 },
   };
@@ -88,8 +227,33 @@ int main(int argc, char** argv) {
       skip_function_file = optarg;
     } else if (option_name == "source"s) {
       source_target_file = optarg;
+    } else if (option_name == "source_cache_dir"s) {
+      // Keeps the extracted source images for the next simulations against the same source.
+      source_cache_dir = optarg;
     } else if (option_name == "ota_package"s) {
-      package_name = optarg;
+      // With more than one package, each update runs against its own copy of the source build.
+      package_names.emplace_back(optarg);
+    } else if (option_name == "device_profile"s) {
+      // Estimates how long the block image updates would take on the device of the profile.
+      std::string content;
+      if (!android::base::ReadFileToString(optarg, &content)) {
+        PLOG(ERROR) << "Failed to read " << optarg;
+        return EXIT_FAILURE;
+      }
+      device_profile = DeviceProfile::Parse(content);
+      if (!device_profile) {
+        return EXIT_FAILURE;
+      }
+    } else if (option_name == "max_install_seconds"s) {
+      if (!android::base::ParseDouble(optarg, &max_install_seconds, 0.0)) {
+        LOG(ERROR) << "Invalid maximum install time: " << optarg;
+        return EXIT_FAILURE;
+      }
+    } else if (option_name == "jobs"s) {
+      if (!android::base::ParseUint(optarg, &jobs) || jobs == 0) {
+        LOG(ERROR) << "Invalid number of jobs: " << optarg;
+        return EXIT_FAILURE;
+      }
     } else if (option_name == "keep_images"s) {
       keep_images = true;
     } else if (option_name == "work_dir"s) {
@@ -100,7 +264,7 @@ int main(int argc, char** argv) {
     }
   }
 
-  if (source_target_file.empty() || package_name.empty()) {
+  if (source_target_file.empty() || package_names.empty()) {
     Usage(argv[0]);
     return EXIT_FAILURE;
   }
@@ -127,21 +291,15 @@ int main(int argc, char** argv) {
     }
   }
 
-  TemporaryFile temp_saved_source;
-  TemporaryFile temp_last_command;
-  TemporaryDir temp_stash_base;
-
-  Paths::Get().set_cache_temp_source(temp_saved_source.path);
-  Paths::Get().set_last_command_file(temp_last_command.path);
-  Paths::Get().set_stash_directory_base(temp_stash_base.path);
-
-  TemporaryFile cmd_pipe;
   TemporaryDir source_temp_dir;
   if (work_dir.empty()) {
     work_dir = source_temp_dir.path;
   }
 
   BuildInfo source_build_info(work_dir, keep_images);
+  if (!source_cache_dir.empty()) {
+    source_build_info.SetSourceCacheDir(source_cache_dir);
+  }
   if (!source_build_info.ParseTargetFile(source_target_file, false)) {
     LOG(ERROR) << "Failed to parse the target file " << source_target_file;
     return EXIT_FAILURE;
@@ -152,16 +310,9 @@ int main(int argc, char** argv) {
     source_build_info.SetOemSettings(oem_settings);
   }
 
-  Updater updater(std::make_unique<SimulatorRuntime>(&source_build_info));
-  if (!updater.Init(cmd_pipe.release(), package_name, false)) {
-    return EXIT_FAILURE;
+  if (package_names.size() == 1) {
+    return RunPackage(&source_build_info, package_names[0]) ? EXIT_SUCCESS : EXIT_FAILURE;
   }
-
-  if (!updater.RunUpdate()) {
-    return EXIT_FAILURE;
-  }
-
-  LOG(INFO) << "\nscript succeeded, result: " << updater.GetResult();
-
-  return 0;
+  return RunPackages(&source_build_info, package_names, work_dir, jobs) ? EXIT_SUCCESS
+                                                                        : EXIT_FAILURE;
 }
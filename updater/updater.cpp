@@ -16,15 +16,36 @@
 
 #include "updater/updater.h"
 
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <android-base/logging.h>
+#include <android-base/parsebool.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
+#include "edify/profiler.h"
 #include "edify/updater_runtime_interface.h"
+#include "otautil/install_metrics.h"
+#include "otautil/paths.h"
+
+// Setting kProfileScriptProperty to true logs where the evaluation of the script went: the time
+// and the I/O of each statement and builtin call (see ScriptProfiler).
+static constexpr const char* kProfileScriptProperty = "ro.updater.profile_script";
+
+static UpdaterCommand MakeCommand(UpdaterCommandType type, std::string text = "") {
+  UpdaterCommand command;
+  command.type = type;
+  command.text = std::move(text);
+  return command;
+}
 
 Updater::~Updater() {
   if (package_handle_) {
@@ -40,12 +61,31 @@ bool Updater::Init(int fd, const std::string_view package_filename, bool is_retr
     return false;
   }
 
-  setlinebuf(cmd_pipe_.get());
+  // Recovery reads the commands as they come, so that the screen keeps up. Frames aren't lines,
+  // and are flushed one by one instead.
+  const char* offer = getenv(kBinaryCommandsEnv);
+  if (offer != nullptr && strcmp(offer, "1") == 0) {
+    setvbuf(cmd_pipe_.get(), nullptr, _IOFBF, BUFSIZ);
+    fprintf(cmd_pipe_.get(), "%s\n", kBinaryCommandsAccept);
+    fflush(cmd_pipe_.get());
+    binary_commands_ = true;
+  } else {
+    setlinebuf(cmd_pipe_.get());
+  }
+  // Not for the programs that the script runs.
+  unsetenv(kBinaryCommandsEnv);
 
   if (!mapped_package_.MapFile(std::string(package_filename))) {
     LOG(ERROR) << "failed to map package " << package_filename;
     return false;
   }
+  // Kept open for the entries that are copied from the package file directly.
+  if (package_filename[0] != '@') {
+    package_fd_.reset(open(std::string(package_filename).c_str(), O_RDONLY | O_CLOEXEC));
+    if (package_fd_ == -1) {
+      PLOG(WARNING) << "Failed to open " << package_filename;
+    }
+  }
   if (int open_err = OpenArchiveFromMemory(mapped_package_.addr, mapped_package_.length,
                                            std::string(package_filename).c_str(), &package_handle_);
       open_err != 0) {
@@ -78,12 +118,30 @@ bool Updater::RunUpdate() {
   State state(updater_script_, this);
   state.is_retry = is_retry_;
 
+  std::unique_ptr<ScriptProfiler> profiler;
+  if (android::base::ParseBool(runtime_->GetProperty(kProfileScriptProperty, "")) ==
+      android::base::ParseBoolResult::kTrue) {
+    profiler = std::make_unique<ScriptProfiler>(updater_script_, root.get());
+    state.profiler = profiler.get();
+  }
+
   bool status = Evaluate(&state, root, &result_);
+  if (profiler) {
+    for (const auto& line : android::base::Split(profiler->Summary(), "\n")) {
+      if (!line.empty()) {
+        LOG(INFO) << line;
+      }
+    }
+  }
   if (status) {
-    fprintf(cmd_pipe_.get(), "ui_print script succeeded: result was [%s]\n", result_.c_str());
+    SendCommand(MakeCommand(UpdaterCommandType::UI_PRINT,
+                            "script succeeded: result was [" + result_ + "]"));
     // Even though the script doesn't abort, still log the cause code if result is empty.
     if (result_.empty() && state.cause_code != kNoCause) {
-      fprintf(cmd_pipe_.get(), "log cause: %d\n", state.cause_code);
+      SendCommand(MakeCommand(UpdaterCommandType::LOG,
+                              android::base::StringPrintf("cause: %d", state.cause_code)));
+      AppendInstallMetrics(Paths::Get().temporary_install_metrics_file(),
+                           { { "cause", state.cause_code } });
     }
     for (const auto& func : skipped_functions_) {
       LOG(WARNING) << "Skipped executing function " << func;
@@ -95,20 +153,44 @@ bool Updater::RunUpdate() {
   return false;
 }
 
-void Updater::WriteToCommandPipe(const std::string_view message, bool flush) const {
-  fprintf(cmd_pipe_.get(), "%s\n", std::string(message).c_str());
+void Updater::SendCommand(const UpdaterCommand& command, bool flush) const {
+  if (binary_commands_) {
+    std::string frame;
+    EncodeUpdaterCommandFrame(command, &frame);
+    fwrite(frame.data(), 1, frame.size(), cmd_pipe_.get());
+    fflush(cmd_pipe_.get());
+    return;
+  }
+  fprintf(cmd_pipe_.get(), "%s\n", FormatUpdaterCommandLine(command).c_str());
   if (flush) {
     fflush(cmd_pipe_.get());
   }
 }
 
+void Updater::WriteToCommandPipe(const std::string_view message, bool flush) const {
+  SendCommand(MakeCommand(UpdaterCommandType::TEXT, std::string(message)), flush);
+}
+
+void Updater::ShowProgress(double fraction, int seconds) const {
+  UpdaterCommand command = MakeCommand(UpdaterCommandType::PROGRESS);
+  command.fraction = fraction;
+  command.seconds = seconds;
+  SendCommand(command);
+}
+
+void Updater::SetProgress(double fraction, bool flush) const {
+  UpdaterCommand command = MakeCommand(UpdaterCommandType::SET_PROGRESS);
+  command.fraction = fraction;
+  SendCommand(command, flush);
+}
+
 void Updater::UiPrint(const std::string_view message) const {
   // "line1\nline2\n" will be split into 3 tokens: "line1", "line2" and "".
   // so skip sending empty strings to ui.
   std::vector<std::string> lines = android::base::Split(std::string(message), "\n");
   for (const auto& line : lines) {
     if (!line.empty()) {
-      fprintf(cmd_pipe_.get(), "ui_print %s\n", line.c_str());
+      SendCommand(MakeCommand(UpdaterCommandType::UI_PRINT, line));
     }
   }
 
@@ -126,7 +208,7 @@ void Updater::ParseAndReportErrorCode(State* state) {
   CHECK(state);
   if (state->errmsg.empty()) {
     LOG(ERROR) << "script aborted (no error message)";
-    fprintf(cmd_pipe_.get(), "ui_print script aborted (no error message)\n");
+    SendCommand(MakeCommand(UpdaterCommandType::UI_PRINT, "script aborted (no error message)"));
   } else {
     LOG(ERROR) << "script aborted: " << state->errmsg;
     const std::vector<std::string> lines = android::base::Split(state->errmsg, "\n");
@@ -138,7 +220,7 @@ void Updater::ParseAndReportErrorCode(State* state) {
           LOG(ERROR) << "Failed to parse error code: [" << line << "]";
         }
       }
-      fprintf(cmd_pipe_.get(), "ui_print %s\n", line.c_str());
+      SendCommand(MakeCommand(UpdaterCommandType::UI_PRINT, line));
     }
   }
 
@@ -147,18 +229,23 @@ void Updater::ParseAndReportErrorCode(State* state) {
   if (state->error_code == kNoError) {
     state->error_code = kScriptExecutionFailure;
   }
-  fprintf(cmd_pipe_.get(), "log error: %d\n", state->error_code);
+  SendCommand(MakeCommand(UpdaterCommandType::LOG,
+                          android::base::StringPrintf("error: %d", state->error_code)));
+  std::vector<std::pair<std::string, int64_t>> metrics = { { "error", state->error_code } };
   // Cause code should provide additional information about the abort.
   if (state->cause_code != kNoCause) {
-    fprintf(cmd_pipe_.get(), "log cause: %d\n", state->cause_code);
+    SendCommand(MakeCommand(UpdaterCommandType::LOG,
+                            android::base::StringPrintf("cause: %d", state->cause_code)));
+    metrics.emplace_back("cause", state->cause_code);
     if (state->cause_code == kPatchApplicationFailure) {
       LOG(INFO) << "Patch application failed, retry update.";
-      fprintf(cmd_pipe_.get(), "retry_update\n");
+      SendCommand(MakeCommand(UpdaterCommandType::RETRY_UPDATE));
     } else if (state->cause_code == kEioFailure) {
       LOG(INFO) << "Update failed due to EIO, retry update.";
-      fprintf(cmd_pipe_.get(), "retry_update\n");
+      SendCommand(MakeCommand(UpdaterCommandType::RETRY_UPDATE));
     }
   }
+  AppendInstallMetrics(Paths::Get().temporary_install_metrics_file(), metrics);
 }
 
 bool Updater::ReadEntryToString(ZipArchiveHandle za, const std::string& entry_name,
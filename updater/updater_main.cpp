@@ -28,6 +28,7 @@
 #include <selinux/selinux.h>
 
 #include "edify/expr.h"
+#include "otautil/log_buffer.h"
 #include "updater/blockimg.h"
 #include "updater/dynamic_partitions.h"
 #include "updater/install.h"
@@ -39,10 +40,14 @@
 // registration functions for device-specific extensions.
 #include "register.inc"
 
+// Holds the log lines on their way to stdout. Never freed, so that it outlives anything that logs
+// at exit.
+static LogBuffer* log_buffer = nullptr;
+
 static void UpdaterLogger(android::base::LogId /* id */, android::base::LogSeverity /* severity */,
                           const char* /* tag */, const char* /* file */, unsigned int /* line */,
                           const char* message) {
-  fprintf(stdout, "%s\n", message);
+  log_buffer->Append(message);
 }
 
 int main(int argc, char** argv) {
@@ -54,7 +59,11 @@ int main(int argc, char** argv) {
   setbuf(stderr, nullptr);
 
   // We don't have logcat yet under recovery. Update logs will always be written to stdout
-  // (which is redirected to recovery.log).
+  // (which is redirected to recovery.log). They go through a buffer in memory, so that verbose
+  // logging (e.g. of the block image update) doesn't cost a write per line; the buffer is written
+  // out at least every LogBuffer::kDefaultFlushInterval, and at exit or on a crash.
+  log_buffer = new LogBuffer(STDOUT_FILENO);
+  FlushLogBufferOnExit(log_buffer);
   android::base::InitLogging(argv, &UpdaterLogger);
 
   // Run the libcrypto KAT(known answer tests) based self tests.
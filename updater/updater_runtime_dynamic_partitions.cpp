@@ -18,8 +18,10 @@
 
 #include <algorithm>
 #include <chrono>
+#include <future>
 #include <iterator>
 #include <optional>
+#include <set>
 #include <string>
 #include <type_traits>
 #include <vector>
@@ -100,9 +102,13 @@ bool UpdaterRuntime::UnmapPartitionOnDeviceMapper(const std::string& partition_n
 
 namespace {  // Ops
 
+// The ops only change the metadata in |builder|. The partitions (with the slot suffix) that have to
+// be unmapped before the metadata is written are added to |unmap|, so that nothing changes on the
+// device until the whole op list has applied.
 struct OpParameters {
   std::vector<std::string> tokens;
   MetadataBuilder* builder;
+  std::set<std::string>* unmap;
 
   bool ExpectArgSize(size_t size) const {
     CHECK(!tokens.empty());
@@ -147,10 +153,7 @@ bool PerformOpResize(const OpParameters& params) {
                << " in dynamic partition metadata.";
     return false;
   }
-  if (!UnmapPartitionWithSuffixOnDeviceMapper(partition_name_suffix)) {
-    LOG(ERROR) << "Cannot unmap " << partition_name_suffix << " before resizing.";
-    return false;
-  }
+  params.unmap->insert(partition_name_suffix);
   if (!params.builder->ResizePartition(partition, size.value())) {
     LOG(ERROR) << "Failed to resize partition " << partition_name_suffix << " to size " << *size
                << ".";
@@ -162,11 +165,7 @@ bool PerformOpResize(const OpParameters& params) {
 bool PerformOpRemove(const OpParameters& params) {
   if (!params.ExpectArgSize(1)) return false;
   const auto& partition_name_suffix = AddSlotSuffix(params.arg(0));
-
-  if (!UnmapPartitionWithSuffixOnDeviceMapper(partition_name_suffix)) {
-    LOG(ERROR) << "Cannot unmap " << partition_name_suffix << " before removing.";
-    return false;
-  }
+  params.unmap->insert(partition_name_suffix);
   params.builder->RemovePartition(partition_name_suffix);
   return true;
 }
@@ -285,18 +284,31 @@ bool PerformOpRemoveAllGroups(const OpParameters& params) {
   auto group_names = params.builder->ListGroups();
   for (const auto& group_name_suffix : group_names) {
     auto partition_names = ListPartitionNamesInGroup(params.builder, group_name_suffix);
-    for (const auto& partition_name_suffix : partition_names) {
-      if (!UnmapPartitionWithSuffixOnDeviceMapper(partition_name_suffix)) {
-        LOG(ERROR) << "Cannot unmap " << partition_name_suffix << " before removing group "
-                   << group_name_suffix << ".";
-        return false;
-      }
-    }
+    params.unmap->insert(partition_names.begin(), partition_names.end());
     params.builder->RemoveGroupAndPartitions(group_name_suffix);
   }
   return true;
 }
 
+// Unmaps all of |partition_names_suffix| at once, each on its own thread, so that the waits for
+// the devices to go away overlap.
+bool UnmapPartitionsWithSuffixOnDeviceMapper(const std::set<std::string>& partition_names_suffix) {
+  std::vector<std::pair<std::string, std::future<bool>>> unmaps;
+  for (const auto& partition_name_suffix : partition_names_suffix) {
+    unmaps.emplace_back(partition_name_suffix,
+                        std::async(std::launch::async, UnmapPartitionWithSuffixOnDeviceMapper,
+                                   partition_name_suffix));
+  }
+  bool result = true;
+  for (auto& [partition_name_suffix, unmapped] : unmaps) {
+    if (!unmapped.get()) {
+      LOG(ERROR) << "Cannot unmap " << partition_name_suffix << " before updating metadata.";
+      result = false;
+    }
+  }
+  return result;
+}
+
 }  // namespace
 
 bool UpdaterRuntime::UpdateDynamicPartitions(const std::string_view op_list_value,
@@ -338,6 +350,8 @@ bool UpdaterRuntime::UpdateDynamicPartitions(const std::string_view op_list_valu
     // clang-format on
   };
 
+  // Parse the whole op list first, so that a malformed one is rejected before any op applies.
+  std::vector<std::pair<OpFunction, std::vector<std::string>>> ops;
   std::vector<std::string> lines = android::base::Split(std::string(op_list_value), "\n");
   for (const auto& line : lines) {
     auto comment_idx = line.find('#');
@@ -352,10 +366,17 @@ bool UpdaterRuntime::UpdateDynamicPartitions(const std::string_view op_list_valu
       LOG(ERROR) << "Unknown operation in op_list: " << op;
       return false;
     }
+    ops.emplace_back(it->second, std::move(tokens));
+  }
+
+  // Then compute the final layout. Nothing is unmapped, or written, unless it's valid as a whole.
+  std::set<std::string> unmap;
+  for (auto& [perform, tokens] : ops) {
     OpParameters params;
-    params.tokens = tokens;
+    params.tokens = std::move(tokens);
     params.builder = builder.get();
-    if (!it->second(params)) {
+    params.unmap = &unmap;
+    if (!perform(params)) {
       return false;
     }
   }
@@ -366,6 +387,10 @@ bool UpdaterRuntime::UpdateDynamicPartitions(const std::string_view op_list_valu
     return false;
   }
 
+  if (!UnmapPartitionsWithSuffixOnDeviceMapper(unmap)) {
+    return false;
+  }
+
   if (flash_metadata) {
     if (!FlashPartitionTable(super_device, *metadata)) {
       LOG(ERROR) << "Failed to flash metadata.";
@@ -37,6 +37,7 @@
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <thread>
 #include <vector>
 
 using android::base::ReadFileToString;
@@ -127,12 +128,14 @@ Disk::~Disk() {
 }
 
 void Disk::getVolumeInfo(std::vector<VolumeInfo>& info) {
+    finishScan();
     for (auto vol : mVolumes) {
         info.push_back(VolumeInfo(vol.get()));
     }
 }
 
 std::shared_ptr<VolumeBase> Disk::findVolume(const std::string& id) {
+    finishScan();
     for (auto vol : mVolumes) {
         if (vol->getId() == id) {
             return vol;
@@ -142,6 +145,7 @@ std::shared_ptr<VolumeBase> Disk::findVolume(const std::string& id) {
 }
 
 void Disk::listVolumes(VolumeBase::Type type, std::list<std::string>& list) {
+    finishScan();
     for (const auto& vol : mVolumes) {
         if (vol->getType() == type) {
             list.push_back(vol->getId());
@@ -161,6 +165,9 @@ status_t Disk::create() {
 
 status_t Disk::destroy() {
     CHECK(mCreated);
+    if (mScan.valid()) {
+        mScan.wait();
+    }
     destroyAllVolumes();
     mCreated = false;
     VolumeManager::Instance()->notifyEvent(ResponseCode::DiskDestroyed);
@@ -276,28 +283,24 @@ status_t Disk::readMetadata() {
     return OK;
 }
 
-status_t Disk::readPartitions() {
-    int8_t maxMinors = getMaxMinors();
-    if (maxMinors < 0) {
-        return -ENOTSUP;
-    }
-
-    if (mSkipChange) {
-        mSkipChange = false;
-        LOG(INFO) << "Skip first change";
-        return OK;
-    }
-
-    destroyAllVolumes();
+/*
+ * Reads the partition table of the disk at devPath, and probes the metadata of the partitions to
+ * create volumes for at the same time, into the cache of ReadMetadataCached(). Runs in the
+ * background, without touching the disk, so that disks are scanned at the same time too.
+ */
+static Disk::PartitionScan scanPartitions(const std::string& id, const std::string& devPath,
+                                          dev_t device, int8_t maxMinors) {
+    Disk::PartitionScan scan = {OK, {}};
 
     // Parse partition table
     sgdisk_partition_table ptbl;
     std::vector<sgdisk_partition> partitions;
-    int res = sgdisk_read(mDevPath.c_str(), ptbl, partitions);
+    int res = sgdisk_read(devPath.c_str(), ptbl, partitions);
     if (res != 0) {
-        LOG(WARNING) << "sgdisk failed to scan " << mDevPath;
+        LOG(WARNING) << "sgdisk failed to scan " << devPath;
+        scan.res = res;
         VolumeManager::Instance()->notifyEvent(ResponseCode::DiskScanned);
-        return res;
+        return scan;
     }
 
     Table table = Table::kUnknown;
@@ -317,11 +320,11 @@ status_t Disk::readPartitions() {
     foundParts = partitions.size() > 0;
     for (const auto& part : partitions) {
         if (part.num <= 0 || part.num > maxMinors) {
-            LOG(WARNING) << mId << " is ignoring partition " << part.num
+            LOG(WARNING) << id << " is ignoring partition " << part.num
                          << " beyond max supported devices";
             continue;
         }
-        dev_t partDevice = makedev(major(mDevice), minor(mDevice) + part.num);
+        dev_t partDevice = makedev(major(device), minor(device) + part.num);
         if (table == Table::kMbr) {
             switch (strtol(part.type.c_str(), nullptr, 16)) {
                 case 0x06:  // FAT16
@@ -330,35 +333,86 @@ status_t Disk::readPartitions() {
                 case 0x0c:  // W95 FAT32 (LBA)
                 case 0x0e:  // W95 FAT16 (LBA)
                 case 0x83:  // Linux EXT4/F2FS/...
-                    createPublicVolume(partDevice);
+                    scan.devices.push_back(partDevice);
                     break;
             }
         } else if (table == Table::kGpt) {
             if (!strcasecmp(part.guid.c_str(), kGptBasicData) ||
                 !strcasecmp(part.guid.c_str(), kGptLinuxFilesystem)) {
-                createPublicVolume(partDevice);
+                scan.devices.push_back(partDevice);
             }
         }
     }
 
+    // The volumes read their metadata as they're created, from the cache by then.
+    std::vector<std::thread> probes;
+    for (dev_t partDevice : scan.devices) {
+        probes.emplace_back([partDevice, device]() {
+            std::string path = StringPrintf("/dev/block/volmgr/probe:%u_%u", major(partDevice),
+                                            minor(partDevice));
+            if (CreateDeviceNode(path, partDevice) != OK) {
+                return;
+            }
+            std::string fsType, fsUuid, fsLabel;
+            ReadMetadataCached(path, partDevice, device, fsType, fsUuid, fsLabel);
+            DestroyDeviceNode(path);
+        });
+    }
+    for (auto& probe : probes) {
+        probe.join();
+    }
+
     // Ugly last ditch effort, treat entire disk as partition
     if (table == Table::kUnknown || !foundParts) {
-        LOG(WARNING) << mId << " has unknown partition table; trying entire device";
+        LOG(WARNING) << id << " has unknown partition table; trying entire device";
 
         std::string fsType;
         std::string unused;
-        if (ReadMetadataUntrusted(mDevPath, fsType, unused, unused) == OK) {
-            createPublicVolume(mDevice);
+        if (ReadMetadataCached(devPath, device, device, fsType, unused, unused) == OK) {
+            scan.devices.push_back(device);
         } else {
-            LOG(WARNING) << mId << " failed to identify, giving up";
+            LOG(WARNING) << id << " failed to identify, giving up";
         }
     }
 
     VolumeManager::Instance()->notifyEvent(ResponseCode::DiskScanned);
+    return scan;
+}
+
+status_t Disk::readPartitions() {
+    int8_t maxMinors = getMaxMinors();
+    if (maxMinors < 0) {
+        return -ENOTSUP;
+    }
+
+    if (mSkipChange) {
+        mSkipChange = false;
+        LOG(INFO) << "Skip first change";
+        return OK;
+    }
+
+    // The volumes are replaced once the scan is done, as they're looked at: DiskScanned has the
+    // watcher look at them.
+    if (mScan.valid()) {
+        mScan.wait();
+    }
+    mScan = std::async(std::launch::async, scanPartitions, mId, mDevPath, mDevice, maxMinors);
     return OK;
 }
 
+void Disk::finishScan() {
+    if (!mScan.valid() || !mCreated) {
+        return;
+    }
+    PartitionScan scan = mScan.get();
+    destroyAllVolumes();
+    for (dev_t device : scan.devices) {
+        createPublicVolume(device);
+    }
+}
+
 status_t Disk::unmountAll() {
+    finishScan();
     for (const auto& vol : mVolumes) {
         vol->unmount();
     }
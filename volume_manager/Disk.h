@@ -23,6 +23,7 @@
 
 #include <utils/Errors.h>
 
+#include <future>
 #include <vector>
 
 #include <volume_manager/VolumeManager.h>
@@ -82,6 +83,12 @@ class Disk {
 
     status_t unmountAll();
 
+    /* Partitions found by a scan of the partition table, with their metadata probed */
+    struct PartitionScan {
+        status_t res;
+        std::vector<dev_t> devices;
+    };
+
   protected:
     /* ID that uniquely references this disk */
     std::string mId;
@@ -107,12 +114,17 @@ class Disk {
     bool mCreated;
     /* Flag that we need to skip first disk change events after partitioning*/
     bool mSkipChange;
+    /* Scan of the partitions running in the background, for readPartitions() */
+    std::future<PartitionScan> mScan;
 
     void createPublicVolume(dev_t device, const std::string& fstype = "",
                             const std::string& mntopts = "");
 
     void destroyAllVolumes();
 
+    /* Replaces the volumes with those of the last scan, once it's done, if not yet */
+    void finishScan();
+
     int getMaxMinors();
 
     DISALLOW_COPY_AND_ASSIGN(Disk);
@@ -68,6 +68,9 @@ status_t DiskPartition::create() {
 
 status_t DiskPartition::destroy() {
     CHECK(mCreated);
+    if (mScan.valid()) {
+        mScan.wait();
+    }
     destroyAllVolumes();
     mCreated = false;
     VolumeManager::Instance()->notifyEvent(ResponseCode::DiskDestroyed);
@@ -19,14 +19,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sysmacros.h>
 
 #define LOG_TAG "Vold"
 
 #include <cutils/log.h>
 
 #include <sysutils/NetlinkEvent.h>
+#include <volume_manager/UeventWaiter.h>
 #include <volume_manager/VolumeManager.h>
 #include "NetlinkHandler.h"
+#include "Utils.h"
 
 NetlinkHandler::NetlinkHandler(int listenerSocket) : NetlinkListener(listenerSocket) {}
 
@@ -50,6 +53,15 @@ void NetlinkHandler::onEvent(NetlinkEvent* evt) {
     }
 
     if (!strcmp(subsys, "block")) {
+        // A disk or a partition that changes, or goes away, needs to be probed again.
+        NetlinkEvent::Action action = evt->getAction();
+        const char* majorParam = evt->findParam("MAJOR");
+        const char* minorParam = evt->findParam("MINOR");
+        if ((action == NetlinkEvent::Action::kChange || action == NetlinkEvent::Action::kRemove) &&
+            majorParam && minorParam) {
+            android::volmgr::InvalidateCachedMetadata(makedev(atoi(majorParam), atoi(minorParam)));
+        }
         vm->handleBlockEvent(evt);
+        android::volmgr::UeventWaiter::Notify();
     }
 }
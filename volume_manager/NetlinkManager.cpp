@@ -30,6 +30,7 @@
 #define LOG_TAG "Vold"
 
 #include <cutils/log.h>
+#include <volume_manager/UeventWaiter.h>
 
 #include "NetlinkHandler.h"
 #include "NetlinkManager.h"
@@ -85,6 +86,7 @@ bool NetlinkManager::start() {
         SLOGE("Unable to start NetlinkHandler: %s", strerror(errno));
         goto out;
     }
+    android::volmgr::UeventWaiter::SetListening(true);
 
     return true;
 
@@ -94,6 +96,7 @@ out:
 }
 
 void NetlinkManager::stop() {
+    android::volmgr::UeventWaiter::SetListening(false);
     mHandler->stop();
     delete mHandler;
     mHandler = NULL;
@@ -56,7 +56,7 @@ PublicVolume::~PublicVolume() {}
 
 status_t PublicVolume::readMetadata() {
     std::string label;
-    status_t res = ReadMetadataUntrusted(mDevPath, mFsType, mFsUuid, label);
+    status_t res = ReadMetadataCached(mDevPath, mDevice, 0, mFsType, mFsUuid, label);
     if (!label.empty()) {
         setPartLabel(label);
     }
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <volume_manager/UeventWaiter.h>
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+namespace android {
+namespace volmgr {
+
+static std::mutex sLock;
+static std::condition_variable sEvent;
+// Counts the block uevents, so that a waiter knows whether one came since it last checked.
+static uint64_t sGeneration = 0;
+static bool sListening = false;
+
+bool UeventWaiter::WaitFor(const std::function<bool()>& ready, std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::unique_lock<std::mutex> lock(sLock);
+    while (true) {
+        uint64_t generation = sGeneration;
+        lock.unlock();
+        if (ready()) {
+            return true;
+        }
+        lock.lock();
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        // Any event that came while |ready| ran changed the generation, and is not missed.
+        auto wake = sListening ? deadline
+                               : std::min(deadline, std::chrono::steady_clock::now() + kPollInterval);
+        sEvent.wait_until(lock, wake, [generation]() { return sGeneration != generation; });
+    }
+}
+
+void UeventWaiter::SetListening(bool listening) {
+    std::lock_guard<std::mutex> lock(sLock);
+    sListening = listening;
+    sGeneration++;
+    sEvent.notify_all();
+}
+
+void UeventWaiter::Notify() {
+    std::lock_guard<std::mutex> lock(sLock);
+    sGeneration++;
+    sEvent.notify_all();
+}
+
+}  // namespace volmgr
+}  // namespace android
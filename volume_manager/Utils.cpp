@@ -32,12 +32,14 @@
 #include <fcntl.h>
 #include <linux/fs.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <map>
 #include <mutex>
 #include <thread>
 
@@ -195,23 +197,46 @@ status_t BindMount(const std::string& source, const std::string& target) {
 
 static status_t readMetadata(const std::string& path, std::string& fsType, std::string& fsUuid,
                              std::string& fsLabel) {
-    char* val = NULL;
-    val = blkid_get_tag_value(NULL, "TYPE", path.c_str());
-    if (val) {
-        fsType = val;
-    }
-    val = blkid_get_tag_value(NULL, "UUID", path.c_str());
-    if (val) {
-        fsUuid = val;
+    // Probe the device once for all its tags, rather than once per tag. Each call gets a cache of
+    // its own, so that devices can be probed at the same time.
+    blkid_cache cache;
+    if (blkid_get_cache(&cache, nullptr) != 0) {
+        LOG(WARNING) << "Failed to get the blkid cache to probe " << path;
+        return OK;
     }
-    val = blkid_get_tag_value(NULL, "LABEL", path.c_str());
-    if (val) {
-        fsLabel = val;
+    blkid_dev dev = blkid_get_dev(cache, path.c_str(), BLKID_DEV_NORMAL);
+    if (dev) {
+        blkid_tag_iterate iter = blkid_tag_iterate_begin(dev);
+        const char* type;
+        const char* value;
+        while (blkid_tag_next(iter, &type, &value) == 0) {
+            if (!strcmp(type, "TYPE")) {
+                fsType = value;
+            } else if (!strcmp(type, "UUID")) {
+                fsUuid = value;
+            } else if (!strcmp(type, "LABEL")) {
+                fsLabel = value;
+            }
+        }
+        blkid_tag_iterate_end(iter);
     }
+    blkid_put_cache(cache);
 
     return OK;
 }
 
+struct CachedMetadata {
+    dev_t disk;
+    std::string fsType;
+    std::string fsUuid;
+    std::string fsLabel;
+};
+
+static std::mutex sMetadataLock;
+static std::map<dev_t, CachedMetadata> sMetadata;
+/* Bumped by every invalidation, to drop the results of the probes that raced with one */
+static uint64_t sMetadataGeneration = 0;
+
 status_t ReadMetadata(const std::string& path, std::string& fsType, std::string& fsUuid,
                       std::string& fsLabel) {
     return readMetadata(path, fsType, fsUuid, fsLabel);
@@ -222,6 +247,50 @@ status_t ReadMetadataUntrusted(const std::string& path, std::string& fsType, std
     return readMetadata(path, fsType, fsUuid, fsLabel);
 }
 
+status_t ReadMetadataCached(const std::string& path, dev_t device, dev_t disk, std::string& fsType,
+                            std::string& fsUuid, std::string& fsLabel) {
+    // Like readMetadata(), leaves the values of the tags that the device doesn't have alone.
+    auto set = [&fsType, &fsUuid, &fsLabel](const CachedMetadata& metadata) {
+        if (!metadata.fsType.empty()) fsType = metadata.fsType;
+        if (!metadata.fsUuid.empty()) fsUuid = metadata.fsUuid;
+        if (!metadata.fsLabel.empty()) fsLabel = metadata.fsLabel;
+    };
+
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(sMetadataLock);
+        auto it = sMetadata.find(device);
+        if (it != sMetadata.end()) {
+            set(it->second);
+            return OK;
+        }
+        generation = sMetadataGeneration;
+    }
+
+    CachedMetadata metadata = {disk, "", "", ""};
+    status_t res = ReadMetadataUntrusted(path, metadata.fsType, metadata.fsUuid, metadata.fsLabel);
+    if (res == OK) {
+        set(metadata);
+        std::lock_guard<std::mutex> lock(sMetadataLock);
+        if (generation == sMetadataGeneration) {
+            sMetadata[device] = metadata;
+        }
+    }
+    return res;
+}
+
+void InvalidateCachedMetadata(dev_t device) {
+    std::lock_guard<std::mutex> lock(sMetadataLock);
+    sMetadataGeneration++;
+    for (auto it = sMetadata.begin(); it != sMetadata.end();) {
+        if (it->first == device || it->second.disk == device) {
+            it = sMetadata.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
 status_t ForkExecvp(const std::vector<std::string>& args) {
     return ForkExecvp(args, nullptr);
 }
@@ -68,6 +68,15 @@ status_t ReadMetadata(const std::string& path, std::string& fsType, std::string&
 status_t ReadMetadataUntrusted(const std::string& path, std::string& fsType, std::string& fsUuid,
                                std::string& fsLabel);
 
+/* Reads filesystem metadata from untrusted device at path, with the kernel device number
+ * |device|, on |disk| (0 if unknown). The metadata are cached by device number until
+ * InvalidateCachedMetadata() of the device, or of its disk. */
+status_t ReadMetadataCached(const std::string& path, dev_t device, dev_t disk, std::string& fsType,
+                            std::string& fsUuid, std::string& fsLabel);
+
+/* Forgets the cached metadata of |device|, and of the devices on it if it's a disk */
+void InvalidateCachedMetadata(dev_t device);
+
 /* Returns either WEXITSTATUS() status, or a negative errno */
 status_t ForkExecvp(const std::vector<std::string>& args);
 status_t ForkExecvp(const std::vector<std::string>& args, char* context);
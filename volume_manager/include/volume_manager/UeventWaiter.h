@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _VOLMGR_UEVENT_WAITER_H
+#define _VOLMGR_UEVENT_WAITER_H
+
+#include <chrono>
+#include <functional>
+
+namespace android {
+namespace volmgr {
+
+// Waits for the block devices to get to some state (e.g. a device-mapper device being created and
+// activated), on the block uevents that the NetlinkManager of the VolumeManager receives, rather
+// than by polling: the state is checked again as soon as an event comes, and only then.
+class UeventWaiter {
+  public:
+    // How often the state is checked while the NetlinkManager isn't running, when there are no
+    // events to wait on.
+    static constexpr std::chrono::milliseconds kPollInterval{ 10 };
+
+    // Calls |ready| now and after each block uevent, until it returns true. Returns false if it
+    // doesn't within |timeout|.
+    static bool WaitFor(const std::function<bool()>& ready, std::chrono::milliseconds timeout);
+
+    // Called by the NetlinkManager as it starts and stops listening, and on each block uevent.
+    static void SetListening(bool listening);
+    static void Notify();
+};
+
+}  // namespace volmgr
+}  // namespace android
+
+#endif